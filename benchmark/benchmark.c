@@ -49,3 +49,143 @@ void benchmark_check_time(gearman_benchmark_st *benchmark)
     gettimeofday(&(benchmark->begin), NULL);
   }
 }
+
+uint64_t benchmark_now(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return ((uint64_t)(now.tv_sec) * 1000000) + (uint64_t)(now.tv_usec);
+}
+
+uint32_t benchmark_parse_list(const char *arg, size_t *list,
+                              uint32_t list_max)
+{
+  uint32_t count= 0;
+  char *end;
+
+  while (1)
+  {
+    if (count == list_max || *arg < '0' || *arg > '9')
+      return 0;
+
+    list[count]= (size_t)strtoull(arg, &end, 10);
+    count++;
+
+    if (*end == 0)
+      return count;
+
+    if (*end != ',')
+      return 0;
+
+    arg= end + 1;
+  }
+}
+
+bool benchmark_parse_format(const char *arg,
+                            gearman_benchmark_format_t *format)
+{
+  if (!strcmp(arg, "text"))
+    *format= GEARMAN_BENCHMARK_FORMAT_TEXT;
+  else if (!strcmp(arg, "csv"))
+    *format= GEARMAN_BENCHMARK_FORMAT_CSV;
+  else if (!strcmp(arg, "json"))
+    *format= GEARMAN_BENCHMARK_FORMAT_JSON;
+  else
+    return false;
+
+  return true;
+}
+
+void benchmark_result_init(gearman_benchmark_result_st *result)
+{
+  memset(result, 0, sizeof(gearman_benchmark_result_st));
+  gearman_histogram_init(&(result->latency));
+}
+
+void benchmark_result_merge(gearman_benchmark_result_st *result,
+                            const gearman_benchmark_result_st *from)
+{
+  result->jobs+= from->jobs;
+  result->fail_count+= from->fail_count;
+  if (from->usec > result->usec)
+    result->usec= from->usec;
+  gearman_histogram_merge(&(result->latency), &(from->latency));
+}
+
+void benchmark_report_begin(gearman_benchmark_format_t format)
+{
+  if (format == GEARMAN_BENCHMARK_FORMAT_CSV)
+  {
+    printf("processes,concurrency,min_size,max_size,jobs,failed,usec,"
+           "jobs_per_sec,min_us,mean_us,p50_us,p99_us,p999_us,max_us\n");
+  }
+  else if (format == GEARMAN_BENCHMARK_FORMAT_JSON)
+    printf("[");
+}
+
+void benchmark_report(gearman_benchmark_format_t format,
+                      const gearman_benchmark_result_st *result, bool first)
+{
+  const gearman_histogram_st *latency= &(result->latency);
+  uint64_t rate= 0;
+
+  if (result->usec > 0)
+    rate= (result->jobs * 1000000) / result->usec;
+
+  switch (format)
+  {
+  case GEARMAN_BENCHMARK_FORMAT_CSV:
+    printf("%u,%u,%zu,%zu,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64
+           ",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
+           result->processes, result->concurrency, result->min_size,
+           result->max_size, result->jobs, result->fail_count, result->usec,
+           rate, gearman_histogram_min(latency),
+           gearman_histogram_mean(latency),
+           gearman_histogram_percentile(latency, 50),
+           gearman_histogram_percentile(latency, 99),
+           gearman_histogram_percentile(latency, 99.9),
+           gearman_histogram_max(latency));
+    break;
+
+  case GEARMAN_BENCHMARK_FORMAT_JSON:
+    printf("%s\n  {\"processes\": %u, \"concurrency\": %u, \"min_size\": %zu,"
+           " \"max_size\": %zu,\n   \"jobs\": %"PRIu64", \"failed\": %"PRIu64
+           ", \"usec\": %"PRIu64", \"jobs_per_sec\": %"PRIu64",\n"
+           "   \"latency_us\": {\"min\": %"PRIu64", \"mean\": %"PRIu64
+           ", \"p50\": %"PRIu64", \"p99\": %"PRIu64", \"p99.9\": %"PRIu64
+           ", \"max\": %"PRIu64"}}", first ? "" : ",",
+           result->processes, result->concurrency, result->min_size,
+           result->max_size, result->jobs, result->fail_count, result->usec,
+           rate, gearman_histogram_min(latency),
+           gearman_histogram_mean(latency),
+           gearman_histogram_percentile(latency, 50),
+           gearman_histogram_percentile(latency, 99),
+           gearman_histogram_percentile(latency, 99.9),
+           gearman_histogram_max(latency));
+    break;
+
+  case GEARMAN_BENCHMARK_FORMAT_TEXT:
+  default:
+    printf("[Processes: %u, Tasks: %u, Size: %zu-%zu] %"PRIu64" jobs, %"PRIu64
+           " failed, %6"PRIu64" jobs/s\n"
+           "  Latency (us): min %"PRIu64", mean %"PRIu64", p50 %"PRIu64
+           ", p99 %"PRIu64", p99.9 %"PRIu64", max %"PRIu64"\n",
+           result->processes, result->concurrency, result->min_size,
+           result->max_size, result->jobs, result->fail_count, rate,
+           gearman_histogram_min(latency), gearman_histogram_mean(latency),
+           gearman_histogram_percentile(latency, 50),
+           gearman_histogram_percentile(latency, 99),
+           gearman_histogram_percentile(latency, 99.9),
+           gearman_histogram_max(latency));
+    break;
+  }
+
+  fflush(stdout);
+}
+
+void benchmark_report_end(gearman_benchmark_format_t format)
+{
+  if (format == GEARMAN_BENCHMARK_FORMAT_JSON)
+    printf("\n]\n");
+}
@@ -33,6 +33,9 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -49,6 +52,7 @@
 #endif
 
 #define GEARMAN_BENCHMARK_DEFAULT_FUNCTION "gb"
+#define GEARMAN_BENCHMARK_LIST_MAX 32
 
 /**
  * @addtogroup benchmark Common Benchmark Utilities
@@ -65,6 +69,29 @@ typedef struct
   struct timeval end;
 } gearman_benchmark_st;
 
+typedef enum
+{
+  GEARMAN_BENCHMARK_FORMAT_TEXT,
+  GEARMAN_BENCHMARK_FORMAT_CSV,
+  GEARMAN_BENCHMARK_FORMAT_JSON
+} gearman_benchmark_format_t;
+
+/**
+ * Results of one benchmark run, added up over every process taking part.
+ * Latencies are from submitting each task to it finishing, in microseconds.
+ */
+typedef struct
+{
+  uint32_t processes;
+  uint32_t concurrency;
+  size_t min_size;
+  size_t max_size;
+  uint64_t jobs;
+  uint64_t fail_count;
+  uint64_t usec;
+  gearman_histogram_st latency;
+} gearman_benchmark_result_st;
+
 /**
  * Initialize a benchmark strucutre.
  */
@@ -75,6 +102,57 @@ void benchmark_init(gearman_benchmark_st *benchmark);
  */
 void benchmark_check_time(gearman_benchmark_st *benchmark);
 
+/**
+ * Get the current time in microseconds.
+ */
+uint64_t benchmark_now(void);
+
+/**
+ * Parse a comma separated list of numbers, such as "1,10,100".
+ * @return Number of values put in list, or 0 if the list is empty, has
+ *         something other than a number in it, or more than list_max values.
+ */
+uint32_t benchmark_parse_list(const char *arg, size_t *list,
+                              uint32_t list_max);
+
+/**
+ * Parse an output format name, "text", "csv", or "json".
+ * @return Whether the name was known.
+ */
+bool benchmark_parse_format(const char *arg,
+                            gearman_benchmark_format_t *format);
+
+/**
+ * Initialize a benchmark result structure.
+ */
+void benchmark_result_init(gearman_benchmark_result_st *result);
+
+/**
+ * Add one process's results to those of a run. The run takes as long as its
+ * slowest process.
+ */
+void benchmark_result_merge(gearman_benchmark_result_st *result,
+                            const gearman_benchmark_result_st *from);
+
+/**
+ * Print anything that goes before the results, such as a CSV header.
+ */
+void benchmark_report_begin(gearman_benchmark_format_t format);
+
+/**
+ * Print the results of one run.
+ * @param format Format to print in.
+ * @param result Results to print.
+ * @param first Whether this is the first run printed.
+ */
+void benchmark_report(gearman_benchmark_format_t format,
+                      const gearman_benchmark_result_st *result, bool first);
+
+/**
+ * Print anything that goes after the results.
+ */
+void benchmark_report_end(gearman_benchmark_format_t format);
+
 /** @} */
 
 #endif /* __GEARMAN_BENCHMARK_H__ */
@@ -24,27 +24,48 @@ static gearman_return_t _status(gearman_task_st *task);
 static gearman_return_t _complete(gearman_task_st *task);
 static gearman_return_t _fail(gearman_task_st *task);
 
+static void _run(gearman_client_st *client, gearman_benchmark_st *benchmark,
+                 const char *function, gearman_task_st *tasks,
+                 uint32_t count, uint32_t duration, char *blob,
+                 gearman_benchmark_result_st *result);
+
+static void _run_processes(gearman_client_st *client,
+                           gearman_benchmark_st *benchmark,
+                           const char *function, gearman_task_st *tasks,
+                           uint32_t count, uint32_t duration, char *blob,
+                           gearman_benchmark_result_st *result);
+
 static void _usage(char *name);
 
 int main(int argc, char *argv[])
 {
   gearman_benchmark_st benchmark;
+  gearman_benchmark_result_st result;
+  gearman_benchmark_format_t format= GEARMAN_BENCHMARK_FORMAT_TEXT;
   int c;
   char *host= NULL;
   in_port_t port= 0;
   const char *function= GEARMAN_BENCHMARK_DEFAULT_FUNCTION;
-  uint32_t num_tasks= BLOBSLAP_DEFAULT_NUM_TASKS;
+  size_t num_tasks[GEARMAN_BENCHMARK_LIST_MAX];
+  uint32_t num_tasks_count= 1;
+  size_t sizes[GEARMAN_BENCHMARK_LIST_MAX];
+  uint32_t sizes_count= 0;
+  bool size_list= false;
   size_t min_size= BLOBSLAP_DEFAULT_BLOB_MIN_SIZE;
   size_t max_size= BLOBSLAP_DEFAULT_BLOB_MAX_SIZE;
+  size_t max_tasks= 0;
   uint32_t count= 1;
+  uint32_t duration= 0;
+  uint32_t processes= 1;
   gearman_return_t ret;
   gearman_client_st client;
   gearman_task_st *tasks;
   char *blob;
-  size_t blob_size;
   uint32_t x;
+  uint32_t y;
 
   benchmark_init(&benchmark);
+  num_tasks[0]= BLOBSLAP_DEFAULT_NUM_TASKS;
 
   if (gearman_client_create(&client) == NULL)
   {
@@ -53,8 +74,9 @@ int main(int argc, char *argv[])
   }
 
   gearman_client_set_options(&client, GEARMAN_CLIENT_UNBUFFERED_RESULT, 1);
+  gearman_client_set_options(&client, GEARMAN_CLIENT_STATS, 1);
 
-  while ((c= getopt(argc, argv, "bc:f:h:m:M:n:p:s:v")) != -1)
+  while ((c= getopt(argc, argv, "bc:d:f:h:m:M:n:o:p:P:s:S:v")) != -1)
   {
     switch(c)
     {
@@ -66,6 +88,10 @@ int main(int argc, char *argv[])
       count= (uint32_t)atoi(optarg);
       break;
 
+    case 'd':
+      duration= (uint32_t)atoi(optarg);
+      break;
+
     case 'f':
       function= optarg;
       break;
@@ -89,17 +115,45 @@ int main(int argc, char *argv[])
       break;
 
     case 'n':
-      num_tasks= (uint32_t)atoi(optarg);
+      num_tasks_count= benchmark_parse_list(optarg, num_tasks,
+                                            GEARMAN_BENCHMARK_LIST_MAX);
+      if (num_tasks_count == 0)
+      {
+        fprintf(stderr, "Bad list of task counts: %s\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case 'o':
+      if (!benchmark_parse_format(optarg, &format))
+      {
+        fprintf(stderr, "Unknown output format: %s\n", optarg);
+        exit(1);
+      }
       break;
 
     case 'p':
       port= (in_port_t)atoi(optarg);
       break;
 
+    case 'P':
+      processes= (uint32_t)atoi(optarg);
+      break;
+
     case 's':
       srand((unsigned int)atoi(optarg));
       break;
 
+    case 'S':
+      sizes_count= benchmark_parse_list(optarg, sizes,
+                                        GEARMAN_BENCHMARK_LIST_MAX);
+      if (sizes_count == 0)
+      {
+        fprintf(stderr, "Bad list of blob sizes: %s\n", optarg);
+        exit(1);
+      }
+      break;
+
     case 'v':
       benchmark.verbose++;
       break;
@@ -127,13 +181,46 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
-  if (num_tasks == 0)
+  if (processes == 0)
+  {
+    fprintf(stderr, "Number of processes must be larger than zero\n");
+    exit(1);
+  }
+
+  if (count == 0 && duration == 0 && (num_tasks_count > 1 || sizes_count > 1))
   {
-    fprintf(stderr, "Number of tasks must be larger than zero\n");
+    fprintf(stderr, "A count or duration is needed to run more than one "
+                    "test\n");
     exit(1);
   }
 
-  tasks= malloc(num_tasks * sizeof(gearman_task_st));
+  for (x= 0; x < num_tasks_count; x++)
+  {
+    if (num_tasks[x] == 0 || num_tasks[x] > UINT32_MAX)
+    {
+      fprintf(stderr, "Number of tasks must be larger than zero\n");
+      exit(1);
+    }
+
+    if (num_tasks[x] > max_tasks)
+      max_tasks= num_tasks[x];
+  }
+
+  /* Without a list of sizes, one test is run with sizes picked at random
+     between the min and max size. */
+  if (sizes_count == 0)
+    sizes_count= 1;
+  else
+  {
+    size_list= true;
+    for (x= 0; x < sizes_count; x++)
+    {
+      if (sizes[x] > max_size)
+        max_size= sizes[x];
+    }
+  }
+
+  tasks= malloc(max_tasks * sizeof(gearman_task_st));
   if (tasks == NULL)
   {
     fprintf(stderr, "Memory allocation failure on malloc\n");
@@ -141,7 +228,7 @@ int main(int argc, char *argv[])
   }
   
   blob= malloc(max_size);
-  if (blob == NULL)
+  if (blob == NULL && max_size > 0)
   {
     fprintf(stderr, "Memory allocation failure on malloc\n");
     exit(1);
@@ -149,65 +236,49 @@ int main(int argc, char *argv[])
 
   memset(blob, 'x', max_size); 
 
-  while (1)
+  gearman_client_set_created_fn(&client, _created);
+  gearman_client_set_data_fn(&client, _data);
+  gearman_client_set_status_fn(&client, _status);
+  gearman_client_set_complete_fn(&client, _complete);
+  gearman_client_set_fail_fn(&client, _fail);
+
+  benchmark_report_begin(format);
+
+  for (x= 0; x < sizes_count; x++)
   {
-    for (x= 0; x < num_tasks; x++)
+    for (y= 0; y < num_tasks_count; y++)
     {
-      if (min_size == max_size)
-        blob_size= max_size;
+      benchmark_result_init(&result);
+      result.processes= processes;
+      result.concurrency= (uint32_t)num_tasks[y];
+      if (size_list)
+      {
+        result.min_size= sizes[x];
+        result.max_size= sizes[x];
+      }
       else
       {
-        blob_size= (size_t)rand();
-
-        if (max_size > RAND_MAX)
-          blob_size*= (size_t)(rand() + 1);
-
-        blob_size= (blob_size % (max_size - min_size)) + min_size;
+        result.min_size= min_size;
+        result.max_size= max_size;
       }
 
-      if (benchmark.background)
+      if (processes == 1)
       {
-        (void)gearman_client_add_task_background(&client, &(tasks[x]),
-                                                 &benchmark, function, NULL,
-                                                 (void *)blob, blob_size, &ret);
+        _run(&client, &benchmark, function, tasks, count, duration, blob,
+             &result);
       }
       else
       {
-        (void)gearman_client_add_task(&client, &(tasks[x]), &benchmark,
-                                      function, NULL, (void *)blob, blob_size,
-                                      &ret);
+        _run_processes(&client, &benchmark, function, tasks, count, duration,
+                       blob, &result);
       }
 
-      if (ret != GEARMAN_SUCCESS)
-      {
-        fprintf(stderr, "%s\n", gearman_client_error(&client));
-        exit(1);
-      }
-    }
-
-    gearman_client_set_created_fn(&client, _created);
-    gearman_client_set_data_fn(&client, _data);
-    gearman_client_set_status_fn(&client, _status);
-    gearman_client_set_complete_fn(&client, _complete);
-    gearman_client_set_fail_fn(&client, _fail);
-    ret= gearman_client_run_tasks(&client);
-    if (ret != GEARMAN_SUCCESS)
-    {
-      fprintf(stderr, "%s\n", gearman_client_error(&client));
-      exit(1);
-    }
-
-    for (x= 0; x < num_tasks; x++)
-      gearman_task_free(&(tasks[x]));
-
-    if (count > 0)
-    {
-      count--;
-      if (count == 0)
-        break;
+      benchmark_report(format, &result, x == 0 && y == 0);
     }
   }
 
+  benchmark_report_end(format);
+
   free(blob);
   free(tasks);
   gearman_client_free(&client);
@@ -317,12 +388,200 @@ static gearman_return_t _fail(gearman_task_st *task)
   return GEARMAN_SUCCESS;
 }
 
+static void _run(gearman_client_st *client, gearman_benchmark_st *benchmark,
+                 const char *function, gearman_task_st *tasks,
+                 uint32_t count, uint32_t duration, char *blob,
+                 gearman_benchmark_result_st *result)
+{
+  gearman_client_stats_st *stats;
+  gearman_return_t ret;
+  uint64_t begin;
+  size_t blob_size;
+  uint32_t x;
+
+  gearman_client_stats_reset(client);
+  begin= benchmark_now();
+
+  while (1)
+  {
+    for (x= 0; x < result->concurrency; x++)
+    {
+      if (result->min_size == result->max_size)
+        blob_size= result->max_size;
+      else
+      {
+        blob_size= (size_t)rand();
+
+        if (result->max_size > RAND_MAX)
+          blob_size*= (size_t)(rand() + 1);
+
+        blob_size= (blob_size % (result->max_size - result->min_size)) +
+                   result->min_size;
+      }
+
+      if (benchmark->background)
+      {
+        (void)gearman_client_add_task_background(client, &(tasks[x]),
+                                                 benchmark, function, NULL,
+                                                 (void *)blob, blob_size, &ret);
+      }
+      else
+      {
+        (void)gearman_client_add_task(client, &(tasks[x]), benchmark,
+                                      function, NULL, (void *)blob, blob_size,
+                                      &ret);
+      }
+
+      if (ret != GEARMAN_SUCCESS)
+      {
+        fprintf(stderr, "%s\n", gearman_client_error(client));
+        exit(1);
+      }
+    }
+
+    ret= gearman_client_run_tasks(client);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "%s\n", gearman_client_error(client));
+      exit(1);
+    }
+
+    for (x= 0; x < result->concurrency; x++)
+      gearman_task_free(&(tasks[x]));
+
+    /* A duration takes the place of a count. */
+    if (duration > 0)
+    {
+      if (benchmark_now() - begin >= (uint64_t)duration * 1000000)
+        break;
+    }
+    else if (count > 0)
+    {
+      count--;
+      if (count == 0)
+        break;
+    }
+  }
+
+  result->usec= benchmark_now() - begin;
+
+  for (stats= gearman_client_stats(client, NULL); stats != NULL;
+       stats= gearman_client_stats(client, stats))
+  {
+    if (!strcmp(gearman_client_stats_function(stats), function))
+    {
+      result->jobs= gearman_client_stats_count(stats);
+      result->fail_count= gearman_client_stats_fail_count(stats);
+      result->latency= *gearman_client_stats_total(stats);
+      break;
+    }
+  }
+}
+
+static void _run_processes(gearman_client_st *client,
+                           gearman_benchmark_st *benchmark,
+                           const char *function, gearman_task_st *tasks,
+                           uint32_t count, uint32_t duration, char *blob,
+                           gearman_benchmark_result_st *result)
+{
+  gearman_benchmark_result_st child;
+  int *fds;
+  int pipe_fds[2];
+  pid_t pid;
+  ssize_t io_size;
+  size_t offset;
+  uint32_t x;
+  bool failed= false;
+
+  fds= malloc(result->processes * sizeof(int));
+  if (fds == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on malloc\n");
+    exit(1);
+  }
+
+  /* Anything still buffered would be printed again by each process. */
+  fflush(stdout);
+
+  /* Each process gets its own pipe, since results may be larger than a pipe
+     can write in one piece. */
+  for (x= 0; x < result->processes; x++)
+  {
+    if (pipe(pipe_fds) == -1)
+    {
+      fprintf(stderr, "pipe:%d\n", errno);
+      exit(1);
+    }
+
+    pid= fork();
+    if (pid == -1)
+    {
+      fprintf(stderr, "fork:%d\n", errno);
+      exit(1);
+    }
+
+    if (pid == 0)
+    {
+      close(pipe_fds[0]);
+      child= *result;
+      /* Different processes should not all pick the same blob sizes. */
+      srand((unsigned int)rand() + x);
+      _run(client, benchmark, function, tasks, count, duration, blob, &child);
+
+      for (offset= 0; offset < sizeof(child); offset+= (size_t)io_size)
+      {
+        io_size= write(pipe_fds[1], (char *)&child + offset,
+                         sizeof(child) - offset);
+        if (io_size <= 0)
+          _exit(1);
+      }
+
+      _exit(0);
+    }
+
+    close(pipe_fds[1]);
+    fds[x]= pipe_fds[0];
+  }
+
+  for (x= 0; x < result->processes; x++)
+  {
+    for (offset= 0; offset < sizeof(child); offset+= (size_t)io_size)
+    {
+      io_size= read(fds[x], (char *)&child + offset, sizeof(child) - offset);
+      if (io_size <= 0)
+        break;
+    }
+
+    close(fds[x]);
+
+    if (offset == sizeof(child))
+      benchmark_result_merge(result, &child);
+    else
+      failed= true;
+  }
+
+  for (x= 0; x < result->processes; x++)
+    (void)wait(NULL);
+
+  free(fds);
+
+  if (failed)
+  {
+    fprintf(stderr, "A benchmark process did not finish\n");
+    exit(1);
+  }
+}
+
 static void _usage(char *name)
 {
   printf("\nusage: %s\n"
-         "\t[-c count] [-f <function>] [-h <host>] [-m <min_size>]\n"
-         "\t[-M <max_size>] [-n <num_tasks>] [-p <port>] [-s] [-v]\n\n", name);
+         "\t[-b] [-c count] [-d <seconds>] [-f <function>] [-h <host>]\n"
+         "\t[-m <min_size>] [-M <max_size>] [-n <num_tasks>] [-o <format>]\n"
+         "\t[-p <port>] [-P <processes>] [-s] [-S <sizes>] [-v]\n\n", name);
+  printf("\t-b             - submit background jobs\n");
   printf("\t-c <count>     - number of times to run all tasks\n");
+  printf("\t-d <seconds>   - run all tasks again until this long has passed,\n"
+         "\t                 in place of a count\n");
   printf("\t-f <function>  - function name for tasks (default %s)\n",
          GEARMAN_BENCHMARK_DEFAULT_FUNCTION);
   printf("\t-h <host>      - job server host, can specify many\n");
@@ -330,9 +589,16 @@ static void _usage(char *name)
          BLOBSLAP_DEFAULT_BLOB_MIN_SIZE);
   printf("\t-M <max_size>  - maximum blob size (default %d)\n",
          BLOBSLAP_DEFAULT_BLOB_MAX_SIZE);
-  printf("\t-n <num_tasks> - number of tasks to run at once (default %d)\n",
-         BLOBSLAP_DEFAULT_NUM_TASKS);
+  printf("\t-n <num_tasks> - number of tasks to run at once in each process,\n"
+         "\t                 or a comma separated list to run a test with "
+         "each\n"
+         "\t                 (default %d)\n", BLOBSLAP_DEFAULT_NUM_TASKS);
+  printf("\t-o <format>    - print results as text, csv, or json\n"
+         "\t                 (default text)\n");
   printf("\t-p <port>      - job server port\n");
+  printf("\t-P <processes> - number of client processes (default 1)\n");
   printf("\t-s <seed>      - seed random number for blobsize with <seed>\n");
-  printf("\t-v            - increase verbose level\n");
+  printf("\t-S <sizes>     - comma separated list of blob sizes to run a test\n"
+         "\t                 with each, in place of a min and max size\n");
+  printf("\t-v             - increase verbose level\n");
 }
@@ -26,6 +26,9 @@ int main(int argc, char *argv[])
   in_port_t port= 0;
   char *function= NULL;
   uint32_t count= 0;
+  uint32_t processes= 1;
+  uint32_t x;
+  pid_t pid= 1;
   gearman_return_t ret;
   gearman_worker_st worker;
 
@@ -37,7 +40,7 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
-  while ((c = getopt(argc, argv, "c:f:h:p:v")) != -1)
+  while ((c = getopt(argc, argv, "c:f:h:p:P:v")) != -1)
   {
     switch(c)
     {
@@ -70,6 +73,10 @@ int main(int argc, char *argv[])
       port= (in_port_t)atoi(optarg);
       break;
 
+    case 'P':
+      processes= (uint32_t)atoi(optarg);
+      break;
+
     case 'v':
       benchmark.verbose++;
       break;
@@ -108,6 +115,18 @@ int main(int argc, char *argv[])
     }
   }
 
+  /* Nothing is connected yet, so each process gets its own connections. This
+     one runs jobs as well. */
+  for (x= 1; x < processes && pid != 0; x++)
+  {
+    pid= fork();
+    if (pid == -1)
+    {
+      fprintf(stderr, "fork:%d\n", errno);
+      exit(1);
+    }
+  }
+
   while (1)
   {
     ret= gearman_worker_work(&worker);
@@ -127,6 +146,12 @@ int main(int argc, char *argv[])
 
   gearman_worker_free(&worker);
 
+  if (pid != 0)
+  {
+    for (x= 1; x < processes; x++)
+      (void)wait(NULL);
+  }
+
   return 0;
 }
 
@@ -153,12 +178,14 @@ static void *worker_fn(gearman_job_st *job, void *cb_arg, size_t *result_size,
 static void usage(char *name)
 {
   printf("\nusage: %s\n"
-         "\t[-c count] [-f function] [-h <host>] [-p <port>] [-v]\n\n", name);
-  printf("\t-c <count>    - number of jobs to run before exiting\n");
+         "\t[-c count] [-f function] [-h <host>] [-p <port>]\n"
+         "\t[-P <processes>] [-v]\n\n", name);
+  printf("\t-c <count>    - number of jobs each process runs before exiting\n");
   printf("\t-f <function> - function name for tasks, can specify many\n"
          "\t                (default %s)\n",
                             GEARMAN_BENCHMARK_DEFAULT_FUNCTION);
   printf("\t-h <host>     - job server host, can specify many\n");
   printf("\t-p <port>     - job server port\n");
+  printf("\t-P <processes> - number of worker processes (default 1)\n");
   printf("\t-v            - increase verbose level\n");
 }
@@ -0,0 +1,652 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Packet and server data structure microbenchmarks
+ */
+
+#include "benchmark.h"
+
+#include <sys/socket.h>
+
+#define MICRO_BENCH_DEFAULT_COUNT 1000000
+#define MICRO_BENCH_DEFAULT_DATA_SIZE 128
+#define MICRO_BENCH_FUNCTION_COUNT 64
+#define MICRO_BENCH_JOB_COUNT 1024
+#define MICRO_BENCH_UNIQUE_SIZE 37
+#define MICRO_BENCH_NAME_SIZE 32
+
+/**
+ * State the tests share. Server tests set up a server with one connection
+ * that has a worker for the first function.
+ */
+typedef struct
+{
+  size_t data_size;
+  size_t buffer_size;
+  char *data;
+  uint8_t *buffer;
+  gearman_st gearman;
+  gearman_packet_st packet;
+  gearman_server_st server;
+  gearman_server_thread_st thread;
+  gearman_server_con_st *con;
+  gearman_server_worker_st *worker;
+  int fds[2];
+  char function[MICRO_BENCH_FUNCTION_COUNT][MICRO_BENCH_NAME_SIZE];
+  char unique[MICRO_BENCH_JOB_COUNT][MICRO_BENCH_UNIQUE_SIZE];
+  char job_handle[MICRO_BENCH_JOB_COUNT][GEARMAN_JOB_HANDLE_SIZE];
+} micro_bench_st;
+
+typedef void (micro_bench_fn)(micro_bench_st *bench, uint32_t count);
+
+typedef struct
+{
+  const char *name;
+  micro_bench_fn *setup;
+  micro_bench_fn *run;
+  micro_bench_fn *teardown;
+} micro_bench_test_st;
+
+static void _packet_setup(micro_bench_st *bench, uint32_t count);
+static void _packet_teardown(micro_bench_st *bench, uint32_t count);
+static void _packet_add_arg(micro_bench_st *bench, uint32_t count);
+static void _packet_pack(micro_bench_st *bench, uint32_t count);
+static void _packet_unpack(micro_bench_st *bench, uint32_t count);
+static void _packet_unpack_split(micro_bench_st *bench, uint32_t count);
+
+static void _server_setup(micro_bench_st *bench, uint32_t count);
+static void _server_setup_jobs(micro_bench_st *bench, uint32_t count);
+static void _server_teardown(micro_bench_st *bench, uint32_t count);
+static void _function_get(micro_bench_st *bench, uint32_t count);
+static void _job_add_take(micro_bench_st *bench, uint32_t count);
+static void _job_add_exists(micro_bench_st *bench, uint32_t count);
+static void _job_get(micro_bench_st *bench, uint32_t count);
+
+static uint64_t _cycles(void);
+static uint64_t _nsec(void);
+static void _usage(char *name);
+
+static micro_bench_test_st _tests[]=
+{
+  { "packet_add_arg", _packet_setup, _packet_add_arg, _packet_teardown },
+  { "packet_pack", _packet_setup, _packet_pack, _packet_teardown },
+  { "packet_unpack", _packet_setup, _packet_unpack, _packet_teardown },
+  { "packet_unpack_split", _packet_setup, _packet_unpack_split,
+    _packet_teardown },
+  { "function_get", _server_setup, _function_get, _server_teardown },
+  { "job_add_take", _server_setup, _job_add_take, _server_teardown },
+  { "job_add_exists", _server_setup_jobs, _job_add_exists, _server_teardown },
+  { "job_get", _server_setup_jobs, _job_get, _server_teardown },
+  { NULL, NULL, NULL, NULL }
+};
+
+/* Allocations are counted by wrapping the C library allocator, which only
+   glibc makes possible. Elsewhere they are reported as 0. The wrappers are
+   exported so calls from inside libgearman resolve to them too. */
+static bool _alloc_counting= false;
+static uint64_t _alloc_count= 0;
+static uint64_t _alloc_bytes= 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+__attribute__ ((visibility("default")))
+void *malloc(size_t size)
+{
+  if (_alloc_counting)
+  {
+    _alloc_count++;
+    _alloc_bytes+= size;
+  }
+
+  return __libc_malloc(size);
+}
+
+__attribute__ ((visibility("default")))
+void *calloc(size_t nmemb, size_t size)
+{
+  if (_alloc_counting)
+  {
+    _alloc_count++;
+    _alloc_bytes+= nmemb * size;
+  }
+
+  return __libc_calloc(nmemb, size);
+}
+
+__attribute__ ((visibility("default")))
+void *realloc(void *ptr, size_t size)
+{
+  if (_alloc_counting)
+  {
+    _alloc_count++;
+    _alloc_bytes+= size;
+  }
+
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+  micro_bench_st bench;
+  gearman_benchmark_format_t format= GEARMAN_BENCHMARK_FORMAT_TEXT;
+  micro_bench_test_st *test;
+  uint32_t count= MICRO_BENCH_DEFAULT_COUNT;
+  uint64_t nsec;
+  uint64_t cycles;
+  bool first= true;
+  int c;
+  int x;
+
+  memset(&bench, 0, sizeof(micro_bench_st));
+  bench.data_size= MICRO_BENCH_DEFAULT_DATA_SIZE;
+
+  while ((c = getopt(argc, argv, "c:o:s:")) != -1)
+  {
+    switch(c)
+    {
+    case 'c':
+      count= (uint32_t)atoi(optarg);
+      break;
+
+    case 'o':
+      if (!benchmark_parse_format(optarg, &format))
+      {
+        fprintf(stderr, "Unknown output format: %s\n", optarg);
+        exit(1);
+      }
+      break;
+
+    case 's':
+      bench.data_size= (size_t)atoi(optarg);
+      break;
+
+    default:
+      _usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (count == 0)
+  {
+    fprintf(stderr, "Count must be larger than zero\n");
+    exit(1);
+  }
+
+  bench.data= malloc(bench.data_size + 1);
+  if (bench.data == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on malloc\n");
+    exit(1);
+  }
+
+  memset(bench.data, 'x', bench.data_size);
+
+  /* Names look like the ones real clients use, and unique IDs like UUIDs. */
+  for (x= 0; x < MICRO_BENCH_FUNCTION_COUNT; x++)
+  {
+    snprintf(bench.function[x], MICRO_BENCH_NAME_SIZE, "reverse_string_%u",
+             (uint32_t)x);
+  }
+
+  for (x= 0; x < MICRO_BENCH_JOB_COUNT; x++)
+  {
+    snprintf(bench.unique[x], MICRO_BENCH_UNIQUE_SIZE,
+             "%08x-1f2e-4d3c-8b4a-%012x", 0x5ca1ab1e + (uint32_t)x,
+             (uint32_t)x * 2654435761U);
+  }
+
+  if (format == GEARMAN_BENCHMARK_FORMAT_CSV)
+    printf("test,ops,ns_per_op,cycles_per_op,allocs_per_op,bytes_per_op\n");
+  else if (format == GEARMAN_BENCHMARK_FORMAT_JSON)
+    printf("[");
+  else
+  {
+    printf("%u ops per test, %zu byte payloads\n", count, bench.data_size);
+    printf("%-20s %12s %12s %10s %10s\n", "test", "ns/op", "cycles/op",
+           "allocs/op", "bytes/op");
+  }
+
+  for (test= _tests; test->name != NULL; test++)
+  {
+    /* Any names given pick the tests to run. */
+    if (optind < argc)
+    {
+      for (x= optind; x < argc && strcmp(argv[x], test->name); x++);
+      if (x == argc)
+        continue;
+    }
+
+    if (test->setup != NULL)
+      (*(test->setup))(&bench, count);
+
+    /* A short run first gets caches and free lists warmed up. */
+    (*(test->run))(&bench, count / 10 + 1);
+
+    _alloc_count= 0;
+    _alloc_bytes= 0;
+    _alloc_counting= true;
+    nsec= _nsec();
+    cycles= _cycles();
+
+    (*(test->run))(&bench, count);
+
+    cycles= _cycles() - cycles;
+    nsec= _nsec() - nsec;
+    _alloc_counting= false;
+
+    if (test->teardown != NULL)
+      (*(test->teardown))(&bench, count);
+
+    switch (format)
+    {
+    case GEARMAN_BENCHMARK_FORMAT_CSV:
+      printf("%s,%u,%.1f,%.1f,%.2f,%.1f\n", test->name, count,
+             (double)nsec / count, (double)cycles / count,
+             (double)_alloc_count / count, (double)_alloc_bytes / count);
+      break;
+
+    case GEARMAN_BENCHMARK_FORMAT_JSON:
+      printf("%s\n  {\"test\": \"%s\", \"ops\": %u, \"ns_per_op\": %.1f, "
+             "\"cycles_per_op\": %.1f,\n   \"allocs_per_op\": %.2f, "
+             "\"bytes_per_op\": %.1f}", first ? "" : ",", test->name, count,
+             (double)nsec / count, (double)cycles / count,
+             (double)_alloc_count / count, (double)_alloc_bytes / count);
+      break;
+
+    case GEARMAN_BENCHMARK_FORMAT_TEXT:
+    default:
+      printf("%-20s %12.1f %12.1f %10.2f %10.1f\n", test->name,
+             (double)nsec / count, (double)cycles / count,
+             (double)_alloc_count / count, (double)_alloc_bytes / count);
+      break;
+    }
+
+    first= false;
+    fflush(stdout);
+  }
+
+  if (format == GEARMAN_BENCHMARK_FORMAT_JSON)
+    printf("\n]\n");
+
+  free(bench.data);
+
+  return 0;
+}
+
+static void _packet_setup(micro_bench_st *bench, uint32_t count)
+{
+  gearman_return_t ret;
+
+  (void)count;
+
+  if (gearman_create(&(bench->gearman)) == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on gearman creation\n");
+    exit(1);
+  }
+
+  gearman_set_options(&(bench->gearman), GEARMAN_DONT_TRACK_PACKETS, 1);
+
+  /* A SUBMIT_JOB the way a client sends it. */
+  ret= gearman_packet_add(&(bench->gearman), &(bench->packet),
+                          GEARMAN_MAGIC_REQUEST, GEARMAN_COMMAND_SUBMIT_JOB,
+                          bench->function[0], strlen(bench->function[0]) + 1,
+                          bench->unique[0], strlen(bench->unique[0]) + 1,
+                          bench->data, bench->data_size, NULL);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "%s\n", gearman_error(&(bench->gearman)));
+    exit(1);
+  }
+
+  bench->buffer_size= bench->packet.args_size + bench->packet.data_size;
+  bench->buffer= malloc(bench->buffer_size);
+  if (bench->buffer == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on malloc\n");
+    exit(1);
+  }
+
+  memcpy(bench->buffer, bench->packet.args, bench->packet.args_size);
+  memcpy(bench->buffer + bench->packet.args_size, bench->packet.data,
+         bench->packet.data_size);
+}
+
+static void _packet_teardown(micro_bench_st *bench, uint32_t count)
+{
+  (void)count;
+
+  free(bench->buffer);
+  gearman_packet_free(&(bench->packet));
+  gearman_free(&(bench->gearman));
+}
+
+static void _packet_add_arg(micro_bench_st *bench, uint32_t count)
+{
+  gearman_packet_st packet;
+  gearman_return_t ret;
+  uint32_t x;
+
+  for (x= 0; x < count; x++)
+  {
+    if (gearman_packet_create(&(bench->gearman), &packet) == NULL)
+    {
+      fprintf(stderr, "%s\n", gearman_error(&(bench->gearman)));
+      exit(1);
+    }
+
+    packet.magic= GEARMAN_MAGIC_REQUEST;
+    packet.command= GEARMAN_COMMAND_SUBMIT_JOB;
+
+    ret= gearman_packet_add_arg(&packet, bench->function[x & 63],
+                                strlen(bench->function[x & 63]) + 1);
+    if (ret == GEARMAN_SUCCESS)
+    {
+      ret= gearman_packet_add_arg(&packet, bench->unique[x & 1023],
+                                  MICRO_BENCH_UNIQUE_SIZE);
+    }
+    if (ret == GEARMAN_SUCCESS)
+      ret= gearman_packet_add_arg(&packet, bench->data, bench->data_size);
+    if (ret == GEARMAN_SUCCESS)
+      ret= gearman_packet_pack_header(&packet);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "%s\n", gearman_error(&(bench->gearman)));
+      exit(1);
+    }
+
+    gearman_packet_free(&packet);
+  }
+}
+
+static void _packet_pack(micro_bench_st *bench, uint32_t count)
+{
+  gearman_return_t ret;
+  uint32_t x;
+
+  for (x= 0; x < count; x++)
+  {
+    if (gearman_packet_pack(&(bench->packet), NULL, bench->buffer,
+                            bench->buffer_size, &ret) == 0 ||
+        ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "Failed to pack packet:%d\n", ret);
+      exit(1);
+    }
+  }
+}
+
+static void _packet_unpack(micro_bench_st *bench, uint32_t count)
+{
+  gearman_packet_st packet;
+  gearman_return_t ret;
+  uint32_t x;
+
+  for (x= 0; x < count; x++)
+  {
+    if (gearman_packet_create(&(bench->gearman), &packet) == NULL)
+    {
+      fprintf(stderr, "%s\n", gearman_error(&(bench->gearman)));
+      exit(1);
+    }
+
+    (void)gearman_packet_unpack(&packet, NULL, bench->buffer,
+                                bench->buffer_size, &ret);
+    if (ret != GEARMAN_SUCCESS || packet.argc != bench->packet.argc)
+    {
+      fprintf(stderr, "Failed to unpack packet:%d\n", ret);
+      exit(1);
+    }
+
+    gearman_packet_free(&packet);
+  }
+}
+
+static void _packet_unpack_split(micro_bench_st *bench, uint32_t count)
+{
+  gearman_packet_st packet;
+  gearman_return_t ret;
+  size_t used;
+  uint32_t x;
+
+  /* Only the header is there on the first call, so the arguments are added
+     one at a time as they arrive. */
+  for (x= 0; x < count; x++)
+  {
+    if (gearman_packet_create(&(bench->gearman), &packet) == NULL)
+    {
+      fprintf(stderr, "%s\n", gearman_error(&(bench->gearman)));
+      exit(1);
+    }
+
+    used= gearman_packet_unpack(&packet, NULL, bench->buffer,
+                                GEARMAN_PACKET_HEADER_SIZE, &ret);
+    if (ret == GEARMAN_IO_WAIT)
+    {
+      used+= gearman_packet_unpack(&packet, NULL, bench->buffer + used,
+                                   bench->buffer_size - used, &ret);
+    }
+
+    if (ret != GEARMAN_SUCCESS || packet.argc != bench->packet.argc)
+    {
+      fprintf(stderr, "Failed to unpack packet:%d\n", ret);
+      exit(1);
+    }
+
+    gearman_packet_free(&packet);
+  }
+}
+
+static void _server_setup(micro_bench_st *bench, uint32_t count)
+{
+  uint32_t x;
+
+  (void)count;
+
+  if (gearman_server_create(&(bench->server)) == NULL ||
+      gearman_server_thread_create(&(bench->server),
+                                   &(bench->thread)) == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on server creation\n");
+    exit(1);
+  }
+
+  /* The connection is never read from, it only needs a descriptor. */
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, bench->fds) == -1)
+  {
+    fprintf(stderr, "socketpair:%d\n", errno);
+    exit(1);
+  }
+
+  bench->con= gearman_server_con_add(&(bench->thread), bench->fds[0], 0, NULL);
+  if (bench->con == NULL)
+  {
+    fprintf(stderr, "%s\n", gearman_server_thread_error(&(bench->thread)));
+    exit(1);
+  }
+
+  for (x= 0; x < MICRO_BENCH_FUNCTION_COUNT; x++)
+  {
+    if (gearman_server_function_get(&(bench->server), bench->function[x],
+                                    strlen(bench->function[x])) == NULL)
+    {
+      fprintf(stderr, "Memory allocation failure on function creation\n");
+      exit(1);
+    }
+  }
+
+  bench->worker= gearman_server_worker_add(bench->con, bench->function[0],
+                                           strlen(bench->function[0]), 0);
+  if (bench->worker == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on worker creation\n");
+    exit(1);
+  }
+}
+
+static void _server_setup_jobs(micro_bench_st *bench, uint32_t count)
+{
+  gearman_server_job_st *server_job;
+  gearman_return_t ret;
+  uint32_t x;
+
+  _server_setup(bench, count);
+
+  /* Jobs are spread over the functions, and left queued. */
+  for (x= 0; x < MICRO_BENCH_JOB_COUNT; x++)
+  {
+    server_job= gearman_server_job_add(&(bench->server),
+                                       bench->function[x & 63],
+                                       strlen(bench->function[x & 63]),
+                                       bench->unique[x],
+                                       MICRO_BENCH_UNIQUE_SIZE - 1, NULL, 0,
+                                       GEARMAN_JOB_PRIORITY_NORMAL, 0, NULL,
+                                       &ret);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "%s\n", gearman_error(bench->server.gearman));
+      exit(1);
+    }
+
+    (void)gearman_server_job_handle(server_job, bench->job_handle[x]);
+  }
+}
+
+static void _server_teardown(micro_bench_st *bench, uint32_t count)
+{
+  (void)count;
+
+  gearman_server_thread_free(&(bench->thread));
+  gearman_server_free(&(bench->server));
+  close(bench->fds[1]);
+}
+
+static void _function_get(micro_bench_st *bench, uint32_t count)
+{
+  uint32_t x;
+
+  for (x= 0; x < count; x++)
+  {
+    if (gearman_server_function_get(&(bench->server), bench->function[x & 63],
+                                    strlen(bench->function[x & 63])) == NULL)
+    {
+      fprintf(stderr, "Function not found\n");
+      exit(1);
+    }
+  }
+}
+
+static void _job_add_take(micro_bench_st *bench, uint32_t count)
+{
+  gearman_server_job_st *server_job;
+  gearman_return_t ret;
+  uint32_t x;
+
+  /* A background job with no payload, so only the server's own work is
+     timed, then the worker takes it and it is done. */
+  for (x= 0; x < count; x++)
+  {
+    (void)gearman_server_job_add(&(bench->server), bench->function[0],
+                                 strlen(bench->function[0]),
+                                 bench->unique[x & 1023],
+                                 MICRO_BENCH_UNIQUE_SIZE - 1, NULL, 0,
+                                 GEARMAN_JOB_PRIORITY_NORMAL, 0, NULL, &ret);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "%s\n", gearman_error(bench->server.gearman));
+      exit(1);
+    }
+
+    server_job= gearman_server_job_take_worker(bench->worker);
+    if (server_job == NULL)
+    {
+      fprintf(stderr, "Job not taken\n");
+      exit(1);
+    }
+
+    gearman_server_job_free(server_job);
+  }
+}
+
+static void _job_add_exists(micro_bench_st *bench, uint32_t count)
+{
+  gearman_return_t ret;
+  uint32_t x;
+
+  /* Submitting a unique ID that is already queued only looks it up. */
+  for (x= 0; x < count; x++)
+  {
+    (void)gearman_server_job_add(&(bench->server), bench->function[x & 63],
+                                 strlen(bench->function[x & 63]),
+                                 bench->unique[x & 1023],
+                                 MICRO_BENCH_UNIQUE_SIZE - 1, NULL, 0,
+                                 GEARMAN_JOB_PRIORITY_NORMAL, 0, NULL, &ret);
+    if (ret != GEARMAN_JOB_EXISTS)
+    {
+      fprintf(stderr, "Job not found:%d\n", ret);
+      exit(1);
+    }
+  }
+}
+
+static void _job_get(micro_bench_st *bench, uint32_t count)
+{
+  uint32_t x;
+
+  for (x= 0; x < count; x++)
+  {
+    if (gearman_server_job_get(&(bench->server),
+                               bench->job_handle[x & 1023]) == NULL)
+    {
+      fprintf(stderr, "Job not found\n");
+      exit(1);
+    }
+  }
+}
+
+static uint64_t _cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  uint32_t low;
+  uint32_t high;
+
+  __asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+  return ((uint64_t)high << 32) | low;
+#else
+  /* There is no cycle counter to read, so cycles are reported as 0. */
+  return 0;
+#endif
+}
+
+static uint64_t _nsec(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+    return 0;
+
+  return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static void _usage(char *name)
+{
+  printf("\nusage: %s\n"
+         "\t[-c <count>] [-o <format>] [-s <data_size>] [test ...]\n\n", name);
+  printf("\t-c <count>     - number of operations in each test (default %d)\n",
+         MICRO_BENCH_DEFAULT_COUNT);
+  printf("\t-o <format>    - print results as text, csv, or json\n");
+  printf("\t-s <data_size> - size of packet payloads (default %d)\n",
+         MICRO_BENCH_DEFAULT_DATA_SIZE);
+  printf("\ttest           - names of tests to run (default all)\n");
+}
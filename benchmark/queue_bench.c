@@ -0,0 +1,717 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Persistent queue benchmark utility
+ */
+
+#include "benchmark.h"
+
+#ifdef HAVE_LIBDRIZZLE
+#include <libgearman/queue_libdrizzle.h>
+#endif
+
+#ifdef HAVE_LIBMEMCACHED
+#include <libgearman/queue_libmemcached.h>
+#endif
+
+#ifdef HAVE_LIBSQLITE3
+#include <libgearman/queue_libsqlite3.h>
+#endif
+
+#ifdef HAVE_LIBPQ
+#include <libgearman/queue_libpq.h>
+#endif
+
+#include <libgearman/queue_logfile.h>
+
+#define QUEUE_BENCH_DEFAULT_JOBS 10000
+#define QUEUE_BENCH_DEFAULT_SIZE 1024
+#define QUEUE_BENCH_UNIQUE_SIZE 24
+
+typedef enum
+{
+  QUEUE_BENCH_OP_ADD,
+  QUEUE_BENCH_OP_FLUSH,
+  QUEUE_BENCH_OP_REPLAY,
+  QUEUE_BENCH_OP_DONE,
+  QUEUE_BENCH_OP_MAX
+} queue_bench_op_t;
+
+/**
+ * Settings shared by every test, and buffers big enough for the largest.
+ */
+typedef struct
+{
+  bool first;
+  gearman_benchmark_format_t format;
+  uint32_t jobs;
+  uint32_t test;
+  const char *queue_type;
+  const char *function;
+  gearman_conf_st *conf;
+  char *blob;
+  char *unique;
+  gearman_queue_record_st *record;
+} queue_bench_st;
+
+/**
+ * Times for one kind of queue operation. Latencies are for each call, which
+ * may handle a whole batch of jobs.
+ */
+typedef struct
+{
+  uint64_t jobs;
+  uint64_t calls;
+  uint64_t usec;
+  gearman_histogram_st latency;
+} queue_bench_result_st;
+
+static const char *_op_name[QUEUE_BENCH_OP_MAX]=
+{
+  "add",
+  "flush",
+  "replay",
+  "done"
+};
+
+static gearman_server_st *_queue_create(queue_bench_st *bench);
+static void _queue_free(queue_bench_st *bench, gearman_server_st *server);
+
+static void _run_raw(queue_bench_st *bench, uint32_t batch, size_t size);
+static void _run_server(queue_bench_st *bench, size_t size);
+
+static gearman_return_t _replay_count(gearman_st *gearman, void *fn_arg,
+                                      const void *unique, size_t unique_size,
+                                      const void *function_name,
+                                      size_t function_name_size,
+                                      const void *data, size_t data_size,
+                                      gearman_job_priority_t priority,
+                                      int64_t when);
+
+static void _result_add(queue_bench_result_st *result, uint64_t begin,
+                        uint64_t jobs);
+static void _report(queue_bench_st *bench, const char *mode, uint32_t op,
+                    uint32_t batch, size_t size,
+                    queue_bench_result_st *result);
+static void _usage(gearman_conf_st *conf, char *name);
+
+int main(int argc, char *argv[])
+{
+  queue_bench_st bench;
+  gearman_conf_st conf;
+  gearman_conf_module_st module;
+  const char *name;
+  const char *value;
+  size_t batches[GEARMAN_BENCHMARK_LIST_MAX];
+  uint32_t batches_count= 1;
+  size_t sizes[GEARMAN_BENCHMARK_LIST_MAX];
+  uint32_t sizes_count= 1;
+  size_t max_size= 0;
+  bool raw= true;
+  bool server= true;
+  uint32_t x;
+  uint32_t y;
+
+  memset(&bench, 0, sizeof(queue_bench_st));
+  bench.first= true;
+  bench.format= GEARMAN_BENCHMARK_FORMAT_TEXT;
+  bench.jobs= QUEUE_BENCH_DEFAULT_JOBS;
+  bench.function= GEARMAN_BENCHMARK_DEFAULT_FUNCTION;
+  bench.conf= &conf;
+  batches[0]= 1;
+  sizes[0]= QUEUE_BENCH_DEFAULT_SIZE;
+
+  if (gearman_conf_create(&conf) == NULL)
+  {
+    fprintf(stderr, "gearman_conf_create: NULL\n");
+    exit(1);
+  }
+
+  if (gearman_conf_module_create(&conf, &module, NULL) == NULL)
+  {
+    fprintf(stderr, "gearman_conf_module_create: NULL\n");
+    exit(1);
+  }
+
+  /* Add all main configuration options. */
+#define MCO(__name, __short, __value, __help) \
+  gearman_conf_module_add_option(&module, __name, __short, __value, __help);
+
+  MCO("batch", 'b', "BATCHES",
+      "Comma separated list of jobs to add and remove in each call through "
+      "the module functions, with a test run for each. Default=1.")
+  MCO("format", 'o', "FORMAT", "Print results as text, csv, or json.")
+  MCO("function", 'f', "FUNCTION", "Function name to store jobs under.")
+  MCO("help", 'h', NULL, "Print this help menu.")
+  MCO("jobs", 'n', "JOBS", "Number of jobs in each test. Default=10000.")
+  MCO("mode", 'm', "MODE",
+      "Either raw to call the module functions directly, server to go "
+      "through the server job functions, or all for both. Default=all.")
+  MCO("queue-type", 'q', "QUEUE", "Persistent queue type to use.")
+  MCO("size", 's', "SIZES",
+      "Comma separated list of payload sizes, with a test run for each. "
+      "Default=1024.")
+
+  if (gearman_conf_return(&conf) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearman_conf_module_add_option: %s\n",
+            gearman_conf_error(&conf));
+    exit(1);
+  }
+
+  /* Add queue configuration options, the same as gearmand. */
+#ifdef HAVE_LIBDRIZZLE
+  if (gearman_queue_libdrizzle_conf(&conf) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearman_queue_libdrizzle_conf: %s\n",
+            gearman_conf_error(&conf));
+    exit(1);
+  }
+#endif
+
+#ifdef HAVE_LIBMEMCACHED
+  if (gearman_queue_libmemcached_conf(&conf) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearman_queue_libmemcached_conf: %s\n",
+            gearman_conf_error(&conf));
+    exit(1);
+  }
+#endif
+
+#ifdef HAVE_LIBSQLITE3
+  if (gearman_queue_libsqlite3_conf(&conf) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearman_queue_libsqlite3_conf: %s\n",
+            gearman_conf_error(&conf));
+    exit(1);
+  }
+#endif
+
+#ifdef HAVE_LIBPQ
+  if (gearman_queue_libpq_conf(&conf) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearman_queue_libpq_conf: %s\n",
+            gearman_conf_error(&conf));
+    exit(1);
+  }
+#endif
+
+  if (gearman_queue_logfile_conf(&conf) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearman_queue_logfile_conf: %s\n",
+            gearman_conf_error(&conf));
+    exit(1);
+  }
+
+  if (gearman_conf_parse_args(&conf, argc, argv) != GEARMAN_SUCCESS)
+  {
+    printf("\n%s\n", gearman_conf_error(&conf));
+    _usage(&conf, argv[0]);
+    exit(1);
+  }
+
+  while (gearman_conf_module_value(&module, &name, &value))
+  {
+    if (!strcmp(name, "batch"))
+    {
+      batches_count= benchmark_parse_list(value, batches,
+                                          GEARMAN_BENCHMARK_LIST_MAX);
+      if (batches_count == 0)
+      {
+        fprintf(stderr, "Bad list of batch sizes: %s\n", value);
+        exit(1);
+      }
+    }
+    else if (!strcmp(name, "format"))
+    {
+      if (!benchmark_parse_format(value, &(bench.format)))
+      {
+        fprintf(stderr, "Unknown output format: %s\n", value);
+        exit(1);
+      }
+    }
+    else if (!strcmp(name, "function"))
+      bench.function= value;
+    else if (!strcmp(name, "help"))
+    {
+      _usage(&conf, argv[0]);
+      exit(1);
+    }
+    else if (!strcmp(name, "jobs"))
+      bench.jobs= (uint32_t)atoi(value);
+    else if (!strcmp(name, "mode"))
+    {
+      raw= !strcmp(value, "raw") || !strcmp(value, "all");
+      server= !strcmp(value, "server") || !strcmp(value, "all");
+      if (!raw && !server)
+      {
+        fprintf(stderr, "Unknown mode: %s\n", value);
+        exit(1);
+      }
+    }
+    else if (!strcmp(name, "queue-type"))
+      bench.queue_type= value;
+    else if (!strcmp(name, "size"))
+    {
+      sizes_count= benchmark_parse_list(value, sizes,
+                                        GEARMAN_BENCHMARK_LIST_MAX);
+      if (sizes_count == 0)
+      {
+        fprintf(stderr, "Bad list of payload sizes: %s\n", value);
+        exit(1);
+      }
+    }
+  }
+
+  if (bench.queue_type == NULL)
+  {
+    fprintf(stderr, "A queue type is needed\n");
+    _usage(&conf, argv[0]);
+    exit(1);
+  }
+
+  if (bench.jobs == 0)
+  {
+    fprintf(stderr, "Number of jobs must be larger than zero\n");
+    exit(1);
+  }
+
+  for (x= 0; x < batches_count; x++)
+  {
+    if (batches[x] == 0 || batches[x] > bench.jobs)
+    {
+      fprintf(stderr, "Batch sizes must be between one and the number of "
+                      "jobs\n");
+      exit(1);
+    }
+  }
+
+  for (x= 0; x < sizes_count; x++)
+  {
+    if (sizes[x] > max_size)
+      max_size= sizes[x];
+  }
+
+  bench.blob= malloc(max_size + 1);
+  bench.unique= malloc((size_t)bench.jobs * QUEUE_BENCH_UNIQUE_SIZE);
+  bench.record= malloc((size_t)bench.jobs * sizeof(gearman_queue_record_st));
+  if (bench.blob == NULL || bench.unique == NULL || bench.record == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on malloc\n");
+    exit(1);
+  }
+
+  memset(bench.blob, 'x', max_size);
+
+  if (bench.format == GEARMAN_BENCHMARK_FORMAT_CSV)
+  {
+    printf("mode,op,batch,size,jobs,calls,usec,jobs_per_sec,min_us,mean_us,"
+           "p50_us,p99_us,p999_us,max_us\n");
+  }
+  else if (bench.format == GEARMAN_BENCHMARK_FORMAT_JSON)
+    printf("[");
+
+  for (x= 0; x < sizes_count; x++)
+  {
+    if (raw)
+    {
+      for (y= 0; y < batches_count; y++)
+        _run_raw(&bench, (uint32_t)batches[y], sizes[x]);
+    }
+
+    if (server)
+      _run_server(&bench, sizes[x]);
+  }
+
+  if (bench.format == GEARMAN_BENCHMARK_FORMAT_JSON)
+    printf("\n]\n");
+
+  free(bench.record);
+  free(bench.unique);
+  free(bench.blob);
+  gearman_conf_free(&conf);
+
+  return 0;
+}
+
+static gearman_server_st *_queue_create(queue_bench_st *bench)
+{
+  gearman_server_st *server;
+  gearman_return_t ret;
+
+  server= gearman_server_create(NULL);
+  if (server == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on server creation\n");
+    exit(1);
+  }
+
+  /* The module is set up on the server the same way gearmand does it. */
+#ifdef HAVE_LIBDRIZZLE
+  if (!strcmp(bench->queue_type, "libdrizzle"))
+    ret= gearman_queue_libdrizzle_init(server->gearman, bench->conf);
+  else
+#endif
+#ifdef HAVE_LIBMEMCACHED
+  if (!strcmp(bench->queue_type, "libmemcached"))
+    ret= gearman_queue_libmemcached_init(server->gearman, bench->conf);
+  else
+#endif
+#ifdef HAVE_LIBSQLITE3
+  if (!strcmp(bench->queue_type, "libsqlite3"))
+    ret= gearman_queue_libsqlite3_init(server->gearman, bench->conf);
+  else
+#endif
+#ifdef HAVE_LIBPQ
+  if (!strcmp(bench->queue_type, "libpq"))
+    ret= gearman_queue_libpq_init(server->gearman, bench->conf);
+  else
+#endif
+  if (!strcmp(bench->queue_type, "logfile"))
+    ret= gearman_queue_logfile_init(server->gearman, bench->conf);
+  else
+  {
+    fprintf(stderr, "Unknown queue module: %s\n", bench->queue_type);
+    exit(1);
+  }
+
+  if (ret != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "%s\n", gearman_error(server->gearman));
+    exit(1);
+  }
+
+  if (server->gearman->queue_add_fn == NULL ||
+      server->gearman->queue_done_fn == NULL)
+  {
+    fprintf(stderr, "Queue module does not store jobs: %s\n",
+            bench->queue_type);
+    exit(1);
+  }
+
+  return server;
+}
+
+static void _queue_free(queue_bench_st *bench, gearman_server_st *server)
+{
+#ifdef HAVE_LIBDRIZZLE
+  if (!strcmp(bench->queue_type, "libdrizzle"))
+    gearman_queue_libdrizzle_deinit(server->gearman);
+#endif
+#ifdef HAVE_LIBMEMCACHED
+  if (!strcmp(bench->queue_type, "libmemcached"))
+    gearman_queue_libmemcached_deinit(server->gearman);
+#endif
+#ifdef HAVE_LIBSQLITE3
+  if (!strcmp(bench->queue_type, "libsqlite3"))
+    gearman_queue_libsqlite3_deinit(server->gearman);
+#endif
+#ifdef HAVE_LIBPQ
+  if (!strcmp(bench->queue_type, "libpq"))
+    gearman_queue_libpq_deinit(server->gearman);
+#endif
+  if (!strcmp(bench->queue_type, "logfile"))
+    gearman_queue_logfile_deinit(server->gearman);
+
+  gearman_server_free(server);
+}
+
+static void _run_raw(queue_bench_st *bench, uint32_t batch, size_t size)
+{
+  queue_bench_result_st result[QUEUE_BENCH_OP_MAX];
+  gearman_server_st *server;
+  gearman_st *gearman;
+  gearman_queue_record_st *record;
+  gearman_return_t ret;
+  uint64_t begin;
+  uint64_t replayed= 0;
+  uint32_t count;
+  uint32_t x;
+
+  memset(result, 0, sizeof(result));
+  server= _queue_create(bench);
+  gearman= server->gearman;
+
+  /* Each test stores jobs of its own, so one that was left behind by an
+     earlier run does not get in the way. */
+  bench->test++;
+  for (x= 0; x < bench->jobs; x++)
+  {
+    record= &(bench->record[x]);
+    record->priority= GEARMAN_JOB_PRIORITY_NORMAL;
+    record->when= 0;
+    record->unique= bench->unique + ((size_t)x * QUEUE_BENCH_UNIQUE_SIZE);
+    record->unique_size= (size_t)snprintf((char *)record->unique,
+                                          QUEUE_BENCH_UNIQUE_SIZE,
+                                          "%u-%u-%u", (uint32_t)getpid(),
+                                          bench->test, x);
+    record->function_name= bench->function;
+    record->function_name_size= strlen(bench->function);
+    record->data= bench->blob;
+    record->data_size= size;
+  }
+
+  /* gearman_server_queue_add and gearman_server_queue_done hand a batch to
+     the module's batch function when it has one. */
+  for (x= 0; x < bench->jobs; x+= count)
+  {
+    count= bench->jobs - x < batch ? bench->jobs - x : batch;
+
+    begin= benchmark_now();
+    ret= gearman_server_queue_add(server, bench->record + x, count);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "%s\n", gearman_error(gearman));
+      exit(1);
+    }
+    _result_add(&(result[QUEUE_BENCH_OP_ADD]), begin, count);
+
+    if (gearman->queue_flush_fn != NULL)
+    {
+      begin= benchmark_now();
+      ret= (*(gearman->queue_flush_fn))(gearman,
+                                        (void *)gearman->queue_fn_arg);
+      if (ret != GEARMAN_SUCCESS)
+      {
+        fprintf(stderr, "%s\n", gearman_error(gearman));
+        exit(1);
+      }
+      _result_add(&(result[QUEUE_BENCH_OP_FLUSH]), begin, count);
+    }
+  }
+
+  if (gearman->queue_replay_fn != NULL)
+  {
+    begin= benchmark_now();
+    ret= (*(gearman->queue_replay_fn))(gearman, (void *)gearman->queue_fn_arg,
+                                       _replay_count, &replayed);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "%s\n", gearman_error(gearman));
+      exit(1);
+    }
+    _result_add(&(result[QUEUE_BENCH_OP_REPLAY]), begin, replayed);
+  }
+
+  for (x= 0; x < bench->jobs; x+= count)
+  {
+    count= bench->jobs - x < batch ? bench->jobs - x : batch;
+
+    begin= benchmark_now();
+    ret= gearman_server_queue_done(server, bench->record + x, count);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "%s\n", gearman_error(gearman));
+      exit(1);
+    }
+    _result_add(&(result[QUEUE_BENCH_OP_DONE]), begin, count);
+  }
+
+  _queue_free(bench, server);
+
+  for (x= 0; x < QUEUE_BENCH_OP_MAX; x++)
+  {
+    if (result[x].calls > 0)
+      _report(bench, "raw", x, batch, size, &(result[x]));
+  }
+}
+
+static void _run_server(queue_bench_st *bench, size_t size)
+{
+  queue_bench_result_st result[QUEUE_BENCH_OP_MAX];
+  gearman_server_st *server;
+  gearman_server_function_st *function;
+  gearman_return_t ret;
+  char unique[QUEUE_BENCH_UNIQUE_SIZE];
+  size_t unique_size;
+  uint64_t begin;
+  uint32_t replayed;
+  void *data;
+  uint32_t x;
+
+  memset(result, 0, sizeof(result));
+  server= _queue_create(bench);
+
+  /* Jobs are added the way a background job is submitted, which stores and
+     flushes each one on its own. */
+  bench->test++;
+  for (x= 0; x < bench->jobs; x++)
+  {
+    unique_size= (size_t)snprintf(unique, QUEUE_BENCH_UNIQUE_SIZE,
+                                  "%u-%u-%u", (uint32_t)getpid(), bench->test,
+                                  x);
+
+    /* The server owns the payload of a job it takes. */
+    data= NULL;
+    if (size > 0)
+    {
+      data= malloc(size);
+      if (data == NULL)
+      {
+        fprintf(stderr, "Memory allocation failure on malloc\n");
+        exit(1);
+      }
+
+      memcpy(data, bench->blob, size);
+    }
+
+    begin= benchmark_now();
+    (void)gearman_server_job_add(server, bench->function,
+                                 strlen(bench->function), unique, unique_size,
+                                 data, size, GEARMAN_JOB_PRIORITY_NORMAL, 0,
+                                 NULL, &ret);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "%s\n", gearman_error(server->gearman));
+      exit(1);
+    }
+    _result_add(&(result[QUEUE_BENCH_OP_ADD]), begin, 1);
+  }
+
+  /* A new server replays the jobs, the same as after a restart. */
+  _queue_free(bench, server);
+  server= _queue_create(bench);
+
+  begin= benchmark_now();
+  ret= gearman_server_queue_replay(server);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "%s\n", gearman_error(server->gearman));
+    exit(1);
+  }
+
+  function= gearman_server_function_find(server, bench->function,
+                                         strlen(bench->function));
+  replayed= function == NULL ? 0 : function->job_total;
+  if (server->gearman->queue_replay_fn != NULL)
+    _result_add(&(result[QUEUE_BENCH_OP_REPLAY]), begin, replayed);
+
+  /* Purging the replayed jobs removes them from the queue in batches. */
+  if (function != NULL)
+  {
+    begin= benchmark_now();
+    _result_add(&(result[QUEUE_BENCH_OP_DONE]), begin,
+                gearman_server_job_purge(function, NULL, 0,
+                                         GEARMAN_JOB_PRIORITY_MAX, false));
+  }
+
+  _queue_free(bench, server);
+
+  for (x= 0; x < QUEUE_BENCH_OP_MAX; x++)
+  {
+    if (result[x].calls > 0)
+      _report(bench, "server", x, 1, size, &(result[x]));
+  }
+}
+
+static gearman_return_t _replay_count(gearman_st *gearman, void *fn_arg,
+                                      const void *unique, size_t unique_size,
+                                      const void *function_name,
+                                      size_t function_name_size,
+                                      const void *data, size_t data_size,
+                                      gearman_job_priority_t priority,
+                                      int64_t when)
+{
+  (void)gearman;
+  (void)unique;
+  (void)unique_size;
+  (void)function_name;
+  (void)function_name_size;
+  (void)data_size;
+  (void)priority;
+  (void)when;
+
+  /* Replayed payloads are handed over to the add function. */
+  if (data != NULL)
+    free((void *)data);
+
+  (*(uint64_t *)fn_arg)++;
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _result_add(queue_bench_result_st *result, uint64_t begin,
+                        uint64_t jobs)
+{
+  uint64_t usec= benchmark_now() - begin;
+
+  result->jobs+= jobs;
+  result->calls++;
+  result->usec+= usec;
+  gearman_histogram_add(&(result->latency), usec);
+}
+
+static void _report(queue_bench_st *bench, const char *mode, uint32_t op,
+                    uint32_t batch, size_t size,
+                    queue_bench_result_st *result)
+{
+  const gearman_histogram_st *latency= &(result->latency);
+  uint64_t rate= 0;
+
+  if (result->usec > 0)
+    rate= (result->jobs * 1000000) / result->usec;
+
+  switch (bench->format)
+  {
+  case GEARMAN_BENCHMARK_FORMAT_CSV:
+    printf("%s,%s,%u,%zu,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64
+           ",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
+           mode, _op_name[op], batch, size, result->jobs, result->calls,
+           result->usec, rate, gearman_histogram_min(latency),
+           gearman_histogram_mean(latency),
+           gearman_histogram_percentile(latency, 50),
+           gearman_histogram_percentile(latency, 99),
+           gearman_histogram_percentile(latency, 99.9),
+           gearman_histogram_max(latency));
+    break;
+
+  case GEARMAN_BENCHMARK_FORMAT_JSON:
+    printf("%s\n  {\"mode\": \"%s\", \"op\": \"%s\", \"batch\": %u, "
+           "\"size\": %zu,\n   \"jobs\": %"PRIu64", \"calls\": %"PRIu64
+           ", \"usec\": %"PRIu64", \"jobs_per_sec\": %"PRIu64",\n"
+           "   \"latency_us\": {\"min\": %"PRIu64", \"mean\": %"PRIu64
+           ", \"p50\": %"PRIu64", \"p99\": %"PRIu64", \"p99.9\": %"PRIu64
+           ", \"max\": %"PRIu64"}}", bench->first ? "" : ",",
+           mode, _op_name[op], batch, size, result->jobs, result->calls,
+           result->usec, rate, gearman_histogram_min(latency),
+           gearman_histogram_mean(latency),
+           gearman_histogram_percentile(latency, 50),
+           gearman_histogram_percentile(latency, 99),
+           gearman_histogram_percentile(latency, 99.9),
+           gearman_histogram_max(latency));
+    break;
+
+  case GEARMAN_BENCHMARK_FORMAT_TEXT:
+  default:
+    printf("[%s %-6s Batch: %u, Size: %zu] %"PRIu64" jobs in %"PRIu64
+           " calls, %8"PRIu64" jobs/s\n"
+           "  Latency (us): min %"PRIu64", mean %"PRIu64", p50 %"PRIu64
+           ", p99 %"PRIu64", p99.9 %"PRIu64", max %"PRIu64"\n",
+           mode, _op_name[op], batch, size, result->jobs, result->calls,
+           rate, gearman_histogram_min(latency),
+           gearman_histogram_mean(latency),
+           gearman_histogram_percentile(latency, 50),
+           gearman_histogram_percentile(latency, 99),
+           gearman_histogram_percentile(latency, 99.9),
+           gearman_histogram_max(latency));
+    break;
+  }
+
+  bench->first= false;
+  fflush(stdout);
+}
+
+static void _usage(gearman_conf_st *conf, char *name)
+{
+  printf("\nusage: %s --queue-type=QUEUE [OPTIONS]\n", name);
+  printf("Times the functions of a persistent queue module without a network "
+         "in the way.\n");
+  gearman_conf_usage(conf);
+}
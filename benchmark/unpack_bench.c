@@ -0,0 +1,168 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Packet unpack microbenchmark
+ */
+
+#include "benchmark.h"
+
+#define UNPACK_BENCH_DEFAULT_COUNT 1000000
+#define UNPACK_BENCH_DEFAULT_ARG_SIZE 16
+
+static uint64_t unpack_run(gearman_st *gearman, const uint8_t *buffer,
+                           size_t buffer_size, size_t split, uint32_t count);
+
+static void usage(char *name);
+
+int main(int argc, char *argv[])
+{
+  int c;
+  uint32_t count= UNPACK_BENCH_DEFAULT_COUNT;
+  size_t arg_size= UNPACK_BENCH_DEFAULT_ARG_SIZE;
+  char *arg;
+  uint8_t *buffer;
+  size_t buffer_size;
+  uint64_t usec;
+  gearman_return_t ret;
+  gearman_st gearman;
+  gearman_packet_st packet;
+
+  while ((c = getopt(argc, argv, "a:c:")) != -1)
+  {
+    switch(c)
+    {
+    case 'a':
+      arg_size= (size_t)atoi(optarg);
+      break;
+
+    case 'c':
+      count= (uint32_t)atoi(optarg);
+      break;
+
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (gearman_create(&gearman) == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on gearman creation\n");
+    exit(1);
+  }
+
+  gearman_set_options(&gearman, GEARMAN_DONT_TRACK_PACKETS, 1);
+
+  arg= malloc(arg_size + 1);
+  if (arg == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on argument\n");
+    exit(1);
+  }
+
+  memset(arg, 'x', arg_size);
+  arg[arg_size]= 0;
+
+  /* SUBMIT_JOB_SCHED has the most arguments of any command. */
+  ret= gearman_packet_add(&gearman, &packet, GEARMAN_MAGIC_REQUEST,
+                          GEARMAN_COMMAND_SUBMIT_JOB_SCHED,
+                          arg, arg_size + 1, arg, arg_size + 1,
+                          arg, arg_size + 1, arg, arg_size + 1,
+                          arg, arg_size + 1, arg, arg_size + 1,
+                          arg, arg_size + 1, arg, arg_size, NULL);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "%s\n", gearman_error(&gearman));
+    exit(1);
+  }
+
+  buffer_size= packet.args_size + packet.data_size;
+  buffer= malloc(buffer_size);
+  if (buffer == NULL)
+  {
+    fprintf(stderr, "Memory allocation failure on buffer\n");
+    exit(1);
+  }
+
+  memcpy(buffer, packet.args, packet.args_size);
+  memcpy(buffer + packet.args_size, packet.data, packet.data_size);
+  gearman_packet_free(&packet);
+
+  printf("%u packets of %zu bytes with %zu byte arguments\n", count,
+         buffer_size, arg_size);
+
+  /* Everything is received at once, so arguments are parsed in one pass. */
+  usec= unpack_run(&gearman, buffer, buffer_size, buffer_size, count);
+  printf("complete: %8"PRIu64" usec, %6.1f nsec/packet\n", usec,
+         ((double)usec * 1000) / count);
+
+  /* Only the header is there on the first call, so the arguments are added
+     one at a time as they arrive. */
+  usec= unpack_run(&gearman, buffer, buffer_size, GEARMAN_PACKET_HEADER_SIZE,
+                   count);
+  printf("split:    %8"PRIu64" usec, %6.1f nsec/packet\n", usec,
+         ((double)usec * 1000) / count);
+
+  free(buffer);
+  free(arg);
+  gearman_free(&gearman);
+
+  return 0;
+}
+
+static uint64_t unpack_run(gearman_st *gearman, const uint8_t *buffer,
+                           size_t buffer_size, size_t split, uint32_t count)
+{
+  struct timeval begin;
+  struct timeval end;
+  gearman_packet_st packet;
+  gearman_return_t ret;
+  size_t used;
+  uint32_t x;
+
+  gettimeofday(&begin, NULL);
+
+  for (x= 0; x < count; x++)
+  {
+    if (gearman_packet_create(gearman, &packet) == NULL)
+    {
+      fprintf(stderr, "%s\n", gearman_error(gearman));
+      exit(1);
+    }
+
+    used= gearman_packet_unpack(&packet, NULL, buffer, split, &ret);
+    if (ret == GEARMAN_IO_WAIT)
+    {
+      used+= gearman_packet_unpack(&packet, NULL, buffer + used,
+                                   buffer_size - used, &ret);
+    }
+
+    if (ret != GEARMAN_SUCCESS || packet.argc != 7)
+    {
+      fprintf(stderr, "Failed to unpack packet:%d\n", ret);
+      exit(1);
+    }
+
+    gearman_packet_free(&packet);
+  }
+
+  gettimeofday(&end, NULL);
+
+  return (((uint64_t)(end.tv_sec) * 1000000) + (uint64_t)(end.tv_usec)) -
+         (((uint64_t)(begin.tv_sec) * 1000000) + (uint64_t)(begin.tv_usec));
+}
+
+static void usage(char *name)
+{
+  printf("\nusage: %s\n"
+         "\t[-a <arg_size>] [-c <count>]\n\n", name);
+  printf("\t-a <arg_size> - size of each packet argument\n");
+  printf("\t-c <count>    - number of packets to unpack\n");
+}
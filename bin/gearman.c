@@ -12,11 +12,15 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
 #include <sys/wait.h>
 
 #include <libgearman/gearman.h>
@@ -30,10 +34,85 @@
   exit(1); \
 }
 
+typedef struct gearman_args gearman_args_st;
+typedef struct gearman_load gearman_load_st;
+typedef struct gearman_load_con gearman_load_con_st;
+
 /**
- * Data structure for arguments and state.
+ * Data structure for one input sent to every function, kept until all of its
+ * tasks are done since the tasks send the workload from it as it is.
+ */
+typedef struct
+{
+  gearman_args_st *args;
+  const char *workload;
+  size_t workload_size;
+  char *buffer;
+  uint32_t task_count;
+} gearman_submit_st;
+
+/**
+ * Data structure for one function in a load spec.
  */
 typedef struct
+{
+  char *function;
+  uint32_t weight;
+  bool background;
+  gearman_job_priority_t priority;
+  size_t size;
+} gearman_load_entry_st;
+
+/**
+ * Data structure for one task kept in flight on a load connection, reused
+ * for the next job once the current one is done.
+ */
+typedef struct
+{
+  gearman_load_con_st *con;
+  gearman_load_entry_st *entry;
+  uint64_t start;
+} gearman_load_task_st;
+
+/**
+ * Data structure for one load connection, run in its own thread. The counts
+ * and latencies are for jobs done since the last report, and are taken under
+ * the lock.
+ */
+struct gearman_load_con
+{
+  gearman_load_st *load;
+  uint32_t running;
+  unsigned int seed;
+  uint64_t jobs;
+  uint64_t fail_count;
+  gearman_load_task_st *task_list;
+  gearman_client_st client;
+  gearman_histogram_st latency;
+  pthread_t id;
+  pthread_mutex_t lock;
+};
+
+/**
+ * Data structure for load mode.
+ */
+struct gearman_load
+{
+  gearman_args_st *args;
+  char *spec;
+  gearman_load_entry_st *entry_list;
+  uint32_t entry_count;
+  uint32_t weight_total;
+  char *workload;
+  volatile uint32_t con_running;
+  volatile uint64_t sent;
+  gearman_load_con_st *con_list;
+};
+
+/**
+ * Data structure for arguments and state.
+ */
+struct gearman_args
 {
   char **function;
   uint32_t function_count;
@@ -47,11 +126,23 @@ typedef struct
   bool suppress_input;
   bool prefix;
   bool background;
+  bool persist;
   gearman_job_priority_t priority;
+  uint32_t jobs;
+  char *load;
+  uint32_t connections;
+  uint32_t seconds;
   char **argv;
-  gearman_task_st *task;
+  gearman_client_st *client;
+  gearman_submit_st *submit;
+  uint32_t running;
+  uint32_t next_arg;
+  bool input_done;
+  pid_t child_pid;
+  int child_fd;
+  FILE *child_out;
   char return_value;
-} gearman_args_st;
+};
 
 /**
  * Function to run in client mode.
@@ -59,16 +150,43 @@ typedef struct
 static void _client(gearman_args_st *args);
 
 /**
- * Run client jobs.
+ * Start jobs for the next inputs until the number given with -j are running,
+ * or the input runs out.
+ */
+static void _client_fill(gearman_args_st *args);
+
+/**
+ * Get the next input to send, one line or argument at a time or all of
+ * standard input at once.
+ */
+static bool _client_next(gearman_args_st *args, gearman_submit_st *submit);
+
+/**
+ * Add a task for each function to send an input to.
+ */
+static void _client_run(gearman_args_st *args, gearman_submit_st *submit);
+
+/**
+ * Count a finished task, and start the next input once all tasks for this
+ * one are done.
  */
-static void _client_run(gearman_client_st *client, gearman_args_st *args,
-                        const void *workload, size_t workload_size);
+static void _client_done(gearman_submit_st *submit);
 
 /**
- * Client data/complete callback function.
+ * Client created callback function.
+ */
+static gearman_return_t _client_created(gearman_task_st *task);
+
+/**
+ * Client data callback function.
  */
 static gearman_return_t _client_data(gearman_task_st *task);
 
+/**
+ * Client complete callback function.
+ */
+static gearman_return_t _client_complete(gearman_task_st *task);
+
 /**
  * Client warning/exception callback function.
  */
@@ -83,28 +201,133 @@ static gearman_return_t _client_status(gearman_task_st *task);
  */
 static gearman_return_t _client_fail(gearman_task_st *task);
 
+/**
+ * Function to run in load mode.
+ */
+static void _load(gearman_args_st *args);
+
+/**
+ * Parse a load spec into the functions to send jobs to.
+ */
+static void _load_parse(gearman_load_st *load, const char *spec);
+
+/**
+ * Run one load connection.
+ */
+static void *_load_thread(void *data);
+
+/**
+ * Send the next job on a load task, unless load mode is stopping.
+ */
+static bool _load_add(gearman_load_task_st *task);
+
+/**
+ * Record a finished job and send the next one on the same task.
+ */
+static void _load_done(gearman_load_task_st *task, bool failed);
+
+/**
+ * Take the counts and latencies from a load connection since the last time.
+ */
+static void _load_collect(gearman_load_con_st *con,
+                          gearman_histogram_st *latency, uint64_t *jobs,
+                          uint64_t *fail_count);
+
+/**
+ * Print one line of load results.
+ */
+static void _load_report(uint64_t elapsed, uint64_t usec, uint64_t jobs,
+                         uint64_t fail_count,
+                         const gearman_histogram_st *latency);
+
+/**
+ * Load created callback function.
+ */
+static gearman_return_t _load_created(gearman_task_st *task);
+
+/**
+ * Load complete callback function.
+ */
+static gearman_return_t _load_complete(gearman_task_st *task);
+
+/**
+ * Load fail callback function.
+ */
+static gearman_return_t _load_fail(gearman_task_st *task);
+
+/**
+ * Interrupt handler for load mode, which stops sending new jobs.
+ */
+static void _load_signal(int signal_number);
+
+/**
+ * Get the current time in microseconds.
+ */
+static uint64_t _load_now(void);
+
+/**
+ * Add a task for one job, in the background or not and with a priority.
+ */
+static gearman_return_t _add_task(gearman_client_st *client, void *context,
+                                  const char *function, const char *unique,
+                                  const void *workload, size_t workload_size,
+                                  bool background,
+                                  gearman_job_priority_t priority);
+
 /**
  * Function to run in worker mode.
  */
 static void _worker(gearman_args_st *args);
 
+/**
+ * Run jobs in one worker process.
+ */
+static void _worker_run(gearman_args_st *args);
+
 /**
  * Callback function when worker gets a job.
  */
 static void *_worker_cb(gearman_job_st *job, void *cb_arg, size_t *result_size,
                         gearman_return_t *ret_ptr);
 
+/**
+ * Run a job through the command kept running with -k.
+ */
+static void *_worker_persist(gearman_job_st *job, gearman_args_st *args,
+                             size_t *result_size, gearman_return_t *ret_ptr);
+
+/**
+ * Start the command kept running with -k.
+ */
+static void _worker_start(gearman_args_st *args);
+
+/**
+ * Stop the command kept running with -k after it exited or broke framing.
+ */
+static void _worker_stop(gearman_args_st *args);
+
 /**
  * Read workload chunk from a file descriptor and put into allocated memory.
  */
 static void _read_workload(int fd, char **workload, size_t *workload_offset,
                            size_t *workload_size);
 
+/**
+ * Read a whole line, however long, into allocated memory.
+ */
+static bool _read_line(FILE *f, char **line, size_t *line_offset,
+                       size_t *line_size);
+
 /**
  * Print usage information.
  */
 static void usage(char *name);
 
+/**
+ * Set once load mode should stop sending new jobs.
+ */
+static volatile sig_atomic_t _load_stop= 0;
+
 int main(int argc, char *argv[])
 {
   int c;
@@ -118,7 +341,7 @@ int main(int argc, char *argv[])
   if (args.function == NULL)
     GEARMAN_ERROR("malloc:%d", errno)
 
-  while ((c = getopt(argc, argv, "bc:f:h:HILnNp:Psu:w")) != -1)
+  while ((c = getopt(argc, argv, "bc:C:f:h:HIj:kl:LnNp:Pst:u:w")) != -1)
   {
     switch(c)
     {
@@ -130,6 +353,10 @@ int main(int argc, char *argv[])
       args.count= (uint32_t)atoi(optarg);
       break;
 
+    case 'C':
+      args.connections= (uint32_t)atoi(optarg);
+      break;
+
     case 'f':
       args.function[args.function_count]= optarg;
       args.function_count++;
@@ -143,6 +370,18 @@ int main(int argc, char *argv[])
       args.priority= GEARMAN_JOB_PRIORITY_HIGH;
       break;
 
+    case 'j':
+      args.jobs= (uint32_t)atoi(optarg);
+      break;
+
+    case 'k':
+      args.persist= true;
+      break;
+
+    case 'l':
+      args.load= optarg;
+      break;
+
     case 'L':
       args.priority= GEARMAN_JOB_PRIORITY_LOW;
       break;
@@ -168,6 +407,10 @@ int main(int argc, char *argv[])
       args.suppress_input= true;
       break;
 
+    case 't':
+      args.seconds= (uint32_t)atoi(optarg);
+      break;
+
     case 'u':
       args.unique= optarg;
       break;
@@ -190,6 +433,8 @@ int main(int argc, char *argv[])
 
   if (args.worker)
     _worker(&args);
+  else if (args.load != NULL)
+    _load(&args);
   else
     _client(&args);
 
@@ -200,9 +445,6 @@ void _client(gearman_args_st *args)
 {
   gearman_client_st client;
   gearman_return_t ret;
-  char *workload= NULL;
-  size_t workload_size= 0;
-  size_t workload_offset= 0;
   uint32_t x;
 
   if (gearman_client_create(&client) == NULL)
@@ -212,145 +454,192 @@ void _client(gearman_args_st *args)
   if (ret != GEARMAN_SUCCESS)
     GEARMAN_ERROR("gearman_client_add_server:%s", gearman_client_error(&client))
 
+  gearman_client_set_created_fn(&client, _client_created);
   gearman_client_set_data_fn(&client, _client_data);
   gearman_client_set_warning_fn(&client, _client_warning);
   gearman_client_set_status_fn(&client, _client_status);
-  gearman_client_set_complete_fn(&client, _client_data);
+  gearman_client_set_complete_fn(&client, _client_complete);
   gearman_client_set_exception_fn(&client, _client_warning);
   gearman_client_set_fail_fn(&client, _client_fail);
 
-  args->task= malloc(sizeof(gearman_task_st) * args->function_count);
-  if (args->task == NULL)
-    GEARMAN_ERROR("malloc:%d", errno)
+  /* Tasks are started from the callbacks as others finish, so let the client
+     free finished ones and reuse their memory. */
+  gearman_client_set_options(&client, GEARMAN_CLIENT_FREE_TASKS, 1);
 
-  if (args->argv[0] == NULL)
+  if (args->jobs == 0)
+    args->jobs= 1;
+
+  ret= gearman_client_task_reserve(&client, args->jobs * args->function_count);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR("gearman_client_task_reserve:%s",
+                  gearman_client_error(&client))
+  }
+
+  args->submit= calloc(args->jobs, sizeof(gearman_submit_st));
+  if (args->submit == NULL)
+    GEARMAN_ERROR("calloc:%d", errno)
+
+  for (x= 0; x < args->jobs; x++)
+    args->submit[x].args= args;
+
+  args->client= &client;
+
+  _client_fill(args);
+  while (args->running > 0)
+  {
+    ret= gearman_client_run_tasks(&client);
+    if (ret != GEARMAN_SUCCESS)
+      GEARMAN_ERROR("gearman_client_run_tasks:%s", gearman_client_error(&client))
+  }
+
+  gearman_client_free(&client);
+
+  for (x= 0; x < args->jobs; x++)
+  {
+    if (args->submit[x].buffer != NULL)
+      free(args->submit[x].buffer);
+  }
+
+  free(args->submit);
+}
+
+static void _client_fill(gearman_args_st *args)
+{
+  gearman_submit_st *submit;
+  uint32_t x;
+
+  while (args->running < args->jobs && !args->input_done)
   {
-    if (args->suppress_input)
-      _client_run(&client, args, NULL, 0);
-    else if (args->job_per_newline)
+    /* There is a free one, since fewer are running than there are. */
+    for (x= 0; args->submit[x].task_count > 0; x++);
+    submit= &(args->submit[x]);
+
+    if (!_client_next(args, submit))
     {
-      workload= malloc(GEARMAN_INITIAL_WORKLOAD_SIZE);
-      if (workload == NULL)
-        GEARMAN_ERROR("malloc:%d", errno)
+      args->input_done= true;
+      break;
+    }
 
-      while (1)
-      {
-        if (fgets(workload, GEARMAN_INITIAL_WORKLOAD_SIZE, stdin) == NULL)
-          break;
+    _client_run(args, submit);
+  }
+}
 
-        if (args->strip_newline)
-          _client_run(&client, args, workload, strlen(workload) - 1);
-        else
-          _client_run(&client, args, workload, strlen(workload));
-      }
+static bool _client_next(gearman_args_st *args, gearman_submit_st *submit)
+{
+  size_t buffer_offset= 0;
+  size_t buffer_size= 0;
+
+  if (args->argv[0] != NULL)
+  {
+    if (args->argv[args->next_arg] == NULL)
+      return false;
+
+    submit->workload= args->argv[args->next_arg];
+    submit->workload_size= strlen(args->argv[args->next_arg]);
+    args->next_arg++;
+    return true;
+  }
+
+  if (args->job_per_newline)
+  {
+    if (submit->buffer == NULL)
+    {
+      submit->buffer= malloc(GEARMAN_INITIAL_WORKLOAD_SIZE);
+      if (submit->buffer == NULL)
+        GEARMAN_ERROR("malloc:%d", errno)
     }
-    else
+
+    if (fgets(submit->buffer, GEARMAN_INITIAL_WORKLOAD_SIZE, stdin) == NULL)
+      return false;
+
+    submit->workload= submit->buffer;
+    submit->workload_size= strlen(submit->buffer);
+    if (args->strip_newline && submit->workload_size > 0 &&
+        submit->buffer[submit->workload_size - 1] == '\n')
     {
-      _read_workload(0, &workload, &workload_offset, &workload_size);
-      _client_run(&client, args, workload, workload_offset);
+      submit->workload_size--;
     }
+
+    return true;
+  }
+
+  /* The rest only make one job. */
+  if (args->next_arg > 0)
+    return false;
+
+  args->next_arg++;
+
+  if (args->suppress_input)
+  {
+    submit->workload= NULL;
+    submit->workload_size= 0;
   }
   else
   {
-    for (x= 0; args->argv[x] != NULL; x++)
-      _client_run(&client, args, args->argv[x], strlen(args->argv[x]));
+    _read_workload(0, &(submit->buffer), &buffer_offset, &buffer_size);
+    submit->workload= submit->buffer;
+    submit->workload_size= buffer_offset;
   }
 
-  gearman_client_free(&client);
-
-  if (workload != NULL)
-    free(workload);
+  return true;
 }
 
-void _client_run(gearman_client_st *client, gearman_args_st *args,
-                 const void *workload, size_t workload_size)
+void _client_run(gearman_args_st *args, gearman_submit_st *submit)
 {
   gearman_return_t ret;
   uint32_t x;
 
   for (x= 0; x < args->function_count; x++)
   {
-    /* This is a bit nasty, but all we have currently is multiple function
-       calls. */
-    if (args->background)
+    ret= _add_task(args->client, submit, args->function[x], args->unique,
+                   submit->workload, submit->workload_size, args->background,
+                   args->priority);
+    if (ret != GEARMAN_SUCCESS)
     {
-      switch (args->priority)
-      {
-      case GEARMAN_JOB_PRIORITY_HIGH:
-        (void)gearman_client_add_task_high_background(client, &(args->task[x]),
-                                                      args, args->function[x],
-                                                      args->unique, workload,
-                                                      workload_size, &ret);
-        break;
+      GEARMAN_ERROR("gearman_client_add_task:%s",
+                    gearman_client_error(args->client))
+    }
 
-      case GEARMAN_JOB_PRIORITY_NORMAL:
-        (void)gearman_client_add_task_background(client, &(args->task[x]), args,
-                                                 args->function[x],
-                                                 args->unique, workload,
-                                                 workload_size, &ret);
-        break;
+    submit->task_count++;
+  }
 
-      case GEARMAN_JOB_PRIORITY_LOW:
-        (void)gearman_client_add_task_low_background(client, &(args->task[x]),
-                                                     args, args->function[x],
-                                                     args->unique, workload,
-                                                     workload_size, &ret);
-        break;
+  if (submit->task_count > 0)
+    args->running++;
+}
 
-      case GEARMAN_JOB_PRIORITY_MAX:
-      default:
-        /* This should never happen. */
-        ret= GEARMAN_UNKNOWN_STATE;
-        break;
-      }
-    }
-    else
-    {
-      switch (args->priority)
-      {
-      case GEARMAN_JOB_PRIORITY_HIGH:
-        (void)gearman_client_add_task_high(client, &(args->task[x]), args,
-                                           args->function[x], args->unique,
-                                           workload, workload_size, &ret);
-        break;
+static void _client_done(gearman_submit_st *submit)
+{
+  gearman_args_st *args= submit->args;
 
-      case GEARMAN_JOB_PRIORITY_NORMAL:
-        (void)gearman_client_add_task(client, &(args->task[x]), args,
-                                      args->function[x], args->unique, workload,
-                                      workload_size, &ret);
-        break;
+  submit->task_count--;
+  if (submit->task_count > 0)
+    return;
 
-      case GEARMAN_JOB_PRIORITY_LOW:
-        (void)gearman_client_add_task_low(client, &(args->task[x]), args,
-                                          args->function[x], args->unique,
-                                          workload, workload_size, &ret);
-        break;
+  /* The client picks up tasks added here before run_tasks returns, so the
+     next input goes out without waiting for the rest to finish. */
+  args->running--;
+  _client_fill(args);
+}
 
-      case GEARMAN_JOB_PRIORITY_MAX:
-      default:
-        /* This should never happen. */
-        ret= GEARMAN_UNKNOWN_STATE;
-        break;
-      }
-    }
-    if (ret != GEARMAN_SUCCESS)
-      GEARMAN_ERROR("gearman_client_add_task:%s", gearman_client_error(client))
-  }
+static gearman_return_t _client_created(gearman_task_st *task)
+{
+  gearman_submit_st *submit;
 
-  ret= gearman_client_run_tasks(client);
-  if (ret != GEARMAN_SUCCESS)
-    GEARMAN_ERROR("gearman_client_run_tasks:%s", gearman_client_error(client))
+  /* Background jobs are done once the job server has them. */
+  submit= gearman_task_fn_arg(task);
+  if (submit->args->background)
+    _client_done(submit);
 
-  for (x= 0; x < args->function_count; x++)
-    gearman_task_free(&(args->task[x]));
+  return GEARMAN_SUCCESS;
 }
 
 static gearman_return_t _client_data(gearman_task_st *task)
 {
-  gearman_args_st *args;
+  gearman_submit_st *submit;
 
-  args= gearman_task_fn_arg(task);
-  if (args->prefix)
+  submit= gearman_task_fn_arg(task);
+  if (submit->args->prefix)
   {
     fprintf(stdout, "%s: ", gearman_task_function(task));
     fflush(stdout);
@@ -362,12 +651,22 @@ static gearman_return_t _client_data(gearman_task_st *task)
   return GEARMAN_SUCCESS;
 }
 
+static gearman_return_t _client_complete(gearman_task_st *task)
+{
+  gearman_return_t ret;
+
+  ret= _client_data(task);
+  _client_done(gearman_task_fn_arg(task));
+
+  return ret;
+}
+
 static gearman_return_t _client_warning(gearman_task_st *task)
 {
-  gearman_args_st *args;
+  gearman_submit_st *submit;
 
-  args= gearman_task_fn_arg(task);
-  if (args->prefix)
+  submit= gearman_task_fn_arg(task);
+  if (submit->args->prefix)
   {
     fprintf(stderr, "%s: ", gearman_task_function(task));
     fflush(stderr);
@@ -381,10 +680,10 @@ static gearman_return_t _client_warning(gearman_task_st *task)
 
 static gearman_return_t _client_status(gearman_task_st *task)
 {
-  gearman_args_st *args;
+  gearman_submit_st *submit;
 
-  args= gearman_task_fn_arg(task);
-  if (args->prefix)
+  submit= gearman_task_fn_arg(task);
+  if (submit->args->prefix)
     printf("%s: ", gearman_task_function(task));
 
   printf("%u%% Complete\n", (gearman_task_numerator(task) * 100) /
@@ -395,24 +694,526 @@ static gearman_return_t _client_status(gearman_task_st *task)
 
 static gearman_return_t _client_fail(gearman_task_st *task)
 {
-  gearman_args_st *args;
+  gearman_submit_st *submit;
 
-  args= gearman_task_fn_arg(task);
-  if (args->prefix)
+  submit= gearman_task_fn_arg(task);
+  if (submit->args->prefix)
     fprintf(stderr, "%s: ", gearman_task_function(task));
 
   fprintf(stderr, "Job failed\n");
 
-  args->return_value= 1;
+  submit->args->return_value= 1;
+  _client_done(submit);
+  return GEARMAN_SUCCESS;
+}
+
+void _load(gearman_args_st *args)
+{
+  gearman_load_st load;
+  gearman_load_con_st *con;
+  gearman_histogram_st interval;
+  gearman_histogram_st total;
+  uint64_t total_jobs= 0;
+  uint64_t total_fail= 0;
+  uint64_t jobs;
+  uint64_t fail_count;
+  uint64_t start;
+  uint64_t last;
+  uint64_t now;
+  uint64_t usec;
+  size_t max_size= 0;
+  uint32_t x;
+
+  memset(&load, 0, sizeof(gearman_load_st));
+  load.args= args;
+  _load_parse(&load, args->load);
+
+  for (x= 0; x < load.entry_count; x++)
+  {
+    if (load.entry_list[x].size > max_size)
+      max_size= load.entry_list[x].size;
+  }
+
+  if (max_size > 0)
+  {
+    load.workload= malloc(max_size);
+    if (load.workload == NULL)
+      GEARMAN_ERROR("malloc:%d", errno)
+    memset(load.workload, 'x', max_size);
+  }
+
+  if (args->connections == 0)
+    args->connections= 1;
+
+  if (args->jobs == 0)
+    args->jobs= 1;
+
+  load.con_list= calloc(args->connections, sizeof(gearman_load_con_st));
+  if (load.con_list == NULL)
+    GEARMAN_ERROR("calloc:%d", errno)
+
+  if (signal(SIGINT, _load_signal) == SIG_ERR)
+    GEARMAN_ERROR("signal:%d", errno)
+
+  gearman_histogram_init(&total);
+  start= _load_now();
+  last= start;
+
+  for (x= 0; x < args->connections; x++)
+  {
+    con= &(load.con_list[x]);
+    con->load= &load;
+    con->seed= (unsigned int)(start + x);
+    gearman_histogram_init(&(con->latency));
+
+    if (pthread_mutex_init(&(con->lock), NULL) != 0)
+      GEARMAN_ERROR("pthread_mutex_init:%d", errno)
+
+    load.con_running++;
+    if (pthread_create(&(con->id), NULL, _load_thread, con) != 0)
+      GEARMAN_ERROR("pthread_create:%d", errno)
+  }
+
+  printf("[Connections: %u, Tasks: %u, Functions: %u]\n", args->connections,
+         args->jobs, load.entry_count);
+
+  while (!_load_stop && load.con_running > 0)
+  {
+    (void)sleep(1);
+
+    now= _load_now();
+    if (args->seconds > 0 && now - start >= (uint64_t)(args->seconds) * 1000000)
+      _load_stop= 1;
+
+    gearman_histogram_init(&interval);
+    jobs= 0;
+    fail_count= 0;
+
+    for (x= 0; x < args->connections; x++)
+      _load_collect(&(load.con_list[x]), &interval, &jobs, &fail_count);
+
+    gearman_histogram_merge(&total, &interval);
+    total_jobs+= jobs;
+    total_fail+= fail_count;
+
+    _load_report(now - start, now - last, jobs, fail_count, &interval);
+    last= now;
+  }
+
+  /* Tasks already sent are still waited for, so nothing is left behind on
+     the job server by stopping. */
+  _load_stop= 1;
+
+  for (x= 0; x < args->connections; x++)
+  {
+    con= &(load.con_list[x]);
+    (void)pthread_join(con->id, NULL);
+    _load_collect(con, &total, &total_jobs, &total_fail);
+    (void)pthread_mutex_destroy(&(con->lock));
+  }
+
+  usec= _load_now() - start;
+  printf("Total: ");
+  _load_report(usec, usec, total_jobs, total_fail, &total);
+
+  if (total_fail > 0)
+    args->return_value= 1;
+
+  free(load.con_list);
+  free(load.entry_list);
+  free(load.spec);
+  if (load.workload != NULL)
+    free(load.workload);
+}
+
+static void _load_parse(gearman_load_st *load, const char *spec)
+{
+  gearman_load_entry_st *entry;
+  char *save_entry;
+  char *save_field;
+  char *field;
+  char *end;
+  uint32_t count= 1;
+  const char *c;
+
+  for (c= spec; *c != 0; c++)
+  {
+    if (*c == ',')
+      count++;
+  }
+
+  load->entry_list= calloc(count, sizeof(gearman_load_entry_st));
+  load->spec= strdup(spec);
+  if (load->entry_list == NULL || load->spec == NULL)
+    GEARMAN_ERROR("malloc:%d", errno)
+
+  for (field= strtok_r(load->spec, ",", &save_entry); field != NULL;
+       field= strtok_r(NULL, ",", &save_entry))
+  {
+    entry= &(load->entry_list[load->entry_count]);
+    entry->weight= 1;
+    entry->background= load->args->background;
+    entry->priority= load->args->priority;
+
+    entry->function= strtok_r(field, ":", &save_field);
+    if (entry->function == NULL)
+      GEARMAN_ERROR("Missing function name in load spec:%s", spec)
+
+    field= strtok_r(NULL, ":", &save_field);
+    if (field != NULL)
+    {
+      entry->weight= (uint32_t)strtoul(field, &end, 10);
+      if (*end != 0)
+        GEARMAN_ERROR("Bad weight in load spec:%s", field)
+
+      field= strtok_r(NULL, ":", &save_field);
+    }
+
+    if (field != NULL)
+    {
+      for (c= field; *c != 0; c++)
+      {
+        switch (*c)
+        {
+        case 'b':
+          entry->background= true;
+          break;
+
+        case 'f':
+          entry->background= false;
+          break;
+
+        case 'h':
+          entry->priority= GEARMAN_JOB_PRIORITY_HIGH;
+          break;
+
+        case 'n':
+          entry->priority= GEARMAN_JOB_PRIORITY_NORMAL;
+          break;
+
+        case 'l':
+          entry->priority= GEARMAN_JOB_PRIORITY_LOW;
+          break;
+
+        default:
+          GEARMAN_ERROR("Bad mode in load spec:%s", field)
+        }
+      }
+
+      field= strtok_r(NULL, ":", &save_field);
+    }
+
+    if (field != NULL)
+    {
+      entry->size= (size_t)strtoull(field, &end, 10);
+      if (*end != 0 || strtok_r(NULL, ":", &save_field) != NULL)
+        GEARMAN_ERROR("Bad size in load spec:%s", field)
+    }
+
+    load->weight_total+= entry->weight;
+    load->entry_count++;
+  }
+
+  if (load->entry_count == 0 || load->weight_total == 0)
+    GEARMAN_ERROR("No functions to send jobs to in load spec:%s", spec)
+}
+
+static void *_load_thread(void *data)
+{
+  gearman_load_con_st *con= (gearman_load_con_st *)data;
+  gearman_args_st *args= con->load->args;
+  gearman_return_t ret;
+  uint32_t x;
+
+  if (gearman_client_create(&(con->client)) == NULL)
+    GEARMAN_ERROR("Memory allocation failure on client creation")
+
+  ret= gearman_client_add_server(&(con->client), args->host, args->port);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR("gearman_client_add_server:%s",
+                  gearman_client_error(&(con->client)))
+  }
+
+  gearman_client_set_created_fn(&(con->client), _load_created);
+  gearman_client_set_complete_fn(&(con->client), _load_complete);
+  gearman_client_set_fail_fn(&(con->client), _load_fail);
+  gearman_client_set_options(&(con->client), GEARMAN_CLIENT_FREE_TASKS, 1);
+
+  ret= gearman_client_task_reserve(&(con->client), args->jobs);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR("gearman_client_task_reserve:%s",
+                  gearman_client_error(&(con->client)))
+  }
+
+  con->task_list= calloc(args->jobs, sizeof(gearman_load_task_st));
+  if (con->task_list == NULL)
+    GEARMAN_ERROR("calloc:%d", errno)
+
+  for (x= 0; x < args->jobs; x++)
+  {
+    con->task_list[x].con= con;
+    if (_load_add(&(con->task_list[x])))
+      con->running++;
+  }
+
+  while (con->running > 0)
+  {
+    ret= gearman_client_run_tasks(&(con->client));
+    if (ret != GEARMAN_SUCCESS)
+    {
+      GEARMAN_ERROR("gearman_client_run_tasks:%s",
+                    gearman_client_error(&(con->client)))
+    }
+  }
+
+  gearman_client_free(&(con->client));
+  free(con->task_list);
+
+  (void)__sync_fetch_and_sub(&(con->load->con_running), 1);
+
+  return NULL;
+}
+
+static bool _load_add(gearman_load_task_st *task)
+{
+  gearman_load_con_st *con= task->con;
+  gearman_load_st *load= con->load;
+  uint32_t pick;
+  gearman_return_t ret;
+
+  if (_load_stop)
+    return false;
+
+  if (load->args->count > 0 &&
+      __sync_fetch_and_add(&(load->sent), 1) >= load->args->count)
+  {
+    return false;
+  }
+
+  pick= (uint32_t)rand_r(&(con->seed)) % load->weight_total;
+  for (task->entry= load->entry_list; pick >= task->entry->weight;
+       task->entry++)
+  {
+    pick-= task->entry->weight;
+  }
+
+  task->start= _load_now();
+
+  ret= _add_task(&(con->client), task, task->entry->function,
+                 load->args->unique, load->workload, task->entry->size,
+                 task->entry->background, task->entry->priority);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR("gearman_client_add_task:%s",
+                  gearman_client_error(&(con->client)))
+  }
+
+  return true;
+}
+
+static void _load_done(gearman_load_task_st *task, bool failed)
+{
+  gearman_load_con_st *con= task->con;
+  uint64_t latency= _load_now() - task->start;
+
+  (void)pthread_mutex_lock(&(con->lock));
+  gearman_histogram_add(&(con->latency), latency);
+  if (failed)
+    con->fail_count++;
+  else
+    con->jobs++;
+  (void)pthread_mutex_unlock(&(con->lock));
+
+  /* As with client mode, a task added here goes out before run_tasks
+     returns, so the connection always has the same number in flight. */
+  if (!_load_add(task))
+    con->running--;
+}
+
+static void _load_collect(gearman_load_con_st *con,
+                          gearman_histogram_st *latency, uint64_t *jobs,
+                          uint64_t *fail_count)
+{
+  (void)pthread_mutex_lock(&(con->lock));
+  gearman_histogram_merge(latency, &(con->latency));
+  gearman_histogram_init(&(con->latency));
+  *jobs+= con->jobs;
+  *fail_count+= con->fail_count;
+  con->jobs= 0;
+  con->fail_count= 0;
+  (void)pthread_mutex_unlock(&(con->lock));
+}
+
+static void _load_report(uint64_t elapsed, uint64_t usec, uint64_t jobs,
+                         uint64_t fail_count,
+                         const gearman_histogram_st *latency)
+{
+  uint64_t rate= 0;
+
+  if (usec > 0)
+    rate= (jobs * 1000000) / usec;
+
+  printf("[%5"PRIu64"s] %"PRIu64" jobs, %"PRIu64" failed, %6"PRIu64
+         " jobs/s, latency (us): p50 %"PRIu64", p99 %"PRIu64", p99.9 %"PRIu64
+         ", max %"PRIu64"\n", elapsed / 1000000, jobs, fail_count, rate,
+         gearman_histogram_percentile(latency, 50),
+         gearman_histogram_percentile(latency, 99),
+         gearman_histogram_percentile(latency, 99.9),
+         gearman_histogram_max(latency));
+  fflush(stdout);
+}
+
+static gearman_return_t _load_created(gearman_task_st *task)
+{
+  gearman_load_task_st *load_task= gearman_task_fn_arg(task);
+
+  /* Background jobs are done once the job server has them. */
+  if (load_task->entry->background)
+    _load_done(load_task, false);
+
   return GEARMAN_SUCCESS;
 }
 
+static gearman_return_t _load_complete(gearman_task_st *task)
+{
+  _load_done(gearman_task_fn_arg(task), false);
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _load_fail(gearman_task_st *task)
+{
+  _load_done(gearman_task_fn_arg(task), true);
+  return GEARMAN_SUCCESS;
+}
+
+static void _load_signal(int signal_number __attribute__ ((unused)))
+{
+  /* A second interrupt stops without waiting for tasks in flight. */
+  _load_stop= 1;
+  (void)signal(SIGINT, SIG_DFL);
+}
+
+static uint64_t _load_now(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return ((uint64_t)(now.tv_sec) * 1000000) + (uint64_t)(now.tv_usec);
+}
+
+static gearman_return_t _add_task(gearman_client_st *client, void *context,
+                                  const char *function, const char *unique,
+                                  const void *workload, size_t workload_size,
+                                  bool background,
+                                  gearman_job_priority_t priority)
+{
+  gearman_return_t ret;
+
+  /* This is a bit nasty, but all we have currently is multiple function
+     calls. */
+  if (background)
+  {
+    switch (priority)
+    {
+    case GEARMAN_JOB_PRIORITY_HIGH:
+      (void)gearman_client_add_task_high_background(client, NULL, context,
+                                                    function, unique, workload,
+                                                    workload_size, &ret);
+      break;
+
+    case GEARMAN_JOB_PRIORITY_NORMAL:
+      (void)gearman_client_add_task_background(client, NULL, context, function,
+                                               unique, workload, workload_size,
+                                               &ret);
+      break;
+
+    case GEARMAN_JOB_PRIORITY_LOW:
+      (void)gearman_client_add_task_low_background(client, NULL, context,
+                                                   function, unique, workload,
+                                                   workload_size, &ret);
+      break;
+
+    case GEARMAN_JOB_PRIORITY_MAX:
+    default:
+      /* This should never happen. */
+      ret= GEARMAN_UNKNOWN_STATE;
+      break;
+    }
+  }
+  else
+  {
+    switch (priority)
+    {
+    case GEARMAN_JOB_PRIORITY_HIGH:
+      (void)gearman_client_add_task_high(client, NULL, context, function,
+                                         unique, workload, workload_size,
+                                         &ret);
+      break;
+
+    case GEARMAN_JOB_PRIORITY_NORMAL:
+      (void)gearman_client_add_task(client, NULL, context, function, unique,
+                                    workload, workload_size, &ret);
+      break;
+
+    case GEARMAN_JOB_PRIORITY_LOW:
+      (void)gearman_client_add_task_low(client, NULL, context, function,
+                                        unique, workload, workload_size, &ret);
+      break;
+
+    case GEARMAN_JOB_PRIORITY_MAX:
+    default:
+      /* This should never happen. */
+      ret= GEARMAN_UNKNOWN_STATE;
+      break;
+    }
+  }
+
+  return ret;
+}
+
 void _worker(gearman_args_st *args)
+{
+  uint32_t x;
+  int status;
+
+  if (args->jobs <= 1)
+  {
+    _worker_run(args);
+    return;
+  }
+
+  /* Each process has its own connection, so jobs run side by side. */
+  for (x= 0; x < args->jobs; x++)
+  {
+    switch (fork())
+    {
+    case -1:
+      GEARMAN_ERROR("fork:%d", errno)
+
+    case 0:
+      _worker_run(args);
+      exit(args->return_value);
+
+    default:
+      break;
+    }
+  }
+
+  while (wait(&status) != -1)
+  {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      args->return_value= 1;
+  }
+}
+
+static void _worker_run(gearman_args_st *args)
 {
   gearman_worker_st worker;
   gearman_return_t ret;
   uint32_t x;
-  
+
   if (gearman_worker_create(&worker) == NULL)
     GEARMAN_ERROR("Memory allocation failure on client creation")
 
@@ -445,6 +1246,9 @@ void _worker(gearman_args_st *args)
     }
   }
 
+  if (args->child_pid != 0)
+    _worker_stop(args);
+
   gearman_worker_free(&worker);
 }
 
@@ -469,6 +1273,8 @@ static void *_worker_cb(gearman_job_st *job, void *cb_arg, size_t *result_size,
       GEARMAN_ERROR("write:%d", errno)
     }
   }
+  else if (args->persist)
+    return _worker_persist(job, args, result_size, ret_ptr);
   else
   {
     if (pipe(in_fds) == -1 || pipe(out_fds) == -1)
@@ -565,6 +1371,140 @@ static void *_worker_cb(gearman_job_st *job, void *cb_arg, size_t *result_size,
   return result;
 }
 
+static void *_worker_persist(gearman_job_st *job, gearman_args_st *args,
+                             size_t *result_size, gearman_return_t *ret_ptr)
+{
+  const char *workload= gearman_job_workload(job);
+  size_t workload_size= gearman_job_workload_size(job);
+  char header[32];
+  char *result= NULL;
+  size_t result_offset= 0;
+  size_t total_size= 0;
+  char *end;
+
+  if (args->child_pid == 0)
+    _worker_start(args);
+
+  /* With -n or -N each workload and result is one line, otherwise each one
+     comes after a line with its size. */
+  if (args->job_per_newline)
+  {
+    if ((workload_size > 0 &&
+         write(args->child_fd, workload, workload_size) == -1) ||
+        ((workload_size == 0 || workload[workload_size - 1] != '\n') &&
+         write(args->child_fd, "\n", 1) == -1) ||
+        !_read_line(args->child_out, &result, &result_offset, &total_size))
+    {
+      _worker_stop(args);
+      if (result != NULL)
+        free(result);
+      *ret_ptr= GEARMAN_WORK_FAIL;
+      return NULL;
+    }
+
+    if (args->strip_newline && result_offset > 0 &&
+        result[result_offset - 1] == '\n')
+    {
+      result_offset--;
+    }
+
+    *result_size= result_offset;
+    return result;
+  }
+
+  snprintf(header, sizeof(header), "%lu\n", (unsigned long)workload_size);
+  if (write(args->child_fd, header, strlen(header)) == -1 ||
+      (workload_size > 0 &&
+       write(args->child_fd, workload, workload_size) == -1) ||
+      fgets(header, sizeof(header), args->child_out) == NULL)
+  {
+    _worker_stop(args);
+    *ret_ptr= GEARMAN_WORK_FAIL;
+    return NULL;
+  }
+
+  total_size= (size_t)strtoul(header, &end, 10);
+  if (end == header || *end != '\n')
+  {
+    _worker_stop(args);
+    *ret_ptr= GEARMAN_WORK_FAIL;
+    return NULL;
+  }
+
+  if (total_size > 0)
+  {
+    result= malloc(total_size);
+    if (result == NULL)
+      GEARMAN_ERROR("malloc:%d", errno)
+
+    if (fread(result, 1, total_size, args->child_out) != total_size)
+    {
+      _worker_stop(args);
+      free(result);
+      *ret_ptr= GEARMAN_WORK_FAIL;
+      return NULL;
+    }
+  }
+
+  *result_size= total_size;
+  return result;
+}
+
+static void _worker_start(gearman_args_st *args)
+{
+  int in_fds[2];
+  int out_fds[2];
+
+  if (pipe(in_fds) == -1 || pipe(out_fds) == -1)
+    GEARMAN_ERROR("pipe:%d", errno)
+
+  args->child_pid= fork();
+  switch (args->child_pid)
+  {
+  case -1:
+    GEARMAN_ERROR("fork:%d", errno)
+
+  case 0:
+    if (dup2(in_fds[0], 0) == -1)
+      GEARMAN_ERROR("dup2:%d", errno)
+
+    close(in_fds[1]);
+
+    if (dup2(out_fds[1], 1) == -1)
+      GEARMAN_ERROR("dup2:%d", errno)
+
+    close(out_fds[0]);
+
+    execvp(args->argv[0], args->argv);
+    GEARMAN_ERROR("execvp:%d", errno)
+
+  default:
+    break;
+  }
+
+  close(in_fds[0]);
+  close(out_fds[1]);
+
+  args->child_fd= in_fds[1];
+  args->child_out= fdopen(out_fds[0], "r");
+  if (args->child_out == NULL)
+    GEARMAN_ERROR("fdopen:%d", errno)
+}
+
+static void _worker_stop(gearman_args_st *args)
+{
+  int status;
+
+  /* Closing its input lets a command that is still running finish. */
+  close(args->child_fd);
+  fclose(args->child_out);
+
+  if (waitpid(args->child_pid, &status, 0) == -1)
+    GEARMAN_ERROR("waitpid:%d", errno)
+
+  args->child_pid= 0;
+}
+
 void _read_workload(int fd, char **workload, size_t *workload_offset,
                     size_t *workload_size)
 {
@@ -595,15 +1535,46 @@ void _read_workload(int fd, char **workload, size_t *workload_offset,
   }
 }
 
+static bool _read_line(FILE *f, char **line, size_t *line_offset,
+                       size_t *line_size)
+{
+  while (1)
+  {
+    if (*line_size - *line_offset < 2)
+    {
+      if (*line_size == 0)
+        *line_size= GEARMAN_INITIAL_WORKLOAD_SIZE;
+      else
+        *line_size= *line_size * 2;
+
+      *line= realloc(*line, *line_size);
+      if (*line == NULL)
+        GEARMAN_ERROR("realloc:%d", errno)
+    }
+
+    if (fgets(*line + *line_offset, (int)(*line_size - *line_offset),
+              f) == NULL)
+    {
+      return *line_offset > 0;
+    }
+
+    *line_offset+= strlen(*line + *line_offset);
+    if ((*line)[*line_offset - 1] == '\n')
+      return true;
+  }
+}
+
 static void usage(char *name)
 {
   printf("Client mode: %s [options] [<data>]\n", name);
   printf("Worker mode: %s -w [options] [<command> [<args> ...]]\n", name);
+  printf("Load mode:   %s -l <spec> [options]\n", name);
 
   printf("\nCommon options to both client and worker modes.\n");
   printf("\t-f <function> - Function name to use for jobs (can give many)\n");
   printf("\t-h <host>     - Job server host\n");
   printf("\t-H            - Print this help menu\n");
+  printf("\t-j <jobs>     - Number of jobs to run at once\n");
   printf("\t-p <port>     - Job server port\n");
 
   printf("\nClient options:\n");
@@ -618,7 +1589,35 @@ static void usage(char *name)
 
   printf("\nWorker options:\n");
   printf("\t-c <count>    - Number of jobs for worker to run before exiting\n");
+  printf("\t-k            - Keep the command running between jobs, see below\n");
   printf("\t-n            - Send data packet for each line\n");
   printf("\t-N            - Same as -n, but strip off the newline\n");
   printf("\t-w            - Run in worker mode\n");
+
+  printf("\nLoad options:\n");
+  printf("\t-b, -I, -L    - Defaults for functions in the spec\n");
+  printf("\t-c <count>    - Number of jobs to send before stopping\n");
+  printf("\t-C <conns>    - Number of connections to open\n");
+  printf("\t-j <jobs>     - Number of jobs to keep in flight on each connection\n");
+  printf("\t-l <spec>     - Run in load mode with the given spec, see below\n");
+  printf("\t-t <seconds>  - Number of seconds to run before stopping\n");
+
+  printf("\nWith -j in client mode, that many lines or arguments are sent at\n");
+  printf("once, and results are written as they come back, not in order.\n");
+  printf("With -j in worker mode, that many worker processes are started, and\n");
+  printf("-c counts jobs for each one. With -k each worker process starts the\n");
+  printf("command once and writes each workload to it after a line with its\n");
+  printf("size, and reads a line with the size of the result followed by the\n");
+  printf("result. With -n or -N each workload and result is one line instead.\n");
+  printf("A command that exits fails the job it had, and is started again for\n");
+  printf("the next one.\n");
+
+  printf("\nIn load mode, the spec is a comma separated list of\n");
+  printf("<function>[:<weight>[:<mode>[:<bytes>]]], with each job going to a\n");
+  printf("function picked by weight. The mode is any of b (background),\n");
+  printf("f (foreground), h (high), n (normal) and l (low), and bytes is the\n");
+  printf("workload size. Throughput and latency percentiles are printed every\n");
+  printf("second, and for the whole run at the end. Latency is until the job\n");
+  printf("completes, or for background jobs until the job server has it. Load\n");
+  printf("mode runs until the count or time given, or until interrupted.\n");
 }
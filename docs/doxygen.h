@@ -196,4 +196,41 @@ which is normally GEARMAN_SUCCESS.
 
 See the examples/ directory for the full worker code examples.
 
+@anchor main_page_cpp
+@section cpp C++
+
+C++17 applications can include libgearman/gearman.hpp instead. It wraps
+the client and worker in classes that free themselves, can be moved but
+not copied, and never copy workloads. For example, the worker above
+becomes:
+
+@code
+
+gearman::worker worker;
+
+worker.add_server("127.0.0.1", 0);
+worker.add_function("function", [](gearman::job &job) {
+  return std::string(job.workload());
+});
+
+while (1) worker.work();
+
+@endcode
+
+and a client runs it with:
+
+@code
+
+gearman::client client;
+
+client.add_server("127.0.0.1", 0);
+gearman::result result= client.run("function", "argument");
+if (result)
+  printf("Result: %.*s\n", (int)result.data.size(), result.data.data());
+
+@endcode
+
+The result is the buffer the library read it into, and is freed when
+the result goes away.
+
 */
@@ -71,7 +71,10 @@
 #include <libgearman/queue_libpq.h>
 #endif
 
+#include <libgearman/queue_logfile.h>
+
 #include <libgearman/protocol_http.h>
+#include <libgearman/protocol_shm.h>
 
 #define GEARMAND_LOG_REOPEN_TIME 60
 #define GEARMAND_LISTEN_BACKLOG 32
@@ -104,9 +107,46 @@ int main(int argc, char *argv[])
   rlim_t fds= 0;
   in_port_t port= 0;
   const char *host= NULL;
+  const char *unix_path= NULL;
   const char *pid_file= NULL;
   const char *queue_type= NULL;
   uint32_t threads= 0;
+  uint32_t proc_threads= 0;
+  uint32_t job_hash_size= 0;
+  uint32_t read_budget= 0;
+  uint32_t accept_budget= GEARMAND_DEFAULT_ACCEPT_BUDGET;
+  uint32_t affinity_wait= GEARMAN_DEFAULT_AFFINITY_WAIT;
+  uint32_t priority_levels= GEARMAN_DEFAULT_PRIORITY_LEVELS;
+  uint32_t priority_age= GEARMAN_DEFAULT_PRIORITY_AGE;
+  uint32_t queue_commit_size= 0;
+  uint32_t queue_commit_window= GEARMAN_DEFAULT_QUEUE_COMMIT_WINDOW;
+  const char *spill_path= NULL;
+  const char *snapshot_file= NULL;
+  uint32_t snapshot_interval= GEARMAN_DEFAULT_SNAPSHOT_INTERVAL;
+  size_t spill_watermark= 0;
+  size_t queue_bytes_max= GEARMAN_DEFAULT_QUEUE_BYTES_MAX;
+  size_t client_rate= GEARMAN_DEFAULT_CLIENT_RATE;
+  int stats_interval= -1;
+  uint32_t log_ring= 0;
+  in_port_t replica_listen= 0;
+  const char *replica_port;
+  char replica_host[NI_MAXHOST];
+  size_t send_buffer_size= 0;
+  size_t recv_buffer_size= 0;
+  bool job_handle_index= false;
+  bool reuseport= false;
+  bool thread_migrate= false;
+  bool tcp_cork= false;
+  bool proc_inline= false;
+  bool lock_stats= false;
+  bool queue_persist_thread= false;
+  bool queue_replay_background= false;
+  const char *io_engine= NULL;
+  const char *io_cpus= NULL;
+  const char *proc_cpus= NULL;
+  int main_cpu= -1;
+  int worker_wakeup= -1;
+  int work_data_max= -1;
   const char *user= NULL;
   uint8_t verbose= 0;
   gearman_return_t ret;
@@ -132,25 +172,141 @@ int main(int argc, char *argv[])
 #define MCO(__name, __short, __value, __help) \
   gearman_conf_module_add_option(&module, __name, __short, __value, __help);
 
+  MCO("accept-budget", 0, "CONNECTIONS",
+      "Connections to accept each time a listening socket is ready. "
+      "Default=64.")
+  MCO("affinity-wait", 0, "SECONDS",
+      "Seconds to hold a job whose unique ID starts with KEY# for the worker "
+      "KEY maps to, before any worker may take it, or 0 to ignore keys. "
+      "Default=0.")
   MCO("backlog", 'b', "BACKLOG", "Number of backlog connections for listen.")
+  MCO("client-rate", 0, "KILOBYTES",
+      "Kilobytes per second of jobs each connection may submit before the "
+      "server stops reading from it for a while. 0 means no limit. "
+      "Default=0.")
   MCO("daemon", 'd', NULL, "Daemon, detach and run in the background.")
   MCO("file-descriptors", 'f', "FDS",
       "Number of file descriptors to allow for the process (total connections "
       "will be slightly less). Default is max allowed for user.")
   MCO("help", 'h', NULL, "Print this help menu.");
+  MCO("io-cpus", 0, "CPUS",
+      "CPUs to pin the I/O threads to, as a list such as 0-3,8. Each thread "
+      "takes the next CPU in the list.")
+  MCO("io-engine", 0, "ENGINE",
+      "I/O engine for the I/O threads to wait on connections with, either "
+      "libevent or io_uring. Default=libevent.")
+  MCO("job-handle-index", 'J', NULL,
+      "Encode a slot number in job handles so jobs can be found without "
+      "hashing the handle.")
+  MCO("job-hash-size", 'j', "SIZE",
+      "Initial number of job hash buckets. Set this near the expected number "
+      "of queued jobs to avoid rehashing while they are loaded.")
+  MCO("lock-stats", 0, NULL,
+      "Time the locks the I/O and processing threads share and report how "
+      "often each kind is contended, and for how long, with the stats admin "
+      "command. This adds a clock read to every lock taken.")
   MCO("log-file", 'l', "FILE",
       "Log file to write errors and information to. Turning this option on "
       "also forces the first verbose level to be enabled.")
+  MCO("log-ring", 0, "RECORDS",
+      "Have each thread copy log lines into a ring of this many records, "
+      "written out by a separate log thread. Lines are dropped and counted "
+      "when a ring is full. Default=0, write lines from the thread that "
+      "logs them.")
   MCO("listen", 'L', "ADDRESS",
-      "Address the server should listen on. Default is INADDR_ANY.")
+      "Address the server should listen on. Default is INADDR_ANY. Use "
+      "unix:PATH to also listen on a Unix domain socket.")
+  MCO("main-cpu", 0, "CPU",
+      "CPU to pin the main thread that accepts connections to.")
   MCO("port", 'p', "PORT", "Port the server should listen on.")
   MCO("pid-file", 'P', "FILE", "File to write process ID out to.")
+  MCO("priority-age", 0, "SECONDS",
+      "Seconds a queued job waits before moving up a priority level, or 0 to "
+      "never move jobs up. Default=0.")
+  MCO("priority-levels", 0, "LEVELS",
+      "Number of priority levels, from 3 to 32. High, normal, and low jobs "
+      "start on the first, middle, and last level. Default=3.")
+  MCO("proc-cpus", 0, "CPUS",
+      "CPUs to pin the processing threads to, as a list such as 4-7. Each "
+      "thread takes the next CPU in the list.")
+  MCO("proc-inline", 0, NULL,
+      "Run commands in the I/O thread that read them when the shard they "
+      "belong to is not busy, instead of handing them to its processing "
+      "thread.")
+  MCO("proc-threads", 'T', "THREADS",
+      "Number of processing threads to split functions between when running "
+      "with more than one I/O thread. Default=1.")
   MCO("protocol", 'r', "PROTOCOL", "Load protocol module.")
+  MCO("queue-bytes-max", 0, "MEGABYTES",
+      "Megabytes of job payload that may be queued over all functions before "
+      "new jobs are refused. 0 means no limit. Default=0.")
+  MCO("queue-commit-size", 0, "JOBS",
+      "Commit up to this many background jobs to the persistent queue at "
+      "once, sending each reply after its group commits. Needs --threads. "
+      "Default=0, commit every job on its own.")
+  MCO("queue-commit-window", 0, "MICROSECONDS",
+      "Longest a job waits for its group to fill before it is committed. "
+      "Default=1000.")
+  MCO("queue-persist-thread", 0, NULL,
+      "Run persistent queue calls in their own thread so a slow queue does "
+      "not hold up other jobs. Needs --threads.")
+  MCO("queue-replay-background", 0, NULL,
+      "Start serving while the persistent queue is still being replayed. "
+      "Needs --threads and a queue type that supports it.")
   MCO("queue-type", 'q', "QUEUE", "Persistent queue type to use.")
+  MCO("read-budget", 0, "PACKETS",
+      "Number of packets an I/O thread reads from one connection before "
+      "giving other connections a turn. Default=0 (no limit).")
+  MCO("recv-buffer-size", 'R', "BYTES",
+      "Size of the receive buffer a connection holds while reading. "
+      "Default=8192.")
+  MCO("replica-listen", 0, "PORT",
+      "Port to accept background jobs from a primary server on, keeping them "
+      "aside until the replica promote admin command adds them to the "
+      "queue.")
+  MCO("replica-peer", 0, "HOST:PORT",
+      "Standby server to stream background jobs to. May be given more than "
+      "once.")
+  MCO("reuseport", 0, NULL,
+      "Have each I/O thread listen with its own SO_REUSEPORT socket and "
+      "accept its own connections, instead of accepting them all in the main "
+      "thread.")
+  MCO("send-buffer-size", 'S', "BYTES",
+      "Size of the send buffer a connection holds while writing. "
+      "Default=8192.")
+  MCO("snapshot-file", 0, "FILE",
+      "File to keep a snapshot of the queued jobs in, so a restart only "
+      "replays the persistent queue after it. Needs --threads and a queue "
+      "type that supports it.")
+  MCO("snapshot-interval", 0, "SECONDS",
+      "Seconds between snapshots, or 0 to only take one on shutdown. "
+      "Default=60.")
+  MCO("spill-path", 0, "DIR",
+      "Directory to spill payloads of queued background jobs to once the "
+      "spill watermark is reached.")
+  MCO("spill-watermark", 0, "MEGABYTES",
+      "Megabytes of queued job payloads to hold in memory before spilling "
+      "them to --spill-path. Default=0.")
+  MCO("stats-interval", 0, "SECONDS",
+      "Seconds to reuse the replies to the status, workers, stats, "
+      "latency and metrics admin commands for, or 0 to build a new reply every time. "
+      "Default=1.")
+  MCO("tcp-cork", 0, NULL,
+      "Hold back partly filled TCP segments while a connection has more "
+      "packets queued, and push them out with the last one.")
+  MCO("thread-migrate", 0, NULL,
+      "Move quiet client connections from busy I/O threads to idle ones.")
   MCO("threads", 't', "THREADS", "Number of I/O threads to use. Default=0.")
   MCO("user", 'u', "USER", "Switch to given user after startup.")
   MCO("verbose", 'v', NULL, "Increase verbosity level by one.")
   MCO("version", 'V', NULL, "Display the version of gearmand and exit.")
+  MCO("work-data-max", 0, "KILOBYTES",
+      "Kilobytes of streamed work data that may wait for one client before "
+      "the worker sending it stops being read. 0 means no limit. "
+      "Default=16384.")
+  MCO("worker-wakeup", 'w', "WORKERS",
+      "Number of extra sleeping workers to wake beyond the number of queued "
+      "jobs. Default=0.")
 
   /* Make sure none of the gearman_conf_module_add_option calls failed. */
   if (gearman_conf_return(&conf) != GEARMAN_SUCCESS)
@@ -198,6 +354,13 @@ int main(int argc, char *argv[])
   }
 #endif
 
+  if (gearman_queue_logfile_conf(&conf) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearmand: gearman_queue_logfile_conf: %s\n",
+            gearman_conf_error(&conf));
+    return 1;
+  }
+
   if (gearman_protocol_http_conf(&conf) != GEARMAN_SUCCESS)
   {
     fprintf(stderr, "gearmand: gearman_protocol_http_conf: %s\n",
@@ -205,6 +368,13 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  if (gearman_protocol_shm_conf(&conf) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearmand: gearman_protocol_shm_conf: %s\n",
+            gearman_conf_error(&conf));
+    return 1;
+  }
+
   /* Let gearman conf parse the command line arguments. */
   if (gearman_conf_parse_args(&conf, argc, argv) != GEARMAN_SUCCESS)
   {
@@ -218,8 +388,14 @@ int main(int argc, char *argv[])
   /* Check for option values that were given. */
   while (gearman_conf_module_value(&module, &name, &value))
   {
-    if (!strcmp(name, "backlog"))
+    if (!strcmp(name, "accept-budget"))
+      accept_budget= (uint32_t)atoi(value);
+    else if (!strcmp(name, "affinity-wait"))
+      affinity_wait= (uint32_t)atoi(value);
+    else if (!strcmp(name, "backlog"))
       backlog= atoi(value);
+    else if (!strcmp(name, "client-rate"))
+      client_rate= (size_t)strtoull(value, NULL, 10) * 1024;
     else if (!strcmp(name, "daemon"))
     {
       switch (fork())
@@ -250,18 +426,83 @@ int main(int argc, char *argv[])
       gearman_conf_usage(&conf);
       return 1;
     }
+    else if (!strcmp(name, "io-cpus"))
+      io_cpus= value;
+    else if (!strcmp(name, "io-engine"))
+      io_engine= value;
+    else if (!strcmp(name, "job-handle-index"))
+      job_handle_index= true;
+    else if (!strcmp(name, "job-hash-size"))
+      job_hash_size= (uint32_t)atoi(value);
+    else if (!strcmp(name, "lock-stats"))
+      lock_stats= true;
     else if (!strcmp(name, "log-file"))
       log_info.file= value;
+    else if (!strcmp(name, "log-ring"))
+      log_ring= (uint32_t)atoi(value);
     else if (!strcmp(name, "listen"))
-      host= value;
+    {
+      if (!strncmp(value, GEARMAN_UNIX_PREFIX, strlen(GEARMAN_UNIX_PREFIX)))
+        unix_path= value + strlen(GEARMAN_UNIX_PREFIX);
+      else
+        host= value;
+    }
+    else if (!strcmp(name, "main-cpu"))
+      main_cpu= atoi(value);
     else if (!strcmp(name, "port"))
       port= (in_port_t)atoi(value);
     else if (!strcmp(name, "pid-file"))
       pid_file= value;
+    else if (!strcmp(name, "priority-age"))
+      priority_age= (uint32_t)atoi(value);
+    else if (!strcmp(name, "priority-levels"))
+      priority_levels= (uint32_t)atoi(value);
+    else if (!strcmp(name, "proc-cpus"))
+      proc_cpus= value;
+    else if (!strcmp(name, "proc-inline"))
+      proc_inline= true;
+    else if (!strcmp(name, "proc-threads"))
+      proc_threads= (uint32_t)atoi(value);
     else if (!strcmp(name, "protocol"))
       continue;
+    else if (!strcmp(name, "queue-bytes-max"))
+      queue_bytes_max= (size_t)strtoull(value, NULL, 10) * 1024 * 1024;
+    else if (!strcmp(name, "queue-commit-size"))
+      queue_commit_size= (uint32_t)atoi(value);
+    else if (!strcmp(name, "queue-commit-window"))
+      queue_commit_window= (uint32_t)atoi(value);
+    else if (!strcmp(name, "queue-persist-thread"))
+      queue_persist_thread= true;
+    else if (!strcmp(name, "queue-replay-background"))
+      queue_replay_background= true;
     else if (!strcmp(name, "queue-type"))
       queue_type= value;
+    else if (!strcmp(name, "read-budget"))
+      read_budget= (uint32_t)atoi(value);
+    else if (!strcmp(name, "recv-buffer-size"))
+      recv_buffer_size= (size_t)atoi(value);
+    else if (!strcmp(name, "replica-listen"))
+      replica_listen= (in_port_t)atoi(value);
+    else if (!strcmp(name, "replica-peer"))
+      continue; /* Added once the instance is created. */
+    else if (!strcmp(name, "reuseport"))
+      reuseport= true;
+    else if (!strcmp(name, "send-buffer-size"))
+      send_buffer_size= (size_t)atoi(value);
+    else if (!strcmp(name, "snapshot-file"))
+      snapshot_file= value;
+    else if (!strcmp(name, "snapshot-interval"))
+      snapshot_interval= (uint32_t)atoi(value);
+    else if (!strcmp(name, "spill-path"))
+      spill_path= value;
+    else if (!strcmp(name, "spill-watermark"))
+      spill_watermark= (size_t)strtoull(value, NULL, 10) * 1024 * 1024;
+    else if (!strcmp(name, "stats-interval"))
+      stats_interval= atoi(value);
+    else if (!strcmp(name, "tcp-cork"))
+      tcp_cork= true;
+    else if (!strcmp(name, "thread-migrate"))
+      thread_migrate= true;
     else if (!strcmp(name, "threads"))
       threads= (uint32_t)atoi(value);
     else if (!strcmp(name, "user"))
@@ -270,6 +511,10 @@ int main(int argc, char *argv[])
       verbose++;
     else if (!strcmp(name, "version"))
       printf("\ngearmand %s - %s\n", gearman_version(), gearman_bugreport());
+    else if (!strcmp(name, "work-data-max"))
+      work_data_max= atoi(value);
+    else if (!strcmp(name, "worker-wakeup"))
+      worker_wakeup= atoi(value);
     else
     {
       fprintf(stderr, "gearmand: Unknown option:%s\n", name);
@@ -293,9 +538,147 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  if (unix_path != NULL &&
+      gearmand_port_add_unix(_gearmand, unix_path, NULL) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearmand: gearmand_port_add_unix: %s\n", unix_path);
+    return 1;
+  }
+
   gearmand_set_backlog(_gearmand, backlog);
+  gearmand_set_accept_budget(_gearmand, accept_budget);
   gearmand_set_threads(_gearmand, threads);
+  gearmand_set_reuseport(_gearmand, reuseport);
+  gearmand_set_migrate(_gearmand, thread_migrate);
+  gearmand_set_read_budget(_gearmand, read_budget);
+  gearmand_set_priority(_gearmand, priority_levels, priority_age);
+  gearmand_set_affinity_wait(_gearmand, affinity_wait);
+
+  if (io_engine != NULL)
+  {
+    if (!strcmp(io_engine, "libevent"))
+      ret= gearmand_set_io_engine(_gearmand, GEARMAND_IO_ENGINE_LIBEVENT);
+    else if (!strcmp(io_engine, "io_uring"))
+      ret= gearmand_set_io_engine(_gearmand, GEARMAND_IO_ENGINE_IO_URING);
+    else
+      ret= GEARMAN_UNKNOWN_OPTION;
+
+    if (ret != GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "gearmand: Unsupported I/O engine:%s\n", io_engine);
+      return 1;
+    }
+  }
+  gearmand_set_buffer_size(_gearmand, send_buffer_size, recv_buffer_size);
+
+  if (proc_threads > 0 &&
+      gearmand_set_proc_threads(_gearmand, proc_threads) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearmand: Could not create processing thread shards\n");
+    return 1;
+  }
+
+  if ((io_cpus != NULL || proc_cpus != NULL || main_cpu >= 0) &&
+      gearmand_set_cpus(_gearmand, io_cpus, proc_cpus, main_cpu) !=
+      GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearmand: Could not pin threads to the given CPUs\n");
+    return 1;
+  }
+
+  if (job_handle_index)
+  {
+    gearmand_set_server_options(_gearmand, GEARMAN_SERVER_JOB_HANDLE_INDEX,
+                                1);
+  }
+
+  if (tcp_cork)
+    gearmand_set_server_options(_gearmand, GEARMAN_SERVER_TCP_CORK, 1);
+
+  if (proc_inline)
+    gearmand_set_server_options(_gearmand, GEARMAN_SERVER_PROC_INLINE, 1);
+
+  if (lock_stats)
+    gearmand_set_server_options(_gearmand, GEARMAN_SERVER_LOCK_STATS, 1);
+
+  if (worker_wakeup >= 0)
+    gearmand_set_worker_wakeup(_gearmand, (uint32_t)worker_wakeup);
+
+  if (work_data_max >= 0)
+    gearmand_set_work_data_max(_gearmand, (size_t)work_data_max * 1024);
+
+  gearmand_set_queue_bytes_max(_gearmand, queue_bytes_max);
+  gearmand_set_client_rate(_gearmand, client_rate);
+
+  if (queue_commit_size > 0)
+  {
+    gearmand_set_queue_commit(_gearmand, queue_commit_size,
+                              queue_commit_window);
+  }
+
+  if (queue_persist_thread)
+    gearmand_set_queue_persist_thread(_gearmand, true);
+
+  if (queue_replay_background)
+    gearmand_set_queue_replay_background(_gearmand, true);
+
+  if (snapshot_file != NULL &&
+      gearmand_set_snapshot(_gearmand, snapshot_file, snapshot_interval) !=
+      GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearmand: Could not set snapshot file:%s\n",
+            snapshot_file);
+    return 1;
+  }
+
+  /* Peers are added now that there is an instance to add them to. */
+  while (gearman_conf_module_value(&module, &name, &value))
+  {
+    if (strcmp(name, "replica-peer"))
+      continue;
+
+    replica_port= strrchr(value, ':');
+    if (replica_port == NULL || replica_port == value ||
+        (size_t)(replica_port - value) >= NI_MAXHOST)
+    {
+      fprintf(stderr, "gearmand: Replica peer must be HOST:PORT:%s\n", value);
+      return 1;
+    }
+
+    snprintf(replica_host, NI_MAXHOST, "%.*s", (int)(replica_port - value),
+             value);
+    if (gearmand_replica_peer_add(_gearmand, replica_host,
+                                  (in_port_t)atoi(replica_port + 1)) !=
+        GEARMAN_SUCCESS)
+    {
+      fprintf(stderr, "gearmand: Could not add replica peer:%s\n", value);
+      return 1;
+    }
+  }
+
+  if (replica_listen > 0)
+    gearmand_set_replica_listen(_gearmand, replica_listen);
+
+  if (stats_interval >= 0)
+    gearmand_set_stats_interval(_gearmand, (uint32_t)stats_interval);
+
+  if (job_hash_size > 0 &&
+      gearmand_set_job_hash_size(_gearmand, job_hash_size) != GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearmand: Could not allocate job hash tables\n");
+    return 1;
+  }
+
+  if (spill_path != NULL &&
+      gearmand_set_spill(_gearmand, spill_path, spill_watermark) !=
+      GEARMAN_SUCCESS)
+  {
+    fprintf(stderr, "gearmand: Could not set spill path:%s\n", spill_path);
+    return 1;
+  }
+
   gearmand_set_log(_gearmand, _log, &log_info, verbose);
+  gearmand_set_log_ring(_gearmand, log_ring);
 
   if (queue_type != NULL)
   {
@@ -335,6 +718,13 @@ int main(int argc, char *argv[])
     }
     else
 #endif
+    if (!strcmp(queue_type, "logfile"))
+    {
+      ret= gearmand_queue_logfile_init(_gearmand, &conf);
+      if (ret != GEARMAN_SUCCESS)
+        return 1;
+    }
+    else
     {
       fprintf(stderr, "gearmand: Unknown queue module: %s\n", queue_type);
       return 1;
@@ -352,6 +742,12 @@ int main(int argc, char *argv[])
       if (ret != GEARMAN_SUCCESS)
         return 1;
     }
+    else if (!strcmp(value, "shm"))
+    {
+      ret= gearmand_protocol_shm_init(_gearmand, &conf);
+      if (ret != GEARMAN_SUCCESS)
+        return 1;
+    }
     else
     {
       fprintf(stderr, "gearmand: Unknown protocol module: %s\n", value);
@@ -379,6 +775,8 @@ int main(int argc, char *argv[])
     if (!strcmp(queue_type, "libpq"))
       gearmand_queue_libpq_deinit(_gearmand);
 #endif
+    if (!strcmp(queue_type, "logfile"))
+      gearmand_queue_logfile_deinit(_gearmand);
   }
 
   while (gearman_conf_module_value(&module, &name, &value))
@@ -388,6 +786,8 @@ int main(int argc, char *argv[])
 
     if (!strcmp(value, "http"))
       gearmand_protocol_http_deinit(_gearmand);
+    else if (!strcmp(value, "shm"))
+      gearmand_protocol_shm_deinit(_gearmand);
   }
 
   gearmand_free(_gearmand);
@@ -32,7 +32,39 @@ static gearman_client_st *_client_allocate(gearman_client_st *client);
  * Callback function used when parsing server lists.
  */
 static gearman_return_t _client_add_server(const char *host, in_port_t port,
-                                           void *data);
+                                           uint32_t weight, void *data);
+
+/**
+ * Build the consistent hash ring from the current server list.
+ */
+static gearman_return_t _client_ring_build(gearman_client_st *client);
+
+/**
+ * Compare function for sorting ring points.
+ */
+static int _client_ring_cmp(const void *a, const void *b);
+
+/**
+ * Find the connection a hashed key maps to on the ring, or NULL if the ring
+ * could not be built.
+ */
+static gearman_con_st *_client_ring_find(gearman_client_st *client,
+                                         uint32_t key);
+
+/**
+ * Hash a unique ID for the ring. Only the affinity key at the start of it is
+ * hashed when there is one, so the jobs for a key all go to the server that
+ * holds them for one worker.
+ */
+static uint32_t _client_ring_key(const char *unique);
+
+/**
+ * Pick a connection for a new task that isn't tied to one by its key. Free
+ * connections are preferred by lowest round trip time. One passed over after
+ * failures is only used if every other connection has been failing too, and
+ * NULL is returned to wait if the working ones are all busy.
+ */
+static gearman_con_st *_client_con_pick(gearman_client_st *client);
 
 /**
  * Add a task.
@@ -53,6 +85,43 @@ static gearman_task_st *_client_add_task(gearman_client_st *client,
 static gearman_return_t _client_run_task(gearman_client_st *client,
                                          gearman_task_st *task);
 
+/**
+ * Flush the submissions packed on a connection without waiting for the next
+ * one to be added.
+ */
+static gearman_return_t _client_flush(gearman_client_st *client,
+                                      gearman_con_st *con);
+
+/**
+ * Find the stats for a function, adding them if this is the first task for
+ * it. Returns NULL if they could not be allocated.
+ */
+static gearman_client_stats_st *_client_stats_get(gearman_client_st *client,
+                                                  const char *function_name);
+
+/**
+ * Record the time a JOB_CREATED or the first result packet for a task came
+ * back.
+ */
+static void _client_stats_packet(gearman_task_st *task);
+
+/**
+ * Record the total time for a finished task.
+ */
+static void _client_stats_finish(gearman_task_st *task);
+
+/**
+ * See if the data of the packet a task is handling goes to its result sink.
+ */
+static bool _client_result_sink(gearman_task_st *task);
+
+/**
+ * Read the data of the packet a task is handling, into the task's result
+ * sink if it has one, or else into a buffer for the packet.
+ */
+static gearman_return_t _client_result_recv(gearman_client_st *client,
+                                            gearman_task_st *task);
+
 /**
  * Real do function.
  */
@@ -61,6 +130,12 @@ static void *_client_do(gearman_client_st *client, gearman_command_t command,
                         const void *workload, size_t workload_size,
                         size_t *result_size, gearman_return_t *ret_ptr);
 
+/**
+ * Run the do task once it has been added, and take its result.
+ */
+static void *_client_do_run(gearman_client_st *client, size_t *result_size,
+                            gearman_return_t *ret_ptr);
+
 /**
  * Real background do function.
  */
@@ -134,12 +209,24 @@ gearman_client_st *gearman_client_clone(gearman_client_st *client,
 
 void gearman_client_free(gearman_client_st *client)
 {
+  gearman_client_stats_st *stats;
+
   if (client->options & GEARMAN_CLIENT_TASK_IN_USE)
     gearman_task_free(&(client->do_task));
 
   if (client->gearman != NULL)
     gearman_free(client->gearman);
 
+  if (client->ring != NULL)
+    free(client->ring);
+
+  while (client->stats_list != NULL)
+  {
+    stats= client->stats_list;
+    client->stats_list= stats->next;
+    free(stats);
+  }
+
   if (client->options & GEARMAN_CLIENT_ALLOCATED)
     free(client);
 }
@@ -161,12 +248,21 @@ void gearman_client_set_options(gearman_client_st *client,
   if (options & GEARMAN_CLIENT_NON_BLOCKING)
     gearman_set_options(client->gearman, GEARMAN_NON_BLOCKING, data);
 
+  if (options & GEARMAN_CLIENT_EPOLL)
+    gearman_set_options(client->gearman, GEARMAN_EPOLL, data);
+
   if (data)
     client->options |= options;
   else
     client->options &= ~options;
 }
 
+void gearman_client_set_compression(gearman_client_st *client,
+                                    size_t threshold)
+{
+  gearman_set_compression(client->gearman, threshold);
+}
+
 void *gearman_client_data(gearman_client_st *client)
 {
   return (void *)(client->data);
@@ -201,9 +297,27 @@ void gearman_client_set_task_fn_arg_free(gearman_client_st *client,
 gearman_return_t gearman_client_add_server(gearman_client_st *client,
                                            const char *host, in_port_t port)
 {
-  if (gearman_con_add(client->gearman, NULL, host, port) == NULL)
+  return gearman_client_add_server_weight(client, host, port, 1);
+}
+
+gearman_return_t gearman_client_add_server_weight(gearman_client_st *client,
+                                                  const char *host,
+                                                  in_port_t port,
+                                                  uint32_t weight)
+{
+  gearman_con_st *con;
+
+  con= gearman_con_add(client->gearman, NULL, host, port);
+  if (con == NULL)
     return GEARMAN_MEMORY_ALLOCATION_FAILURE;
 
+  if (weight == 0)
+    weight= 1;
+  else if (weight > GEARMAN_CLIENT_MAX_WEIGHT)
+    weight= GEARMAN_CLIENT_MAX_WEIGHT;
+
+  con->weight= weight;
+
   return GEARMAN_SUCCESS;
 }
 
@@ -240,6 +354,25 @@ void *gearman_client_do_low(gearman_client_st *client,
                     unique, workload, workload_size, result_size, ret_ptr);
 }
 
+void *gearman_client_do_iov(gearman_client_st *client,
+                            const char *function_name, const char *unique,
+                            const struct iovec *iov, int iov_count,
+                            size_t *result_size, gearman_return_t *ret_ptr)
+{
+  if (!(client->options & GEARMAN_CLIENT_TASK_IN_USE))
+  {
+    (void)gearman_client_add_task_iov(client, &(client->do_task), client,
+                                      function_name, unique, iov, iov_count,
+                                      ret_ptr);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+      return NULL;
+
+    client->options|= GEARMAN_CLIENT_TASK_IN_USE;
+  }
+
+  return _client_do_run(client, result_size, ret_ptr);
+}
+
 const char *gearman_client_do_job_handle(gearman_client_st *client)
 {
   return client->do_task.job_handle;
@@ -423,6 +556,245 @@ gearman_client_add_task_low_background(gearman_client_st *client,
                           unique, workload, workload_size, ret_ptr);
 }
 
+gearman_task_st *
+gearman_client_add_task_epoch(gearman_client_st *client,
+                              gearman_task_st *task,
+                              const void *fn_arg,
+                              const char *function_name,
+                              const char *unique,
+                              const void *workload,
+                              size_t workload_size,
+                              time_t when,
+                              gearman_return_t *ret_ptr)
+{
+  uuid_t uuid;
+  char uuid_string[37];
+  char epoch_string[21]; /* Max string size to hold an int64_t. */
+
+  task= gearman_task_create(client->gearman, task);
+  if (task == NULL)
+  {
+    *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+
+  task->fn_arg= fn_arg;
+
+  if (client->options & GEARMAN_CLIENT_STATS)
+    task->stats= _client_stats_get(client, function_name);
+
+  if (unique == NULL)
+  {
+    uuid_generate(uuid);
+    uuid_unparse(uuid, uuid_string);
+    unique= uuid_string;
+  }
+  else if (unique[0] == '-' && unique[1] == 0 && workload != NULL)
+    task->server_key= gearman_server_hash((const char *)workload,
+                                          workload_size);
+  else
+    task->server_key= _client_ring_key(unique);
+
+  snprintf(epoch_string, sizeof(epoch_string), "%"PRId64, (int64_t)when);
+
+  *ret_ptr= gearman_packet_add(client->gearman, &(task->send),
+                               GEARMAN_MAGIC_REQUEST,
+                               GEARMAN_COMMAND_SUBMIT_JOB_EPOCH,
+                               (uint8_t *)function_name,
+                               (size_t)(strlen(function_name) + 1),
+                               (uint8_t *)unique, (size_t)(strlen(unique) + 1),
+                               (uint8_t *)epoch_string,
+                               (size_t)(strlen(epoch_string) + 1),
+                               workload, workload_size, NULL);
+  if (*ret_ptr == GEARMAN_SUCCESS)
+  {
+    client->new_tasks++;
+    client->running_tasks++;
+    task->options|= GEARMAN_TASK_SEND_IN_USE;
+    gearman_task_queue_new(task);
+  }
+
+  return task;
+}
+
+gearman_task_st *
+gearman_client_add_task_chain(gearman_client_st *client,
+                              gearman_task_st *task,
+                              const void *fn_arg,
+                              const char *function_name,
+                              const char *unique,
+                              const char *chain,
+                              const void *workload,
+                              size_t workload_size,
+                              gearman_return_t *ret_ptr)
+{
+  uuid_t uuid;
+  char uuid_string[37];
+
+  task= gearman_task_create(client->gearman, task);
+  if (task == NULL)
+  {
+    *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+
+  task->fn_arg= fn_arg;
+
+  if (client->options & GEARMAN_CLIENT_STATS)
+    task->stats= _client_stats_get(client, function_name);
+
+  if (unique == NULL)
+  {
+    uuid_generate(uuid);
+    uuid_unparse(uuid, uuid_string);
+    unique= uuid_string;
+  }
+  else if (unique[0] == '-' && unique[1] == 0 && workload != NULL)
+    task->server_key= gearman_server_hash((const char *)workload,
+                                          workload_size);
+  else
+    task->server_key= _client_ring_key(unique);
+
+  *ret_ptr= gearman_packet_add(client->gearman, &(task->send),
+                               GEARMAN_MAGIC_REQUEST,
+                               GEARMAN_COMMAND_SUBMIT_JOB_CHAIN,
+                               (uint8_t *)function_name,
+                               (size_t)(strlen(function_name) + 1),
+                               (uint8_t *)unique, (size_t)(strlen(unique) + 1),
+                               (uint8_t *)chain, (size_t)(strlen(chain) + 1),
+                               workload, workload_size, NULL);
+  if (*ret_ptr == GEARMAN_SUCCESS)
+  {
+    client->new_tasks++;
+    client->running_tasks++;
+    task->options|= GEARMAN_TASK_SEND_IN_USE;
+    gearman_task_queue_new(task);
+  }
+
+  return task;
+}
+
+gearman_task_st *gearman_client_add_task_iov(gearman_client_st *client,
+                                             gearman_task_st *task,
+                                             const void *fn_arg,
+                                             const char *function_name,
+                                             const char *unique,
+                                             const struct iovec *iov,
+                                             int iov_count,
+                                             gearman_return_t *ret_ptr)
+{
+  task= _client_add_task(client, task, fn_arg, GEARMAN_COMMAND_SUBMIT_JOB,
+                         function_name, unique, NULL, 0, ret_ptr);
+  if (*ret_ptr != GEARMAN_SUCCESS)
+    return task;
+
+  *ret_ptr= gearman_packet_set_data_iov(&(task->send), iov, iov_count);
+  if (*ret_ptr != GEARMAN_SUCCESS)
+  {
+    client->new_tasks--;
+    client->running_tasks--;
+    gearman_task_free(task);
+    return NULL;
+  }
+
+  return task;
+}
+
+gearman_task_st *gearman_client_add_tasks_batch(gearman_client_st *client,
+                                                gearman_task_st *task,
+                                                const void *fn_arg,
+                                                const char *function_name,
+                                                gearman_job_priority_t priority,
+                                                uint32_t count,
+                                                const char * const *unique,
+                                                const void * const *workload,
+                                                const size_t *workload_size,
+                                                gearman_return_t *ret_ptr)
+{
+  uuid_t uuid;
+  char uuid_string[37];
+  char priority_string[2];
+  const char *job_unique;
+  uint8_t *data;
+  uint8_t *ptr;
+  size_t data_size= 0;
+  size_t unique_size;
+  uint32_t size;
+  uint32_t x;
+
+  for (x= 0; x < count; x++)
+  {
+    if (unique == NULL || unique[x] == NULL)
+      unique_size= 36;
+    else
+      unique_size= strlen(unique[x]);
+
+    data_size+= unique_size + 1 + GEARMAN_BATCH_SIZE_LENGTH + workload_size[x];
+  }
+
+  if (client->gearman->workload_malloc == NULL)
+    data= malloc(data_size);
+  else
+  {
+    data= client->gearman->workload_malloc(data_size,
+                                (void *)(client->gearman->workload_malloc_arg));
+  }
+  if (data == NULL && data_size > 0)
+  {
+    GEARMAN_ERROR_SET(client->gearman, "gearman_client_add_tasks_batch",
+                      "malloc")
+    *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    return NULL;
+  }
+
+  for (x= 0, ptr= data; x < count; x++)
+  {
+    if (unique == NULL || unique[x] == NULL)
+    {
+      uuid_generate(uuid);
+      uuid_unparse(uuid, uuid_string);
+      job_unique= uuid_string;
+    }
+    else
+      job_unique= unique[x];
+
+    unique_size= strlen(job_unique) + 1;
+    memcpy(ptr, job_unique, unique_size);
+    ptr+= unique_size;
+
+    size= htonl((uint32_t)workload_size[x]);
+    memcpy(ptr, &size, GEARMAN_BATCH_SIZE_LENGTH);
+    ptr+= GEARMAN_BATCH_SIZE_LENGTH;
+
+    if (workload_size[x] > 0)
+      memcpy(ptr, workload[x], workload_size[x]);
+    ptr+= workload_size[x];
+  }
+
+  priority_string[0]= (char)('0' + priority);
+  priority_string[1]= 0;
+
+  task= _client_add_task(client, task, fn_arg,
+                         GEARMAN_COMMAND_SUBMIT_JOB_BATCH, function_name,
+                         priority_string, data, data_size, ret_ptr);
+  if (*ret_ptr != GEARMAN_SUCCESS)
+  {
+    if (client->gearman->workload_free == NULL)
+      free(data);
+    else
+    {
+      client->gearman->workload_free(data,
+                                  (void *)(client->gearman->workload_free_arg));
+    }
+
+    return task;
+  }
+
+  task->send.options|= GEARMAN_PACKET_FREE_DATA;
+
+  return task;
+}
+
 gearman_task_st *gearman_client_add_task_status(gearman_client_st *client,
                                                 gearman_task_st *task,
                                                 const void *fn_arg,
@@ -448,11 +820,44 @@ gearman_task_st *gearman_client_add_task_status(gearman_client_st *client,
     client->new_tasks++;
     client->running_tasks++;
     task->options|= GEARMAN_TASK_SEND_IN_USE;
+    gearman_task_queue_new(task);
   }
 
   return task;
 }
 
+gearman_return_t gearman_client_task_reserve(gearman_client_st *client,
+                                             uint32_t count)
+{
+  return gearman_task_reserve(client->gearman, count);
+}
+
+void gearman_client_task_free_all(gearman_client_st *client)
+{
+  gearman_task_st *task;
+  gearman_task_st *next;
+
+  for (task= client->gearman->task_list; task != NULL; task= next)
+  {
+    next= task->next;
+
+    /* The blocking interface frees its own task. */
+    if (task != &(client->do_task))
+      gearman_task_free(task);
+  }
+
+  client->new_tasks= 0;
+  client->running_tasks= 0;
+
+  if (client->options & GEARMAN_CLIENT_TASK_IN_USE &&
+      client->do_task.state != GEARMAN_TASK_STATE_FINISHED)
+  {
+    client->running_tasks++;
+    if (client->do_task.state == GEARMAN_TASK_STATE_NEW)
+      client->new_tasks++;
+  }
+}
+
 void gearman_client_set_workload_fn(gearman_client_st *client,
                                     gearman_workload_fn *workload_fn)
 {
@@ -529,12 +934,8 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
       /* Start any new tasks. */
       if (client->new_tasks > 0 && !(client->options & GEARMAN_CLIENT_NO_NEW))
       {
-        for (client->task= client->gearman->task_list; client->task != NULL;
-             client->task= client->task->next)
+        while ((client->task= client->gearman->task_new_list) != NULL)
         {
-          if (client->task->state != GEARMAN_TASK_STATE_NEW)
-            continue;
-
   case GEARMAN_CLIENT_STATE_NEW:
           ret= _client_run_task(client, client->task);
           if (ret != GEARMAN_SUCCESS && ret != GEARMAN_IO_WAIT)
@@ -543,6 +944,26 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
             client->gearman->options= options;
             return ret;
           }
+
+          /* Every connection is busy sending, so the rest have to wait. */
+          if (client->options & GEARMAN_CLIENT_NO_NEW)
+            break;
+        }
+
+        /* Write out what was packed, once for each connection. */
+        for (client->con= client->gearman->con_list; client->con != NULL;
+             client->con= client->con->next)
+        {
+          if (client->con->task_send != NULL)
+            continue;
+
+          ret= _client_flush(client, client->con);
+          if (ret != GEARMAN_SUCCESS && ret != GEARMAN_IO_WAIT)
+          {
+            client->state= GEARMAN_CLIENT_STATE_IDLE;
+            client->gearman->options= options;
+            return ret;
+          }
         }
       }
 
@@ -551,17 +972,13 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
       {
         if (client->con->revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL))
         {
-          /* Socket is ready for writing, continue submitting jobs. */
-          for (client->task= client->gearman->task_list; client->task != NULL;
-               client->task= client->task->next)
+          /* Socket is ready for writing, continue submitting the job. Only
+             one task at a time can be sending on a connection. */
+          client->task= client->con->task_send;
+          if (client->task != NULL &&
+              (client->task->state == GEARMAN_TASK_STATE_SUBMIT ||
+               client->task->state == GEARMAN_TASK_STATE_WORKLOAD))
           {
-            if (client->task->con != client->con ||
-                (client->task->state != GEARMAN_TASK_STATE_SUBMIT &&
-                 client->task->state != GEARMAN_TASK_STATE_WORKLOAD))
-            {
-              continue;
-            }
-
   case GEARMAN_CLIENT_STATE_SUBMIT:
             ret= _client_run_task(client, client->task);
             if (ret != GEARMAN_SUCCESS && ret != GEARMAN_IO_WAIT)
@@ -571,6 +988,17 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
               return ret;
             }
           }
+          else if (client->task == NULL)
+          {
+            /* Finish writing submissions no task is waiting on. */
+            ret= _client_flush(client, client->con);
+            if (ret != GEARMAN_SUCCESS && ret != GEARMAN_IO_WAIT)
+            {
+              client->state= GEARMAN_CLIENT_STATE_IDLE;
+              client->gearman->options= options;
+              return ret;
+            }
+          }
         }
 
         if (!(client->con->revents & POLLIN))
@@ -580,38 +1008,20 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
         while (1)
         {
           /* Read packet on connection and find which task it belongs to. */
-          if (client->options & GEARMAN_CLIENT_UNBUFFERED_RESULT)
+          if (client->con->recv_state == GEARMAN_CON_RECV_STATE_READ_DATA)
           {
-            /* If client is handling the data read, make sure it's complete. */
-            if (client->con->recv_state == GEARMAN_CON_RECV_STATE_READ_DATA)
-            {
-              for (client->task= client->gearman->task_list;
-                   client->task != NULL; client->task= client->task->next)
-              {
-                if (client->task->con == client->con &&
-                    (client->task->state == GEARMAN_TASK_STATE_DATA ||
-                     client->task->state == GEARMAN_TASK_STATE_COMPLETE))
-                {
-                  break;
-                }
-              }
-
-              assert(client->task != NULL);
-            }
-            else
-            {
-              /* Read the next packet, without buffering the data part. */
-              client->task= NULL;
-              (void)gearman_con_recv(client->con, &(client->con->packet), &ret,
-                                     false);
-            }
+            /* The data of the last packet is still being read, by the client
+               callbacks or into a result sink. */
+            client->task= client->con->task_recv;
+            assert(client->task != NULL);
           }
           else
           {
-            /* Read the next packet, buffering the data part. */
+            /* Read the next packet. The data part is read once the task is
+               known, so it can go straight to where the task wants it. */
             client->task= NULL;
             (void)gearman_con_recv(client->con, &(client->con->packet), &ret,
-                                   true);
+                                   false);
           }
 
           if (client->task == NULL)
@@ -622,6 +1032,9 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
               if (ret == GEARMAN_IO_WAIT)
                 break;
 
+              if (ret == GEARMAN_LOST_CONNECTION)
+                gearman_con_health_fail(client->con);
+
               client->state= GEARMAN_CLIENT_STATE_IDLE;
               client->gearman->options= options;
               return ret;
@@ -630,43 +1043,77 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
             client->con->options|= GEARMAN_CON_PACKET_IN_USE;
 
             /* We have a packet, see which task it belongs to. */
-            for (client->task= client->gearman->task_list; client->task != NULL;
-                 client->task= client->task->next)
+            if (client->con->packet.command == GEARMAN_COMMAND_JOB_CREATED ||
+                client->con->packet.command ==
+                GEARMAN_COMMAND_JOB_CREATED_BATCH)
             {
-              if (client->task->con != client->con)
-                continue;
-
-              if (client->con->packet.command == GEARMAN_COMMAND_JOB_CREATED)
-              {
-                if (client->task->created_id != client->con->created_id)
-                  continue;
+              /* New job created, this is the oldest submission waiting. */
+              client->task= client->con->task_created_list;
+              assert(client->task != NULL);
+              gearman_task_dequeue(client->task);
+              client->con->created_id++;
 
-                /* New job created, drop through below and notify task. */
-                client->con->created_id++;
-              }
-              else if (client->con->packet.command == GEARMAN_COMMAND_ERROR)
+              if (client->con->rtt_start != 0 &&
+                  client->task->created_id == client->con->rtt_id)
               {
-                GEARMAN_ERROR_SET(client->gearman, "gearman_client_run_tasks",
-                                  "%s:%.*s",
-                                  (char *)(client->con->packet.arg[0]),
-                                  (int)(client->con->packet.arg_size[1]),
-                                  (char *)(client->con->packet.arg[1]));
-                return GEARMAN_SERVER_ERROR;
+                gearman_con_health_ok(client->con, gearman_time_now() -
+                                                   client->con->rtt_start);
+                client->con->rtt_start= 0;
               }
-              else if (strcmp(client->task->job_handle,
-                              (char *)(client->con->packet.arg[0])))
+              else
               {
-                continue;
+                /* The timed submission never got its reply. */
+                if ((int32_t)(client->task->created_id -
+                              client->con->rtt_id) > 0)
+                {
+                  client->con->rtt_start= 0;
+                }
+
+                if (client->con->error_count != 0)
+                  gearman_con_health_ok(client->con, 0);
               }
+            }
+            else if (client->con->packet.command == GEARMAN_COMMAND_ERROR)
+            {
+              GEARMAN_ERROR_SET(client->gearman, "gearman_client_run_tasks",
+                                "%s:%.*s",
+                                (char *)(client->con->packet.arg[0]),
+                                (int)(client->con->packet.arg_size[1]),
+                                (char *)(client->con->packet.arg[1]));
+              return GEARMAN_SERVER_ERROR;
+            }
+            else
+            {
+              /* Else, find the task with a matching job handle. */
+              client->task= gearman_task_hash_find(client->con,
+                                        (char *)(client->con->packet.arg[0]),
+                                        client->con->packet.command ==
+                                        GEARMAN_COMMAND_STATUS_RES);
+              assert(client->task != NULL);
+            }
 
-              /* Else, we have a matching result packet of some kind. */
+            client->task->recv= &(client->con->packet);
+            client->con->task_recv= client->task;
+          }
 
+          /* Unless the client callbacks read it themselves, read the data
+             into the task's result sink or a buffer for the packet. */
+          if (client->con->recv_state == GEARMAN_CON_RECV_STATE_READ_DATA &&
+              (!(client->options & GEARMAN_CLIENT_UNBUFFERED_RESULT) ||
+               _client_result_sink(client->task)))
+          {
+            ret= _client_result_recv(client, client->task);
+            if (ret == GEARMAN_IO_WAIT)
               break;
-            }
-
-            assert(client->task != NULL);
+            if (ret != GEARMAN_SUCCESS)
+            {
+              if (ret == GEARMAN_LOST_CONNECTION)
+                gearman_con_health_fail(client->con);
 
-            client->task->recv= &(client->con->packet);
+              client->state= GEARMAN_CLIENT_STATE_IDLE;
+              client->gearman->options= options;
+              return ret;
+            }
           }
 
   case GEARMAN_CLIENT_STATE_PACKET:
@@ -682,6 +1129,7 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
           }
 
           /* Clean up the packet. */
+          client->con->task_recv= NULL;
           gearman_packet_free(&(client->con->packet));
           client->con->options&=
                            (gearman_client_options_t)~GEARMAN_CON_PACKET_IN_USE;
@@ -731,6 +1179,100 @@ gearman_return_t gearman_client_run_tasks(gearman_client_st *client)
   return GEARMAN_SUCCESS;
 }
 
+void gearman_client_set_event_watch(gearman_client_st *client,
+                                    gearman_event_watch_fn *event_watch,
+                                    void *event_watch_arg)
+{
+  gearman_set_event_watch(client->gearman, event_watch, event_watch_arg);
+
+  if (event_watch == NULL)
+  {
+    client->gearman->options&= (gearman_options_t)~GEARMAN_WATCH_CLOSE;
+    return;
+  }
+
+  client->gearman->options|= GEARMAN_WATCH_CLOSE;
+  gearman_client_set_options(client, GEARMAN_CLIENT_NON_BLOCKING, 1);
+}
+
+gearman_return_t gearman_client_process_ready(gearman_client_st *client,
+                                              int fd, short revents)
+{
+  gearman_con_st *con;
+  gearman_return_t ret;
+
+  for (con= client->gearman->con_list; con != NULL; con= con->next)
+  {
+    if (con->fd == -1 || con->fd != fd)
+      continue;
+
+    ret= gearman_con_set_revents(con, revents);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    break;
+  }
+
+  return gearman_client_run_tasks(client);
+}
+
+gearman_client_stats_st *gearman_client_stats(gearman_client_st *client,
+                                              gearman_client_stats_st *stats)
+{
+  if (stats == NULL)
+    return client->stats_list;
+
+  return stats->next;
+}
+
+const char *gearman_client_stats_function(const gearman_client_stats_st *stats)
+{
+  return stats->function_name;
+}
+
+uint64_t gearman_client_stats_count(const gearman_client_stats_st *stats)
+{
+  return stats->count;
+}
+
+uint64_t gearman_client_stats_fail_count(const gearman_client_stats_st *stats)
+{
+  return stats->fail_count;
+}
+
+const gearman_histogram_st *
+gearman_client_stats_created(const gearman_client_stats_st *stats)
+{
+  return &(stats->created);
+}
+
+const gearman_histogram_st *
+gearman_client_stats_first_data(const gearman_client_stats_st *stats)
+{
+  return &(stats->first_data);
+}
+
+const gearman_histogram_st *
+gearman_client_stats_total(const gearman_client_stats_st *stats)
+{
+  return &(stats->total);
+}
+
+void gearman_client_stats_reset(gearman_client_st *client)
+{
+  gearman_client_stats_st *stats;
+
+  /* Running tasks point at these, so they are cleared rather than freed. */
+  for (stats= client->stats_list; stats != NULL; stats= stats->next)
+  {
+    stats->count= 0;
+    stats->fail_count= 0;
+    gearman_histogram_init(&(stats->created));
+    gearman_histogram_init(&(stats->first_data));
+    gearman_histogram_init(&(stats->total));
+  }
+}
+
 /*
  * Private definitions
  */
@@ -752,10 +1294,14 @@ static gearman_client_st *_client_allocate(gearman_client_st *client)
   client->do_ret= 0;
   client->new_tasks= 0;
   client->running_tasks= 0;
+  client->ring_count= 0;
+  client->ring_con_count= 0;
   client->do_data_size= 0;
   client->gearman= NULL;
   client->data= NULL;
   client->con= NULL;
+  client->ring= NULL;
+  client->stats_list= NULL;
   client->task= NULL;
   client->do_data= NULL;
   client->workload_fn= NULL;
@@ -771,9 +1317,150 @@ static gearman_client_st *_client_allocate(gearman_client_st *client)
 }
 
 static gearman_return_t _client_add_server(const char *host, in_port_t port,
-                                           void *data)
+                                           uint32_t weight, void *data)
+{
+  return gearman_client_add_server_weight((gearman_client_st *)data, host,
+                                          port, weight);
+}
+
+static gearman_return_t _client_ring_build(gearman_client_st *client)
+{
+  gearman_con_st *con;
+  gearman_client_point_st *ring;
+  uint32_t count= 0;
+  uint32_t x;
+  char key[NI_MAXHOST + 24];
+  int key_size;
+
+  for (con= client->gearman->con_list; con != NULL; con= con->next)
+    count+= GEARMAN_CLIENT_RING_POINTS * con->weight;
+
+  ring= realloc(client->ring, sizeof(gearman_client_point_st) * count);
+  if (ring == NULL)
+  {
+    GEARMAN_ERROR_SET(client->gearman, "_client_ring_build", "realloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  client->ring= ring;
+  client->ring_count= 0;
+
+  /* Each server gets points by hashing its name and a point number, so
+     adding or removing one only moves the keys that land near its points. */
+  for (con= client->gearman->con_list; con != NULL; con= con->next)
+  {
+    for (x= 0; x < GEARMAN_CLIENT_RING_POINTS * con->weight; x++)
+    {
+      key_size= snprintf(key, sizeof(key), "%s:%u-%u",
+                         con->host == NULL ? GEARMAN_DEFAULT_TCP_HOST :
+                         con->host, (unsigned int)con->port, x);
+      if (key_size < 0 || (size_t)key_size >= sizeof(key))
+        key_size= (int)sizeof(key) - 1;
+
+      ring[client->ring_count].value= gearman_server_hash(key,
+                                                          (size_t)key_size);
+      ring[client->ring_count].con= con;
+      client->ring_count++;
+    }
+  }
+
+  qsort(ring, client->ring_count, sizeof(gearman_client_point_st),
+        _client_ring_cmp);
+  client->ring_con_count= client->gearman->con_count;
+
+  return GEARMAN_SUCCESS;
+}
+
+static int _client_ring_cmp(const void *a, const void *b)
 {
-  return gearman_client_add_server((gearman_client_st *)data, host, port);
+  uint32_t a_value= ((const gearman_client_point_st *)a)->value;
+  uint32_t b_value= ((const gearman_client_point_st *)b)->value;
+
+  if (a_value < b_value)
+    return -1;
+
+  return a_value > b_value ? 1 : 0;
+}
+
+static gearman_con_st *_client_ring_find(gearman_client_st *client,
+                                         uint32_t key)
+{
+  uint32_t low= 0;
+  uint32_t high;
+  uint32_t mid;
+
+  if (client->ring_con_count != client->gearman->con_count ||
+      client->ring_count == 0)
+  {
+    if (_client_ring_build(client) != GEARMAN_SUCCESS ||
+        client->ring_count == 0)
+    {
+      return NULL;
+    }
+  }
+
+  /* Find the first point at or past the key, wrapping around to the start. */
+  high= client->ring_count;
+  while (low < high)
+  {
+    mid= low + ((high - low) / 2);
+    if (client->ring[mid].value < key)
+      low= mid + 1;
+    else
+      high= mid;
+  }
+
+  if (low == client->ring_count)
+    low= 0;
+
+  return client->ring[low].con;
+}
+
+static uint32_t _client_ring_key(const char *unique)
+{
+  const char *affinity= strchr(unique, GEARMAN_AFFINITY_SEPARATOR);
+
+  if (affinity != NULL && affinity != unique)
+    return gearman_server_hash(unique, (size_t)(affinity - unique));
+
+  return gearman_server_hash(unique, strlen(unique));
+}
+
+static gearman_con_st *_client_con_pick(gearman_client_st *client)
+{
+  gearman_con_st *con;
+  gearman_con_st *best= NULL;
+  gearman_con_st *retry= NULL;
+  bool busy= false;
+
+  for (con= client->gearman->con_list; con != NULL; con= con->next)
+  {
+    if (!gearman_con_health_ready(con))
+    {
+      if (retry == NULL && con->send_state == GEARMAN_CON_SEND_STATE_NONE)
+        retry= con;
+      continue;
+    }
+
+    if (con->send_state != GEARMAN_CON_SEND_STATE_NONE)
+    {
+      busy= true;
+      continue;
+    }
+
+    /* A server not measured yet has a time of 0, so it is tried first and
+       gets measured. */
+    if (best == NULL || con->rtt < best->rtt)
+      best= con;
+  }
+
+  if (best != NULL)
+    return best;
+
+  if (busy)
+    return NULL;
+
+  return retry;
 }
 
 static gearman_task_st *_client_add_task(gearman_client_st *client,
@@ -798,24 +1485,66 @@ static gearman_task_st *_client_add_task(gearman_client_st *client,
 
   task->fn_arg= fn_arg;
 
-  if (unique == NULL)
+  if (client->options & GEARMAN_CLIENT_STATS)
+    task->stats= _client_stats_get(client, function_name);
+
+  /* Only a caller's unique key says anything about where a job belongs. A
+     unique key of "-" asks for the workload to be hashed instead. */
+  if (unique != NULL && command != GEARMAN_COMMAND_SUBMIT_JOB_BATCH)
   {
-    uuid_generate(uuid);
-    uuid_unparse(uuid, uuid_string);
-    unique= uuid_string;
+    if (unique[0] == '-' && unique[1] == 0 && workload != NULL)
+      task->server_key= gearman_server_hash((const char *)workload,
+                                            workload_size);
+    else
+      task->server_key= _client_ring_key(unique);
+  }
+
+  /* The batch builds its priority argument on the stack, so it is always
+     copied. */
+  if (client->options & GEARMAN_CLIENT_DIRECT_PACK &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_BATCH)
+  {
+    /* A generated unique ID lives at the end of the packet's argument buffer,
+       past the header that is the only other thing kept there. */
+    if (unique == NULL)
+    {
+      uuid_generate(uuid);
+      unique= (char *)(task->send.args_buffer + GEARMAN_ARGS_BUFFER_SIZE -
+                       sizeof(uuid_string));
+      uuid_unparse(uuid, (char *)unique);
+    }
+
+    *ret_ptr= gearman_packet_add_ref(client->gearman, &(task->send),
+                                     GEARMAN_MAGIC_REQUEST, command,
+                                     function_name,
+                                     (size_t)(strlen(function_name) + 1),
+                                     unique, (size_t)(strlen(unique) + 1),
+                                     workload, workload_size, NULL);
+  }
+  else
+  {
+    if (unique == NULL)
+    {
+      uuid_generate(uuid);
+      uuid_unparse(uuid, uuid_string);
+      unique= uuid_string;
+    }
+
+    *ret_ptr= gearman_packet_add(client->gearman, &(task->send),
+                                 GEARMAN_MAGIC_REQUEST, command,
+                                 (uint8_t *)function_name,
+                                 (size_t)(strlen(function_name) + 1),
+                                 (uint8_t *)unique,
+                                 (size_t)(strlen(unique) + 1),
+                                 workload, workload_size, NULL);
   }
 
-  *ret_ptr= gearman_packet_add(client->gearman, &(task->send),
-                               GEARMAN_MAGIC_REQUEST, command,
-                               (uint8_t *)function_name,
-                               (size_t)(strlen(function_name) + 1),
-                               (uint8_t *)unique, (size_t)(strlen(unique) + 1),
-                               workload, workload_size, NULL);
   if (*ret_ptr == GEARMAN_SUCCESS)
   {
     client->new_tasks++;
     client->running_tasks++;
     task->options|= GEARMAN_TASK_SEND_IN_USE;
+    gearman_task_queue_new(task);
   }
 
   return task;
@@ -835,17 +1564,34 @@ static gearman_return_t _client_run_task(gearman_client_st *client,
     {
       client->new_tasks--;
       client->running_tasks--;
+      gearman_task_dequeue(task);
       GEARMAN_ERROR_SET(client->gearman, "_client_run_task", "no servers added")
       return GEARMAN_NO_SERVERS;
     }
 
-    for (task->con= task->gearman->con_list; task->con != NULL;
-         task->con= task->con->next)
+    task->con= NULL;
+    if (client->options & GEARMAN_CLIENT_CONSISTENT_HASH &&
+        task->server_key != 0)
     {
-      if (task->con->send_state == GEARMAN_CON_SEND_STATE_NONE)
-        break;
+      task->con= _client_ring_find(client, task->server_key);
+
+      /* A server that keeps failing hands its keys to the others until it
+         is tried again. Otherwise wait for the server the key maps to,
+         holding back the tasks behind this one so they are still sent in
+         order. */
+      if (task->con != NULL && !gearman_con_health_ready(task->con))
+        task->con= NULL;
+      else if (task->con != NULL &&
+               task->con->send_state != GEARMAN_CON_SEND_STATE_NONE)
+      {
+        client->options|= GEARMAN_CLIENT_NO_NEW;
+        return GEARMAN_IO_WAIT;
+      }
     }
 
+    if (task->con == NULL)
+      task->con= _client_con_pick(client);
+
     if (task->con == NULL)
     {
       client->options|= GEARMAN_CLIENT_NO_NEW;
@@ -853,18 +1599,36 @@ static gearman_return_t _client_run_task(gearman_client_st *client,
     }
 
     client->new_tasks--;
+    gearman_task_dequeue(task);
+    task->con->task_send= task;
+
+    if (task->stats != NULL)
+      task->submit_time= gearman_time_now();
 
     if (task->send.command != GEARMAN_COMMAND_GET_STATUS)
     {
       task->created_id= task->con->created_id_next;
       task->con->created_id_next++;
+      gearman_task_queue_created(task);
+
+      /* Time one submission per round trip, leaving out connecting. */
+      if (task->con->rtt_start == 0 &&
+          task->con->state == GEARMAN_CON_STATE_CONNECTED)
+      {
+        task->con->rtt_start= gearman_time_now();
+        task->con->rtt_id= task->created_id;
+      }
     }
 
   case GEARMAN_TASK_STATE_SUBMIT:
     while (1)
     {
+      /* Submissions are packed back to back and flushed once per pass in
+         gearman_client_run_tasks, since JOB_CREATED replies come back in the
+         order they were sent. Only a connection that is not up yet flushes
+         right away, so a failed connect still moves to the next server. */
       ret= gearman_con_send(task->con, &(task->send),
-                            client->new_tasks == 0 ? true : false);
+                            task->con->state != GEARMAN_CON_STATE_CONNECTED);
       if (ret == GEARMAN_SUCCESS)
         break;
       else if (ret == GEARMAN_IO_WAIT)
@@ -874,8 +1638,12 @@ static gearman_return_t _client_run_task(gearman_client_st *client,
       }
       else if (ret != GEARMAN_SUCCESS)
       {
+        gearman_con_health_fail(task->con);
+
         /* Increment this since the job submission failed. */
         task->con->created_id++;
+        task->con->task_send= NULL;
+        gearman_task_dequeue(task);
 
         if (ret == GEARMAN_COULD_NOT_CONNECT)
         {
@@ -889,19 +1657,44 @@ static gearman_return_t _client_run_task(gearman_client_st *client,
 
         if (task->con == NULL)
         {
+          /* Start the task over if a server that is still working can take
+             it once it is free. */
+          if (ret == GEARMAN_COULD_NOT_CONNECT)
+          {
+            for (task->con= task->gearman->con_list; task->con != NULL;
+                 task->con= task->con->next)
+            {
+              if (task->con->error_count == 0)
+                break;
+            }
+
+            if (task->con != NULL)
+            {
+              task->con= NULL;
+              task->state= GEARMAN_TASK_STATE_NEW;
+              client->new_tasks++;
+              gearman_task_queue_new(task);
+              return GEARMAN_IO_WAIT;
+            }
+          }
+
           client->running_tasks--;
           return ret;
         }
 
+        task->con->task_send= task;
+
         if (task->send.command != GEARMAN_COMMAND_GET_STATUS)
         {
           task->created_id= task->con->created_id_next;
           task->con->created_id_next++;
+          gearman_task_queue_created(task);
         }
       }
     }
 
-    if (task->send.data_size > 0 && task->send.data == NULL)
+    if (task->send.data_size > 0 && task->send.data == NULL &&
+        task->send.data_iov == NULL)
     {
       if (client->workload_fn == NULL)
       {
@@ -920,15 +1713,37 @@ static gearman_return_t _client_run_task(gearman_client_st *client,
     }
 
     client->options&= (gearman_client_options_t)~GEARMAN_CLIENT_NO_NEW;
+    task->con->task_send= NULL;
     task->state= GEARMAN_TASK_STATE_WORK;
+
+    /* A status request already has the job handle its reply will carry. */
+    if (task->send.command == GEARMAN_COMMAND_GET_STATUS)
+      gearman_task_hash_add(task);
+
     return gearman_con_set_events(task->con, POLLIN);
 
   case GEARMAN_TASK_STATE_WORK:
-    if (task->recv->command == GEARMAN_COMMAND_JOB_CREATED)
+    if (task->stats != NULL)
+      _client_stats_packet(task);
+
+    if (task->recv->command == GEARMAN_COMMAND_JOB_CREATED ||
+        task->recv->command == GEARMAN_COMMAND_JOB_CREATED_BATCH)
     {
-      snprintf(task->job_handle, GEARMAN_JOB_HANDLE_SIZE, "%.*s",
-               (uint32_t)(task->recv->arg_size[0]),
-               (char *)(task->recv->arg[0]));
+      if (task->recv->command == GEARMAN_COMMAND_JOB_CREATED)
+      {
+        snprintf(task->job_handle, GEARMAN_JOB_HANDLE_SIZE, "%.*s",
+                 (uint32_t)(task->recv->arg_size[0]),
+                 (char *)(task->recv->arg[0]));
+      }
+      else if (task->recv->data_size == 0)
+        task->job_handle[0]= 0;
+      else
+      {
+        /* The first handle in the list stands for the batch. */
+        snprintf(task->job_handle, GEARMAN_JOB_HANDLE_SIZE, "%.*s",
+                 (uint32_t)(task->recv->data_size),
+                 (char *)(task->recv->data));
+      }
 
   case GEARMAN_TASK_STATE_CREATED:
       if (client->created_fn != NULL)
@@ -943,10 +1758,15 @@ static gearman_return_t _client_run_task(gearman_client_st *client,
 
       if (task->send.command == GEARMAN_COMMAND_SUBMIT_JOB_BG ||
           task->send.command == GEARMAN_COMMAND_SUBMIT_JOB_HIGH_BG ||
-          task->send.command == GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG)
+          task->send.command == GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG ||
+          task->send.command == GEARMAN_COMMAND_SUBMIT_JOB_EPOCH ||
+          task->send.command == GEARMAN_COMMAND_SUBMIT_JOB_BATCH)
       {
         break;
       }
+
+      /* Results for the job come back with its handle. */
+      gearman_task_hash_add(task);
     }
     else if (task->recv->command == GEARMAN_COMMAND_WORK_DATA)
     {
@@ -1073,12 +1893,156 @@ static gearman_return_t _client_run_task(gearman_client_st *client,
   client->running_tasks--;
   task->state= GEARMAN_TASK_STATE_FINISHED;
 
+  if (task->stats != NULL)
+    _client_stats_finish(task);
+  gearman_task_hash_del(task);
+
   if (client->options & GEARMAN_CLIENT_FREE_TASKS)
     gearman_task_free(task);
 
   return GEARMAN_SUCCESS;
 }
 
+static gearman_return_t _client_flush(gearman_client_st *client,
+                                      gearman_con_st *con)
+{
+  gearman_return_t ret;
+
+  if (con->send_state == GEARMAN_CON_SEND_STATE_NONE)
+  {
+    if (con->send_buffer_size == 0)
+      return GEARMAN_SUCCESS;
+
+    con->send_state= GEARMAN_CON_SEND_STATE_FLUSH;
+  }
+  else if (con->send_state != GEARMAN_CON_SEND_STATE_FLUSH)
+    return GEARMAN_SUCCESS;
+
+  ret= gearman_con_flush(con);
+  if (ret == GEARMAN_SUCCESS)
+    client->options&= (gearman_client_options_t)~GEARMAN_CLIENT_NO_NEW;
+
+  return ret;
+}
+
+static gearman_client_stats_st *_client_stats_get(gearman_client_st *client,
+                                                  const char *function_name)
+{
+  gearman_client_stats_st *stats;
+  size_t function_name_size= strlen(function_name);
+
+  /* Clients tend to run only a handful of functions, so a list is enough. */
+  for (stats= client->stats_list; stats != NULL; stats= stats->next)
+  {
+    if (stats->function_name_size == function_name_size &&
+        !memcmp(stats->function_name, function_name, function_name_size))
+    {
+      return stats;
+    }
+  }
+
+  stats= malloc(sizeof(gearman_client_stats_st) + function_name_size + 1);
+  if (stats == NULL)
+    return NULL;
+
+  stats->count= 0;
+  stats->fail_count= 0;
+  stats->function_name_size= function_name_size;
+  stats->function_name= (char *)(stats + 1);
+  memcpy(stats->function_name, function_name, function_name_size + 1);
+  gearman_histogram_init(&(stats->created));
+  gearman_histogram_init(&(stats->first_data));
+  gearman_histogram_init(&(stats->total));
+
+  stats->next= client->stats_list;
+  client->stats_list= stats;
+
+  return stats;
+}
+
+static void _client_stats_packet(gearman_task_st *task)
+{
+  gearman_command_t command= task->recv->command;
+
+  if (command == GEARMAN_COMMAND_JOB_CREATED ||
+      command == GEARMAN_COMMAND_JOB_CREATED_BATCH)
+  {
+    task->created_time= gearman_time_now();
+    gearman_histogram_add(&(task->stats->created),
+                          task->created_time - task->submit_time);
+  }
+  else if ((command == GEARMAN_COMMAND_WORK_DATA ||
+            command == GEARMAN_COMMAND_WORK_COMPLETE) && task->data_time == 0)
+  {
+    task->data_time= gearman_time_now();
+    gearman_histogram_add(&(task->stats->first_data),
+                          task->data_time - task->created_time);
+  }
+  else if (command == GEARMAN_COMMAND_WORK_FAIL)
+    task->stats->fail_count++;
+}
+
+static void _client_stats_finish(gearman_task_st *task)
+{
+  task->stats->count++;
+  gearman_histogram_add(&(task->stats->total),
+                        gearman_time_now() - task->submit_time);
+}
+
+static bool _client_result_sink(gearman_task_st *task)
+{
+  if (task->result_buffer == NULL && task->result_fn == NULL)
+    return false;
+
+  return task->recv->command == GEARMAN_COMMAND_WORK_DATA ||
+         task->recv->command == GEARMAN_COMMAND_WORK_COMPLETE;
+}
+
+static gearman_return_t _client_result_recv(gearman_client_st *client,
+                                            gearman_task_st *task)
+{
+  gearman_con_st *con= client->con;
+  const void *data;
+  size_t data_size;
+  gearman_return_t ret;
+
+  if (!_client_result_sink(task))
+    return gearman_con_recv_packet_data(con, task->recv);
+
+  while (con->recv_data_size != 0)
+  {
+    if (task->result_fn == NULL &&
+        task->result_size < task->result_buffer_size)
+    {
+      data_size= gearman_con_recv_data(con, (uint8_t *)(task->result_buffer) +
+                                       task->result_size,
+                                       task->result_buffer_size -
+                                       task->result_size, &ret);
+    }
+    else
+    {
+      /* Pieces for the callback, or past the end of a full buffer, are used
+         where they were read. */
+      data_size= gearman_con_recv_data_ref(con, &data, &ret);
+      if (data_size > 0 && task->result_fn != NULL)
+      {
+        ret= (*(task->result_fn))(task, data, data_size);
+        if (ret != GEARMAN_SUCCESS)
+        {
+          gearman_con_close(con);
+          return ret;
+        }
+      }
+    }
+
+    task->result_size+= data_size;
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
 static void *_client_do(gearman_client_st *client, gearman_command_t command,
                         const char *function_name, const char *unique,
                         const void *workload, size_t workload_size,
@@ -1095,6 +2059,14 @@ static void *_client_do(gearman_client_st *client, gearman_command_t command,
     client->options|= GEARMAN_CLIENT_TASK_IN_USE;
   }
 
+  return _client_do_run(client, result_size, ret_ptr);
+}
+
+static void *_client_do_run(gearman_client_st *client, size_t *result_size,
+                            gearman_return_t *ret_ptr)
+{
+  void *result= NULL;
+
   client->workload_fn= NULL;
   client->created_fn= NULL;
   client->data_fn= _client_do_data;
@@ -1112,18 +2084,16 @@ static void *_client_do(gearman_client_st *client, gearman_command_t command,
     client->options&= (gearman_client_options_t)~GEARMAN_CLIENT_TASK_IN_USE;
   }
 
-  workload= NULL;
-
   if (*ret_ptr == GEARMAN_SUCCESS || *ret_ptr == GEARMAN_PAUSE)
   {
     *ret_ptr= client->do_ret;
-    workload= client->do_data;
+    result= client->do_data;
     *result_size= client->do_data_size;
     client->do_data= NULL;
     client->do_data_size= 0;
   }
 
-  return (void *)workload;
+  return result;
 }
 
 static gearman_return_t _client_do_background(gearman_client_st *client,
@@ -88,6 +88,17 @@ void gearman_client_set_options(gearman_client_st *client,
                                 gearman_client_options_t options,
                                 uint32_t data);
 
+/**
+ * Compress workloads at least this large. See gearman_set_compression for
+ * details.
+ * @param client Client structure previously initialized with
+ *        gearman_client_create or gearman_client_clone.
+ * @param threshold Smallest workload size to compress, or 0 to not compress.
+ */
+GEARMAN_API
+void gearman_client_set_compression(gearman_client_st *client,
+                                    size_t threshold);
+
 /**
  * Get the application data pointer for a client.
  * @param client Client structure previously initialized with
@@ -150,20 +161,55 @@ void gearman_client_set_task_fn_arg_free(gearman_client_st *client,
  * used to run tasks. No socket I/O happens here, it is just added to a list.
  * @param client Client structure previously initialized with
  *        gearman_client_create or gearman_client_clone.
- * @param host Hostname or IP address (IPv4 or IPv6) of the server to add.
- * @param port Port of the server to add.
+ * @param host Hostname or IP address (IPv4 or IPv6) of the server to add, or
+ *        the path of a Unix domain socket, either absolute or prefixed with
+ *        "unix:". A "shm:" prefix instead connects to the socket of a
+ *        server's shared memory module.
+ * @param port Port of the server to add, ignored for Unix domain sockets.
  * @return Standard gearman return value.
  */
 GEARMAN_API
 gearman_return_t gearman_client_add_server(gearman_client_st *client,
                                            const char *host, in_port_t port);
 
+/**
+ * Add a job server to a client with a weight. With the
+ * GEARMAN_CLIENT_CONSISTENT_HASH option set, a task given a unique ID is sent
+ * to the server its ID hashes to on a ring of points, so the same ID always
+ * goes to the same server while it is up, and adding or removing a server
+ * only moves the IDs near its points. A unique ID of "-" hashes the workload
+ * instead, and one with GEARMAN_AFFINITY_SEPARATOR in it only hashes the
+ * affinity key before it, so jobs sharing a key meet on one server that can
+ * hold them for one worker. A server gets GEARMAN_CLIENT_RING_POINTS points
+ * for each unit of weight. Tasks without a unique ID, or when the ring cannot
+ * be built, go to the first server that is free, and a server that cannot be
+ * connected to fails over to the next one in the list as usual. While the
+ * server a task maps to is busy sending, the tasks added after it wait too.
+ * @param client Client structure previously initialized with
+ *        gearman_client_create or gearman_client_clone.
+ * @param host Same as gearman_client_add_server.
+ * @param port Same as gearman_client_add_server.
+ * @param weight Relative share of the keys, from 1 to
+ *        GEARMAN_CLIENT_MAX_WEIGHT. 0 is taken as 1.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_client_add_server_weight(gearman_client_st *client,
+                                                  const char *host,
+                                                  in_port_t port,
+                                                  uint32_t weight);
+
 /**
  * Add a list of job servers to a client. The format for the server list is:
- * SERVER[:PORT][,SERVER[:PORT]]...
+ * SERVER[:PORT][/?WEIGHT][,SERVER[:PORT][/?WEIGHT]]...
  * Some examples are:
  * 10.0.0.1,10.0.0.2,10.0.0.3
  * localhost:1234,jobserver2.domain.com:7003,10.0.0.3
+ * unix:/run/gearmand.sock,10.0.0.1
+ * shm:/tmp/gearmand.shm
+ * 10.0.0.1/?2,10.0.0.2:7003/?1
+ * A weight is only used for consistent hashing, see
+ * gearman_client_add_server_weight.
  * @param client Client structure previously initialized with
  *        gearman_client_create or gearman_client_clone.
  * @param servers Server list described above.
@@ -230,6 +276,22 @@ void *gearman_client_do_low(gearman_client_st *client,
                             const void *workload, size_t workload_size,
                             size_t *result_size, gearman_return_t *ret_ptr);
 
+/**
+ * Run a single task with a workload made of several chunks, and return an
+ * allocated result. The chunks are written to the connection with writev
+ * instead of being gathered into one buffer first, so they are never copied.
+ * See gearman_client_do() for the other parameters and return information.
+ * @param iov Array of chunks making up the workload, in order. Only the
+ *        array is copied, so every chunk must stay valid until the task is
+ *        done.
+ * @param iov_count Number of entries in iov.
+ */
+GEARMAN_API
+void *gearman_client_do_iov(gearman_client_st *client,
+                            const char *function_name, const char *unique,
+                            const struct iovec *iov, int iov_count,
+                            size_t *result_size, gearman_return_t *ret_ptr);
+
 /**
  * Get the job handle for the running task. This should be used between
  * repeated gearman_client_do() and gearman_client_do_high() calls to get
@@ -346,7 +408,11 @@ gearman_return_t gearman_client_echo(gearman_client_st *client,
  */
 
 /**
- * Add a task to be run in parallel.
+ * Add a task to be run in parallel. With the GEARMAN_CLIENT_DIRECT_PACK
+ * option set, the function name and unique ID given to this and the other
+ * add_task functions are not copied. They are packed straight into the
+ * connection send buffer, so they must stay valid until the task is freed,
+ * just like the workload.
  */
 GEARMAN_API
 gearman_task_st *gearman_client_add_task(gearman_client_st *client,
@@ -425,6 +491,103 @@ gearman_client_add_task_low_background(gearman_client_st *client,
                                        size_t workload_size,
                                        gearman_return_t *ret_ptr);
 
+/**
+ * Add a background task that the job server holds until a given time before
+ * any worker can take it. The time is kept with the job in a persistent
+ * queue, and a time that has already passed runs the job right away. See
+ * gearman_client_add_task_background() for the other parameters.
+ * @param when Time to run the job at, in seconds since the epoch.
+ */
+GEARMAN_API
+gearman_task_st *
+gearman_client_add_task_epoch(gearman_client_st *client,
+                              gearman_task_st *task,
+                              const void *fn_arg,
+                              const char *function_name,
+                              const char *unique,
+                              const void *workload,
+                              size_t workload_size,
+                              time_t when,
+                              gearman_return_t *ret_ptr);
+
+/**
+ * Add a task that the job server runs through several functions in turn.
+ * When the first function completes, the server queues the job for the next
+ * function in the chain with the result as its workload, without a round trip
+ * through the client. Only the result of the last function is returned, and
+ * the task sees status, data and warning packets from every stage under one
+ * job handle. A failure or exception ends the chain. See
+ * gearman_client_add_task() for the other parameters.
+ * @param chain Functions to run after the first, separated by
+ *        GEARMAN_CHAIN_SEPARATOR. A function starting with
+ *        GEARMAN_CHAIN_KEEP_WORKLOAD is given the same workload as the stage
+ *        before it, not that stage's result. With several job server
+ *        processing threads, every function must be handled by the same one
+ *        as the first, or the server rejects the job.
+ */
+GEARMAN_API
+gearman_task_st *
+gearman_client_add_task_chain(gearman_client_st *client,
+                              gearman_task_st *task,
+                              const void *fn_arg,
+                              const char *function_name,
+                              const char *unique,
+                              const char *chain,
+                              const void *workload,
+                              size_t workload_size,
+                              gearman_return_t *ret_ptr);
+
+/**
+ * Add a task to be run in parallel with a workload made of several chunks.
+ * The chunks are written to the connection with writev where they are, and
+ * the workload size is their total. Only the iovec array is copied, so every
+ * chunk must stay valid until the task is freed. A unique ID of "-" is hashed
+ * like the others, since there is no single workload buffer to hash.
+ */
+GEARMAN_API
+gearman_task_st *gearman_client_add_task_iov(gearman_client_st *client,
+                                             gearman_task_st *task,
+                                             const void *fn_arg,
+                                             const char *function_name,
+                                             const char *unique,
+                                             const struct iovec *iov,
+                                             int iov_count,
+                                             gearman_return_t *ret_ptr);
+
+/**
+ * Add a batch of background jobs for one function, submitted together in a
+ * single packet. The whole batch is one task, and its job handle is the
+ * handle of the first job once it is created. The created callback can get
+ * every handle from gearman_task_data, each one NULL terminated. If the job
+ * queue fills up part way through, only the jobs that were created are
+ * listed.
+ * @param client Client structure previously initialized with
+ *        gearman_client_create or gearman_client_clone.
+ * @param task Caller allocated structure, or NULL to allocate one.
+ * @param fn_arg Argument to pass into task callbacks.
+ * @param function_name Function name shared by every job.
+ * @param priority Priority shared by every job.
+ * @param count Number of jobs in the batch.
+ * @param unique List of unique IDs, or NULL for all of them to be generated.
+ *        A NULL entry has its unique ID generated too.
+ * @param workload List of workloads.
+ * @param workload_size List of workload sizes.
+ * @param ret_ptr Standard gearman return value.
+ * @return On success, a pointer to the (possibly allocated) structure. On
+ *         failure this will be NULL.
+ */
+GEARMAN_API
+gearman_task_st *gearman_client_add_tasks_batch(gearman_client_st *client,
+                                                gearman_task_st *task,
+                                                const void *fn_arg,
+                                                const char *function_name,
+                                                gearman_job_priority_t priority,
+                                                uint32_t count,
+                                                const char * const *unique,
+                                                const void * const *workload,
+                                                const size_t *workload_size,
+                                                gearman_return_t *ret_ptr);
+
 /**
  * Add task to get the status for a backgound task in parallel.
  */
@@ -435,6 +598,31 @@ gearman_task_st *gearman_client_add_task_status(gearman_client_st *client,
                                                 const char *job_handle,
                                                 gearman_return_t *ret_ptr);
 
+/**
+ * Reserve memory for tasks ahead of time. Tasks added without a task
+ * structure are taken from this reserve, a block of them at a time, and go
+ * back to it when freed so they can be used again. Once it runs out, tasks
+ * are allocated one by one as usual. The memory is released when the client
+ * is freed.
+ * @param client Client structure previously initialized with
+ *        gearman_client_create or gearman_client_clone.
+ * @param count Number of tasks to have in reserve.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_client_task_reserve(gearman_client_st *client,
+                                             uint32_t count);
+
+/**
+ * Free all tasks at once, whether they are finished or not. Tasks from the
+ * reserve go back to it. The task used by the gearman_client_do functions is
+ * left alone.
+ * @param client Client structure previously initialized with
+ *        gearman_client_create or gearman_client_clone.
+ */
+GEARMAN_API
+void gearman_client_task_free_all(gearman_client_st *client);
+
 /**
  * Callback function when workload data needs to be sent for a task.
  */
@@ -498,11 +686,111 @@ GEARMAN_API
 void gearman_client_clear_fn(gearman_client_st *client);
 
 /**
- * Run tasks that have been added in parallel.
+ * Run tasks that have been added in parallel. New tasks are written to each
+ * connection back to back, without waiting for their JOB_CREATED replies,
+ * and each connection is flushed once after all of them are packed.
  */
 GEARMAN_API
 gearman_return_t gearman_client_run_tasks(gearman_client_st *client);
 
+/**
+ * Hand the client's connections to an external event loop such as libevent,
+ * libuv, or asio, instead of having gearman_client_run_tasks poll them. This
+ * also sets the non-blocking option. The event_watch function is called with
+ * a connection whenever the events it needs change, and gearman_con_fd gives
+ * the descriptor to watch. It is called with no events just before a
+ * connection is closed, so the watch can be removed while the descriptor is
+ * still the same one. Once tasks are added, call gearman_client_run_tasks to
+ * start them, and then gearman_client_process_ready as descriptors become
+ * ready. Task callbacks are run from inside those two calls.
+ * @param client Client structure previously initialized with
+ *        gearman_client_create or gearman_client_clone.
+ * @param event_watch Function to call when the events to watch for change,
+ *        or NULL to go back to polling in gearman_client_run_tasks.
+ * @param event_watch_arg Argument to pass along to event_watch.
+ */
+GEARMAN_API
+void gearman_client_set_event_watch(gearman_client_st *client,
+                                    gearman_event_watch_fn *event_watch,
+                                    void *event_watch_arg);
+
+/**
+ * Process events an external event loop saw on a descriptor, and run the
+ * tasks as far as they can go without blocking. Events on a descriptor the
+ * client no longer uses are ignored.
+ * @param client Client structure previously set up with
+ *        gearman_client_set_event_watch.
+ * @param fd The descriptor the events were seen on.
+ * @param revents The events seen, as POLLIN, POLLOUT, POLLERR, and POLLHUP.
+ * @return GEARMAN_IO_WAIT while tasks are still running, GEARMAN_SUCCESS
+ *         once they are all done, or another gearman return value on error.
+ */
+GEARMAN_API
+gearman_return_t gearman_client_process_ready(gearman_client_st *client,
+                                              int fd, short revents);
+
+/**
+ * Walk the latency stats kept for each function while the
+ * GEARMAN_CLIENT_STATS option is set. With the option set, each task is
+ * timed from being handed to a connection to its JOB_CREATED, from then to
+ * its first WORK_DATA or WORK_COMPLETE, and from being handed to a
+ * connection to finishing. Times are in microseconds from a monotonic
+ * clock. Without the option tasks are not timed at all.
+ * @param client Client structure previously initialized with
+ *        gearman_client_create or gearman_client_clone.
+ * @param stats NULL to get the first function, or the stats returned by the
+ *        last call to get the next one.
+ * @return The stats for the next function, or NULL when there are no more.
+ */
+GEARMAN_API
+gearman_client_stats_st *gearman_client_stats(gearman_client_st *client,
+                                              gearman_client_stats_st *stats);
+
+/**
+ * Get the function name the stats are for.
+ */
+GEARMAN_API
+const char *gearman_client_stats_function(const gearman_client_stats_st *stats);
+
+/**
+ * Get the number of tasks for the function that finished.
+ */
+GEARMAN_API
+uint64_t gearman_client_stats_count(const gearman_client_stats_st *stats);
+
+/**
+ * Get the number of tasks for the function whose job failed.
+ */
+GEARMAN_API
+uint64_t gearman_client_stats_fail_count(const gearman_client_stats_st *stats);
+
+/**
+ * Get the times from submitting to JOB_CREATED.
+ */
+GEARMAN_API
+const gearman_histogram_st *
+gearman_client_stats_created(const gearman_client_stats_st *stats);
+
+/**
+ * Get the times from JOB_CREATED to the first result packet.
+ */
+GEARMAN_API
+const gearman_histogram_st *
+gearman_client_stats_first_data(const gearman_client_stats_st *stats);
+
+/**
+ * Get the times from submitting to finishing.
+ */
+GEARMAN_API
+const gearman_histogram_st *
+gearman_client_stats_total(const gearman_client_stats_st *stats);
+
+/**
+ * Clear the stats for every function.
+ */
+GEARMAN_API
+void gearman_client_stats_reset(gearman_client_st *client);
+
 /** @} */
 
 /** @} */
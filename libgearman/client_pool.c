@@ -0,0 +1,648 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Client pool definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_client_pool_private Private Client Pool Functions
+ * @ingroup gearman_client_pool
+ * @{
+ */
+
+/**
+ * Queue a request for the I/O thread and wait for it to be done.
+ */
+static gearman_return_t _client_pool_run(gearman_client_pool_st *pool,
+                                         gearman_client_pool_req_st *req);
+
+/**
+ * Main function for the I/O thread.
+ */
+static void *_client_pool_thread(void *data);
+
+/**
+ * Add a queued request to the client as a task.
+ */
+static void _client_pool_add(gearman_client_pool_st *pool,
+                             gearman_client_pool_req_st *req);
+
+/**
+ * Wait for activity on the connections or a new request.
+ */
+static void _client_pool_wait(gearman_client_pool_st *pool);
+
+/**
+ * Fail every request in flight and reset the client and its connections.
+ */
+static void _client_pool_abort(gearman_client_pool_st *pool,
+                               gearman_return_t ret);
+
+/**
+ * Mark a request done and wake the thread waiting on it.
+ */
+static void _client_pool_done(gearman_client_pool_req_st *req,
+                              gearman_return_t ret);
+
+/**
+ * Wake the I/O thread.
+ */
+static void _client_pool_wakeup(gearman_client_pool_st *pool);
+
+/**
+ * Create the descriptor used to wake the I/O thread.
+ */
+static gearman_return_t _client_pool_wakeup_init(gearman_client_pool_st *pool);
+
+/**
+ * Created function for pool tasks.
+ */
+static gearman_return_t _client_pool_created_fn(gearman_task_st *task);
+
+/**
+ * Complete function for pool tasks.
+ */
+static gearman_return_t _client_pool_complete_fn(gearman_task_st *task);
+
+/**
+ * Fail function for pool tasks.
+ */
+static gearman_return_t _client_pool_fail_fn(gearman_task_st *task);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+gearman_client_pool_st *gearman_client_pool_create(gearman_client_pool_st *pool)
+{
+  if (pool == NULL)
+  {
+    pool= malloc(sizeof(gearman_client_pool_st));
+    if (pool == NULL)
+      return NULL;
+
+    pool->options= GEARMAN_CLIENT_POOL_ALLOCATED;
+  }
+  else
+    pool->options= 0;
+
+  pool->shutdown= false;
+  pool->wakeup= false;
+  pool->wakeup_fd[0]= -1;
+  pool->wakeup_fd[1]= -1;
+  pool->pfds_size= 0;
+  pool->pfds= NULL;
+  pool->list= NULL;
+  pool->end= NULL;
+
+  if (gearman_client_create(&(pool->client)) == NULL)
+  {
+    if (pool->options & GEARMAN_CLIENT_POOL_ALLOCATED)
+      free(pool);
+
+    return NULL;
+  }
+
+  gearman_client_set_created_fn(&(pool->client), _client_pool_created_fn);
+  gearman_client_set_complete_fn(&(pool->client), _client_pool_complete_fn);
+  gearman_client_set_fail_fn(&(pool->client), _client_pool_fail_fn);
+
+  return pool;
+}
+
+void gearman_client_pool_free(gearman_client_pool_st *pool)
+{
+  if (pool->options & GEARMAN_CLIENT_POOL_STARTED)
+  {
+    (void) pthread_mutex_lock(&(pool->lock));
+    pool->shutdown= true;
+    (void) pthread_mutex_unlock(&(pool->lock));
+
+    _client_pool_wakeup(pool);
+    (void) pthread_join(pool->id, NULL);
+    (void) pthread_mutex_destroy(&(pool->lock));
+  }
+
+  if (pool->wakeup_fd[0] >= 0)
+  {
+    close(pool->wakeup_fd[0]);
+    if (pool->wakeup_fd[1] != pool->wakeup_fd[0])
+      close(pool->wakeup_fd[1]);
+  }
+
+  if (pool->pfds != NULL)
+    free(pool->pfds);
+
+  gearman_client_free(&(pool->client));
+
+  if (pool->options & GEARMAN_CLIENT_POOL_ALLOCATED)
+    free(pool);
+}
+
+gearman_client_st *gearman_client_pool_client(gearman_client_pool_st *pool)
+{
+  return &(pool->client);
+}
+
+gearman_return_t gearman_client_pool_add_servers(gearman_client_pool_st *pool,
+                                                 const char *servers)
+{
+  return gearman_client_add_servers(&(pool->client), servers);
+}
+
+gearman_return_t gearman_client_pool_start(gearman_client_pool_st *pool)
+{
+  gearman_return_t ret;
+
+  if (pool->options & GEARMAN_CLIENT_POOL_STARTED)
+    return GEARMAN_SUCCESS;
+
+  /* Requests wait until they are done, so their arguments can be packed
+     straight from the caller. */
+  gearman_client_set_options(&(pool->client),
+                             GEARMAN_CLIENT_NON_BLOCKING |
+                             GEARMAN_CLIENT_FREE_TASKS |
+                             GEARMAN_CLIENT_DIRECT_PACK, 1);
+  gearman_client_set_options(&(pool->client), GEARMAN_CLIENT_EPOLL, 0);
+
+  if (pool->wakeup_fd[0] == -1)
+  {
+    ret= _client_pool_wakeup_init(pool);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  if (pthread_mutex_init(&(pool->lock), NULL) != 0)
+  {
+    GEARMAN_ERROR_SET(pool->client.gearman, "gearman_client_pool_start",
+                      "pthread_mutex_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  if (pthread_create(&(pool->id), NULL, _client_pool_thread, pool) != 0)
+  {
+    (void) pthread_mutex_destroy(&(pool->lock));
+    GEARMAN_ERROR_SET(pool->client.gearman, "gearman_client_pool_start",
+                      "pthread_create")
+    return GEARMAN_PTHREAD;
+  }
+
+  pool->options|= GEARMAN_CLIENT_POOL_STARTED;
+
+  return GEARMAN_SUCCESS;
+}
+
+void *gearman_client_pool_do(gearman_client_pool_st *pool,
+                             gearman_job_priority_t priority,
+                             const char *function_name, const char *unique,
+                             const void *workload, size_t workload_size,
+                             size_t *result_size, gearman_return_t *ret_ptr)
+{
+  gearman_client_pool_req_st req;
+
+  req.priority= priority;
+  req.background= false;
+  req.workload_size= workload_size;
+  req.function_name= function_name;
+  req.unique= unique;
+  req.workload= workload;
+  req.job_handle= NULL;
+
+  *ret_ptr= _client_pool_run(pool, &req);
+  if (*ret_ptr != GEARMAN_SUCCESS)
+  {
+    if (req.result != NULL)
+      free(req.result);
+
+    *result_size= 0;
+    return NULL;
+  }
+
+  *result_size= req.result_size;
+  return req.result;
+}
+
+gearman_return_t
+gearman_client_pool_do_background(gearman_client_pool_st *pool,
+                                  gearman_job_priority_t priority,
+                                  const char *function_name,
+                                  const char *unique, const void *workload,
+                                  size_t workload_size, char *job_handle)
+{
+  gearman_client_pool_req_st req;
+
+  req.priority= priority;
+  req.background= true;
+  req.workload_size= workload_size;
+  req.function_name= function_name;
+  req.unique= unique;
+  req.workload= workload;
+  req.job_handle= job_handle;
+
+  return _client_pool_run(pool, &req);
+}
+
+/*
+ * Private definitions
+ */
+
+static gearman_return_t _client_pool_run(gearman_client_pool_st *pool,
+                                         gearman_client_pool_req_st *req)
+{
+  bool wakeup;
+
+  if (!(pool->options & GEARMAN_CLIENT_POOL_STARTED))
+    return GEARMAN_NOT_CONNECTED;
+
+  req->ret= GEARMAN_SUCCESS;
+  req->done= false;
+  req->result_size= 0;
+  req->result= NULL;
+  req->pool= pool;
+  req->next= NULL;
+
+  /* Each request has its own condition, so a finished job only wakes the
+     thread that asked for it. */
+  if (pthread_cond_init(&(req->cond), NULL) != 0)
+    return GEARMAN_PTHREAD;
+
+  (void) pthread_mutex_lock(&(pool->lock));
+
+  if (pool->shutdown)
+  {
+    (void) pthread_mutex_unlock(&(pool->lock));
+    (void) pthread_cond_destroy(&(req->cond));
+    return GEARMAN_SHUTDOWN;
+  }
+
+  if (pool->list == NULL)
+    pool->list= req;
+  else
+    pool->end->next= req;
+  pool->end= req;
+
+  /* Only the first request since the I/O thread last looked needs to wake
+     it, the rest are picked up along with that one. */
+  wakeup= !(pool->wakeup);
+  pool->wakeup= true;
+
+  (void) pthread_mutex_unlock(&(pool->lock));
+
+  if (wakeup)
+    _client_pool_wakeup(pool);
+
+  (void) pthread_mutex_lock(&(pool->lock));
+  while (!(req->done))
+    (void) pthread_cond_wait(&(req->cond), &(pool->lock));
+  (void) pthread_mutex_unlock(&(pool->lock));
+
+  (void) pthread_cond_destroy(&(req->cond));
+
+  return req->ret;
+}
+
+static void *_client_pool_thread(void *data)
+{
+  gearman_client_pool_st *pool= (gearman_client_pool_st *)data;
+  gearman_client_st *client= &(pool->client);
+  gearman_client_pool_req_st *req;
+  gearman_client_pool_req_st *next;
+  gearman_return_t ret;
+  bool shutdown;
+
+  while (1)
+  {
+    (void) pthread_mutex_lock(&(pool->lock));
+    req= pool->list;
+    pool->list= NULL;
+    pool->end= NULL;
+    pool->wakeup= false;
+    shutdown= pool->shutdown;
+    (void) pthread_mutex_unlock(&(pool->lock));
+
+    for (; req != NULL; req= next)
+    {
+      next= req->next;
+      _client_pool_add(pool, req);
+    }
+
+    if (client->running_tasks > 0)
+    {
+      ret= gearman_client_run_tasks(client);
+      if (ret != GEARMAN_SUCCESS && ret != GEARMAN_IO_WAIT)
+        _client_pool_abort(pool, ret);
+    }
+
+    /* Requests are turned away once shutdown is set, so this only waits for
+       the ones taken before it. */
+    if (shutdown && client->running_tasks == 0)
+      break;
+
+    _client_pool_wait(pool);
+  }
+
+  return NULL;
+}
+
+static void _client_pool_add(gearman_client_pool_st *pool,
+                             gearman_client_pool_req_st *req)
+{
+  gearman_client_st *client= &(pool->client);
+  gearman_task_st *task;
+  gearman_return_t ret;
+
+  switch (req->priority)
+  {
+  case GEARMAN_JOB_PRIORITY_HIGH:
+    if (req->background)
+    {
+      task= gearman_client_add_task_high_background(client, NULL, req,
+                                                    req->function_name,
+                                                    req->unique,
+                                                    req->workload,
+                                                    req->workload_size, &ret);
+    }
+    else
+    {
+      task= gearman_client_add_task_high(client, NULL, req,
+                                         req->function_name, req->unique,
+                                         req->workload, req->workload_size,
+                                         &ret);
+    }
+    break;
+
+  case GEARMAN_JOB_PRIORITY_LOW:
+    if (req->background)
+    {
+      task= gearman_client_add_task_low_background(client, NULL, req,
+                                                   req->function_name,
+                                                   req->unique,
+                                                   req->workload,
+                                                   req->workload_size, &ret);
+    }
+    else
+    {
+      task= gearman_client_add_task_low(client, NULL, req,
+                                        req->function_name, req->unique,
+                                        req->workload, req->workload_size,
+                                        &ret);
+    }
+    break;
+
+  case GEARMAN_JOB_PRIORITY_NORMAL:
+  case GEARMAN_JOB_PRIORITY_MAX:
+  default:
+    if (req->background)
+    {
+      task= gearman_client_add_task_background(client, NULL, req,
+                                               req->function_name,
+                                               req->unique, req->workload,
+                                               req->workload_size, &ret);
+    }
+    else
+    {
+      task= gearman_client_add_task(client, NULL, req, req->function_name,
+                                    req->unique, req->workload,
+                                    req->workload_size, &ret);
+    }
+    break;
+  }
+
+  if (ret != GEARMAN_SUCCESS)
+  {
+    if (task != NULL)
+      gearman_task_free(task);
+
+    _client_pool_done(req, ret);
+  }
+}
+
+static void _client_pool_wait(gearman_client_pool_st *pool)
+{
+  gearman_st *gearman= pool->client.gearman;
+  gearman_con_st *con;
+  struct pollfd *pfds;
+  nfds_t x;
+  ssize_t read_size;
+  uint64_t value;
+  gearman_return_t ret;
+
+  if (pool->pfds_size < gearman->con_count + 1)
+  {
+    pfds= realloc(pool->pfds,
+                  (gearman->con_count + 1) * sizeof(struct pollfd));
+    if (pfds == NULL)
+    {
+      GEARMAN_ERROR_SET(gearman, "_client_pool_wait", "realloc")
+      _client_pool_abort(pool, GEARMAN_MEMORY_ALLOCATION_FAILURE);
+      return;
+    }
+
+    pool->pfds= pfds;
+    pool->pfds_size= gearman->con_count + 1;
+  }
+  else
+    pfds= pool->pfds;
+
+  pfds[0].fd= pool->wakeup_fd[0];
+  pfds[0].events= POLLIN;
+  pfds[0].revents= 0;
+
+  x= 1;
+  for (con= gearman->con_list; con != NULL; con= con->next)
+  {
+    if (con->events == 0)
+      continue;
+
+    pfds[x].fd= con->fd;
+    pfds[x].events= con->events;
+    pfds[x].revents= 0;
+    x++;
+  }
+
+  while (poll(pfds, x, -1) == -1)
+  {
+    if (errno != EINTR)
+    {
+      GEARMAN_ERROR_SET(gearman, "_client_pool_wait", "poll:%d", errno)
+      gearman->last_errno= errno;
+      _client_pool_abort(pool, GEARMAN_ERRNO);
+      return;
+    }
+  }
+
+  /* An eventfd is cleared with one read, and a pipe may need a few. */
+  if (pfds[0].revents != 0)
+  {
+    do
+    {
+      read_size= read(pool->wakeup_fd[0], &value, sizeof(value));
+    }
+    while (read_size > 0 && pool->wakeup_fd[0] != pool->wakeup_fd[1]);
+  }
+
+  x= 1;
+  for (con= gearman->con_list; con != NULL; con= con->next)
+  {
+    if (con->events == 0)
+      continue;
+
+    ret= gearman_con_set_revents(con, pfds[x].revents);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      _client_pool_abort(pool, ret);
+      return;
+    }
+
+    x++;
+  }
+}
+
+static void _client_pool_abort(gearman_client_pool_st *pool,
+                               gearman_return_t ret)
+{
+  gearman_client_st *client= &(pool->client);
+  gearman_task_st *task;
+  gearman_con_st *con;
+
+  /* Finished tasks are freed as they finish, so every task left still has a
+     thread waiting on it. */
+  for (task= client->gearman->task_list; task != NULL; task= task->next)
+    _client_pool_done((gearman_client_pool_req_st *)gearman_task_fn_arg(task),
+                      ret);
+
+  gearman_client_task_free_all(client);
+  client->state= GEARMAN_CLIENT_STATE_IDLE;
+  client->options&= (gearman_client_options_t)~GEARMAN_CLIENT_NO_NEW;
+
+  for (con= client->gearman->con_list; con != NULL; con= con->next)
+  {
+    if (con->options & GEARMAN_CON_PACKET_IN_USE)
+    {
+      gearman_packet_free(&(con->packet));
+      con->options&= (gearman_con_options_t)~GEARMAN_CON_PACKET_IN_USE;
+    }
+
+    gearman_con_close(con);
+    con->task_send= NULL;
+  }
+}
+
+static void _client_pool_done(gearman_client_pool_req_st *req,
+                              gearman_return_t ret)
+{
+  gearman_client_pool_st *pool= req->pool;
+
+  (void) pthread_mutex_lock(&(pool->lock));
+  req->ret= ret;
+  req->done= true;
+  (void) pthread_cond_signal(&(req->cond));
+  (void) pthread_mutex_unlock(&(pool->lock));
+}
+
+static void _client_pool_wakeup(gearman_client_pool_st *pool)
+{
+  uint64_t value= 1;
+
+  /* As with the server thread wakeup, the same write works for an eventfd or
+     a pipe. */
+  if (write(pool->wakeup_fd[1], &value, sizeof(value)) != sizeof(value))
+  {
+    GEARMAN_ERROR_SET(pool->client.gearman, "_client_pool_wakeup", "write:%d",
+                      errno)
+  }
+}
+
+static gearman_return_t _client_pool_wakeup_init(gearman_client_pool_st *pool)
+{
+  int ret;
+
+#ifdef HAVE_SYS_EVENTFD_H
+  ret= eventfd(0, EFD_NONBLOCK);
+  if (ret == -1)
+  {
+    GEARMAN_ERROR_SET(pool->client.gearman, "_client_pool_wakeup_init",
+                      "eventfd:%d", errno)
+    return GEARMAN_ERRNO;
+  }
+
+  pool->wakeup_fd[0]= ret;
+  pool->wakeup_fd[1]= ret;
+#else
+  if (pipe(pool->wakeup_fd) == -1)
+  {
+    GEARMAN_ERROR_SET(pool->client.gearman, "_client_pool_wakeup_init",
+                      "pipe:%d", errno)
+    return GEARMAN_ERRNO;
+  }
+
+  ret= fcntl(pool->wakeup_fd[0], F_GETFL, 0);
+  if (ret == -1 || fcntl(pool->wakeup_fd[0], F_SETFL, ret | O_NONBLOCK) == -1)
+  {
+    GEARMAN_ERROR_SET(pool->client.gearman, "_client_pool_wakeup_init",
+                      "fcntl:%d", errno)
+    close(pool->wakeup_fd[0]);
+    close(pool->wakeup_fd[1]);
+    pool->wakeup_fd[0]= -1;
+    pool->wakeup_fd[1]= -1;
+    return GEARMAN_ERRNO;
+  }
+#endif
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _client_pool_created_fn(gearman_task_st *task)
+{
+  gearman_client_pool_req_st *req;
+
+  req= (gearman_client_pool_req_st *)gearman_task_fn_arg(task);
+
+  /* A background job is done once it exists. */
+  if (req->background)
+  {
+    if (req->job_handle != NULL)
+      strcpy(req->job_handle, gearman_task_job_handle(task));
+
+    _client_pool_done(req, GEARMAN_SUCCESS);
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _client_pool_complete_fn(gearman_task_st *task)
+{
+  gearman_client_pool_req_st *req;
+
+  req= (gearman_client_pool_req_st *)gearman_task_fn_arg(task);
+
+  /* The waiting thread is the only one that looks at these until the request
+     is marked done. */
+  req->result= gearman_task_take_data(task, &(req->result_size));
+  _client_pool_done(req, GEARMAN_SUCCESS);
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _client_pool_fail_fn(gearman_task_st *task)
+{
+  _client_pool_done((gearman_client_pool_req_st *)gearman_task_fn_arg(task),
+                    GEARMAN_WORK_FAIL);
+
+  return GEARMAN_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Client pool declarations
+ */
+
+#ifndef __GEARMAN_CLIENT_POOL_H__
+#define __GEARMAN_CLIENT_POOL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_client_pool Client Pool Interface
+ * @ingroup gearman_client
+ * This is the interface for running jobs from many threads over one shared
+ * set of server connections. The pool owns a client that only its I/O thread
+ * uses. Other threads queue requests to it, and the I/O thread adds them as
+ * tasks, runs them together with everything else in flight, and wakes each
+ * waiting thread when its own job is done. Only gearman_client_pool_do and
+ * gearman_client_pool_do_background may be called from more than one thread,
+ * and only between gearman_client_pool_start and gearman_client_pool_free.
+ *
+ * If running the tasks fails on a connection, every request in flight fails
+ * with that error and all connections are closed, to be opened again by the
+ * next request.
+ * @{
+ */
+
+/**
+ * Initialize a client pool structure. The I/O thread is not started yet.
+ * @param pool Caller allocated pool structure, or NULL to allocate one.
+ * @return Pointer to an allocated pool structure if pool parameter was NULL,
+ *         or the pool parameter pointer if it was not NULL. NULL on failure.
+ */
+GEARMAN_API
+gearman_client_pool_st *gearman_client_pool_create(gearman_client_pool_st *pool);
+
+/**
+ * Stop the I/O thread once the requests already queued have finished, and
+ * free resources used by a pool structure. No other thread may use the pool
+ * once this is called.
+ * @param pool Pool structure previously initialized with
+ *        gearman_client_pool_create.
+ */
+GEARMAN_API
+void gearman_client_pool_free(gearman_client_pool_st *pool);
+
+/**
+ * Get the client the I/O thread runs, to add servers or change options
+ * before the pool is started. The non-blocking, free tasks, and direct pack
+ * options are always set, and the epoll option is turned off when the pool
+ * starts since the I/O thread waits on the connections itself.
+ */
+GEARMAN_API
+gearman_client_st *gearman_client_pool_client(gearman_client_pool_st *pool);
+
+/**
+ * Add a list of job servers to the pool. See gearman_client_add_servers for
+ * the format. This must be called before the pool is started.
+ */
+GEARMAN_API
+gearman_return_t gearman_client_pool_add_servers(gearman_client_pool_st *pool,
+                                                 const char *servers);
+
+/**
+ * Start the I/O thread.
+ * @param pool Pool structure previously initialized with
+ *        gearman_client_pool_create.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_client_pool_start(gearman_client_pool_st *pool);
+
+/**
+ * Run a job through the pool and wait for its result. This is safe to call
+ * from any number of threads at once. The arguments are not copied, and only
+ * need to stay valid until this returns. Intermediate data, warnings, and
+ * status updates are not reported.
+ * @param pool Pool structure previously started with
+ *        gearman_client_pool_start.
+ * @param priority Priority to submit the job with.
+ * @param function_name The name of the function to run.
+ * @param unique Optional unique job identifier, or NULL for a new UUID.
+ * @param workload The workload to pass to the function when it is run.
+ * @param workload_size Size of the workload.
+ * @param result_size The size of the data being returned.
+ * @param ret_ptr Standard gearman return value. GEARMAN_WORK_FAIL is returned
+ *        if the job failed.
+ * @return The result data to be freed by the caller, or NULL.
+ */
+GEARMAN_API
+void *gearman_client_pool_do(gearman_client_pool_st *pool,
+                             gearman_job_priority_t priority,
+                             const char *function_name, const char *unique,
+                             const void *workload, size_t workload_size,
+                             size_t *result_size, gearman_return_t *ret_ptr);
+
+/**
+ * Run a job in the background through the pool, waiting only for the job to
+ * be created. This is safe to call from any number of threads at once.
+ * @param pool Pool structure previously started with
+ *        gearman_client_pool_start.
+ * @param priority Priority to submit the job with.
+ * @param function_name The name of the function to run.
+ * @param unique Optional unique job identifier, or NULL for a new UUID.
+ * @param workload The workload to pass to the function when it is run.
+ * @param workload_size Size of the workload.
+ * @param job_handle A buffer to store the job handle in. Must be at least
+ *        GEARMAN_JOB_HANDLE_SIZE bytes long, or NULL.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t
+gearman_client_pool_do_background(gearman_client_pool_st *pool,
+                                  gearman_job_priority_t priority,
+                                  const char *function_name,
+                                  const char *unique, const void *workload,
+                                  size_t workload_size, char *job_handle);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_CLIENT_POOL_H__ */
@@ -30,6 +30,11 @@
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
 #endif
@@ -51,6 +56,21 @@
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
 #ifdef HAVE_SYS_UTSNAME_H
 #include <sys/utsname.h>
 #endif
@@ -75,6 +95,8 @@
 # endif
 #endif
 
+#include "probes.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -174,7 +196,10 @@ extern "C" {
  */
 #define GEARMAN_SERVER_THREAD_LOCK(__thread) { \
   if ((__thread)->server->thread_count > 1) \
-    (void) pthread_mutex_lock(&((__thread)->lock)); \
+  { \
+    GEARMAN_SERVER_LOCK((__thread)->server, &((__thread)->lock), \
+                        &((__thread)->lock_stats)) \
+  } \
 }
 
 /**
@@ -183,7 +208,55 @@ extern "C" {
  */
 #define GEARMAN_SERVER_THREAD_UNLOCK(__thread) { \
   if ((__thread)->server->thread_count > 1) \
-    (void) pthread_mutex_unlock(&((__thread)->lock)); \
+  { \
+    GEARMAN_SERVER_UNLOCK((__thread)->server, &((__thread)->lock), \
+                          &((__thread)->lock_stats)) \
+  } \
+}
+
+/**
+ * Take a server lock, keeping stats for it if the server was asked to.
+ * @ingroup gearman_server_lock
+ */
+#define GEARMAN_SERVER_LOCK(__server, __mutex, __stats) { \
+  if ((__server)->options & GEARMAN_SERVER_LOCK_STATS) \
+    gearman_server_lock_acquire(__mutex, __stats); \
+  else \
+    (void) pthread_mutex_lock(__mutex); \
+}
+
+/**
+ * Release a lock taken with GEARMAN_SERVER_LOCK.
+ * @ingroup gearman_server_lock
+ */
+#define GEARMAN_SERVER_UNLOCK(__server, __mutex, __stats) { \
+  if ((__server)->options & GEARMAN_SERVER_LOCK_STATS) \
+    gearman_server_lock_release(__mutex, __stats); \
+  else \
+    (void) pthread_mutex_unlock(__mutex); \
+}
+
+/**
+ * Lock the persistent queue only if more than one shard processing thread, or
+ * a background replay thread, may be calling into it.
+ */
+#define GEARMAN_SERVER_QUEUE_LOCK(__server) { \
+  if (((__server)->shard_count > 1 || (__server)->queue_shared) && \
+      (__server)->options & GEARMAN_SERVER_PROC_THREAD) \
+  { \
+    (void) pthread_mutex_lock(&((__server)->queue_lock)); \
+  } \
+}
+
+/**
+ * Unlock the persistent queue only if it was locked.
+ */
+#define GEARMAN_SERVER_QUEUE_UNLOCK(__server) { \
+  if (((__server)->shard_count > 1 || (__server)->queue_shared) && \
+      (__server)->options & GEARMAN_SERVER_PROC_THREAD) \
+  { \
+    (void) pthread_mutex_unlock(&((__server)->queue_lock)); \
+  } \
 }
 
 /**
@@ -237,6 +310,39 @@ extern "C" {
   __list ## _count--; \
 }
 
+/**
+ * Push an object onto a lock-free queue. Any number of threads may push at
+ * once. Objects go on the __queue ## _stack end, and __next is set to the
+ * object that was there before, so NULL means the queue was empty.
+ * @ingroup gearman_constants
+ */
+#define GEARMAN_SERVER_QUEUE_PUSH(__queue, __obj, __prefix, __next) { \
+  do \
+  { \
+    __next= __queue ## _stack; \
+    __obj->__prefix ## next= __next; \
+  } while (!__sync_bool_compare_and_swap(&(__queue ## _stack), __next, \
+                                         __obj)); \
+}
+
+/**
+ * Move everything pushed onto a lock-free queue to the __queue ## _list end,
+ * in the order it was pushed. Only the one thread consuming the queue may use
+ * that end, and only when it is empty. Objects are taken all at once, so
+ * there is no ABA problem with the push above.
+ * @ingroup gearman_constants
+ */
+#define GEARMAN_SERVER_QUEUE_TAKE(__queue, __obj, __next, __prefix) { \
+  __obj= __sync_lock_test_and_set(&(__queue ## _stack), NULL); \
+  while (__obj != NULL) \
+  { \
+    __next= __obj->__prefix ## next; \
+    __obj->__prefix ## next= __queue ## _list; \
+    __queue ## _list= __obj; \
+    __obj= __next; \
+  } \
+}
+
 /**
  * Add an object to a hash.
  * @ingroup gearman_constants
@@ -264,6 +370,31 @@ extern "C" {
   __hash ## _count--; \
 }
 
+/**
+ * Add an object to the head of a hash bucket.
+ * @ingroup gearman_constants
+ */
+#define GEARMAN_BUCKET_ADD(__bucket, __obj, __prefix) { \
+  if ((__bucket) != NULL) \
+    (__bucket)->__prefix ## prev= __obj; \
+  __obj->__prefix ## next= (__bucket); \
+  __obj->__prefix ## prev= NULL; \
+  (__bucket)= __obj; \
+}
+
+/**
+ * Delete an object from a hash bucket.
+ * @ingroup gearman_constants
+ */
+#define GEARMAN_BUCKET_DEL(__bucket, __obj, __prefix) { \
+  if ((__bucket) == __obj) \
+    (__bucket)= __obj->__prefix ## next; \
+  if (__obj->__prefix ## prev != NULL) \
+    __obj->__prefix ## prev->__prefix ## next= __obj->__prefix ## next; \
+  if (__obj->__prefix ## next != NULL) \
+    __obj->__prefix ## next->__prefix ## prev= __obj->__prefix ## prev; \
+}
+
 /* All thread-safe libevent functions are not in libevent 1.3x, and this is the
    common package version. Make this work for these earlier versions. */
 #ifndef HAVE_EVENT_BASE_NEW
@@ -293,6 +424,136 @@ GEARMAN_LOCAL
 gearman_return_t gearman_parse_servers(const char *servers, void *data,
                                        gearman_parse_server_fn *server_fn);
 
+/**
+ * Queue a task to be submitted once a connection is free. Tasks are
+ * submitted in the order they were queued.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+void gearman_task_queue_new(gearman_task_st *task);
+
+/**
+ * Queue a task on its connection to wait for a JOB_CREATED packet. The
+ * server answers submissions in order, so the packet belongs to the oldest
+ * task in this queue.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+void gearman_task_queue_created(gearman_task_st *task);
+
+/**
+ * Take a task off the new task or JOB_CREATED queue it is in, if any.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+void gearman_task_dequeue(gearman_task_st *task);
+
+/**
+ * Add a task to the job handle hash so result packets can find it. A failure
+ * to grow the hash only makes the chains longer.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+void gearman_task_hash_add(gearman_task_st *task);
+
+/**
+ * Delete a task from the job handle hash, if it is there.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+void gearman_task_hash_del(gearman_task_st *task);
+
+/**
+ * Find the task a result packet for a job handle belongs to. Status replies
+ * only go to status requests, and other results only go to submitted jobs.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+gearman_task_st *gearman_task_hash_find(gearman_con_st *con,
+                                        const char *job_handle, bool status);
+
+/**
+ * Add at least count tasks to the pool that gearman_task_create takes from
+ * when no task structure is given.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+gearman_return_t gearman_task_reserve(gearman_st *gearman, uint32_t count);
+
+/**
+ * Free the memory behind the task pool. Every pooled task must have been
+ * freed first.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+void gearman_task_pool_free(gearman_st *gearman);
+
+/**
+ * Take the tasks still waiting on a connection off it before it is freed.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+void gearman_task_con_free(gearman_con_st *con);
+
+/**
+ * Find the registered function a job is for.
+ * @ingroup gearman_private
+ * @return The function, or NULL if none has that name.
+ */
+GEARMAN_LOCAL
+gearman_worker_function_st *
+gearman_worker_function_find(gearman_worker_st *worker,
+                             const char *function_name);
+
+/**
+ * Get a monotonic timestamp in microseconds.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+uint64_t gearman_time_now(void);
+
+/**
+ * Hash function used for server job handles, unique IDs, and function names.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+uint32_t gearman_server_hash(const char *key, size_t key_size);
+
+/**
+ * 64-bit hash function used for server job handles and unique IDs, including
+ * whole workloads when the unique ID is '-'. This reads eight bytes at a time
+ * and uses the SSE4.2 CRC32 instruction when the CPU has it, so the value is
+ * only stable within one process.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+uint64_t gearman_server_hash64(const char *key, size_t key_size);
+
+/**
+ * Compress data in the LZ4 block format.
+ * @ingroup gearman_private
+ * @return Size of the compressed data, or 0 if it does not fit in the buffer.
+ */
+GEARMAN_LOCAL
+size_t gearman_compress(const void *data, size_t data_size, void *buffer,
+                        size_t buffer_size);
+
+/**
+ * Decompress data in the LZ4 block format.
+ * @ingroup gearman_private
+ * @return Whether the data was valid and filled the buffer exactly.
+ */
+GEARMAN_LOCAL
+bool gearman_decompress(const void *data, size_t data_size, void *buffer,
+                        size_t buffer_size);
+
+/**
+ * Switch a connection to or from the shared memory transport.
+ * @ingroup gearman_private
+ */
+GEARMAN_LOCAL
+void gearman_protocol_shm_con_set(gearman_con_st *con, bool shm);
+
 #ifdef __cplusplus
 }
 #endif
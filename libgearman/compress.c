@@ -0,0 +1,261 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Payload compression definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_compress_private Private Compression Functions
+ * @ingroup gearman_packet
+ * @{
+ */
+
+/* Everything after the last match must be literals, and the last match has to
+   start at least this far from the end, as in the LZ4 block format. */
+#define GEARMAN_COMPRESS_LAST_LITERALS 5
+#define GEARMAN_COMPRESS_MATCH_LIMIT 12
+#define GEARMAN_COMPRESS_MIN_MATCH 4
+#define GEARMAN_COMPRESS_MAX_OFFSET 65535
+#define GEARMAN_COMPRESS_HASH_BITS 12
+
+/**
+ * Hash the four bytes at a position for the match table.
+ */
+static inline uint32_t _compress_hash(const uint8_t *ptr);
+
+/**
+ * Write a length continued past the four bits in a token.
+ */
+static inline uint8_t *_compress_length(uint8_t *ptr, size_t length);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+size_t gearman_compress(const void *data, size_t data_size, void *buffer,
+                        size_t buffer_size)
+{
+  uint32_t table[1 << GEARMAN_COMPRESS_HASH_BITS];
+  const uint8_t *start= (const uint8_t *)data;
+  const uint8_t *end= start + data_size;
+  const uint8_t *ptr= start;
+  const uint8_t *anchor= start;
+  const uint8_t *match;
+  uint8_t *out= (uint8_t *)buffer;
+  uint8_t *out_end= out + buffer_size;
+  uint8_t *token;
+  uint32_t hash;
+  uint32_t value;
+  size_t literals;
+  size_t length;
+
+  memset(table, 0, sizeof(table));
+
+  if (data_size > GEARMAN_COMPRESS_MATCH_LIMIT)
+  {
+    while (ptr < end - GEARMAN_COMPRESS_MATCH_LIMIT)
+    {
+      memcpy(&value, ptr, 4);
+      hash= _compress_hash(ptr);
+      match= start + table[hash];
+      table[hash]= (uint32_t)(ptr - start);
+
+      if (match >= ptr || ptr - match > GEARMAN_COMPRESS_MAX_OFFSET ||
+          memcmp(match, &value, 4))
+      {
+        ptr++;
+        continue;
+      }
+
+      /* Take in any earlier bytes that match too. */
+      while (ptr > anchor && match > start && ptr[-1] == match[-1])
+      {
+        ptr--;
+        match--;
+      }
+
+      length= GEARMAN_COMPRESS_MIN_MATCH;
+      while (ptr + length < end - GEARMAN_COMPRESS_LAST_LITERALS &&
+             ptr[length] == match[length])
+      {
+        length++;
+      }
+
+      literals= (size_t)(ptr - anchor);
+      if ((size_t)(out_end - out) < literals + (literals / 255) +
+                                    (length / 255) + 5)
+      {
+        return 0;
+      }
+
+      token= out++;
+      if (literals >= 15)
+      {
+        *token= 15 << 4;
+        out= _compress_length(out, literals - 15);
+      }
+      else
+        *token= (uint8_t)(literals << 4);
+
+      memcpy(out, anchor, literals);
+      out+= literals;
+
+      *out++= (uint8_t)(ptr - match);
+      *out++= (uint8_t)((ptr - match) >> 8);
+
+      length-= GEARMAN_COMPRESS_MIN_MATCH;
+      if (length >= 15)
+      {
+        *token|= 15;
+        out= _compress_length(out, length - 15);
+      }
+      else
+        *token|= (uint8_t)length;
+
+      ptr+= length + GEARMAN_COMPRESS_MIN_MATCH;
+      anchor= ptr;
+
+      if (ptr < end - GEARMAN_COMPRESS_MATCH_LIMIT)
+        table[_compress_hash(ptr - 2)]= (uint32_t)(ptr - 2 - start);
+    }
+  }
+
+  /* The rest goes in as literals. */
+  literals= (size_t)(end - anchor);
+  if ((size_t)(out_end - out) < literals + (literals / 255) + 2)
+    return 0;
+
+  token= out++;
+  if (literals >= 15)
+  {
+    *token= 15 << 4;
+    out= _compress_length(out, literals - 15);
+  }
+  else
+    *token= (uint8_t)(literals << 4);
+
+  memcpy(out, anchor, literals);
+  out+= literals;
+
+  return (size_t)(out - (uint8_t *)buffer);
+}
+
+bool gearman_decompress(const void *data, size_t data_size, void *buffer,
+                        size_t buffer_size)
+{
+  const uint8_t *ptr= (const uint8_t *)data;
+  const uint8_t *end= ptr + data_size;
+  uint8_t *out= (uint8_t *)buffer;
+  uint8_t *out_end= out + buffer_size;
+  const uint8_t *match;
+  size_t length;
+  size_t offset;
+  uint8_t token;
+  uint8_t byte;
+
+  while (ptr < end)
+  {
+    token= *ptr++;
+
+    length= token >> 4;
+    if (length == 15)
+    {
+      do
+      {
+        if (ptr == end)
+          return false;
+        byte= *ptr++;
+        length+= byte;
+      } while (byte == 255);
+    }
+
+    if (length > (size_t)(end - ptr) || length > (size_t)(out_end - out))
+      return false;
+
+    memcpy(out, ptr, length);
+    out+= length;
+    ptr+= length;
+
+    /* The last sequence has no match. */
+    if (ptr == end)
+      break;
+
+    if (end - ptr < 2)
+      return false;
+
+    offset= (size_t)ptr[0] | ((size_t)ptr[1] << 8);
+    ptr+= 2;
+    if (offset == 0 || offset > (size_t)(out - (uint8_t *)buffer))
+      return false;
+
+    length= token & 15;
+    if (length == 15)
+    {
+      do
+      {
+        if (ptr == end)
+          return false;
+        byte= *ptr++;
+        length+= byte;
+      } while (byte == 255);
+    }
+
+    length+= GEARMAN_COMPRESS_MIN_MATCH;
+    if (length > (size_t)(out_end - out))
+      return false;
+
+    match= out - offset;
+    if (offset >= length)
+    {
+      memcpy(out, match, length);
+      out+= length;
+    }
+    else
+    {
+      /* Overlapping matches repeat the bytes just written. */
+      while (length-- > 0)
+        *out++= *match++;
+    }
+  }
+
+  return out == out_end;
+}
+
+/*
+ * Private definitions
+ */
+
+static inline uint32_t _compress_hash(const uint8_t *ptr)
+{
+  uint32_t value;
+
+  memcpy(&value, ptr, 4);
+  return (value * 2654435761U) >> (32 - GEARMAN_COMPRESS_HASH_BITS);
+}
+
+static inline uint8_t *_compress_length(uint8_t *ptr, size_t length)
+{
+  while (length >= 255)
+  {
+    *ptr++= 255;
+    length-= 255;
+  }
+
+  *ptr++= (uint8_t)length;
+  return ptr;
+}
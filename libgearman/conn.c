@@ -28,6 +28,119 @@
  */
 static gearman_return_t _con_setsockopt(gearman_con_st *con);
 
+/**
+ * Get the socket path if a host names a Unix domain socket, either as an
+ * absolute path or with a "unix:" prefix.
+ */
+static const char *_con_unix_path(const char *host);
+
+/**
+ * Build the address list for a Unix domain socket path. This is a single
+ * allocation so it can be released with _con_free_addrinfo.
+ */
+static gearman_return_t _con_addrinfo_unix(gearman_con_st *con,
+                                           const char *path);
+
+/**
+ * Free an address list from getaddrinfo or _con_addrinfo_unix.
+ */
+static void _con_free_addrinfo(struct addrinfo *addrinfo);
+
+/**
+ * Take a buffer from a pool if it is the pool size and one is free, otherwise
+ * allocate it.
+ */
+static uint8_t *_con_buffer_take(void **list, uint32_t *count,
+                                 size_t pool_size, size_t size);
+
+/**
+ * Give a buffer back to a pool, or free it if it is not the pool size or the
+ * pool is full.
+ */
+static void _con_buffer_give(void **list, uint32_t *count, size_t pool_size,
+                             uint8_t *buffer, size_t size);
+
+/**
+ * Get the largest size a buffer may grow to.
+ */
+static size_t _con_buffer_max(size_t pool_size);
+
+/**
+ * Replace the send buffer of a connection with an empty one that holds at
+ * least size bytes. This must only be called while the send buffer is empty.
+ */
+static gearman_return_t _con_send_buffer_get(gearman_con_st *con,
+                                             size_t size);
+
+/**
+ * Give the send buffer of a connection back to the pool once it is empty.
+ */
+static void _con_send_buffer_release(gearman_con_st *con);
+
+/**
+ * Make sure a connection has a receive buffer that holds at least size bytes,
+ * keeping anything that is already buffered.
+ */
+static gearman_return_t _con_recv_buffer_get(gearman_con_st *con,
+                                             size_t size);
+
+/**
+ * Give the receive buffer of a connection back to the pool once it is empty.
+ */
+static void _con_recv_buffer_release(gearman_con_st *con);
+
+/**
+ * Write the chunks of a packet's data straight from the caller's memory with
+ * writev, picking up at send_data_offset after a partial write.
+ */
+static gearman_return_t _con_send_iov_data(gearman_con_st *con,
+                                           gearman_packet_st *packet);
+
+/**
+ * Ask for compression ahead of the first packet on a new connection, then
+ * compress or decompress the data of a packet to match what the peer
+ * accepts.
+ */
+static gearman_return_t _con_send_compression(gearman_con_st *con,
+                                              gearman_packet_st *packet);
+
+/**
+ * See if a packet is the reply to a compression request, recording the
+ * outcome if it is.
+ * @return Whether the packet was the reply, and should not be returned.
+ */
+static bool _con_recv_compression(gearman_con_st *con,
+                                  gearman_packet_st *packet);
+
+/**
+ * Remove a connection from the ready list if it is on it.
+ */
+static void _con_ready_remove(gearman_con_st *con);
+
+/**
+ * Tell the event watch callback or epoll about the events a connection is
+ * now waiting for.
+ */
+static gearman_return_t _con_events_update(gearman_con_st *con);
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Make the epoll registration for a connection match the events it is
+ * waiting for.
+ */
+static gearman_return_t _con_epoll_watch(gearman_con_st *con);
+
+/**
+ * Drop the epoll registration for a connection before its socket is closed.
+ */
+static void _con_epoll_remove(gearman_con_st *con);
+
+/**
+ * Wait for connection activity with epoll.
+ */
+static gearman_return_t _con_epoll_wait(gearman_st *gearman, int timeout);
+#endif
+
 /** @} */
 
 /*
@@ -69,23 +182,43 @@ gearman_con_st *gearman_con_create(gearman_st *gearman, gearman_con_st *con)
   con->port= 0;
   con->events= 0;
   con->revents= 0;
+  con->watch_events= 0;
   con->fd= -1;
   con->created_id= 0;
   con->created_id_next= 0;
+  con->weight= 1;
+  con->error_count= 0;
+  con->close_count= 0;
+  con->grab_quantum= 1;
+  con->grab_deficit= 0;
+  con->grab_count= 0;
+  con->slots= 0;
+  con->rtt_id= 0;
+  con->rtt= 0;
+  con->rtt_start= 0;
+  con->retry_time= 0;
   con->send_buffer_size= 0;
+  con->send_buffer_alloc= 0;
   con->send_data_size= 0;
   con->send_data_offset= 0;
   con->recv_buffer_size= 0;
+  con->recv_buffer_alloc= 0;
   con->recv_data_size= 0;
   con->recv_data_offset= 0;
   con->gearman= gearman;
   GEARMAN_LIST_ADD(gearman->con, con,)
+  con->ready_next= NULL;
   con->data= NULL;
   con->addrinfo= NULL;
   con->addrinfo_next= NULL;
-  con->send_buffer_ptr= con->send_buffer;
+  con->send_buffer_ptr= NULL;
   con->recv_packet= NULL;
-  con->recv_buffer_ptr= con->recv_buffer;
+  con->task_send= NULL;
+  con->task_recv= NULL;
+  con->task_created_list= NULL;
+  con->task_created_end= NULL;
+  con->recv_buffer_ptr= NULL;
+  con->recv_data_ptr= NULL;
   con->protocol_data= NULL;
   con->protocol_data_free_fn= NULL;
   con->recv_fn= NULL;
@@ -94,7 +227,9 @@ gearman_con_st *gearman_con_create(gearman_st *gearman, gearman_con_st *con)
   con->send_data_fn= NULL;
   con->packet_pack_fn= gearman_packet_pack;
   con->packet_unpack_fn= gearman_packet_unpack;
-  con->host[0]= 0;
+  con->host= NULL;
+  con->send_buffer= NULL;
+  con->recv_buffer= NULL;
 
   return con;
 }
@@ -107,9 +242,18 @@ gearman_con_st *gearman_con_clone(gearman_st *gearman, gearman_con_st *con,
     return NULL;
 
   con->options|= (from->options &
-                  (gearman_con_options_t)~GEARMAN_CON_ALLOCATED);
-  strcpy(con->host, from->host);
+                  (gearman_con_options_t)~(GEARMAN_CON_ALLOCATED |
+                                           GEARMAN_CON_READY |
+                                           GEARMAN_CON_WATCHED |
+                                           GEARMAN_CON_SEND_MORE |
+                                           GEARMAN_CON_COMPRESSION |
+                                           GEARMAN_CON_COMPRESSION_WAIT |
+                                           GEARMAN_CON_SHM |
+                                           GEARMAN_CON_ABANDON));
+  if (from->host != NULL)
+    gearman_con_set_host(con, from->host);
   con->port= from->port;
+  con->weight= from->weight;
 
   return con;
 }
@@ -124,11 +268,23 @@ void gearman_con_free(gearman_con_st *con)
   if (con->protocol_data != NULL && con->protocol_data_free_fn != NULL)
     (*con->protocol_data_free_fn)(con, con->protocol_data);
 
+  gearman_task_con_free(con);
+
+  _con_ready_remove(con);
   GEARMAN_LIST_DEL(con->gearman->con, con,)
 
   if (con->options & GEARMAN_CON_PACKET_IN_USE)
     gearman_packet_free(&(con->packet));
 
+  /* Anything left unsent or unread is dropped along with the connection. */
+  con->send_buffer_size= 0;
+  con->recv_buffer_size= 0;
+  _con_send_buffer_release(con);
+  _con_recv_buffer_release(con);
+
+  if (con->host != NULL)
+    free(con->host);
+
   if (con->options & GEARMAN_CON_ALLOCATED)
     free(con);
 }
@@ -137,9 +293,15 @@ void gearman_con_set_host(gearman_con_st *con, const char *host)
 {
   gearman_con_reset_addrinfo(con);
 
-  strncpy(con->host, host == NULL ? GEARMAN_DEFAULT_TCP_HOST : host,
-          NI_MAXHOST);
-  con->host[NI_MAXHOST - 1]= 0;
+  if (con->host != NULL)
+    free(con->host);
+
+  /* If this fails, connecting falls back to the default host. */
+  con->host= strdup(host == NULL ? GEARMAN_DEFAULT_TCP_HOST : host);
+
+  gearman_protocol_shm_con_set(con, host != NULL &&
+                               !strncmp(host, GEARMAN_SHM_PREFIX,
+                                        strlen(GEARMAN_SHM_PREFIX)));
 }
 
 void gearman_con_set_port(gearman_con_st *con, in_port_t port)
@@ -176,6 +338,11 @@ gearman_return_t gearman_con_set_fd(gearman_con_st *con, int fd)
   return GEARMAN_SUCCESS;
 }
 
+int gearman_con_fd(gearman_con_st *con)
+{
+  return con->fd;
+}
+
 void *gearman_con_data(gearman_con_st *con)
 {
   return con->data;
@@ -196,6 +363,18 @@ void gearman_con_close(gearman_con_st *con)
   if (con->fd == -1)
     return;
 
+#ifdef HAVE_SYS_EPOLL_H
+  _con_epoll_remove(con);
+#endif
+
+  /* Let an external event loop drop its watch while the descriptor is still
+     the one it knows about. */
+  if (con->gearman->options & GEARMAN_WATCH_CLOSE &&
+      con->gearman->event_watch != NULL)
+  {
+    (void)(con->gearman->event_watch)(con, 0, con->gearman->event_watch_arg);
+  }
+
   if (con->options & GEARMAN_CON_EXTERNAL_FD)
     con->options&= (gearman_con_options_t)~GEARMAN_CON_EXTERNAL_FD;
   else
@@ -203,27 +382,43 @@ void gearman_con_close(gearman_con_st *con)
 
   con->state= GEARMAN_CON_STATE_ADDRINFO;
   con->fd= -1;
+  con->close_count++;
   con->events= 0;
   con->revents= 0;
+  con->rtt_start= 0;
+
+  /* A new connection has no slots until the worker sends them again. */
+  con->slots= 0;
+
+  /* Compression, shared memory and abandon notices are set up again on the
+     next connection, and a new connection has not been put to sleep. */
+  con->options&= (gearman_con_options_t)~(GEARMAN_CON_COMPRESSION |
+                                          GEARMAN_CON_COMPRESSION_WAIT |
+                                          GEARMAN_CON_SHM |
+                                          GEARMAN_CON_SLEEPING |
+                                          GEARMAN_CON_ABANDON);
 
   con->send_state= GEARMAN_CON_SEND_STATE_NONE;
-  con->send_buffer_ptr= con->send_buffer;
   con->send_buffer_size= 0;
   con->send_data_size= 0;
   con->send_data_offset= 0;
+  _con_send_buffer_release(con);
 
   con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
   if (con->recv_packet != NULL)
     gearman_packet_free(con->recv_packet);
-  con->recv_buffer_ptr= con->recv_buffer;
   con->recv_buffer_size= 0;
+  con->recv_data_size= 0;
+  con->recv_data_offset= 0;
+  con->recv_data_ptr= NULL;
+  _con_recv_buffer_release(con);
 }
 
 void gearman_con_reset_addrinfo(gearman_con_st *con)
 {
   if (con->addrinfo != NULL)
   {
-    freeaddrinfo(con->addrinfo);
+    _con_free_addrinfo(con->addrinfo);
     con->addrinfo= NULL;
   }
 
@@ -248,13 +443,24 @@ gearman_return_t gearman_con_send(gearman_con_st *con,
       return GEARMAN_INVALID_PACKET;
     }
 
+    ret= _con_send_compression(con, packet);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
     /* Pack first part of packet, which is everything but the payload. */
     while (1)
     {
+      if (con->send_buffer == NULL)
+      {
+        ret= _con_send_buffer_get(con, 0);
+        if (ret != GEARMAN_SUCCESS)
+          return ret;
+      }
+
       send_size= (*con->packet_pack_fn)(packet, con,
                                         con->send_buffer +
                                         con->send_buffer_size,
-                                        GEARMAN_SEND_BUFFER_SIZE -
+                                        con->send_buffer_alloc -
                                         con->send_buffer_size,
                                         &ret);
       if (ret == GEARMAN_SUCCESS)
@@ -267,13 +473,14 @@ gearman_return_t gearman_con_send(gearman_con_st *con,
       else if (ret != GEARMAN_FLUSH_DATA)
         return ret;
 
-      /* We were asked to flush when the buffer is already flushed! */
+      /* The buffer is already flushed, so grow it for this packet. */
       if (con->send_buffer_size == 0)
       {
-        GEARMAN_ERROR_SET(con->gearman, "gearman_con_send",
-                          "send buffer too small (%u)",
-                          GEARMAN_SEND_BUFFER_SIZE)
-        return GEARMAN_SEND_BUFFER_TOO_SMALL;
+        ret= _con_send_buffer_get(con, con->send_buffer_alloc << 1);
+        if (ret != GEARMAN_SUCCESS)
+          return ret;
+
+        continue;
       }
 
       /* Flush buffer now if first part of packet won't fit in. */
@@ -289,11 +496,34 @@ gearman_return_t gearman_con_send(gearman_con_st *con,
     if (packet->data_size == 0)
       break;
 
+    /* Chunked data is never copied, so flush the header out first and then
+       write the chunks where they are. */
+    if (packet->data_iov != NULL)
+    {
+      con->send_state= GEARMAN_CON_SEND_STATE_IOV_FLUSH;
+
+  case GEARMAN_CON_SEND_STATE_IOV_FLUSH:
+      ret= gearman_con_flush(con);
+      if (ret != GEARMAN_SUCCESS)
+        return ret;
+
+      con->send_data_size= packet->data_size;
+      con->send_data_offset= 0;
+      con->send_state= GEARMAN_CON_SEND_STATE_IOV_DATA;
+
+  case GEARMAN_CON_SEND_STATE_IOV_DATA:
+      ret= _con_send_iov_data(con, packet);
+      if (ret != GEARMAN_SUCCESS)
+        return ret;
+
+      break;
+    }
+
     /* If there is any room in the buffer, copy in data. */
     if (packet->data != NULL &&
-        (GEARMAN_SEND_BUFFER_SIZE - con->send_buffer_size) > 0)
+        (con->send_buffer_alloc - con->send_buffer_size) > 0)
     {
-      con->send_data_offset= GEARMAN_SEND_BUFFER_SIZE - con->send_buffer_size;
+      con->send_data_offset= con->send_buffer_alloc - con->send_buffer_size;
       if (con->send_data_offset > packet->data_size)
         con->send_data_offset= packet->data_size;
 
@@ -327,8 +557,15 @@ gearman_return_t gearman_con_send(gearman_con_st *con,
     }
 
     /* Copy into the buffer if it fits, otherwise flush from packet buffer. */
+    if (con->send_buffer == NULL)
+    {
+      ret= _con_send_buffer_get(con, 0);
+      if (ret != GEARMAN_SUCCESS)
+        return ret;
+    }
+
     con->send_buffer_size= packet->data_size - con->send_data_offset;
-    if (con->send_buffer_size < GEARMAN_SEND_BUFFER_SIZE)
+    if (con->send_buffer_size < con->send_buffer_alloc)
     {
       memcpy(con->send_buffer,
              ((uint8_t *)(packet->data)) + con->send_data_offset,
@@ -399,10 +636,99 @@ size_t gearman_con_send_data(gearman_con_st *con, const void *data,
   return data_size - con->send_buffer_size;
 }
 
+size_t gearman_con_send_iov(gearman_con_st *con, const struct iovec *iov,
+                            int iov_count, gearman_return_t *ret_ptr)
+{
+#ifdef MSG_MORE
+  struct msghdr msg;
+#endif
+  ssize_t write_size;
+
+  if (con->state != GEARMAN_CON_STATE_CONNECTED ||
+      (con->send_state != GEARMAN_CON_SEND_STATE_NONE &&
+       con->send_state != GEARMAN_CON_SEND_STATE_IOV_DATA) ||
+      con->send_buffer_size != 0)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "gearman_con_send_iov", "not ready")
+    *ret_ptr= GEARMAN_NOT_FLUSHING;
+    return 0;
+  }
+
+#ifdef MSG_MORE
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov= (struct iovec *)iov;
+  msg.msg_iovlen= (size_t)iov_count;
+#endif
+
+  while (1)
+  {
+#ifdef MSG_MORE
+    if (con->options & GEARMAN_CON_SEND_MORE)
+      write_size= sendmsg(con->fd, &msg, MSG_MORE);
+    else
+#endif
+      write_size= writev(con->fd, iov, iov_count);
+    con->gearman->write_count++;
+    if (write_size > 0)
+    {
+      con->gearman->write_bytes+= (uint64_t)write_size;
+      break;
+    }
+
+    if (write_size == -1)
+    {
+      if (errno == EAGAIN)
+      {
+        con->gearman->eagain_count++;
+        *ret_ptr= gearman_con_set_events(con, POLLOUT);
+        if (*ret_ptr != GEARMAN_SUCCESS)
+          return 0;
+
+        if (con->gearman->options & GEARMAN_NON_BLOCKING)
+        {
+          *ret_ptr= GEARMAN_IO_WAIT;
+          return 0;
+        }
+
+        *ret_ptr= gearman_con_wait(con->gearman, -1);
+        if (*ret_ptr != GEARMAN_SUCCESS)
+          return 0;
+
+        continue;
+      }
+      else if (errno == EINTR)
+        continue;
+      else if (errno != EPIPE && errno != ECONNRESET)
+      {
+        GEARMAN_ERROR_SET(con->gearman, "gearman_con_send_iov", "writev:%d",
+                          errno)
+        con->gearman->last_errno= errno;
+        gearman_con_close(con);
+        *ret_ptr= GEARMAN_ERRNO;
+        return 0;
+      }
+    }
+
+    if (!(con->options & GEARMAN_CON_IGNORE_LOST_CONNECTION))
+    {
+      GEARMAN_ERROR_SET(con->gearman, "gearman_con_send_iov",
+                        "lost connection to server (%d)",
+                        write_size == 0 ? 0 : errno)
+    }
+    gearman_con_close(con);
+    *ret_ptr= GEARMAN_LOST_CONNECTION;
+    return 0;
+  }
+
+  *ret_ptr= GEARMAN_SUCCESS;
+  return (size_t)write_size;
+}
+
 gearman_return_t gearman_con_flush(gearman_con_st *con)
 {
   char port_str[NI_MAXSERV];
   struct addrinfo ai;
+  const char *path;
   int ret;
   ssize_t write_size;
   gearman_return_t gret;
@@ -414,17 +740,30 @@ gearman_return_t gearman_con_flush(gearman_con_st *con)
     case GEARMAN_CON_STATE_ADDRINFO:
       if (con->addrinfo != NULL)
       {
-        freeaddrinfo(con->addrinfo);
+        _con_free_addrinfo(con->addrinfo);
         con->addrinfo= NULL;
       }
 
+      path= _con_unix_path(con->host);
+      if (path != NULL)
+      {
+        gret= _con_addrinfo_unix(con, path);
+        if (gret != GEARMAN_SUCCESS)
+          return gret;
+
+        con->addrinfo_next= con->addrinfo;
+        con->state= GEARMAN_CON_STATE_CONNECT;
+        continue;
+      }
+
       snprintf(port_str, NI_MAXSERV, "%u", con->port);
 
       memset(&ai, 0, sizeof(struct addrinfo));
       ai.ai_socktype= SOCK_STREAM;
       ai.ai_protocol= IPPROTO_TCP;
 
-      ret= getaddrinfo(con->host, port_str, &ai, &(con->addrinfo));
+      ret= getaddrinfo(con->host == NULL ? GEARMAN_DEFAULT_TCP_HOST : con->host,
+                       port_str, &ai, &(con->addrinfo));
       if (ret != 0)
       {
         GEARMAN_ERROR_SET(con->gearman, "gearman_con_flush", "getaddrinfo:%s",
@@ -485,7 +824,8 @@ gearman_return_t gearman_con_flush(gearman_con_st *con)
           break;
         }
 
-        if (errno == ECONNREFUSED || errno == ENETUNREACH || errno == ETIMEDOUT)
+        if (errno == ECONNREFUSED || errno == ENETUNREACH ||
+            errno == ETIMEDOUT || errno == ENOENT)
         {
           con->state= GEARMAN_CON_STATE_CONNECT;
           con->addrinfo_next= con->addrinfo_next->ai_next;
@@ -505,15 +845,17 @@ gearman_return_t gearman_con_flush(gearman_con_st *con)
     case GEARMAN_CON_STATE_CONNECTING:
       while (1)
       {
-        if (con->revents & POLLOUT)
+        /* A refused connect is reported as writable too, so check for the
+           error first to move on to the next address right away. */
+        if (con->revents & (POLLERR | POLLHUP | POLLNVAL))
         {
-          con->state= GEARMAN_CON_STATE_CONNECTED;
+          con->state= GEARMAN_CON_STATE_CONNECT;
+          con->addrinfo_next= con->addrinfo_next->ai_next;
           break;
         }
-        else if (con->revents & (POLLERR | POLLHUP | POLLNVAL))
+        else if (con->revents & POLLOUT)
         {
-          con->state= GEARMAN_CON_STATE_CONNECT;
-          con->addrinfo_next= con->addrinfo_next->ai_next;
+          con->state= GEARMAN_CON_STATE_CONNECTED;
           break;
         }
 
@@ -538,7 +880,17 @@ gearman_return_t gearman_con_flush(gearman_con_st *con)
     case GEARMAN_CON_STATE_CONNECTED:
       while (con->send_buffer_size != 0)
       {
-        write_size= write(con->fd, con->send_buffer_ptr, con->send_buffer_size);
+#ifdef MSG_MORE
+        if (con->options & GEARMAN_CON_SEND_MORE)
+        {
+          write_size= send(con->fd, con->send_buffer_ptr,
+                           con->send_buffer_size, MSG_MORE);
+        }
+        else
+#endif
+          write_size= write(con->fd, con->send_buffer_ptr,
+                            con->send_buffer_size);
+        con->gearman->write_count++;
         if (write_size == 0)
         {
           if (!(con->options & GEARMAN_CON_IGNORE_LOST_CONNECTION))
@@ -553,6 +905,7 @@ gearman_return_t gearman_con_flush(gearman_con_st *con)
         {
           if (errno == EAGAIN)
           {
+            con->gearman->eagain_count++;
             gret= gearman_con_set_events(con, POLLOUT);
             if (gret != GEARMAN_SUCCESS)
               return gret;
@@ -586,6 +939,7 @@ gearman_return_t gearman_con_flush(gearman_con_st *con)
           return GEARMAN_ERRNO;
         }
 
+        con->gearman->write_bytes+= (uint64_t)write_size;
         con->send_buffer_size-= (size_t)write_size;
         if (con->send_state == GEARMAN_CON_SEND_STATE_FLUSH_DATA)
         {
@@ -607,7 +961,7 @@ gearman_return_t gearman_con_flush(gearman_con_st *con)
       }
 
       con->send_state= GEARMAN_CON_SEND_STATE_NONE;
-      con->send_buffer_ptr= con->send_buffer;
+      _con_send_buffer_release(con);
       return GEARMAN_SUCCESS;
 
     default:
@@ -751,16 +1105,31 @@ gearman_packet_st *gearman_con_recv(gearman_con_st *con,
         }
       }
 
-      /* Shift buffer contents if needed. */
+      /* Shift buffer contents if needed, and grow it if the packet needs
+         more room than there is. */
       if (con->recv_buffer_size > 0)
         memmove(con->recv_buffer, con->recv_buffer_ptr, con->recv_buffer_size);
       con->recv_buffer_ptr= con->recv_buffer;
 
+      if (con->recv_buffer_size == con->recv_buffer_alloc)
+      {
+        *ret_ptr= _con_recv_buffer_get(con, con->recv_buffer_alloc << 1);
+        if (*ret_ptr != GEARMAN_SUCCESS)
+        {
+          gearman_con_close(con);
+          return NULL;
+        }
+      }
+
       recv_size= gearman_con_read(con, con->recv_buffer + con->recv_buffer_size,
-                               GEARMAN_RECV_BUFFER_SIZE - con->recv_buffer_size,
-                               ret_ptr);
+                                  con->recv_buffer_alloc -
+                                  con->recv_buffer_size, ret_ptr);
       if (*ret_ptr != GEARMAN_SUCCESS)
+      {
+        /* Don't hold on to a buffer while waiting for an idle connection. */
+        _con_recv_buffer_release(con);
         return NULL;
+      }
 
       con->recv_buffer_size+= recv_size;
     }
@@ -772,43 +1141,17 @@ gearman_packet_st *gearman_con_recv(gearman_con_st *con,
     }
 
     con->recv_data_size= packet->data_size;
+    con->recv_state= GEARMAN_CON_RECV_STATE_READ_DATA;
 
-    if (!recv_data)
-    {
-      con->recv_state= GEARMAN_CON_RECV_STATE_READ_DATA;
+    /* Compressed data has to be all here before it can be read. */
+    if (!recv_data && !(packet->options & GEARMAN_PACKET_COMPRESSED))
       break;
-    }
-
-    if (packet->gearman->workload_malloc == NULL)
-      packet->data= malloc(packet->data_size);
-    else
-    {
-      packet->data= packet->gearman->workload_malloc(packet->data_size,
-                                (void *)(packet->gearman->workload_malloc_arg));
-    }
-    if (packet->data == NULL)
-    {
-      *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
-      gearman_con_close(con);
-      return NULL;
-    }
-
-    packet->options|= GEARMAN_PACKET_FREE_DATA;
-    con->recv_state= GEARMAN_CON_RECV_STATE_READ_DATA;
 
   case GEARMAN_CON_RECV_STATE_READ_DATA:
-    while (con->recv_data_size != 0)
-    {
-      (void)gearman_con_recv_data(con,
-                                  ((uint8_t *)(packet->data)) +
-                                  con->recv_data_offset,
-                                  packet->data_size -
-                                  con->recv_data_offset, ret_ptr);
-      if (*ret_ptr != GEARMAN_SUCCESS)
-        return NULL;
-    }
+    *ret_ptr= gearman_con_recv_packet_data(con, con->recv_packet);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+      return NULL;
 
-    con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
     break;
 
   default:
@@ -821,6 +1164,42 @@ gearman_packet_st *gearman_con_recv(gearman_con_st *con,
   packet= con->recv_packet;
   con->recv_packet= NULL;
 
+  _con_recv_buffer_release(con);
+
+  if (con->options & GEARMAN_CON_COMPRESSION_WAIT &&
+      _con_recv_compression(con, packet))
+  {
+    if (packet->options & GEARMAN_PACKET_ALLOCATED)
+    {
+      gearman_packet_free(packet);
+      packet= NULL;
+    }
+    else
+      gearman_packet_free(packet);
+
+    return gearman_con_recv(con, packet, ret_ptr, recv_data);
+  }
+
+  if (packet->options & GEARMAN_PACKET_COMPRESSED &&
+      !(con->gearman->options & GEARMAN_KEEP_COMPRESSED))
+  {
+    *ret_ptr= gearman_packet_decompress(packet);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+    {
+      gearman_packet_free(packet);
+      gearman_con_close(con);
+      return NULL;
+    }
+
+    /* The caller still reads the data, so hand it out from the packet. */
+    if (!recv_data)
+    {
+      con->recv_data_ptr= packet->data;
+      con->recv_data_size= packet->data_size;
+      con->recv_state= GEARMAN_CON_RECV_STATE_READ_DATA;
+    }
+  }
+
   return packet;
 }
 
@@ -841,6 +1220,22 @@ size_t gearman_con_recv_data(gearman_con_st *con, void *data, size_t data_size,
   if ((con->recv_data_size - con->recv_data_offset) < data_size)
     data_size= con->recv_data_size - con->recv_data_offset;
 
+  if (con->recv_data_ptr != NULL)
+  {
+    memcpy(data, con->recv_data_ptr + con->recv_data_offset, data_size);
+    con->recv_data_offset+= data_size;
+    if (con->recv_data_size == con->recv_data_offset)
+    {
+      con->recv_data_size= 0;
+      con->recv_data_offset= 0;
+      con->recv_data_ptr= NULL;
+      con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
+    }
+
+    *ret_ptr= GEARMAN_SUCCESS;
+    return data_size;
+  }
+
   if (con->recv_buffer_size > 0)
   {
     if (con->recv_buffer_size < data_size)
@@ -870,25 +1265,148 @@ size_t gearman_con_recv_data(gearman_con_st *con, void *data, size_t data_size,
     con->recv_data_size= 0;
     con->recv_data_offset= 0;
     con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
+    _con_recv_buffer_release(con);
   }
 
   return recv_size;
 }
 
-size_t gearman_con_read(gearman_con_st *con, void *data, size_t data_size,
-                        gearman_return_t *ret_ptr)
+gearman_return_t gearman_con_recv_packet_data(gearman_con_st *con,
+                                              gearman_packet_st *packet)
 {
-  ssize_t read_size;
+  gearman_return_t ret;
 
-  while (1)
+  /* Decompressed data is already in the packet. */
+  if (con->recv_data_ptr != NULL && con->recv_data_ptr == packet->data)
   {
-    read_size= read(con->fd, data, data_size);
-    if (read_size == 0)
+    con->recv_data_size= 0;
+    con->recv_data_offset= 0;
+    con->recv_data_ptr= NULL;
+    con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
+    return GEARMAN_SUCCESS;
+  }
+
+  if (packet->data == NULL && con->recv_data_size != 0)
+  {
+    if (packet->gearman->workload_malloc == NULL)
+      packet->data= malloc(packet->data_size);
+    else
     {
-      if (!(con->options & GEARMAN_CON_IGNORE_LOST_CONNECTION))
-      {
-        GEARMAN_ERROR_SET(con->gearman, "gearman_con_read",
-                          "lost connection to server (EOF)")
+      packet->data= packet->gearman->workload_malloc(packet->data_size,
+                                (void *)(packet->gearman->workload_malloc_arg));
+    }
+    if (packet->data == NULL)
+    {
+      gearman_con_close(con);
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    packet->options|= GEARMAN_PACKET_FREE_DATA;
+  }
+
+  while (con->recv_data_size != 0)
+  {
+    (void)gearman_con_recv_data(con,
+                                ((uint8_t *)(packet->data)) +
+                                con->recv_data_offset,
+                                packet->data_size - con->recv_data_offset,
+                                &ret);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
+  return GEARMAN_SUCCESS;
+}
+
+size_t gearman_con_recv_data_ref(gearman_con_st *con, const void **data,
+                                 gearman_return_t *ret_ptr)
+{
+  size_t data_size;
+
+  *data= NULL;
+
+  if (con->recv_data_size == 0)
+  {
+    *ret_ptr= GEARMAN_SUCCESS;
+    return 0;
+  }
+
+  data_size= con->recv_data_size - con->recv_data_offset;
+
+  if (con->recv_data_ptr != NULL)
+    *data= con->recv_data_ptr + con->recv_data_offset;
+  else if (con->recv_buffer_size > 0 && con->recv_data_fn == NULL)
+  {
+    /* Hand out what was read along with the header where it is. */
+    if (data_size > con->recv_buffer_size)
+      data_size= con->recv_buffer_size;
+
+    *data= con->recv_buffer_ptr;
+    con->recv_buffer_ptr+= data_size;
+    con->recv_buffer_size-= data_size;
+  }
+  else
+  {
+    /* Read the next piece into the empty receive buffer, never past the end
+       of this packet so the buffer can be handed out whole. */
+    if (con->recv_buffer == NULL)
+    {
+      *ret_ptr= _con_recv_buffer_get(con, 0);
+      if (*ret_ptr != GEARMAN_SUCCESS)
+        return 0;
+    }
+
+    if (data_size > con->recv_buffer_alloc)
+      data_size= con->recv_buffer_alloc;
+
+    if (con->recv_data_fn != NULL)
+    {
+      data_size= (*con->recv_data_fn)(con, con->recv_buffer, data_size,
+                                      ret_ptr);
+      if (*ret_ptr == GEARMAN_SUCCESS)
+        *data= con->recv_buffer;
+      return data_size;
+    }
+
+    data_size= gearman_con_read(con, con->recv_buffer, data_size, ret_ptr);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+    {
+      _con_recv_buffer_release(con);
+      return 0;
+    }
+
+    *data= con->recv_buffer;
+  }
+
+  con->recv_data_offset+= data_size;
+  if (con->recv_data_size == con->recv_data_offset)
+  {
+    con->recv_data_size= 0;
+    con->recv_data_offset= 0;
+    con->recv_data_ptr= NULL;
+    con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
+  }
+
+  *ret_ptr= GEARMAN_SUCCESS;
+  return data_size;
+}
+
+size_t gearman_con_read(gearman_con_st *con, void *data, size_t data_size,
+                        gearman_return_t *ret_ptr)
+{
+  ssize_t read_size;
+
+  while (1)
+  {
+    read_size= read(con->fd, data, data_size);
+    con->gearman->read_count++;
+    if (read_size == 0)
+    {
+      if (!(con->options & GEARMAN_CON_IGNORE_LOST_CONNECTION))
+      {
+        GEARMAN_ERROR_SET(con->gearman, "gearman_con_read",
+                          "lost connection to server (EOF)")
       }
       gearman_con_close(con);
       *ret_ptr= GEARMAN_LOST_CONNECTION;
@@ -898,6 +1416,7 @@ size_t gearman_con_read(gearman_con_st *con, void *data, size_t data_size,
     {
       if (errno == EAGAIN)
       {
+        con->gearman->eagain_count++;
         *ret_ptr= gearman_con_set_events(con, POLLIN);
         if (*ret_ptr != GEARMAN_SUCCESS)
           return 0;
@@ -939,6 +1458,7 @@ size_t gearman_con_read(gearman_con_st *con, void *data, size_t data_size,
     break;
   }
 
+  con->gearman->read_bytes+= (uint64_t)read_size;
   *ret_ptr= GEARMAN_SUCCESS;
   return (size_t)read_size;
 }
@@ -951,6 +1471,11 @@ gearman_return_t gearman_con_wait(gearman_st *gearman, int timeout)
   int ret;
   gearman_return_t gret;
 
+#ifdef HAVE_SYS_EPOLL_H
+  if (gearman->options & GEARMAN_EPOLL)
+    return _con_epoll_wait(gearman, timeout);
+#endif
+
   if (gearman->pfds_size < gearman->con_count)
   {
     pfds= realloc(gearman->pfds, gearman->con_count * sizeof(struct pollfd));
@@ -1018,36 +1543,56 @@ gearman_return_t gearman_con_wait(gearman_st *gearman, int timeout)
 
 gearman_return_t gearman_con_set_events(gearman_con_st *con, short events)
 {
-  gearman_return_t ret;
-
   if ((con->events | events) == con->events)
     return GEARMAN_SUCCESS;
 
   con->events|= events;
 
-  if (con->gearman->event_watch != NULL)
-  {
-    ret= (con->gearman->event_watch)(con, con->events,
-                                     con->gearman->event_watch_arg);
-    if (ret != GEARMAN_SUCCESS)
-    {
-      gearman_con_close(con);
-      return ret;
-    }
-  }
+  return _con_events_update(con);
+}
 
-  return GEARMAN_SUCCESS;
+gearman_return_t gearman_con_clear_events(gearman_con_st *con, short events)
+{
+  if (!(con->events & events))
+    return GEARMAN_SUCCESS;
+
+  con->events&= (short)~events;
+
+  return _con_events_update(con);
 }
 
 gearman_return_t gearman_con_set_revents(gearman_con_st *con, short revents)
 {
   gearman_return_t ret;
 
-  if (revents != 0)
+  /* Shared memory connections are told about free space the same way as new
+     data, so let a blocked send see it as the socket being writable. */
+  if (con->options & GEARMAN_CON_SHM && revents & POLLIN &&
+      con->send_state != GEARMAN_CON_SEND_STATE_NONE)
+  {
+    revents|= POLLOUT;
+  }
+
+  /* Queue the connection for gearman_con_ready the first time it becomes
+     ready, so finding ready connections doesn't mean walking all of them. */
+  if (revents != 0 && !(con->options & GEARMAN_CON_READY))
+  {
     con->options|= GEARMAN_CON_READY;
+    con->ready_next= NULL;
+    if (con->gearman->ready_list == NULL)
+      con->gearman->ready_list= con;
+    else
+      con->gearman->ready_end->ready_next= con;
+    con->gearman->ready_end= con;
+  }
 
   con->revents= revents;
 
+  /* A sleeping worker connection only has input once the job server wakes
+     it, so it needs asking for jobs again. */
+  if (revents & (POLLIN | POLLERR | POLLHUP))
+    con->options&= (gearman_con_options_t)~GEARMAN_CON_SLEEPING;
+
   /* Remove external POLLOUT watch if we didn't ask for it. Otherwise we spin
      forever until another POLLIN state change. This is much more efficient
      than removing POLLOUT on every state change since some external polling
@@ -1073,19 +1618,19 @@ gearman_con_st *gearman_con_ready(gearman_st *gearman)
 {
   gearman_con_st *con;
 
-  /* We can't keep state between calls since connections may be removed during
-     processing. If this list ever gets big, we may want something faster. */
+  /* Connections take themselves off the ready list when they are freed, so
+     anything still on it is safe to return. */
+  con= gearman->ready_list;
+  if (con == NULL)
+    return NULL;
 
-  for (con= gearman->con_list; con != NULL; con= con->next)
-  {
-    if (con->options & GEARMAN_CON_READY)
-    {
-      con->options&= (gearman_con_options_t)~GEARMAN_CON_READY;
-      return con;
-    }
-  }
+  gearman->ready_list= con->ready_next;
+  if (gearman->ready_list == NULL)
+    gearman->ready_end= NULL;
 
-  return NULL;
+  con->ready_next= NULL;
+  con->options&= (gearman_con_options_t)~GEARMAN_CON_READY;
+  return con;
 }
 
 gearman_return_t gearman_con_echo(gearman_st *gearman, const void *workload,
@@ -1095,6 +1640,7 @@ gearman_return_t gearman_con_echo(gearman_st *gearman, const void *workload,
   gearman_options_t options= gearman->options;
   gearman_packet_st packet;
   gearman_return_t ret;
+  uint64_t start;
 
   ret= gearman_packet_add(gearman, &packet, GEARMAN_MAGIC_REQUEST,
                           GEARMAN_COMMAND_ECHO_REQ, workload, workload_size,
@@ -1106,6 +1652,8 @@ gearman_return_t gearman_con_echo(gearman_st *gearman, const void *workload,
 
   for (con= gearman->con_list; con != NULL; con= con->next)
   {
+    start= gearman_time_now();
+
     ret= gearman_con_send(con, &packet, true);
     if (ret != GEARMAN_SUCCESS)
     {
@@ -1133,6 +1681,7 @@ gearman_return_t gearman_con_echo(gearman_st *gearman, const void *workload,
     }
 
     gearman_packet_free(&(con->packet));
+    gearman_con_health_ok(con, gearman_time_now() - start);
   }
 
   gearman_packet_free(&packet);
@@ -1140,6 +1689,59 @@ gearman_return_t gearman_con_echo(gearman_st *gearman, const void *workload,
   return GEARMAN_SUCCESS;
 }
 
+void gearman_con_health_ok(gearman_con_st *con, uint64_t rtt)
+{
+  con->error_count= 0;
+  con->retry_time= 0;
+
+  if (rtt == 0)
+    return;
+
+  /* Smooth the same way TCP does, so one slow reply doesn't move all the
+     traffic away from a server. */
+  if (con->rtt == 0)
+    con->rtt= rtt;
+  else
+    con->rtt= con->rtt - (con->rtt >> 3) + (rtt >> 3);
+}
+
+void gearman_con_health_fail(gearman_con_st *con)
+{
+  uint64_t wait;
+
+  if (con->error_count < 32)
+    con->error_count++;
+
+  wait= (uint64_t)GEARMAN_CON_RETRY_MIN << (con->error_count - 1);
+  if (wait > GEARMAN_CON_RETRY_MAX || con->error_count > 16)
+    wait= GEARMAN_CON_RETRY_MAX;
+
+  con->retry_time= gearman_time_now() + wait;
+}
+
+bool gearman_con_health_ready(gearman_con_st *con)
+{
+  if (con->retry_time == 0)
+    return true;
+
+  if (gearman_time_now() < con->retry_time)
+    return false;
+
+  /* Let the next attempt through, another failure sets the time again. */
+  con->retry_time= 0;
+  return true;
+}
+
+uint64_t gearman_con_rtt(gearman_con_st *con)
+{
+  return con->rtt;
+}
+
+uint32_t gearman_con_error_count(gearman_con_st *con)
+{
+  return con->error_count;
+}
+
 void *gearman_con_protocol_data(gearman_con_st *con)
 {
   return con->protocol_data;
@@ -1203,7 +1805,7 @@ static gearman_return_t _con_setsockopt(gearman_con_st *con)
   ret= 1;
   ret= setsockopt(con->fd, IPPROTO_TCP, TCP_NODELAY, &ret,
                   (socklen_t)sizeof(int));
-  if (ret == -1)
+  if (ret == -1 && errno != EOPNOTSUPP)
   {
     GEARMAN_ERROR_SET(con->gearman, "_con_setsockopt",
                       "setsockopt:TCP_NODELAY:%d", errno)
@@ -1259,6 +1861,10 @@ static gearman_return_t _con_setsockopt(gearman_con_st *con)
     return GEARMAN_ERRNO;
   }
 
+  /* Sockets from accept4 are already non-blocking. */
+  if (con->options & GEARMAN_CON_NONBLOCK)
+    return GEARMAN_SUCCESS;
+
   ret= fcntl(con->fd, F_GETFL, 0);
   if (ret == -1)
   {
@@ -1277,3 +1883,566 @@ static gearman_return_t _con_setsockopt(gearman_con_st *con)
 
   return GEARMAN_SUCCESS;
 }
+
+static const char *_con_unix_path(const char *host)
+{
+  if (host == NULL)
+    return NULL;
+
+  if (host[0] == '/')
+    return host;
+
+  if (strncmp(host, GEARMAN_UNIX_PREFIX, strlen(GEARMAN_UNIX_PREFIX)) == 0)
+    return host + strlen(GEARMAN_UNIX_PREFIX);
+
+  if (strncmp(host, GEARMAN_SHM_PREFIX, strlen(GEARMAN_SHM_PREFIX)) == 0)
+    return host + strlen(GEARMAN_SHM_PREFIX);
+
+  return NULL;
+}
+
+static gearman_return_t _con_addrinfo_unix(gearman_con_st *con,
+                                           const char *path)
+{
+#ifdef HAVE_SYS_UN_H
+  struct addrinfo *addrinfo;
+  struct sockaddr_un *sa;
+
+  if (strlen(path) >= sizeof(sa->sun_path))
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_con_addrinfo_unix", "path too long:%s",
+                      path)
+    return GEARMAN_GETADDRINFO;
+  }
+
+  addrinfo= malloc(sizeof(struct addrinfo) + sizeof(struct sockaddr_un));
+  if (addrinfo == NULL)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_con_addrinfo_unix", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  sa= (struct sockaddr_un *)(addrinfo + 1);
+  memset(sa, 0, sizeof(struct sockaddr_un));
+  sa->sun_family= AF_UNIX;
+  strcpy(sa->sun_path, path);
+
+  memset(addrinfo, 0, sizeof(struct addrinfo));
+  addrinfo->ai_family= AF_UNIX;
+  addrinfo->ai_socktype= SOCK_STREAM;
+  addrinfo->ai_addrlen= sizeof(struct sockaddr_un);
+  addrinfo->ai_addr= (struct sockaddr *)sa;
+
+  con->addrinfo= addrinfo;
+
+  return GEARMAN_SUCCESS;
+#else
+  GEARMAN_ERROR_SET(con->gearman, "_con_addrinfo_unix",
+                    "Unix sockets not supported:%s", path)
+  return GEARMAN_GETADDRINFO;
+#endif
+}
+
+static void _con_free_addrinfo(struct addrinfo *addrinfo)
+{
+  if (addrinfo->ai_family == AF_UNIX)
+    free(addrinfo);
+  else
+    freeaddrinfo(addrinfo);
+}
+
+static uint8_t *_con_buffer_take(void **list, uint32_t *count,
+                                 size_t pool_size, size_t size)
+{
+  void *buffer;
+
+  if (size != pool_size || *list == NULL)
+    return malloc(size);
+
+  buffer= *list;
+  *list= *((void **)buffer);
+  (*count)--;
+
+  return buffer;
+}
+
+static void _con_buffer_give(void **list, uint32_t *count, size_t pool_size,
+                             uint8_t *buffer, size_t size)
+{
+  if (size != pool_size || *count == GEARMAN_BUFFER_POOL_SIZE)
+  {
+    free(buffer);
+    return;
+  }
+
+  *((void **)buffer)= *list;
+  *list= buffer;
+  (*count)++;
+}
+
+static size_t _con_buffer_max(size_t pool_size)
+{
+  return pool_size > GEARMAN_MAX_BUFFER_SIZE ? pool_size :
+                                               GEARMAN_MAX_BUFFER_SIZE;
+}
+
+static gearman_return_t _con_send_buffer_get(gearman_con_st *con,
+                                             size_t size)
+{
+  gearman_st *gearman= con->gearman;
+  size_t alloc= gearman->send_buffer_size;
+  uint8_t *buffer;
+
+  if (size > _con_buffer_max(gearman->send_buffer_size))
+  {
+    GEARMAN_ERROR_SET(gearman, "gearman_con_send",
+                      "send buffer too small (%u)",
+                      (uint32_t)(con->send_buffer_alloc))
+    return GEARMAN_SEND_BUFFER_TOO_SMALL;
+  }
+
+  while (alloc < size)
+    alloc<<= 1;
+  if (alloc > _con_buffer_max(gearman->send_buffer_size))
+    alloc= _con_buffer_max(gearman->send_buffer_size);
+
+  buffer= _con_buffer_take(&(gearman->send_buffer_list),
+                           &(gearman->send_buffer_count),
+                           gearman->send_buffer_size, alloc);
+  if (buffer == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "gearman_con_send", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  if (con->send_buffer != NULL)
+  {
+    _con_buffer_give(&(gearman->send_buffer_list),
+                     &(gearman->send_buffer_count), gearman->send_buffer_size,
+                     con->send_buffer, con->send_buffer_alloc);
+  }
+
+  con->send_buffer= buffer;
+  con->send_buffer_ptr= buffer;
+  con->send_buffer_alloc= alloc;
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _con_send_buffer_release(gearman_con_st *con)
+{
+  gearman_st *gearman= con->gearman;
+
+  if (con->send_buffer == NULL || con->send_buffer_size != 0)
+    return;
+
+  _con_buffer_give(&(gearman->send_buffer_list),
+                   &(gearman->send_buffer_count), gearman->send_buffer_size,
+                   con->send_buffer, con->send_buffer_alloc);
+
+  con->send_buffer= NULL;
+  con->send_buffer_ptr= NULL;
+  con->send_buffer_alloc= 0;
+}
+
+static gearman_return_t _con_recv_buffer_get(gearman_con_st *con,
+                                             size_t size)
+{
+  gearman_st *gearman= con->gearman;
+  size_t alloc= gearman->recv_buffer_size;
+  uint8_t *buffer;
+
+  if (size > _con_buffer_max(gearman->recv_buffer_size))
+  {
+    GEARMAN_ERROR_SET(gearman, "gearman_con_recv",
+                      "recv buffer too small (%u)",
+                      (uint32_t)(con->recv_buffer_alloc))
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  while (alloc < size)
+    alloc<<= 1;
+  if (alloc > _con_buffer_max(gearman->recv_buffer_size))
+    alloc= _con_buffer_max(gearman->recv_buffer_size);
+
+  buffer= _con_buffer_take(&(gearman->recv_buffer_list),
+                           &(gearman->recv_buffer_count),
+                           gearman->recv_buffer_size, alloc);
+  if (buffer == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "gearman_con_recv", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  if (con->recv_buffer != NULL)
+  {
+    if (con->recv_buffer_size > 0)
+      memcpy(buffer, con->recv_buffer_ptr, con->recv_buffer_size);
+
+    _con_buffer_give(&(gearman->recv_buffer_list),
+                     &(gearman->recv_buffer_count), gearman->recv_buffer_size,
+                     con->recv_buffer, con->recv_buffer_alloc);
+  }
+
+  con->recv_buffer= buffer;
+  con->recv_buffer_ptr= buffer;
+  con->recv_buffer_alloc= alloc;
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _con_recv_buffer_release(gearman_con_st *con)
+{
+  gearman_st *gearman= con->gearman;
+
+  if (con->recv_buffer == NULL || con->recv_buffer_size != 0)
+    return;
+
+  _con_buffer_give(&(gearman->recv_buffer_list),
+                   &(gearman->recv_buffer_count), gearman->recv_buffer_size,
+                   con->recv_buffer, con->recv_buffer_alloc);
+
+  con->recv_buffer= NULL;
+  con->recv_buffer_ptr= NULL;
+  con->recv_buffer_alloc= 0;
+}
+
+static gearman_return_t _con_send_iov_data(gearman_con_st *con,
+                                           gearman_packet_st *packet)
+{
+  struct iovec iov[GEARMAN_CON_IOV_MAX];
+  size_t skip;
+  size_t write_size;
+  gearman_return_t ret;
+  int iov_count;
+  int x;
+
+  while (con->send_data_offset < con->send_data_size)
+  {
+    /* Find where the last write stopped and build the next batch from
+       there. */
+    skip= con->send_data_offset;
+    for (x= 0; x < packet->data_iov_count &&
+               skip >= packet->data_iov[x].iov_len; x++)
+    {
+      skip-= packet->data_iov[x].iov_len;
+    }
+
+    for (iov_count= 0; x < packet->data_iov_count &&
+                       iov_count < GEARMAN_CON_IOV_MAX; x++)
+    {
+      if (packet->data_iov[x].iov_len == skip)
+        continue;
+
+      iov[iov_count].iov_base= (uint8_t *)(packet->data_iov[x].iov_base) +
+                               skip;
+      iov[iov_count].iov_len= packet->data_iov[x].iov_len - skip;
+      iov_count++;
+      skip= 0;
+    }
+
+    write_size= gearman_con_send_iov(con, iov, iov_count, &ret);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    con->send_data_offset+= write_size;
+  }
+
+  con->send_data_size= 0;
+  con->send_data_offset= 0;
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _con_send_compression(gearman_con_st *con,
+                                              gearman_packet_st *packet)
+{
+  size_t threshold= con->gearman->compress_threshold;
+  size_t request_size;
+  uint8_t *ptr;
+  uint32_t tmp;
+  gearman_return_t ret;
+
+  request_size= GEARMAN_PACKET_HEADER_SIZE +
+                 sizeof(GEARMAN_COMPRESS_OPTION) - 1;
+
+  if (threshold > 0 && con->packet_pack_fn == gearman_packet_pack &&
+      !(con->options & (GEARMAN_CON_COMPRESSION |
+                        GEARMAN_CON_COMPRESSION_WAIT)))
+  {
+    if (con->send_buffer == NULL)
+    {
+      ret= _con_send_buffer_get(con, 0);
+      if (ret != GEARMAN_SUCCESS)
+        return ret;
+    }
+
+    /* A new connection has nothing else buffered, so this goes out first. */
+    if (con->send_buffer_alloc - con->send_buffer_size >= request_size)
+    {
+      ptr= con->send_buffer + con->send_buffer_size;
+      memcpy(ptr, "\0REQ", 4);
+      tmp= htonl(GEARMAN_COMMAND_OPTION_REQ);
+      memcpy(ptr + 4, &tmp, 4);
+      tmp= htonl((uint32_t)(request_size - GEARMAN_PACKET_HEADER_SIZE));
+      memcpy(ptr + 8, &tmp, 4);
+      memcpy(ptr + GEARMAN_PACKET_HEADER_SIZE, GEARMAN_COMPRESS_OPTION,
+             request_size - GEARMAN_PACKET_HEADER_SIZE);
+      con->send_buffer_size+= request_size;
+      con->options|= GEARMAN_CON_COMPRESSION_WAIT;
+    }
+  }
+
+  if (packet->options & GEARMAN_PACKET_COMPRESSED)
+  {
+    if (con->options & GEARMAN_CON_COMPRESSION)
+      return GEARMAN_SUCCESS;
+
+    return gearman_packet_decompress(packet);
+  }
+
+  if (threshold == 0 || packet->data_size < threshold ||
+      packet->data_iov != NULL ||
+      !(con->options & GEARMAN_CON_COMPRESSION) ||
+      packet->magic == GEARMAN_MAGIC_TEXT ||
+      !(gearman_command_info_list[packet->command].data))
+  {
+    return GEARMAN_SUCCESS;
+  }
+
+  return gearman_packet_compress(packet);
+}
+
+static bool _con_recv_compression(gearman_con_st *con,
+                                  gearman_packet_st *packet)
+{
+  if (packet->command == GEARMAN_COMMAND_OPTION_RES)
+  {
+    if (packet->arg_size[0] != sizeof(GEARMAN_COMPRESS_OPTION) - 1 ||
+        memcmp(packet->arg[0], GEARMAN_COMPRESS_OPTION,
+               sizeof(GEARMAN_COMPRESS_OPTION) - 1))
+    {
+      return false;
+    }
+
+    con->options|= GEARMAN_CON_COMPRESSION;
+  }
+  else if (packet->command == GEARMAN_COMMAND_ERROR)
+  {
+    /* Servers that don't support it just say so. */
+    if (packet->arg_size[0] < sizeof("unknown_option") - 1 ||
+        memcmp(packet->arg[0], "unknown_option",
+               sizeof("unknown_option") - 1))
+    {
+      return false;
+    }
+  }
+  else
+    return false;
+
+  con->options&= (gearman_con_options_t)~GEARMAN_CON_COMPRESSION_WAIT;
+  return true;
+}
+
+static void _con_ready_remove(gearman_con_st *con)
+{
+  gearman_st *gearman= con->gearman;
+  gearman_con_st *prev;
+
+  if (!(con->options & GEARMAN_CON_READY))
+    return;
+
+  con->options&= (gearman_con_options_t)~GEARMAN_CON_READY;
+
+  if (gearman->ready_list == con)
+  {
+    gearman->ready_list= con->ready_next;
+    if (gearman->ready_list == NULL)
+      gearman->ready_end= NULL;
+    return;
+  }
+
+  for (prev= gearman->ready_list; prev != NULL; prev= prev->ready_next)
+  {
+    if (prev->ready_next == con)
+    {
+      prev->ready_next= con->ready_next;
+      if (gearman->ready_end == con)
+        gearman->ready_end= prev;
+      return;
+    }
+  }
+}
+
+static gearman_return_t _con_events_update(gearman_con_st *con)
+{
+  gearman_return_t ret;
+
+  if (con->gearman->event_watch != NULL)
+  {
+    ret= (con->gearman->event_watch)(con, con->events,
+                                     con->gearman->event_watch_arg);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      gearman_con_close(con);
+      return ret;
+    }
+  }
+#ifdef HAVE_SYS_EPOLL_H
+  else if (con->gearman->options & GEARMAN_EPOLL)
+  {
+    ret= _con_epoll_watch(con);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      gearman_con_close(con);
+      return ret;
+    }
+  }
+#endif
+
+  return GEARMAN_SUCCESS;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static gearman_return_t _con_epoll_watch(gearman_con_st *con)
+{
+  gearman_st *gearman= con->gearman;
+  struct epoll_event event;
+  int op;
+
+  if (con->fd == -1 || con->watch_events == con->events)
+    return GEARMAN_SUCCESS;
+
+  if (gearman->epoll_fd == -1)
+  {
+    gearman->epoll_fd= epoll_create(GEARMAN_EPOLL_EVENTS);
+    if (gearman->epoll_fd == -1)
+    {
+      GEARMAN_ERROR_SET(gearman, "_con_epoll_watch", "epoll_create:%d", errno)
+      gearman->last_errno= errno;
+      return GEARMAN_ERRNO;
+    }
+  }
+
+  /* Registrations are one-shot, which matches poll where events are cleared
+     once they have been returned. */
+  memset(&event, 0, sizeof(struct epoll_event));
+  event.events= EPOLLONESHOT;
+  if (con->events & POLLIN)
+    event.events|= EPOLLIN;
+  if (con->events & POLLOUT)
+    event.events|= EPOLLOUT;
+  event.data.ptr= con;
+
+  op= con->options & GEARMAN_CON_WATCHED ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(gearman->epoll_fd, op, con->fd, &event) == -1)
+  {
+    GEARMAN_ERROR_SET(gearman, "_con_epoll_watch", "epoll_ctl:%d", errno)
+    gearman->last_errno= errno;
+    return GEARMAN_ERRNO;
+  }
+
+  con->options|= GEARMAN_CON_WATCHED;
+
+  if (con->watch_events == 0)
+    gearman->watch_count++;
+  else if (con->events == 0)
+    gearman->watch_count--;
+  con->watch_events= con->events;
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _con_epoll_remove(gearman_con_st *con)
+{
+  if (!(con->options & GEARMAN_CON_WATCHED))
+    return;
+
+  /* External descriptors are not closed by us, so they must be removed. */
+  (void)epoll_ctl(con->gearman->epoll_fd, EPOLL_CTL_DEL, con->fd, NULL);
+
+  con->options&= (gearman_con_options_t)~GEARMAN_CON_WATCHED;
+  if (con->watch_events != 0)
+    con->gearman->watch_count--;
+  con->watch_events= 0;
+}
+
+static gearman_return_t _con_epoll_wait(gearman_st *gearman, int timeout)
+{
+  gearman_con_st *con;
+  short revents;
+  int ret;
+  int x;
+  gearman_return_t gret;
+
+  if (gearman->watch_count == 0)
+  {
+    GEARMAN_ERROR_SET(gearman, "gearman_con_wait", "no active file descriptors")
+    return GEARMAN_NO_ACTIVE_FDS;
+  }
+
+  if (gearman->epoll_events == NULL)
+  {
+    gearman->epoll_events= malloc(sizeof(struct epoll_event) *
+                                  GEARMAN_EPOLL_EVENTS);
+    if (gearman->epoll_events == NULL)
+    {
+      GEARMAN_ERROR_SET(gearman, "gearman_con_wait", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+  }
+
+  while (1)
+  {
+    ret= epoll_wait(gearman->epoll_fd, gearman->epoll_events,
+                    GEARMAN_EPOLL_EVENTS, timeout);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+
+      GEARMAN_ERROR_SET(gearman, "gearman_con_wait", "epoll_wait:%d", errno)
+      gearman->last_errno= errno;
+      return GEARMAN_ERRNO;
+    }
+
+    break;
+  }
+
+  for (x= 0; x < ret; x++)
+  {
+    con= (gearman_con_st *)(gearman->epoll_events[x].data.ptr);
+
+    revents= 0;
+    if (gearman->epoll_events[x].events & EPOLLIN)
+      revents|= POLLIN;
+    if (gearman->epoll_events[x].events & EPOLLOUT)
+      revents|= POLLOUT;
+    if (gearman->epoll_events[x].events & EPOLLERR)
+      revents|= POLLERR;
+    if (gearman->epoll_events[x].events & EPOLLHUP)
+      revents|= POLLHUP;
+
+    /* The one-shot registration is disarmed now. */
+    if (con->watch_events != 0)
+    {
+      con->watch_events= 0;
+      gearman->watch_count--;
+    }
+
+    gret= gearman_con_set_revents(con, revents);
+    if (gret != GEARMAN_SUCCESS)
+      return gret;
+
+    /* Rearm for anything that is still being waited on. */
+    gret= _con_epoll_watch(con);
+    if (gret != GEARMAN_SUCCESS)
+    {
+      gearman_con_close(con);
+      return gret;
+    }
+  }
+
+  return GEARMAN_SUCCESS;
+}
+#endif
@@ -70,6 +70,12 @@ void gearman_con_set_options(gearman_con_st *con, gearman_con_options_t options,
 GEARMAN_API
 gearman_return_t gearman_con_set_fd(gearman_con_st *con, int fd);
 
+/**
+ * Get the file descriptor for the connection, or -1 if it is not open.
+ */
+GEARMAN_API
+int gearman_con_fd(gearman_con_st *con);
+
 /**
  * Get application data pointer.
  */
@@ -114,6 +120,22 @@ GEARMAN_API
 size_t gearman_con_send_data(gearman_con_st *con, const void *data,
                              size_t data_size, gearman_return_t *ret_ptr);
 
+/**
+ * Write a list of buffers to a connection with one system call, bypassing the
+ * send buffer. This must only be used while the send buffer is empty, and it
+ * does not wait for the whole list to be written. As with flushing the send
+ * buffer, setting GEARMAN_CON_SEND_MORE on the connection tells the kernel
+ * that more data follows, so it can hold back a partly filled segment.
+ * @param con Connection to write to.
+ * @param iov Buffers to write.
+ * @param iov_count Number of buffers in iov.
+ * @param ret_ptr Standard gearman return value.
+ * @return Number of bytes written, which may be less than the total.
+ */
+GEARMAN_API
+size_t gearman_con_send_iov(gearman_con_st *con, const struct iovec *iov,
+                            int iov_count, gearman_return_t *ret_ptr);
+
 /**
  * Flush the send buffer.
  */
@@ -134,13 +156,44 @@ gearman_return_t gearman_con_send_all(gearman_st *gearman,
                                       gearman_packet_st *packet);
 
 /**
- * Receive packet from a connection.
+ * Receive packet from a connection. If recv_data is true, the data part of the
+ * packet is read straight into a buffer allocated at the size given in the
+ * header, and only bytes already read along with the header are copied. The
+ * buffer belongs to the packet through GEARMAN_PACKET_FREE_DATA, so callers
+ * that keep the data, like server jobs, can take it by clearing that flag.
+ * If recv_data is false, the data is left for gearman_con_recv_data.
  */
 GEARMAN_API
 gearman_packet_st *gearman_con_recv(gearman_con_st *con,
                                     gearman_packet_st *packet,
                                     gearman_return_t *ret_ptr, bool recv_data);
 
+/**
+ * Finish reading the data of a packet received with recv_data false into a
+ * buffer allocated for the packet, the same as if recv_data had been true.
+ * @param con Connection the packet was received on.
+ * @param packet Packet returned by gearman_con_recv.
+ * @return Standard gearman return value. GEARMAN_IO_WAIT means calling this
+ *         again picks up where the last call stopped.
+ */
+GEARMAN_API
+gearman_return_t gearman_con_recv_packet_data(gearman_con_st *con,
+                                              gearman_packet_st *packet);
+
+/**
+ * Get the next piece of packet data without copying it out. Bytes read along
+ * with the header are handed out from the receive buffer where they are, and
+ * when it is empty the next piece is read into it from the socket.
+ * @param con Connection to read from.
+ * @param data Set to the piece of data, which is only valid until the next
+ *        call on the connection.
+ * @param ret_ptr Standard gearman return value.
+ * @return Size of the piece, or 0 once all the data has been read.
+ */
+GEARMAN_API
+size_t gearman_con_recv_data_ref(gearman_con_st *con, const void **data,
+                                 gearman_return_t *ret_ptr);
+
 /**
  * Receive packet data from a connection.
  */
@@ -167,6 +220,13 @@ gearman_return_t gearman_con_wait(gearman_st *gearman, int timeout);
 GEARMAN_API
 gearman_return_t gearman_con_set_events(gearman_con_st *con, short events);
 
+/**
+ * Stop watching for events on a connection, such as POLLIN while a job server
+ * connection is not being read.
+ */
+GEARMAN_API
+gearman_return_t gearman_con_clear_events(gearman_con_st *con, short events);
+
 /**
  * Set events that are ready for a connection. This is used with the external
  * event callbacks.
@@ -187,6 +247,44 @@ GEARMAN_API
 gearman_return_t gearman_con_echo(gearman_st *gearman, const void *workload,
                                   size_t workload_size);
 
+/**
+ * Record that a request on a connection was answered, clearing any errors
+ * counted against it.
+ * @param con Connection the reply came in on.
+ * @param rtt Round trip time in microseconds to fold into the smoothed round
+ *        trip time, or 0 if the reply was not timed.
+ */
+GEARMAN_API
+void gearman_con_health_ok(gearman_con_st *con, uint64_t rtt);
+
+/**
+ * Record that connecting to or talking to a server failed. Each failure in a
+ * row doubles how long the connection is passed over, from
+ * GEARMAN_CON_RETRY_MIN up to GEARMAN_CON_RETRY_MAX.
+ */
+GEARMAN_API
+void gearman_con_health_fail(gearman_con_st *con);
+
+/**
+ * See if a connection may be used, which is false while it is being passed
+ * over after failures.
+ */
+GEARMAN_API
+bool gearman_con_health_ready(gearman_con_st *con);
+
+/**
+ * Get the smoothed round trip time for a connection in microseconds, or 0 if
+ * none has been measured yet.
+ */
+GEARMAN_API
+uint64_t gearman_con_rtt(gearman_con_st *con);
+
+/**
+ * Get the number of failures in a row for a connection.
+ */
+GEARMAN_API
+uint32_t gearman_con_error_count(gearman_con_st *con);
+
 /**
  * Get protocol data pointer.
  */
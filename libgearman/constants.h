@@ -26,11 +26,32 @@ extern "C" {
 /* Defines. */
 #define GEARMAN_DEFAULT_TCP_HOST "127.0.0.1"
 #define GEARMAN_DEFAULT_TCP_PORT 4730
+#define GEARMAN_UNIX_PREFIX "unix:"
+#define GEARMAN_SHM_PREFIX "shm:"
+#define GEARMAN_WEIGHT_PREFIX "/?"
+#define GEARMAN_AFFINITY_SEPARATOR '#'
+#define GEARMAN_CHAIN_SEPARATOR ' '
+#define GEARMAN_CHAIN_KEEP_WORKLOAD '='
 #define GEARMAN_DEFAULT_SOCKET_TIMEOUT 10
+#define GEARMAN_CON_RETRY_MIN (100 * 1000) /* Microseconds */
+#define GEARMAN_CON_RETRY_MAX (30 * 1000 * 1000) /* Microseconds */
+#define GEARMAN_CON_IOV_MAX 64
 #define GEARMAN_DEFAULT_SOCKET_SEND_SIZE 32768
 #define GEARMAN_DEFAULT_SOCKET_RECV_SIZE 32768
 #define GEARMAN_DEFAULT_BACKLOG 64
 #define GEARMAN_DEFAULT_MAX_QUEUE_SIZE 0
+#define GEARMAN_DEFAULT_FUNCTION_WEIGHT 1
+#define GEARMAN_DEFAULT_WORKER_WAKEUP 0
+#define GEARMAN_DEFAULT_PRIORITY_LEVELS 3
+#define GEARMAN_DEFAULT_PRIORITY_AGE 0 /* Seconds */
+#define GEARMAN_DEFAULT_AFFINITY_WAIT 0 /* Seconds */
+#define GEARMAN_DEFAULT_QUEUE_BYTES_MAX 0
+#define GEARMAN_DEFAULT_CLIENT_RATE 0 /* Bytes per second */
+#define GEARMAN_DEFAULT_WORK_DATA_MAX (16 * 1024 * 1024)
+#define GEARMAN_DEFAULT_STATS_INTERVAL 1
+#define GEARMAN_DEFAULT_QUEUE_COMMIT_WINDOW 1000 /* Microseconds */
+#define GEARMAN_DEFAULT_SNAPSHOT_INTERVAL 60 /* Seconds */
+#define GEARMAN_DEFAULT_CACHE_BYTES (16 * 1024 * 1024)
 
 #define GEARMAN_MAX_ERROR_SIZE 1024
 #define GEARMAN_PACKET_HEADER_SIZE 12
@@ -38,19 +59,89 @@ extern "C" {
 #define GEARMAN_OPTION_SIZE 64
 #define GEARMAN_UNIQUE_SIZE 64
 #define GEARMAN_MAX_COMMAND_ARGS 8
+#define GEARMAN_BATCH_SIZE_LENGTH 4
+#define GEARMAN_GRAB_JOB_MULTI_MAX 1024
+#define GEARMAN_COMPRESS_OPTION "compression"
+#define GEARMAN_ABANDON_OPTION "abandon"
+#define GEARMAN_COMPRESS_SIZE_LENGTH 4
+#define GEARMAN_COMMAND_COMPRESSED 0x80000000
 #define GEARMAN_ARGS_BUFFER_SIZE 128
 #define GEARMAN_SEND_BUFFER_SIZE 8192
 #define GEARMAN_RECV_BUFFER_SIZE 8192
+#define GEARMAN_MAX_BUFFER_SIZE (1024 * 1024)
+#define GEARMAN_BUFFER_POOL_SIZE 64
 #define GEARMAN_SERVER_CON_ID_SIZE 128
 #define GEARMAN_JOB_HASH_SIZE 383
+#define GEARMAN_JOB_HASH_REHASH_STEP 16
+#define GEARMAN_FUNCTION_HASH_SIZE 383
+#define GEARMAN_TASK_HASH_SIZE 383
+#define GEARMAN_WORKER_FUNCTION_HASH_SIZE 61
+#define GEARMAN_JOB_RESULT_BUFFER_SIZE 1024
+#define GEARMAN_TASK_CHUNK_SIZE 1024
+#define GEARMAN_CLIENT_RING_POINTS 160
+#define GEARMAN_CLIENT_MAX_WEIGHT 1000
+#define GEARMAN_HISTOGRAM_SUB_BITS 3
+#define GEARMAN_HISTOGRAM_MAX_BITS 36 /* About 19 hours in microseconds. */
+#define GEARMAN_HISTOGRAM_BUCKETS \
+  ((GEARMAN_HISTOGRAM_MAX_BITS - GEARMAN_HISTOGRAM_SUB_BITS + 1) << \
+   GEARMAN_HISTOGRAM_SUB_BITS)
+#define GEARMAN_JOB_SLOT_SIZE 1024
+#define GEARMAN_JOB_SLOT_NONE UINT32_MAX
+#define GEARMAN_SERVER_SHARD_ANY UINT32_MAX
 #define GEARMAN_MAX_FREE_SERVER_CON 1000
-#define GEARMAN_MAX_FREE_SERVER_PACKET 2000
-#define GEARMAN_MAX_FREE_SERVER_JOB 1000
-#define GEARMAN_MAX_FREE_SERVER_CLIENT 1000
-#define GEARMAN_MAX_FREE_SERVER_WORKER 1000
+#define GEARMAN_SERVER_SLAB_CHUNK_SIZE 65536
+#define GEARMAN_SERVER_SLAB_ALIGN 16
+#define GEARMAN_SERVER_SLAB_MAX_EMPTY 4
+#define GEARMAN_SERVER_JOB_SLAB_STEP 16
+#define GEARMAN_SERVER_JOB_SLAB_CLASSES \
+  (GEARMAN_UNIQUE_SIZE / GEARMAN_SERVER_JOB_SLAB_STEP)
+#define GEARMAN_SERVER_MAGAZINE_SIZE 64
+#define GEARMAN_SERVER_NUMA_NODES 8
+#define GEARMAN_SERVER_CPU_MAX 1024
+#define GEARMAN_SERVER_SPILL_SIZE (1024 * 1024)
+#define GEARMAN_SERVER_CACHE_HASH_SIZE 64
+#define GEARMAN_SERVER_IOV_SIZE 64
+#define GEARMAN_SERVER_IO_ARGS_SIZE 56
+#define GEARMAN_SERVER_REPLAY_CHUNK_SIZE 1024
+#define GEARMAN_SERVER_QUEUE_BATCH_SIZE 256
+#define GEARMAN_SERVER_PRIORITY_LEVELS_MAX 32
+#define GEARMAN_SERVER_SNAPSHOT_MAGIC "GEARSNP1"
+#define GEARMAN_SERVER_SNAPSHOT_HEADER_SIZE 16
+#define GEARMAN_SERVER_SNAPSHOT_RECORD_SIZE 12
+#define GEARMAN_SERVER_SNAPSHOT_RECORD_WHEN 1
+#define GEARMAN_SERVER_SNAPSHOT_TRAILER_SIZE 12
+#define GEARMAN_SERVER_SNAPSHOT_BUFFER_SIZE (1024 * 1024)
+#define GEARMAN_SERVER_SNAPSHOT_DROP_HASH_SIZE 1024
+#define GEARMAN_SERVER_SNAPSHOT_PATH_SIZE 1024
+#define GEARMAN_SERVER_REPLICA_MAGIC "GEARREP1"
+#define GEARMAN_SERVER_REPLICA_MAGIC_SIZE 8
+#define GEARMAN_SERVER_REPLICA_ADD_SIZE 22
+#define GEARMAN_SERVER_REPLICA_DONE_SIZE 3
+#define GEARMAN_SERVER_REPLICA_SYNC_SIZE 9
+#define GEARMAN_SERVER_REPLICA_HASH_SIZE 65536
+#define GEARMAN_SERVER_REPLICA_BATCH_SIZE (64 * 1024)
+#define GEARMAN_SERVER_REPLICA_BACKLOG_MAX (64 * 1024 * 1024)
+#define GEARMAN_SERVER_REPLICA_MESSAGE_MAX (256 * 1024 * 1024)
+#define GEARMAN_SERVER_REPLICA_TIMEOUT 10 /* Seconds */
+#define GEARMAN_SERVER_REPLICA_KEEPALIVE 1 /* Seconds */
+#define GEARMAN_SERVER_REPLICA_RETRY 1 /* Seconds */
+#define GEARMAN_SERVER_TIMER_LEVELS 4
+#define GEARMAN_SERVER_TIMER_BITS 8
+#define GEARMAN_SERVER_TIMER_SLOTS (1 << GEARMAN_SERVER_TIMER_BITS)
 #define GEARMAN_TEXT_RESPONSE_SIZE 8192
 #define GEARMAN_WORKER_WAIT_TIMEOUT (10 * 1000) /* Milliseconds */
+#define GEARMAN_WORKER_QUANTUM_MAX 64
 #define GEARMAN_PIPE_BUFFER_SIZE 256
+#define GEARMAN_EPOLL_EVENTS 64
+#define GEARMAND_URING_ENTRIES 1024
+#define GEARMAND_URING_SLOT_NONE UINT32_MAX
+#define GEARMAND_THREAD_LOAD_BYTES 1024
+#define GEARMAND_THREAD_CON_LOAD 16
+#define GEARMAND_THREAD_MIGRATE_MIN 1000
+#define GEARMAND_LOG_WAIT 10 /* Milliseconds */
+#define GEARMAND_LOG_RING_MAX (1 << 20)
+#define GEARMAND_LOG_THREAD_NONE UINT32_MAX
+#define GEARMAND_DEFAULT_ACCEPT_BUDGET 64
 #define GEARMAN_CONF_MAX_OPTION_SHORT 128
 #define GEARMAN_CONF_DISPLAY_WIDTH 80
 
@@ -58,24 +149,68 @@ extern "C" {
 typedef struct gearman_st gearman_st;
 typedef struct gearman_con_st gearman_con_st;
 typedef struct gearman_packet_st gearman_packet_st;
+typedef struct gearman_packet_buffer_st gearman_packet_buffer_st;
+typedef struct gearman_queue_record_st gearman_queue_record_st;
 typedef struct gearman_command_info_st gearman_command_info_st;
 typedef struct gearman_task_st gearman_task_st;
+typedef struct gearman_task_chunk_st gearman_task_chunk_st;
 typedef struct gearman_client_st gearman_client_st;
+typedef struct gearman_client_point_st gearman_client_point_st;
+typedef struct gearman_client_pool_st gearman_client_pool_st;
+typedef struct gearman_client_pool_req_st gearman_client_pool_req_st;
+typedef struct gearman_client_stats_st gearman_client_stats_st;
+typedef struct gearman_histogram_st gearman_histogram_st;
 typedef struct gearman_job_st gearman_job_st;
+typedef struct gearman_job_buffer_st gearman_job_buffer_st;
 typedef struct gearman_worker_st gearman_worker_st;
 typedef struct gearman_worker_function_st gearman_worker_function_st;
+typedef struct gearman_worker_batch_job_st gearman_worker_batch_job_st;
+typedef struct gearman_worker_pool_st gearman_worker_pool_st;
+typedef struct gearman_worker_pool_job_st gearman_worker_pool_job_st;
 typedef struct gearman_server_st gearman_server_st;
 typedef struct gearman_server_thread_st gearman_server_thread_st;
 typedef struct gearman_server_con_st gearman_server_con_st;
 typedef struct gearman_server_packet_st gearman_server_packet_st;
+typedef struct gearman_server_io_packet_st gearman_server_io_packet_st;
 typedef struct gearman_server_function_st gearman_server_function_st;
+typedef struct gearman_server_latency_st gearman_server_latency_st;
 typedef struct gearman_server_client_st gearman_server_client_st;
 typedef struct gearman_server_worker_st gearman_server_worker_st;
 typedef struct gearman_server_job_st gearman_server_job_st;
+typedef struct gearman_server_job_slot_st gearman_server_job_slot_st;
+typedef struct gearman_server_slab_st gearman_server_slab_st;
+typedef struct gearman_server_slab_chunk_st gearman_server_slab_chunk_st;
+typedef struct gearman_server_magazine_st gearman_server_magazine_st;
+typedef struct gearman_server_spill_st gearman_server_spill_st;
+typedef struct gearman_server_stats_st gearman_server_stats_st;
+typedef struct gearman_server_lock_stats_st gearman_server_lock_stats_st;
+typedef struct gearman_server_commit_st gearman_server_commit_st;
+typedef struct gearman_server_timer_st gearman_server_timer_st;
+typedef struct gearman_server_cache_st gearman_server_cache_st;
+typedef struct gearman_server_cache_entry_st gearman_server_cache_entry_st;
+typedef struct gearman_server_replay_st gearman_server_replay_st;
+typedef struct gearman_server_replay_chunk_st gearman_server_replay_chunk_st;
+typedef struct gearman_server_replay_job_st gearman_server_replay_job_st;
+typedef struct gearman_server_persist_st gearman_server_persist_st;
+typedef struct gearman_server_persist_req_st gearman_server_persist_req_st;
+typedef struct gearman_server_persist_count_st gearman_server_persist_count_st;
+typedef struct gearman_server_snapshot_st gearman_server_snapshot_st;
+typedef struct gearman_server_snapshot_drop_st gearman_server_snapshot_drop_st;
+typedef struct gearman_server_replica_st gearman_server_replica_st;
+typedef struct gearman_server_replica_peer_st gearman_server_replica_peer_st;
+typedef struct gearman_server_replica_entry_st gearman_server_replica_entry_st;
+typedef struct gearman_server_replica_event_st gearman_server_replica_event_st;
+typedef struct gearman_server_shard_st gearman_server_shard_st;
+typedef struct gearman_server_con_shard_st gearman_server_con_shard_st;
 typedef struct gearmand_st gearmand_st;
 typedef struct gearmand_port_st gearmand_port_st;
 typedef struct gearmand_con_st gearmand_con_st;
 typedef struct gearmand_thread_st gearmand_thread_st;
+typedef struct gearmand_uring_st gearmand_uring_st;
+typedef struct gearmand_uring_event_st gearmand_uring_event_st;
+typedef struct gearmand_log_st gearmand_log_st;
+typedef struct gearmand_log_ring_st gearmand_log_ring_st;
+typedef struct gearmand_log_record_st gearmand_log_record_st;
 typedef struct gearman_conf_st gearman_conf_st;
 typedef struct gearman_conf_option_st gearman_conf_option_st;
 typedef struct gearman_conf_module_st gearman_conf_module_st;
@@ -157,7 +292,11 @@ typedef enum
 {
   GEARMAN_ALLOCATED=          (1 << 0),
   GEARMAN_NON_BLOCKING=       (1 << 1),
-  GEARMAN_DONT_TRACK_PACKETS= (1 << 2)
+  GEARMAN_DONT_TRACK_PACKETS= (1 << 2),
+  GEARMAN_EPOLL=              (1 << 3),
+  GEARMAN_KEEP_COMPRESSED=    (1 << 4),
+  GEARMAN_QUEUE_REPLAY_CONCURRENT= (1 << 5),
+  GEARMAN_WATCH_CLOSE=        (1 << 6)
 } gearman_options_t;
 
 /**
@@ -171,7 +310,15 @@ typedef enum
   GEARMAN_CON_PACKET_IN_USE=          (1 << 2),
   GEARMAN_CON_EXTERNAL_FD=            (1 << 3),
   GEARMAN_CON_IGNORE_LOST_CONNECTION= (1 << 4),
-  GEARMAN_CON_CLOSE_AFTER_FLUSH=      (1 << 5)
+  GEARMAN_CON_CLOSE_AFTER_FLUSH=      (1 << 5),
+  GEARMAN_CON_WATCHED=                (1 << 6),
+  GEARMAN_CON_SEND_MORE=              (1 << 7),
+  GEARMAN_CON_COMPRESSION=            (1 << 8),
+  GEARMAN_CON_COMPRESSION_WAIT=       (1 << 9),
+  GEARMAN_CON_SHM=                    (1 << 10),
+  GEARMAN_CON_SLEEPING=               (1 << 11),
+  GEARMAN_CON_NONBLOCK=               (1 << 12),
+  GEARMAN_CON_ABANDON=                (1 << 13)
 } gearman_con_options_t;
 
 /**
@@ -196,7 +343,9 @@ typedef enum
   GEARMAN_CON_SEND_STATE_PRE_FLUSH,
   GEARMAN_CON_SEND_STATE_FORCE_FLUSH,
   GEARMAN_CON_SEND_STATE_FLUSH,
-  GEARMAN_CON_SEND_STATE_FLUSH_DATA
+  GEARMAN_CON_SEND_STATE_FLUSH_DATA,
+  GEARMAN_CON_SEND_STATE_IOV_FLUSH,
+  GEARMAN_CON_SEND_STATE_IOV_DATA
 } gearman_con_send_state_t;
 
 /**
@@ -216,9 +365,11 @@ typedef enum
  */
 typedef enum
 {
-  GEARMAN_PACKET_ALLOCATED= (1 << 0),
-  GEARMAN_PACKET_COMPLETE=  (1 << 1),
-  GEARMAN_PACKET_FREE_DATA= (1 << 2)
+  GEARMAN_PACKET_ALLOCATED=  (1 << 0),
+  GEARMAN_PACKET_COMPLETE=   (1 << 1),
+  GEARMAN_PACKET_FREE_DATA=  (1 << 2),
+  GEARMAN_PACKET_COMPRESSED= (1 << 3),
+  GEARMAN_PACKET_ARGS_REF=   (1 << 4)
 } gearman_packet_options_t;
 
 /**
@@ -276,6 +427,12 @@ typedef enum
   GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG,
   GEARMAN_COMMAND_SUBMIT_JOB_SCHED,
   GEARMAN_COMMAND_SUBMIT_JOB_EPOCH,
+  GEARMAN_COMMAND_SUBMIT_JOB_BATCH,
+  GEARMAN_COMMAND_JOB_CREATED_BATCH,
+  GEARMAN_COMMAND_GRAB_JOB_MULTI,
+  GEARMAN_COMMAND_SET_SLOTS,
+  GEARMAN_COMMAND_SUBMIT_JOB_CHAIN,
+  GEARMAN_COMMAND_JOB_ABANDONED,
   GEARMAN_COMMAND_MAX /* Always add new commands before this. */
 } gearman_command_t;
 
@@ -285,8 +442,12 @@ typedef enum
  */
 typedef enum
 {
-  GEARMAN_TASK_ALLOCATED=   (1 << 0),
-  GEARMAN_TASK_SEND_IN_USE= (1 << 1)
+  GEARMAN_TASK_ALLOCATED=      (1 << 0),
+  GEARMAN_TASK_SEND_IN_USE=    (1 << 1),
+  GEARMAN_TASK_NEW_QUEUED=     (1 << 2),
+  GEARMAN_TASK_CREATED_QUEUED= (1 << 3),
+  GEARMAN_TASK_HANDLE_HASHED=  (1 << 4),
+  GEARMAN_TASK_POOLED=         (1 << 5)
 } gearman_task_options_t;
 
 /**
@@ -344,7 +505,11 @@ typedef enum
   GEARMAN_CLIENT_TASK_IN_USE=       (1 << 2),
   GEARMAN_CLIENT_UNBUFFERED_RESULT= (1 << 3),
   GEARMAN_CLIENT_NO_NEW=            (1 << 4),
-  GEARMAN_CLIENT_FREE_TASKS=        (1 << 5)
+  GEARMAN_CLIENT_FREE_TASKS=        (1 << 5),
+  GEARMAN_CLIENT_EPOLL=             (1 << 6),
+  GEARMAN_CLIENT_DIRECT_PACK=       (1 << 7),
+  GEARMAN_CLIENT_CONSISTENT_HASH=   (1 << 8),
+  GEARMAN_CLIENT_STATS=             (1 << 9)
 } gearman_client_options_t;
 
 /**
@@ -359,6 +524,16 @@ typedef enum
   GEARMAN_CLIENT_STATE_PACKET
 } gearman_client_state_t;
 
+/**
+ * @ingroup gearman_client_pool
+ * Options for gearman_client_pool_st.
+ */
+typedef enum
+{
+  GEARMAN_CLIENT_POOL_ALLOCATED= (1 << 0),
+  GEARMAN_CLIENT_POOL_STARTED=   (1 << 1)
+} gearman_client_pool_options_t;
+
 /**
  * @ingroup gearman_worker
  * Options for gearman_worker_st.
@@ -372,7 +547,9 @@ typedef enum
   GEARMAN_WORKER_PRE_SLEEP_IN_USE= (1 << 4),
   GEARMAN_WORKER_WORK_JOB_IN_USE=  (1 << 5),
   GEARMAN_WORKER_CHANGE=           (1 << 6),
-  GEARMAN_WORKER_GRAB_UNIQ=        (1 << 7)
+  GEARMAN_WORKER_GRAB_UNIQ=        (1 << 7),
+  GEARMAN_WORKER_EPOLL=            (1 << 8),
+  GEARMAN_WORKER_ABANDON_IN_USE=   (1 << 9)
 } gearman_worker_options_t;
 
 /**
@@ -389,6 +566,18 @@ typedef enum
   GEARMAN_WORKER_STATE_PRE_SLEEP
 } gearman_worker_state_t;
 
+/**
+ * @ingroup gearman_worker
+ * Orders for asking job servers for work, see gearman_worker_set_poll.
+ */
+typedef enum
+{
+  GEARMAN_WORKER_POLL_ORDER,
+  GEARMAN_WORKER_POLL_ROUND_ROBIN,
+  GEARMAN_WORKER_POLL_DEFICIT,
+  GEARMAN_WORKER_POLL_LAST_WORK
+} gearman_worker_poll_t;
+
 /**
  * @ingroup gearman_worker
  * Options for gearman_worker_function_st.
@@ -400,6 +589,16 @@ typedef enum
   GEARMAN_WORKER_FUNCTION_REMOVE=        (1 << 2)
 } gearman_worker_function_options_t;
 
+/**
+ * @ingroup gearman_worker_pool
+ * Options for gearman_worker_pool_st.
+ */
+typedef enum
+{
+  GEARMAN_WORKER_POOL_ALLOCATED= (1 << 0),
+  GEARMAN_WORKER_POOL_STARTED=   (1 << 1)
+} gearman_worker_pool_options_t;
+
 /**
  * @ingroup gearman_worker
  * Work states for gearman_worker_st.
@@ -409,7 +608,10 @@ typedef enum
   GEARMAN_WORKER_WORK_STATE_GRAB_JOB,
   GEARMAN_WORKER_WORK_STATE_FUNCTION,
   GEARMAN_WORKER_WORK_STATE_COMPLETE,
-  GEARMAN_WORKER_WORK_STATE_FAIL
+  GEARMAN_WORKER_WORK_STATE_FAIL,
+  GEARMAN_WORKER_WORK_STATE_BATCH_GRAB,
+  GEARMAN_WORKER_WORK_STATE_BATCH_FUNCTION,
+  GEARMAN_WORKER_WORK_STATE_BATCH_COMPLETE
 } gearman_worker_work_state_t;
 
 /**
@@ -420,9 +622,79 @@ typedef enum
 {
   GEARMAN_SERVER_ALLOCATED=    (1 << 0),
   GEARMAN_SERVER_PROC_THREAD=  (1 << 1),
-  GEARMAN_SERVER_QUEUE_REPLAY= (1 << 2)
+  GEARMAN_SERVER_QUEUE_REPLAY= (1 << 2),
+  GEARMAN_SERVER_JOB_HANDLE_INDEX= (1 << 3),
+  GEARMAN_SERVER_TCP_CORK=         (1 << 4),
+  GEARMAN_SERVER_PROC_INLINE=      (1 << 5),
+  GEARMAN_SERVER_LOCK_STATS=       (1 << 6)
 } gearman_server_options_t;
 
+/**
+ * @ingroup gearman_server_lock
+ * Kinds of locks that keep stats.
+ */
+typedef enum
+{
+  GEARMAN_SERVER_LOCK_THREAD,
+  GEARMAN_SERVER_LOCK_GEARMAND_THREAD,
+  GEARMAN_SERVER_LOCK_SHARD,
+  GEARMAN_SERVER_LOCK_PROC,
+  GEARMAN_SERVER_LOCK_MAX
+} gearman_server_lock_site_t;
+
+/**
+ * @ingroup gearman_server_stats
+ * Snapshots kept for the admin commands.
+ */
+typedef enum
+{
+  GEARMAN_SERVER_STATS_STATUS,
+  GEARMAN_SERVER_STATS_STATUS_JSON,
+  GEARMAN_SERVER_STATS_WORKERS,
+  GEARMAN_SERVER_STATS_WORKERS_JSON,
+  GEARMAN_SERVER_STATS_COUNTERS,
+  GEARMAN_SERVER_STATS_COUNTERS_JSON,
+  GEARMAN_SERVER_STATS_LATENCY,
+  GEARMAN_SERVER_STATS_LATENCY_JSON,
+  GEARMAN_SERVER_STATS_METRICS,
+  GEARMAN_SERVER_STATS_MAX
+} gearman_server_stats_t;
+
+/**
+ * @ingroup gearman_server_persist
+ * Requests for the persistence thread.
+ */
+typedef enum
+{
+  GEARMAN_SERVER_PERSIST_ADD,
+  GEARMAN_SERVER_PERSIST_DONE,
+  GEARMAN_SERVER_PERSIST_COMMIT
+} gearman_server_persist_type_t;
+
+/**
+ * @ingroup gearman_server_replica
+ * Message types sent between replicating servers.
+ */
+typedef enum
+{
+  GEARMAN_SERVER_REPLICA_ADD=   'A',
+  GEARMAN_SERVER_REPLICA_DONE=  'D',
+  GEARMAN_SERVER_REPLICA_RESET= 'R',
+  GEARMAN_SERVER_REPLICA_SYNC=  'S',
+  GEARMAN_SERVER_REPLICA_ACK=   'K'
+} gearman_server_replica_message_t;
+
+/**
+ * @ingroup gearman_server_replica
+ * States of a replication peer.
+ */
+typedef enum
+{
+  GEARMAN_SERVER_REPLICA_PEER_CONNECTING,
+  GEARMAN_SERVER_REPLICA_PEER_SYNCING,
+  GEARMAN_SERVER_REPLICA_PEER_STREAMING
+} gearman_server_replica_peer_state_t;
+
 /**
  * @ingroup gearman_server_thread
  * Options for gearman_server_thread_st.
@@ -440,7 +712,8 @@ typedef enum
 {
   GEARMAN_SERVER_CON_SLEEPING=   (1 << 0),
   GEARMAN_SERVER_CON_EXCEPTIONS= (1 << 1),
-  GEARMAN_SERVER_CON_DEAD=       (1 << 2)
+  GEARMAN_SERVER_CON_DEAD=       (1 << 2),
+  GEARMAN_SERVER_CON_ABANDON=    (1 << 3)
 } gearman_server_con_options_t;
 
 /**
@@ -476,11 +749,29 @@ typedef enum
  */
 typedef enum
 {
-  GEARMAN_SERVER_JOB_ALLOCATED= (1 << 0),
-  GEARMAN_SERVER_JOB_QUEUED=    (1 << 1),
-  GEARMAN_SERVER_JOB_IGNORE=    (1 << 2)
+  GEARMAN_SERVER_JOB_ALLOCATED=  (1 << 0),
+  GEARMAN_SERVER_JOB_QUEUED=     (1 << 1),
+  GEARMAN_SERVER_JOB_IGNORE=     (1 << 2),
+  GEARMAN_SERVER_JOB_COMPRESSED= (1 << 3),
+  GEARMAN_SERVER_JOB_SPILLED=    (1 << 4),
+  GEARMAN_SERVER_JOB_PUSHED=     (1 << 5),
+  GEARMAN_SERVER_JOB_TIMER=      (1 << 6),
+  GEARMAN_SERVER_JOB_SCHEDULED=  (1 << 7),
+  GEARMAN_SERVER_JOB_AFFINITY=   (1 << 8),
+  GEARMAN_SERVER_JOB_STREAMED=   (1 << 9),
+  GEARMAN_SERVER_JOB_REPLICATED= (1 << 10),
+  GEARMAN_SERVER_JOB_CHAINED=    (1 << 11)
 } gearman_server_job_options_t;
 
+/**
+ * @ingroup gearman_server_slab
+ * Options for gearman_server_slab_st.
+ */
+typedef enum
+{
+  GEARMAN_SERVER_SLAB_ALLOCATED= (1 << 0)
+} gearman_server_slab_options_t;
+
 /**
  * @ingroup gearmand
  * Options for gearmand_st.
@@ -488,7 +779,10 @@ typedef enum
 typedef enum
 {
   GEARMAND_LISTEN_EVENT= (1 << 0),
-  GEARMAND_WAKEUP_EVENT= (1 << 1)
+  GEARMAND_WAKEUP_EVENT= (1 << 1),
+  GEARMAND_REUSEPORT=    (1 << 2),
+  GEARMAND_TIMER_EVENT=  (1 << 3),
+  GEARMAND_MIGRATE=      (1 << 4)
 } gearmand_options_t;
 
 /**
@@ -501,7 +795,8 @@ typedef enum
   GEARMAND_WAKEUP_SHUTDOWN=          (1 << 1),
   GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL= (1 << 2),
   GEARMAND_WAKEUP_CON=               (1 << 3),
-  GEARMAND_WAKEUP_RUN=               (1 << 4)
+  GEARMAND_WAKEUP_RUN=               (1 << 4),
+  GEARMAND_WAKEUP_BALANCE=           (1 << 5)
 } gearmand_wakeup_t;
 
 /**
@@ -511,9 +806,44 @@ typedef enum
 typedef enum
 {
   GEARMAND_THREAD_WAKEUP_EVENT= (1 << 0),
-  GEARMAND_THREAD_LOCK=         (1 << 1)
+  GEARMAND_THREAD_LOCK=         (1 << 1),
+  GEARMAND_THREAD_LISTEN_EVENT= (1 << 2),
+  GEARMAND_THREAD_URING=        (1 << 3)
 } gearmand_thread_options_t;
 
+/**
+ * @ingroup gearmand_con
+ * How far a gearmand_con_st is in turning its address into host and port
+ * strings, which is only done once something asks for them.
+ */
+typedef enum
+{
+  GEARMAND_CON_NAME_NONE,
+  GEARMAND_CON_NAME_BUSY,
+  GEARMAND_CON_NAME_DONE
+} gearmand_con_name_t;
+
+/**
+ * @ingroup gearmand
+ * I/O engines the gearmand I/O threads can wait for connections with.
+ */
+typedef enum
+{
+  GEARMAND_IO_ENGINE_LIBEVENT,
+  GEARMAND_IO_ENGINE_IO_URING
+} gearmand_io_engine_t;
+
+/**
+ * @ingroup gearmand_log
+ * Kinds of records in a gearmand_log_ring_st.
+ */
+typedef enum
+{
+  GEARMAND_LOG_RECORD_LINE,
+  GEARMAND_LOG_RECORD_RECEIVED,
+  GEARMAND_LOG_RECORD_SENT
+} gearmand_log_record_t;
+
 /**
  * @ingroup gearman_conf
  * Options for gearman_conf_st.
@@ -547,13 +877,25 @@ typedef gearman_return_t (gearman_status_fn)(gearman_task_st *task);
 typedef gearman_return_t (gearman_complete_fn)(gearman_task_st *task);
 typedef gearman_return_t (gearman_exception_fn)(gearman_task_st *task);
 typedef gearman_return_t (gearman_fail_fn)(gearman_task_st *task);
+typedef gearman_return_t (gearman_result_fn)(gearman_task_st *task,
+                                             const void *data,
+                                             size_t data_size);
 
 typedef gearman_return_t (gearman_parse_server_fn)(const char *host,
-                                                   in_port_t port, void *data);
+                                                   in_port_t port,
+                                                   uint32_t weight,
+                                                   void *data);
 
 typedef void* (gearman_worker_fn)(gearman_job_st *job, void *fn_arg,
                                   size_t *result_size,
                                   gearman_return_t *ret_ptr);
+typedef gearman_return_t (gearman_worker_buffer_fn)(gearman_job_st *job,
+                                                    void *fn_arg);
+typedef gearman_return_t (gearman_worker_batch_fn)(gearman_job_st **job_list,
+                                                   uint32_t job_count,
+                                                   void *fn_arg);
+typedef void (gearman_worker_abandoned_fn)(const char *job_handle,
+                                           void *fn_arg);
 
 typedef gearman_return_t (gearman_event_watch_fn)(gearman_con_st *con,
                                                   short events, void *arg);
@@ -571,9 +913,19 @@ typedef void (gearman_server_log_fn)(gearman_server_st *server,
 typedef void (gearman_server_thread_log_fn)(gearman_server_thread_st *thread,
                                             gearman_verbose_t verbose,
                                             const char *line, void *fn_arg);
+typedef void (gearman_server_thread_packet_log_fn)(
+                                            gearman_server_thread_st *thread,
+                                            gearman_server_con_st *con,
+                                            gearman_command_t command,
+                                            bool sent, void *fn_arg);
+typedef void (gearman_server_thread_con_name_fn)(
+                                            gearman_server_thread_st *thread,
+                                            gearman_server_con_st *con);
 typedef void (gearmand_log_fn)(gearmand_st *gearmand, gearman_verbose_t verbose,
                                const char *line, void *fn_arg);
 
+typedef void (gearmand_uring_event_fn)(int fd, short events, void *arg);
+
 typedef void (gearman_server_thread_run_fn)(gearman_server_thread_st *thread,
                                             void *fn_arg);
 
@@ -614,7 +966,8 @@ typedef gearman_return_t (gearman_queue_add_fn)(gearman_st *gearman,
                                                 size_t function_name_size,
                                                 const void *data,
                                                 size_t data_size,
-                                               gearman_job_priority_t priority);
+                                                gearman_job_priority_t priority,
+                                                int64_t when);
 typedef gearman_return_t (gearman_queue_flush_fn)(gearman_st *gearman,
                                                   void *fn_arg);
 typedef gearman_return_t (gearman_queue_done_fn)(gearman_st *gearman,
@@ -623,10 +976,34 @@ typedef gearman_return_t (gearman_queue_done_fn)(gearman_st *gearman,
                                                  size_t unique_size,
                                                  const void *function_name,
                                                  size_t function_name_size);
+typedef gearman_return_t (gearman_queue_add_batch_fn)(gearman_st *gearman,
+                                          void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count);
+typedef gearman_return_t (gearman_queue_done_batch_fn)(gearman_st *gearman,
+                                          void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count);
 typedef gearman_return_t (gearman_queue_replay_fn)(gearman_st *gearman,
                                                    void *fn_arg,
                                                    gearman_queue_add_fn *add_fn,
                                                    void *add_fn_arg);
+typedef void (gearman_queue_commit_done_fn)(void *done_arg,
+                                            gearman_return_t ret);
+typedef gearman_return_t (gearman_queue_commit_fn)(gearman_st *gearman,
+                                            void *fn_arg,
+                                            gearman_queue_commit_done_fn *done_fn,
+                                            void *done_arg);
+typedef gearman_return_t (gearman_queue_mark_fn)(gearman_st *gearman,
+                                                 void *fn_arg, uint64_t *mark);
+typedef gearman_return_t (gearman_queue_checkpoint_fn)(gearman_st *gearman,
+                                                       void *fn_arg,
+                                                       uint64_t mark);
+typedef gearman_return_t (gearman_queue_replay_tail_fn)(gearman_st *gearman,
+                                                   void *fn_arg, uint64_t mark,
+                                                   gearman_queue_add_fn *add_fn,
+                                                 gearman_queue_done_fn *done_fn,
+                                                   void *replay_fn_arg);
 
 /** @} */
 
@@ -35,6 +35,11 @@ static const char *_verbose_name[GEARMAN_VERBOSE_MAX]=
   "CRAZY"
 };
 
+/**
+ * Free all buffers in a connection buffer pool.
+ */
+static void _buffer_pool_free(void **list, uint32_t *count);
+
 /** @} */
 
 /*
@@ -76,15 +81,40 @@ gearman_st *gearman_create(gearman_st *gearman)
   gearman->con_count= 0;
   gearman->job_count= 0;
   gearman->task_count= 0;
+  gearman->handle_count= 0;
+  gearman->handle_hash_size= 0;
+  gearman->task_pool_count= 0;
   gearman->packet_count= 0;
   gearman->pfds_size= 0;
+  gearman->watch_count= 0;
   gearman->sending= 0;
+  gearman->send_buffer_count= 0;
+  gearman->recv_buffer_count= 0;
   gearman->last_errno= 0;
+  gearman->epoll_fd= -1;
+  gearman->read_count= 0;
+  gearman->read_bytes= 0;
+  gearman->write_count= 0;
+  gearman->write_bytes= 0;
+  gearman->eagain_count= 0;
+  gearman->send_buffer_size= GEARMAN_SEND_BUFFER_SIZE;
+  gearman->recv_buffer_size= GEARMAN_RECV_BUFFER_SIZE;
+  gearman->compress_threshold= 0;
+  gearman->send_buffer_list= NULL;
+  gearman->recv_buffer_list= NULL;
   gearman->con_list= NULL;
+  gearman->ready_list= NULL;
+  gearman->ready_end= NULL;
   gearman->job_list= NULL;
   gearman->task_list= NULL;
+  gearman->task_new_list= NULL;
+  gearman->task_new_end= NULL;
+  gearman->handle_hash= NULL;
+  gearman->task_pool_list= NULL;
+  gearman->task_chunk_list= NULL;
   gearman->packet_list= NULL;
   gearman->pfds= NULL;
+  gearman->epoll_events= NULL;
   gearman->log_fn= NULL;
   gearman->log_fn_arg= NULL;
   gearman->event_watch= NULL;
@@ -99,6 +129,12 @@ gearman_st *gearman_create(gearman_st *gearman)
   gearman->queue_flush_fn= NULL;
   gearman->queue_done_fn= NULL;
   gearman->queue_replay_fn= NULL;
+  gearman->queue_commit_fn= NULL;
+  gearman->queue_add_batch_fn= NULL;
+  gearman->queue_done_batch_fn= NULL;
+  gearman->queue_mark_fn= NULL;
+  gearman->queue_checkpoint_fn= NULL;
+  gearman->queue_replay_tail_fn= NULL;
   gearman->last_error[0]= 0;
 
   return gearman;
@@ -113,6 +149,9 @@ gearman_st *gearman_clone(gearman_st *gearman, gearman_st *from)
     return NULL;
 
   gearman->options|= (from->options & (gearman_options_t)~GEARMAN_ALLOCATED);
+  gearman->send_buffer_size= from->send_buffer_size;
+  gearman->recv_buffer_size= from->recv_buffer_size;
+  gearman->compress_threshold= from->compress_threshold;
 
   for (con= from->con_list; con != NULL; con= con->next)
   {
@@ -145,6 +184,11 @@ void gearman_free(gearman_st *gearman)
   for (task= gearman->task_list; task != NULL; task= gearman->task_list)
     gearman_task_free(task);
 
+  if (gearman->handle_hash != NULL)
+    free(gearman->handle_hash);
+
+  gearman_task_pool_free(gearman);
+
   for (packet= gearman->packet_list; packet != NULL;
        packet= gearman->packet_list)
   {
@@ -154,6 +198,17 @@ void gearman_free(gearman_st *gearman)
   if (gearman->pfds != NULL)
     free(gearman->pfds);
 
+  if (gearman->epoll_events != NULL)
+    free(gearman->epoll_events);
+
+  if (gearman->epoll_fd != -1)
+    (void)close(gearman->epoll_fd);
+
+  _buffer_pool_free(&(gearman->send_buffer_list),
+                    &(gearman->send_buffer_count));
+  _buffer_pool_free(&(gearman->recv_buffer_list),
+                    &(gearman->recv_buffer_count));
+
   if (gearman->options & GEARMAN_ALLOCATED)
     free(gearman);
 }
@@ -177,6 +232,40 @@ void gearman_set_options(gearman_st *gearman, gearman_options_t options,
     gearman->options &= ~options;
 }
 
+void gearman_set_buffer_size(gearman_st *gearman, size_t send_size,
+                             size_t recv_size)
+{
+  if (send_size == 0)
+    send_size= GEARMAN_SEND_BUFFER_SIZE;
+  else if (send_size < GEARMAN_PACKET_HEADER_SIZE)
+    send_size= GEARMAN_PACKET_HEADER_SIZE;
+
+  if (recv_size == 0)
+    recv_size= GEARMAN_RECV_BUFFER_SIZE;
+  else if (recv_size < GEARMAN_PACKET_HEADER_SIZE)
+    recv_size= GEARMAN_PACKET_HEADER_SIZE;
+
+  /* Pooled buffers are all the old size, so they can't be handed out now. */
+  if (send_size != gearman->send_buffer_size)
+  {
+    _buffer_pool_free(&(gearman->send_buffer_list),
+                      &(gearman->send_buffer_count));
+    gearman->send_buffer_size= send_size;
+  }
+
+  if (recv_size != gearman->recv_buffer_size)
+  {
+    _buffer_pool_free(&(gearman->recv_buffer_list),
+                      &(gearman->recv_buffer_count));
+    gearman->recv_buffer_size= recv_size;
+  }
+}
+
+void gearman_set_compression(gearman_st *gearman, size_t threshold)
+{
+  gearman->compress_threshold= threshold;
+}
+
 void gearman_set_log(gearman_st *gearman, gearman_log_fn log_fn,
                      void *log_fn_arg, gearman_verbose_t verbose)
 {
@@ -248,6 +337,41 @@ void gearman_set_queue_replay(gearman_st *gearman,
   gearman->queue_replay_fn= replay_fn;
 }
 
+void gearman_set_queue_commit(gearman_st *gearman,
+                              gearman_queue_commit_fn *commit_fn)
+{
+  gearman->queue_commit_fn= commit_fn;
+}
+
+void gearman_set_queue_add_batch(gearman_st *gearman,
+                                 gearman_queue_add_batch_fn *add_batch_fn)
+{
+  gearman->queue_add_batch_fn= add_batch_fn;
+}
+
+void gearman_set_queue_done_batch(gearman_st *gearman,
+                                  gearman_queue_done_batch_fn *done_batch_fn)
+{
+  gearman->queue_done_batch_fn= done_batch_fn;
+}
+
+void gearman_set_queue_mark(gearman_st *gearman, gearman_queue_mark_fn *mark_fn)
+{
+  gearman->queue_mark_fn= mark_fn;
+}
+
+void gearman_set_queue_checkpoint(gearman_st *gearman,
+                                  gearman_queue_checkpoint_fn *checkpoint_fn)
+{
+  gearman->queue_checkpoint_fn= checkpoint_fn;
+}
+
+void gearman_set_queue_replay_tail(gearman_st *gearman,
+                                   gearman_queue_replay_tail_fn *replay_tail_fn)
+{
+  gearman->queue_replay_tail_fn= replay_tail_fn;
+}
+
 gearman_return_t gearman_parse_servers(const char *servers, void *data,
                                        gearman_parse_server_fn *server_fn)
 { 
@@ -255,16 +379,24 @@ gearman_return_t gearman_parse_servers(const char *servers, void *data,
   size_t x;
   char host[NI_MAXHOST];
   char port[NI_MAXSERV];
+  bool unix_path;
+  uint32_t weight;
   gearman_return_t ret;
 
   if (ptr == NULL)
-    return (*server_fn)(NULL, 0, data);
+    return (*server_fn)(NULL, 0, 1, data);
 
   while (1)
   { 
     x= 0;
 
-    while (*ptr != 0 && *ptr != ',' && *ptr != ':')
+    /* Unix socket paths may contain ':' and never have a port. */
+    unix_path= *ptr == '/' ||
+               !strncmp(ptr, GEARMAN_UNIX_PREFIX, strlen(GEARMAN_UNIX_PREFIX)) ||
+               !strncmp(ptr, GEARMAN_SHM_PREFIX, strlen(GEARMAN_SHM_PREFIX));
+
+    while (*ptr != 0 && *ptr != ',' && (unix_path || *ptr != ':') &&
+           strncmp(ptr, GEARMAN_WEIGHT_PREFIX, strlen(GEARMAN_WEIGHT_PREFIX)))
     { 
       if (x < (NI_MAXHOST - 1))
         host[x++]= *ptr;
@@ -279,7 +411,8 @@ gearman_return_t gearman_parse_servers(const char *servers, void *data,
       ptr++;
       x= 0;
 
-      while (*ptr != 0 && *ptr != ',')
+      while (*ptr != 0 && *ptr != ',' &&
+             strncmp(ptr, GEARMAN_WEIGHT_PREFIX, strlen(GEARMAN_WEIGHT_PREFIX)))
       { 
         if (x < (NI_MAXSERV - 1))
           port[x++]= *ptr;
@@ -292,7 +425,18 @@ gearman_return_t gearman_parse_servers(const char *servers, void *data,
     else
       port[0]= 0;
 
-    ret= (*server_fn)(host, (in_port_t)atoi(port), data);
+    /* A weight only matters for consistent hashing, and defaults to 1. */
+    weight= 1;
+    if (!strncmp(ptr, GEARMAN_WEIGHT_PREFIX, strlen(GEARMAN_WEIGHT_PREFIX)))
+    {
+      ptr+= strlen(GEARMAN_WEIGHT_PREFIX);
+      weight= (uint32_t)strtoul(ptr, NULL, 10);
+
+      while (*ptr != 0 && *ptr != ',')
+        ptr++;
+    }
+
+    ret= (*server_fn)(host, (in_port_t)atoi(port), weight, data);
     if (ret != GEARMAN_SUCCESS)
       return ret;
 
@@ -304,3 +448,31 @@ gearman_return_t gearman_parse_servers(const char *servers, void *data,
 
   return GEARMAN_SUCCESS;
 }
+
+uint64_t gearman_time_now(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+    return 0;
+
+  return ((uint64_t)ts.tv_sec * 1000000) + ((uint64_t)ts.tv_nsec / 1000);
+}
+
+/*
+ * Private definitions
+ */
+
+static void _buffer_pool_free(void **list, uint32_t *count)
+{
+  void *buffer;
+
+  while (*list != NULL)
+  {
+    buffer= *list;
+    *list= *((void **)buffer);
+    free(buffer);
+  }
+
+  *count= 0;
+}
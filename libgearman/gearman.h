@@ -33,12 +33,27 @@
 #include <libgearman/structs.h>
 #include <libgearman/conn.h>
 #include <libgearman/packet.h>
+#include <libgearman/histogram.h>
 #include <libgearman/task.h>
 #include <libgearman/job.h>
 #include <libgearman/client.h>
+#include <libgearman/client_pool.h>
 #include <libgearman/worker.h>
+#include <libgearman/worker_pool.h>
 #include <libgearman/server_con.h>
 #include <libgearman/server_packet.h>
+#include <libgearman/server_slab.h>
+#include <libgearman/server_spill.h>
+#include <libgearman/server_shard.h>
+#include <libgearman/server_stats.h>
+#include <libgearman/server_lock.h>
+#include <libgearman/server_commit.h>
+#include <libgearman/server_timer.h>
+#include <libgearman/server_cache.h>
+#include <libgearman/server_replay.h>
+#include <libgearman/server_persist.h>
+#include <libgearman/server_snapshot.h>
+#include <libgearman/server_replica.h>
 #include <libgearman/server_function.h>
 #include <libgearman/server_client.h>
 #include <libgearman/server_worker.h>
@@ -48,6 +63,8 @@
 #include <libgearman/gearmand.h>
 #include <libgearman/gearmand_thread.h>
 #include <libgearman/gearmand_con.h>
+#include <libgearman/gearmand_uring.h>
+#include <libgearman/gearmand_log.h>
 #include <libgearman/conf.h>
 #include <libgearman/conf_module.h>
 
@@ -117,12 +134,45 @@ GEARMAN_API
 int gearman_errno(gearman_st *gearman);
 
 /**
- * Set options for a gearman structure.
+ * Set options for a gearman structure. With GEARMAN_EPOLL and no event watch
+ * function, connections stay registered with epoll and gearman_con_wait only
+ * touches the ones that are ready, rather than polling every connection each
+ * time. Set it before any connections are used. Where epoll is not available
+ * it has no effect.
  */
 GEARMAN_API
 void gearman_set_options(gearman_st *gearman, gearman_options_t options,
                          uint32_t data);
 
+/**
+ * Set the size of the send and receive buffers given to connections. Buffers
+ * are only held while a connection has data waiting in them, and are kept in
+ * a pool on the gearman instance between uses. A buffer grows past this size
+ * when a single packet needs it, up to GEARMAN_MAX_BUFFER_SIZE. This only
+ * affects buffers taken after the call.
+ * @param gearman Gearman instance structure previously initialized with
+ *        gearman_create.
+ * @param send_size Send buffer size, or 0 for GEARMAN_SEND_BUFFER_SIZE.
+ * @param recv_size Receive buffer size, or 0 for GEARMAN_RECV_BUFFER_SIZE.
+ */
+GEARMAN_API
+void gearman_set_buffer_size(gearman_st *gearman, size_t send_size,
+                             size_t recv_size);
+
+/**
+ * Compress the data of packets at least this large. Each connection asks the
+ * job server for the GEARMAN_COMPRESS_OPTION option when it connects, and
+ * only compresses once the server has accepted it, so the first packets on a
+ * new connection may still go out as they are. Compressed data that is
+ * received is decompressed before it is handed back, unless the
+ * GEARMAN_KEEP_COMPRESSED option is set so it can be forwarded as it is.
+ * @param gearman Gearman instance structure previously initialized with
+ *        gearman_create.
+ * @param threshold Smallest data size to compress, or 0 to not compress.
+ */
+GEARMAN_API
+void gearman_set_compression(gearman_st *gearman, size_t threshold);
+
 /**
  * Set logging callback for gearman instance.
  * @param gearman Gearman instance structure previously initialized with
@@ -206,12 +256,80 @@ void gearman_set_queue_done(gearman_st *gearman,
 
 /**
  * Set function to call when jobs in the persistent queue should be replayed
- * after a restart.
+ * after a restart. Modules that can take add, flush and done calls from other
+ * threads in between the jobs they pass to add_fn should also set the
+ * GEARMAN_QUEUE_REPLAY_CONCURRENT option, so the server can replay them in
+ * the background.
  */
 GEARMAN_API
 void gearman_set_queue_replay(gearman_st *gearman,
                               gearman_queue_replay_fn *replay_fn);
 
+/**
+ * Set function to call when a group of jobs added to the persistent queue
+ * should be committed, for modules that can finish the commit in the
+ * background. The function starts the commit and returns, and done_fn is
+ * called with done_arg and the result once it is durable, from any thread.
+ * If the function fails to start the commit it must not call done_fn. Without
+ * this, the flush function is used to commit groups of jobs.
+ */
+GEARMAN_API
+void gearman_set_queue_commit(gearman_st *gearman,
+                              gearman_queue_commit_fn *commit_fn);
+
+/**
+ * Set function to call when several jobs need to be stored in the persistent
+ * queue at once. This is optional, and the add function is called for each
+ * job when it is not set. The records only last for the call. If it fails,
+ * the server treats every job in the call as not stored, so it should leave
+ * a failed batch the way the add function leaves a failed job.
+ */
+GEARMAN_API
+void gearman_set_queue_add_batch(gearman_st *gearman,
+                                 gearman_queue_add_batch_fn *add_batch_fn);
+
+/**
+ * Set function to call when several jobs should be removed from the
+ * persistent queue at once. This is optional, and the done function is
+ * called for each job when it is not set. Only the unique and function name
+ * of each record are set.
+ */
+GEARMAN_API
+void gearman_set_queue_done_batch(gearman_st *gearman,
+                                  gearman_queue_done_batch_fn *done_batch_fn);
+
+/**
+ * Set function to call when the server starts a snapshot of its queued jobs,
+ * see gearman_server_snapshot. The module stores mark, a position after
+ * everything it has stored so far, and keeps every record made from then on
+ * for gearman_set_queue_replay_tail. This is optional, and all three
+ * snapshot functions must be set for snapshots to be used.
+ */
+GEARMAN_API
+void gearman_set_queue_mark(gearman_st *gearman, gearman_queue_mark_fn *mark_fn);
+
+/**
+ * Set function to call once a snapshot taken after mark is safely on disk.
+ * The module may then drop everything it stored before mark, since the
+ * snapshot holds the jobs that are left from it. After this, done calls for
+ * jobs the module no longer has must still be recorded, so the tail replay
+ * can take them out of the snapshot.
+ */
+GEARMAN_API
+void gearman_set_queue_checkpoint(gearman_st *gearman,
+                                  gearman_queue_checkpoint_fn *checkpoint_fn);
+
+/**
+ * Set function to call at startup to replay only what was stored after mark,
+ * instead of the whole queue. Every job removed after mark is passed to
+ * done_fn before any job is passed to add_fn, and add_fn only gets jobs that
+ * are still queued. The server calls it once for each kind with the other
+ * function NULL.
+ */
+GEARMAN_API
+void gearman_set_queue_replay_tail(gearman_st *gearman,
+                                   gearman_queue_replay_tail_fn *replay_tail_fn);
+
 /** @} */
 
 #ifdef __cplusplus
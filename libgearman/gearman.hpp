@@ -0,0 +1,864 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief C++ interface declarations
+ */
+
+#ifndef __GEARMAN_HPP__
+#define __GEARMAN_HPP__
+
+#if __cplusplus < 201703L
+#error "libgearman/gearman.hpp requires C++17"
+#endif
+
+#include <libgearman/gearman.h>
+
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * @addtogroup gearman_cpp C++ Interface
+ * @ingroup gearman
+ * A header only C++ layer over the client and worker interfaces. Clients,
+ * workers, and tasks are move-only and free what they hold when they go away.
+ * Workloads are passed as views and never copied. The client packs them
+ * straight from the caller's memory with GEARMAN_CLIENT_DIRECT_PACK, so they
+ * must stay valid until the task is done. Results are handed over in the
+ * buffers the library read them into. Worker functions may be lambdas or any
+ * other callable, and each is called through a function made for its type
+ * instead of through std::function.
+ *
+ * Errors are returned as gearman_return_t, just like the C interface. Only
+ * running out of memory while creating a client or worker throws.
+ * @{
+ */
+
+namespace gearman
+{
+
+/**
+ * A view of bytes owned by someone else, like std::span<const char>.
+ */
+class bytes
+{
+public:
+  constexpr bytes() noexcept :
+    _data(nullptr),
+    _size(0)
+  { }
+
+  bytes(const void *data, size_t size) noexcept :
+    _data(static_cast<const char *>(data)),
+    _size(size)
+  { }
+
+  constexpr bytes(std::string_view view) noexcept :
+    _data(view.data()),
+    _size(view.size())
+  { }
+
+  constexpr bytes(const char *str) noexcept :
+    bytes(std::string_view(str))
+  { }
+
+  /**
+   * View any contiguous container of single byte elements, such as
+   * std::string, std::vector<char>, or std::span<const std::byte>.
+   */
+  template <class T,
+            class= std::enable_if_t<sizeof(*std::declval<const T &>().data()) ==
+                                    1>>
+  bytes(const T &container) noexcept :
+    _data(reinterpret_cast<const char *>(container.data())),
+    _size(container.size())
+  { }
+
+  constexpr const char *data() const noexcept
+  {
+    return _data;
+  }
+
+  constexpr size_t size() const noexcept
+  {
+    return _size;
+  }
+
+  constexpr bool empty() const noexcept
+  {
+    return _size == 0;
+  }
+
+  constexpr std::string_view view() const noexcept
+  {
+    return std::string_view(_data, _size);
+  }
+
+private:
+  const char *_data;
+  size_t _size;
+};
+
+/**
+ * Memory allocated by the library, released with free() when the buffer goes
+ * away.
+ */
+class buffer
+{
+public:
+  buffer() noexcept :
+    _data(nullptr),
+    _size(0)
+  { }
+
+  /**
+   * Take ownership of memory from malloc().
+   */
+  buffer(void *data, size_t size) noexcept :
+    _data(static_cast<char *>(data)),
+    _size(data == nullptr ? 0 : size)
+  { }
+
+  buffer(buffer &&from) noexcept :
+    _data(std::exchange(from._data, nullptr)),
+    _size(std::exchange(from._size, 0))
+  { }
+
+  buffer &operator=(buffer &&from) noexcept
+  {
+    if (this != &from)
+    {
+      std::free(_data);
+      _data= std::exchange(from._data, nullptr);
+      _size= std::exchange(from._size, 0);
+    }
+
+    return *this;
+  }
+
+  buffer(const buffer &)= delete;
+  buffer &operator=(const buffer &)= delete;
+
+  ~buffer()
+  {
+    std::free(_data);
+  }
+
+  char *data() noexcept
+  {
+    return _data;
+  }
+
+  const char *data() const noexcept
+  {
+    return _data;
+  }
+
+  size_t size() const noexcept
+  {
+    return _size;
+  }
+
+  bool empty() const noexcept
+  {
+    return _size == 0;
+  }
+
+  std::string_view view() const noexcept
+  {
+    return std::string_view(_data, _size);
+  }
+
+  /**
+   * Give up ownership. The caller must free() what is returned.
+   */
+  char *release() noexcept
+  {
+    _size= 0;
+    return std::exchange(_data, nullptr);
+  }
+
+private:
+  char *_data;
+  size_t _size;
+};
+
+/**
+ * The return value of a task and the result it sent, if any.
+ */
+struct result
+{
+  gearman_return_t ret;
+  buffer data;
+
+  explicit operator bool() const noexcept
+  {
+    return ret == GEARMAN_SUCCESS;
+  }
+};
+
+/**
+ * The job a worker function is called with. It is only valid during the
+ * call.
+ */
+class job
+{
+public:
+  explicit job(gearman_job_st *job_st) noexcept :
+    _job(job_st)
+  { }
+
+  gearman_job_st *get() const noexcept
+  {
+    return _job;
+  }
+
+  const char *handle() const noexcept
+  {
+    return gearman_job_handle(_job);
+  }
+
+  const char *function_name() const noexcept
+  {
+    return gearman_job_function_name(_job);
+  }
+
+  const char *unique() const noexcept
+  {
+    return gearman_job_unique(_job);
+  }
+
+  /**
+   * The workload, read in place from the packet it arrived in.
+   */
+  std::string_view workload() const noexcept
+  {
+    return std::string_view(static_cast<const char *>(gearman_job_workload(_job)),
+                            gearman_job_workload_size(_job));
+  }
+
+  gearman_return_t send_data(bytes data) noexcept
+  {
+    return gearman_job_data(_job, const_cast<char *>(data.data()), data.size());
+  }
+
+  gearman_return_t send_warning(bytes warning) noexcept
+  {
+    return gearman_job_warning(_job, const_cast<char *>(warning.data()),
+                               warning.size());
+  }
+
+  gearman_return_t send_status(uint32_t numerator,
+                               uint32_t denominator) noexcept
+  {
+    return gearman_job_status(_job, numerator, denominator);
+  }
+
+  /**
+   * Get a buffer owned by the library to write the result into, see
+   * gearman_job_result_buffer.
+   * @return Pointer to at least size bytes, or nullptr if it could not be
+   *         allocated.
+   */
+  char *result_buffer(size_t size) noexcept
+  {
+    gearman_return_t ret;
+    return static_cast<char *>(gearman_job_result_buffer(_job, size, &ret));
+  }
+
+  /**
+   * Send memory the caller keeps valid until the job is done as the result,
+   * without copying it.
+   */
+  void set_result(bytes result) noexcept
+  {
+    gearman_job_set_result(_job, result.data(), result.size(), nullptr,
+                           nullptr);
+  }
+
+private:
+  gearman_job_st *_job;
+};
+
+namespace detail
+{
+
+struct function_base
+{
+  virtual ~function_base()= default;
+};
+
+template <class F>
+struct function : function_base
+{
+  template <class G>
+  explicit function(G &&fn) :
+    _fn(std::forward<G>(fn))
+  { }
+
+  static void free_buffer(void *ptr, void *)
+  {
+    std::free(ptr);
+  }
+
+  template <class R>
+  static void free_result(void *, void *arg)
+  {
+    delete static_cast<R *>(arg);
+  }
+
+  /* This is what the worker calls, so nothing may be thrown past it. */
+  static gearman_return_t call(gearman_job_st *job_st, void *fn_arg) noexcept
+  {
+    F &fn= static_cast<function *>(fn_arg)->_fn;
+    gearman::job job(job_st);
+    using R= std::invoke_result_t<F &, gearman::job &>;
+
+    try
+    {
+      if constexpr (std::is_void_v<R>)
+      {
+        fn(job);
+        return GEARMAN_SUCCESS;
+      }
+      else if constexpr (std::is_same_v<R, gearman_return_t>)
+        return fn(job);
+      else if constexpr (std::is_same_v<R, buffer>)
+      {
+        buffer result= fn(job);
+        gearman_job_set_result(job_st, result.data(), result.size(),
+                               free_buffer, nullptr);
+        (void)result.release();
+        return GEARMAN_SUCCESS;
+      }
+      else
+      {
+        /* The result is built in place and kept until it is sent. */
+        R *result= new R(fn(job));
+        gearman_job_set_result(job_st, result->data(),
+                               result->size() * sizeof(*(result->data())),
+                               free_result<R>, result);
+        return GEARMAN_SUCCESS;
+      }
+    }
+    catch (...)
+    {
+      return GEARMAN_WORK_FAIL;
+    }
+  }
+
+  F _fn;
+};
+
+struct task_state;
+
+struct client_state
+{
+  gearman_client_st client;
+  task_state *task_list;
+};
+
+struct task_state
+{
+  task_state() :
+    task(),
+    client(nullptr),
+    next(nullptr),
+    prev(nullptr),
+    ret(GEARMAN_IO_WAIT),
+    background(false),
+    result()
+  { }
+
+  task_state(const task_state &)= delete;
+  task_state &operator=(const task_state &)= delete;
+
+  gearman_task_st task;
+  client_state *client;
+  task_state *next;
+  task_state *prev;
+  gearman_return_t ret;
+  bool background;
+  buffer result;
+};
+
+} /* namespace detail */
+
+/**
+ * A worker that owns its functions.
+ */
+class worker
+{
+public:
+  /**
+   * @throw std::bad_alloc if the worker could not be created.
+   */
+  worker() :
+    _worker(gearman_worker_create(nullptr)),
+    _function_list()
+  {
+    if (_worker == nullptr)
+      throw std::bad_alloc();
+  }
+
+  worker(worker &&from) noexcept :
+    _worker(std::exchange(from._worker, nullptr)),
+    _function_list(std::move(from._function_list))
+  { }
+
+  worker &operator=(worker &&from) noexcept
+  {
+    if (this != &from)
+    {
+      _free();
+      _worker= std::exchange(from._worker, nullptr);
+      _function_list= std::move(from._function_list);
+    }
+
+    return *this;
+  }
+
+  worker(const worker &)= delete;
+  worker &operator=(const worker &)= delete;
+
+  ~worker()
+  {
+    _free();
+  }
+
+  gearman_worker_st *get() const noexcept
+  {
+    return _worker;
+  }
+
+  const char *error() const noexcept
+  {
+    return gearman_worker_error(_worker);
+  }
+
+  gearman_return_t add_server(const char *host= nullptr, in_port_t port= 0)
+  {
+    return gearman_worker_add_server(_worker, host, port);
+  }
+
+  gearman_return_t add_servers(const char *servers)
+  {
+    return gearman_worker_add_servers(_worker, servers);
+  }
+
+  /**
+   * Register a function, which is called with a gearman::job reference. What
+   * it returns decides the result:
+   * - void: the job completes with whatever was set on the job, see
+   *   job::result_buffer and job::set_result.
+   * - gearman_return_t: the same, but GEARMAN_WORK_FAIL fails the job.
+   * - gearman::buffer, or anything else with data() and size(), such as
+   *   std::string: it is moved into the job and sent without a copy.
+   * A function that throws fails the job.
+   * @param function_name Function name to register.
+   * @param fn Function to call for each job. It is moved into the worker.
+   * @param timeout Timeout for each job in seconds, or 0 for no timeout.
+   * @return Standard gearman return value.
+   */
+  template <class F>
+  gearman_return_t add_function(const char *function_name, F &&fn,
+                                uint32_t timeout= 0)
+  {
+    using function_t= detail::function<std::decay_t<F>>;
+    std::unique_ptr<function_t> function(new function_t(std::forward<F>(fn)));
+    gearman_return_t ret;
+
+    /* Make room first so the function can't be lost once it is registered. */
+    _function_list.reserve(_function_list.size() + 1);
+
+    ret= gearman_worker_add_function_buffer(_worker, function_name, timeout,
+                                            function_t::call, function.get());
+    if (ret == GEARMAN_SUCCESS)
+      _function_list.push_back(std::move(function));
+
+    return ret;
+  }
+
+  gearman_return_t unregister(const char *function_name)
+  {
+    return gearman_worker_unregister(_worker, function_name);
+  }
+
+  /**
+   * Wait for a job and call its function, see gearman_worker_work.
+   */
+  gearman_return_t work()
+  {
+    return gearman_worker_work(_worker);
+  }
+
+private:
+  void _free() noexcept
+  {
+    if (_worker != nullptr)
+      gearman_worker_free(_worker);
+
+    _worker= nullptr;
+    _function_list.clear();
+  }
+
+  gearman_worker_st *_worker;
+  std::vector<std::unique_ptr<detail::function_base>> _function_list;
+};
+
+/**
+ * A task added with client::add_task. It may outlive the client, but is of no
+ * use after that.
+ */
+class task
+{
+public:
+  task() noexcept :
+    _state()
+  { }
+
+  task(task &&from) noexcept= default;
+
+  task &operator=(task &&from) noexcept
+  {
+    if (this != &from)
+    {
+      _free();
+      _state= std::move(from._state);
+    }
+
+    return *this;
+  }
+
+  task(const task &)= delete;
+  task &operator=(const task &)= delete;
+
+  ~task()
+  {
+    _free();
+  }
+
+  gearman_task_st *get() const noexcept
+  {
+    return _state == nullptr ? nullptr : &(_state->task);
+  }
+
+  /**
+   * GEARMAN_IO_WAIT until the task is done, then GEARMAN_SUCCESS,
+   * GEARMAN_WORK_FAIL, or GEARMAN_WORK_EXCEPTION. If the task could not be
+   * added, this is why.
+   */
+  gearman_return_t ret() const noexcept
+  {
+    return _state == nullptr ? GEARMAN_UNKNOWN_STATE : _state->ret;
+  }
+
+  const char *job_handle() const noexcept
+  {
+    return _state == nullptr ? "" : gearman_task_job_handle(&(_state->task));
+  }
+
+  /**
+   * The result of a finished foreground task, or the exception it sent.
+   */
+  const buffer &data() const noexcept
+  {
+    return _state->result;
+  }
+
+  buffer take_data() noexcept
+  {
+    return std::move(_state->result);
+  }
+
+private:
+  friend class client;
+
+  explicit task(std::unique_ptr<detail::task_state> state) noexcept :
+    _state(std::move(state))
+  { }
+
+  void _free() noexcept
+  {
+    if (_state == nullptr || _state->client == nullptr)
+      return;
+
+    gearman_task_free(&(_state->task));
+
+    if (_state->prev == nullptr)
+      _state->client->task_list= _state->next;
+    else
+      _state->prev->next= _state->next;
+
+    if (_state->next != nullptr)
+      _state->next->prev= _state->prev;
+
+    _state->client= nullptr;
+  }
+
+  std::unique_ptr<detail::task_state> _state;
+};
+
+/**
+ * A client that sends workloads without copying them.
+ */
+class client
+{
+public:
+  /**
+   * @throw std::bad_alloc if the client could not be created.
+   */
+  client() :
+    _state(new detail::client_state())
+  {
+    if (gearman_client_create(&(_state->client)) == nullptr)
+    {
+      _state.reset();
+      throw std::bad_alloc();
+    }
+
+    gearman_client_set_options(&(_state->client), GEARMAN_CLIENT_DIRECT_PACK,
+                               1);
+  }
+
+  client(client &&from) noexcept= default;
+
+  client &operator=(client &&from) noexcept
+  {
+    if (this != &from)
+    {
+      _free();
+      _state= std::move(from._state);
+    }
+
+    return *this;
+  }
+
+  client(const client &)= delete;
+  client &operator=(const client &)= delete;
+
+  ~client()
+  {
+    _free();
+  }
+
+  gearman_client_st *get() const noexcept
+  {
+    return &(_state->client);
+  }
+
+  const char *error() const noexcept
+  {
+    return gearman_client_error(&(_state->client));
+  }
+
+  gearman_return_t add_server(const char *host= nullptr, in_port_t port= 0)
+  {
+    return gearman_client_add_server(&(_state->client), host, port);
+  }
+
+  gearman_return_t add_servers(const char *servers)
+  {
+    return gearman_client_add_servers(&(_state->client), servers);
+  }
+
+  /**
+   * Run a task and wait for its result. Data and status sent while it runs
+   * are skipped. This must not be called while tasks from add_task are still
+   * running.
+   * @param function_name The name of the function to run.
+   * @param workload The workload to pass to the function.
+   * @param unique Optional unique job identifier, or nullptr for a new UUID.
+   */
+  result run(const char *function_name, bytes workload,
+             const char *unique= nullptr)
+  {
+    result res{GEARMAN_SUCCESS, buffer()};
+    void *data;
+    size_t size;
+
+    do
+    {
+      size= 0;
+      data= gearman_client_do(&(_state->client), function_name, unique,
+                              workload.data(), workload.size(), &size,
+                              &(res.ret));
+      res.data= buffer(data, size);
+    }
+    while (res.ret == GEARMAN_WORK_DATA || res.ret == GEARMAN_WORK_WARNING ||
+           res.ret == GEARMAN_WORK_STATUS);
+
+    return res;
+  }
+
+  /**
+   * Run a task in the background.
+   * @param job_handle Buffer of at least GEARMAN_JOB_HANDLE_SIZE bytes for
+   *        the job handle, or nullptr.
+   */
+  gearman_return_t run_background(const char *function_name, bytes workload,
+                                  char *job_handle= nullptr,
+                                  const char *unique= nullptr)
+  {
+    return gearman_client_do_background(&(_state->client), function_name,
+                                        unique, workload.data(),
+                                        workload.size(), job_handle);
+  }
+
+  /**
+   * Add a task to be run by run_tasks. The workload must stay valid until
+   * the task is done.
+   */
+  task add_task(const char *function_name, bytes workload,
+                const char *unique= nullptr)
+  {
+    return _add_task(gearman_client_add_task, false, function_name, unique,
+                     workload);
+  }
+
+  /**
+   * Add a background task to be run by run_tasks. It is done once the job
+   * server has created the job.
+   */
+  task add_task_background(const char *function_name, bytes workload,
+                           const char *unique= nullptr)
+  {
+    return _add_task(gearman_client_add_task_background, true, function_name,
+                     unique, workload);
+  }
+
+  /**
+   * Run the tasks that have been added in parallel, and fill in their
+   * results.
+   */
+  gearman_return_t run_tasks()
+  {
+    gearman_client_st *client_st= &(_state->client);
+
+    /* gearman_client_do sets its own callbacks, so always put these back. */
+    gearman_client_clear_fn(client_st);
+    gearman_client_set_created_fn(client_st, _task_created);
+    gearman_client_set_complete_fn(client_st, _task_complete);
+    gearman_client_set_exception_fn(client_st, _task_exception);
+    gearman_client_set_fail_fn(client_st, _task_fail);
+
+    return gearman_client_run_tasks(client_st);
+  }
+
+private:
+  typedef gearman_task_st *(add_task_fn)(gearman_client_st *client,
+                                         gearman_task_st *task,
+                                         const void *fn_arg,
+                                         const char *function_name,
+                                         const char *unique,
+                                         const void *workload,
+                                         size_t workload_size,
+                                         gearman_return_t *ret_ptr);
+
+  task _add_task(add_task_fn *add_fn, bool background,
+                 const char *function_name, const char *unique,
+                 bytes workload)
+  {
+    std::unique_ptr<detail::task_state> state(new detail::task_state());
+    gearman_return_t ret;
+
+    state->background= background;
+
+    if ((*add_fn)(&(_state->client), &(state->task), state.get(),
+                  function_name, unique, workload.data(), workload.size(),
+                  &ret) == nullptr)
+    {
+      state->ret= ret;
+      return task(std::move(state));
+    }
+
+    state->ret= ret == GEARMAN_SUCCESS ? GEARMAN_IO_WAIT : ret;
+    state->client= _state.get();
+    state->next= _state->task_list;
+    if (_state->task_list != nullptr)
+      _state->task_list->prev= state.get();
+    _state->task_list= state.get();
+
+    return task(std::move(state));
+  }
+
+  static detail::task_state *_task_state(gearman_task_st *task) noexcept
+  {
+    return static_cast<detail::task_state *>(gearman_task_fn_arg(task));
+  }
+
+  static gearman_return_t _task_created(gearman_task_st *task) noexcept
+  {
+    detail::task_state *state= _task_state(task);
+
+    if (state->background)
+      state->ret= GEARMAN_SUCCESS;
+
+    return GEARMAN_SUCCESS;
+  }
+
+  static gearman_return_t _task_complete(gearman_task_st *task) noexcept
+  {
+    detail::task_state *state= _task_state(task);
+    size_t size= 0;
+    void *data= gearman_task_take_data(task, &size);
+
+    state->result= buffer(data, size);
+    state->ret= GEARMAN_SUCCESS;
+    return GEARMAN_SUCCESS;
+  }
+
+  static gearman_return_t _task_exception(gearman_task_st *task) noexcept
+  {
+    detail::task_state *state= _task_state(task);
+    size_t size= 0;
+    void *data= gearman_task_take_data(task, &size);
+
+    state->result= buffer(data, size);
+    state->ret= GEARMAN_WORK_EXCEPTION;
+    return GEARMAN_SUCCESS;
+  }
+
+  static gearman_return_t _task_fail(gearman_task_st *task) noexcept
+  {
+    _task_state(task)->ret= GEARMAN_WORK_FAIL;
+    return GEARMAN_SUCCESS;
+  }
+
+  void _free() noexcept
+  {
+    detail::task_state *state;
+
+    if (_state == nullptr)
+      return;
+
+    /* Tasks still around are left with nothing to free. */
+    for (state= _state->task_list; state != nullptr; state= state->next)
+    {
+      gearman_task_free(&(state->task));
+      state->client= nullptr;
+    }
+
+    gearman_client_free(&(_state->client));
+    _state.reset();
+  }
+
+  std::unique_ptr<detail::client_state> _state;
+};
+
+} /* namespace gearman */
+
+/** @} */
+
+#endif /* __GEARMAN_HPP__ */
@@ -26,6 +26,12 @@
 static void _log(gearman_server_st *server, gearman_verbose_t verbose,
                  const char *line, void *arg);
 
+/**
+ * Open the listening socket for a Unix socket path.
+ */
+static gearman_return_t _listen_unix(gearmand_port_st *port, int **listen_fd,
+                                     uint32_t *listen_count);
+
 static gearman_return_t _listen_init(gearmand_st *gearmand);
 static void _listen_close(gearmand_st *gearmand);
 static gearman_return_t _listen_watch(gearmand_st *gearmand);
@@ -38,6 +44,11 @@ static gearman_return_t _wakeup_watch(gearmand_st *gearmand);
 static void _wakeup_clear(gearmand_st *gearmand);
 static void _wakeup_event(int fd, short events, void *arg);
 
+static gearman_return_t _timer_watch(gearmand_st *gearmand);
+static void _timer_clear(gearmand_st *gearmand);
+static void _timer_event(int fd, short events, void *arg);
+static void _timer_balance(gearmand_st *gearmand);
+
 static gearman_return_t _watch_events(gearmand_st *gearmand);
 static void _clear_events(gearmand_st *gearmand);
 static void _close_events(gearmand_st *gearmand);
@@ -66,11 +77,18 @@ gearmand_st *gearmand_create(const char *host, in_port_t port)
   gearmand->verbose= 0;
   gearmand->ret= 0;
   gearmand->backlog= GEARMAN_DEFAULT_BACKLOG;
+  gearmand->spare_fd= -1;
+  gearmand->accept_budget= GEARMAND_DEFAULT_ACCEPT_BUDGET;
   gearmand->threads= 0;
   gearmand->port_count= 0;
   gearmand->thread_count= 0;
   gearmand->free_dcon_count= 0;
   gearmand->max_thread_free_dcon_count= 0;
+  gearmand->wakeup_pending= 0;
+  gearmand->io_engine= GEARMAND_IO_ENGINE_LIBEVENT;
+  gearmand->main_cpu= -1;
+  gearmand->io_cpu_count= 0;
+  gearmand->io_cpu_list= NULL;
   gearmand->wakeup_fd[0]= -1;
   gearmand->wakeup_fd[1]= -1;
   gearmand->host= host;
@@ -81,6 +99,14 @@ gearmand_st *gearmand_create(const char *host, in_port_t port)
   gearmand->thread_list= NULL;
   gearmand->thread_add_next= NULL;
   gearmand->free_dcon_list= NULL;
+  gearmand->migrate_list= NULL;
+  gearmand->migrate_stack= NULL;
+  gearmand->log.started= false;
+  gearmand->log.shutdown= false;
+  gearmand->log.ring_size= 0;
+  gearmand->log.write_fn= NULL;
+  gearmand->log.write_fn_arg= NULL;
+  gearmand->log.ring_list= NULL;
 
   if (port == 0)
     port= GEARMAN_DEFAULT_TCP_PORT;
@@ -97,6 +123,7 @@ gearmand_st *gearmand_create(const char *host, in_port_t port)
 void gearmand_free(gearmand_st *gearmand)
 {
   gearmand_con_st *dcon;
+  gearmand_con_st *next;
   uint32_t x;
 
   _close_events(gearmand);
@@ -107,6 +134,16 @@ void gearmand_free(gearmand_st *gearmand)
   while (gearmand->thread_list != NULL)
     gearmand_thread_free(gearmand->thread_list);
 
+  /* Connections on their way to another thread have nowhere to go now. */
+  GEARMAN_SERVER_QUEUE_TAKE(gearmand->migrate, dcon, next,)
+  while (gearmand->migrate_list != NULL)
+  {
+    dcon= gearmand->migrate_list;
+    gearmand->migrate_list= dcon->next;
+    close(dcon->fd);
+    free(dcon);
+  }
+
   while (gearmand->free_dcon_list != NULL)
   {
     dcon= gearmand->free_dcon_list;
@@ -131,6 +168,16 @@ void gearmand_free(gearmand_st *gearmand)
   if (gearmand->port_list != NULL)
     free(gearmand->port_list);
 
+  if (gearmand->io_cpu_list != NULL)
+    free(gearmand->io_cpu_list);
+
+  if (gearmand->spare_fd != -1)
+    close(gearmand->spare_fd);
+
+  /* Every other thread is gone, so the rings can be written out and the log
+     callback called directly again. */
+  gearmand_log_stop(gearmand);
+
   GEARMAN_INFO(gearmand, "Shutdown complete")
 
   free(gearmand);
@@ -141,11 +188,199 @@ void gearmand_set_backlog(gearmand_st *gearmand, int backlog)
   gearmand->backlog= backlog;
 }
 
+void gearmand_set_accept_budget(gearmand_st *gearmand, uint32_t budget)
+{
+  gearmand->accept_budget= budget == 0 ? 1 : budget;
+}
+
 void gearmand_set_threads(gearmand_st *gearmand, uint32_t threads)
 {
   gearmand->threads= threads;
 }
 
+gearman_return_t gearmand_set_proc_threads(gearmand_st *gearmand,
+                                           uint32_t proc_threads)
+{
+  return gearman_server_set_shards(&(gearmand->server), proc_threads);
+}
+
+void gearmand_set_server_options(gearmand_st *gearmand,
+                                 gearman_server_options_t options,
+                                 uint32_t data)
+{
+  gearman_server_set_options(&(gearmand->server), options, data);
+}
+
+gearman_return_t gearmand_set_job_hash_size(gearmand_st *gearmand,
+                                           uint32_t size)
+{
+  return gearman_server_set_job_hash_size(&(gearmand->server), size);
+}
+
+void gearmand_set_worker_wakeup(gearmand_st *gearmand, uint32_t worker_wakeup)
+{
+  gearman_server_set_worker_wakeup(&(gearmand->server), worker_wakeup);
+}
+
+void gearmand_set_read_budget(gearmand_st *gearmand, uint32_t read_budget)
+{
+  gearman_server_set_read_budget(&(gearmand->server), read_budget);
+}
+
+void gearmand_set_affinity_wait(gearmand_st *gearmand, uint32_t affinity_wait)
+{
+  gearman_server_set_affinity_wait(&(gearmand->server), affinity_wait);
+}
+
+void gearmand_set_priority(gearmand_st *gearmand, uint32_t levels,
+                           uint32_t age)
+{
+  gearman_server_set_priority_levels(&(gearmand->server), levels);
+  gearman_server_set_priority_age(&(gearmand->server), age);
+}
+
+void gearmand_set_work_data_max(gearmand_st *gearmand, size_t work_data_max)
+{
+  gearman_server_set_work_data_max(&(gearmand->server), work_data_max);
+}
+
+void gearmand_set_queue_bytes_max(gearmand_st *gearmand,
+                                  size_t queue_bytes_max)
+{
+  gearman_server_set_queue_bytes_max(&(gearmand->server), queue_bytes_max);
+}
+
+void gearmand_set_client_rate(gearmand_st *gearmand, size_t client_rate)
+{
+  gearman_server_set_client_rate(&(gearmand->server), client_rate);
+}
+
+gearman_return_t gearmand_set_spill(gearmand_st *gearmand, const char *path,
+                                    size_t watermark)
+{
+  return gearman_server_set_spill(&(gearmand->server), path, watermark);
+}
+
+void gearmand_set_queue_commit(gearmand_st *gearmand, uint32_t size,
+                               uint32_t window)
+{
+  gearman_server_set_queue_commit(&(gearmand->server), size, window);
+}
+
+void gearmand_set_queue_persist_thread(gearmand_st *gearmand,
+                                       bool persist_thread)
+{
+  gearman_server_set_queue_persist_thread(&(gearmand->server), persist_thread);
+}
+
+void gearmand_set_queue_replay_background(gearmand_st *gearmand,
+                                          bool background)
+{
+  gearman_server_set_queue_replay_background(&(gearmand->server), background);
+}
+
+gearman_return_t gearmand_set_snapshot(gearmand_st *gearmand, const char *path,
+                                       uint32_t interval)
+{
+  return gearman_server_set_snapshot(&(gearmand->server), path, interval);
+}
+
+gearman_return_t gearmand_replica_peer_add(gearmand_st *gearmand,
+                                           const char *host, in_port_t port)
+{
+  return gearman_server_replica_peer_add(&(gearmand->server), host, port);
+}
+
+void gearmand_set_replica_listen(gearmand_st *gearmand, in_port_t port)
+{
+  gearman_server_replica_set_listen(&(gearmand->server), port);
+}
+
+void gearmand_set_stats_interval(gearmand_st *gearmand, uint32_t seconds)
+{
+  gearman_server_set_stats_interval(&(gearmand->server), seconds);
+}
+
+void gearmand_set_buffer_size(gearmand_st *gearmand, size_t send_size,
+                              size_t recv_size)
+{
+  gearman_server_set_buffer_size(&(gearmand->server), send_size, recv_size);
+}
+
+void gearmand_set_reuseport(gearmand_st *gearmand, bool reuseport)
+{
+  if (reuseport)
+    gearmand->options|= GEARMAND_REUSEPORT;
+  else
+    gearmand->options&= (gearmand_options_t)~GEARMAND_REUSEPORT;
+}
+
+void gearmand_set_migrate(gearmand_st *gearmand, bool migrate)
+{
+  if (migrate)
+    gearmand->options|= GEARMAND_MIGRATE;
+  else
+    gearmand->options&= (gearmand_options_t)~GEARMAND_MIGRATE;
+}
+
+gearman_return_t gearmand_set_cpus(gearmand_st *gearmand, const char *io_cpus,
+                                   const char *proc_cpus, int main_cpu)
+{
+  gearman_return_t ret;
+  uint32_t *cpu_list;
+  uint32_t cpu_count;
+
+#ifndef HAVE_PTHREAD_SETAFFINITY_NP
+  if (io_cpus != NULL || proc_cpus != NULL || main_cpu >= 0)
+    return GEARMAN_UNKNOWN_OPTION;
+#endif
+
+  if (main_cpu >= GEARMAN_SERVER_CPU_MAX)
+    return GEARMAN_UNKNOWN_OPTION;
+
+  if (proc_cpus != NULL)
+  {
+    ret= gearman_server_cpu_list(proc_cpus, &cpu_list, &cpu_count);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    ret= gearman_server_set_proc_cpus(&(gearmand->server), cpu_list,
+                                      cpu_count);
+    free(cpu_list);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  if (io_cpus != NULL)
+  {
+    ret= gearman_server_cpu_list(io_cpus, &cpu_list, &cpu_count);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    if (gearmand->io_cpu_list != NULL)
+      free(gearmand->io_cpu_list);
+
+    gearmand->io_cpu_list= cpu_list;
+    gearmand->io_cpu_count= cpu_count;
+  }
+
+  gearmand->main_cpu= main_cpu;
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearmand_set_io_engine(gearmand_st *gearmand,
+                                        gearmand_io_engine_t io_engine)
+{
+#ifndef HAVE_LINUX_IO_URING_H
+  if (io_engine == GEARMAND_IO_ENGINE_IO_URING)
+    return GEARMAN_UNKNOWN_OPTION;
+#endif
+
+  gearmand->io_engine= io_engine;
+  return GEARMAN_SUCCESS;
+}
+
 void gearmand_set_log(gearmand_st *gearmand, gearmand_log_fn log_fn,
                       void *log_fn_arg, gearman_verbose_t verbose)
 {
@@ -155,6 +390,18 @@ void gearmand_set_log(gearmand_st *gearmand, gearmand_log_fn log_fn,
   gearmand->verbose= verbose;
 }
 
+void gearmand_set_log_ring(gearmand_st *gearmand, uint32_t records)
+{
+  uint32_t size= 0;
+
+  if (records > 0)
+  {
+    for (size= 1; size < records && size < GEARMAND_LOG_RING_MAX; size<<= 1);
+  }
+
+  gearmand->log.ring_size= size;
+}
+
 gearman_return_t gearmand_port_add(gearmand_st *gearmand, in_port_t port,
                                    gearman_con_add_fn *add_fn)
 {
@@ -170,6 +417,7 @@ gearman_return_t gearmand_port_add(gearmand_st *gearmand, in_port_t port,
 
   port_list[gearmand->port_count].port= port;
   port_list[gearmand->port_count].listen_count= 0;
+  port_list[gearmand->port_count].path= NULL;
   port_list[gearmand->port_count].gearmand= gearmand;
   port_list[gearmand->port_count].add_fn= add_fn;
   port_list[gearmand->port_count].listen_fd= NULL;
@@ -181,6 +429,175 @@ gearman_return_t gearmand_port_add(gearmand_st *gearmand, in_port_t port,
   return GEARMAN_SUCCESS;
 }
 
+gearman_return_t gearmand_port_add_unix(gearmand_st *gearmand,
+                                        const char *path,
+                                        gearman_con_add_fn *add_fn)
+{
+  gearman_return_t ret;
+
+  ret= gearmand_port_add(gearmand, 0, add_fn);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  gearmand->port_list[gearmand->port_count - 1].path= path;
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearmand_port_listen(gearmand_port_st *port, int **listen_fd,
+                                      uint32_t *listen_count)
+{
+  struct addrinfo *addrinfo;
+  struct addrinfo *addrinfo_next;
+  struct addrinfo ai;
+  int ret;
+  int opt;
+  char host[NI_MAXHOST];
+  char port_str[NI_MAXSERV];
+  int fd;
+  int *fd_list;
+  uint32_t count= *listen_count;
+
+  if (port->path != NULL)
+    return _listen_unix(port, listen_fd, listen_count);
+
+  snprintf(port_str, NI_MAXSERV, "%u", port->port);
+
+  memset(&ai, 0, sizeof(struct addrinfo));
+  ai.ai_flags  = AI_PASSIVE;
+  ai.ai_family = AF_UNSPEC;
+  ai.ai_socktype = SOCK_STREAM;
+  ai.ai_protocol= IPPROTO_TCP;
+
+  ret= getaddrinfo(port->gearmand->host, port_str, &ai, &addrinfo);
+  if (ret != 0)
+  {
+    GEARMAN_FATAL(port->gearmand, "gearmand_port_listen:getaddrinfo:%s",
+                  gai_strerror(ret))
+    return GEARMAN_ERRNO;
+  }
+
+  for (addrinfo_next= addrinfo; addrinfo_next != NULL;
+       addrinfo_next= addrinfo_next->ai_next)
+  {
+    ret= getnameinfo(addrinfo_next->ai_addr, addrinfo_next->ai_addrlen, host,
+                     NI_MAXHOST, port_str, NI_MAXSERV,
+                     NI_NUMERICHOST | NI_NUMERICSERV);
+    if (ret != 0)
+    {
+      GEARMAN_ERROR(port->gearmand, "gearmand_port_listen:getnameinfo:%s",
+                    gai_strerror(ret))
+      strcpy(host, "-");
+      strcpy(port_str, "-");
+    }
+
+    GEARMAN_DEBUG(port->gearmand, "Trying to listen on %s:%s", host, port_str)
+
+    /* Call to socket() can fail for some getaddrinfo results, try another. */
+    fd= socket(addrinfo_next->ai_family, addrinfo_next->ai_socktype,
+               addrinfo_next->ai_protocol);
+    if (fd == -1)
+    {
+      GEARMAN_ERROR(port->gearmand, "Failed to listen on %s:%s", host,
+                    port_str)
+      continue;
+    }
+
+    opt= 1;
+    ret= setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (ret == -1)
+    {
+      close(fd);
+      GEARMAN_FATAL(port->gearmand, "gearmand_port_listen:setsockopt:%d",
+                    errno)
+      return GEARMAN_ERRNO;
+    }
+
+    /* Let every I/O thread bind its own socket to the same address, and have
+       the kernel spread new connections between them. */
+    if (port->gearmand->options & GEARMAND_REUSEPORT &&
+        port->gearmand->threads > 0)
+    {
+#ifdef SO_REUSEPORT
+      ret= setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#else
+      ret= -1;
+      errno= ENOPROTOOPT;
+#endif
+      if (ret == -1)
+      {
+        close(fd);
+        GEARMAN_FATAL(port->gearmand,
+                      "gearmand_port_listen:setsockopt:SO_REUSEPORT:%d", errno)
+        return GEARMAN_ERRNO;
+      }
+    }
+
+    ret= bind(fd, addrinfo_next->ai_addr, addrinfo_next->ai_addrlen);
+    if (ret == -1)
+    {
+      close(fd);
+      if (errno == EADDRINUSE)
+      {
+        if (*listen_count == count)
+        {
+          GEARMAN_ERROR(port->gearmand, "Address already in use %s:%s", host,
+                        port_str)
+        }
+
+        continue;
+      }
+
+      GEARMAN_FATAL(port->gearmand, "gearmand_port_listen:bind:%d", errno)
+      return GEARMAN_ERRNO;
+    }
+
+    if (listen(fd, port->gearmand->backlog) == -1)
+    {
+      close(fd);
+      GEARMAN_FATAL(port->gearmand, "gearmand_port_listen:listen:%d", errno)
+      return GEARMAN_ERRNO;
+    }
+
+    /* Connections are accepted until there are none left, see
+       gearmand_con_accept. */
+    ret= fcntl(fd, F_GETFL, 0);
+    if (ret == -1 || fcntl(fd, F_SETFL, ret | O_NONBLOCK) == -1)
+    {
+      close(fd);
+      GEARMAN_FATAL(port->gearmand, "gearmand_port_listen:fcntl:%d", errno)
+      return GEARMAN_ERRNO;
+    }
+
+    fd_list= realloc(*listen_fd, sizeof(int) * (*listen_count + 1));
+    if (fd_list == NULL)
+    {
+      close(fd);
+      GEARMAN_FATAL(port->gearmand, "gearmand_port_listen:realloc:%d", errno)
+      return GEARMAN_ERRNO;
+    }
+
+    *listen_fd= fd_list;
+    (*listen_fd)[*listen_count]= fd;
+    (*listen_count)++;
+
+    GEARMAN_INFO(port->gearmand, "Listening on %s:%s (%d)", host, port_str,
+                 fd)
+  }
+
+  freeaddrinfo(addrinfo);
+
+  /* Report last socket() error if we couldn't find an address to bind. */
+  if (*listen_count == count)
+  {
+    GEARMAN_FATAL(port->gearmand,
+                  "gearmand_port_listen:Could not bind/listen to any addresses")
+    return GEARMAN_ERRNO;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
 gearman_return_t gearmand_run(gearmand_st *gearmand)
 {
   uint32_t x;
@@ -188,6 +605,10 @@ gearman_return_t gearmand_run(gearmand_st *gearmand)
   /* Initialize server components. */
   if (gearmand->base == NULL)
   {
+    gearmand->ret= gearmand_log_start(gearmand);
+    if (gearmand->ret != GEARMAN_SUCCESS)
+      return gearmand->ret;
+
     GEARMAN_INFO(gearmand, "Starting up")
 
     if (gearmand->threads > 0)
@@ -225,6 +646,12 @@ gearman_return_t gearmand_run(gearmand_st *gearmand)
     if (gearmand->ret != GEARMAN_SUCCESS)
       return gearmand->ret;
 
+    /* Held in reserve so connections can still be shed when the process runs
+       out of descriptors, see gearmand_con_accept. */
+    gearmand->spare_fd= open("/dev/null", O_RDONLY);
+    if (gearmand->spare_fd == -1)
+      GEARMAN_ERROR(gearmand, "gearmand_run:open:/dev/null:%d", errno)
+
     GEARMAN_DEBUG(gearmand, "Creating %u threads", gearmand->threads)
 
     /* If we have 0 threads we still need to create a fake one for context. */
@@ -238,35 +665,74 @@ gearman_return_t gearmand_run(gearmand_st *gearmand)
     }
     while (x < gearmand->threads);
 
+    /* Jobs coming back from the queue are sent to peers too. */
+    gearmand->ret= gearman_server_replica_start(&(gearmand->server));
+    if (gearmand->ret != GEARMAN_SUCCESS)
+      return gearmand->ret;
+
     gearmand->ret= gearman_server_queue_replay(&(gearmand->server));
     if (gearmand->ret != GEARMAN_SUCCESS)
       return gearmand->ret;
+
+    /* Pin the main thread last, since threads inherit the CPUs of the thread
+       that starts them. With no I/O threads the main thread also serves the
+       connections, so it takes packets from its node's pool too. */
+    if (gearmand->main_cpu >= 0)
+    {
+      if (gearman_server_pin(&(gearmand->server), (uint32_t)gearmand->main_cpu,
+                             gearmand->threads == 0 ?
+                             &(gearmand->server.packet_magazine) : NULL,
+                             gearmand->threads == 0 ?
+                             &(gearmand->server.io_packet_magazine) : NULL) ==
+          GEARMAN_SUCCESS)
+      {
+        GEARMAN_INFO(gearmand, "Pinned main thread to CPU %d",
+                     gearmand->main_cpu)
+      }
+      else
+      {
+        GEARMAN_ERROR(gearmand, "Could not pin main thread to CPU %d:%d",
+                      gearmand->main_cpu, errno)
+      }
+    }
   }
 
   gearmand->ret= _watch_events(gearmand);
   if (gearmand->ret != GEARMAN_SUCCESS)
+  {
+    gearman_server_snapshot_stop(&(gearmand->server));
     return gearmand->ret;
+  }
 
   GEARMAN_INFO(gearmand, "Entering main event loop")
 
   if (event_base_loop(gearmand->base, 0) == -1)
   {
     GEARMAN_FATAL(gearmand, "gearmand_run:event_base_loop:-1")
+    gearman_server_snapshot_stop(&(gearmand->server));
     return GEARMAN_EVENT;
   }
 
   GEARMAN_INFO(gearmand, "Exited main event loop")
 
+  /* The queue module is shut down once this returns, so the last snapshot
+     is taken while it is still there. */
+  gearman_server_snapshot_stop(&(gearmand->server));
+
   return gearmand->ret;
 }
 
 void gearmand_wakeup(gearmand_st *gearmand, gearmand_wakeup_t wakeup)
 {
-  uint8_t buffer= wakeup;
+  uint64_t value= 1;
 
-  /* If this fails, there is not much we can really do. This should never fail
+  /* Same as gearmand_thread_wakeup, only signal if nothing was pending. If
+     this fails, there is not much we can really do. This should never fail
      though if the main gearmand thread is still active. */
-  if (write(gearmand->wakeup_fd[1], &buffer, 1) != 1)
+  if (__sync_fetch_and_or(&(gearmand->wakeup_pending), (uint32_t)wakeup) != 0)
+    return;
+
+  if (write(gearmand->wakeup_fd[1], &value, sizeof(value)) != sizeof(value))
     GEARMAN_ERROR(gearmand, "gearmand_wakeup:write:%d", errno)
 }
 
@@ -281,125 +747,120 @@ static void _log(gearman_server_st *server __attribute__ ((unused)),
   (*gearmand->log_fn)(gearmand, verbose, line, gearmand->log_fn_arg);
 }
 
-static gearman_return_t _listen_init(gearmand_st *gearmand)
+static gearman_return_t _listen_unix(gearmand_port_st *port, int **listen_fd,
+                                     uint32_t *listen_count)
 {
-  struct gearmand_port_st *port;
-  struct addrinfo *addrinfo;
-  struct addrinfo *addrinfo_next;
-  struct addrinfo ai;
-  int ret;
-  int opt;
-  char host[NI_MAXHOST];
-  char port_str[NI_MAXSERV];
+#ifdef HAVE_SYS_UN_H
+  struct sockaddr_un sa;
+  struct stat st;
   int fd;
+  int flags;
   int *fd_list;
-  uint32_t x;
-  uint32_t y;
 
-  for (x= 0; x < gearmand->port_count; x++)
+  if (strlen(port->path) >= sizeof(sa.sun_path))
   {
-    port= &gearmand->port_list[x];
+    GEARMAN_FATAL(port->gearmand, "_listen_unix:path too long:%s", port->path)
+    return GEARMAN_ERRNO;
+  }
 
-    snprintf(port_str, NI_MAXSERV, "%u", port->port);
+  memset(&sa, 0, sizeof(struct sockaddr_un));
+  sa.sun_family= AF_UNIX;
+  strcpy(sa.sun_path, port->path);
 
-    memset(&ai, 0, sizeof(struct addrinfo));
-    ai.ai_flags  = AI_PASSIVE;
-    ai.ai_family = AF_UNSPEC;
-    ai.ai_socktype = SOCK_STREAM;
-    ai.ai_protocol= IPPROTO_TCP;
+  GEARMAN_DEBUG(port->gearmand, "Trying to listen on %s", port->path)
 
-    ret= getaddrinfo(gearmand->host, port_str, &ai, &addrinfo);
-    if (ret != 0)
+  fd= socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+  {
+    GEARMAN_FATAL(port->gearmand, "_listen_unix:socket:%d", errno)
+    return GEARMAN_ERRNO;
+  }
+
+  /* A socket left behind by a server that did not shut down cleanly would make
+     bind fail, but never remove anything that is not a socket. */
+  if (lstat(port->path, &st) == 0 && S_ISSOCK(st.st_mode))
+    (void)unlink(port->path);
+
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(struct sockaddr_un)) == -1)
+  {
+    close(fd);
+    if (errno == EADDRINUSE)
     {
-      GEARMAN_FATAL(gearmand, "_listen_init:getaddrinfo:%s", gai_strerror(ret))
-      return GEARMAN_ERRNO;
+      GEARMAN_FATAL(port->gearmand, "Address already in use %s", port->path)
     }
-
-    for (addrinfo_next= addrinfo; addrinfo_next != NULL;
-         addrinfo_next= addrinfo_next->ai_next)
+    else
     {
-      ret= getnameinfo(addrinfo_next->ai_addr, addrinfo_next->ai_addrlen, host,
-                       NI_MAXHOST, port_str, NI_MAXSERV,
-                       NI_NUMERICHOST | NI_NUMERICSERV);
-      if (ret != 0)
-      {
-        GEARMAN_ERROR(gearmand, "_listen_init:getnameinfo:%s",
-                      gai_strerror(ret))
-        strcpy(host, "-");
-        strcpy(port_str, "-");
-      }
-
-      GEARMAN_DEBUG(gearmand, "Trying to listen on %s:%s", host, port_str)
-
-      /* Call to socket() can fail for some getaddrinfo results, try another. */
-      fd= socket(addrinfo_next->ai_family, addrinfo_next->ai_socktype,
-                 addrinfo_next->ai_protocol);
-      if (fd == -1)
-      {
-        GEARMAN_ERROR(gearmand, "Failed to listen on %s:%s", host, port_str)
-        continue;
-      }
+      GEARMAN_FATAL(port->gearmand, "_listen_unix:bind:%d", errno)
+    }
 
-      opt= 1;
-      ret= setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-      if (ret == -1)
-      {
-        close(fd);
-        GEARMAN_FATAL(gearmand, "_listen_init:setsockopt:%d", errno)
-        return GEARMAN_ERRNO;
-      }
+    return GEARMAN_ERRNO;
+  }
 
-      ret= bind(fd, addrinfo_next->ai_addr, addrinfo_next->ai_addrlen);
-      if (ret == -1)
-      {
-        close(fd);
-        if (errno == EADDRINUSE)
-        {
-          if (port->listen_fd == NULL)
-          {
-            GEARMAN_ERROR(gearmand, "Address already in use %s:%s", host,
-                          port_str)
-          }
+  if (listen(fd, port->gearmand->backlog) == -1)
+  {
+    close(fd);
+    (void)unlink(port->path);
+    GEARMAN_FATAL(port->gearmand, "_listen_unix:listen:%d", errno)
+    return GEARMAN_ERRNO;
+  }
 
-          continue;
-        }
+  flags= fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+  {
+    close(fd);
+    (void)unlink(port->path);
+    GEARMAN_FATAL(port->gearmand, "_listen_unix:fcntl:%d", errno)
+    return GEARMAN_ERRNO;
+  }
 
-        GEARMAN_FATAL(gearmand, "_listen_init:bind:%d", errno)
-        return GEARMAN_ERRNO;
-      }
+  fd_list= realloc(*listen_fd, sizeof(int) * (*listen_count + 1));
+  if (fd_list == NULL)
+  {
+    close(fd);
+    (void)unlink(port->path);
+    GEARMAN_FATAL(port->gearmand, "_listen_unix:realloc:%d", errno)
+    return GEARMAN_ERRNO;
+  }
 
-      if (listen(fd, gearmand->backlog) == -1)
-      {
-        close(fd);
-        GEARMAN_FATAL(gearmand, "_listen_init:listen:%d", errno)
-        return GEARMAN_ERRNO;
-      }
+  *listen_fd= fd_list;
+  (*listen_fd)[*listen_count]= fd;
+  (*listen_count)++;
 
-      fd_list= realloc(port->listen_fd, sizeof(int) * (port->listen_count + 1));
-      if (fd_list == NULL)
-      {
-        close(fd);
-        GEARMAN_FATAL(gearmand, "_listen_init:realloc:%d", errno)
-        return GEARMAN_ERRNO;
-      }
+  GEARMAN_INFO(port->gearmand, "Listening on %s (%d)", port->path, fd)
 
-      port->listen_fd= fd_list;
-      port->listen_fd[port->listen_count]= fd;
-      port->listen_count++;
+  return GEARMAN_SUCCESS;
+#else
+  (void)listen_fd;
+  (void)listen_count;
+  GEARMAN_FATAL(port->gearmand, "_listen_unix:Unix sockets not supported:%s",
+                port->path)
+  return GEARMAN_ERRNO;
+#endif
+}
 
-      GEARMAN_INFO(gearmand, "Listening on %s:%s (%d)", host, port_str, fd)
-    }
+static gearman_return_t _listen_init(gearmand_st *gearmand)
+{
+  struct gearmand_port_st *port;
+  gearman_return_t ret;
+  uint32_t x;
+  uint32_t y;
 
-    freeaddrinfo(addrinfo);
+  for (x= 0; x < gearmand->port_count; x++)
+  {
+    port= &gearmand->port_list[x];
 
-    /* Report last socket() error if we couldn't find an address to bind. */
-    if (port->listen_fd == NULL)
+    /* Each I/O thread opens its own TCP listening sockets instead, but a Unix
+       socket path can only be bound once. */
+    if (gearmand->options & GEARMAND_REUSEPORT && gearmand->threads > 0 &&
+        port->path == NULL)
     {
-      GEARMAN_FATAL(gearmand,
-                    "_listen_init:Could not bind/listen to any addresses")
-      return GEARMAN_ERRNO;
+      continue;
     }
 
+    ret= gearmand_port_listen(port, &(port->listen_fd), &(port->listen_count));
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
     port->listen_event= malloc(sizeof(struct event) * port->listen_count);
     if (port->listen_event == NULL)
     {
@@ -435,6 +896,9 @@ static void _listen_close(gearmand_st *gearmand)
                      gearmand->port_list[x].listen_fd[y])
         close(gearmand->port_list[x].listen_fd[y]);
         gearmand->port_list[x].listen_fd[y]= -1;
+
+        if (gearmand->port_list[x].path != NULL)
+          (void)unlink(gearmand->port_list[x].path);
       }
     }
   }
@@ -492,46 +956,8 @@ static void _listen_event(int fd, short events __attribute__ ((unused)),
                           void *arg)
 {
   gearmand_port_st *port= (gearmand_port_st *)arg;
-  struct sockaddr sa;
-  socklen_t sa_len;
-  char host[NI_MAXHOST];
-  char port_str[NI_MAXSERV];
-  int ret;
 
-  sa_len= sizeof(sa);
-  fd= accept(fd, &sa, &sa_len);
-  if (fd == -1)
-  {
-    if (errno == EINTR)
-      return;
-    else if (errno == EMFILE)
-    {
-      GEARMAN_ERROR(port->gearmand, "_listen_event:accept:too many open files")
-      return;
-    }
-
-    _clear_events(port->gearmand);
-    GEARMAN_FATAL(port->gearmand, "_listen_event:accept:%d", errno)
-    port->gearmand->ret= GEARMAN_ERRNO;
-    return;
-  }
-
-  /* Since this is numeric, it should never fail. Even if it did we don't want
-     to really error from it. */
-  ret= getnameinfo(&sa, sa_len, host, NI_MAXHOST, port_str, NI_MAXSERV,
-                   NI_NUMERICHOST | NI_NUMERICSERV);
-  if (ret != 0)
-  {
-    GEARMAN_ERROR(port->gearmand, "_listen_event:getnameinfo:%s",
-                  gai_strerror(ret))
-    strcpy(host, "-");
-    strcpy(port_str, "-");
-  }
-
-  GEARMAN_INFO(port->gearmand, "Accepted connection from %s:%s", host, port_str)
-
-  port->gearmand->ret= gearmand_con_create(port->gearmand, fd, host, port_str,
-                                           port->add_fn);
+  port->gearmand->ret= gearmand_con_accept(port->gearmand, NULL, port, fd);
   if (port->gearmand->ret != GEARMAN_SUCCESS)
     _clear_events(port->gearmand);
 }
@@ -540,6 +966,20 @@ static gearman_return_t _wakeup_init(gearmand_st *gearmand)
 {
   int ret;
 
+#ifdef HAVE_SYS_EVENTFD_H
+  GEARMAN_INFO(gearmand, "Creating wakeup eventfd")
+
+  /* One descriptor serves as both ends, which the close code checks for. */
+  ret= eventfd(0, EFD_NONBLOCK);
+  if (ret == -1)
+  {
+    GEARMAN_FATAL(gearmand, "_wakeup_init:eventfd:%d", errno)
+    return GEARMAN_ERRNO;
+  }
+
+  gearmand->wakeup_fd[0]= ret;
+  gearmand->wakeup_fd[1]= ret;
+#else
   GEARMAN_INFO(gearmand, "Creating wakeup pipe")
 
   ret= pipe(gearmand->wakeup_fd);
@@ -562,6 +1002,7 @@ static gearman_return_t _wakeup_init(gearmand_st *gearmand)
     GEARMAN_FATAL(gearmand, "_wakeup_init:fcntl:F_SETFL:%d", errno)
     return GEARMAN_ERRNO;
   }
+#endif
 
   event_set(&(gearmand->wakeup_event), gearmand->wakeup_fd[0],
             EV_READ | EV_PERSIST, _wakeup_event, gearmand);
@@ -578,8 +1019,9 @@ static void _wakeup_close(gearmand_st *gearmand)
   {
     GEARMAN_INFO(gearmand, "Closing wakeup pipe")
     close(gearmand->wakeup_fd[0]);
+    if (gearmand->wakeup_fd[1] != gearmand->wakeup_fd[0])
+      close(gearmand->wakeup_fd[1]);
     gearmand->wakeup_fd[0]= -1;
-    close(gearmand->wakeup_fd[1]);
     gearmand->wakeup_fd[1]= -1;
   }
 }
@@ -617,7 +1059,7 @@ static void _wakeup_event(int fd, short events __attribute__ ((unused)),
   gearmand_st *gearmand= (gearmand_st *)arg;
   uint8_t buffer[GEARMAN_PIPE_BUFFER_SIZE];
   ssize_t ret;
-  ssize_t x;
+  uint32_t wakeup;
   gearmand_thread_st *thread;
 
   while (1)
@@ -643,47 +1085,161 @@ static void _wakeup_event(int fd, short events __attribute__ ((unused)),
       gearmand->ret= GEARMAN_ERRNO;
       return;
     }
+  }
 
-    for (x= 0; x < ret; x++)
-    {
-      switch ((gearmand_wakeup_t)buffer[x])
-      {
-      case GEARMAND_WAKEUP_PAUSE:
-        GEARMAN_INFO(gearmand, "Received PAUSE wakeup event")
-        _clear_events(gearmand);
-        gearmand->ret= GEARMAN_PAUSE;
-        break;
+  /* Take everything pending only after draining, since a wakeup set after
+     this point will signal again. */
+  wakeup= __sync_fetch_and_and(&(gearmand->wakeup_pending), 0);
 
-      case GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL:
-        GEARMAN_INFO(gearmand, "Received SHUTDOWN_GRACEFUL wakeup event")
-        _listen_close(gearmand);
+  if (wakeup & GEARMAND_WAKEUP_CON)
+  {
+    GEARMAN_DEBUG(gearmand, "Received CON wakeup event")
+    gearmand_con_check_migrate(gearmand);
+  }
 
-        for (thread= gearmand->thread_list; thread != NULL;
-             thread= thread->next)
-        {
-          gearmand_thread_wakeup(thread, GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL);
-        }
+  if (wakeup & GEARMAND_WAKEUP_PAUSE)
+  {
+    GEARMAN_INFO(gearmand, "Received PAUSE wakeup event")
+    _clear_events(gearmand);
+    gearmand->ret= GEARMAN_PAUSE;
+  }
 
-        gearmand->ret= GEARMAN_SHUTDOWN_GRACEFUL;
-        break;
+  if (wakeup & GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL)
+  {
+    GEARMAN_INFO(gearmand, "Received SHUTDOWN_GRACEFUL wakeup event")
+    _listen_close(gearmand);
 
-      case GEARMAND_WAKEUP_SHUTDOWN:
-        GEARMAN_INFO(gearmand, "Received SHUTDOWN wakeup event")
-        _clear_events(gearmand);
-        gearmand->ret= GEARMAN_SHUTDOWN;
-        break;
+    for (thread= gearmand->thread_list; thread != NULL; thread= thread->next)
+      gearmand_thread_wakeup(thread, GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL);
 
-      case GEARMAND_WAKEUP_CON:
-      case GEARMAND_WAKEUP_RUN:
-      default:
-        GEARMAN_FATAL(gearmand, "Received unknown wakeup event (%u)",
-                      buffer[x])
-        _clear_events(gearmand);
-        gearmand->ret= GEARMAN_UNKNOWN_STATE;
-        break;
-      }
+    gearmand->ret= GEARMAN_SHUTDOWN_GRACEFUL;
+  }
+
+  if (wakeup & GEARMAND_WAKEUP_SHUTDOWN)
+  {
+    GEARMAN_INFO(gearmand, "Received SHUTDOWN wakeup event")
+    _clear_events(gearmand);
+    gearmand->ret= GEARMAN_SHUTDOWN;
+  }
+
+  wakeup&= (uint32_t)~(GEARMAND_WAKEUP_PAUSE | GEARMAND_WAKEUP_SHUTDOWN |
+                       GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL |
+                       GEARMAND_WAKEUP_CON);
+  if (wakeup != 0)
+  {
+    GEARMAN_FATAL(gearmand, "Received unknown wakeup event (%u)", wakeup)
+    _clear_events(gearmand);
+    gearmand->ret= GEARMAN_UNKNOWN_STATE;
+  }
+}
+
+static gearman_return_t _timer_watch(gearmand_st *gearmand)
+{
+  struct timeval tv;
+
+  if (gearmand->options & GEARMAND_TIMER_EVENT)
+    return GEARMAN_SUCCESS;
+
+  GEARMAN_INFO(gearmand, "Adding event for job timeouts")
+
+  evtimer_set(&(gearmand->timer_event), _timer_event, gearmand);
+  event_base_set(gearmand->base, &(gearmand->timer_event));
+
+  tv.tv_sec= 1;
+  tv.tv_usec= 0;
+  if (evtimer_add(&(gearmand->timer_event), &tv) == -1)
+  {
+    GEARMAN_FATAL(gearmand, "_timer_watch:evtimer_add:-1")
+    return GEARMAN_EVENT;
+  }
+
+  gearmand->options|= GEARMAND_TIMER_EVENT;
+  return GEARMAN_SUCCESS;
+}
+
+static void _timer_clear(gearmand_st *gearmand)
+{
+  if (gearmand->options & GEARMAND_TIMER_EVENT)
+  {
+    GEARMAN_INFO(gearmand, "Clearing event for job timeouts")
+    (void) evtimer_del(&(gearmand->timer_event));
+    gearmand->options&= (gearmand_options_t)~GEARMAND_TIMER_EVENT;
+  }
+}
+
+static void _timer_event(int fd __attribute__ ((unused)),
+                         short events __attribute__ ((unused)), void *arg)
+{
+  gearmand_st *gearmand= (gearmand_st *)arg;
+  gearmand_thread_st *thread;
+  gearman_return_t ret;
+
+  /* Without processing threads the one server thread runs the shards, so
+     have it turn their timer wheels once a second. Processing threads turn
+     their own, but threads holding connections that went over their rate
+     are woken to top them up. */
+  gearmand->options&= (gearmand_options_t)~GEARMAND_TIMER_EVENT;
+  if (!(gearmand->server.options & GEARMAN_SERVER_PROC_THREAD))
+  {
+    if (gearmand->thread_list != NULL)
+      gearmand_thread_wakeup(gearmand->thread_list, GEARMAND_WAKEUP_RUN);
+  }
+  else
+  {
+    for (thread= gearmand->thread_list; thread != NULL; thread= thread->next)
+    {
+      if (thread->server_thread.rate_count > 0)
+        gearmand_thread_wakeup(thread, GEARMAND_WAKEUP_RUN);
     }
   }
+
+  if (gearmand->threads > 1)
+    _timer_balance(gearmand);
+
+  ret= _timer_watch(gearmand);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    _clear_events(gearmand);
+    gearmand->ret= ret;
+  }
+}
+
+static void _timer_balance(gearmand_st *gearmand)
+{
+  gearmand_thread_st *thread;
+  gearmand_thread_st *busy= NULL;
+  gearmand_thread_st *idle= NULL;
+  uint64_t load;
+
+  /* The counts only ever go up, and are read without a lock since a value
+     that just missed a packet makes no difference here. */
+  for (thread= gearmand->thread_list; thread != NULL; thread= thread->next)
+  {
+    load= thread->server_thread.load_count;
+    thread->load= load - thread->load_last;
+    thread->load_last= load;
+
+    if (busy == NULL || thread->load > busy->load)
+      busy= thread;
+    if (idle == NULL || thread->load < idle->load)
+      idle= thread;
+  }
+
+  if (!(gearmand->options & GEARMAND_MIGRATE))
+    return;
+
+  /* Only bother when the busiest thread has a fair amount more to do than
+     the idlest. */
+  if (busy->load - idle->load >= GEARMAND_THREAD_MIGRATE_MIN &&
+      busy->load > idle->load * 2)
+  {
+    busy->migrate_load= busy->load - idle->load;
+  }
+
+  /* Every thread starts counting its connections again each second, so the
+     one asked to move a connection knows what each did in the last one. */
+  for (thread= gearmand->thread_list; thread != NULL; thread= thread->next)
+    gearmand_thread_wakeup(thread, GEARMAND_WAKEUP_BALANCE);
 }
 
 static gearman_return_t _watch_events(gearmand_st *gearmand)
@@ -698,6 +1254,10 @@ static gearman_return_t _watch_events(gearmand_st *gearmand)
   if (ret != GEARMAN_SUCCESS)
     return ret;
 
+  ret= _timer_watch(gearmand);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
   return GEARMAN_SUCCESS;
 }
 
@@ -705,6 +1265,7 @@ static void _clear_events(gearmand_st *gearmand)
 {
   _listen_clear(gearmand);
   _wakeup_clear(gearmand);
+  _timer_clear(gearmand);
 
   /* If we are not threaded, tell the fake thread to shutdown now to clear
      connections. Otherwise we will never exit the libevent loop. */
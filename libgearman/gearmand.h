@@ -50,6 +50,17 @@ void gearmand_free(gearmand_st *gearmand);
 GEARMAN_API
 void gearmand_set_backlog(gearmand_st *gearmand, int backlog);
 
+/**
+ * Set how many connections are accepted each time a listening socket is ready.
+ * Anything left waiting is taken on the next pass, after the connections
+ * already open have had a turn.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param budget Number of connections, at least 1.
+ */
+GEARMAN_API
+void gearmand_set_accept_budget(gearmand_st *gearmand, uint32_t budget);
+
 /**
  * Set number of I/O threads for server to use.
  * @param gearmand Server instance structure previously initialized with
@@ -59,6 +70,291 @@ void gearmand_set_backlog(gearmand_st *gearmand, int backlog);
 GEARMAN_API
 void gearmand_set_threads(gearmand_st *gearmand, uint32_t threads);
 
+/**
+ * Set number of processing threads for server to use, see
+ * gearman_server_set_shards. These are only started along with more than one
+ * I/O thread.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param proc_threads Number of processing threads.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_set_proc_threads(gearmand_st *gearmand,
+                                           uint32_t proc_threads);
+
+/**
+ * Set options for the server instance, see gearman_server_set_options.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param options Available options for server structures.
+ * @param data For options that require data, the value to set it to.
+ */
+GEARMAN_API
+void gearmand_set_server_options(gearmand_st *gearmand,
+                                 gearman_server_options_t options,
+                                 uint32_t data);
+
+/**
+ * Pre-size the server job hash tables for an expected backlog.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param size Number of hash buckets to use.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_set_job_hash_size(gearmand_st *gearmand,
+                                           uint32_t size);
+
+/**
+ * Set the extra number of sleeping workers to wake for queued jobs, see
+ * gearman_server_set_worker_wakeup.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param worker_wakeup Number of extra workers to wake.
+ */
+GEARMAN_API
+void gearmand_set_worker_wakeup(gearmand_st *gearmand, uint32_t worker_wakeup);
+
+/**
+ * Set how many packets an I/O thread reads from one connection at a time, see
+ * gearman_server_set_read_budget.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param read_budget Packets to read per pass, or 0 for no limit.
+ */
+GEARMAN_API
+void gearmand_set_read_budget(gearmand_st *gearmand, uint32_t read_budget);
+
+/**
+ * Set how long jobs are held for the worker their affinity key prefers, see
+ * gearman_server_set_affinity_wait.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param affinity_wait Seconds to hold a job, or 0 to not use affinity keys.
+ */
+GEARMAN_API
+void gearmand_set_affinity_wait(gearmand_st *gearmand, uint32_t affinity_wait);
+
+/**
+ * Set the number of priority levels and how long jobs wait on one before
+ * moving up, see gearman_server_set_priority_levels and
+ * gearman_server_set_priority_age.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param levels Number of priority levels.
+ * @param age Seconds to wait on a level, or 0 to never move jobs up.
+ */
+GEARMAN_API
+void gearmand_set_priority(gearmand_st *gearmand, uint32_t levels,
+                           uint32_t age);
+
+/**
+ * Set how many bytes of streamed work data may wait for one client, see
+ * gearman_server_set_work_data_max.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param work_data_max Bytes that may wait for each client, or 0 for no
+ *        limit.
+ */
+GEARMAN_API
+void gearmand_set_work_data_max(gearmand_st *gearmand, size_t work_data_max);
+
+/**
+ * Set how many bytes of job payload may be queued at once, see
+ * gearman_server_set_queue_bytes_max.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param queue_bytes_max Bytes that may be queued, or 0 for no limit.
+ */
+GEARMAN_API
+void gearmand_set_queue_bytes_max(gearmand_st *gearmand,
+                                  size_t queue_bytes_max);
+
+/**
+ * Set how fast each connection may submit jobs, see
+ * gearman_server_set_client_rate.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param client_rate Bytes per second each connection may submit, or 0 for
+ *        no limit.
+ */
+GEARMAN_API
+void gearmand_set_client_rate(gearmand_st *gearmand, size_t client_rate);
+
+/**
+ * Set where queued background job payloads are spilled to, see
+ * gearman_server_set_spill.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param path Directory to create the spill files in, or NULL to disable.
+ * @param watermark Bytes of payload to keep in memory before spilling.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_set_spill(gearmand_st *gearmand, const char *path,
+                                    size_t watermark);
+
+/**
+ * Commit background jobs to the persistent queue in groups, see
+ * gearman_server_set_queue_commit.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param size Jobs to commit at once, or 0 to commit each job on its own.
+ * @param window Microseconds a job may wait for its group to fill.
+ */
+GEARMAN_API
+void gearmand_set_queue_commit(gearmand_st *gearmand, uint32_t size,
+                               uint32_t window);
+
+/**
+ * Run persistent queue calls in their own thread, see
+ * gearman_server_set_queue_persist_thread.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param persist_thread True to use a persistence thread.
+ */
+GEARMAN_API
+void gearmand_set_queue_persist_thread(gearmand_st *gearmand,
+                                       bool persist_thread);
+
+/**
+ * Replay the persistent queue in the background, see
+ * gearman_server_set_queue_replay_background.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param background True to replay in the background.
+ */
+GEARMAN_API
+void gearmand_set_queue_replay_background(gearmand_st *gearmand,
+                                          bool background);
+
+/**
+ * Take periodic snapshots of the queued jobs, see
+ * gearman_server_set_snapshot.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param path File to keep the snapshot in, or NULL to disable snapshots.
+ * @param interval Seconds between snapshots, or 0 for only on shutdown.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_set_snapshot(gearmand_st *gearmand, const char *path,
+                                       uint32_t interval);
+
+/**
+ * Stream background jobs to a standby, see gearman_server_replica_peer_add.
+ * This may be called more than once to add more peers.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param host Host of the standby.
+ * @param port Replication port the standby listens on.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_replica_peer_add(gearmand_st *gearmand,
+                                           const char *host, in_port_t port);
+
+/**
+ * Act as a standby, keeping the background jobs a primary streams to this
+ * port until promoted with the "replica promote" admin command.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param port Port to listen on for a primary.
+ */
+GEARMAN_API
+void gearmand_set_replica_listen(gearmand_st *gearmand, in_port_t port);
+
+/**
+ * Set how long admin status replies are reused for, see
+ * gearman_server_set_stats_interval.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param seconds Seconds to reuse a reply for, or 0 to never reuse one.
+ */
+GEARMAN_API
+void gearmand_set_stats_interval(gearmand_st *gearmand, uint32_t seconds);
+
+/**
+ * Set the send and receive buffer sizes for connections, see
+ * gearman_server_set_buffer_size.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param send_size Send buffer size, or 0 for the default.
+ * @param recv_size Receive buffer size, or 0 for the default.
+ */
+GEARMAN_API
+void gearmand_set_buffer_size(gearmand_st *gearmand, size_t send_size,
+                              size_t recv_size);
+
+/**
+ * Have each I/O thread listen on its own SO_REUSEPORT socket and accept its
+ * own connections, rather than accepting every connection in the main thread
+ * and handing it off. This only applies when running with I/O threads. Note
+ * that any other process run by the same user can then bind the same port.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param reuseport Whether to use per-thread listening sockets.
+ */
+GEARMAN_API
+void gearmand_set_reuseport(gearmand_st *gearmand, bool reuseport);
+
+/**
+ * Move connections from busy I/O threads to idle ones. New connections
+ * always go to the thread with the least load, counted as packets and
+ * kilobytes read and sent in the last second plus a share for each
+ * connection. With this set, a thread that stays well ahead of the idlest
+ * one also hands one of its connections back to be placed again, once a
+ * second. Only connections that are between packets and hold nothing in
+ * the server, such as clients submitting background jobs, are moved, so
+ * workers and clients waiting on jobs stay where they are. This only
+ * applies when running with more than one I/O thread.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param migrate Whether to move connections between threads.
+ */
+GEARMAN_API
+void gearmand_set_migrate(gearmand_st *gearmand, bool migrate);
+
+/**
+ * Pin the server threads to CPUs. I/O thread x runs on the CPU at position x
+ * of io_cpus and processing thread x on the one at position x of proc_cpus,
+ * wrapping around when there are more threads than CPUs, and the main
+ * thread, which accepts connections, runs on main_cpu. Each pinned thread
+ * takes packets from a pool for the NUMA node of its CPU, see
+ * gearman_server_pin, and allocates the connections it serves itself, so a
+ * packet is read, parsed and freed in memory on the node that uses it. This
+ * must be set before gearmand_run.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param io_cpus CPU list for the I/O threads such as "0-3,8", see
+ *        gearman_server_cpu_list, or NULL to not pin them.
+ * @param proc_cpus CPU list for the processing threads, or NULL to not pin
+ *        them.
+ * @param main_cpu CPU for the main thread, or -1 to not pin it.
+ * @return Standard gearman return value. This fails with
+ *         GEARMAN_UNKNOWN_OPTION if a list is malformed or the system can't
+ *         pin threads.
+ */
+GEARMAN_API
+gearman_return_t gearmand_set_cpus(gearmand_st *gearmand, const char *io_cpus,
+                                   const char *proc_cpus, int main_cpu);
+
+/**
+ * Set the I/O engine that I/O threads wait for connections with. The io_uring
+ * engine queues a poll request for each connection instead of using libevent,
+ * and submits them all with the next wait in a single system call. This only
+ * applies when running with I/O threads, the main thread always uses libevent.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param io_engine I/O engine to use.
+ * @return Standard gearman return value. This fails with
+ *         GEARMAN_UNKNOWN_OPTION if io_uring support was not built in.
+ */
+GEARMAN_API
+gearman_return_t gearmand_set_io_engine(gearmand_st *gearmand,
+                                        gearmand_io_engine_t io_engine);
+
 /**
  * Set logging callback for server instance.
  * @param gearmand Server instance structure previously initialized with
@@ -71,6 +367,19 @@ GEARMAN_API
 void gearmand_set_log(gearmand_st *gearmand, gearmand_log_fn log_fn,
                       void *log_fn_arg, gearman_verbose_t verbose);
 
+/**
+ * Set the number of records in each thread's log ring. When this is not 0,
+ * the log callback is only called from a separate writer thread, and the
+ * I/O and processing threads just copy their lines into a ring, see
+ * gearmand_log. Lines logged while a ring is full are dropped and counted.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param records Records per ring, rounded up to a power of two, or 0 to call
+ *        the log callback directly.
+ */
+GEARMAN_API
+void gearmand_set_log_ring(gearmand_st *gearmand, uint32_t records);
+
 /**
  * Add a port to listen on when starting server with optional callback.
  * @param gearmand Server instance structure previously initialized with
@@ -84,6 +393,39 @@ GEARMAN_API
 gearman_return_t gearmand_port_add(gearmand_st *gearmand, in_port_t port,
                                    gearman_con_add_fn *add_fn);
 
+/**
+ * Add a Unix domain socket to listen on when starting server with optional
+ * callback. A stale socket left at the path is replaced, and the path is
+ * removed again when the server stops listening. Unix sockets are always
+ * accepted by the main thread, even when listening with SO_REUSEPORT.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param path Path of the socket, which must stay valid until the server is
+ *        freed.
+ * @param add_fn Optional callback function that is called when a connection
+                 has been accepted on the given socket.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_port_add_unix(gearmand_st *gearmand,
+                                        const char *path,
+                                        gearman_con_add_fn *add_fn);
+
+/**
+ * Open listening sockets on every address for a port, or the single socket
+ * for a Unix socket path. This is used by gearmand_run, and by each I/O
+ * thread when listening with SO_REUSEPORT.
+ * @param port Port previously added with gearmand_port_add or
+ *        gearmand_port_add_unix.
+ * @param listen_fd List of listening sockets to append the new sockets to.
+ * @param listen_count Number of sockets in the list, updated as they are
+ *        added.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_port_listen(gearmand_port_st *port, int **listen_fd,
+                                      uint32_t *listen_count);
+
 /**
  * Run the server instance.
  * @param gearmand Server instance structure previously initialized with
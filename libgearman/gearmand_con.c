@@ -28,19 +28,128 @@ static void _con_ready(int fd, short events, void *arg);
 static gearman_return_t _con_add(gearmand_thread_st *thread,
                                  gearmand_con_st *con);
 
+/**
+ * Hand a connection accepted or given up by an I/O thread to the thread with
+ * the least load to add.
+ */
+static void _con_place(gearmand_st *gearmand, gearmand_con_st *dcon);
+
+/**
+ * Pick the I/O thread with the least load for a new connection. Load is
+ * what each thread moved in the last second, plus GEARMAND_THREAD_CON_LOAD
+ * for each connection it has or is about to add, so idle threads and a
+ * burst of new connections are still spread evenly. Ties go to the next
+ * thread in turn.
+ */
+static gearmand_thread_st *_con_thread(gearmand_st *gearmand);
+
+/**
+ * Stop watching a connection and free its server connection, leaving the
+ * socket open.
+ */
+static void _con_detach(gearmand_con_st *dcon);
+
+/**
+ * Keep the peer address of a new connection to name it by later. Unix socket
+ * peers have no address, so they are named after the socket right away.
+ */
+static void _con_set_peer(gearmand_con_st *dcon, gearmand_port_st *port,
+                          const struct sockaddr *addr, socklen_t addr_len);
+
+/**
+ * Fill in the host and port strings of a connection from its address the
+ * first time they are needed. Any thread may call this.
+ */
+static void _con_name(gearmand_con_st *dcon);
+
+/**
+ * Turn away a connection while out of file descriptors. The spare descriptor
+ * is closed to make room to accept it, and opened again after closing it, so
+ * the listening socket does not stay ready and the client is not left
+ * waiting.
+ */
+static void _con_shed(gearmand_st *gearmand, int fd);
+
+/**
+ * Options for the connection structures of accepted sockets, which accept4
+ * already made non-blocking.
+ */
+#ifdef HAVE_ACCEPT4
+static const gearman_con_options_t _con_options= GEARMAN_CON_NONBLOCK;
+#else
+static const gearman_con_options_t _con_options= 0;
+#endif
+
 /** @} */
 
 /*
  * Public definitions
  */
 
+gearman_return_t gearmand_con_accept(gearmand_st *gearmand,
+                                     gearmand_thread_st *thread,
+                                     gearmand_port_st *port, int fd)
+{
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  gearman_return_t ret;
+  uint32_t x;
+  int con_fd;
+
+  /* Take what is waiting, but only up to the budget so a storm of new
+     connections can't hold up the ones already here. The listening socket
+     stays ready for the next pass if more are left. */
+  for (x= 0; x < gearmand->accept_budget; x++)
+  {
+    sa_len= sizeof(sa);
+#ifdef HAVE_ACCEPT4
+    con_fd= accept4(fd, (struct sockaddr *)&sa, &sa_len,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    con_fd= accept(fd, (struct sockaddr *)&sa, &sa_len);
+#endif
+    if (con_fd == -1)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      else if (errno == EAGAIN)
+        break;
+      else if (errno == EMFILE || errno == ENFILE)
+      {
+        GEARMAN_ERROR(gearmand, "gearmand_con_accept:accept:too many open "
+                      "files")
+        _con_shed(gearmand, fd);
+        break;
+      }
+
+      GEARMAN_FATAL(gearmand, "gearmand_con_accept:accept:%d", errno)
+      return GEARMAN_ERRNO;
+    }
+
+    if (thread == NULL)
+    {
+      ret= gearmand_con_create(gearmand, con_fd, port,
+                               (struct sockaddr *)&sa, sa_len);
+    }
+    else
+    {
+      ret= gearmand_con_thread_create(thread, con_fd, port,
+                                      (struct sockaddr *)&sa, sa_len);
+    }
+
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
 gearman_return_t gearmand_con_create(gearmand_st *gearmand, int fd,
-                                     const char *host, const char *port,
-                                     gearman_con_add_fn *add_fn)
+                                     gearmand_port_st *port,
+                                     const struct sockaddr *addr,
+                                     socklen_t addr_len)
 {
   gearmand_con_st *dcon;
-  gearmand_con_st *free_dcon_list;
-  uint32_t free_dcon_count;
 
   if (gearmand->free_dcon_count > 0)
   {
@@ -64,10 +173,11 @@ gearman_return_t gearmand_con_create(gearmand_st *gearmand, int fd,
   dcon->prev= NULL;
   dcon->server_con= NULL;
   dcon->con= NULL;
-  dcon->add_fn= NULL;
-  strncpy(dcon->host, host, NI_MAXHOST - 1);
-  strncpy(dcon->port, port, NI_MAXSERV - 1);
-  dcon->add_fn= add_fn;
+  dcon->add_fn= port->add_fn;
+  _con_set_peer(dcon, port, addr, addr_len);
+
+  GEARMAN_INFO(gearmand, "Accepted connection from %s:%s",
+               gearmand_con_host(dcon), gearmand_con_port(dcon))
 
   /* If we are not threaded, just add the connection now. */
   if (gearmand->threads == 0)
@@ -76,84 +186,140 @@ gearman_return_t gearmand_con_create(gearmand_st *gearmand, int fd,
     return _con_add(gearmand->thread_list, dcon);
   }
 
-  /* We do a simple round-robin connection queue algorithm here. */
-  if (gearmand->thread_add_next == NULL)
-    gearmand->thread_add_next= gearmand->thread_list;
+  _con_place(gearmand, dcon);
 
-  dcon->thread= gearmand->thread_add_next;
+  return GEARMAN_SUCCESS;
+}
 
-  /* We don't need to lock if the list is empty. */
-  if (dcon->thread->dcon_add_count == 0 &&
-      dcon->thread->free_dcon_count < gearmand->max_thread_free_dcon_count)
+gearman_return_t gearmand_con_thread_create(gearmand_thread_st *thread, int fd,
+                                            gearmand_port_st *port,
+                                            const struct sockaddr *addr,
+                                            socklen_t addr_len)
+{
+  gearmand_con_st *dcon= NULL;
+
+  /* The main thread never takes these back in this mode, so reuse them here.
+     Nothing else touches the list, but frees still take the lock. */
+  if (thread->free_dcon_count > 0)
   {
-    GEARMAN_LIST_ADD(dcon->thread->dcon_add, dcon,)
-    gearmand_thread_wakeup(dcon->thread, GEARMAND_WAKEUP_CON);
+    GEARMAN_SERVER_LOCK(&(thread->gearmand->server), &(thread->lock),
+                        &(thread->lock_stats))
+    dcon= thread->free_dcon_list;
+    GEARMAN_LIST_DEL(thread->free_dcon, dcon,)
+    GEARMAN_SERVER_UNLOCK(&(thread->gearmand->server), &(thread->lock),
+                          &(thread->lock_stats))
   }
   else
   {
-    (void ) pthread_mutex_lock(&(dcon->thread->lock));
-
-    GEARMAN_LIST_ADD(dcon->thread->dcon_add, dcon,)
-
-    /* Take the free connection structures back to reuse. */
-    free_dcon_list= dcon->thread->free_dcon_list;
-    free_dcon_count= dcon->thread->free_dcon_count;
-    dcon->thread->free_dcon_list= NULL;
-    dcon->thread->free_dcon_count= 0;
-
-    (void ) pthread_mutex_unlock(&(dcon->thread->lock));
-
-    /* Only wakeup the thread if this is the first in the queue. We don't need
-       to lock around the count check, worst case it was already picked up and
-       we send an extra byte. */
-    if (dcon->thread->dcon_add_count == 1)
-      gearmand_thread_wakeup(dcon->thread, GEARMAND_WAKEUP_CON);
-
-    /* Put the free connection structures we grabbed on the main list. */
-    while (free_dcon_list != NULL)
+    dcon= malloc(sizeof(gearmand_con_st));
+    if (dcon == NULL)
     {
-      dcon= free_dcon_list;
-      GEARMAN_LIST_DEL(free_dcon, dcon,)
-      GEARMAN_LIST_ADD(gearmand->free_dcon, dcon,)
+      close(fd);
+      GEARMAN_FATAL(thread->gearmand, "gearmand_con_thread_create:malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
     }
   }
 
-  gearmand->thread_add_next= gearmand->thread_add_next->next;
+  dcon->last_events= 0;
+  dcon->fd= fd;
+  dcon->thread= thread;
+  dcon->next= NULL;
+  dcon->prev= NULL;
+  dcon->server_con= NULL;
+  dcon->con= NULL;
+  dcon->add_fn= port->add_fn;
+  _con_set_peer(dcon, port, addr, addr_len);
+
+  GEARMAN_INFO(thread->gearmand, "[%4u] Accepted connection from %s:%s",
+               thread->count, gearmand_con_host(dcon), gearmand_con_port(dcon))
 
-  return GEARMAN_SUCCESS;
+  return _con_add(thread, dcon);
 }
 
 void gearmand_con_free(gearmand_con_st *dcon)
 {
-  assert(event_del(&(dcon->event)) == 0);
-
-  /* This gets around a libevent bug when both POLLIN and POLLOUT are set. */
-  event_set(&(dcon->event), dcon->fd, EV_READ, _con_ready, dcon);
-  event_base_set(dcon->thread->base, &(dcon->event));
-  event_add(&(dcon->event), NULL);
-  assert(event_del(&(dcon->event)) == 0);
-
-  gearman_server_con_free(dcon->server_con);
-  GEARMAN_LIST_DEL(dcon->thread->dcon, dcon,)
+  _con_detach(dcon);
 
+  if (GEARMAND_CON_CLOSE_ENABLED())
+    _con_name(dcon);
+  GEARMAND_CON_CLOSE(dcon->fd, dcon->host, dcon->port);
   close(dcon->fd);
 
   if (dcon->thread->gearmand->free_dcon_count < GEARMAN_MAX_FREE_SERVER_CON)
   {
     if (dcon->thread->gearmand->threads == 0)
       GEARMAN_LIST_ADD(dcon->thread->gearmand->free_dcon, dcon,)
+    else if (dcon->thread->gearmand->options & GEARMAND_REUSEPORT &&
+             dcon->thread->free_dcon_count >=
+             dcon->thread->gearmand->max_thread_free_dcon_count)
+    {
+      /* Threads that accept for themselves are never emptied by the main
+         thread, so cap them here instead. */
+      free(dcon);
+    }
     else
     {
       /* Lock here because the main thread may be emptying this. */
-      (void ) pthread_mutex_lock(&(dcon->thread->lock));
+      GEARMAN_SERVER_LOCK(&(dcon->thread->gearmand->server),
+                          &(dcon->thread->lock), &(dcon->thread->lock_stats))
       GEARMAN_LIST_ADD(dcon->thread->free_dcon, dcon,)
-      (void ) pthread_mutex_unlock(&(dcon->thread->lock));
+      GEARMAN_SERVER_UNLOCK(&(dcon->thread->gearmand->server),
+                            &(dcon->thread->lock), &(dcon->thread->lock_stats))
     }
   }
   else
     free(dcon);
 }
 
+const char *gearmand_con_host(gearmand_con_st *dcon)
+{
+  _con_name(dcon);
+  return dcon->host;
+}
+
+const char *gearmand_con_port(gearmand_con_st *dcon)
+{
+  _con_name(dcon);
+  return dcon->port;
+}
+
+void gearmand_con_migrate(gearmand_con_st *dcon)
+{
+  gearmand_st *gearmand= dcon->thread->gearmand;
+  gearmand_con_st *next;
+
+  GEARMAN_INFO(gearmand, "[%4u] %15s:%5s Moving to another thread",
+               dcon->thread->count, gearmand_con_host(dcon),
+               gearmand_con_port(dcon))
+
+  /* The socket stays open, and anything the client sends meanwhile waits in
+     it until the new thread watches it. */
+  _con_detach(dcon);
+  dcon->last_events= 0;
+  dcon->server_con= NULL;
+  dcon->con= NULL;
+
+  GEARMAN_SERVER_QUEUE_PUSH(gearmand->migrate, dcon,, next)
+  if (next == NULL)
+    gearmand_wakeup(gearmand, GEARMAND_WAKEUP_CON);
+}
+
+void gearmand_con_check_migrate(gearmand_st *gearmand)
+{
+  gearmand_con_st *dcon;
+  gearmand_con_st *next;
+
+  GEARMAN_SERVER_QUEUE_TAKE(gearmand->migrate, dcon, next,)
+
+  while (gearmand->migrate_list != NULL)
+  {
+    dcon= gearmand->migrate_list;
+    gearmand->migrate_list= dcon->next;
+    dcon->next= NULL;
+    _con_place(gearmand, dcon);
+  }
+}
+
 void gearmand_con_check_queue(gearmand_thread_st *thread)
 {
   gearmand_con_st *dcon;
@@ -166,10 +332,12 @@ void gearmand_con_check_queue(gearmand_thread_st *thread)
      walk the thread's dcon_list while holding the lock. */
   while (thread->dcon_add_list != NULL)
   {
-    (void ) pthread_mutex_lock(&(thread->lock));
+    GEARMAN_SERVER_LOCK(&(thread->gearmand->server), &(thread->lock),
+                        &(thread->lock_stats))
     dcon= thread->dcon_add_list;
     GEARMAN_LIST_DEL(thread->dcon_add, dcon,)
-    (void ) pthread_mutex_unlock(&(thread->lock));
+    GEARMAN_SERVER_UNLOCK(&(thread->gearmand->server), &(thread->lock),
+                          &(thread->lock_stats))
 
     if (_con_add(thread, dcon) != GEARMAN_SUCCESS)
       gearmand_wakeup(thread->gearmand, GEARMAND_WAKEUP_SHUTDOWN);
@@ -181,6 +349,7 @@ gearman_return_t gearmand_con_watch(gearman_con_st *con, short events,
 {
   (void) arg;
   gearmand_con_st *dcon;
+  gearman_return_t ret;
   short set_events= 0;
 
   dcon= (gearmand_con_st *)gearman_con_data(con);
@@ -191,7 +360,31 @@ gearman_return_t gearmand_con_watch(gearman_con_st *con, short events,
   if (events & POLLOUT)
     set_events|= EV_WRITE;
 
-  if (dcon->last_events != set_events)
+  if (dcon->last_events != set_events && set_events == 0)
+  {
+    /* Nothing to watch for now, such as while reading is paused. */
+    if (dcon->thread->options & GEARMAND_THREAD_URING)
+      gearmand_uring_event_del(&(dcon->thread->uring), &(dcon->uring_event));
+    else
+      assert(event_del(&(dcon->event)) == 0);
+
+    dcon->last_events= 0;
+  }
+  else if (dcon->last_events != set_events &&
+           dcon->thread->options & GEARMAND_THREAD_URING)
+  {
+    ret= gearmand_uring_event_add(&(dcon->thread->uring), &(dcon->uring_event),
+                                  set_events);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      GEARMAN_FATAL(dcon->thread->gearmand,
+                    "_con_watch:gearmand_uring_event_add:%d", ret)
+      return ret;
+    }
+
+    dcon->last_events= set_events;
+  }
+  else if (dcon->last_events != set_events)
   {
     if (dcon->last_events != 0)
       assert(event_del(&(dcon->event)) == 0);
@@ -209,7 +402,8 @@ gearman_return_t gearmand_con_watch(gearman_con_st *con, short events,
   }
 
   GEARMAN_CRAZY(dcon->thread->gearmand, "[%4u] %15s:%5s Watching  %6s %s",
-                dcon->thread->count, dcon->host, dcon->port,
+                dcon->thread->count, gearmand_con_host(dcon),
+                gearmand_con_port(dcon),
                 events & POLLIN ? "POLLIN" : "",
                 events & POLLOUT ? "POLLOUT" : "")
 
@@ -240,7 +434,8 @@ static void _con_ready(int fd __attribute__ ((unused)), short events,
   }
 
   GEARMAN_CRAZY(dcon->thread->gearmand, "[%4u] %15s:%5s Ready     %6s %s",
-                dcon->thread->count, dcon->host, dcon->port,
+                dcon->thread->count, gearmand_con_host(dcon),
+                gearmand_con_port(dcon),
                 revents & POLLIN ? "POLLIN" : "",
                 revents & POLLOUT ? "POLLOUT" : "")
 
@@ -252,8 +447,10 @@ static gearman_return_t _con_add(gearmand_thread_st *thread,
 {
   gearman_return_t ret;
 
+  gearmand_uring_event_set(&(dcon->uring_event), dcon->fd, _con_ready, dcon);
+
   dcon->server_con= gearman_server_con_add(&(thread->server_thread), dcon->fd,
-                                           dcon);
+                                           _con_options, dcon);
   if (dcon->server_con == NULL)
   {
     close(dcon->fd);
@@ -269,6 +466,8 @@ static gearman_return_t _con_add(gearmand_thread_st *thread,
     ret= (*dcon->add_fn)(gearman_server_con_con(dcon->server_con));
     if (ret != GEARMAN_SUCCESS)
     {
+      if (thread->options & GEARMAND_THREAD_URING)
+        gearmand_uring_event_del(&(thread->uring), &(dcon->uring_event));
       gearman_server_con_free(dcon->server_con);
       close(dcon->fd);
       free(dcon);
@@ -277,9 +476,208 @@ static gearman_return_t _con_add(gearmand_thread_st *thread,
   }
 
   GEARMAN_INFO(thread->gearmand, "[%4u] %15s:%5s Connected", thread->count,
-               dcon->host, dcon->port)
+               gearmand_con_host(dcon), gearmand_con_port(dcon))
+  if (GEARMAND_CON_ACCEPT_ENABLED())
+    _con_name(dcon);
+  GEARMAND_CON_ACCEPT(dcon->fd, dcon->host, dcon->port);
 
   GEARMAN_LIST_ADD(thread->dcon, dcon,)
 
   return GEARMAN_SUCCESS;
 }
+
+static void _con_place(gearmand_st *gearmand, gearmand_con_st *dcon)
+{
+  gearmand_con_st *free_dcon_list;
+  uint32_t free_dcon_count;
+
+  dcon->thread= _con_thread(gearmand);
+
+  /* We don't need to lock if the list is empty. */
+  if (dcon->thread->dcon_add_count == 0 &&
+      dcon->thread->free_dcon_count < gearmand->max_thread_free_dcon_count)
+  {
+    GEARMAN_LIST_ADD(dcon->thread->dcon_add, dcon,)
+    gearmand_thread_wakeup(dcon->thread, GEARMAND_WAKEUP_CON);
+  }
+  else
+  {
+    GEARMAN_SERVER_LOCK(&(dcon->thread->gearmand->server),
+                        &(dcon->thread->lock), &(dcon->thread->lock_stats))
+
+    GEARMAN_LIST_ADD(dcon->thread->dcon_add, dcon,)
+
+    /* Take the free connection structures back to reuse. */
+    free_dcon_list= dcon->thread->free_dcon_list;
+    free_dcon_count= dcon->thread->free_dcon_count;
+    dcon->thread->free_dcon_list= NULL;
+    dcon->thread->free_dcon_count= 0;
+
+    GEARMAN_SERVER_UNLOCK(&(dcon->thread->gearmand->server),
+                          &(dcon->thread->lock), &(dcon->thread->lock_stats))
+
+    /* Only wakeup the thread if this is the first in the queue. We don't need
+       to lock around the count check, worst case it was already picked up and
+       we send an extra byte. */
+    if (dcon->thread->dcon_add_count == 1)
+      gearmand_thread_wakeup(dcon->thread, GEARMAND_WAKEUP_CON);
+
+    /* Put the free connection structures we grabbed on the main list. */
+    while (free_dcon_list != NULL)
+    {
+      dcon= free_dcon_list;
+      GEARMAN_LIST_DEL(free_dcon, dcon,)
+      GEARMAN_LIST_ADD(gearmand->free_dcon, dcon,)
+    }
+  }
+}
+
+static gearmand_thread_st *_con_thread(gearmand_st *gearmand)
+{
+  gearmand_thread_st *thread;
+  gearmand_thread_st *best= NULL;
+  uint64_t load;
+  uint64_t best_load= 0;
+  uint32_t x;
+
+  thread= gearmand->thread_add_next;
+  if (thread == NULL)
+    thread= gearmand->thread_list;
+
+  /* Other threads change their connection counts as this looks, but a
+     slightly old count only makes the choice slightly worse. */
+  for (x= 0; x < gearmand->thread_count; x++)
+  {
+    load= thread->load +
+          (uint64_t)(thread->server_thread.con_count + thread->dcon_add_count) *
+          GEARMAND_THREAD_CON_LOAD;
+    if (best == NULL || load < best_load)
+    {
+      best= thread;
+      best_load= load;
+    }
+
+    thread= thread->next == NULL ? gearmand->thread_list : thread->next;
+  }
+
+  gearmand->thread_add_next= best->next;
+
+  return best;
+}
+
+static void _con_detach(gearmand_con_st *dcon)
+{
+  if (dcon->thread->options & GEARMAND_THREAD_URING)
+    gearmand_uring_event_del(&(dcon->thread->uring), &(dcon->uring_event));
+  else
+  {
+    assert(event_del(&(dcon->event)) == 0);
+
+    /* This gets around a libevent bug when both POLLIN and POLLOUT are set. */
+    event_set(&(dcon->event), dcon->fd, EV_READ, _con_ready, dcon);
+    event_base_set(dcon->thread->base, &(dcon->event));
+    event_add(&(dcon->event), NULL);
+    assert(event_del(&(dcon->event)) == 0);
+  }
+
+  if (dcon->thread->migrate_dcon == dcon)
+    dcon->thread->migrate_dcon= NULL;
+
+  gearman_server_con_free(dcon->server_con);
+  GEARMAN_LIST_DEL(dcon->thread->dcon, dcon,)
+}
+
+static void _con_set_peer(gearmand_con_st *dcon, gearmand_port_st *port,
+                          const struct sockaddr *addr, socklen_t addr_len)
+{
+  if (port->path != NULL)
+  {
+    snprintf(dcon->host, NI_MAXHOST, "%s", port->path);
+    strcpy(dcon->port, "-");
+    dcon->addr_len= 0;
+    dcon->name_state= GEARMAND_CON_NAME_DONE;
+    return;
+  }
+
+  if (addr_len > sizeof(dcon->addr))
+    addr_len= sizeof(dcon->addr);
+
+  memcpy(&(dcon->addr), addr, addr_len);
+  dcon->addr_len= addr_len;
+  dcon->host[0]= 0;
+  dcon->port[0]= 0;
+  dcon->name_state= GEARMAND_CON_NAME_NONE;
+}
+
+static void _con_name(gearmand_con_st *dcon)
+{
+  const struct sockaddr_in *sin;
+  const struct sockaddr_in6 *sin6;
+  const char *host= NULL;
+  in_port_t port= 0;
+
+  if (dcon->name_state == GEARMAND_CON_NAME_DONE)
+  {
+    __sync_synchronize();
+    return;
+  }
+
+  /* Whoever gets here first names it, and anyone else waits the moment that
+     takes. */
+  if (!__sync_bool_compare_and_swap(&(dcon->name_state),
+                                    GEARMAND_CON_NAME_NONE,
+                                    GEARMAND_CON_NAME_BUSY))
+  {
+    while (dcon->name_state != GEARMAND_CON_NAME_DONE)
+      ;
+    __sync_synchronize();
+    return;
+  }
+
+  /* Only numeric forms are used, so this never blocks on a lookup. */
+  if (dcon->addr.ss_family == AF_INET &&
+      dcon->addr_len >= sizeof(struct sockaddr_in))
+  {
+    sin= (const struct sockaddr_in *)&(dcon->addr);
+    host= inet_ntop(AF_INET, &(sin->sin_addr), dcon->host, NI_MAXHOST);
+    port= ntohs(sin->sin_port);
+  }
+  else if (dcon->addr.ss_family == AF_INET6 &&
+           dcon->addr_len >= sizeof(struct sockaddr_in6))
+  {
+    sin6= (const struct sockaddr_in6 *)&(dcon->addr);
+    host= inet_ntop(AF_INET6, &(sin6->sin6_addr), dcon->host, NI_MAXHOST);
+    port= ntohs(sin6->sin6_port);
+  }
+
+  if (host == NULL)
+  {
+    strcpy(dcon->host, "-");
+    strcpy(dcon->port, "-");
+  }
+  else
+    snprintf(dcon->port, NI_MAXSERV, "%u", port);
+
+  __sync_synchronize();
+  dcon->name_state= GEARMAND_CON_NAME_DONE;
+}
+
+static void _con_shed(gearmand_st *gearmand, int fd)
+{
+  int spare_fd;
+
+  /* Threads with their own listening sockets may all run out at once, and
+     only the one that takes the spare gets to shed. */
+  spare_fd= __sync_lock_test_and_set(&(gearmand->spare_fd), -1);
+  if (spare_fd == -1)
+    return;
+
+  close(spare_fd);
+
+  fd= accept(fd, NULL, NULL);
+  if (fd != -1)
+    close(fd);
+
+  spare_fd= open("/dev/null", O_RDONLY);
+  (void)__sync_lock_test_and_set(&(gearmand->spare_fd), spare_fd);
+}
@@ -24,21 +24,70 @@ extern "C" {
  * @{
  */
 
+/**
+ * Accept the connections waiting on a listening socket, up to the accept
+ * budget, see gearmand_set_accept_budget. Running out of file descriptors is
+ * not an error, the connection is closed right away instead.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param thread I/O thread with its own listening socket that is accepting,
+ *        or NULL for the main thread.
+ * @param port Port the listening socket is for.
+ * @param fd Listening socket, which must be non-blocking.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_con_accept(gearmand_st *gearmand,
+                                     gearmand_thread_st *thread,
+                                     gearmand_port_st *port, int fd);
+
 /**
  * Create a new gearmand connection.
  * @param gearmand Server instance structure previously initialized with
  *        gearmand_create.
  * @param fd File descriptor of new connection.
- * @param host Host of peer connection.
- * @param port Port of peer connection.
- * @param add_fn Optional callback to use when adding the connection to an
-          I/O thread.
- * @return Pointer to an allocated gearmand structure.
+ * @param port Port the connection was accepted on. Its add_fn is used when
+ *        adding the connection to an I/O thread.
+ * @param addr Address of the peer. It is only turned into host and port
+ *        strings when something asks for them, see gearmand_con_host.
+ * @param addr_len Size of addr.
+ * @return Standard gearman return value.
  */
 GEARMAN_API
 gearman_return_t gearmand_con_create(gearmand_st *gearmand, int fd,
-                                     const char *host, const char *port,
-                                     gearman_con_add_fn *add_fn);
+                                     gearmand_port_st *port,
+                                     const struct sockaddr *addr,
+                                     socklen_t addr_len);
+
+/**
+ * Create a new gearmand connection for a socket accepted by an I/O thread
+ * with its own listening socket. The connection is added to that thread
+ * directly rather than being queued by the main thread.
+ * @param thread Thread that accepted the connection.
+ * @param fd File descriptor of new connection.
+ * @param port Port the connection was accepted on.
+ * @param addr Address of the peer.
+ * @param addr_len Size of addr.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_con_thread_create(gearmand_thread_st *thread, int fd,
+                                            gearmand_port_st *port,
+                                            const struct sockaddr *addr,
+                                            socklen_t addr_len);
+
+/**
+ * Get the numeric host of the peer for a connection, formatting it the first
+ * time. This may be called from any thread.
+ */
+GEARMAN_API
+const char *gearmand_con_host(gearmand_con_st *dcon);
+
+/**
+ * Get the port of the peer for a connection, see gearmand_con_host.
+ */
+GEARMAN_API
+const char *gearmand_con_port(gearmand_con_st *dcon);
 
 /**
  * Free resources used by a connection.
@@ -47,6 +96,22 @@ gearman_return_t gearmand_con_create(gearmand_st *gearmand, int fd,
 GEARMAN_API
 void gearmand_con_free(gearmand_con_st *dcon);
 
+/**
+ * Give up a quiescent connection so the main thread can add it to the I/O
+ * thread with the least load, see gearman_server_con_quiescent. The socket
+ * is kept, and everything else about the connection is freed.
+ * @param dcon Connection to move, from its own I/O thread.
+ */
+GEARMAN_API
+void gearmand_con_migrate(gearmand_con_st *dcon);
+
+/**
+ * Add connections given up with gearmand_con_migrate to new threads, from
+ * the main thread.
+ */
+GEARMAN_API
+void gearmand_con_check_migrate(gearmand_st *gearmand);
+
 /**
  * Check connection queue for a thread.
  */
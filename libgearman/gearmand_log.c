@@ -0,0 +1,415 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Gearmand Asynchronous Logging Definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearmand_log_private Private Gearmand Logging Functions
+ * @ingroup gearmand_log
+ * @{
+ */
+
+/**
+ * Log callback gearmand uses while the writer thread is running.
+ */
+static void _log_push(gearmand_st *gearmand, gearman_verbose_t verbose,
+                      const char *line, void *fn_arg);
+
+/**
+ * Get the ring of the calling thread, creating it on first use.
+ */
+static gearmand_log_ring_st *_log_ring(gearmand_log_st *log);
+
+/**
+ * Get the next free record in a ring, or NULL if the ring is full.
+ */
+static gearmand_log_record_st *_log_record(gearmand_log_st *log,
+                                           gearmand_log_ring_st *ring);
+
+/**
+ * Make a record filled in by the caller visible to the writer thread.
+ */
+static void _log_record_add(gearmand_log_st *log, gearmand_log_ring_st *ring);
+
+/**
+ * Format and write all records in all rings.
+ */
+static void _log_drain(gearmand_st *gearmand);
+
+/**
+ * Format and write a single record.
+ */
+static void _log_write(gearmand_st *gearmand, gearmand_log_record_st *record);
+
+/**
+ * Writer thread main function.
+ */
+static void *_log_thread(void *data);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+gearman_return_t gearmand_log_start(gearmand_st *gearmand)
+{
+  gearmand_log_st *log= &(gearmand->log);
+  int pthread_ret;
+
+  if (log->ring_size == 0 || log->started || gearmand->log_fn == NULL)
+    return GEARMAN_SUCCESS;
+
+  pthread_ret= pthread_key_create(&(log->key), NULL);
+  if (pthread_ret != 0)
+  {
+    GEARMAN_FATAL(gearmand, "gearmand_log_start:pthread_key_create:%d",
+                  pthread_ret)
+    return GEARMAN_PTHREAD;
+  }
+
+  pthread_ret= pthread_mutex_init(&(log->lock), NULL);
+  if (pthread_ret != 0)
+  {
+    (void) pthread_key_delete(log->key);
+    GEARMAN_FATAL(gearmand, "gearmand_log_start:pthread_mutex_init:%d",
+                  pthread_ret)
+    return GEARMAN_PTHREAD;
+  }
+
+  pthread_ret= pthread_cond_init(&(log->cond), NULL);
+  if (pthread_ret != 0)
+  {
+    (void) pthread_mutex_destroy(&(log->lock));
+    (void) pthread_key_delete(log->key);
+    GEARMAN_FATAL(gearmand, "gearmand_log_start:pthread_cond_init:%d",
+                  pthread_ret)
+    return GEARMAN_PTHREAD;
+  }
+
+  log->shutdown= false;
+
+  pthread_ret= pthread_create(&(log->id), NULL, _log_thread, gearmand);
+  if (pthread_ret != 0)
+  {
+    (void) pthread_cond_destroy(&(log->cond));
+    (void) pthread_mutex_destroy(&(log->lock));
+    (void) pthread_key_delete(log->key);
+    GEARMAN_FATAL(gearmand, "gearmand_log_start:pthread_create:%d",
+                  pthread_ret)
+    return GEARMAN_PTHREAD;
+  }
+
+  /* No other threads are running yet, so the callback can be switched over
+     without anyone seeing it change. */
+  log->write_fn= gearmand->log_fn;
+  log->write_fn_arg= gearmand->log_fn_arg;
+  gearmand->log_fn= _log_push;
+  gearmand->log_fn_arg= NULL;
+  log->started= true;
+
+  GEARMAN_INFO(gearmand, "Logging through %u record rings", log->ring_size)
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearmand_log_stop(gearmand_st *gearmand)
+{
+  gearmand_log_st *log= &(gearmand->log);
+  gearmand_log_ring_st *ring;
+
+  if (!(log->started))
+    return;
+
+  (void) pthread_mutex_lock(&(log->lock));
+  log->shutdown= true;
+  (void) pthread_cond_signal(&(log->cond));
+  (void) pthread_mutex_unlock(&(log->lock));
+
+  /* The writer drains all rings one last time before it exits. */
+  (void) pthread_join(log->id, NULL);
+
+  gearmand->log_fn= log->write_fn;
+  gearmand->log_fn_arg= log->write_fn_arg;
+  log->started= false;
+
+  while (log->ring_list != NULL)
+  {
+    ring= log->ring_list;
+    log->ring_list= ring->next;
+    free(ring->record_list);
+    free(ring);
+  }
+
+  (void) pthread_cond_destroy(&(log->cond));
+  (void) pthread_mutex_destroy(&(log->lock));
+  (void) pthread_key_delete(log->key);
+}
+
+void gearmand_log_line(gearmand_st *gearmand, gearman_verbose_t verbose,
+                       uint32_t thread, const char *line)
+{
+  gearmand_log_st *log= &(gearmand->log);
+  gearmand_log_ring_st *ring;
+  gearmand_log_record_st *record;
+  char buffer[GEARMAN_MAX_ERROR_SIZE];
+
+  ring= _log_ring(log);
+  if (ring == NULL)
+  {
+    /* Without a ring, fall back to writing the line from this thread. */
+    if (thread != GEARMAND_LOG_THREAD_NONE)
+    {
+      snprintf(buffer, GEARMAN_MAX_ERROR_SIZE, "[%4u] %s", thread, line);
+      line= buffer;
+    }
+
+    (*log->write_fn)(gearmand, verbose, line, log->write_fn_arg);
+    return;
+  }
+
+  record= _log_record(log, ring);
+  if (record == NULL)
+    return;
+
+  record->type= GEARMAND_LOG_RECORD_LINE;
+  record->verbose= verbose;
+  record->thread= thread;
+  strncpy(record->data.line, line, GEARMAN_MAX_ERROR_SIZE);
+  record->data.line[GEARMAN_MAX_ERROR_SIZE - 1]= 0;
+
+  _log_record_add(log, ring);
+}
+
+void gearmand_log_packet(gearmand_st *gearmand, uint32_t thread,
+                         const char *host, const char *port,
+                         gearman_command_t command, bool sent)
+{
+  gearmand_log_st *log= &(gearmand->log);
+  gearmand_log_ring_st *ring;
+  gearmand_log_record_st *record;
+  gearmand_log_record_st fallback;
+
+  ring= _log_ring(log);
+  if (ring == NULL)
+    record= &fallback;
+  else
+  {
+    record= _log_record(log, ring);
+    if (record == NULL)
+      return;
+  }
+
+  record->type= sent ? GEARMAND_LOG_RECORD_SENT : GEARMAND_LOG_RECORD_RECEIVED;
+  record->verbose= GEARMAN_VERBOSE_DEBUG;
+  record->thread= thread;
+  record->command= command;
+  strncpy(record->data.con.host, host == NULL ? "-" : host, NI_MAXHOST);
+  record->data.con.host[NI_MAXHOST - 1]= 0;
+  strncpy(record->data.con.port, port == NULL ? "-" : port, NI_MAXSERV);
+  record->data.con.port[NI_MAXSERV - 1]= 0;
+
+  if (ring == NULL)
+    _log_write(gearmand, record);
+  else
+    _log_record_add(log, ring);
+}
+
+/*
+ * Private definitions
+ */
+
+static void _log_push(gearmand_st *gearmand, gearman_verbose_t verbose,
+                      const char *line, void *fn_arg __attribute__ ((unused)))
+{
+  gearmand_log_line(gearmand, verbose, GEARMAND_LOG_THREAD_NONE, line);
+}
+
+static gearmand_log_ring_st *_log_ring(gearmand_log_st *log)
+{
+  gearmand_log_ring_st *ring;
+
+  ring= pthread_getspecific(log->key);
+  if (ring != NULL)
+    return ring;
+
+  ring= malloc(sizeof(gearmand_log_ring_st));
+  if (ring == NULL)
+    return NULL;
+
+  ring->record_list= malloc(sizeof(gearmand_log_record_st) * log->ring_size);
+  if (ring->record_list == NULL)
+  {
+    free(ring);
+    return NULL;
+  }
+
+  if (pthread_setspecific(log->key, ring) != 0)
+  {
+    free(ring->record_list);
+    free(ring);
+    return NULL;
+  }
+
+  ring->head= 0;
+  ring->tail= 0;
+  ring->dropped= 0;
+  ring->dropped_reported= 0;
+
+  (void) pthread_mutex_lock(&(log->lock));
+  ring->next= log->ring_list;
+  log->ring_list= ring;
+  (void) pthread_mutex_unlock(&(log->lock));
+
+  return ring;
+}
+
+static gearmand_log_record_st *_log_record(gearmand_log_st *log,
+                                           gearmand_log_ring_st *ring)
+{
+  if (ring->head - ring->tail >= log->ring_size)
+  {
+    /* Only this thread writes the count, the writer just reads it. */
+    ring->dropped++;
+    return NULL;
+  }
+
+  return &(ring->record_list[ring->head & (log->ring_size - 1)]);
+}
+
+static void _log_record_add(gearmand_log_st *log, gearmand_log_ring_st *ring)
+{
+  uint32_t used;
+
+  /* The record must be complete before the writer can see it. */
+  __sync_synchronize();
+  ring->head++;
+
+  /* Wake the writer early once a ring is half full, instead of waiting for
+     its next poll. It may already be awake, in which case this is lost, but
+     it will get to the ring soon enough either way. */
+  used= ring->head - ring->tail;
+  if (used == log->ring_size / 2)
+    (void) pthread_cond_signal(&(log->cond));
+}
+
+static void _log_drain(gearmand_st *gearmand)
+{
+  gearmand_log_st *log= &(gearmand->log);
+  gearmand_log_ring_st *ring;
+  uint32_t head;
+  uint64_t dropped;
+  char buffer[GEARMAN_MAX_ERROR_SIZE];
+
+  /* Rings are only ever added to the front of the list, so once we have the
+     head the rest can be walked without the lock. */
+  (void) pthread_mutex_lock(&(log->lock));
+  ring= log->ring_list;
+  (void) pthread_mutex_unlock(&(log->lock));
+
+  for (; ring != NULL; ring= ring->next)
+  {
+    head= ring->head;
+    __sync_synchronize();
+
+    while (ring->tail != head)
+    {
+      _log_write(gearmand,
+                 &(ring->record_list[ring->tail & (log->ring_size - 1)]));
+
+      /* The record must be done with before the thread can reuse it. */
+      __sync_synchronize();
+      ring->tail++;
+    }
+
+    dropped= ring->dropped;
+    if (dropped != ring->dropped_reported &&
+        gearmand->verbose >= GEARMAN_VERBOSE_ERROR)
+    {
+      snprintf(buffer, GEARMAN_MAX_ERROR_SIZE,
+               "Dropped %" PRIu64 " log lines, log ring was full",
+               dropped - ring->dropped_reported);
+      (*log->write_fn)(gearmand, GEARMAN_VERBOSE_ERROR, buffer,
+                       log->write_fn_arg);
+    }
+    ring->dropped_reported= dropped;
+  }
+}
+
+static void _log_write(gearmand_st *gearmand, gearmand_log_record_st *record)
+{
+  gearmand_log_st *log= &(gearmand->log);
+  const char *line;
+  char buffer[GEARMAN_MAX_ERROR_SIZE];
+
+  if (record->type == GEARMAND_LOG_RECORD_LINE)
+  {
+    if (record->thread == GEARMAND_LOG_THREAD_NONE)
+      line= record->data.line;
+    else
+    {
+      /* Leave room for the widest thread number. */
+      snprintf(buffer, GEARMAN_MAX_ERROR_SIZE, "[%4u] %.*s", record->thread,
+               GEARMAN_MAX_ERROR_SIZE - 14, record->data.line);
+      line= buffer;
+    }
+  }
+  else
+  {
+    /* Connection hosts and ports are numeric, so these never cut them. */
+    snprintf(buffer, GEARMAN_MAX_ERROR_SIZE, "[%4u] %15.*s:%5.*s %s%s",
+             record->thread, INET6_ADDRSTRLEN, record->data.con.host,
+             NI_MAXSERV, record->data.con.port,
+             record->type == GEARMAND_LOG_RECORD_SENT ? "Sent      " :
+                                                        "Received  ",
+             gearman_command_info_list[record->command].name);
+    line= buffer;
+  }
+
+  (*log->write_fn)(gearmand, record->verbose, line, log->write_fn_arg);
+}
+
+static void *_log_thread(void *data)
+{
+  gearmand_st *gearmand= (gearmand_st *)data;
+  gearmand_log_st *log= &(gearmand->log);
+  struct timespec deadline;
+  struct timeval now;
+  bool shutdown;
+
+  do
+  {
+    (void) pthread_mutex_lock(&(log->lock));
+
+    if (!(log->shutdown))
+    {
+      (void) gettimeofday(&now, NULL);
+      now.tv_usec+= GEARMAND_LOG_WAIT * 1000;
+      deadline.tv_sec= now.tv_sec + now.tv_usec / 1000000;
+      deadline.tv_nsec= (now.tv_usec % 1000000) * 1000;
+      (void) pthread_cond_timedwait(&(log->cond), &(log->lock), &deadline);
+    }
+
+    shutdown= log->shutdown;
+    (void) pthread_mutex_unlock(&(log->lock));
+
+    _log_drain(gearmand);
+  }
+  while (!shutdown);
+
+  return NULL;
+}
@@ -0,0 +1,91 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Gearmand Asynchronous Logging Declarations
+ */
+
+#ifndef __GEARMAND_LOG_H__
+#define __GEARMAND_LOG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearmand_log Gearmand Asynchronous Logging
+ * @ingroup gearmand
+ * Moves calls to the gearmand log callback off the I/O and processing
+ * threads. Each thread that logs gets its own ring of records, which only it
+ * writes to and only the log writer thread reads from, so adding a line takes
+ * no locks. Packet debug lines are stored as the connection address and
+ * command, and are only formatted by the writer. When a ring is full, lines
+ * are dropped and counted, and the writer logs how many were lost. Lines from
+ * one thread stay in order, but lines from different threads may be written
+ * in a different order than they were logged.
+ * @{
+ */
+
+/**
+ * Start the log writer thread and send all further log lines through it.
+ * This is a no-op unless gearmand_set_log_ring was given a ring size, and is
+ * called by gearmand_run before any other threads are started.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_log_start(gearmand_st *gearmand);
+
+/**
+ * Write out everything left in the rings, stop the log writer thread, and go
+ * back to calling the log callback directly. This is called by gearmand_free
+ * once all other threads have exited.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ */
+GEARMAN_API
+void gearmand_log_stop(gearmand_st *gearmand);
+
+/**
+ * Add a line to the ring of the calling thread.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param verbose Verbosity level of the line.
+ * @param thread Number of the I/O thread to prefix the line with, or
+ *        GEARMAND_LOG_THREAD_NONE.
+ * @param line Line to log.
+ */
+GEARMAN_API
+void gearmand_log_line(gearmand_st *gearmand, gearman_verbose_t verbose,
+                       uint32_t thread, const char *line);
+
+/**
+ * Add a packet debug line to the ring of the calling thread. Only the
+ * arguments are copied, the line is formatted by the writer thread.
+ * @param gearmand Server instance structure previously initialized with
+ *        gearmand_create.
+ * @param thread Number of the I/O thread the packet went through.
+ * @param host Host of the connection, or NULL.
+ * @param port Port of the connection, or NULL.
+ * @param command Command of the packet.
+ * @param sent True if the packet was sent, false if it was received.
+ */
+GEARMAN_API
+void gearmand_log_packet(gearmand_st *gearmand, uint32_t thread,
+                         const char *host, const char *port,
+                         gearman_command_t command, bool sent);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAND_LOG_H__ */
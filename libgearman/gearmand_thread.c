@@ -26,7 +26,17 @@
 static void *_thread(void *data);
 static void _log(gearman_server_thread_st *thread, gearman_verbose_t verbose,
                  const char *line, void *arg);
+static void _log_packet(gearman_server_thread_st *thread,
+                        gearman_server_con_st *con, gearman_command_t command,
+                        bool sent, void *fn_arg);
 static void _run(gearman_server_thread_st *thread, void *fn_arg);
+static void _con_name(gearman_server_thread_st *thread,
+                      gearman_server_con_st *con);
+
+static gearman_return_t _listen_init(gearmand_thread_st *thread);
+static void _listen_close(gearmand_thread_st *thread);
+static void _listen_clear(gearmand_thread_st *thread);
+static void _listen_event(int fd, short events, void *arg);
 
 static gearman_return_t _wakeup_init(gearmand_thread_st *thread);
 static void _wakeup_close(gearmand_thread_st *thread);
@@ -34,6 +44,9 @@ static void _wakeup_clear(gearmand_thread_st *thread);
 static void _wakeup_event(int fd, short events, void *arg);
 static void _clear_events(gearmand_thread_st *thread);
 
+static void _balance(gearmand_thread_st *thread);
+static void _migrate(gearmand_thread_st *thread);
+
 /** @} */
 
 /*
@@ -64,26 +77,58 @@ gearman_return_t gearmand_thread_create(gearmand_st *gearmand)
 
   gearman_server_thread_set_log(&(thread->server_thread), _log, thread,
                                 gearmand->verbose);
+  if (gearmand->log.started)
+  {
+    gearman_server_thread_set_packet_log(&(thread->server_thread),
+                                         _log_packet);
+  }
   gearman_server_thread_set_event_watch(&(thread->server_thread),
                                         gearmand_con_watch, NULL);
+  gearman_server_thread_set_con_name(&(thread->server_thread), _con_name);
 
   thread->options= 0;
   thread->count= 0;
   thread->dcon_count= 0;
   thread->dcon_add_count= 0;
   thread->free_dcon_count= 0;
+  thread->listen_count= 0;
+  thread->wakeup_pending= 0;
   thread->wakeup_fd[0]= -1;
   thread->wakeup_fd[1]= -1;
+  thread->load= 0;
+  thread->load_last= 0;
+  thread->migrate_load= 0;
   GEARMAN_LIST_ADD(gearmand->thread, thread,)
   thread->gearmand= gearmand;
   thread->dcon_list= NULL;
   thread->dcon_add_list= NULL;
   thread->free_dcon_list= NULL;
+  thread->migrate_dcon= NULL;
+  thread->listen_fd= NULL;
+  thread->listen_port= NULL;
+  thread->listen_event= NULL;
+  thread->listen_uring_event= NULL;
+  thread->base= NULL;
 
   /* If we have no threads, we still create a fake thread that uses the main
-     libevent instance. Otherwise create a libevent instance for each thread. */
+     libevent instance. Otherwise create an event loop for each thread. */
   if (gearmand->threads == 0)
     thread->base= gearmand->base;
+  else if (gearmand->io_engine == GEARMAND_IO_ENGINE_IO_URING)
+  {
+    GEARMAN_INFO(gearmand, "Initializing io_uring for IO thread")
+
+    if (gearmand_uring_create(&(thread->uring), GEARMAND_URING_ENTRIES) ==
+        NULL)
+    {
+      GEARMAN_FATAL(gearmand, "gearmand_thread_create:gearmand_uring_create:%d",
+                    errno)
+      gearmand_thread_free(thread);
+      return GEARMAN_ERRNO;
+    }
+
+    thread->options|= GEARMAND_THREAD_URING;
+  }
   else
   {
     GEARMAN_INFO(gearmand, "Initializing libevent for IO thread")
@@ -121,6 +166,19 @@ gearman_return_t gearmand_thread_create(gearmand_st *gearmand)
   }
 
   thread->options|= GEARMAND_THREAD_LOCK;
+  gearman_server_lock_stats_init(&(gearmand->server), &(thread->lock_stats),
+                                 GEARMAN_SERVER_LOCK_GEARMAND_THREAD);
+
+  if (gearmand->options & GEARMAND_REUSEPORT)
+  {
+    ret= _listen_init(thread);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      thread->count= 0;
+      gearmand_thread_free(thread);
+      return ret;
+    }
+  }
 
   gearman_server_thread_set_run(&(thread->server_thread), _run, thread);
 
@@ -152,8 +210,13 @@ void gearmand_thread_free(gearmand_thread_st *thread)
   }
 
   if (thread->options & GEARMAND_THREAD_LOCK)
+  {
+    gearman_server_lock_stats_free(&(thread->gearmand->server),
+                                   &(thread->lock_stats));
     (void) pthread_mutex_destroy(&(thread->lock));
+  }
 
+  _listen_close(thread);
   _wakeup_close(thread);
 
   while (thread->dcon_list != NULL)
@@ -174,6 +237,15 @@ void gearmand_thread_free(gearmand_thread_st *thread)
     free(dcon);
   }
 
+  if (thread->listen_fd != NULL)
+    free(thread->listen_fd);
+  if (thread->listen_port != NULL)
+    free(thread->listen_port);
+  if (thread->listen_event != NULL)
+    free(thread->listen_event);
+  if (thread->listen_uring_event != NULL)
+    free(thread->listen_uring_event);
+
   gearman_server_thread_free(&(thread->server_thread));
 
   GEARMAN_LIST_DEL(thread->gearmand->thread, thread,)
@@ -182,6 +254,8 @@ void gearmand_thread_free(gearmand_thread_st *thread)
   {
     if (thread->base != NULL)
       event_base_free(thread->base);
+    if (thread->options & GEARMAND_THREAD_URING)
+      gearmand_uring_free(&(thread->uring));
 
     GEARMAN_INFO(thread->gearmand, "Thread %u shutdown complete", thread->count)
   }
@@ -192,11 +266,19 @@ void gearmand_thread_free(gearmand_thread_st *thread)
 void gearmand_thread_wakeup(gearmand_thread_st *thread,
                             gearmand_wakeup_t wakeup)
 {
-  uint8_t buffer= wakeup;
-
-  /* If this fails, there is not much we can really do. This should never fail
-     though if the thread is still active. */
-  if (write(thread->wakeup_fd[1], &buffer, 1) != 1)
+  uint64_t value= 1;
+
+  /* Wakeups are pending bits, and the thread takes them all each time it
+     wakes. Only signal it when nothing was pending yet, so a stream of RUN
+     wakeups from a busy processing thread costs one write and one read. */
+  if (__sync_fetch_and_or(&(thread->wakeup_pending), (uint32_t)wakeup) != 0)
+    return;
+
+  /* An eventfd needs a full 8 byte counter value, and a pipe only cares that
+     something arrived, so the same write works for both. If this fails, there
+     is not much we can really do. This should never fail though if the thread
+     is still active. */
+  if (write(thread->wakeup_fd[1], &value, sizeof(value)) != sizeof(value))
     GEARMAN_ERROR(thread->gearmand, "gearmand_thread_wakeup:write:%d", errno)
 }
 
@@ -212,6 +294,11 @@ void gearmand_thread_run(gearmand_thread_st *thread)
     if (ret == GEARMAN_SUCCESS || ret == GEARMAN_IO_WAIT ||
         ret == GEARMAN_SHUTDOWN_GRACEFUL)
     { 
+      /* Everything ready has been read and flushed, so this is when the
+         connection picked to move may have gone quiet. */
+      if (thread->migrate_dcon != NULL)
+        _migrate(thread);
+
       return;
     }
 
@@ -226,7 +313,7 @@ void gearmand_thread_run(gearmand_thread_st *thread)
     dcon= (gearmand_con_st *)gearman_server_con_data(server_con);
 
     GEARMAN_INFO(thread->gearmand, "[%4u] %15s:%5s Disconnected", thread->count,
-                 dcon->host, dcon->port)
+                 gearmand_con_host(dcon), gearmand_con_port(dcon))
 
     gearmand_con_free(dcon);
   }
@@ -239,11 +326,37 @@ void gearmand_thread_run(gearmand_thread_st *thread)
 static void *_thread(void *data)
 {
   gearmand_thread_st *thread= (gearmand_thread_st *)data;
+  gearmand_st *gearmand= thread->gearmand;
+  uint32_t cpu;
+
+  if (gearmand->io_cpu_count > 0)
+  {
+    cpu= gearmand->io_cpu_list[(thread->count - 1) % gearmand->io_cpu_count];
+    if (gearman_server_thread_pin(&(thread->server_thread), cpu) ==
+        GEARMAN_SUCCESS)
+    {
+      GEARMAN_INFO(gearmand, "[%4u] Pinned to CPU %u", thread->count, cpu)
+    }
+    else
+    {
+      GEARMAN_ERROR(gearmand, "[%4u] Could not pin to CPU %u:%d",
+                    thread->count, cpu, errno)
+    }
+  }
 
   GEARMAN_INFO(thread->gearmand, "[%4u] Entering thread event loop",
                thread->count)
 
-  if (event_base_loop(thread->base, 0) == -1)
+  if (thread->options & GEARMAND_THREAD_URING)
+  {
+    if (gearmand_uring_loop(&(thread->uring)) != GEARMAN_SUCCESS)
+    {
+      GEARMAN_FATAL(thread->gearmand, "_io_thread:gearmand_uring_loop:%d",
+                    errno)
+      thread->gearmand->ret= GEARMAN_EVENT;
+    }
+  }
+  else if (event_base_loop(thread->base, 0) == -1)
   {
     GEARMAN_FATAL(thread->gearmand, "_io_thread:event_base_loop:-1")
     thread->gearmand->ret= GEARMAN_EVENT;
@@ -261,11 +374,39 @@ static void _log(gearman_server_thread_st *thread __attribute__ ((unused)),
   gearmand_thread_st *dthread= (gearmand_thread_st *)fn_arg;
   char buffer[GEARMAN_MAX_ERROR_SIZE];
 
+  /* The log writer thread adds the prefix itself. */
+  if (dthread->gearmand->log.started)
+  {
+    gearmand_log_line(dthread->gearmand, verbose, dthread->count, line);
+    return;
+  }
+
   snprintf(buffer, GEARMAN_MAX_ERROR_SIZE, "[%4u] %s", dthread->count, line);
   (*dthread->gearmand->log_fn)(dthread->gearmand, verbose, buffer,
                                dthread->gearmand->log_fn_arg);
 }
 
+static void _log_packet(gearman_server_thread_st *thread
+                        __attribute__ ((unused)),
+                        gearman_server_con_st *con, gearman_command_t command,
+                        bool sent, void *fn_arg)
+{
+  gearmand_thread_st *dthread= (gearmand_thread_st *)fn_arg;
+  gearmand_log_packet(dthread->gearmand, dthread->count,
+                      gearman_server_con_host(con),
+                      gearman_server_con_port(con), command, sent);
+}
+
+static void _con_name(gearman_server_thread_st *thread
+                      __attribute__ ((unused)),
+                      gearman_server_con_st *con)
+{
+  gearmand_con_st *dcon= (gearmand_con_st *)gearman_server_con_data(con);
+
+  if (dcon != NULL)
+    (void)gearmand_con_host(dcon);
+}
+
 static void _run(gearman_server_thread_st *thread __attribute__ ((unused)),
                  void *fn_arg)
 {
@@ -273,10 +414,191 @@ static void _run(gearman_server_thread_st *thread __attribute__ ((unused)),
   gearmand_thread_wakeup(dthread, GEARMAND_WAKEUP_RUN);
 }
 
+static gearman_return_t _listen_init(gearmand_thread_st *thread)
+{
+  gearmand_port_st *port;
+  gearmand_port_st **port_list;
+  gearman_return_t ret;
+  uint32_t count;
+  uint32_t x;
+  uint32_t y;
+
+  for (x= 0; x < thread->gearmand->port_count; x++)
+  {
+    port= &(thread->gearmand->port_list[x]);
+    count= thread->listen_count;
+
+    /* Unix socket paths are only listened on by the main thread. */
+    if (port->path != NULL)
+      continue;
+
+    ret= gearmand_port_listen(port, &(thread->listen_fd),
+                              &(thread->listen_count));
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    port_list= realloc(thread->listen_port,
+                       sizeof(gearmand_port_st *) * thread->listen_count);
+    if (port_list == NULL)
+    {
+      GEARMAN_FATAL(thread->gearmand, "_listen_init:realloc:%d", errno)
+      return GEARMAN_ERRNO;
+    }
+
+    thread->listen_port= port_list;
+    for (y= count; y < thread->listen_count; y++)
+      thread->listen_port[y]= port;
+  }
+
+  if (thread->options & GEARMAND_THREAD_URING)
+  {
+    thread->listen_uring_event= malloc(sizeof(gearmand_uring_event_st) *
+                                       thread->listen_count);
+    if (thread->listen_uring_event == NULL)
+    {
+      GEARMAN_FATAL(thread->gearmand, "_listen_init:malloc:%d", errno)
+      return GEARMAN_ERRNO;
+    }
+
+    for (x= 0; x < thread->listen_count; x++)
+    {
+      gearmand_uring_event_set(&(thread->listen_uring_event[x]),
+                               thread->listen_fd[x], _listen_event, thread);
+      ret= gearmand_uring_event_add(&(thread->uring),
+                                    &(thread->listen_uring_event[x]),
+                                    EV_READ);
+      if (ret != GEARMAN_SUCCESS)
+      {
+        for (y= 0; y < x; y++)
+        {
+          gearmand_uring_event_del(&(thread->uring),
+                                   &(thread->listen_uring_event[y]));
+        }
+        GEARMAN_FATAL(thread->gearmand,
+                      "_listen_init:gearmand_uring_event_add:%d", ret)
+        return ret;
+      }
+    }
+
+    thread->options|= GEARMAND_THREAD_LISTEN_EVENT;
+
+    return GEARMAN_SUCCESS;
+  }
+
+  thread->listen_event= malloc(sizeof(struct event) * thread->listen_count);
+  if (thread->listen_event == NULL)
+  {
+    GEARMAN_FATAL(thread->gearmand, "_listen_init:malloc:%d", errno)
+    return GEARMAN_ERRNO;
+  }
+
+  for (x= 0; x < thread->listen_count; x++)
+  {
+    event_set(&(thread->listen_event[x]), thread->listen_fd[x],
+              EV_READ | EV_PERSIST, _listen_event, thread);
+    event_base_set(thread->base, &(thread->listen_event[x]));
+
+    if (event_add(&(thread->listen_event[x]), NULL) == -1)
+    {
+      for (y= 0; y < x; y++)
+        assert(event_del(&(thread->listen_event[y])) == 0);
+      GEARMAN_FATAL(thread->gearmand, "_listen_init:event_add:-1")
+      return GEARMAN_EVENT;
+    }
+  }
+
+  thread->options|= GEARMAND_THREAD_LISTEN_EVENT;
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _listen_close(gearmand_thread_st *thread)
+{
+  uint32_t x;
+
+  _listen_clear(thread);
+
+  for (x= 0; x < thread->listen_count; x++)
+  {
+    if (thread->listen_fd[x] >= 0)
+    {
+      GEARMAN_INFO(thread->gearmand, "[%4u] Closing listening socket (%d)",
+                   thread->count, thread->listen_fd[x])
+      close(thread->listen_fd[x]);
+      thread->listen_fd[x]= -1;
+    }
+  }
+}
+
+static void _listen_clear(gearmand_thread_st *thread)
+{
+  uint32_t x;
+
+  if (!(thread->options & GEARMAND_THREAD_LISTEN_EVENT))
+    return;
+
+  for (x= 0; x < thread->listen_count; x++)
+  {
+    GEARMAN_INFO(thread->gearmand,
+                 "[%4u] Clearing event for listening socket (%d)",
+                 thread->count, thread->listen_fd[x])
+    if (thread->options & GEARMAND_THREAD_URING)
+    {
+      gearmand_uring_event_del(&(thread->uring),
+                               &(thread->listen_uring_event[x]));
+    }
+    else
+      assert(event_del(&(thread->listen_event[x])) == 0);
+  }
+
+  thread->options&= (gearmand_thread_options_t)~GEARMAND_THREAD_LISTEN_EVENT;
+}
+
+static void _listen_event(int fd, short events __attribute__ ((unused)),
+                          void *arg)
+{
+  gearmand_thread_st *thread= (gearmand_thread_st *)arg;
+  gearmand_port_st *port= NULL;
+  uint32_t x;
+
+  for (x= 0; x < thread->listen_count; x++)
+  {
+    if (thread->listen_fd[x] == fd)
+    {
+      port= thread->listen_port[x];
+      break;
+    }
+  }
+
+  assert(port != NULL);
+
+  if (gearmand_con_accept(thread->gearmand, thread, port, fd) !=
+      GEARMAN_SUCCESS)
+  {
+    thread->gearmand->ret= GEARMAN_ERRNO;
+    gearmand_wakeup(thread->gearmand, GEARMAND_WAKEUP_SHUTDOWN);
+  }
+}
+
 static gearman_return_t _wakeup_init(gearmand_thread_st *thread)
 {
   int ret;
+  gearman_return_t event_ret;
+
+#ifdef HAVE_SYS_EVENTFD_H
+  GEARMAN_INFO(thread->gearmand, "Creating IO thread wakeup eventfd")
+
+  /* One descriptor serves as both ends, which the close code checks for. */
+  ret= eventfd(0, EFD_NONBLOCK);
+  if (ret == -1)
+  {
+    GEARMAN_FATAL(thread->gearmand, "_wakeup_init:eventfd:%d", errno)
+    return GEARMAN_ERRNO;
+  }
 
+  thread->wakeup_fd[0]= ret;
+  thread->wakeup_fd[1]= ret;
+#else
   GEARMAN_INFO(thread->gearmand, "Creating IO thread wakeup pipe")
 
   ret= pipe(thread->wakeup_fd);
@@ -299,15 +621,32 @@ static gearman_return_t _wakeup_init(gearmand_thread_st *thread)
     GEARMAN_FATAL(thread->gearmand, "_wakeup_init:fcntl:F_SETFL:%d", errno)
     return GEARMAN_ERRNO;
   }
+#endif
 
-  event_set(&(thread->wakeup_event), thread->wakeup_fd[0], EV_READ | EV_PERSIST,
-            _wakeup_event, thread);
-  event_base_set(thread->base, &(thread->wakeup_event));
-
-  if (event_add(&(thread->wakeup_event), NULL) == -1)
+  if (thread->options & GEARMAND_THREAD_URING)
+  {
+    gearmand_uring_event_set(&(thread->wakeup_uring_event),
+                             thread->wakeup_fd[0], _wakeup_event, thread);
+    event_ret= gearmand_uring_event_add(&(thread->uring),
+                                        &(thread->wakeup_uring_event), EV_READ);
+    if (event_ret != GEARMAN_SUCCESS)
+    {
+      GEARMAN_FATAL(thread->gearmand,
+                    "_wakeup_init:gearmand_uring_event_add:%d", event_ret)
+      return event_ret;
+    }
+  }
+  else
   {
-    GEARMAN_FATAL(thread->gearmand, "_wakeup_init:event_add:-1")
-    return GEARMAN_EVENT;
+    event_set(&(thread->wakeup_event), thread->wakeup_fd[0],
+              EV_READ | EV_PERSIST, _wakeup_event, thread);
+    event_base_set(thread->base, &(thread->wakeup_event));
+
+    if (event_add(&(thread->wakeup_event), NULL) == -1)
+    {
+      GEARMAN_FATAL(thread->gearmand, "_wakeup_init:event_add:-1")
+      return GEARMAN_EVENT;
+    }
   }
 
   thread->options|= GEARMAND_THREAD_WAKEUP_EVENT;
@@ -323,8 +662,9 @@ static void _wakeup_close(gearmand_thread_st *thread)
   {
     GEARMAN_INFO(thread->gearmand, "Closing IO thread wakeup pipe")
     close(thread->wakeup_fd[0]);
+    if (thread->wakeup_fd[1] != thread->wakeup_fd[0])
+      close(thread->wakeup_fd[1]);
     thread->wakeup_fd[0]= -1;
-    close(thread->wakeup_fd[1]);
     thread->wakeup_fd[1]= -1;
   }
 }
@@ -336,7 +676,13 @@ static void _wakeup_clear(gearmand_thread_st *thread)
     GEARMAN_INFO(thread->gearmand,
                  "[%4u] Clearing event for IO thread wakeup pipe",
                  thread->count)
-    assert(event_del(&(thread->wakeup_event)) == 0);
+    if (thread->options & GEARMAND_THREAD_URING)
+    {
+      gearmand_uring_event_del(&(thread->uring),
+                               &(thread->wakeup_uring_event));
+    }
+    else
+      assert(event_del(&(thread->wakeup_event)) == 0);
     thread->options&= (gearmand_thread_options_t)~GEARMAND_THREAD_WAKEUP_EVENT;
   }
 }
@@ -347,7 +693,7 @@ static void _wakeup_event(int fd, short events __attribute__ ((unused)),
   gearmand_thread_st *thread= (gearmand_thread_st *)arg;
   uint8_t buffer[GEARMAN_PIPE_BUFFER_SIZE];
   ssize_t ret;
-  ssize_t x;
+  uint32_t wakeup;
 
   while (1)
   {
@@ -372,61 +718,127 @@ static void _wakeup_event(int fd, short events __attribute__ ((unused)),
       thread->gearmand->ret= GEARMAN_ERRNO;
       return;
     }
+  }
 
-    for (x= 0; x < ret; x++)
-    {
-      switch ((gearmand_wakeup_t)buffer[x])
-      {
-      case GEARMAND_WAKEUP_PAUSE:
-        GEARMAN_INFO(thread->gearmand, "[%4u] Received PAUSE wakeup event",
-                     thread->count)
-        break;
+  /* Take everything pending only after draining, since a wakeup set after
+     this point will signal again. Handle the ones that stop the thread last. */
+  wakeup= __sync_fetch_and_and(&(thread->wakeup_pending), 0);
 
-      case GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL:
-        GEARMAN_INFO(thread->gearmand,
-                     "[%4u] Received SHUTDOWN_GRACEFUL wakeup event",
-                     thread->count)
-        if (gearman_server_shutdown_graceful(&(thread->gearmand->server)) ==
-            GEARMAN_SHUTDOWN)
-        {
-          gearmand_wakeup(thread->gearmand, GEARMAND_WAKEUP_SHUTDOWN);
-        }
-        break;
+  if (wakeup & GEARMAND_WAKEUP_CON)
+  {
+    GEARMAN_INFO(thread->gearmand, "[%4u] Received CON wakeup event",
+                 thread->count)
+    gearmand_con_check_queue(thread);
+  }
 
-      case GEARMAND_WAKEUP_SHUTDOWN:
-        GEARMAN_INFO(thread->gearmand, "[%4u] Received SHUTDOWN wakeup event",
-                     thread->count)
-        _clear_events(thread);
-        break;
+  if (wakeup & GEARMAND_WAKEUP_RUN)
+  {
+    GEARMAN_DEBUG(thread->gearmand, "[%4u] Received RUN wakeup event",
+                  thread->count)
+    thread->server_thread.wakeups_received++;
+    gearmand_thread_run(thread);
+  }
 
-      case GEARMAND_WAKEUP_CON:
-        GEARMAN_INFO(thread->gearmand, "[%4u] Received CON wakeup event",
-                     thread->count)
-        gearmand_con_check_queue(thread);
-        break;
+  if (wakeup & GEARMAND_WAKEUP_BALANCE)
+  {
+    GEARMAN_DEBUG(thread->gearmand, "[%4u] Received BALANCE wakeup event",
+                  thread->count)
+    _balance(thread);
+  }
 
-      case GEARMAND_WAKEUP_RUN:
-        GEARMAN_DEBUG(thread->gearmand, "[%4u] Received RUN wakeup event",
-                      thread->count)
-        gearmand_thread_run(thread);
-        break;
+  if (wakeup & GEARMAND_WAKEUP_PAUSE)
+  {
+    GEARMAN_INFO(thread->gearmand, "[%4u] Received PAUSE wakeup event",
+                 thread->count)
+  }
 
-      default:
-        GEARMAN_FATAL(thread->gearmand,
-                     "[%4u] Received unknown wakeup event (%u)", thread->count,
-                     buffer[x])
-        _clear_events(thread);
-        thread->gearmand->ret= GEARMAN_UNKNOWN_STATE;
-        break;
-      }
+  if (wakeup & GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL)
+  {
+    GEARMAN_INFO(thread->gearmand,
+                 "[%4u] Received SHUTDOWN_GRACEFUL wakeup event",
+                 thread->count)
+    _listen_close(thread);
+    if (gearman_server_shutdown_graceful(&(thread->gearmand->server)) ==
+        GEARMAN_SHUTDOWN)
+    {
+      gearmand_wakeup(thread->gearmand, GEARMAND_WAKEUP_SHUTDOWN);
     }
   }
+
+  if (wakeup & GEARMAND_WAKEUP_SHUTDOWN)
+  {
+    GEARMAN_INFO(thread->gearmand, "[%4u] Received SHUTDOWN wakeup event",
+                 thread->count)
+    _clear_events(thread);
+  }
+
+  wakeup&= (uint32_t)~(GEARMAND_WAKEUP_PAUSE | GEARMAND_WAKEUP_SHUTDOWN |
+                       GEARMAND_WAKEUP_SHUTDOWN_GRACEFUL |
+                       GEARMAND_WAKEUP_CON | GEARMAND_WAKEUP_RUN |
+                       GEARMAND_WAKEUP_BALANCE);
+  if (wakeup != 0)
+  {
+    GEARMAN_FATAL(thread->gearmand, "[%4u] Received unknown wakeup event (%u)",
+                  thread->count, wakeup)
+    _clear_events(thread);
+    thread->gearmand->ret= GEARMAN_UNKNOWN_STATE;
+  }
 }
 
 static void _clear_events(gearmand_thread_st *thread)
 {
+  _listen_clear(thread);
   _wakeup_clear(thread);
 
   while (thread->dcon_list != NULL)
     gearmand_con_free(thread->dcon_list);
 }
+
+static void _balance(gearmand_thread_st *thread)
+{
+  gearmand_con_st *dcon;
+  gearmand_con_st *best= NULL;
+  uint64_t limit;
+  uint64_t load;
+  uint64_t off;
+  uint64_t best_off= 0;
+
+  /* The main thread sets how far ahead of the idlest thread this one is.
+     Moving any connection with less load than that evens them out some, and
+     the one closest to half of it evens them out the most. Connections with
+     protocol state of their own stay where they are. */
+  limit= __sync_lock_test_and_set(&(thread->migrate_load), 0);
+  thread->migrate_dcon= NULL;
+
+  for (dcon= thread->dcon_list; dcon != NULL; dcon= dcon->next)
+  {
+    load= dcon->server_con->load_count;
+    dcon->server_con->load_count= 0;
+
+    if (load == 0 || load >= limit || dcon->add_fn != NULL)
+      continue;
+
+    off= load > limit / 2 ? load - limit / 2 : limit / 2 - load;
+    if (best == NULL || off < best_off)
+    {
+      best= dcon;
+      best_off= off;
+    }
+  }
+
+  thread->migrate_dcon= best;
+  if (best != NULL)
+    _migrate(thread);
+}
+
+static void _migrate(gearmand_thread_st *thread)
+{
+  gearmand_con_st *dcon= thread->migrate_dcon;
+
+  /* Try again after the next run, until the next balance picks again. */
+  if (!gearman_server_con_quiescent(dcon->server_con))
+    return;
+
+  thread->migrate_dcon= NULL;
+  gearmand_con_migrate(dcon);
+}
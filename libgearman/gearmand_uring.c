@@ -0,0 +1,486 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Gearmand io_uring Definitions
+ */
+
+#include "common.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearmand_uring_private Private Gearmand io_uring Functions
+ * @ingroup gearmand_uring
+ * @{
+ */
+
+/**
+ * User data for poll remove requests, whose completions are ignored.
+ */
+#define GEARMAND_URING_REMOVE UINT64_MAX
+
+/**
+ * Submit queued requests, optionally waiting for at least one completion.
+ */
+static int _uring_enter(gearmand_uring_st *uring, uint32_t wait);
+
+/**
+ * Get the next free submission queue entry, submitting if the queue is full.
+ */
+static struct io_uring_sqe *_uring_sqe(gearmand_uring_st *uring);
+
+/**
+ * Make a submission queue entry filled in by the caller visible to the kernel.
+ */
+static void _uring_sqe_queue(gearmand_uring_st *uring);
+
+/**
+ * Queue a poll request for the events an event is watching.
+ */
+static gearman_return_t _uring_arm(gearmand_uring_st *uring,
+                                   gearmand_uring_event_st *event);
+
+/**
+ * Detach an event from its pending poll request and queue a remove for it.
+ */
+static void _uring_cancel(gearmand_uring_st *uring,
+                          gearmand_uring_event_st *event);
+
+/**
+ * Run callbacks for all completions.
+ */
+static gearman_return_t _uring_reap(gearmand_uring_st *uring);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+gearmand_uring_st *gearmand_uring_create(gearmand_uring_st *uring,
+                                         uint32_t entries)
+{
+  struct io_uring_params params;
+  long ret;
+  int err;
+
+  memset(&params, 0, sizeof(params));
+  memset(uring, 0, sizeof(gearmand_uring_st));
+  uring->fd= -1;
+  uring->slot_free= GEARMAND_URING_SLOT_NONE;
+
+  ret= syscall(__NR_io_uring_setup, entries, &params);
+  if (ret == -1)
+    return NULL;
+
+  uring->fd= (int)ret;
+  uring->sq_entries= params.sq_entries;
+
+  uring->sq_ring_size= params.sq_off.array +
+                       (params.sq_entries * sizeof(uint32_t));
+  uring->sq_ring= mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd,
+                       IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED)
+  {
+    err= errno;
+    uring->sq_ring= NULL;
+    gearmand_uring_free(uring);
+    errno= err;
+    return NULL;
+  }
+
+  uring->cq_ring_size= params.cq_off.cqes +
+                       (params.cq_entries * sizeof(struct io_uring_cqe));
+  uring->cq_ring= mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd,
+                       IORING_OFF_CQ_RING);
+  if (uring->cq_ring == MAP_FAILED)
+  {
+    err= errno;
+    uring->cq_ring= NULL;
+    gearmand_uring_free(uring);
+    errno= err;
+    return NULL;
+  }
+
+  uring->sqe_size= params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqe_list= mmap(NULL, uring->sqe_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, uring->fd,
+                        IORING_OFF_SQES);
+  if (uring->sqe_list == MAP_FAILED)
+  {
+    err= errno;
+    uring->sqe_list= NULL;
+    gearmand_uring_free(uring);
+    errno= err;
+    return NULL;
+  }
+
+  uring->sq_tail= (uint32_t *)((uint8_t *)uring->sq_ring +
+                               params.sq_off.tail);
+  uring->sq_mask= (uint32_t *)((uint8_t *)uring->sq_ring +
+                               params.sq_off.ring_mask);
+  uring->sq_array= (uint32_t *)((uint8_t *)uring->sq_ring +
+                                params.sq_off.array);
+  uring->cq_head= (uint32_t *)((uint8_t *)uring->cq_ring +
+                               params.cq_off.head);
+  uring->cq_tail= (uint32_t *)((uint8_t *)uring->cq_ring +
+                               params.cq_off.tail);
+  uring->cq_mask= (uint32_t *)((uint8_t *)uring->cq_ring +
+                               params.cq_off.ring_mask);
+  uring->cqe_list= (struct io_uring_cqe *)((uint8_t *)uring->cq_ring +
+                                           params.cq_off.cqes);
+
+  return uring;
+}
+
+void gearmand_uring_free(gearmand_uring_st *uring)
+{
+  /* Closing the ring cancels anything still pending in it. */
+  if (uring->sqe_list != NULL)
+    (void) munmap(uring->sqe_list, uring->sqe_size);
+  if (uring->cq_ring != NULL)
+    (void) munmap(uring->cq_ring, uring->cq_ring_size);
+  if (uring->sq_ring != NULL)
+    (void) munmap(uring->sq_ring, uring->sq_ring_size);
+  if (uring->fd != -1)
+    close(uring->fd);
+
+  if (uring->slot_event != NULL)
+    free(uring->slot_event);
+  if (uring->slot_next != NULL)
+    free(uring->slot_next);
+
+  memset(uring, 0, sizeof(gearmand_uring_st));
+  uring->fd= -1;
+}
+
+void gearmand_uring_event_set(gearmand_uring_event_st *event, int fd,
+                              gearmand_uring_event_fn *fn, void *arg)
+{
+  event->events= 0;
+  event->fd= fd;
+  event->slot= GEARMAND_URING_SLOT_NONE;
+  event->fn= fn;
+  event->arg= arg;
+}
+
+gearman_return_t gearmand_uring_event_add(gearmand_uring_st *uring,
+                                          gearmand_uring_event_st *event,
+                                          short events)
+{
+  if (event->events == 0)
+    uring->watch_count++;
+  else if (event->events == events)
+    return GEARMAN_SUCCESS;
+
+  /* A poll request can't be changed in place, so replace it. */
+  if (event->slot != GEARMAND_URING_SLOT_NONE)
+    _uring_cancel(uring, event);
+
+  event->events= events;
+
+  return _uring_arm(uring, event);
+}
+
+void gearmand_uring_event_del(gearmand_uring_st *uring,
+                              gearmand_uring_event_st *event)
+{
+  if (event->events == 0)
+    return;
+
+  uring->watch_count--;
+  event->events= 0;
+
+  if (event->slot != GEARMAND_URING_SLOT_NONE)
+    _uring_cancel(uring, event);
+}
+
+gearman_return_t gearmand_uring_loop(gearmand_uring_st *uring)
+{
+  gearman_return_t ret;
+
+  while (uring->watch_count > 0)
+  {
+    if (_uring_enter(uring, 1) == -1)
+    {
+      /* A full completion queue only needs to be emptied to continue. */
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        return GEARMAN_ERRNO;
+    }
+
+    ret= _uring_reap(uring);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+/*
+ * Private definitions
+ */
+
+static int _uring_enter(gearmand_uring_st *uring, uint32_t wait)
+{
+  long ret;
+
+  ret= syscall(__NR_io_uring_enter, uring->fd, uring->sq_queued, wait,
+               wait == 0 ? 0 : IORING_ENTER_GETEVENTS, NULL, 0);
+  if (ret == -1)
+    return -1;
+
+  uring->sq_queued-= (uint32_t)ret;
+
+  return 0;
+}
+
+static struct io_uring_sqe *_uring_sqe(gearmand_uring_st *uring)
+{
+  struct io_uring_sqe *sqe;
+  uint32_t index;
+
+  while (uring->sq_queued == uring->sq_entries)
+  {
+    if (_uring_enter(uring, 0) == -1 && errno != EINTR)
+      return NULL;
+  }
+
+  index= *(uring->sq_tail) & *(uring->sq_mask);
+  uring->sq_array[index]= index;
+
+  sqe= &(uring->sqe_list[index]);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+  return sqe;
+}
+
+static void _uring_sqe_queue(gearmand_uring_st *uring)
+{
+  /* The entry must be complete before the kernel can see the new tail. */
+  __sync_synchronize();
+  *(uring->sq_tail)= *(uring->sq_tail) + 1;
+  uring->sq_queued++;
+}
+
+static gearman_return_t _uring_arm(gearmand_uring_st *uring,
+                                   gearmand_uring_event_st *event)
+{
+  gearmand_uring_event_st **slot_event;
+  struct io_uring_sqe *sqe;
+  uint32_t *slot_next;
+  uint32_t slot_size;
+  uint32_t slot;
+
+  /* Requests refer to a slot rather than the event, since an event may be
+     freed while its request is still pending. */
+  if (uring->slot_free == GEARMAND_URING_SLOT_NONE)
+  {
+    slot_size= uring->slot_size == 0 ? uring->sq_entries :
+               uring->slot_size * 2;
+
+    slot_event= realloc(uring->slot_event,
+                        sizeof(gearmand_uring_event_st *) * slot_size);
+    if (slot_event == NULL)
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+    uring->slot_event= slot_event;
+
+    slot_next= realloc(uring->slot_next, sizeof(uint32_t) * slot_size);
+    if (slot_next == NULL)
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+    uring->slot_next= slot_next;
+
+    for (slot= uring->slot_size; slot < slot_size; slot++)
+    {
+      uring->slot_next[slot]= uring->slot_free;
+      uring->slot_free= slot;
+    }
+
+    uring->slot_size= slot_size;
+  }
+
+  sqe= _uring_sqe(uring);
+  if (sqe == NULL)
+    return GEARMAN_ERRNO;
+
+  slot= uring->slot_free;
+  uring->slot_free= uring->slot_next[slot];
+  uring->slot_event[slot]= event;
+  event->slot= slot;
+
+  sqe->opcode= IORING_OP_POLL_ADD;
+  sqe->fd= event->fd;
+  if (event->events & EV_READ)
+    sqe->poll_events|= POLLIN;
+  if (event->events & EV_WRITE)
+    sqe->poll_events|= POLLOUT;
+  sqe->user_data= slot;
+
+  _uring_sqe_queue(uring);
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _uring_cancel(gearmand_uring_st *uring,
+                          gearmand_uring_event_st *event)
+{
+  struct io_uring_sqe *sqe;
+
+  /* The slot is only released when the original request completes. */
+  uring->slot_event[event->slot]= NULL;
+
+  /* The request holds a reference to the file, so if the remove can't be
+     queued the descriptor stays open until the request completes. */
+  sqe= _uring_sqe(uring);
+  if (sqe != NULL)
+  {
+    sqe->opcode= IORING_OP_POLL_REMOVE;
+    sqe->fd= -1;
+    sqe->addr= event->slot;
+    sqe->user_data= GEARMAND_URING_REMOVE;
+    _uring_sqe_queue(uring);
+  }
+
+  event->slot= GEARMAND_URING_SLOT_NONE;
+}
+
+static gearman_return_t _uring_reap(gearmand_uring_st *uring)
+{
+  gearmand_uring_event_st *event;
+  struct io_uring_cqe *cqe;
+  gearman_return_t ret;
+  uint64_t user_data;
+  uint32_t head;
+  uint32_t slot;
+  int32_t res;
+  short revents;
+
+  head= *(uring->cq_head);
+
+  while (1)
+  {
+    __sync_synchronize();
+    if (head == *(uring->cq_tail))
+      break;
+
+    cqe= &(uring->cqe_list[head & *(uring->cq_mask)]);
+    user_data= cqe->user_data;
+    res= cqe->res;
+
+    /* Hand the entry back before running callbacks, which may take a while. */
+    head++;
+    __sync_synchronize();
+    *(uring->cq_head)= head;
+
+    if (user_data == GEARMAND_URING_REMOVE)
+      continue;
+
+    slot= (uint32_t)user_data;
+    event= uring->slot_event[slot];
+    uring->slot_next[slot]= uring->slot_free;
+    uring->slot_free= slot;
+
+    /* Nothing to do if the event was deleted or changed since. */
+    if (event == NULL)
+      continue;
+
+    event->slot= GEARMAND_URING_SLOT_NONE;
+
+    revents= 0;
+    if (res < 0)
+    {
+      /* Let the callback find the error when it does its own I/O. */
+      if (res != -ECANCELED)
+        revents= event->events;
+    }
+    else
+    {
+      if (res & (POLLIN | POLLERR | POLLHUP))
+        revents|= EV_READ;
+      if (res & (POLLOUT | POLLERR | POLLHUP))
+        revents|= EV_WRITE;
+      revents&= event->events;
+    }
+
+    /* Poll requests are one-shot, so arm the next one now. It is not
+       submitted until the next wait, after the callback has done its I/O. */
+    ret= _uring_arm(uring, event);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    if (revents != 0)
+      (*event->fn)(event->fd, revents, event->arg);
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+/*
+ * Public definitions
+ */
+
+gearmand_uring_st *gearmand_uring_create(gearmand_uring_st *uring,
+                                         uint32_t entries)
+{
+  (void) entries;
+  memset(uring, 0, sizeof(gearmand_uring_st));
+  uring->fd= -1;
+  errno= ENOSYS;
+  return NULL;
+}
+
+void gearmand_uring_free(gearmand_uring_st *uring)
+{
+  (void) uring;
+}
+
+void gearmand_uring_event_set(gearmand_uring_event_st *event, int fd,
+                              gearmand_uring_event_fn *fn, void *arg)
+{
+  event->events= 0;
+  event->fd= fd;
+  event->slot= GEARMAND_URING_SLOT_NONE;
+  event->fn= fn;
+  event->arg= arg;
+}
+
+gearman_return_t gearmand_uring_event_add(gearmand_uring_st *uring,
+                                          gearmand_uring_event_st *event,
+                                          short events)
+{
+  (void) uring;
+  (void) event;
+  (void) events;
+  return GEARMAN_EVENT;
+}
+
+void gearmand_uring_event_del(gearmand_uring_st *uring,
+                              gearmand_uring_event_st *event)
+{
+  (void) uring;
+  (void) event;
+}
+
+gearman_return_t gearmand_uring_loop(gearmand_uring_st *uring)
+{
+  (void) uring;
+  return GEARMAN_EVENT;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
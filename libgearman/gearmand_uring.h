@@ -0,0 +1,96 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Gearmand io_uring Declarations
+ */
+
+#ifndef __GEARMAND_URING_H__
+#define __GEARMAND_URING_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearmand_uring Gearmand io_uring Event Loop
+ * @ingroup gearmand
+ * A small event loop on top of io_uring that gearmand I/O threads can use in
+ * place of libevent. Events behave like persistent libevent events, calling
+ * back with EV_READ and EV_WRITE while the descriptor stays ready, so the same
+ * callbacks work with either. All poll requests queued while running callbacks
+ * are submitted with the next wait, in a single system call.
+ * @{
+ */
+
+/**
+ * Initialize an io_uring event loop.
+ * @param uring Caller allocated structure.
+ * @param entries Number of submission queue entries.
+ * @return The structure, or NULL with errno set on failure. This always fails
+ *         with ENOSYS if io_uring support was not built in.
+ */
+GEARMAN_API
+gearmand_uring_st *gearmand_uring_create(gearmand_uring_st *uring,
+                                         uint32_t entries);
+
+/**
+ * Free an io_uring event loop. Any events still watched are dropped.
+ */
+GEARMAN_API
+void gearmand_uring_free(gearmand_uring_st *uring);
+
+/**
+ * Initialize an event. This must be done before the event is first added, and
+ * never while it is added.
+ * @param event Caller allocated structure.
+ * @param fd File descriptor to watch.
+ * @param fn Function to call when the descriptor is ready.
+ * @param arg Argument to pass into the callback.
+ */
+GEARMAN_API
+void gearmand_uring_event_set(gearmand_uring_event_st *event, int fd,
+                              gearmand_uring_event_fn *fn, void *arg);
+
+/**
+ * Start watching an event, or change the events an added event watches.
+ * @param uring Event loop structure.
+ * @param event Event structure previously initialized with
+ *        gearmand_uring_event_set.
+ * @param events EV_READ and EV_WRITE flags to watch for.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearmand_uring_event_add(gearmand_uring_st *uring,
+                                          gearmand_uring_event_st *event,
+                                          short events);
+
+/**
+ * Stop watching an event. The event structure may be freed or reused as soon
+ * as this returns, even if the request is still pending in the kernel.
+ */
+GEARMAN_API
+void gearmand_uring_event_del(gearmand_uring_st *uring,
+                              gearmand_uring_event_st *event);
+
+/**
+ * Run the event loop until no events are watched.
+ * @param uring Event loop structure.
+ * @return Standard gearman return value, with errno set on GEARMAN_ERRNO.
+ */
+GEARMAN_API
+gearman_return_t gearmand_uring_loop(gearmand_uring_st *uring);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAND_URING_H__ */
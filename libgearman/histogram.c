@@ -0,0 +1,207 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Histogram definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_histogram_private Private Histogram Functions
+ * @ingroup gearman_histogram
+ * @{
+ */
+
+/**
+ * Get the bucket a value is counted in.
+ */
+static uint32_t _histogram_bucket(uint64_t value);
+
+/**
+ * Get the highest value counted in a bucket.
+ */
+static uint64_t _histogram_bucket_max(uint32_t bucket);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_histogram_init(gearman_histogram_st *histogram)
+{
+  memset(histogram, 0, sizeof(gearman_histogram_st));
+}
+
+void gearman_histogram_add(gearman_histogram_st *histogram, uint64_t value)
+{
+  if (histogram->count == 0 || value < histogram->min)
+    histogram->min= value;
+  if (value > histogram->max)
+    histogram->max= value;
+
+  histogram->count++;
+  histogram->sum+= value;
+  histogram->bucket[_histogram_bucket(value)]++;
+}
+
+void gearman_histogram_merge(gearman_histogram_st *histogram,
+                             const gearman_histogram_st *from)
+{
+  uint32_t x;
+
+  if (from->count == 0)
+    return;
+
+  if (histogram->count == 0 || from->min < histogram->min)
+    histogram->min= from->min;
+  if (from->max > histogram->max)
+    histogram->max= from->max;
+
+  histogram->count+= from->count;
+  histogram->sum+= from->sum;
+  for (x= 0; x < GEARMAN_HISTOGRAM_BUCKETS; x++)
+    histogram->bucket[x]+= from->bucket[x];
+}
+
+uint64_t gearman_histogram_count(const gearman_histogram_st *histogram)
+{
+  return histogram->count;
+}
+
+uint64_t gearman_histogram_min(const gearman_histogram_st *histogram)
+{
+  return histogram->min;
+}
+
+uint64_t gearman_histogram_max(const gearman_histogram_st *histogram)
+{
+  return histogram->max;
+}
+
+uint64_t gearman_histogram_mean(const gearman_histogram_st *histogram)
+{
+  if (histogram->count == 0)
+    return 0;
+
+  return histogram->sum / histogram->count;
+}
+
+uint64_t gearman_histogram_sum(const gearman_histogram_st *histogram)
+{
+  return histogram->sum;
+}
+
+uint64_t gearman_histogram_count_at(const gearman_histogram_st *histogram,
+                                    uint64_t value)
+{
+  uint64_t count= 0;
+  uint32_t x;
+
+  if (value >= histogram->max)
+    return histogram->count;
+
+  for (x= 0; x < GEARMAN_HISTOGRAM_BUCKETS; x++)
+  {
+    if (_histogram_bucket_max(x) > value)
+      break;
+
+    count+= histogram->bucket[x];
+  }
+
+  return count;
+}
+
+uint64_t gearman_histogram_percentile(const gearman_histogram_st *histogram,
+                                      double percentile)
+{
+  uint64_t target;
+  uint64_t seen= 0;
+  uint64_t value;
+  uint32_t x;
+
+  if (histogram->count == 0)
+    return 0;
+
+  if (percentile <= 0)
+    return histogram->min;
+
+  if (percentile >= 100)
+    return histogram->max;
+
+  /* Round up so the percentile of a single value is that value. */
+  target= (uint64_t)(((double)histogram->count * percentile) / 100.0);
+  if ((double)target < ((double)histogram->count * percentile) / 100.0)
+    target++;
+
+  for (x= 0; x < GEARMAN_HISTOGRAM_BUCKETS; x++)
+  {
+    seen+= histogram->bucket[x];
+    if (seen >= target)
+      break;
+  }
+
+  /* The recorded extremes are exact, so never report past them. */
+  value= _histogram_bucket_max(x);
+  if (value > histogram->max)
+    return histogram->max;
+  if (value < histogram->min)
+    return histogram->min;
+
+  return value;
+}
+
+/*
+ * Private definitions
+ */
+
+static uint32_t _histogram_bucket(uint64_t value)
+{
+  uint32_t bits;
+
+  if (value < (1 << GEARMAN_HISTOGRAM_SUB_BITS))
+    return (uint32_t)value;
+
+  if (value >> GEARMAN_HISTOGRAM_MAX_BITS)
+    return GEARMAN_HISTOGRAM_BUCKETS - 1;
+
+  /* The position of the top bit picks the power of two, and the bits just
+     below it pick the bucket within it. */
+#ifdef __GNUC__
+  bits= (uint32_t)(63 - __builtin_clzll(value));
+#else
+  for (bits= GEARMAN_HISTOGRAM_SUB_BITS; (value >> (bits + 1)) != 0; bits++);
+#endif
+
+  return ((bits - GEARMAN_HISTOGRAM_SUB_BITS + 1) <<
+          GEARMAN_HISTOGRAM_SUB_BITS) |
+         (uint32_t)((value >> (bits - GEARMAN_HISTOGRAM_SUB_BITS)) &
+                    ((1 << GEARMAN_HISTOGRAM_SUB_BITS) - 1));
+}
+
+static uint64_t _histogram_bucket_max(uint32_t bucket)
+{
+  uint32_t bits;
+  uint64_t sub;
+
+  if (bucket < (1 << GEARMAN_HISTOGRAM_SUB_BITS))
+    return bucket;
+
+  bits= (bucket >> GEARMAN_HISTOGRAM_SUB_BITS) + GEARMAN_HISTOGRAM_SUB_BITS - 1;
+  sub= (uint64_t)(bucket & ((1 << GEARMAN_HISTOGRAM_SUB_BITS) - 1));
+
+  return (((uint64_t)(1 << GEARMAN_HISTOGRAM_SUB_BITS) | sub) <<
+          (bits - GEARMAN_HISTOGRAM_SUB_BITS)) +
+         ((uint64_t)1 << (bits - GEARMAN_HISTOGRAM_SUB_BITS)) - 1;
+}
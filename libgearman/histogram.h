@@ -0,0 +1,112 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Histogram declarations
+ */
+
+#ifndef __GEARMAN_HISTOGRAM_H__
+#define __GEARMAN_HISTOGRAM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_histogram Latency Histograms
+ * @ingroup gearman
+ * These are fixed size histograms for recording latencies in microseconds.
+ * Values below 2^GEARMAN_HISTOGRAM_SUB_BITS are counted exactly, and each
+ * power of two above that is split into 2^GEARMAN_HISTOGRAM_SUB_BITS
+ * buckets, so a percentile is never off by more than one part in eight.
+ * Adding a value is a few instructions and never allocates.
+ * @{
+ */
+
+/**
+ * Clear a histogram.
+ */
+GEARMAN_API
+void gearman_histogram_init(gearman_histogram_st *histogram);
+
+/**
+ * Record a value in a histogram. Values too large for the last bucket are
+ * counted in it.
+ */
+GEARMAN_API
+void gearman_histogram_add(gearman_histogram_st *histogram, uint64_t value);
+
+/**
+ * Add the values recorded in one histogram to another, as though each had
+ * been added to it directly.
+ * @param histogram Histogram to add to.
+ * @param from Histogram to add from, which is left as it is.
+ */
+GEARMAN_API
+void gearman_histogram_merge(gearman_histogram_st *histogram,
+                             const gearman_histogram_st *from);
+
+/**
+ * Get the number of values recorded.
+ */
+GEARMAN_API
+uint64_t gearman_histogram_count(const gearman_histogram_st *histogram);
+
+/**
+ * Get the smallest value recorded, or 0 if there are none.
+ */
+GEARMAN_API
+uint64_t gearman_histogram_min(const gearman_histogram_st *histogram);
+
+/**
+ * Get the largest value recorded, or 0 if there are none.
+ */
+GEARMAN_API
+uint64_t gearman_histogram_max(const gearman_histogram_st *histogram);
+
+/**
+ * Get the average of the values recorded, or 0 if there are none.
+ */
+GEARMAN_API
+uint64_t gearman_histogram_mean(const gearman_histogram_st *histogram);
+
+/**
+ * Get the sum of the values recorded.
+ */
+GEARMAN_API
+uint64_t gearman_histogram_sum(const gearman_histogram_st *histogram);
+
+/**
+ * Get the number of recorded values at or below a value, for reporting
+ * cumulative buckets. Only whole buckets are counted, so unless the value
+ * is at or above the largest one recorded, values in the bucket that
+ * straddles it are left out.
+ */
+GEARMAN_API
+uint64_t gearman_histogram_count_at(const gearman_histogram_st *histogram,
+                                    uint64_t value);
+
+/**
+ * Get a value that the given percentage of recorded values are at or below.
+ * @param histogram Histogram to look at.
+ * @param percentile Percentage from 0 to 100, such as 99.9.
+ * @return The highest value in the bucket holding the percentile, or 0 if
+ *         there are no values.
+ */
+GEARMAN_API
+uint64_t gearman_histogram_percentile(const gearman_histogram_st *histogram,
+                                      double percentile);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_HISTOGRAM_H__ */
@@ -28,6 +28,11 @@
  */
 static gearman_return_t _job_send(gearman_job_st *job);
 
+/**
+ * Release memory referenced as the result of a job.
+ */
+static void _job_result_release(gearman_job_st *job);
+
 /** @} */
 
 /*
@@ -53,12 +58,19 @@ gearman_job_st *gearman_job_create(gearman_st *gearman, gearman_job_st *job)
   job->gearman= gearman;
   GEARMAN_LIST_ADD(gearman->job, job,)
   job->con= NULL;
+  job->result_size= 0;
+  job->result= NULL;
+  job->buffer= NULL;
+  job->result_free_fn= NULL;
+  job->result_free_arg= NULL;
 
   return job;
 }
 
 void gearman_job_free(gearman_job_st *job)
 {
+  _job_result_release(job);
+
   if (job->options & GEARMAN_JOB_ASSIGNED_IN_USE)
     gearman_packet_free(&(job->assigned));
 
@@ -211,6 +223,76 @@ gearman_return_t gearman_job_fail(gearman_job_st *job)
   return GEARMAN_SUCCESS;
 }
 
+gearman_return_t gearman_job_wait(gearman_job_st *job, int timeout)
+{
+  gearman_return_t ret;
+
+  if (!(job->options & GEARMAN_JOB_WORK_IN_USE))
+    return GEARMAN_SUCCESS;
+
+  ret= gearman_con_set_events(job->con, POLLOUT);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  return gearman_con_wait(job->gearman, timeout);
+}
+
+void *gearman_job_result_buffer(gearman_job_st *job, size_t size,
+                                gearman_return_t *ret_ptr)
+{
+  gearman_job_buffer_st *buffer= job->buffer;
+  size_t new_size;
+  uint8_t *data;
+
+  if (buffer == NULL)
+  {
+    GEARMAN_ERROR_SET(job->gearman, "gearman_job_result_buffer",
+                      "job has no result buffer")
+    *ret_ptr= GEARMAN_INVALID_WORKER_FUNCTION;
+    return NULL;
+  }
+
+  if (size > buffer->size)
+  {
+    new_size= buffer->size == 0 ? GEARMAN_JOB_RESULT_BUFFER_SIZE :
+                                  buffer->size;
+    while (new_size < size)
+      new_size*= 2;
+
+    data= realloc(buffer->data, new_size);
+    if (data == NULL)
+    {
+      GEARMAN_ERROR_SET(job->gearman, "gearman_job_result_buffer", "realloc")
+      *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+      return NULL;
+    }
+
+    buffer->size= new_size;
+    buffer->data= data;
+  }
+
+  if (job->result != buffer->data)
+    _job_result_release(job);
+
+  job->result= buffer->data;
+  job->result_size= size;
+
+  *ret_ptr= GEARMAN_SUCCESS;
+  return buffer->data;
+}
+
+void gearman_job_set_result(gearman_job_st *job, const void *result,
+                            size_t result_size, gearman_free_fn *free_fn,
+                            void *free_arg)
+{
+  _job_result_release(job);
+
+  job->result= result;
+  job->result_size= result_size;
+  job->result_free_fn= free_fn;
+  job->result_free_arg= free_arg;
+}
+
 char *gearman_job_handle(gearman_job_st *job)
 {
   return (char *)job->assigned.arg[0];
@@ -255,3 +337,15 @@ static gearman_return_t _job_send(gearman_job_st *job)
 
   return GEARMAN_SUCCESS;
 }
+
+static void _job_result_release(gearman_job_st *job)
+{
+  if (job->result_free_fn != NULL)
+  {
+    (*(job->result_free_fn))((void *)(job->result), job->result_free_arg);
+    job->result_free_fn= NULL;
+  }
+
+  job->result= NULL;
+  job->result_size= 0;
+}
@@ -39,7 +39,12 @@ GEARMAN_API
 void gearman_job_free(gearman_job_st *job);
 
 /**
- * Send data for a running job.
+ * Send data for a running job. The data is not copied, and is sent as it is.
+ * A job server stops reading from a worker that streams data faster than a
+ * client takes it, so with the non-blocking option set this returns
+ * GEARMAN_IO_WAIT once the data can't all be sent yet. The data must then
+ * stay valid, and this is called again with the same arguments to send the
+ * rest, after gearman_job_wait if there is nothing else to do meanwhile.
  */
 GEARMAN_API
 gearman_return_t gearman_job_data(gearman_job_st *job, void *data,
@@ -79,6 +84,51 @@ gearman_return_t gearman_job_exception(gearman_job_st *job, void *exceptio,
 GEARMAN_API
 gearman_return_t gearman_job_fail(gearman_job_st *job);
 
+/**
+ * Wait for the connection of a job to take more of a packet that one of the
+ * send functions above returned GEARMAN_IO_WAIT for.
+ * @param job Job structure the send was for.
+ * @param timeout Milliseconds to wait at most, or -1 to wait until it does.
+ * @return Standard gearman return value. GEARMAN_SUCCESS does not mean the
+ *         rest will go out, only that it is worth trying again.
+ */
+GEARMAN_API
+gearman_return_t gearman_job_wait(gearman_job_st *job, int timeout);
+
+/**
+ * Get the result buffer for a job run by a function added with
+ * gearman_worker_add_function_buffer, and make the first size bytes of it the
+ * result. The buffer is owned by the library and reused for later jobs, so the
+ * result is sent as it is written without allocating or copying it. Calling
+ * this again with a larger size grows the buffer and keeps what was already
+ * written.
+ * @param job Job structure passed to the buffer function.
+ * @param size Size of the result.
+ * @param ret_ptr Standard gearman return value.
+ * @return Pointer to at least size bytes, or NULL on failure. The pointer is
+ *         only valid until the next call for the job.
+ */
+GEARMAN_API
+void *gearman_job_result_buffer(gearman_job_st *job, size_t size,
+                                gearman_return_t *ret_ptr);
+
+/**
+ * Make caller owned memory the result for a job run by a function added with
+ * gearman_worker_add_function_buffer. The memory is sent as it is, and
+ * free_fn is called with it and free_arg when the job is freed after the
+ * result is sent, or when another result is set.
+ * @param job Job structure passed to the buffer function.
+ * @param result Result to send. It must stay valid until free_fn is called.
+ * @param result_size Size of the result.
+ * @param free_fn Function to release the result, or NULL if it does not need
+ *        to be released.
+ * @param free_arg Argument passed to free_fn.
+ */
+GEARMAN_API
+void gearman_job_set_result(gearman_job_st *job, const void *result,
+                            size_t result_size, gearman_free_fn *free_fn,
+                            void *free_arg);
+
 /**
  * Get job handle.
  */
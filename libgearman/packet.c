@@ -29,7 +29,7 @@
  */
 gearman_command_info_st gearman_command_info_list[GEARMAN_COMMAND_MAX]=
 {
-  { "TEXT",               3, false },
+  { "TEXT",               4, false },
   { "CAN_DO",             1, false },
   { "CANT_DO",            1, false },
   { "RESET_ABILITIES",    0, false },
@@ -65,9 +65,49 @@ gearman_command_info_st gearman_command_info_list[GEARMAN_COMMAND_MAX]=
   { "SUBMIT_JOB_LOW",     2, true  },
   { "SUBMIT_JOB_LOW_BG",  2, true  },
   { "SUBMIT_JOB_SCHED",   7, true  },
-  { "SUBMIT_JOB_EPOCH",   3, true  }
+  { "SUBMIT_JOB_EPOCH",   3, true  },
+  { "SUBMIT_JOB_BATCH",   2, true  },
+  { "JOB_CREATED_BATCH",  0, true  },
+  { "GRAB_JOB_MULTI",     1, false },
+  { "SET_SLOTS",          1, false },
+  { "SUBMIT_JOB_CHAIN",   3, true  },
+  { "JOB_ABANDONED",      1, false }
 };
 
+/**
+ * Parse all arguments of a binary packet in one pass when they have all been
+ * received, right after the header. The arguments are copied with a single
+ * memcpy into a buffer sized once, instead of growing it one argument at a
+ * time.
+ * @return Number of bytes used, with *ret_ptr set to GEARMAN_IO_WAIT and
+ *         nothing used if the arguments are not all in data yet.
+ */
+static size_t _packet_unpack_args(gearman_packet_st *packet,
+                                  const uint8_t *data, size_t data_size,
+                                  gearman_return_t *ret_ptr);
+
+/**
+ * Allocate a data buffer with the workload allocator, if one is set.
+ */
+static void *_packet_data_malloc(gearman_packet_st *packet, size_t size);
+
+/**
+ * Free a data buffer with the workload free function, if one is set.
+ */
+static void _packet_data_free(gearman_packet_st *packet, const void *data);
+
+/**
+ * Replace the data of a packet with a buffer it now owns.
+ */
+static void _packet_data_replace(gearman_packet_st *packet, void *data,
+                                 size_t data_size);
+
+/**
+ * Drop the reference a packet has on a shared data buffer, freeing it if this
+ * was the last one.
+ */
+static void _packet_buffer_release(gearman_packet_st *packet);
+
 /** @} */
 
 /*
@@ -113,6 +153,114 @@ gearman_return_t gearman_packet_add(gearman_st *gearman,
   return gearman_packet_pack_header(packet);
 }
 
+gearman_return_t gearman_packet_add_ref(gearman_st *gearman,
+                                        gearman_packet_st *packet,
+                                        gearman_magic_t magic,
+                                        gearman_command_t command,
+                                        const void *arg, ...)
+{
+  va_list ap;
+  size_t arg_size;
+
+  packet= gearman_packet_create(gearman, packet);
+  if (packet == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  packet->magic= magic;
+  packet->command= command;
+  packet->options|= GEARMAN_PACKET_ARGS_REF;
+
+  /* Only the header is kept in the packet itself. */
+  packet->args= packet->args_buffer;
+  packet->args_size= GEARMAN_PACKET_HEADER_SIZE;
+
+  va_start(ap, arg);
+
+  while (arg != NULL)
+  {
+    arg_size = va_arg(ap, size_t);
+
+    if (packet->argc == gearman_command_info_list[command].argc)
+    {
+      if (!(gearman_command_info_list[command].data) || packet->data != NULL)
+      {
+        va_end(ap);
+        gearman_packet_free(packet);
+        GEARMAN_ERROR_SET(gearman, "gearman_packet_add_ref",
+                          "too many arguments for command")
+        return GEARMAN_TOO_MANY_ARGS;
+      }
+
+      packet->data= arg;
+      packet->data_size= arg_size;
+    }
+    else
+    {
+      packet->arg[packet->argc]= (uint8_t *)arg;
+      packet->arg_size[packet->argc]= arg_size;
+      packet->args_size+= arg_size;
+      packet->argc++;
+    }
+
+    arg = va_arg(ap, void *);
+  }
+
+  va_end(ap);
+
+  return gearman_packet_pack_header(packet);
+}
+
+gearman_return_t gearman_packet_copy_args(gearman_packet_st *packet)
+{
+  uint8_t args_buffer[GEARMAN_ARGS_BUFFER_SIZE];
+  uint8_t *args;
+  uint8_t *ptr;
+  uint8_t x;
+
+  if (!(packet->options & GEARMAN_PACKET_ARGS_REF))
+    return GEARMAN_SUCCESS;
+
+  /* Arguments may point into the packet's own buffer, so build them in a
+     separate one first. */
+  if (packet->args_size < GEARMAN_ARGS_BUFFER_SIZE)
+    args= args_buffer;
+  else
+  {
+    args= malloc(packet->args_size);
+    if (args == NULL)
+    {
+      GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_copy_args", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+  }
+
+  memcpy(args, packet->args, GEARMAN_PACKET_HEADER_SIZE);
+  ptr= args + GEARMAN_PACKET_HEADER_SIZE;
+  for (x= 0; x < packet->argc; x++)
+  {
+    memcpy(ptr, packet->arg[x], packet->arg_size[x]);
+    ptr+= packet->arg_size[x];
+  }
+
+  if (args == args_buffer)
+  {
+    memcpy(packet->args_buffer, args_buffer, packet->args_size);
+    args= packet->args_buffer;
+  }
+
+  packet->args= args;
+  ptr= args + GEARMAN_PACKET_HEADER_SIZE;
+  for (x= 0; x < packet->argc; x++)
+  {
+    packet->arg[x]= ptr;
+    ptr+= packet->arg_size[x];
+  }
+
+  packet->options&= (gearman_packet_options_t)~GEARMAN_PACKET_ARGS_REF;
+
+  return GEARMAN_SUCCESS;
+}
+
 gearman_packet_st *gearman_packet_create(gearman_st *gearman,
                                          gearman_packet_st *packet)
 {
@@ -142,6 +290,9 @@ gearman_packet_st *gearman_packet_create(gearman_st *gearman,
 
   packet->args= NULL;
   packet->data= NULL;
+  packet->buffer= NULL;
+  packet->data_iov= NULL;
+  packet->data_iov_count= 0;
 
   return packet;
 }
@@ -152,15 +303,12 @@ void gearman_packet_free(gearman_packet_st *packet)
     free(packet->args);
 
   if (packet->options & GEARMAN_PACKET_FREE_DATA && packet->data != NULL)
-  {
-    if (packet->gearman->workload_free == NULL)
-      free((void *)(packet->data));
-    else
-    {
-      packet->gearman->workload_free((void *)(packet->data),
-                                  (void *)(packet->gearman->workload_free_arg));
-    }
-  }
+    _packet_data_free(packet, packet->data);
+
+  _packet_buffer_release(packet);
+
+  if (packet->data_iov != NULL)
+    free(packet->data_iov);
 
   if (!(packet->gearman->options & GEARMAN_DONT_TRACK_PACKETS))
     GEARMAN_LIST_DEL(packet->gearman->packet, packet,)
@@ -182,7 +330,7 @@ void gearman_packet_set_options(gearman_packet_st *packet,
 gearman_return_t gearman_packet_add_arg(gearman_packet_st *packet,
                                         const void *arg, size_t arg_size)
 {
-  void *new_args;
+  uint8_t *new_args;
   size_t offset;
   uint8_t x;
 
@@ -206,39 +354,50 @@ gearman_return_t gearman_packet_add_arg(gearman_packet_st *packet,
     packet->args_size= GEARMAN_PACKET_HEADER_SIZE;
 
   if ((packet->args_size + arg_size) < GEARMAN_ARGS_BUFFER_SIZE)
-    packet->args= packet->args_buffer;
-  else
+    new_args= packet->args_buffer;
+  else if (packet->args == packet->args_buffer || packet->args == NULL)
   {
-    if (packet->args == packet->args_buffer)
-      packet->args= NULL;
-
-    new_args= realloc(packet->args, packet->args_size + arg_size);
+    new_args= malloc(packet->args_size + arg_size);
     if (new_args == NULL)
     {
-      GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_add_arg", "realloc")
+      GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_add_arg", "malloc")
       return GEARMAN_MEMORY_ALLOCATION_FAILURE;
     }
 
     if (packet->args_size > 0)
       memcpy(new_args, packet->args_buffer, packet->args_size);
-
-    packet->args= new_args;
+  }
+  else
+  {
+    new_args= realloc(packet->args, packet->args_size + arg_size);
+    if (new_args == NULL)
+    {
+      GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_add_arg", "realloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
   }
 
-  memcpy(packet->args + packet->args_size, arg, arg_size);
+  memcpy(new_args + packet->args_size, arg, arg_size);
+  packet->arg[packet->argc]= new_args + packet->args_size;
   packet->args_size+= arg_size;
   packet->arg_size[packet->argc]= arg_size;
   packet->argc++;
 
-  if (packet->magic == GEARMAN_MAGIC_TEXT)
-    offset= 0;
-  else
-    offset= GEARMAN_PACKET_HEADER_SIZE;
-
-  for (x= 0; x < packet->argc; x++)
+  /* Earlier arguments only need to be pointed at again if they moved. */
+  if (new_args != packet->args)
   {
-    packet->arg[x]= packet->args + offset;
-    offset+= packet->arg_size[x];
+    packet->args= new_args;
+
+    if (packet->magic == GEARMAN_MAGIC_TEXT)
+      offset= 0;
+    else
+      offset= GEARMAN_PACKET_HEADER_SIZE;
+
+    for (x= 0; x < packet->argc; x++)
+    {
+      packet->arg[x]= packet->args + offset;
+      offset+= packet->arg_size[x];
+    }
   }
 
   return GEARMAN_SUCCESS;
@@ -288,6 +447,8 @@ gearman_return_t gearman_packet_pack_header(gearman_packet_st *packet)
   }
 
   tmp= packet->command;
+  if (packet->options & GEARMAN_PACKET_COMPRESSED)
+    tmp|= GEARMAN_COMMAND_COMPRESSED;
   tmp= htonl(tmp);
   memcpy(packet->args + 4, &tmp, 4);
 
@@ -317,7 +478,13 @@ gearman_return_t gearman_packet_unpack_header(gearman_packet_st *packet)
   }
 
   memcpy(&tmp, packet->args + 4, 4);
-  packet->command= ntohl(tmp);
+  tmp= ntohl(tmp);
+  if (tmp & GEARMAN_COMMAND_COMPRESSED)
+  {
+    packet->options|= GEARMAN_PACKET_COMPRESSED;
+    tmp&= ~GEARMAN_COMMAND_COMPRESSED;
+  }
+  packet->command= tmp;
 
   if (packet->command == GEARMAN_COMMAND_TEXT ||
       packet->command >= GEARMAN_COMMAND_MAX)
@@ -333,11 +500,106 @@ gearman_return_t gearman_packet_unpack_header(gearman_packet_st *packet)
   return GEARMAN_SUCCESS;
 }
 
+gearman_return_t gearman_packet_compress(gearman_packet_st *packet)
+{
+  uint8_t *data;
+  size_t data_size;
+  uint32_t tmp;
+
+  if (packet->options & GEARMAN_PACKET_COMPRESSED || packet->data == NULL ||
+      packet->data_size <= GEARMAN_COMPRESS_SIZE_LENGTH ||
+      packet->data_size > UINT32_MAX)
+  {
+    return GEARMAN_SUCCESS;
+  }
+
+  data= _packet_data_malloc(packet, packet->data_size);
+  if (data == NULL)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_compress", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  /* Only send it compressed if that makes it smaller. */
+  data_size= gearman_compress(packet->data, packet->data_size,
+                              data + GEARMAN_COMPRESS_SIZE_LENGTH,
+                              packet->data_size - GEARMAN_COMPRESS_SIZE_LENGTH -
+                              1);
+  if (data_size == 0)
+  {
+    _packet_data_free(packet, data);
+    return GEARMAN_SUCCESS;
+  }
+
+  tmp= htonl((uint32_t)(packet->data_size));
+  memcpy(data, &tmp, GEARMAN_COMPRESS_SIZE_LENGTH);
+
+  _packet_data_replace(packet, data, data_size + GEARMAN_COMPRESS_SIZE_LENGTH);
+  packet->options|= GEARMAN_PACKET_COMPRESSED;
+
+  return gearman_packet_pack_header(packet);
+}
+
+gearman_return_t gearman_packet_decompress(gearman_packet_st *packet)
+{
+  uint8_t *data;
+  size_t data_size;
+  uint32_t tmp;
+
+  if (!(packet->options & GEARMAN_PACKET_COMPRESSED))
+    return GEARMAN_SUCCESS;
+
+  if (packet->data_size <= GEARMAN_COMPRESS_SIZE_LENGTH)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_decompress",
+                      "compressed data too short")
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  memcpy(&tmp, packet->data, GEARMAN_COMPRESS_SIZE_LENGTH);
+  data_size= ntohl(tmp);
+
+  /* A byte of compressed data can never expand to more than this. */
+  if (data_size == 0 ||
+      data_size / 255 > packet->data_size - GEARMAN_COMPRESS_SIZE_LENGTH)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_decompress",
+                      "invalid decompressed size:%u", (uint32_t)data_size)
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  data= _packet_data_malloc(packet, data_size);
+  if (data == NULL)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_decompress", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  if (!gearman_decompress(((const uint8_t *)(packet->data)) +
+                          GEARMAN_COMPRESS_SIZE_LENGTH,
+                          packet->data_size - GEARMAN_COMPRESS_SIZE_LENGTH,
+                          data, data_size))
+  {
+    _packet_data_free(packet, data);
+    GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_decompress",
+                      "invalid compressed data")
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  _packet_data_replace(packet, data, data_size);
+  packet->options&= (gearman_packet_options_t)~GEARMAN_PACKET_COMPRESSED;
+
+  return gearman_packet_pack_header(packet);
+}
+
 size_t gearman_packet_pack(gearman_packet_st *packet,
                            gearman_con_st *con __attribute__ ((unused)),
                            void *data, size_t data_size,
                            gearman_return_t *ret_ptr)
 {
+  uint8_t *ptr;
+  uint8_t x;
+
   if (packet->args_size == 0)
   {
     *ret_ptr= GEARMAN_SUCCESS;
@@ -350,7 +612,21 @@ size_t gearman_packet_pack(gearman_packet_st *packet,
     return 0;
   }
 
-  memcpy(data, packet->args, packet->args_size);
+  if (packet->options & GEARMAN_PACKET_ARGS_REF)
+  {
+    ptr= data;
+    memcpy(ptr, packet->args, GEARMAN_PACKET_HEADER_SIZE);
+    ptr+= GEARMAN_PACKET_HEADER_SIZE;
+
+    for (x= 0; x < packet->argc; x++)
+    {
+      memcpy(ptr, packet->arg[x], packet->arg_size[x]);
+      ptr+= packet->arg_size[x];
+    }
+  }
+  else
+    memcpy(data, packet->args, packet->args_size);
+
   *ret_ptr= GEARMAN_SUCCESS;
   return packet->args_size;
 }
@@ -420,6 +696,13 @@ size_t gearman_packet_unpack(gearman_packet_st *packet,
       return 0;
 
     used_size= GEARMAN_PACKET_HEADER_SIZE;
+
+    used_size+= _packet_unpack_args(packet, ((uint8_t *)data) + used_size,
+                                    data_size - used_size, ret_ptr);
+    if (*ret_ptr == GEARMAN_SUCCESS)
+      return used_size;
+    else if (*ret_ptr != GEARMAN_IO_WAIT)
+      return 0;
   }
   else
     used_size= 0;
@@ -467,10 +750,150 @@ size_t gearman_packet_unpack(gearman_packet_st *packet,
   return used_size;
 }
 
+gearman_packet_buffer_st *gearman_packet_buffer_create(void *data, size_t size)
+{
+  gearman_packet_buffer_st *buffer;
+
+  buffer= malloc(sizeof(gearman_packet_buffer_st));
+  if (buffer == NULL)
+    return NULL;
+
+  buffer->ref_count= 1;
+  buffer->size= size;
+  buffer->data= data;
+  buffer->free_fn= NULL;
+  buffer->free_arg= NULL;
+
+  return buffer;
+}
+
+void gearman_packet_buffer_release(gearman_packet_buffer_st *buffer)
+{
+  /* Packets sharing a buffer may be flushed from different threads. */
+  if (__sync_sub_and_fetch(&(buffer->ref_count), 1) != 0)
+    return;
+
+  if (buffer->free_fn == NULL)
+    free(buffer->data);
+  else
+    buffer->free_fn(buffer->data, (void *)(buffer->free_arg));
+
+  free(buffer);
+}
+
+gearman_packet_buffer_st *gearman_packet_share_data(gearman_packet_st *packet)
+{
+  gearman_packet_buffer_st *buffer;
+
+  if (packet->buffer != NULL)
+    return packet->buffer;
+
+  if (!(packet->options & GEARMAN_PACKET_FREE_DATA) || packet->data == NULL)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_share_data",
+                      "packet does not own its data")
+    return NULL;
+  }
+
+  buffer= gearman_packet_buffer_create((void *)(packet->data),
+                                       packet->data_size);
+  if (buffer == NULL)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_share_data", "malloc")
+    return NULL;
+  }
+
+  buffer->free_fn= packet->gearman->workload_free;
+  buffer->free_arg= packet->gearman->workload_free_arg;
+
+  packet->buffer= buffer;
+  packet->options&= (gearman_packet_options_t)~GEARMAN_PACKET_FREE_DATA;
+
+  return buffer;
+}
+
+void gearman_packet_set_buffer(gearman_packet_st *packet,
+                               gearman_packet_buffer_st *buffer)
+{
+  (void)__sync_add_and_fetch(&(buffer->ref_count), 1);
+
+  if (packet->options & GEARMAN_PACKET_FREE_DATA && packet->data != NULL)
+    _packet_data_free(packet, packet->data);
+  _packet_buffer_release(packet);
+
+  packet->data= buffer->data;
+  packet->data_size= buffer->size;
+  packet->buffer= buffer;
+  packet->options&= (gearman_packet_options_t)~GEARMAN_PACKET_FREE_DATA;
+}
+
+gearman_return_t gearman_packet_set_data_iov(gearman_packet_st *packet,
+                                             const struct iovec *iov,
+                                             int iov_count)
+{
+  struct iovec *data_iov= NULL;
+  size_t data_size= 0;
+  int x;
+
+  if (packet->data != NULL || iov_count < 0)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_set_data_iov",
+                      "packet already has data")
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  if (iov_count > 0)
+  {
+    data_iov= malloc(sizeof(struct iovec) * (size_t)iov_count);
+    if (data_iov == NULL)
+    {
+      GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_set_data_iov",
+                        "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    for (x= 0; x < iov_count; x++)
+    {
+      data_iov[x]= iov[x];
+      data_size+= iov[x].iov_len;
+    }
+  }
+
+  if (packet->data_iov != NULL)
+    free(packet->data_iov);
+
+  packet->data_iov= data_iov;
+  packet->data_iov_count= iov_count;
+  packet->data_size= data_size;
+
+  return gearman_packet_pack_header(packet);
+}
+
+void gearman_packet_replace_data(gearman_packet_st *packet, void *data,
+                                 size_t data_size)
+{
+  _packet_data_replace(packet, data, data_size);
+}
+
 void *gearman_packet_take_data(gearman_packet_st *packet, size_t *size)
 {
   void *data= (void *)(packet->data);
 
+  /* Other packets may still be using a shared buffer, so give a copy. */
+  if (packet->buffer != NULL)
+  {
+    data= _packet_data_malloc(packet, packet->data_size);
+    if (data == NULL)
+    {
+      GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_take_data", "malloc")
+      *size= 0;
+      return NULL;
+    }
+
+    memcpy(data, packet->data, packet->data_size);
+    _packet_buffer_release(packet);
+  }
+
   *size= packet->data_size;
 
   packet->data= NULL;
@@ -479,3 +902,124 @@ void *gearman_packet_take_data(gearman_packet_st *packet, size_t *size)
 
   return data;
 }
+
+/*
+ * Private definitions
+ */
+
+static size_t _packet_unpack_args(gearman_packet_st *packet,
+                                  const uint8_t *data, size_t data_size,
+                                  gearman_return_t *ret_ptr)
+{
+  gearman_command_info_st *info= &gearman_command_info_list[packet->command];
+  const uint8_t *ptr;
+  uint8_t *args;
+  size_t offset;
+  uint8_t x;
+
+  /* Never look past the end of this packet for a terminator. */
+  if (data_size > packet->data_size)
+    data_size= packet->data_size;
+
+  for (x= 0, offset= 0; x < info->argc; x++)
+  {
+    if (x == info->argc - 1 && !(info->data))
+    {
+      /* The last argument of a command without data runs to the end. */
+      if (data_size < packet->data_size)
+      {
+        *ret_ptr= GEARMAN_IO_WAIT;
+        return 0;
+      }
+
+      packet->arg_size[x]= packet->data_size - offset;
+    }
+    else
+    {
+      ptr= memchr(data + offset, 0, data_size - offset);
+      if (ptr == NULL)
+      {
+        *ret_ptr= GEARMAN_IO_WAIT;
+        return 0;
+      }
+
+      packet->arg_size[x]= (size_t)(ptr - (data + offset)) + 1;
+    }
+
+    offset+= packet->arg_size[x];
+  }
+
+  if (GEARMAN_PACKET_HEADER_SIZE + offset < GEARMAN_ARGS_BUFFER_SIZE)
+    args= packet->args_buffer;
+  else
+  {
+    args= malloc(GEARMAN_PACKET_HEADER_SIZE + offset);
+    if (args == NULL)
+    {
+      GEARMAN_ERROR_SET(packet->gearman, "gearman_packet_unpack", "malloc")
+      *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+      return 0;
+    }
+
+    memcpy(args, packet->args_buffer, GEARMAN_PACKET_HEADER_SIZE);
+  }
+
+  memcpy(args + GEARMAN_PACKET_HEADER_SIZE, data, offset);
+
+  packet->args= args;
+  packet->args_size= GEARMAN_PACKET_HEADER_SIZE + offset;
+  packet->argc= info->argc;
+  packet->data_size-= offset;
+
+  for (x= 0, args+= GEARMAN_PACKET_HEADER_SIZE; x < packet->argc; x++)
+  {
+    packet->arg[x]= args;
+    args+= packet->arg_size[x];
+  }
+
+  *ret_ptr= GEARMAN_SUCCESS;
+  return offset;
+}
+
+static void *_packet_data_malloc(gearman_packet_st *packet, size_t size)
+{
+  if (packet->gearman->workload_malloc == NULL)
+    return malloc(size);
+
+  return packet->gearman->workload_malloc(size,
+                                (void *)(packet->gearman->workload_malloc_arg));
+}
+
+static void _packet_data_free(gearman_packet_st *packet, const void *data)
+{
+  if (packet->gearman->workload_free == NULL)
+    free((void *)data);
+  else
+  {
+    packet->gearman->workload_free((void *)data,
+                                  (void *)(packet->gearman->workload_free_arg));
+  }
+}
+
+static void _packet_data_replace(gearman_packet_st *packet, void *data,
+                                 size_t data_size)
+{
+  if (packet->options & GEARMAN_PACKET_FREE_DATA && packet->data != NULL)
+    _packet_data_free(packet, packet->data);
+  _packet_buffer_release(packet);
+
+  packet->data= data;
+  packet->data_size= data_size;
+  packet->options|= GEARMAN_PACKET_FREE_DATA;
+}
+
+static void _packet_buffer_release(gearman_packet_st *packet)
+{
+  gearman_packet_buffer_st *buffer= packet->buffer;
+
+  if (buffer == NULL)
+    return;
+
+  packet->buffer= NULL;
+  gearman_packet_buffer_release(buffer);
+}
@@ -46,6 +46,25 @@ gearman_return_t gearman_packet_add(gearman_st *gearman,
                                     gearman_command_t command,
                                     const void *arg, ...);
 
+/**
+ * Initialize a packet the same way as gearman_packet_add, but without copying
+ * the arguments. They are packed straight from the given pointers into the
+ * connection send buffer, so they must stay valid until the packet is freed.
+ */
+GEARMAN_API
+gearman_return_t gearman_packet_add_ref(gearman_st *gearman,
+                                        gearman_packet_st *packet,
+                                        gearman_magic_t magic,
+                                        gearman_command_t command,
+                                        const void *arg, ...);
+
+/**
+ * Copy the arguments of a packet made with gearman_packet_add_ref into the
+ * packet, for code that needs them in one piece.
+ */
+GEARMAN_API
+gearman_return_t gearman_packet_copy_args(gearman_packet_st *packet);
+
 /**
  * Initialize a packet structure.
  */
@@ -86,6 +105,27 @@ gearman_return_t gearman_packet_pack_header(gearman_packet_st *packet);
 GEARMAN_API
 gearman_return_t gearman_packet_unpack_header(gearman_packet_st *packet);
 
+/**
+ * Compress the data of a packet, leaving it as it is if that would not make
+ * it smaller. Compressed data starts with its original size as a 4 byte
+ * integer in network byte order, followed by an LZ4 block, and the high bit
+ * of the command is set in the header. This must only be sent to peers that
+ * accepted the GEARMAN_COMPRESS_OPTION option.
+ * @param packet Packet with all data set, which now owns the new data buffer.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_packet_compress(gearman_packet_st *packet);
+
+/**
+ * Decompress the data of a packet, if it is compressed.
+ * @param packet Packet with all data received.
+ * @return Standard gearman return value, with GEARMAN_INVALID_PACKET if the
+ *         data is not valid.
+ */
+GEARMAN_API
+gearman_return_t gearman_packet_decompress(gearman_packet_st *packet);
+
 /**
  * Pack packet into output buffer.
  */
@@ -102,9 +142,73 @@ size_t gearman_packet_unpack(gearman_packet_st *packet, gearman_con_st *con,
                              const void *data, size_t data_size,
                              gearman_return_t *ret_ptr);
 
+/**
+ * Create a reference counted buffer for allocated data, holding one
+ * reference for the caller. The data is given to free() along with the last
+ * reference.
+ * @param data Data the buffer takes over.
+ * @param size Size of the data.
+ * @return Buffer, or NULL if it could not be allocated.
+ */
+GEARMAN_API
+gearman_packet_buffer_st *gearman_packet_buffer_create(void *data, size_t size);
+
+/**
+ * Drop a reference to a buffer, freeing it and its data with the last one.
+ */
+GEARMAN_API
+void gearman_packet_buffer_release(gearman_packet_buffer_st *buffer);
+
+/**
+ * Move the data a packet owns into a reference counted buffer, so other
+ * packets can send the same data without copying it. The data must not be
+ * changed after this. The buffer is freed along with the last packet using
+ * it.
+ * @param packet Packet that owns its data through GEARMAN_PACKET_FREE_DATA.
+ * @return Buffer the packet now uses, or NULL on error.
+ */
+GEARMAN_API
+gearman_packet_buffer_st *gearman_packet_share_data(gearman_packet_st *packet);
+
+/**
+ * Set the data of a packet to a shared buffer, taking a reference on it.
+ * This must be done before the header is packed.
+ * @param packet Packet to set the data for.
+ * @param buffer Buffer returned by gearman_packet_share_data.
+ */
+GEARMAN_API
+void gearman_packet_set_buffer(gearman_packet_st *packet,
+                               gearman_packet_buffer_st *buffer);
+
+/**
+ * Set the data of a packet to a list of chunks that are written to the
+ * connection in place with writev, instead of being copied into one buffer.
+ * The iovec array itself is copied, but the chunks it points at must stay
+ * valid until the packet is freed. The header is packed again with the total
+ * size.
+ * @param packet Packet to set the data for.
+ * @param iov Array of chunks making up the data.
+ * @param iov_count Number of entries in iov.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_packet_set_data_iov(gearman_packet_st *packet,
+                                             const struct iovec *iov,
+                                             int iov_count);
+
+/**
+ * Replace the data of a packet with allocated data the packet then owns. The
+ * old data is freed, or released if it is in a shared buffer. A pack
+ * function may do this for the packet it is packing, since the connection
+ * only reads the data after the pack function returns.
+ */
+GEARMAN_API
+void gearman_packet_replace_data(gearman_packet_st *packet, void *data,
+                                 size_t data_size);
+
 /**
  * Take allocated data from packet. After this, the caller is responsible for
- * free()ing the memory.
+ * free()ing the memory. Data in a shared buffer is copied.
  */
 GEARMAN_API
 void *gearman_packet_take_data(gearman_packet_st *packet, size_t *size);
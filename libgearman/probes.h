@@ -0,0 +1,55 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Static probe macros
+ */
+
+#ifndef __GEARMAN_PROBES_H__
+#define __GEARMAN_PROBES_H__
+
+/*
+ * With --enable-dtrace the probe macros come from the header dtrace(1)
+ * builds from gearmand_probes.d. Otherwise they expand to nothing, and
+ * their arguments are never evaluated. The _ENABLED() tests let a caller
+ * skip work that only a probe needs.
+ */
+#ifdef HAVE_DTRACE
+#include "gearmand_probes.h"
+#else
+#define GEARMAND_JOB_ADD(__handle, __function, __unique, __data_size, \
+                         __priority, __background)
+#define GEARMAND_JOB_ADD_ENABLED() (0)
+#define GEARMAND_JOB_QUEUE(__handle, __function)
+#define GEARMAND_JOB_QUEUE_ENABLED() (0)
+#define GEARMAND_JOB_TAKE(__handle, __function, __fd)
+#define GEARMAND_JOB_TAKE_ENABLED() (0)
+#define GEARMAND_JOB_COMPLETE(__handle, __function, __run_time)
+#define GEARMAND_JOB_COMPLETE_ENABLED() (0)
+#define GEARMAND_JOB_FAIL(__handle, __function, __run_time)
+#define GEARMAND_JOB_FAIL_ENABLED() (0)
+#define GEARMAND_PACKET_READ(__fd, __command, __data_size)
+#define GEARMAND_PACKET_READ_ENABLED() (0)
+#define GEARMAND_PACKET_FLUSH(__fd, __command, __data_size)
+#define GEARMAND_PACKET_FLUSH_ENABLED() (0)
+#define GEARMAND_CON_ACCEPT(__fd, __host, __port)
+#define GEARMAND_CON_ACCEPT_ENABLED() (0)
+#define GEARMAND_CON_CLOSE(__fd, __host, __port)
+#define GEARMAND_CON_CLOSE_ENABLED() (0)
+#define GEARMAND_QUEUE_ADD_START(__unique, __function, __data_size)
+#define GEARMAND_QUEUE_ADD_START_ENABLED() (0)
+#define GEARMAND_QUEUE_ADD_DONE(__unique, __function, __ret)
+#define GEARMAND_QUEUE_ADD_DONE_ENABLED() (0)
+#define GEARMAND_QUEUE_DONE_START(__unique, __function)
+#define GEARMAND_QUEUE_DONE_START_ENABLED() (0)
+#define GEARMAND_QUEUE_DONE_DONE(__unique, __function, __ret)
+#define GEARMAND_QUEUE_DONE_DONE_ENABLED() (0)
+#endif
+
+#endif /* __GEARMAN_PROBES_H__ */
@@ -31,14 +31,67 @@
  */
 
 /**
- * Structure for HTTP specific data.
+ * Headers the module looks at, indexing _http_header_list.
  */
-typedef struct
+typedef enum
+{
+  GEARMAN_PROTOCOL_HTTP_HEADER_CONTENT_LENGTH,
+  GEARMAN_PROTOCOL_HTTP_HEADER_CONNECTION,
+  GEARMAN_PROTOCOL_HTTP_HEADER_UNIQUE,
+  GEARMAN_PROTOCOL_HTTP_HEADER_BACKGROUND,
+  GEARMAN_PROTOCOL_HTTP_HEADER_PRIORITY,
+  GEARMAN_PROTOCOL_HTTP_HEADER_MAX
+} gearman_protocol_http_header_t;
+
+/**
+ * Structure for a request waiting on its response. Requests are answered in
+ * the order they came in, so a response that shows up early is held here
+ * until every request before it has been answered. A metrics request is
+ * answered with the reply to the "metrics" admin command.
+ */
+typedef struct gearman_protocol_http_request_st
 {
   bool background;
   bool keep_alive;
+  bool metrics;
+  bool ready;
+  bool version_1_1;
+  gearman_command_t command;
+  size_t job_handle_size;
+  size_t data_size;
+  void *data;
+  struct gearman_protocol_http_request_st *next;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+} gearman_protocol_http_request_st;
+
+/**
+ * Structure for HTTP specific data.
+ */
+typedef struct
+{
+  bool closing;
+  size_t scan_offset;
+  gearman_protocol_http_request_st *request_list;
+  gearman_protocol_http_request_st *request_end;
+  gearman_protocol_http_request_st *request_created;
 } gearman_protocol_http_st;
 
+/**
+ * Header names, matched without regard to case.
+ */
+static const struct
+{
+  const char *name;
+  size_t size;
+} _http_header_list[GEARMAN_PROTOCOL_HTTP_HEADER_MAX]=
+{
+  { "Content-Length", 14 },
+  { "Connection", 10 },
+  { "X-Gearman-Unique", 16 },
+  { "X-Gearman-Background", 20 },
+  { "X-Gearman-Priority", 18 }
+};
+
 /* Protocol callback functions. */
 static gearman_return_t _http_con_add(gearman_con_st *con);
 static void _http_free(gearman_con_st *con , void *data);
@@ -49,9 +102,49 @@ static size_t _http_unpack(gearman_packet_st *packet, gearman_con_st *con,
                            const void *data, size_t data_size,
                            gearman_return_t *ret_ptr);
 
-/* Line parsing helper function. */
-static const char *_http_line(const void *data, size_t data_size,
-                              size_t *line_size, size_t *offset);
+/**
+ * Find the end of the request headers, picking up the search where the last
+ * call left off.
+ * @return Size of the request line and headers, or 0 if not all here yet.
+ */
+static size_t _http_headers_end(gearman_protocol_http_st *http,
+                                const char *data, size_t offset,
+                                size_t data_size);
+
+/**
+ * Look up a header name.
+ * @return Header, or GEARMAN_PROTOCOL_HTTP_HEADER_MAX if it's not one we use.
+ */
+static gearman_protocol_http_header_t _http_header(const char *name,
+                                                   size_t name_size);
+
+/**
+ * Find the request a packet answers. This does not change any state, so it
+ * can be called again for a packet that did not fit the send buffer.
+ * @return Request, or NULL if the packet is not sent to the client.
+ */
+static gearman_protocol_http_request_st *
+_http_request_find(gearman_protocol_http_st *http, gearman_packet_st *packet);
+
+/**
+ * Print the response header for a request.
+ * @return Size the header needs, which may be more than data_size.
+ */
+static size_t _http_response(gearman_protocol_http_request_st *request,
+                             char *data, size_t data_size);
+
+/**
+ * Move the packet data and the held responses that follow it into one
+ * buffer, so they go out right behind the response being packed.
+ */
+static gearman_return_t _http_held_add(gearman_protocol_http_st *http,
+                                       gearman_packet_st *packet);
+
+/**
+ * Remove the oldest request, returning true if the connection should close
+ * once it has been answered.
+ */
+static bool _http_request_done(gearman_protocol_http_st *http);
 
 /** @} */
 
@@ -117,6 +210,7 @@ gearman_return_t gearmand_protocol_http_deinit(gearmand_st *gearmand __attribute
  * Private definitions
  */
 
+
 static gearman_return_t _http_con_add(gearman_con_st *con)
 {
   gearman_protocol_http_st *http;
@@ -128,8 +222,11 @@ static gearman_return_t _http_con_add(gearman_con_st *con)
     return GEARMAN_MEMORY_ALLOCATION_FAILURE;
   }
 
-  http->background= false;
-  http->keep_alive= false;
+  http->closing= false;
+  http->scan_offset= 0;
+  http->request_list= NULL;
+  http->request_end= NULL;
+  http->request_created= NULL;
 
   gearman_con_set_protocol_data(con, http);
   gearman_con_set_protocol_data_free_fn(con, _http_free);
@@ -141,7 +238,12 @@ static gearman_return_t _http_con_add(gearman_con_st *con)
 
 static void _http_free(gearman_con_st *con __attribute__ ((unused)), void *data)
 {
-  free(data);
+  gearman_protocol_http_st *http= (gearman_protocol_http_st *)data;
+
+  while (http->request_list != NULL)
+    (void)_http_request_done(http);
+
+  free(http);
 }
 
 static size_t _http_pack(gearman_packet_st *packet, gearman_con_st *con,
@@ -150,37 +252,99 @@ static size_t _http_pack(gearman_packet_st *packet, gearman_con_st *con,
 {
   size_t pack_size;
   gearman_protocol_http_st *http;
+  gearman_protocol_http_request_st *request;
+  bool close_after;
 
   http= (gearman_protocol_http_st *)gearman_con_protocol_data(con);
 
-  if (packet->command != GEARMAN_COMMAND_WORK_COMPLETE &&
-      packet->command != GEARMAN_COMMAND_WORK_FAIL &&
-      (http->background == false ||
-       packet->command != GEARMAN_COMMAND_JOB_CREATED))
+  request= _http_request_find(http, packet);
+  if (request == NULL)
+  {
+    *ret_ptr= GEARMAN_IGNORE_PACKET;
+    return 0;
+  }
+
+  request->command= packet->command;
+  request->data_size= packet->data_size;
+
+  if (packet->command == GEARMAN_COMMAND_JOB_CREATED)
+  {
+    request->job_handle_size= packet->arg_size[0];
+    if (request->job_handle_size >= GEARMAN_JOB_HANDLE_SIZE)
+      request->job_handle_size= GEARMAN_JOB_HANDLE_SIZE - 1;
+    memcpy(request->job_handle, packet->arg[0], request->job_handle_size);
+
+    /* Foreground requests are answered once the job is done. */
+    if (!(request->background))
+    {
+      http->request_created= request->next;
+      *ret_ptr= GEARMAN_IGNORE_PACKET;
+      return 0;
+    }
+  }
+
+  if (packet->command == GEARMAN_COMMAND_JOB_CREATED ||
+      packet->command == GEARMAN_COMMAND_ERROR)
+  {
+    request->data_size= 0;
+  }
+
+  /* Hold on to responses that are ready before the ones ahead of them. */
+  if (request != http->request_list)
   {
+    if (packet->command == GEARMAN_COMMAND_JOB_CREATED ||
+        packet->command == GEARMAN_COMMAND_ERROR ||
+        packet->command == GEARMAN_COMMAND_TEXT)
+    {
+      http->request_created= request->next;
+    }
+
+    if (packet->command != GEARMAN_COMMAND_JOB_CREATED &&
+        packet->command != GEARMAN_COMMAND_ERROR && packet->data_size > 0)
+    {
+      request->data= gearman_packet_take_data(packet, &(request->data_size));
+      if (request->data == NULL)
+      {
+        *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+        return 0;
+      }
+    }
+
+    request->ready= true;
     *ret_ptr= GEARMAN_IGNORE_PACKET;
     return 0;
   }
 
-  pack_size= (size_t)snprintf((char *)data, data_size,
-                              "HTTP/1.0 200 OK\r\n"
-                              "X-Gearman-Job-Handle: %.*s\r\n"
-                              "Content-Length: %"PRIu64"\r\n"
-                              "Server: Gearman/" PACKAGE_VERSION "\r\n"
-                              "\r\n",
-                              packet->command == GEARMAN_COMMAND_JOB_CREATED ?
-                              (uint32_t)packet->arg_size[0] :
-                              (uint32_t)packet->arg_size[0] - 1,
-                              packet->arg[0],
-                              (uint64_t)packet->data_size);
-
-  if (pack_size > data_size)
+  pack_size= _http_response(request, (char *)data, data_size);
+  if (pack_size >= data_size)
   {
     *ret_ptr= GEARMAN_FLUSH_DATA;
     return 0;
   }
 
-  if (!(http->keep_alive))
+  if (packet->command == GEARMAN_COMMAND_JOB_CREATED ||
+      packet->command == GEARMAN_COMMAND_ERROR ||
+      packet->command == GEARMAN_COMMAND_TEXT)
+  {
+    http->request_created= request->next;
+  }
+
+  if (request->next != NULL && request->next->ready)
+  {
+    *ret_ptr= _http_held_add(http, packet);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+      return 0;
+  }
+
+  /* The held responses now go out with this one. */
+  do
+  {
+    close_after= _http_request_done(http);
+  }
+  while (!close_after && http->request_list != NULL &&
+         http->request_list->ready);
+
+  if (close_after)
     gearman_con_set_options(con, GEARMAN_CON_CLOSE_AFTER_FLUSH, 1);
 
   *ret_ptr= GEARMAN_SUCCESS;
@@ -192,8 +356,11 @@ static size_t _http_unpack(gearman_packet_st *packet, gearman_con_st *con,
                            gearman_return_t *ret_ptr)
 {
   gearman_protocol_http_st *http;
+  gearman_protocol_http_request_st *request;
+  const char *start= (const char *)data;
   size_t offset= 0;
-  const char *request;
+  size_t headers_size;
+  const char *request_line;
   size_t request_size;
   const char *method;
   ptrdiff_t method_size;
@@ -201,37 +368,66 @@ static size_t _http_unpack(gearman_packet_st *packet, gearman_con_st *con,
   ptrdiff_t uri_size;
   const char *version;
   size_t version_size;
-  const char *header;
-  size_t header_size;
-  char content_length[11]; /* 11 bytes to fit max display length of uint32_t */
+  const char *line;
+  const char *line_end;
+  const char *name_end;
+  const char *value;
+  size_t value_size;
+  size_t x;
+  size_t content_length= 0;
   const char *unique= "-";
-  size_t unique_size= 2;
+  size_t unique_size= 1;
+  bool has_body;
+  bool metrics;
+  bool version_1_1;
+  bool background= false;
+  bool keep_alive= false;
+  bool close_requested= false;
   gearman_job_priority_t priority= GEARMAN_JOB_PRIORITY_NORMAL;
 
-  /* Get the request line first. */
-  request= _http_line(data, data_size, &request_size, &offset);
-  if (request == NULL || request_size == 0)
+  http= (gearman_protocol_http_st *)gearman_con_protocol_data(con);
+
+  /* Nothing after a request that closes the connection gets answered. */
+  if (http->closing)
   {
     *ret_ptr= GEARMAN_IO_WAIT;
-    return offset;
+    return data_size;
   }
 
-  http= (gearman_protocol_http_st *)gearman_con_protocol_data(con);
-  http->background= false;
-  http->keep_alive= false;
+  /* Skip empty lines between requests. */
+  while (offset < data_size && (start[offset] == '\r' || start[offset] == '\n'))
+    offset++;
+
+  /* Don't parse anything until the request line and all headers are here. */
+  headers_size= _http_headers_end(http, start, offset, data_size);
+  if (headers_size == 0)
+  {
+    *ret_ptr= GEARMAN_IO_WAIT;
+    return 0;
+  }
+
+  http->scan_offset= 0;
+
+  /* The end of headers was found, so every line below is complete. */
+  request_line= start + offset;
+  line_end= memchr(request_line, '\n', headers_size - offset);
+  line= line_end + 1;
+  if (line_end != request_line && *(line_end - 1) == '\r')
+    line_end--;
+  request_size= (size_t)(line_end - request_line);
 
   /* Parse out the method, URI, and HTTP version from the request line. */
-  method= request;
-  uri= memchr(request, ' ', request_size);
+  method= request_line;
+  uri= memchr(request_line, ' ', request_size);
   if (uri == NULL)
   {
     GEARMAN_ERROR_SET(packet->gearman, "_http_unpack", "bad request line: %.*s",
-                      (uint32_t)request_size, request);
+                      (uint32_t)request_size, request_line);
     *ret_ptr= GEARMAN_INVALID_PACKET;
     return 0;
   }
 
-  method_size= uri - request;
+  method_size= uri - request_line;
   if ((method_size != 3 ||
        (strncasecmp(method, "GET", 3) && strncasecmp(method, "PUT", 3))) &&
       (method_size != 4 || strncasecmp(method, "POST", 4)))
@@ -242,22 +438,26 @@ static size_t _http_unpack(gearman_packet_st *packet, gearman_con_st *con,
     return 0;
   }
 
+  has_body= method_size == 4 || !strncasecmp(method, "PUT", 3);
+
   while (*uri == ' ')
     uri++;
 
   while (*uri == '/')
     uri++;
 
-  version= memchr(uri, ' ', request_size - (size_t)(uri - request));
+  version= memchr(uri, ' ', request_size - (size_t)(uri - request_line));
   if (version == NULL)
   {
     GEARMAN_ERROR_SET(packet->gearman, "_http_unpack", "bad request line: %.*s",
-                      (uint32_t)request_size, request);
+                      (uint32_t)request_size, request_line);
     *ret_ptr= GEARMAN_INVALID_PACKET;
     return 0;
   }
 
   uri_size= version - uri;
+  metrics= method_size == 3 && !strncasecmp(method, "GET", 3) &&
+           uri_size == 7 && !strncmp(uri, "metrics", 7);
   if (uri_size == 0)
   {
     GEARMAN_ERROR_SET(packet->gearman, "_http_unpack",
@@ -269,11 +469,13 @@ static size_t _http_unpack(gearman_packet_st *packet, gearman_con_st *con,
   while (*version == ' ')
     version++;
 
-  version_size= request_size - (size_t)(version - request);
+  version_size= request_size - (size_t)(version - request_line);
 
   if (version_size == 8 && !strncasecmp(version, "HTTP/1.1", 8))
-    http->keep_alive= true;
-  else if (version_size != 8 || strncasecmp(version, "HTTP/1.0", 8))
+    version_1_1= true;
+  else if (version_size == 8 && !strncasecmp(version, "HTTP/1.0", 8))
+    version_1_1= false;
+  else
   {
     GEARMAN_ERROR_SET(packet->gearman, "_http_unpack", "bad version: %.*s",
                       (uint32_t)version_size, version);
@@ -281,114 +483,363 @@ static size_t _http_unpack(gearman_packet_st *packet, gearman_con_st *con,
     return 0;
   }
 
-  /* Loop through all the headers looking for ones of interest. */
-  while ((header= _http_line(data, data_size, &header_size, &offset)) != NULL)
+  /* Go through the headers once, picking out the ones we use. */
+  while (1)
   {
-    if (header_size == 0)
+    line_end= memchr(line, '\n', headers_size - (size_t)(line - start));
+    if (line_end != line && *(line_end - 1) == '\r')
+      line_end--;
+
+    if (line_end == line)
       break;
 
-    if (header_size > 16 && !strncasecmp(header, "Content-Length: ", 16))
+    name_end= memchr(line, ':', (size_t)(line_end - line));
+    if (name_end != NULL)
     {
-      if ((method_size == 4 && !strncasecmp(method, "POST", 4)) ||
-          (method_size == 3 && !strncasecmp(method, "PUT", 3)))
+      value= name_end + 1;
+      while (value != line_end && (*value == ' ' || *value == '\t'))
+        value++;
+      value_size= (size_t)(line_end - value);
+
+      switch (_http_header(line, (size_t)(name_end - line)))
       {
-        snprintf(content_length, 11, "%.*s", (uint32_t)header_size - 16,
-                 header + 16);
-        packet->data_size= (size_t)atoi(content_length);
+      case GEARMAN_PROTOCOL_HTTP_HEADER_CONTENT_LENGTH:
+        content_length= 0;
+        for (x= 0; x < value_size; x++)
+        {
+          if (value[x] < '0' || value[x] > '9' ||
+              content_length > (SIZE_MAX - 9) / 10)
+          {
+            break;
+          }
+
+          content_length= (content_length * 10) + (size_t)(value[x] - '0');
+        }
+
+        if (value_size == 0 || x != value_size)
+        {
+          GEARMAN_ERROR_SET(packet->gearman, "_http_unpack",
+                            "bad content length: %.*s", (uint32_t)value_size,
+                            value)
+          *ret_ptr= GEARMAN_INVALID_PACKET;
+          return 0;
+        }
+        break;
+
+      case GEARMAN_PROTOCOL_HTTP_HEADER_CONNECTION:
+        if (value_size == 10 && !strncasecmp(value, "Keep-Alive", 10))
+          keep_alive= true;
+        else if (value_size == 5 && !strncasecmp(value, "close", 5))
+          close_requested= true;
+        break;
+
+      case GEARMAN_PROTOCOL_HTTP_HEADER_UNIQUE:
+        if (value_size > 0)
+        {
+          unique= value;
+          unique_size= value_size;
+        }
+        break;
+
+      case GEARMAN_PROTOCOL_HTTP_HEADER_BACKGROUND:
+        if (value_size == 4 && !strncasecmp(value, "true", 4))
+          background= true;
+        break;
+
+      case GEARMAN_PROTOCOL_HTTP_HEADER_PRIORITY:
+        if (value_size == 4 && !strncasecmp(value, "high", 4))
+          priority= GEARMAN_JOB_PRIORITY_HIGH;
+        else if (value_size == 3 && !strncasecmp(value, "low", 3))
+          priority= GEARMAN_JOB_PRIORITY_LOW;
+        break;
+
+      case GEARMAN_PROTOCOL_HTTP_HEADER_MAX:
+      default:
+        break;
       }
     }
-    else if (header_size == 22 &&
-             !strncasecmp(header, "Connection: Keep-Alive", 22))
+
+    line= memchr(line_end, '\n', headers_size - (size_t)(line_end - start));
+    line++;
+  }
+
+  request= malloc(sizeof(gearman_protocol_http_request_st));
+  if (request == NULL)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "_http_unpack", "malloc")
+    *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    return 0;
+  }
+
+  request->background= background && !metrics;
+  request->keep_alive= !close_requested && (version_1_1 || keep_alive);
+  request->metrics= metrics;
+  request->ready= false;
+  request->version_1_1= version_1_1;
+  request->command= GEARMAN_COMMAND_TEXT;
+  request->job_handle_size= 0;
+  request->data_size= 0;
+  request->data= NULL;
+  request->next= NULL;
+
+  /* Request and all headers complete, build a packet based on HTTP request.
+     A metrics request becomes the admin command that renders them. */
+  if (metrics)
+  {
+    packet->magic= GEARMAN_MAGIC_TEXT;
+    packet->command= GEARMAN_COMMAND_TEXT;
+
+    *ret_ptr= gearman_packet_add_arg(packet, "metrics", sizeof("metrics"));
+    if (*ret_ptr == GEARMAN_SUCCESS)
+      *ret_ptr= gearman_packet_pack_header(packet);
+    if (*ret_ptr != GEARMAN_SUCCESS)
     {
-      http->keep_alive= true;
+      free(request);
+      return 0;
     }
-    else if (header_size > 18 && !strncasecmp(header, "X-Gearman-Unique: ", 18))
+  }
+  else
+  {
+    packet->magic= GEARMAN_MAGIC_REQUEST;
+
+    if (background)
     {
-      unique= header + 18;
-      unique_size= header_size - 18;
+      if (priority == GEARMAN_JOB_PRIORITY_NORMAL)
+        packet->command= GEARMAN_COMMAND_SUBMIT_JOB_BG;
+      else if (priority == GEARMAN_JOB_PRIORITY_HIGH)
+        packet->command= GEARMAN_COMMAND_SUBMIT_JOB_HIGH_BG;
+      else
+        packet->command= GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG;
     }
-    else if (header_size == 26 &&
-             !strncasecmp(header, "X-Gearman-Background: true", 26))
+    else
     {
-      http->background= true;
+      if (priority == GEARMAN_JOB_PRIORITY_NORMAL)
+        packet->command= GEARMAN_COMMAND_SUBMIT_JOB;
+      else if (priority == GEARMAN_JOB_PRIORITY_HIGH)
+        packet->command= GEARMAN_COMMAND_SUBMIT_JOB_HIGH;
+      else
+        packet->command= GEARMAN_COMMAND_SUBMIT_JOB_LOW;
     }
-    else if (header_size == 24 &&
-             !strncasecmp(header, "X-Gearman-Priority: high", 24))
+
+    /* The body is read by the connection straight into the packet data,
+       which the job then keeps, so it never goes through here. */
+    if (has_body)
+      packet->data_size= content_length;
+
+    *ret_ptr= gearman_packet_pack_header(packet);
+    if (*ret_ptr == GEARMAN_SUCCESS)
+      *ret_ptr= gearman_packet_add_arg(packet, uri, (size_t)uri_size + 1);
+    if (*ret_ptr == GEARMAN_SUCCESS)
+      *ret_ptr= gearman_packet_add_arg(packet, unique, unique_size + 1);
+    if (*ret_ptr != GEARMAN_SUCCESS)
     {
-      priority= GEARMAN_JOB_PRIORITY_HIGH;
+      free(request);
+      return 0;
     }
-    else if (header_size == 23 &&
-             !strncasecmp(header, "X-Gearman-Priority: low", 23))
+
+    /* Make sure function and unique are NULL terminated. */
+    packet->arg[0][uri_size]= 0;
+    packet->arg[1][unique_size]= 0;
+  }
+
+  if (http->request_end == NULL)
+    http->request_list= request;
+  else
+    http->request_end->next= request;
+  http->request_end= request;
+
+  if (http->request_created == NULL)
+    http->request_created= request;
+
+  if (!(request->keep_alive))
+    http->closing= true;
+
+  *ret_ptr= GEARMAN_SUCCESS;
+  return headers_size;
+}
+
+static size_t _http_headers_end(gearman_protocol_http_st *http,
+                                const char *data, size_t offset,
+                                size_t data_size)
+{
+  const char *end;
+
+  if (http->scan_offset > offset && http->scan_offset < data_size)
+    offset= http->scan_offset;
+
+  while (offset < data_size &&
+         (end= memchr(data + offset, '\n', data_size - offset)) != NULL)
+  {
+    /* Look at this line ending again next time if what follows isn't here. */
+    http->scan_offset= (size_t)(end - data);
+    offset= http->scan_offset + 1;
+
+    if (offset < data_size && data[offset] == '\n')
+      return offset + 1;
+
+    if (offset + 1 < data_size && data[offset] == '\r' &&
+        data[offset + 1] == '\n')
     {
-      priority= GEARMAN_JOB_PRIORITY_LOW;
+      return offset + 2;
     }
   }
 
-  /* Make sure we received the end of headers. */
-  if (header == NULL)
+  return 0;
+}
+
+static gearman_protocol_http_header_t _http_header(const char *name,
+                                                   size_t name_size)
+{
+  uint32_t x;
+
+  for (x= 0; x < GEARMAN_PROTOCOL_HTTP_HEADER_MAX; x++)
   {
-    *ret_ptr= GEARMAN_IO_WAIT;
-    return 0;
+    if (_http_header_list[x].size == name_size &&
+        (_http_header_list[x].name[0] | 0x20) == (name[0] | 0x20) &&
+        !strncasecmp(_http_header_list[x].name, name, name_size))
+    {
+      return (gearman_protocol_http_header_t)x;
+    }
   }
 
-  /* Request and all headers complete, build a packet based on HTTP request. */
-  packet->magic= GEARMAN_MAGIC_REQUEST;
+  return GEARMAN_PROTOCOL_HTTP_HEADER_MAX;
+}
+
+static gearman_protocol_http_request_st *
+_http_request_find(gearman_protocol_http_st *http, gearman_packet_st *packet)
+{
+  gearman_protocol_http_request_st *request;
+  size_t job_handle_size;
 
-  if (http->background)
+  /* These come back in the order the requests were submitted. */
+  if (packet->command == GEARMAN_COMMAND_JOB_CREATED ||
+      packet->command == GEARMAN_COMMAND_ERROR ||
+      packet->command == GEARMAN_COMMAND_TEXT)
   {
-    if (priority == GEARMAN_JOB_PRIORITY_NORMAL)
-      packet->command= GEARMAN_COMMAND_SUBMIT_JOB_BG;
-    else if (priority == GEARMAN_JOB_PRIORITY_HIGH)
-      packet->command= GEARMAN_COMMAND_SUBMIT_JOB_HIGH_BG;
-    else
-      packet->command= GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG;
+    return http->request_created;
   }
-  else
+
+  if (packet->command != GEARMAN_COMMAND_WORK_COMPLETE &&
+      packet->command != GEARMAN_COMMAND_WORK_FAIL)
   {
-    if (priority == GEARMAN_JOB_PRIORITY_NORMAL)
-      packet->command= GEARMAN_COMMAND_SUBMIT_JOB;
-    else if (priority == GEARMAN_JOB_PRIORITY_HIGH)
-      packet->command= GEARMAN_COMMAND_SUBMIT_JOB_HIGH;
-    else
-      packet->command= GEARMAN_COMMAND_SUBMIT_JOB_LOW;
+    return NULL;
   }
 
-  *ret_ptr= gearman_packet_pack_header(packet);
-  if (*ret_ptr != GEARMAN_SUCCESS)
-    return 0;
+  job_handle_size= packet->arg_size[0] - 1;
 
-  *ret_ptr= gearman_packet_add_arg(packet, uri, (size_t)uri_size + 1);
-  if (*ret_ptr != GEARMAN_SUCCESS)
-    return 0;
+  for (request= http->request_list; request != http->request_created;
+       request= request->next)
+  {
+    if (!(request->background) && !(request->ready) &&
+        request->job_handle_size == job_handle_size &&
+        !memcmp(request->job_handle, packet->arg[0], job_handle_size))
+    {
+      return request;
+    }
+  }
 
-  *ret_ptr= gearman_packet_add_arg(packet, unique, unique_size + 1);
-  if (*ret_ptr != GEARMAN_SUCCESS)
-    return 0;
+  return NULL;
+}
 
-  /* Make sure function and unique are NULL terminated. */
-  packet->arg[0][uri_size]= 0;
-  packet->arg[1][unique_size]= 0;
+static size_t _http_response(gearman_protocol_http_request_st *request,
+                             char *data, size_t data_size)
+{
+  const char *connection= "";
 
-  *ret_ptr= GEARMAN_SUCCESS;
-  return offset;
+  if (request->version_1_1 && !(request->keep_alive))
+    connection= "Connection: close\r\n";
+  else if (!(request->version_1_1) && request->keep_alive)
+    connection= "Connection: Keep-Alive\r\n";
+
+  if (request->metrics)
+  {
+    return (size_t)snprintf(data, data_size,
+                            "HTTP/1.%c 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %"PRIu64"\r\n"
+                            "%s"
+                            "Server: Gearman/" PACKAGE_VERSION "\r\n"
+                            "\r\n",
+                            request->version_1_1 ? '1' : '0',
+                            (uint64_t)request->data_size, connection);
+  }
+
+  return (size_t)snprintf(data, data_size,
+                          "HTTP/1.%c %s\r\n"
+                          "X-Gearman-Job-Handle: %.*s\r\n"
+                          "Content-Length: %"PRIu64"\r\n"
+                          "%s"
+                          "Server: Gearman/" PACKAGE_VERSION "\r\n"
+                          "\r\n",
+                          request->version_1_1 ? '1' : '0',
+                          request->command == GEARMAN_COMMAND_ERROR ?
+                          "503 Service Unavailable" : "200 OK",
+                          (uint32_t)request->job_handle_size,
+                          request->job_handle, (uint64_t)request->data_size,
+                          connection);
 }
 
-static const char *_http_line(const void *data, size_t data_size,
-                              size_t *line_size, size_t *offset)
+static gearman_return_t _http_held_add(gearman_protocol_http_st *http,
+                                       gearman_packet_st *packet)
 {
-  const char *start= (const char *)data + *offset;
-  const char *end;
+  gearman_protocol_http_request_st *request;
+  size_t size= packet->data_size;
+  size_t offset;
+  uint8_t *data;
 
-  end= memchr(start, '\n', data_size - *offset);
-  if (end == NULL)
-    return NULL;
+  for (request= http->request_list->next; request != NULL && request->ready;
+       request= request->next)
+  {
+    size+= _http_response(request, NULL, 0) + request->data_size;
+  }
+
+  /* One more byte for the terminator snprintf always writes. */
+  data= malloc(size + 1);
+  if (data == NULL)
+  {
+    GEARMAN_ERROR_SET(packet->gearman, "_http_held_add", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  if (packet->data_size > 0)
+    memcpy(data, packet->data, packet->data_size);
+  offset= packet->data_size;
+
+  for (request= http->request_list->next; request != NULL && request->ready;
+       request= request->next)
+  {
+    offset+= _http_response(request, (char *)data + offset, size + 1 - offset);
+
+    if (request->data_size > 0)
+    {
+      memcpy(data + offset, request->data, request->data_size);
+      offset+= request->data_size;
+      free(request->data);
+      request->data= NULL;
+    }
+  }
+
+  gearman_packet_replace_data(packet, data, size);
+
+  return GEARMAN_SUCCESS;
+}
+
+static bool _http_request_done(gearman_protocol_http_st *http)
+{
+  gearman_protocol_http_request_st *request= http->request_list;
+  bool close_after= !(request->keep_alive);
+
+  http->request_list= request->next;
+  if (http->request_list == NULL)
+    http->request_end= NULL;
 
-  *offset+= (size_t)(end - start) + 1;
+  if (http->request_created == request)
+    http->request_created= request->next;
 
-  if (end != start && *(end - 1) == '\r')
-    end--;
+  if (request->data != NULL)
+    free(request->data);
 
-  *line_size= (size_t)(end - start);
+  free(request);
 
-  return start;
+  return close_after;
 }
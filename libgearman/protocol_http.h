@@ -25,14 +25,18 @@ extern "C" {
  * is also meant to serve as an example of how other protocols can plug into
  * the server. This module will ignore all headers except:
  * Content-Length: SIZE
- * Connection: Keep-Alive
+ * Connection: Keep-Alive | close
  * X-Gearman-Unique: UNIQUE_KEY
  * X-Gearman-Background: true
  * X-Gearman-Priority: HIGH | LOW
- * All HTTP requests are translated into SUBMIT_JOB requests, and only
- * WORK_COMPLETE, WORK_FAIL, and JOB_CREATED responses are returned.
+ * All HTTP requests except GET /metrics are translated into SUBMIT_JOB
+ * requests, and only WORK_COMPLETE, WORK_FAIL, and JOB_CREATED responses are
+ * returned. GET /metrics returns the reply to the "metrics" admin command,
+ * the server stats in the Prometheus text format, see gearman_server_stats.
  * JOB_CREATED packet are only sent back if the "X-Gearman-Background: true"
- * header is given.
+ * header is given. HTTP/1.1 connections stay open unless the client asks to
+ * close them, and requests may be pipelined: every request is submitted as
+ * soon as it is read, and the responses come back in request order.
  * @{
  */
 
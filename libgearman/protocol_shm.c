@@ -0,0 +1,1219 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Shared Memory Protocol Definitions
+ */
+
+#include "common.h"
+
+#include <libgearman/protocol_shm.h>
+
+/**
+ * @addtogroup gearman_protocol_shm Shared Memory Protocol Functions
+ * @ingroup gearman_protocol
+ * @{
+ */
+
+/**
+ * Default values.
+ */
+#define GEARMAN_PROTOCOL_SHM_DEFAULT_PATH "/tmp/gearmand.shm"
+#define GEARMAN_PROTOCOL_SHM_RING_SIZE (1 << 20)
+#define GEARMAN_PROTOCOL_SHM_MAX_RING_SIZE (1 << 28)
+#define GEARMAN_PROTOCOL_SHM_MAGIC 0x47534852
+
+/*
+ * Private declarations
+ */
+
+/**
+ * One direction of a connection. Positions count bytes and wrap at 2^32, so
+ * the bytes waiting are always tail - head. The producer only moves tail and
+ * the consumer only moves head, each on its own cache line.
+ */
+typedef struct
+{
+  volatile uint32_t head;
+  volatile uint32_t producer_wait;
+  uint8_t head_pad[56];
+  volatile uint32_t tail;
+  volatile uint32_t consumer_wait;
+  uint8_t tail_pad[56];
+} gearman_protocol_shm_ring_st;
+
+/**
+ * Start of the shared segment. The ring data follows in the next page, first
+ * the client to server ring and then the server to client ring.
+ */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t ring_size;
+  uint8_t pad[56];
+  gearman_protocol_shm_ring_st ring[2];
+} gearman_protocol_shm_header_st;
+
+/**
+ * Message sent along with the segment descriptor when a client connects.
+ */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t ring_size;
+} gearman_protocol_shm_hello_st;
+
+/**
+ * Structure for shared memory specific data. Each ring is mapped twice in a
+ * row, so anything between head and tail can be read or written in one piece
+ * even when it wraps around the end.
+ */
+typedef struct
+{
+  bool client;
+  uint8_t *map;
+  size_t map_size;
+  uint32_t ring_size;
+  gearman_protocol_shm_ring_st *recv_ring;
+  gearman_protocol_shm_ring_st *send_ring;
+  uint8_t *recv_data;
+  uint8_t *send_data;
+  size_t send_offset;
+} gearman_protocol_shm_st;
+
+/* Protocol callback functions. */
+static gearman_return_t _shm_con_add(gearman_con_st *con);
+static void _shm_free(gearman_con_st *con, void *data);
+static gearman_packet_st *_shm_recv(gearman_con_st *con,
+                                    gearman_packet_st *packet,
+                                    gearman_return_t *ret_ptr, bool recv_data);
+static size_t _shm_recv_data(gearman_con_st *con, void *data,
+                             size_t data_size, gearman_return_t *ret_ptr);
+static gearman_return_t _shm_send(gearman_con_st *con,
+                                  gearman_packet_st *packet, bool flush);
+static size_t _shm_send_data(gearman_con_st *con, const void *data,
+                             size_t data_size, gearman_return_t *ret_ptr);
+
+/**
+ * Make sure the segment is set up for the current socket, connecting and
+ * passing a new one over for clients, or picking it up for the server.
+ */
+static gearman_return_t _shm_ready(gearman_con_st *con,
+                                   gearman_protocol_shm_st **shm_ptr);
+
+/**
+ * Create a segment and pass it to the server over a connected socket.
+ */
+static gearman_return_t _shm_connect(gearman_con_st *con,
+                                     gearman_protocol_shm_st *shm);
+
+/**
+ * Receive the segment a client passed over the socket.
+ */
+static gearman_return_t _shm_accept(gearman_con_st *con,
+                                    gearman_protocol_shm_st *shm);
+
+/**
+ * Map a segment, with each ring mapped twice in a row.
+ */
+static gearman_return_t _shm_map(gearman_con_st *con,
+                                 gearman_protocol_shm_st *shm, int fd,
+                                 uint32_t ring_size);
+
+/**
+ * Unmap the segment if there is one.
+ */
+static void _shm_unmap(gearman_protocol_shm_st *shm);
+
+/**
+ * Get the number of bytes waiting in the receive ring.
+ */
+static gearman_return_t _shm_recv_used(gearman_con_st *con,
+                                       gearman_protocol_shm_st *shm,
+                                       size_t *used);
+
+/**
+ * Release bytes from the receive ring, waking the producer if it is waiting
+ * for space.
+ */
+static gearman_return_t _shm_recv_consume(gearman_con_st *con,
+                                          gearman_protocol_shm_st *shm,
+                                          size_t size);
+
+/**
+ * Wait for more than the given number of bytes in the receive ring.
+ */
+static gearman_return_t _shm_recv_wait(gearman_con_st *con,
+                                       gearman_protocol_shm_st *shm,
+                                       size_t used);
+
+/**
+ * Copy as much as fits into the send ring, waking the consumer if it is
+ * waiting for data.
+ */
+static size_t _shm_send_push(gearman_con_st *con, gearman_protocol_shm_st *shm,
+                             const void *data, size_t data_size,
+                             gearman_return_t *ret_ptr);
+
+/**
+ * Wait for space in the send ring.
+ */
+static gearman_return_t _shm_send_wait(gearman_con_st *con,
+                                       gearman_protocol_shm_st *shm);
+
+/**
+ * Send a wakeup if the other side said it is waiting.
+ */
+static gearman_return_t _shm_notify(gearman_con_st *con,
+                                    volatile uint32_t *wait);
+
+/**
+ * Read any wakeups waiting on the socket.
+ */
+static gearman_return_t _shm_drain(gearman_con_st *con);
+
+/**
+ * Wait for a wakeup on the socket, or return GEARMAN_IO_WAIT when not
+ * blocking.
+ */
+static gearman_return_t _shm_sleep(gearman_con_st *con);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+gearman_return_t gearman_protocol_shm_conf(gearman_conf_st *conf)
+{
+  gearman_conf_module_st *module;
+
+  module= gearman_conf_module_create(conf, NULL, "shm");
+  if (module == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  gearman_conf_module_add_option(module, "path", 0, "PATH",
+                                 "Unix domain socket path to listen on.");
+
+  return gearman_conf_return(conf);
+}
+
+gearman_return_t gearmand_protocol_shm_init(gearmand_st *gearmand,
+                                            gearman_conf_st *conf)
+{
+  const char *path= GEARMAN_PROTOCOL_SHM_DEFAULT_PATH;
+  gearman_conf_module_st *module;
+  const char *name;
+  const char *value;
+
+  GEARMAN_INFO(gearmand, "Initializing shm module")
+
+  /* Get module and parse the option values that were given. */
+  module= gearman_conf_module_find(conf, "shm");
+  if (module == NULL)
+  {
+    GEARMAN_FATAL(gearmand,
+                  "gearman_protocol_shm_init:gearman_conf_module_find:NULL")
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  while (gearman_conf_module_value(module, &name, &value))
+  {
+    if (!strcmp(name, "path"))
+      path= value;
+    else
+    {
+      gearmand_protocol_shm_deinit(gearmand);
+      GEARMAN_FATAL(gearmand, "gearman_protocol_shm_init:Unknown argument: %s",
+                    name)
+      return GEARMAN_QUEUE_ERROR;
+    }
+  }
+
+  return gearmand_port_add_unix(gearmand, path, _shm_con_add);
+}
+
+gearman_return_t gearmand_protocol_shm_deinit(gearmand_st *gearmand __attribute__ ((unused)))
+{
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_protocol_shm_con_set(gearman_con_st *con, bool shm)
+{
+  if (shm)
+  {
+    if (con->send_fn == _shm_send)
+      return;
+
+    gearman_con_set_protocol_data_free_fn(con, _shm_free);
+    gearman_con_set_recv_fn(con, _shm_recv);
+    gearman_con_set_recv_data_fn(con, _shm_recv_data);
+    gearman_con_set_send_fn(con, _shm_send);
+    gearman_con_set_send_data_fn(con, _shm_send_data);
+    return;
+  }
+
+  if (con->send_fn != _shm_send)
+    return;
+
+  if (con->protocol_data != NULL)
+    _shm_free(con, con->protocol_data);
+
+  gearman_con_set_protocol_data(con, NULL);
+  gearman_con_set_protocol_data_free_fn(con, NULL);
+  gearman_con_set_recv_fn(con, NULL);
+  gearman_con_set_recv_data_fn(con, NULL);
+  gearman_con_set_send_fn(con, NULL);
+  gearman_con_set_send_data_fn(con, NULL);
+}
+
+/*
+ * Private definitions
+ */
+
+static gearman_return_t _shm_con_add(gearman_con_st *con)
+{
+  gearman_protocol_shm_st *shm;
+
+  shm= malloc(sizeof(gearman_protocol_shm_st));
+  if (shm == NULL)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_con_add", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  memset(shm, 0, sizeof(gearman_protocol_shm_st));
+
+  gearman_con_set_protocol_data(con, shm);
+  gearman_protocol_shm_con_set(con, true);
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _shm_free(gearman_con_st *con __attribute__ ((unused)), void *data)
+{
+  _shm_unmap((gearman_protocol_shm_st *)data);
+  free(data);
+}
+
+static gearman_packet_st *_shm_recv(gearman_con_st *con,
+                                    gearman_packet_st *packet,
+                                    gearman_return_t *ret_ptr, bool recv_data)
+{
+  gearman_protocol_shm_st *shm;
+  size_t used;
+  size_t unpack_size;
+
+  *ret_ptr= _shm_ready(con, &shm);
+  if (*ret_ptr != GEARMAN_SUCCESS)
+    return NULL;
+
+  switch (con->recv_state)
+  {
+  case GEARMAN_CON_RECV_STATE_NONE:
+    con->recv_packet= gearman_packet_create(con->gearman, packet);
+    if (con->recv_packet == NULL)
+    {
+      *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+      return NULL;
+    }
+
+    con->recv_state= GEARMAN_CON_RECV_STATE_READ;
+
+  case GEARMAN_CON_RECV_STATE_READ:
+    while (1)
+    {
+      *ret_ptr= _shm_recv_used(con, shm, &used);
+      if (*ret_ptr != GEARMAN_SUCCESS)
+        return NULL;
+
+      if (used > 0)
+      {
+        unpack_size= gearman_packet_unpack(con->recv_packet, con,
+                                           shm->recv_data +
+                                           (shm->recv_ring->head &
+                                            (shm->ring_size - 1)),
+                                           used, ret_ptr);
+        if (*ret_ptr != GEARMAN_SUCCESS && *ret_ptr != GEARMAN_IO_WAIT)
+        {
+          gearman_con_close(con);
+          return NULL;
+        }
+
+        if (*ret_ptr == GEARMAN_IO_WAIT && unpack_size == 0 &&
+            used == shm->ring_size)
+        {
+          GEARMAN_ERROR_SET(con->gearman, "_shm_recv",
+                            "packet arguments larger than ring")
+          gearman_con_close(con);
+          *ret_ptr= GEARMAN_INVALID_PACKET;
+          return NULL;
+        }
+
+        if (*ret_ptr == GEARMAN_SUCCESS)
+        {
+          *ret_ptr= _shm_recv_consume(con, shm, unpack_size);
+          if (*ret_ptr != GEARMAN_SUCCESS)
+            return NULL;
+
+          break;
+        }
+
+        *ret_ptr= _shm_recv_consume(con, shm, unpack_size);
+        if (*ret_ptr != GEARMAN_SUCCESS)
+          return NULL;
+
+        used-= unpack_size;
+      }
+
+      *ret_ptr= _shm_recv_wait(con, shm, used);
+      if (*ret_ptr != GEARMAN_SUCCESS)
+        return NULL;
+    }
+
+    if (con->recv_packet->data_size == 0)
+    {
+      con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
+      break;
+    }
+
+    con->recv_data_size= con->recv_packet->data_size;
+    con->recv_data_offset= 0;
+
+    if (!recv_data)
+    {
+      con->recv_state= GEARMAN_CON_RECV_STATE_READ_DATA;
+      break;
+    }
+
+    if (con->gearman->workload_malloc == NULL)
+      con->recv_packet->data= malloc(con->recv_packet->data_size);
+    else
+    {
+      con->recv_packet->data= con->gearman->workload_malloc(
+                                con->recv_packet->data_size,
+                                (void *)(con->gearman->workload_malloc_arg));
+    }
+    if (con->recv_packet->data == NULL)
+    {
+      *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+      gearman_con_close(con);
+      return NULL;
+    }
+
+    con->recv_packet->options|= GEARMAN_PACKET_FREE_DATA;
+    con->recv_state= GEARMAN_CON_RECV_STATE_READ_DATA;
+
+  case GEARMAN_CON_RECV_STATE_READ_DATA:
+    while (con->recv_data_size != 0)
+    {
+      (void)_shm_recv_data(con,
+                           ((uint8_t *)(con->recv_packet->data)) +
+                           con->recv_data_offset,
+                           con->recv_packet->data_size -
+                           con->recv_data_offset, ret_ptr);
+      if (*ret_ptr != GEARMAN_SUCCESS)
+        return NULL;
+    }
+
+    con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
+    break;
+
+  default:
+    GEARMAN_ERROR_SET(con->gearman, "_shm_recv", "unknown state: %u",
+                      con->recv_state)
+    *ret_ptr= GEARMAN_UNKNOWN_STATE;
+    return NULL;
+  }
+
+  packet= con->recv_packet;
+  con->recv_packet= NULL;
+
+  /* Compression is never asked for over shared memory, but a peer could
+     still send it. */
+  if (packet->options & GEARMAN_PACKET_COMPRESSED &&
+      !(con->gearman->options & GEARMAN_KEEP_COMPRESSED))
+  {
+    *ret_ptr= gearman_packet_decompress(packet);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+    {
+      gearman_packet_free(packet);
+      gearman_con_close(con);
+      return NULL;
+    }
+  }
+
+  *ret_ptr= GEARMAN_SUCCESS;
+  return packet;
+}
+
+static size_t _shm_recv_data(gearman_con_st *con, void *data,
+                             size_t data_size, gearman_return_t *ret_ptr)
+{
+  gearman_protocol_shm_st *shm;
+  size_t used;
+
+  if (con->recv_data_size == 0)
+  {
+    *ret_ptr= GEARMAN_SUCCESS;
+    return 0;
+  }
+
+  *ret_ptr= _shm_ready(con, &shm);
+  if (*ret_ptr != GEARMAN_SUCCESS)
+    return 0;
+
+  if ((con->recv_data_size - con->recv_data_offset) < data_size)
+    data_size= con->recv_data_size - con->recv_data_offset;
+
+  while (1)
+  {
+    *ret_ptr= _shm_recv_used(con, shm, &used);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+      return 0;
+
+    if (used > 0)
+      break;
+
+    *ret_ptr= _shm_recv_wait(con, shm, 0);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+      return 0;
+  }
+
+  if (used < data_size)
+    data_size= used;
+
+  memcpy(data, shm->recv_data + (shm->recv_ring->head & (shm->ring_size - 1)),
+         data_size);
+
+  *ret_ptr= _shm_recv_consume(con, shm, data_size);
+  if (*ret_ptr != GEARMAN_SUCCESS)
+    return 0;
+
+  con->recv_data_offset+= data_size;
+  if (con->recv_data_size == con->recv_data_offset)
+  {
+    con->recv_data_size= 0;
+    con->recv_data_offset= 0;
+    con->recv_state= GEARMAN_CON_RECV_STATE_NONE;
+  }
+
+  return data_size;
+}
+
+static gearman_return_t _shm_send(gearman_con_st *con,
+                                  gearman_packet_st *packet,
+                                  bool flush __attribute__ ((unused)))
+{
+  gearman_protocol_shm_st *shm;
+  gearman_return_t ret;
+  size_t send_size;
+
+  ret= _shm_ready(con, &shm);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  switch (con->send_state)
+  {
+  case GEARMAN_CON_SEND_STATE_NONE:
+    if (!(packet->options & GEARMAN_PACKET_COMPLETE))
+    {
+      GEARMAN_ERROR_SET(con->gearman, "_shm_send", "packet not complete")
+      return GEARMAN_INVALID_PACKET;
+    }
+
+    /* Arguments are pushed from the packet in one piece. */
+    ret= gearman_packet_copy_args(packet);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    shm->send_offset= 0;
+    con->send_state= GEARMAN_CON_SEND_STATE_FLUSH;
+
+  case GEARMAN_CON_SEND_STATE_FLUSH:
+    /* Wakeups go out as soon as anything is added for a waiting peer, so
+       there is nothing more to do for a flush. */
+    send_size= packet->args_size;
+    if (packet->data != NULL)
+      send_size+= packet->data_size;
+
+    while (shm->send_offset < send_size)
+    {
+      if (shm->send_offset < packet->args_size)
+      {
+        shm->send_offset+= _shm_send_push(con, shm,
+                                          packet->args + shm->send_offset,
+                                          packet->args_size -
+                                          shm->send_offset, &ret);
+      }
+      else
+      {
+        shm->send_offset+= _shm_send_push(con, shm,
+                                          ((const uint8_t *)(packet->data)) +
+                                          shm->send_offset -
+                                          packet->args_size,
+                                          send_size - shm->send_offset, &ret);
+      }
+
+      if (ret == GEARMAN_IO_WAIT)
+        ret= _shm_send_wait(con, shm);
+
+      if (ret != GEARMAN_SUCCESS)
+        return ret;
+    }
+
+    shm->send_offset= 0;
+
+    /* The caller streams the data with gearman_con_send_data. */
+    if (packet->data == NULL && packet->data_size > 0)
+    {
+      con->send_data_size= packet->data_size;
+      con->send_data_offset= 0;
+      con->send_state= GEARMAN_CON_SEND_STATE_FLUSH_DATA;
+      return GEARMAN_SUCCESS;
+    }
+
+    con->send_state= GEARMAN_CON_SEND_STATE_NONE;
+    break;
+
+  /* These belong to the socket path, or to data still being streamed. */
+  case GEARMAN_CON_SEND_STATE_PRE_FLUSH:
+  case GEARMAN_CON_SEND_STATE_FORCE_FLUSH:
+  case GEARMAN_CON_SEND_STATE_FLUSH_DATA:
+  case GEARMAN_CON_SEND_STATE_IOV_FLUSH:
+  case GEARMAN_CON_SEND_STATE_IOV_DATA:
+    GEARMAN_ERROR_SET(con->gearman, "_shm_send", "unexpected state: %u",
+                      con->send_state)
+    return GEARMAN_INVALID_PACKET;
+
+  default:
+    GEARMAN_ERROR_SET(con->gearman, "_shm_send", "unknown state: %u",
+                      con->send_state)
+    return GEARMAN_UNKNOWN_STATE;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static size_t _shm_send_data(gearman_con_st *con, const void *data,
+                             size_t data_size, gearman_return_t *ret_ptr)
+{
+  gearman_protocol_shm_st *shm;
+  size_t send_size;
+
+  if (con->send_state != GEARMAN_CON_SEND_STATE_FLUSH_DATA)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_send_data", "not flushing")
+    *ret_ptr= GEARMAN_NOT_FLUSHING;
+    return 0;
+  }
+
+  if (data_size > (con->send_data_size - con->send_data_offset))
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_send_data", "data too large")
+    *ret_ptr= GEARMAN_DATA_TOO_LARGE;
+    return 0;
+  }
+
+  *ret_ptr= _shm_ready(con, &shm);
+  if (*ret_ptr != GEARMAN_SUCCESS)
+    return 0;
+
+  while (1)
+  {
+    send_size= _shm_send_push(con, shm, data, data_size, ret_ptr);
+    if (*ret_ptr != GEARMAN_IO_WAIT)
+      break;
+
+    *ret_ptr= _shm_send_wait(con, shm);
+    if (*ret_ptr != GEARMAN_SUCCESS)
+      return 0;
+  }
+
+  if (*ret_ptr != GEARMAN_SUCCESS)
+    return 0;
+
+  con->send_data_offset+= send_size;
+  if (con->send_data_offset == con->send_data_size)
+  {
+    con->send_data_size= 0;
+    con->send_data_offset= 0;
+    con->send_state= GEARMAN_CON_SEND_STATE_NONE;
+  }
+
+  return send_size;
+}
+
+static gearman_return_t _shm_ready(gearman_con_st *con,
+                                   gearman_protocol_shm_st **shm_ptr)
+{
+  gearman_protocol_shm_st *shm;
+
+  shm= (gearman_protocol_shm_st *)gearman_con_protocol_data(con);
+  if (shm == NULL)
+  {
+    /* Clients only allocate this once they are used. */
+    shm= malloc(sizeof(gearman_protocol_shm_st));
+    if (shm == NULL)
+    {
+      GEARMAN_ERROR_SET(con->gearman, "_shm_ready", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    memset(shm, 0, sizeof(gearman_protocol_shm_st));
+    shm->client= true;
+    gearman_con_set_protocol_data(con, shm);
+  }
+
+  *shm_ptr= shm;
+
+  /* Closing the connection clears this, and the segment goes with it. */
+  if (con->options & GEARMAN_CON_SHM)
+    return GEARMAN_SUCCESS;
+
+  _shm_unmap(shm);
+
+  if (shm->client)
+    return _shm_connect(con, shm);
+
+  return _shm_accept(con, shm);
+}
+
+static gearman_return_t _shm_connect(gearman_con_st *con,
+                                     gearman_protocol_shm_st *shm)
+{
+#ifdef HAVE_MEMFD_CREATE
+  gearman_protocol_shm_header_st *header;
+  gearman_protocol_shm_hello_st hello;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  gearman_return_t ret;
+  ssize_t send_size;
+  int fd;
+
+  /* Nothing is ever put in the send buffer, so this only connects. */
+  ret= gearman_con_flush(con);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  fd= memfd_create("gearman", MFD_CLOEXEC);
+  if (fd == -1)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_connect", "memfd_create:%d", errno)
+    con->gearman->last_errno= errno;
+    gearman_con_close(con);
+    return GEARMAN_ERRNO;
+  }
+
+  if (ftruncate(fd, (off_t)sysconf(_SC_PAGESIZE) +
+                    ((off_t)GEARMAN_PROTOCOL_SHM_RING_SIZE * 2)) == -1)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_connect", "ftruncate:%d", errno)
+    con->gearman->last_errno= errno;
+    (void)close(fd);
+    gearman_con_close(con);
+    return GEARMAN_ERRNO;
+  }
+
+  ret= _shm_map(con, shm, fd, GEARMAN_PROTOCOL_SHM_RING_SIZE);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    (void)close(fd);
+    gearman_con_close(con);
+    return ret;
+  }
+
+  /* The server is not waiting yet, but the hello wakes it up anyway. Callers
+     may wait on the socket for the first reply without trying to read it, so
+     ask for a wakeup from the start. */
+  header= (gearman_protocol_shm_header_st *)(shm->map);
+  header->magic= GEARMAN_PROTOCOL_SHM_MAGIC;
+  header->ring_size= GEARMAN_PROTOCOL_SHM_RING_SIZE;
+  shm->recv_ring->consumer_wait= 1;
+
+  hello.magic= GEARMAN_PROTOCOL_SHM_MAGIC;
+  hello.ring_size= GEARMAN_PROTOCOL_SHM_RING_SIZE;
+  iov.iov_base= &hello;
+  iov.iov_len= sizeof(hello);
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov= &iov;
+  msg.msg_iovlen= 1;
+  msg.msg_control= control;
+  msg.msg_controllen= sizeof(control);
+
+  cmsg= CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level= SOL_SOCKET;
+  cmsg->cmsg_type= SCM_RIGHTS;
+  cmsg->cmsg_len= CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  do
+  {
+    send_size= sendmsg(con->fd, &msg, MSG_NOSIGNAL);
+  } while (send_size == -1 && errno == EINTR);
+
+  (void)close(fd);
+
+  /* A new socket always has room for this much. */
+  if (send_size != (ssize_t)sizeof(hello))
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_connect", "sendmsg:%d", errno)
+    con->gearman->last_errno= errno;
+    _shm_unmap(shm);
+    gearman_con_close(con);
+    return GEARMAN_ERRNO;
+  }
+
+  con->options|= GEARMAN_CON_SHM;
+
+  return GEARMAN_SUCCESS;
+#else
+  (void)shm;
+  GEARMAN_ERROR_SET(con->gearman, "_shm_connect",
+                    "shared memory transport not supported")
+  return GEARMAN_COULD_NOT_CONNECT;
+#endif
+}
+
+static gearman_return_t _shm_accept(gearman_con_st *con,
+                                    gearman_protocol_shm_st *shm)
+{
+  gearman_protocol_shm_header_st *header;
+  gearman_protocol_shm_hello_st hello;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  struct stat st;
+  char control[CMSG_SPACE(sizeof(int))];
+  gearman_return_t ret;
+  ssize_t recv_size;
+  int fd= -1;
+
+  iov.iov_base= &hello;
+  iov.iov_len= sizeof(hello);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov= &iov;
+  msg.msg_iovlen= 1;
+  msg.msg_control= control;
+  msg.msg_controllen= sizeof(control);
+
+  while (1)
+  {
+    recv_size= recvmsg(con->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (recv_size == 0)
+    {
+      GEARMAN_ERROR_SET(con->gearman, "_shm_accept",
+                        "lost connection to client (EOF)")
+      gearman_con_close(con);
+      return GEARMAN_LOST_CONNECTION;
+    }
+    else if (recv_size == -1)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN)
+      {
+        ret= _shm_sleep(con);
+        if (ret != GEARMAN_SUCCESS)
+          return ret;
+
+        continue;
+      }
+
+      GEARMAN_ERROR_SET(con->gearman, "_shm_accept", "recvmsg:%d", errno)
+      con->gearman->last_errno= errno;
+      gearman_con_close(con);
+      return GEARMAN_ERRNO;
+    }
+
+    break;
+  }
+
+  cmsg= CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+  {
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  if (recv_size != (ssize_t)sizeof(hello) || fd == -1 ||
+      msg.msg_flags & MSG_CTRUNC || hello.magic != GEARMAN_PROTOCOL_SHM_MAGIC ||
+      hello.ring_size < (uint32_t)sysconf(_SC_PAGESIZE) ||
+      hello.ring_size > GEARMAN_PROTOCOL_SHM_MAX_RING_SIZE ||
+      (hello.ring_size & (hello.ring_size - 1)) != 0)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_accept", "bad hello")
+    if (fd != -1)
+      (void)close(fd);
+    gearman_con_close(con);
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  if (fstat(fd, &st) == -1 ||
+      st.st_size != (off_t)sysconf(_SC_PAGESIZE) +
+                    ((off_t)(hello.ring_size) * 2))
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_accept", "bad segment size")
+    (void)close(fd);
+    gearman_con_close(con);
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  ret= _shm_map(con, shm, fd, hello.ring_size);
+  (void)close(fd);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    gearman_con_close(con);
+    return ret;
+  }
+
+  header= (gearman_protocol_shm_header_st *)(shm->map);
+  if (header->magic != GEARMAN_PROTOCOL_SHM_MAGIC ||
+      header->ring_size != hello.ring_size)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_accept", "bad segment header")
+    _shm_unmap(shm);
+    gearman_con_close(con);
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  con->options|= GEARMAN_CON_SHM;
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _shm_map(gearman_con_st *con,
+                                 gearman_protocol_shm_st *shm, int fd,
+                                 uint32_t ring_size)
+{
+  gearman_protocol_shm_header_st *header;
+  size_t page_size= (size_t)sysconf(_SC_PAGESIZE);
+  uint8_t *map;
+  uint8_t *ptr;
+  uint32_t x;
+
+  shm->map_size= page_size + ((size_t)ring_size * 4);
+
+  /* Reserve the whole range first so the pieces can go in fixed places. */
+  map= mmap(NULL, shm->map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+            0);
+  if (map == MAP_FAILED)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_map", "mmap:%d", errno)
+    con->gearman->last_errno= errno;
+    return GEARMAN_ERRNO;
+  }
+
+  for (x= 0; x < 5; x++)
+  {
+    if (x == 0)
+    {
+      ptr= mmap(map, page_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                fd, 0);
+    }
+    else
+    {
+      ptr= mmap(map + page_size + ((size_t)ring_size * (x - 1)), ring_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                (off_t)page_size + ((off_t)ring_size * ((x - 1) / 2)));
+    }
+
+    if (ptr == MAP_FAILED)
+    {
+      GEARMAN_ERROR_SET(con->gearman, "_shm_map", "mmap:%d", errno)
+      con->gearman->last_errno= errno;
+      (void)munmap(map, shm->map_size);
+      return GEARMAN_ERRNO;
+    }
+  }
+
+  header= (gearman_protocol_shm_header_st *)map;
+  shm->map= map;
+  shm->ring_size= ring_size;
+
+  if (shm->client)
+  {
+    shm->send_ring= &(header->ring[0]);
+    shm->send_data= map + page_size;
+    shm->recv_ring= &(header->ring[1]);
+    shm->recv_data= map + page_size + ((size_t)ring_size * 2);
+  }
+  else
+  {
+    shm->recv_ring= &(header->ring[0]);
+    shm->recv_data= map + page_size;
+    shm->send_ring= &(header->ring[1]);
+    shm->send_data= map + page_size + ((size_t)ring_size * 2);
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _shm_unmap(gearman_protocol_shm_st *shm)
+{
+  if (shm->map == NULL)
+    return;
+
+  (void)munmap(shm->map, shm->map_size);
+  shm->map= NULL;
+  shm->recv_ring= NULL;
+  shm->send_ring= NULL;
+  shm->recv_data= NULL;
+  shm->send_data= NULL;
+  shm->send_offset= 0;
+}
+
+static gearman_return_t _shm_recv_used(gearman_con_st *con,
+                                       gearman_protocol_shm_st *shm,
+                                       size_t *used)
+{
+  uint32_t tail= shm->recv_ring->tail;
+
+  __sync_synchronize();
+
+  /* The other side can write anything here, so don't trust it. */
+  *used= tail - shm->recv_ring->head;
+  if (*used > shm->ring_size)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_recv_used", "bad ring position")
+    gearman_con_close(con);
+    return GEARMAN_INVALID_PACKET;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _shm_recv_consume(gearman_con_st *con,
+                                          gearman_protocol_shm_st *shm,
+                                          size_t size)
+{
+  gearman_return_t ret;
+
+  if (size == 0)
+    return GEARMAN_SUCCESS;
+
+  __sync_synchronize();
+  shm->recv_ring->head+= (uint32_t)size;
+
+  /* Once everything has been read, the next packet wakes us up. If the flag
+     was cleared, a wakeup was sent for data that has now been read, and it
+     would make the next wait return for nothing. */
+  if (shm->recv_ring->head == shm->recv_ring->tail &&
+      shm->recv_ring->consumer_wait == 0)
+  {
+    shm->recv_ring->consumer_wait= 1;
+    __sync_synchronize();
+
+    ret= _shm_drain(con);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  return _shm_notify(con, &(shm->recv_ring->producer_wait));
+}
+
+static gearman_return_t _shm_recv_wait(gearman_con_st *con,
+                                       gearman_protocol_shm_st *shm,
+                                       size_t used)
+{
+  gearman_return_t ret;
+  size_t now_used;
+
+  while (1)
+  {
+    /* Ask for a wakeup before looking again, so no packet gets missed. */
+    shm->recv_ring->consumer_wait= 1;
+    __sync_synchronize();
+
+    ret= _shm_drain(con);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    ret= _shm_recv_used(con, shm, &now_used);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    if (now_used > used)
+      return GEARMAN_SUCCESS;
+
+    ret= _shm_sleep(con);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+}
+
+static size_t _shm_send_push(gearman_con_st *con, gearman_protocol_shm_st *shm,
+                             const void *data, size_t data_size,
+                             gearman_return_t *ret_ptr)
+{
+  uint32_t tail= shm->send_ring->tail;
+  size_t free_size;
+
+  free_size= shm->ring_size - (size_t)(tail - shm->send_ring->head);
+  if (free_size > shm->ring_size)
+  {
+    GEARMAN_ERROR_SET(con->gearman, "_shm_send_push", "bad ring position")
+    gearman_con_close(con);
+    *ret_ptr= GEARMAN_INVALID_PACKET;
+    return 0;
+  }
+
+  if (free_size == 0)
+  {
+    *ret_ptr= GEARMAN_IO_WAIT;
+    return 0;
+  }
+
+  if (data_size > free_size)
+    data_size= free_size;
+
+  __sync_synchronize();
+  memcpy(shm->send_data + (tail & (shm->ring_size - 1)), data, data_size);
+  __sync_synchronize();
+  shm->send_ring->tail= tail + (uint32_t)data_size;
+
+  *ret_ptr= _shm_notify(con, &(shm->send_ring->consumer_wait));
+  if (*ret_ptr != GEARMAN_SUCCESS)
+    return 0;
+
+  return data_size;
+}
+
+static gearman_return_t _shm_send_wait(gearman_con_st *con,
+                                       gearman_protocol_shm_st *shm)
+{
+  gearman_return_t ret;
+
+  while (1)
+  {
+    shm->send_ring->producer_wait= 1;
+    __sync_synchronize();
+
+    ret= _shm_drain(con);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    if (shm->send_ring->tail - shm->send_ring->head < shm->ring_size)
+      return GEARMAN_SUCCESS;
+
+    ret= _shm_sleep(con);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+}
+
+static gearman_return_t _shm_notify(gearman_con_st *con,
+                                    volatile uint32_t *wait)
+{
+  ssize_t send_size;
+
+  __sync_synchronize();
+
+  if (*wait == 0 || __sync_lock_test_and_set(wait, 0) == 0)
+    return GEARMAN_SUCCESS;
+
+  while (1)
+  {
+    send_size= send(con->fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (send_size == 1)
+      return GEARMAN_SUCCESS;
+
+    /* A full socket already has wakeups waiting to be read. */
+    if (errno == EAGAIN)
+      return GEARMAN_SUCCESS;
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno == EPIPE || errno == ECONNRESET)
+    {
+      if (!(con->options & GEARMAN_CON_IGNORE_LOST_CONNECTION))
+      {
+        GEARMAN_ERROR_SET(con->gearman, "_shm_notify",
+                          "lost connection (%d)", errno)
+      }
+      gearman_con_close(con);
+      return GEARMAN_LOST_CONNECTION;
+    }
+
+    GEARMAN_ERROR_SET(con->gearman, "_shm_notify", "send:%d", errno)
+    con->gearman->last_errno= errno;
+    gearman_con_close(con);
+    return GEARMAN_ERRNO;
+  }
+}
+
+static gearman_return_t _shm_drain(gearman_con_st *con)
+{
+  uint8_t buffer[64];
+  ssize_t recv_size;
+
+  while (1)
+  {
+    recv_size= recv(con->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (recv_size == (ssize_t)sizeof(buffer))
+      continue;
+
+    if (recv_size > 0)
+      return GEARMAN_SUCCESS;
+
+    if (recv_size == 0)
+    {
+      if (!(con->options & GEARMAN_CON_IGNORE_LOST_CONNECTION))
+      {
+        GEARMAN_ERROR_SET(con->gearman, "_shm_drain", "lost connection (EOF)")
+      }
+      gearman_con_close(con);
+      return GEARMAN_LOST_CONNECTION;
+    }
+
+    if (errno == EAGAIN)
+      return GEARMAN_SUCCESS;
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno == ECONNRESET)
+    {
+      if (!(con->options & GEARMAN_CON_IGNORE_LOST_CONNECTION))
+      {
+        GEARMAN_ERROR_SET(con->gearman, "_shm_drain",
+                          "lost connection (%d)", errno)
+      }
+      gearman_con_close(con);
+      return GEARMAN_LOST_CONNECTION;
+    }
+
+    GEARMAN_ERROR_SET(con->gearman, "_shm_drain", "recv:%d", errno)
+    con->gearman->last_errno= errno;
+    gearman_con_close(con);
+    return GEARMAN_ERRNO;
+  }
+}
+
+static gearman_return_t _shm_sleep(gearman_con_st *con)
+{
+  gearman_return_t ret;
+
+  ret= gearman_con_set_events(con, POLLIN);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  if (con->gearman->options & GEARMAN_NON_BLOCKING)
+    return GEARMAN_IO_WAIT;
+
+  return gearman_con_wait(con->gearman, -1);
+}
@@ -0,0 +1,62 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Shared Memory Protocol Declarations
+ */
+
+#ifndef __GEARMAN_PROTOCOL_SHM_H__
+#define __GEARMAN_PROTOCOL_SHM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_protocol_shm Shared Memory Protocol Functions
+ * @ingroup gearman_protocol
+ * This module lets clients and workers on the same host exchange packets with
+ * the job server through a pair of single producer, single consumer ring
+ * buffers in a shared memory segment, one for each direction. A client
+ * connects to the Unix domain socket this module listens on, and passes the
+ * segment over it when the connection is first used. After that the socket
+ * only carries single byte wakeups, which are sent when the other side has
+ * said it is waiting for data or space, so a busy connection moves packets
+ * without any system calls. The socket also tells either side when the other
+ * goes away. Clients and workers use this transport when a server is added
+ * with a "shm:" prefix on the socket path, for example "shm:/tmp/gearmand.shm".
+ * @{
+ */
+
+/**
+ * Get module configuration options.
+ */
+GEARMAN_API
+gearman_return_t gearman_protocol_shm_conf(gearman_conf_st *conf);
+
+/**
+ * Initialize the shared memory protocol module.
+ */
+GEARMAN_API
+gearman_return_t gearmand_protocol_shm_init(gearmand_st *gearmand,
+                                            gearman_conf_st *conf);
+
+/**
+ * De-initialize the shared memory protocol module.
+ */
+GEARMAN_API
+gearman_return_t gearmand_protocol_shm_deinit(gearmand_st *gearmand);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_PROTOCOL_SHM_H__ */
@@ -28,6 +28,7 @@
 #define GEARMAN_QUEUE_LIBDRIZZLE_DEFAULT_DATABASE "test"
 #define GEARMAN_QUEUE_LIBDRIZZLE_DEFAULT_TABLE "queue"
 #define GEARMAN_QUEUE_QUERY_BUFFER 256
+#define GEARMAN_QUEUE_LIBDRIZZLE_BATCH_SIZE (1024 * 1024)
 
 /*
  * Private declarations
@@ -44,6 +45,10 @@ typedef struct
   char table[DRIZZLE_MAX_TABLE_SIZE];
   char *query;
   size_t query_size;
+  size_t query_length;
+  char *done_query;
+  size_t done_query_size;
+  size_t done_query_length;
 } gearman_queue_libdrizzle_st;
 
 /**
@@ -53,13 +58,32 @@ static drizzle_return_t _libdrizzle_query(gearman_st *gearman,
                                           gearman_queue_libdrizzle_st *queue,
                                           const char *query, size_t query_size);
 
+/**
+ * Grow a query buffer to hold at least size bytes.
+ */
+static gearman_return_t _libdrizzle_reserve(gearman_st *gearman, char **query,
+                                            size_t *query_size, size_t size);
+
+/**
+ * Send the pending multi-row INSERT.
+ */
+static gearman_return_t _libdrizzle_add_send(gearman_st *gearman,
+                                             gearman_queue_libdrizzle_st *queue);
+
+/**
+ * Send the pending DELETE of done jobs.
+ */
+static gearman_return_t _libdrizzle_done_send(gearman_st *gearman,
+                                            gearman_queue_libdrizzle_st *queue);
+
 /* Queue callback functions. */
 static gearman_return_t _libdrizzle_add(gearman_st *gearman, void *fn_arg,
                                         const void *unique, size_t unique_size,
                                         const void *function_name,
                                         size_t function_name_size,
                                         const void *data, size_t data_size,
-                                        gearman_job_priority_t priority);
+                                        gearman_job_priority_t priority,
+                                        int64_t when);
 static gearman_return_t _libdrizzle_flush(gearman_st *gearman, void *fn_arg);
 static gearman_return_t _libdrizzle_done(gearman_st *gearman, void *fn_arg,
                                          const void *unique,
@@ -227,7 +251,8 @@ gearman_return_t gearman_queue_libdrizzle_init(gearman_st *gearman,
                "unique_key VARCHAR(%d) PRIMARY KEY,"
                "function_name VARCHAR(255),"
                "priority INT,"
-               "data LONGBLOB"
+               "data LONGBLOB,"
+               "when_to_run BIGINT"
              ")",
              queue->table, GEARMAN_UNIQUE_SIZE);
 
@@ -243,6 +268,49 @@ gearman_return_t gearman_queue_libdrizzle_init(gearman_st *gearman,
 
     drizzle_result_free(&(queue->result));
   }
+  else
+  {
+    /* Tables from before jobs could be scheduled don't have the column. */
+    snprintf(create, 1024, "SHOW COLUMNS FROM %s LIKE 'when_to_run'",
+             queue->table);
+    if (_libdrizzle_query(gearman, queue, create, strlen(create))
+        != DRIZZLE_RETURN_OK)
+    {
+      gearman_queue_libdrizzle_deinit(gearman);
+      return GEARMAN_QUEUE_ERROR;
+    }
+
+    if (drizzle_result_buffer(&(queue->result)) != DRIZZLE_RETURN_OK)
+    {
+      drizzle_result_free(&(queue->result));
+      gearman_queue_libdrizzle_deinit(gearman);
+      GEARMAN_ERROR_SET(gearman, "gearman_queue_libdrizzle_init",
+                        "drizzle_result_buffer:%s",
+                        drizzle_error(&(queue->drizzle)))
+      return GEARMAN_QUEUE_ERROR;
+    }
+
+    row= drizzle_row_next(&(queue->result));
+    drizzle_result_free(&(queue->result));
+
+    if (row == NULL)
+    {
+      snprintf(create, 1024, "ALTER TABLE %s ADD COLUMN when_to_run BIGINT",
+               queue->table);
+
+      GEARMAN_INFO(gearman, "libdrizzle module adding column when_to_run to "
+                   "'%s.%s'", drizzle_con_db(&queue->con), queue->table)
+
+      if (_libdrizzle_query(gearman, queue, create, strlen(create))
+          != DRIZZLE_RETURN_OK)
+      {
+        gearman_queue_libdrizzle_deinit(gearman);
+        return GEARMAN_QUEUE_ERROR;
+      }
+
+      drizzle_result_free(&(queue->result));
+    }
+  }
 
   gearman_set_queue_add(gearman, _libdrizzle_add);
   gearman_set_queue_flush(gearman, _libdrizzle_flush);
@@ -260,10 +328,18 @@ gearman_return_t gearman_queue_libdrizzle_deinit(gearman_st *gearman)
 
   queue= (gearman_queue_libdrizzle_st *)gearman_queue_fn_arg(gearman);
   gearman_set_queue_fn_arg(gearman, NULL);
+
+  if (queue->done_query_length > 0)
+    (void)_libdrizzle_done_send(gearman, queue);
+  if (queue->query_length > 0)
+    (void)_libdrizzle_add_send(gearman, queue);
+
   drizzle_con_free(&(queue->con));
   drizzle_free(&(queue->drizzle));
   if (queue->query != NULL)
     free(queue->query);
+  if (queue->done_query != NULL)
+    free(queue->done_query);
   free(queue);
 
   return GEARMAN_SUCCESS;
@@ -313,82 +389,153 @@ static drizzle_return_t _libdrizzle_query(gearman_st *gearman,
   return DRIZZLE_RETURN_OK;
 }
 
+static gearman_return_t _libdrizzle_reserve(gearman_st *gearman, char **query,
+                                            size_t *query_size, size_t size)
+{
+  char *new_query;
+
+  if (size <= *query_size)
+    return GEARMAN_SUCCESS;
+
+  new_query= realloc(*query, size);
+  if (new_query == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libdrizzle_reserve", "realloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  *query= new_query;
+  *query_size= size;
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _libdrizzle_add_send(gearman_st *gearman,
+                                             gearman_queue_libdrizzle_st *queue)
+{
+  size_t query_length= queue->query_length;
+
+  /* A failed batch is reported once and dropped, not retried. */
+  queue->query_length= 0;
+
+  if (_libdrizzle_query(gearman, queue, queue->query, query_length) !=
+      DRIZZLE_RETURN_OK)
+  {
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  drizzle_result_free(&(queue->result));
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _libdrizzle_done_send(gearman_st *gearman,
+                                            gearman_queue_libdrizzle_st *queue)
+{
+  size_t query_length= queue->done_query_length;
+
+  queue->done_query_length= 0;
+
+  /* _libdrizzle_done always leaves room to close the list. */
+  queue->done_query[query_length]= ')';
+  query_length++;
+
+  if (_libdrizzle_query(gearman, queue, queue->done_query, query_length) !=
+      DRIZZLE_RETURN_OK)
+  {
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  drizzle_result_free(&(queue->result));
+
+  return GEARMAN_SUCCESS;
+}
+
 static gearman_return_t _libdrizzle_add(gearman_st *gearman, void *fn_arg,
                                         const void *unique, size_t unique_size,
                                         const void *function_name,
                                         size_t function_name_size,
                                         const void *data, size_t data_size,
-                                        gearman_job_priority_t priority)
+                                        gearman_job_priority_t priority,
+                                        int64_t when)
 {
   gearman_queue_libdrizzle_st *queue= (gearman_queue_libdrizzle_st *)fn_arg;
+  gearman_return_t ret;
   char *query;
   size_t query_size;
 
   GEARMAN_DEBUG(gearman, "libdrizzle add: %.*s", (uint32_t)unique_size,
                 (char *)unique)
 
-  /* This is not used currently, it will be once batch writes are supported
-     inside of the Gearman job server. */
-#if 0
-  if (!not started)
-  {
-    if (_query(drizzle, "BEGIN", 5) != DRIZZLE_RETURN_OK)
-      return REPQ_RETURN_EXTERNAL;
-
-    drizzle_result_free(&(drizzle->result));
-  }
-#endif
-
+  /* Jobs are collected into one multi-row INSERT that is sent on flush, or
+     early if it grows too large for a single packet. */
   query_size= ((unique_size + function_name_size + data_size) * 2) +
               GEARMAN_QUEUE_QUERY_BUFFER;
-  if (query_size > queue->query_size)
+  if (queue->query_length > 0 &&
+      queue->query_length + query_size > GEARMAN_QUEUE_LIBDRIZZLE_BATCH_SIZE)
   {
-    query= realloc(queue->query, query_size);
-    if (query == NULL)
-    {
-      GEARMAN_ERROR_SET(gearman, "_libdrizzle_add", "realloc")
-      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
+    ret= _libdrizzle_add_send(gearman, queue);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  ret= _libdrizzle_reserve(gearman, &(queue->query), &(queue->query_size),
+                           queue->query_length + query_size);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
 
-    queue->query= query;
-    queue->query_size= query_size;
+  query= queue->query + queue->query_length;
+
+  if (queue->query_length == 0)
+  {
+    query_size= (size_t)snprintf(query, query_size,
+                                 "INSERT INTO %s "
+                                 "(priority,unique_key,function_name,data,"
+                                 "when_to_run) VALUES(%u,'", queue->table,
+                                 (uint32_t)priority);
   }
   else
-    query= queue->query;
-
-  query_size= (size_t)snprintf(query, query_size,
-                               "INSERT INTO %s SET priority=%u,unique_key='",
-                               queue->table, (uint32_t)priority);
+  {
+    query_size= (size_t)snprintf(query, query_size, ",(%u,'",
+                                 (uint32_t)priority);
+  }
 
   query_size+= (size_t)drizzle_escape_string(query + query_size, unique,
                                              unique_size);
-  memcpy(query + query_size, "',function_name='", 17);
-  query_size+= 17;
+  memcpy(query + query_size, "','", 3);
+  query_size+= 3;
 
   query_size+= (size_t)drizzle_escape_string(query + query_size, function_name,
                                              function_name_size);
-  memcpy(query + query_size, "',data='", 8);
-  query_size+= 8;
+  memcpy(query + query_size, "','", 3);
+  query_size+= 3;
 
   query_size+= (size_t)drizzle_escape_string(query + query_size, data,
                                              data_size);
-  memcpy(query + query_size, "'", 1);
-  query_size+= 1;
+  query_size+= (size_t)snprintf(query + query_size, GEARMAN_QUEUE_QUERY_BUFFER,
+                                "',%"PRId64")", when);
 
-  if (_libdrizzle_query(gearman, queue, query, query_size) != DRIZZLE_RETURN_OK)
-    return GEARMAN_QUEUE_ERROR;
-
-  drizzle_result_free(&(queue->result));
+  queue->query_length+= query_size;
 
   return GEARMAN_SUCCESS;
 }
 
-static gearman_return_t _libdrizzle_flush(gearman_st *gearman,
-                                          void *fn_arg __attribute__((unused)))
+static gearman_return_t _libdrizzle_flush(gearman_st *gearman, void *fn_arg)
 {
+  gearman_queue_libdrizzle_st *queue= (gearman_queue_libdrizzle_st *)fn_arg;
+
   GEARMAN_DEBUG(gearman, "libdrizzle flush")
 
-  return GEARMAN_SUCCESS;
+  /* Remove done jobs first, in case one of them was added again under the
+     same unique key. A failed delete only means the job runs again after a
+     restart, so it does not fail the adds. */
+  if (queue->done_query_length > 0)
+    (void)_libdrizzle_done_send(gearman, queue);
+
+  if (queue->query_length == 0)
+    return GEARMAN_SUCCESS;
+
+  return _libdrizzle_add_send(gearman, queue);
 }
 
 static gearman_return_t _libdrizzle_done(gearman_st *gearman, void *fn_arg,
@@ -398,6 +545,7 @@ static gearman_return_t _libdrizzle_done(gearman_st *gearman, void *fn_arg,
                                          size_t function_name_size __attribute__((unused)))
 {
   gearman_queue_libdrizzle_st *queue= (gearman_queue_libdrizzle_st *)fn_arg;
+  gearman_return_t ret;
   char *query;
   size_t query_size;
 
@@ -405,36 +553,48 @@ static gearman_return_t _libdrizzle_done(gearman_st *gearman, void *fn_arg,
                 (char *)unique)
 
   query_size= (unique_size * 2) + GEARMAN_QUEUE_QUERY_BUFFER;
-  if (query_size > queue->query_size)
+  if (queue->done_query_length > 0 &&
+      queue->done_query_length + query_size >
+      GEARMAN_QUEUE_LIBDRIZZLE_BATCH_SIZE)
   {
-    query= realloc(queue->query, query_size);
-    if (query == NULL)
-    {
-      GEARMAN_ERROR_SET(gearman, "_libdrizzle_add", "realloc")
-      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
+    ret= _libdrizzle_done_send(gearman, queue);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  ret= _libdrizzle_reserve(gearman, &(queue->done_query),
+                           &(queue->done_query_size),
+                           queue->done_query_length + query_size);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
 
-    queue->query= query;
-    queue->query_size= query_size;
+  query= queue->done_query + queue->done_query_length;
+
+  if (queue->done_query_length == 0)
+  {
+    query_size= (size_t)snprintf(query, query_size,
+                                 "DELETE FROM %s WHERE unique_key IN('",
+                                 queue->table);
   }
   else
-    query= queue->query;
-
-  query_size= (size_t)snprintf(query, query_size,
-                               "DELETE FROM %s WHERE unique_key='",
-                               queue->table);
+  {
+    memcpy(query, ",'", 2);
+    query_size= 2;
+  }
 
   query_size+= (size_t)drizzle_escape_string(query + query_size, unique,
                                              unique_size);
   memcpy(query + query_size, "'", 1);
   query_size+= 1;
 
-  if (_libdrizzle_query(gearman, queue, query, query_size) != DRIZZLE_RETURN_OK)
-    return GEARMAN_QUEUE_ERROR;
+  queue->done_query_length+= query_size;
 
-  drizzle_result_free(&(queue->result));
+  /* Done jobs only wait for the flush of adds already pending, since
+     nothing else is sure to flush them. */
+  if (queue->query_length > 0)
+    return GEARMAN_SUCCESS;
 
-  return GEARMAN_SUCCESS;
+  return _libdrizzle_done_send(gearman, queue);
 }
 
 static gearman_return_t _libdrizzle_replay(gearman_st *gearman, void *fn_arg,
@@ -442,7 +602,7 @@ static gearman_return_t _libdrizzle_replay(gearman_st *gearman, void *fn_arg,
                                            void *add_fn_arg)
 {
   gearman_queue_libdrizzle_st *queue= (gearman_queue_libdrizzle_st *)fn_arg;
-  char *query;
+  char query[GEARMAN_QUEUE_QUERY_BUFFER];
   size_t query_size;
   drizzle_return_t ret;
   drizzle_row_t row;
@@ -451,26 +611,13 @@ static gearman_return_t _libdrizzle_replay(gearman_st *gearman, void *fn_arg,
 
   GEARMAN_INFO(gearman, "libdrizzle replay start")
 
-  if (GEARMAN_QUEUE_QUERY_BUFFER > queue->query_size)
-  {
-    query= realloc(queue->query, GEARMAN_QUEUE_QUERY_BUFFER);
-    if (query == NULL)
-    {
-      GEARMAN_ERROR_SET(gearman, "_libdrizzle_add", "realloc")
-      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
-
-    queue->query= query;
-    queue->query_size= GEARMAN_QUEUE_QUERY_BUFFER;
-  }
-  else
-    query= queue->query;
-
   query_size= (size_t)snprintf(query, GEARMAN_QUEUE_QUERY_BUFFER,
-                               "SELECT unique_key,function_name,priority,data "
-                               "FROM %s",
+                               "SELECT unique_key,function_name,priority,data,"
+                               "when_to_run FROM %s",
                                queue->table);
 
+  /* Rows are read off the connection one at a time as they are replayed,
+     rather than buffering the whole result first. */
   if (_libdrizzle_query(gearman, queue, query, query_size) != DRIZZLE_RETURN_OK)
     return GEARMAN_QUEUE_ERROR;
 
@@ -499,10 +646,12 @@ static gearman_return_t _libdrizzle_replay(gearman_st *gearman, void *fn_arg,
     field_sizes= drizzle_row_field_sizes(&(queue->result));
 
     GEARMAN_DEBUG(gearman, "libdrizzle replay: %.*s", (uint32_t)field_sizes[0],
-                  row[1])
+                  row[0])
 
+    /* Rows from before the column was added have no time to run at. */
     gret= (*add_fn)(gearman, add_fn_arg, row[0], field_sizes[0], row[1],
-                    field_sizes[1], row[3], field_sizes[3], atoi(row[2]));
+                    field_sizes[1], row[3], field_sizes[3], atoi(row[2]),
+                    row[4] == NULL ? 0 : (int64_t)strtoll(row[4], NULL, 10));
     if (gret != GEARMAN_SUCCESS)
     {
       drizzle_row_free(&(queue->result), row);
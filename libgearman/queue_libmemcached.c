@@ -26,6 +26,26 @@
  * Default values.
  */
 #define GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX "gear_"
+#define GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_BLOCK 1024
+#define GEARMAN_QUEUE_LIBMEMCACHED_REPLAY_KEYS 256
+
+/**
+ * Jobs are indexed by sequence number so replay can find them with
+ * multiget. The index key for a job holds its function name and unique key,
+ * and replay reads the index between the low and sequence counters.
+ */
+#define GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_KEY \
+  GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX "seq"
+#define GEARMAN_QUEUE_LIBMEMCACHED_LOW_KEY \
+  GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX "low"
+#define GEARMAN_QUEUE_LIBMEMCACHED_INDEX_PREFIX \
+  GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX "idx_"
+
+/**
+ * The flags of a job hold its priority. Jobs to run later also have this
+ * flag set, and the time to run at before their workload.
+ */
+#define GEARMAN_QUEUE_LIBMEMCACHED_FLAG_WHEN 0x100
 
 /*
  * Private declarations
@@ -37,8 +57,59 @@
 typedef struct
 {
   memcached_st memc;
+  memcached_st memc_sync;
+  uint64_t sequence;
+  uint64_t sequence_last;
+  uint32_t pending;
 } gearman_queue_libmemcached_st;
 
+/**
+ * One index entry being replayed.
+ */
+typedef struct
+{
+  uint64_t sequence;
+  bool indexed;
+  char index_key[MEMCACHED_MAX_KEY];
+  size_t index_key_length;
+  char job_key[MEMCACHED_MAX_KEY];
+  size_t job_key_length;
+  char value[MEMCACHED_MAX_KEY * 2];
+  size_t function_name_size;
+  size_t unique_size;
+} gearman_queue_libmemcached_replay_st;
+
+/**
+ * Build the key a job is stored under.
+ */
+static size_t _libmemcached_key(char *key, const void *unique,
+                                size_t unique_size, const void *function_name,
+                                size_t function_name_size);
+
+/**
+ * Read one of the index counters, 0 if it is not set.
+ */
+static gearman_return_t _libmemcached_counter(gearman_st *gearman,
+                                         gearman_queue_libmemcached_st *queue,
+                                         const char *key, uint64_t *value);
+
+/**
+ * Add an index entry for a job.
+ */
+static gearman_return_t _libmemcached_index(gearman_st *gearman,
+                                         gearman_queue_libmemcached_st *queue,
+                                         const char *value, size_t value_size);
+
+/**
+ * Replay the jobs for a chunk of index entries.
+ */
+static gearman_return_t _libmemcached_replay_chunk(gearman_st *gearman,
+                                         gearman_queue_libmemcached_st *queue,
+                                         gearman_queue_libmemcached_replay_st *entries,
+                                         uint32_t count,
+                                         gearman_queue_add_fn *add_fn,
+                                         void *add_fn_arg);
+
 /* Queue callback functions. */
 static gearman_return_t _libmemcached_add(gearman_st *gearman, void *fn_arg,
                                           const void *unique,
@@ -46,7 +117,8 @@ static gearman_return_t _libmemcached_add(gearman_st *gearman, void *fn_arg,
                                           const void *function_name,
                                           size_t function_name_size,
                                           const void *data, size_t data_size,
-                                          gearman_job_priority_t priority);
+                                          gearman_job_priority_t priority,
+                                          int64_t when);
 static gearman_return_t _libmemcached_flush(gearman_st *gearman, void *fn_arg);
 static gearman_return_t _libmemcached_done(gearman_st *gearman, void *fn_arg,
                                            const void *unique,
@@ -149,6 +221,30 @@ gearman_return_t gearman_queue_libmemcached_init(gearman_st *gearman,
   memcached_server_push(&queue->memc, servers);
   memcached_server_list_free(servers);
 
+  /* Counters and replay need replies, so they go through a clone made
+     before job writes are switched to noreply. */
+  (void)memcached_behavior_set(&(queue->memc),
+                               MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+  if (memcached_clone(&(queue->memc_sync), &(queue->memc)) == NULL)
+  {
+    memcached_free(&(queue->memc));
+    free(queue);
+    GEARMAN_ERROR_SET(gearman, "gearman_queue_libmemcached_init",
+                      "memcached_clone")
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  (void)memcached_behavior_set(&(queue->memc), MEMCACHED_BEHAVIOR_NOREPLY, 1);
+  (void)memcached_behavior_set(&(queue->memc),
+                               MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, 1);
+
+  /* Increment needs the counter to exist, so this fails harmlessly once it
+     does. */
+  (void)memcached_add(&(queue->memc_sync),
+                      GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_KEY,
+                      strlen(GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_KEY), "0", 1,
+                      0, 0);
+
   gearman_set_queue_fn_arg(gearman, queue);
 
   gearman_set_queue_add(gearman, _libmemcached_add);
@@ -167,6 +263,8 @@ gearman_return_t gearman_queue_libmemcached_deinit(gearman_st *gearman)
 
   queue= (gearman_queue_libmemcached_st *)gearman_queue_fn_arg(gearman);
   gearman_set_queue_fn_arg(gearman, NULL);
+  (void)memcached_flush_buffers(&(queue->memc));
+  memcached_free(&(queue->memc_sync));
   memcached_free(&(queue->memc));
 
   free(queue);
@@ -189,41 +287,193 @@ gearman_return_t gearmand_queue_libmemcached_deinit(gearmand_st *gearmand)
  * Private definitions
  */
 
+static size_t _libmemcached_key(char *key, const void *unique,
+                                size_t unique_size, const void *function_name,
+                                size_t function_name_size)
+{
+  int key_length;
+
+  key_length= snprintf(key, MEMCACHED_MAX_KEY, "%s%.*s-%.*s",
+                       GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX,
+                       (int)function_name_size, (const char *)function_name,
+                       (int)unique_size, (const char *)unique);
+  if (key_length >= MEMCACHED_MAX_KEY)
+    return MEMCACHED_MAX_KEY - 1;
+
+  return (size_t)key_length;
+}
+
+static gearman_return_t _libmemcached_counter(gearman_st *gearman,
+                                         gearman_queue_libmemcached_st *queue,
+                                         const char *key, uint64_t *value)
+{
+  memcached_return rc;
+  char *result;
+  size_t result_length;
+  uint32_t flags;
+  size_t x;
+
+  result= memcached_get(&(queue->memc_sync), key, strlen(key), &result_length,
+                        &flags, &rc);
+  if (result == NULL)
+  {
+    if (rc == MEMCACHED_NOTFOUND)
+    {
+      *value= 0;
+      return GEARMAN_SUCCESS;
+    }
+
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_counter", "memcached_get:%s",
+                      memcached_strerror(&(queue->memc_sync), rc))
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  /* Counters are stored as text, and the value is not terminated. */
+  *value= 0;
+  for (x= 0; x < result_length && result[x] >= '0' && result[x] <= '9'; x++)
+    *value= (*value * 10) + (uint64_t)(result[x] - '0');
+
+  free(result);
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _libmemcached_index(gearman_st *gearman,
+                                         gearman_queue_libmemcached_st *queue,
+                                         const char *value, size_t value_size)
+{
+  memcached_return rc;
+  char key[MEMCACHED_MAX_KEY];
+  size_t key_length;
+  uint64_t sequence;
+
+  /* Sequence numbers are reserved a block at a time, so most adds don't
+     wait on the counter. */
+  if (queue->sequence == 0 || queue->sequence > queue->sequence_last)
+  {
+    rc= memcached_increment(&(queue->memc_sync),
+                            GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_KEY,
+                            strlen(GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_KEY),
+                            GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_BLOCK,
+                            &sequence);
+    if (rc != MEMCACHED_SUCCESS)
+    {
+      GEARMAN_ERROR_SET(gearman, "_libmemcached_index",
+                        "memcached_increment:%s",
+                        memcached_strerror(&(queue->memc_sync), rc))
+      return GEARMAN_QUEUE_ERROR;
+    }
+
+    queue->sequence= sequence - GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_BLOCK + 1;
+    queue->sequence_last= sequence;
+  }
+
+  key_length= (size_t)snprintf(key, MEMCACHED_MAX_KEY, "%s%" PRIu64,
+                               GEARMAN_QUEUE_LIBMEMCACHED_INDEX_PREFIX,
+                               queue->sequence);
+  queue->sequence++;
+
+  rc= memcached_set(&(queue->memc), key, key_length, value, value_size, 0, 0);
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_index", "memcached_set:%s",
+                      memcached_strerror(&(queue->memc), rc))
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
 static gearman_return_t _libmemcached_add(gearman_st *gearman, void *fn_arg,
                                           const void *unique,
                                           size_t unique_size,
                                           const void *function_name,
                                           size_t function_name_size,
                                           const void *data, size_t data_size,
-                                          gearman_job_priority_t priority)
+                                          gearman_job_priority_t priority,
+                                          int64_t when)
 {
   gearman_queue_libmemcached_st *queue= (gearman_queue_libmemcached_st *)fn_arg;
   memcached_return rc;
   char key[MEMCACHED_MAX_KEY];
   size_t key_length;
+  char value[MEMCACHED_MAX_KEY * 2];
+  uint32_t flags= (uint32_t)priority;
+  uint8_t *buffer= NULL;
+  uint32_t tmp;
 
   GEARMAN_DEBUG(gearman, "libmemcached add: %.*s", (uint32_t)unique_size, (char *)unique);
 
-  key_length= (size_t)snprintf(key, MEMCACHED_MAX_KEY, "%s%.*s-%.*s",
-                               GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX,
-                               (int)function_name_size,
-                               (const char *)function_name, (int)unique_size,
-                               (const char *)unique);  
+  if (function_name_size + unique_size + 1 > sizeof(value))
+  {
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_add", "key too long")
+    return GEARMAN_QUEUE_ERROR;
+  }
 
-  rc= memcached_set(&queue->memc, (const char *)key, key_length,
-                    (const char *)data, data_size, 0, (uint32_t)priority);
+  key_length= _libmemcached_key(key, unique, unique_size, function_name,
+                                function_name_size);
 
-  if (rc != MEMCACHED_SUCCESS)
+  if (when != 0)
+  {
+    buffer= malloc(data_size + 8);
+    if (buffer == NULL)
+    {
+      GEARMAN_ERROR_SET(gearman, "_libmemcached_add", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    tmp= htonl((uint32_t)((uint64_t)when >> 32));
+    memcpy(buffer, &tmp, 4);
+    tmp= htonl((uint32_t)when);
+    memcpy(buffer + 4, &tmp, 4);
+    if (data_size > 0)
+      memcpy(buffer + 8, data, data_size);
+
+    data= buffer;
+    data_size+= 8;
+    flags|= GEARMAN_QUEUE_LIBMEMCACHED_FLAG_WHEN;
+  }
+
+  /* Writes are buffered until flush, and the servers don't reply to them. */
+  rc= memcached_set(&queue->memc, (const char *)key, key_length,
+                    (const char *)data, data_size, 0, flags);
+  if (buffer != NULL)
+    free(buffer);
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_add", "memcached_set:%s",
+                      memcached_strerror(&(queue->memc), rc))
     return GEARMAN_QUEUE_ERROR;
+  }
 
-  return GEARMAN_SUCCESS;
+  memcpy(value, function_name, function_name_size);
+  value[function_name_size]= 0;
+  memcpy(value + function_name_size + 1, unique, unique_size);
+
+  queue->pending++;
+
+  return _libmemcached_index(gearman, queue, value,
+                             function_name_size + 1 + unique_size);
 }
 
-static gearman_return_t _libmemcached_flush(gearman_st *gearman,
-                                           void *fn_arg __attribute__((unused)))
+static gearman_return_t _libmemcached_flush(gearman_st *gearman, void *fn_arg)
 {
+  gearman_queue_libmemcached_st *queue= (gearman_queue_libmemcached_st *)fn_arg;
+  memcached_return rc;
+
   GEARMAN_DEBUG(gearman, "libmemcached flush");
 
+  queue->pending= 0;
+
+  rc= memcached_flush_buffers(&(queue->memc));
+  if (rc != MEMCACHED_SUCCESS)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_flush",
+                      "memcached_flush_buffers:%s",
+                      memcached_strerror(&(queue->memc), rc))
+    return GEARMAN_QUEUE_ERROR;
+  }
+
   return GEARMAN_SUCCESS;
 }
 
@@ -240,113 +490,299 @@ static gearman_return_t _libmemcached_done(gearman_st *gearman, void *fn_arg,
 
   GEARMAN_DEBUG(gearman, "libmemcached done: %.*s", (uint32_t)unique_size, (char *)unique);
 
-  key_length= (size_t)snprintf(key, MEMCACHED_MAX_KEY, "%s%.*s-%.*s",
-                               GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX,
-                               (int)function_name_size,
-                               (const char *)function_name, (int)unique_size,
-                               (const char *)unique);  
+  key_length= _libmemcached_key(key, unique, unique_size, function_name,
+                                function_name_size);
 
-  /* For the moment we will assume it happened */
+  /* The index entry is left for replay to clean up. */
   rc= memcached_delete(&queue->memc, (const char *)key, key_length, 0);
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED)
+    return GEARMAN_QUEUE_ERROR;
+
+  /* Nothing flushes after a done job, so send it unless adds are waiting
+     for their own flush. */
+  if (queue->pending > 0)
+    return GEARMAN_SUCCESS;
 
+  rc= memcached_flush_buffers(&(queue->memc));
   if (rc != MEMCACHED_SUCCESS)
     return GEARMAN_QUEUE_ERROR;
 
   return GEARMAN_SUCCESS;
 }
 
-struct replay_context
-{
-  memcached_st clone;
-  gearman_st *gearman;
-  gearman_queue_add_fn *add_fn;
-  void *add_fn_arg;
-};
-
-static memcached_return callback_loader(memcached_st *ptr __attribute__((unused)), 
-                                        memcached_result_st *result __attribute__((unused)), 
-                                        void *context)
+static gearman_return_t _libmemcached_replay_chunk(gearman_st *gearman,
+                                         gearman_queue_libmemcached_st *queue,
+                                         gearman_queue_libmemcached_replay_st *entries,
+                                         uint32_t count,
+                                         gearman_queue_add_fn *add_fn,
+                                         void *add_fn_arg)
 {
-  struct replay_context *container= (struct replay_context *)context;
-  char *unique;
-  char *function;
-  size_t unique_len;
-
-  unique= memcached_result_key_value(result);
-
-  if (strcmp(unique, GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX))
-    return MEMCACHED_SUCCESS;
+  gearman_queue_libmemcached_replay_st *entry;
+  char *keys[GEARMAN_QUEUE_LIBMEMCACHED_REPLAY_KEYS];
+  size_t key_lengths[GEARMAN_QUEUE_LIBMEMCACHED_REPLAY_KEYS];
+  memcached_result_st result;
+  memcached_return rc;
+  gearman_return_t ret= GEARMAN_SUCCESS;
+  uint32_t job_count= 0;
+  uint32_t x;
+  size_t length;
+  const uint8_t *value;
+  uint32_t flags;
+  uint32_t tmp;
+  int64_t when;
+  void *data;
+
+  for (x= 0; x < count; x++)
+  {
+    keys[x]= entries[x].index_key;
+    key_lengths[x]= entries[x].index_key_length;
+  }
 
-  unique+=strlen(GEARMAN_QUEUE_LIBMEMCACHED_DEFAULT_PREFIX);
+  if (memcached_result_create(&(queue->memc_sync), &result) == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_replay_chunk",
+                      "memcached_result_create")
+    return GEARMAN_QUEUE_ERROR;
+  }
 
-  function= index(unique, '-');
-  unique_len= (size_t)(function - unique);
-  function++;
+  /* First fetch the index entries, which name the jobs. */
+  rc= memcached_mget(&(queue->memc_sync), keys, key_lengths, count);
+  if (rc != MEMCACHED_SUCCESS)
+  {
+    memcached_result_free(&result);
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_replay_chunk",
+                      "memcached_mget:%s",
+                      memcached_strerror(&(queue->memc_sync), rc))
+    return GEARMAN_QUEUE_ERROR;
+  }
 
-  assert(unique);
-  assert(unique_len);
-  assert(function);
-  assert(strlen(function));
-  /* Currently not looking at failure cases */
-  (void)(*container->add_fn)(container->gearman, container->add_fn_arg, 
-                             unique, unique_len, 
-                             function, strlen(function), 
-                             memcached_result_value(result), memcached_result_length(result),
-                             memcached_result_flags(result));
+  while (memcached_fetch_result(&(queue->memc_sync), &result, &rc) != NULL)
+  {
+    for (x= 0; x < count; x++)
+    {
+      entry= &(entries[x]);
+      if (entry->indexed ||
+          entry->index_key_length != memcached_result_key_length(&result) ||
+          memcmp(entry->index_key, memcached_result_key_value(&result),
+                 entry->index_key_length))
+      {
+        continue;
+      }
+
+      length= memcached_result_length(&result);
+      if (length > sizeof(entry->value))
+        break;
+
+      memcpy(entry->value, memcached_result_value(&result), length);
+      entry->function_name_size= strnlen(entry->value, length);
+      if (entry->function_name_size == length)
+        break;
+
+      entry->unique_size= length - entry->function_name_size - 1;
+      entry->job_key_length= _libmemcached_key(entry->job_key,
+                                               entry->value +
+                                               entry->function_name_size + 1,
+                                               entry->unique_size,
+                                               entry->value,
+                                               entry->function_name_size);
+      entry->indexed= true;
+
+      keys[job_count]= entry->job_key;
+      key_lengths[job_count]= entry->job_key_length;
+      job_count++;
+      break;
+    }
+  }
 
+  /* Then fetch the jobs that are left. Done jobs are simply missing. */
+  if (job_count > 0)
+  {
+    rc= memcached_mget(&(queue->memc_sync), keys, key_lengths, job_count);
+    if (rc != MEMCACHED_SUCCESS)
+    {
+      memcached_result_free(&result);
+      GEARMAN_ERROR_SET(gearman, "_libmemcached_replay_chunk",
+                        "memcached_mget:%s",
+                        memcached_strerror(&(queue->memc_sync), rc))
+      return GEARMAN_QUEUE_ERROR;
+    }
+  }
 
-  return MEMCACHED_SUCCESS;
-}
+  while (job_count > 0 &&
+         memcached_fetch_result(&(queue->memc_sync), &result, &rc) != NULL)
+  {
+    if (ret != GEARMAN_SUCCESS)
+      continue;
 
-/* Grab the object and load it into the loader */
-static memcached_return callback_for_key(memcached_st *ptr __attribute__((unused)),  
-                                         const char *key, size_t key_length,
-                                         void *context)
-{
-  memcached_return rc;
-  struct replay_context *container= (struct replay_context *)context;
-  memcached_execute_function callbacks[1];
-  char *passable[1];
+    for (x= 0; x < count; x++)
+    {
+      entry= &(entries[x]);
+      if (!(entry->indexed) ||
+          entry->job_key_length != memcached_result_key_length(&result) ||
+          memcmp(entry->job_key, memcached_result_key_value(&result),
+                 entry->job_key_length))
+      {
+        continue;
+      }
+
+      GEARMAN_DEBUG(gearman, "libmemcached replay: %.*s",
+                    (uint32_t)entry->unique_size,
+                    entry->value + entry->function_name_size + 1)
+
+      length= memcached_result_length(&result);
+      value= (const uint8_t *)memcached_result_value(&result);
+      flags= memcached_result_flags(&result);
+      when= 0;
+      if (flags & GEARMAN_QUEUE_LIBMEMCACHED_FLAG_WHEN)
+      {
+        if (length < 8)
+          break;
+
+        memcpy(&tmp, value, 4);
+        when= (int64_t)((uint64_t)ntohl(tmp) << 32);
+        memcpy(&tmp, value + 4, 4);
+        when|= (int64_t)ntohl(tmp);
+        value+= 8;
+        length-= 8;
+      }
+
+      if (length == 0)
+        data= NULL;
+      else
+      {
+        data= malloc(length);
+        if (data == NULL)
+        {
+          GEARMAN_ERROR_SET(gearman, "_libmemcached_replay_chunk", "malloc")
+          ret= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+          break;
+        }
+
+        memcpy(data, value, length);
+      }
+
+      ret= (*add_fn)(gearman, add_fn_arg,
+                     entry->value + entry->function_name_size + 1,
+                     entry->unique_size, entry->value,
+                     entry->function_name_size, data, length,
+                     (gearman_job_priority_t)(flags &
+                                   ~GEARMAN_QUEUE_LIBMEMCACHED_FLAG_WHEN),
+                     when);
+      if (ret != GEARMAN_SUCCESS)
+        break;
+
+      /* Move live jobs past the range being replayed, so the next replay
+         starts after it. */
+      ret= _libmemcached_index(gearman, queue, entry->value,
+                               entry->function_name_size + 1 +
+                               entry->unique_size);
+      break;
+    }
+  }
 
-  callbacks[0]= &callback_loader;
-  
-  passable[0]= (char *)key;
-  rc= memcached_mget(&container->clone, passable, &key_length, 1);
+  memcached_result_free(&result);
 
-  /* Just void errors for the moment, since other treads might have picked up the object. */
-  (void)memcached_fetch_execute(&container->clone, callbacks, context, 1);
+  for (x= 0; x < count; x++)
+  {
+    if (entries[x].indexed)
+    {
+      (void)memcached_delete(&(queue->memc), entries[x].index_key,
+                             entries[x].index_key_length, 0);
+    }
+  }
 
-  return MEMCACHED_SUCCESS;
+  return ret;
 }
 
 /*
-  If we have any failures for loading values back into replay we just ignore them.
+  Replay reads the index a chunk at a time with multiget. Jobs that were
+  evicted or lost with a server are skipped.
 */
 static gearman_return_t _libmemcached_replay(gearman_st *gearman, void *fn_arg,
                                              gearman_queue_add_fn *add_fn,
                                              void *add_fn_arg)
 {
   gearman_queue_libmemcached_st *queue= (gearman_queue_libmemcached_st *)fn_arg;
-  struct replay_context context;
-  memcached_st *check_for_failure;
-  memcached_dump_func callbacks[1];
-
-  callbacks[0]= &callback_for_key;
+  gearman_queue_libmemcached_replay_st *entries;
+  gearman_return_t ret;
+  memcached_return rc;
+  uint64_t low;
+  uint64_t high;
+  uint64_t sequence;
+  uint32_t count= 0;
+  char value[32];
+  size_t value_length;
 
   GEARMAN_INFO(gearman, "libmemcached replay start");
 
-  memset(&context, 0, sizeof(struct replay_context));
-  check_for_failure= memcached_clone(&context.clone, &queue->memc);
-  context.gearman= gearman;
-  context.add_fn= add_fn;
-  context.add_fn_arg= add_fn_arg;
+  ret= _libmemcached_counter(gearman, queue, GEARMAN_QUEUE_LIBMEMCACHED_LOW_KEY,
+                             &low);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  ret= _libmemcached_counter(gearman, queue,
+                             GEARMAN_QUEUE_LIBMEMCACHED_SEQUENCE_KEY, &high);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
 
-  assert(check_for_failure);
+  if (low >= high)
+    return GEARMAN_SUCCESS;
 
+  entries= malloc(sizeof(gearman_queue_libmemcached_replay_st) *
+                  GEARMAN_QUEUE_LIBMEMCACHED_REPLAY_KEYS);
+  if (entries == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_replay", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  for (sequence= low + 1; sequence <= high; sequence++)
+  {
+    entries[count].sequence= sequence;
+    entries[count].indexed= false;
+    entries[count].index_key_length=
+      (size_t)snprintf(entries[count].index_key, MEMCACHED_MAX_KEY,
+                       "%s%" PRIu64, GEARMAN_QUEUE_LIBMEMCACHED_INDEX_PREFIX,
+                       sequence);
+    count++;
+
+    if (count == GEARMAN_QUEUE_LIBMEMCACHED_REPLAY_KEYS || sequence == high)
+    {
+      ret= _libmemcached_replay_chunk(gearman, queue, entries, count, add_fn,
+                                      add_fn_arg);
+      if (ret != GEARMAN_SUCCESS)
+        break;
+
+      count= 0;
+    }
+  }
+
+  free(entries);
 
-  (void)memcached_dump(&queue->memc, callbacks, (void *)&context, 1);
+  /* The new index entries have to be stored before the range they replace
+     is dropped. */
+  rc= memcached_flush_buffers(&(queue->memc));
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
 
-  memcached_free(&context.clone);
+  if (rc != MEMCACHED_SUCCESS)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_replay",
+                      "memcached_flush_buffers:%s",
+                      memcached_strerror(&(queue->memc), rc))
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  value_length= (size_t)snprintf(value, sizeof(value), "%" PRIu64, high);
+  rc= memcached_set(&(queue->memc_sync), GEARMAN_QUEUE_LIBMEMCACHED_LOW_KEY,
+                    strlen(GEARMAN_QUEUE_LIBMEMCACHED_LOW_KEY), value,
+                    value_length, 0, 0);
+  if (rc != MEMCACHED_SUCCESS)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libmemcached_replay", "memcached_set:%s",
+                      memcached_strerror(&(queue->memc_sync), rc))
+    return GEARMAN_QUEUE_ERROR;
+  }
 
   return GEARMAN_SUCCESS;
 }
@@ -28,6 +28,13 @@
  */
 #define GEARMAN_QUEUE_LIBPQ_DEFAULT_TABLE "queue"
 #define GEARMAN_QUEUE_QUERY_BUFFER 256
+#define GEARMAN_QUEUE_LIBPQ_REPLAY_ROWS "1000"
+
+/**
+ * Names of the statements prepared on the server.
+ */
+#define GEARMAN_QUEUE_LIBPQ_ADD "gearman_queue_add"
+#define GEARMAN_QUEUE_LIBPQ_DONE "gearman_queue_done"
 
 /*
  * Private declarations
@@ -40,8 +47,9 @@ typedef struct
 {
   PGconn *con;
   char table[NAMEDATALEN];
-  char *query;
-  size_t query_size;
+  bool in_transaction;
+  bool transaction_failed;
+  uint32_t result_count;
 } gearman_queue_libpq_st;
 
 /**
@@ -49,13 +57,56 @@ typedef struct
  */
 static void _libpq_notice_processor(void *arg, const char *message);
 
+/**
+ * Run a command that returns no rows.
+ */
+static gearman_return_t _libpq_exec(gearman_st *gearman,
+                                    gearman_queue_libpq_st *queue,
+                                    const char *query);
+
+/**
+ * Prepare a statement on the server for the life of the connection.
+ */
+static gearman_return_t _libpq_prepare(gearman_st *gearman,
+                                       gearman_queue_libpq_st *queue,
+                                       const char *name, const char *query,
+                                       int param_count);
+
+/**
+ * Run a prepared statement. In pipeline mode this only sends it, and the
+ * result is read later by _libpq_results.
+ */
+static gearman_return_t _libpq_send(gearman_st *gearman,
+                                    gearman_queue_libpq_st *queue,
+                                    const char *name, int param_count,
+                                    const char *const *param_values,
+                                    const int *param_lengths,
+                                    const int *param_formats);
+
+#ifdef LIBPQ_HAS_PIPELINING
+/**
+ * End the statements sent so far, which the server runs as one implicit
+ * transaction, and optionally wait for all results.
+ */
+static gearman_return_t _libpq_sync(gearman_st *gearman,
+                                    gearman_queue_libpq_st *queue, bool wait);
+
+/**
+ * Read pipeline results, either all of them or only those already received.
+ * A failed statement marks the transaction failed.
+ */
+static void _libpq_results(gearman_st *gearman, gearman_queue_libpq_st *queue,
+                           bool wait);
+#endif
+
 /* Queue callback functions. */
 static gearman_return_t _libpq_add(gearman_st *gearman, void *fn_arg,
                                    const void *unique, size_t unique_size,
                                    const void *function_name,
                                    size_t function_name_size,
                                    const void *data, size_t data_size,
-                                   gearman_job_priority_t priority);
+                                   gearman_job_priority_t priority,
+                                   int64_t when);
 static gearman_return_t _libpq_flush(gearman_st *gearman, void *fn_arg);
 static gearman_return_t _libpq_done(gearman_st *gearman, void *fn_arg,
                                     const void *unique,
@@ -172,7 +223,8 @@ gearman_return_t gearman_queue_libpq_init(gearman_st *gearman,
                "unique_key VARCHAR(%d) PRIMARY KEY,"
                "function_name VARCHAR(255),"
                "priority INTEGER,"
-               "data BYTEA"
+               "data BYTEA,"
+               "when_to_run BIGINT"
              ")",
              queue->table, GEARMAN_UNIQUE_SIZE);
 
@@ -191,8 +243,38 @@ gearman_return_t gearman_queue_libpq_init(gearman_st *gearman,
     PQclear(result);
   }
   else
+  {
     PQclear(result);
 
+    /* Tables from before jobs could be scheduled don't have the column. */
+    snprintf(create, 1024,
+             "ALTER TABLE %s ADD COLUMN IF NOT EXISTS when_to_run BIGINT",
+             queue->table);
+    if (_libpq_exec(gearman, queue, create) != GEARMAN_SUCCESS)
+    {
+      gearman_queue_libpq_deinit(gearman);
+      return GEARMAN_QUEUE_ERROR;
+    }
+  }
+
+  snprintf(create, 1024,
+           "INSERT INTO %s (priority,unique_key,function_name,data,"
+           "when_to_run) VALUES($1,$2,$3,$4,$5)", queue->table);
+  if (_libpq_prepare(gearman, queue, GEARMAN_QUEUE_LIBPQ_ADD, create, 5) !=
+      GEARMAN_SUCCESS)
+  {
+    gearman_queue_libpq_deinit(gearman);
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  snprintf(create, 1024, "DELETE FROM %s WHERE unique_key=$1", queue->table);
+  if (_libpq_prepare(gearman, queue, GEARMAN_QUEUE_LIBPQ_DONE, create, 1) !=
+      GEARMAN_SUCCESS)
+  {
+    gearman_queue_libpq_deinit(gearman);
+    return GEARMAN_QUEUE_ERROR;
+  }
+
   gearman_set_queue_add(gearman, _libpq_add);
   gearman_set_queue_flush(gearman, _libpq_flush);
   gearman_set_queue_done(gearman, _libpq_done);
@@ -211,10 +293,14 @@ gearman_return_t gearman_queue_libpq_deinit(gearman_st *gearman)
   gearman_set_queue_fn_arg(gearman, NULL);
 
   if (queue->con != NULL)
+  {
+#ifdef LIBPQ_HAS_PIPELINING
+    /* Let done jobs still in the pipeline reach the server. */
+    if (queue->result_count > 0 && !(queue->in_transaction))
+      _libpq_results(gearman, queue, true);
+#endif
     PQfinish(queue->con);
-
-  if (queue->query != NULL)
-    free(queue->query);
+  }
 
   free(queue);
 
@@ -242,65 +328,88 @@ static void _libpq_notice_processor(void *arg, const char *message)
   GEARMAN_INFO(gearman, "PostgreSQL %s", message)
 }
 
-static gearman_return_t _libpq_add(gearman_st *gearman, void *fn_arg,
-                                        const void *unique, size_t unique_size,
-                                        const void *function_name,
-                                        size_t function_name_size,
-                                        const void *data, size_t data_size,
-                                        gearman_job_priority_t priority)
+static gearman_return_t _libpq_exec(gearman_st *gearman,
+                                    gearman_queue_libpq_st *queue,
+                                    const char *query)
 {
-  gearman_queue_libpq_st *queue= (gearman_queue_libpq_st *)fn_arg;
-  char *query;
-  size_t query_size;
   PGresult *result;
 
-  const char *param_values[3]= { (char *)unique,
-                                 (char *)function_name,
-                                 (char *)data };
-  int param_lengths[3]= { (int)unique_size,
-                          (int)function_name_size,
-                          (int)data_size };
-  int param_formats[3]= { 0, 0, 1 };
+  result= PQexec(queue->con, query);
+  if (result == NULL || PQresultStatus(result) != PGRES_COMMAND_OK)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libpq_exec", "PQexec:%s",
+                      PQerrorMessage(queue->con))
+    PQclear(result);
+    return GEARMAN_QUEUE_ERROR;
+  }
 
-  GEARMAN_DEBUG(gearman, "libpq add: %.*s", (uint32_t)unique_size,
-                (char *)unique)
+  PQclear(result);
 
-  /* This is not used currently, it will be once batch writes are supported
-     inside of the Gearman job server. */
-#if 0
-  if (!not started)
-  {
-    if (_query(pq, "BEGIN", 5) != PQ_RETURN_OK)
-      return REPQ_RETURN_EXTERNAL;
+  return GEARMAN_SUCCESS;
+}
 
-    pq_result_free(&(pq->result));
+static gearman_return_t _libpq_prepare(gearman_st *gearman,
+                                       gearman_queue_libpq_st *queue,
+                                       const char *name, const char *query,
+                                       int param_count)
+{
+  PGresult *result;
+
+  result= PQprepare(queue->con, name, query, param_count, NULL);
+  if (result == NULL || PQresultStatus(result) != PGRES_COMMAND_OK)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libpq_prepare", "PQprepare:%s",
+                      PQerrorMessage(queue->con))
+    PQclear(result);
+    return GEARMAN_QUEUE_ERROR;
   }
-#endif
 
-  query_size= GEARMAN_QUEUE_QUERY_BUFFER;
-  if (query_size > queue->query_size)
+  PQclear(result);
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _libpq_send(gearman_st *gearman,
+                                    gearman_queue_libpq_st *queue,
+                                    const char *name, int param_count,
+                                    const char *const *param_values,
+                                    const int *param_lengths,
+                                    const int *param_formats)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+  /* Replay reads rows the normal way, so the pipeline starts with the first
+     job after it. */
+  if (PQpipelineStatus(queue->con) == PQ_PIPELINE_OFF &&
+      PQenterPipelineMode(queue->con) != 1)
   {
-    query= realloc(queue->query, query_size);
-    if (query == NULL)
-    {
-      GEARMAN_ERROR_SET(gearman, "_libpq_add", "realloc")
-      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
+    GEARMAN_ERROR_SET(gearman, "_libpq_send", "PQenterPipelineMode:%s",
+                      PQerrorMessage(queue->con))
+    return GEARMAN_QUEUE_ERROR;
+  }
 
-    queue->query= query;
-    queue->query_size= query_size;
+  if (PQsendQueryPrepared(queue->con, name, param_count, param_values,
+                          param_lengths, param_formats, 0) != 1)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libpq_send", "PQsendQueryPrepared:%s",
+                      PQerrorMessage(queue->con))
+    return GEARMAN_QUEUE_ERROR;
   }
-  else
-    query= queue->query;
 
-  (void)snprintf(query, query_size,
-                 "INSERT INTO %s (priority,unique_key,function_name,data) "
-                 "VALUES(%u,$1,$2,$3)", queue->table, (uint32_t)priority);
-  result= PQexecParams(queue->con, query, 3, NULL, param_values, param_lengths,
-                       param_formats, 0);
+  queue->result_count++;
+
+  /* Keep up with results as they come in so neither side fills up its
+     socket buffer waiting on the other. */
+  _libpq_results(gearman, queue, false);
+
+  return GEARMAN_SUCCESS;
+#else
+  PGresult *result;
+
+  result= PQexecPrepared(queue->con, name, param_count, param_values,
+                         param_lengths, param_formats, 0);
   if (result == NULL || PQresultStatus(result) != PGRES_COMMAND_OK)
   {
-    GEARMAN_ERROR_SET(gearman, "_libpq_command", "PQexec:%s",
+    GEARMAN_ERROR_SET(gearman, "_libpq_send", "PQexecPrepared:%s",
                       PQerrorMessage(queue->con))
     PQclear(result);
     return GEARMAN_QUEUE_ERROR;
@@ -309,66 +418,216 @@ static gearman_return_t _libpq_add(gearman_st *gearman, void *fn_arg,
   PQclear(result);
 
   return GEARMAN_SUCCESS;
+#endif
 }
 
-static gearman_return_t _libpq_flush(gearman_st *gearman,
-                                     void *fn_arg __attribute__((unused)))
+#ifdef LIBPQ_HAS_PIPELINING
+static gearman_return_t _libpq_sync(gearman_st *gearman,
+                                    gearman_queue_libpq_st *queue, bool wait)
 {
-  GEARMAN_DEBUG(gearman, "libpq flush")
+  if (PQpipelineSync(queue->con) != 1)
+  {
+    GEARMAN_ERROR_SET(gearman, "_libpq_sync", "PQpipelineSync:%s",
+                      PQerrorMessage(queue->con))
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  queue->result_count++;
+
+  _libpq_results(gearman, queue, wait);
 
   return GEARMAN_SUCCESS;
 }
 
-static gearman_return_t _libpq_done(gearman_st *gearman, void *fn_arg,
-                                    const void *unique,
-                                    size_t unique_size,
-                                    const void *function_name __attribute__((unused)),
-                                    size_t function_name_size __attribute__((unused)))
+static void _libpq_results(gearman_st *gearman, gearman_queue_libpq_st *queue,
+                           bool wait)
 {
-  gearman_queue_libpq_st *queue= (gearman_queue_libpq_st *)fn_arg;
-  char *query;
-  size_t query_size;
   PGresult *result;
 
-  GEARMAN_DEBUG(gearman, "libpq done: %.*s", (uint32_t)unique_size,
+  while (queue->result_count > 0)
+  {
+    if (!wait &&
+        (PQconsumeInput(queue->con) != 1 || PQisBusy(queue->con)))
+    {
+      return;
+    }
+
+    /* Each statement's result is followed by a NULL, the sync's is not. */
+    result= PQgetResult(queue->con);
+    if (result == NULL)
+    {
+      if (PQstatus(queue->con) == CONNECTION_BAD)
+      {
+        GEARMAN_ERROR_SET(gearman, "_libpq_results", "PQgetResult:%s",
+                          PQerrorMessage(queue->con))
+        queue->result_count= 0;
+        queue->transaction_failed= true;
+        return;
+      }
+
+      continue;
+    }
+
+    switch (PQresultStatus(result))
+    {
+    case PGRES_COMMAND_OK:
+    case PGRES_PIPELINE_SYNC:
+      break;
+
+    case PGRES_PIPELINE_ABORTED:
+      queue->transaction_failed= true;
+      break;
+
+    default:
+      GEARMAN_ERROR_SET(gearman, "_libpq_results", "%s",
+                        PQresultErrorMessage(result))
+      queue->transaction_failed= true;
+      break;
+    }
+
+    PQclear(result);
+    queue->result_count--;
+  }
+}
+#endif
+
+static gearman_return_t _libpq_add(gearman_st *gearman, void *fn_arg,
+                                   const void *unique, size_t unique_size,
+                                   const void *function_name,
+                                   size_t function_name_size,
+                                   const void *data, size_t data_size,
+                                   gearman_job_priority_t priority,
+                                   int64_t when)
+{
+  gearman_queue_libpq_st *queue= (gearman_queue_libpq_st *)fn_arg;
+  char priority_string[2]= { (char)('0' + (int)priority), 0 };
+  char when_string[21]; /* Max string size to hold an int64_t. */
+  bool begin= !(queue->in_transaction);
+  gearman_return_t ret;
+
+  const char *param_values[5]= { priority_string,
+                                 (char *)unique,
+                                 (char *)function_name,
+                                 (char *)data,
+                                 when_string };
+  int param_lengths[5]= { 1,
+                          (int)unique_size,
+                          (int)function_name_size,
+                          (int)data_size,
+                          0 };
+  int param_formats[5]= { 0, 0, 0, 1, 0 };
+
+  param_lengths[4]= snprintf(when_string, sizeof(when_string), "%"PRId64,
+                             when);
+
+  GEARMAN_DEBUG(gearman, "libpq add: %.*s", (uint32_t)unique_size,
                 (char *)unique)
 
-  query_size= (unique_size * 2) + GEARMAN_QUEUE_QUERY_BUFFER;
-  if (query_size > queue->query_size)
+  /* Jobs added together are committed together by the next flush. */
+  if (begin)
+  {
+#ifdef LIBPQ_HAS_PIPELINING
+    /* Everything sent until the next sync is one implicit transaction. Wait
+       out earlier done jobs first, so their errors don't fail this one. */
+    _libpq_results(gearman, queue, true);
+    queue->transaction_failed= false;
+#else
+    if (_libpq_exec(gearman, queue, "BEGIN") != GEARMAN_SUCCESS)
+      return GEARMAN_QUEUE_ERROR;
+#endif
+    queue->in_transaction= true;
+  }
+
+  ret= _libpq_send(gearman, queue, GEARMAN_QUEUE_LIBPQ_ADD, 5, param_values,
+                   param_lengths, param_formats);
+  if (ret != GEARMAN_SUCCESS)
   {
-    query= realloc(queue->query, query_size);
-    if (query == NULL)
+#ifndef LIBPQ_HAS_PIPELINING
+    /* PostgreSQL drops the rest of the transaction after an error, so fail
+       the flush for any jobs added before this one. */
+    if (begin)
     {
-      GEARMAN_ERROR_SET(gearman, "_libpq_add", "realloc")
-      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+      PQclear(PQexec(queue->con, "ROLLBACK"));
+      queue->in_transaction= false;
+      return ret;
     }
-
-    queue->query= query;
-    queue->query_size= query_size;
+#endif
+    queue->transaction_failed= true;
+    return ret;
   }
-  else
-    query= queue->query;
 
-  query_size= (size_t)snprintf(query, query_size,
-                               "DELETE FROM %s WHERE unique_key='",
-                               queue->table);
+  return GEARMAN_SUCCESS;
+}
 
-  query_size+= PQescapeStringConn(queue->con, query + query_size, unique,
-                                  unique_size, NULL);
-  memcpy(query + query_size, "'", 1);
-  query_size+= 1;
-  query[query_size]= 0;
+static gearman_return_t _libpq_flush(gearman_st *gearman, void *fn_arg)
+{
+  gearman_queue_libpq_st *queue= (gearman_queue_libpq_st *)fn_arg;
 
-  result= PQexec(queue->con, query);
-  if (result == NULL || PQresultStatus(result) != PGRES_COMMAND_OK)
+  GEARMAN_DEBUG(gearman, "libpq flush")
+
+  if (!(queue->in_transaction))
+    return GEARMAN_SUCCESS;
+
+  /* A failed transaction ends either way, so the next add starts over. */
+  queue->in_transaction= false;
+
+#ifdef LIBPQ_HAS_PIPELINING
+  /* The sync commits the batch, or rolls all of it back if anything in it
+     failed. */
+  if (_libpq_sync(gearman, queue, true) != GEARMAN_SUCCESS ||
+      queue->transaction_failed)
   {
-    GEARMAN_ERROR_SET(gearman, "_libpq_add", "PQexec:%s",
-                      PQerrorMessage(queue->con))
-    PQclear(result);
+    queue->transaction_failed= false;
+    GEARMAN_ERROR_SET(gearman, "_libpq_flush", "transaction failed")
     return GEARMAN_QUEUE_ERROR;
   }
 
-  PQclear(result);
+  return GEARMAN_SUCCESS;
+#else
+  /* A COMMIT after an error only rolls back, so report the error here. */
+  if (queue->transaction_failed)
+  {
+    queue->transaction_failed= false;
+    PQclear(PQexec(queue->con, "ROLLBACK"));
+    GEARMAN_ERROR_SET(gearman, "_libpq_flush", "transaction failed")
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  return _libpq_exec(gearman, queue, "COMMIT");
+#endif
+}
+
+static gearman_return_t _libpq_done(gearman_st *gearman, void *fn_arg,
+                                    const void *unique,
+                                    size_t unique_size,
+                                    const void *function_name __attribute__((unused)),
+                                    size_t function_name_size __attribute__((unused)))
+{
+  gearman_queue_libpq_st *queue= (gearman_queue_libpq_st *)fn_arg;
+  gearman_return_t ret;
+
+  const char *param_values[1]= { (char *)unique };
+  int param_lengths[1]= { (int)unique_size };
+  int param_formats[1]= { 0 };
+
+  GEARMAN_DEBUG(gearman, "libpq done: %.*s", (uint32_t)unique_size,
+                (char *)unique)
+
+  ret= _libpq_send(gearman, queue, GEARMAN_QUEUE_LIBPQ_DONE, 1, param_values,
+                   param_lengths, param_formats);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    if (queue->in_transaction)
+      queue->transaction_failed= true;
+    return ret;
+  }
+
+#ifdef LIBPQ_HAS_PIPELINING
+  /* Outside of a batch, send it on its own without waiting for it. Losing
+     it only means the job runs again after a restart. */
+  if (!(queue->in_transaction))
+    return _libpq_sync(gearman, queue, false);
+#endif
 
   return GEARMAN_SUCCESS;
 }
@@ -378,77 +637,114 @@ static gearman_return_t _libpq_replay(gearman_st *gearman, void *fn_arg,
                                       void *add_fn_arg)
 {
   gearman_queue_libpq_st *queue= (gearman_queue_libpq_st *)fn_arg;
-  char *query;
-  gearman_return_t ret;
+  char query[GEARMAN_QUEUE_QUERY_BUFFER];
+  gearman_return_t ret= GEARMAN_SUCCESS;
   PGresult *result;
   int row;
+  int rows;
   void *data;
+  uint32_t priority;
+  uint32_t tmp;
+  int64_t when;
 
   GEARMAN_INFO(gearman, "libpq replay start")
 
-  if (GEARMAN_QUEUE_QUERY_BUFFER > queue->query_size)
-  {
-    query= realloc(queue->query, GEARMAN_QUEUE_QUERY_BUFFER);
-    if (query == NULL)
-    {
-      GEARMAN_ERROR_SET(gearman, "_libpq_replay", "realloc")
-      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
-
-    queue->query= query;
-    queue->query_size= GEARMAN_QUEUE_QUERY_BUFFER;
-  }
-  else
-    query= queue->query;
+  /* Read the table through a cursor, a chunk of rows at a time, so it is
+     never all held in memory at once. */
+  if (_libpq_exec(gearman, queue, "BEGIN") != GEARMAN_SUCCESS)
+    return GEARMAN_QUEUE_ERROR;
 
   (void)snprintf(query, GEARMAN_QUEUE_QUERY_BUFFER,
-                 "SELECT unique_key,function_name,priority,data FROM %s",
+                 "DECLARE gearman_queue_replay NO SCROLL CURSOR FOR "
+                 "SELECT unique_key,function_name,priority,data,"
+                 "when_to_run FROM %s",
                  queue->table);
-
-  result= PQexecParams(queue->con, query, 0, NULL, NULL, NULL, NULL, 1);
-  if (result == NULL || PQresultStatus(result) != PGRES_TUPLES_OK)
+  if (_libpq_exec(gearman, queue, query) != GEARMAN_SUCCESS)
   {
-    GEARMAN_ERROR_SET(gearman, "_libpq_replay", "PQexecParams:%s",
-                      PQerrorMessage(queue->con))
-    PQclear(result);
+    PQclear(PQexec(queue->con, "ROLLBACK"));
     return GEARMAN_QUEUE_ERROR;
   }
 
-  for (row= 0; row < PQntuples(result); row++)
+  do
   {
-    GEARMAN_DEBUG(gearman, "libpq replay: %.*s", PQgetlength(result, row, 0),
-                  PQgetvalue(result, row, 0));
+    result= PQexecParams(queue->con, "FETCH " GEARMAN_QUEUE_LIBPQ_REPLAY_ROWS
+                         " FROM gearman_queue_replay", 0, NULL, NULL, NULL,
+                         NULL, 1);
+    if (result == NULL || PQresultStatus(result) != PGRES_TUPLES_OK)
+    {
+      GEARMAN_ERROR_SET(gearman, "_libpq_replay", "PQexecParams:%s",
+                        PQerrorMessage(queue->con))
+      PQclear(result);
+      ret= GEARMAN_QUEUE_ERROR;
+      break;
+    }
 
-    if (PQgetlength(result, row, 3) == 0)
-      data= NULL;
-    else
+    rows= PQntuples(result);
+
+    for (row= 0; row < rows; row++)
     {
-      data= malloc((size_t)PQgetlength(result, row, 3));
-      if (query == NULL)
+      GEARMAN_DEBUG(gearman, "libpq replay: %.*s",
+                    PQgetlength(result, row, 0), PQgetvalue(result, row, 0));
+
+      /* Rows come back in binary, so the priority is a network order
+         integer. */
+      if (PQgetlength(result, row, 2) != 4)
       {
-        PQclear(result);
-        GEARMAN_ERROR_SET(gearman, "_libpq_replay", "malloc")
-        return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+        GEARMAN_ERROR_SET(gearman, "_libpq_replay", "bad priority")
+        ret= GEARMAN_QUEUE_ERROR;
+        break;
       }
 
-      memcpy(data, PQgetvalue(result, row, 3),
-             (size_t)PQgetlength(result, row, 3));
-    }
+      memcpy(&priority, PQgetvalue(result, row, 2), 4);
+      priority= ntohl(priority);
 
-    ret= (*add_fn)(gearman, add_fn_arg, PQgetvalue(result, row, 0),
-                   (size_t)PQgetlength(result, row, 0),
-                   PQgetvalue(result, row, 1),
-                   (size_t)PQgetlength(result, row, 1),
-                   data, (size_t)PQgetlength(result, row, 3),
-                   atoi(PQgetvalue(result, row, 2)));
-    if (ret != GEARMAN_SUCCESS)
-    {
-      PQclear(result);
-      return ret;
+      /* Rows from before the column was added have no time to run at. */
+      if (PQgetisnull(result, row, 4) || PQgetlength(result, row, 4) != 8)
+        when= 0;
+      else
+      {
+        memcpy(&tmp, PQgetvalue(result, row, 4), 4);
+        when= (int64_t)((uint64_t)ntohl(tmp) << 32);
+        memcpy(&tmp, PQgetvalue(result, row, 4) + 4, 4);
+        when|= (int64_t)ntohl(tmp);
+      }
+
+      if (PQgetlength(result, row, 3) == 0)
+        data= NULL;
+      else
+      {
+        data= malloc((size_t)PQgetlength(result, row, 3));
+        if (data == NULL)
+        {
+          GEARMAN_ERROR_SET(gearman, "_libpq_replay", "malloc")
+          ret= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+          break;
+        }
+
+        memcpy(data, PQgetvalue(result, row, 3),
+               (size_t)PQgetlength(result, row, 3));
+      }
+
+      ret= (*add_fn)(gearman, add_fn_arg, PQgetvalue(result, row, 0),
+                     (size_t)PQgetlength(result, row, 0),
+                     PQgetvalue(result, row, 1),
+                     (size_t)PQgetlength(result, row, 1),
+                     data, (size_t)PQgetlength(result, row, 3),
+                     (gearman_job_priority_t)priority, when);
+      if (ret != GEARMAN_SUCCESS)
+        break;
     }
+
+    PQclear(result);
   }
+  while (ret == GEARMAN_SUCCESS && rows > 0);
 
-  PQclear(result);
+  /* Closing the transaction closes the cursor too. */
+  if (ret != GEARMAN_SUCCESS)
+  {
+    PQclear(PQexec(queue->con, "ROLLBACK"));
+    return ret;
+  }
 
-  return GEARMAN_SUCCESS;
+  return _libpq_exec(gearman, queue, "COMMIT");
 }
@@ -26,6 +26,7 @@
  * Default values.
  */
 #define GEARMAN_QUEUE_SQLITE_DEFAULT_TABLE "gearman_queue"
+#define GEARMAN_QUEUE_SQLITE_DEFAULT_SYNCHRONOUS "full"
 #define GEARMAN_QUEUE_QUERY_BUFFER 256
 
 /*
@@ -33,6 +34,7 @@
  */
 #define SQLITE_MAX_TABLE_SIZE 256
 #define SQLITE_MAX_CREATE_TABLE_SIZE 1024
+#define SQLITE_MAX_SYNCHRONOUS_SIZE 16
 
 /**
  * Structure for sqlite specific data.
@@ -41,9 +43,15 @@ typedef struct
 {
   sqlite3* db;
   char table[SQLITE_MAX_TABLE_SIZE];
+  char synchronous[SQLITE_MAX_SYNCHRONOUS_SIZE];
   char *query;
   size_t query_size;
   int in_trans;
+  sqlite3_stmt *begin_sth;
+  sqlite3_stmt *commit_sth;
+  sqlite3_stmt *rollback_sth;
+  sqlite3_stmt *insert_sth;
+  sqlite3_stmt *delete_sth;
 } gearman_queue_sqlite_st;
 
 /**
@@ -53,6 +61,25 @@ static int _sqlite_query(gearman_st *gearman,
                          gearman_queue_sqlite_st *queue,
                          const char *query, size_t query_size,
                          sqlite3_stmt ** sth);
+
+/**
+ * Prepare the statements used for every job once, after the table exists.
+ */
+static int _sqlite_prepare(gearman_st *gearman,
+                           gearman_queue_sqlite_st *queue);
+
+/**
+ * Add the when_to_run column to a table created before jobs could be
+ * scheduled, if it does not have it yet.
+ */
+static int _sqlite_when_column(gearman_st *gearman,
+                               gearman_queue_sqlite_st *queue);
+
+/**
+ * Run a prepared statement that returns no rows and reset it for next time.
+ */
+static int _sqlite_step(sqlite3_stmt *sth);
+
 static int _sqlite_lock(gearman_st *gearman,
                         gearman_queue_sqlite_st *queue);
 static int _sqlite_commit(gearman_st *gearman,
@@ -66,7 +93,8 @@ static gearman_return_t _sqlite_add(gearman_st *gearman, void *fn_arg,
                                     const void *function_name,
                                     size_t function_name_size,
                                     const void *data, size_t data_size,
-                                    gearman_job_priority_t priority);
+                                    gearman_job_priority_t priority,
+                                    int64_t when);
 static gearman_return_t _sqlite_flush(gearman_st *gearman, void *fn_arg);
 static gearman_return_t _sqlite_done(gearman_st *gearman, void *fn_arg,
                                      const void *unique,
@@ -76,6 +104,12 @@ static gearman_return_t _sqlite_done(gearman_st *gearman, void *fn_arg,
 static gearman_return_t _sqlite_replay(gearman_st *gearman, void *fn_arg,
                                        gearman_queue_add_fn *add_fn,
                                        void *add_fn_arg);
+static gearman_return_t _sqlite_add_batch(gearman_st *gearman, void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count);
+static gearman_return_t _sqlite_done_batch(gearman_st *gearman, void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count);
 
 /** @} */
 
@@ -96,6 +130,9 @@ gearman_return_t gearman_queue_libsqlite3_conf(gearman_conf_st *conf)
 
   MCO("db", "DB", "Database file to use.")
   MCO("table", "TABLE", "Table to use.")
+  MCO("synchronous", "LEVEL",
+      "How often to sync the write-ahead log: off, normal or full. "
+      "Default=full.")
 
   return gearman_conf_return(conf);
 }
@@ -124,6 +161,8 @@ gearman_return_t gearman_queue_libsqlite3_init(gearman_st *gearman,
   memset(queue, 0, sizeof(gearman_queue_sqlite_st));
   snprintf(queue->table, SQLITE_MAX_TABLE_SIZE,
            GEARMAN_QUEUE_SQLITE_DEFAULT_TABLE);
+  snprintf(queue->synchronous, SQLITE_MAX_SYNCHRONOUS_SIZE,
+           GEARMAN_QUEUE_SQLITE_DEFAULT_SYNCHRONOUS);
 
   /* Get module and parse the option values that were given. */
   module= gearman_conf_module_find(conf, "libsqlite3");
@@ -152,6 +191,19 @@ gearman_return_t gearman_queue_libsqlite3_init(gearman_st *gearman,
     }
     else if (!strcmp(name, "table"))
       snprintf(queue->table, SQLITE_MAX_TABLE_SIZE, "%s", value);
+    else if (!strcmp(name, "synchronous"))
+    {
+      if (strcasecmp(value, "off") && strcasecmp(value, "normal") &&
+          strcasecmp(value, "full"))
+      {
+        gearman_queue_libsqlite3_deinit(gearman);
+        GEARMAN_ERROR_SET(gearman, "gearman_queue_libsqlite3_init",
+                          "Unknown synchronous level: %s", value);
+        return GEARMAN_QUEUE_ERROR;
+      }
+
+      snprintf(queue->synchronous, SQLITE_MAX_SYNCHRONOUS_SIZE, "%s", value);
+    }
     else
     {
       gearman_queue_libsqlite3_deinit(gearman);
@@ -169,6 +221,19 @@ gearman_return_t gearman_queue_libsqlite3_init(gearman_st *gearman,
     return GEARMAN_QUEUE_ERROR;
   }    
 
+  /* With a write-ahead log a commit is one append to the log instead of
+     rewriting pages and a rollback journal. */
+  snprintf(create, SQLITE_MAX_CREATE_TABLE_SIZE,
+           "PRAGMA journal_mode=WAL; PRAGMA synchronous=%s",
+           queue->synchronous);
+  if (sqlite3_exec(queue->db, create, NULL, NULL, NULL) != SQLITE_OK)
+  {
+    GEARMAN_ERROR_SET(gearman, "gearman_queue_libsqlite3_init",
+                      "pragma error: %s", sqlite3_errmsg(queue->db));
+    gearman_queue_libsqlite3_deinit(gearman);
+    return GEARMAN_QUEUE_ERROR;
+  }
+
   query= "SELECT name FROM sqlite_master WHERE type='table'";
   if (_sqlite_query(gearman, queue, query, strlen(query), &sth) != SQLITE_OK)
   {
@@ -211,7 +276,8 @@ gearman_return_t gearman_queue_libsqlite3_init(gearman_st *gearman,
              "unique_key TEXT PRIMARY KEY,"
              "function_name TEXT,"
              "priority INTEGER,"
-             "data BLOB"
+             "data BLOB,"
+             "when_to_run INTEGER"
              ")",
              queue->table);
 
@@ -240,11 +306,25 @@ gearman_return_t gearman_queue_libsqlite3_init(gearman_st *gearman,
       return GEARMAN_QUEUE_ERROR;
     }
   }
+  else if (_sqlite_when_column(gearman, queue) != SQLITE_OK)
+  {
+    gearman_queue_libsqlite3_deinit(gearman);
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  if (_sqlite_prepare(gearman, queue) != SQLITE_OK)
+  {
+    gearman_queue_libsqlite3_deinit(gearman);
+    return GEARMAN_QUEUE_ERROR;
+  }
 
   gearman_set_queue_add(gearman, _sqlite_add);
   gearman_set_queue_flush(gearman, _sqlite_flush);
   gearman_set_queue_done(gearman, _sqlite_done);
   gearman_set_queue_replay(gearman, _sqlite_replay);
+  gearman_set_queue_add_batch(gearman, _sqlite_add_batch);
+  gearman_set_queue_done_batch(gearman, _sqlite_done_batch);
+  gearman_set_options(gearman, GEARMAN_QUEUE_REPLAY_CONCURRENT, 1);
 
   return GEARMAN_SUCCESS;
 }
@@ -257,6 +337,16 @@ gearman_return_t gearman_queue_libsqlite3_deinit(gearman_st *gearman)
 
   queue= (gearman_queue_sqlite_st *)gearman_queue_fn_arg(gearman);
   gearman_set_queue_fn_arg(gearman, NULL);
+
+  /* Done jobs may still be waiting in an open transaction. */
+  if (queue->in_trans)
+    (void) _sqlite_commit(gearman, queue);
+
+  sqlite3_finalize(queue->begin_sth);
+  sqlite3_finalize(queue->commit_sth);
+  sqlite3_finalize(queue->rollback_sth);
+  sqlite3_finalize(queue->insert_sth);
+  sqlite3_finalize(queue->delete_sth);
   sqlite3_close(queue->db);
   if (queue->query != NULL)
     free(queue->query);
@@ -295,7 +385,7 @@ int _sqlite_query(gearman_st *gearman,
   }
 
   GEARMAN_CRAZY(gearman, "sqlite query: %s", query);
-  ret= sqlite3_prepare(queue->db, query, (int)query_size, sth, NULL);
+  ret= sqlite3_prepare_v2(queue->db, query, (int)query_size, sth, NULL);
   if (ret  != SQLITE_OK)
   {
     if (*sth)
@@ -308,40 +398,114 @@ int _sqlite_query(gearman_st *gearman,
   return ret;
 }
 
-int _sqlite_lock(gearman_st *gearman,
-                 gearman_queue_sqlite_st *queue)
+int _sqlite_prepare(gearman_st *gearman, gearman_queue_sqlite_st *queue)
 {
-  sqlite3_stmt* sth;
-  int ret;
-  if (queue->in_trans)
+  char query[SQLITE_MAX_CREATE_TABLE_SIZE];
+  size_t query_size;
+
+  if (_sqlite_query(gearman, queue, "BEGIN TRANSACTION",
+                    sizeof("BEGIN TRANSACTION") - 1,
+                    &(queue->begin_sth)) != SQLITE_OK ||
+      _sqlite_query(gearman, queue, "COMMIT", sizeof("COMMIT") - 1,
+                    &(queue->commit_sth)) != SQLITE_OK ||
+      _sqlite_query(gearman, queue, "ROLLBACK", sizeof("ROLLBACK") - 1,
+                    &(queue->rollback_sth)) != SQLITE_OK)
   {
-    /* already in transaction */
-    return SQLITE_OK;
+    return SQLITE_ERROR;
   }
 
-  ret= _sqlite_query(gearman, queue, "BEGIN TRANSACTION", 
-                     sizeof("BEGIN TRANSACTION") - 1, &sth);
-  if (ret != SQLITE_OK)
+  /* A job submitted while the queue is replayed in the background may still
+     have a row from before the restart. */
+  query_size= (size_t)snprintf(query, SQLITE_MAX_CREATE_TABLE_SIZE,
+                               "INSERT OR REPLACE INTO %s (priority,"
+                               "unique_key,function_name,data,when_to_run) "
+                               "VALUES (?,?,?,?,?)",
+                               queue->table);
+  if (_sqlite_query(gearman, queue, query, query_size,
+                    &(queue->insert_sth)) != SQLITE_OK)
   {
-    GEARMAN_ERROR_SET(gearman, "_sqlite_lock",
-                      "failed to begin transaction: %s", 
-                      sqlite3_errmsg(queue->db));
-    if(sth)
-      sqlite3_finalize(sth);
+    return SQLITE_ERROR;
+  }
+
+  /* unique_key is the primary key, so this is an index lookup. */
+  query_size= (size_t)snprintf(query, SQLITE_MAX_CREATE_TABLE_SIZE,
+                               "DELETE FROM %s WHERE unique_key=?",
+                               queue->table);
+  return _sqlite_query(gearman, queue, query, query_size,
+                       &(queue->delete_sth));
+}
 
-    return ret;
+int _sqlite_when_column(gearman_st *gearman, gearman_queue_sqlite_st *queue)
+{
+  char query[SQLITE_MAX_CREATE_TABLE_SIZE];
+  size_t query_size;
+  sqlite3_stmt *sth;
+  bool found= false;
+
+  query_size= (size_t)snprintf(query, SQLITE_MAX_CREATE_TABLE_SIZE,
+                               "PRAGMA table_info(%s)", queue->table);
+  if (_sqlite_query(gearman, queue, query, query_size, &sth) != SQLITE_OK)
+    return SQLITE_ERROR;
+
+  /* The second column of each row is the name. */
+  while (sqlite3_step(sth) == SQLITE_ROW)
+  {
+    if (sqlite3_column_type(sth, 1) == SQLITE_TEXT &&
+        !strcasecmp((char *)sqlite3_column_text(sth, 1), "when_to_run"))
+    {
+      found= true;
+      break;
+    }
   }
 
+  sqlite3_finalize(sth);
+
+  if (found)
+    return SQLITE_OK;
+
+  GEARMAN_INFO(gearman, "sqlite module adding column when_to_run to '%s'",
+               queue->table);
+
+  query_size= (size_t)snprintf(query, SQLITE_MAX_CREATE_TABLE_SIZE,
+                               "ALTER TABLE %s ADD COLUMN when_to_run INTEGER",
+                               queue->table);
+  if (sqlite3_exec(queue->db, query, NULL, NULL, NULL) != SQLITE_OK)
+  {
+    GEARMAN_ERROR_SET(gearman, "_sqlite_when_column", "alter table error: %s",
+                      sqlite3_errmsg(queue->db));
+    return SQLITE_ERROR;
+  }
+
+  return SQLITE_OK;
+}
+
+int _sqlite_step(sqlite3_stmt *sth)
+{
+  int ret;
+
   ret= sqlite3_step(sth);
-  if (ret != SQLITE_DONE)
+  sqlite3_reset(sth);
+  sqlite3_clear_bindings(sth);
+
+  return ret == SQLITE_DONE ? SQLITE_OK : ret;
+}
+
+int _sqlite_lock(gearman_st *gearman,
+                 gearman_queue_sqlite_st *queue)
+{
+  if (queue->in_trans)
+  {
+    /* already in transaction */
+    return SQLITE_OK;
+  }
+
+  if (_sqlite_step(queue->begin_sth) != SQLITE_OK)
   {
     GEARMAN_ERROR_SET(gearman, "_sqlite_lock", "lock error: %s",
                       sqlite3_errmsg(queue->db));
-    sqlite3_finalize(sth);
-    return ret;
+    return SQLITE_ERROR;
   }
 
-  sqlite3_finalize(sth);
   queue->in_trans++;
 
   return SQLITE_OK;
@@ -350,34 +514,24 @@ int _sqlite_lock(gearman_st *gearman,
 int _sqlite_commit(gearman_st *gearman,
                    gearman_queue_sqlite_st *queue)
 {
-  sqlite3_stmt* sth;
-  int ret;
-
   if (! queue->in_trans)
   {
     /* not in transaction */
     return SQLITE_OK;
   }
 
-  ret= _sqlite_query(gearman, queue, "COMMIT", sizeof("COMMIT") - 1, &sth);
-  if (ret != SQLITE_OK)
-  {
-    GEARMAN_ERROR_SET(gearman, "_sqlite_commit",
-                      "failed to commit transaction: %s", 
-                      sqlite3_errmsg(queue->db));
-    if(sth)
-      sqlite3_finalize(sth);
-    return ret;
-  }
-  ret= sqlite3_step(sth);
-  if (ret != SQLITE_DONE)
+  if (_sqlite_step(queue->commit_sth) != SQLITE_OK)
   {
     GEARMAN_ERROR_SET(gearman, "_sqlite_commit", "commit error: %s",
                       sqlite3_errmsg(queue->db));
-    sqlite3_finalize(sth);
-    return ret;
+
+    /* Give up on the batch so the next one starts a new transaction. */
+    if (!sqlite3_get_autocommit(queue->db))
+      (void) _sqlite_rollback(gearman, queue);
+    queue->in_trans= 0;
+    return SQLITE_ERROR;
   }
-  sqlite3_finalize(sth);
+
   queue->in_trans= 0;
   return SQLITE_OK;
 }
@@ -385,36 +539,19 @@ int _sqlite_commit(gearman_st *gearman,
 int _sqlite_rollback(gearman_st *gearman,
                      gearman_queue_sqlite_st *queue)
 {
-  sqlite3_stmt* sth;
-  int ret;
-  const char* query;
-
   if (! queue->in_trans)
   {
     /* not in transaction */
     return SQLITE_OK;
   }
 
-  query= "ROLLBACK";
-  ret= _sqlite_query(gearman, queue, query, strlen(query), &sth);
-  if (ret != SQLITE_OK)
-  {
-    GEARMAN_ERROR_SET(gearman, "_sqlite_rollback",
-                      "failed to rollback transaction: %s",
-                      sqlite3_errmsg(queue->db));
-    if(sth)
-      sqlite3_finalize(sth);
-    return ret;
-  }
-  ret= sqlite3_step(sth);
-  if (ret != SQLITE_DONE)
+  if (_sqlite_step(queue->rollback_sth) != SQLITE_OK)
   {
     GEARMAN_ERROR_SET(gearman, "_sqlite_rollback", "rollback error: %s",
                       sqlite3_errmsg(queue->db));
-    sqlite3_finalize(sth);
-    return ret;
+    return SQLITE_ERROR;
   }
-  sqlite3_finalize(sth);
+
   queue->in_trans= 0;
   return SQLITE_OK;
 }
@@ -424,11 +561,10 @@ static gearman_return_t _sqlite_add(gearman_st *gearman, void *fn_arg,
                                     const void *function_name,
                                     size_t function_name_size,
                                     const void *data, size_t data_size,
-                                    gearman_job_priority_t priority)
+                                    gearman_job_priority_t priority,
+                                    int64_t when)
 {
   gearman_queue_sqlite_st *queue= (gearman_queue_sqlite_st *)fn_arg;
-  char *query;
-  size_t query_size;
   sqlite3_stmt* sth;
 
   if (unique_size > UINT32_MAX || function_name_size > UINT32_MAX ||
@@ -445,98 +581,47 @@ static gearman_return_t _sqlite_add(gearman_st *gearman, void *fn_arg,
   if (_sqlite_lock(gearman, queue) !=  SQLITE_OK)
     return GEARMAN_QUEUE_ERROR;
 
-  query_size= ((unique_size + function_name_size + data_size) * 2) +
-    GEARMAN_QUEUE_QUERY_BUFFER;
-  if (query_size > queue->query_size)
-  {
-    query= realloc(queue->query, query_size);
-    if (query == NULL)
-    {
-      GEARMAN_ERROR_SET(gearman, "_sqlite_add", "realloc")
-      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
-
-    queue->query= query;
-    queue->query_size= query_size;
-  }
-  else
-    query= queue->query;
-
-  query_size= (size_t)snprintf(query, query_size,
-                               "INSERT INTO %s (priority,unique_key,"
-                               "function_name,data) VALUES (?,?,?,?)",
-                               queue->table);
-
-  if (_sqlite_query(gearman, queue, query, query_size, &sth) != SQLITE_OK)
-    return GEARMAN_QUEUE_ERROR;
-
-  if (sqlite3_bind_int(sth,  1, priority) != SQLITE_OK)
-  {
-    _sqlite_rollback(gearman, queue);
-    GEARMAN_ERROR_SET(gearman, "_sqlite_add", "failed to bind int [%d]: %s",
-                      priority, sqlite3_errmsg(queue->db));
-    sqlite3_finalize(sth);
-    return GEARMAN_QUEUE_ERROR;
-  }
-
-  if (sqlite3_bind_text(sth, 2, unique, (int)unique_size,
-                        SQLITE_TRANSIENT) != SQLITE_OK)
-  {
-    _sqlite_rollback(gearman, queue);
-    GEARMAN_ERROR_SET(gearman, "_sqlite_add", "failed to bind text [%.*s]: %s", 
-                      (uint32_t)unique_size, (char*)unique,
-                      sqlite3_errmsg(queue->db));
-    sqlite3_finalize(sth);
-    return GEARMAN_QUEUE_ERROR;
-  }
-
-  if (sqlite3_bind_text(sth, 3, function_name, (int)function_name_size,
-                        SQLITE_TRANSIENT) != SQLITE_OK)
+  sth= queue->insert_sth;
+
+  /* The values only need to last until the step, so nothing is copied. A
+     failed insert leaves the rest of the transaction alone. */
+  if (sqlite3_bind_int(sth,  1, priority) != SQLITE_OK ||
+      sqlite3_bind_text(sth, 2, unique, (int)unique_size,
+                        SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_text(sth, 3, function_name, (int)function_name_size,
+                        SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_blob(sth, 4, data, (int)data_size,
+                        SQLITE_STATIC) != SQLITE_OK ||
+      sqlite3_bind_int64(sth, 5, when) != SQLITE_OK)
   {
-    _sqlite_rollback(gearman, queue);
-    GEARMAN_ERROR_SET(gearman, "_sqlite_add", "failed to bind text [%.*s]: %s", 
-                      (uint32_t)function_name_size, (char*)function_name,
+    GEARMAN_ERROR_SET(gearman, "_sqlite_add", "failed to bind: %s",
                       sqlite3_errmsg(queue->db));
-    sqlite3_finalize(sth);
+    sqlite3_reset(sth);
+    sqlite3_clear_bindings(sth);
     return GEARMAN_QUEUE_ERROR;
   }
 
-  if (sqlite3_bind_blob(sth, 4, data, (int)data_size,
-                        SQLITE_TRANSIENT) != SQLITE_OK)
-  {
-    _sqlite_rollback(gearman, queue);
-    GEARMAN_ERROR_SET(gearman, "_sqlite_add", "failed to bind blob: %s",
-                      sqlite3_errmsg(queue->db));
-    sqlite3_finalize(sth);
-    return GEARMAN_QUEUE_ERROR;
-  }
-
-  if (sqlite3_step(sth) != SQLITE_DONE)
+  if (_sqlite_step(sth) != SQLITE_OK)
   {
     GEARMAN_ERROR_SET(gearman, "_sqlite_add", "insert error: %s",
                       sqlite3_errmsg(queue->db));
-    if (sqlite3_finalize(sth) != SQLITE_OK )
-    {
-      GEARMAN_ERROR_SET(gearman, "_sqlite_add", "finalize error: %s",
-                        sqlite3_errmsg(queue->db));
-    }
-
     return GEARMAN_QUEUE_ERROR;
   }
 
-  sqlite3_finalize(sth);
-
-  if (_sqlite_commit(gearman, queue) !=  SQLITE_OK)
-    return GEARMAN_QUEUE_ERROR;
-
+  /* The transaction is left open so jobs added together are committed
+     together by the next flush. */
   return GEARMAN_SUCCESS;
 }
 
-static gearman_return_t _sqlite_flush(gearman_st *gearman,
-                                      void *fn_arg __attribute__((unused)))
+static gearman_return_t _sqlite_flush(gearman_st *gearman, void *fn_arg)
 {
+  gearman_queue_sqlite_st *queue= (gearman_queue_sqlite_st *)fn_arg;
+
   GEARMAN_DEBUG(gearman, "sqlite flush");
 
+  if (_sqlite_commit(gearman, queue) !=  SQLITE_OK)
+    return GEARMAN_QUEUE_ERROR;
+
   return GEARMAN_SUCCESS;
 }
 
@@ -547,8 +632,6 @@ static gearman_return_t _sqlite_done(gearman_st *gearman, void *fn_arg,
                                      size_t function_name_size __attribute__((unused)))
 {
   gearman_queue_sqlite_st *queue= (gearman_queue_sqlite_st *)fn_arg;
-  char *query;
-  size_t query_size;
   sqlite3_stmt* sth;
 
   if (unique_size > UINT32_MAX)
@@ -561,47 +644,27 @@ static gearman_return_t _sqlite_done(gearman_st *gearman, void *fn_arg,
   GEARMAN_DEBUG(gearman, "sqlite done: %.*s", (uint32_t)unique_size,
                 (char *)unique);
 
-    if (_sqlite_lock(gearman, queue) !=  SQLITE_OK)
-      return GEARMAN_QUEUE_ERROR;
+  /* Outside of a batch this runs in its own implicit transaction. Inside
+     one it is committed along with the jobs being added. */
+  sth= queue->delete_sth;
 
-  query_size= (unique_size * 2) + GEARMAN_QUEUE_QUERY_BUFFER;
-  if (query_size > queue->query_size)
+  if (sqlite3_bind_text(sth, 1, unique, (int)unique_size,
+                        SQLITE_STATIC) != SQLITE_OK)
   {
-    query= realloc(queue->query, query_size);
-    if (query == NULL)
-    {
-      GEARMAN_ERROR_SET(gearman, "_sqlite_add", "realloc")
-      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
-
-    queue->query= query;
-    queue->query_size= query_size;
-  }
-  else
-    query= queue->query;
-
-  query_size= (size_t)snprintf(query, query_size,
-                               "DELETE FROM %s WHERE unique_key=?",
-                               queue->table);
-
-  if (_sqlite_query(gearman, queue, query, query_size, &sth) != SQLITE_OK)
+    GEARMAN_ERROR_SET(gearman, "_sqlite_done", "failed to bind: %s",
+                      sqlite3_errmsg(queue->db));
+    sqlite3_reset(sth);
+    sqlite3_clear_bindings(sth);
     return GEARMAN_QUEUE_ERROR;
+  }
 
-  sqlite3_bind_text(sth, 1, unique, (int)unique_size, SQLITE_TRANSIENT);
-
-  if (sqlite3_step(sth) != SQLITE_DONE)
+  if (_sqlite_step(sth) != SQLITE_OK)
   {
     GEARMAN_ERROR_SET(gearman, "_sqlite_done", "delete error: %s",
                       sqlite3_errmsg(queue->db));
-    sqlite3_finalize(sth);
     return GEARMAN_QUEUE_ERROR;
   }
 
-  sqlite3_finalize(sth);
-
-  if (_sqlite_commit(gearman, queue) !=  SQLITE_OK)
-    return GEARMAN_QUEUE_ERROR;
-
   return GEARMAN_SUCCESS;
 }
 
@@ -633,8 +696,8 @@ static gearman_return_t _sqlite_replay(gearman_st *gearman, void *fn_arg,
     query= queue->query;
 
   query_size= (size_t)snprintf(query, GEARMAN_QUEUE_QUERY_BUFFER,
-                               "SELECT unique_key,function_name,priority,data "
-                               "FROM %s",
+                               "SELECT unique_key,function_name,priority,data,"
+                               "when_to_run FROM %s",
                                queue->table);
 
   if (_sqlite_query(gearman, queue, query, query_size, &sth) != SQLITE_OK)
@@ -645,6 +708,7 @@ static gearman_return_t _sqlite_replay(gearman_st *gearman, void *fn_arg,
     void *data;
     size_t unique_size, function_name_size, data_size;
     gearman_job_priority_t priority;
+    int64_t when;
 
     if (sqlite3_column_type(sth,0) == SQLITE_TEXT)
     {
@@ -684,7 +748,13 @@ static gearman_return_t _sqlite_replay(gearman_st *gearman, void *fn_arg,
       return GEARMAN_QUEUE_ERROR;
     }
 
-    if (sqlite3_column_type(sth,3) == SQLITE_BLOB)
+    /* An empty payload is bound from a NULL pointer, and stored as NULL. */
+    if (sqlite3_column_type(sth,3) == SQLITE_NULL)
+    {
+      data_size= 0;
+      data= NULL;
+    }
+    else if (sqlite3_column_type(sth,3) == SQLITE_BLOB)
     {
       data_size= (size_t)sqlite3_column_bytes(sth,3);
       /* need to make a copy here ... gearman_server_job_free will free it later */
@@ -705,13 +775,19 @@ static gearman_return_t _sqlite_replay(gearman_st *gearman, void *fn_arg,
       return GEARMAN_QUEUE_ERROR;
     }
 
+    /* Rows added before the column was there have no time to run at. */
+    if (sqlite3_column_type(sth,4) == SQLITE_INTEGER)
+      when= (int64_t)sqlite3_column_int64(sth,4);
+    else
+      when= 0;
+
     GEARMAN_DEBUG(gearman, "sqlite replay: %s", (char*)function_name);
 
     gret= (*add_fn)(gearman, add_fn_arg,
                     unique, unique_size,
                     function_name, function_name_size,
                     data, data_size,
-                    priority);
+                    priority, when);
     if (gret != GEARMAN_SUCCESS)
     {
       sqlite3_finalize(sth);
@@ -723,3 +799,56 @@ static gearman_return_t _sqlite_replay(gearman_st *gearman, void *fn_arg,
 
   return GEARMAN_SUCCESS;
 }
+
+static gearman_return_t _sqlite_add_batch(gearman_st *gearman, void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count)
+{
+  gearman_return_t ret;
+  size_t x;
+
+  /* Every insert goes into the transaction the first one opens. */
+  for (x= 0; x < record_count; x++)
+  {
+    ret= _sqlite_add(gearman, fn_arg, record[x].unique, record[x].unique_size,
+                     record[x].function_name, record[x].function_name_size,
+                     record[x].data, record[x].data_size, record[x].priority,
+                     record[x].when);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _sqlite_done_batch(gearman_st *gearman, void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count)
+{
+  gearman_queue_sqlite_st *queue= (gearman_queue_sqlite_st *)fn_arg;
+  gearman_return_t ret= GEARMAN_SUCCESS;
+  bool own_trans= false;
+  size_t x;
+
+  /* Deletes on their own each commit, so group them unless a batch of adds
+     already has a transaction open for the next flush to commit. */
+  if (!(queue->in_trans))
+  {
+    if (_sqlite_lock(gearman, queue) != SQLITE_OK)
+      return GEARMAN_QUEUE_ERROR;
+    own_trans= true;
+  }
+
+  for (x= 0; x < record_count; x++)
+  {
+    ret= _sqlite_done(gearman, fn_arg, record[x].unique, record[x].unique_size,
+                      record[x].function_name, record[x].function_name_size);
+    if (ret != GEARMAN_SUCCESS)
+      break;
+  }
+
+  if (own_trans && _sqlite_commit(gearman, queue) != SQLITE_OK)
+    return GEARMAN_QUEUE_ERROR;
+
+  return ret;
+}
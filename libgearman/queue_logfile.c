@@ -0,0 +1,1854 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Log File Queue Storage Definitions
+ */
+
+#include "common.h"
+
+#include <libgearman/queue_logfile.h>
+#include <dirent.h>
+
+/**
+ * @addtogroup gearman_queue_logfile_static Static log file Queue Storage Functions
+ * @ingroup gearman_queue_logfile
+ * @{
+ */
+
+/**
+ * Default values.
+ */
+#define GEARMAN_QUEUE_LOGFILE_DEFAULT_SEGMENT_SIZE 64 /* Megabytes */
+#define GEARMAN_QUEUE_LOGFILE_COMPACT_PERCENT 50
+#define GEARMAN_QUEUE_LOGFILE_COMPACT_BATCH 1024
+#define GEARMAN_QUEUE_LOGFILE_HASH_SIZE 1024
+#define GEARMAN_QUEUE_LOGFILE_HEADER_SIZE 16
+#define GEARMAN_QUEUE_LOGFILE_NAME "gearmand-%010u.log"
+#define GEARMAN_QUEUE_LOGFILE_CHECKPOINT_NAME "gearmand-checkpoint"
+#define GEARMAN_QUEUE_LOGFILE_PATH_SIZE 1024
+
+/*
+ * Private declarations
+ */
+
+/**
+ * Record types. An add record for a job to run later has its own type, and
+ * the time follows the header, so older log files still read the same.
+ */
+typedef enum
+{
+  GEARMAN_QUEUE_LOGFILE_ADD= 1,
+  GEARMAN_QUEUE_LOGFILE_DONE= 2,
+  GEARMAN_QUEUE_LOGFILE_ADD_WHEN= 3
+} gearman_queue_logfile_type_t;
+
+/**
+ * When to sync appended records to disk.
+ */
+typedef enum
+{
+  GEARMAN_QUEUE_LOGFILE_SYNC_ALWAYS,
+  GEARMAN_QUEUE_LOGFILE_SYNC_INTERVAL,
+  GEARMAN_QUEUE_LOGFILE_SYNC_NEVER
+} gearman_queue_logfile_sync_t;
+
+typedef struct gearman_queue_logfile_segment_st
+               gearman_queue_logfile_segment_st;
+typedef struct gearman_queue_logfile_entry_st gearman_queue_logfile_entry_st;
+
+/**
+ * One log file. Only the last one in the list is appended to.
+ */
+struct gearman_queue_logfile_segment_st
+{
+  uint32_t seq;
+  uint32_t add_count;
+  uint32_t live_count;
+  size_t size;
+  gearman_queue_logfile_segment_st *next;
+};
+
+/**
+ * Index entry for a job still in the queue, followed by its function name
+ * and unique key.
+ */
+struct gearman_queue_logfile_entry_st
+{
+  uint32_t key;
+  uint32_t unique_size;
+  size_t function_name_size;
+  size_t offset;
+  gearman_queue_logfile_segment_st *segment;
+  gearman_queue_logfile_entry_st *next;
+};
+
+/**
+ * A record read back from a segment.
+ */
+typedef struct
+{
+  gearman_queue_logfile_type_t type;
+  gearman_job_priority_t priority;
+  int64_t when;
+  size_t function_name_size;
+  size_t unique_size;
+  size_t data_size;
+  size_t size;
+  const uint8_t *function_name;
+  const uint8_t *unique;
+  const uint8_t *data;
+} gearman_queue_logfile_record_st;
+
+/**
+ * Structure for log file specific data.
+ */
+typedef struct
+{
+  int fd;
+  bool dirty;
+  bool shutdown;
+  bool thread_started;
+  bool replaying;
+  bool marked;
+  gearman_queue_logfile_sync_t sync;
+  uint32_t checkpoint;
+  uint32_t hash_size;
+  uint32_t entry_count;
+  size_t segment_size;
+  time_t sync_time;
+  char *dir;
+  gearman_queue_logfile_segment_st *segment_list;
+  gearman_queue_logfile_segment_st *segment_end;
+  gearman_queue_logfile_entry_st **hash;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+} gearman_queue_logfile_st;
+
+/**
+ * Add to a record checksum.
+ */
+static uint32_t _logfile_checksum(uint32_t value, const uint8_t *data,
+                                  size_t size);
+
+/**
+ * Finish a record checksum.
+ */
+static uint32_t _logfile_checksum_end(uint32_t value);
+
+/**
+ * Write the path of a segment into path.
+ */
+static void _logfile_path(gearman_queue_logfile_st *queue, uint32_t seq,
+                          char *path);
+
+/**
+ * Read the record at the start of data, checking that it is whole.
+ */
+static bool _logfile_parse(const uint8_t *data, size_t size,
+                           gearman_queue_logfile_record_st *record);
+
+/**
+ * Find the index entry for a job, returning the link pointing to it. The link
+ * points to NULL if the job is not in the index.
+ */
+static gearman_queue_logfile_entry_st **
+_logfile_find(gearman_queue_logfile_st *queue, const void *function_name,
+              size_t function_name_size, const void *unique,
+              size_t unique_size, uint32_t *key_ptr);
+
+/**
+ * Point the index entry for a job at a record, adding the entry if needed.
+ */
+static gearman_return_t _logfile_index(gearman_queue_logfile_st *queue,
+                                       const void *function_name,
+                                       size_t function_name_size,
+                                       const void *unique, size_t unique_size,
+                                       gearman_queue_logfile_segment_st *segment,
+                                       size_t offset);
+
+/**
+ * Drop the index entry a link points to.
+ */
+static void _logfile_unindex(gearman_queue_logfile_st *queue,
+                             gearman_queue_logfile_entry_st **link);
+
+/**
+ * Map a segment for reading. Returns NULL for empty segments and on error.
+ */
+static uint8_t *_logfile_map(gearman_queue_logfile_st *queue,
+                             gearman_queue_logfile_segment_st *segment);
+
+/**
+ * Order segment sequence numbers for qsort.
+ */
+static int _logfile_seq_cmp(const void *a, const void *b);
+
+/**
+ * Read the checkpoint file left by an earlier snapshot, if there is one.
+ */
+static gearman_return_t _logfile_checkpoint_read(gearman_st *gearman,
+                                                 gearman_queue_logfile_st *queue);
+
+/**
+ * Replace the checkpoint file with one holding seq.
+ */
+static bool _logfile_checkpoint_write(gearman_queue_logfile_st *queue,
+                                      uint32_t seq);
+
+/**
+ * Read the segments left in the directory and build the index from them.
+ */
+static gearman_return_t _logfile_load(gearman_st *gearman,
+                                      gearman_queue_logfile_st *queue);
+
+/**
+ * Start a new segment to append to.
+ */
+static gearman_return_t _logfile_open(gearman_queue_logfile_st *queue);
+
+/**
+ * Append a record to the last segment, starting a new one first if it would
+ * not fit.
+ */
+static gearman_return_t _logfile_write(gearman_queue_logfile_st *queue,
+                                       struct iovec *iov, int iovcnt,
+                                       size_t size, size_t *offset_ptr);
+
+/**
+ * Append a record built from its parts. Add records with a time to run at
+ * carry it after the header.
+ */
+static gearman_return_t _logfile_append(gearman_queue_logfile_st *queue,
+                                        gearman_queue_logfile_type_t type,
+                                        const void *unique,
+                                        size_t unique_size,
+                                        const void *function_name,
+                                        size_t function_name_size,
+                                        const void *data, size_t data_size,
+                                        gearman_job_priority_t priority,
+                                        int64_t when, size_t *offset_ptr);
+
+/**
+ * Sync the last segment to disk.
+ */
+static bool _logfile_sync(gearman_queue_logfile_st *queue);
+
+/**
+ * Drop old segments once nothing in them is needed, copying the jobs left in
+ * the oldest one forward first when it is mostly done.
+ */
+static void _logfile_compact(gearman_queue_logfile_st *queue);
+
+/**
+ * Copy the jobs left in a segment to the last one.
+ */
+static bool _logfile_copy(gearman_queue_logfile_st *queue,
+                          gearman_queue_logfile_segment_st *segment);
+
+/**
+ * Walk the records in segments from first_seq on, passing jobs still in the
+ * index to add_fn and done records to done_fn. Either may be NULL to skip
+ * that kind of record.
+ */
+static gearman_return_t _logfile_scan(gearman_st *gearman,
+                                      gearman_queue_logfile_st *queue,
+                                      uint32_t first_seq,
+                                      gearman_queue_add_fn *add_fn,
+                                      gearman_queue_done_fn *done_fn,
+                                      void *scan_fn_arg);
+
+/**
+ * Background thread for interval syncs and compaction.
+ */
+static void *_logfile_thread(void *data);
+
+/**
+ * Append and index an add record, with the queue lock held.
+ */
+static gearman_return_t _logfile_add_record(gearman_queue_logfile_st *queue,
+                                            const void *unique,
+                                            size_t unique_size,
+                                            const void *function_name,
+                                            size_t function_name_size,
+                                            const void *data, size_t data_size,
+                                            gearman_job_priority_t priority,
+                                            int64_t when);
+
+/**
+ * Append a done record and drop the job from the index, with the queue lock
+ * held. Jobs the index does not have are skipped.
+ */
+static gearman_return_t _logfile_done_record(gearman_queue_logfile_st *queue,
+                                             const void *unique,
+                                             size_t unique_size,
+                                             const void *function_name,
+                                             size_t function_name_size);
+
+/* Queue callback functions. */
+static gearman_return_t _logfile_add(gearman_st *gearman, void *fn_arg,
+                                     const void *unique, size_t unique_size,
+                                     const void *function_name,
+                                     size_t function_name_size,
+                                     const void *data, size_t data_size,
+                                     gearman_job_priority_t priority,
+                                     int64_t when);
+static gearman_return_t _logfile_flush(gearman_st *gearman, void *fn_arg);
+static gearman_return_t _logfile_done(gearman_st *gearman, void *fn_arg,
+                                      const void *unique,
+                                      size_t unique_size,
+                                      const void *function_name,
+                                      size_t function_name_size);
+static gearman_return_t _logfile_replay(gearman_st *gearman, void *fn_arg,
+                                        gearman_queue_add_fn *add_fn,
+                                        void *add_fn_arg);
+static gearman_return_t _logfile_add_batch(gearman_st *gearman, void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count);
+static gearman_return_t _logfile_done_batch(gearman_st *gearman, void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count);
+static gearman_return_t _logfile_mark(gearman_st *gearman, void *fn_arg,
+                                      uint64_t *mark);
+static gearman_return_t _logfile_checkpoint(gearman_st *gearman, void *fn_arg,
+                                            uint64_t mark);
+static gearman_return_t _logfile_replay_tail(gearman_st *gearman, void *fn_arg,
+                                             uint64_t mark,
+                                             gearman_queue_add_fn *add_fn,
+                                             gearman_queue_done_fn *done_fn,
+                                             void *replay_fn_arg);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+gearman_return_t gearman_queue_logfile_conf(gearman_conf_st *conf)
+{
+  gearman_conf_module_st *module;
+
+  module= gearman_conf_module_create(conf, NULL, "logfile");
+  if (module == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+#define MCO(__name, __value, __help) \
+  gearman_conf_module_add_option(module, __name, 0, __value, __help);
+
+  MCO("dir", "DIR", "Directory to keep the log files in.")
+  MCO("segment-size", "MEGABYTES",
+      "Size to start a new log file at. Default=64.")
+  MCO("sync", "POLICY",
+      "When to sync the log to disk: always, interval (once a second) or "
+      "never. Default=always.")
+
+  return gearman_conf_return(conf);
+}
+
+gearman_return_t gearman_queue_logfile_init(gearman_st *gearman,
+                                            gearman_conf_st *conf)
+{
+  gearman_queue_logfile_st *queue;
+  gearman_conf_module_st *module;
+  const char *name;
+  const char *value;
+  gearman_return_t ret;
+
+  GEARMAN_INFO(gearman, "Initializing logfile module")
+
+  queue= malloc(sizeof(gearman_queue_logfile_st));
+  if (queue == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  memset(queue, 0, sizeof(gearman_queue_logfile_st));
+  queue->fd= -1;
+  queue->sync= GEARMAN_QUEUE_LOGFILE_SYNC_ALWAYS;
+  queue->segment_size= GEARMAN_QUEUE_LOGFILE_DEFAULT_SEGMENT_SIZE * 1024 * 1024;
+  (void) pthread_mutex_init(&(queue->lock), NULL);
+  (void) pthread_cond_init(&(queue->cond), NULL);
+
+  gearman_set_queue_fn_arg(gearman, queue);
+
+  /* Get module and parse the option values that were given. */
+  module= gearman_conf_module_find(conf, "logfile");
+  if (module == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init",
+                      "gearman_conf_module_find:NULL")
+    gearman_queue_logfile_deinit(gearman);
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  while (gearman_conf_module_value(module, &name, &value))
+  {
+    if (!strcmp(name, "dir"))
+    {
+      if (queue->dir != NULL)
+        free(queue->dir);
+
+      queue->dir= strdup(value);
+      if (queue->dir == NULL)
+      {
+        gearman_queue_logfile_deinit(gearman);
+        GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init", "strdup")
+        return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+      }
+    }
+    else if (!strcmp(name, "segment-size"))
+      queue->segment_size= (size_t)strtoull(value, NULL, 10) * 1024 * 1024;
+    else if (!strcmp(name, "sync"))
+    {
+      if (!strcmp(value, "always"))
+        queue->sync= GEARMAN_QUEUE_LOGFILE_SYNC_ALWAYS;
+      else if (!strcmp(value, "interval"))
+        queue->sync= GEARMAN_QUEUE_LOGFILE_SYNC_INTERVAL;
+      else if (!strcmp(value, "never"))
+        queue->sync= GEARMAN_QUEUE_LOGFILE_SYNC_NEVER;
+      else
+      {
+        gearman_queue_logfile_deinit(gearman);
+        GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init",
+                          "Unknown sync policy: %s", value)
+        return GEARMAN_QUEUE_ERROR;
+      }
+    }
+    else
+    {
+      gearman_queue_logfile_deinit(gearman);
+      GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init",
+                        "Unknown argument: %s", name)
+      return GEARMAN_QUEUE_ERROR;
+    }
+  }
+
+  if (queue->dir == NULL)
+  {
+    gearman_queue_logfile_deinit(gearman);
+    GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init",
+                      "missing required --logfile-dir argument")
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  if (queue->segment_size == 0)
+    queue->segment_size= GEARMAN_QUEUE_LOGFILE_DEFAULT_SEGMENT_SIZE * 1024 *
+                         1024;
+
+  queue->hash= calloc(GEARMAN_QUEUE_LOGFILE_HASH_SIZE,
+                      sizeof(gearman_queue_logfile_entry_st *));
+  if (queue->hash == NULL)
+  {
+    gearman_queue_logfile_deinit(gearman);
+    GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init", "calloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  queue->hash_size= GEARMAN_QUEUE_LOGFILE_HASH_SIZE;
+
+  ret= _logfile_checkpoint_read(gearman, queue);
+  if (ret == GEARMAN_SUCCESS)
+    ret= _logfile_load(gearman, queue);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    gearman_queue_logfile_deinit(gearman);
+    return ret;
+  }
+
+  if (_logfile_open(queue) != GEARMAN_SUCCESS)
+  {
+    gearman_queue_logfile_deinit(gearman);
+    GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init", "open:%s:%d",
+                      queue->dir, errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  if (pthread_create(&(queue->thread), NULL, _logfile_thread, queue) != 0)
+  {
+    gearman_queue_logfile_deinit(gearman);
+    GEARMAN_ERROR_SET(gearman, "gearman_queue_logfile_init", "pthread_create")
+    return GEARMAN_PTHREAD;
+  }
+
+  queue->thread_started= true;
+
+  gearman_set_queue_add(gearman, _logfile_add);
+  gearman_set_queue_flush(gearman, _logfile_flush);
+  gearman_set_queue_done(gearman, _logfile_done);
+  gearman_set_queue_replay(gearman, _logfile_replay);
+  gearman_set_queue_add_batch(gearman, _logfile_add_batch);
+  gearman_set_queue_done_batch(gearman, _logfile_done_batch);
+  gearman_set_queue_mark(gearman, _logfile_mark);
+  gearman_set_queue_checkpoint(gearman, _logfile_checkpoint);
+  gearman_set_queue_replay_tail(gearman, _logfile_replay_tail);
+  gearman_set_options(gearman, GEARMAN_QUEUE_REPLAY_CONCURRENT, 1);
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearman_queue_logfile_deinit(gearman_st *gearman)
+{
+  gearman_queue_logfile_st *queue;
+  gearman_queue_logfile_segment_st *segment;
+  gearman_queue_logfile_entry_st *entry;
+  uint32_t x;
+
+  GEARMAN_INFO(gearman, "Shutting down logfile queue module")
+
+  queue= (gearman_queue_logfile_st *)gearman_queue_fn_arg(gearman);
+  gearman_set_queue_fn_arg(gearman, NULL);
+
+  if (queue->thread_started)
+  {
+    (void) pthread_mutex_lock(&(queue->lock));
+    queue->shutdown= true;
+    (void) pthread_cond_signal(&(queue->cond));
+    (void) pthread_mutex_unlock(&(queue->lock));
+    (void) pthread_join(queue->thread, NULL);
+  }
+
+  if (queue->fd != -1)
+  {
+    if (queue->dirty && queue->sync != GEARMAN_QUEUE_LOGFILE_SYNC_NEVER)
+      (void) _logfile_sync(queue);
+
+    (void) close(queue->fd);
+  }
+
+  for (x= 0; x < queue->hash_size; x++)
+  {
+    while (queue->hash[x] != NULL)
+    {
+      entry= queue->hash[x];
+      queue->hash[x]= entry->next;
+      free(entry);
+    }
+  }
+
+  while (queue->segment_list != NULL)
+  {
+    segment= queue->segment_list;
+    queue->segment_list= segment->next;
+    free(segment);
+  }
+
+  if (queue->hash != NULL)
+    free(queue->hash);
+
+  if (queue->dir != NULL)
+    free(queue->dir);
+
+  (void) pthread_cond_destroy(&(queue->cond));
+  (void) pthread_mutex_destroy(&(queue->lock));
+
+  free(queue);
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearmand_queue_logfile_init(gearmand_st *gearmand,
+                                             gearman_conf_st *conf)
+{
+  return gearman_queue_logfile_init(gearmand->server.gearman, conf);
+}
+
+gearman_return_t gearmand_queue_logfile_deinit(gearmand_st *gearmand)
+{
+  return gearman_queue_logfile_deinit(gearmand->server.gearman);
+}
+
+/*
+ * Private definitions
+ */
+
+static uint32_t _logfile_checksum(uint32_t value, const uint8_t *data,
+                                  size_t size)
+{
+  while (size--)
+  {
+    value+= *data++;
+    value+= (value << 10);
+    value^= (value >> 6);
+  }
+
+  return value;
+}
+
+static uint32_t _logfile_checksum_end(uint32_t value)
+{
+  value+= (value << 3);
+  value^= (value >> 11);
+  value+= (value << 15);
+
+  return value;
+}
+
+static void _logfile_path(gearman_queue_logfile_st *queue, uint32_t seq,
+                          char *path)
+{
+  snprintf(path, GEARMAN_QUEUE_LOGFILE_PATH_SIZE,
+           "%s/" GEARMAN_QUEUE_LOGFILE_NAME, queue->dir, seq);
+}
+
+static bool _logfile_parse(const uint8_t *data, size_t size,
+                           gearman_queue_logfile_record_st *record)
+{
+  uint32_t checksum;
+  uint32_t tmp;
+  uint16_t tmp16;
+  size_t header_size= GEARMAN_QUEUE_LOGFILE_HEADER_SIZE;
+
+  if (size < GEARMAN_QUEUE_LOGFILE_HEADER_SIZE)
+    return false;
+
+  record->type= (gearman_queue_logfile_type_t)data[0];
+  record->when= 0;
+  if (record->type == GEARMAN_QUEUE_LOGFILE_ADD_WHEN)
+  {
+    if (size < GEARMAN_QUEUE_LOGFILE_HEADER_SIZE + 8)
+      return false;
+
+    memcpy(&tmp, data + header_size, 4);
+    record->when= (int64_t)((uint64_t)ntohl(tmp) << 32);
+    memcpy(&tmp, data + header_size + 4, 4);
+    record->when|= (int64_t)ntohl(tmp);
+    header_size+= 8;
+
+    /* Everything else treats it as any other add record. */
+    record->type= GEARMAN_QUEUE_LOGFILE_ADD;
+  }
+  else if (record->type != GEARMAN_QUEUE_LOGFILE_ADD &&
+           record->type != GEARMAN_QUEUE_LOGFILE_DONE)
+  {
+    return false;
+  }
+
+  record->priority= (gearman_job_priority_t)data[1];
+  if (record->priority >= GEARMAN_JOB_PRIORITY_MAX)
+    return false;
+
+  memcpy(&tmp16, data + 2, 2);
+  record->function_name_size= ntohs(tmp16);
+  memcpy(&tmp, data + 4, 4);
+  record->unique_size= ntohl(tmp);
+  memcpy(&tmp, data + 8, 4);
+  record->data_size= ntohl(tmp);
+
+  if (record->type == GEARMAN_QUEUE_LOGFILE_DONE && record->data_size != 0)
+    return false;
+
+  if (record->function_name_size + record->unique_size > size - header_size ||
+      record->data_size > size - header_size - record->function_name_size -
+                          record->unique_size)
+  {
+    return false;
+  }
+
+  record->size= header_size + record->function_name_size +
+                record->unique_size + record->data_size;
+  record->function_name= data + header_size;
+  record->unique= record->function_name + record->function_name_size;
+  record->data= record->unique + record->unique_size;
+
+  checksum= _logfile_checksum(0, data, 12);
+  checksum= _logfile_checksum(checksum,
+                              data + GEARMAN_QUEUE_LOGFILE_HEADER_SIZE,
+                              record->size - GEARMAN_QUEUE_LOGFILE_HEADER_SIZE);
+  memcpy(&tmp, data + 12, 4);
+
+  /* A torn write at the end of the log shows up here. */
+  return ntohl(tmp) == _logfile_checksum_end(checksum);
+}
+
+static gearman_queue_logfile_entry_st **
+_logfile_find(gearman_queue_logfile_st *queue, const void *function_name,
+              size_t function_name_size, const void *unique,
+              size_t unique_size, uint32_t *key_ptr)
+{
+  gearman_queue_logfile_entry_st **link;
+  gearman_queue_logfile_entry_st *entry;
+  uint32_t key;
+
+  key= _logfile_checksum(0, function_name, function_name_size);
+  key= _logfile_checksum(key, unique, unique_size);
+  key= _logfile_checksum_end(key);
+  if (key_ptr != NULL)
+    *key_ptr= key;
+
+  for (link= &(queue->hash[key & (queue->hash_size - 1)]); *link != NULL;
+       link= &((*link)->next))
+  {
+    entry= *link;
+    if (entry->key == key && entry->function_name_size == function_name_size &&
+        entry->unique_size == unique_size &&
+        !memcmp(entry + 1, function_name, function_name_size) &&
+        !memcmp((uint8_t *)(entry + 1) + function_name_size, unique,
+                unique_size))
+    {
+      break;
+    }
+  }
+
+  return link;
+}
+
+static gearman_return_t _logfile_index(gearman_queue_logfile_st *queue,
+                                       const void *function_name,
+                                       size_t function_name_size,
+                                       const void *unique, size_t unique_size,
+                                       gearman_queue_logfile_segment_st *segment,
+                                       size_t offset)
+{
+  gearman_queue_logfile_entry_st **link;
+  gearman_queue_logfile_entry_st **hash;
+  gearman_queue_logfile_entry_st *entry;
+  uint32_t key;
+  uint32_t x;
+
+  link= _logfile_find(queue, function_name, function_name_size, unique,
+                      unique_size, &key);
+  if (*link != NULL)
+  {
+    /* The job was copied forward, or added again after being done. */
+    entry= *link;
+    entry->segment->live_count--;
+  }
+  else
+  {
+    /* Grow the table to keep chains short. */
+    if (queue->entry_count >= queue->hash_size &&
+        queue->hash_size < (UINT32_MAX >> 1))
+    {
+      hash= calloc((size_t)queue->hash_size << 1,
+                   sizeof(gearman_queue_logfile_entry_st *));
+      if (hash != NULL)
+      {
+        for (x= 0; x < queue->hash_size; x++)
+        {
+          while (queue->hash[x] != NULL)
+          {
+            entry= queue->hash[x];
+            queue->hash[x]= entry->next;
+            entry->next= hash[entry->key & ((queue->hash_size << 1) - 1)];
+            hash[entry->key & ((queue->hash_size << 1) - 1)]= entry;
+          }
+        }
+
+        free(queue->hash);
+        queue->hash= hash;
+        queue->hash_size<<= 1;
+        link= &(queue->hash[key & (queue->hash_size - 1)]);
+      }
+    }
+
+    entry= malloc(sizeof(gearman_queue_logfile_entry_st) + function_name_size +
+                  unique_size);
+    if (entry == NULL)
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+    entry->key= key;
+    entry->function_name_size= function_name_size;
+    entry->unique_size= (uint32_t)unique_size;
+    memcpy(entry + 1, function_name, function_name_size);
+    memcpy((uint8_t *)(entry + 1) + function_name_size, unique, unique_size);
+    entry->next= *link;
+    *link= entry;
+    queue->entry_count++;
+  }
+
+  entry->segment= segment;
+  entry->offset= offset;
+  segment->live_count++;
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _logfile_unindex(gearman_queue_logfile_st *queue,
+                             gearman_queue_logfile_entry_st **link)
+{
+  gearman_queue_logfile_entry_st *entry= *link;
+
+  *link= entry->next;
+  entry->segment->live_count--;
+  queue->entry_count--;
+  free(entry);
+}
+
+static uint8_t *_logfile_map(gearman_queue_logfile_st *queue,
+                             gearman_queue_logfile_segment_st *segment)
+{
+  char path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+  void *map;
+  int fd;
+
+  if (segment->size == 0)
+    return NULL;
+
+  _logfile_path(queue, segment->seq, path);
+
+  fd= open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  map= mmap(NULL, segment->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  (void) close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  (void) madvise(map, segment->size, MADV_SEQUENTIAL);
+
+  return map;
+}
+
+static int _logfile_seq_cmp(const void *a, const void *b)
+{
+  uint32_t seq_a= *(const uint32_t *)a;
+  uint32_t seq_b= *(const uint32_t *)b;
+
+  return seq_a < seq_b ? -1 : (seq_a > seq_b ? 1 : 0);
+}
+
+static gearman_return_t _logfile_checkpoint_read(gearman_st *gearman,
+                                                 gearman_queue_logfile_st *queue)
+{
+  char path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+  unsigned int seq;
+  FILE *fp;
+
+  snprintf(path, GEARMAN_QUEUE_LOGFILE_PATH_SIZE,
+           "%s/" GEARMAN_QUEUE_LOGFILE_CHECKPOINT_NAME, queue->dir);
+
+  fp= fopen(path, "r");
+  if (fp == NULL)
+  {
+    if (errno == ENOENT)
+      return GEARMAN_SUCCESS;
+
+    GEARMAN_ERROR_SET(gearman, "_logfile_checkpoint_read", "fopen:%s/"
+                      GEARMAN_QUEUE_LOGFILE_CHECKPOINT_NAME ":%d", queue->dir,
+                      errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  if (fscanf(fp, "%u", &seq) != 1)
+  {
+    (void) fclose(fp);
+    GEARMAN_ERROR_SET(gearman, "_logfile_checkpoint_read", "bad checkpoint:%s/"
+                      GEARMAN_QUEUE_LOGFILE_CHECKPOINT_NAME, queue->dir)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  (void) fclose(fp);
+
+  queue->marked= true;
+  queue->checkpoint= (uint32_t)seq;
+
+  return GEARMAN_SUCCESS;
+}
+
+static bool _logfile_checkpoint_write(gearman_queue_logfile_st *queue,
+                                      uint32_t seq)
+{
+  char path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+  char tmp_path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+  char buffer[16];
+  int length;
+  int fd;
+
+  snprintf(path, GEARMAN_QUEUE_LOGFILE_PATH_SIZE,
+           "%s/" GEARMAN_QUEUE_LOGFILE_CHECKPOINT_NAME, queue->dir);
+  snprintf(tmp_path, GEARMAN_QUEUE_LOGFILE_PATH_SIZE,
+           "%s/" GEARMAN_QUEUE_LOGFILE_CHECKPOINT_NAME ".tmp", queue->dir);
+
+  length= snprintf(buffer, sizeof(buffer), "%u\n", seq);
+
+  fd= open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+    return false;
+
+  if (write(fd, buffer, (size_t)length) != length || fsync(fd) == -1)
+  {
+    (void) close(fd);
+    (void) unlink(tmp_path);
+    return false;
+  }
+
+  (void) close(fd);
+
+  return rename(tmp_path, path) == 0;
+}
+
+static gearman_return_t _logfile_load(gearman_st *gearman,
+                                      gearman_queue_logfile_st *queue)
+{
+  char path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+  gearman_queue_logfile_segment_st *segment;
+  gearman_queue_logfile_record_st record;
+  gearman_queue_logfile_entry_st **link;
+  struct dirent *dirent;
+  struct stat st;
+  DIR *dir;
+  uint32_t *seq_list= NULL;
+  uint32_t *new_seq_list;
+  uint32_t seq_count= 0;
+  uint32_t seq_total= 0;
+  uint32_t seq;
+  uint32_t x;
+  uint8_t *map;
+  size_t offset;
+  char end;
+  gearman_return_t ret;
+
+  dir= opendir(queue->dir);
+  if (dir == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_load", "opendir:%s:%d", queue->dir,
+                      errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  while ((dirent= readdir(dir)) != NULL)
+  {
+    if (sscanf(dirent->d_name, "gearmand-%10u.lo%c", &seq, &end) != 2 ||
+        end != 'g')
+    {
+      continue;
+    }
+
+    if (seq_count == seq_total)
+    {
+      seq_total= seq_total == 0 ? 64 : seq_total << 1;
+      new_seq_list= realloc(seq_list, seq_total * sizeof(uint32_t));
+      if (new_seq_list == NULL)
+      {
+        free(seq_list);
+        (void) closedir(dir);
+        GEARMAN_ERROR_SET(gearman, "_logfile_load", "realloc")
+        return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+      }
+
+      seq_list= new_seq_list;
+    }
+
+    seq_list[seq_count++]= seq;
+  }
+
+  (void) closedir(dir);
+
+  if (seq_count > 0)
+    qsort(seq_list, seq_count, sizeof(uint32_t), _logfile_seq_cmp);
+
+  for (x= 0; x < seq_count; x++)
+  {
+    _logfile_path(queue, seq_list[x], path);
+
+    /* Segments before the checkpoint are in the server's snapshot, and were
+       only left behind if it stopped while dropping them. */
+    if (seq_list[x] < queue->checkpoint || stat(path, &st) == -1 ||
+        st.st_size == 0)
+    {
+      (void) unlink(path);
+      continue;
+    }
+
+    segment= malloc(sizeof(gearman_queue_logfile_segment_st));
+    if (segment == NULL)
+    {
+      free(seq_list);
+      GEARMAN_ERROR_SET(gearman, "_logfile_load", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    segment->seq= seq_list[x];
+    segment->add_count= 0;
+    segment->live_count= 0;
+    segment->size= (size_t)st.st_size;
+    segment->next= NULL;
+
+    if (queue->segment_end == NULL)
+      queue->segment_list= segment;
+    else
+      queue->segment_end->next= segment;
+    queue->segment_end= segment;
+
+    map= _logfile_map(queue, segment);
+    if (map == NULL)
+    {
+      free(seq_list);
+      GEARMAN_ERROR_SET(gearman, "_logfile_load",
+                        "mmap:%s/" GEARMAN_QUEUE_LOGFILE_NAME ":%d", queue->dir,
+                        segment->seq, errno)
+      return GEARMAN_QUEUE_ERROR;
+    }
+
+    for (offset= 0; offset < segment->size; offset+= record.size)
+    {
+      if (!_logfile_parse(map + offset, segment->size - offset, &record))
+        break;
+
+      if (record.type == GEARMAN_QUEUE_LOGFILE_ADD)
+      {
+        ret= _logfile_index(queue, record.function_name,
+                            record.function_name_size, record.unique,
+                            record.unique_size, segment, offset);
+        if (ret != GEARMAN_SUCCESS)
+        {
+          (void) munmap(map, segment->size);
+          free(seq_list);
+          GEARMAN_ERROR_SET(gearman, "_logfile_load", "malloc")
+          return ret;
+        }
+
+        segment->add_count++;
+      }
+      else
+      {
+        link= _logfile_find(queue, record.function_name,
+                            record.function_name_size, record.unique,
+                            record.unique_size, NULL);
+        if (*link != NULL)
+          _logfile_unindex(queue, link);
+      }
+    }
+
+    (void) munmap(map, segment->size);
+
+    /* Anything after the last whole record was never fully written, and a
+       new segment is started below, so nothing will be appended after it. */
+    if (offset < segment->size)
+    {
+      GEARMAN_INFO(gearman, "logfile ignoring %zu bytes at the end of %s/"
+                   GEARMAN_QUEUE_LOGFILE_NAME, segment->size - offset,
+                   queue->dir, segment->seq)
+      (void) truncate(path, (off_t)offset);
+      segment->size= offset;
+    }
+  }
+
+  free(seq_list);
+
+  GEARMAN_INFO(gearman, "logfile found %u queued jobs", queue->entry_count)
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_open(gearman_queue_logfile_st *queue)
+{
+  char path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+  gearman_queue_logfile_segment_st *segment;
+  int fd;
+
+  segment= malloc(sizeof(gearman_queue_logfile_segment_st));
+  if (segment == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  /* Segments before the checkpoint are gone, so numbering goes on from it
+     even when none are left. */
+  if (queue->segment_end != NULL)
+    segment->seq= queue->segment_end->seq + 1;
+  else
+    segment->seq= queue->checkpoint > 0 ? queue->checkpoint : 1;
+  segment->add_count= 0;
+  segment->live_count= 0;
+  segment->size= 0;
+  segment->next= NULL;
+
+  _logfile_path(queue, segment->seq, path);
+
+  fd= open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (fd == -1)
+  {
+    free(segment);
+    return GEARMAN_ERRNO;
+  }
+
+  if (queue->fd != -1)
+  {
+    /* Finished segments are only read again, so get them on disk now. */
+    if (queue->sync != GEARMAN_QUEUE_LOGFILE_SYNC_NEVER)
+      (void) fdatasync(queue->fd);
+    (void) close(queue->fd);
+  }
+
+  queue->fd= fd;
+  queue->dirty= false;
+
+  if (queue->segment_end == NULL)
+    queue->segment_list= segment;
+  else
+    queue->segment_end->next= segment;
+  queue->segment_end= segment;
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_write(gearman_queue_logfile_st *queue,
+                                       struct iovec *iov, int iovcnt,
+                                       size_t size, size_t *offset_ptr)
+{
+  ssize_t written;
+  gearman_return_t ret;
+
+  if (queue->segment_end->size > 0 &&
+      queue->segment_end->size + size > queue->segment_size)
+  {
+    ret= _logfile_open(queue);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  *offset_ptr= queue->segment_end->size;
+
+  while (iovcnt > 0)
+  {
+    written= writev(queue->fd, iov, iovcnt);
+    if (written == -1)
+    {
+      if (errno == EINTR)
+        continue;
+
+      /* Drop the partial record so the segment stays readable. */
+      (void) ftruncate(queue->fd, (off_t)(*offset_ptr));
+      return GEARMAN_ERRNO;
+    }
+
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+    {
+      written-= (ssize_t)(iov->iov_len);
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0)
+    {
+      iov->iov_base= (uint8_t *)(iov->iov_base) + written;
+      iov->iov_len-= (size_t)written;
+    }
+  }
+
+  queue->segment_end->size+= size;
+  queue->dirty= true;
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_append(gearman_queue_logfile_st *queue,
+                                        gearman_queue_logfile_type_t type,
+                                        const void *unique,
+                                        size_t unique_size,
+                                        const void *function_name,
+                                        size_t function_name_size,
+                                        const void *data, size_t data_size,
+                                        gearman_job_priority_t priority,
+                                        int64_t when, size_t *offset_ptr)
+{
+  uint8_t header[GEARMAN_QUEUE_LOGFILE_HEADER_SIZE + 8];
+  size_t header_size= GEARMAN_QUEUE_LOGFILE_HEADER_SIZE;
+  struct iovec iov[4];
+  uint32_t checksum;
+  uint32_t tmp;
+  uint16_t tmp16;
+
+  if (type == GEARMAN_QUEUE_LOGFILE_ADD && when != 0)
+  {
+    type= GEARMAN_QUEUE_LOGFILE_ADD_WHEN;
+    tmp= htonl((uint32_t)((uint64_t)when >> 32));
+    memcpy(header + header_size, &tmp, 4);
+    tmp= htonl((uint32_t)when);
+    memcpy(header + header_size + 4, &tmp, 4);
+    header_size+= 8;
+  }
+
+  header[0]= (uint8_t)type;
+  header[1]= (uint8_t)priority;
+  tmp16= htons((uint16_t)function_name_size);
+  memcpy(header + 2, &tmp16, 2);
+  tmp= htonl((uint32_t)unique_size);
+  memcpy(header + 4, &tmp, 4);
+  tmp= htonl((uint32_t)data_size);
+  memcpy(header + 8, &tmp, 4);
+
+  checksum= _logfile_checksum(0, header, 12);
+  checksum= _logfile_checksum(checksum,
+                              header + GEARMAN_QUEUE_LOGFILE_HEADER_SIZE,
+                              header_size - GEARMAN_QUEUE_LOGFILE_HEADER_SIZE);
+  checksum= _logfile_checksum(checksum, function_name, function_name_size);
+  checksum= _logfile_checksum(checksum, unique, unique_size);
+  checksum= _logfile_checksum(checksum, data, data_size);
+  tmp= htonl(_logfile_checksum_end(checksum));
+  memcpy(header + 12, &tmp, 4);
+
+  iov[0].iov_base= header;
+  iov[0].iov_len= header_size;
+  iov[1].iov_base= (void *)function_name;
+  iov[1].iov_len= function_name_size;
+  iov[2].iov_base= (void *)unique;
+  iov[2].iov_len= unique_size;
+  iov[3].iov_base= (void *)data;
+  iov[3].iov_len= data_size;
+
+  return _logfile_write(queue, iov, 4, header_size + function_name_size +
+                        unique_size + data_size, offset_ptr);
+}
+
+static bool _logfile_sync(gearman_queue_logfile_st *queue)
+{
+  if (fdatasync(queue->fd) == -1)
+    return false;
+
+  queue->dirty= false;
+  queue->sync_time= time(NULL);
+
+  return true;
+}
+
+static void _logfile_compact(gearman_queue_logfile_st *queue)
+{
+  char path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+  gearman_queue_logfile_segment_st *segment;
+
+  /* A replay lets go of the lock between jobs, so leave the segments it is
+     walking alone until it is done. Once the server takes snapshots, done
+     records after the mark are needed to take jobs out of the snapshot, and
+     checkpoints drop old segments instead. */
+  if (queue->replaying || queue->marked)
+    return;
+
+  /* Done records only ever refer to jobs in the same or older segments, so
+     segments are always dropped oldest first. Copying lets go of the lock,
+     so a snapshot may have started meanwhile. */
+  while (queue->segment_list != queue->segment_end && !(queue->marked))
+  {
+    segment= queue->segment_list;
+
+    if (segment->live_count > 0)
+    {
+      if ((uint64_t)(segment->live_count) * 100 >
+          (uint64_t)(segment->add_count) * GEARMAN_QUEUE_LOGFILE_COMPACT_PERCENT)
+      {
+        return;
+      }
+
+      if (!_logfile_copy(queue, segment))
+        return;
+
+      /* The copies must be on disk before the originals go away. */
+      if (queue->sync != GEARMAN_QUEUE_LOGFILE_SYNC_NEVER &&
+          !_logfile_sync(queue))
+      {
+        return;
+      }
+    }
+
+    _logfile_path(queue, segment->seq, path);
+    (void) unlink(path);
+
+    queue->segment_list= segment->next;
+    free(segment);
+  }
+}
+
+static bool _logfile_copy(gearman_queue_logfile_st *queue,
+                          gearman_queue_logfile_segment_st *segment)
+{
+  gearman_queue_logfile_record_st record;
+  gearman_queue_logfile_entry_st **link;
+  struct iovec iov[1];
+  uint8_t *map;
+  size_t offset;
+  size_t new_offset;
+  uint32_t count= 0;
+
+  map= _logfile_map(queue, segment);
+  if (map == NULL)
+    return false;
+
+  for (offset= 0; offset < segment->size; offset+= record.size)
+  {
+    if (!_logfile_parse(map + offset, segment->size - offset, &record))
+      break;
+
+    if (record.type != GEARMAN_QUEUE_LOGFILE_ADD)
+      continue;
+
+    link= _logfile_find(queue, record.function_name, record.function_name_size,
+                        record.unique, record.unique_size, NULL);
+    if (*link == NULL || (*link)->segment != segment ||
+        (*link)->offset != offset)
+    {
+      continue;
+    }
+
+    iov[0].iov_base= map + offset;
+    iov[0].iov_len= record.size;
+    if (_logfile_write(queue, iov, 1, record.size, &new_offset) !=
+        GEARMAN_SUCCESS)
+    {
+      break;
+    }
+
+    segment->live_count--;
+    (*link)->segment= queue->segment_end;
+    (*link)->offset= new_offset;
+    queue->segment_end->live_count++;
+    queue->segment_end->add_count++;
+
+    /* Only this thread drops segments, so the one being copied stays put
+       while others get a turn at the lock. */
+    if (++count == GEARMAN_QUEUE_LOGFILE_COMPACT_BATCH)
+    {
+      count= 0;
+      (void) pthread_mutex_unlock(&(queue->lock));
+      (void) pthread_mutex_lock(&(queue->lock));
+    }
+  }
+
+  (void) munmap(map, segment->size);
+
+  return segment->live_count == 0;
+}
+
+static void *_logfile_thread(void *data)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)data;
+  struct timespec deadline;
+  struct timeval now;
+
+  (void) pthread_mutex_lock(&(queue->lock));
+
+  while (!(queue->shutdown))
+  {
+    (void) gettimeofday(&now, NULL);
+    deadline.tv_sec= now.tv_sec + 1;
+    deadline.tv_nsec= now.tv_usec * 1000;
+    (void) pthread_cond_timedwait(&(queue->cond), &(queue->lock), &deadline);
+
+    if (queue->shutdown)
+      break;
+
+    if (queue->dirty && queue->sync == GEARMAN_QUEUE_LOGFILE_SYNC_INTERVAL)
+      (void) _logfile_sync(queue);
+
+    _logfile_compact(queue);
+  }
+
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  return NULL;
+}
+
+static gearman_return_t _logfile_add_record(gearman_queue_logfile_st *queue,
+                                            const void *unique,
+                                            size_t unique_size,
+                                            const void *function_name,
+                                            size_t function_name_size,
+                                            const void *data, size_t data_size,
+                                            gearman_job_priority_t priority,
+                                            int64_t when)
+{
+  size_t offset;
+  gearman_return_t ret;
+
+  ret= _logfile_append(queue, GEARMAN_QUEUE_LOGFILE_ADD, unique, unique_size,
+                       function_name, function_name_size, data, data_size,
+                       priority, when, &offset);
+  if (ret == GEARMAN_SUCCESS)
+  {
+    ret= _logfile_index(queue, function_name, function_name_size, unique,
+                        unique_size, queue->segment_end, offset);
+    if (ret == GEARMAN_SUCCESS)
+      queue->segment_end->add_count++;
+  }
+
+  return ret;
+}
+
+static gearman_return_t _logfile_done_record(gearman_queue_logfile_st *queue,
+                                             const void *unique,
+                                             size_t unique_size,
+                                             const void *function_name,
+                                             size_t function_name_size)
+{
+  gearman_queue_logfile_entry_st **link;
+  size_t offset;
+  gearman_return_t ret= GEARMAN_SUCCESS;
+
+  link= _logfile_find(queue, function_name, function_name_size, unique,
+                      unique_size, NULL);
+
+  /* After a checkpoint, jobs from dropped segments are only in the server's
+     snapshot, so they are recorded as done without being in the index. */
+  if (*link != NULL || queue->checkpoint > 0)
+  {
+    /* Done records are not synced on their own. Losing one only means the
+       job runs again after a crash. */
+    ret= _logfile_append(queue, GEARMAN_QUEUE_LOGFILE_DONE, unique,
+                         unique_size, function_name, function_name_size, NULL,
+                         0, 0, 0, &offset);
+    if (ret == GEARMAN_SUCCESS && *link != NULL)
+      _logfile_unindex(queue, link);
+  }
+
+  return ret;
+}
+
+static gearman_return_t _logfile_add(gearman_st *gearman, void *fn_arg,
+                                     const void *unique, size_t unique_size,
+                                     const void *function_name,
+                                     size_t function_name_size,
+                                     const void *data, size_t data_size,
+                                     gearman_job_priority_t priority,
+                                     int64_t when)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  gearman_return_t ret;
+
+  GEARMAN_DEBUG(gearman, "logfile add: %.*s", (uint32_t)unique_size,
+                (char *)unique)
+
+  if (function_name_size > UINT16_MAX || unique_size > UINT32_MAX ||
+      data_size > UINT32_MAX)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_add", "size too big [%zu]",
+                      data_size)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  (void) pthread_mutex_lock(&(queue->lock));
+  ret= _logfile_add_record(queue, unique, unique_size, function_name,
+                           function_name_size, data, data_size, priority,
+                           when);
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  if (ret != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_add", "write:%d", errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_flush(gearman_st *gearman, void *fn_arg)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  bool synced= true;
+
+  GEARMAN_DEBUG(gearman, "logfile flush")
+
+  (void) pthread_mutex_lock(&(queue->lock));
+
+  if (queue->dirty)
+  {
+    if (queue->sync == GEARMAN_QUEUE_LOGFILE_SYNC_ALWAYS ||
+        (queue->sync == GEARMAN_QUEUE_LOGFILE_SYNC_INTERVAL &&
+         time(NULL) - queue->sync_time >= 1))
+    {
+      synced= _logfile_sync(queue);
+    }
+  }
+
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  if (!synced)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_flush", "fdatasync:%d", errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_done(gearman_st *gearman, void *fn_arg,
+                                      const void *unique,
+                                      size_t unique_size,
+                                      const void *function_name,
+                                      size_t function_name_size)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  gearman_return_t ret;
+
+  GEARMAN_DEBUG(gearman, "logfile done: %.*s", (uint32_t)unique_size,
+                (char *)unique)
+
+  (void) pthread_mutex_lock(&(queue->lock));
+  ret= _logfile_done_record(queue, unique, unique_size, function_name,
+                            function_name_size);
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  if (ret != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_done", "write:%d", errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_replay(gearman_st *gearman, void *fn_arg,
+                                        gearman_queue_add_fn *add_fn,
+                                        void *add_fn_arg)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  char path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+
+  GEARMAN_INFO(gearman, "logfile replay start")
+
+  (void) pthread_mutex_lock(&(queue->lock));
+
+  /* Every segment is still here until the first checkpoint. */
+  if (queue->checkpoint > 0)
+  {
+    (void) pthread_mutex_unlock(&(queue->lock));
+    GEARMAN_ERROR_SET(gearman, "_logfile_replay",
+                      "jobs before log file %u are only in the server "
+                      "snapshot, start with --snapshot-file", queue->checkpoint)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  /* Snapshots are not being used after all, so compaction can go on. */
+  if (queue->marked)
+  {
+    snprintf(path, GEARMAN_QUEUE_LOGFILE_PATH_SIZE,
+             "%s/" GEARMAN_QUEUE_LOGFILE_CHECKPOINT_NAME, queue->dir);
+    if (unlink(path) == 0)
+      queue->marked= false;
+  }
+
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  return _logfile_scan(gearman, queue, 0, add_fn, NULL, add_fn_arg);
+}
+
+static gearman_return_t _logfile_scan(gearman_st *gearman,
+                                      gearman_queue_logfile_st *queue,
+                                      uint32_t first_seq,
+                                      gearman_queue_add_fn *add_fn,
+                                      gearman_queue_done_fn *done_fn,
+                                      void *scan_fn_arg)
+{
+  gearman_queue_logfile_segment_st *segment;
+  gearman_queue_logfile_record_st record;
+  gearman_queue_logfile_entry_st **link;
+  uint8_t *map;
+  size_t offset;
+  size_t size;
+  void *data;
+  gearman_return_t ret= GEARMAN_SUCCESS;
+
+  (void) pthread_mutex_lock(&(queue->lock));
+
+  queue->replaying= true;
+
+  for (segment= queue->segment_list;
+       segment != NULL && ret == GEARMAN_SUCCESS; segment= segment->next)
+  {
+    if (segment->seq < first_seq ||
+        (done_fn == NULL && segment->live_count == 0))
+    {
+      continue;
+    }
+
+    /* The last segment may grow while the lock is let go below, so only read
+       as far as it went when it was mapped. */
+    size= segment->size;
+    if (size == 0)
+      continue;
+
+    map= _logfile_map(queue, segment);
+    if (map == NULL)
+    {
+      GEARMAN_ERROR_SET(gearman, "_logfile_scan", "mmap:%d", errno)
+      ret= GEARMAN_QUEUE_ERROR;
+      break;
+    }
+
+    for (offset= 0; offset < size; offset+= record.size)
+    {
+      if (!_logfile_parse(map + offset, size - offset, &record))
+        break;
+
+      if (record.type != GEARMAN_QUEUE_LOGFILE_ADD)
+      {
+        if (done_fn == NULL)
+          continue;
+
+        (void) pthread_mutex_unlock(&(queue->lock));
+        ret= (*done_fn)(gearman, scan_fn_arg, record.unique,
+                        record.unique_size, record.function_name,
+                        record.function_name_size);
+        (void) pthread_mutex_lock(&(queue->lock));
+        if (ret != GEARMAN_SUCCESS)
+          break;
+
+        continue;
+      }
+
+      if (add_fn == NULL)
+        continue;
+
+      /* Only the newest copy of each job is still in the index. */
+      link= _logfile_find(queue, record.function_name,
+                          record.function_name_size, record.unique,
+                          record.unique_size, NULL);
+      if (*link == NULL || (*link)->segment != segment ||
+          (*link)->offset != offset)
+      {
+        continue;
+      }
+
+      if (record.data_size == 0)
+        data= NULL;
+      else
+      {
+        data= malloc(record.data_size);
+        if (data == NULL)
+        {
+          GEARMAN_ERROR_SET(gearman, "_logfile_scan", "malloc")
+          ret= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+          break;
+        }
+
+        memcpy(data, record.data, record.data_size);
+      }
+
+      /* The server may add and finish jobs from other threads while it
+         replays in the background, so don't hold them up. Segments are not
+         dropped meanwhile, and the index is looked at again for every
+         record. */
+      (void) pthread_mutex_unlock(&(queue->lock));
+      ret= (*add_fn)(gearman, scan_fn_arg, record.unique, record.unique_size,
+                     record.function_name, record.function_name_size, data,
+                     record.data_size, record.priority, record.when);
+      (void) pthread_mutex_lock(&(queue->lock));
+      if (ret != GEARMAN_SUCCESS)
+      {
+        if (data != NULL)
+          free(data);
+        break;
+      }
+    }
+
+    (void) munmap(map, size);
+  }
+
+  queue->replaying= false;
+
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  return ret;
+}
+
+static gearman_return_t _logfile_add_batch(gearman_st *gearman, void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  gearman_return_t ret= GEARMAN_SUCCESS;
+  size_t x;
+
+  GEARMAN_DEBUG(gearman, "logfile add batch: %zu", record_count)
+
+  for (x= 0; x < record_count; x++)
+  {
+    if (record[x].function_name_size > UINT16_MAX ||
+        record[x].unique_size > UINT32_MAX || record[x].data_size > UINT32_MAX)
+    {
+      GEARMAN_ERROR_SET(gearman, "_logfile_add_batch", "size too big [%zu]",
+                        record[x].data_size)
+      return GEARMAN_QUEUE_ERROR;
+    }
+  }
+
+  /* One pass under the lock, so compaction and syncs wait for the batch. */
+  (void) pthread_mutex_lock(&(queue->lock));
+
+  for (x= 0; x < record_count && ret == GEARMAN_SUCCESS; x++)
+  {
+    ret= _logfile_add_record(queue, record[x].unique, record[x].unique_size,
+                             record[x].function_name,
+                             record[x].function_name_size, record[x].data,
+                             record[x].data_size, record[x].priority,
+                             record[x].when);
+  }
+
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  if (ret != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_add_batch", "write:%d", errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_done_batch(gearman_st *gearman, void *fn_arg,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  gearman_return_t ret= GEARMAN_SUCCESS;
+  size_t x;
+
+  GEARMAN_DEBUG(gearman, "logfile done batch: %zu", record_count)
+
+  (void) pthread_mutex_lock(&(queue->lock));
+
+  for (x= 0; x < record_count && ret == GEARMAN_SUCCESS; x++)
+  {
+    ret= _logfile_done_record(queue, record[x].unique, record[x].unique_size,
+                              record[x].function_name,
+                              record[x].function_name_size);
+  }
+
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  if (ret != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_done_batch", "write:%d", errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_mark(gearman_st *gearman, void *fn_arg,
+                                      uint64_t *mark)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  gearman_return_t ret= GEARMAN_SUCCESS;
+
+  (void) pthread_mutex_lock(&(queue->lock));
+
+  /* The checkpoint file turns compaction off for good, even across restarts,
+     before any segment it would drop is needed by a snapshot. */
+  if (!(queue->marked))
+  {
+    if (_logfile_checkpoint_write(queue, queue->checkpoint))
+      queue->marked= true;
+    else
+    {
+      GEARMAN_ERROR_SET(gearman, "_logfile_mark", "checkpoint:%s:%d",
+                        queue->dir, errno)
+      ret= GEARMAN_QUEUE_ERROR;
+    }
+  }
+
+  /* The snapshot starts with the next segment, which also syncs this one. */
+  if (ret == GEARMAN_SUCCESS && queue->segment_end->size > 0 &&
+      _logfile_open(queue) != GEARMAN_SUCCESS)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_mark", "open:%s:%d", queue->dir,
+                      errno)
+    ret= GEARMAN_QUEUE_ERROR;
+  }
+
+  if (ret == GEARMAN_SUCCESS)
+    *mark= queue->segment_end->seq;
+
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  return ret;
+}
+
+static gearman_return_t _logfile_checkpoint(gearman_st *gearman, void *fn_arg,
+                                            uint64_t mark)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  char path[GEARMAN_QUEUE_LOGFILE_PATH_SIZE];
+  gearman_queue_logfile_segment_st *segment;
+  gearman_queue_logfile_entry_st **link;
+  uint32_t x;
+
+  GEARMAN_DEBUG(gearman, "logfile checkpoint: %"PRIu64, mark)
+
+  (void) pthread_mutex_lock(&(queue->lock));
+
+  if (mark <= queue->checkpoint)
+  {
+    (void) pthread_mutex_unlock(&(queue->lock));
+    return GEARMAN_SUCCESS;
+  }
+
+  if (queue->replaying || mark > queue->segment_end->seq)
+  {
+    (void) pthread_mutex_unlock(&(queue->lock));
+    GEARMAN_ERROR_SET(gearman, "_logfile_checkpoint", "bad mark:%"PRIu64,
+                      mark)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  if (!_logfile_checkpoint_write(queue, (uint32_t)mark))
+  {
+    (void) pthread_mutex_unlock(&(queue->lock));
+    GEARMAN_ERROR_SET(gearman, "_logfile_checkpoint", "checkpoint:%s:%d",
+                      queue->dir, errno)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  queue->checkpoint= (uint32_t)mark;
+
+  /* Jobs left in the old segments are in the snapshot now. */
+  for (x= 0; x < queue->hash_size; x++)
+  {
+    link= &(queue->hash[x]);
+    while (*link != NULL)
+    {
+      if ((*link)->segment->seq < queue->checkpoint)
+        _logfile_unindex(queue, link);
+      else
+        link= &((*link)->next);
+    }
+  }
+
+  while (queue->segment_list->seq < queue->checkpoint)
+  {
+    segment= queue->segment_list;
+    _logfile_path(queue, segment->seq, path);
+    (void) unlink(path);
+
+    queue->segment_list= segment->next;
+    free(segment);
+  }
+
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _logfile_replay_tail(gearman_st *gearman, void *fn_arg,
+                                             uint64_t mark,
+                                             gearman_queue_add_fn *add_fn,
+                                             gearman_queue_done_fn *done_fn,
+                                             void *replay_fn_arg)
+{
+  gearman_queue_logfile_st *queue= (gearman_queue_logfile_st *)fn_arg;
+  bool missing;
+
+  GEARMAN_INFO(gearman, "logfile replay from log file %"PRIu64, mark)
+
+  /* Without the checkpoint file, compaction may have dropped done records
+     the snapshot needs, and before the checkpoint they are gone anyway. */
+  (void) pthread_mutex_lock(&(queue->lock));
+  missing= !(queue->marked) || mark < queue->checkpoint || mark > UINT32_MAX;
+  (void) pthread_mutex_unlock(&(queue->lock));
+
+  if (missing)
+  {
+    GEARMAN_ERROR_SET(gearman, "_logfile_replay_tail",
+                      "log files from %"PRIu64" are not all there", mark)
+    return GEARMAN_QUEUE_ERROR;
+  }
+
+  return _logfile_scan(gearman, queue, (uint32_t)mark, add_fn, done_fn,
+                       replay_fn_arg);
+}
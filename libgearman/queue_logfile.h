@@ -0,0 +1,71 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Log File Queue Storage Declarations
+ */
+
+#ifndef __GEARMAN_QUEUE_LOGFILE_H__
+#define __GEARMAN_QUEUE_LOGFILE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_queue_logfile Log File Queue Storage Functions
+ * @ingroup gearman_queue
+ * Built in persistent queue that appends add and done records to segmented
+ * log files in a directory, with no external store. All jobs still queued
+ * are indexed in memory. Replay maps the segments and hands their live jobs
+ * back to the server. A background thread drops the oldest segment once
+ * every job in it is done, copying its remaining jobs forward first when
+ * most of them are.
+ * @{
+ */
+
+/**
+ * Get module configuration options.
+ */
+GEARMAN_API
+gearman_return_t gearman_queue_logfile_conf(gearman_conf_st *conf);
+
+/**
+ * Initialize the queue.
+ */
+GEARMAN_API
+gearman_return_t gearman_queue_logfile_init(gearman_st *gearman,
+                                               gearman_conf_st *conf);
+
+/**
+ * De-initialize the queue.
+ */
+GEARMAN_API
+gearman_return_t gearman_queue_logfile_deinit(gearman_st *gearman);
+
+/**
+ * Initialize the queue for a gearmand object.
+ */
+GEARMAN_API
+gearman_return_t gearmand_queue_logfile_init(gearmand_st *gearmand,
+                                                gearman_conf_st *conf);
+
+/**
+ * De-initialize the queue for a gearmand object.
+ */
+GEARMAN_API
+gearman_return_t gearmand_queue_logfile_deinit(gearmand_st *gearmand);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_QUEUE_LOGFILE_H__ */
@@ -31,7 +31,8 @@ gearman_return_t _queue_replay_add(gearman_st *gearman, void *fn_arg,
                                    const void *function_name,
                                    size_t function_name_size, const void *data,
                                    size_t data_size,
-                                   gearman_job_priority_t priority);
+                                   gearman_job_priority_t priority,
+                                   int64_t when);
 
 /**
  * Queue an error packet.
@@ -40,12 +41,45 @@ static gearman_return_t _server_error_packet(gearman_server_con_st *server_con,
                                              const char *error_code,
                                              const char *error_string);
 
+/**
+ * See if a compressed packet can be handled without decompressing it. Job
+ * data is only passed along, so it can stay compressed unless the server
+ * needs to look at it for a unique ID or store it in a persistent queue.
+ */
+static bool _server_keep_compressed(gearman_server_con_st *server_con,
+                                    gearman_packet_st *packet);
+
+/**
+ * Add every job in a SUBMIT_JOB_BATCH packet and queue a single
+ * JOB_CREATED_BATCH reply listing their handles.
+ */
+static gearman_return_t
+_server_submit_job_batch(gearman_server_con_st *server_con,
+                         gearman_packet_st *packet);
+
+/**
+ * Assign up to the number of jobs asked for in a GRAB_JOB_MULTI packet,
+ * starting with one already taken. A NO_JOB packet follows when fewer were
+ * found, so the worker knows the reply is complete.
+ */
+static gearman_return_t
+_server_grab_job_multi(gearman_server_con_st *server_con,
+                       gearman_packet_st *packet,
+                       gearman_server_job_st *server_job);
+
 /**
  * Process text commands for a connection.
  */
 static gearman_return_t _server_run_text(gearman_server_con_st *server_con,
                                          gearman_packet_st *packet);
 
+/**
+ * Get a job a work result packet refers to, if it is running on the
+ * connection that sent the packet.
+ */
+static gearman_server_job_st *
+_server_job_running(gearman_server_con_st *server_con, const char *job_handle);
+
 /**
  * Send work result packets with data back to clients.
  */
@@ -53,6 +87,47 @@ static gearman_return_t
 _server_queue_work_data(gearman_server_job_st *server_job,
                         gearman_packet_st *packet, gearman_command_t command);
 
+/**
+ * Stop reading from a worker connection once a client of the job it is
+ * streaming data for has too much of it waiting to be sent.
+ */
+static void _server_work_data_pause(gearman_server_con_st *server_con,
+                                    gearman_server_job_st *server_job);
+
+/**
+ * Answer a submit from the result cache, with a job created packet for a job
+ * handle no other job uses and the kept result right after it.
+ */
+static gearman_return_t
+_server_cache_reply(gearman_server_con_st *server_con,
+                    gearman_server_cache_entry_st *entry);
+
+/**
+ * Check the chain given with SUBMIT_JOB_CHAIN and copy it into a string for
+ * the job, which the caller frees if no job takes it.
+ * @return The copy, or NULL if a stage is empty, is in a different shard
+ *         than the first function, or memory ran out.
+ */
+static char *_server_chain_copy(gearman_server_st *server,
+                                gearman_packet_st *packet);
+
+/**
+ * Free all shards for a server.
+ */
+static void _server_shard_list_free(gearman_server_st *server);
+
+/**
+ * Free the packet slabs for a server, with the node slabs for the first
+ * node_count nodes.
+ */
+static void _server_packet_slab_free(gearman_server_st *server,
+                                     uint32_t node_count);
+
+/**
+ * Find the NUMA node a CPU belongs to, or 0 if the system does not say.
+ */
+static uint32_t _server_cpu_node(uint32_t cpu);
+
 /**
  * Wrapper for log handling.
  */
@@ -68,6 +143,7 @@ static void _log(gearman_st *gearman, gearman_verbose_t verbose,
 gearman_server_st *gearman_server_create(gearman_server_st *server)
 {
   struct utsname un;
+  uint32_t x;
 
   if (server == NULL)
   {
@@ -82,28 +158,95 @@ gearman_server_st *gearman_server_create(gearman_server_st *server)
 
   server->shutdown= false;
   server->shutdown_graceful= false;
-  server->proc_wakeup= false;
   server->proc_shutdown= false;
+  server->queue_replay_background= false;
+  server->queue_shared= false;
+  server->queue_persist_thread= false;
   server->thread_count= 0;
-  server->free_packet_count= 0;
-  server->function_count= 0;
-  server->job_count= 0;
-  server->unique_count= 0;
-  server->free_job_count= 0;
-  server->free_client_count= 0;
-  server->free_worker_count= 0;
+  server->shard_count= 0;
+  server->worker_wakeup= GEARMAN_DEFAULT_WORKER_WAKEUP;
+  server->read_budget= 0;
+  gearman_server_set_priority_levels(server, GEARMAN_DEFAULT_PRIORITY_LEVELS);
+  server->priority_age= GEARMAN_DEFAULT_PRIORITY_AGE;
+  server->affinity_wait= GEARMAN_DEFAULT_AFFINITY_WAIT;
+  server->work_data_max= GEARMAN_DEFAULT_WORK_DATA_MAX;
+  server->queue_bytes_max= GEARMAN_DEFAULT_QUEUE_BYTES_MAX;
+  server->queue_bytes= 0;
+  server->client_rate= GEARMAN_DEFAULT_CLIENT_RATE;
+  server->queue_commit_size= 0;
+  server->queue_commit_window= GEARMAN_DEFAULT_QUEUE_COMMIT_WINDOW;
+  server->spill_watermark= 0;
+  server->proc_cpu_count= 0;
+  server->lock_stats_count= 0;
+  server->proc_cpu_list= NULL;
+  server->spill_path= NULL;
+  gearman_server_stats_init(server);
+  gearman_server_replay_init(&(server->replay));
+  gearman_server_persist_init(&(server->persist));
+  gearman_server_snapshot_init(&(server->snapshot));
+  gearman_server_replica_init(&(server->replica));
   server->thread_list= NULL;
-  server->free_packet_list= NULL;
-  server->function_list= NULL;
-  server->free_job_list= NULL;
-  server->free_client_list= NULL;
-  server->free_worker_list= NULL;
+  server->shard_list= NULL;
+  server->lock_stats_list= NULL;
   server->log_fn= NULL;
   server->log_fn_arg= NULL;
-  memset(server->job_hash, 0,
-         sizeof(gearman_server_job_st *) * GEARMAN_JOB_HASH_SIZE);
-  memset(server->unique_hash, 0,
-         sizeof(gearman_server_job_st *) * GEARMAN_JOB_HASH_SIZE);
+
+  if (gearman_server_slab_create(&(server->packet_slab),
+                                 sizeof(gearman_server_packet_st)) == NULL)
+  {
+    if (server->options & GEARMAN_SERVER_ALLOCATED)
+      free(server);
+    return NULL;
+  }
+
+  /* Packets read are kept whole for parsing, while packets to send are only
+     their packed bytes, so they come from a slab of their own. */
+  if (gearman_server_slab_create(&(server->io_packet_slab),
+                                 sizeof(gearman_server_io_packet_st)) == NULL)
+  {
+    gearman_server_slab_free(&(server->packet_slab));
+    if (server->options & GEARMAN_SERVER_ALLOCATED)
+      free(server);
+    return NULL;
+  }
+
+  /* Node slabs only take memory once a thread pinned to that node uses
+     them. */
+  for (x= 0; x < GEARMAN_SERVER_NUMA_NODES; x++)
+  {
+    if (gearman_server_slab_create(&(server->node_packet_slab[x]),
+                                   sizeof(gearman_server_packet_st)) == NULL)
+    {
+      _server_packet_slab_free(server, x);
+      if (server->options & GEARMAN_SERVER_ALLOCATED)
+        free(server);
+      return NULL;
+    }
+
+    if (gearman_server_slab_create(&(server->node_io_packet_slab[x]),
+                                   sizeof(gearman_server_io_packet_st)) ==
+        NULL)
+    {
+      gearman_server_slab_free(&(server->node_packet_slab[x]));
+      _server_packet_slab_free(server, x);
+      if (server->options & GEARMAN_SERVER_ALLOCATED)
+        free(server);
+      return NULL;
+    }
+  }
+
+  gearman_server_magazine_init(&(server->packet_magazine),
+                               &(server->packet_slab));
+  gearman_server_magazine_init(&(server->io_packet_magazine),
+                               &(server->io_packet_slab));
+
+  if (pthread_mutex_init(&(server->queue_lock), NULL) != 0)
+  {
+    _server_packet_slab_free(server, GEARMAN_SERVER_NUMA_NODES);
+    if (server->options & GEARMAN_SERVER_ALLOCATED)
+      free(server);
+    return NULL;
+  }
 
   server->gearman= gearman_create(&(server->gearman_static));
   if (server->gearman == NULL)
@@ -120,73 +263,309 @@ gearman_server_st *gearman_server_create(gearman_server_st *server)
 
   snprintf(server->job_handle_prefix, GEARMAN_JOB_HANDLE_SIZE, "H:%s",
            un.nodename);
-  server->job_handle_count= 1;
+  server->job_handle_prefix_size= strlen(server->job_handle_prefix);
+
+  if (gearman_server_set_shards(server, 1) != GEARMAN_SUCCESS)
+  {
+    gearman_server_free(server);
+    return NULL;
+  }
 
   return server;
 }
 
 void gearman_server_free(gearman_server_st *server)
 {
-  uint32_t key;
-  gearman_server_packet_st *packet;
-  gearman_server_job_st *job;
-  gearman_server_client_st *client;
-  gearman_server_worker_st *worker;
-
   /* All threads should be cleaned up before calling this. */
   assert(server->thread_list == NULL);
 
-  for (key= 0; key < GEARMAN_JOB_HASH_SIZE; key++)
+  /* Peers keep the jobs freed below, they are only gone from this server. */
+  gearman_server_replica_free(server);
+
+  _server_shard_list_free(server);
+
+  gearman_server_magazine_flush(&(server->packet_magazine));
+  gearman_server_magazine_flush(&(server->io_packet_magazine));
+  _server_packet_slab_free(server, GEARMAN_SERVER_NUMA_NODES);
+  (void) pthread_mutex_destroy(&(server->queue_lock));
+
+  if (server->options & GEARMAN_SERVER_PROC_THREAD)
+    (void) pthread_key_delete(server->proc_key);
+
+  if (server->gearman != NULL)
+    gearman_free(server->gearman);
+
+  if (server->spill_path != NULL)
+    free(server->spill_path);
+
+  if (server->proc_cpu_list != NULL)
+    free(server->proc_cpu_list);
+
+  gearman_server_snapshot_free(&(server->snapshot));
+  gearman_server_stats_free(server);
+
+  if (server->options & GEARMAN_SERVER_ALLOCATED)
+    free(server);
+}
+
+void gearman_server_set_log(gearman_server_st *server,
+                            gearman_server_log_fn log_fn, void *log_fn_arg,
+                            gearman_verbose_t verbose)
+{
+  server->log_fn= log_fn;
+  server->log_fn_arg= log_fn_arg;
+  gearman_set_log(server->gearman, _log, server, verbose);
+}
+
+void gearman_server_set_options(gearman_server_st *server,
+                                gearman_server_options_t options,
+                                uint32_t data)
+{
+  /* Lookups depend on how a handle was built, so only switch when empty. */
+  if ((options & GEARMAN_SERVER_JOB_HANDLE_INDEX) &&
+      gearman_server_shard_job_count(server) != 0)
   {
-    while (server->job_hash[key] != NULL)
-      gearman_server_job_free(server->job_hash[key]);
+    return;
   }
 
-  while (server->function_list != NULL)
-    gearman_server_function_free(server->function_list);
+  if (data)
+    server->options|= options;
+  else
+    server->options&= ~options;
+}
+
+gearman_return_t gearman_server_set_job_hash_size(gearman_server_st *server,
+                                                 uint32_t size)
+{
+  gearman_return_t ret;
+  uint32_t x;
+
+  /* Jobs are spread over the shards, so split the buckets between them. */
+  size= (size + server->shard_count - 1) / server->shard_count;
 
-  while (server->free_packet_list != NULL)
+  for (x= 0; x < server->shard_count; x++)
   {
-    packet= server->free_packet_list;
-    server->free_packet_list= packet->next;
-    free(packet);
+    ret= gearman_server_job_hash_resize(&(server->shard_list[x]), size);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
   }
 
-  while (server->free_job_list != NULL)
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearman_server_set_shards(gearman_server_st *server,
+                                           uint32_t shard_count)
+{
+  gearman_server_shard_st *shard_list;
+  uint32_t x;
+
+  if (shard_count == 0)
+    shard_count= 1;
+
+  if (shard_count == server->shard_count)
+    return GEARMAN_SUCCESS;
+
+  /* Connections size their per-shard state when they are created, and jobs
+     can't move between shards, so this only works on an idle server. */
+  if (server->thread_count != 0 || gearman_server_shard_job_count(server) != 0)
   {
-    job= server->free_job_list;
-    server->free_job_list= job->next;
-    free(job);
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_set_shards",
+                      "server already in use")
+    return GEARMAN_SERVER_ERROR;
   }
 
-  while (server->free_client_list != NULL)
+  shard_list= malloc(sizeof(gearman_server_shard_st) * shard_count);
+  if (shard_list == NULL)
   {
-    client= server->free_client_list;
-    server->free_client_list= client->con_next;
-    free(client);
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_set_shards", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
   }
 
-  while (server->free_worker_list != NULL)
+  _server_shard_list_free(server);
+
+  server->shard_list= shard_list;
+  server->shard_count= shard_count;
+
+  for (x= 0; x < shard_count; x++)
   {
-    worker= server->free_worker_list;
-    server->free_worker_list= worker->con_next;
-    free(worker);
+    if (gearman_server_shard_create(server, &(shard_list[x]), x) == NULL)
+    {
+      server->shard_count= x;
+      _server_shard_list_free(server);
+      GEARMAN_ERROR_SET(server->gearman, "gearman_server_set_shards",
+                        "gearman_server_shard_create")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
   }
 
-  if (server->gearman != NULL)
-    gearman_free(server->gearman);
+  return GEARMAN_SUCCESS;
+}
 
-  if (server->options & GEARMAN_SERVER_ALLOCATED)
-    free(server);
+void gearman_server_set_worker_wakeup(gearman_server_st *server,
+                                      uint32_t worker_wakeup)
+{
+  server->worker_wakeup= worker_wakeup;
 }
 
-void gearman_server_set_log(gearman_server_st *server,
-                            gearman_server_log_fn log_fn, void *log_fn_arg,
-                            gearman_verbose_t verbose)
+void gearman_server_set_read_budget(gearman_server_st *server,
+                                    uint32_t read_budget)
 {
-  server->log_fn= log_fn;
-  server->log_fn_arg= log_fn_arg;
-  gearman_set_log(server->gearman, _log, server, verbose);
+  server->read_budget= read_budget;
+}
+
+void gearman_server_set_priority_levels(gearman_server_st *server,
+                                        uint32_t levels)
+{
+  if (levels < GEARMAN_JOB_PRIORITY_MAX)
+    levels= GEARMAN_JOB_PRIORITY_MAX;
+  else if (levels > GEARMAN_SERVER_PRIORITY_LEVELS_MAX)
+    levels= GEARMAN_SERVER_PRIORITY_LEVELS_MAX;
+
+  /* Jobs already queued keep the level they are on, so changing this only
+     affects where new jobs start. */
+  server->priority_levels= levels;
+  server->priority_level[GEARMAN_JOB_PRIORITY_HIGH]= 0;
+  server->priority_level[GEARMAN_JOB_PRIORITY_NORMAL]= (levels - 1) / 2;
+  server->priority_level[GEARMAN_JOB_PRIORITY_LOW]= levels - 1;
+}
+
+void gearman_server_set_priority_age(gearman_server_st *server,
+                                     uint32_t priority_age)
+{
+  server->priority_age= priority_age;
+}
+
+void gearman_server_set_affinity_wait(gearman_server_st *server,
+                                      uint32_t affinity_wait)
+{
+  server->affinity_wait= affinity_wait;
+}
+
+void gearman_server_set_work_data_max(gearman_server_st *server,
+                                      size_t work_data_max)
+{
+  server->work_data_max= work_data_max;
+}
+
+void gearman_server_set_queue_bytes_max(gearman_server_st *server,
+                                        size_t queue_bytes_max)
+{
+  server->queue_bytes_max= queue_bytes_max;
+}
+
+void gearman_server_set_client_rate(gearman_server_st *server,
+                                    size_t client_rate)
+{
+  server->client_rate= client_rate;
+}
+
+gearman_return_t gearman_server_set_spill(gearman_server_st *server,
+                                          const char *path, size_t watermark)
+{
+  char *spill_path= NULL;
+
+  if (path != NULL)
+  {
+    spill_path= strdup(path);
+    if (spill_path == NULL)
+    {
+      GEARMAN_ERROR_SET(server->gearman, "gearman_server_set_spill", "strdup")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+  }
+
+  if (server->spill_path != NULL)
+    free(server->spill_path);
+
+  server->spill_path= spill_path;
+  server->spill_watermark= watermark;
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_server_set_queue_commit(gearman_server_st *server,
+                                     uint32_t size, uint32_t window)
+{
+  server->queue_commit_size= size;
+  server->queue_commit_window= window;
+}
+
+void gearman_server_set_queue_persist_thread(gearman_server_st *server,
+                                             bool persist_thread)
+{
+  server->queue_persist_thread= persist_thread;
+}
+
+void gearman_server_set_queue_replay_background(gearman_server_st *server,
+                                                bool background)
+{
+  server->queue_replay_background= background;
+}
+
+gearman_return_t gearman_server_set_snapshot(gearman_server_st *server,
+                                             const char *path,
+                                             uint32_t interval)
+{
+  char *snapshot_path= NULL;
+
+  if (path != NULL)
+  {
+    snapshot_path= strdup(path);
+    if (snapshot_path == NULL)
+    {
+      GEARMAN_ERROR_SET(server->gearman, "gearman_server_set_snapshot",
+                        "strdup")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+  }
+
+  if (server->snapshot.path != NULL)
+    free(server->snapshot.path);
+
+  server->snapshot.path= snapshot_path;
+  server->snapshot.interval= interval;
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_server_set_stats_interval(gearman_server_st *server,
+                                       uint32_t seconds)
+{
+  server->stats_interval= seconds;
+}
+
+void gearman_server_set_buffer_size(gearman_server_st *server,
+                                    size_t send_size, size_t recv_size)
+{
+  gearman_set_buffer_size(server->gearman, send_size, recv_size);
+}
+
+gearman_return_t gearman_server_set_proc_cpus(gearman_server_st *server,
+                                              const uint32_t *cpu_list,
+                                              uint32_t cpu_count)
+{
+  uint32_t *proc_cpu_list= NULL;
+
+  if (cpu_count > 0)
+  {
+    proc_cpu_list= malloc(sizeof(uint32_t) * cpu_count);
+    if (proc_cpu_list == NULL)
+    {
+      GEARMAN_ERROR_SET(server->gearman, "gearman_server_set_proc_cpus",
+                        "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    memcpy(proc_cpu_list, cpu_list, sizeof(uint32_t) * cpu_count);
+  }
+
+  if (server->proc_cpu_list != NULL)
+    free(server->proc_cpu_list);
+
+  server->proc_cpu_list= proc_cpu_list;
+  server->proc_cpu_count= cpu_count;
+
+  return GEARMAN_SUCCESS;
 }
 
 gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
@@ -197,10 +576,26 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
   char job_handle[GEARMAN_JOB_HANDLE_SIZE];
   char option[GEARMAN_OPTION_SIZE];
   gearman_server_client_st *server_client;
+  gearman_server_function_st *wakeup_function;
+  gearman_server_function_st *function;
+  gearman_server_cache_entry_st *entry;
+  gearman_server_worker_st *server_worker;
+  char count_buffer[11]; /* Max string size to hold a uint32_t. */
+  uint32_t slots;
   char numerator_buffer[11]; /* Max string size to hold a uint32_t. */
   char denominator_buffer[11]; /* Max string size to hold a uint32_t. */
+  char epoch_buffer[21]; /* Max string size to hold an int64_t. */
+  int64_t when;
+  uint64_t run_time;
+  const void *arg[GEARMAN_MAX_COMMAND_ARGS];
+  size_t arg_size[GEARMAN_MAX_COMMAND_ARGS];
   gearman_job_priority_t priority;
-  gearman_st *gearman= gearman= server_con->thread->server->gearman;
+  bool commit;
+  char *chain;
+  gearman_server_st *server= server_con->thread->server;
+  gearman_server_con_shard_st *con_shard=
+                               &(server_con->shard_list[server_con->shard->id]);
+  gearman_st *gearman= gearman= server->gearman;
 
   if (packet->magic == GEARMAN_MAGIC_RESPONSE)
   {
@@ -208,12 +603,28 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
                                 "Request magic expected");
   }
 
+  if (packet->options & GEARMAN_PACKET_COMPRESSED &&
+      !_server_keep_compressed(server_con, packet))
+  {
+    ret= gearman_packet_decompress(packet);
+    if (ret == GEARMAN_INVALID_PACKET)
+    {
+      return _server_error_packet(server_con, "bad_compression",
+                                  "Compressed data is not valid");
+    }
+    else if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
   switch (packet->command)
   {
   /* Client/worker requests. */
   case GEARMAN_COMMAND_ECHO_REQ:
     /* Reuse the data buffer and just shove the data back. */
-    ret= gearman_server_io_packet_add(server_con, true, GEARMAN_MAGIC_RESPONSE,
+    ret= gearman_server_io_packet_add(server_con, GEARMAN_PACKET_FREE_DATA |
+                                      (packet->options &
+                                       GEARMAN_PACKET_COMPRESSED),
+                                      GEARMAN_MAGIC_RESPONSE,
                                       GEARMAN_COMMAND_ECHO_RES, packet->data,
                                       packet->data_size, NULL);
     if (ret != GEARMAN_SUCCESS)
@@ -230,9 +641,13 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
   case GEARMAN_COMMAND_SUBMIT_JOB_HIGH_BG:
   case GEARMAN_COMMAND_SUBMIT_JOB_LOW:
   case GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG:
+  case GEARMAN_COMMAND_SUBMIT_JOB_EPOCH:
+  case GEARMAN_COMMAND_SUBMIT_JOB_CHAIN:
 
     if (packet->command == GEARMAN_COMMAND_SUBMIT_JOB ||
-        packet->command == GEARMAN_COMMAND_SUBMIT_JOB_BG)
+        packet->command == GEARMAN_COMMAND_SUBMIT_JOB_BG ||
+        packet->command == GEARMAN_COMMAND_SUBMIT_JOB_EPOCH ||
+        packet->command == GEARMAN_COMMAND_SUBMIT_JOB_CHAIN)
     {
       priority= GEARMAN_JOB_PRIORITY_NORMAL;
     }
@@ -244,29 +659,94 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     else
       priority= GEARMAN_JOB_PRIORITY_LOW;
 
+    /* Jobs to run at a given time are always background jobs, since the
+       client is not expected to wait around for them. */
+    if (packet->command == GEARMAN_COMMAND_SUBMIT_JOB_EPOCH)
+    {
+      snprintf(epoch_buffer, sizeof(epoch_buffer), "%.*s",
+               (int)(packet->arg_size[2]), (char *)(packet->arg[2]));
+      when= (int64_t)strtoll(epoch_buffer, NULL, 10);
+    }
+    else
+      when= 0;
+
+    /* Chained jobs run each function in turn, and only the last result goes
+       back to the client. */
+    if (packet->command == GEARMAN_COMMAND_SUBMIT_JOB_CHAIN)
+    {
+      chain= _server_chain_copy(server, packet);
+      if (chain == NULL)
+      {
+        return _server_error_packet(server_con, "bad_chain",
+                                    "Chain has an empty stage or one that "
+                                    "is in another shard");
+      }
+    }
+    else
+      chain= NULL;
+
     if (packet->command == GEARMAN_COMMAND_SUBMIT_JOB_BG ||
         packet->command == GEARMAN_COMMAND_SUBMIT_JOB_HIGH_BG ||
-        packet->command == GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG)
+        packet->command == GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG ||
+        packet->command == GEARMAN_COMMAND_SUBMIT_JOB_EPOCH)
     {
       server_client= NULL;
     }
     else
     {
+      /* A result kept from an earlier run answers the client right away.
+         Background jobs still run, since nobody is waiting on them. */
+      if (chain == NULL && packet->arg_size[1] > 1 &&
+          (packet->arg_size[1] != 2 || *((char *)(packet->arg[1])) != '-'))
+      {
+        function= gearman_server_function_find(server,
+                                               (char *)(packet->arg[0]),
+                                               packet->arg_size[0] - 1);
+        if (function != NULL && function->cache.ttl > 0)
+        {
+          entry= gearman_server_cache_get(&(function->cache),
+                                          (char *)(packet->arg[1]),
+                                          packet->arg_size[1] - 1);
+          if (entry != NULL)
+            return _server_cache_reply(server_con, entry);
+        }
+      }
+
       server_client= gearman_server_client_add(server_con);
       if (server_client == NULL)
+      {
+        if (chain != NULL)
+          free(chain);
         return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+      }
     }
 
+    /* Jobs waiting for a group commit are flushed together later. */
+    commit= server_client == NULL && gearman_server_commit_enabled(server);
+    if (commit)
+      server_con->shard->queue_batch= true;
+
     /* Create a job. */
+    server_con->shard->job_chain= chain;
     server_job= gearman_server_job_add(server_con->thread->server,
                                        (char *)(packet->arg[0]),
                                        packet->arg_size[0] - 1,
                                        (char *)(packet->arg[1]),
                                        packet->arg_size[1] - 1, packet->data,
-                                       packet->data_size, priority,
+                                       packet->data_size, priority, when,
                                        server_client, &ret);
+    if (commit)
+      server_con->shard->queue_batch= false;
+    server_con->shard->job_chain= NULL;
+    if (ret != GEARMAN_SUCCESS && chain != NULL)
+      free(chain);
+
     if (ret == GEARMAN_SUCCESS)
+    {
       packet->options&= (gearman_packet_options_t)~GEARMAN_PACKET_FREE_DATA;
+      if (packet->options & GEARMAN_PACKET_COMPRESSED)
+        server_job->options|= GEARMAN_SERVER_JOB_COMPRESSED;
+    }
     else if (ret == GEARMAN_JOB_QUEUE_FULL)
     {
       return _server_error_packet(server_con, "queue_full",
@@ -275,12 +755,28 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     else if (ret != GEARMAN_JOB_EXISTS)
       return ret;
 
+    arg_size[0]= gearman_server_job_handle(server_job, job_handle);
+
+    /* Replies for jobs that already exist wait too, since the job may not
+       have been committed yet. */
+    if (commit)
+    {
+      gearman_server_commit_add(server_con, job_handle);
+      break;
+    }
+
     /* Queue the job created packet. */
-    ret= gearman_server_io_packet_add(server_con, false, GEARMAN_MAGIC_RESPONSE,
-                                      GEARMAN_COMMAND_JOB_CREATED,
-                                      server_job->job_handle,
-                                      (size_t)strlen(server_job->job_handle),
-                                      NULL);
+    arg[0]= job_handle;
+    ret= gearman_server_io_response_add(server_con,
+                                        GEARMAN_COMMAND_JOB_CREATED, 1, arg,
+                                        arg_size);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    break;
+
+  case GEARMAN_COMMAND_SUBMIT_JOB_BATCH:
+    ret= _server_submit_job_batch(server_con, packet);
     if (ret != GEARMAN_SUCCESS)
       return ret;
 
@@ -294,32 +790,35 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     server_job= gearman_server_job_get(server_con->thread->server, job_handle);
 
     /* Queue status result packet. */
+    arg[0]= job_handle;
+    arg_size[0]= strlen(job_handle) + 1;
     if (server_job == NULL)
     {
-      ret= gearman_server_io_packet_add(server_con, false,
-                                        GEARMAN_MAGIC_RESPONSE,
-                                        GEARMAN_COMMAND_STATUS_RES, job_handle,
-                                        (size_t)(strlen(job_handle) + 1),
-                                        "0", (size_t)2, "0", (size_t)2, "0",
-                                        (size_t)2, "0", (size_t)1, NULL);
+      arg[1]= "0";
+      arg[2]= "0";
+      arg[3]= "0";
+      arg[4]= "0";
+      arg_size[3]= 2;
+      arg_size[4]= 1;
     }
     else
     {
       snprintf(numerator_buffer, 11, "%u", server_job->numerator);
       snprintf(denominator_buffer, 11, "%u", server_job->denominator);
 
-      ret= gearman_server_io_packet_add(server_con, false,
-                                        GEARMAN_MAGIC_RESPONSE,
-                                        GEARMAN_COMMAND_STATUS_RES, job_handle,
-                                        (size_t)(strlen(job_handle) + 1),
-                                        "1", (size_t)2,
-                                        server_job->worker == NULL ? "0" : "1",
-                                        (size_t)2, numerator_buffer,
-                                        (size_t)(strlen(numerator_buffer) + 1),
-                                        denominator_buffer,
-                                        (size_t)strlen(denominator_buffer),
-                                        NULL);
+      arg[1]= "1";
+      arg[2]= server_job->worker == NULL ? "0" : "1";
+      arg[3]= numerator_buffer;
+      arg[4]= denominator_buffer;
+      arg_size[3]= strlen(numerator_buffer) + 1;
+      arg_size[4]= strlen(denominator_buffer);
     }
+    arg_size[1]= 2;
+    arg_size[2]= 2;
+
+    ret= gearman_server_io_response_add(server_con,
+                                        GEARMAN_COMMAND_STATUS_RES, 5, arg,
+                                        arg_size);
 
     if (ret != GEARMAN_SUCCESS)
       return ret;
@@ -332,13 +831,17 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
              (uint32_t)(packet->arg_size[0]), (char *)(packet->arg[0]));
     if (!strcasecmp(option, "exceptions"))
       server_con->options|= GEARMAN_SERVER_CON_EXCEPTIONS;
+    else if (!strcasecmp(option, GEARMAN_COMPRESS_OPTION))
+      server_con->con.options|= GEARMAN_CON_COMPRESSION;
+    else if (!strcasecmp(option, GEARMAN_ABANDON_OPTION))
+      server_con->options|= GEARMAN_SERVER_CON_ABANDON;
     else
     {
       return _server_error_packet(server_con, "unknown_option",
                                   "Server does not recognize given option");
     }
 
-    ret= gearman_server_io_packet_add(server_con, false, GEARMAN_MAGIC_RESPONSE,
+    ret= gearman_server_io_packet_add(server_con, 0, GEARMAN_MAGIC_RESPONSE,
                                       GEARMAN_COMMAND_OPTION_RES,
                                       packet->arg[0], packet->arg_size[0],
                                       NULL);
@@ -349,24 +852,27 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
 
   /* Worker requests. */
   case GEARMAN_COMMAND_CAN_DO:
-    if (gearman_server_worker_add(server_con, (char *)(packet->arg[0]),
-                                  packet->arg_size[0], 0) == NULL)
-    {
+    server_worker= gearman_server_worker_add(server_con,
+                                             (char *)(packet->arg[0]),
+                                             packet->arg_size[0], 0);
+    if (server_worker == NULL)
       return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
 
-    break;
+    /* Hand queued jobs straight to a worker that already has free slots. */
+    return gearman_server_job_push(server_worker);
 
   case GEARMAN_COMMAND_CAN_DO_TIMEOUT:
-    if (gearman_server_worker_add(server_con, (char *)(packet->arg[0]),
-                                  packet->arg_size[0] - 1,
-                                  (in_port_t)atoi((char *)(packet->arg[1])))
-         == NULL)
-    {
+    /* This may not be NULL terminated, so copy to make sure it is. */
+    snprintf(count_buffer, sizeof(count_buffer), "%.*s",
+             (uint32_t)(packet->arg_size[1]), (char *)(packet->arg[1]));
+    server_worker= gearman_server_worker_add(server_con,
+                                    (char *)(packet->arg[0]),
+                                    packet->arg_size[0] - 1,
+                                    (in_port_t)atoi(count_buffer));
+    if (server_worker == NULL)
       return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-    }
 
-    break;
+    return gearman_server_job_push(server_worker);
 
   case GEARMAN_COMMAND_CANT_DO:
     gearman_server_con_free_worker(server_con, (char *)(packet->arg[0]),
@@ -374,20 +880,46 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     break;
 
   case GEARMAN_COMMAND_RESET_ABILITIES:
-    gearman_server_con_free_workers(server_con);
+    gearman_server_con_free_workers(server_con, server_con->shard);
+    if (server_con->proc_hops > 0)
+      server_con->proc_forward= true;
     break;
 
+  case GEARMAN_COMMAND_SET_SLOTS:
+    /* This may not be NULL terminated, so copy to make sure it is. */
+    snprintf(count_buffer, sizeof(count_buffer), "%.*s",
+             (uint32_t)(packet->arg_size[0]), (char *)(packet->arg[0]));
+    slots= (uint32_t)strtoul(count_buffer, NULL, 10);
+    if (slots > GEARMAN_GRAB_JOB_MULTI_MAX)
+      slots= GEARMAN_GRAB_JOB_MULTI_MAX;
+
+    /* The packet visits every shard, and each one takes its share of the
+       slots so the worker is never sent more jobs than it asked for. */
+    slots= slots / server->shard_count +
+           (server_con->shard->id < slots % server->shard_count ? 1 : 0);
+    gearman_server_con_set_slots(server_con, server_con->shard, slots,
+                                 con_shard->slots_used);
+    if (server_con->proc_hops > 0)
+      server_con->proc_forward= true;
+
+    return gearman_server_con_push(server_con, server_con->shard);
+
   case GEARMAN_COMMAND_PRE_SLEEP:
     server_job= gearman_server_job_peek(server_con);
     if (server_job == NULL)
-      server_con->options|= GEARMAN_SERVER_CON_SLEEPING;
+    {
+      con_shard->options|= GEARMAN_SERVER_CON_SLEEPING;
+
+      /* Only go to sleep once no shard has a job to run. */
+      if (server_con->proc_hops > 0)
+        server_con->proc_forward= true;
+    }
     else
     {
       /* If there are jobs that could be run, queue a NOOP packet to wake the
          worker up. This could be the result of a race codition. */
-      ret= gearman_server_io_packet_add(server_con, false,
-                                        GEARMAN_MAGIC_RESPONSE,
-                                        GEARMAN_COMMAND_NOOP, NULL);
+      ret= gearman_server_io_response_add(server_con, GEARMAN_COMMAND_NOOP,
+                                          0, NULL, NULL);
       if (ret != GEARMAN_SUCCESS)
         return ret;
     }
@@ -396,45 +928,54 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
 
   case GEARMAN_COMMAND_GRAB_JOB:
   case GEARMAN_COMMAND_GRAB_JOB_UNIQ:
-    server_con->options&=
+  case GEARMAN_COMMAND_GRAB_JOB_MULTI:
+    con_shard->options&=
                      (gearman_server_con_options_t)~GEARMAN_SERVER_CON_SLEEPING;
 
     server_job= gearman_server_job_take(server_con);
-    if (server_job == NULL)
+
+    /* If this worker was woken for a function, it is back now. Wake another
+       one if the jobs it was woken for are still waiting, since it may have
+       taken a job for a different function. */
+    wakeup_function= con_shard->wakeup_function;
+    if (wakeup_function != NULL)
     {
-      /* No jobs found, queue no job packet. */
-      ret= gearman_server_io_packet_add(server_con, false,
-                                        GEARMAN_MAGIC_RESPONSE,
-                                        GEARMAN_COMMAND_NO_JOB, NULL);
+      con_shard->wakeup_function= NULL;
+      wakeup_function->wakeup_count--;
+      ret= gearman_server_function_wakeup(wakeup_function,
+                                          wakeup_function->job_count);
+      if (ret != GEARMAN_SUCCESS)
+      {
+        if (server_job != NULL)
+          (void)gearman_server_job_queue(server_job);
+        return ret;
+      }
     }
-    else if (packet->command == GEARMAN_COMMAND_GRAB_JOB_UNIQ)
+    if (server_job == NULL && server_con->proc_hops > 0)
     {
-      /* We found a runnable job, queue job assigned packet and take the job
-         off the queue. */
-      ret= gearman_server_io_packet_add(server_con, false,
-                                   GEARMAN_MAGIC_RESPONSE,
-                                   GEARMAN_COMMAND_JOB_ASSIGN_UNIQ,
-                                   server_job->job_handle,
-                                   (size_t)(strlen(server_job->job_handle) + 1),
-                                   server_job->function->function_name,
-                                   server_job->function->function_name_size + 1,
-                                   server_job->unique,
-                                   (size_t)(strlen(server_job->unique) + 1),
-                                   server_job->data, server_job->data_size,
-                                   NULL);
+      /* Nothing to run here, so try the next shard. */
+      server_con->proc_forward= true;
+      break;
+    }
+    else if (server_job == NULL)
+    {
+      /* No jobs found, queue no job packet. */
+      ret= gearman_server_io_response_add(server_con, GEARMAN_COMMAND_NO_JOB,
+                                          0, NULL, NULL);
+    }
+    else if (packet->command == GEARMAN_COMMAND_GRAB_JOB_MULTI)
+    {
+      /* The jobs are queued back by the call on failure. */
+      return _server_grab_job_multi(server_con, packet, server_job);
     }
     else
     {
-      /* Same, but without unique ID. */
-      ret= gearman_server_io_packet_add(server_con, false,
-                                   GEARMAN_MAGIC_RESPONSE,
-                                   GEARMAN_COMMAND_JOB_ASSIGN,
-                                   server_job->job_handle,
-                                   (size_t)(strlen(server_job->job_handle) + 1),
-                                   server_job->function->function_name,
-                                   server_job->function->function_name_size + 1,
-                                   server_job->data, server_job->data_size,
-                                   NULL);
+      /* We found a runnable job, queue job assigned packet and take the job
+         off the queue. */
+      ret= gearman_server_job_assign(server_con, server_job,
+                             packet->command == GEARMAN_COMMAND_GRAB_JOB_UNIQ ?
+                             GEARMAN_COMMAND_JOB_ASSIGN_UNIQ :
+                             GEARMAN_COMMAND_JOB_ASSIGN);
     }
 
     if (ret != GEARMAN_SUCCESS)
@@ -448,24 +989,28 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
 
   case GEARMAN_COMMAND_WORK_DATA:
   case GEARMAN_COMMAND_WORK_WARNING:
-    server_job= gearman_server_job_get(server_con->thread->server,
-                                       (char *)(packet->arg[0]));
+    server_job= _server_job_running(server_con, (char *)(packet->arg[0]));
     if (server_job == NULL)
     {
       return _server_error_packet(server_con, "job_not_found",
                                   "Job given in work result not found");
     }
 
-    /* Queue the data/warning packet for all clients. */
+    /* Queue the data/warning packet for all clients. A cached result would
+       leave these out, so the job is not cached. */
     ret= _server_queue_work_data(server_job, packet, packet->command);
     if (ret != GEARMAN_SUCCESS)
       return ret;
 
+    server_job->options|= GEARMAN_SERVER_JOB_STREAMED;
+
+    if (server->work_data_max > 0)
+      _server_work_data_pause(server_con, server_job);
+
     break;
 
   case GEARMAN_COMMAND_WORK_STATUS:
-    server_job= gearman_server_job_get(server_con->thread->server,
-                                       (char *)(packet->arg[0]));
+    server_job= _server_job_running(server_con, (char *)(packet->arg[0]));
     if (server_job == NULL)
     {
       return _server_error_packet(server_con, "job_not_found",
@@ -484,7 +1029,7 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     for (server_client= server_job->client_list; server_client;
          server_client= server_client->job_next)
     {
-      ret= gearman_server_io_packet_add(server_client->con, false,
+      ret= gearman_server_io_packet_add(server_client->con, 0,
                                         GEARMAN_MAGIC_RESPONSE,
                                         GEARMAN_COMMAND_WORK_STATUS,
                                         packet->arg[0], packet->arg_size[0],
@@ -498,14 +1043,43 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     break;
 
   case GEARMAN_COMMAND_WORK_COMPLETE:
-    server_job= gearman_server_job_get(server_con->thread->server,
-                                       (char *)(packet->arg[0]));
+    server_job= _server_job_running(server_con, (char *)(packet->arg[0]));
     if (server_job == NULL)
     {
       return _server_error_packet(server_con, "job_not_found",
                                   "Job given in work result not found");
     }
 
+    /* A chained job goes on to its next stage instead of back to its
+       clients, unless they have all gone away. */
+    function= server_job->function;
+    if (server_job->chain != NULL && server_job->client_list != NULL)
+    {
+      run_time= gearman_time_now() - server_job->assigned_time;
+      gearman_server_function_run_add(function, run_time);
+      GEARMAND_JOB_COMPLETE((char *)(packet->arg[0]),
+                            function->function_name, run_time);
+      ret= gearman_server_job_chain(server_job, packet);
+      if (ret != GEARMAN_SUCCESS)
+        return ret;
+
+      return gearman_server_con_push(server_con, server_con->shard);
+    }
+
+    /* Keep the result for later submits before the clients are given the
+       data. Unique IDs of "-" are taken from the data, which is gone. A
+       chained job's result depends on the whole chain, so it is not kept. */
+    if (function->cache.ttl > 0 &&
+        !(server_job->options & GEARMAN_SERVER_JOB_STREAMED) &&
+        !(server_job->options & GEARMAN_SERVER_JOB_CHAINED) &&
+        server_job->unique_size != 0 && strcmp(server_job->unique, "-"))
+    {
+      gearman_server_cache_add(&(function->cache), server_job->unique,
+                               server_job->unique_size, packet->data,
+                               packet->data_size,
+                               packet->options & GEARMAN_PACKET_COMPRESSED);
+    }
+
     /* Queue the complete packet for all clients. */
     ret= _server_queue_work_data(server_job, packet,
                                  GEARMAN_COMMAND_WORK_COMPLETE);
@@ -516,22 +1090,44 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     if (server_job->options & GEARMAN_SERVER_JOB_QUEUED &&
         gearman->queue_done_fn != NULL)
     {
-      ret= (*(gearman->queue_done_fn))(gearman, (void *)gearman->queue_fn_arg,
-                                      server_job->unique,
-                                      (size_t)strlen(server_job->unique),
-                                      server_job->function->function_name,
-                                      server_job->function->function_name_size);
+      if (gearman_server_persist_enabled(server))
+      {
+        ret= gearman_server_persist_done(server, server_job->unique,
+                                     (size_t)(server_job->unique_size),
+                                     server_job->function->function_name,
+                                     server_job->function->function_name_size);
+      }
+      else
+      {
+        GEARMAN_SERVER_QUEUE_LOCK(server)
+        GEARMAND_QUEUE_DONE_START(server_job->unique,
+                                  server_job->function->function_name);
+        ret= (*(gearman->queue_done_fn))(gearman,
+                                     (void *)gearman->queue_fn_arg,
+                                     server_job->unique,
+                                     (size_t)(server_job->unique_size),
+                                     server_job->function->function_name,
+                                     server_job->function->function_name_size);
+        GEARMAND_QUEUE_DONE_DONE(server_job->unique,
+                                 server_job->function->function_name,
+                                 (int)ret);
+        GEARMAN_SERVER_QUEUE_UNLOCK(server)
+      }
       if (ret != GEARMAN_SUCCESS)
         return ret;
     }
 
-    /* Job is done, remove it. */
+    /* Job is done, record how long it ran, remove it, and fill the slot it
+       was using. */
+    run_time= gearman_time_now() - server_job->assigned_time;
+    gearman_server_function_run_add(server_job->function, run_time);
+    GEARMAND_JOB_COMPLETE((char *)(packet->arg[0]),
+                          server_job->function->function_name, run_time);
     gearman_server_job_free(server_job);
-    break;
+    return gearman_server_con_push(server_con, server_con->shard);
 
   case GEARMAN_COMMAND_WORK_EXCEPTION:
-    server_job= gearman_server_job_get(server_con->thread->server,
-                                       (char *)(packet->arg[0]));
+    server_job= _server_job_running(server_con, (char *)(packet->arg[0]));
     if (server_job == NULL)
     {
       return _server_error_packet(server_con, "job_not_found",
@@ -550,7 +1146,7 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     snprintf(job_handle, GEARMAN_JOB_HANDLE_SIZE, "%.*s",
              (uint32_t)(packet->arg_size[0]), (char *)(packet->arg[0]));
 
-    server_job= gearman_server_job_get(server_con->thread->server, job_handle);
+    server_job= _server_job_running(server_con, job_handle);
     if (server_job == NULL)
     {
       return _server_error_packet(server_con, "job_not_found",
@@ -561,7 +1157,7 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     for (server_client= server_job->client_list; server_client;
          server_client= server_client->job_next)
     {
-      ret= gearman_server_io_packet_add(server_client->con, false,
+      ret= gearman_server_io_packet_add(server_client->con, 0,
                                         GEARMAN_MAGIC_RESPONSE,
                                         GEARMAN_COMMAND_WORK_FAIL,
                                         packet->arg[0], packet->arg_size[0],
@@ -574,18 +1170,41 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
     if (server_job->options & GEARMAN_SERVER_JOB_QUEUED &&
         gearman->queue_done_fn != NULL)
     {
-      ret= (*(gearman->queue_done_fn))(gearman, (void *)gearman->queue_fn_arg,
-                                      server_job->unique,
-                                      (size_t)strlen(server_job->unique),
-                                      server_job->function->function_name,
-                                      server_job->function->function_name_size);
+      if (gearman_server_persist_enabled(server))
+      {
+        ret= gearman_server_persist_done(server, server_job->unique,
+                                     (size_t)(server_job->unique_size),
+                                     server_job->function->function_name,
+                                     server_job->function->function_name_size);
+      }
+      else
+      {
+        GEARMAN_SERVER_QUEUE_LOCK(server)
+        GEARMAND_QUEUE_DONE_START(server_job->unique,
+                                  server_job->function->function_name);
+        ret= (*(gearman->queue_done_fn))(gearman,
+                                     (void *)gearman->queue_fn_arg,
+                                     server_job->unique,
+                                     (size_t)(server_job->unique_size),
+                                     server_job->function->function_name,
+                                     server_job->function->function_name_size);
+        GEARMAND_QUEUE_DONE_DONE(server_job->unique,
+                                 server_job->function->function_name,
+                                 (int)ret);
+        GEARMAN_SERVER_QUEUE_UNLOCK(server)
+      }
       if (ret != GEARMAN_SUCCESS)
         return ret;
     }
 
-    /* Job is done, remove it. */
+    /* Job is done, record how long it ran, remove it, and fill the slot it
+       was using. */
+    run_time= gearman_time_now() - server_job->assigned_time;
+    gearman_server_function_run_add(server_job->function, run_time);
+    GEARMAND_JOB_FAIL(job_handle,
+                      server_job->function->function_name, run_time);
     gearman_server_job_free(server_job);
-    break;
+    return gearman_server_con_push(server_con, server_con->shard);
 
   case GEARMAN_COMMAND_SET_CLIENT_ID:
     gearman_server_con_set_id(server_con, (char *)(packet->arg[0]),
@@ -606,8 +1225,9 @@ gearman_return_t gearman_server_run_command(gearman_server_con_st *server_con,
   case GEARMAN_COMMAND_ALL_YOURS:
   case GEARMAN_COMMAND_OPTION_RES:
   case GEARMAN_COMMAND_SUBMIT_JOB_SCHED:
-  case GEARMAN_COMMAND_SUBMIT_JOB_EPOCH:
+  case GEARMAN_COMMAND_JOB_CREATED_BATCH:
   case GEARMAN_COMMAND_JOB_ASSIGN_UNIQ:
+  case GEARMAN_COMMAND_JOB_ABANDONED:
   case GEARMAN_COMMAND_MAX:
   default:
     return _server_error_packet(server_con, "bad_command",
@@ -621,7 +1241,7 @@ gearman_return_t gearman_server_shutdown_graceful(gearman_server_st *server)
 {
   server->shutdown_graceful= true;
 
-  if (server->job_count == 0)
+  if (gearman_server_shard_job_count(server) == 0)
     return GEARMAN_SHUTDOWN;
 
   return GEARMAN_SHUTDOWN_GRACEFUL;
@@ -630,10 +1250,46 @@ gearman_return_t gearman_server_shutdown_graceful(gearman_server_st *server)
 gearman_return_t gearman_server_queue_replay(gearman_server_st *server)
 {
   gearman_return_t ret;
+  bool loaded;
+
+  gearman_server_replay_st *replay= &(server->replay);
 
   if (server->gearman->queue_replay_fn == NULL)
     return GEARMAN_SUCCESS;
 
+  if (gearman_server_snapshot_enabled(server))
+  {
+    ret= gearman_server_snapshot_load(server, &loaded);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    if (loaded)
+      return gearman_server_snapshot_start(server);
+  }
+  else if (server->snapshot.path != NULL)
+  {
+    GEARMAN_INFO(server->gearman, "Queue can't be snapshotted, replaying it "
+                 "in full")
+  }
+
+  if (gearman_server_replay_enabled(server))
+  {
+    ret= gearman_server_replay_start(server);
+    if (ret == GEARMAN_SUCCESS && gearman_server_snapshot_enabled(server))
+      ret= gearman_server_snapshot_start(server);
+    return ret;
+  }
+
+  if (server->queue_replay_background)
+  {
+    GEARMAN_INFO(server->gearman, "Queue can't be replayed in the background, "
+                 "replaying it before starting")
+  }
+
+  replay->started= true;
+  replay->running= true;
+  replay->start= time(NULL);
+
   server->options|= GEARMAN_SERVER_QUEUE_REPLAY;
 
   ret= (*(server->gearman->queue_replay_fn))(server->gearman,
@@ -642,9 +1298,219 @@ gearman_return_t gearman_server_queue_replay(gearman_server_st *server)
 
   server->options&= (gearman_server_options_t)~GEARMAN_SERVER_QUEUE_REPLAY;
 
+  replay->ret= ret;
+  replay->end= time(NULL);
+  replay->running= false;
+
+  if (ret == GEARMAN_SUCCESS && gearman_server_snapshot_enabled(server))
+    ret= gearman_server_snapshot_start(server);
+
   return ret;
 }
 
+gearman_return_t gearman_server_queue_add(gearman_server_st *server,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count)
+{
+  gearman_st *gearman= server->gearman;
+  gearman_return_t ret;
+  size_t x;
+
+  if (record_count > 1 && gearman->queue_add_batch_fn != NULL)
+  {
+    for (x= 0; x < record_count; x++)
+    {
+      GEARMAND_QUEUE_ADD_START(record[x].unique, record[x].function_name,
+                               record[x].data_size);
+    }
+
+    ret= (*(gearman->queue_add_batch_fn))(gearman,
+                                          (void *)gearman->queue_fn_arg,
+                                          record, record_count);
+
+    for (x= 0; x < record_count; x++)
+    {
+      GEARMAND_QUEUE_ADD_DONE(record[x].unique, record[x].function_name,
+                              (int)ret);
+    }
+
+    return ret;
+  }
+
+  for (x= 0; x < record_count; x++)
+  {
+    GEARMAND_QUEUE_ADD_START(record[x].unique, record[x].function_name,
+                             record[x].data_size);
+    ret= (*(gearman->queue_add_fn))(gearman, (void *)gearman->queue_fn_arg,
+                                    record[x].unique, record[x].unique_size,
+                                    record[x].function_name,
+                                    record[x].function_name_size,
+                                    record[x].data, record[x].data_size,
+                                    record[x].priority, record[x].when);
+    GEARMAND_QUEUE_ADD_DONE(record[x].unique, record[x].function_name,
+                            (int)ret);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearman_server_queue_done(gearman_server_st *server,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count)
+{
+  gearman_st *gearman= server->gearman;
+  gearman_return_t ret;
+  gearman_return_t first_ret= GEARMAN_SUCCESS;
+  size_t x;
+
+  if (record_count > 1 && gearman->queue_done_batch_fn != NULL)
+  {
+    for (x= 0; x < record_count; x++)
+      GEARMAND_QUEUE_DONE_START(record[x].unique, record[x].function_name);
+
+    ret= (*(gearman->queue_done_batch_fn))(gearman,
+                                           (void *)gearman->queue_fn_arg,
+                                           record, record_count);
+
+    for (x= 0; x < record_count; x++)
+    {
+      GEARMAND_QUEUE_DONE_DONE(record[x].unique, record[x].function_name,
+                               (int)ret);
+    }
+
+    return ret;
+  }
+
+  /* Removing the rest is still worth it when one fails. */
+  for (x= 0; x < record_count; x++)
+  {
+    GEARMAND_QUEUE_DONE_START(record[x].unique, record[x].function_name);
+    ret= (*(gearman->queue_done_fn))(gearman, (void *)gearman->queue_fn_arg,
+                                     record[x].unique, record[x].unique_size,
+                                     record[x].function_name,
+                                     record[x].function_name_size);
+    GEARMAND_QUEUE_DONE_DONE(record[x].unique, record[x].function_name,
+                             (int)ret);
+    if (ret != GEARMAN_SUCCESS && first_ret == GEARMAN_SUCCESS)
+      first_ret= ret;
+  }
+
+  return first_ret;
+}
+
+gearman_return_t gearman_server_cpu_list(const char *list,
+                                         uint32_t **cpu_list,
+                                         uint32_t *cpu_count)
+{
+  uint32_t *cpus= NULL;
+  uint32_t *new_cpus;
+  uint32_t count= 0;
+  unsigned long first;
+  unsigned long last;
+  char *end;
+
+  while (*list >= '0' && *list <= '9')
+  {
+    first= strtoul(list, &end, 10);
+    last= first;
+
+    if (*end == '-')
+    {
+      list= end + 1;
+      if (*list < '0' || *list > '9')
+        break;
+
+      last= strtoul(list, &end, 10);
+    }
+
+    if (last < first || last >= GEARMAN_SERVER_CPU_MAX)
+      break;
+
+    new_cpus= realloc(cpus, sizeof(uint32_t) *
+                            (count + (uint32_t)(last - first) + 1));
+    if (new_cpus == NULL)
+    {
+      if (cpus != NULL)
+        free(cpus);
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    cpus= new_cpus;
+    for (; first <= last; first++)
+      cpus[count++]= (uint32_t)first;
+
+    if (*end == 0)
+    {
+      *cpu_list= cpus;
+      *cpu_count= count;
+      return GEARMAN_SUCCESS;
+    }
+
+    if (*end != ',')
+      break;
+
+    list= end + 1;
+  }
+
+  if (cpus != NULL)
+    free(cpus);
+
+  return GEARMAN_UNKNOWN_OPTION;
+}
+
+gearman_return_t gearman_server_pin(gearman_server_st *server, uint32_t cpu,
+                                    gearman_server_magazine_st *magazine,
+                                    gearman_server_magazine_st *io_magazine)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  gearman_server_slab_st *slab;
+  cpu_set_t cpu_set;
+  int pthread_ret;
+
+  if (cpu >= CPU_SETSIZE)
+    return GEARMAN_UNKNOWN_OPTION;
+
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+
+  pthread_ret= pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                      &cpu_set);
+  if (pthread_ret != 0)
+  {
+    errno= pthread_ret;
+    return GEARMAN_ERRNO;
+  }
+
+  /* The thread has run nothing yet, but anything it did cache came from the
+     slab it used before. Chunks of the new slab are allocated, and their
+     free lists threaded, by threads on its node, so Linux places their pages
+     there on first touch. */
+  if (magazine != NULL)
+  {
+    slab= &(server->node_packet_slab[_server_cpu_node(cpu)]);
+    gearman_server_magazine_flush(magazine);
+    gearman_server_magazine_init(magazine, slab);
+  }
+
+  if (io_magazine != NULL)
+  {
+    slab= &(server->node_io_packet_slab[_server_cpu_node(cpu)]);
+    gearman_server_magazine_flush(io_magazine);
+    gearman_server_magazine_init(io_magazine, slab);
+  }
+
+  return GEARMAN_SUCCESS;
+#else
+  (void) server;
+  (void) cpu;
+  (void) magazine;
+  (void) io_magazine;
+  return GEARMAN_UNKNOWN_OPTION;
+#endif
+}
+
 /*
  * Private definitions
  */
@@ -655,28 +1521,298 @@ gearman_return_t _queue_replay_add(gearman_st *gearman __attribute__ ((unused)),
                                    const void *function_name,
                                    size_t function_name_size, const void *data,
                                    size_t data_size,
-                                   gearman_job_priority_t priority)
+                                   gearman_job_priority_t priority,
+                                   int64_t when)
 {
   gearman_server_st *server= (gearman_server_st *)fn_arg;
   gearman_return_t ret;
 
+  server->replay.read_count++;
+
   (void)gearman_server_job_add(server, (char *)function_name,
                                function_name_size, (char *)unique, unique_size,
-                               data, data_size, priority, NULL, &ret);
+                               data, data_size, priority, when, NULL, &ret);
+  if (ret == GEARMAN_SUCCESS)
+    server->replay.add_count++;
+
+  return ret;
+}
+
+static gearman_return_t
+_server_submit_job_batch(gearman_server_con_st *server_con,
+                         gearman_packet_st *packet)
+{
+  gearman_server_st *server= server_con->thread->server;
+  gearman_server_shard_st *shard;
+  gearman_server_job_st *server_job;
+  gearman_job_priority_t priority;
+  const char *function_name= (char *)(packet->arg[0]);
+  size_t function_name_size= packet->arg_size[0] - 1;
+  const uint8_t *ptr= packet->data;
+  const uint8_t *end= ptr + packet->data_size;
+  const uint8_t *unique;
+  size_t unique_size;
+  uint32_t data_size;
+  void *data;
+  char *handles;
+  size_t handles_size= 0;
+  size_t handle_size;
+  uint32_t count= 0;
+  uint32_t x;
+  gearman_return_t ret= GEARMAN_SUCCESS;
+  gearman_return_t flush_ret;
+  gearman_queue_record_st *record= NULL;
+
+  if (packet->arg_size[1] != 2 || packet->arg[1][0] < '0' ||
+      packet->arg[1][0] >= '0' + GEARMAN_JOB_PRIORITY_MAX)
+  {
+    return _server_error_packet(server_con, "bad_priority",
+                                "Priority must be 0, 1 or 2");
+  }
+
+  priority= (gearman_job_priority_t)(packet->arg[1][0] - '0');
+
+  /* Each job takes at least a terminated unique ID and a size. */
+  for (; ptr < end; count++)
+  {
+    ptr= memchr(ptr, 0, (size_t)(end - ptr));
+    if (ptr == NULL || (size_t)(end - ptr) < GEARMAN_BATCH_SIZE_LENGTH + 1)
+      break;
+
+    memcpy(&data_size, ptr + 1, GEARMAN_BATCH_SIZE_LENGTH);
+    ptr+= GEARMAN_BATCH_SIZE_LENGTH + 1 + ntohl(data_size);
+    if (ptr > end)
+      break;
+  }
+
+  if (ptr != end)
+  {
+    return _server_error_packet(server_con, "bad_batch",
+                                "Malformed job batch");
+  }
+
+  if (count == 0)
+    handles= NULL;
+  else
+  {
+    handles= malloc((size_t)count * GEARMAN_JOB_HANDLE_SIZE);
+    if (handles == NULL)
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  shard= gearman_server_shard_function(server, function_name,
+                                       function_name_size);
+
+  /* Flush the persistent queue once for the whole batch. Modules that take
+     batches get all of the jobs in one call too. */
+  shard->queue_batch= true;
+
+  if (count > 1 && server->gearman->queue_add_batch_fn != NULL &&
+      !(server->options & GEARMAN_SERVER_QUEUE_REPLAY) &&
+      !gearman_server_persist_enabled(server))
+  {
+    record= malloc((size_t)count * (sizeof(gearman_queue_record_st) +
+                                    sizeof(gearman_server_job_st *)));
+    if (record == NULL)
+    {
+      shard->queue_batch= false;
+      free(handles);
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    shard->queue_record= record;
+    shard->queue_record_job= (gearman_server_job_st **)(record + count);
+    shard->queue_record_count= 0;
+  }
+
+  for (ptr= packet->data; ptr < end;)
+  {
+    unique= ptr;
+    unique_size= strlen((char *)unique);
+    ptr+= unique_size + 1;
+    memcpy(&data_size, ptr, GEARMAN_BATCH_SIZE_LENGTH);
+    data_size= ntohl(data_size);
+    ptr+= GEARMAN_BATCH_SIZE_LENGTH;
+
+    if (data_size == 0)
+      data= NULL;
+    else
+    {
+      data= malloc(data_size);
+      if (data == NULL)
+      {
+        ret= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+        break;
+      }
+
+      memcpy(data, ptr, data_size);
+    }
+
+    ptr+= data_size;
+
+    server_job= gearman_server_job_add(server, function_name,
+                                       function_name_size, (char *)unique,
+                                       unique_size, data, data_size, priority,
+                                       0, NULL, &ret);
+    if (ret != GEARMAN_SUCCESS && data != NULL)
+      free(data);
+
+    /* A full queue ends the batch early, and the reply only lists the jobs
+       that made it in. */
+    if (ret == GEARMAN_JOB_QUEUE_FULL)
+    {
+      ret= GEARMAN_SUCCESS;
+      break;
+    }
+    else if (ret != GEARMAN_SUCCESS && ret != GEARMAN_JOB_EXISTS)
+      break;
+
+    ret= GEARMAN_SUCCESS;
+    handle_size= gearman_server_job_handle(server_job,
+                                           handles + handles_size) + 1;
+    handles_size+= handle_size;
+  }
+
+  shard->queue_batch= false;
+
+  /* Jobs that made it in before an error are in the server and marked as
+     queued, so they are stored either way. */
+  if (record != NULL)
+  {
+    shard->queue_record= NULL;
+    if (shard->queue_record_count > 0)
+    {
+      GEARMAN_SERVER_QUEUE_LOCK(server)
+      flush_ret= gearman_server_queue_add(server, record,
+                                          shard->queue_record_count);
+      GEARMAN_SERVER_QUEUE_UNLOCK(server)
+      if (ret == GEARMAN_SUCCESS)
+        ret= flush_ret;
+
+      /* Payloads could only be spilled once the module was done with them. */
+      for (x= 0; x < shard->queue_record_count; x++)
+        gearman_server_spill_add(shard->queue_record_job[x], true);
+    }
+
+    free(record);
+  }
+
+  /* The persistence thread flushes after each batch it runs. */
+  if (handles_size > 0 && server->gearman->queue_flush_fn != NULL &&
+      !(server->options & GEARMAN_SERVER_QUEUE_REPLAY) &&
+      !gearman_server_persist_enabled(server))
+  {
+    GEARMAN_SERVER_QUEUE_LOCK(server)
+    flush_ret= (*(server->gearman->queue_flush_fn))(server->gearman,
+                                         (void *)server->gearman->queue_fn_arg);
+    GEARMAN_SERVER_QUEUE_UNLOCK(server)
+    if (ret == GEARMAN_SUCCESS)
+      ret= flush_ret;
+  }
+
+  if (ret != GEARMAN_SUCCESS)
+  {
+    free(handles);
+    return ret;
+  }
+
+  ret= gearman_server_io_packet_add(server_con, GEARMAN_PACKET_FREE_DATA,
+                                    GEARMAN_MAGIC_RESPONSE,
+                                    GEARMAN_COMMAND_JOB_CREATED_BATCH, handles,
+                                    handles_size, NULL);
+  if (ret != GEARMAN_SUCCESS)
+    free(handles);
+
   return ret;
 }
 
+static bool _server_keep_compressed(gearman_server_con_st *server_con,
+                                    gearman_packet_st *packet)
+{
+  gearman_server_st *server= server_con->thread->server;
+  gearman_command_t command= packet->command;
+
+  if (command == GEARMAN_COMMAND_ECHO_REQ)
+    return (server_con->con.options & GEARMAN_CON_COMPRESSION) ? true : false;
+
+  if (command == GEARMAN_COMMAND_WORK_DATA ||
+      command == GEARMAN_COMMAND_WORK_WARNING ||
+      command == GEARMAN_COMMAND_WORK_COMPLETE ||
+      command == GEARMAN_COMMAND_WORK_EXCEPTION)
+  {
+    return true;
+  }
+
+  if (command == GEARMAN_COMMAND_SUBMIT_JOB_BG ||
+      command == GEARMAN_COMMAND_SUBMIT_JOB_HIGH_BG ||
+      command == GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG)
+  {
+    if (server->gearman->queue_add_fn != NULL)
+      return false;
+  }
+  else if (command != GEARMAN_COMMAND_SUBMIT_JOB &&
+           command != GEARMAN_COMMAND_SUBMIT_JOB_HIGH &&
+           command != GEARMAN_COMMAND_SUBMIT_JOB_LOW &&
+           command != GEARMAN_COMMAND_SUBMIT_JOB_CHAIN)
+  {
+    return false;
+  }
+
+  return packet->arg_size[1] != 2 || *((char *)(packet->arg[1])) != '-';
+}
+
 static gearman_return_t _server_error_packet(gearman_server_con_st *server_con,
                                              const char *error_code,
                                              const char *error_string)
 {
-  return gearman_server_io_packet_add(server_con, false, GEARMAN_MAGIC_RESPONSE,
+  return gearman_server_io_packet_add(server_con, 0, GEARMAN_MAGIC_RESPONSE,
                                       GEARMAN_COMMAND_ERROR, error_code,
                                       (size_t)(strlen(error_code) + 1),
                                       error_string,
                                       (size_t)strlen(error_string), NULL);
 }
 
+static gearman_return_t
+_server_grab_job_multi(gearman_server_con_st *server_con,
+                       gearman_packet_st *packet,
+                       gearman_server_job_st *server_job)
+{
+  char count_buffer[11];
+  uint32_t count;
+  uint32_t x;
+  gearman_return_t ret;
+
+  /* This may not be NULL terminated, so copy to make sure it is. */
+  snprintf(count_buffer, sizeof(count_buffer), "%.*s",
+           (uint32_t)(packet->arg_size[0]), (char *)(packet->arg[0]));
+  count= (uint32_t)strtoul(count_buffer, NULL, 10);
+  if (count == 0)
+    count= 1;
+  else if (count > GEARMAN_GRAB_JOB_MULTI_MAX)
+    count= GEARMAN_GRAB_JOB_MULTI_MAX;
+
+  for (x= 0; x < count && server_job != NULL; x++)
+  {
+    /* The unique ID is always sent so workers can batch either kind. */
+    ret= gearman_server_job_assign(server_con, server_job,
+                                   GEARMAN_COMMAND_JOB_ASSIGN_UNIQ);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      (void)gearman_server_job_queue(server_job);
+      return ret;
+    }
+
+    if (x + 1 < count)
+      server_job= gearman_server_job_take(server_con);
+  }
+
+  if (x == count)
+    return GEARMAN_SUCCESS;
+
+  return gearman_server_io_response_add(server_con, GEARMAN_COMMAND_NO_JOB, 0,
+                                        NULL, NULL);
+}
+
 static gearman_return_t _server_run_text(gearman_server_con_st *server_con,
                                          gearman_packet_st *packet)
 {
@@ -685,11 +1821,19 @@ static gearman_return_t _server_run_text(gearman_server_con_st *server_con,
   size_t size;
   size_t total;
   int max_queue_size;
+  long long max_queue_bytes= -1;
+  int weight;
+  int ttl;
+  long long cache_bytes;
+  gearman_job_priority_t priority;
+  size_t prefix_size;
+  uint32_t x;
+  gearman_return_t ret;
+  gearman_server_st *server= server_con->thread->server;
   gearman_server_thread_st *thread;
-  gearman_server_con_st *con;
-  gearman_server_worker_st *worker;
   gearman_server_function_st *function;
-  gearman_server_packet_st *server_packet;
+  gearman_server_io_packet_st *io_packet;
+  gearman_server_io_packet_st *next_packet;
 
   data= malloc(GEARMAN_TEXT_RESPONSE_SIZE);
   if (data == NULL)
@@ -706,69 +1850,58 @@ static gearman_return_t _server_run_text(gearman_server_con_st *server_con,
   }
   else if (!strcasecmp("workers", (char *)(packet->arg[0])))
   {
-    size= 0;
-
-    for (thread= server_con->thread->server->thread_list; thread != NULL;
-         thread= thread->next)
-    {
-      GEARMAN_SERVER_THREAD_LOCK(thread)
-
-      for (con= thread->con_list; con != NULL; con= con->next)
-      {
-        if (con->host == NULL)
-          continue;
-
-        if (size > total)
-          size= total;
+    free(data);
 
-        /* Make sure we have at least GEARMAN_TEXT_RESPONSE_SIZE bytes. */
-        if (size + GEARMAN_TEXT_RESPONSE_SIZE > total)
-        {
-          new_data= realloc(data, total + GEARMAN_TEXT_RESPONSE_SIZE);
-          if (new_data == NULL)
-          {
-            GEARMAN_SERVER_THREAD_UNLOCK(thread)
-            free(data);
-            GEARMAN_ERROR_SET(packet->gearman, "_server_run_text", "malloc")
-            return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-          }
+    if (packet->argc > 1 && !strcasecmp("json", (char *)(packet->arg[1])))
+      return gearman_server_stats_send(server_con,
+                                       GEARMAN_SERVER_STATS_WORKERS_JSON);
 
-          data= new_data;
-          total+= GEARMAN_TEXT_RESPONSE_SIZE;
-        }
+    return gearman_server_stats_send(server_con, GEARMAN_SERVER_STATS_WORKERS);
+  }
+  else if (!strcasecmp("status", (char *)(packet->arg[0])))
+  {
+    free(data);
 
-        size+= (size_t)snprintf(data + size, total - size, "%d %s %s :",
-                                con->con.fd, con->host, con->id);
-        if (size > total)
-          continue;
+    if (packet->argc > 1 && !strcasecmp("json", (char *)(packet->arg[1])))
+      return gearman_server_stats_send(server_con,
+                                       GEARMAN_SERVER_STATS_STATUS_JSON);
 
-        for (worker= con->worker_list; worker != NULL; worker= worker->con_next)
-        {
-          size+= (size_t)snprintf(data + size, total - size, " %.*s",
-                                  (int)(worker->function->function_name_size),
-                                  worker->function->function_name);
-          if (size > total)
-            break;
-        }
+    return gearman_server_stats_send(server_con, GEARMAN_SERVER_STATS_STATUS);
+  }
+  else if (!strcasecmp("stats", (char *)(packet->arg[0])))
+  {
+    free(data);
 
-        if (size > total)
-          continue;
+    if (packet->argc > 1 && !strcasecmp("json", (char *)(packet->arg[1])))
+      return gearman_server_stats_send(server_con,
+                                       GEARMAN_SERVER_STATS_COUNTERS_JSON);
 
-        size+= (size_t)snprintf(data + size, total - size, "\n");
-      }
+    return gearman_server_stats_send(server_con,
+                                     GEARMAN_SERVER_STATS_COUNTERS);
+  }
+  else if (!strcasecmp("latency", (char *)(packet->arg[0])))
+  {
+    free(data);
 
-      GEARMAN_SERVER_THREAD_UNLOCK(thread)
-    }
+    if (packet->argc > 1 && !strcasecmp("json", (char *)(packet->arg[1])))
+      return gearman_server_stats_send(server_con,
+                                       GEARMAN_SERVER_STATS_LATENCY_JSON);
 
-    if (size < total)
-      snprintf(data + size, total - size, ".\n");
+    return gearman_server_stats_send(server_con,
+                                     GEARMAN_SERVER_STATS_LATENCY);
   }
-  else if (!strcasecmp("status", (char *)(packet->arg[0])))
+  else if (!strcasecmp("metrics", (char *)(packet->arg[0])))
+  {
+    free(data);
+    return gearman_server_stats_send(server_con, GEARMAN_SERVER_STATS_METRICS);
+  }
+  else if (!strcasecmp("threads", (char *)(packet->arg[0])))
   {
     size= 0;
+    x= 0;
 
-    for (function= server_con->thread->server->function_list; function != NULL;
-         function= function->next)
+    /* These are only written by each thread, so a loose read is fine. */
+    for (thread= server->thread_list; thread != NULL; thread= thread->next)
     {
       if (size + GEARMAN_TEXT_RESPONSE_SIZE > total)
       {
@@ -784,12 +1917,14 @@ static gearman_return_t _server_run_text(gearman_server_con_st *server_con,
         total+= GEARMAN_TEXT_RESPONSE_SIZE;
       }
 
-      size+= (size_t)snprintf(data + size, total - size, "%.*s\t%u\t%u\t%u\n",
-                              (int)(function->function_name_size),
-                              function->function_name, function->job_total,
-                              function->job_running, function->worker_count);
+      size+= (size_t)snprintf(data + size, total - size,
+                              "%u\t%u\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+                              x, thread->con_count, thread->read_budget_hits,
+                              thread->rate_limit_hits, thread->inline_count);
       if (size > total)
         size= total;
+
+      x++;
     }
 
     if (size < total)
@@ -813,20 +1948,200 @@ static gearman_return_t _server_run_text(gearman_server_con_st *server_con,
           max_queue_size= 0;
       }
 
-      for (function= server_con->thread->server->function_list;
-           function != NULL; function= function->next)
+      /* The byte limit is left alone unless it is given, or both limits are
+         cleared together. */
+      if (packet->argc == 2)
+        max_queue_bytes= 0;
+      else if (packet->argc > 3)
+      {
+        max_queue_bytes= atoll((char *)(packet->arg[3]));
+        if (max_queue_bytes < 0)
+          max_queue_bytes= 0;
+      }
+
+      gearman_server_shard_lock(server);
+      function= gearman_server_function_find(server_con->thread->server,
+                                             (char *)(packet->arg[1]),
+                                             strlen((char *)(packet->arg[1])));
+      if (function != NULL)
+      {
+        function->max_queue_size= (uint32_t)max_queue_size;
+        if (max_queue_bytes >= 0)
+          function->max_queue_bytes= (size_t)max_queue_bytes;
+      }
+      gearman_server_shard_unlock(server);
+
+      snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "OK\n");
+    }
+  }
+  else if (!strcasecmp("weight", (char *)(packet->arg[0])))
+  {
+    if (packet->argc == 1)
+    {
+      snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "ERR incomplete_args "
+               "An+incomplete+set+of+arguments+was+sent+to+this+command\n");
+    }
+    else
+    {
+      if (packet->argc == 2)
+        weight= GEARMAN_DEFAULT_FUNCTION_WEIGHT;
+      else
+      {
+        weight= atoi((char *)(packet->arg[2]));
+        if (weight < 1)
+          weight= 1;
+      }
+
+      /* Workers pick up the new weight at the start of their next turn. */
+      gearman_server_shard_lock(server);
+      function= gearman_server_function_find(server_con->thread->server,
+                                             (char *)(packet->arg[1]),
+                                             strlen((char *)(packet->arg[1])));
+      if (function != NULL)
+        function->weight= (uint32_t)weight;
+      gearman_server_shard_unlock(server);
+
+      snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "OK\n");
+    }
+  }
+  else if (!strcasecmp("cache", (char *)(packet->arg[0])))
+  {
+    if (packet->argc == 1)
+    {
+      size= 0;
+
+      /* List the functions that have their cache on. */
+      gearman_server_shard_lock(server);
+      for (x= 0; x < server->shard_count; x++)
       {
-        if (strlen((char *)(packet->arg[1])) == function->function_name_size &&
-            !memcmp(packet->arg[1], function->function_name,
-                    function->function_name_size))
+        for (function= server->shard_list[x].function_list; function != NULL;
+             function= function->next)
         {
-          function->max_queue_size= (uint32_t)max_queue_size;
+          if (function->cache.ttl == 0)
+            continue;
+
+          if (size + GEARMAN_TEXT_RESPONSE_SIZE > total)
+          {
+            new_data= realloc(data, total + GEARMAN_TEXT_RESPONSE_SIZE);
+            if (new_data == NULL)
+            {
+              gearman_server_shard_unlock(server);
+              free(data);
+              GEARMAN_ERROR_SET(packet->gearman, "_server_run_text", "malloc")
+              return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+            }
+
+            data= new_data;
+            total+= GEARMAN_TEXT_RESPONSE_SIZE;
+          }
+
+          size+= (size_t)snprintf(data + size, total - size,
+                                  "%s\t%u\t%u\t%zu\t%zu\t%"PRIu64"\t%"PRIu64
+                                  "\n", function->function_name,
+                                  function->cache.ttl,
+                                  function->cache.lru_count,
+                                  function->cache.bytes,
+                                  function->cache.bytes_max,
+                                  function->cache.hit_count,
+                                  function->cache.miss_count);
+          if (size > total)
+            size= total;
         }
       }
+      gearman_server_shard_unlock(server);
+
+      if (size < total)
+        snprintf(data + size, total - size, ".\n");
+    }
+    else if (packet->argc == 2)
+    {
+      snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "ERR incomplete_args "
+               "An+incomplete+set+of+arguments+was+sent+to+this+command\n");
+    }
+    else
+    {
+      /* A time to live of 0 turns the cache off and drops what it holds. */
+      cache_bytes= GEARMAN_DEFAULT_CACHE_BYTES;
+      if (packet->argc > 3)
+      {
+        cache_bytes= atoll((char *)(packet->arg[3]));
+        if (cache_bytes < 0)
+          cache_bytes= 0;
+      }
+
+      gearman_server_shard_lock(server);
+      function= gearman_server_function_find(server_con->thread->server,
+                                             (char *)(packet->arg[1]),
+                                             strlen((char *)(packet->arg[1])));
+      if (function == NULL)
+        ;
+      else if (!strcasecmp("flush", (char *)(packet->arg[2])))
+        gearman_server_cache_flush(&(function->cache));
+      else
+      {
+        ttl= atoi((char *)(packet->arg[2]));
+        if (ttl < 0)
+          ttl= 0;
+
+        gearman_server_cache_set(&(function->cache), (uint32_t)ttl,
+                                 (size_t)cache_bytes);
+      }
+      gearman_server_shard_unlock(server);
 
       snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "OK\n");
     }
   }
+  else if (!strcasecmp("purge", (char *)(packet->arg[0])) ||
+           !strcasecmp("cancel", (char *)(packet->arg[0])))
+  {
+    priority= GEARMAN_JOB_PRIORITY_MAX;
+    if (packet->argc > 3)
+    {
+      if (!strcasecmp("high", (char *)(packet->arg[3])))
+        priority= GEARMAN_JOB_PRIORITY_HIGH;
+      else if (!strcasecmp("normal", (char *)(packet->arg[3])))
+        priority= GEARMAN_JOB_PRIORITY_NORMAL;
+      else if (!strcasecmp("low", (char *)(packet->arg[3])))
+        priority= GEARMAN_JOB_PRIORITY_LOW;
+    }
+
+    if (packet->argc == 1)
+    {
+      snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "ERR incomplete_args "
+               "An+incomplete+set+of+arguments+was+sent+to+this+command\n");
+    }
+    else if (packet->argc > 3 && priority == GEARMAN_JOB_PRIORITY_MAX)
+    {
+      snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE,
+               "ERR unknown_args Unknown+arguments+to+server+command\n");
+    }
+    else
+    {
+      /* A prefix of "*" matches any unique ID, so a priority can be given
+         alone. Purge leaves foreground jobs alone, cancel fails them. */
+      prefix_size= 0;
+      if (packet->argc > 2 && strcmp("*", (char *)(packet->arg[2])))
+        prefix_size= strlen((char *)(packet->arg[2]));
+
+      x= 0;
+      gearman_server_shard_lock(server);
+      function= gearman_server_function_find(server_con->thread->server,
+                                             (char *)(packet->arg[1]),
+                                             strlen((char *)(packet->arg[1])));
+      if (function != NULL)
+      {
+        x= gearman_server_job_purge(function,
+                                    packet->argc > 2 ?
+                                    (char *)(packet->arg[2]) : NULL,
+                                    prefix_size, priority,
+                                    !strcasecmp("cancel",
+                                                (char *)(packet->arg[0])));
+      }
+      gearman_server_shard_unlock(server);
+
+      snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "OK %u\n", x);
+    }
+  }
   else if (!strcasecmp("shutdown", (char *)(packet->arg[0])))
   {
     if (packet->argc == 1)
@@ -846,6 +2161,46 @@ static gearman_return_t _server_run_text(gearman_server_con_st *server_con,
                "ERR unknown_args Unknown+arguments+to+server+command\n");
     }
   }
+  else if (!strcasecmp("persist", (char *)(packet->arg[0])))
+  {
+    (void)gearman_server_persist_status(server, data,
+                                        GEARMAN_TEXT_RESPONSE_SIZE);
+  }
+  else if (!strcasecmp("replay", (char *)(packet->arg[0])))
+    (void)gearman_server_replay_status(server, data, GEARMAN_TEXT_RESPONSE_SIZE);
+  else if (!strcasecmp("snapshot", (char *)(packet->arg[0])))
+  {
+    (void)gearman_server_snapshot_status(server, data,
+                                         GEARMAN_TEXT_RESPONSE_SIZE);
+  }
+  else if (!strcasecmp("replica", (char *)(packet->arg[0])))
+  {
+    if (packet->argc == 1)
+    {
+      (void)gearman_server_replica_status(server, data,
+                                          GEARMAN_TEXT_RESPONSE_SIZE);
+    }
+    else if (packet->argc == 2 &&
+             !strcasecmp("promote", (char *)(packet->arg[1])))
+    {
+      gearman_server_shard_lock(server);
+      ret= gearman_server_replica_promote(server, &x);
+      gearman_server_shard_unlock(server);
+
+      if (ret == GEARMAN_SUCCESS)
+        snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "OK %u\n", x);
+      else
+      {
+        snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "ERR not_standby "
+                 "Server+is+not+a+replication+standby\n");
+      }
+    }
+    else
+    {
+      snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE,
+               "ERR unknown_args Unknown+arguments+to+server+command\n");
+    }
+  }
   else if (!strcasecmp("version", (char *)(packet->arg[0])))
     snprintf(data, GEARMAN_TEXT_RESPONSE_SIZE, "%s\n", PACKAGE_VERSION);
   else
@@ -854,45 +2209,63 @@ static gearman_return_t _server_run_text(gearman_server_con_st *server_con,
              "ERR unknown_command Unknown+server+command\n");
   }
 
-  server_packet= gearman_server_packet_create(server_con->thread, false);
-  if (server_packet == NULL)
+  io_packet= gearman_server_io_packet_create(server_con->thread, false);
+  if (io_packet == NULL)
   {
     free(data);
     return GEARMAN_MEMORY_ALLOCATION_FAILURE;
   }
 
-  if (gearman_packet_create(server_con->thread->gearman,
-                            &(server_packet->packet)) == NULL)
-  {
-    free(data);
-    gearman_server_packet_free(server_packet, server_con->thread, false);
-    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-  }
-  
-  server_packet->packet.magic= GEARMAN_MAGIC_TEXT;
-  server_packet->packet.command= GEARMAN_COMMAND_TEXT;
-  server_packet->packet.options|= (GEARMAN_PACKET_COMPLETE |
-                                   GEARMAN_PACKET_FREE_DATA);
-  server_packet->packet.data= data;
-  server_packet->packet.data_size= strlen(data);
+  io_packet->magic= GEARMAN_MAGIC_TEXT;
+  io_packet->command= GEARMAN_COMMAND_TEXT;
+  io_packet->options= (GEARMAN_PACKET_COMPLETE | GEARMAN_PACKET_FREE_DATA);
+  io_packet->data= data;
+  io_packet->data_size= strlen(data);
 
-  GEARMAN_SERVER_THREAD_LOCK(server_con->thread)
-  GEARMAN_FIFO_ADD(server_con->io_packet, server_packet,)
-  GEARMAN_SERVER_THREAD_UNLOCK(server_con->thread)
+  GEARMAN_SERVER_QUEUE_PUSH(server_con->io_packet, io_packet,, next_packet)
 
   gearman_server_con_io_add(server_con);
 
   return GEARMAN_SUCCESS;
 }
 
+static gearman_server_job_st *
+_server_job_running(gearman_server_con_st *server_con, const char *job_handle)
+{
+  gearman_server_job_st *server_job;
+
+  server_job= gearman_server_job_get(server_con->thread->server, job_handle);
+
+  /* A job that timed out went back to the queue, and may be running on
+     another worker by now, so late results from the old one are dropped. */
+  if (server_job == NULL || server_job->worker == NULL ||
+      server_job->worker->con != server_con)
+  {
+    return NULL;
+  }
+
+  return server_job;
+}
+
 static gearman_return_t
 _server_queue_work_data(gearman_server_job_st *server_job,
                         gearman_packet_st *packet, gearman_command_t command)
 {
   gearman_server_client_st *server_client;
+  gearman_packet_buffer_st *buffer= NULL;
   uint8_t *data;
   gearman_return_t ret;
 
+  /* Clients attached to the same job all share one copy of the data. */
+  if (packet->data_size > 0 && packet->options & GEARMAN_PACKET_FREE_DATA &&
+      server_job->client_list != NULL &&
+      server_job->client_list->job_next != NULL)
+  {
+    buffer= gearman_packet_share_data(packet);
+    if (buffer == NULL)
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
   for (server_client= server_job->client_list; server_client;
        server_client= server_client->job_next)
   {
@@ -903,6 +2276,20 @@ _server_queue_work_data(gearman_server_job_st *server_job,
     //   continue;
     // }
 
+    if (buffer != NULL)
+    {
+      ret= gearman_server_io_buffer_add(server_client->con,
+                                        packet->options &
+                                        GEARMAN_PACKET_COMPRESSED,
+                                        GEARMAN_MAGIC_RESPONSE, command,
+                                        buffer, packet->arg[0],
+                                        packet->arg_size[0], NULL);
+      if (ret != GEARMAN_SUCCESS)
+        return ret;
+
+      continue;
+    }
+
     if (packet->data_size > 0)
     {
       if (packet->options & GEARMAN_PACKET_FREE_DATA &&
@@ -926,7 +2313,10 @@ _server_queue_work_data(gearman_server_job_st *server_job,
     else
       data= NULL;
 
-    ret= gearman_server_io_packet_add(server_client->con, true,
+    ret= gearman_server_io_packet_add(server_client->con,
+                                      GEARMAN_PACKET_FREE_DATA |
+                                      (packet->options &
+                                       GEARMAN_PACKET_COMPRESSED),
                                       GEARMAN_MAGIC_RESPONSE, command,
                                       packet->arg[0], packet->arg_size[0],
                                       data, packet->data_size, NULL);
@@ -937,6 +2327,183 @@ _server_queue_work_data(gearman_server_job_st *server_job,
   return GEARMAN_SUCCESS;
 }
 
+static void _server_work_data_pause(gearman_server_con_st *server_con,
+                                    gearman_server_job_st *server_job)
+{
+  gearman_server_st *server= server_con->thread->server;
+  gearman_server_client_st *server_client;
+
+  if (server_con->io_paused != NULL)
+    return;
+
+  for (server_client= server_job->client_list; server_client;
+       server_client= server_client->job_next)
+  {
+    if (server_client->con->io_data_size <= server->work_data_max)
+      continue;
+
+    /* The client is kept from being freed while anything waits on it, and
+       the I/O thread for the worker stops reading once it sees this. */
+    (void)__sync_add_and_fetch(&(server_client->con->io_data_waiters), 1);
+    server_con->io_paused= server_client->con;
+    gearman_server_con_io_add(server_con);
+    return;
+  }
+}
+
+static gearman_return_t
+_server_cache_reply(gearman_server_con_st *server_con,
+                    gearman_server_cache_entry_st *entry)
+{
+  gearman_server_shard_st *shard= server_con->shard;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  const void *arg[1];
+  size_t arg_size[1];
+  uint8_t *data;
+  gearman_return_t ret;
+
+  /* Handles from the cache are marked so they never match a real job, even
+     when handles are built from job slots. The prefix is kept short enough
+     that the rest always fits, as in gearman_server_job_handle. */
+  memcpy(job_handle, shard->job_handle_prefix, shard->job_handle_prefix_size);
+  arg_size[0]= shard->job_handle_prefix_size +
+               (size_t)snprintf(job_handle + shard->job_handle_prefix_size,
+                                GEARMAN_JOB_HANDLE_SIZE -
+                                shard->job_handle_prefix_size, ":c%u",
+                                shard->job_handle_count);
+  shard->job_handle_count++;
+
+  arg[0]= job_handle;
+  ret= gearman_server_io_response_add(server_con, GEARMAN_COMMAND_JOB_CREATED,
+                                      1, arg, arg_size);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  if (entry->result_size > 0)
+  {
+    data= malloc(entry->result_size);
+    if (data == NULL)
+    {
+      GEARMAN_ERROR_SET(server_con->thread->gearman, "_server_cache_reply",
+                        "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    memcpy(data, entry->result, entry->result_size);
+  }
+  else
+    data= NULL;
+
+  return gearman_server_io_packet_add(server_con, GEARMAN_PACKET_FREE_DATA |
+                                      (entry->compressed ?
+                                       GEARMAN_PACKET_COMPRESSED : 0),
+                                      GEARMAN_MAGIC_RESPONSE,
+                                      GEARMAN_COMMAND_WORK_COMPLETE,
+                                      job_handle, strlen(job_handle) + 1,
+                                      data, entry->result_size, NULL);
+}
+
+static char *_server_chain_copy(gearman_server_st *server,
+                                gearman_packet_st *packet)
+{
+  gearman_server_shard_st *shard;
+  const char *stage;
+  const char *end;
+  const char *next;
+  char *chain;
+  size_t chain_size;
+
+  shard= gearman_server_shard_function(server, (char *)(packet->arg[0]),
+                                       packet->arg_size[0] - 1);
+
+  /* This may not be NULL terminated, so stop at the end of the argument. */
+  stage= (char *)(packet->arg[2]);
+  end= memchr(stage, 0, packet->arg_size[2]);
+  if (end == NULL)
+    end= stage + packet->arg_size[2];
+  chain_size= (size_t)(end - stage);
+
+  while (stage < end)
+  {
+    if (*stage == GEARMAN_CHAIN_KEEP_WORKLOAD)
+      stage++;
+
+    next= memchr(stage, GEARMAN_CHAIN_SEPARATOR, (size_t)(end - stage));
+    if (next == NULL)
+      next= end;
+
+    if (next == stage ||
+        gearman_server_shard_function(server, stage,
+                                      (size_t)(next - stage)) != shard)
+    {
+      return NULL;
+    }
+
+    stage= next;
+    while (stage < end && *stage == GEARMAN_CHAIN_SEPARATOR)
+      stage++;
+  }
+
+  if (chain_size == 0)
+    return NULL;
+
+  chain= malloc(chain_size + 1);
+  if (chain == NULL)
+    return NULL;
+
+  memcpy(chain, packet->arg[2], chain_size);
+  chain[chain_size]= 0;
+
+  return chain;
+}
+
+static void _server_shard_list_free(gearman_server_st *server)
+{
+  uint32_t x;
+
+  for (x= 0; x < server->shard_count; x++)
+    gearman_server_shard_free(&(server->shard_list[x]));
+
+  if (server->shard_list != NULL)
+    free(server->shard_list);
+
+  server->shard_list= NULL;
+  server->shard_count= 0;
+}
+
+static void _server_packet_slab_free(gearman_server_st *server,
+                                     uint32_t node_count)
+{
+  uint32_t x;
+
+  gearman_server_slab_free(&(server->packet_slab));
+  gearman_server_slab_free(&(server->io_packet_slab));
+
+  for (x= 0; x < node_count; x++)
+  {
+    gearman_server_slab_free(&(server->node_packet_slab[x]));
+    gearman_server_slab_free(&(server->node_io_packet_slab[x]));
+  }
+}
+
+static uint32_t _server_cpu_node(uint32_t cpu)
+{
+  char path[64];
+  uint32_t node;
+
+  /* Linux links each CPU to its node in sysfs. Nodes past the ones we keep
+     a slab for share the first one. */
+  for (node= 0; node < GEARMAN_SERVER_NUMA_NODES; node++)
+  {
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/node%u", cpu,
+             node);
+    if (access(path, F_OK) == 0)
+      return node;
+  }
+
+  return 0;
+}
+
 static void _log(gearman_st *gearman __attribute__ ((unused)),
                  gearman_verbose_t verbose, const char *line, void *fn_arg)
 {
@@ -25,8 +25,7 @@ extern "C" {
  */
 
 /**
- * Initialize a server structure. This cannot fail if the caller supplies a
- * server structure.
+ * Initialize a server structure.
  * @param server Caller allocated server structure, or NULL to allocate one.
  * @return Pointer to an allocated server structure if server parameter was
  *         NULL, or the server parameter pointer if it was not NULL.
@@ -55,6 +54,290 @@ void gearman_server_set_log(gearman_server_st *server,
                             gearman_server_log_fn log_fn, void *log_fn_arg,
                             gearman_verbose_t verbose);
 
+/**
+ * Set options for a server instance. GEARMAN_SERVER_JOB_HANDLE_INDEX makes
+ * job handles carry a slot number and generation that are used to find the
+ * job directly instead of hashing the handle string. It can only be changed
+ * while the server has no jobs.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param options Available options for server structures.
+ * @param data For options that require data, the value to set it to.
+ */
+GEARMAN_API
+void gearman_server_set_options(gearman_server_st *server,
+                                gearman_server_options_t options,
+                                uint32_t data);
+
+/**
+ * Pre-size the job hash tables for an expected number of jobs. The tables
+ * still grow on their own past this, this just avoids rehashing while a known
+ * backlog is loaded.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param size Number of hash buckets to use.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_set_job_hash_size(gearman_server_st *server,
+                                                 uint32_t size);
+
+/**
+ * Set the number of shards to split functions and jobs between. When the
+ * server runs with more than one I/O thread, each shard gets its own
+ * processing thread, so jobs for different functions are run in parallel.
+ * This can only be changed before any threads are created or jobs added.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param shard_count Number of shards to use, default is one.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_set_shards(gearman_server_st *server,
+                                           uint32_t shard_count);
+
+/**
+ * Set how many extra sleeping workers to wake beyond the number of queued
+ * jobs. Waking exactly one worker per job avoids a thundering herd of
+ * GRAB_JOB requests, while a small overshoot hides the latency of a woken
+ * worker that ends up taking a job for another function.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param worker_wakeup Number of extra workers to wake, default is
+ *        GEARMAN_DEFAULT_WORKER_WAKEUP.
+ */
+GEARMAN_API
+void gearman_server_set_worker_wakeup(gearman_server_st *server,
+                                      uint32_t worker_wakeup);
+
+/**
+ * Set how many packets an I/O thread reads from one connection before moving
+ * on. A connection that still has packets waiting goes to the back of the
+ * line and is read again on the next pass of the thread's event loop, so one
+ * busy client can't hold up every other connection on its thread.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param read_budget Packets to read per pass, or 0 for no limit. The default
+ *        is no limit.
+ */
+GEARMAN_API
+void gearman_server_set_read_budget(gearman_server_st *server,
+                                    uint32_t read_budget);
+
+/**
+ * Set how many priority levels each function queues jobs on. Jobs submitted
+ * with high, normal, and low priority start on the first, middle, and last
+ * level, and a worker is always given a job from the first level that has
+ * any. The levels in between only hold jobs moved up by the priority age, so
+ * more levels make a low priority job climb more slowly past normal ones.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param levels Number of levels, from GEARMAN_JOB_PRIORITY_MAX to
+ *        GEARMAN_SERVER_PRIORITY_LEVELS_MAX. Values outside that are clamped.
+ *        The default is GEARMAN_DEFAULT_PRIORITY_LEVELS.
+ */
+GEARMAN_API
+void gearman_server_set_priority_levels(gearman_server_st *server,
+                                        uint32_t levels);
+
+/**
+ * Set how long a job may wait at the front of its priority level before it
+ * is moved to the back of the level above, so a steady stream of normal jobs
+ * can't hold back low priority ones forever. Jobs are only moved when a
+ * worker asks for one, and only the jobs at the front of each level are
+ * looked at. A job then moves up one level for each age it waited, so time
+ * spent with no worker asking still counts.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param priority_age Seconds to wait on a level, or 0 to never move jobs up.
+ *        The default is GEARMAN_DEFAULT_PRIORITY_AGE.
+ */
+GEARMAN_API
+void gearman_server_set_priority_age(gearman_server_st *server,
+                                     uint32_t priority_age);
+
+/**
+ * Set how long a job with an affinity key is held for the worker its key
+ * prefers before any worker may take it. The key is the part of the unique
+ * ID before GEARMAN_AFFINITY_SEPARATOR, so "user42#1" and "user42#2" go to
+ * the same worker, which can keep what it cached for the first job for the
+ * second. Workers that set an ID with SET_CLIENT_ID keep their keys when they
+ * reconnect. The wait is counted in whole seconds on the shard timer wheel.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param affinity_wait Seconds to hold a job, or 0 to not use affinity keys.
+ *        The default is GEARMAN_DEFAULT_AFFINITY_WAIT.
+ */
+GEARMAN_API
+void gearman_server_set_affinity_wait(gearman_server_st *server,
+                                      uint32_t affinity_wait);
+
+/**
+ * Set how many bytes of WORK_DATA and WORK_WARNING packets may wait to be
+ * sent to one client. Once a client is this far behind, the server stops
+ * reading from the worker connection streaming to it, and starts again when
+ * the client is down to half of this. A worker in non-blocking mode then sees
+ * GEARMAN_IO_WAIT from gearman_job_data instead of filling server memory.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param work_data_max Bytes that may wait for each client, or 0 for no
+ *        limit. The default is GEARMAN_DEFAULT_WORK_DATA_MAX.
+ */
+GEARMAN_API
+void gearman_server_set_work_data_max(gearman_server_st *server,
+                                      size_t work_data_max);
+
+/**
+ * Set how many bytes of job payload may be queued in the server at once,
+ * over all functions. A job that would go past this is refused with
+ * GEARMAN_JOB_QUEUE_FULL, the same as one past the max_queue_size of its
+ * function. Each function can also have its own limit, set with the maxqueue
+ * admin command. Jobs replayed from the persistent queue are always let in.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param queue_bytes_max Bytes that may be queued, or 0 for no limit. The
+ *        default is GEARMAN_DEFAULT_QUEUE_BYTES_MAX.
+ */
+GEARMAN_API
+void gearman_server_set_queue_bytes_max(gearman_server_st *server,
+                                        size_t queue_bytes_max);
+
+/**
+ * Set how fast each connection may submit jobs. Every connection has a
+ * bucket that holds up to one second worth of bytes and refills at this
+ * rate, and each SUBMIT_JOB packet takes its size out of it. Once the bucket
+ * is empty the server stops reading from the connection until it has filled
+ * up again, so a client that submits too fast is slowed down to the rate
+ * instead of being refused. This must be set before the server starts.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param client_rate Bytes per second each connection may submit, or 0 for
+ *        no limit. The default is GEARMAN_DEFAULT_CLIENT_RATE.
+ */
+GEARMAN_API
+void gearman_server_set_client_rate(gearman_server_st *server,
+                                    size_t client_rate);
+
+/**
+ * Set where queued background job payloads go once the server holds too many
+ * of them in memory, see gearman_server_spill. Payloads already queued stay
+ * where they are.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param path Directory to create the spill files in, or NULL to keep all
+ *        payloads in memory. The default is NULL.
+ * @param watermark Bytes of payload to keep in memory before spilling, split
+ *        evenly between the shards.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_set_spill(gearman_server_st *server,
+                                          const char *path, size_t watermark);
+
+/**
+ * Commit background jobs to the persistent queue in groups instead of one at
+ * a time, see gearman_server_commit. This needs processing threads, and the
+ * JOB_CREATED reply for each job is only sent once its group is committed.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param size Jobs to commit at once, or 0 to commit every job as it is
+ *        added. The default is 0.
+ * @param window Microseconds a job may wait for its group to fill before it
+ *        is committed anyway. The default is
+ *        GEARMAN_DEFAULT_QUEUE_COMMIT_WINDOW.
+ */
+GEARMAN_API
+void gearman_server_set_queue_commit(gearman_server_st *server,
+                                     uint32_t size, uint32_t window);
+
+/**
+ * Run persistent queue calls in their own thread, see gearman_server_persist,
+ * so a slow queue module does not hold up jobs that are never persisted.
+ * Background job replies wait for their jobs to be committed by it. This
+ * needs processing threads. The "persist" admin command reports how far
+ * behind the thread is.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param persist_thread True to use a persistence thread.
+ */
+GEARMAN_API
+void gearman_server_set_queue_persist_thread(gearman_server_st *server,
+                                             bool persist_thread);
+
+/**
+ * Replay the persistent queue in the background, so the server takes
+ * connections and runs jobs while the rest of the queue loads. Jobs already in
+ * the server under a unique key that is replayed keep their place. This needs
+ * processing threads and a queue module that sets
+ * GEARMAN_QUEUE_REPLAY_CONCURRENT; otherwise the queue is replayed before the
+ * server starts as usual. The "replay" admin command reports progress.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param background True to replay in the background.
+ */
+GEARMAN_API
+void gearman_server_set_queue_replay_background(gearman_server_st *server,
+                                                bool background);
+
+/**
+ * Take periodic snapshots of the queued jobs, see gearman_server_snapshot, so
+ * a restart loads the snapshot and only replays the persistent queue after
+ * it. A last snapshot is taken on shutdown. This needs processing threads
+ * and a queue module with snapshot functions; otherwise the whole queue is
+ * replayed as usual. The "snapshot" admin command reports on the last one.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param path File to keep the snapshot in, or NULL to disable snapshots.
+ * @param interval Seconds between snapshots, or 0 to only take one on
+ *        shutdown. The default is GEARMAN_DEFAULT_SNAPSHOT_INTERVAL.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_set_snapshot(gearman_server_st *server,
+                                             const char *path,
+                                             uint32_t interval);
+
+/**
+ * Set how long the replies to the "status", "workers", "stats", "latency"
+ * and "metrics" admin commands are reused for, see gearman_server_stats.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param seconds Seconds to reuse a reply for, or 0 to build a new one for
+ *        every command. The default is GEARMAN_DEFAULT_STATS_INTERVAL.
+ */
+GEARMAN_API
+void gearman_server_set_stats_interval(gearman_server_st *server,
+                                       uint32_t seconds);
+
+/**
+ * Set the send and receive buffer sizes for connections, see
+ * gearman_set_buffer_size. This only applies to server threads created after
+ * the call.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param send_size Send buffer size, or 0 for the default.
+ * @param recv_size Receive buffer size, or 0 for the default.
+ */
+GEARMAN_API
+void gearman_server_set_buffer_size(gearman_server_st *server,
+                                    size_t send_size, size_t recv_size);
+
+/**
+ * Pin the processing threads to CPUs, see gearman_server_pin. Processing
+ * thread x runs on the CPU at position x in the list, wrapping around when
+ * there are more threads than CPUs. This must be set before any threads are
+ * created.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param cpu_list CPUs to pin to, which are copied.
+ * @param cpu_count Number of CPUs in cpu_list, or 0 to not pin them.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_set_proc_cpus(gearman_server_st *server,
+                                              const uint32_t *cpu_list,
+                                              uint32_t cpu_count);
+
 /**
  * Process commands for a connection.
  * @param server_con Server connection that has a packet to process.
@@ -86,6 +369,72 @@ gearman_return_t gearman_server_shutdown_graceful(gearman_server_st *server);
 GEARMAN_API
 gearman_return_t gearman_server_queue_replay(gearman_server_st *server);
 
+/**
+ * Store jobs in the persistent queue, through the module's batch function
+ * when there is more than one and it has one. The caller holds the queue
+ * lock.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param record Jobs to store.
+ * @param record_count Number of jobs in record.
+ * @return Standard gearman return value. On failure none of the jobs should
+ *         be taken as stored.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_queue_add(gearman_server_st *server,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count);
+
+/**
+ * Remove jobs from the persistent queue, through the module's batch function
+ * when there is more than one and it has one. The caller holds the queue
+ * lock.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param record Jobs to remove, only the unique and function name are used.
+ * @param record_count Number of jobs in record.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_queue_done(gearman_server_st *server,
+                                          const gearman_queue_record_st *record,
+                                          size_t record_count);
+
+/**
+ * Parse a CPU list such as "0-3,8,10-11" into CPU numbers.
+ * @param list String to parse.
+ * @param cpu_list Set to an array holding the CPUs in the order they are
+ *        listed, which the caller frees.
+ * @param cpu_count Set to the number of CPUs in cpu_list.
+ * @return Standard gearman return value. GEARMAN_UNKNOWN_OPTION means the
+ *         list is malformed or names a CPU past GEARMAN_SERVER_CPU_MAX.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_cpu_list(const char *list,
+                                         uint32_t **cpu_list,
+                                         uint32_t *cpu_count);
+
+/**
+ * Pin the calling thread to a CPU. Packets the thread allocates through the
+ * magazine come from a slab of its own for the NUMA node of that CPU from
+ * then on, so their memory is first touched on, and stays on, that node.
+ * Packets from another node's slab go straight back to their own slab when
+ * they are released through the magazine.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param cpu CPU to run the calling thread on.
+ * @param magazine Packet magazine only the calling thread uses, or NULL to
+ *        just pin the thread.
+ * @param io_magazine Output packet magazine only the calling thread uses, or
+ *        NULL.
+ * @return Standard gearman return value. GEARMAN_UNKNOWN_OPTION means the
+ *         system can't pin threads, and GEARMAN_ERRNO that it refused to.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_pin(gearman_server_st *server, uint32_t cpu,
+                                    gearman_server_magazine_st *magazine,
+                                    gearman_server_magazine_st *io_magazine);
+
 /** @} */
 
 #ifdef __cplusplus
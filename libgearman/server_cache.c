@@ -0,0 +1,270 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server result cache definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_cache_private Private Server Result Cache Functions
+ * @ingroup gearman_server_cache
+ * @{
+ */
+
+/**
+ * Get the number of bytes an entry counts for against the cache limit.
+ */
+static size_t _server_cache_entry_size(size_t unique_size, size_t result_size);
+
+/**
+ * Find the entry for a unique ID, whether or not it has expired.
+ */
+static gearman_server_cache_entry_st *
+_server_cache_find(gearman_server_cache_st *cache, const char *unique,
+                   size_t unique_size);
+
+/**
+ * Remove an entry from a cache and free it.
+ */
+static void _server_cache_entry_free(gearman_server_cache_st *cache,
+                                     gearman_server_cache_entry_st *entry);
+
+/**
+ * Drop least recently used entries until the cache has room for the given
+ * number of bytes.
+ */
+static void _server_cache_evict(gearman_server_cache_st *cache, size_t size);
+
+/**
+ * Rebuild the hash of a cache with a new number of buckets. The cache is
+ * bounded by its byte limit, so this does not need to be incremental.
+ */
+static gearman_return_t
+_server_cache_hash_resize(gearman_server_cache_st *cache, uint32_t size);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_cache_init(gearman_server_cache_st *cache)
+{
+  cache->ttl= 0;
+  cache->lru_count= 0;
+  cache->hash_size= 0;
+  cache->bytes= 0;
+  cache->bytes_max= GEARMAN_DEFAULT_CACHE_BYTES;
+  cache->hit_count= 0;
+  cache->miss_count= 0;
+  cache->lru_list= NULL;
+  cache->lru_end= NULL;
+  cache->hash= NULL;
+}
+
+void gearman_server_cache_free(gearman_server_cache_st *cache)
+{
+  gearman_server_cache_flush(cache);
+
+  if (cache->hash != NULL)
+    free(cache->hash);
+
+  cache->hash= NULL;
+  cache->hash_size= 0;
+}
+
+void gearman_server_cache_set(gearman_server_cache_st *cache, uint32_t ttl,
+                              size_t bytes_max)
+{
+  cache->ttl= ttl;
+  cache->bytes_max= bytes_max;
+
+  if (ttl == 0)
+    gearman_server_cache_free(cache);
+  else
+    _server_cache_evict(cache, 0);
+}
+
+void gearman_server_cache_flush(gearman_server_cache_st *cache)
+{
+  while (cache->lru_list != NULL)
+    _server_cache_entry_free(cache, cache->lru_list);
+}
+
+void gearman_server_cache_add(gearman_server_cache_st *cache,
+                              const char *unique, size_t unique_size,
+                              const void *result, size_t result_size,
+                              bool compressed)
+{
+  gearman_server_cache_entry_st *entry;
+  size_t size;
+
+  if (cache->ttl == 0)
+    return;
+
+  size= _server_cache_entry_size(unique_size, result_size);
+  if (size > cache->bytes_max)
+    return;
+
+  entry= _server_cache_find(cache, unique, unique_size);
+  if (entry != NULL)
+    _server_cache_entry_free(cache, entry);
+
+  if (cache->lru_count >= cache->hash_size &&
+      cache->hash_size < (UINT32_MAX >> 1))
+  {
+    /* Without a first table there is nowhere to put the entry. */
+    if (_server_cache_hash_resize(cache,
+                                  cache->hash_size == 0 ?
+                                  GEARMAN_SERVER_CACHE_HASH_SIZE :
+                                  cache->hash_size << 1) != GEARMAN_SUCCESS &&
+        cache->hash == NULL)
+    {
+      return;
+    }
+  }
+
+  _server_cache_evict(cache, size);
+
+  /* The unique ID and result are kept right after the entry. */
+  entry= malloc(size);
+  if (entry == NULL)
+    return;
+
+  entry->compressed= compressed;
+  entry->key= gearman_server_hash64(unique, unique_size);
+  entry->expire= time(NULL) + (time_t)(cache->ttl);
+  entry->unique_size= unique_size;
+  entry->result_size= result_size;
+  entry->unique= (char *)(entry + 1);
+  entry->result= (uint8_t *)(entry->unique + unique_size + 1);
+  memcpy(entry->unique, unique, unique_size);
+  entry->unique[unique_size]= 0;
+  if (result_size > 0)
+    memcpy(entry->result, result, result_size);
+
+  GEARMAN_LIST_ADD(cache->lru, entry, lru_)
+  if (cache->lru_end == NULL)
+    cache->lru_end= entry;
+  GEARMAN_BUCKET_ADD(cache->hash[entry->key & (cache->hash_size - 1)], entry,
+                     hash_)
+  cache->bytes+= size;
+}
+
+gearman_server_cache_entry_st *
+gearman_server_cache_get(gearman_server_cache_st *cache, const char *unique,
+                         size_t unique_size)
+{
+  gearman_server_cache_entry_st *entry;
+
+  entry= _server_cache_find(cache, unique, unique_size);
+  if (entry != NULL && entry->expire <= time(NULL))
+  {
+    _server_cache_entry_free(cache, entry);
+    entry= NULL;
+  }
+
+  if (entry == NULL)
+  {
+    cache->miss_count++;
+    return NULL;
+  }
+
+  if (entry != cache->lru_list)
+  {
+    if (cache->lru_end == entry)
+      cache->lru_end= entry->lru_prev;
+    GEARMAN_LIST_DEL(cache->lru, entry, lru_)
+    GEARMAN_LIST_ADD(cache->lru, entry, lru_)
+  }
+
+  cache->hit_count++;
+  return entry;
+}
+
+/*
+ * Private definitions
+ */
+
+static size_t _server_cache_entry_size(size_t unique_size, size_t result_size)
+{
+  return sizeof(gearman_server_cache_entry_st) + unique_size + 1 + result_size;
+}
+
+static gearman_server_cache_entry_st *
+_server_cache_find(gearman_server_cache_st *cache, const char *unique,
+                   size_t unique_size)
+{
+  gearman_server_cache_entry_st *entry;
+  uint64_t key;
+
+  if (cache->lru_count == 0)
+    return NULL;
+
+  key= gearman_server_hash64(unique, unique_size);
+  for (entry= cache->hash[key & (cache->hash_size - 1)]; entry != NULL;
+       entry= entry->hash_next)
+  {
+    if (entry->key == key && entry->unique_size == unique_size &&
+        !memcmp(entry->unique, unique, unique_size))
+    {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+static void _server_cache_entry_free(gearman_server_cache_st *cache,
+                                     gearman_server_cache_entry_st *entry)
+{
+  if (cache->lru_end == entry)
+    cache->lru_end= entry->lru_prev;
+  GEARMAN_LIST_DEL(cache->lru, entry, lru_)
+  GEARMAN_BUCKET_DEL(cache->hash[entry->key & (cache->hash_size - 1)], entry,
+                     hash_)
+  cache->bytes-= _server_cache_entry_size(entry->unique_size,
+                                          entry->result_size);
+  free(entry);
+}
+
+static void _server_cache_evict(gearman_server_cache_st *cache, size_t size)
+{
+  while (cache->lru_end != NULL && cache->bytes + size > cache->bytes_max)
+    _server_cache_entry_free(cache, cache->lru_end);
+}
+
+static gearman_return_t
+_server_cache_hash_resize(gearman_server_cache_st *cache, uint32_t size)
+{
+  gearman_server_cache_entry_st **hash;
+  gearman_server_cache_entry_st *entry;
+
+  /* Sizes are kept a power of two so a key is put in a bucket with a mask. */
+  hash= calloc(size, sizeof(gearman_server_cache_entry_st *));
+  if (hash == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  for (entry= cache->lru_list; entry != NULL; entry= entry->lru_next)
+    GEARMAN_BUCKET_ADD(hash[entry->key & (size - 1)], entry, hash_)
+
+  if (cache->hash != NULL)
+    free(cache->hash);
+
+  cache->hash= hash;
+  cache->hash_size= size;
+
+  return GEARMAN_SUCCESS;
+}
@@ -0,0 +1,105 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server result cache declarations
+ */
+
+#ifndef __GEARMAN_SERVER_CACHE_H__
+#define __GEARMAN_SERVER_CACHE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_cache Server Result Cache
+ * @ingroup gearman_server
+ * This is a low level interface for keeping the results of recent jobs, for
+ * functions that always return the same result for the same unique ID. Each
+ * function has its own cache, which is off until a time to live is set with
+ * the "cache" admin command. A job that completes has its result kept for
+ * that long, and a later foreground submit with the same unique ID is
+ * answered from the cache without going to a worker. Entries are kept in
+ * least recently used order, and the oldest are dropped once the cache would
+ * go over its byte limit. Jobs with no unique ID, or one taken from their
+ * data, are never cached, and neither are jobs that sent WORK_DATA or
+ * WORK_WARNING. The cache functions do no locking on their own and run under
+ * the shard lock of the function.
+ * @{
+ */
+
+/**
+ * Initialize the cache for a function. It starts out off.
+ */
+GEARMAN_API
+void gearman_server_cache_init(gearman_server_cache_st *cache);
+
+/**
+ * Free all entries in a cache.
+ */
+GEARMAN_API
+void gearman_server_cache_free(gearman_server_cache_st *cache);
+
+/**
+ * Turn a cache on or off, or change its limits. Entries over the new byte
+ * limit are dropped, and turning the cache off drops all of them. Entries
+ * already in the cache keep the time to live they were added with.
+ * @param cache Cache to change.
+ * @param ttl Seconds to keep each result for, or 0 to turn the cache off.
+ * @param bytes_max Most bytes the entries may take up together.
+ */
+GEARMAN_API
+void gearman_server_cache_set(gearman_server_cache_st *cache, uint32_t ttl,
+                              size_t bytes_max);
+
+/**
+ * Drop all entries in a cache, leaving it on.
+ */
+GEARMAN_API
+void gearman_server_cache_flush(gearman_server_cache_st *cache);
+
+/**
+ * Keep the result of a job that just completed. This replaces any entry with
+ * the same unique ID. Results that don't fit are not kept, and neither is any
+ * result when memory can't be allocated.
+ * @param cache Cache for the function of the job.
+ * @param unique Unique ID of the job.
+ * @param unique_size Size of unique.
+ * @param result Result data, which is copied.
+ * @param result_size Size of result.
+ * @param compressed Whether the result was sent compressed.
+ */
+GEARMAN_API
+void gearman_server_cache_add(gearman_server_cache_st *cache,
+                              const char *unique, size_t unique_size,
+                              const void *result, size_t result_size,
+                              bool compressed);
+
+/**
+ * Find the result kept for a unique ID, and mark it as most recently used. An
+ * entry whose time to live has passed is dropped instead.
+ * @param cache Cache for the function being submitted to.
+ * @param unique Unique ID of the job being submitted.
+ * @param unique_size Size of unique.
+ * @return Entry found, or NULL if there is none. It is only valid until the
+ *         cache is next changed.
+ */
+GEARMAN_API
+gearman_server_cache_entry_st *
+gearman_server_cache_get(gearman_server_cache_st *cache, const char *unique,
+                         size_t unique_size);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_CACHE_H__ */
@@ -33,24 +33,16 @@ gearman_server_client_st *
 gearman_server_client_create(gearman_server_con_st *con,
                              gearman_server_client_st *client)
 {
-  gearman_server_st *server= con->thread->server;
+  gearman_server_shard_st *shard= con->shard;
 
   if (client == NULL)
   {
-    if (server->free_client_count > 0)
+    client= gearman_server_slab_alloc(&(shard->client_slab));
+    if (client == NULL)
     {
-      client= server->free_client_list;
-      GEARMAN_LIST_DEL(server->free_client, client, con_)
-    }
-    else
-    {
-      client= malloc(sizeof(gearman_server_client_st));
-      if (client == NULL)
-      {
-        GEARMAN_ERROR_SET(con->thread->gearman, "gearman_server_client_create",
-                          "malloc")
-        return NULL;
-      }
+      GEARMAN_ERROR_SET(con->thread->gearman, "gearman_server_client_create",
+                        "malloc")
+      return NULL;
     }
 
     client->options= GEARMAN_SERVER_CLIENT_ALLOCATED;
@@ -59,7 +51,8 @@ gearman_server_client_create(gearman_server_con_st *con,
     client->options= 0;
 
   client->con= con;
-  GEARMAN_LIST_ADD(con->client, client, con_)
+  client->shard= shard;
+  GEARMAN_LIST_ADD(con->shard_list[shard->id].client, client, con_)
   client->job= NULL;
   client->job_next= NULL;
   client->job_prev= NULL;
@@ -69,24 +62,22 @@ gearman_server_client_create(gearman_server_con_st *con,
 
 void gearman_server_client_free(gearman_server_client_st *client)
 {
-  gearman_server_st *server= client->con->thread->server;
+  gearman_server_shard_st *shard= client->shard;
 
-  GEARMAN_LIST_DEL(client->con->client, client, con_)
+  GEARMAN_LIST_DEL(client->con->shard_list[shard->id].client, client, con_)
 
   if (client->job != NULL)
   {
     GEARMAN_LIST_DEL(client->job->client, client, job_)
 
-    /* If this was a foreground job and is now abandoned, mark to not run. */
-    if (client->job->client_list == NULL)
-      client->job->options|= GEARMAN_SERVER_JOB_IGNORE;
+    /* If this was a foreground job and is now abandoned, drop it. */
+    if (client->job->client_list == NULL &&
+        !(client->job->options & GEARMAN_SERVER_JOB_IGNORE))
+    {
+      gearman_server_job_abandon(client->job);
+    }
   }
 
   if (client->options & GEARMAN_SERVER_CLIENT_ALLOCATED)
-  {
-    if (server->free_client_count < GEARMAN_MAX_FREE_SERVER_CLIENT)
-      GEARMAN_LIST_ADD(server->free_client, client, con_)
-    else
-      free(client);
-  }
+    gearman_server_slab_release(&(shard->client_slab), client);
 }
@@ -34,7 +34,8 @@ gearman_server_client_st *
 gearman_server_client_add(gearman_server_con_st *con);
 
 /**
- * Initialize a server client structure.
+ * Initialize a server client structure in the shard the connection is
+ * currently running in.
  */
 GEARMAN_API
 gearman_server_client_st *
@@ -0,0 +1,282 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server group commit definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_commit_private Private Server Group Commit Functions
+ * @ingroup gearman_server_commit
+ * @{
+ */
+
+/**
+ * Start committing all jobs waiting in a shard.
+ */
+static void _server_commit_start(gearman_server_shard_st *shard);
+
+/**
+ * Record the result of a commit and wake the shard. This is given to queue
+ * modules as the done callback, so it may run in any thread.
+ */
+static void _server_commit_done(void *done_arg, gearman_return_t ret);
+
+/**
+ * Queue replies for the connections of a finished commit and run them again.
+ */
+static void _server_commit_reply(gearman_server_shard_st *shard,
+                                 gearman_return_t ret);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_commit_init(gearman_server_commit_st *commit)
+{
+  commit->in_flight= false;
+  commit->done= false;
+  commit->ret= GEARMAN_SUCCESS;
+  commit->count= 0;
+  commit->start.tv_sec= 0;
+  commit->start.tv_usec= 0;
+  commit->con_list= NULL;
+  commit->con_end= NULL;
+  commit->flight_list= NULL;
+}
+
+bool gearman_server_commit_enabled(gearman_server_st *server)
+{
+  /* The persistence thread commits as soon as it can, and the size and window
+     only make groups bigger. */
+  return (server->queue_commit_size > 0 ||
+          gearman_server_persist_enabled(server)) &&
+         server->options & GEARMAN_SERVER_PROC_THREAD &&
+         !(server->options & GEARMAN_SERVER_QUEUE_REPLAY) &&
+         server->gearman->queue_add_fn != NULL;
+}
+
+void gearman_server_commit_add(gearman_server_con_st *con,
+                               const char *job_handle)
+{
+  gearman_server_commit_st *commit= &(con->shard->commit);
+
+  snprintf(con->commit_handle, GEARMAN_JOB_HANDLE_SIZE, "%s", job_handle);
+  con->commit_wait= true;
+  con->commit_next= NULL;
+
+  if (commit->con_list == NULL)
+  {
+    commit->con_list= con;
+    (void) gettimeofday(&(commit->start), NULL);
+  }
+  else
+    commit->con_end->commit_next= con;
+
+  commit->con_end= con;
+  commit->count++;
+}
+
+bool gearman_server_commit_run(gearman_server_shard_st *shard, bool force)
+{
+  gearman_server_commit_st *commit= &(shard->commit);
+  gearman_server_st *server= shard->server;
+  struct timeval now;
+  uint64_t waited;
+  bool done;
+  bool resumed= false;
+
+  while (1)
+  {
+    if (commit->in_flight)
+    {
+      GEARMAN_SERVER_LOCK(shard->server, &(shard->proc_lock),
+                          &(shard->proc_lock_stats))
+      done= commit->done;
+      GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                            &(shard->proc_lock_stats))
+
+      if (!done)
+        return resumed;
+
+      _server_commit_reply(shard, commit->ret);
+      resumed= true;
+    }
+
+    if (commit->count == 0)
+      return resumed;
+
+    if (!force && commit->count < server->queue_commit_size)
+    {
+      (void) gettimeofday(&now, NULL);
+      waited= (uint64_t)(now.tv_sec - commit->start.tv_sec) * 1000000 +
+              (uint64_t)(now.tv_usec - commit->start.tv_usec);
+      if (now.tv_sec >= commit->start.tv_sec &&
+          waited < server->queue_commit_window)
+      {
+        return resumed;
+      }
+    }
+
+    _server_commit_start(shard);
+  }
+}
+
+bool gearman_server_commit_deadline(gearman_server_shard_st *shard,
+                                    struct timespec *deadline)
+{
+  gearman_server_commit_st *commit= &(shard->commit);
+  uint64_t usec;
+
+  if (commit->count == 0 || commit->in_flight)
+    return false;
+
+  usec= (uint64_t)(commit->start.tv_usec) + shard->server->queue_commit_window;
+  deadline->tv_sec= commit->start.tv_sec + (time_t)(usec / 1000000);
+  deadline->tv_nsec= (long)(usec % 1000000) * 1000;
+
+  return true;
+}
+
+/*
+ * Private definitions
+ */
+
+static void _server_commit_start(gearman_server_shard_st *shard)
+{
+  gearman_server_commit_st *commit= &(shard->commit);
+  gearman_server_st *server= shard->server;
+  gearman_st *gearman= server->gearman;
+  gearman_return_t ret;
+
+  commit->flight_list= commit->con_list;
+  commit->con_list= NULL;
+  commit->con_end= NULL;
+  commit->count= 0;
+  commit->done= false;
+  commit->in_flight= true;
+
+  /* The commit runs after the jobs the shard already handed over. */
+  if (gearman_server_persist_enabled(server))
+  {
+    if (gearman_server_persist_commit(server, _server_commit_done,
+                                      shard) != GEARMAN_SUCCESS)
+    {
+      _server_commit_done(shard, GEARMAN_MEMORY_ALLOCATION_FAILURE);
+    }
+
+    return;
+  }
+
+  /* The queue is shared, so this commits whatever other shards have added
+     too. That only makes their jobs durable sooner. */
+  GEARMAN_SERVER_QUEUE_LOCK(server)
+  if (gearman->queue_commit_fn != NULL)
+  {
+    ret= (*(gearman->queue_commit_fn))(gearman, (void *)gearman->queue_fn_arg,
+                                       _server_commit_done, shard);
+  }
+  else
+  {
+    if (gearman->queue_flush_fn == NULL)
+      ret= GEARMAN_SUCCESS;
+    else
+    {
+      ret= (*(gearman->queue_flush_fn))(gearman,
+                                        (void *)gearman->queue_fn_arg);
+    }
+
+    _server_commit_done(shard, ret);
+    ret= GEARMAN_SUCCESS;
+  }
+  GEARMAN_SERVER_QUEUE_UNLOCK(server)
+
+  if (ret != GEARMAN_SUCCESS)
+    _server_commit_done(shard, ret);
+}
+
+static void _server_commit_done(void *done_arg, gearman_return_t ret)
+{
+  gearman_server_shard_st *shard= (gearman_server_shard_st *)done_arg;
+
+  GEARMAN_SERVER_LOCK(shard->server, &(shard->proc_lock),
+                      &(shard->proc_lock_stats))
+
+  shard->commit.ret= ret;
+  shard->commit.done= true;
+
+  if (!(shard->proc_wakeup))
+  {
+    shard->proc_wakeup= true;
+    (void) pthread_cond_signal(&(shard->proc_cond));
+  }
+
+  GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                        &(shard->proc_lock_stats))
+}
+
+static void _server_commit_reply(gearman_server_shard_st *shard,
+                                 gearman_return_t ret)
+{
+  gearman_server_commit_st *commit= &(shard->commit);
+  gearman_server_con_st *con;
+  const void *arg[1];
+  size_t arg_size[1];
+  gearman_return_t reply_ret;
+
+  commit->in_flight= false;
+  commit->done= false;
+
+  while (commit->flight_list != NULL)
+  {
+    con= commit->flight_list;
+    commit->flight_list= con->commit_next;
+    con->commit_next= NULL;
+    con->commit_wait= false;
+
+    /* The job stays queued in memory either way, so a client that retries
+       with the same unique key just gets the same job back. */
+    if (ret == GEARMAN_SUCCESS)
+    {
+      arg[0]= con->commit_handle;
+      arg_size[0]= strlen(con->commit_handle);
+      reply_ret= gearman_server_io_response_add(con,
+                                                GEARMAN_COMMAND_JOB_CREATED, 1,
+                                                arg, arg_size);
+    }
+    else
+    {
+      reply_ret= gearman_server_io_packet_add(con, 0, GEARMAN_MAGIC_RESPONSE,
+                                              GEARMAN_COMMAND_ERROR,
+                                              "queue_error",
+                                              sizeof("queue_error"),
+                                              "Job could not be committed",
+                                              sizeof("Job could not be "
+                                                     "committed") - 1, NULL);
+    }
+
+    /* Let the I/O thread close connections we could not reply to, the same
+       way it does when a command fails. */
+    if (reply_ret != GEARMAN_SUCCESS)
+    {
+      con->ret= reply_ret;
+      gearman_server_con_io_add(con);
+    }
+
+    gearman_server_con_proc_queue(con, shard);
+  }
+}
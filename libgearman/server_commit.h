@@ -0,0 +1,88 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server group commit declarations
+ */
+
+#ifndef __GEARMAN_SERVER_COMMIT_H__
+#define __GEARMAN_SERVER_COMMIT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_commit Server Group Commit
+ * @ingroup gearman_server
+ * This is a low level interface for committing background jobs to the
+ * persistent queue in groups. Instead of flushing the queue for every job,
+ * a shard holds back the JOB_CREATED reply and stops running the submitting
+ * connection until the job is committed, so replies still go out in order.
+ * The jobs waiting in a shard are committed together once the commit size is
+ * reached, or once the oldest of them has waited for the commit window,
+ * whichever comes first. Only one commit is in flight per shard; jobs
+ * submitted meanwhile wait for the next one. This is only used with
+ * processing threads, and all of it runs under the shard lock.
+ * @{
+ */
+
+/**
+ * Initialize the group commit state for a shard.
+ */
+GEARMAN_API
+void gearman_server_commit_init(gearman_server_commit_st *commit);
+
+/**
+ * See if background job replies should wait for a group commit.
+ */
+GEARMAN_API
+bool gearman_server_commit_enabled(gearman_server_st *server);
+
+/**
+ * Hold back the JOB_CREATED reply for a background job until the next commit
+ * in the shard running the connection. The connection is not run again until
+ * the reply has been queued.
+ * @param con Connection that submitted the job.
+ * @param job_handle Handle to reply with.
+ */
+GEARMAN_API
+void gearman_server_commit_add(gearman_server_con_st *con,
+                               const char *job_handle);
+
+/**
+ * Finish a commit that completed and start the next one if it is due.
+ * Connections whose jobs were committed get their replies and are queued to
+ * run in the shard again.
+ * @param shard Shard to run group commits for.
+ * @param force Commit waiting jobs now, without waiting for the commit size
+ *        or window.
+ * @return Whether any connections were queued to run again.
+ */
+GEARMAN_API
+bool gearman_server_commit_run(gearman_server_shard_st *shard, bool force);
+
+/**
+ * Get the time the next commit is due in a shard.
+ * @param shard Shard to look at.
+ * @param deadline Absolute time the oldest waiting job's window ends.
+ * @return Whether a deadline was set. There is none if nothing is waiting, or
+ *         if a commit is in flight and the shard must wait for it instead.
+ */
+GEARMAN_API
+bool gearman_server_commit_deadline(gearman_server_shard_st *shard,
+                                    struct timespec *deadline);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_COMMIT_H__ */
@@ -13,12 +13,33 @@
 
 #include "common.h"
 
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_con_private Private Server Connection Functions
+ * @ingroup gearman_server_con
+ * @{
+ */
+
+/**
+ * Get the wakeup counter of the thread calling, which is the shard it runs
+ * under if it has one, or else the I/O thread of the connection. Either way
+ * only one thread writes to it at a time.
+ */
+static uint64_t *_con_wakeups_sent(gearman_server_con_st *con);
+
+/** @} */
+
 /*
  * Public definitions
  */
 
 gearman_server_con_st *gearman_server_con_add(gearman_server_thread_st *thread,
-                                              int fd, void *data)
+                                              int fd,
+                                              gearman_con_options_t options,
+                                              void *data)
 {
   gearman_server_con_st *con;
   gearman_return_t ret;
@@ -27,6 +48,8 @@ gearman_server_con_st *gearman_server_con_add(gearman_server_thread_st *thread,
   if (con == NULL)
     return NULL;
 
+  con->con.options|= options;
+
   if (gearman_con_set_fd(&(con->con), fd) != GEARMAN_SUCCESS)
   {
     gearman_server_con_free(con);
@@ -49,6 +72,8 @@ gearman_server_con_st *
 gearman_server_con_create(gearman_server_thread_st *thread)
 {
   gearman_server_con_st *con;
+  uint32_t shard_count= thread->server->shard_count;
+  uint32_t x;
 
   if (thread->free_con_count > 0)
   {
@@ -57,13 +82,20 @@ gearman_server_con_create(gearman_server_thread_st *thread)
   }
   else
   {
-    con= malloc(sizeof(gearman_server_con_st));
+    /* The per-shard state is kept in the same allocation, right after the
+       connection. */
+    con= malloc(sizeof(gearman_server_con_st) +
+                (sizeof(gearman_server_con_shard_st) * shard_count));
     if (con == NULL)
     {
       GEARMAN_ERROR_SET(thread->gearman, "gearman_server_con_create",
                         "malloc")
       return NULL;
     }
+
+    /* A reused connection may still have paused connections looking at it,
+       and they let go of it in their own time. */
+    con->io_data_waiters= 0;
   }
 
   if (gearman_con_create(thread->gearman, &(con->con)) == NULL)
@@ -78,27 +110,58 @@ gearman_server_con_create(gearman_server_thread_st *thread)
   con->ret= 0;
   con->noop_queued= false;
   con->io_list= false;
+  con->budget_list= false;
+  con->pause_list= false;
+  con->rate_list= false;
   con->proc_list= false;
   con->proc_removed= false;
-  con->io_packet_count= 0;
-  con->proc_packet_count= 0;
-  con->worker_count= 0;
-  con->client_count= 0;
+  con->proc_forward= false;
+  con->commit_wait= false;
+  con->proc_hops= 0;
+  con->proc_dead= 0;
+  con->proc_rotate= 0;
+  con->io_packet_offset= 0;
+  con->io_data_size= 0;
+  con->id_key= (uint64_t)(uintptr_t)con;
+  con->rate_tokens= 0;
+  con->rate_time= 0;
+  con->load_count= 0;
   con->thread= thread;
+  con->shard= NULL;
+  con->shard_list= (gearman_server_con_shard_st *)(con + 1);
   con->packet= NULL;
   con->io_packet_list= NULL;
-  con->io_packet_end= NULL;
+  con->io_packet_stack= NULL;
   con->proc_packet_list= NULL;
-  con->proc_packet_end= NULL;
+  con->proc_packet_stack= NULL;
   con->io_next= NULL;
-  con->io_prev= NULL;
   con->proc_next= NULL;
-  con->proc_prev= NULL;
-  con->worker_list= NULL;
-  con->client_list= NULL;
+  con->budget_next= NULL;
+  con->budget_prev= NULL;
+  con->pause_next= NULL;
+  con->pause_prev= NULL;
+  con->rate_next= NULL;
+  con->rate_prev= NULL;
+  con->io_paused= NULL;
+  con->commit_next= NULL;
   con->host= NULL;
   con->port= NULL;
-  strcpy(con->id, "-");
+  con->id= NULL;
+
+  for (x= 0; x < shard_count; x++)
+  {
+    con->shard_list[x].options= 0;
+    con->shard_list[x].worker_count= 0;
+    con->shard_list[x].ready_worker_count= 0;
+    con->shard_list[x].client_count= 0;
+    con->shard_list[x].slots= 0;
+    con->shard_list[x].slots_used= 0;
+    con->shard_list[x].worker_list= NULL;
+    con->shard_list[x].ready_worker_list= NULL;
+    con->shard_list[x].ready_worker_turn= NULL;
+    con->shard_list[x].client_list= NULL;
+    con->shard_list[x].wakeup_function= NULL;
+  }
 
   GEARMAN_SERVER_THREAD_LOCK(thread)
   GEARMAN_LIST_ADD(thread->con, con,)
@@ -111,10 +174,30 @@ void gearman_server_con_free(gearman_server_con_st *con)
 {
   gearman_server_thread_st *thread= con->thread;
   gearman_server_packet_st *packet;
+  uint32_t x;
 
   con->host= NULL;
   con->port= NULL;
 
+  /* Connections are only freed by their I/O thread, which owns this list. */
+  if (con->budget_list)
+  {
+    GEARMAN_LIST_DEL(thread->budget, con, budget_)
+    con->budget_list= false;
+  }
+
+  if (con->pause_list)
+  {
+    GEARMAN_LIST_DEL(thread->pause, con, pause_)
+    con->pause_list= false;
+  }
+
+  if (con->rate_list)
+  {
+    GEARMAN_LIST_DEL(thread->rate, con, rate_)
+    con->rate_list= false;
+  }
+
   if (thread->server->options & GEARMAN_SERVER_PROC_THREAD &&
       !(con->proc_removed) && !(thread->server->proc_shutdown))
   {
@@ -125,6 +208,11 @@ void gearman_server_con_free(gearman_server_con_st *con)
 
   gearman_con_free(&(con->con));
 
+  /* Freeing workers can requeue jobs and wake other workers, so do this
+     before the connection is taken off the I/O list. */
+  for (x= 0; x < thread->server->shard_count; x++)
+    gearman_server_con_free_shard(con, &(thread->server->shard_list[x]));
+
   if (con->proc_list)
     gearman_server_con_proc_remove(con);
 
@@ -138,31 +226,83 @@ void gearman_server_con_free(gearman_server_con_st *con)
     gearman_server_packet_free(con->packet, con->thread, true); 
   }
 
-  while (con->io_packet_list != NULL)
+  while (gearman_server_io_packet_peek(con) != NULL)
     gearman_server_io_packet_remove(con);
 
-  while (con->proc_packet_list != NULL)
+  while ((packet= gearman_server_proc_packet_remove(con)) != NULL)
   {
-    packet= gearman_server_proc_packet_remove(con);
     gearman_packet_free(&(packet->packet));
     gearman_server_packet_free(packet, con->thread, true); 
   }
 
-  gearman_server_con_free_workers(con);
-
-  while (con->client_list != NULL)
-    gearman_server_client_free(con->client_list);
-
   GEARMAN_SERVER_THREAD_LOCK(thread)
   GEARMAN_LIST_DEL(con->thread->con, con,)
   GEARMAN_SERVER_THREAD_UNLOCK(thread)
 
-  if (thread->free_con_count < GEARMAN_MAX_FREE_SERVER_CON)
+  if (con->id != NULL)
+    free(con->id);
+
+  /* Nothing can pause on this connection any more, but it must stay around
+     for any that already did. */
+  if (con->io_paused != NULL)
+  {
+    (void)__sync_sub_and_fetch(&(con->io_paused->io_data_waiters), 1);
+    con->io_paused= NULL;
+  }
+
+  if (thread->free_con_count < GEARMAN_MAX_FREE_SERVER_CON ||
+      con->io_data_waiters > 0)
     GEARMAN_LIST_ADD(thread->free_con, con,)
   else
     free(con);
 }
 
+bool gearman_server_con_quiescent(gearman_server_con_st *con)
+{
+  uint32_t x;
+
+  if (con->options != 0 || con->id != NULL || con->noop_queued ||
+      con->commit_wait || con->budget_list || con->pause_list ||
+      con->rate_list || con->io_paused != NULL || con->io_data_waiters > 0 ||
+      con->io_data_size > 0)
+  {
+    return false;
+  }
+
+  /* Processing threads reply before they let go of a client, so look at the
+     shards first and then for a reply. */
+  for (x= 0; x < con->thread->server->shard_count; x++)
+  {
+    if (con->shard_list[x].worker_count > 0 ||
+        con->shard_list[x].client_count > 0)
+    {
+      return false;
+    }
+  }
+
+  __sync_synchronize();
+
+  if (con->io_list || con->io_packet_list != NULL ||
+      con->io_packet_stack != NULL || con->proc_list ||
+      con->proc_packet_list != NULL || con->proc_packet_stack != NULL)
+  {
+    return false;
+  }
+
+  /* A connection waiting for its next packet already has an empty one to
+     read it into, which is freed with the connection. */
+  if (con->con.recv_state == GEARMAN_CON_RECV_STATE_READ_DATA ||
+      (con->con.recv_state == GEARMAN_CON_RECV_STATE_READ &&
+       con->con.recv_packet->args_size > 0))
+  {
+    return false;
+  }
+
+  return con->con.recv_buffer_size == 0 &&
+         con->con.send_state == GEARMAN_CON_SEND_STATE_NONE &&
+         con->con.send_buffer_size == 0;
+}
+
 gearman_con_st *gearman_server_con_con(gearman_server_con_st *con)
 {
   return &con->con;
@@ -180,6 +320,9 @@ void gearman_server_con_set_data(gearman_server_con_st *con, void *data)
 
 const char *gearman_server_con_host(gearman_server_con_st *con)
 {
+  if (con->thread->con_name_fn != NULL)
+    (*(con->thread->con_name_fn))(con->thread, con);
+
   return con->host;
 }
 
@@ -190,6 +333,9 @@ void gearman_server_con_set_host(gearman_server_con_st *con, const char *host)
 
 const char *gearman_server_con_port(gearman_server_con_st *con)
 {
+  if (con->thread->con_name_fn != NULL)
+    (*(con->thread->con_name_fn))(con->thread, con);
+
   return con->port;
 }
 
@@ -200,138 +346,344 @@ void gearman_server_con_set_port(gearman_server_con_st *con, const char *port)
 
 const char *gearman_server_con_id(gearman_server_con_st *con)
 {
-  return con->id;
+  return con->id == NULL ? "-" : con->id;
 }
 
 void gearman_server_con_set_id(gearman_server_con_st *con, char *id,
                                size_t size)
 {
+  char *con_id= con->id;
+
+  /* Most connections never set an ID, so only allocate space when one does.
+     If this fails the old ID is kept. */
+  if (con_id == NULL)
+  {
+    con_id= malloc(GEARMAN_SERVER_CON_ID_SIZE);
+    if (con_id == NULL)
+      return;
+  }
+
   if (size >= GEARMAN_SERVER_CON_ID_SIZE)
     size= GEARMAN_SERVER_CON_ID_SIZE - 1;
 
-  memcpy(con->id, id, size);
-  con->id[size]= 0;
+  memcpy(con_id, id, size);
+  con_id[size]= 0;
+  con->id= con_id;
+
+  /* Jobs with an affinity key keep going to a worker with the same ID after
+     it reconnects. */
+  con->id_key= gearman_server_hash64(con_id, size);
 }
 
 void gearman_server_con_free_worker(gearman_server_con_st *con,
                                     char *function_name,
                                     size_t function_name_size)
 {
+  gearman_server_function_st *function;
   gearman_server_worker_st *worker;
+  gearman_server_worker_st *worker_next;
+
+  function= gearman_server_function_find(con->thread->server, function_name,
+                                         function_name_size);
+  if (function == NULL)
+    return;
 
-  for (worker= con->worker_list; worker != NULL; worker= worker->con_next)
+  for (worker= con->shard_list[function->shard->id].worker_list;
+       worker != NULL; worker= worker_next)
   {
-    if (worker->function->function_name_size == function_name_size &&
-        !memcmp(worker->function->function_name, function_name,
-                function_name_size))
-    {
+    worker_next= worker->con_next;
+    if (worker->function == function)
       gearman_server_worker_free(worker);
-    }
   }
 }
 
-void gearman_server_con_free_workers(gearman_server_con_st *con)
+void gearman_server_con_free_workers(gearman_server_con_st *con,
+                                     gearman_server_shard_st *shard)
 {
-  while (con->worker_list != NULL)
-    gearman_server_worker_free(con->worker_list);
+  gearman_server_con_shard_st *con_shard= &(con->shard_list[shard->id]);
+
+  while (con_shard->worker_list != NULL)
+    gearman_server_worker_free(con_shard->worker_list);
+}
+
+void gearman_server_con_free_shard(gearman_server_con_st *con,
+                                   gearman_server_shard_st *shard)
+{
+  gearman_server_con_shard_st *con_shard= &(con->shard_list[shard->id]);
+  gearman_server_function_st *function= con_shard->wakeup_function;
+
+  /* If this connection was woken for a function, wake another worker in its
+     place. */
+  if (function != NULL)
+  {
+    con_shard->wakeup_function= NULL;
+    function->wakeup_count--;
+    (void)gearman_server_function_wakeup(function, function->job_count);
+  }
+
+  /* Jobs queued again as the workers go must not be pushed back here. */
+  gearman_server_con_set_slots(con, shard, 0, 0);
+
+  gearman_server_con_free_workers(con, shard);
+
+  while (con_shard->client_list != NULL)
+    gearman_server_client_free(con_shard->client_list);
+}
+
+void gearman_server_con_set_slots(gearman_server_con_st *con,
+                                  gearman_server_shard_st *shard,
+                                  uint32_t slots, uint32_t slots_used)
+{
+  gearman_server_con_shard_st *con_shard= &(con->shard_list[shard->id]);
+
+  if (con_shard->slots > con_shard->slots_used)
+    shard->worker_slots_free-= con_shard->slots - con_shard->slots_used;
+
+  con_shard->slots= slots;
+  con_shard->slots_used= slots_used;
+
+  if (slots > slots_used)
+    shard->worker_slots_free+= slots - slots_used;
+}
+
+gearman_return_t gearman_server_con_push(gearman_server_con_st *con,
+                                         gearman_server_shard_st *shard)
+{
+  gearman_server_con_shard_st *con_shard= &(con->shard_list[shard->id]);
+  gearman_server_worker_st *server_worker;
+  uint32_t slots_used;
+  gearman_return_t ret;
+
+  /* Push one job at a time so the functions take turns filling the slots. */
+  for (server_worker= gearman_server_worker_turn(con_shard);
+       server_worker != NULL && con_shard->slots_used < con_shard->slots;
+       server_worker= gearman_server_worker_turn(con_shard))
+  {
+    slots_used= con_shard->slots_used;
+
+    ret= gearman_server_job_push_one(server_worker);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    /* A worker that was not given a job has jobs it could not be given, so
+       stop rather than try it again. */
+    if (con_shard->slots_used == slots_used)
+      break;
+  }
+
+  return GEARMAN_SUCCESS;
 }
 
 void gearman_server_con_io_add(gearman_server_con_st *con)
 {
-  if (con->io_list)
-    return;
+  gearman_server_con_st *next;
 
-  GEARMAN_SERVER_THREAD_LOCK(con->thread)
+  /* Processing threads may get here at once, only the first one queues it. */
+  if (con->io_list ||
+      !__sync_bool_compare_and_swap(&(con->io_list), false, true))
+  {
+    return;
+  }
 
-  GEARMAN_LIST_ADD(con->thread->io, con, io_)
-  con->io_list= true;
+  GEARMAN_SERVER_QUEUE_PUSH(con->thread->io, con, io_, next)
 
-  /* Looks funny, but need to check io_count locked, but call run unlocked. */
-  if (con->thread->io_count == 1 && con->thread->run_fn)
+  /* Only wake the thread up if nothing else was waiting for it, and it is
+     not reading, since it flushes what was queued once it is done. */
+  if (next == NULL && !(con->thread->io_reading) && con->thread->run_fn)
   {
-    GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+    (*_con_wakeups_sent(con))++;
     (*con->thread->run_fn)(con->thread, con->thread->run_fn_arg);
   }
-  else
-    GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+}
+
+void gearman_server_con_io_drained(gearman_server_con_st *con, size_t size)
+{
+  gearman_server_st *server= con->thread->server;
+  gearman_server_thread_st *thread;
+  size_t low= server->work_data_max / 2;
+  size_t left;
+
+  left= __sync_sub_and_fetch(&(con->io_data_size), size);
+  if (left > low || left + size <= low || con->io_data_waiters == 0)
+    return;
+
+  /* The paused connections could be on any I/O thread, so wake the ones
+     holding some to see if they can start reading again. */
+  for (thread= server->thread_list; thread != NULL; thread= thread->next)
+  {
+    if (thread->pause_count > 0 && thread->run_fn != NULL)
+    {
+      (*_con_wakeups_sent(con))++;
+      (*thread->run_fn)(thread, thread->run_fn_arg);
+    }
+  }
 }
 
 void gearman_server_con_io_remove(gearman_server_con_st *con)
 {
-  GEARMAN_SERVER_THREAD_LOCK(con->thread)
-  if (con->io_list)
+  gearman_server_thread_st *thread= con->thread;
+  gearman_server_con_st **prev;
+  gearman_server_con_st *pushed;
+  gearman_server_con_st *next;
+
+  if (!(con->io_list))
+    return;
+
+  /* This is only called from the I/O thread once no processing thread can
+     queue the connection, so it is somewhere on one of the two ends. */
+  for (prev= &(thread->io_list); *prev != NULL; prev= &((*prev)->io_next))
+  {
+    if (*prev == con)
+    {
+      *prev= con->io_next;
+      con->io_list= false;
+      return;
+    }
+  }
+
+  /* Not taken yet, so move what was pushed over, after what is there. */
+  pushed= __sync_lock_test_and_set(&(thread->io_stack), NULL);
+  for (; pushed != NULL; pushed= next)
   {
-    GEARMAN_LIST_DEL(con->thread->io, con, io_)
-    con->io_list= false;
+    next= pushed->io_next;
+    if (pushed == con)
+      continue;
+
+    pushed->io_next= *prev;
+    *prev= pushed;
   }
-  GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+
+  con->io_list= false;
 }
 
 gearman_server_con_st *
 gearman_server_con_io_next(gearman_server_thread_st *thread)
 {
-  gearman_server_con_st *con= thread->io_list;
+  gearman_server_con_st *con;
+  gearman_server_con_st *next;
 
+  if (thread->io_list == NULL)
+  {
+    GEARMAN_SERVER_QUEUE_TAKE(thread->io, con, next, io_)
+    if (thread->io_list != NULL)
+      thread->io_queue_takes++;
+  }
+
+  con= thread->io_list;
   if (con == NULL)
     return NULL;
 
-  gearman_server_con_io_remove(con);
+  thread->io_list= con->io_next;
+  thread->io_queue_cons++;
+
+  /* Clear the flag before the caller looks for packets, so anything queued
+     after that queues the connection again. */
+  con->io_list= false;
+  __sync_synchronize();
 
   return con;
 }
 
 void gearman_server_con_proc_add(gearman_server_con_st *con)
 {
-  if (con->proc_list)
-    return;
+  gearman_server_packet_st *packet;
+  uint32_t shard;
 
-  GEARMAN_SERVER_THREAD_LOCK(con->thread)
-  GEARMAN_LIST_ADD(con->thread->proc, con, proc_)
-  con->proc_list= true;
-  GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+  /* A connection is only ever run by one shard, so if it is already on a
+     list or being run, that shard will pick up anything new. */
+  __sync_synchronize();
+  if (con->proc_list || con->proc_removed ||
+      !__sync_bool_compare_and_swap(&(con->proc_list), false, true))
+  {
+    return;
+  }
 
-  if (!(con->thread->server->proc_shutdown) &&
-      !(con->thread->server->proc_wakeup))
+  if (con->options & GEARMAN_SERVER_CON_DEAD)
+    shard= con->proc_dead;
+  else
   {
-    (void) pthread_mutex_lock(&(con->thread->server->proc_lock));
-    con->thread->server->proc_wakeup= true;
-    (void) pthread_cond_signal(&(con->thread->server->proc_cond));
-    (void) pthread_mutex_unlock(&(con->thread->server->proc_lock));
+    /* Nothing else is running the connection now, so it's safe to look. */
+    packet= gearman_server_proc_packet_peek(con);
+    if (packet == NULL || packet->shard == GEARMAN_SERVER_SHARD_ANY)
+      shard= 0;
+    else
+      shard= packet->shard;
   }
+
+  gearman_server_con_proc_queue(con, &(con->thread->server->shard_list[shard]));
 }
 
-void gearman_server_con_proc_remove(gearman_server_con_st *con)
+void gearman_server_con_proc_queue(gearman_server_con_st *con,
+                                   gearman_server_shard_st *shard)
 {
-  GEARMAN_SERVER_THREAD_LOCK(con->thread)
-  if (con->proc_list)
+  gearman_server_con_st *next;
+
+  GEARMAN_SERVER_QUEUE_PUSH(shard->proc, con, proc_, next)
+
+  /* The processing thread takes everything queued each time it looks, so it
+     only needs a signal when the queue was empty and it has gone to sleep.
+     The push above is a full barrier, so either the thread sees this
+     connection before it sleeps or we see it sleeping. */
+  if (next != NULL || !(shard->proc_sleeping))
+    return;
+
+  GEARMAN_SERVER_LOCK(shard->server, &(shard->proc_lock),
+                      &(shard->proc_lock_stats))
+
+  if (!(shard->proc_wakeup))
   {
-    GEARMAN_LIST_DEL(con->thread->proc, con, proc_)
-    con->proc_list= false;
+    shard->proc_wakeup= true;
+    (*_con_wakeups_sent(con))++;
+    (void) pthread_cond_signal(&(shard->proc_cond));
   }
-  GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+
+  GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                        &(shard->proc_lock_stats))
+}
+
+void gearman_server_con_proc_remove(gearman_server_con_st *con)
+{
+  con->proc_list= false;
 }
 
 gearman_server_con_st *
-gearman_server_con_proc_next(gearman_server_thread_st *thread)
+gearman_server_con_proc_next(gearman_server_shard_st *shard)
 {
   gearman_server_con_st *con;
+  gearman_server_con_st *next;
 
-  if (thread->proc_list == NULL)
-    return NULL;
-
-  GEARMAN_SERVER_THREAD_LOCK(thread)
-
-  con= thread->proc_list;
-  while (con != NULL)
+  if (shard->proc_list == NULL)
   {
-    GEARMAN_LIST_DEL(thread->proc, con, proc_)
-    con->proc_list= false;
-    if (!(con->proc_removed))
-      break;
-    con= thread->proc_list;
+    GEARMAN_SERVER_QUEUE_TAKE(shard->proc, con, next, proc_)
+    if (shard->proc_list != NULL)
+      shard->proc_queue_takes++;
   }
 
-  GEARMAN_SERVER_THREAD_UNLOCK(thread)
+  con= shard->proc_list;
+  if (con != NULL)
+  {
+    shard->proc_list= con->proc_next;
+    shard->proc_queue_cons++;
+  }
 
   return con;
 }
+
+/*
+ * Private definitions
+ */
+
+static uint64_t *_con_wakeups_sent(gearman_server_con_st *con)
+{
+  gearman_server_st *server= con->thread->server;
+  gearman_server_shard_st *shard;
+
+  if (server->options & GEARMAN_SERVER_PROC_THREAD)
+  {
+    shard= pthread_getspecific(server->proc_key);
+    if (shard != NULL)
+      return &(shard->wakeups_sent);
+  }
+
+  return &(con->thread->wakeups_sent);
+}
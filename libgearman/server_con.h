@@ -32,12 +32,17 @@ extern "C" {
  * @param thread Thread structure previously initialized with
  *        gearman_server_thread_create.
  * @param fd File descriptor for a newly accepted connection.
+ * @param options Options to set on the connection before it takes the file
+ *        descriptor, such as GEARMAN_CON_NONBLOCK if the descriptor is
+ *        already non-blocking.
  * @param data Application data pointer.
  * @return Gearman server connection pointer.
  */
 GEARMAN_API
 gearman_server_con_st *gearman_server_con_add(gearman_server_thread_st *thread,
-                                              int fd, void *data);
+                                              int fd,
+                                              gearman_con_options_t options,
+                                              void *data);
 
 /**
  * Initialize a server connection structure.
@@ -52,6 +57,19 @@ gearman_server_con_create(gearman_server_thread_st *thread);
 GEARMAN_API
 void gearman_server_con_free(gearman_server_con_st *con);
 
+/**
+ * See if a connection could be closed and taken over by another connection
+ * on the same socket without anything being lost. It must have no partly
+ * read or sent packets, no packets waiting on either side, no workers or
+ * waiting clients in any shard, and no options or ID set. Nothing but its
+ * own packets can change this, so once it is true it stays true until the
+ * I/O thread that owns the connection reads from it again.
+ * @param con Connection to check, from its own I/O thread.
+ * @return Whether the connection is quiescent.
+ */
+GEARMAN_API
+bool gearman_server_con_quiescent(gearman_server_con_st *con);
+
 /**
  * Get gearman connection pointer the server connection uses.
  */
@@ -71,7 +89,8 @@ GEARMAN_API
 void gearman_server_con_set_data(gearman_server_con_st *con, void *data);
 
 /**
- * Get client host.
+ * Get client host. If the thread has a naming callback, see
+ * gearman_server_thread_set_con_name, it is called first.
  */
 GEARMAN_API
 const char *gearman_server_con_host(gearman_server_con_st *con);
@@ -116,19 +135,56 @@ void gearman_server_con_free_worker(gearman_server_con_st *con,
                                     size_t function_name_size);
 
 /**
- * Free all server worker structures for a server connection.
+ * Free all server worker structures for a server connection in a shard.
+ */
+GEARMAN_API
+void gearman_server_con_free_workers(gearman_server_con_st *con,
+                                     gearman_server_shard_st *shard);
+
+/**
+ * Free all worker and client state a server connection has in a shard, waking
+ * another worker for any function this connection was woken for.
+ */
+GEARMAN_API
+void gearman_server_con_free_shard(gearman_server_con_st *con,
+                                   gearman_server_shard_st *shard);
+
+/**
+ * Set how many jobs a worker connection takes pushed to it in a shard, and how
+ * many of those it is running, keeping the count of free slots in the shard
+ * up to date.
  */
 GEARMAN_API
-void gearman_server_con_free_workers(gearman_server_con_st *con);
+void gearman_server_con_set_slots(gearman_server_con_st *con,
+                                  gearman_server_shard_st *shard,
+                                  uint32_t slots, uint32_t slots_used);
 
 /**
- * Add connection to the io thread list.
+ * Push queued jobs in a shard to a worker connection while it has free
+ * slots.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_con_push(gearman_server_con_st *con,
+                                         gearman_server_shard_st *shard);
+
+/**
+ * Add connection to the io thread list. This is safe to call from any
+ * thread, the connection is pushed onto a lock-free queue.
  */
 GEARMAN_API
 void gearman_server_con_io_add(gearman_server_con_st *con);
 
 /**
- * Remove connection from the io thread list.
+ * Take sent work data off the count of what is waiting for a connection. Once
+ * it is down to half the limit, I/O threads with connections paused on it
+ * are woken to start reading them again.
+ */
+GEARMAN_API
+void gearman_server_con_io_drained(gearman_server_con_st *con, size_t size);
+
+/**
+ * Remove connection from the io thread list. This must only be called from
+ * the I/O thread once no other thread can add the connection.
  */
 GEARMAN_API
 void gearman_server_con_io_remove(gearman_server_con_st *con);
@@ -141,23 +197,32 @@ gearman_server_con_st *
 gearman_server_con_io_next(gearman_server_thread_st *thread);
 
 /**
- * Add connection to the proc thread list.
+ * Schedule a connection to be run by a processing thread, if it is not
+ * already. The connection goes to the shard its next packet is routed to.
  */
 GEARMAN_API
 void gearman_server_con_proc_add(gearman_server_con_st *con);
 
 /**
- * Remove connection from the proc thread list.
+ * Add a scheduled connection to the list of a shard processing thread. This
+ * is also used to hand a connection from one shard to another.
+ */
+GEARMAN_API
+void gearman_server_con_proc_queue(gearman_server_con_st *con,
+                                   gearman_server_shard_st *shard);
+
+/**
+ * Mark a connection as no longer scheduled to be run.
  */
 GEARMAN_API
 void gearman_server_con_proc_remove(gearman_server_con_st *con);
 
 /**
- * Get next connection from the proc thread list.
+ * Get next connection from the list of a shard processing thread.
  */
 GEARMAN_API
 gearman_server_con_st *
-gearman_server_con_proc_next(gearman_server_thread_st *thread);
+gearman_server_con_proc_next(gearman_server_shard_st *shard);
 
 /** @} */
 
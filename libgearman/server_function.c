@@ -13,6 +13,32 @@
 
 #include "common.h"
 
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_function_private Private Server Function Functions
+ * @ingroup gearman_server_function
+ * @{
+ */
+
+/**
+ * Rebuild the function hash with a new number of buckets. Functions are only
+ * added when a new name is seen, so this does not need to be incremental.
+ */
+static gearman_return_t
+_server_function_hash_resize(gearman_server_shard_st *shard, uint32_t size);
+
+/**
+ * Get the latency histograms for a function, allocating them the first time
+ * a value is recorded so idle functions do not pay for them.
+ */
+static gearman_server_latency_st *
+_server_function_latency(gearman_server_function_st *function);
+
+/** @} */
+
 /*
  * Public definitions
  */
@@ -22,19 +48,27 @@ gearman_server_function_get(gearman_server_st *server,
                             const char *function_name,
                             size_t function_name_size)
 {
+  gearman_server_shard_st *shard;
   gearman_server_function_st *function;
+  uint32_t key;
 
-  for (function= server->function_list; function != NULL;
-       function= function->next)
+  function= gearman_server_function_find(server, function_name,
+                                         function_name_size);
+  if (function != NULL)
+    return function;
+
+  shard= gearman_server_shard_function(server, function_name,
+                                       function_name_size);
+
+  if (shard->function_count >= shard->function_hash_size &&
+      shard->function_hash_size < (UINT32_MAX >> 1))
   {
-    if (function->function_name_size == function_name_size &&
-        !memcmp(function->function_name, function_name, function_name_size))
-    {
-      return function;
-    }
+    /* If this fails we keep using the old table, just with longer chains. */
+    (void)_server_function_hash_resize(shard,
+                                       (shard->function_hash_size << 1) + 1);
   }
 
-  function= gearman_server_function_create(server, NULL);
+  function= gearman_server_function_create(shard, NULL);
   if (function == NULL)
     return NULL;
 
@@ -49,11 +83,45 @@ gearman_server_function_get(gearman_server_st *server,
   function->function_name[function_name_size]= 0;
   function->function_name_size= function_name_size;
 
+  function->function_key= gearman_server_hash(function_name,
+                                              function_name_size);
+  key= function->function_key % shard->function_hash_size;
+  GEARMAN_BUCKET_ADD(shard->function_hash[key], function, hash_)
+
   return function;
 }
 
 gearman_server_function_st *
-gearman_server_function_create(gearman_server_st *server,
+gearman_server_function_find(gearman_server_st *server,
+                             const char *function_name,
+                             size_t function_name_size)
+{
+  gearman_server_shard_st *shard;
+  gearman_server_function_st *function;
+  uint32_t key;
+
+  key= gearman_server_hash(function_name, function_name_size);
+  if (server->shard_count == 1)
+    shard= server->shard_list;
+  else
+    shard= &(server->shard_list[key % server->shard_count]);
+
+  for (function= shard->function_hash[key % shard->function_hash_size];
+       function != NULL; function= function->hash_next)
+  {
+    if (function->function_key == key &&
+        function->function_name_size == function_name_size &&
+        !memcmp(function->function_name, function_name, function_name_size))
+    {
+      return function;
+    }
+  }
+
+  return NULL;
+}
+
+gearman_server_function_st *
+gearman_server_function_create(gearman_server_shard_st *shard,
                                gearman_server_function_st *function)
 {
   if (function == NULL)
@@ -72,26 +140,208 @@ gearman_server_function_create(gearman_server_st *server,
   function->job_total= 0;
   function->job_running= 0;
   function->max_queue_size= GEARMAN_DEFAULT_MAX_QUEUE_SIZE;
+  function->queue_bytes= 0;
+  function->max_queue_bytes= 0;
+  function->function_key= 0;
+  function->wakeup_count= 0;
+  function->weight= GEARMAN_DEFAULT_FUNCTION_WEIGHT;
+  function->job_scheduled= 0;
+  function->level_map= 0;
+  function->timeout_count= 0;
   function->function_name_size= 0;
-  function->server= server;
-  GEARMAN_LIST_ADD(server->function, function,)
+  gearman_server_cache_init(&(function->cache));
+  function->latency= NULL;
+  function->shard= shard;
+  GEARMAN_LIST_ADD(shard->function, function,)
+  function->hash_next= NULL;
+  function->hash_prev= NULL;
   function->function_name= NULL;
   function->worker_list= NULL;
-  memset(function->job_list, 0,
-         sizeof(gearman_server_job_st *) * GEARMAN_JOB_PRIORITY_MAX);
-  memset(function->job_end, 0,
-         sizeof(gearman_server_job_st *) * GEARMAN_JOB_PRIORITY_MAX);
+  function->wakeup_worker= NULL;
+  memset(function->job_list, 0, sizeof(function->job_list));
+  memset(function->job_end, 0, sizeof(function->job_end));
 
   return function;
 }
 
 void gearman_server_function_free(gearman_server_function_st *function)
 {
+  gearman_server_shard_st *shard= function->shard;
+  uint32_t key;
+
   if (function->function_name != NULL)
+  {
+    /* Functions only get a name once they are added to the hash. */
+    key= function->function_key % shard->function_hash_size;
+    GEARMAN_BUCKET_DEL(shard->function_hash[key], function, hash_)
     free(function->function_name);
+  }
 
-  GEARMAN_LIST_DEL(function->server->function, function,)
+  gearman_server_cache_free(&(function->cache));
+  if (function->latency != NULL)
+    free(function->latency);
+  GEARMAN_LIST_DEL(shard->function, function,)
 
   if (function->options & GEARMAN_SERVER_FUNCTION_ALLOCATED)
     free(function);
 }
+
+gearman_return_t
+gearman_server_function_wakeup(gearman_server_function_st *function,
+                               uint32_t job_count)
+{
+  gearman_server_worker_st *start;
+  gearman_server_worker_st *worker;
+  gearman_server_worker_st *next;
+  gearman_server_con_st *con;
+  gearman_server_con_shard_st *con_shard;
+  gearman_return_t ret;
+  uint32_t wakeup;
+
+  if (job_count == 0)
+    return GEARMAN_SUCCESS;
+
+  wakeup= job_count + function->shard->server->worker_wakeup;
+  if (function->wakeup_count >= wakeup)
+    return GEARMAN_SUCCESS;
+
+  start= function->wakeup_worker;
+  if (start == NULL)
+    start= function->worker_list;
+
+  worker= start;
+  while (worker != NULL)
+  {
+    next= worker->function_next;
+    if (next == NULL)
+      next= function->worker_list;
+
+    con= worker->con;
+    con_shard= &(con->shard_list[function->shard->id]);
+    if (con_shard->options & GEARMAN_SERVER_CON_SLEEPING &&
+        !(con->noop_queued))
+    {
+      /* Mark the NOOP queued before adding it, since the I/O thread may send
+         it and clear the flag before the add returns. */
+      con->noop_queued= true;
+      ret= gearman_server_io_response_add(con, GEARMAN_COMMAND_NOOP, 0, NULL,
+                                          NULL);
+      if (ret != GEARMAN_SUCCESS)
+      {
+        con->noop_queued= false;
+        function->wakeup_worker= worker;
+        return ret;
+      }
+
+      /* The connection is no longer a sleeper until it sends PRE_SLEEP
+         again, so later jobs will not wake it a second time. */
+      con_shard->options&=
+                     (gearman_server_con_options_t)~GEARMAN_SERVER_CON_SLEEPING;
+      con_shard->wakeup_function= function;
+      function->wakeup_count++;
+
+      if (function->wakeup_count >= wakeup)
+      {
+        function->wakeup_worker= next;
+        return GEARMAN_SUCCESS;
+      }
+    }
+
+    worker= next;
+    if (worker == start)
+      break;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_server_function_wait_add(gearman_server_function_st *function,
+                                      uint64_t usec)
+{
+  gearman_server_latency_st *latency= _server_function_latency(function);
+
+  if (latency != NULL)
+    gearman_histogram_add(&(latency->wait), usec);
+}
+
+void gearman_server_function_run_add(gearman_server_function_st *function,
+                                     uint64_t usec)
+{
+  gearman_server_latency_st *latency= _server_function_latency(function);
+
+  if (latency != NULL)
+    gearman_histogram_add(&(latency->run), usec);
+}
+
+uint64_t
+gearman_server_function_oldest(const gearman_server_function_st *function,
+                               uint64_t now)
+{
+  uint64_t oldest= 0;
+  uint32_t level;
+
+  for (level= 0; level < GEARMAN_SERVER_PRIORITY_LEVELS_MAX; level++)
+  {
+    if (function->job_list[level] == NULL ||
+        function->job_list[level]->created_time == 0 ||
+        function->job_list[level]->created_time > now)
+    {
+      continue;
+    }
+
+    if (now - function->job_list[level]->created_time > oldest)
+      oldest= now - function->job_list[level]->created_time;
+  }
+
+  return oldest;
+}
+
+/*
+ * Private definitions
+ */
+
+static gearman_return_t
+_server_function_hash_resize(gearman_server_shard_st *shard, uint32_t size)
+{
+  gearman_server_function_st **function_hash;
+  gearman_server_function_st *function;
+  uint32_t key;
+
+  function_hash= calloc(size, sizeof(gearman_server_function_st *));
+  if (function_hash == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  for (function= shard->function_list; function != NULL;
+       function= function->next)
+  {
+    if (function->function_name == NULL)
+      continue;
+
+    key= function->function_key % size;
+    GEARMAN_BUCKET_ADD(function_hash[key], function, hash_)
+  }
+
+  if (shard->function_hash != NULL)
+    free(shard->function_hash);
+
+  shard->function_hash= function_hash;
+  shard->function_hash_size= size;
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_server_latency_st *
+_server_function_latency(gearman_server_function_st *function)
+{
+  if (function->latency == NULL)
+  {
+    function->latency= malloc(sizeof(gearman_server_latency_st));
+    if (function->latency == NULL)
+      return NULL;
+
+    gearman_histogram_init(&(function->latency->wait));
+    gearman_histogram_init(&(function->latency->run));
+  }
+
+  return function->latency;
+}
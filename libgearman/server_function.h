@@ -36,11 +36,21 @@ gearman_server_function_get(gearman_server_st *server,
                             size_t function_name_size);
 
 /**
- * Initialize a server function structure.
+ * Find an existing function in a server instance. Unlike
+ * gearman_server_function_get, this will not add a new function.
  */
 GEARMAN_API
 gearman_server_function_st *
-gearman_server_function_create(gearman_server_st *server,
+gearman_server_function_find(gearman_server_st *server,
+                             const char *function_name,
+                             size_t function_name_size);
+
+/**
+ * Initialize a server function structure in a shard.
+ */
+GEARMAN_API
+gearman_server_function_st *
+gearman_server_function_create(gearman_server_shard_st *shard,
                                gearman_server_function_st *function);
 
 /**
@@ -49,6 +59,54 @@ gearman_server_function_create(gearman_server_st *server,
 GEARMAN_API
 void gearman_server_function_free(gearman_server_function_st *function);
 
+/**
+ * Queue NOOP packets to wake sleeping workers for a function. Only enough
+ * workers are woken to cover the given number of jobs plus the server wakeup
+ * overshoot, counting workers already woken and not yet back for a job. Each
+ * call starts where the last one left off so the same workers are not always
+ * picked first.
+ * @param function Function to wake workers for.
+ * @param job_count Number of jobs the workers are needed for.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t
+gearman_server_function_wakeup(gearman_server_function_st *function,
+                               uint32_t job_count);
+
+/**
+ * Record how long a job waited in the queue before it was first handed to a
+ * worker. The histograms are allocated on first use; if that fails the value
+ * is dropped.
+ * @param function Function the job was queued under.
+ * @param usec Wait time in microseconds.
+ */
+GEARMAN_API
+void gearman_server_function_wait_add(gearman_server_function_st *function,
+                                      uint64_t usec);
+
+/**
+ * Record how long a worker took to complete or fail a job.
+ * @param function Function the job ran under.
+ * @param usec Run time in microseconds, from assignment to the final result.
+ */
+GEARMAN_API
+void gearman_server_function_run_add(gearman_server_function_st *function,
+                                     uint64_t usec);
+
+/**
+ * Get the age of the oldest job waiting to run for a function. Only the job
+ * at the front of each priority level is looked at, so a job that was
+ * requeued behind newer ones is not counted until it reaches the front.
+ * @param function Function to look at.
+ * @param now Current time from gearman_time_now().
+ * @return Age in microseconds, or 0 if nothing is queued.
+ */
+GEARMAN_API
+uint64_t
+gearman_server_function_oldest(const gearman_server_function_st *function,
+                               uint64_t now);
+
 /** @} */
 
 #ifdef __cplusplus
@@ -13,6 +13,11 @@
 
 #include "common.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define _SERVER_HASH64_SSE42
+#include <nmmintrin.h>
+#endif
+
 /*
  * Private declarations
  */
@@ -24,19 +29,209 @@
  */
 
 /**
- * Generate hash key for job handles and unique IDs.
+ * Find the bucket a key lives in, which is in the old table if that bucket
+ * has not been rehashed yet.
+ */
+static inline gearman_server_job_st **
+_server_job_bucket(gearman_server_shard_st *shard, gearman_server_job_st **hash,
+                   gearman_server_job_st **hash_old, uint64_t key);
+
+/**
+ * Move up to count buckets from the old hash tables into the new ones.
+ */
+static void _server_job_rehash(gearman_server_shard_st *shard, uint32_t count);
+
+/**
+ * Put all workers for a function on their connection ready lists, called when
+ * the first job for the function is queued. Workers with held jobs stay on
+ * them either way.
+ */
+static void _server_job_function_ready(gearman_server_function_st *function);
+
+/**
+ * Take all workers for a function off their connection ready lists, called
+ * when the last queued job for the function is taken.
+ */
+static void _server_job_function_idle(gearman_server_function_st *function);
+
+/**
+ * Move jobs that have waited the priority age at the front of their level to
+ * the back of the level above. Jobs join a level in the order they got there,
+ * so only the front of each level has to be looked at.
+ */
+static void _server_job_function_age(gearman_server_function_st *function);
+
+/**
+ * Get the job a worker should be given next, either the oldest job held for
+ * it or the first job on the highest priority level with jobs, whichever has
+ * the higher priority.
+ */
+static gearman_server_job_st *
+_server_job_next(gearman_server_worker_st *server_worker);
+
+/**
+ * Pick the worker for a function an affinity key prefers, by hashing the key
+ * with each worker's connection and taking the highest. Adding or removing a
+ * worker only moves the keys that pick that worker.
+ */
+static gearman_server_worker_st *
+_server_job_affinity_worker(gearman_server_function_st *function,
+                            uint64_t affinity_key);
+
+/**
+ * Hold a job for the worker its affinity key prefers until the affinity wait
+ * is over, and give it to that worker if it has a free slot or wake it up.
+ */
+static gearman_return_t _server_job_hold(gearman_server_job_st *server_job,
+                                         gearman_server_worker_st *worker);
+
+/**
+ * Take a held job off the list of the worker it is held for.
+ */
+static void _server_job_unhold(gearman_server_job_st *server_job);
+
+/**
+ * Put a job on the queue of its function for any worker to take.
+ */
+static gearman_return_t
+_server_job_queue_any(gearman_server_job_st *server_job);
+
+/**
+ * Take a queued job off the level list of its function, wherever it is on
+ * it. The caller updates the function's job count.
+ */
+static void _server_job_unlink(gearman_server_job_st *server_job);
+
+/**
+ * Give back the worker slot a pushed job was using.
+ */
+static void _server_job_slot_release(gearman_server_job_st *server_job);
+
+/**
+ * Push queued jobs for a function to its workers that have free slots.
+ */
+static gearman_return_t
+_server_job_function_push(gearman_server_function_st *function);
+
+/**
+ * See if a job not given to a worker yet is one a purge should drop.
+ */
+static bool _server_job_purge_match(gearman_server_job_st *server_job,
+                                    const char *prefix, size_t prefix_size,
+                                    gearman_job_priority_t priority,
+                                    bool cancel);
+
+/**
+ * Drop the first jobs on a purge list from the persistent queue, in one
+ * batch for as many of them as fit, fail them for any clients waiting on
+ * them, and free them.
+ * @return First job on the list that is left.
+ */
+static gearman_server_job_st *
+_server_job_purge_batch(gearman_server_job_st *purge_list);
+
+/**
+ * Make sure there is a free job slot, growing the slot table if needed.
+ */
+static gearman_return_t
+_server_job_slot_reserve(gearman_server_shard_st *shard);
+
+/**
+ * Assign a reserved job slot to a job and make its job handle number from it.
+ */
+static void _server_job_slot_add(gearman_server_shard_st *shard,
+                                 gearman_server_job_st *server_job);
+
+/**
+ * Get a job from its slot, which is the low half of its job handle number.
+ */
+static gearman_server_job_st *
+_server_job_slot_get(gearman_server_shard_st *shard, uint64_t id);
+
+/**
+ * Decode the number at the end of a job handle, checking the rest is the
+ * prefix of the shard.
+ */
+static bool _server_job_handle_id(gearman_server_shard_st *shard,
+                                  const char *job_handle, uint64_t *id);
+
+/**
+ * Take a job out of a job handle hash bucket. Buckets only link forward, and
+ * the tables grow with the jobs, so the walk is short.
+ */
+static inline void _server_job_hash_del(gearman_server_job_st **bucket,
+                                        gearman_server_job_st *server_job);
+
+/**
+ * Take a job out of a unique key hash bucket.
  */
-static uint32_t _server_job_hash(const char *key, size_t key_size);
+static inline void _server_job_unique_del(gearman_server_job_st **bucket,
+                                          gearman_server_job_st *server_job);
 
 /**
  * Get a server job structure from the unique ID. If data_size is non-zero,
  * then unique points to the workload data and not a real unique key.
  */
 static gearman_server_job_st *
-_server_job_get_unique(gearman_server_st *server, uint32_t unique_key,
+_server_job_get_unique(gearman_server_shard_st *shard, uint64_t unique_key,
                        gearman_server_function_st *server_function,
                        const char *unique, size_t data_size);
 
+/**
+ * Primes used to mix words into the 64-bit hash.
+ */
+#define _SERVER_HASH64_PRIME1 0x9E3779B185EBCA87ULL
+#define _SERVER_HASH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+/**
+ * Rotate a 64-bit value left.
+ */
+#define _SERVER_HASH64_ROTATE(__value, __bits) \
+  (((__value) << (__bits)) | ((__value) >> (64 - (__bits))))
+
+/**
+ * Mix one word into a hash lane.
+ */
+#define _SERVER_HASH64_ROUND(__lane, __word) { \
+  __lane+= (__word) * _SERVER_HASH64_PRIME2; \
+  __lane= _SERVER_HASH64_ROTATE(__lane, 31); \
+  __lane*= _SERVER_HASH64_PRIME1; }
+
+/**
+ * Hash function type, used to pick an implementation for the CPU at runtime.
+ */
+typedef uint64_t (_server_hash64_fn)(const char *key, size_t key_size);
+
+/**
+ * Implementation picked on the first call to gearman_server_hash64.
+ */
+static _server_hash64_fn *_server_hash64= NULL;
+
+/**
+ * Read eight unaligned bytes.
+ */
+static inline uint64_t _server_hash64_load(const char *ptr);
+
+/**
+ * Spread the bits of a hash value so every bucket count works well.
+ */
+static inline uint64_t _server_hash64_final(uint64_t value);
+
+/**
+ * Hash a key eight bytes at a time in four independent lanes, so the
+ * multiplies for one lane overlap with the others.
+ */
+static uint64_t _server_hash64_generic(const char *key, size_t key_size);
+
+#ifdef _SERVER_HASH64_SSE42
+/**
+ * Hash a key with the SSE4.2 CRC32 instruction, running three lanes to cover
+ * the latency of each instruction.
+ */
+static uint64_t _server_hash64_sse42(const char *key, size_t key_size)
+  __attribute__ ((target ("sse4.2")));
+#endif
+
 /** @} */
 
 /*
@@ -47,13 +242,18 @@ gearman_server_job_st *
 gearman_server_job_add(gearman_server_st *server, const char *function_name,
                        size_t function_name_size, const char *unique,
                        size_t unique_size, const void *data, size_t data_size,
-                       gearman_job_priority_t priority,
+                       gearman_job_priority_t priority, int64_t when,
                        gearman_server_client_st *server_client,
                        gearman_return_t *ret_ptr)
 {
+  gearman_server_shard_st *shard;
   gearman_server_job_st *server_job;
   gearman_server_function_st *server_function;
-  uint32_t key;
+  uint64_t key;
+  gearman_server_job_st **bucket;
+  gearman_queue_record_st *record= NULL;
+  const char *affinity;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
 
   server_function= gearman_server_function_get(server, function_name,
                                                function_name_size);
@@ -63,7 +263,15 @@ gearman_server_job_add(gearman_server_st *server, const char *function_name,
     return NULL;
   }
 
-  if (unique_size == 0)
+  /* Jobs live in the same shard as their function. */
+  shard= server_function->shard;
+
+  if (shard->job_hash_old != NULL)
+    _server_job_rehash(shard, GEARMAN_JOB_HASH_REHASH_STEP);
+
+  /* Chained jobs end with a different result than the function alone would
+     give, so they are never merged with other jobs. */
+  if (unique_size == 0 || shard->job_chain != NULL)
   {
     server_job= NULL;
     key= 0;
@@ -80,16 +288,16 @@ gearman_server_job_add(gearman_server_st *server, const char *function_name,
       else
       {
         /* Look up job via unique data when unique = '-'. */
-        key= _server_job_hash(data, data_size);
-        server_job= _server_job_get_unique(server, key, server_function, data,
+        key= gearman_server_hash64(data, data_size);
+        server_job= _server_job_get_unique(shard, key, server_function, data,
                                            data_size);
       }
     }
     else
     {
       /* Look up job via unique ID first to make sure it's not a duplicate. */
-      key= _server_job_hash(unique, unique_size);
-      server_job= _server_job_get_unique(server, key, server_function, unique,
+      key= gearman_server_hash64(unique, unique_size);
+      server_job= _server_job_get_unique(shard, key, server_function, unique,
                                          0);
     }
   }
@@ -103,47 +311,160 @@ gearman_server_job_add(gearman_server_st *server, const char *function_name,
       return NULL;
     }
 
-    server_job= gearman_server_job_create(server, NULL);
+    /* Jobs coming back from the queue were already accepted once, so they
+       are let in whatever they add up to. */
+    if (!(server->options & GEARMAN_SERVER_QUEUE_REPLAY) &&
+        !(shard->queue_replay) &&
+        ((server_function->max_queue_bytes > 0 &&
+          server_function->queue_bytes + data_size >
+          server_function->max_queue_bytes) ||
+         (server->queue_bytes_max > 0 &&
+          server->queue_bytes + data_size > server->queue_bytes_max)))
+    {
+      *ret_ptr= GEARMAN_JOB_QUEUE_FULL;
+      return NULL;
+    }
+
+    if (shard->server->options & GEARMAN_SERVER_JOB_HANDLE_INDEX)
+    {
+      *ret_ptr= _server_job_slot_reserve(shard);
+      if (*ret_ptr != GEARMAN_SUCCESS)
+        return NULL;
+    }
+
+    server_job= gearman_server_job_create(shard, unique, unique_size);
     if (server_job == NULL)
     {
       *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
       return NULL;
     }
 
-    server_job->priority= priority;
+    server_job->priority= (uint8_t)priority;
+    server_job->when= when;
+    server_job->created_time= gearman_time_now();
 
     server_job->function= server_function;
     server_function->job_total++;
 
-    snprintf(server_job->job_handle, GEARMAN_JOB_HANDLE_SIZE, "%s:%u",
-             server->job_handle_prefix, server->job_handle_count);
-    snprintf(server_job->unique, GEARMAN_UNIQUE_SIZE, "%.*s",
-             (uint32_t)unique_size, unique);
-    server->job_handle_count++;
+    if (shard->server->options & GEARMAN_SERVER_JOB_HANDLE_INDEX)
+      _server_job_slot_add(shard, server_job);
+    else
+    {
+      server_job->id= shard->job_handle_count;
+      shard->job_handle_count++;
+    }
+    affinity= memchr(server_job->unique, GEARMAN_AFFINITY_SEPARATOR,
+                     server_job->unique_size);
+    if (affinity != NULL && affinity != server_job->unique)
+    {
+      server_job->affinity_key=
+                gearman_server_hash64(server_job->unique,
+                                      (size_t)(affinity - server_job->unique));
+    }
     server_job->data= data;
     server_job->data_size= data_size;
+    server_function->queue_bytes+= data_size;
+    if (server->queue_bytes_max > 0)
+      (void)__sync_add_and_fetch(&(server->queue_bytes), data_size);
 
     server_job->unique_key= key;
-    key= key % GEARMAN_JOB_HASH_SIZE;
-    GEARMAN_HASH_ADD(server->unique, key, server_job, unique_)
+    bucket= _server_job_bucket(shard, shard->unique_hash,
+                               shard->unique_hash_old, key);
+    server_job->unique_next= *bucket;
+    *bucket= server_job;
+    shard->unique_count++;
+
+    /* Indexed job handles are found through their slot, not the hash. The
+       handle numbers count up, so they spread over the buckets as they are. */
+    if (!(shard->server->options & GEARMAN_SERVER_JOB_HANDLE_INDEX))
+    {
+      bucket= _server_job_bucket(shard, shard->job_hash,
+                                 shard->job_hash_old, server_job->id);
+      server_job->next= *bucket;
+      *bucket= server_job;
+    }
+    shard->job_count++;
+
+    /* Start growing the tables once the average chain passes one job. */
+    if (shard->job_hash_old == NULL && shard->job_count > shard->hash_size &&
+        shard->hash_size < (UINT32_MAX >> 1))
+    {
+      (void)gearman_server_job_hash_resize(shard, (shard->hash_size << 1) + 1);
+    }
+
+    /* Peers hear about the job first, so if storing it fails below, freeing
+       it tells them it is gone. */
+    if (server_client == NULL && gearman_server_replica_enabled(server))
+    {
+      *ret_ptr= gearman_server_replica_add(server, server_job, function_name,
+                                           function_name_size, unique,
+                                           unique_size, data, data_size);
+      if (*ret_ptr != GEARMAN_SUCCESS)
+      {
+        server_job->data= NULL;
+        gearman_server_job_free(server_job);
+        return NULL;
+      }
+    }
+
+    if (server->options & GEARMAN_SERVER_QUEUE_REPLAY || shard->queue_replay)
+      server_job->options|= GEARMAN_SERVER_JOB_QUEUED;
+    else if (server_client == NULL && gearman_server_persist_enabled(server))
+    {
+      *ret_ptr= gearman_server_persist_add(server, server_job->unique,
+                                           server_job->unique_size,
+                                           function_name,
+                                           function_name_size, data, data_size,
+                                           priority, when);
+      if (*ret_ptr != GEARMAN_SUCCESS)
+      {
+        server_job->data= NULL;
+        gearman_server_job_free(server_job);
+        return NULL;
+      }
 
-    key= _server_job_hash(server_job->job_handle,
-                          strlen(server_job->job_handle));
-    server_job->job_handle_key= key;
-    key= key % GEARMAN_JOB_HASH_SIZE;
-    GEARMAN_HASH_ADD(server->job, key, server_job,)
+      server_job->options|= GEARMAN_SERVER_JOB_QUEUED;
+    }
+    else if (server_client == NULL && shard->queue_record != NULL)
+    {
+      /* The batch stores its jobs together once they are all in. */
+      record= &(shard->queue_record[shard->queue_record_count]);
+      record->priority= priority;
+      record->when= when;
+      record->unique= server_job->unique;
+      record->unique_size= server_job->unique_size;
+      record->function_name= server_function->function_name;
+      record->function_name_size= server_function->function_name_size;
+      record->data= data;
+      record->data_size= data_size;
+      shard->queue_record_job[shard->queue_record_count]= server_job;
+      shard->queue_record_count++;
 
-    if (server->options & GEARMAN_SERVER_QUEUE_REPLAY)
       server_job->options|= GEARMAN_SERVER_JOB_QUEUED;
+    }
     else if (server_client == NULL && server->gearman->queue_add_fn != NULL)
     {
+      GEARMAN_SERVER_QUEUE_LOCK(server)
+      GEARMAND_QUEUE_ADD_START(server_job->unique,
+                               server_function->function_name, data_size);
       *ret_ptr= (*(server->gearman->queue_add_fn))(server->gearman,
                                           (void *)server->gearman->queue_fn_arg,
                                           server_job->unique,
-                                          unique_size,
+                                          server_job->unique_size,
                                           function_name,
                                           function_name_size,
-                                          data, data_size, priority);
+                                          data, data_size, priority, when);
+      GEARMAND_QUEUE_ADD_DONE(server_job->unique,
+                              server_function->function_name, (int)*ret_ptr);
+      /* A batch flushes once after all of its jobs have been added. */
+      if (*ret_ptr == GEARMAN_SUCCESS &&
+          server->gearman->queue_flush_fn != NULL && !(shard->queue_batch))
+      {
+        *ret_ptr= (*(server->gearman->queue_flush_fn))(server->gearman,
+                                         (void *)server->gearman->queue_fn_arg);
+      }
+      GEARMAN_SERVER_QUEUE_UNLOCK(server)
+
       if (*ret_ptr != GEARMAN_SUCCESS)
       {
         server_job->data= NULL;
@@ -151,41 +472,75 @@ gearman_server_job_add(gearman_server_st *server, const char *function_name,
         return NULL;
       }
 
-      if (server->gearman->queue_flush_fn != NULL)
-      {
-        *ret_ptr= (*(server->gearman->queue_flush_fn))(server->gearman,
-                                         (void *)server->gearman->queue_fn_arg);
-        if (*ret_ptr != GEARMAN_SUCCESS)
-        {
-          server_job->data= NULL;
-          gearman_server_job_free(server_job);
-          return NULL;
-        }
-      }
-
       server_job->options|= GEARMAN_SERVER_JOB_QUEUED;
     }
 
-    *ret_ptr= gearman_server_job_queue(server_job);
+    if (GEARMAND_JOB_ADD_ENABLED())
+    {
+      (void)gearman_server_job_handle(server_job, job_handle);
+      GEARMAND_JOB_ADD(job_handle, server_function->function_name,
+                       server_job->unique, data_size, (int)priority,
+                       server_client == NULL);
+    }
+
+    if (record == NULL)
+      gearman_server_spill_add(server_job, server_client == NULL);
+
+    if (when > (int64_t)time(NULL))
+    {
+      gearman_server_timer_schedule(server_job);
+      *ret_ptr= GEARMAN_SUCCESS;
+    }
+    else
+      *ret_ptr= gearman_server_job_queue(server_job);
     if (*ret_ptr != GEARMAN_SUCCESS)
     {
-      if (server_client == NULL && server->gearman->queue_done_fn != NULL)
+      /* The job is not stored with the rest of its batch after all. */
+      if (record != NULL)
+        shard->queue_record_count--;
+      else if (server_client == NULL && gearman_server_persist_enabled(server))
+      {
+        (void)gearman_server_persist_done(server, server_job->unique,
+                                          server_job->unique_size,
+                                          server_job->function->function_name,
+                                   server_job->function->function_name_size);
+      }
+      else if (server_client == NULL &&
+               server->gearman->queue_done_fn != NULL)
       {
         /* Do our best to remove the job from the queue. */
+        GEARMAN_SERVER_QUEUE_LOCK(server)
         (void)(*(server->gearman->queue_done_fn))(server->gearman,
                                           (void *)server->gearman->queue_fn_arg,
-                                          server_job->unique, unique_size, 
+                                          server_job->unique,
+                                          server_job->unique_size,
                                           server_job->function->function_name,
                                           server_job->function->function_name_size);
+        GEARMAN_SERVER_QUEUE_UNLOCK(server)
       }
 
       gearman_server_job_free(server_job);
       return NULL;
     }
+
+    if (shard->job_chain != NULL)
+    {
+      server_job->chain= shard->job_chain;
+      server_job->options|= GEARMAN_SERVER_JOB_CHAINED;
+    }
   }
   else
+  {
     *ret_ptr= GEARMAN_JOB_EXISTS;
 
+    /* A running job whose clients all left is wanted again. */
+    if (server_client != NULL)
+    {
+      server_job->options&=
+                      (gearman_server_job_options_t)~GEARMAN_SERVER_JOB_IGNORE;
+    }
+  }
+
   if (server_client != NULL)
   {
     server_client->job= server_job;
@@ -196,236 +551,732 @@ gearman_server_job_add(gearman_server_st *server, const char *function_name,
 }
 
 gearman_server_job_st *
-gearman_server_job_create(gearman_server_st *server,
-                          gearman_server_job_st *server_job)
+gearman_server_job_create(gearman_server_shard_st *shard, const char *unique,
+                          size_t unique_size)
 {
-  if (server_job == NULL)
-  {
-    if (server->free_job_count > 0)
-    {
-      server_job= server->free_job_list;
-      GEARMAN_LIST_DEL(server->free_job, server_job,)
-    }
-    else
-    {
-      server_job= malloc(sizeof(gearman_server_job_st));
-      if (server_job == NULL)
-        return NULL;
-    }
+  gearman_server_job_st *server_job;
+  const char *ptr;
 
-    server_job->options= GEARMAN_SERVER_JOB_ALLOCATED;
-  }
-  else
-    server_job->options= 0;
+  /* This stops at a NULL, as the key is used as a string too. */
+  if (unique_size > GEARMAN_UNIQUE_SIZE - 1)
+    unique_size= GEARMAN_UNIQUE_SIZE - 1;
+  ptr= unique_size == 0 ? NULL : memchr(unique, 0, unique_size);
+  if (ptr != NULL)
+    unique_size= (size_t)(ptr - unique);
+
+  server_job= gearman_server_slab_alloc(&(shard->job_slab[unique_size /
+                                               GEARMAN_SERVER_JOB_SLAB_STEP]));
+  if (server_job == NULL)
+    return NULL;
 
+  server_job->options= GEARMAN_SERVER_JOB_ALLOCATED;
   server_job->priority= 0;
-  server_job->job_handle_key= 0;
-  server_job->unique_key= 0;
-  server_job->client_count= 0;
-  server_job->numerator= 0;
-  server_job->denominator= 0;
-  server_job->data_size= 0;
-  server_job->server= server;
-  server_job->next= NULL;
-  server_job->prev= NULL;
-  server_job->unique_next= NULL;
-  server_job->unique_prev= NULL;
+  server_job->level= 0;
+  server_job->unique_size= (uint8_t)unique_size;
   server_job->function= NULL;
   server_job->function_next= NULL;
   server_job->data= NULL;
-  server_job->client_list= NULL;
+  server_job->data_size= 0;
   server_job->worker= NULL;
-  server_job->job_handle[0]= 0;
-  server_job->unique[0]= 0;
+  server_job->client_list= NULL;
+  server_job->chain= NULL;
+  server_job->affinity_key= 0;
+  server_job->id= 0;
+  server_job->unique_key= 0;
+  server_job->next= NULL;
+  server_job->unique_next= NULL;
+  server_job->affinity_worker= NULL;
+  server_job->queue_time= 0;
+  server_job->created_time= 0;
+  server_job->assigned_time= 0;
+  server_job->when= 0;
+  server_job->timer_expire= 0;
+  server_job->timer_next= NULL;
+  server_job->timer_prev= NULL;
+  server_job->spill_offset= 0;
+  server_job->client_count= 0;
+  server_job->numerator= 0;
+  server_job->denominator= 0;
+  server_job->timer_slot= 0;
+  if (unique_size > 0)
+    memcpy(server_job->unique, unique, unique_size);
+  server_job->unique[unique_size]= 0;
 
   return server_job;
 }
 
 void gearman_server_job_free(gearman_server_job_st *server_job)
 {
-  uint32_t key;
+  gearman_server_shard_st *shard= server_job->function->shard;
+  gearman_server_job_st **bucket;
+  gearman_server_job_slot_st *job_slot;
+  uint32_t slot;
 
   if (server_job->worker != NULL)
+  {
     server_job->function->job_running--;
+    _server_job_slot_release(server_job);
+  }
+
+  if (server_job->options & GEARMAN_SERVER_JOB_AFFINITY)
+    _server_job_unhold(server_job);
+
+  /* Scheduled jobs are on the timer wheel before any worker has them. */
+  if (server_job->options & GEARMAN_SERVER_JOB_TIMER)
+    gearman_server_timer_remove(server_job);
 
   server_job->function->job_total--;
+  server_job->function->queue_bytes-= server_job->data_size;
+  if (shard->server->queue_bytes_max > 0)
+  {
+    (void)__sync_sub_and_fetch(&(shard->server->queue_bytes),
+                               server_job->data_size);
+  }
 
-  if (server_job->data != NULL)
-    free((void *)(server_job->data));
+  gearman_server_spill_release(server_job);
+
+  if (server_job->options & GEARMAN_SERVER_JOB_REPLICATED &&
+      gearman_server_replica_enabled(shard->server))
+  {
+    gearman_server_replica_done(shard->server, server_job);
+  }
 
+  /* The job is going away, so losing its last client must not abandon it
+     again. */
+  server_job->options|= GEARMAN_SERVER_JOB_IGNORE;
   while (server_job->client_list != NULL)
     gearman_server_client_free(server_job->client_list);
 
-  if (server_job->worker != NULL)
-    server_job->worker->job= NULL;
+  if (server_job->chain != NULL)
+    free(server_job->chain);
 
-  key= server_job->unique_key % GEARMAN_JOB_HASH_SIZE;
-  GEARMAN_HASH_DEL(server_job->server->unique, key, server_job, unique_)
+  if (server_job->worker != NULL)
+    GEARMAN_LIST_DEL(server_job->worker->job, server_job, worker_)
 
-  key= server_job->job_handle_key % GEARMAN_JOB_HASH_SIZE;
-  GEARMAN_HASH_DEL(server_job->server->job, key, server_job,)
+  bucket= _server_job_bucket(shard, shard->unique_hash,
+                             shard->unique_hash_old, server_job->unique_key);
+  _server_job_unique_del(bucket, server_job);
+  shard->unique_count--;
 
-  if (server_job->options & GEARMAN_SERVER_JOB_ALLOCATED)
+  if (shard->server->options & GEARMAN_SERVER_JOB_HANDLE_INDEX)
   {
-    if (server_job->server->free_job_count < GEARMAN_MAX_FREE_SERVER_JOB)
-      GEARMAN_LIST_ADD(server_job->server->free_job, server_job,)
-    else
-      free(server_job);
+    /* Bump the generation so old handles for this slot no longer match. */
+    slot= (uint32_t)(server_job->id & UINT32_MAX);
+    job_slot= &(shard->job_slot_list[slot]);
+    job_slot->job= NULL;
+    job_slot->generation++;
+    job_slot->next_free= shard->job_slot_free;
+    shard->job_slot_free= slot;
   }
+  else
+  {
+    bucket= _server_job_bucket(shard, shard->job_hash, shard->job_hash_old,
+                               server_job->id);
+    _server_job_hash_del(bucket, server_job);
+  }
+  shard->job_count--;
+
+  gearman_server_slab_release(&(shard->job_slab[server_job->unique_size /
+                                               GEARMAN_SERVER_JOB_SLAB_STEP]),
+                              server_job);
 }
 
 gearman_server_job_st *gearman_server_job_get(gearman_server_st *server,
                                               const char *job_handle)
 {
+  gearman_server_shard_st *shard;
   gearman_server_job_st *server_job;
-  uint32_t key;
+  uint64_t id;
+
+  shard= gearman_server_shard_job(server, job_handle, strlen(job_handle));
+
+  if (!_server_job_handle_id(shard, job_handle, &id))
+    return NULL;
+
+  if (server->options & GEARMAN_SERVER_JOB_HANDLE_INDEX)
+    return _server_job_slot_get(shard, id);
 
-  key= _server_job_hash(job_handle, strlen(job_handle));
+  if (shard->job_hash_old != NULL)
+    _server_job_rehash(shard, GEARMAN_JOB_HASH_REHASH_STEP);
 
-  for (server_job= server->job_hash[key % GEARMAN_JOB_HASH_SIZE];
+  for (server_job= *_server_job_bucket(shard, shard->job_hash,
+                                       shard->job_hash_old, id);
        server_job != NULL; server_job= server_job->next)
   {
-    if (server_job->job_handle_key == key &&
-        !strcmp(server_job->job_handle, job_handle))
-    {
+    if (server_job->id == id)
       return server_job;
-    }
   }
 
   return NULL;
 }
 
-gearman_server_job_st *
-gearman_server_job_peek(gearman_server_con_st *server_con)
+size_t gearman_server_job_handle(const gearman_server_job_st *server_job,
+                                 char *job_handle)
 {
-  gearman_server_worker_st *server_worker;
-  gearman_job_priority_t priority;
-
-  for (server_worker= server_con->worker_list; server_worker != NULL;
-       server_worker= server_worker->con_next)
+  gearman_server_shard_st *shard= server_job->function->shard;
+  uint64_t value= server_job->id;
+  char digits[20];
+  char *ptr;
+  size_t x= 0;
+
+  /* The prefix is kept short enough that the handle always fits, so this can
+     be built by hand rather than with snprintf. */
+  do
   {
-    if (server_worker->function->job_count != 0)
-    {
-      for (priority= GEARMAN_JOB_PRIORITY_HIGH;
-           priority != GEARMAN_JOB_PRIORITY_MAX; priority++)
-      {
-        if (server_worker->function->job_list[priority] != NULL)
-        {
-          if (server_worker->function->job_list[priority]->options &
-              GEARMAN_SERVER_JOB_IGNORE)
-          {
-            /* This is only happens when a client disconnects from a foreground
-               job. We do this because we don't want to run the job anymore. */
-            server_worker->function->job_list[priority]->options&=
-                       (gearman_server_job_options_t)~GEARMAN_SERVER_JOB_IGNORE;
-            gearman_server_job_free(gearman_server_job_take(server_con));
-            return gearman_server_job_peek(server_con);
-          }
-          return server_worker->function->job_list[priority];
-        }
-      }
-    }
-  }
-
-  return NULL;
+    digits[x++]= (char)('0' + (value % 10));
+    value/= 10;
+  } while (value != 0);
+
+  memcpy(job_handle, shard->job_handle_prefix, shard->job_handle_prefix_size);
+  ptr= job_handle + shard->job_handle_prefix_size;
+  *ptr++= ':';
+  while (x > 0)
+    *ptr++= digits[--x];
+  *ptr= 0;
+
+  return (size_t)(ptr - job_handle);
 }
 
 gearman_server_job_st *
-gearman_server_job_take(gearman_server_con_st *server_con)
+gearman_server_job_peek(gearman_server_con_st *server_con)
 {
   gearman_server_worker_st *server_worker;
   gearman_server_job_st *server_job;
-  gearman_job_priority_t priority;
-
-  for (server_worker= server_con->worker_list; server_worker != NULL;
-       server_worker= server_worker->con_next)
-  {
-    if (server_worker->function->job_count != 0)
-      break;
-  }
 
+  /* Every worker on the ready list has queued or held jobs. */
+  server_worker= gearman_server_worker_turn(
+                          &(server_con->shard_list[server_con->shard->id]));
   if (server_worker == NULL)
     return NULL;
 
-  for (priority= GEARMAN_JOB_PRIORITY_HIGH;
-       priority != GEARMAN_JOB_PRIORITY_MAX; priority++)
-  {
-    if (server_worker->function->job_list[priority] != NULL)
-      break;
-  }
-
-  server_job= server_worker->function->job_list[priority];
-  server_job->function->job_list[priority]= server_job->function_next;
-  if (server_job->function->job_end[priority] == server_job)
-    server_job->function->job_end[priority]= NULL;
-  server_job->function->job_count--;
-
-  server_job->worker= server_worker;
-  server_worker->job= server_job;
-  server_job->function->job_running++;
+  server_job= _server_job_next(server_worker);
+  if (server_job == NULL)
+    return NULL;
 
   if (server_job->options & GEARMAN_SERVER_JOB_IGNORE)
   {
-    gearman_server_job_free(server_job);
-    return gearman_server_job_take(server_con);
+    /* This is only happens when a client disconnects from a foreground
+       job. We do this because we don't want to run the job anymore. */
+    server_job->options&= (gearman_server_job_options_t)
+                          ~GEARMAN_SERVER_JOB_IGNORE;
+    gearman_server_job_free(gearman_server_job_take(server_con));
+    return gearman_server_job_peek(server_con);
   }
 
   return server_job;
 }
 
-gearman_return_t gearman_server_job_queue(gearman_server_job_st *server_job)
+gearman_server_job_st *
+gearman_server_job_take(gearman_server_con_st *server_con)
 {
   gearman_server_worker_st *server_worker;
-  gearman_return_t ret;
+  gearman_server_job_st *server_job;
 
-  if (server_job->worker != NULL)
+  /* Taking a worker's jobs can find only ones to be ignored, which leaves its
+     function idle, so move on to the next ready worker then. */
+  while ((server_worker= gearman_server_worker_turn(
+                        &(server_con->shard_list[server_con->shard->id]))) !=
+         NULL)
   {
-    server_job->function->job_running--;
-    server_job->function_next= NULL;
-  }
+    server_job= gearman_server_job_take_worker(server_worker);
+    if (server_job != NULL || server_worker->function->job_count > 0 ||
+        server_worker->held_count > 0)
+    {
+      return server_job;
+    }
+  }
+
+  return NULL;
+}
+
+gearman_server_job_st *
+gearman_server_job_take_worker(gearman_server_worker_st *server_worker)
+{
+  gearman_server_function_st *function= server_worker->function;
+  gearman_server_job_st *server_job;
+  uint64_t now;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+
+  while ((server_job= _server_job_next(server_worker)) != NULL)
+  {
+    /* Leave the job queued if its payload can't be brought back in. */
+    if (!(server_job->options & GEARMAN_SERVER_JOB_IGNORE) &&
+        gearman_server_spill_load(server_job) != GEARMAN_SUCCESS)
+    {
+      return NULL;
+    }
+
+    if (server_job->options & GEARMAN_SERVER_JOB_AFFINITY)
+      _server_job_unhold(server_job);
+    else
+    {
+      _server_job_unlink(server_job);
+      function->job_count--;
+      if (function->job_count == 0)
+        _server_job_function_idle(function);
+    }
+
+    server_job->worker= server_worker;
+    GEARMAN_LIST_ADD(server_worker->job, server_job, worker_)
+    server_job->function->job_running++;
+
+    if (!(server_job->options & GEARMAN_SERVER_JOB_IGNORE))
+    {
+      /* Only the first assignment counts as queue wait. A job handed out
+         again after a timeout or lost worker keeps timing from the latest
+         assignment so its run time covers the attempt that finishes. */
+      now= gearman_time_now();
+      if (server_job->assigned_time == 0 && now >= server_job->created_time)
+      {
+        gearman_server_function_wait_add(server_job->function,
+                                         now - server_job->created_time);
+      }
+      server_job->assigned_time= now;
+
+      if (GEARMAND_JOB_TAKE_ENABLED())
+      {
+        (void)gearman_server_job_handle(server_job, job_handle);
+        GEARMAND_JOB_TAKE(job_handle, function->function_name,
+                          server_worker->con->con.fd);
+      }
+
+      if (server_worker->timeout > 0)
+        gearman_server_timer_add(server_job, server_worker->timeout);
+      gearman_server_worker_charge(server_worker);
+      return server_job;
+    }
+
+    gearman_server_job_free(server_job);
+  }
+
+  return NULL;
+}
+
+gearman_return_t
+gearman_server_job_push(gearman_server_worker_st *server_worker)
+{
+  gearman_server_con_shard_st *con_shard=
+   &(server_worker->con->shard_list[server_worker->function->shard->id]);
+  uint32_t slots_used;
+  gearman_return_t ret;
+
+  while (con_shard->slots_used < con_shard->slots)
+  {
+    slots_used= con_shard->slots_used;
+
+    ret= gearman_server_job_push_one(server_worker);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+
+    if (con_shard->slots_used == slots_used)
+      break;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t
+gearman_server_job_push_one(gearman_server_worker_st *server_worker)
+{
+  gearman_server_con_st *server_con= server_worker->con;
+  gearman_server_shard_st *shard= server_worker->function->shard;
+  gearman_server_con_shard_st *con_shard= &(server_con->shard_list[shard->id]);
+  gearman_server_job_st *server_job;
+  gearman_return_t ret;
+
+  server_job= gearman_server_job_take_worker(server_worker);
+  if (server_job == NULL)
+    return GEARMAN_SUCCESS;
+
+  ret= gearman_server_job_assign(server_con, server_job,
+                                 GEARMAN_COMMAND_JOB_ASSIGN_UNIQ);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    /* Stop pushing to a connection that can't take a job, so queuing the
+       job again doesn't come straight back here. */
+    gearman_server_con_set_slots(server_con, shard, con_shard->slots_used,
+                                 con_shard->slots_used);
+    (void)gearman_server_job_queue(server_job);
+    return ret;
+  }
+
+  server_job->options|= GEARMAN_SERVER_JOB_PUSHED;
+  gearman_server_con_set_slots(server_con, shard, con_shard->slots,
+                               con_shard->slots_used + 1);
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearman_server_job_assign(gearman_server_con_st *server_con,
+                                           gearman_server_job_st *server_job,
+                                           gearman_command_t command)
+{
+  gearman_packet_options_t options= 0;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  size_t job_handle_size;
+
+  if (server_job->options & GEARMAN_SERVER_JOB_COMPRESSED)
+    options= GEARMAN_PACKET_COMPRESSED;
+
+  job_handle_size= gearman_server_job_handle(server_job, job_handle);
+
+  if (command == GEARMAN_COMMAND_JOB_ASSIGN_UNIQ)
+  {
+    return gearman_server_io_packet_add(server_con, options,
+                                   GEARMAN_MAGIC_RESPONSE,
+                                   GEARMAN_COMMAND_JOB_ASSIGN_UNIQ,
+                                   job_handle, job_handle_size + 1,
+                                   server_job->function->function_name,
+                                   server_job->function->function_name_size + 1,
+                                   server_job->unique,
+                                   (size_t)(server_job->unique_size + 1),
+                                   server_job->data, server_job->data_size,
+                                   NULL);
+  }
+
+  /* Same, but without unique ID. */
+  return gearman_server_io_packet_add(server_con, options,
+                                   GEARMAN_MAGIC_RESPONSE,
+                                   GEARMAN_COMMAND_JOB_ASSIGN,
+                                   job_handle, job_handle_size + 1,
+                                   server_job->function->function_name,
+                                   server_job->function->function_name_size + 1,
+                                   server_job->data, server_job->data_size,
+                                   NULL);
+}
+
+gearman_return_t gearman_server_job_queue(gearman_server_job_st *server_job)
+{
+  gearman_server_function_st *function= server_job->function;
+  gearman_server_st *server= function->shard->server;
+  gearman_server_worker_st *server_worker;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+
+  if (server_job->worker != NULL)
+  {
+    _server_job_slot_release(server_job);
+    if (server_job->options & GEARMAN_SERVER_JOB_TIMER)
+      gearman_server_timer_remove(server_job);
+    GEARMAN_LIST_DEL(server_job->worker->job, server_job, worker_)
+    server_job->function->job_running--;
+    server_job->function_next= NULL;
+  }
 
   server_job->worker= NULL;
   server_job->numerator= 0;
   server_job->denominator= 0;
 
-  /* Queue NOOP for possible sleeping workers. */
-  for (server_worker= server_job->function->worker_list; server_worker != NULL;
-       server_worker= server_worker->function_next)
+  if (GEARMAND_JOB_QUEUE_ENABLED())
+  {
+    (void)gearman_server_job_handle(server_job, job_handle);
+    GEARMAND_JOB_QUEUE(job_handle, function->function_name);
+  }
+
+  /* Queue the job to be run, starting again from the level for its priority
+     if it had already moved up before. */
+  server_job->level= (uint8_t)(server->priority_level[server_job->priority]);
+  if (server->priority_age > 0)
+    server_job->queue_time= (uint64_t)time(NULL);
+
+  /* There is no point holding a job when only one worker could take it. */
+  if (server_job->affinity_key != 0 && server->affinity_wait > 0 &&
+      function->worker_count > 1)
+  {
+    server_worker= _server_job_affinity_worker(function,
+                                               server_job->affinity_key);
+    return _server_job_hold(server_job, server_worker);
+  }
+
+  return _server_job_queue_any(server_job);
+}
+
+gearman_return_t gearman_server_job_release(gearman_server_job_st *server_job)
+{
+  _server_job_unhold(server_job);
+  return _server_job_queue_any(server_job);
+}
+
+gearman_return_t gearman_server_job_chain(gearman_server_job_st *server_job,
+                                          gearman_packet_st *packet)
+{
+  gearman_server_function_st *function= server_job->function;
+  gearman_server_st *server= function->shard->server;
+  gearman_server_function_st *next_function;
+  const char *name= server_job->chain;
+  const char *rest;
+  size_t name_size;
+  bool keep;
+
+  keep= *name == GEARMAN_CHAIN_KEEP_WORKLOAD;
+  if (keep)
+    name++;
+
+  rest= strchr(name, GEARMAN_CHAIN_SEPARATOR);
+  name_size= rest == NULL ? strlen(name) : (size_t)(rest - name);
+
+  /* Every stage was checked to be in this shard when the job came in. */
+  next_function= gearman_server_function_get(server, name, name_size);
+  if (next_function == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  /* Take the job back from the worker that ran the stage. */
+  _server_job_slot_release(server_job);
+  if (server_job->options & GEARMAN_SERVER_JOB_TIMER)
+    gearman_server_timer_remove(server_job);
+  GEARMAN_LIST_DEL(server_job->worker->job, server_job, worker_)
+  function->job_running--;
+  server_job->function_next= NULL;
+  server_job->worker= NULL;
+
+  function->job_total--;
+  function->queue_bytes-= server_job->data_size;
+  if (server->queue_bytes_max > 0)
+    (void)__sync_sub_and_fetch(&(server->queue_bytes), server_job->data_size);
+
+  if (!keep)
+  {
+    gearman_server_spill_release(server_job);
+    server_job->data= packet->data;
+    server_job->data_size= packet->data_size;
+    packet->options&= (gearman_packet_options_t)~GEARMAN_PACKET_FREE_DATA;
+
+    if (packet->options & GEARMAN_PACKET_COMPRESSED)
+      server_job->options|= GEARMAN_SERVER_JOB_COMPRESSED;
+    else
+    {
+      server_job->options&=
+                  (gearman_server_job_options_t)~GEARMAN_SERVER_JOB_COMPRESSED;
+    }
+
+    gearman_server_spill_add(server_job, false);
+  }
+
+  server_job->function= next_function;
+  next_function->job_total++;
+  next_function->queue_bytes+= server_job->data_size;
+  if (server->queue_bytes_max > 0)
+    (void)__sync_add_and_fetch(&(server->queue_bytes), server_job->data_size);
+
+  /* Each stage waits in its own function's queue. */
+  server_job->created_time= gearman_time_now();
+  server_job->assigned_time= 0;
+
+  while (rest != NULL && *rest == GEARMAN_CHAIN_SEPARATOR)
+    rest++;
+
+  if (rest == NULL || *rest == 0)
   {
-    if (!(server_worker->con->noop_queued) &&
-        !(server_worker->con->options & GEARMAN_SERVER_CON_SLEEPING))
+    free(server_job->chain);
+    server_job->chain= NULL;
+  }
+  else
+    memmove(server_job->chain, rest, strlen(rest) + 1);
+
+  return gearman_server_job_queue(server_job);
+}
+
+void gearman_server_job_abandon(gearman_server_job_st *server_job)
+{
+  gearman_server_function_st *function= server_job->function;
+  gearman_server_con_st *server_con;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  const void *arg[1];
+  size_t arg_size[1];
+
+  server_job->options|= GEARMAN_SERVER_JOB_IGNORE;
+
+  /* A running job is freed once its worker is done with it. Workers that
+     asked to be told can stop working on it early. */
+  if (server_job->worker != NULL)
+  {
+    server_con= server_job->worker->con;
+    if (server_con->options & GEARMAN_SERVER_CON_ABANDON)
     {
+      arg[0]= job_handle;
+      arg_size[0]= gearman_server_job_handle(server_job, job_handle);
+      (void)gearman_server_io_response_add(server_con,
+                                           GEARMAN_COMMAND_JOB_ABANDONED, 1,
+                                           arg, arg_size);
+    }
+
+    return;
+  }
+
+  /* Held and scheduled jobs are taken off their worker or the timer wheel
+     when freed. */
+  if (!(server_job->options & (GEARMAN_SERVER_JOB_AFFINITY |
+                               GEARMAN_SERVER_JOB_SCHEDULED)))
+  {
+    _server_job_unlink(server_job);
+    function->job_count--;
+    if (function->job_count == 0)
+      _server_job_function_idle(function);
+  }
+
+  gearman_server_job_free(server_job);
+}
+
+uint32_t gearman_server_job_purge(gearman_server_function_st *function,
+                                  const char *prefix, size_t prefix_size,
+                                  gearman_job_priority_t priority, bool cancel)
+{
+  gearman_server_timer_st *timer= &(function->shard->timer);
+  gearman_server_job_st *purge_list= NULL;
+  gearman_server_job_st *purge_end= NULL;
+  gearman_server_job_st *server_job;
+  gearman_server_job_st *next;
+  gearman_server_job_st *keep;
+  uint32_t level_map= function->level_map;
+  uint32_t count= 0;
+  uint32_t level;
+  uint32_t slot;
+
+  /* Queued jobs are linked through function_next, so dropping every job on a
+     level moves its whole chain over at once. The purge list uses the same
+     links. */
+  while (level_map != 0)
+  {
+    level= (uint32_t)ffs((int)level_map) - 1;
+    level_map&= level_map - 1;
+
+    server_job= function->job_list[level];
+    if (cancel && prefix_size == 0 && priority == GEARMAN_JOB_PRIORITY_MAX)
+    {
+      if (purge_list == NULL)
+        purge_list= server_job;
+      else
+        purge_end->function_next= server_job;
+      purge_end= function->job_end[level];
+      for (; server_job != NULL; server_job= server_job->function_next)
+        count++;
+
+      function->job_list[level]= NULL;
+      function->job_end[level]= NULL;
+      function->level_map&= ~((uint32_t)1 << level);
       continue;
     }
 
-    ret= gearman_server_io_packet_add(server_worker->con, false,
-                                      GEARMAN_MAGIC_RESPONSE,
-                                      GEARMAN_COMMAND_NOOP, NULL);
-    if (ret != GEARMAN_SUCCESS)
-      return ret;
+    function->job_list[level]= NULL;
+    keep= NULL;
+    for (; server_job != NULL; server_job= next)
+    {
+      next= server_job->function_next;
+      server_job->function_next= NULL;
+
+      if (_server_job_purge_match(server_job, prefix, prefix_size, priority,
+                                  cancel))
+      {
+        if (purge_list == NULL)
+          purge_list= server_job;
+        else
+          purge_end->function_next= server_job;
+        purge_end= server_job;
+        count++;
+      }
+      else
+      {
+        if (keep == NULL)
+          function->job_list[level]= server_job;
+        else
+          keep->function_next= server_job;
+        server_job->worker_prev= keep;
+        keep= server_job;
+      }
+    }
+
+    function->job_end[level]= keep;
+    if (keep == NULL)
+      function->level_map&= ~((uint32_t)1 << level);
+  }
+
+  function->job_count-= count;
+  if (count > 0 && function->job_count == 0)
+    _server_job_function_idle(function);
+
+  /* Jobs scheduled for later and jobs held for a worker have not been queued
+     yet, and only wait on the timer wheel. Freeing takes them off it, so they
+     stay there until then. */
+  if (timer->count > 0)
+  {
+    for (level= 0; level < GEARMAN_SERVER_TIMER_LEVELS; level++)
+    {
+      for (slot= 0; slot < GEARMAN_SERVER_TIMER_SLOTS; slot++)
+      {
+        for (server_job= timer->slot_list[level][slot]; server_job != NULL;
+             server_job= server_job->timer_next)
+        {
+          if (server_job->function != function || server_job->worker != NULL ||
+              !_server_job_purge_match(server_job, prefix, prefix_size,
+                                       priority, cancel))
+          {
+            continue;
+          }
+
+          server_job->function_next= NULL;
+          if (purge_list == NULL)
+            purge_list= server_job;
+          else
+            purge_end->function_next= server_job;
+          purge_end= server_job;
+          count++;
+        }
+      }
+    }
+  }
+
+  while (purge_list != NULL)
+    purge_list= _server_job_purge_batch(purge_list);
+
+  return count;
+}
+
+gearman_return_t gearman_server_job_hash_resize(gearman_server_shard_st *shard,
+                                                uint32_t size)
+{
+  gearman_server_job_st **job_hash;
+  gearman_server_job_st **unique_hash;
+
+  /* Only one resize can be in progress, so finish any current one first. */
+  if (shard->job_hash_old != NULL)
+    _server_job_rehash(shard, shard->hash_old_size);
+
+  if (size <= shard->hash_size)
+    return GEARMAN_SUCCESS;
+
+  job_hash= calloc(size, sizeof(gearman_server_job_st *));
+  if (job_hash == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
 
-    server_worker->con->noop_queued= true;
+  unique_hash= calloc(size, sizeof(gearman_server_job_st *));
+  if (unique_hash == NULL)
+  {
+    free(job_hash);
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
   }
 
-  /* Queue the job to be run. */
-  if (server_job->function->job_list[server_job->priority] == NULL)
-    server_job->function->job_list[server_job->priority]= server_job;
+  if (shard->job_count == 0)
+  {
+    if (shard->job_hash != NULL)
+      free(shard->job_hash);
+    if (shard->unique_hash != NULL)
+      free(shard->unique_hash);
+  }
   else
   {
-    server_job->function->job_end[server_job->priority]->function_next=
-                                                                     server_job;
+    shard->job_hash_old= shard->job_hash;
+    shard->unique_hash_old= shard->unique_hash;
+    shard->hash_old_size= shard->hash_size;
+    shard->hash_rehash= 0;
   }
-  server_job->function->job_end[server_job->priority]= server_job;
-  server_job->function->job_count++;
+
+  shard->job_hash= job_hash;
+  shard->unique_hash= unique_hash;
+  shard->hash_size= size;
 
   return GEARMAN_SUCCESS;
 }
 
-/*
- * Private definitions
- */
-
-static uint32_t _server_job_hash(const char *key, size_t key_size)
+uint32_t gearman_server_hash(const char *key, size_t key_size)
 {
   const char *ptr= key;
   int32_t value= 0;
@@ -443,16 +1294,142 @@ static uint32_t _server_job_hash(const char *key, size_t key_size)
   return (uint32_t)(value == 0 ? 1 : value);
 }
 
+uint64_t gearman_server_hash64(const char *key, size_t key_size)
+{
+  if (_server_hash64 == NULL)
+  {
+    /* Every thread picks the same implementation, so racing here is fine. */
+#ifdef _SERVER_HASH64_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+      _server_hash64= _server_hash64_sse42;
+    else
+#endif
+      _server_hash64= _server_hash64_generic;
+  }
+
+  return (*_server_hash64)(key, key_size);
+}
+
+/*
+ * Private definitions
+ */
+
+static inline uint64_t _server_hash64_load(const char *ptr)
+{
+  uint64_t word;
+
+  memcpy(&word, ptr, sizeof(uint64_t));
+  return word;
+}
+
+static inline uint64_t _server_hash64_final(uint64_t value)
+{
+  value^= value >> 33;
+  value*= 0xFF51AFD7ED558CCDULL;
+  value^= value >> 33;
+  value*= 0xC4CEB9FE1A85EC53ULL;
+  value^= value >> 33;
+
+  return value;
+}
+
+static uint64_t _server_hash64_generic(const char *key, size_t key_size)
+{
+  uint64_t lane[4];
+  uint64_t word;
+  uint64_t value;
+  size_t size= key_size;
+
+  lane[0]= _SERVER_HASH64_PRIME1 + _SERVER_HASH64_PRIME2;
+  lane[1]= _SERVER_HASH64_PRIME2;
+  lane[2]= 0;
+  lane[3]= 0 - _SERVER_HASH64_PRIME1;
+
+  while (size >= 32)
+  {
+    _SERVER_HASH64_ROUND(lane[0], _server_hash64_load(key))
+    _SERVER_HASH64_ROUND(lane[1], _server_hash64_load(key + 8))
+    _SERVER_HASH64_ROUND(lane[2], _server_hash64_load(key + 16))
+    _SERVER_HASH64_ROUND(lane[3], _server_hash64_load(key + 24))
+    key+= 32;
+    size-= 32;
+  }
+
+  value= _SERVER_HASH64_ROTATE(lane[0], 1) + _SERVER_HASH64_ROTATE(lane[1], 7) +
+         _SERVER_HASH64_ROTATE(lane[2], 12) +
+         _SERVER_HASH64_ROTATE(lane[3], 18) + key_size;
+
+  while (size >= 8)
+  {
+    _SERVER_HASH64_ROUND(value, _server_hash64_load(key))
+    key+= 8;
+    size-= 8;
+  }
+
+  if (size > 0)
+  {
+    word= 0;
+    memcpy(&word, key, size);
+    _SERVER_HASH64_ROUND(value, word)
+  }
+
+  return _server_hash64_final(value);
+}
+
+#ifdef _SERVER_HASH64_SSE42
+static uint64_t _server_hash64_sse42(const char *key, size_t key_size)
+{
+  uint64_t lane[3];
+  uint64_t word;
+  size_t size= key_size;
+
+  lane[0]= 0;
+  lane[1]= 0xFFFFFFFF;
+  lane[2]= 0x5BD1E995;
+
+  while (size >= 24)
+  {
+    lane[0]= _mm_crc32_u64(lane[0], _server_hash64_load(key));
+    lane[1]= _mm_crc32_u64(lane[1], _server_hash64_load(key + 8));
+    lane[2]= _mm_crc32_u64(lane[2], _server_hash64_load(key + 16));
+    key+= 24;
+    size-= 24;
+  }
+
+  while (size >= 8)
+  {
+    lane[0]= _mm_crc32_u64(lane[0], _server_hash64_load(key));
+    key+= 8;
+    size-= 8;
+  }
+
+  if (size > 0)
+  {
+    word= 0;
+    memcpy(&word, key, size);
+    lane[1]= _mm_crc32_u64(lane[1], word);
+  }
+
+  return _server_hash64_final(((lane[0] << 32) | lane[1]) +
+                              (lane[2] * _SERVER_HASH64_PRIME1) + key_size);
+}
+#endif
+
 static gearman_server_job_st *
-_server_job_get_unique(gearman_server_st *server, uint32_t unique_key,
+_server_job_get_unique(gearman_server_shard_st *shard, uint64_t unique_key,
                        gearman_server_function_st *server_function,
                        const char *unique, size_t data_size)
 {
   gearman_server_job_st *server_job;
 
-  for (server_job= server->unique_hash[unique_key % GEARMAN_JOB_HASH_SIZE];
+  for (server_job= *_server_job_bucket(shard, shard->unique_hash,
+                                       shard->unique_hash_old, unique_key);
        server_job != NULL; server_job= server_job->unique_next)
   {
+    if (server_job->options & GEARMAN_SERVER_JOB_CHAINED)
+      continue;
+
     if (data_size == 0)
     {
       if (server_job->function == server_function &&
@@ -467,7 +1444,7 @@ _server_job_get_unique(gearman_server_st *server, uint32_t unique_key,
       if (server_job->function == server_function &&
           server_job->unique_key == unique_key &&
           server_job->data_size == data_size &&
-          !memcmp(server_job->data, unique, data_size))
+          !memcmp(gearman_server_spill_data(server_job), unique, data_size))
       {
         return server_job;
       }
@@ -476,3 +1453,514 @@ _server_job_get_unique(gearman_server_st *server, uint32_t unique_key,
 
   return NULL;
 }
+
+static inline gearman_server_job_st **
+_server_job_bucket(gearman_server_shard_st *shard, gearman_server_job_st **hash,
+                   gearman_server_job_st **hash_old, uint64_t key)
+{
+  if (hash_old != NULL && key % shard->hash_old_size >= shard->hash_rehash)
+    return &(hash_old[key % shard->hash_old_size]);
+
+  return &(hash[key % shard->hash_size]);
+}
+
+static void _server_job_rehash(gearman_server_shard_st *shard, uint32_t count)
+{
+  gearman_server_job_st *server_job;
+  gearman_server_job_st **bucket;
+
+  while (count-- > 0 && shard->hash_rehash < shard->hash_old_size)
+  {
+    while (shard->job_hash_old[shard->hash_rehash] != NULL)
+    {
+      server_job= shard->job_hash_old[shard->hash_rehash];
+      shard->job_hash_old[shard->hash_rehash]= server_job->next;
+      bucket= &(shard->job_hash[server_job->id % shard->hash_size]);
+      server_job->next= *bucket;
+      *bucket= server_job;
+    }
+
+    while (shard->unique_hash_old[shard->hash_rehash] != NULL)
+    {
+      server_job= shard->unique_hash_old[shard->hash_rehash];
+      shard->unique_hash_old[shard->hash_rehash]= server_job->unique_next;
+      bucket= &(shard->unique_hash[server_job->unique_key %
+                                    shard->hash_size]);
+      server_job->unique_next= *bucket;
+      *bucket= server_job;
+    }
+
+    shard->hash_rehash++;
+  }
+
+  if (shard->hash_rehash == shard->hash_old_size)
+  {
+    free(shard->job_hash_old);
+    free(shard->unique_hash_old);
+    shard->job_hash_old= NULL;
+    shard->unique_hash_old= NULL;
+    shard->hash_old_size= 0;
+    shard->hash_rehash= 0;
+  }
+}
+
+static gearman_return_t
+_server_job_slot_reserve(gearman_server_shard_st *shard)
+{
+  gearman_server_job_slot_st *job_slot_list;
+  uint32_t size;
+  uint32_t x;
+
+  if (shard->job_slot_free != GEARMAN_JOB_SLOT_NONE)
+    return GEARMAN_SUCCESS;
+
+  if (shard->job_slot_size == 0)
+    size= GEARMAN_JOB_SLOT_SIZE;
+  else if (shard->job_slot_size >= (GEARMAN_JOB_SLOT_NONE >> 1))
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  else
+    size= shard->job_slot_size << 1;
+
+  job_slot_list= realloc(shard->job_slot_list,
+                         sizeof(gearman_server_job_slot_st) * size);
+  if (job_slot_list == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  /* Chain the new slots so the lowest index is handed out first. */
+  for (x= shard->job_slot_size; x < size; x++)
+  {
+    job_slot_list[x].generation= 0;
+    job_slot_list[x].next_free= x + 1 == size ? GEARMAN_JOB_SLOT_NONE : x + 1;
+    job_slot_list[x].job= NULL;
+  }
+
+  shard->job_slot_free= shard->job_slot_size;
+  shard->job_slot_list= job_slot_list;
+  shard->job_slot_size= size;
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _server_job_slot_add(gearman_server_shard_st *shard,
+                                 gearman_server_job_st *server_job)
+{
+  gearman_server_job_slot_st *job_slot;
+  uint32_t slot;
+
+  slot= shard->job_slot_free;
+  job_slot= &(shard->job_slot_list[slot]);
+  shard->job_slot_free= job_slot->next_free;
+  job_slot->job= server_job;
+
+  server_job->id= ((uint64_t)(job_slot->generation) << 32) | slot;
+}
+
+static gearman_server_job_st *
+_server_job_slot_get(gearman_server_shard_st *shard, uint64_t id)
+{
+  gearman_server_job_slot_st *job_slot;
+  uint32_t slot;
+
+  slot= (uint32_t)(id & UINT32_MAX);
+  if (slot >= shard->job_slot_size)
+    return NULL;
+
+  job_slot= &(shard->job_slot_list[slot]);
+  if (job_slot->job == NULL || job_slot->generation != (uint32_t)(id >> 32))
+    return NULL;
+
+  return job_slot->job;
+}
+
+static bool _server_job_handle_id(gearman_server_shard_st *shard,
+                                  const char *job_handle, uint64_t *id)
+{
+  const char *ptr;
+  uint64_t value= 0;
+  size_t x;
+
+  if (strncmp(job_handle, shard->job_handle_prefix,
+              shard->job_handle_prefix_size) ||
+      job_handle[shard->job_handle_prefix_size] != ':')
+  {
+    return false;
+  }
+
+  ptr= job_handle + shard->job_handle_prefix_size + 1;
+  for (x= 0; ptr[x] != 0; x++)
+  {
+    if (ptr[x] < '0' || ptr[x] > '9' || x == 20)
+      return false;
+
+    value= (value * 10) + (uint64_t)(ptr[x] - '0');
+  }
+
+  if (x == 0)
+    return false;
+
+  *id= value;
+  return true;
+}
+
+static inline void _server_job_hash_del(gearman_server_job_st **bucket,
+                                        gearman_server_job_st *server_job)
+{
+  while (*bucket != server_job)
+    bucket= &((*bucket)->next);
+
+  *bucket= server_job->next;
+}
+
+static inline void _server_job_unique_del(gearman_server_job_st **bucket,
+                                          gearman_server_job_st *server_job)
+{
+  while (*bucket != server_job)
+    bucket= &((*bucket)->unique_next);
+
+  *bucket= server_job->unique_next;
+}
+
+static void _server_job_function_ready(gearman_server_function_st *function)
+{
+  gearman_server_worker_st *server_worker;
+
+  for (server_worker= function->worker_list; server_worker != NULL;
+       server_worker= server_worker->function_next)
+  {
+    if (server_worker->held_count == 0)
+      gearman_server_worker_ready(server_worker);
+  }
+}
+
+static void _server_job_function_idle(gearman_server_function_st *function)
+{
+  gearman_server_worker_st *server_worker;
+
+  for (server_worker= function->worker_list; server_worker != NULL;
+       server_worker= server_worker->function_next)
+  {
+    if (server_worker->held_count == 0)
+      gearman_server_worker_idle(server_worker);
+  }
+}
+
+static void _server_job_function_age(gearman_server_function_st *function)
+{
+  uint32_t age= function->shard->server->priority_age;
+  gearman_server_job_st *server_job;
+  uint32_t level_map;
+  uint32_t level;
+  uint32_t next;
+  uint64_t steps;
+  uint64_t now;
+
+  /* Nothing on the first level can move up. */
+  level_map= function->level_map & ~(uint32_t)1;
+  if (age == 0 || level_map == 0)
+    return;
+
+  now= (uint64_t)time(NULL);
+
+  /* Jobs are only looked at when a worker asks for one, so a job climbs one
+     level for each whole age it waited since it last moved, and keeps what is
+     left of an age for the next move. Levels are walked from the first, so a
+     job is never moved twice in one pass. */
+  while (level_map != 0)
+  {
+    level= (uint32_t)ffs((int)level_map) - 1;
+    level_map&= level_map - 1;
+
+    while ((server_job= function->job_list[level]) != NULL &&
+           server_job->queue_time + age <= now)
+    {
+      _server_job_unlink(server_job);
+
+      steps= (now - server_job->queue_time) / age;
+      if (steps > level)
+        steps= level;
+      next= level - (uint32_t)steps;
+
+      server_job->level= (uint8_t)next;
+      server_job->queue_time+= steps * age;
+
+      server_job->worker_prev= function->job_end[next];
+      if (function->job_list[next] == NULL)
+      {
+        function->job_list[next]= server_job;
+        function->level_map|= (uint32_t)1 << next;
+      }
+      else
+        function->job_end[next]->function_next= server_job;
+      function->job_end[next]= server_job;
+    }
+  }
+}
+
+static gearman_server_job_st *
+_server_job_next(gearman_server_worker_st *server_worker)
+{
+  gearman_server_function_st *function= server_worker->function;
+  gearman_server_job_st *server_job= server_worker->held_end;
+  uint32_t level;
+
+  _server_job_function_age(function);
+  if (function->level_map == 0)
+    return server_job;
+
+  /* The lowest set bit is the first level with jobs, found in one step
+     however many levels there are. */
+  level= (uint32_t)ffs((int)(function->level_map)) - 1;
+  if (server_job != NULL && server_job->level <= level)
+    return server_job;
+
+  return function->job_list[level];
+}
+
+static gearman_server_worker_st *
+_server_job_affinity_worker(gearman_server_function_st *function,
+                            uint64_t affinity_key)
+{
+  gearman_server_worker_st *server_worker;
+  gearman_server_worker_st *best= NULL;
+  uint64_t best_score= 0;
+  uint64_t score;
+
+  for (server_worker= function->worker_list; server_worker != NULL;
+       server_worker= server_worker->function_next)
+  {
+    score= _server_hash64_final(affinity_key ^ server_worker->con->id_key);
+    if (best == NULL || score > best_score)
+    {
+      best= server_worker;
+      best_score= score;
+    }
+  }
+
+  return best;
+}
+
+static gearman_return_t _server_job_hold(gearman_server_job_st *server_job,
+                                         gearman_server_worker_st *worker)
+{
+  gearman_server_function_st *function= server_job->function;
+  gearman_server_con_shard_st *con_shard=
+                          &(worker->con->shard_list[function->shard->id]);
+
+  /* Held jobs are not running, so they use the worker links to sit on the
+     list of the worker they are held for, newest first. */
+  server_job->affinity_worker= worker;
+  GEARMAN_LIST_ADD(worker->held, server_job, worker_)
+  if (worker->held_end == NULL)
+    worker->held_end= server_job;
+  if (worker->held_count == 1 && function->job_count == 0)
+    gearman_server_worker_ready(worker);
+
+  gearman_server_timer_add(server_job, function->shard->server->affinity_wait);
+  server_job->options|= GEARMAN_SERVER_JOB_AFFINITY;
+
+  if (con_shard->slots_used < con_shard->slots)
+    return gearman_server_job_push(worker);
+
+  return gearman_server_worker_wakeup(worker);
+}
+
+static void _server_job_unhold(gearman_server_job_st *server_job)
+{
+  gearman_server_worker_st *worker= server_job->affinity_worker;
+
+  gearman_server_timer_remove(server_job);
+  if (worker->held_end == server_job)
+    worker->held_end= server_job->worker_prev;
+  GEARMAN_LIST_DEL(worker->held, server_job, worker_)
+  server_job->affinity_worker= NULL;
+  server_job->worker_next= NULL;
+  server_job->worker_prev= NULL;
+
+  if (worker->held_count == 0 && server_job->function->job_count == 0)
+    gearman_server_worker_idle(worker);
+}
+
+static gearman_return_t
+_server_job_queue_any(gearman_server_job_st *server_job)
+{
+  gearman_server_function_st *function= server_job->function;
+  uint32_t level= server_job->level;
+  gearman_return_t ret;
+
+  /* Queued jobs are not running, so they use the worker back link to point
+     at the job before them, which lets any of them be taken off in one
+     step. */
+  server_job->worker_prev= function->job_end[level];
+  if (function->job_list[level] == NULL)
+  {
+    function->job_list[level]= server_job;
+    function->level_map|= (uint32_t)1 << level;
+  }
+  else
+    function->job_end[level]->function_next= server_job;
+  function->job_end[level]= server_job;
+  function->job_count++;
+  if (function->job_count == 1)
+    _server_job_function_ready(function);
+
+  /* Workers with free slots are given the job right away, and only what is
+     left wakes sleeping workers. */
+  if (function->shard->worker_slots_free > 0)
+  {
+    ret= _server_job_function_push(function);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  /* Queue NOOP for enough sleeping workers to cover the queued jobs. */
+  return gearman_server_function_wakeup(function, function->job_count);
+}
+
+static void _server_job_unlink(gearman_server_job_st *server_job)
+{
+  gearman_server_function_st *function= server_job->function;
+  uint32_t level= server_job->level;
+
+  if (server_job->worker_prev == NULL)
+    function->job_list[level]= server_job->function_next;
+  else
+    server_job->worker_prev->function_next= server_job->function_next;
+
+  if (server_job->function_next == NULL)
+    function->job_end[level]= server_job->worker_prev;
+  else
+    server_job->function_next->worker_prev= server_job->worker_prev;
+
+  if (function->job_list[level] == NULL)
+    function->level_map&= ~((uint32_t)1 << level);
+
+  server_job->function_next= NULL;
+  server_job->worker_prev= NULL;
+}
+
+static void _server_job_slot_release(gearman_server_job_st *server_job)
+{
+  gearman_server_shard_st *shard= server_job->function->shard;
+  gearman_server_con_st *server_con= server_job->worker->con;
+  gearman_server_con_shard_st *con_shard= &(server_con->shard_list[shard->id]);
+
+  if (!(server_job->options & GEARMAN_SERVER_JOB_PUSHED))
+    return;
+
+  server_job->options&= (gearman_server_job_options_t)~GEARMAN_SERVER_JOB_PUSHED;
+
+  /* The slots are dropped when the connection goes away, before its jobs are
+     queued again. */
+  if (con_shard->slots_used > 0)
+  {
+    gearman_server_con_set_slots(server_con, shard, con_shard->slots,
+                                 con_shard->slots_used - 1);
+  }
+}
+
+static gearman_return_t
+_server_job_function_push(gearman_server_function_st *function)
+{
+  gearman_server_worker_st *server_worker;
+  gearman_return_t ret;
+
+  for (server_worker= function->worker_list;
+       server_worker != NULL && function->job_count > 0;
+       server_worker= server_worker->function_next)
+  {
+    ret= gearman_server_job_push(server_worker);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static bool _server_job_purge_match(gearman_server_job_st *server_job,
+                                    const char *prefix, size_t prefix_size,
+                                    gearman_job_priority_t priority,
+                                    bool cancel)
+{
+  /* A purge leaves jobs clients are waiting on alone, while a cancel fails
+     them. */
+  if (!cancel && server_job->client_list != NULL)
+    return false;
+
+  if (priority != GEARMAN_JOB_PRIORITY_MAX && server_job->priority != priority)
+    return false;
+
+  return prefix_size == 0 ||
+         (server_job->unique_size >= prefix_size &&
+          !memcmp(server_job->unique, prefix, prefix_size));
+}
+
+static gearman_server_job_st *
+_server_job_purge_batch(gearman_server_job_st *purge_list)
+{
+  gearman_server_st *server= purge_list->function->shard->server;
+  gearman_queue_record_st record[GEARMAN_SERVER_QUEUE_BATCH_SIZE];
+  gearman_server_client_st *server_client;
+  gearman_server_job_st *server_job;
+  gearman_server_job_st *next;
+  size_t record_count= 0;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  size_t job_handle_size;
+  uint32_t x;
+
+  for (x= 0, server_job= purge_list;
+       x < GEARMAN_SERVER_QUEUE_BATCH_SIZE && server_job != NULL;
+       x++, server_job= server_job->function_next)
+  {
+    if (!(server_job->options & GEARMAN_SERVER_JOB_QUEUED))
+      continue;
+
+    record[record_count].unique= server_job->unique;
+    record[record_count].unique_size= server_job->unique_size;
+    record[record_count].function_name= server_job->function->function_name;
+    record[record_count].function_name_size=
+                                   server_job->function->function_name_size;
+    record_count++;
+  }
+
+  /* Do our best to remove the jobs from the persistent queue, the same as
+     when adding a job fails. The persistence thread groups what it is handed
+     on its own. */
+  if (record_count == 0)
+    ;
+  else if (gearman_server_persist_enabled(server))
+  {
+    for (x= 0; x < record_count; x++)
+    {
+      (void)gearman_server_persist_done(server, record[x].unique,
+                                        record[x].unique_size,
+                                        record[x].function_name,
+                                        record[x].function_name_size);
+    }
+  }
+  else if (server->gearman->queue_done_fn != NULL)
+  {
+    GEARMAN_SERVER_QUEUE_LOCK(server)
+    (void)gearman_server_queue_done(server, record, record_count);
+    GEARMAN_SERVER_QUEUE_UNLOCK(server)
+  }
+
+  for (; purge_list != server_job; purge_list= next)
+  {
+    next= purge_list->function_next;
+    job_handle_size= gearman_server_job_handle(purge_list, job_handle);
+
+    for (server_client= purge_list->client_list; server_client != NULL;
+         server_client= server_client->job_next)
+    {
+      (void)gearman_server_io_packet_add(server_client->con, 0,
+                                         GEARMAN_MAGIC_RESPONSE,
+                                         GEARMAN_COMMAND_WORK_FAIL,
+                                         job_handle, job_handle_size + 1,
+                                         NULL);
+    }
+
+    gearman_server_job_free(purge_list);
+  }
+
+  return server_job;
+}
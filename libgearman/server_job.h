@@ -27,24 +27,27 @@ extern "C" {
  */
 
 /**
- * Add a new job to a server instance.
+ * Add a new job to a server instance. A background job with a when time
+ * still to come is held on the timer wheel of its shard until then.
  */
 GEARMAN_API
 gearman_server_job_st *
 gearman_server_job_add(gearman_server_st *server, const char *function_name,
                        size_t function_name_size, const char *unique,
                        size_t unique_size, const void *data, size_t data_size,
-                       gearman_job_priority_t priority,
+                       gearman_job_priority_t priority, int64_t when,
                        gearman_server_client_st *server_client,
                        gearman_return_t *ret_ptr);
 
 /**
- * Initialize a server job structure.
+ * Allocate a server job structure in a shard. The unique key is kept right
+ * after the structure, cut to GEARMAN_UNIQUE_SIZE - 1 bytes, so the job is
+ * taken from the shard slab for that size.
  */
 GEARMAN_API
 gearman_server_job_st *
-gearman_server_job_create(gearman_server_st *server,
-                          gearman_server_job_st *server_job);
+gearman_server_job_create(gearman_server_shard_st *shard, const char *unique,
+                          size_t unique_size);
 
 /**
  * Free a server job structure.
@@ -60,25 +63,134 @@ gearman_server_job_st *gearman_server_job_get(gearman_server_st *server,
                                               const char *job_handle);
 
 /**
- * See if there are any jobs to be run for the server worker connection.
+ * Write the job handle for a job. Jobs only keep the number at the end of
+ * their handle, and the rest is the prefix of their shard.
+ * @param server_job Job to get the handle for.
+ * @param job_handle Buffer of GEARMAN_JOB_HANDLE_SIZE bytes to write the
+ *        handle to, which is always NULL terminated.
+ * @return Size of the handle, not counting the NULL.
+ */
+GEARMAN_API
+size_t gearman_server_job_handle(const gearman_server_job_st *server_job,
+                                 char *job_handle);
+
+/**
+ * See if there are any jobs to be run for the server worker connection in the
+ * shard it is currently running in.
  */
 GEARMAN_API
 gearman_server_job_st *
 gearman_server_job_peek(gearman_server_con_st *server_con);
 
 /**
- * Start running a job for the server worker connection.
+ * Start running a job for the server worker connection. A worker may be
+ * running several jobs at once, and all of them are queued again when it
+ * goes away. The job comes from the function whose turn it is on the
+ * connection, see gearman_server_worker_ready.
  */
 GEARMAN_API
 gearman_server_job_st *
 gearman_server_job_take(gearman_server_con_st *server_con);
 
 /**
- * Queue a job to be run.
+ * Start running the next queued job for a server worker's function. Queued
+ * jobs that are to be ignored are freed along the way.
+ * @return The job, or NULL if none are left or the next one could not be
+ *         loaded back in from the spill file.
+ */
+GEARMAN_API
+gearman_server_job_st *
+gearman_server_job_take_worker(gearman_server_worker_st *server_worker);
+
+/**
+ * Assign jobs to a server worker while its connection has free slots in the
+ * shard of the worker's function. Each job is sent with JOB_ASSIGN_UNIQ
+ * without waiting for a GRAB_JOB, and holds its slot until it is freed or
+ * queued again.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_job_push(gearman_server_worker_st *server_worker);
+
+/**
+ * Assign one job to a server worker the same way, if it has one queued.
+ */
+GEARMAN_API
+gearman_return_t
+gearman_server_job_push_one(gearman_server_worker_st *server_worker);
+
+/**
+ * Send a job to the server worker connection running it with the given
+ * JOB_ASSIGN or JOB_ASSIGN_UNIQ command.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_job_assign(gearman_server_con_st *server_con,
+                                           gearman_server_job_st *server_job,
+                                           gearman_command_t command);
+
+/**
+ * Queue a job to be run. Workers with free slots are given it right away,
+ * otherwise sleeping workers for its function are woken up. With an affinity
+ * wait set, a job whose unique ID starts with a key and
+ * GEARMAN_AFFINITY_SEPARATOR is held for the worker the key hashes to among
+ * those for its function, so jobs with the same key go to the same worker.
  */
 GEARMAN_API
 gearman_return_t gearman_server_job_queue(gearman_server_job_st *server_job);
 
+/**
+ * Stop holding a job for the worker its affinity key prefers, and queue it
+ * for any worker. This is called once the affinity wait is over.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_job_release(gearman_server_job_st *server_job);
+
+/**
+ * Move a chained job whose current stage is complete on to the next function
+ * in its chain and queue it again. The job keeps its handle and clients, and
+ * the stage result in the packet becomes its workload unless the next stage
+ * starts with GEARMAN_CHAIN_KEEP_WORKLOAD. The job takes over the packet data
+ * when it uses it.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_job_chain(gearman_server_job_st *server_job,
+                                          gearman_packet_st *packet);
+
+/**
+ * Drop a foreground job whose last client has gone away. A queued or held
+ * job is taken off its queue and freed right away. A running job is marked
+ * to be ignored and freed when its worker finishes, and a worker connection
+ * that set the GEARMAN_ABANDON_OPTION option is sent JOB_ABANDONED for it.
+ */
+GEARMAN_API
+void gearman_server_job_abandon(gearman_server_job_st *server_job);
+
+/**
+ * Remove the jobs of a function that no worker has taken yet, including ones
+ * scheduled for later or held for a worker. They are also removed from the
+ * persistent queue.
+ * @param function Function to remove jobs from.
+ * @param prefix Only remove jobs whose unique ID starts with this.
+ * @param prefix_size Size of prefix, or 0 to match any unique ID.
+ * @param priority Only remove jobs of this priority, or
+ *        GEARMAN_JOB_PRIORITY_MAX for any.
+ * @param cancel Whether to also remove jobs clients are waiting on, sending
+ *        them a WORK_FAIL. Otherwise only background jobs are removed.
+ * @return Number of jobs removed.
+ */
+GEARMAN_API
+uint32_t gearman_server_job_purge(gearman_server_function_st *function,
+                                  const char *prefix, size_t prefix_size,
+                                  gearman_job_priority_t priority, bool cancel);
+
+/**
+ * Grow the job handle and unique ID hash tables of a shard to the given number
+ * of buckets. If jobs already exist, they are moved into the new tables a few
+ * buckets at a time as later job operations run.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_job_hash_resize(gearman_server_shard_st *shard,
+                                                uint32_t size);
+
 /** @} */
 
 #ifdef __cplusplus
@@ -0,0 +1,174 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server lock profiling definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_lock_private Private Server Lock Profiling Functions
+ * @ingroup gearman_server_lock
+ * @{
+ */
+
+/**
+ * Names for each kind of lock, in gearman_server_lock_site_t order.
+ */
+static const char *_lock_site_name[GEARMAN_SERVER_LOCK_MAX]=
+{
+  "server_thread",
+  "gearmand_thread",
+  "shard",
+  "proc"
+};
+
+/**
+ * Get the monotonic time in nanoseconds. Most locks are held for well under
+ * the microsecond gearman_time_now() gives.
+ */
+static uint64_t _lock_time_now(void);
+
+/**
+ * Record the hold time for a lock that is about to be released.
+ */
+static void _lock_hold_end(gearman_server_lock_stats_st *stats);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_lock_stats_init(gearman_server_st *server,
+                                    gearman_server_lock_stats_st *stats,
+                                    gearman_server_lock_site_t site)
+{
+  stats->site= site;
+  stats->count= 0;
+  stats->contended= 0;
+  stats->hold_start= 0;
+  gearman_histogram_init(&(stats->wait));
+  gearman_histogram_init(&(stats->hold));
+  GEARMAN_LIST_ADD(server->lock_stats, stats,)
+}
+
+void gearman_server_lock_stats_free(gearman_server_st *server,
+                                    gearman_server_lock_stats_st *stats)
+{
+  GEARMAN_LIST_DEL(server->lock_stats, stats,)
+}
+
+const char *gearman_server_lock_site_name(gearman_server_lock_site_t site)
+{
+  if (site >= GEARMAN_SERVER_LOCK_MAX)
+    return "unknown";
+
+  return _lock_site_name[site];
+}
+
+void gearman_server_lock_acquire(pthread_mutex_t *mutex,
+                                 gearman_server_lock_stats_st *stats)
+{
+  uint64_t start;
+  uint64_t now;
+
+  if (pthread_mutex_trylock(mutex) == 0)
+  {
+    now= _lock_time_now();
+    gearman_histogram_add(&(stats->wait), 0);
+  }
+  else
+  {
+    start= _lock_time_now();
+    (void) pthread_mutex_lock(mutex);
+    now= _lock_time_now();
+    stats->contended++;
+    gearman_histogram_add(&(stats->wait), now - start);
+  }
+
+  stats->count++;
+  stats->hold_start= now;
+}
+
+void gearman_server_lock_release(pthread_mutex_t *mutex,
+                                 gearman_server_lock_stats_st *stats)
+{
+  _lock_hold_end(stats);
+  (void) pthread_mutex_unlock(mutex);
+}
+
+int gearman_server_lock_try(gearman_server_st *server, pthread_mutex_t *mutex,
+                            gearman_server_lock_stats_st *stats)
+{
+  int ret;
+
+  /* A lock that was not taken is not counted, since the stats belong to
+     whoever holds it. */
+  ret= pthread_mutex_trylock(mutex);
+  if (ret != 0 || !(server->options & GEARMAN_SERVER_LOCK_STATS))
+    return ret;
+
+  stats->count++;
+  stats->hold_start= _lock_time_now();
+  gearman_histogram_add(&(stats->wait), 0);
+
+  return 0;
+}
+
+int gearman_server_lock_wait(gearman_server_st *server, pthread_cond_t *cond,
+                             pthread_mutex_t *mutex,
+                             gearman_server_lock_stats_st *stats,
+                             const struct timespec *deadline)
+{
+  int ret;
+
+  if (server->options & GEARMAN_SERVER_LOCK_STATS)
+    _lock_hold_end(stats);
+
+  if (deadline == NULL)
+    ret= pthread_cond_wait(cond, mutex);
+  else
+    ret= pthread_cond_timedwait(cond, mutex, deadline);
+
+  if (server->options & GEARMAN_SERVER_LOCK_STATS)
+    stats->hold_start= _lock_time_now();
+
+  return ret;
+}
+
+/*
+ * Private definitions
+ */
+
+static uint64_t _lock_time_now(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+    return 0;
+
+  return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static void _lock_hold_end(gearman_server_lock_stats_st *stats)
+{
+  uint64_t now= _lock_time_now();
+
+  /* The option may have been turned on while the lock was held. */
+  if (stats->hold_start != 0 && now >= stats->hold_start)
+    gearman_histogram_add(&(stats->hold), now - stats->hold_start);
+
+  stats->hold_start= 0;
+}
@@ -0,0 +1,113 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server lock profiling declarations
+ */
+
+#ifndef __GEARMAN_SERVER_LOCK_H__
+#define __GEARMAN_SERVER_LOCK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_lock Server Lock Profiling
+ * @ingroup gearman_server
+ * This is a low level interface for timing the locks the I/O and processing
+ * threads hand work over with. Each lock has stats of its own, kept under
+ * the lock they are for, so they need no locking of their own. With the
+ * GEARMAN_SERVER_LOCK_STATS server option set, every lock counts how often
+ * it was taken and how often it was already held, and keeps histograms of
+ * how long each taker waited and how long it held the lock, in nanoseconds.
+ * Without the option the locks are taken directly and nothing is recorded.
+ * The "stats" admin command adds the stats up for each kind of lock.
+ *
+ * Stats are added to the server list when the lock is created, which only
+ * happens while the server is starting up, and taken off when it is freed.
+ * @{
+ */
+
+/**
+ * Initialize the stats for a lock and add them to the server list.
+ * @param server Server the lock belongs to.
+ * @param stats Stats to initialize.
+ * @param site Kind of lock the stats are for.
+ */
+GEARMAN_API
+void gearman_server_lock_stats_init(gearman_server_st *server,
+                                    gearman_server_lock_stats_st *stats,
+                                    gearman_server_lock_site_t site);
+
+/**
+ * Take the stats for a lock off the server list.
+ */
+GEARMAN_API
+void gearman_server_lock_stats_free(gearman_server_st *server,
+                                    gearman_server_lock_stats_st *stats);
+
+/**
+ * Get the name a kind of lock is reported under.
+ */
+GEARMAN_API
+const char *gearman_server_lock_site_name(gearman_server_lock_site_t site);
+
+/**
+ * Take a lock, recording whether it was held and how long it took. Use
+ * GEARMAN_SERVER_LOCK rather than calling this directly.
+ */
+GEARMAN_API
+void gearman_server_lock_acquire(pthread_mutex_t *mutex,
+                                 gearman_server_lock_stats_st *stats);
+
+/**
+ * Release a lock taken with gearman_server_lock_acquire, recording how long
+ * it was held. Use GEARMAN_SERVER_UNLOCK rather than calling this directly.
+ */
+GEARMAN_API
+void gearman_server_lock_release(pthread_mutex_t *mutex,
+                                 gearman_server_lock_stats_st *stats);
+
+/**
+ * Try to take a lock without waiting for it.
+ * @param server Server the lock belongs to.
+ * @param mutex Lock to take.
+ * @param stats Stats for the lock. Nothing is recorded if the lock was
+ *        already held, since the stats then belong to the holder.
+ * @return 0 if the lock was taken, or the error from pthread_mutex_trylock.
+ */
+GEARMAN_API
+int gearman_server_lock_try(gearman_server_st *server, pthread_mutex_t *mutex,
+                            gearman_server_lock_stats_st *stats);
+
+/**
+ * Wait on a condition with a lock held. The time spent waiting is not
+ * counted as time the lock was held, and taking the lock back once woken is
+ * not counted as another acquisition.
+ * @param server Server the lock belongs to.
+ * @param cond Condition to wait on.
+ * @param mutex Lock held by the caller.
+ * @param stats Stats for the lock.
+ * @param deadline Time to stop waiting at, or NULL to wait until signaled.
+ * @return The result of pthread_cond_wait or pthread_cond_timedwait.
+ */
+GEARMAN_API
+int gearman_server_lock_wait(gearman_server_st *server, pthread_cond_t *cond,
+                             pthread_mutex_t *mutex,
+                             gearman_server_lock_stats_st *stats,
+                             const struct timespec *deadline);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_LOCK_H__ */
@@ -13,6 +13,64 @@
 
 #include "common.h"
 
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_private Private Server Functions
+ * @ingroup gearman_server
+ * @{
+ */
+
+/**
+ * Get the magazine packets should come from in the calling thread.
+ */
+static inline gearman_server_magazine_st *
+_server_packet_magazine(gearman_server_thread_st *thread, bool from_thread);
+
+/**
+ * Get the magazine output packets should come from in the calling thread.
+ */
+static inline gearman_server_magazine_st *
+_server_io_packet_magazine(gearman_server_thread_st *thread, bool from_thread);
+
+/**
+ * Build a packet from an argument list and queue it on a connection, with the
+ * data from a shared buffer if one is given.
+ */
+static gearman_return_t
+_server_io_packet_add(gearman_server_con_st *con,
+                      gearman_packet_options_t options,
+                      gearman_magic_t magic, gearman_command_t command,
+                      gearman_packet_buffer_st *buffer, const void *arg,
+                      va_list ap);
+
+/**
+ * Queue a packet on a connection and let its I/O thread know.
+ */
+static void _server_io_packet_queue(gearman_server_con_st *con,
+                                    gearman_server_io_packet_st *io_packet);
+
+/**
+ * Fill in a packet on the stack from an output packet, so it can be passed to
+ * the packet functions. The packet points at what the output packet holds and
+ * does not own any of it.
+ */
+static void _server_io_packet_unpack(gearman_server_con_st *con,
+                                     gearman_server_io_packet_st *io_packet,
+                                     gearman_packet_st *packet);
+
+/**
+ * Pre-packed responses that never carry arguments.
+ */
+static const uint8_t _server_packet_noop[GEARMAN_PACKET_HEADER_SIZE]=
+  { 0, 'R', 'E', 'S', 0, 0, 0, GEARMAN_COMMAND_NOOP, 0, 0, 0, 0 };
+static const uint8_t _server_packet_no_job[GEARMAN_PACKET_HEADER_SIZE]=
+  { 0, 'R', 'E', 'S', 0, 0, 0, GEARMAN_COMMAND_NO_JOB, 0, 0, 0, 0 };
+
+/** @} */
+
 /*
  * Public definitions
  */
@@ -21,36 +79,16 @@ gearman_server_packet_st *
 gearman_server_packet_create(gearman_server_thread_st *thread,
                              bool from_thread)
 {
-  gearman_server_packet_st *server_packet= NULL;
+  gearman_server_packet_st *server_packet;
 
-  if (from_thread && thread->server->options & GEARMAN_SERVER_PROC_THREAD)
-  {
-    if (thread->free_packet_count > 0)
-    {
-      server_packet= thread->free_packet_list;
-      thread->free_packet_list= server_packet->next;
-      thread->free_packet_count--;
-    }
-  }
-  else
-  {
-    if (thread->server->free_packet_count > 0)
-    {
-      server_packet= thread->server->free_packet_list;
-      thread->server->free_packet_list= server_packet->next;
-      thread->server->free_packet_count--;
-    }
-  }
+  server_packet= gearman_server_magazine_alloc(
+                                _server_packet_magazine(thread, from_thread));
 
   if (server_packet == NULL)
   {
-    server_packet= malloc(sizeof(gearman_server_packet_st));
-    if (server_packet == NULL)
-    {
-      GEARMAN_ERROR_SET(thread->gearman, "gearman_server_packet_create",
-                        "malloc")
-      return NULL;
-    }
+    GEARMAN_ERROR_SET(thread->gearman, "gearman_server_packet_create",
+                      "malloc")
+    return NULL;
   }
 
   server_packet->next= NULL;
@@ -62,129 +100,455 @@ void gearman_server_packet_free(gearman_server_packet_st *packet,
                                 gearman_server_thread_st *thread,
                                 bool from_thread)
 {
-  if (from_thread && thread->server->options & GEARMAN_SERVER_PROC_THREAD)
-  {
-    if (thread->free_packet_count < GEARMAN_MAX_FREE_SERVER_PACKET)
-    {
-      packet->next= thread->free_packet_list;
-      thread->free_packet_list= packet;
-      thread->free_packet_count++;
-    }
-    else
-      free(packet);
-  }
-  else
+  gearman_server_magazine_release(_server_packet_magazine(thread, from_thread),
+                                  packet);
+}
+
+gearman_server_io_packet_st *
+gearman_server_io_packet_create(gearman_server_thread_st *thread,
+                                bool from_thread)
+{
+  gearman_server_io_packet_st *io_packet;
+
+  io_packet= gearman_server_magazine_alloc(
+                             _server_io_packet_magazine(thread, from_thread));
+
+  if (io_packet == NULL)
   {
-    if (thread->server->free_packet_count < GEARMAN_MAX_FREE_SERVER_PACKET)
-    {
-      packet->next= thread->server->free_packet_list;
-      thread->server->free_packet_list= packet;
-      thread->server->free_packet_count++;
-    }
-    else
-      free(packet);
+    GEARMAN_ERROR_SET(thread->gearman, "gearman_server_io_packet_create",
+                      "malloc")
+    return NULL;
   }
+
+  io_packet->options= 0;
+  io_packet->argc= 0;
+  io_packet->args_size= 0;
+  io_packet->data_size= 0;
+  io_packet->io_data_size= 0;
+  io_packet->args= NULL;
+  io_packet->data= NULL;
+  io_packet->buffer= NULL;
+  io_packet->next= NULL;
+
+  return io_packet;
+}
+
+void gearman_server_io_packet_free(gearman_server_io_packet_st *io_packet,
+                                   gearman_server_thread_st *thread,
+                                   bool from_thread)
+{
+  gearman_packet_st packet;
+
+  /* Hand whatever the packet owns to a packet on the stack to free. */
+  (void)gearman_packet_create(thread->gearman, &packet);
+  packet.options= io_packet->options;
+  if (io_packet->args != io_packet->args_buffer)
+    packet.args= io_packet->args;
+  packet.data= io_packet->data;
+  packet.buffer= io_packet->buffer;
+  gearman_packet_free(&packet);
+
+  gearman_server_magazine_release(
+                    _server_io_packet_magazine(thread, from_thread), io_packet);
 }
 
 gearman_return_t gearman_server_io_packet_add(gearman_server_con_st *con,
-                                              bool take_data,
+                                              gearman_packet_options_t options,
                                               gearman_magic_t magic,
                                               gearman_command_t command,
                                               const void *arg, ...)
 {
-  gearman_server_packet_st *server_packet;
   va_list ap;
-  size_t arg_size;
   gearman_return_t ret;
 
-  server_packet= gearman_server_packet_create(con->thread, false);
-  if (server_packet == NULL)
-    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  va_start(ap, arg);
+  ret= _server_io_packet_add(con, options, magic, command, NULL, arg, ap);
+  va_end(ap);
 
-  if (gearman_packet_create(con->thread->gearman,
-                            &(server_packet->packet)) == NULL)
-  {
-    gearman_server_packet_free(server_packet, con->thread, false);
-    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
-  }
+  return ret;
+}
 
-  server_packet->packet.magic= magic;
-  server_packet->packet.command= command;
+gearman_return_t gearman_server_io_buffer_add(gearman_server_con_st *con,
+                                              gearman_packet_options_t options,
+                                              gearman_magic_t magic,
+                                              gearman_command_t command,
+                                              gearman_packet_buffer_st *buffer,
+                                              const void *arg, ...)
+{
+  va_list ap;
+  gearman_return_t ret;
 
   va_start(ap, arg);
+  ret= _server_io_packet_add(con, options, magic, command, buffer, arg, ap);
+  va_end(ap);
 
-  while (arg != NULL)
-  {
-    arg_size = va_arg(ap, size_t);
+  return ret;
+}
 
-    ret= gearman_packet_add_arg(&(server_packet->packet), arg, arg_size);
-    if (ret != GEARMAN_SUCCESS)
+gearman_return_t gearman_server_io_response_add(gearman_server_con_st *con,
+                                                gearman_command_t command,
+                                                uint8_t argc,
+                                                const void *const *arg,
+                                                const size_t *arg_size)
+{
+  gearman_server_io_packet_st *io_packet;
+  uint8_t *ptr;
+  size_t args_size;
+  uint32_t tmp;
+  uint8_t x;
+
+  io_packet= gearman_server_io_packet_create(con->thread, false);
+  if (io_packet == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  args_size= GEARMAN_PACKET_HEADER_SIZE;
+  for (x= 0; x < argc; x++)
+    args_size+= arg_size[x];
+
+  if (args_size <= GEARMAN_SERVER_IO_ARGS_SIZE)
+    io_packet->args= io_packet->args_buffer;
+  else
+  {
+    io_packet->args= malloc(args_size);
+    if (io_packet->args == NULL)
     {
-      va_end(ap);
-      gearman_packet_free(&(server_packet->packet));
-      gearman_server_packet_free(server_packet, con->thread, false);
-      return ret;
+      GEARMAN_ERROR_SET(con->thread->gearman, "gearman_server_io_response_add",
+                        "malloc")
+      gearman_server_io_packet_free(io_packet, con->thread, false);
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
     }
-
-    arg = va_arg(ap, void *);
   }
 
-  va_end(ap);
-
-  ret= gearman_packet_pack_header(&(server_packet->packet));
-  if (ret != GEARMAN_SUCCESS)
+  if (command == GEARMAN_COMMAND_NOOP)
+    memcpy(io_packet->args, _server_packet_noop, GEARMAN_PACKET_HEADER_SIZE);
+  else if (command == GEARMAN_COMMAND_NO_JOB)
+    memcpy(io_packet->args, _server_packet_no_job, GEARMAN_PACKET_HEADER_SIZE);
+  else
   {
-    gearman_packet_free(&(server_packet->packet));
-    gearman_server_packet_free(server_packet, con->thread, false);
-    return ret;
+    memcpy(io_packet->args, "\0RES", 4);
+    tmp= htonl(command);
+    memcpy(io_packet->args + 4, &tmp, 4);
+    tmp= htonl((uint32_t)(args_size - GEARMAN_PACKET_HEADER_SIZE));
+    memcpy(io_packet->args + 8, &tmp, 4);
   }
 
-  if (take_data)
-    server_packet->packet.options|= GEARMAN_PACKET_FREE_DATA;
+  ptr= io_packet->args + GEARMAN_PACKET_HEADER_SIZE;
+  for (x= 0; x < argc; x++)
+  {
+    memcpy(ptr, arg[x], arg_size[x]);
+    ptr+= arg_size[x];
+  }
 
-  GEARMAN_SERVER_THREAD_LOCK(con->thread)
-  GEARMAN_FIFO_ADD(con->io_packet, server_packet,)
-  GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+  io_packet->magic= GEARMAN_MAGIC_RESPONSE;
+  io_packet->command= command;
+  io_packet->argc= argc;
+  io_packet->args_size= args_size;
+  io_packet->options= GEARMAN_PACKET_COMPLETE;
 
-  gearman_server_con_io_add(con);
+  _server_io_packet_queue(con, io_packet);
 
   return GEARMAN_SUCCESS;
 }
 
-void gearman_server_io_packet_remove(gearman_server_con_st *con)
+gearman_server_io_packet_st *
+gearman_server_io_packet_peek(gearman_server_con_st *con)
 {
-  gearman_server_packet_st *server_packet= con->io_packet_list;
+  gearman_server_io_packet_st *io_packet;
+  gearman_server_io_packet_st *next;
 
-  gearman_packet_free(&(server_packet->packet));
+  if (con->io_packet_list == NULL)
+    GEARMAN_SERVER_QUEUE_TAKE(con->io_packet, io_packet, next,)
 
-  GEARMAN_SERVER_THREAD_LOCK(con->thread)
-  GEARMAN_FIFO_DEL(con->io_packet, server_packet,)
-  GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+  return con->io_packet_list;
+}
 
-  gearman_server_packet_free(server_packet, con->thread, true);
+gearman_return_t
+gearman_server_io_packet_send(gearman_server_con_st *con,
+                              gearman_server_io_packet_st *io_packet,
+                              bool flush)
+{
+  gearman_packet_st packet;
+  gearman_return_t ret;
+
+  _server_io_packet_unpack(con, io_packet, &packet);
+
+  ret= gearman_con_send(&(con->con), &packet, flush);
+
+  /* Sending may compress or decompress the data, and a send that has to wait
+     picks up where it left off with the data it has by then. */
+  io_packet->options= packet.options;
+  io_packet->data= packet.data;
+  io_packet->data_size= packet.data_size;
+  io_packet->buffer= packet.buffer;
+
+  packet.args= NULL;
+  packet.data= NULL;
+  packet.buffer= NULL;
+  gearman_packet_free(&packet);
+
+  return ret;
+}
+
+void gearman_server_io_packet_remove(gearman_server_con_st *con)
+{
+  gearman_server_io_packet_st *io_packet= con->io_packet_list;
+
+  if (io_packet->io_data_size > 0)
+    gearman_server_con_io_drained(con, io_packet->io_data_size);
+
+  con->io_packet_list= io_packet->next;
+  gearman_server_io_packet_free(io_packet, con->thread, true);
 }
 
 void gearman_server_proc_packet_add(gearman_server_con_st *con,
                                     gearman_server_packet_st *packet)
 {
-  GEARMAN_SERVER_THREAD_LOCK(con->thread)
-  GEARMAN_FIFO_ADD(con->proc_packet, packet,)
-  GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+  gearman_server_packet_st *next;
+
+  GEARMAN_SERVER_QUEUE_PUSH(con->proc_packet, packet,, next)
 
   gearman_server_con_proc_add(con);
 }
 
+gearman_server_packet_st *
+gearman_server_proc_packet_peek(gearman_server_con_st *con)
+{
+  gearman_server_packet_st *server_packet;
+  gearman_server_packet_st *next;
+
+  if (con->proc_packet_list == NULL)
+    GEARMAN_SERVER_QUEUE_TAKE(con->proc_packet, server_packet, next,)
+
+  return con->proc_packet_list;
+}
+
 gearman_server_packet_st *
 gearman_server_proc_packet_remove(gearman_server_con_st *con)
 {
-  gearman_server_packet_st *server_packet= con->proc_packet_list;
+  gearman_server_packet_st *server_packet;
 
+  server_packet= gearman_server_proc_packet_peek(con);
   if (server_packet == NULL)
     return NULL;
 
-  GEARMAN_SERVER_THREAD_LOCK(con->thread)
-  GEARMAN_FIFO_DEL(con->proc_packet, server_packet,)
-  GEARMAN_SERVER_THREAD_UNLOCK(con->thread)
+  con->proc_packet_list= server_packet->next;
 
   return server_packet;
 }
+
+/*
+ * Private definitions
+ */
+
+static inline gearman_server_magazine_st *
+_server_packet_magazine(gearman_server_thread_st *thread, bool from_thread)
+{
+  gearman_server_st *server= thread->server;
+  gearman_server_shard_st *shard;
+
+  if (!(server->options & GEARMAN_SERVER_PROC_THREAD))
+    return &(server->packet_magazine);
+
+  /* I/O threads use their own magazine, and each shard processing thread
+     uses the one in its shard. */
+  if (from_thread)
+    return &(thread->packet_magazine);
+
+  shard= pthread_getspecific(server->proc_key);
+  if (shard == NULL)
+    return &(server->packet_magazine);
+
+  return &(shard->packet_magazine);
+}
+
+static inline gearman_server_magazine_st *
+_server_io_packet_magazine(gearman_server_thread_st *thread, bool from_thread)
+{
+  gearman_server_st *server= thread->server;
+  gearman_server_shard_st *shard;
+
+  if (!(server->options & GEARMAN_SERVER_PROC_THREAD))
+    return &(server->io_packet_magazine);
+
+  if (from_thread)
+    return &(thread->io_packet_magazine);
+
+  shard= pthread_getspecific(server->proc_key);
+  if (shard == NULL)
+    return &(server->io_packet_magazine);
+
+  return &(shard->io_packet_magazine);
+}
+
+static gearman_return_t
+_server_io_packet_add(gearman_server_con_st *con,
+                      gearman_packet_options_t options,
+                      gearman_magic_t magic, gearman_command_t command,
+                      gearman_packet_buffer_st *buffer, const void *arg,
+                      va_list ap)
+{
+  gearman_server_io_packet_st *io_packet;
+  gearman_packet_st packet;
+  size_t arg_size;
+  gearman_return_t ret;
+
+  io_packet= gearman_server_io_packet_create(con->thread, false);
+  if (io_packet == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  /* The packet is built on the stack, and only what goes out on the wire is
+     kept in the output packet. */
+  (void)gearman_packet_create(con->thread->gearman, &packet);
+  packet.magic= magic;
+  packet.command= command;
+  /* The data is only taken once nothing else can fail. */
+  packet.options|= (options &
+                    (gearman_packet_options_t)~GEARMAN_PACKET_FREE_DATA);
+
+  while (arg != NULL)
+  {
+    arg_size = va_arg(ap, size_t);
+
+    ret= gearman_packet_add_arg(&packet, arg, arg_size);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      gearman_packet_free(&packet);
+      gearman_server_io_packet_free(io_packet, con->thread, false);
+      return ret;
+    }
+
+    arg = va_arg(ap, void *);
+  }
+
+  if (buffer != NULL)
+    gearman_packet_set_buffer(&packet, buffer);
+
+  ret= gearman_packet_pack_header(&packet);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    gearman_packet_free(&packet);
+    gearman_server_io_packet_free(io_packet, con->thread, false);
+    return ret;
+  }
+
+  /* Arguments too large for the output packet keep their own allocation, or
+     get one if they were built in the packet on the stack. */
+  if (packet.args_size <= GEARMAN_SERVER_IO_ARGS_SIZE)
+    io_packet->args= io_packet->args_buffer;
+  else if (packet.args == packet.args_buffer)
+  {
+    io_packet->args= malloc(packet.args_size);
+    if (io_packet->args == NULL)
+    {
+      GEARMAN_ERROR_SET(con->thread->gearman, "_server_io_packet_add", "malloc")
+      gearman_packet_free(&packet);
+      gearman_server_io_packet_free(io_packet, con->thread, false);
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+  }
+
+  if (options & GEARMAN_PACKET_FREE_DATA)
+    packet.options|= GEARMAN_PACKET_FREE_DATA;
+
+  /* Packed packets may be written without going through gearman_con_send, so
+     peers that did not ask for compression get the data decompressed here. */
+  if (options & GEARMAN_PACKET_COMPRESSED &&
+      !(con->con.options & GEARMAN_CON_COMPRESSION))
+  {
+    ret= gearman_packet_decompress(&packet);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      /* The data was not replaced, so leave it with the caller. */
+      packet.options&= (gearman_packet_options_t)~GEARMAN_PACKET_FREE_DATA;
+      gearman_packet_free(&packet);
+      gearman_server_io_packet_free(io_packet, con->thread, false);
+      return ret;
+    }
+  }
+
+  if (io_packet->args == NULL)
+    io_packet->args= packet.args;
+  else if (packet.args_size > 0)
+    memcpy(io_packet->args, packet.args, packet.args_size);
+
+  io_packet->options= packet.options;
+  io_packet->magic= packet.magic;
+  io_packet->command= packet.command;
+  io_packet->argc= packet.argc;
+  io_packet->args_size= packet.args_size;
+  io_packet->data= packet.data;
+  io_packet->data_size= packet.data_size;
+  io_packet->buffer= packet.buffer;
+
+  packet.args= NULL;
+  packet.data= NULL;
+  packet.buffer= NULL;
+  gearman_packet_free(&packet);
+
+  _server_io_packet_queue(con, io_packet);
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _server_io_packet_queue(gearman_server_con_st *con,
+                                    gearman_server_io_packet_st *io_packet)
+{
+  gearman_server_io_packet_st *next;
+
+  /* Streamed work data is what a slow client piles up, so count it against
+     the client until it is sent. */
+  if (io_packet->command == GEARMAN_COMMAND_WORK_DATA ||
+      io_packet->command == GEARMAN_COMMAND_WORK_WARNING)
+  {
+    io_packet->io_data_size= io_packet->args_size + io_packet->data_size;
+    (void)__sync_add_and_fetch(&(con->io_data_size), io_packet->io_data_size);
+  }
+
+  GEARMAN_SERVER_QUEUE_PUSH(con->io_packet, io_packet,, next)
+
+  gearman_server_con_io_add(con);
+}
+
+static void _server_io_packet_unpack(gearman_server_con_st *con,
+                                     gearman_server_io_packet_st *io_packet,
+                                     gearman_packet_st *packet)
+{
+  uint8_t *ptr;
+  uint8_t *end;
+  uint8_t *next;
+  uint8_t x;
+
+  (void)gearman_packet_create(con->thread->gearman, packet);
+  packet->options= io_packet->options;
+  packet->magic= io_packet->magic;
+  packet->command= io_packet->command;
+  packet->args_size= io_packet->args_size;
+  packet->data_size= io_packet->data_size;
+  packet->args= io_packet->args;
+  packet->data= io_packet->data;
+  packet->buffer= io_packet->buffer;
+
+  if (io_packet->args_size <= GEARMAN_PACKET_HEADER_SIZE)
+    return;
+
+  /* Every argument but the last ends in a NUL, and so does the last when the
+     data follows it. */
+  ptr= io_packet->args + GEARMAN_PACKET_HEADER_SIZE;
+  end= io_packet->args + io_packet->args_size;
+  for (x= 0; x < io_packet->argc; x++)
+  {
+    next= end;
+    if (x + 1 < io_packet->argc ||
+        gearman_command_info_list[io_packet->command].data)
+    {
+      next= memchr(ptr, 0, (size_t)(end - ptr));
+      next= next == NULL ? end : next + 1;
+    }
+
+    packet->arg[x]= ptr;
+    packet->arg_size[x]= (size_t)(next - ptr);
+    ptr= next;
+  }
+
+  packet->argc= io_packet->argc;
+}
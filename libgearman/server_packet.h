@@ -42,18 +42,104 @@ void gearman_server_packet_free(gearman_server_packet_st *packet,
                                 gearman_server_thread_st *thread,
                                 bool from_thread);
 
+/**
+ * Initialize a server output packet structure. Output packets only hold the
+ * packed header and arguments of a packet to send, with a reference to its
+ * data, so they are much smaller than the packets read from connections.
+ */
+GEARMAN_API
+gearman_server_io_packet_st *
+gearman_server_io_packet_create(gearman_server_thread_st *thread,
+                                bool from_thread);
+
+/**
+ * Free a server output packet structure, along with the arguments and data
+ * it owns.
+ */
+GEARMAN_API
+void gearman_server_io_packet_free(gearman_server_io_packet_st *io_packet,
+                                   gearman_server_thread_st *thread,
+                                   bool from_thread);
+
 /**
  * Add a server packet structure to io queue for a connection.
+ * @param con Connection to queue the packet on.
+ * @param options Options to set on the packet, GEARMAN_PACKET_FREE_DATA to
+ *        take the data and GEARMAN_PACKET_COMPRESSED if it is compressed.
+ * @param magic Magic type of the packet.
+ * @param command Packet command.
+ * @param arg List of argument and size pairs, ending with NULL.
+ * @return Standard gearman return value.
  */
 GEARMAN_API
 gearman_return_t gearman_server_io_packet_add(gearman_server_con_st *con,
-                                              bool take_data,
+                                              gearman_packet_options_t options,
                                               gearman_magic_t magic,
                                               gearman_command_t command,
                                               const void *arg, ...);
 
+/**
+ * Add a server packet structure to io queue for a connection, with the data
+ * coming from a shared buffer instead of the argument list.
+ * @param con Connection to queue the packet on.
+ * @param options Options to set on the packet, GEARMAN_PACKET_COMPRESSED if
+ *        the data is compressed.
+ * @param magic Magic type of the packet.
+ * @param command Packet command.
+ * @param buffer Buffer from gearman_packet_share_data to send as the data.
+ * @param arg List of argument and size pairs, ending with NULL.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_io_buffer_add(gearman_server_con_st *con,
+                                              gearman_packet_options_t options,
+                                              gearman_magic_t magic,
+                                              gearman_command_t command,
+                                              gearman_packet_buffer_st *buffer,
+                                              const void *arg, ...);
+
+/**
+ * Add a response packet without data to io queue for a connection, encoding
+ * it straight into the packet buffer. This is the fast path for frequent
+ * replies such as NOOP, NO_JOB, JOB_CREATED and STATUS_RES; replies without
+ * arguments are copied from pre-packed headers. Arguments must be sized the
+ * way gearman_server_io_packet_add takes them.
+ * @param con Connection to queue the response on.
+ * @param command Response command.
+ * @param argc Number of arguments, which must match the command.
+ * @param arg List of arguments, or NULL if argc is 0.
+ * @param arg_size List of argument sizes, or NULL if argc is 0.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_io_response_add(gearman_server_con_st *con,
+                                                gearman_command_t command,
+                                                uint8_t argc,
+                                                const void *const *arg,
+                                                const size_t *arg_size);
+
+/**
+ * Get the first server packet structure from io queue for a connection,
+ * without removing it. Only the I/O thread for the connection may call this.
+ */
+GEARMAN_API
+gearman_server_io_packet_st *
+gearman_server_io_packet_peek(gearman_server_con_st *con);
+
+/**
+ * Send a packet from the io queue for a connection through gearman_con_send,
+ * for protocols that don't take the packed bytes as they are. This may be
+ * called again with the same packet after it returns GEARMAN_IO_WAIT.
+ */
+GEARMAN_API
+gearman_return_t
+gearman_server_io_packet_send(gearman_server_con_st *con,
+                              gearman_server_io_packet_st *io_packet,
+                              bool flush);
+
 /**
  * Remove the first server packet structure from io queue for a connection.
+ * This must follow a gearman_server_io_packet_peek that found a packet.
  */
 GEARMAN_API
 void gearman_server_io_packet_remove(gearman_server_con_st *con);
@@ -65,6 +151,14 @@ GEARMAN_API
 void gearman_server_proc_packet_add(gearman_server_con_st *con,
                                     gearman_server_packet_st *packet);
 
+/**
+ * Get the first server packet structure from proc queue for a connection,
+ * without removing it. Only the thread running the connection may call this.
+ */
+GEARMAN_API
+gearman_server_packet_st *
+gearman_server_proc_packet_peek(gearman_server_con_st *con);
+
 /**
  * Remove the first server packet structure from proc queue for a connection.
  */
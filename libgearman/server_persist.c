@@ -0,0 +1,572 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server persistence thread definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_persist_private Private Server Persistence Thread Functions
+ * @ingroup gearman_server_persist
+ * @{
+ */
+
+/**
+ * Main function for the persistence thread.
+ */
+static void *_server_persist_thread(void *data);
+
+/**
+ * Run one batch of requests against the queue module.
+ * @return Number of requests run.
+ */
+static uint32_t _server_persist_run(gearman_server_st *server,
+                                    gearman_server_persist_req_st *list);
+
+/**
+ * Pass a run of add or done requests to the queue module, then free them.
+ */
+static void _server_persist_group(gearman_server_st *server,
+                                  gearman_server_persist_req_st **group,
+                                  uint32_t group_count,
+                                  gearman_server_persist_count_st *count);
+
+/**
+ * Create a request along with room for its names and data.
+ */
+static gearman_server_persist_req_st *
+_server_persist_req_create(gearman_server_st *server,
+                           gearman_server_persist_type_t type,
+                           const char *unique, size_t unique_size,
+                           const char *function_name,
+                           size_t function_name_size, const void *data,
+                           size_t data_size);
+
+/**
+ * Append a request to the queue and wake the persistence thread.
+ */
+static void _server_persist_queue(gearman_server_persist_st *persist,
+                                  gearman_server_persist_req_st *req);
+
+/**
+ * Get the microseconds the oldest request has been waiting. The persistence
+ * lock must be held.
+ */
+static uint64_t _server_persist_lag(gearman_server_persist_st *persist);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_persist_init(gearman_server_persist_st *persist)
+{
+  persist->started= false;
+  persist->shutdown= false;
+  persist->pending= 0;
+  persist->pending_max= 0;
+  persist->add_count= 0;
+  persist->done_count= 0;
+  persist->commit_count= 0;
+  persist->fail_count= 0;
+  persist->batch_time.tv_sec= 0;
+  persist->batch_time.tv_usec= 0;
+  persist->list= NULL;
+  persist->end= NULL;
+}
+
+bool gearman_server_persist_enabled(gearman_server_st *server)
+{
+  return server->persist.started;
+}
+
+gearman_return_t gearman_server_persist_start(gearman_server_st *server)
+{
+  gearman_server_persist_st *persist= &(server->persist);
+
+  if (!(server->queue_persist_thread) || server->gearman->queue_add_fn == NULL)
+    return GEARMAN_SUCCESS;
+
+  if (pthread_mutex_init(&(persist->lock), NULL) != 0)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_persist_start",
+                      "pthread_mutex_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  if (pthread_cond_init(&(persist->cond), NULL) != 0)
+  {
+    (void) pthread_mutex_destroy(&(persist->lock));
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_persist_start",
+                      "pthread_cond_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  /* A background replay may call into the module at the same time. */
+  server->queue_shared= true;
+
+  if (pthread_create(&(persist->id), NULL, _server_persist_thread,
+                     server) != 0)
+  {
+    (void) pthread_cond_destroy(&(persist->cond));
+    (void) pthread_mutex_destroy(&(persist->lock));
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_persist_start",
+                      "pthread_create")
+    return GEARMAN_PTHREAD;
+  }
+
+  persist->started= true;
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_server_persist_stop(gearman_server_st *server)
+{
+  gearman_server_persist_st *persist= &(server->persist);
+
+  if (!(persist->started))
+    return;
+
+  (void) pthread_mutex_lock(&(persist->lock));
+  persist->shutdown= true;
+  (void) pthread_cond_signal(&(persist->cond));
+  (void) pthread_mutex_unlock(&(persist->lock));
+
+  (void) pthread_join(persist->id, NULL);
+
+  (void) pthread_cond_destroy(&(persist->cond));
+  (void) pthread_mutex_destroy(&(persist->lock));
+  persist->started= false;
+  persist->shutdown= false;
+}
+
+gearman_return_t gearman_server_persist_add(gearman_server_st *server,
+                                            const char *unique,
+                                            size_t unique_size,
+                                            const char *function_name,
+                                            size_t function_name_size,
+                                            const void *data, size_t data_size,
+                                            gearman_job_priority_t priority,
+                                            int64_t when)
+{
+  gearman_server_persist_req_st *req;
+
+  req= _server_persist_req_create(server, GEARMAN_SERVER_PERSIST_ADD, unique,
+                                  unique_size, function_name,
+                                  function_name_size, data, data_size);
+  if (req == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  req->priority= priority;
+  req->when= when;
+  _server_persist_queue(&(server->persist), req);
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearman_server_persist_done(gearman_server_st *server,
+                                             const char *unique,
+                                             size_t unique_size,
+                                             const char *function_name,
+                                             size_t function_name_size)
+{
+  gearman_server_persist_req_st *req;
+
+  if (server->gearman->queue_done_fn == NULL)
+    return GEARMAN_SUCCESS;
+
+  req= _server_persist_req_create(server, GEARMAN_SERVER_PERSIST_DONE, unique,
+                                  unique_size, function_name,
+                                  function_name_size, NULL, 0);
+  if (req == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  _server_persist_queue(&(server->persist), req);
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearman_server_persist_commit(gearman_server_st *server,
+                                         gearman_queue_commit_done_fn *done_fn,
+                                         void *done_arg)
+{
+  gearman_server_persist_req_st *req;
+
+  req= _server_persist_req_create(server, GEARMAN_SERVER_PERSIST_COMMIT, NULL,
+                                  0, NULL, 0, NULL, 0);
+  if (req == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  req->done_fn= done_fn;
+  req->done_arg= done_arg;
+  _server_persist_queue(&(server->persist), req);
+
+  return GEARMAN_SUCCESS;
+}
+
+size_t gearman_server_persist_status(gearman_server_st *server, char *buffer,
+                                     size_t buffer_size)
+{
+  gearman_server_persist_st *persist= &(server->persist);
+  uint64_t lag;
+  int size;
+
+  if (!(persist->started))
+  {
+    snprintf(buffer, buffer_size, "inline\n");
+    return strlen(buffer);
+  }
+
+  (void) pthread_mutex_lock(&(persist->lock));
+
+  lag= _server_persist_lag(persist);
+
+  size= snprintf(buffer, buffer_size,
+                 "%u\t%u\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64
+                 "\n", persist->pending, persist->pending_max,
+                 persist->add_count, persist->done_count,
+                 persist->commit_count, persist->fail_count, lag);
+
+  (void) pthread_mutex_unlock(&(persist->lock));
+
+  if (size < 0)
+    return 0;
+  if ((size_t)size >= buffer_size)
+    return buffer_size - 1;
+
+  return (size_t)size;
+}
+
+bool gearman_server_persist_backlog(gearman_server_st *server,
+                                    uint32_t *pending, uint64_t *lag)
+{
+  gearman_server_persist_st *persist= &(server->persist);
+
+  if (!(persist->started))
+    return false;
+
+  (void) pthread_mutex_lock(&(persist->lock));
+  *pending= persist->pending;
+  *lag= _server_persist_lag(persist);
+  (void) pthread_mutex_unlock(&(persist->lock));
+
+  return true;
+}
+
+/*
+ * Private definitions
+ */
+
+static void *_server_persist_thread(void *data)
+{
+  gearman_server_st *server= (gearman_server_st *)data;
+  gearman_server_persist_st *persist= &(server->persist);
+  gearman_server_persist_req_st *list;
+  uint32_t count;
+
+  while (1)
+  {
+    (void) pthread_mutex_lock(&(persist->lock));
+    while (persist->list == NULL && !(persist->shutdown))
+      (void) pthread_cond_wait(&(persist->cond), &(persist->lock));
+
+    /* Shutdown only happens once nothing else can queue requests, so an
+       empty queue here means we are done. */
+    if (persist->list == NULL)
+    {
+      (void) pthread_mutex_unlock(&(persist->lock));
+      break;
+    }
+
+    list= persist->list;
+    persist->list= NULL;
+    persist->end= NULL;
+    persist->batch_time= list->time;
+    (void) pthread_mutex_unlock(&(persist->lock));
+
+    count= _server_persist_run(server, list);
+
+    (void) pthread_mutex_lock(&(persist->lock));
+    persist->pending-= count;
+    persist->batch_time.tv_sec= 0;
+    persist->batch_time.tv_usec= 0;
+    (void) pthread_mutex_unlock(&(persist->lock));
+  }
+
+  return NULL;
+}
+
+static uint32_t _server_persist_run(gearman_server_st *server,
+                                    gearman_server_persist_req_st *list)
+{
+  gearman_server_persist_st *persist= &(server->persist);
+  gearman_st *gearman= server->gearman;
+  gearman_server_persist_req_st *req;
+  gearman_server_persist_req_st *group[GEARMAN_SERVER_QUEUE_BATCH_SIZE];
+  gearman_server_persist_req_st *commit_list= NULL;
+  gearman_server_persist_req_st *commit_end= NULL;
+  gearman_server_persist_count_st count;
+  gearman_return_t ret;
+  uint32_t group_count= 0;
+
+  count.ret= GEARMAN_SUCCESS;
+  count.run= 0;
+  count.add= 0;
+  count.done= 0;
+  count.fail= 0;
+
+  GEARMAN_SERVER_QUEUE_LOCK(server)
+
+  while (list != NULL)
+  {
+    req= list;
+    list= req->next;
+    count.run++;
+
+    if (req->type == GEARMAN_SERVER_PERSIST_COMMIT)
+    {
+      /* Commits wait until everything in the batch has been added. */
+      req->next= NULL;
+      if (commit_list == NULL)
+        commit_list= req;
+      else
+        commit_end->next= req;
+      commit_end= req;
+      continue;
+    }
+
+    /* Runs of adds or removals go to the module together. */
+    if (group_count == GEARMAN_SERVER_QUEUE_BATCH_SIZE ||
+        (group_count > 0 && group[0]->type != req->type))
+    {
+      _server_persist_group(server, group, group_count, &count);
+      group_count= 0;
+    }
+
+    group[group_count]= req;
+    group_count++;
+  }
+
+  if (group_count > 0)
+    _server_persist_group(server, group, group_count, &count);
+
+  /* Modules with their own commit get one call per commit, the rest get one
+     flush for the whole batch. */
+  if (gearman->queue_commit_fn == NULL || commit_list == NULL)
+  {
+    if ((count.add > 0 || commit_list != NULL) &&
+        gearman->queue_flush_fn != NULL)
+    {
+      ret= (*(gearman->queue_flush_fn))(gearman,
+                                        (void *)gearman->queue_fn_arg);
+      if (ret != GEARMAN_SUCCESS)
+      {
+        GEARMAN_ERROR(gearman, "Could not flush the queue:%d", ret)
+        count.fail++;
+        if (count.ret == GEARMAN_SUCCESS)
+          count.ret= ret;
+      }
+    }
+  }
+
+  while (commit_list != NULL)
+  {
+    req= commit_list;
+    commit_list= req->next;
+
+    if (gearman->queue_commit_fn == NULL || count.ret != GEARMAN_SUCCESS)
+      (*(req->done_fn))(req->done_arg, count.ret);
+    else
+    {
+      ret= (*(gearman->queue_commit_fn))(gearman,
+                                         (void *)gearman->queue_fn_arg,
+                                         req->done_fn, req->done_arg);
+      if (ret != GEARMAN_SUCCESS)
+        (*(req->done_fn))(req->done_arg, ret);
+    }
+
+    free(req);
+  }
+
+  GEARMAN_SERVER_QUEUE_UNLOCK(server)
+
+  (void) pthread_mutex_lock(&(persist->lock));
+  persist->add_count+= count.add;
+  persist->done_count+= count.done;
+  persist->fail_count+= count.fail;
+  (void) pthread_mutex_unlock(&(persist->lock));
+
+  return count.run;
+}
+
+static void _server_persist_group(gearman_server_st *server,
+                                  gearman_server_persist_req_st **group,
+                                  uint32_t group_count,
+                                  gearman_server_persist_count_st *count)
+{
+  gearman_queue_record_st record[GEARMAN_SERVER_QUEUE_BATCH_SIZE];
+  gearman_return_t ret;
+  uint32_t x;
+
+  for (x= 0; x < group_count; x++)
+  {
+    record[x].priority= group[x]->priority;
+    record[x].when= group[x]->when;
+    record[x].unique= group[x]->unique;
+    record[x].unique_size= group[x]->unique_size;
+    record[x].function_name= group[x]->function_name;
+    record[x].function_name_size= group[x]->function_name_size;
+    record[x].data= group[x]->data;
+    record[x].data_size= group[x]->data_size;
+  }
+
+  if (group[0]->type == GEARMAN_SERVER_PERSIST_ADD)
+  {
+    ret= gearman_server_queue_add(server, record, group_count);
+    if (ret == GEARMAN_SUCCESS)
+      count->add+= group_count;
+    else
+    {
+      GEARMAN_ERROR(server->gearman, "Could not add %u jobs to the queue:%d",
+                    group_count, ret)
+      count->fail+= group_count;
+      if (count->ret == GEARMAN_SUCCESS)
+        count->ret= ret;
+    }
+  }
+  else
+  {
+    ret= gearman_server_queue_done(server, record, group_count);
+    if (ret == GEARMAN_SUCCESS)
+      count->done+= group_count;
+    else
+    {
+      GEARMAN_ERROR(server->gearman,
+                    "Could not remove %u jobs from the queue:%d", group_count,
+                    ret)
+      count->fail+= group_count;
+    }
+  }
+
+  for (x= 0; x < group_count; x++)
+    free(group[x]);
+}
+
+static gearman_server_persist_req_st *
+_server_persist_req_create(gearman_server_st *server,
+                           gearman_server_persist_type_t type,
+                           const char *unique, size_t unique_size,
+                           const char *function_name,
+                           size_t function_name_size, const void *data,
+                           size_t data_size)
+{
+  gearman_server_persist_req_st *req;
+  char *ptr;
+
+  /* The names and data share the allocation, the names NULL terminated. */
+  req= malloc(sizeof(gearman_server_persist_req_st) + unique_size +
+              function_name_size + data_size + 2);
+  if (req == NULL)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "_server_persist_req_create", "malloc")
+    return NULL;
+  }
+
+  ptr= (char *)(req + 1);
+
+  req->type= type;
+  req->priority= GEARMAN_JOB_PRIORITY_NORMAL;
+  req->when= 0;
+  req->unique_size= unique_size;
+  req->function_name_size= function_name_size;
+  req->data_size= data_size;
+  req->next= NULL;
+  req->done_fn= NULL;
+  req->done_arg= NULL;
+
+  req->unique= ptr;
+  if (unique_size > 0)
+    memcpy(ptr, unique, unique_size);
+  ptr[unique_size]= 0;
+  ptr+= unique_size + 1;
+
+  req->function_name= ptr;
+  if (function_name_size > 0)
+    memcpy(ptr, function_name, function_name_size);
+  ptr[function_name_size]= 0;
+  ptr+= function_name_size + 1;
+
+  if (data_size > 0)
+  {
+    req->data= ptr;
+    memcpy(ptr, data, data_size);
+  }
+  else
+    req->data= NULL;
+
+  (void) gettimeofday(&(req->time), NULL);
+
+  return req;
+}
+
+static void _server_persist_queue(gearman_server_persist_st *persist,
+                                  gearman_server_persist_req_st *req)
+{
+  (void) pthread_mutex_lock(&(persist->lock));
+
+  if (persist->end == NULL)
+  {
+    persist->list= req;
+    (void) pthread_cond_signal(&(persist->cond));
+  }
+  else
+    persist->end->next= req;
+  persist->end= req;
+
+  if (req->type == GEARMAN_SERVER_PERSIST_COMMIT)
+    persist->commit_count++;
+
+  persist->pending++;
+  if (persist->pending > persist->pending_max)
+    persist->pending_max= persist->pending;
+
+  (void) pthread_mutex_unlock(&(persist->lock));
+}
+
+static uint64_t _server_persist_lag(gearman_server_persist_st *persist)
+{
+  struct timeval now;
+  struct timeval oldest;
+
+  (void) gettimeofday(&now, NULL);
+
+  /* Requests the thread is running are older than the ones still queued. */
+  if (persist->batch_time.tv_sec != 0)
+    oldest= persist->batch_time;
+  else if (persist->list != NULL)
+    oldest= persist->list->time;
+  else
+    return 0;
+
+  if (now.tv_sec < oldest.tv_sec ||
+      (now.tv_sec == oldest.tv_sec && now.tv_usec <= oldest.tv_usec))
+  {
+    return 0;
+  }
+
+  return (uint64_t)(now.tv_sec - oldest.tv_sec) * 1000000 +
+         (uint64_t)(now.tv_usec) - (uint64_t)(oldest.tv_usec);
+}
@@ -0,0 +1,122 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server persistence thread declarations
+ */
+
+#ifndef __GEARMAN_SERVER_PERSIST_H__
+#define __GEARMAN_SERVER_PERSIST_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_persist Server Persistence Thread
+ * @ingroup gearman_server
+ * This is a low level interface for moving persistent queue calls off the
+ * shard processing threads. Shards append add, done, and commit requests to
+ * one queue, and a persistence thread runs them against the queue module in
+ * the order they were made. Each pass takes everything that is waiting, so a
+ * slow module gets bigger batches instead of holding up dispatch. Background
+ * job replies still wait for their jobs to be committed through the group
+ * commit, which hands its commits to this thread too. This is only used with
+ * processing threads.
+ * @{
+ */
+
+/**
+ * Initialize the persistence thread state for a server.
+ */
+GEARMAN_API
+void gearman_server_persist_init(gearman_server_persist_st *persist);
+
+/**
+ * See if persistent queue calls should go through the persistence thread.
+ */
+GEARMAN_API
+bool gearman_server_persist_enabled(gearman_server_st *server);
+
+/**
+ * Start the persistence thread.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_persist_start(gearman_server_st *server);
+
+/**
+ * Run all waiting requests, then stop the persistence thread and wait for it
+ * to exit. Nothing may add requests once this is called.
+ */
+GEARMAN_API
+void gearman_server_persist_stop(gearman_server_st *server);
+
+/**
+ * Queue a job to be added to the persistent queue. The names and data are
+ * copied, so the job may finish before the request runs.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_persist_add(gearman_server_st *server,
+                                            const char *unique,
+                                            size_t unique_size,
+                                            const char *function_name,
+                                            size_t function_name_size,
+                                            const void *data, size_t data_size,
+                                            gearman_job_priority_t priority,
+                                            int64_t when);
+
+/**
+ * Queue a job to be removed from the persistent queue. A failure here is
+ * logged and counted by the persistence thread, since the job is gone from
+ * the server either way.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_persist_done(gearman_server_st *server,
+                                             const char *unique,
+                                             size_t unique_size,
+                                             const char *function_name,
+                                             size_t function_name_size);
+
+/**
+ * Queue a commit of everything added before it. The done function is called
+ * from the persistence thread once the commit finishes, the same way queue
+ * modules call it for gearman_queue_commit_fn.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_persist_commit(gearman_server_st *server,
+                                         gearman_queue_commit_done_fn *done_fn,
+                                         void *done_arg);
+
+/**
+ * Write backlog figures for the "persist" admin command: requests waiting,
+ * the most that have waited at once, jobs added, jobs removed, commits,
+ * failed requests, and the microseconds the oldest waiting request has been
+ * waiting.
+ */
+GEARMAN_API
+size_t gearman_server_persist_status(gearman_server_st *server, char *buffer,
+                                     size_t buffer_size);
+
+/**
+ * Get the requests waiting and the microseconds the oldest one has been
+ * waiting, as "persist" reports them.
+ * @return false if persistent queue calls are made inline, in which case
+ *         nothing is set.
+ */
+GEARMAN_API
+bool gearman_server_persist_backlog(gearman_server_st *server,
+                                    uint32_t *pending, uint64_t *lag);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_PERSIST_H__ */
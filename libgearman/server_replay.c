@@ -0,0 +1,414 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server background queue replay definitions
+ */
+
+#include "common.h"
+
+#include <sched.h>
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_replay_private Private Server Background Queue Replay Functions
+ * @ingroup gearman_server_replay
+ * @{
+ */
+
+/**
+ * Main function for the replay thread.
+ */
+static void *_server_replay_thread(void *data);
+
+/**
+ * Add callback given to the queue module. This only copies the job into the
+ * chunk for its shard, and hands the chunk over once it is full.
+ */
+static gearman_return_t _server_replay_add(gearman_st *gearman, void *fn_arg,
+                                           const void *unique,
+                                           size_t unique_size,
+                                           const void *function_name,
+                                           size_t function_name_size,
+                                           const void *data, size_t data_size,
+                                           gearman_job_priority_t priority,
+                                           int64_t when);
+
+/**
+ * Hand a chunk over to a shard and wake its processing thread.
+ */
+static void _server_replay_queue(gearman_server_shard_st *shard,
+                                 gearman_server_replay_chunk_st *chunk);
+
+/**
+ * Free a chunk along with the jobs still in it.
+ */
+static void _server_replay_chunk_free(gearman_server_replay_chunk_st *chunk);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_replay_init(gearman_server_replay_st *replay)
+{
+  replay->started= false;
+  replay->thread_started= false;
+  replay->running= false;
+  replay->stop= false;
+  replay->ret= GEARMAN_SUCCESS;
+  replay->read_count= 0;
+  replay->add_count= 0;
+  replay->start= 0;
+  replay->end= 0;
+  replay->chunk_list= NULL;
+}
+
+bool gearman_server_replay_enabled(gearman_server_st *server)
+{
+  return server->queue_replay_background &&
+         server->options & GEARMAN_SERVER_PROC_THREAD &&
+         server->gearman->options & GEARMAN_QUEUE_REPLAY_CONCURRENT;
+}
+
+gearman_return_t gearman_server_replay_start(gearman_server_st *server)
+{
+  gearman_server_replay_st *replay= &(server->replay);
+
+  replay->chunk_list= calloc(server->shard_count,
+                             sizeof(gearman_server_replay_chunk_st *));
+  if (replay->chunk_list == NULL)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replay_start", "calloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  /* Nothing is connected yet, so no processing thread is in the queue
+     module while this changes how it is locked. */
+  server->queue_shared= true;
+
+  replay->started= true;
+  replay->running= true;
+  replay->start= time(NULL);
+
+  if (pthread_create(&(replay->id), NULL, _server_replay_thread, server) != 0)
+  {
+    replay->running= false;
+    replay->ret= GEARMAN_PTHREAD;
+    free(replay->chunk_list);
+    replay->chunk_list= NULL;
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replay_start",
+                      "pthread_create")
+    return GEARMAN_PTHREAD;
+  }
+
+  replay->thread_started= true;
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_server_replay_stop(gearman_server_st *server)
+{
+  gearman_server_replay_st *replay= &(server->replay);
+
+  if (!(replay->thread_started))
+    return;
+
+  replay->stop= true;
+  (void) pthread_join(replay->id, NULL);
+  replay->thread_started= false;
+
+  free(replay->chunk_list);
+  replay->chunk_list= NULL;
+}
+
+bool gearman_server_replay_run(gearman_server_shard_st *shard)
+{
+  gearman_server_st *server= shard->server;
+  gearman_server_replay_chunk_st *chunk;
+  gearman_server_replay_job_st *job;
+  gearman_server_job_st *server_job;
+  gearman_return_t ret;
+  uint32_t added= 0;
+  uint32_t x;
+
+  GEARMAN_SERVER_LOCK(shard->server, &(shard->proc_lock),
+                      &(shard->proc_lock_stats))
+  chunk= shard->replay_list;
+  if (chunk != NULL)
+  {
+    shard->replay_list= chunk->next;
+    if (shard->replay_list == NULL)
+      shard->replay_end= NULL;
+  }
+  GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                        &(shard->proc_lock_stats))
+
+  if (chunk == NULL)
+    return false;
+
+  shard->queue_replay= true;
+
+  for (x= 0; x < chunk->count; x++)
+  {
+    job= &(chunk->job[x]);
+
+    server_job= gearman_server_job_add(server, job->name,
+                                       job->function_name_size,
+                                       job->name + job->function_name_size + 1,
+                                       job->unique_size, job->data,
+                                       job->data_size, job->priority,
+                                       job->when, NULL, &ret);
+    if (ret == GEARMAN_SUCCESS)
+      added++;
+    else
+    {
+      if (job->data != NULL)
+        free(job->data);
+
+      /* A job with this unique key was submitted since the server started.
+         That job takes the place of the replayed one, including removing it
+         from the persistent queue once it is done. */
+      if (ret == GEARMAN_JOB_EXISTS)
+        server_job->options|= GEARMAN_SERVER_JOB_QUEUED;
+      else
+      {
+        GEARMAN_ERROR(server->gearman, "Could not add replayed job %.*s:%d",
+                      (int)(job->unique_size),
+                      job->name + job->function_name_size + 1, ret)
+      }
+    }
+
+    free(job->name);
+  }
+
+  shard->queue_replay= false;
+
+  (void) __sync_fetch_and_add(&(server->replay.add_count), (uint64_t)added);
+
+  free(chunk);
+
+  return true;
+}
+
+void gearman_server_replay_free(gearman_server_shard_st *shard)
+{
+  gearman_server_replay_chunk_st *chunk;
+
+  while (shard->replay_list != NULL)
+  {
+    chunk= shard->replay_list;
+    shard->replay_list= chunk->next;
+    _server_replay_chunk_free(chunk);
+  }
+
+  shard->replay_end= NULL;
+}
+
+size_t gearman_server_replay_status(gearman_server_st *server, char *buffer,
+                                    size_t buffer_size)
+{
+  gearman_server_replay_st *replay= &(server->replay);
+  const char *state;
+  time_t end;
+  int size;
+
+  /* The counts are only written by the replay and processing threads, so a
+     loose read is fine. */
+  if (!(replay->started))
+    state= "none";
+  else if (replay->running)
+    state= "running";
+  else if (replay->stop)
+    state= "stopped";
+  else if (replay->ret != GEARMAN_SUCCESS)
+    state= "failed";
+  else
+    state= "done";
+
+  end= replay->running ? time(NULL) : replay->end;
+
+  size= snprintf(buffer, buffer_size, "%s\t%"PRIu64"\t%"PRIu64"\t%lu\n", state,
+                 replay->read_count, replay->add_count,
+                 replay->started ? (unsigned long)(end - replay->start) : 0UL);
+  if (size < 0)
+    return 0;
+  if ((size_t)size >= buffer_size)
+    return buffer_size - 1;
+
+  return (size_t)size;
+}
+
+/*
+ * Private definitions
+ */
+
+static void *_server_replay_thread(void *data)
+{
+  gearman_server_st *server= (gearman_server_st *)data;
+  gearman_server_replay_st *replay= &(server->replay);
+  gearman_st *gearman= server->gearman;
+  gearman_return_t ret;
+  uint32_t x;
+
+  GEARMAN_INFO(gearman, "Replaying queue in the background")
+
+  GEARMAN_SERVER_QUEUE_LOCK(server)
+  ret= (*(gearman->queue_replay_fn))(gearman, (void *)gearman->queue_fn_arg,
+                                     _server_replay_add, server);
+  GEARMAN_SERVER_QUEUE_UNLOCK(server)
+
+  /* Jobs read before a failure are still good, so add them too. */
+  for (x= 0; x < server->shard_count; x++)
+  {
+    if (replay->chunk_list[x] != NULL)
+    {
+      _server_replay_queue(&(server->shard_list[x]), replay->chunk_list[x]);
+      replay->chunk_list[x]= NULL;
+    }
+  }
+
+  replay->ret= ret;
+  replay->end= time(NULL);
+  __sync_synchronize();
+  replay->running= false;
+
+  if (ret == GEARMAN_SUCCESS)
+  {
+    GEARMAN_INFO(gearman, "Queue replay read %"PRIu64" jobs in %lu seconds",
+                 replay->read_count,
+                 (unsigned long)(replay->end - replay->start))
+  }
+  else if (!(replay->stop))
+  {
+    GEARMAN_ERROR(gearman, "Queue replay failed after %"PRIu64" jobs:%d",
+                  replay->read_count, ret)
+  }
+
+  return NULL;
+}
+
+static gearman_return_t _server_replay_add(gearman_st *gearman,
+                                           void *fn_arg, const void *unique,
+                                           size_t unique_size,
+                                           const void *function_name,
+                                           size_t function_name_size,
+                                           const void *data, size_t data_size,
+                                           gearman_job_priority_t priority,
+                                           int64_t when)
+{
+  gearman_server_st *server= (gearman_server_st *)fn_arg;
+  gearman_server_replay_st *replay= &(server->replay);
+  gearman_server_shard_st *shard;
+  gearman_server_replay_chunk_st *chunk;
+  gearman_server_replay_job_st *job;
+
+  /* The job stays with the module when this fails. */
+  if (replay->stop)
+    return GEARMAN_SHUTDOWN;
+
+  shard= gearman_server_shard_function(server, function_name,
+                                       function_name_size);
+
+  chunk= replay->chunk_list[shard->id];
+  if (chunk == NULL)
+  {
+    chunk= malloc(sizeof(gearman_server_replay_chunk_st));
+    if (chunk == NULL)
+    {
+      GEARMAN_ERROR_SET(gearman, "_server_replay_add", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    chunk->count= 0;
+    chunk->next= NULL;
+    replay->chunk_list[shard->id]= chunk;
+  }
+
+  job= &(chunk->job[chunk->count]);
+
+  /* The function name and unique key share one allocation. */
+  job->name= malloc(function_name_size + unique_size + 2);
+  if (job->name == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "_server_replay_add", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  memcpy(job->name, function_name, function_name_size);
+  job->name[function_name_size]= 0;
+  memcpy(job->name + function_name_size + 1, unique, unique_size);
+  job->name[function_name_size + unique_size + 1]= 0;
+  job->function_name_size= function_name_size;
+  job->unique_size= unique_size;
+  job->data= (void *)data;
+  job->data_size= data_size;
+  job->priority= priority;
+  job->when= when;
+
+  chunk->count++;
+  replay->read_count++;
+
+  if (chunk->count == GEARMAN_SERVER_REPLAY_CHUNK_SIZE)
+  {
+    replay->chunk_list[shard->id]= NULL;
+    _server_replay_queue(shard, chunk);
+  }
+
+  /* Let processing threads that are waiting to add or finish jobs have the
+     queue for a moment. */
+  if (replay->read_count % GEARMAN_SERVER_REPLAY_CHUNK_SIZE == 0)
+  {
+    GEARMAN_SERVER_QUEUE_UNLOCK(server)
+    (void) sched_yield();
+    GEARMAN_SERVER_QUEUE_LOCK(server)
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _server_replay_queue(gearman_server_shard_st *shard,
+                                 gearman_server_replay_chunk_st *chunk)
+{
+  GEARMAN_SERVER_LOCK(shard->server, &(shard->proc_lock),
+                      &(shard->proc_lock_stats))
+
+  if (shard->replay_end == NULL)
+    shard->replay_list= chunk;
+  else
+    shard->replay_end->next= chunk;
+  shard->replay_end= chunk;
+
+  if (!(shard->proc_wakeup))
+  {
+    shard->proc_wakeup= true;
+    (void) pthread_cond_signal(&(shard->proc_cond));
+  }
+
+  GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                        &(shard->proc_lock_stats))
+}
+
+static void _server_replay_chunk_free(gearman_server_replay_chunk_st *chunk)
+{
+  uint32_t x;
+
+  for (x= 0; x < chunk->count; x++)
+  {
+    if (chunk->job[x].data != NULL)
+      free(chunk->job[x].data);
+    free(chunk->job[x].name);
+  }
+
+  free(chunk);
+}
@@ -0,0 +1,91 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server background queue replay declarations
+ */
+
+#ifndef __GEARMAN_SERVER_REPLAY_H__
+#define __GEARMAN_SERVER_REPLAY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_replay Server Background Queue Replay
+ * @ingroup gearman_server
+ * This is a low level interface for replaying the persistent queue while the
+ * server is already running. A replay thread reads jobs from the queue module
+ * and groups them into chunks for the shard that owns each function. Every
+ * shard processing thread adds one chunk at a time under its shard lock, and
+ * runs its connections between chunks, so workers are served while the rest
+ * of the queue loads. The replay thread only holds the queue lock while it is
+ * in the module, and gives it up between chunks so new jobs and finished ones
+ * still reach the queue. This needs processing threads and a module that set
+ * GEARMAN_QUEUE_REPLAY_CONCURRENT.
+ * @{
+ */
+
+/**
+ * Initialize the replay state for a server.
+ */
+GEARMAN_API
+void gearman_server_replay_init(gearman_server_replay_st *replay);
+
+/**
+ * See if the persistent queue can be replayed in the background.
+ */
+GEARMAN_API
+bool gearman_server_replay_enabled(gearman_server_st *server);
+
+/**
+ * Start the replay thread.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_replay_start(gearman_server_st *server);
+
+/**
+ * Stop the replay thread if it is still running and wait for it to exit.
+ * Jobs it did not get to stay in the persistent queue for the next start.
+ */
+GEARMAN_API
+void gearman_server_replay_stop(gearman_server_st *server);
+
+/**
+ * Add the next chunk of replayed jobs waiting for a shard. Jobs that are
+ * already in the server under the same unique key are dropped, and the job
+ * that is there takes over removing it from the persistent queue.
+ * @param shard Shard to add jobs to, with its lock held.
+ * @return True if a chunk was added and there may be more.
+ */
+GEARMAN_API
+bool gearman_server_replay_run(gearman_server_shard_st *shard);
+
+/**
+ * Free chunks of replayed jobs that were never added to a shard.
+ */
+GEARMAN_API
+void gearman_server_replay_free(gearman_server_shard_st *shard);
+
+/**
+ * Write replay progress for the "replay" admin command: the state, the jobs
+ * read from the queue, the jobs added, and the seconds the replay has run.
+ */
+GEARMAN_API
+size_t gearman_server_replay_status(gearman_server_st *server, char *buffer,
+                                    size_t buffer_size);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_REPLAY_H__ */
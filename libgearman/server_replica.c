@@ -0,0 +1,1690 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server background job replication definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_replica_private Private Server Background Job Replication Functions
+ * @ingroup gearman_server_replica
+ * @{
+ */
+
+/**
+ * Bucket in a job table for a key.
+ */
+#define _REPLICA_BUCKET(__hash, __key) \
+  (&((__hash)[(__key) & (GEARMAN_SERVER_REPLICA_HASH_SIZE - 1)]))
+
+/**
+ * Add message of a job table entry.
+ */
+#define _REPLICA_MESSAGE(__entry) ((uint8_t *)((__entry) + 1))
+
+/**
+ * Main function for the thread streaming to a peer.
+ */
+static void *_replica_peer_thread(void *data);
+
+/**
+ * Send a peer every job, with the replica lock not held.
+ */
+static bool _replica_resync(gearman_server_replica_peer_st *peer, int fd,
+                            uint8_t **buffer, size_t *total);
+
+/**
+ * Send a peer new events in batches until it needs a resync, with the
+ * replica lock held.
+ * @return True if the peer needs a resync, false if the connection should
+ *         be closed.
+ */
+static bool _replica_stream(gearman_server_replica_peer_st *peer, int fd,
+                            uint8_t **buffer, size_t *total);
+
+/**
+ * Send what is in the buffer followed by a sync, and wait for the peer to
+ * acknowledge it.
+ */
+static bool _replica_sync(gearman_server_replica_peer_st *peer, int fd,
+                          uint8_t **buffer, size_t *total, size_t size,
+                          uint64_t seq);
+
+/**
+ * Connect to a peer and exchange magic.
+ */
+static int _replica_connect(gearman_server_replica_peer_st *peer);
+
+/**
+ * Main function for the standby listener thread.
+ */
+static void *_replica_listen_thread(void *data);
+
+/**
+ * Create the standby listening sockets.
+ */
+static gearman_return_t _replica_listen(gearman_server_st *server);
+
+/**
+ * Read and apply messages from a primary until the connection is closed.
+ */
+static void _replica_standby(gearman_server_st *server, int fd,
+                             uint8_t **buffer, size_t *total);
+
+/**
+ * Apply one message from a primary, with the replica lock held.
+ */
+static bool _replica_apply(gearman_server_st *server, const uint8_t *message,
+                           size_t size);
+
+/**
+ * Size of the message at the start of a buffer.
+ * @return Size of the message, 0 if it is not all there yet, or SIZE_MAX if
+ *         it is not valid.
+ */
+static size_t _replica_message_size(const uint8_t *buffer, size_t size);
+
+/**
+ * Find the link to a job in a table, pointing to NULL if it is not there.
+ */
+static gearman_server_replica_entry_st **
+_replica_entry_find(gearman_server_replica_entry_st **hash, uint64_t key,
+                    const char *job_handle, size_t job_handle_size);
+
+/**
+ * Add a job to a table, replacing one with the same job handle.
+ * @return True if a job was replaced.
+ */
+static bool _replica_entry_insert(gearman_server_replica_entry_st **hash,
+                                  gearman_server_replica_entry_st *entry);
+
+/**
+ * Free every job in a table, leaving the table itself.
+ */
+static void _replica_entry_free_all(gearman_server_replica_entry_st **hash);
+
+/**
+ * See if a peer has events held for it.
+ */
+static bool _replica_holding(gearman_server_replica_peer_st *peer);
+
+/**
+ * Add an event for peers, with the replica lock held.
+ */
+static void _replica_event_add(gearman_server_replica_st *replica,
+                               const uint8_t *message, size_t size);
+
+/**
+ * Free events every peer has been sent, sending the furthest behind peers
+ * everything again when too much is held for them.
+ */
+static void _replica_trim(gearman_server_replica_st *replica);
+
+/**
+ * Add bytes to a growing buffer.
+ */
+static bool _replica_append(uint8_t **buffer, size_t *total, size_t *size,
+                            const void *data, size_t data_size);
+
+/**
+ * Send or receive a whole buffer.
+ */
+static bool _replica_send(int fd, const void *data, size_t size);
+static bool _replica_recv(int fd, void *data, size_t size);
+
+/**
+ * Set the options every replication connection uses.
+ */
+static void _replica_socket(int fd);
+
+/**
+ * Store and read 64-bit numbers in network byte order.
+ */
+static void _replica_pack64(uint8_t *ptr, uint64_t value);
+static uint64_t _replica_unpack64(const uint8_t *ptr);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_replica_init(gearman_server_replica_st *replica)
+{
+  replica->started= false;
+  replica->shutdown= false;
+  replica->promoted= false;
+  replica->standby_connected= false;
+  replica->listening= false;
+  replica->listen_port= 0;
+  replica->listen_count= 0;
+  replica->peer_count= 0;
+  replica->waiting= 0;
+  replica->entry_count= 0;
+  replica->standby_count= 0;
+  replica->seq= 0;
+  replica->event_size= 0;
+  replica->standby_seq= 0;
+  replica->standby_connect_count= 0;
+  replica->peer_list= NULL;
+  replica->entry_hash= NULL;
+  replica->standby_hash= NULL;
+  replica->event_list= NULL;
+  replica->event_end= NULL;
+  replica->listen_fd= NULL;
+}
+
+void gearman_server_replica_free(gearman_server_st *server)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  gearman_server_replica_peer_st *peer;
+  gearman_server_replica_event_st *event;
+  uint32_t x;
+
+  if (replica->started)
+  {
+    (void) pthread_mutex_lock(&(replica->lock));
+    replica->shutdown= true;
+    (void) pthread_cond_broadcast(&(replica->cond));
+    (void) pthread_mutex_unlock(&(replica->lock));
+
+    /* Peers are sent what is left before their threads exit. */
+    for (peer= replica->peer_list; peer != NULL; peer= peer->next)
+    {
+      if (peer->started)
+      {
+        (void) pthread_join(peer->id, NULL);
+        peer->started= false;
+      }
+    }
+
+    if (replica->listening)
+    {
+      (void) pthread_join(replica->listen_id, NULL);
+      replica->listening= false;
+    }
+
+    (void) pthread_cond_destroy(&(replica->cond));
+    (void) pthread_mutex_destroy(&(replica->lock));
+    replica->started= false;
+  }
+
+  for (x= 0; x < replica->listen_count; x++)
+    (void) close(replica->listen_fd[x]);
+  replica->listen_count= 0;
+
+  if (replica->listen_fd != NULL)
+  {
+    free(replica->listen_fd);
+    replica->listen_fd= NULL;
+  }
+
+  while (replica->peer_list != NULL)
+  {
+    peer= replica->peer_list;
+    replica->peer_list= peer->next;
+    free(peer->host);
+    free(peer);
+  }
+  replica->peer_count= 0;
+
+  while (replica->event_list != NULL)
+  {
+    event= replica->event_list;
+    replica->event_list= event->next;
+    free(event);
+  }
+  replica->event_end= NULL;
+  replica->event_size= 0;
+
+  if (replica->entry_hash != NULL)
+  {
+    _replica_entry_free_all(replica->entry_hash);
+    free(replica->entry_hash);
+    replica->entry_hash= NULL;
+  }
+
+  if (replica->standby_hash != NULL)
+  {
+    _replica_entry_free_all(replica->standby_hash);
+    free(replica->standby_hash);
+    replica->standby_hash= NULL;
+  }
+}
+
+gearman_return_t gearman_server_replica_peer_add(gearman_server_st *server,
+                                                 const char *host,
+                                                 in_port_t port)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  gearman_server_replica_peer_st *peer;
+  gearman_server_replica_peer_st **end;
+
+  peer= malloc(sizeof(gearman_server_replica_peer_st));
+  if (peer == NULL)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_peer_add",
+                      "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  peer->host= strdup(host);
+  if (peer->host == NULL)
+  {
+    free(peer);
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_peer_add",
+                      "strdup")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  peer->state= GEARMAN_SERVER_REPLICA_PEER_CONNECTING;
+  peer->started= false;
+  peer->resync= false;
+  peer->port= port;
+  peer->sent_seq= 0;
+  peer->ack_seq= 0;
+  peer->connect_count= 0;
+  peer->resync_count= 0;
+  peer->server= server;
+  peer->next= NULL;
+
+  /* Keep peers in the order they were given for the status list. */
+  end= &(replica->peer_list);
+  while (*end != NULL)
+    end= &((*end)->next);
+  *end= peer;
+  replica->peer_count++;
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_server_replica_set_listen(gearman_server_st *server,
+                                       in_port_t port)
+{
+  server->replica.listen_port= port;
+}
+
+gearman_return_t gearman_server_replica_start(gearman_server_st *server)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  gearman_server_replica_peer_st *peer;
+  gearman_return_t ret;
+
+  if (replica->peer_count == 0 && replica->listen_port == 0)
+    return GEARMAN_SUCCESS;
+
+  if (replica->peer_count > 0)
+  {
+    replica->entry_hash= calloc(GEARMAN_SERVER_REPLICA_HASH_SIZE,
+                                sizeof(gearman_server_replica_entry_st *));
+    if (replica->entry_hash == NULL)
+    {
+      GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                        "calloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+  }
+
+  if (replica->listen_port != 0)
+  {
+    replica->standby_hash= calloc(GEARMAN_SERVER_REPLICA_HASH_SIZE,
+                                  sizeof(gearman_server_replica_entry_st *));
+    if (replica->standby_hash == NULL)
+    {
+      GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                        "calloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    ret= _replica_listen(server);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  if (pthread_mutex_init(&(replica->lock), NULL) != 0)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                      "pthread_mutex_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  if (pthread_cond_init(&(replica->cond), NULL) != 0)
+  {
+    (void) pthread_mutex_destroy(&(replica->lock));
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                      "pthread_cond_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  /* From here on gearman_server_replica_free stops whatever was started. */
+  replica->started= true;
+
+  for (peer= replica->peer_list; peer != NULL; peer= peer->next)
+  {
+    if (pthread_create(&(peer->id), NULL, _replica_peer_thread, peer) != 0)
+    {
+      GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                        "pthread_create")
+      return GEARMAN_PTHREAD;
+    }
+
+    peer->started= true;
+  }
+
+  if (replica->listen_count > 0)
+  {
+    if (pthread_create(&(replica->listen_id), NULL, _replica_listen_thread,
+                       server) != 0)
+    {
+      GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                        "pthread_create")
+      return GEARMAN_PTHREAD;
+    }
+
+    replica->listening= true;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+bool gearman_server_replica_enabled(gearman_server_st *server)
+{
+  return server->replica.started && server->replica.entry_hash != NULL;
+}
+
+gearman_return_t gearman_server_replica_add(gearman_server_st *server,
+                                            gearman_server_job_st *server_job,
+                                            const char *function_name,
+                                            size_t function_name_size,
+                                            const char *unique,
+                                            size_t unique_size,
+                                            const void *data,
+                                            size_t data_size)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  gearman_server_replica_entry_st *entry;
+  uint8_t *message;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  size_t job_handle_size;
+  size_t size;
+  uint32_t tmp;
+  uint16_t tmp16;
+
+  job_handle_size= gearman_server_job_handle(server_job, job_handle);
+  size= GEARMAN_SERVER_REPLICA_ADD_SIZE + job_handle_size +
+        function_name_size + unique_size + data_size;
+
+  /* The entry is built before taking the lock, and kept for resyncs. */
+  entry= malloc(sizeof(gearman_server_replica_entry_st) + size);
+  if (entry == NULL)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_add", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  entry->key= gearman_server_hash64(job_handle, job_handle_size);
+  entry->size= size;
+  entry->job_handle_size= job_handle_size;
+
+  message= _REPLICA_MESSAGE(entry);
+  message[0]= GEARMAN_SERVER_REPLICA_ADD;
+  message[1]= (uint8_t)(server_job->priority);
+  _replica_pack64(message + 2, (uint64_t)(server_job->when));
+  tmp16= htons((uint16_t)job_handle_size);
+  memcpy(message + 10, &tmp16, 2);
+  tmp16= htons((uint16_t)function_name_size);
+  memcpy(message + 12, &tmp16, 2);
+  tmp= htonl((uint32_t)unique_size);
+  memcpy(message + 14, &tmp, 4);
+  tmp= htonl((uint32_t)data_size);
+  memcpy(message + 18, &tmp, 4);
+
+  message+= GEARMAN_SERVER_REPLICA_ADD_SIZE;
+  memcpy(message, job_handle, job_handle_size);
+  message+= job_handle_size;
+  memcpy(message, function_name, function_name_size);
+  message+= function_name_size;
+  memcpy(message, unique, unique_size);
+  if (data_size > 0)
+    memcpy(message + unique_size, data, data_size);
+
+  (void) pthread_mutex_lock(&(replica->lock));
+  if (!_replica_entry_insert(replica->entry_hash, entry))
+    replica->entry_count++;
+  _replica_event_add(replica, _REPLICA_MESSAGE(entry), size);
+  (void) pthread_mutex_unlock(&(replica->lock));
+
+  server_job->options|= GEARMAN_SERVER_JOB_REPLICATED;
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_server_replica_done(gearman_server_st *server,
+                                 gearman_server_job_st *server_job)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  gearman_server_replica_entry_st **link;
+  gearman_server_replica_entry_st *entry;
+  uint8_t message[GEARMAN_SERVER_REPLICA_DONE_SIZE + GEARMAN_JOB_HANDLE_SIZE];
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  size_t job_handle_size;
+  uint64_t key;
+  uint16_t tmp16;
+
+  job_handle_size= gearman_server_job_handle(server_job, job_handle);
+  key= gearman_server_hash64(job_handle, job_handle_size);
+
+  message[0]= GEARMAN_SERVER_REPLICA_DONE;
+  tmp16= htons((uint16_t)job_handle_size);
+  memcpy(message + 1, &tmp16, 2);
+  memcpy(message + GEARMAN_SERVER_REPLICA_DONE_SIZE, job_handle,
+         job_handle_size);
+
+  (void) pthread_mutex_lock(&(replica->lock));
+
+  link= _replica_entry_find(replica->entry_hash, key, job_handle,
+                            job_handle_size);
+  entry= *link;
+  if (entry != NULL)
+  {
+    *link= entry->next;
+    replica->entry_count--;
+  }
+
+  _replica_event_add(replica, message,
+                     GEARMAN_SERVER_REPLICA_DONE_SIZE + job_handle_size);
+
+  (void) pthread_mutex_unlock(&(replica->lock));
+
+  if (entry != NULL)
+    free(entry);
+
+  server_job->options&= (gearman_server_job_options_t)
+                        ~GEARMAN_SERVER_JOB_REPLICATED;
+}
+
+gearman_return_t gearman_server_replica_promote(gearman_server_st *server,
+                                                uint32_t *added)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  gearman_server_replica_entry_st **hash;
+  gearman_server_replica_entry_st *entry;
+  const uint8_t *message;
+  const char *function_name;
+  const char *unique;
+  size_t job_handle_size;
+  size_t function_name_size;
+  size_t unique_size;
+  size_t data_size;
+  uint32_t tmp;
+  uint16_t tmp16;
+  uint32_t x;
+  void *data;
+  gearman_return_t ret;
+
+  *added= 0;
+
+  if (!(replica->started) || replica->standby_hash == NULL)
+  {
+    /* Promoting twice is fine, there is just nothing left to add. */
+    return replica->promoted ? GEARMAN_SUCCESS : GEARMAN_INVALID_COMMAND;
+  }
+
+  /* Take the table so nothing the primary sends from now on is applied. The
+     listener closes the connection once it sees the flag. */
+  (void) pthread_mutex_lock(&(replica->lock));
+  hash= replica->standby_hash;
+  replica->standby_hash= NULL;
+  replica->standby_count= 0;
+  replica->promoted= true;
+  (void) pthread_mutex_unlock(&(replica->lock));
+
+  for (x= 0; x < GEARMAN_SERVER_REPLICA_HASH_SIZE; x++)
+  {
+    while (hash[x] != NULL)
+    {
+      entry= hash[x];
+      hash[x]= entry->next;
+
+      message= _REPLICA_MESSAGE(entry);
+      job_handle_size= entry->job_handle_size;
+      memcpy(&tmp16, message + 12, 2);
+      function_name_size= ntohs(tmp16);
+      memcpy(&tmp, message + 14, 4);
+      unique_size= ntohl(tmp);
+      memcpy(&tmp, message + 18, 4);
+      data_size= ntohl(tmp);
+
+      function_name= (const char *)message + GEARMAN_SERVER_REPLICA_ADD_SIZE +
+                     job_handle_size;
+      unique= function_name + function_name_size;
+
+      if (data_size == 0)
+        data= NULL;
+      else
+      {
+        /* Jobs own their payloads. */
+        data= malloc(data_size);
+        if (data == NULL)
+        {
+          GEARMAN_ERROR(server->gearman, "Could not promote job %.*s:malloc",
+                        (int)job_handle_size,
+                        (const char *)message +
+                        GEARMAN_SERVER_REPLICA_ADD_SIZE)
+          free(entry);
+          continue;
+        }
+
+        memcpy(data, unique + unique_size, data_size);
+      }
+
+      (void)gearman_server_job_add(server, function_name, function_name_size,
+                                   unique, unique_size, data, data_size,
+                                   (gearman_job_priority_t)message[1],
+                                   (int64_t)_replica_unpack64(message + 2),
+                                   NULL, &ret);
+      if (ret == GEARMAN_SUCCESS)
+        (*added)++;
+      else
+      {
+        if (data != NULL)
+          free(data);
+
+        if (ret != GEARMAN_JOB_EXISTS)
+        {
+          GEARMAN_ERROR(server->gearman, "Could not promote job %.*s:%d",
+                        (int)job_handle_size,
+                        (const char *)message +
+                        GEARMAN_SERVER_REPLICA_ADD_SIZE, ret)
+        }
+      }
+
+      free(entry);
+    }
+  }
+
+  free(hash);
+
+  GEARMAN_INFO(server->gearman, "Promoted replication standby with %u jobs",
+               *added)
+
+  return GEARMAN_SUCCESS;
+}
+
+size_t gearman_server_replica_status(gearman_server_st *server, char *buffer,
+                                     size_t buffer_size)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  gearman_server_replica_peer_st *peer;
+  const char *state;
+  size_t size= 0;
+  int ret;
+
+  if (!(replica->started))
+  {
+    snprintf(buffer, buffer_size, ".\n");
+    return strlen(buffer);
+  }
+
+  (void) pthread_mutex_lock(&(replica->lock));
+
+  for (peer= replica->peer_list; peer != NULL; peer= peer->next)
+  {
+    if (peer->state == GEARMAN_SERVER_REPLICA_PEER_STREAMING)
+      state= peer->resync ? "resync" : "streaming";
+    else if (peer->state == GEARMAN_SERVER_REPLICA_PEER_SYNCING)
+      state= "syncing";
+    else
+      state= "connecting";
+
+    ret= snprintf(buffer + size, buffer_size - size,
+                  "peer\t%s:%u\t%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64
+                  "\n", peer->host, (uint32_t)(peer->port), state,
+                  peer->sent_seq, peer->ack_seq, replica->seq - peer->ack_seq,
+                  peer->connect_count);
+    if (ret < 0 || (size_t)ret >= buffer_size - size)
+      break;
+    size+= (size_t)ret;
+  }
+
+  if (replica->listen_port != 0)
+  {
+    if (replica->promoted)
+      state= "promoted";
+    else if (replica->standby_connected)
+      state= "connected";
+    else
+      state= "waiting";
+
+    ret= snprintf(buffer + size, buffer_size - size,
+                  "standby\t%u\t%s\t%u\t%"PRIu64"\t%"PRIu64"\n",
+                  (uint32_t)(replica->listen_port), state,
+                  replica->standby_count, replica->standby_seq,
+                  replica->standby_connect_count);
+    if (ret > 0 && (size_t)ret < buffer_size - size)
+      size+= (size_t)ret;
+  }
+
+  (void) pthread_mutex_unlock(&(replica->lock));
+
+  /* Always leave room to end the list. */
+  if (size + 3 > buffer_size)
+    size= buffer_size - 3;
+  memcpy(buffer + size, ".\n", 3);
+
+  return size + 2;
+}
+
+/*
+ * Private definitions
+ */
+
+static void *_replica_peer_thread(void *data)
+{
+  gearman_server_replica_peer_st *peer= (gearman_server_replica_peer_st *)data;
+  gearman_server_st *server= peer->server;
+  gearman_server_replica_st *replica= &(server->replica);
+  struct timespec deadline;
+  struct timeval now;
+  uint8_t *buffer= NULL;
+  size_t total= 0;
+  bool logged= false;
+  int fd;
+
+  (void) pthread_mutex_lock(&(replica->lock));
+
+  while (!(replica->shutdown))
+  {
+    (void) pthread_mutex_unlock(&(replica->lock));
+    fd= _replica_connect(peer);
+    (void) pthread_mutex_lock(&(replica->lock));
+
+    if (fd == -1)
+    {
+      /* Only log the first of a run of failures. */
+      if (!logged)
+      {
+        GEARMAN_ERROR(server->gearman, "Could not connect to replication peer "
+                      "%s:%u", peer->host, (uint32_t)(peer->port))
+        logged= true;
+      }
+
+      if (!(replica->shutdown))
+      {
+        (void) gettimeofday(&now, NULL);
+        deadline.tv_sec= now.tv_sec + GEARMAN_SERVER_REPLICA_RETRY;
+        deadline.tv_nsec= now.tv_usec * 1000;
+        (void) pthread_cond_timedwait(&(replica->cond), &(replica->lock),
+                                      &deadline);
+      }
+
+      continue;
+    }
+
+    GEARMAN_INFO(server->gearman, "Connected to replication peer %s:%u",
+                 peer->host, (uint32_t)(peer->port))
+    logged= false;
+    peer->connect_count++;
+
+    do
+    {
+      /* Everything from here on is held for the peer, so whatever changes
+         while the jobs are being sent goes out after them. */
+      peer->state= GEARMAN_SERVER_REPLICA_PEER_SYNCING;
+      peer->resync= false;
+      peer->sent_seq= replica->seq;
+      peer->resync_count++;
+      (void) pthread_mutex_unlock(&(replica->lock));
+
+      if (!_replica_resync(peer, fd, &buffer, &total))
+      {
+        (void) pthread_mutex_lock(&(replica->lock));
+        break;
+      }
+
+      (void) pthread_mutex_lock(&(replica->lock));
+      peer->state= GEARMAN_SERVER_REPLICA_PEER_STREAMING;
+    }
+    while (_replica_stream(peer, fd, &buffer, &total));
+
+    peer->state= GEARMAN_SERVER_REPLICA_PEER_CONNECTING;
+    _replica_trim(replica);
+
+    if (!(replica->shutdown))
+    {
+      GEARMAN_ERROR(server->gearman, "Lost replication peer %s:%u",
+                    peer->host, (uint32_t)(peer->port))
+    }
+
+    (void) close(fd);
+  }
+
+  (void) pthread_mutex_unlock(&(replica->lock));
+
+  if (buffer != NULL)
+    free(buffer);
+
+  return NULL;
+}
+
+static bool _replica_resync(gearman_server_replica_peer_st *peer, int fd,
+                            uint8_t **buffer, size_t *total)
+{
+  gearman_server_replica_st *replica= &(peer->server->replica);
+  gearman_server_replica_entry_st *entry;
+  uint8_t reset= GEARMAN_SERVER_REPLICA_RESET;
+  size_t size= 0;
+  uint32_t x= 0;
+  bool ret= true;
+
+  if (!_replica_append(buffer, total, &size, &reset, 1))
+    return false;
+
+  /* The lock is only held while copying a batch. A job that changes after
+     its bucket was copied has an event after the sync, so the peer still
+     ends up with the same jobs. */
+  while (x < GEARMAN_SERVER_REPLICA_HASH_SIZE)
+  {
+    (void) pthread_mutex_lock(&(replica->lock));
+    for (; x < GEARMAN_SERVER_REPLICA_HASH_SIZE &&
+           size < GEARMAN_SERVER_REPLICA_BATCH_SIZE; x++)
+    {
+      for (entry= replica->entry_hash[x]; entry != NULL; entry= entry->next)
+      {
+        ret= _replica_append(buffer, total, &size, _REPLICA_MESSAGE(entry),
+                             entry->size);
+        if (!ret)
+          break;
+      }
+
+      if (!ret)
+        break;
+    }
+    (void) pthread_mutex_unlock(&(replica->lock));
+
+    if (!ret)
+      return false;
+
+    if (x == GEARMAN_SERVER_REPLICA_HASH_SIZE)
+      break;
+
+    if (!_replica_send(fd, *buffer, size))
+      return false;
+    size= 0;
+  }
+
+  /* Only this thread changes where the peer was sent up to. */
+  return _replica_sync(peer, fd, buffer, total, size, peer->sent_seq);
+}
+
+static bool _replica_stream(gearman_server_replica_peer_st *peer, int fd,
+                            uint8_t **buffer, size_t *total)
+{
+  gearman_server_replica_st *replica= &(peer->server->replica);
+  gearman_server_replica_event_st *event;
+  struct timespec deadline;
+  struct timeval now;
+  size_t size;
+  uint64_t seq;
+  bool ret;
+
+  while (1)
+  {
+    /* Wait for events, sending a sync now and then so a dead peer is seen
+       even when nothing is happening. */
+    (void) gettimeofday(&now, NULL);
+    deadline.tv_sec= now.tv_sec + GEARMAN_SERVER_REPLICA_KEEPALIVE;
+    deadline.tv_nsec= now.tv_usec * 1000;
+    while (!(replica->shutdown) && !(peer->resync) &&
+           peer->sent_seq == replica->seq)
+    {
+      replica->waiting++;
+      ret= pthread_cond_timedwait(&(replica->cond), &(replica->lock),
+                                  &deadline) == ETIMEDOUT;
+      replica->waiting--;
+      if (ret)
+        break;
+    }
+
+    if (peer->resync)
+      return !(replica->shutdown);
+
+    /* Once shutting down, the peer is sent what is left and let go. */
+    if (replica->shutdown && peer->sent_seq == replica->seq)
+      return false;
+
+    size= 0;
+    seq= peer->sent_seq;
+    for (event= replica->event_list; event != NULL &&
+         size < GEARMAN_SERVER_REPLICA_BATCH_SIZE; event= event->next)
+    {
+      if (event->seq <= seq)
+        continue;
+
+      if (!_replica_append(buffer, total, &size, event + 1, event->size))
+        return false;
+
+      seq= event->seq;
+    }
+
+    /* Events are copied, so they can go as soon as every peer has them. */
+    peer->sent_seq= seq;
+    _replica_trim(replica);
+
+    (void) pthread_mutex_unlock(&(replica->lock));
+    ret= _replica_sync(peer, fd, buffer, total, size, seq);
+    (void) pthread_mutex_lock(&(replica->lock));
+
+    if (!ret)
+      return false;
+  }
+}
+
+static bool _replica_sync(gearman_server_replica_peer_st *peer, int fd,
+                          uint8_t **buffer, size_t *total, size_t size,
+                          uint64_t seq)
+{
+  uint8_t sync[GEARMAN_SERVER_REPLICA_SYNC_SIZE];
+
+  sync[0]= GEARMAN_SERVER_REPLICA_SYNC;
+  _replica_pack64(sync + 1, seq);
+
+  if (!_replica_append(buffer, total, &size, sync,
+                       GEARMAN_SERVER_REPLICA_SYNC_SIZE) ||
+      !_replica_send(fd, *buffer, size) ||
+      !_replica_recv(fd, sync, GEARMAN_SERVER_REPLICA_SYNC_SIZE))
+  {
+    return false;
+  }
+
+  if (sync[0] != GEARMAN_SERVER_REPLICA_ACK ||
+      _replica_unpack64(sync + 1) != seq)
+  {
+    GEARMAN_ERROR(peer->server->gearman, "Replication peer %s:%u sent a bad "
+                  "acknowledgement", peer->host, (uint32_t)(peer->port))
+    return false;
+  }
+
+  /* Only this thread writes it, so the status command reads it loosely. */
+  peer->ack_seq= seq;
+
+  return true;
+}
+
+static int _replica_connect(gearman_server_replica_peer_st *peer)
+{
+  struct addrinfo ai;
+  struct addrinfo *addrinfo;
+  struct addrinfo *addrinfo_next;
+  struct pollfd pfd;
+  char port_str[NI_MAXSERV];
+  char magic[GEARMAN_SERVER_REPLICA_MAGIC_SIZE];
+  socklen_t len;
+  int flags;
+  int error;
+  int fd= -1;
+
+  snprintf(port_str, NI_MAXSERV, "%u", (uint32_t)(peer->port));
+
+  memset(&ai, 0, sizeof(struct addrinfo));
+  ai.ai_family= AF_UNSPEC;
+  ai.ai_socktype= SOCK_STREAM;
+  ai.ai_protocol= IPPROTO_TCP;
+
+  if (getaddrinfo(peer->host, port_str, &ai, &addrinfo) != 0)
+    return -1;
+
+  for (addrinfo_next= addrinfo; addrinfo_next != NULL;
+       addrinfo_next= addrinfo_next->ai_next)
+  {
+    fd= socket(addrinfo_next->ai_family, addrinfo_next->ai_socktype,
+               addrinfo_next->ai_protocol);
+    if (fd == -1)
+      continue;
+
+    /* Connect without blocking so an unreachable peer times out quickly. */
+    flags= fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+      (void) close(fd);
+      fd= -1;
+      continue;
+    }
+
+    error= 0;
+    if (connect(fd, addrinfo_next->ai_addr, addrinfo_next->ai_addrlen) == -1)
+    {
+      error= errno;
+      if (error == EINPROGRESS)
+      {
+        pfd.fd= fd;
+        pfd.events= POLLOUT;
+        if (poll(&pfd, 1, GEARMAN_SERVER_REPLICA_TIMEOUT * 1000) == 1)
+        {
+          len= sizeof(error);
+          if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+            error= errno;
+        }
+        else
+          error= ETIMEDOUT;
+      }
+    }
+
+    if (error == 0 && fcntl(fd, F_SETFL, flags) != -1)
+      break;
+
+    (void) close(fd);
+    fd= -1;
+  }
+
+  freeaddrinfo(addrinfo);
+
+  if (fd == -1)
+    return -1;
+
+  _replica_socket(fd);
+
+  if (!_replica_send(fd, GEARMAN_SERVER_REPLICA_MAGIC,
+                     GEARMAN_SERVER_REPLICA_MAGIC_SIZE) ||
+      !_replica_recv(fd, magic, GEARMAN_SERVER_REPLICA_MAGIC_SIZE) ||
+      memcmp(magic, GEARMAN_SERVER_REPLICA_MAGIC,
+             GEARMAN_SERVER_REPLICA_MAGIC_SIZE))
+  {
+    (void) close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void *_replica_listen_thread(void *data)
+{
+  gearman_server_st *server= (gearman_server_st *)data;
+  gearman_server_replica_st *replica= &(server->replica);
+  struct pollfd *pfds;
+  struct sockaddr_storage sa;
+  socklen_t sa_len;
+  char host[NI_MAXHOST];
+  char magic[GEARMAN_SERVER_REPLICA_MAGIC_SIZE];
+  uint8_t *buffer= NULL;
+  size_t total= 0;
+  bool done;
+  uint32_t x;
+  int fd;
+
+  pfds= malloc(sizeof(struct pollfd) * replica->listen_count);
+  if (pfds == NULL)
+  {
+    GEARMAN_ERROR(server->gearman, "_replica_listen_thread:malloc")
+    return NULL;
+  }
+
+  for (x= 0; x < replica->listen_count; x++)
+  {
+    pfds[x].fd= replica->listen_fd[x];
+    pfds[x].events= POLLIN;
+  }
+
+  while (1)
+  {
+    (void) pthread_mutex_lock(&(replica->lock));
+    done= replica->shutdown || replica->promoted;
+    (void) pthread_mutex_unlock(&(replica->lock));
+    if (done)
+      break;
+
+    if (poll(pfds, replica->listen_count, 1000) <= 0)
+      continue;
+
+    for (x= 0; x < replica->listen_count; x++)
+    {
+      if (!(pfds[x].revents & POLLIN))
+        continue;
+
+      sa_len= sizeof(sa);
+      fd= accept(pfds[x].fd, (struct sockaddr *)&sa, &sa_len);
+      if (fd == -1)
+        continue;
+
+      if (getnameinfo((struct sockaddr *)&sa, sa_len, host, NI_MAXHOST, NULL,
+                      0, NI_NUMERICHOST) != 0)
+      {
+        strcpy(host, "-");
+      }
+
+      _replica_socket(fd);
+
+      if (!_replica_recv(fd, magic, GEARMAN_SERVER_REPLICA_MAGIC_SIZE) ||
+          memcmp(magic, GEARMAN_SERVER_REPLICA_MAGIC,
+                 GEARMAN_SERVER_REPLICA_MAGIC_SIZE) ||
+          !_replica_send(fd, GEARMAN_SERVER_REPLICA_MAGIC,
+                         GEARMAN_SERVER_REPLICA_MAGIC_SIZE))
+      {
+        GEARMAN_ERROR(server->gearman, "Bad replication handshake from %s",
+                      host)
+        (void) close(fd);
+        continue;
+      }
+
+      GEARMAN_INFO(server->gearman, "Replicating from primary %s", host)
+
+      (void) pthread_mutex_lock(&(replica->lock));
+      replica->standby_connected= true;
+      replica->standby_connect_count++;
+      (void) pthread_mutex_unlock(&(replica->lock));
+
+      /* One primary at a time, others wait in the backlog. */
+      _replica_standby(server, fd, &buffer, &total);
+
+      (void) pthread_mutex_lock(&(replica->lock));
+      replica->standby_connected= false;
+      (void) pthread_mutex_unlock(&(replica->lock));
+
+      (void) close(fd);
+    }
+  }
+
+  free(pfds);
+
+  if (buffer != NULL)
+    free(buffer);
+
+  return NULL;
+}
+
+static gearman_return_t _replica_listen(gearman_server_st *server)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  struct addrinfo *addrinfo;
+  struct addrinfo *addrinfo_next;
+  struct addrinfo ai;
+  char port_str[NI_MAXSERV];
+  uint32_t count= 0;
+  int *fd_list;
+  int opt;
+  int ret;
+  int fd;
+
+  snprintf(port_str, NI_MAXSERV, "%u", (uint32_t)(replica->listen_port));
+
+  memset(&ai, 0, sizeof(struct addrinfo));
+  ai.ai_flags= AI_PASSIVE;
+  ai.ai_family= AF_UNSPEC;
+  ai.ai_socktype= SOCK_STREAM;
+  ai.ai_protocol= IPPROTO_TCP;
+
+  ret= getaddrinfo(NULL, port_str, &ai, &addrinfo);
+  if (ret != 0)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                      "getaddrinfo:%s", gai_strerror(ret))
+    return GEARMAN_ERRNO;
+  }
+
+  for (addrinfo_next= addrinfo; addrinfo_next != NULL;
+       addrinfo_next= addrinfo_next->ai_next)
+    count++;
+
+  replica->listen_fd= malloc(sizeof(int) * count);
+  if (replica->listen_fd == NULL)
+  {
+    freeaddrinfo(addrinfo);
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                      "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+  fd_list= replica->listen_fd;
+
+  for (addrinfo_next= addrinfo; addrinfo_next != NULL;
+       addrinfo_next= addrinfo_next->ai_next)
+  {
+    fd= socket(addrinfo_next->ai_family, addrinfo_next->ai_socktype,
+               addrinfo_next->ai_protocol);
+    if (fd == -1)
+      continue;
+
+    opt= 1;
+    (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    /* An IPv6 socket may already cover IPv4, same as the client ports. */
+    if (bind(fd, addrinfo_next->ai_addr, addrinfo_next->ai_addrlen) == -1 ||
+        listen(fd, 4) == -1)
+    {
+      (void) close(fd);
+      continue;
+    }
+
+    fd_list[replica->listen_count]= fd;
+    replica->listen_count++;
+  }
+
+  freeaddrinfo(addrinfo);
+
+  if (replica->listen_count == 0)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_replica_start",
+                      "Could not listen on replication port %u",
+                      (uint32_t)(replica->listen_port))
+    return GEARMAN_ERRNO;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _replica_standby(gearman_server_st *server, int fd,
+                             uint8_t **buffer, size_t *total)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  struct pollfd pfd;
+  uint8_t ack[GEARMAN_SERVER_REPLICA_SYNC_SIZE];
+  uint8_t *new_buffer;
+  size_t message_size;
+  size_t offset;
+  size_t size= 0;
+  uint32_t idle= 0;
+  ssize_t read_size;
+  bool done;
+  int ret;
+
+  pfd.fd= fd;
+  pfd.events= POLLIN;
+
+  while (1)
+  {
+    (void) pthread_mutex_lock(&(replica->lock));
+    done= replica->shutdown || replica->promoted;
+    (void) pthread_mutex_unlock(&(replica->lock));
+    if (done)
+      return;
+
+    ret= poll(&pfd, 1, 1000);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    /* The primary sends a sync every second, even when idle. */
+    if (ret == 0)
+    {
+      idle++;
+      if (idle < GEARMAN_SERVER_REPLICA_TIMEOUT)
+        continue;
+
+      GEARMAN_ERROR(server->gearman, "Replication primary timed out")
+      return;
+    }
+    idle= 0;
+
+    if (size == *total)
+    {
+      new_buffer= realloc(*buffer, *total == 0 ?
+                          GEARMAN_SERVER_REPLICA_BATCH_SIZE : *total * 2);
+      if (new_buffer == NULL)
+      {
+        GEARMAN_ERROR(server->gearman, "_replica_standby:realloc")
+        return;
+      }
+
+      *buffer= new_buffer;
+      *total= *total == 0 ? GEARMAN_SERVER_REPLICA_BATCH_SIZE : *total * 2;
+    }
+
+    read_size= recv(fd, *buffer + size, *total - size, 0);
+    if (read_size <= 0)
+    {
+      if (read_size == -1 && (errno == EINTR || errno == EAGAIN))
+        continue;
+
+      GEARMAN_INFO(server->gearman, "Replication primary disconnected")
+      return;
+    }
+    size+= (size_t)read_size;
+
+    offset= 0;
+    (void) pthread_mutex_lock(&(replica->lock));
+    while (1)
+    {
+      message_size= _replica_message_size(*buffer + offset, size - offset);
+      if (message_size == 0)
+        break;
+
+      if (message_size == SIZE_MAX)
+      {
+        (void) pthread_mutex_unlock(&(replica->lock));
+        GEARMAN_ERROR(server->gearman, "Bad message from replication primary")
+        return;
+      }
+
+      if ((*buffer)[offset] == GEARMAN_SERVER_REPLICA_SYNC)
+      {
+        /* Everything before the sync has been applied. */
+        replica->standby_seq= _replica_unpack64(*buffer + offset + 1);
+        (void) pthread_mutex_unlock(&(replica->lock));
+
+        ack[0]= GEARMAN_SERVER_REPLICA_ACK;
+        memcpy(ack + 1, *buffer + offset + 1, 8);
+        if (!_replica_send(fd, ack, GEARMAN_SERVER_REPLICA_SYNC_SIZE))
+          return;
+
+        (void) pthread_mutex_lock(&(replica->lock));
+      }
+      else if (!_replica_apply(server, *buffer + offset, message_size))
+      {
+        (void) pthread_mutex_unlock(&(replica->lock));
+        return;
+      }
+
+      offset+= message_size;
+    }
+    (void) pthread_mutex_unlock(&(replica->lock));
+
+    if (offset > 0)
+    {
+      memmove(*buffer, *buffer + offset, size - offset);
+      size-= offset;
+    }
+  }
+}
+
+static bool _replica_apply(gearman_server_st *server, const uint8_t *message,
+                           size_t size)
+{
+  gearman_server_replica_st *replica= &(server->replica);
+  gearman_server_replica_entry_st **link;
+  gearman_server_replica_entry_st *entry;
+  size_t job_handle_size;
+  uint16_t tmp16;
+
+  /* Once promoted, the jobs are the server's own. */
+  if (replica->promoted)
+    return true;
+
+  switch (message[0])
+  {
+  case GEARMAN_SERVER_REPLICA_ADD:
+    memcpy(&tmp16, message + 10, 2);
+    job_handle_size= ntohs(tmp16);
+
+    entry= malloc(sizeof(gearman_server_replica_entry_st) + size);
+    if (entry == NULL)
+    {
+      GEARMAN_ERROR(server->gearman, "_replica_apply:malloc")
+      return false;
+    }
+
+    entry->key= gearman_server_hash64((const char *)message +
+                                      GEARMAN_SERVER_REPLICA_ADD_SIZE,
+                                      job_handle_size);
+    entry->size= size;
+    entry->job_handle_size= job_handle_size;
+    memcpy(_REPLICA_MESSAGE(entry), message, size);
+
+    if (!_replica_entry_insert(replica->standby_hash, entry))
+      replica->standby_count++;
+    break;
+
+  case GEARMAN_SERVER_REPLICA_DONE:
+    job_handle_size= size - GEARMAN_SERVER_REPLICA_DONE_SIZE;
+    link= _replica_entry_find(replica->standby_hash,
+                              gearman_server_hash64((const char *)message +
+                                              GEARMAN_SERVER_REPLICA_DONE_SIZE,
+                                                    job_handle_size),
+                              (const char *)message +
+                              GEARMAN_SERVER_REPLICA_DONE_SIZE,
+                              job_handle_size);
+    entry= *link;
+    if (entry != NULL)
+    {
+      *link= entry->next;
+      free(entry);
+      replica->standby_count--;
+    }
+    break;
+
+  case GEARMAN_SERVER_REPLICA_RESET:
+    _replica_entry_free_all(replica->standby_hash);
+    replica->standby_count= 0;
+    break;
+
+  default:
+    return false;
+  }
+
+  return true;
+}
+
+static size_t _replica_message_size(const uint8_t *buffer, size_t size)
+{
+  size_t job_handle_size;
+  size_t message_size;
+  uint32_t tmp;
+  uint16_t tmp16;
+
+  if (size == 0)
+    return 0;
+
+  switch (buffer[0])
+  {
+  case GEARMAN_SERVER_REPLICA_ADD:
+    if (size < GEARMAN_SERVER_REPLICA_ADD_SIZE)
+      return 0;
+
+    memcpy(&tmp16, buffer + 10, 2);
+    job_handle_size= ntohs(tmp16);
+    if (job_handle_size == 0 || job_handle_size >= GEARMAN_JOB_HANDLE_SIZE)
+      return SIZE_MAX;
+
+    message_size= GEARMAN_SERVER_REPLICA_ADD_SIZE + job_handle_size;
+    memcpy(&tmp16, buffer + 12, 2);
+    message_size+= ntohs(tmp16);
+    memcpy(&tmp, buffer + 14, 4);
+    message_size+= ntohl(tmp);
+    memcpy(&tmp, buffer + 18, 4);
+    message_size+= ntohl(tmp);
+    if (message_size > GEARMAN_SERVER_REPLICA_MESSAGE_MAX)
+      return SIZE_MAX;
+    break;
+
+  case GEARMAN_SERVER_REPLICA_DONE:
+    if (size < GEARMAN_SERVER_REPLICA_DONE_SIZE)
+      return 0;
+
+    memcpy(&tmp16, buffer + 1, 2);
+    job_handle_size= ntohs(tmp16);
+    if (job_handle_size == 0 || job_handle_size >= GEARMAN_JOB_HANDLE_SIZE)
+      return SIZE_MAX;
+
+    message_size= GEARMAN_SERVER_REPLICA_DONE_SIZE + job_handle_size;
+    break;
+
+  case GEARMAN_SERVER_REPLICA_RESET:
+    message_size= 1;
+    break;
+
+  case GEARMAN_SERVER_REPLICA_SYNC:
+    message_size= GEARMAN_SERVER_REPLICA_SYNC_SIZE;
+    break;
+
+  default:
+    return SIZE_MAX;
+  }
+
+  return size < message_size ? 0 : message_size;
+}
+
+static gearman_server_replica_entry_st **
+_replica_entry_find(gearman_server_replica_entry_st **hash, uint64_t key,
+                    const char *job_handle, size_t job_handle_size)
+{
+  gearman_server_replica_entry_st **link;
+
+  for (link= _REPLICA_BUCKET(hash, key); *link != NULL;
+       link= &((*link)->next))
+  {
+    if ((*link)->key == key && (*link)->job_handle_size == job_handle_size &&
+        !memcmp(_REPLICA_MESSAGE(*link) + GEARMAN_SERVER_REPLICA_ADD_SIZE,
+                job_handle, job_handle_size))
+    {
+      break;
+    }
+  }
+
+  return link;
+}
+
+static bool _replica_entry_insert(gearman_server_replica_entry_st **hash,
+                                  gearman_server_replica_entry_st *entry)
+{
+  gearman_server_replica_entry_st **link;
+  gearman_server_replica_entry_st *old;
+
+  link= _replica_entry_find(hash, entry->key,
+                            (const char *)_REPLICA_MESSAGE(entry) +
+                            GEARMAN_SERVER_REPLICA_ADD_SIZE,
+                            entry->job_handle_size);
+  old= *link;
+  entry->next= old == NULL ? NULL : old->next;
+  *link= entry;
+
+  if (old == NULL)
+    return false;
+
+  free(old);
+  return true;
+}
+
+static void _replica_entry_free_all(gearman_server_replica_entry_st **hash)
+{
+  gearman_server_replica_entry_st *entry;
+  uint32_t x;
+
+  for (x= 0; x < GEARMAN_SERVER_REPLICA_HASH_SIZE; x++)
+  {
+    while (hash[x] != NULL)
+    {
+      entry= hash[x];
+      hash[x]= entry->next;
+      free(entry);
+    }
+  }
+}
+
+static bool _replica_holding(gearman_server_replica_peer_st *peer)
+{
+  return peer->state != GEARMAN_SERVER_REPLICA_PEER_CONNECTING &&
+         !(peer->resync);
+}
+
+static void _replica_event_add(gearman_server_replica_st *replica,
+                               const uint8_t *message, size_t size)
+{
+  gearman_server_replica_peer_st *peer;
+  gearman_server_replica_event_st *event;
+
+  /* Peers that are not connected are sent everything when they are. */
+  for (peer= replica->peer_list; peer != NULL; peer= peer->next)
+  {
+    if (_replica_holding(peer))
+      break;
+  }
+
+  if (peer == NULL)
+    return;
+
+  event= malloc(sizeof(gearman_server_replica_event_st) + size);
+  if (event == NULL)
+  {
+    /* Without the event, peers need all the jobs again to catch up. */
+    for (peer= replica->peer_list; peer != NULL; peer= peer->next)
+    {
+      if (_replica_holding(peer))
+        peer->resync= true;
+    }
+
+    _replica_trim(replica);
+    (void) pthread_cond_broadcast(&(replica->cond));
+    return;
+  }
+
+  replica->seq++;
+  event->seq= replica->seq;
+  event->size= size;
+  event->next= NULL;
+  memcpy(event + 1, message, size);
+
+  if (replica->event_end == NULL)
+    replica->event_list= event;
+  else
+    replica->event_end->next= event;
+  replica->event_end= event;
+  replica->event_size+= size;
+
+  if (replica->event_size > GEARMAN_SERVER_REPLICA_BACKLOG_MAX)
+    _replica_trim(replica);
+
+  /* Busy peers pick new events up after their current batch. */
+  if (replica->waiting > 0)
+    (void) pthread_cond_broadcast(&(replica->cond));
+}
+
+static void _replica_trim(gearman_server_replica_st *replica)
+{
+  gearman_server_replica_peer_st *peer;
+  gearman_server_replica_peer_st *slow;
+  gearman_server_replica_event_st *event;
+  uint64_t seq;
+
+  while (1)
+  {
+    seq= replica->seq;
+    slow= NULL;
+    for (peer= replica->peer_list; peer != NULL; peer= peer->next)
+    {
+      if (_replica_holding(peer) && peer->sent_seq < seq)
+      {
+        seq= peer->sent_seq;
+        slow= peer;
+      }
+    }
+
+    while (replica->event_list != NULL && replica->event_list->seq <= seq)
+    {
+      event= replica->event_list;
+      replica->event_list= event->next;
+      replica->event_size-= event->size;
+      free(event);
+    }
+
+    if (replica->event_list == NULL)
+      replica->event_end= NULL;
+
+    if (replica->event_size <= GEARMAN_SERVER_REPLICA_BACKLOG_MAX ||
+        slow == NULL)
+    {
+      break;
+    }
+
+    /* Sending a peer that is too far behind all the jobs again is cheaper
+       than holding everything that happened since. */
+    slow->resync= true;
+    (void) pthread_cond_broadcast(&(replica->cond));
+  }
+}
+
+static bool _replica_append(uint8_t **buffer, size_t *total, size_t *size,
+                            const void *data, size_t data_size)
+{
+  uint8_t *new_buffer;
+  size_t new_total;
+
+  if (*size + data_size > *total)
+  {
+    new_total= *total == 0 ? GEARMAN_SERVER_REPLICA_BATCH_SIZE : *total;
+    while (new_total < *size + data_size)
+      new_total*= 2;
+
+    new_buffer= realloc(*buffer, new_total);
+    if (new_buffer == NULL)
+      return false;
+
+    *buffer= new_buffer;
+    *total= new_total;
+  }
+
+  memcpy(*buffer + *size, data, data_size);
+  *size+= data_size;
+
+  return true;
+}
+
+static bool _replica_send(int fd, const void *data, size_t size)
+{
+  const uint8_t *ptr= (const uint8_t *)data;
+  ssize_t ret;
+
+  while (size > 0)
+  {
+    ret= send(fd, ptr, size, MSG_NOSIGNAL);
+    if (ret == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    ptr+= ret;
+    size-= (size_t)ret;
+  }
+
+  return true;
+}
+
+static bool _replica_recv(int fd, void *data, size_t size)
+{
+  uint8_t *ptr= (uint8_t *)data;
+  ssize_t ret;
+
+  while (size > 0)
+  {
+    ret= recv(fd, ptr, size, 0);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+
+    ptr+= ret;
+    size-= (size_t)ret;
+  }
+
+  return true;
+}
+
+static void _replica_socket(int fd)
+{
+  struct timeval waittime;
+  int opt= 1;
+
+  /* Batches end with a small sync that should not wait behind an ack. */
+  (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+  /* Blocking calls give up on a peer that stops responding. */
+  waittime.tv_sec= GEARMAN_SERVER_REPLICA_TIMEOUT;
+  waittime.tv_usec= 0;
+  (void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &waittime, sizeof(waittime));
+  (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &waittime, sizeof(waittime));
+}
+
+static void _replica_pack64(uint8_t *ptr, uint64_t value)
+{
+  uint32_t tmp;
+
+  tmp= htonl((uint32_t)(value >> 32));
+  memcpy(ptr, &tmp, 4);
+  tmp= htonl((uint32_t)value);
+  memcpy(ptr + 4, &tmp, 4);
+}
+
+static uint64_t _replica_unpack64(const uint8_t *ptr)
+{
+  uint32_t high;
+  uint32_t low;
+
+  memcpy(&high, ptr, 4);
+  memcpy(&low, ptr + 4, 4);
+
+  return ((uint64_t)ntohl(high) << 32) | (uint64_t)ntohl(low);
+}
@@ -0,0 +1,150 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server background job replication declarations
+ */
+
+#ifndef __GEARMAN_SERVER_REPLICA_H__
+#define __GEARMAN_SERVER_REPLICA_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_replica Server Background Job Replication
+ * @ingroup gearman_server
+ * This is a low level interface for keeping a warm copy of the background
+ * jobs of one server in others. The primary keeps its own copy of every
+ * background job it holds, and a thread for each peer streams add and done
+ * events for them over a dedicated connection. Events are sent in batches,
+ * each ending with a sync that the peer acknowledges once it has applied the
+ * batch, and the next batch goes out after that. When a peer connects, or
+ * falls more than GEARMAN_SERVER_REPLICA_BACKLOG_MAX bytes behind, it is sent
+ * a reset and every job the primary holds before streaming again. This is
+ * asynchronous, clients are answered without waiting for peers, so jobs added
+ * in the last moments before the primary is lost may be missing.
+ *
+ * A standby listens on its own port for a primary and keeps the jobs it is
+ * sent to the side, where workers do not see them. Promoting the standby adds
+ * them to its queue like newly submitted background jobs, after which it no
+ * longer accepts a primary.
+ *
+ * Each message starts with a type byte. An add is followed by the priority
+ * byte, the time to run (64 bits), the job handle and function name sizes (16
+ * bits each), the unique key and payload sizes (32 bits each), and those
+ * bytes. A done is followed by the job handle size (16 bits) and the handle,
+ * and a sync or its acknowledgement by a sequence number (64 bits). Both ends
+ * send GEARMAN_SERVER_REPLICA_MAGIC first. Numbers are in network byte order.
+ * @{
+ */
+
+/**
+ * Initialize the replication state for a server.
+ */
+GEARMAN_API
+void gearman_server_replica_init(gearman_server_replica_st *replica);
+
+/**
+ * Stop replication if it is still running and free its state. Jobs freed
+ * from here on are not sent to peers as done.
+ */
+GEARMAN_API
+void gearman_server_replica_free(gearman_server_st *server);
+
+/**
+ * Add a peer to stream background jobs to.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param host Host of the peer.
+ * @param port Replication port the peer listens on.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_replica_peer_add(gearman_server_st *server,
+                                                 const char *host,
+                                                 in_port_t port);
+
+/**
+ * Set the port to listen on for a primary, making this server a standby.
+ */
+GEARMAN_API
+void gearman_server_replica_set_listen(gearman_server_st *server,
+                                       in_port_t port);
+
+/**
+ * Start the peer threads and the standby listener. This should be called
+ * before the persistent queue is replayed, so replayed jobs are sent to peers
+ * too.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_replica_start(gearman_server_st *server);
+
+/**
+ * See if background jobs are being sent to peers.
+ */
+GEARMAN_API
+bool gearman_server_replica_enabled(gearman_server_st *server);
+
+/**
+ * Record a new background job for peers. This copies everything it needs.
+ * @param server_job Job that was just added.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_replica_add(gearman_server_st *server,
+                                            gearman_server_job_st *server_job,
+                                            const char *function_name,
+                                            size_t function_name_size,
+                                            const char *unique,
+                                            size_t unique_size,
+                                            const void *data,
+                                            size_t data_size);
+
+/**
+ * Tell peers a background job recorded with gearman_server_replica_add is
+ * gone. This is called when the job is freed.
+ */
+GEARMAN_API
+void gearman_server_replica_done(gearman_server_st *server,
+                                 gearman_server_job_st *server_job);
+
+/**
+ * Promote a standby, adding the jobs it was sent to its queue. This must be
+ * called with all shards locked, see gearman_server_shard_lock.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param added Set to the number of jobs added.
+ * @return Standard gearman return value. This fails with
+ *         GEARMAN_INVALID_COMMAND if the server is not a standby.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_replica_promote(gearman_server_st *server,
+                                                uint32_t *added);
+
+/**
+ * Write replication state for the "replica" admin command. There is a
+ * "peer" line for each peer with its host and port, its state, the last
+ * event sequence sent and acknowledged, the events it is behind, and how
+ * many times it connected. A standby has a "standby" line with its port, its
+ * state, the jobs it holds, the last sequence it acknowledged, and how many
+ * times a primary connected. The list ends with a line holding a single '.'.
+ */
+GEARMAN_API
+size_t gearman_server_replica_status(gearman_server_st *server, char *buffer,
+                                     size_t buffer_size);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_REPLICA_H__ */
@@ -0,0 +1,444 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server shard definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_shard_private Private Server Shard Functions
+ * @ingroup gearman_server_shard
+ * @{
+ */
+
+/**
+ * Free the slabs for a shard.
+ */
+static void _server_shard_slab_free(gearman_server_shard_st *shard);
+
+/**
+ * Free the first count job slabs for a shard.
+ */
+static void _server_shard_job_slab_free(gearman_server_shard_st *shard,
+                                        uint32_t count);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+gearman_server_shard_st *
+gearman_server_shard_create(gearman_server_st *server,
+                            gearman_server_shard_st *shard, uint32_t id)
+{
+  uint32_t x;
+
+  shard->proc_wakeup= false;
+  shard->queue_batch= false;
+  shard->job_chain= NULL;
+  shard->queue_replay= false;
+  shard->proc_sleeping= false;
+  shard->id= id;
+  shard->job_handle_count= 1;
+  shard->function_count= 0;
+  shard->job_count= 0;
+  shard->unique_count= 0;
+  shard->hash_size= 0;
+  shard->hash_old_size= 0;
+  shard->hash_rehash= 0;
+  shard->function_hash_size= 0;
+  shard->job_slot_size= 0;
+  shard->job_slot_free= GEARMAN_JOB_SLOT_NONE;
+  shard->worker_slots_free= 0;
+  shard->wakeups_sent= 0;
+  shard->wakeups_received= 0;
+  shard->proc_queue_takes= 0;
+  shard->proc_queue_cons= 0;
+  shard->server= server;
+  shard->function_list= NULL;
+  shard->proc_list= NULL;
+  shard->proc_stack= NULL;
+  shard->job_slot_list= NULL;
+  shard->job_hash= NULL;
+  shard->unique_hash= NULL;
+  shard->job_hash_old= NULL;
+  shard->unique_hash_old= NULL;
+  shard->function_hash= NULL;
+  shard->replay_list= NULL;
+  shard->replay_end= NULL;
+  shard->queue_record= NULL;
+  shard->queue_record_job= NULL;
+  shard->queue_record_count= 0;
+  gearman_server_spill_init(&(shard->spill));
+  gearman_server_commit_init(&(shard->commit));
+  gearman_server_timer_init(&(shard->timer));
+
+  /* Handles carry the shard number so results can be routed back to it. The
+     prefix is kept short enough that indexed handles always fit. */
+  if (server->shard_count == 1)
+  {
+    snprintf(shard->job_handle_prefix, GEARMAN_JOB_HANDLE_SIZE, "%s",
+             server->job_handle_prefix);
+  }
+  else
+  {
+    snprintf(shard->job_handle_prefix, GEARMAN_JOB_HANDLE_SIZE, "%.*s:%u",
+             GEARMAN_JOB_HANDLE_SIZE - 33, server->job_handle_prefix, id);
+  }
+  shard->job_handle_prefix_size= strlen(shard->job_handle_prefix);
+  if (shard->job_handle_prefix_size > GEARMAN_JOB_HANDLE_SIZE - 22)
+  {
+    shard->job_handle_prefix_size= GEARMAN_JOB_HANDLE_SIZE - 22;
+    shard->job_handle_prefix[shard->job_handle_prefix_size]= 0;
+  }
+
+  /* Jobs keep their unique key right after them, so there is a slab for each
+     size the key is rounded up to. */
+  for (x= 0; x < GEARMAN_SERVER_JOB_SLAB_CLASSES; x++)
+  {
+    if (gearman_server_slab_create(&(shard->job_slab[x]),
+                                   sizeof(gearman_server_job_st) +
+                                   ((x + 1) * GEARMAN_SERVER_JOB_SLAB_STEP)) ==
+        NULL)
+    {
+      _server_shard_job_slab_free(shard, x);
+      return NULL;
+    }
+  }
+
+  if (gearman_server_slab_create(&(shard->client_slab),
+                                 sizeof(gearman_server_client_st)) == NULL)
+  {
+    _server_shard_job_slab_free(shard, GEARMAN_SERVER_JOB_SLAB_CLASSES);
+    return NULL;
+  }
+
+  if (gearman_server_slab_create(&(shard->worker_slab),
+                                 sizeof(gearman_server_worker_st)) == NULL)
+  {
+    _server_shard_job_slab_free(shard, GEARMAN_SERVER_JOB_SLAB_CLASSES);
+    gearman_server_slab_free(&(shard->client_slab));
+    return NULL;
+  }
+
+  gearman_server_magazine_init(&(shard->packet_magazine),
+                               &(server->packet_slab));
+  gearman_server_magazine_init(&(shard->io_packet_magazine),
+                               &(server->io_packet_slab));
+
+  if (pthread_mutex_init(&(shard->lock), NULL) != 0)
+  {
+    _server_shard_slab_free(shard);
+    return NULL;
+  }
+
+  if (pthread_mutex_init(&(shard->proc_lock), NULL) != 0)
+  {
+    (void) pthread_mutex_destroy(&(shard->lock));
+    _server_shard_slab_free(shard);
+    return NULL;
+  }
+
+  if (pthread_cond_init(&(shard->proc_cond), NULL) != 0)
+  {
+    (void) pthread_mutex_destroy(&(shard->proc_lock));
+    (void) pthread_mutex_destroy(&(shard->lock));
+    _server_shard_slab_free(shard);
+    return NULL;
+  }
+
+  gearman_server_lock_stats_init(server, &(shard->lock_stats),
+                                 GEARMAN_SERVER_LOCK_SHARD);
+  gearman_server_lock_stats_init(server, &(shard->proc_lock_stats),
+                                 GEARMAN_SERVER_LOCK_PROC);
+
+  if (gearman_server_job_hash_resize(shard, GEARMAN_JOB_HASH_SIZE) !=
+      GEARMAN_SUCCESS)
+  {
+    gearman_server_shard_free(shard);
+    return NULL;
+  }
+
+  shard->function_hash= calloc(GEARMAN_FUNCTION_HASH_SIZE,
+                               sizeof(gearman_server_function_st *));
+  if (shard->function_hash == NULL)
+  {
+    gearman_server_shard_free(shard);
+    return NULL;
+  }
+
+  shard->function_hash_size= GEARMAN_FUNCTION_HASH_SIZE;
+
+  return shard;
+}
+
+void gearman_server_shard_free(gearman_server_shard_st *shard)
+{
+  uint32_t key;
+
+  /* Every job is in the unique hash, even those without a unique ID. */
+  for (key= 0; key < shard->hash_old_size; key++)
+  {
+    while (shard->unique_hash_old[key] != NULL)
+      gearman_server_job_free(shard->unique_hash_old[key]);
+  }
+
+  for (key= 0; key < shard->hash_size; key++)
+  {
+    while (shard->unique_hash[key] != NULL)
+      gearman_server_job_free(shard->unique_hash[key]);
+  }
+
+  if (shard->job_hash_old != NULL)
+    free(shard->job_hash_old);
+  if (shard->unique_hash_old != NULL)
+    free(shard->unique_hash_old);
+  if (shard->job_hash != NULL)
+    free(shard->job_hash);
+  if (shard->unique_hash != NULL)
+    free(shard->unique_hash);
+
+  while (shard->function_list != NULL)
+    gearman_server_function_free(shard->function_list);
+
+  if (shard->function_hash != NULL)
+    free(shard->function_hash);
+
+  if (shard->job_slot_list != NULL)
+    free(shard->job_slot_list);
+
+  gearman_server_spill_free(&(shard->spill));
+  gearman_server_replay_free(shard);
+
+  gearman_server_lock_stats_free(shard->server, &(shard->proc_lock_stats));
+  gearman_server_lock_stats_free(shard->server, &(shard->lock_stats));
+  (void) pthread_cond_destroy(&(shard->proc_cond));
+  (void) pthread_mutex_destroy(&(shard->proc_lock));
+  (void) pthread_mutex_destroy(&(shard->lock));
+
+  _server_shard_slab_free(shard);
+}
+
+gearman_server_shard_st *
+gearman_server_shard_function(gearman_server_st *server,
+                              const char *function_name,
+                              size_t function_name_size)
+{
+  uint32_t key;
+
+  if (server->shard_count == 1)
+    return server->shard_list;
+
+  key= gearman_server_hash(function_name, function_name_size);
+  return &(server->shard_list[key % server->shard_count]);
+}
+
+gearman_server_shard_st *gearman_server_shard_job(gearman_server_st *server,
+                                                  const char *job_handle,
+                                                  size_t job_handle_size)
+{
+  const char *ptr;
+  size_t end;
+  size_t start;
+  uint32_t id= 0;
+
+  if (server->shard_count == 1)
+    return server->shard_list;
+
+  /* The shard number is the field before the last ':' in the handle. */
+  ptr= memchr(job_handle, 0, job_handle_size);
+  end= ptr == NULL ? job_handle_size : (size_t)(ptr - job_handle);
+  while (end > 0 && job_handle[end - 1] != ':')
+    end--;
+  if (end == 0)
+    return server->shard_list;
+  end--;
+
+  start= end;
+  while (start > 0 && job_handle[start - 1] != ':')
+    start--;
+  if (start == 0 || start == end)
+    return server->shard_list;
+
+  for (; start < end; start++)
+  {
+    if (job_handle[start] < '0' || job_handle[start] > '9')
+      return server->shard_list;
+
+    id= (id * 10) + (uint32_t)(job_handle[start] - '0');
+    if (id >= server->shard_count)
+      return server->shard_list;
+  }
+
+  return &(server->shard_list[id]);
+}
+
+void gearman_server_shard_route(gearman_server_con_st *con,
+                                gearman_server_packet_st *packet)
+{
+  gearman_server_st *server= con->thread->server;
+  gearman_packet_st *p= &(packet->packet);
+  size_t size;
+
+  packet->shard_hops= 0;
+
+  if (server->shard_count == 1)
+  {
+    packet->shard= 0;
+    return;
+  }
+
+  switch (p->command)
+  {
+  case GEARMAN_COMMAND_SUBMIT_JOB:
+  case GEARMAN_COMMAND_SUBMIT_JOB_BG:
+  case GEARMAN_COMMAND_SUBMIT_JOB_HIGH:
+  case GEARMAN_COMMAND_SUBMIT_JOB_HIGH_BG:
+  case GEARMAN_COMMAND_SUBMIT_JOB_LOW:
+  case GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG:
+  case GEARMAN_COMMAND_SUBMIT_JOB_EPOCH:
+  case GEARMAN_COMMAND_SUBMIT_JOB_BATCH:
+  case GEARMAN_COMMAND_SUBMIT_JOB_CHAIN:
+  case GEARMAN_COMMAND_CAN_DO:
+  case GEARMAN_COMMAND_CAN_DO_TIMEOUT:
+  case GEARMAN_COMMAND_CANT_DO:
+    /* Match the name size the command itself will use. */
+    size= p->arg_size[0];
+    if (p->command != GEARMAN_COMMAND_CAN_DO &&
+        p->command != GEARMAN_COMMAND_CANT_DO)
+    {
+      size--;
+    }
+
+    packet->shard= gearman_server_shard_function(server, (char *)(p->arg[0]),
+                                                 size)->id;
+    break;
+
+  case GEARMAN_COMMAND_GET_STATUS:
+  case GEARMAN_COMMAND_WORK_DATA:
+  case GEARMAN_COMMAND_WORK_WARNING:
+  case GEARMAN_COMMAND_WORK_STATUS:
+  case GEARMAN_COMMAND_WORK_COMPLETE:
+  case GEARMAN_COMMAND_WORK_FAIL:
+  case GEARMAN_COMMAND_WORK_EXCEPTION:
+    packet->shard= gearman_server_shard_job(server, (char *)(p->arg[0]),
+                                            p->arg_size[0])->id;
+    break;
+
+  case GEARMAN_COMMAND_GRAB_JOB:
+  case GEARMAN_COMMAND_GRAB_JOB_UNIQ:
+  case GEARMAN_COMMAND_GRAB_JOB_MULTI:
+  case GEARMAN_COMMAND_PRE_SLEEP:
+  case GEARMAN_COMMAND_RESET_ABILITIES:
+  case GEARMAN_COMMAND_SET_SLOTS:
+    /* Start in a different shard each time so no shard's jobs are always
+       preferred. */
+    packet->shard= con->proc_rotate % server->shard_count;
+    packet->shard_hops= server->shard_count - 1;
+    con->proc_rotate++;
+    break;
+
+  case GEARMAN_COMMAND_TEXT:
+    packet->shard= 0;
+    break;
+
+  case GEARMAN_COMMAND_ECHO_REQ:
+  case GEARMAN_COMMAND_SET_CLIENT_ID:
+  case GEARMAN_COMMAND_OPTION_REQ:
+  case GEARMAN_COMMAND_UNUSED:
+  case GEARMAN_COMMAND_NOOP:
+  case GEARMAN_COMMAND_JOB_CREATED:
+  case GEARMAN_COMMAND_NO_JOB:
+  case GEARMAN_COMMAND_JOB_ASSIGN:
+  case GEARMAN_COMMAND_ECHO_RES:
+  case GEARMAN_COMMAND_ERROR:
+  case GEARMAN_COMMAND_STATUS_RES:
+  case GEARMAN_COMMAND_ALL_YOURS:
+  case GEARMAN_COMMAND_OPTION_RES:
+  case GEARMAN_COMMAND_SUBMIT_JOB_SCHED:
+  case GEARMAN_COMMAND_JOB_CREATED_BATCH:
+  case GEARMAN_COMMAND_JOB_ASSIGN_UNIQ:
+  case GEARMAN_COMMAND_JOB_ABANDONED:
+  case GEARMAN_COMMAND_MAX:
+  default:
+    packet->shard= GEARMAN_SERVER_SHARD_ANY;
+    break;
+  }
+}
+
+void gearman_server_shard_forward(gearman_server_st *server,
+                                  gearman_server_packet_st *packet)
+{
+  packet->shard= (packet->shard + 1) % server->shard_count;
+  packet->shard_hops--;
+}
+
+void gearman_server_shard_lock(gearman_server_st *server)
+{
+  uint32_t x;
+
+  if (!(server->options & GEARMAN_SERVER_PROC_THREAD))
+    return;
+
+  /* Only the first shard ever holds more than its own lock, so taking them
+     in order here can't deadlock. */
+  for (x= 1; x < server->shard_count; x++)
+    (void) pthread_mutex_lock(&(server->shard_list[x].lock));
+}
+
+void gearman_server_shard_unlock(gearman_server_st *server)
+{
+  uint32_t x;
+
+  if (!(server->options & GEARMAN_SERVER_PROC_THREAD))
+    return;
+
+  for (x= 1; x < server->shard_count; x++)
+    (void) pthread_mutex_unlock(&(server->shard_list[x].lock));
+}
+
+uint32_t gearman_server_shard_job_count(gearman_server_st *server)
+{
+  uint32_t job_count= 0;
+  uint32_t x;
+
+  for (x= 0; x < server->shard_count; x++)
+    job_count+= server->shard_list[x].job_count;
+
+  return job_count;
+}
+
+/*
+ * Private definitions
+ */
+
+static void _server_shard_slab_free(gearman_server_shard_st *shard)
+{
+  gearman_server_magazine_flush(&(shard->packet_magazine));
+  gearman_server_magazine_flush(&(shard->io_packet_magazine));
+  _server_shard_job_slab_free(shard, GEARMAN_SERVER_JOB_SLAB_CLASSES);
+  gearman_server_slab_free(&(shard->client_slab));
+  gearman_server_slab_free(&(shard->worker_slab));
+}
+
+static void _server_shard_job_slab_free(gearman_server_shard_st *shard,
+                                        uint32_t count)
+{
+  uint32_t x;
+
+  for (x= 0; x < count; x++)
+    gearman_server_slab_free(&(shard->job_slab[x]));
+}
@@ -0,0 +1,113 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server shard declarations
+ */
+
+#ifndef __GEARMAN_SERVER_SHARD_H__
+#define __GEARMAN_SERVER_SHARD_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_shard Server Shard Handling
+ * @ingroup gearman_server
+ * This is a low level interface for server shards. Functions, and the jobs
+ * queued for them, are split between shards by a hash of the function name.
+ * When the server runs with I/O threads each shard has its own processing
+ * thread, and packets are routed to the shard that owns the function or job
+ * they refer to. A connection is only ever run by one shard at a time, and
+ * worker and client state on connections is kept per shard, so shards never
+ * touch each other's data.
+ * @{
+ */
+
+/**
+ * Initialize a server shard structure. Shards always live in the shard list
+ * of a server, so unlike most other structures this cannot allocate one.
+ * @param server Server the shard belongs to.
+ * @param shard Shard structure to initialize.
+ * @param id Index of the shard in the server shard list.
+ * @return The shard, or NULL on failure.
+ */
+GEARMAN_API
+gearman_server_shard_st *
+gearman_server_shard_create(gearman_server_st *server,
+                            gearman_server_shard_st *shard, uint32_t id);
+
+/**
+ * Free a server shard structure along with all jobs and functions in it.
+ */
+GEARMAN_API
+void gearman_server_shard_free(gearman_server_shard_st *shard);
+
+/**
+ * Get the shard that owns a function name.
+ */
+GEARMAN_API
+gearman_server_shard_st *
+gearman_server_shard_function(gearman_server_st *server,
+                              const char *function_name,
+                              size_t function_name_size);
+
+/**
+ * Get the shard a job handle was created in. Handles that were not made by
+ * this server map to the first shard, where they will not be found.
+ */
+GEARMAN_API
+gearman_server_shard_st *gearman_server_shard_job(gearman_server_st *server,
+                                                  const char *job_handle,
+                                                  size_t job_handle_size);
+
+/**
+ * Pick the shard a packet read from a connection should run in. Commands that
+ * only depend on the connection can run in any shard, while GRAB_JOB,
+ * PRE_SLEEP and RESET_ABILITIES pass through every shard in turn.
+ */
+GEARMAN_API
+void gearman_server_shard_route(gearman_server_con_st *con,
+                                gearman_server_packet_st *packet);
+
+/**
+ * Move a packet that the current shard has finished with on to the next
+ * shard it needs to pass through.
+ */
+GEARMAN_API
+void gearman_server_shard_forward(gearman_server_st *server,
+                                  gearman_server_packet_st *packet);
+
+/**
+ * Lock every shard except the first, for commands run in the first shard that
+ * need to look at all of them. This does nothing without processing threads.
+ */
+GEARMAN_API
+void gearman_server_shard_lock(gearman_server_st *server);
+
+/**
+ * Unlock shards locked with gearman_server_shard_lock.
+ */
+GEARMAN_API
+void gearman_server_shard_unlock(gearman_server_st *server);
+
+/**
+ * Get the total number of jobs in all shards.
+ */
+GEARMAN_API
+uint32_t gearman_server_shard_job_count(gearman_server_st *server);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_SHARD_H__ */
@@ -0,0 +1,284 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server slab definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_slab_private Private Server Slab Functions
+ * @ingroup gearman_server_slab
+ * @{
+ */
+
+/**
+ * Size of the chunk header, rounded so the first object is aligned.
+ */
+#define _SERVER_SLAB_HEADER_SIZE \
+  ((sizeof(gearman_server_slab_chunk_st) + GEARMAN_SERVER_SLAB_ALIGN - 1) & \
+   ~((size_t)GEARMAN_SERVER_SLAB_ALIGN - 1))
+
+/**
+ * Find the chunk an object lives in. Chunks are aligned to their size, so
+ * this is just a mask of the object address.
+ */
+#define _SERVER_SLAB_CHUNK(__object) \
+  ((gearman_server_slab_chunk_st *)((uintptr_t)(__object) & \
+   ~((uintptr_t)GEARMAN_SERVER_SLAB_CHUNK_SIZE - 1)))
+
+/**
+ * Allocate a new chunk and add it to the slab.
+ */
+static gearman_server_slab_chunk_st *
+_server_slab_chunk_add(gearman_server_slab_st *slab);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+gearman_server_slab_st *gearman_server_slab_create(gearman_server_slab_st *slab,
+                                                   size_t size)
+{
+  if (slab == NULL)
+  {
+    slab= malloc(sizeof(gearman_server_slab_st));
+    if (slab == NULL)
+      return NULL;
+
+    slab->options= GEARMAN_SERVER_SLAB_ALLOCATED;
+  }
+  else
+    slab->options= 0;
+
+  if (size < sizeof(void *))
+    size= sizeof(void *);
+
+  slab->size= (size + GEARMAN_SERVER_SLAB_ALIGN - 1) &
+              ~((size_t)GEARMAN_SERVER_SLAB_ALIGN - 1);
+  slab->chunk_objects= (uint32_t)((GEARMAN_SERVER_SLAB_CHUNK_SIZE -
+                                   _SERVER_SLAB_HEADER_SIZE) / slab->size);
+  slab->chunk_count= 0;
+  slab->empty_count= 0;
+  slab->chunk_list= NULL;
+  slab->partial_list= NULL;
+
+  if (slab->chunk_objects == 0 || pthread_mutex_init(&(slab->lock), NULL) != 0)
+  {
+    if (slab->options & GEARMAN_SERVER_SLAB_ALLOCATED)
+      free(slab);
+    return NULL;
+  }
+
+  return slab;
+}
+
+void gearman_server_slab_free(gearman_server_slab_st *slab)
+{
+  gearman_server_slab_chunk_st *chunk;
+
+  while (slab->chunk_list != NULL)
+  {
+    chunk= slab->chunk_list;
+    slab->chunk_list= chunk->next;
+    free(chunk);
+  }
+
+  (void) pthread_mutex_destroy(&(slab->lock));
+
+  if (slab->options & GEARMAN_SERVER_SLAB_ALLOCATED)
+    free(slab);
+}
+
+void *gearman_server_slab_alloc(gearman_server_slab_st *slab)
+{
+  gearman_server_slab_chunk_st *chunk;
+  void *object;
+
+  chunk= slab->partial_list;
+  if (chunk == NULL)
+  {
+    chunk= _server_slab_chunk_add(slab);
+    if (chunk == NULL)
+      return NULL;
+  }
+
+  if (chunk->free_count == slab->chunk_objects)
+    slab->empty_count--;
+
+  object= chunk->free_list;
+  chunk->free_list= *((void **)object);
+  chunk->free_count--;
+
+  if (chunk->free_count == 0)
+    GEARMAN_BUCKET_DEL(slab->partial_list, chunk, partial_)
+
+  return object;
+}
+
+void gearman_server_slab_release(gearman_server_slab_st *slab, void *object)
+{
+  gearman_server_slab_chunk_st *chunk= _SERVER_SLAB_CHUNK(object);
+
+  assert(chunk->slab == slab);
+
+  *((void **)object)= chunk->free_list;
+  chunk->free_list= object;
+  chunk->free_count++;
+
+  if (chunk->free_count == 1)
+    GEARMAN_BUCKET_ADD(slab->partial_list, chunk, partial_)
+
+  if (chunk->free_count == slab->chunk_objects)
+  {
+    /* Keep a few empty chunks around so bursts don't thrash the system
+       allocator, but give the rest back once a burst is over. */
+    if (slab->empty_count == GEARMAN_SERVER_SLAB_MAX_EMPTY)
+    {
+      GEARMAN_BUCKET_DEL(slab->partial_list, chunk, partial_)
+      GEARMAN_LIST_DEL(slab->chunk, chunk,)
+      free(chunk);
+    }
+    else
+      slab->empty_count++;
+  }
+}
+
+void gearman_server_magazine_init(gearman_server_magazine_st *magazine,
+                                  gearman_server_slab_st *slab)
+{
+  magazine->count= 0;
+  magazine->hit_count= 0;
+  magazine->miss_count= 0;
+  magazine->slab= slab;
+}
+
+void *gearman_server_magazine_alloc(gearman_server_magazine_st *magazine)
+{
+  void *object;
+
+  if (magazine->count == 0)
+  {
+    magazine->miss_count++;
+    pthread_mutex_lock(&(magazine->slab->lock));
+    while (magazine->count < (GEARMAN_SERVER_MAGAZINE_SIZE >> 1))
+    {
+      object= gearman_server_slab_alloc(magazine->slab);
+      if (object == NULL)
+        break;
+
+      magazine->object[magazine->count]= object;
+      magazine->count++;
+    }
+    pthread_mutex_unlock(&(magazine->slab->lock));
+
+    if (magazine->count == 0)
+      return NULL;
+  }
+  else
+    magazine->hit_count++;
+
+  magazine->count--;
+  return magazine->object[magazine->count];
+}
+
+void gearman_server_magazine_release(gearman_server_magazine_st *magazine,
+                                     void *object)
+{
+  gearman_server_slab_st *slab= _SERVER_SLAB_CHUNK(object)->slab;
+
+  /* Objects from another slab, such as a packet from a thread on another
+     NUMA node, go straight back to it so a magazine only ever caches objects
+     of its own slab. */
+  if (slab != magazine->slab)
+  {
+    pthread_mutex_lock(&(slab->lock));
+    gearman_server_slab_release(slab, object);
+    pthread_mutex_unlock(&(slab->lock));
+    return;
+  }
+
+  if (magazine->count == GEARMAN_SERVER_MAGAZINE_SIZE)
+  {
+    pthread_mutex_lock(&(magazine->slab->lock));
+    while (magazine->count > (GEARMAN_SERVER_MAGAZINE_SIZE >> 1))
+    {
+      magazine->count--;
+      gearman_server_slab_release(magazine->slab,
+                                  magazine->object[magazine->count]);
+    }
+    pthread_mutex_unlock(&(magazine->slab->lock));
+  }
+
+  magazine->object[magazine->count]= object;
+  magazine->count++;
+}
+
+void gearman_server_magazine_flush(gearman_server_magazine_st *magazine)
+{
+  if (magazine->count == 0)
+    return;
+
+  pthread_mutex_lock(&(magazine->slab->lock));
+  while (magazine->count > 0)
+  {
+    magazine->count--;
+    gearman_server_slab_release(magazine->slab,
+                                magazine->object[magazine->count]);
+  }
+  pthread_mutex_unlock(&(magazine->slab->lock));
+}
+
+/*
+ * Private definitions
+ */
+
+static gearman_server_slab_chunk_st *
+_server_slab_chunk_add(gearman_server_slab_st *slab)
+{
+  gearman_server_slab_chunk_st *chunk;
+  void *memory;
+  char *object;
+  uint32_t x;
+
+  if (posix_memalign(&memory, GEARMAN_SERVER_SLAB_CHUNK_SIZE,
+                     GEARMAN_SERVER_SLAB_CHUNK_SIZE) != 0)
+  {
+    return NULL;
+  }
+
+  chunk= memory;
+  chunk->slab= slab;
+  chunk->free_list= NULL;
+  chunk->free_count= slab->chunk_objects;
+
+  /* Thread the free list from the end so objects are handed out in address
+     order. */
+  object= (char *)chunk + _SERVER_SLAB_HEADER_SIZE +
+          (slab->size * slab->chunk_objects);
+  for (x= 0; x < slab->chunk_objects; x++)
+  {
+    object-= slab->size;
+    *((void **)object)= chunk->free_list;
+    chunk->free_list= object;
+  }
+
+  GEARMAN_LIST_ADD(slab->chunk, chunk,)
+  GEARMAN_BUCKET_ADD(slab->partial_list, chunk, partial_)
+  slab->empty_count++;
+
+  return chunk;
+}
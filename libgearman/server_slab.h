@@ -0,0 +1,93 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server Slab declarations
+ */
+
+#ifndef __GEARMAN_SERVER_SLAB_H__
+#define __GEARMAN_SERVER_SLAB_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_slab Server Slab Allocation
+ * @ingroup gearman_server
+ * This is a low level interface for allocating fixed size server objects.
+ * Each slab hands out objects of one size from aligned chunks, and chunks are
+ * returned to the system once too many of them are completely free. The
+ * slab functions do no locking on their own; callers either serialize access
+ * or go through a magazine, which keeps a small per-thread cache of objects
+ * and only takes the slab lock to refill or drain it.
+ * @{
+ */
+
+/**
+ * Initialize a slab structure for objects of the given size.
+ */
+GEARMAN_API
+gearman_server_slab_st *gearman_server_slab_create(gearman_server_slab_st *slab,
+                                                   size_t size);
+
+/**
+ * Free a slab structure and all chunks it holds. Any objects still in use
+ * from this slab are no longer valid after this.
+ */
+GEARMAN_API
+void gearman_server_slab_free(gearman_server_slab_st *slab);
+
+/**
+ * Get an object from a slab.
+ */
+GEARMAN_API
+void *gearman_server_slab_alloc(gearman_server_slab_st *slab);
+
+/**
+ * Return an object to the slab it came from.
+ */
+GEARMAN_API
+void gearman_server_slab_release(gearman_server_slab_st *slab, void *object);
+
+/**
+ * Initialize a magazine for a slab.
+ */
+GEARMAN_API
+void gearman_server_magazine_init(gearman_server_magazine_st *magazine,
+                                  gearman_server_slab_st *slab);
+
+/**
+ * Get an object through a magazine, refilling it from the slab if empty. An
+ * object already in the magazine counts as a hit, and a refill as a miss.
+ */
+GEARMAN_API
+void *gearman_server_magazine_alloc(gearman_server_magazine_st *magazine);
+
+/**
+ * Return an object through a magazine, draining half of it back to the slab
+ * if full. An object from a different slab is returned to that slab instead.
+ */
+GEARMAN_API
+void gearman_server_magazine_release(gearman_server_magazine_st *magazine,
+                                     void *object);
+
+/**
+ * Return all objects cached in a magazine to the slab.
+ */
+GEARMAN_API
+void gearman_server_magazine_flush(gearman_server_magazine_st *magazine);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_SLAB_H__ */
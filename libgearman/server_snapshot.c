@@ -0,0 +1,1004 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server queue snapshot definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_snapshot_private Private Server Queue Snapshot Functions
+ * @ingroup gearman_server_snapshot
+ * @{
+ */
+
+/**
+ * FNV-1a parameters for the file checksum.
+ */
+#define _SERVER_SNAPSHOT_FNV_OFFSET 2166136261U
+#define _SERVER_SNAPSHOT_FNV_PRIME 16777619U
+
+/**
+ * Main function for the snapshot thread.
+ */
+static void *_server_snapshot_thread(void *data);
+
+/**
+ * Take one snapshot, logging and counting a failure.
+ */
+static gearman_return_t _server_snapshot_take(gearman_server_st *server);
+
+/**
+ * Write the persisted jobs of one shard, with its lock held.
+ */
+static bool _server_snapshot_shard(gearman_server_shard_st *shard, FILE *fp,
+                                   uint32_t *checksum, uint64_t *count);
+
+/**
+ * Write bytes to the snapshot, adding them to the checksum.
+ */
+static bool _server_snapshot_put(FILE *fp, uint32_t *checksum,
+                                 const void *data, size_t size);
+
+/**
+ * Add bytes to a checksum.
+ */
+static uint32_t _server_snapshot_checksum(uint32_t checksum, const void *data,
+                                          size_t size);
+
+/**
+ * Store and read 64-bit numbers in network byte order.
+ */
+static void _server_snapshot_pack64(uint8_t *ptr, uint64_t value);
+static uint64_t _server_snapshot_unpack64(const uint8_t *ptr);
+
+/**
+ * Sync the directory a file is in, so a rename into it lasts.
+ */
+static void _server_snapshot_sync_dir(const char *path);
+
+/**
+ * Check a mapped snapshot file, returning its mark and job count.
+ */
+static bool _server_snapshot_check(const uint8_t *map, size_t size,
+                                   uint64_t *mark, uint64_t *count);
+
+/**
+ * Add the jobs in a checked snapshot file, leaving out dropped ones.
+ */
+static gearman_return_t _server_snapshot_add_all(gearman_server_st *server,
+                                                 const uint8_t *map,
+                                                 uint64_t count);
+
+/**
+ * Key for a job in the drop table.
+ */
+static uint64_t _server_snapshot_drop_key(const void *function_name,
+                                          size_t function_name_size,
+                                          const void *unique,
+                                          size_t unique_size);
+
+/**
+ * See if a job was removed after the snapshot was taken.
+ */
+static bool _server_snapshot_dropped(gearman_server_snapshot_st *snapshot,
+                                     const void *function_name,
+                                     size_t function_name_size,
+                                     const void *unique, size_t unique_size);
+
+/**
+ * Free the drop table.
+ */
+static void _server_snapshot_drop_free(gearman_server_snapshot_st *snapshot);
+
+/**
+ * Done callback given to the tail replay, remembering jobs to leave out of
+ * the snapshot.
+ */
+static gearman_return_t _server_snapshot_drop(gearman_st *gearman,
+                                              void *fn_arg, const void *unique,
+                                              size_t unique_size,
+                                              const void *function_name,
+                                              size_t function_name_size);
+
+/**
+ * Add callback given to the tail replay. Jobs that are also in the snapshot
+ * are already there.
+ */
+static gearman_return_t _server_snapshot_add(gearman_st *gearman, void *fn_arg,
+                                             const void *unique,
+                                             size_t unique_size,
+                                             const void *function_name,
+                                             size_t function_name_size,
+                                             const void *data,
+                                             size_t data_size,
+                                             gearman_job_priority_t priority,
+                                             int64_t when);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_snapshot_init(gearman_server_snapshot_st *snapshot)
+{
+  snapshot->started= false;
+  snapshot->shutdown= false;
+  snapshot->loaded= false;
+  snapshot->interval= GEARMAN_DEFAULT_SNAPSHOT_INTERVAL;
+  snapshot->drop_hash_size= 0;
+  snapshot->drop_count= 0;
+  snapshot->mark= 0;
+  snapshot->count= 0;
+  snapshot->fail_count= 0;
+  snapshot->job_count= 0;
+  snapshot->size= 0;
+  snapshot->usec= 0;
+  snapshot->time= 0;
+  snapshot->path= NULL;
+  snapshot->drop_hash= NULL;
+}
+
+void gearman_server_snapshot_free(gearman_server_snapshot_st *snapshot)
+{
+  _server_snapshot_drop_free(snapshot);
+
+  if (snapshot->path != NULL)
+  {
+    free(snapshot->path);
+    snapshot->path= NULL;
+  }
+}
+
+bool gearman_server_snapshot_enabled(gearman_server_st *server)
+{
+  gearman_st *gearman= server->gearman;
+
+  return server->snapshot.path != NULL &&
+         server->options & GEARMAN_SERVER_PROC_THREAD &&
+         gearman->queue_mark_fn != NULL &&
+         gearman->queue_checkpoint_fn != NULL &&
+         gearman->queue_replay_tail_fn != NULL;
+}
+
+gearman_return_t gearman_server_snapshot_load(gearman_server_st *server,
+                                              bool *loaded)
+{
+  gearman_server_snapshot_st *snapshot= &(server->snapshot);
+  gearman_server_replay_st *replay= &(server->replay);
+  gearman_st *gearman= server->gearman;
+  struct stat st;
+  uint8_t *map;
+  size_t size;
+  uint64_t count;
+  uint32_t x;
+  int fd;
+  gearman_return_t ret;
+
+  *loaded= false;
+
+  fd= open(snapshot->path, O_RDONLY);
+  if (fd == -1)
+  {
+    if (errno != ENOENT)
+    {
+      GEARMAN_ERROR(gearman, "Could not open snapshot %s:%d", snapshot->path,
+                    errno)
+    }
+
+    GEARMAN_INFO(gearman, "No snapshot to load, replaying the whole queue")
+    return GEARMAN_SUCCESS;
+  }
+
+  if (fstat(fd, &st) == -1 || st.st_size == 0)
+  {
+    (void) close(fd);
+    GEARMAN_ERROR(gearman, "Snapshot %s is empty, replaying the whole queue",
+                  snapshot->path)
+    return GEARMAN_SUCCESS;
+  }
+
+  size= (size_t)st.st_size;
+  map= mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  (void) close(fd);
+  if (map == MAP_FAILED)
+  {
+    GEARMAN_ERROR(gearman, "Could not map snapshot %s:%d", snapshot->path,
+                  errno)
+    return GEARMAN_SUCCESS;
+  }
+
+  (void) madvise(map, size, MADV_SEQUENTIAL);
+
+  if (!_server_snapshot_check(map, size, &(snapshot->mark), &count))
+  {
+    (void) munmap(map, size);
+    GEARMAN_ERROR(gearman, "Snapshot %s is damaged, replaying the whole queue",
+                  snapshot->path)
+    return GEARMAN_SUCCESS;
+  }
+
+  replay->started= true;
+  replay->running= true;
+  replay->start= time(NULL);
+
+  /* Jobs removed after the mark are found first, so the snapshot can be
+     loaded without them. Nothing has been added yet if this fails, so the
+     whole queue can still be replayed. */
+  ret= (*(gearman->queue_replay_tail_fn))(gearman,
+                                          (void *)gearman->queue_fn_arg,
+                                          snapshot->mark, NULL,
+                                          _server_snapshot_drop, server);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    (void) munmap(map, size);
+    _server_snapshot_drop_free(snapshot);
+    replay->started= false;
+    replay->running= false;
+    GEARMAN_ERROR(gearman, "Could not read the queue after snapshot %s:%d, "
+                  "replaying the whole queue", snapshot->path, ret)
+    return GEARMAN_SUCCESS;
+  }
+
+  /* Size the tables once instead of growing them while the jobs go in. */
+  for (x= 0; x < server->shard_count; x++)
+  {
+    (void)gearman_server_job_hash_resize(&(server->shard_list[x]),
+                              (uint32_t)(count / server->shard_count) + 1);
+  }
+
+  server->options|= GEARMAN_SERVER_QUEUE_REPLAY;
+
+  ret= _server_snapshot_add_all(server, map, count);
+  (void) munmap(map, size);
+  _server_snapshot_drop_free(snapshot);
+
+  if (ret == GEARMAN_SUCCESS)
+  {
+    ret= (*(gearman->queue_replay_tail_fn))(gearman,
+                                            (void *)gearman->queue_fn_arg,
+                                            snapshot->mark,
+                                            _server_snapshot_add, NULL,
+                                            server);
+  }
+
+  server->options&= (gearman_server_options_t)~GEARMAN_SERVER_QUEUE_REPLAY;
+
+  replay->ret= ret;
+  replay->end= time(NULL);
+  replay->running= false;
+
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  snapshot->loaded= true;
+  *loaded= true;
+
+  GEARMAN_INFO(gearman, "Loaded %"PRIu64" jobs from snapshot %s in %lu "
+               "seconds", replay->add_count, snapshot->path,
+               (unsigned long)(replay->end - replay->start))
+
+  return GEARMAN_SUCCESS;
+}
+
+gearman_return_t gearman_server_snapshot_start(gearman_server_st *server)
+{
+  gearman_server_snapshot_st *snapshot= &(server->snapshot);
+
+  if (pthread_mutex_init(&(snapshot->lock), NULL) != 0)
+  {
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_snapshot_start",
+                      "pthread_mutex_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  if (pthread_cond_init(&(snapshot->cond), NULL) != 0)
+  {
+    (void) pthread_mutex_destroy(&(snapshot->lock));
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_snapshot_start",
+                      "pthread_cond_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  /* Nothing is connected yet, so no processing thread is in the queue
+     module while this changes how it is locked. */
+  server->queue_shared= true;
+
+  if (pthread_create(&(snapshot->id), NULL, _server_snapshot_thread,
+                     server) != 0)
+  {
+    (void) pthread_cond_destroy(&(snapshot->cond));
+    (void) pthread_mutex_destroy(&(snapshot->lock));
+    GEARMAN_ERROR_SET(server->gearman, "gearman_server_snapshot_start",
+                      "pthread_create")
+    return GEARMAN_PTHREAD;
+  }
+
+  snapshot->started= true;
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_server_snapshot_stop(gearman_server_st *server)
+{
+  gearman_server_snapshot_st *snapshot= &(server->snapshot);
+
+  if (!(snapshot->started))
+    return;
+
+  (void) pthread_mutex_lock(&(snapshot->lock));
+  snapshot->shutdown= true;
+  (void) pthread_cond_signal(&(snapshot->cond));
+  (void) pthread_mutex_unlock(&(snapshot->lock));
+
+  (void) pthread_join(snapshot->id, NULL);
+  snapshot->started= false;
+
+  (void) pthread_cond_destroy(&(snapshot->cond));
+  (void) pthread_mutex_destroy(&(snapshot->lock));
+
+  /* A replay still running has not told the module about all of its jobs,
+     so the queue is left for it to finish next time. */
+  if (!(server->replay.running))
+    (void)_server_snapshot_take(server);
+}
+
+size_t gearman_server_snapshot_status(gearman_server_st *server, char *buffer,
+                                      size_t buffer_size)
+{
+  gearman_server_snapshot_st *snapshot= &(server->snapshot);
+  int size;
+
+  if (!(snapshot->started))
+  {
+    snprintf(buffer, buffer_size, "none\n");
+    return strlen(buffer);
+  }
+
+  /* Only the snapshot thread writes these, so a loose read is fine. */
+  size= snprintf(buffer, buffer_size,
+                 "%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%lu\n",
+                 snapshot->count, snapshot->fail_count, snapshot->job_count,
+                 snapshot->size, snapshot->usec,
+                 snapshot->time == 0 ? 0UL :
+                 (unsigned long)(time(NULL) - snapshot->time));
+  if (size < 0)
+    return 0;
+  if ((size_t)size >= buffer_size)
+    return buffer_size - 1;
+
+  return (size_t)size;
+}
+
+/*
+ * Private definitions
+ */
+
+static void *_server_snapshot_thread(void *data)
+{
+  gearman_server_st *server= (gearman_server_st *)data;
+  gearman_server_snapshot_st *snapshot= &(server->snapshot);
+  struct timespec deadline;
+  struct timeval now;
+
+  (void) pthread_mutex_lock(&(snapshot->lock));
+
+  while (!(snapshot->shutdown))
+  {
+    /* With no interval, the only snapshot is the one taken on shutdown. */
+    if (snapshot->interval == 0)
+      (void) pthread_cond_wait(&(snapshot->cond), &(snapshot->lock));
+    else
+    {
+      (void) gettimeofday(&now, NULL);
+      deadline.tv_sec= now.tv_sec + (time_t)(snapshot->interval);
+      deadline.tv_nsec= now.tv_usec * 1000;
+      (void) pthread_cond_timedwait(&(snapshot->cond), &(snapshot->lock),
+                                    &deadline);
+    }
+
+    if (snapshot->shutdown)
+      break;
+
+    /* The module may be dropping nothing while a background replay walks
+       it, and the replay has not added everything yet anyway. */
+    if (server->replay.running)
+      continue;
+
+    (void) pthread_mutex_unlock(&(snapshot->lock));
+    (void)_server_snapshot_take(server);
+    (void) pthread_mutex_lock(&(snapshot->lock));
+  }
+
+  (void) pthread_mutex_unlock(&(snapshot->lock));
+
+  return NULL;
+}
+
+static gearman_return_t _server_snapshot_take(gearman_server_st *server)
+{
+  gearman_server_snapshot_st *snapshot= &(server->snapshot);
+  gearman_st *gearman= server->gearman;
+  gearman_server_shard_st *shard;
+  char tmp_path[GEARMAN_SERVER_SNAPSHOT_PATH_SIZE];
+  uint8_t buffer[GEARMAN_SERVER_SNAPSHOT_HEADER_SIZE];
+  struct timeval start;
+  struct timeval end;
+  uint32_t checksum= _SERVER_SNAPSHOT_FNV_OFFSET;
+  uint32_t tmp;
+  uint64_t mark;
+  uint64_t count= 0;
+  uint32_t x;
+  long size;
+  bool ok;
+  FILE *fp;
+  gearman_return_t ret;
+
+  (void) gettimeofday(&start, NULL);
+
+  /* Everything stored from here on is replayed on top of the snapshot, so
+     jobs can change while the shards are written one at a time. */
+  GEARMAN_SERVER_QUEUE_LOCK(server)
+  ret= (*(gearman->queue_mark_fn))(gearman, (void *)gearman->queue_fn_arg,
+                                   &mark);
+  GEARMAN_SERVER_QUEUE_UNLOCK(server)
+  if (ret != GEARMAN_SUCCESS)
+  {
+    snapshot->fail_count++;
+    GEARMAN_ERROR(gearman, "Could not mark the queue for a snapshot:%d", ret)
+    return ret;
+  }
+
+  snprintf(tmp_path, GEARMAN_SERVER_SNAPSHOT_PATH_SIZE, "%s.tmp", snapshot->path);
+
+  fp= fopen(tmp_path, "w");
+  if (fp == NULL)
+  {
+    snapshot->fail_count++;
+    GEARMAN_ERROR(gearman, "Could not create snapshot %s.tmp:%d",
+                  snapshot->path, errno)
+    return GEARMAN_ERRNO;
+  }
+
+  (void) setvbuf(fp, NULL, _IOFBF, GEARMAN_SERVER_SNAPSHOT_BUFFER_SIZE);
+
+  memcpy(buffer, GEARMAN_SERVER_SNAPSHOT_MAGIC, 8);
+  _server_snapshot_pack64(buffer + 8, mark);
+  ok= _server_snapshot_put(fp, &checksum, buffer,
+                           GEARMAN_SERVER_SNAPSHOT_HEADER_SIZE);
+
+  for (x= 0; x < server->shard_count && ok; x++)
+  {
+    shard= &(server->shard_list[x]);
+
+    GEARMAN_SERVER_LOCK(shard->server, &(shard->lock), &(shard->lock_stats))
+    ok= _server_snapshot_shard(shard, fp, &checksum, &count);
+    GEARMAN_SERVER_UNLOCK(shard->server, &(shard->lock), &(shard->lock_stats))
+  }
+
+  if (ok)
+  {
+    _server_snapshot_pack64(buffer, count);
+    ok= _server_snapshot_put(fp, &checksum, buffer, 8);
+  }
+
+  if (ok)
+  {
+    tmp= htonl(checksum);
+    ok= fwrite(&tmp, 4, 1, fp) == 1;
+  }
+
+  size= ftell(fp);
+
+  if (fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+    ok= false;
+
+  if (fclose(fp) != 0)
+    ok= false;
+
+  if (!ok || rename(tmp_path, snapshot->path) == -1)
+  {
+    (void) unlink(tmp_path);
+    snapshot->fail_count++;
+    GEARMAN_ERROR(gearman, "Could not write snapshot %s:%d", snapshot->path,
+                  errno)
+    return GEARMAN_ERRNO;
+  }
+
+  /* The old snapshot must stay gone before the module drops what it needs. */
+  _server_snapshot_sync_dir(snapshot->path);
+
+  GEARMAN_SERVER_QUEUE_LOCK(server)
+  ret= (*(gearman->queue_checkpoint_fn))(gearman,
+                                         (void *)gearman->queue_fn_arg, mark);
+  GEARMAN_SERVER_QUEUE_UNLOCK(server)
+  if (ret != GEARMAN_SUCCESS)
+  {
+    /* The snapshot is still good, the module just keeps more around. */
+    GEARMAN_ERROR(gearman, "Could not checkpoint the queue:%d", ret)
+  }
+
+  (void) gettimeofday(&end, NULL);
+
+  snapshot->count++;
+  snapshot->job_count= count;
+  snapshot->size= size < 0 ? 0 : (uint64_t)size;
+  snapshot->usec= (uint64_t)(end.tv_sec - start.tv_sec) * 1000000 +
+                  (uint64_t)(end.tv_usec) - (uint64_t)(start.tv_usec);
+  snapshot->time= end.tv_sec;
+
+  GEARMAN_DEBUG(gearman, "Wrote snapshot of %"PRIu64" jobs in %"PRIu64
+                " microseconds", count, snapshot->usec)
+
+  return GEARMAN_SUCCESS;
+}
+
+static bool _server_snapshot_shard(gearman_server_shard_st *shard, FILE *fp,
+                                   uint32_t *checksum, uint64_t *count)
+{
+  gearman_server_job_st **hash;
+  gearman_server_job_st *server_job;
+  uint8_t header[GEARMAN_SERVER_SNAPSHOT_RECORD_SIZE + 8];
+  size_t header_size;
+  size_t unique_size;
+  uint32_t hash_size;
+  uint32_t tmp;
+  uint16_t tmp16;
+  uint32_t x;
+  uint32_t y;
+
+  /* A table being grown has jobs in both the old and new buckets. */
+  for (y= 0; y < 2; y++)
+  {
+    hash= y == 0 ? shard->unique_hash : shard->unique_hash_old;
+    hash_size= y == 0 ? shard->hash_size : shard->hash_old_size;
+    if (hash == NULL)
+      continue;
+
+    for (x= 0; x < hash_size; x++)
+    {
+      for (server_job= hash[x]; server_job != NULL;
+           server_job= server_job->unique_next)
+      {
+        /* Foreground jobs are gone on restart anyway. */
+        if (!(server_job->options & GEARMAN_SERVER_JOB_QUEUED))
+          continue;
+
+        unique_size= server_job->unique_size;
+
+        /* Jobs still waiting for their time carry it after the header. */
+        header[0]= (uint8_t)(server_job->priority);
+        header_size= GEARMAN_SERVER_SNAPSHOT_RECORD_SIZE;
+        if (server_job->options & GEARMAN_SERVER_JOB_SCHEDULED)
+        {
+          header[1]= GEARMAN_SERVER_SNAPSHOT_RECORD_WHEN;
+          _server_snapshot_pack64(header + header_size,
+                                  (uint64_t)(server_job->when));
+          header_size+= 8;
+        }
+        else
+          header[1]= 0;
+        tmp16= htons((uint16_t)(server_job->function->function_name_size));
+        memcpy(header + 2, &tmp16, 2);
+        tmp= htonl((uint32_t)unique_size);
+        memcpy(header + 4, &tmp, 4);
+        tmp= htonl((uint32_t)(server_job->data_size));
+        memcpy(header + 8, &tmp, 4);
+
+        if (!_server_snapshot_put(fp, checksum, header, header_size) ||
+            !_server_snapshot_put(fp, checksum,
+                                  server_job->function->function_name,
+                              server_job->function->function_name_size) ||
+            !_server_snapshot_put(fp, checksum, server_job->unique,
+                                  unique_size) ||
+            !_server_snapshot_put(fp, checksum,
+                                  gearman_server_spill_data(server_job),
+                                  server_job->data_size))
+        {
+          return false;
+        }
+
+        (*count)++;
+      }
+    }
+  }
+
+  return true;
+}
+
+static bool _server_snapshot_put(FILE *fp, uint32_t *checksum,
+                                 const void *data, size_t size)
+{
+  if (size == 0)
+    return true;
+
+  *checksum= _server_snapshot_checksum(*checksum, data, size);
+
+  return fwrite(data, size, 1, fp) == 1;
+}
+
+static uint32_t _server_snapshot_checksum(uint32_t checksum, const void *data,
+                                          size_t size)
+{
+  const uint8_t *ptr= (const uint8_t *)data;
+  const uint8_t *end= ptr + size;
+
+  while (ptr < end)
+  {
+    checksum^= *ptr++;
+    checksum*= _SERVER_SNAPSHOT_FNV_PRIME;
+  }
+
+  return checksum;
+}
+
+static void _server_snapshot_pack64(uint8_t *ptr, uint64_t value)
+{
+  uint32_t tmp;
+
+  tmp= htonl((uint32_t)(value >> 32));
+  memcpy(ptr, &tmp, 4);
+  tmp= htonl((uint32_t)value);
+  memcpy(ptr + 4, &tmp, 4);
+}
+
+static uint64_t _server_snapshot_unpack64(const uint8_t *ptr)
+{
+  uint32_t high;
+  uint32_t low;
+
+  memcpy(&high, ptr, 4);
+  memcpy(&low, ptr + 4, 4);
+
+  return ((uint64_t)ntohl(high) << 32) | (uint64_t)ntohl(low);
+}
+
+static void _server_snapshot_sync_dir(const char *path)
+{
+  char dir[GEARMAN_SERVER_SNAPSHOT_PATH_SIZE];
+  const char *slash;
+  int fd;
+
+  slash= strrchr(path, '/');
+  if (slash == NULL)
+    snprintf(dir, GEARMAN_SERVER_SNAPSHOT_PATH_SIZE, ".");
+  else if (slash == path)
+    snprintf(dir, GEARMAN_SERVER_SNAPSHOT_PATH_SIZE, "/");
+  else
+    snprintf(dir, GEARMAN_SERVER_SNAPSHOT_PATH_SIZE, "%.*s", (int)(slash - path), path);
+
+  fd= open(dir, O_RDONLY);
+  if (fd == -1)
+    return;
+
+  (void) fsync(fd);
+  (void) close(fd);
+}
+
+static bool _server_snapshot_check(const uint8_t *map, size_t size,
+                                   uint64_t *mark, uint64_t *count)
+{
+  const uint8_t *ptr;
+  const uint8_t *end;
+  uint32_t tmp;
+  uint16_t tmp16;
+  uint64_t found= 0;
+  size_t record_size;
+
+  if (size < GEARMAN_SERVER_SNAPSHOT_HEADER_SIZE +
+             GEARMAN_SERVER_SNAPSHOT_TRAILER_SIZE ||
+      memcmp(map, GEARMAN_SERVER_SNAPSHOT_MAGIC, 8))
+  {
+    return false;
+  }
+
+  memcpy(&tmp, map + size - 4, 4);
+  if (ntohl(tmp) != _server_snapshot_checksum(_SERVER_SNAPSHOT_FNV_OFFSET,
+                                              map, size - 4))
+  {
+    return false;
+  }
+
+  *mark= _server_snapshot_unpack64(map + 8);
+  *count= _server_snapshot_unpack64(map + size -
+                                    GEARMAN_SERVER_SNAPSHOT_TRAILER_SIZE);
+
+  /* Make sure every record fits before any job is added from it. */
+  ptr= map + GEARMAN_SERVER_SNAPSHOT_HEADER_SIZE;
+  end= map + size - GEARMAN_SERVER_SNAPSHOT_TRAILER_SIZE;
+  while (ptr < end)
+  {
+    if ((size_t)(end - ptr) < GEARMAN_SERVER_SNAPSHOT_RECORD_SIZE)
+      return false;
+
+    memcpy(&tmp16, ptr + 2, 2);
+    record_size= GEARMAN_SERVER_SNAPSHOT_RECORD_SIZE + ntohs(tmp16);
+    if (ptr[1] & GEARMAN_SERVER_SNAPSHOT_RECORD_WHEN)
+      record_size+= 8;
+    memcpy(&tmp, ptr + 4, 4);
+    if (ntohl(tmp) >= GEARMAN_UNIQUE_SIZE)
+      return false;
+    record_size+= ntohl(tmp);
+    memcpy(&tmp, ptr + 8, 4);
+    record_size+= ntohl(tmp);
+
+    if (record_size > (size_t)(end - ptr))
+      return false;
+
+    ptr+= record_size;
+    found++;
+  }
+
+  return found == *count;
+}
+
+static gearman_return_t _server_snapshot_add_all(gearman_server_st *server,
+                                                 const uint8_t *map,
+                                                 uint64_t count)
+{
+  gearman_server_snapshot_st *snapshot= &(server->snapshot);
+  gearman_server_replay_st *replay= &(server->replay);
+  const uint8_t *ptr= map + GEARMAN_SERVER_SNAPSHOT_HEADER_SIZE;
+  const char *function_name;
+  const char *unique;
+  size_t function_name_size;
+  size_t unique_size;
+  size_t data_size;
+  size_t header_size;
+  int64_t when;
+  uint32_t tmp;
+  uint16_t tmp16;
+  uint64_t x;
+  void *data;
+  gearman_return_t ret;
+
+  for (x= 0; x < count; x++)
+  {
+    memcpy(&tmp16, ptr + 2, 2);
+    function_name_size= ntohs(tmp16);
+    memcpy(&tmp, ptr + 4, 4);
+    unique_size= ntohl(tmp);
+    memcpy(&tmp, ptr + 8, 4);
+    data_size= ntohl(tmp);
+
+    header_size= GEARMAN_SERVER_SNAPSHOT_RECORD_SIZE;
+    if (ptr[1] & GEARMAN_SERVER_SNAPSHOT_RECORD_WHEN)
+    {
+      when= (int64_t)_server_snapshot_unpack64(ptr + header_size);
+      header_size+= 8;
+    }
+    else
+      when= 0;
+
+    function_name= (const char *)ptr + header_size;
+    unique= function_name + function_name_size;
+
+    replay->read_count++;
+
+    if (snapshot->drop_count == 0 ||
+        !_server_snapshot_dropped(snapshot, function_name, function_name_size,
+                                  unique, unique_size))
+    {
+      if (data_size == 0)
+        data= NULL;
+      else
+      {
+        /* Jobs own their payloads, and the map goes away after loading. */
+        data= malloc(data_size);
+        if (data == NULL)
+        {
+          GEARMAN_ERROR_SET(server->gearman, "_server_snapshot_add_all",
+                            "malloc")
+          return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+        }
+
+        memcpy(data, unique + unique_size, data_size);
+      }
+
+      (void)gearman_server_job_add(server, function_name, function_name_size,
+                                   unique, unique_size, data, data_size,
+                                   (gearman_job_priority_t)ptr[0], when, NULL,
+                                   &ret);
+      if (ret == GEARMAN_SUCCESS)
+        replay->add_count++;
+      else
+      {
+        if (data != NULL)
+          free(data);
+
+        if (ret != GEARMAN_JOB_EXISTS)
+        {
+          GEARMAN_ERROR_SET(server->gearman, "_server_snapshot_add_all",
+                            "gearman_server_job_add:%d", ret)
+          return ret;
+        }
+      }
+    }
+
+    ptr+= header_size + function_name_size + unique_size + data_size;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static uint64_t _server_snapshot_drop_key(const void *function_name,
+                                          size_t function_name_size,
+                                          const void *unique,
+                                          size_t unique_size)
+{
+  return gearman_server_hash64(unique, unique_size) ^
+         gearman_server_hash64(function_name, function_name_size);
+}
+
+static bool _server_snapshot_dropped(gearman_server_snapshot_st *snapshot,
+                                     const void *function_name,
+                                     size_t function_name_size,
+                                     const void *unique, size_t unique_size)
+{
+  gearman_server_snapshot_drop_st *drop;
+  uint64_t key;
+
+  key= _server_snapshot_drop_key(function_name, function_name_size, unique,
+                                 unique_size);
+
+  for (drop= snapshot->drop_hash[key % snapshot->drop_hash_size];
+       drop != NULL; drop= drop->next)
+  {
+    if (drop->key == key && drop->function_name_size == function_name_size &&
+        drop->unique_size == unique_size &&
+        !memcmp(drop + 1, function_name, function_name_size) &&
+        !memcmp((uint8_t *)(drop + 1) + function_name_size, unique,
+                unique_size))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void _server_snapshot_drop_free(gearman_server_snapshot_st *snapshot)
+{
+  gearman_server_snapshot_drop_st *drop;
+  uint32_t x;
+
+  if (snapshot->drop_hash == NULL)
+    return;
+
+  for (x= 0; x < snapshot->drop_hash_size; x++)
+  {
+    while (snapshot->drop_hash[x] != NULL)
+    {
+      drop= snapshot->drop_hash[x];
+      snapshot->drop_hash[x]= drop->next;
+      free(drop);
+    }
+  }
+
+  free(snapshot->drop_hash);
+  snapshot->drop_hash= NULL;
+  snapshot->drop_hash_size= 0;
+  snapshot->drop_count= 0;
+}
+
+static gearman_return_t _server_snapshot_drop(gearman_st *gearman,
+                                              void *fn_arg, const void *unique,
+                                              size_t unique_size,
+                                              const void *function_name,
+                                              size_t function_name_size)
+{
+  gearman_server_st *server= (gearman_server_st *)fn_arg;
+  gearman_server_snapshot_st *snapshot= &(server->snapshot);
+  gearman_server_snapshot_drop_st **hash;
+  gearman_server_snapshot_drop_st *drop;
+  uint32_t size;
+  uint32_t x;
+
+  if (snapshot->drop_hash == NULL)
+  {
+    snapshot->drop_hash= calloc(GEARMAN_SERVER_SNAPSHOT_DROP_HASH_SIZE,
+                                sizeof(gearman_server_snapshot_drop_st *));
+    if (snapshot->drop_hash == NULL)
+    {
+      GEARMAN_ERROR_SET(gearman, "_server_snapshot_drop", "calloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    snapshot->drop_hash_size= GEARMAN_SERVER_SNAPSHOT_DROP_HASH_SIZE;
+  }
+  else if (_server_snapshot_dropped(snapshot, function_name,
+                                    function_name_size, unique, unique_size))
+  {
+    return GEARMAN_SUCCESS;
+  }
+
+  /* Grow the table to keep chains short. */
+  if (snapshot->drop_count >= snapshot->drop_hash_size &&
+      snapshot->drop_hash_size < (UINT32_MAX >> 1))
+  {
+    size= snapshot->drop_hash_size << 1;
+    hash= calloc(size, sizeof(gearman_server_snapshot_drop_st *));
+    if (hash != NULL)
+    {
+      for (x= 0; x < snapshot->drop_hash_size; x++)
+      {
+        while (snapshot->drop_hash[x] != NULL)
+        {
+          drop= snapshot->drop_hash[x];
+          snapshot->drop_hash[x]= drop->next;
+          drop->next= hash[drop->key % size];
+          hash[drop->key % size]= drop;
+        }
+      }
+
+      free(snapshot->drop_hash);
+      snapshot->drop_hash= hash;
+      snapshot->drop_hash_size= size;
+    }
+  }
+
+  drop= malloc(sizeof(gearman_server_snapshot_drop_st) + function_name_size +
+               unique_size);
+  if (drop == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "_server_snapshot_drop", "malloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  drop->key= _server_snapshot_drop_key(function_name, function_name_size,
+                                       unique, unique_size);
+  drop->function_name_size= function_name_size;
+  drop->unique_size= unique_size;
+  memcpy(drop + 1, function_name, function_name_size);
+  memcpy((uint8_t *)(drop + 1) + function_name_size, unique, unique_size);
+  drop->next= snapshot->drop_hash[drop->key % snapshot->drop_hash_size];
+  snapshot->drop_hash[drop->key % snapshot->drop_hash_size]= drop;
+  snapshot->drop_count++;
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _server_snapshot_add(gearman_st *gearman, void *fn_arg,
+                                             const void *unique,
+                                             size_t unique_size,
+                                             const void *function_name,
+                                             size_t function_name_size,
+                                             const void *data,
+                                             size_t data_size,
+                                             gearman_job_priority_t priority,
+                                             int64_t when)
+{
+  gearman_server_st *server= (gearman_server_st *)fn_arg;
+  gearman_return_t ret;
+
+  (void) gearman;
+
+  server->replay.read_count++;
+
+  (void)gearman_server_job_add(server, (char *)function_name,
+                               function_name_size, (char *)unique, unique_size,
+                               data, data_size, priority, when, NULL, &ret);
+  if (ret == GEARMAN_SUCCESS)
+    server->replay.add_count++;
+  else if (ret == GEARMAN_JOB_EXISTS)
+  {
+    /* Jobs still queued that were added after the mark can be in both. */
+    if (data != NULL)
+      free((void *)data);
+    ret= GEARMAN_SUCCESS;
+  }
+
+  return ret;
+}
@@ -0,0 +1,105 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server queue snapshot declarations
+ */
+
+#ifndef __GEARMAN_SERVER_SNAPSHOT_H__
+#define __GEARMAN_SERVER_SNAPSHOT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_snapshot Server Queue Snapshots
+ * @ingroup gearman_server
+ * This is a low level interface for restarting from a snapshot of the queued
+ * jobs instead of replaying every record in the persistent queue. A snapshot
+ * thread asks the queue module for a mark, writes the function, priority,
+ * unique key, and payload of every persisted job to one file shard by shard,
+ * and then tells the module it may drop what it stored before the mark. At
+ * startup the snapshot is mapped and its jobs are added in one pass, and only
+ * the records after its mark are replayed from the module: first the jobs
+ * removed since, which are left out of the snapshot, then the jobs still
+ * queued. Each shard is held locked while it is written, so the shard waits
+ * for its jobs to be copied out. This needs processing threads and a queue
+ * module with mark, checkpoint, and tail replay functions.
+ *
+ * The file starts with GEARMAN_SERVER_SNAPSHOT_MAGIC and the mark, followed
+ * by each job as a priority byte, a zero byte, the function name size (16
+ * bits), the unique key size and payload size (32 bits each), and then those
+ * bytes. It ends with the job count (64 bits) and an FNV-1a checksum (32 bits)
+ * of everything before it. Numbers are in network byte order.
+ * @{
+ */
+
+/**
+ * Initialize the snapshot state for a server.
+ */
+GEARMAN_API
+void gearman_server_snapshot_init(gearman_server_snapshot_st *snapshot);
+
+/**
+ * Free the snapshot state for a server.
+ */
+GEARMAN_API
+void gearman_server_snapshot_free(gearman_server_snapshot_st *snapshot);
+
+/**
+ * See if snapshots can be used with the current options and queue module.
+ */
+GEARMAN_API
+bool gearman_server_snapshot_enabled(gearman_server_st *server);
+
+/**
+ * Load the snapshot file if there is a good one, along with the tail of the
+ * persistent queue after it. This should only be run at startup. When there
+ * is no usable snapshot nothing is loaded, and the whole queue should be
+ * replayed instead.
+ * @param server Server structure previously initialized with
+ *        gearman_server_create.
+ * @param loaded Set to true if the jobs were loaded from the snapshot.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_snapshot_load(gearman_server_st *server,
+                                              bool *loaded);
+
+/**
+ * Start the snapshot thread.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_snapshot_start(gearman_server_st *server);
+
+/**
+ * Stop the snapshot thread and wait for it to exit, then take one last
+ * snapshot so the next start has little to replay. This must be called while
+ * the queue module is still there.
+ */
+GEARMAN_API
+void gearman_server_snapshot_stop(gearman_server_st *server);
+
+/**
+ * Write figures for the "snapshot" admin command: snapshots written, failed
+ * snapshots, and the jobs, bytes, microseconds taken, and age in seconds of
+ * the last one.
+ */
+GEARMAN_API
+size_t gearman_server_snapshot_status(gearman_server_st *server, char *buffer,
+                                      size_t buffer_size);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_SNAPSHOT_H__ */
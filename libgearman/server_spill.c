@@ -0,0 +1,235 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server spill store definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_spill_private Private Server Spill Functions
+ * @ingroup gearman_server_spill
+ * @{
+ */
+
+/**
+ * Create the spill file, unlinking it right away so it goes away with us.
+ */
+static bool _server_spill_open(gearman_server_spill_st *spill,
+                               const char *path);
+
+/**
+ * Grow the spill file and its mapping to hold at least size bytes.
+ */
+static bool _server_spill_grow(gearman_server_spill_st *spill, size_t size);
+
+/**
+ * Drop one job from the spill file, truncating it once it holds none.
+ */
+static void _server_spill_drop(gearman_server_spill_st *spill);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_spill_init(gearman_server_spill_st *spill)
+{
+  spill->fd= -1;
+  spill->job_count= 0;
+  spill->memory_size= 0;
+  spill->size= 0;
+  spill->map_size= 0;
+  spill->map= NULL;
+}
+
+void gearman_server_spill_free(gearman_server_spill_st *spill)
+{
+  if (spill->map != NULL)
+    (void) munmap(spill->map, spill->map_size);
+
+  if (spill->fd != -1)
+    (void) close(spill->fd);
+
+  gearman_server_spill_init(spill);
+}
+
+void gearman_server_spill_add(gearman_server_job_st *server_job,
+                              bool background)
+{
+  gearman_server_st *server= server_job->function->shard->server;
+  gearman_server_spill_st *spill= &(server_job->function->shard->spill);
+  size_t watermark;
+
+  if (server_job->data == NULL)
+    return;
+
+  /* Each shard keeps an even share of the payloads in memory. */
+  watermark= server->spill_watermark / server->shard_count;
+
+  /* A client is waiting on foreground jobs, so those are run soon anyway. */
+  if (!background || server->spill_path == NULL ||
+      spill->memory_size + server_job->data_size <= watermark)
+  {
+    spill->memory_size+= server_job->data_size;
+    return;
+  }
+
+  if (spill->fd == -1 && !_server_spill_open(spill, server->spill_path))
+  {
+    spill->memory_size+= server_job->data_size;
+    return;
+  }
+
+  if (spill->size + server_job->data_size > spill->map_size &&
+      !_server_spill_grow(spill, spill->size + server_job->data_size))
+  {
+    spill->memory_size+= server_job->data_size;
+    return;
+  }
+
+  memcpy(spill->map + spill->size, server_job->data, server_job->data_size);
+  server_job->spill_offset= spill->size;
+  spill->size+= server_job->data_size;
+  spill->job_count++;
+
+  free((void *)(server_job->data));
+  server_job->data= NULL;
+  server_job->options|= GEARMAN_SERVER_JOB_SPILLED;
+}
+
+gearman_return_t gearman_server_spill_load(gearman_server_job_st *server_job)
+{
+  gearman_server_spill_st *spill= &(server_job->function->shard->spill);
+  void *data;
+
+  if (!(server_job->options & GEARMAN_SERVER_JOB_SPILLED))
+    return GEARMAN_SUCCESS;
+
+  data= malloc(server_job->data_size);
+  if (data == NULL)
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+
+  memcpy(data, spill->map + server_job->spill_offset, server_job->data_size);
+  server_job->data= data;
+  server_job->options&=
+                     (gearman_server_job_options_t)~GEARMAN_SERVER_JOB_SPILLED;
+  spill->memory_size+= server_job->data_size;
+
+  _server_spill_drop(spill);
+
+  return GEARMAN_SUCCESS;
+}
+
+const void *gearman_server_spill_data(gearman_server_job_st *server_job)
+{
+  if (server_job->options & GEARMAN_SERVER_JOB_SPILLED)
+  {
+    return server_job->function->shard->spill.map +
+           server_job->spill_offset;
+  }
+
+  return server_job->data;
+}
+
+void gearman_server_spill_release(gearman_server_job_st *server_job)
+{
+  gearman_server_spill_st *spill= &(server_job->function->shard->spill);
+
+  if (server_job->options & GEARMAN_SERVER_JOB_SPILLED)
+  {
+    server_job->options&=
+                     (gearman_server_job_options_t)~GEARMAN_SERVER_JOB_SPILLED;
+    _server_spill_drop(spill);
+  }
+  else if (server_job->data != NULL)
+  {
+    spill->memory_size-= server_job->data_size;
+    free((void *)(server_job->data));
+  }
+
+  server_job->data= NULL;
+}
+
+/*
+ * Private definitions
+ */
+
+static bool _server_spill_open(gearman_server_spill_st *spill,
+                               const char *path)
+{
+  size_t size;
+  char *name;
+
+  size= strlen(path) + sizeof("/gearmand-spill-XXXXXX");
+  name= malloc(size);
+  if (name == NULL)
+    return false;
+
+  snprintf(name, size, "%s/gearmand-spill-XXXXXX", path);
+
+  spill->fd= mkstemp(name);
+  if (spill->fd != -1)
+    (void) unlink(name);
+
+  free(name);
+
+  return spill->fd != -1;
+}
+
+static bool _server_spill_grow(gearman_server_spill_st *spill, size_t size)
+{
+  size_t map_size;
+  uint8_t *map;
+
+  map_size= spill->map_size == 0 ? GEARMAN_SERVER_SPILL_SIZE : spill->map_size;
+  while (map_size < size)
+  {
+    if (map_size > (SIZE_MAX >> 1))
+      return false;
+    map_size<<= 1;
+  }
+
+  if (ftruncate(spill->fd, (off_t)map_size) == -1)
+    return false;
+
+  /* Map the new size before letting go of the old mapping, so a failure
+     leaves the spilled payloads where they were. */
+  map= mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, spill->fd, 0);
+  if (map == MAP_FAILED)
+    return false;
+
+  if (spill->map != NULL)
+    (void) munmap(spill->map, spill->map_size);
+
+  spill->map= map;
+  spill->map_size= map_size;
+
+  return true;
+}
+
+static void _server_spill_drop(gearman_server_spill_st *spill)
+{
+  spill->job_count--;
+  if (spill->job_count != 0)
+    return;
+
+  /* The file is append only, so space is only given back once it's empty. */
+  (void) munmap(spill->map, spill->map_size);
+  (void) ftruncate(spill->fd, 0);
+  spill->size= 0;
+  spill->map_size= 0;
+  spill->map= NULL;
+}
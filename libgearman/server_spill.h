@@ -0,0 +1,91 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server spill store declarations
+ */
+
+#ifndef __GEARMAN_SERVER_SPILL_H__
+#define __GEARMAN_SERVER_SPILL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_spill Server Spill Store
+ * @ingroup gearman_server
+ * This is a low level interface for moving queued job payloads out of the
+ * heap. Once the payloads held in memory by a shard pass its share of the
+ * server spill watermark, payloads of new background jobs are appended to a
+ * memory mapped file instead, and only the job structure stays in memory.
+ * The payload is copied back to the heap when a worker takes the job. The
+ * file is unlinked as soon as it is created and only ever grows, until the
+ * last spilled job is gone and it is truncated back to nothing. The spill
+ * functions do no locking on their own and run under the shard lock.
+ * @{
+ */
+
+/**
+ * Initialize the spill store for a shard. No file is created until the first
+ * payload is spilled.
+ */
+GEARMAN_API
+void gearman_server_spill_init(gearman_server_spill_st *spill);
+
+/**
+ * Unmap and close the spill file for a shard, if there is one.
+ */
+GEARMAN_API
+void gearman_server_spill_free(gearman_server_spill_st *spill);
+
+/**
+ * Account for a job payload being queued, moving it to the spill file if the
+ * shard is over its watermark. On success the heap copy is freed and the job
+ * is marked GEARMAN_SERVER_JOB_SPILLED. Any failure just leaves the payload
+ * in memory.
+ * @param server_job Job whose data was just set.
+ * @param background Whether the job is a background job. Only those are
+ *        spilled.
+ */
+GEARMAN_API
+void gearman_server_spill_add(gearman_server_job_st *server_job,
+                              bool background);
+
+/**
+ * Copy a spilled payload back to the heap so it can be sent to a worker.
+ * This does nothing for jobs that were never spilled.
+ * @param server_job Job to load.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_spill_load(gearman_server_job_st *server_job);
+
+/**
+ * Get the payload for a job, wherever it is stored. For spilled jobs the
+ * pointer is into the spill file and is only valid until the next payload is
+ * spilled.
+ */
+GEARMAN_API
+const void *gearman_server_spill_data(gearman_server_job_st *server_job);
+
+/**
+ * Account for a job being freed. This frees the heap payload, or drops the
+ * job from the spill file.
+ */
+GEARMAN_API
+void gearman_server_spill_release(gearman_server_job_st *server_job);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_SPILL_H__ */
@@ -0,0 +1,1143 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server stats snapshot definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_stats_private Private Server Stats Functions
+ * @ingroup gearman_server_stats
+ * @{
+ */
+
+/**
+ * Growable buffer a snapshot is formatted into.
+ */
+typedef struct
+{
+  char *data;
+  size_t size;
+  size_t total;
+  bool error;
+} gearman_server_stats_out_st;
+
+/**
+ * Per function metric families in the "metrics" reply.
+ */
+typedef enum
+{
+  GEARMAN_SERVER_METRIC_JOBS,
+  GEARMAN_SERVER_METRIC_RUNNING,
+  GEARMAN_SERVER_METRIC_WORKERS,
+  GEARMAN_SERVER_METRIC_TIMEOUTS,
+  GEARMAN_SERVER_METRIC_BYTES,
+  GEARMAN_SERVER_METRIC_OLDEST,
+  GEARMAN_SERVER_METRIC_WAIT,
+  GEARMAN_SERVER_METRIC_RUN,
+  GEARMAN_SERVER_METRIC_MAX
+} gearman_server_metric_t;
+
+/**
+ * Per I/O thread metric families in the "metrics" reply.
+ */
+typedef enum
+{
+  GEARMAN_SERVER_METRIC_THREAD_CONNECTIONS,
+  GEARMAN_SERVER_METRIC_THREAD_READ_BYTES,
+  GEARMAN_SERVER_METRIC_THREAD_WRITE_BYTES,
+  GEARMAN_SERVER_METRIC_THREAD_READ_CALLS,
+  GEARMAN_SERVER_METRIC_THREAD_WRITE_CALLS,
+  GEARMAN_SERVER_METRIC_THREAD_EAGAIN,
+  GEARMAN_SERVER_METRIC_THREAD_MAX
+} gearman_server_metric_thread_t;
+
+/**
+ * Name, type and help text of each per function metric family.
+ */
+static const struct
+{
+  const char *name;
+  const char *type;
+  const char *help;
+} _stats_metric_list[GEARMAN_SERVER_METRIC_MAX]=
+{
+  { "gearmand_function_jobs", "gauge",
+    "Jobs queued or running for a function." },
+  { "gearmand_function_running", "gauge",
+    "Jobs of a function assigned to a worker." },
+  { "gearmand_function_workers", "gauge",
+    "Workers registered for a function." },
+  { "gearmand_function_timeouts_total", "counter",
+    "Jobs of a function that timed out on a worker." },
+  { "gearmand_function_queue_bytes", "gauge",
+    "Bytes of job data queued for a function." },
+  { "gearmand_function_oldest_seconds", "gauge",
+    "Age of the oldest queued job of a function." },
+  { "gearmand_function_wait_seconds", "histogram",
+    "Time jobs waited in the queue before their first assignment." },
+  { "gearmand_function_run_seconds", "histogram",
+    "Time from the latest assignment of a job to WORK_COMPLETE or WORK_FAIL." }
+};
+
+/**
+ * Name, type and help text of each per I/O thread metric family.
+ */
+static const struct
+{
+  const char *name;
+  const char *type;
+  const char *help;
+} _stats_metric_thread_list[GEARMAN_SERVER_METRIC_THREAD_MAX]=
+{
+  { "gearmand_thread_connections", "gauge",
+    "Connections handled by an I/O thread." },
+  { "gearmand_thread_read_bytes_total", "counter",
+    "Bytes read by an I/O thread." },
+  { "gearmand_thread_written_bytes_total", "counter",
+    "Bytes written by an I/O thread." },
+  { "gearmand_thread_read_calls_total", "counter",
+    "Read calls made by an I/O thread." },
+  { "gearmand_thread_write_calls_total", "counter",
+    "Write calls made by an I/O thread." },
+  { "gearmand_thread_eagain_total", "counter",
+    "Reads and writes by an I/O thread that would have blocked." }
+};
+
+/**
+ * Bucket bounds for the latency histograms in the "metrics" reply, in
+ * microseconds and as the le label gives them in seconds.
+ */
+static const struct
+{
+  uint64_t value;
+  const char *le;
+} _stats_metric_bucket_list[]=
+{
+  { 100, "0.0001" },
+  { 1000, "0.001" },
+  { 10000, "0.01" },
+  { 100000, "0.1" },
+  { 1000000, "1" },
+  { 10000000, "10" },
+  { 60000000, "60" }
+};
+
+/**
+ * Append formatted text to a snapshot, growing it as needed. Once an
+ * allocation fails everything else is dropped and error is set.
+ */
+static void _stats_printf(gearman_server_stats_out_st *out,
+                          const char *format, ...);
+
+/**
+ * Append a string to a snapshot as a quoted JSON string.
+ */
+static void _stats_json_string(gearman_server_stats_out_st *out,
+                               const char *string, size_t string_size);
+
+/**
+ * Lock a single shard while reading from it, if it may be running in its own
+ * processing thread. The first shard is where text commands run.
+ */
+static void _stats_shard_lock(gearman_server_shard_st *shard);
+
+/**
+ * Unlock a shard locked with _stats_shard_lock.
+ */
+static void _stats_shard_unlock(gearman_server_shard_st *shard);
+
+/**
+ * Format the reply for "status" or "status json".
+ */
+static void _stats_status(gearman_server_st *server,
+                          gearman_server_stats_out_st *out, bool json);
+
+/**
+ * Format the reply for "workers" or "workers json".
+ */
+static void _stats_workers(gearman_server_st *server,
+                           gearman_server_stats_out_st *out, bool json);
+
+/**
+ * Format the reply for "stats" or "stats json".
+ */
+static void _stats_counters(gearman_server_st *server,
+                            gearman_server_stats_out_st *out, bool json);
+
+/**
+ * Format one counter for _stats_counters.
+ */
+static void _stats_counter(gearman_server_stats_out_st *out, bool json,
+                           const char **separator, const char *name,
+                           uint64_t value);
+
+/**
+ * Format the lock counters for _stats_counters, added up for each kind of
+ * lock. Times are in nanoseconds.
+ */
+static void _stats_locks(gearman_server_st *server,
+                         gearman_server_stats_out_st *out, bool json,
+                         const char **separator);
+
+/**
+ * Format the reply for "latency" or "latency json".
+ */
+static void _stats_latency(gearman_server_st *server,
+                           gearman_server_stats_out_st *out, bool json);
+
+/**
+ * Format one histogram for _stats_latency. A function with nothing recorded
+ * yet has no histograms, which is given as NULL and shown as all zeros.
+ */
+static void _stats_histogram(gearman_server_stats_out_st *out, bool json,
+                             const gearman_histogram_st *histogram);
+
+/**
+ * Format the reply for "metrics", in the Prometheus text exposition format.
+ */
+static void _stats_metrics(gearman_server_st *server,
+                           gearman_server_stats_out_st *out);
+
+/**
+ * Format the HELP and TYPE lines that start a metric family.
+ */
+static void _stats_metric_header(gearman_server_stats_out_st *out,
+                                 const char *name, const char *type,
+                                 const char *help);
+
+/**
+ * Format the samples one function has in a per function metric family.
+ */
+static void _stats_metric_function(gearman_server_stats_out_st *out,
+                                   gearman_server_metric_t metric,
+                                   gearman_server_function_st *function,
+                                   uint64_t now);
+
+/**
+ * Format a function name as a label value, escaping it as the exposition
+ * format needs.
+ */
+static void _stats_metric_label(gearman_server_stats_out_st *out,
+                                gearman_server_function_st *function);
+
+/**
+ * Get one value of an I/O thread, indexing _stats_metric_thread_list.
+ */
+static uint64_t _stats_metric_thread(gearman_server_thread_st *thread,
+                                     gearman_server_metric_thread_t metric);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_stats_init(gearman_server_st *server)
+{
+  uint32_t x;
+
+  server->stats_interval= GEARMAN_DEFAULT_STATS_INTERVAL;
+
+  for (x= 0; x < GEARMAN_SERVER_STATS_MAX; x++)
+  {
+    server->stats[x].time= 0;
+    server->stats[x].buffer= NULL;
+  }
+}
+
+void gearman_server_stats_free(gearman_server_st *server)
+{
+  uint32_t x;
+
+  for (x= 0; x < GEARMAN_SERVER_STATS_MAX; x++)
+  {
+    if (server->stats[x].buffer != NULL)
+      gearman_packet_buffer_release(server->stats[x].buffer);
+  }
+
+  gearman_server_stats_init(server);
+}
+
+gearman_return_t gearman_server_stats_send(gearman_server_con_st *server_con,
+                                           gearman_server_stats_t type)
+{
+  gearman_server_st *server= server_con->thread->server;
+  gearman_server_stats_st *stats= &(server->stats[type]);
+  gearman_server_stats_out_st out;
+  gearman_packet_buffer_st *buffer;
+  time_t now;
+
+  now= time(NULL);
+
+  if (stats->buffer == NULL || server->stats_interval == 0 ||
+      now - stats->time >= (time_t)(server->stats_interval) ||
+      now < stats->time)
+  {
+    out.data= NULL;
+    out.size= 0;
+    out.total= 0;
+    out.error= false;
+
+    if (type == GEARMAN_SERVER_STATS_STATUS ||
+        type == GEARMAN_SERVER_STATS_STATUS_JSON)
+    {
+      _stats_status(server, &out, type == GEARMAN_SERVER_STATS_STATUS_JSON);
+    }
+    else if (type == GEARMAN_SERVER_STATS_WORKERS ||
+             type == GEARMAN_SERVER_STATS_WORKERS_JSON)
+    {
+      _stats_workers(server, &out, type == GEARMAN_SERVER_STATS_WORKERS_JSON);
+    }
+    else if (type == GEARMAN_SERVER_STATS_LATENCY ||
+             type == GEARMAN_SERVER_STATS_LATENCY_JSON)
+    {
+      _stats_latency(server, &out, type == GEARMAN_SERVER_STATS_LATENCY_JSON);
+    }
+    else if (type == GEARMAN_SERVER_STATS_METRICS)
+      _stats_metrics(server, &out);
+    else
+    {
+      _stats_counters(server, &out,
+                      type == GEARMAN_SERVER_STATS_COUNTERS_JSON);
+    }
+
+    if (out.error)
+    {
+      free(out.data);
+      GEARMAN_ERROR_SET(server_con->thread->gearman,
+                        "gearman_server_stats_send", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    buffer= gearman_packet_buffer_create(out.data, out.size);
+    if (buffer == NULL)
+    {
+      free(out.data);
+      GEARMAN_ERROR_SET(server_con->thread->gearman,
+                        "gearman_server_stats_send", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    /* Connections still sending the old snapshot hold their own reference. */
+    if (stats->buffer != NULL)
+      gearman_packet_buffer_release(stats->buffer);
+
+    stats->buffer= buffer;
+    stats->time= now;
+  }
+
+  return gearman_server_io_buffer_add(server_con, 0, GEARMAN_MAGIC_TEXT,
+                                      GEARMAN_COMMAND_TEXT, stats->buffer,
+                                      NULL);
+}
+
+/*
+ * Private definitions
+ */
+
+static void _stats_printf(gearman_server_stats_out_st *out,
+                          const char *format, ...)
+{
+  va_list ap;
+  int length;
+  size_t total;
+  char *data;
+
+  if (out->error)
+    return;
+
+  while (1)
+  {
+    if (out->total > out->size)
+    {
+      va_start(ap, format);
+      length= vsnprintf(out->data + out->size, out->total - out->size, format,
+                        ap);
+      va_end(ap);
+
+      if (length < 0)
+      {
+        out->error= true;
+        return;
+      }
+
+      if ((size_t)length < out->total - out->size)
+      {
+        out->size+= (size_t)length;
+        return;
+      }
+    }
+
+    total= out->total == 0 ? GEARMAN_TEXT_RESPONSE_SIZE : out->total << 1;
+    data= realloc(out->data, total);
+    if (data == NULL)
+    {
+      out->error= true;
+      return;
+    }
+
+    out->data= data;
+    out->total= total;
+  }
+}
+
+static void _stats_json_string(gearman_server_stats_out_st *out,
+                               const char *string, size_t string_size)
+{
+  size_t start;
+  size_t x;
+  unsigned char c;
+
+  _stats_printf(out, "\"");
+
+  for (start= 0, x= 0; x < string_size; x++)
+  {
+    c= (unsigned char)string[x];
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+
+    _stats_printf(out, "%.*s", (int)(x - start), string + start);
+
+    if (c == '"' || c == '\\')
+      _stats_printf(out, "\\%c", c);
+    else
+      _stats_printf(out, "\\u%04x", c);
+
+    start= x + 1;
+  }
+
+  _stats_printf(out, "%.*s\"", (int)(x - start), string + start);
+}
+
+static void _stats_shard_lock(gearman_server_shard_st *shard)
+{
+  if (shard->id != 0 && shard->server->options & GEARMAN_SERVER_PROC_THREAD)
+    GEARMAN_SERVER_LOCK(shard->server, &(shard->lock), &(shard->lock_stats))
+}
+
+static void _stats_shard_unlock(gearman_server_shard_st *shard)
+{
+  if (shard->id != 0 && shard->server->options & GEARMAN_SERVER_PROC_THREAD)
+    GEARMAN_SERVER_UNLOCK(shard->server, &(shard->lock), &(shard->lock_stats))
+}
+
+static void _stats_status(gearman_server_st *server,
+                          gearman_server_stats_out_st *out, bool json)
+{
+  gearman_server_shard_st *shard;
+  gearman_server_function_st *function;
+  const char *separator= "";
+  uint32_t x;
+
+  if (json)
+    _stats_printf(out, "{\"functions\":[");
+
+  /* Functions never move between shards, so each one only needs to be
+     consistent on its own and the shards can be locked one at a time. */
+  for (x= 0; x < server->shard_count; x++)
+  {
+    shard= &(server->shard_list[x]);
+    _stats_shard_lock(shard);
+
+    for (function= shard->function_list; function != NULL;
+         function= function->next)
+    {
+      if (json)
+      {
+        _stats_printf(out, "%s{\"name\":", separator);
+        _stats_json_string(out, function->function_name,
+                           function->function_name_size);
+        _stats_printf(out, ",\"total\":%u,\"running\":%u,\"workers\":%u,"
+                      "\"timeouts\":%"PRIu64",\"weight\":%u,"
+                      "\"scheduled\":%u,\"bytes\":%"PRIu64"}",
+                      function->job_total, function->job_running,
+                      function->worker_count, function->timeout_count,
+                      function->weight, function->job_scheduled,
+                      (uint64_t)(function->queue_bytes));
+        separator= ",";
+      }
+      else
+      {
+        _stats_printf(out, "%.*s\t%u\t%u\t%u\n",
+                      (int)(function->function_name_size),
+                      function->function_name, function->job_total,
+                      function->job_running, function->worker_count);
+      }
+    }
+
+    _stats_shard_unlock(shard);
+  }
+
+  _stats_printf(out, json ? "]}\n" : ".\n");
+}
+
+static void _stats_workers(gearman_server_st *server,
+                           gearman_server_stats_out_st *out, bool json)
+{
+  gearman_server_thread_st *thread;
+  gearman_server_con_st *con;
+  gearman_server_worker_st *worker;
+  const char *separator= "";
+  const char *function_separator;
+  const char *host;
+  const char *id;
+  uint32_t x;
+
+  if (json)
+    _stats_printf(out, "{\"workers\":[");
+
+  /* Text commands run in the first shard, so lock the rest while looking at
+     workers in them. */
+  gearman_server_shard_lock(server);
+
+  for (thread= server->thread_list; thread != NULL; thread= thread->next)
+  {
+    GEARMAN_SERVER_THREAD_LOCK(thread)
+
+    for (con= thread->con_list; con != NULL; con= con->next)
+    {
+      if (con->host == NULL)
+        continue;
+
+      /* Peers are only named once something like this needs it. */
+      host= gearman_server_con_host(con);
+      id= gearman_server_con_id(con);
+
+      if (json)
+      {
+        _stats_printf(out, "%s{\"fd\":%d,\"ip\":", separator, con->con.fd);
+        _stats_json_string(out, host, strlen(host));
+        _stats_printf(out, ",\"id\":");
+        _stats_json_string(out, id, strlen(id));
+        _stats_printf(out, ",\"functions\":[");
+        separator= ",";
+      }
+      else
+        _stats_printf(out, "%d %s %s :", con->con.fd, host, id);
+
+      function_separator= "";
+
+      for (x= 0; x < server->shard_count; x++)
+      {
+        for (worker= con->shard_list[x].worker_list; worker != NULL;
+             worker= worker->con_next)
+        {
+          if (json)
+          {
+            _stats_printf(out, "%s", function_separator);
+            _stats_json_string(out, worker->function->function_name,
+                               worker->function->function_name_size);
+            function_separator= ",";
+          }
+          else
+          {
+            _stats_printf(out, " %.*s",
+                          (int)(worker->function->function_name_size),
+                          worker->function->function_name);
+          }
+        }
+      }
+
+      _stats_printf(out, json ? "]}" : "\n");
+    }
+
+    GEARMAN_SERVER_THREAD_UNLOCK(thread)
+  }
+
+  gearman_server_shard_unlock(server);
+
+  _stats_printf(out, json ? "]}\n" : ".\n");
+}
+
+static void _stats_counters(gearman_server_st *server,
+                            gearman_server_stats_out_st *out, bool json)
+{
+  gearman_server_thread_st *thread;
+  gearman_server_shard_st *shard;
+  gearman_st *gearman;
+  uint64_t packets_in[GEARMAN_COMMAND_MAX];
+  uint64_t packets_out[GEARMAN_COMMAND_MAX];
+  uint64_t read_count= 0;
+  uint64_t read_bytes= 0;
+  uint64_t write_count= 0;
+  uint64_t write_bytes= 0;
+  uint64_t eagain_count= 0;
+  uint64_t io_wakeups_sent= 0;
+  uint64_t io_wakeups_received= 0;
+  uint64_t io_queue_takes= 0;
+  uint64_t io_queue_cons= 0;
+  uint64_t proc_wakeups_sent= 0;
+  uint64_t proc_wakeups_received= 0;
+  uint64_t proc_queue_takes= 0;
+  uint64_t proc_queue_cons= 0;
+  uint64_t hit_count= server->packet_magazine.hit_count +
+                      server->io_packet_magazine.hit_count;
+  uint64_t miss_count= server->packet_magazine.miss_count +
+                       server->io_packet_magazine.miss_count;
+  const char *separator= "";
+  uint32_t thread_count= 0;
+  uint32_t x;
+
+  memset(packets_in, 0, sizeof(packets_in));
+  memset(packets_out, 0, sizeof(packets_out));
+
+  /* Each counter only has one writer, so a loose read is fine. */
+  for (thread= server->thread_list; thread != NULL; thread= thread->next)
+  {
+    gearman= thread->gearman;
+    read_count+= gearman->read_count;
+    read_bytes+= gearman->read_bytes;
+    write_count+= gearman->write_count;
+    write_bytes+= gearman->write_bytes;
+    eagain_count+= gearman->eagain_count;
+    io_wakeups_sent+= thread->wakeups_sent;
+    io_wakeups_received+= thread->wakeups_received;
+    io_queue_takes+= thread->io_queue_takes;
+    io_queue_cons+= thread->io_queue_cons;
+    hit_count+= thread->packet_magazine.hit_count +
+                thread->io_packet_magazine.hit_count;
+    miss_count+= thread->packet_magazine.miss_count +
+                 thread->io_packet_magazine.miss_count;
+
+    for (x= 0; x < GEARMAN_COMMAND_MAX; x++)
+    {
+      packets_in[x]+= thread->packets_in[x];
+      packets_out[x]+= thread->packets_out[x];
+    }
+
+    thread_count++;
+  }
+
+  for (x= 0; x < server->shard_count; x++)
+  {
+    shard= &(server->shard_list[x]);
+    proc_wakeups_sent+= shard->wakeups_sent;
+    proc_wakeups_received+= shard->wakeups_received;
+    proc_queue_takes+= shard->proc_queue_takes;
+    proc_queue_cons+= shard->proc_queue_cons;
+    hit_count+= shard->packet_magazine.hit_count +
+                shard->io_packet_magazine.hit_count;
+    miss_count+= shard->packet_magazine.miss_count +
+                 shard->io_packet_magazine.miss_count;
+  }
+
+  if (json)
+    _stats_printf(out, "{");
+
+  _stats_counter(out, json, &separator, "io_threads", thread_count);
+  _stats_counter(out, json, &separator, "proc_threads",
+                 server->options & GEARMAN_SERVER_PROC_THREAD ?
+                 server->shard_count : 0);
+  _stats_counter(out, json, &separator, "bytes_read", read_bytes);
+  _stats_counter(out, json, &separator, "bytes_written", write_bytes);
+  _stats_counter(out, json, &separator, "read_calls", read_count);
+  _stats_counter(out, json, &separator, "write_calls", write_count);
+  _stats_counter(out, json, &separator, "eagain", eagain_count);
+  _stats_counter(out, json, &separator, "io_wakeups_sent", io_wakeups_sent);
+  _stats_counter(out, json, &separator, "io_wakeups_received",
+                 io_wakeups_received);
+  _stats_counter(out, json, &separator, "io_queue_takes", io_queue_takes);
+  _stats_counter(out, json, &separator, "io_queue_cons", io_queue_cons);
+  _stats_counter(out, json, &separator, "proc_wakeups_sent",
+                 proc_wakeups_sent);
+  _stats_counter(out, json, &separator, "proc_wakeups_received",
+                 proc_wakeups_received);
+  _stats_counter(out, json, &separator, "proc_queue_takes", proc_queue_takes);
+  _stats_counter(out, json, &separator, "proc_queue_cons", proc_queue_cons);
+  _stats_counter(out, json, &separator, "packet_hits", hit_count);
+  _stats_counter(out, json, &separator, "packet_misses", miss_count);
+
+  if (server->options & GEARMAN_SERVER_LOCK_STATS)
+    _stats_locks(server, out, json, &separator);
+
+  /* The average depth a queue had each time its thread emptied it. */
+  if (json)
+  {
+    _stats_printf(out, ",\"io_queue_depth\":%.2f,\"proc_queue_depth\":%.2f",
+                  io_queue_takes == 0 ? 0.0 :
+                  (double)io_queue_cons / (double)io_queue_takes,
+                  proc_queue_takes == 0 ? 0.0 :
+                  (double)proc_queue_cons / (double)proc_queue_takes);
+    _stats_printf(out, ",\"packets_in\":{");
+  }
+  else
+  {
+    _stats_printf(out, "io_queue_depth\t%.2f\nproc_queue_depth\t%.2f\n",
+                  io_queue_takes == 0 ? 0.0 :
+                  (double)io_queue_cons / (double)io_queue_takes,
+                  proc_queue_takes == 0 ? 0.0 :
+                  (double)proc_queue_cons / (double)proc_queue_takes);
+  }
+
+  /* Only commands that were seen are listed. */
+  separator= "";
+  for (x= 0; x < GEARMAN_COMMAND_MAX; x++)
+  {
+    if (packets_in[x] == 0)
+      continue;
+
+    if (json)
+    {
+      _stats_printf(out, "%s\"%s\":%"PRIu64, separator,
+                    gearman_command_info_list[x].name, packets_in[x]);
+      separator= ",";
+    }
+    else
+    {
+      _stats_printf(out, "packets_in.%s\t%"PRIu64"\n",
+                    gearman_command_info_list[x].name, packets_in[x]);
+    }
+  }
+
+  if (json)
+    _stats_printf(out, "},\"packets_out\":{");
+
+  separator= "";
+  for (x= 0; x < GEARMAN_COMMAND_MAX; x++)
+  {
+    if (packets_out[x] == 0)
+      continue;
+
+    if (json)
+    {
+      _stats_printf(out, "%s\"%s\":%"PRIu64, separator,
+                    gearman_command_info_list[x].name, packets_out[x]);
+      separator= ",";
+    }
+    else
+    {
+      _stats_printf(out, "packets_out.%s\t%"PRIu64"\n",
+                    gearman_command_info_list[x].name, packets_out[x]);
+    }
+  }
+
+  _stats_printf(out, json ? "}}\n" : ".\n");
+}
+
+static void _stats_counter(gearman_server_stats_out_st *out, bool json,
+                           const char **separator, const char *name,
+                           uint64_t value)
+{
+  if (json)
+  {
+    _stats_printf(out, "%s\"%s\":%"PRIu64, *separator, name, value);
+    *separator= ",";
+  }
+  else
+    _stats_printf(out, "%s\t%"PRIu64"\n", name, value);
+}
+
+static void _stats_locks(gearman_server_st *server,
+                         gearman_server_stats_out_st *out, bool json,
+                         const char **separator)
+{
+  gearman_server_lock_stats_st *stats;
+  gearman_histogram_st wait[GEARMAN_SERVER_LOCK_MAX];
+  gearman_histogram_st hold[GEARMAN_SERVER_LOCK_MAX];
+  uint64_t count[GEARMAN_SERVER_LOCK_MAX];
+  uint64_t contended[GEARMAN_SERVER_LOCK_MAX];
+  const char *site;
+  char name[64];
+  uint32_t x;
+
+  for (x= 0; x < GEARMAN_SERVER_LOCK_MAX; x++)
+  {
+    gearman_histogram_init(&(wait[x]));
+    gearman_histogram_init(&(hold[x]));
+    count[x]= 0;
+    contended[x]= 0;
+  }
+
+  /* The stats are only written under their own lock, which is not taken
+     here, so a reply may be an acquisition or two behind. */
+  for (stats= server->lock_stats_list; stats != NULL; stats= stats->next)
+  {
+    gearman_histogram_merge(&(wait[stats->site]), &(stats->wait));
+    gearman_histogram_merge(&(hold[stats->site]), &(stats->hold));
+    count[stats->site]+= stats->count;
+    contended[stats->site]+= stats->contended;
+  }
+
+  for (x= 0; x < GEARMAN_SERVER_LOCK_MAX; x++)
+  {
+    if (count[x] == 0)
+      continue;
+
+    site= gearman_server_lock_site_name(x);
+    snprintf(name, sizeof(name), "lock.%s.count", site);
+    _stats_counter(out, json, separator, name, count[x]);
+    snprintf(name, sizeof(name), "lock.%s.contended", site);
+    _stats_counter(out, json, separator, name, contended[x]);
+    snprintf(name, sizeof(name), "lock.%s.wait_p50", site);
+    _stats_counter(out, json, separator, name,
+                   gearman_histogram_percentile(&(wait[x]), 50));
+    snprintf(name, sizeof(name), "lock.%s.wait_p99", site);
+    _stats_counter(out, json, separator, name,
+                   gearman_histogram_percentile(&(wait[x]), 99));
+    snprintf(name, sizeof(name), "lock.%s.wait_max", site);
+    _stats_counter(out, json, separator, name,
+                   gearman_histogram_max(&(wait[x])));
+    snprintf(name, sizeof(name), "lock.%s.hold_p50", site);
+    _stats_counter(out, json, separator, name,
+                   gearman_histogram_percentile(&(hold[x]), 50));
+    snprintf(name, sizeof(name), "lock.%s.hold_p99", site);
+    _stats_counter(out, json, separator, name,
+                   gearman_histogram_percentile(&(hold[x]), 99));
+    snprintf(name, sizeof(name), "lock.%s.hold_max", site);
+    _stats_counter(out, json, separator, name,
+                   gearman_histogram_max(&(hold[x])));
+  }
+}
+
+static void _stats_latency(gearman_server_st *server,
+                           gearman_server_stats_out_st *out, bool json)
+{
+  gearman_server_shard_st *shard;
+  gearman_server_function_st *function;
+  const char *separator= "";
+  uint64_t now;
+  uint32_t x;
+
+  if (json)
+    _stats_printf(out, "{\"functions\":[");
+
+  for (x= 0; x < server->shard_count; x++)
+  {
+    shard= &(server->shard_list[x]);
+    _stats_shard_lock(shard);
+    now= gearman_time_now();
+
+    for (function= shard->function_list; function != NULL;
+         function= function->next)
+    {
+      if (json)
+      {
+        _stats_printf(out, "%s{\"name\":", separator);
+        _stats_json_string(out, function->function_name,
+                           function->function_name_size);
+        _stats_printf(out, ",\"oldest\":%"PRIu64",\"wait\":",
+                      gearman_server_function_oldest(function, now));
+        _stats_histogram(out, json, function->latency == NULL ? NULL :
+                         &(function->latency->wait));
+        _stats_printf(out, ",\"run\":");
+        _stats_histogram(out, json, function->latency == NULL ? NULL :
+                         &(function->latency->run));
+        _stats_printf(out, "}");
+        separator= ",";
+      }
+      else
+      {
+        _stats_printf(out, "%.*s", (int)(function->function_name_size),
+                      function->function_name);
+        _stats_histogram(out, json, function->latency == NULL ? NULL :
+                         &(function->latency->wait));
+        _stats_histogram(out, json, function->latency == NULL ? NULL :
+                         &(function->latency->run));
+        _stats_printf(out, "\t%"PRIu64"\n",
+                      gearman_server_function_oldest(function, now));
+      }
+    }
+
+    _stats_shard_unlock(shard);
+  }
+
+  _stats_printf(out, json ? "]}\n" : ".\n");
+}
+
+static void _stats_histogram(gearman_server_stats_out_st *out, bool json,
+                             const gearman_histogram_st *histogram)
+{
+  if (json)
+  {
+    if (histogram == NULL)
+    {
+      _stats_printf(out, "{\"count\":0,\"mean\":0,\"p50\":0,\"p90\":0,"
+                    "\"p99\":0,\"max\":0}");
+      return;
+    }
+
+    _stats_printf(out, "{\"count\":%"PRIu64",\"mean\":%"PRIu64","
+                  "\"p50\":%"PRIu64",\"p90\":%"PRIu64",\"p99\":%"PRIu64","
+                  "\"max\":%"PRIu64"}", gearman_histogram_count(histogram),
+                  gearman_histogram_mean(histogram),
+                  gearman_histogram_percentile(histogram, 50),
+                  gearman_histogram_percentile(histogram, 90),
+                  gearman_histogram_percentile(histogram, 99),
+                  gearman_histogram_max(histogram));
+  }
+  else if (histogram == NULL)
+    _stats_printf(out, "\t0\t0\t0\t0");
+  else
+  {
+    _stats_printf(out, "\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64,
+                  gearman_histogram_count(histogram),
+                  gearman_histogram_percentile(histogram, 50),
+                  gearman_histogram_percentile(histogram, 99),
+                  gearman_histogram_max(histogram));
+  }
+}
+
+static void _stats_metrics(gearman_server_st *server,
+                           gearman_server_stats_out_st *out)
+{
+  gearman_server_shard_st *shard;
+  gearman_server_function_st *function;
+  gearman_server_thread_st *thread;
+  uint64_t packets_in[GEARMAN_COMMAND_MAX];
+  uint64_t packets_out[GEARMAN_COMMAND_MAX];
+  uint32_t pending;
+  uint64_t lag;
+  uint64_t now;
+  uint32_t metric;
+  uint32_t x;
+
+  /* Samples of a family have to be together, so each family takes its own
+     pass over the functions. Like "status", each shard only needs to be
+     consistent on its own. */
+  for (metric= 0; metric < GEARMAN_SERVER_METRIC_MAX; metric++)
+  {
+    _stats_metric_header(out, _stats_metric_list[metric].name,
+                         _stats_metric_list[metric].type,
+                         _stats_metric_list[metric].help);
+
+    for (x= 0; x < server->shard_count; x++)
+    {
+      shard= &(server->shard_list[x]);
+      _stats_shard_lock(shard);
+      now= gearman_time_now();
+
+      for (function= shard->function_list; function != NULL;
+           function= function->next)
+      {
+        _stats_metric_function(out, (gearman_server_metric_t)metric,
+                               function, now);
+      }
+
+      _stats_shard_unlock(shard);
+    }
+  }
+
+  if (gearman_server_persist_backlog(server, &pending, &lag))
+  {
+    _stats_metric_header(out, "gearmand_persist_pending", "gauge",
+                         "Requests waiting for the persistence thread.");
+    _stats_printf(out, "gearmand_persist_pending %u\n", pending);
+    _stats_metric_header(out, "gearmand_persist_lag_seconds", "gauge",
+                         "Time the oldest request has waited for the "
+                         "persistence thread.");
+    _stats_printf(out, "gearmand_persist_lag_seconds %.6f\n",
+                  (double)lag / 1000000.0);
+  }
+
+  /* Each counter only has one writer, so a loose read is fine. */
+  for (metric= 0; metric < GEARMAN_SERVER_METRIC_THREAD_MAX; metric++)
+  {
+    _stats_metric_header(out, _stats_metric_thread_list[metric].name,
+                         _stats_metric_thread_list[metric].type,
+                         _stats_metric_thread_list[metric].help);
+
+    for (thread= server->thread_list, x= 0; thread != NULL;
+         thread= thread->next, x++)
+    {
+      _stats_printf(out, "%s{thread=\"%u\"} %"PRIu64"\n",
+                    _stats_metric_thread_list[metric].name, x,
+                    _stats_metric_thread(thread,
+                                      (gearman_server_metric_thread_t)metric));
+    }
+  }
+
+  memset(packets_in, 0, sizeof(packets_in));
+  memset(packets_out, 0, sizeof(packets_out));
+
+  for (thread= server->thread_list; thread != NULL; thread= thread->next)
+  {
+    for (x= 0; x < GEARMAN_COMMAND_MAX; x++)
+    {
+      packets_in[x]+= thread->packets_in[x];
+      packets_out[x]+= thread->packets_out[x];
+    }
+  }
+
+  /* Only commands that were seen are listed, as with "stats". */
+  _stats_metric_header(out, "gearmand_packets_received_total", "counter",
+                       "Packets read, by command.");
+  for (x= 0; x < GEARMAN_COMMAND_MAX; x++)
+  {
+    if (packets_in[x] > 0)
+    {
+      _stats_printf(out, "gearmand_packets_received_total{command=\"%s\"} "
+                    "%"PRIu64"\n", gearman_command_info_list[x].name,
+                    packets_in[x]);
+    }
+  }
+
+  _stats_metric_header(out, "gearmand_packets_sent_total", "counter",
+                       "Packets written, by command.");
+  for (x= 0; x < GEARMAN_COMMAND_MAX; x++)
+  {
+    if (packets_out[x] > 0)
+    {
+      _stats_printf(out, "gearmand_packets_sent_total{command=\"%s\"} "
+                    "%"PRIu64"\n", gearman_command_info_list[x].name,
+                    packets_out[x]);
+    }
+  }
+}
+
+static void _stats_metric_header(gearman_server_stats_out_st *out,
+                                 const char *name, const char *type,
+                                 const char *help)
+{
+  _stats_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void _stats_metric_function(gearman_server_stats_out_st *out,
+                                   gearman_server_metric_t metric,
+                                   gearman_server_function_st *function,
+                                   uint64_t now)
+{
+  const char *name= _stats_metric_list[metric].name;
+  const gearman_histogram_st *histogram= NULL;
+  uint64_t value;
+  uint32_t x;
+
+  switch (metric)
+  {
+  case GEARMAN_SERVER_METRIC_JOBS:
+    value= function->job_total;
+    break;
+
+  case GEARMAN_SERVER_METRIC_RUNNING:
+    value= function->job_running;
+    break;
+
+  case GEARMAN_SERVER_METRIC_WORKERS:
+    value= function->worker_count;
+    break;
+
+  case GEARMAN_SERVER_METRIC_TIMEOUTS:
+    value= function->timeout_count;
+    break;
+
+  case GEARMAN_SERVER_METRIC_BYTES:
+    value= (uint64_t)(function->queue_bytes);
+    break;
+
+  case GEARMAN_SERVER_METRIC_OLDEST:
+    _stats_printf(out, "%s{function=", name);
+    _stats_metric_label(out, function);
+    _stats_printf(out, "} %.6f\n",
+                  (double)gearman_server_function_oldest(function, now) /
+                  1000000.0);
+    return;
+
+  case GEARMAN_SERVER_METRIC_WAIT:
+  case GEARMAN_SERVER_METRIC_RUN:
+    /* A function with nothing recorded yet has no histograms. */
+    if (function->latency != NULL)
+    {
+      histogram= metric == GEARMAN_SERVER_METRIC_WAIT ?
+                 &(function->latency->wait) : &(function->latency->run);
+    }
+
+    for (x= 0;
+         x < sizeof(_stats_metric_bucket_list) /
+             sizeof(_stats_metric_bucket_list[0]);
+         x++)
+    {
+      _stats_printf(out, "%s_bucket{function=", name);
+      _stats_metric_label(out, function);
+      _stats_printf(out, ",le=\"%s\"} %"PRIu64"\n",
+                    _stats_metric_bucket_list[x].le,
+                    histogram == NULL ? 0 :
+                    gearman_histogram_count_at(histogram,
+                                            _stats_metric_bucket_list[x].value));
+    }
+
+    value= histogram == NULL ? 0 : gearman_histogram_count(histogram);
+
+    _stats_printf(out, "%s_bucket{function=", name);
+    _stats_metric_label(out, function);
+    _stats_printf(out, ",le=\"+Inf\"} %"PRIu64"\n", value);
+    _stats_printf(out, "%s_sum{function=", name);
+    _stats_metric_label(out, function);
+    _stats_printf(out, "} %.6f\n", histogram == NULL ? 0.0 :
+                  (double)gearman_histogram_sum(histogram) / 1000000.0);
+    _stats_printf(out, "%s_count{function=", name);
+    _stats_metric_label(out, function);
+    _stats_printf(out, "} %"PRIu64"\n", value);
+    return;
+
+  case GEARMAN_SERVER_METRIC_MAX:
+  default:
+    return;
+  }
+
+  _stats_printf(out, "%s{function=", name);
+  _stats_metric_label(out, function);
+  _stats_printf(out, "} %"PRIu64"\n", value);
+}
+
+static void _stats_metric_label(gearman_server_stats_out_st *out,
+                                gearman_server_function_st *function)
+{
+  const char *string= function->function_name;
+  size_t start;
+  size_t x;
+
+  _stats_printf(out, "\"");
+
+  for (start= 0, x= 0; x < function->function_name_size; x++)
+  {
+    if (string[x] != '"' && string[x] != '\\' && string[x] != '\n')
+      continue;
+
+    _stats_printf(out, "%.*s\\%c", (int)(x - start), string + start,
+                  string[x] == '\n' ? 'n' : string[x]);
+    start= x + 1;
+  }
+
+  _stats_printf(out, "%.*s\"", (int)(x - start), string + start);
+}
+
+static uint64_t _stats_metric_thread(gearman_server_thread_st *thread,
+                                     gearman_server_metric_thread_t metric)
+{
+  switch (metric)
+  {
+  case GEARMAN_SERVER_METRIC_THREAD_CONNECTIONS:
+    return thread->con_count;
+
+  case GEARMAN_SERVER_METRIC_THREAD_READ_BYTES:
+    return thread->gearman->read_bytes;
+
+  case GEARMAN_SERVER_METRIC_THREAD_WRITE_BYTES:
+    return thread->gearman->write_bytes;
+
+  case GEARMAN_SERVER_METRIC_THREAD_READ_CALLS:
+    return thread->gearman->read_count;
+
+  case GEARMAN_SERVER_METRIC_THREAD_WRITE_CALLS:
+    return thread->gearman->write_count;
+
+  case GEARMAN_SERVER_METRIC_THREAD_EAGAIN:
+    return thread->gearman->eagain_count;
+
+  case GEARMAN_SERVER_METRIC_THREAD_MAX:
+  default:
+    return 0;
+  }
+}
@@ -0,0 +1,81 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server stats snapshot declarations
+ */
+
+#ifndef __GEARMAN_SERVER_STATS_H__
+#define __GEARMAN_SERVER_STATS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_stats Server Stats Snapshots
+ * @ingroup gearman_server
+ * This is a low level interface for the replies to the "status", "workers",
+ * "stats", "latency" and "metrics" admin commands. Each reply is built into
+ * a shared, read only buffer that is handed to every admin connection asking
+ * for it until it is older than the stats interval, so many monitors polling
+ * at once only walk the functions and connections, and take the locks for
+ * them, once per interval. Only text commands use the snapshots, and those all run in the
+ * first shard, so the snapshots need no lock of their own.
+ *
+ * The "stats" reply adds up counters that each I/O thread, processing thread
+ * and packet magazine keeps for itself, with plain increments by the one
+ * thread that owns them. They are read here without locking, so a reply may
+ * be a packet or two behind, the same as with the "threads" command. With
+ * the GEARMAN_SERVER_LOCK_STATS option it also has lock counters for each
+ * kind of lock that was taken, see gearman_server_lock.
+ *
+ * The "latency" reply has a line per function with the count, median, 99th
+ * percentile and maximum of the time jobs waited in the queue before their
+ * first assignment, the same four for the time from the latest assignment to
+ * WORK_COMPLETE or WORK_FAIL, and the age of the oldest queued job, all in
+ * microseconds.
+ *
+ * The "metrics" reply has the "status" figures, the same two histograms with
+ * fixed buckets, the persistence thread backlog, and the I/O counters of each
+ * I/O thread, in the Prometheus text exposition format. The HTTP protocol
+ * module serves it for GET /metrics.
+ * @{
+ */
+
+/**
+ * Initialize the stats snapshots for a server.
+ */
+GEARMAN_API
+void gearman_server_stats_init(gearman_server_st *server);
+
+/**
+ * Release the stats snapshots for a server.
+ */
+GEARMAN_API
+void gearman_server_stats_free(gearman_server_st *server);
+
+/**
+ * Queue a stats snapshot on a connection, building a new one first if the
+ * current one is too old.
+ * @param server_con Connection to send the snapshot to.
+ * @param type Snapshot to send.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_stats_send(gearman_server_con_st *server_con,
+                                           gearman_server_stats_t type);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_STATS_H__ */
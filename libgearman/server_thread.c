@@ -23,31 +23,146 @@
  * @{
  */
 
+/**
+ * Flush outgoing packets for the connections processing threads queued for
+ * an I/O thread, and start reading the ones they let go of again.
+ */
+static gearman_server_con_st *_thread_io_run(gearman_server_thread_st *thread,
+                                             gearman_return_t *ret_ptr);
+
+/**
+ * Stop holding back wakeups for an I/O thread that leaves its reading early,
+ * and wake it if anything was queued for it meanwhile.
+ */
+static void _thread_io_reading_done(gearman_server_thread_st *thread);
+
 /**
  * Try reading packets for a connection.
  */
 gearman_return_t _thread_packet_read(gearman_server_con_st *con);
 
+/**
+ * Put connections that used up their read budget back on the ready list.
+ */
+static void _thread_budget_requeue(gearman_server_thread_st *thread);
+
+/**
+ * Stop reading a connection that streams work data to a client that is too
+ * far behind, until the client catches up.
+ */
+static gearman_return_t _thread_pause(gearman_server_con_st *con);
+
+/**
+ * Start reading paused connections again once the clients they wait on have
+ * caught up.
+ */
+static void _thread_pause_check(gearman_server_thread_st *thread);
+
+/**
+ * Take a submitted job out of the rate bucket of its connection.
+ * @return Whether the connection went over its rate and should stop being
+ *         read.
+ */
+static bool _thread_rate_charge(gearman_server_con_st *con,
+                                gearman_packet_st *packet);
+
+/**
+ * Add what a connection has earned since it was last topped up to its rate
+ * bucket, up to one second worth.
+ */
+static void _thread_rate_refill(gearman_server_con_st *con);
+
+/**
+ * Stop reading a connection that went over its rate, until its bucket has
+ * filled up again.
+ */
+static gearman_return_t _thread_rate_pause(gearman_server_con_st *con);
+
+/**
+ * Start reading connections that went over their rate again once their
+ * buckets are back to full.
+ */
+static void _thread_rate_check(gearman_server_thread_st *thread);
+
+/**
+ * Count a packet read or sent towards the load of its connection and thread,
+ * as one for the packet and one more for each GEARMAND_THREAD_LOAD_BYTES of
+ * its size.
+ */
+static void _thread_load(gearman_server_con_st *con, size_t size);
+
+/**
+ * Log a packet read or sent, through the packet log callback if there is one.
+ */
+static void _thread_packet_log(gearman_server_con_st *con,
+                               gearman_command_t command, bool sent);
+
+/**
+ * Run a packet read by an I/O thread when there are no processing threads,
+ * passing it through each shard it needs to visit.
+ */
+static gearman_return_t _thread_packet_run(gearman_server_con_st *con,
+                                           gearman_server_packet_st *packet);
+
+/**
+ * Hand a packet read by an I/O thread to the processing side. If nothing is
+ * running the connection and the shard of the packet is not busy, the I/O
+ * thread runs it right away under the shard lock, as the processing thread
+ * would have.
+ */
+static void _thread_proc_inline(gearman_server_con_st *con,
+                                gearman_server_packet_st *packet);
+
 /**
  * Flush outgoing packets for a connection.
  */
 static gearman_return_t _thread_packet_flush(gearman_server_con_st *con);
 
 /**
- * Start processing thread for the server.
+ * Flush outgoing packets for a connection by writing the headers and data of
+ * many packets at once, straight from the packets.
+ */
+static gearman_return_t _thread_packet_writev(gearman_server_con_st *con);
+
+/**
+ * Tell the connection whether more outgoing packets follow the ones about to
+ * be written, when the server corks multi-packet flushes.
+ */
+static void _thread_packet_more(gearman_server_con_st *con, bool more);
+
+/**
+ * Remove the first outgoing packet for a connection once it has been sent.
+ */
+static void _thread_packet_sent(gearman_server_con_st *con);
+
+/**
+ * Start processing threads for the server, one for each shard.
  */
 static gearman_return_t _proc_thread_start(gearman_server_st *server);
 
 /**
- * Kill processing thread for the server.
+ * Kill processing threads for the server.
  */
 static void _proc_thread_kill(gearman_server_st *server);
 
 /**
- * Processing thread.
+ * Processing thread for a shard.
  */
 static void *_proc(void *data);
 
+/**
+ * Run packets for a connection in a shard processing thread until the
+ * connection has nothing left to run, or its next packet belongs to another
+ * shard and it has been handed over.
+ */
+static void _proc_con(gearman_server_shard_st *shard,
+                      gearman_server_con_st *con);
+
+/**
+ * Wake the processing thread for a shard so it looks at its deadlines again.
+ */
+static void _proc_wakeup(gearman_server_shard_st *shard);
+
 /**
  * Wrapper for log handling.
  */
@@ -85,21 +200,40 @@ gearman_server_thread_create(gearman_server_st *server,
   else
     thread->options= 0;
 
+  thread->io_reading= false;
   thread->con_count= 0;
-  thread->io_count= 0;
-  thread->proc_count= 0;
   thread->free_con_count= 0;
-  thread->free_packet_count= 0;
+  thread->budget_count= 0;
+  thread->pause_count= 0;
+  thread->rate_count= 0;
+  thread->read_budget_hits= 0;
+  thread->rate_limit_hits= 0;
+  thread->inline_count= 0;
+  thread->load_count= 0;
+  thread->wakeups_sent= 0;
+  thread->wakeups_received= 0;
+  thread->io_queue_takes= 0;
+  thread->io_queue_cons= 0;
+  memset(thread->packets_in, 0, sizeof(thread->packets_in));
+  memset(thread->packets_out, 0, sizeof(thread->packets_out));
   thread->server= server;
   thread->log_fn= NULL;
+  thread->packet_log_fn= NULL;
+  thread->con_name_fn= NULL;
   thread->log_fn_arg= NULL;
   thread->run_fn= NULL;
   thread->run_fn_arg= NULL;
   thread->con_list= NULL;
   thread->io_list= NULL;
-  thread->proc_list= NULL;
+  thread->io_stack= NULL;
   thread->free_con_list= NULL;
-  thread->free_packet_list= NULL;
+  thread->budget_list= NULL;
+  thread->pause_list= NULL;
+  thread->rate_list= NULL;
+  gearman_server_magazine_init(&(thread->packet_magazine),
+                               &(server->packet_slab));
+  gearman_server_magazine_init(&(thread->io_packet_magazine),
+                               &(server->io_packet_slab));
 
   if (pthread_mutex_init(&(thread->lock), NULL) != 0)
   {
@@ -108,6 +242,9 @@ gearman_server_thread_create(gearman_server_st *server,
     return NULL;
   }
 
+  gearman_server_lock_stats_init(server, &(thread->lock_stats),
+                                 GEARMAN_SERVER_LOCK_THREAD);
+
   GEARMAN_LIST_ADD(server->thread, thread,)
 
   thread->gearman= gearman_create(&(thread->gearman_static));
@@ -119,6 +256,9 @@ gearman_server_thread_create(gearman_server_st *server,
 
   gearman_set_options(thread->gearman, GEARMAN_NON_BLOCKING, 1);
   gearman_set_options(thread->gearman, GEARMAN_DONT_TRACK_PACKETS, 1);
+  gearman_set_options(thread->gearman, GEARMAN_KEEP_COMPRESSED, 1);
+  gearman_set_buffer_size(thread->gearman, server->gearman->send_buffer_size,
+                          server->gearman->recv_buffer_size);
 
   return thread;
 }
@@ -126,7 +266,6 @@ gearman_server_thread_create(gearman_server_st *server,
 void gearman_server_thread_free(gearman_server_thread_st *thread)
 {
   gearman_server_con_st *con;
-  gearman_server_packet_st *packet;
 
   _proc_thread_kill(thread->server);
 
@@ -140,16 +279,13 @@ void gearman_server_thread_free(gearman_server_thread_st *thread)
     free(con);
   }
 
-  while (thread->free_packet_list != NULL)
-  {
-    packet= thread->free_packet_list;
-    thread->free_packet_list= packet->next;
-    free(packet);
-  }
+  gearman_server_magazine_flush(&(thread->packet_magazine));
+  gearman_server_magazine_flush(&(thread->io_packet_magazine));
 
   if (thread->gearman != NULL)
     gearman_free(thread->gearman);
 
+  gearman_server_lock_stats_free(thread->server, &(thread->lock_stats));
   pthread_mutex_destroy(&(thread->lock));
 
   GEARMAN_LIST_DEL(thread->server->thread, thread,)
@@ -192,74 +328,127 @@ void gearman_server_thread_set_log(gearman_server_thread_st *thread,
   gearman_set_log(thread->gearman, _log, thread, verbose);
 }
 
+void gearman_server_thread_set_packet_log(gearman_server_thread_st *thread,
+                              gearman_server_thread_packet_log_fn *packet_log_fn)
+{
+  thread->packet_log_fn= packet_log_fn;
+}
+
+void gearman_server_thread_set_con_name(gearman_server_thread_st *thread,
+                                 gearman_server_thread_con_name_fn *con_name_fn)
+{
+  thread->con_name_fn= con_name_fn;
+}
+
+gearman_return_t gearman_server_thread_pin(gearman_server_thread_st *thread,
+                                           uint32_t cpu)
+{
+  return gearman_server_pin(thread->server, cpu, &(thread->packet_magazine),
+                            &(thread->io_packet_magazine));
+}
+
 gearman_server_con_st *
 gearman_server_thread_run(gearman_server_thread_st *thread,
                           gearman_return_t *ret_ptr)
 {
   gearman_con_st *con;
   gearman_server_con_st *server_con;
+  uint32_t x;
 
   /* If we are multi-threaded, we may have packets to flush or connections that
      should start reading again. */
   if (thread->server->options & GEARMAN_SERVER_PROC_THREAD)
   {
-    while ((server_con= gearman_server_con_io_next(thread)) != NULL)
+    server_con= _thread_io_run(thread, ret_ptr);
+    if (server_con != NULL)
+      return server_con;
+  }
+
+  _thread_pause_check(thread);
+  _thread_rate_check(thread);
+  _thread_budget_requeue(thread);
+
+  /* Replies queued while reading, inline or by the processing threads, are
+     flushed once the reading is done, without waking this thread for them. */
+  if (thread->server->options & GEARMAN_SERVER_PROC_INLINE)
+    thread->io_reading= true;
+
+  while (1)
+  {
+    /* Check for new activity on connections. */
+    while ((con= gearman_con_ready(thread->gearman)) != NULL)
     {
-      if (server_con->options & GEARMAN_SERVER_CON_DEAD)
-      {
-        if (server_con->proc_removed)
-          gearman_server_con_free(server_con);
+      /* Inherited classes anyone? Some people would call this a hack, I call
+         it clean (avoids extra ptrs). Brian, I'll give you your C99 0-byte
+         arrays at the ends of structs for this. :) */
+      server_con= (gearman_server_con_st *)con;
 
-        continue;
+      /* Try to read new packets. */
+      if (con->revents & POLLIN)
+      {
+        *ret_ptr= _thread_packet_read(server_con);
+        if (*ret_ptr != GEARMAN_SUCCESS && *ret_ptr != GEARMAN_IO_WAIT)
+        {
+          _thread_io_reading_done(thread);
+          return server_con;
+        }
       }
 
-      if (server_con->ret != GEARMAN_SUCCESS)
+      /* Flush existing outgoing packets. */
+      if (con->revents & POLLOUT)
       {
-        *ret_ptr= server_con->ret;
-        return server_con;
+        *ret_ptr= _thread_packet_flush(server_con);
+        if (*ret_ptr != GEARMAN_SUCCESS && *ret_ptr != GEARMAN_IO_WAIT)
+        {
+          _thread_io_reading_done(thread);
+          return server_con;
+        }
       }
-
-      /* See if any outgoing packets were queued. */
-      *ret_ptr= _thread_packet_flush(server_con);
-      if (*ret_ptr != GEARMAN_SUCCESS && *ret_ptr != GEARMAN_IO_WAIT)
-        return server_con;
     }
-  }
 
-  /* Check for new activity on connections. */
-  while ((con= gearman_con_ready(thread->gearman)) != NULL)
-  {
-    /* Inherited classes anyone? Some people would call this a hack, I call
-       it clean (avoids extra ptrs). Brian, I'll give you your C99 0-byte
-       arrays at the ends of structs for this. :) */
-    server_con= (gearman_server_con_st *)con;
+    if (thread->budget_list == NULL)
+      break;
 
-    /* Try to read new packets. */
-    if (con->revents & POLLIN)
+    /* Connections over budget are read again on the next pass through the
+       caller's event loop, so it can pick up activity on other connections
+       first. Without a run callback there is no way to ask for that pass, so
+       just let them take turns now. */
+    if (thread->run_fn != NULL)
     {
-      *ret_ptr= _thread_packet_read(server_con);
-      if (*ret_ptr != GEARMAN_SUCCESS && *ret_ptr != GEARMAN_IO_WAIT)
-        return server_con;
+      (*thread->run_fn)(thread, thread->run_fn_arg);
+      break;
     }
 
-    /* Flush existing outgoing packets. */
-    if (con->revents & POLLOUT)
-    {
-      *ret_ptr= _thread_packet_flush(server_con);
-      if (*ret_ptr != GEARMAN_SUCCESS && *ret_ptr != GEARMAN_IO_WAIT)
-        return server_con;
-    }
+    _thread_budget_requeue(thread);
+  }
+
+  if (thread->io_reading)
+  {
+    /* Anything queued after this wakes the thread as usual. */
+    thread->io_reading= false;
+    __sync_synchronize();
+
+    server_con= _thread_io_run(thread, ret_ptr);
+    if (server_con != NULL)
+      return server_con;
   }
 
-  /* Start flushing new outgoing packets if we are single threaded. */
+  /* Start flushing new outgoing packets if we are single threaded. The
+     shards run here then, so their timer wheels turn here too. */
   if (!(thread->server->options & GEARMAN_SERVER_PROC_THREAD))
   {
+    for (x= 0; x < thread->server->shard_count; x++)
+      gearman_server_timer_run(&(thread->server->shard_list[x]));
+
     while ((server_con= gearman_server_con_io_next(thread)) != NULL)
     {
       *ret_ptr= _thread_packet_flush(server_con);
       if (*ret_ptr != GEARMAN_SUCCESS && *ret_ptr != GEARMAN_IO_WAIT)
         return server_con;
     }
+
+    /* Clients drain here, with no other thread to wake this one. */
+    _thread_pause_check(thread);
   }
 
   /* Check for the two shutdown modes. */
@@ -267,7 +456,7 @@ gearman_server_thread_run(gearman_server_thread_st *thread,
     *ret_ptr= GEARMAN_SHUTDOWN;
   else if (thread->server->shutdown_graceful)
   {
-    if (thread->server->job_count == 0)
+    if (gearman_server_shard_job_count(thread->server) == 0)
       *ret_ptr= GEARMAN_SHUTDOWN;
     else
       *ret_ptr= GEARMAN_SHUTDOWN_GRACEFUL;
@@ -282,12 +471,73 @@ gearman_server_thread_run(gearman_server_thread_st *thread,
  * Private definitions
  */
 
+static gearman_server_con_st *_thread_io_run(gearman_server_thread_st *thread,
+                                             gearman_return_t *ret_ptr)
+{
+  gearman_server_con_st *server_con;
+
+  while ((server_con= gearman_server_con_io_next(thread)) != NULL)
+  {
+    if (server_con->options & GEARMAN_SERVER_CON_DEAD)
+    {
+      if (server_con->proc_removed)
+        gearman_server_con_free(server_con);
+
+      continue;
+    }
+
+    if (server_con->ret != GEARMAN_SUCCESS)
+    {
+      *ret_ptr= server_con->ret;
+      return server_con;
+    }
+
+    if (server_con->io_paused != NULL && !(server_con->pause_list))
+    {
+      *ret_ptr= _thread_pause(server_con);
+      if (*ret_ptr != GEARMAN_SUCCESS)
+        return server_con;
+    }
+
+    /* See if any outgoing packets were queued. */
+    *ret_ptr= _thread_packet_flush(server_con);
+    if (*ret_ptr != GEARMAN_SUCCESS && *ret_ptr != GEARMAN_IO_WAIT)
+      return server_con;
+  }
+
+  return NULL;
+}
+
+static void _thread_io_reading_done(gearman_server_thread_st *thread)
+{
+  if (!(thread->io_reading))
+    return;
+
+  thread->io_reading= false;
+  __sync_synchronize();
+
+  if ((thread->io_list != NULL || thread->io_stack != NULL) &&
+      thread->run_fn != NULL)
+  {
+    (*thread->run_fn)(thread, thread->run_fn_arg);
+  }
+}
+
 gearman_return_t _thread_packet_read(gearman_server_con_st *con)
 {
+  gearman_server_thread_st *thread= con->thread;
+  uint32_t read_budget= thread->server->read_budget;
+  bool rate_over= false;
   gearman_return_t ret;
 
   while (1)
   {
+    if (con->io_paused != NULL)
+      return _thread_pause(con);
+
+    if (con->rate_list)
+      return gearman_con_clear_events(&(con->con), POLLIN);
+
     if (con->packet == NULL)
     {
       con->packet= gearman_server_packet_create(con->thread, true);
@@ -306,13 +556,29 @@ gearman_return_t _thread_packet_read(gearman_server_con_st *con)
       return ret;
     }
 
-    GEARMAN_DEBUG(con->thread->gearman, "%15s:%5s Received  %s",
-                  con->host == NULL ? "-" : con->host,
-                  con->port == NULL ? "-" : con->port,
-                  gearman_command_info_list[con->packet->packet.command].name)
+    _thread_packet_log(con, con->packet->packet.command, false);
+
+    /* We read a complete packet. It is charged before it is handed on,
+       since it may be gone once it has run. */
+    thread->packets_in[con->packet->packet.command]++;
+    GEARMAND_PACKET_READ(con->con.fd,
+               gearman_command_info_list[con->packet->packet.command].name,
+                         con->packet->packet.data_size);
+    if (thread->server->client_rate > 0)
+      rate_over= _thread_rate_charge(con, &(con->packet->packet));
+    _thread_load(con, con->packet->packet.args_size +
+                      con->packet->packet.data_size);
+
+    gearman_server_shard_route(con, con->packet);
 
-    /* We read a complete packet. */
-    if (con->thread->server->options & GEARMAN_SERVER_PROC_THREAD)
+    if (con->thread->server->options & GEARMAN_SERVER_PROC_INLINE &&
+        con->thread->server->options & GEARMAN_SERVER_PROC_THREAD)
+    {
+      /* Multi-threaded, but run it here if the shard is free. */
+      _thread_proc_inline(con, con->packet);
+      con->packet= NULL;
+    }
+    else if (con->thread->server->options & GEARMAN_SERVER_PROC_THREAD)
     {
       /* Multi-threaded, queue for the processing thread to run. */
       gearman_server_proc_packet_add(con, con->packet);
@@ -321,56 +587,440 @@ gearman_return_t _thread_packet_read(gearman_server_con_st *con)
     else
     {
       /* Single threaded, run the command here. */
-      ret= gearman_server_run_command(con, &(con->packet->packet));
+      ret= _thread_packet_run(con, con->packet);
       gearman_packet_free(&(con->packet->packet));
       gearman_server_packet_free(con->packet, con->thread, true);
       con->packet= NULL;
       if (ret != GEARMAN_SUCCESS)
         return ret;
     }
+
+    if (rate_over)
+      return _thread_rate_pause(con);
+
+    if (read_budget > 0 && --read_budget == 0)
+    {
+      /* Out of budget, leave the rest for later. Anything already in the
+         receive buffer won't show up as a new event, so queue it here. */
+      thread->read_budget_hits++;
+      if (!(con->budget_list))
+      {
+        GEARMAN_LIST_ADD(thread->budget, con, budget_)
+        con->budget_list= true;
+      }
+
+      break;
+    }
   }
 
   return GEARMAN_SUCCESS;
 }
 
+static void _thread_budget_requeue(gearman_server_thread_st *thread)
+{
+  gearman_server_con_st *con;
+
+  while (thread->budget_list != NULL)
+  {
+    con= thread->budget_list;
+    GEARMAN_LIST_DEL(thread->budget, con, budget_)
+    con->budget_list= false;
+
+    /* Without POLLOUT this only queues the connection, so it can't fail. */
+    (void)gearman_con_set_revents(&(con->con), POLLIN);
+  }
+}
+
+static gearman_return_t _thread_pause(gearman_server_con_st *con)
+{
+  gearman_server_thread_st *thread= con->thread;
+  gearman_return_t ret;
+
+  if (!(con->pause_list))
+  {
+    GEARMAN_LIST_ADD(thread->pause, con, pause_)
+    con->pause_list= true;
+  }
+
+  ret= gearman_con_clear_events(&(con->con), POLLIN);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  /* The client may have caught up before this connection was on the list,
+     when nothing would have woken the thread for it. */
+  _thread_pause_check(thread);
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _thread_pause_check(gearman_server_thread_st *thread)
+{
+  gearman_server_con_st *con;
+  gearman_server_con_st *next;
+  gearman_server_con_st *client;
+
+  for (con= thread->pause_list; con != NULL; con= next)
+  {
+    next= con->pause_next;
+    client= con->io_paused;
+
+    if (client->io_data_size > thread->server->work_data_max / 2)
+      continue;
+
+    GEARMAN_LIST_DEL(thread->pause, con, pause_)
+    con->pause_list= false;
+    con->io_paused= NULL;
+    (void)__sync_sub_and_fetch(&(client->io_data_waiters), 1);
+
+    /* A failed watch closes the connection, and reading it then finds that
+       out and frees it. */
+    (void)gearman_con_set_events(&(con->con), POLLIN);
+    (void)gearman_con_set_revents(&(con->con), POLLIN);
+  }
+}
+
+static bool _thread_rate_charge(gearman_server_con_st *con,
+                                gearman_packet_st *packet)
+{
+  gearman_command_t command= packet->command;
+
+  if (command != GEARMAN_COMMAND_SUBMIT_JOB &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_BG &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_HIGH &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_HIGH_BG &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_LOW &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_LOW_BG &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_SCHED &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_EPOCH &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_BATCH &&
+      command != GEARMAN_COMMAND_SUBMIT_JOB_CHAIN)
+  {
+    return false;
+  }
+
+  _thread_rate_refill(con);
+  con->rate_tokens-= (int64_t)(GEARMAN_PACKET_HEADER_SIZE + packet->args_size +
+                               packet->data_size);
+
+  return con->rate_tokens < 0;
+}
+
+static void _thread_rate_refill(gearman_server_con_st *con)
+{
+  uint64_t rate= (uint64_t)(con->thread->server->client_rate);
+  uint64_t now= gearman_time_now();
+  uint64_t elapsed;
+  uint64_t tokens;
+
+  /* A connection that has been quiet for a second is full whatever it used
+     before, which also covers the first job it sends. */
+  elapsed= now - con->rate_time;
+  if (elapsed >= 1000000)
+    tokens= rate;
+  else
+  {
+    tokens= elapsed * rate / 1000000;
+    /* Keep the time for later rather than dropping a fraction of a byte on
+       every packet of a busy connection. */
+    if (tokens == 0)
+      return;
+  }
+
+  con->rate_time= now;
+  con->rate_tokens+= (int64_t)tokens;
+  if (con->rate_tokens > (int64_t)rate)
+    con->rate_tokens= (int64_t)rate;
+}
+
+static gearman_return_t _thread_rate_pause(gearman_server_con_st *con)
+{
+  gearman_server_thread_st *thread= con->thread;
+
+  thread->rate_limit_hits++;
+  if (!(con->rate_list))
+  {
+    GEARMAN_LIST_ADD(thread->rate, con, rate_)
+    con->rate_list= true;
+  }
+
+  return gearman_con_clear_events(&(con->con), POLLIN);
+}
+
+static void _thread_rate_check(gearman_server_thread_st *thread)
+{
+  gearman_server_con_st *con;
+  gearman_server_con_st *next;
+
+  for (con= thread->rate_list; con != NULL; con= next)
+  {
+    next= con->rate_next;
+
+    /* Waiting for a full bucket rather than just a positive one lets the
+       connection send a whole second worth before it is stopped again. */
+    _thread_rate_refill(con);
+    if (con->rate_tokens < (int64_t)(thread->server->client_rate))
+      continue;
+
+    GEARMAN_LIST_DEL(thread->rate, con, rate_)
+    con->rate_list= false;
+
+    (void)gearman_con_set_events(&(con->con), POLLIN);
+    (void)gearman_con_set_revents(&(con->con), POLLIN);
+  }
+}
+
+static void _thread_load(gearman_server_con_st *con, size_t size)
+{
+  uint64_t load= 1 + size / GEARMAND_THREAD_LOAD_BYTES;
+
+  con->load_count+= load;
+  con->thread->load_count+= load;
+}
+
+static void _thread_packet_log(gearman_server_con_st *con,
+                               gearman_command_t command, bool sent)
+{
+  gearman_server_thread_st *thread= con->thread;
+
+  if (thread->gearman->verbose < GEARMAN_VERBOSE_DEBUG)
+    return;
+
+  if (thread->packet_log_fn != NULL)
+  {
+    (*(thread->packet_log_fn))(thread, con, command, sent, thread->log_fn_arg);
+    return;
+  }
+
+  GEARMAN_DEBUG(thread->gearman, "%15s:%5s %s%s",
+                con->host == NULL ? "-" : gearman_server_con_host(con),
+                con->port == NULL ? "-" : gearman_server_con_port(con),
+                sent ? "Sent      " : "Received  ",
+                gearman_command_info_list[command].name)
+}
+
+static gearman_return_t _thread_packet_run(gearman_server_con_st *con,
+                                           gearman_server_packet_st *packet)
+{
+  gearman_server_st *server= con->thread->server;
+  gearman_return_t ret;
+
+  while (1)
+  {
+    if (packet->shard != GEARMAN_SERVER_SHARD_ANY)
+      con->shard= &(server->shard_list[packet->shard]);
+    else if (con->shard == NULL)
+      con->shard= server->shard_list;
+
+    con->proc_hops= packet->shard_hops;
+    con->proc_forward= false;
+
+    ret= gearman_server_run_command(con, &(packet->packet));
+    if (ret != GEARMAN_SUCCESS || !(con->proc_forward))
+      return ret;
+
+    gearman_server_shard_forward(server, packet);
+  }
+}
+
+static void _thread_proc_inline(gearman_server_con_st *con,
+                                gearman_server_packet_st *packet)
+{
+  gearman_server_st *server= con->thread->server;
+  gearman_server_packet_st *next;
+  gearman_server_shard_st *shard;
+  uint32_t timer_count;
+  uint32_t commit_count;
+
+  GEARMAN_SERVER_QUEUE_PUSH(con->proc_packet, packet,, next)
+
+  /* Claim the connection the same way it is handed to a processing thread.
+     If a shard already has it, that shard runs this packet after the rest. */
+  __sync_synchronize();
+  if (con->proc_list || con->proc_removed ||
+      !__sync_bool_compare_and_swap(&(con->proc_list), false, true))
+  {
+    return;
+  }
+
+  packet= gearman_server_proc_packet_peek(con);
+  if (packet->shard == GEARMAN_SERVER_SHARD_ANY)
+    shard= server->shard_list;
+  else
+    shard= &(server->shard_list[packet->shard]);
+
+  /* A queue add not done by the persistence thread would hold up every
+     connection on this thread, so those servers always hand packets over. */
+  if ((server->gearman->queue_add_fn != NULL &&
+       !gearman_server_persist_enabled(server)) ||
+      gearman_server_lock_try(server, &(shard->lock),
+                              &(shard->lock_stats)) != 0)
+  {
+    gearman_server_con_proc_queue(con, shard);
+    return;
+  }
+
+  /* Packets built here come from the shard the same as in its own thread. */
+  (void) pthread_setspecific(server->proc_key, shard);
+  timer_count= shard->timer.count;
+  commit_count= shard->commit.count;
+
+  _proc_con(shard, con);
+  con->thread->inline_count++;
+
+  /* The processing thread only sleeps until the deadlines it knew of, so
+     tell it about the first job on its timer wheel or waiting to commit. */
+  if ((timer_count == 0 && shard->timer.count > 0) ||
+      (commit_count == 0 && shard->commit.count > 0))
+  {
+    _proc_wakeup(shard);
+  }
+
+  (void) pthread_setspecific(server->proc_key, NULL);
+  GEARMAN_SERVER_UNLOCK(shard->server, &(shard->lock), &(shard->lock_stats))
+}
+
 static gearman_return_t _thread_packet_flush(gearman_server_con_st *con)
 {
+  gearman_server_io_packet_st *packet;
   gearman_return_t ret;
 
   /* Check to see if we've already tried to avoid excessive system calls. */
   if (con->con.events & POLLOUT)
     return GEARMAN_IO_WAIT;
 
-  while (con->io_packet_list != NULL)
+  /* Packets in the plain binary protocol are already packed, so they can be
+     written straight from their buffers unless a send is part way through
+     the connection send buffer. */
+  if (con->con.send_fn == NULL &&
+      con->con.packet_pack_fn == gearman_packet_pack &&
+      con->con.send_state == GEARMAN_CON_SEND_STATE_NONE &&
+      con->con.send_buffer_size == 0 &&
+      !(con->con.options & GEARMAN_CON_CLOSE_AFTER_FLUSH))
   {
-    ret= gearman_con_send(&(con->con), &(con->io_packet_list->packet),
-                          con->io_packet_list->next == NULL ? true : false);
+    ret= _thread_packet_writev(con);
     if (ret != GEARMAN_SUCCESS)
+    {
+      _thread_packet_more(con, false);
       return ret;
+    }
+  }
 
-    if (con->io_packet_list->packet.command == GEARMAN_COMMAND_NOOP)
-      con->noop_queued= false;
+  while ((packet= gearman_server_io_packet_peek(con)) != NULL)
+  {
+    /* The send buffer only goes out early when it fills, and then the rest
+       of the queue follows right behind it. */
+    _thread_packet_more(con, packet->next != NULL);
 
-    GEARMAN_DEBUG(con->thread->gearman, "%15s:%5s Sent      %s",
-            con->host == NULL ? "-" : con->host,
-            con->port == NULL ? "-" : con->port,
-            gearman_command_info_list[con->io_packet_list->packet.command].name)
+    ret= gearman_server_io_packet_send(con, packet,
+                                       packet->next == NULL ? true : false);
+    if (ret != GEARMAN_SUCCESS)
+    {
+      _thread_packet_more(con, false);
+      return ret;
+    }
 
-    gearman_server_io_packet_remove(con);
+    _thread_packet_sent(con);
   }
 
+  _thread_packet_more(con, false);
+
   /* Clear the POLLOUT flag. */
   return gearman_con_set_events(&(con->con), POLLIN);
 }
 
+static gearman_return_t _thread_packet_writev(gearman_server_con_st *con)
+{
+  struct iovec iov[GEARMAN_SERVER_IOV_SIZE];
+  gearman_server_io_packet_st *packet;
+  gearman_return_t ret;
+  size_t offset;
+  size_t size;
+  int iov_count;
+
+  while ((packet= gearman_server_io_packet_peek(con)) != NULL)
+  {
+    /* Skip whatever part of the first packet an earlier write got out. */
+    offset= con->io_packet_offset;
+    iov_count= 0;
+
+    for (; packet != NULL && iov_count <= GEARMAN_SERVER_IOV_SIZE - 2;
+         packet= packet->next)
+    {
+      if (offset < packet->args_size)
+      {
+        iov[iov_count].iov_base= packet->args + offset;
+        iov[iov_count].iov_len= packet->args_size - offset;
+        iov_count++;
+        offset= 0;
+      }
+      else
+        offset-= packet->args_size;
+
+      if (packet->data_size > 0)
+      {
+        iov[iov_count].iov_base= (uint8_t *)(packet->data) + offset;
+        iov[iov_count].iov_len= packet->data_size - offset;
+        iov_count++;
+        offset= 0;
+      }
+    }
+
+    /* Only the write that ends the queue pushes out a partial segment. */
+    _thread_packet_more(con, packet != NULL);
+
+    size= gearman_con_send_iov(&(con->con), iov, iov_count, &ret);
+
+    /* Retire every packet that is now completely written. */
+    size+= con->io_packet_offset;
+    while (con->io_packet_list != NULL &&
+           size >= con->io_packet_list->args_size +
+                   con->io_packet_list->data_size)
+    {
+      size-= con->io_packet_list->args_size + con->io_packet_list->data_size;
+      _thread_packet_sent(con);
+    }
+    con->io_packet_offset= size;
+
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _thread_packet_more(gearman_server_con_st *con, bool more)
+{
+  if (more && con->thread->server->options & GEARMAN_SERVER_TCP_CORK)
+    con->con.options|= GEARMAN_CON_SEND_MORE;
+  else
+    con->con.options&= (gearman_con_options_t)~GEARMAN_CON_SEND_MORE;
+}
+
+static void _thread_packet_sent(gearman_server_con_st *con)
+{
+  gearman_server_io_packet_st *packet= con->io_packet_list;
+
+  if (packet->command == GEARMAN_COMMAND_NOOP)
+    con->noop_queued= false;
+
+  con->thread->packets_out[packet->command]++;
+  GEARMAND_PACKET_FLUSH(con->con.fd,
+                        gearman_command_info_list[packet->command].name,
+                        packet->data_size);
+  _thread_load(con, packet->args_size + packet->data_size);
+
+  _thread_packet_log(con, packet->command, true);
+
+  gearman_server_io_packet_remove(con);
+}
+
 static gearman_return_t _proc_thread_start(gearman_server_st *server)
 {
+  gearman_server_shard_st *shard;
   pthread_attr_t attr;
+  uint32_t x;
 
-  if (pthread_mutex_init(&(server->proc_lock), NULL) != 0)
-    return GEARMAN_PTHREAD;
-
-  if (pthread_cond_init(&(server->proc_cond), NULL) != 0)
+  if (pthread_key_create(&(server->proc_key), NULL) != 0)
     return GEARMAN_PTHREAD;
 
   if (pthread_attr_init(&attr) != 0)
@@ -379,88 +1029,279 @@ static gearman_return_t _proc_thread_start(gearman_server_st *server)
   if (pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM) != 0)
     return GEARMAN_PTHREAD;
 
-  if (pthread_create(&(server->proc_id), &attr, _proc, server) != 0)
+  /* Shards hand queue calls to the persistence thread from the start. */
+  if (gearman_server_persist_start(server) != GEARMAN_SUCCESS)
+  {
+    (void) pthread_attr_destroy(&attr);
+    (void) pthread_key_delete(server->proc_key);
     return GEARMAN_PTHREAD;
-
-  (void) pthread_attr_destroy(&attr);
+  }
 
   server->options|= GEARMAN_SERVER_PROC_THREAD;
 
+  for (x= 0; x < server->shard_count; x++)
+  {
+    if (pthread_create(&(server->shard_list[x].proc_id), &attr, _proc,
+                       &(server->shard_list[x])) != 0)
+    {
+      /* Only stop the threads that were started. */
+      server->proc_shutdown= true;
+      while (x-- > 0)
+      {
+        shard= &(server->shard_list[x]);
+        GEARMAN_SERVER_LOCK(server, &(shard->proc_lock),
+                            &(shard->proc_lock_stats))
+        (void) pthread_cond_signal(&(shard->proc_cond));
+        GEARMAN_SERVER_UNLOCK(server, &(shard->proc_lock),
+                              &(shard->proc_lock_stats))
+        (void) pthread_join(server->shard_list[x].proc_id, NULL);
+      }
+
+      gearman_server_persist_stop(server);
+      (void) pthread_attr_destroy(&attr);
+      (void) pthread_key_delete(server->proc_key);
+      server->options&= (gearman_server_options_t)~GEARMAN_SERVER_PROC_THREAD;
+      server->proc_shutdown= false;
+      return GEARMAN_PTHREAD;
+    }
+  }
+
+  (void) pthread_attr_destroy(&attr);
+
   return GEARMAN_SUCCESS;
 }
 
 static void _proc_thread_kill(gearman_server_st *server)
 {
+  gearman_server_shard_st *shard;
+  uint32_t x;
+
   if (!(server->options & GEARMAN_SERVER_PROC_THREAD) || server->proc_shutdown)
     return;
 
+  /* The replay thread hands jobs to the processing threads, so it goes
+     first. */
+  gearman_server_replay_stop(server);
+
   server->proc_shutdown= true;
 
-  /* Signal proc thread to shutdown. */
-  (void) pthread_mutex_lock(&(server->proc_lock));
-  (void) pthread_cond_signal(&(server->proc_cond));
-  (void) pthread_mutex_unlock(&(server->proc_lock));
+  for (x= 0; x < server->shard_count; x++)
+  {
+    shard= &(server->shard_list[x]);
+
+    /* Signal proc thread to shutdown. */
+    GEARMAN_SERVER_LOCK(shard->server, &(shard->proc_lock),
+                        &(shard->proc_lock_stats))
+    (void) pthread_cond_signal(&(shard->proc_cond));
+    GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                          &(shard->proc_lock_stats))
+
+    /* Wait for the proc thread to exit. Connections still waiting to be run
+       are freed directly by their I/O threads. */
+    (void) pthread_join(shard->proc_id, NULL);
+    shard->proc_list= NULL;
+    shard->proc_stack= NULL;
+  }
 
-  /* Wait for the proc thread to exit and then cleanup. */
-  (void) pthread_join(server->proc_id, NULL);
-  (void) pthread_cond_destroy(&(server->proc_cond));
-  (void) pthread_mutex_destroy(&(server->proc_lock));
+  /* The processing threads committed what they had on the way out, so this
+     only waits for the persistence thread to get through it. */
+  gearman_server_persist_stop(server);
 }
 
 static void *_proc(void *data)
 {
-  gearman_server_st *server= (gearman_server_st *)data;
-  gearman_server_thread_st *thread;
+  gearman_server_shard_st *shard= (gearman_server_shard_st *)data;
   gearman_server_con_st *con;
-  gearman_server_packet_st *packet;
+  struct timespec deadline;
+  struct timespec timer_deadline;
+  uint32_t cpu;
+  bool timed;
+
+  (void) pthread_setspecific(shard->server->proc_key, shard);
+
+  /* A thread that can't be pinned still runs, wherever the system puts it. */
+  if (shard->server->proc_cpu_count > 0)
+  {
+    cpu= shard->server->proc_cpu_list[shard->id %
+                                      shard->server->proc_cpu_count];
+    (void) gearman_server_pin(shard->server, cpu, &(shard->packet_magazine),
+                              &(shard->io_packet_magazine));
+  }
 
   while (1)
   {
-    (void) pthread_mutex_lock(&(server->proc_lock));
-    while (server->proc_wakeup == false)
+    GEARMAN_SERVER_LOCK(shard->server, &(shard->proc_lock),
+                        &(shard->proc_lock_stats))
+    while (shard->proc_wakeup == false)
     {
-      if (server->proc_shutdown)
+      if (shard->server->proc_shutdown)
       {
-        (void) pthread_mutex_unlock(&(server->proc_lock));
+        GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                              &(shard->proc_lock_stats))
+
+        /* Don't leave jobs that were added to the queue uncommitted. */
+        GEARMAN_SERVER_LOCK(shard->server, &(shard->lock), &(shard->lock_stats))
+        (void) gearman_server_commit_run(shard, true);
+        GEARMAN_SERVER_UNLOCK(shard->server, &(shard->lock),
+                              &(shard->lock_stats))
         return NULL;
       }
 
-      (void) pthread_cond_wait(&(server->proc_cond), &(server->proc_lock));
+      /* Connections queued while we were running don't signal, so check
+         once more after saying we are about to sleep. */
+      shard->proc_sleeping= true;
+      __sync_synchronize();
+      if (shard->proc_stack != NULL)
+        break;
+
+      /* Jobs waiting for a group commit only wait out their window, and
+         running jobs with a timeout until the timer wheel next turns. */
+      timed= gearman_server_commit_deadline(shard, &deadline);
+      if (gearman_server_timer_deadline(shard, &timer_deadline) &&
+          (!timed || timer_deadline.tv_sec < deadline.tv_sec ||
+           (timer_deadline.tv_sec == deadline.tv_sec &&
+            timer_deadline.tv_nsec < deadline.tv_nsec)))
+      {
+        deadline= timer_deadline;
+        timed= true;
+      }
+
+      if (timed)
+      {
+        if (gearman_server_lock_wait(shard->server, &(shard->proc_cond),
+                                     &(shard->proc_lock),
+                                     &(shard->proc_lock_stats),
+                                     &deadline) == ETIMEDOUT)
+        {
+          break;
+        }
+      }
+      else
+      {
+        (void) gearman_server_lock_wait(shard->server, &(shard->proc_cond),
+                                        &(shard->proc_lock),
+                                        &(shard->proc_lock_stats), NULL);
+      }
+    }
+    if (shard->proc_wakeup)
+      shard->wakeups_received++;
+    shard->proc_sleeping= false;
+    shard->proc_wakeup= false;
+    GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                          &(shard->proc_lock_stats))
+
+    GEARMAN_SERVER_LOCK(shard->server, &(shard->lock), &(shard->lock_stats))
+    gearman_server_timer_run(shard);
+    do
+    {
+      while ((con= gearman_server_con_proc_next(shard)) != NULL)
+        _proc_con(shard, con);
     }
-    server->proc_wakeup= false;
-    (void) pthread_mutex_unlock(&(server->proc_lock));
+    while (gearman_server_commit_run(shard, false) ||
+           gearman_server_replay_run(shard));
+    GEARMAN_SERVER_UNLOCK(shard->server, &(shard->lock), &(shard->lock_stats))
+  }
+}
 
-    for (thread= server->thread_list; thread != NULL; thread= thread->next)
+static void _proc_con(gearman_server_shard_st *shard,
+                      gearman_server_con_st *con)
+{
+  gearman_server_st *server= shard->server;
+  gearman_server_packet_st *packet;
+
+  while (1)
+  {
+    if (con->options & GEARMAN_SERVER_CON_DEAD)
     {
-      while ((con= gearman_server_con_proc_next(thread)) != NULL)
+      /* Each shard cleans up its own part of a dead connection, and then
+         passes it on. */
+      if (con->proc_dead == shard->id)
       {
-        if (con->options & GEARMAN_SERVER_CON_DEAD)
-        {
-          gearman_server_con_free_workers(con);
+        gearman_server_con_free_shard(con, shard);
+        con->proc_dead++;
+      }
 
-          while (con->client_list != NULL)
-            gearman_server_client_free(con->client_list);
+      if (con->proc_dead < server->shard_count)
+      {
+        gearman_server_con_proc_queue(con,
+                                      &(server->shard_list[con->proc_dead]));
+        return;
+      }
 
-          con->proc_removed= true;
-          gearman_server_con_io_add(con);
-          continue;
-        }
+      /* This leaves the connection marked as running, so nothing can
+         schedule it again before the I/O thread frees it. */
+      __sync_synchronize();
+      con->proc_removed= true;
 
-        while (1)
-        {
-          packet= gearman_server_proc_packet_remove(con);
-          if (packet == NULL)
-            break;
+      gearman_server_con_io_add(con);
+      return;
+    }
 
-          con->ret= gearman_server_run_command(con, &(packet->packet));
-          gearman_packet_free(&(packet->packet));
-          gearman_server_packet_free(packet, con->thread, false);
-        }
+    packet= gearman_server_proc_packet_peek(con);
+    if (packet == NULL)
+    {
+      /* Stop running the connection, then look again in case the I/O thread
+         queued something before it could see that. Once the flag is clear
+         another shard may pick the connection up, so only carry on if this
+         shard gets it back. */
+      con->proc_list= false;
+      __sync_synchronize();
+
+      if (con->proc_packet_stack == NULL &&
+          !(con->options & GEARMAN_SERVER_CON_DEAD))
+      {
+        return;
       }
+
+      if (!__sync_bool_compare_and_swap(&(con->proc_list), false, true))
+        return;
+
+      continue;
+    }
+
+    if (packet->shard != GEARMAN_SERVER_SHARD_ANY && packet->shard != shard->id)
+    {
+      gearman_server_con_proc_queue(con, &(server->shard_list[packet->shard]));
+      return;
+    }
+
+    con->shard= shard;
+    con->proc_hops= packet->shard_hops;
+    con->proc_forward= false;
+
+    con->ret= gearman_server_run_command(con, &(packet->packet));
+    if (con->ret == GEARMAN_SUCCESS && con->proc_forward)
+    {
+      gearman_server_shard_forward(server, packet);
+      continue;
     }
+
+    packet= gearman_server_proc_packet_remove(con);
+    gearman_packet_free(&(packet->packet));
+    gearman_server_packet_free(packet, con->thread, false);
+
+    /* The connection stays ours until its job is committed, and the commit
+       queues it to run here again. */
+    if (con->commit_wait)
+      return;
   }
 }
 
+static void _proc_wakeup(gearman_server_shard_st *shard)
+{
+  GEARMAN_SERVER_LOCK(shard->server, &(shard->proc_lock),
+                      &(shard->proc_lock_stats))
+
+  if (!(shard->proc_wakeup))
+  {
+    shard->proc_wakeup= true;
+    (void) pthread_cond_signal(&(shard->proc_cond));
+  }
+
+  GEARMAN_SERVER_UNLOCK(shard->server, &(shard->proc_lock),
+                        &(shard->proc_lock_stats))
+}
+
 static void _log(gearman_st *gearman __attribute__ ((unused)),
                  gearman_verbose_t verbose, const char *line, void *fn_arg)
 {
@@ -89,6 +89,34 @@ void gearman_server_thread_set_log(gearman_server_thread_st *thread,
                                    gearman_server_thread_log_fn log_fn,
                                    void *log_fn_arg, gearman_verbose_t verbose);
 
+/**
+ * Set a callback for the per packet debug lines, in place of formatting them
+ * and passing them to the log callback. This lets the caller defer the
+ * formatting, see gearmand_log. It is only called at GEARMAN_VERBOSE_DEBUG,
+ * and is passed the log_fn_arg given to gearman_server_thread_set_log.
+ * @param thread Thread structure previously initialized with
+ *        gearman_server_thread_create.
+ * @param packet_log_fn Function to call for each packet sent or received, or
+ *        NULL to log them as regular lines.
+ */
+GEARMAN_API
+void gearman_server_thread_set_packet_log(gearman_server_thread_st *thread,
+                             gearman_server_thread_packet_log_fn *packet_log_fn);
+
+/**
+ * Set a callback that fills in the host and port of a connection, so they
+ * only need to be formatted when something reads them with
+ * gearman_server_con_host or gearman_server_con_port. It may be called from
+ * any thread, and more than once for the same connection.
+ * @param thread Thread structure previously initialized with
+ *        gearman_server_thread_create.
+ * @param con_name_fn Function to call, or NULL if connections are named
+ *        when they are added.
+ */
+GEARMAN_API
+void gearman_server_thread_set_con_name(gearman_server_thread_st *thread,
+                                 gearman_server_thread_con_name_fn *con_name_fn);
+
 /**
  * Set thread run callback.
  * @param thread Thread structure previously initialized with
@@ -101,6 +129,19 @@ void gearman_server_thread_set_run(gearman_server_thread_st *thread,
                                    gearman_server_thread_run_fn *run_fn,
                                    void *run_arg);
 
+/**
+ * Pin the calling thread to a CPU, and have this server thread take packets
+ * from the pool for the NUMA node of that CPU, see gearman_server_pin. This
+ * is called from the thread that runs the server thread, before it runs.
+ * @param thread Thread structure previously initialized with
+ *        gearman_server_thread_create.
+ * @param cpu CPU to run on.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_thread_pin(gearman_server_thread_st *thread,
+                                           uint32_t cpu);
+
 /**
  * Process server thread connections.
  * @param thread Thread structure previously initialized with
@@ -0,0 +1,239 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server job timeout definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_server_timer_private Private Server Job Timeout Functions
+ * @ingroup gearman_server_timer
+ * @{
+ */
+
+/**
+ * Put a job in the slot for the tick its timeout ends on, picking the level
+ * by how far away that is from the current tick.
+ */
+static void _server_timer_insert(gearman_server_timer_st *timer,
+                                 gearman_server_job_st *server_job);
+
+/**
+ * Spread the jobs in the current slot of each coarser level over the levels
+ * below, called when the first level wraps around.
+ */
+static void _server_timer_cascade(gearman_server_timer_st *timer);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+void gearman_server_timer_init(gearman_server_timer_st *timer)
+{
+  uint32_t x;
+  uint32_t y;
+
+  timer->count= 0;
+  timer->tick= 0;
+
+  for (x= 0; x < GEARMAN_SERVER_TIMER_LEVELS; x++)
+  {
+    for (y= 0; y < GEARMAN_SERVER_TIMER_SLOTS; y++)
+      timer->slot_list[x][y]= NULL;
+  }
+}
+
+void gearman_server_timer_add(gearman_server_job_st *server_job,
+                              uint32_t timeout)
+{
+  gearman_server_timer_st *timer= &(server_job->function->shard->timer);
+  uint64_t span= (uint64_t)1 << (GEARMAN_SERVER_TIMER_BITS *
+                                 GEARMAN_SERVER_TIMER_LEVELS);
+  uint64_t now= (uint64_t)time(NULL);
+
+  /* The wheel stops turning while it is empty, so catch it up first. */
+  if (timer->count == 0)
+    timer->tick= now;
+
+  /* The current second is already partly gone, so count from the next one to
+     give the worker at least the whole timeout. A wheel that fell behind the
+     clock can only hold jobs up to its span ahead of where it is. */
+  server_job->timer_expire= now + timeout + 1;
+  if (server_job->timer_expire >= timer->tick + span)
+    server_job->timer_expire= timer->tick + span - 1;
+
+  _server_timer_insert(timer, server_job);
+  server_job->options|= GEARMAN_SERVER_JOB_TIMER;
+  timer->count++;
+}
+
+void gearman_server_timer_schedule(gearman_server_job_st *server_job)
+{
+  gearman_server_timer_st *timer= &(server_job->function->shard->timer);
+  uint64_t span= (uint64_t)1 << (GEARMAN_SERVER_TIMER_BITS *
+                                 GEARMAN_SERVER_TIMER_LEVELS);
+
+  if (timer->count == 0)
+    timer->tick= (uint64_t)time(NULL);
+
+  /* The tick for a second runs once that second has begun, which is as soon
+     as the job may run. */
+  server_job->timer_expire= (uint64_t)(server_job->when);
+  if (server_job->timer_expire >= timer->tick + span)
+    server_job->timer_expire= timer->tick + span - 1;
+
+  _server_timer_insert(timer, server_job);
+  server_job->options|= GEARMAN_SERVER_JOB_TIMER | GEARMAN_SERVER_JOB_SCHEDULED;
+  server_job->function->job_scheduled++;
+  timer->count++;
+}
+
+void gearman_server_timer_remove(gearman_server_job_st *server_job)
+{
+  gearman_server_timer_st *timer= &(server_job->function->shard->timer);
+  uint32_t level= server_job->timer_slot >> GEARMAN_SERVER_TIMER_BITS;
+  uint32_t slot= server_job->timer_slot & (GEARMAN_SERVER_TIMER_SLOTS - 1);
+
+  GEARMAN_BUCKET_DEL(timer->slot_list[level][slot], server_job, timer_)
+  if (server_job->options & GEARMAN_SERVER_JOB_SCHEDULED)
+    server_job->function->job_scheduled--;
+  server_job->options&= (gearman_server_job_options_t)
+                        ~(GEARMAN_SERVER_JOB_TIMER |
+                          GEARMAN_SERVER_JOB_SCHEDULED |
+                          GEARMAN_SERVER_JOB_AFFINITY);
+  timer->count--;
+}
+
+void gearman_server_timer_run(gearman_server_shard_st *shard)
+{
+  gearman_server_timer_st *timer= &(shard->timer);
+  gearman_server_job_st *server_job;
+  uint64_t now;
+  uint32_t slot;
+
+  if (timer->count == 0)
+    return;
+
+  now= (uint64_t)time(NULL);
+
+  /* Stop early once the last job is gone, since the time may have jumped a
+     long way ahead and an empty wheel is caught up when a job is added. */
+  while (timer->tick <= now && timer->count > 0)
+  {
+    slot= (uint32_t)(timer->tick) & (GEARMAN_SERVER_TIMER_SLOTS - 1);
+    if (slot == 0)
+      _server_timer_cascade(timer);
+
+    /* Queuing the job again takes it off the wheel and away from the worker
+       that has it, so results that worker sends later are refused. A
+       scheduled job has no worker yet, and is just queued now it is due. A
+       job held for the worker its key prefers is let go to any worker. */
+    while ((server_job= timer->slot_list[0][slot]) != NULL)
+    {
+      if (server_job->options & GEARMAN_SERVER_JOB_AFFINITY)
+      {
+        (void)gearman_server_job_release(server_job);
+        continue;
+      }
+
+      if (server_job->options & GEARMAN_SERVER_JOB_SCHEDULED)
+      {
+        /* Queue wait for a scheduled job starts when it comes due. */
+        gearman_server_timer_remove(server_job);
+        server_job->created_time= gearman_time_now();
+      }
+      else
+        server_job->function->timeout_count++;
+      (void)gearman_server_job_queue(server_job);
+    }
+
+    timer->tick++;
+  }
+}
+
+bool gearman_server_timer_deadline(gearman_server_shard_st *shard,
+                                   struct timespec *deadline)
+{
+  gearman_server_timer_st *timer= &(shard->timer);
+
+  if (timer->count == 0)
+    return false;
+
+  /* A tick is run once the clock reaches the second it stands for. */
+  deadline->tv_sec= (time_t)(timer->tick);
+  deadline->tv_nsec= 0;
+
+  return true;
+}
+
+/*
+ * Private definitions
+ */
+
+static void _server_timer_insert(gearman_server_timer_st *timer,
+                                 gearman_server_job_st *server_job)
+{
+  uint64_t expire= server_job->timer_expire;
+  uint64_t delta;
+  uint32_t level;
+  uint32_t slot;
+
+  /* A job that is already late expires on the next tick run. */
+  if (expire < timer->tick)
+    expire= timer->tick;
+
+  delta= expire - timer->tick;
+  for (level= 0; level < GEARMAN_SERVER_TIMER_LEVELS - 1; level++)
+  {
+    if (delta < ((uint64_t)1 << (GEARMAN_SERVER_TIMER_BITS * (level + 1))))
+      break;
+  }
+
+  slot= (uint32_t)(expire >> (GEARMAN_SERVER_TIMER_BITS * level)) &
+        (GEARMAN_SERVER_TIMER_SLOTS - 1);
+  server_job->timer_slot= (uint16_t)((level << GEARMAN_SERVER_TIMER_BITS) |
+                                     slot);
+  GEARMAN_BUCKET_ADD(timer->slot_list[level][slot], server_job, timer_)
+}
+
+static void _server_timer_cascade(gearman_server_timer_st *timer)
+{
+  gearman_server_job_st *server_job;
+  gearman_server_job_st *next;
+  uint32_t level;
+  uint32_t slot;
+
+  /* Each slot of a level holds the jobs for one turn of the level below, so
+     only move on to the next level when this one wraps around too. */
+  for (level= 1; level < GEARMAN_SERVER_TIMER_LEVELS; level++)
+  {
+    slot= (uint32_t)(timer->tick >> (GEARMAN_SERVER_TIMER_BITS * level)) &
+          (GEARMAN_SERVER_TIMER_SLOTS - 1);
+
+    server_job= timer->slot_list[level][slot];
+    timer->slot_list[level][slot]= NULL;
+
+    for (; server_job != NULL; server_job= next)
+    {
+      next= server_job->timer_next;
+      _server_timer_insert(timer, server_job);
+    }
+
+    if (slot != 0)
+      break;
+  }
+}
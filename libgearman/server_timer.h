@@ -0,0 +1,94 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Server job timeout declarations
+ */
+
+#ifndef __GEARMAN_SERVER_TIMER_H__
+#define __GEARMAN_SERVER_TIMER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_server_timer Server Job Timeouts
+ * @ingroup gearman_server
+ * This is a low level interface for enforcing the timeouts workers register
+ * with CAN_DO_TIMEOUT. Each shard keeps a hierarchical timer wheel with one
+ * second ticks. A running job is put in the slot for when its timeout ends,
+ * in the first level if that is less than GEARMAN_SERVER_TIMER_SLOTS ticks
+ * away, and in a coarser level otherwise. Slots of a coarser level are spread
+ * over the level below as the wheel turns, so adding and removing a job and
+ * expiring it all take constant time, however many jobs are running. A job
+ * whose timeout has passed is queued to run again, and counted for its
+ * function. Background jobs submitted to run at a later time wait on the
+ * same wheel, in the slot for that time, and are queued once it comes. Jobs
+ * held for the worker their affinity key prefers wait there too, until any
+ * worker may have them. This runs in the processing thread of a shard under
+ * the shard lock, or in the I/O thread when there are no processing threads.
+ * @{
+ */
+
+/**
+ * Initialize the timer wheel for a shard.
+ */
+GEARMAN_API
+void gearman_server_timer_init(gearman_server_timer_st *timer);
+
+/**
+ * Start the timeout for a job a worker has just taken.
+ * @param server_job Job that is now running.
+ * @param timeout Seconds the worker has to finish the job.
+ */
+GEARMAN_API
+void gearman_server_timer_add(gearman_server_job_st *server_job,
+                              uint32_t timeout);
+
+/**
+ * Hold a new job until the time in its when field, instead of queuing it.
+ * @param server_job Job that is not queued or running yet.
+ */
+GEARMAN_API
+void gearman_server_timer_schedule(gearman_server_job_st *server_job);
+
+/**
+ * Stop the timeout for a job that finished or went back to the queue, or
+ * take a scheduled job off the wheel. The job must have the
+ * GEARMAN_SERVER_JOB_TIMER option set.
+ */
+GEARMAN_API
+void gearman_server_timer_remove(gearman_server_job_st *server_job);
+
+/**
+ * Turn the timer wheel of a shard up to the current time, queuing every job
+ * whose timeout has passed to run again.
+ */
+GEARMAN_API
+void gearman_server_timer_run(gearman_server_shard_st *shard);
+
+/**
+ * Get the time the timer wheel of a shard next needs to turn.
+ * @param shard Shard to look at.
+ * @param deadline Absolute time of the next tick.
+ * @return Whether a deadline was set. There is none if no job in the shard
+ *         has a timeout.
+ */
+GEARMAN_API
+bool gearman_server_timer_deadline(gearman_server_shard_st *shard,
+                                   struct timespec *deadline);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_SERVER_TIMER_H__ */
@@ -43,24 +43,16 @@ gearman_server_worker_create(gearman_server_con_st *con,
                              gearman_server_function_st *function,
                              gearman_server_worker_st *worker)
 {
-  gearman_server_st *server= con->thread->server;
+  gearman_server_con_shard_st *con_shard;
 
   if (worker == NULL)
   {
-    if (server->free_worker_count > 0)
+    worker= gearman_server_slab_alloc(&(function->shard->worker_slab));
+    if (worker == NULL)
     {
-      worker= server->free_worker_list;
-      GEARMAN_LIST_DEL(server->free_worker, worker, con_)
-    }
-    else
-    {
-      worker= malloc(sizeof(gearman_server_worker_st));
-      if (worker == NULL)
-      {
-        GEARMAN_ERROR_SET(con->thread->gearman, "gearman_server_worker_create",
-                          "malloc")
-        return NULL;
-      }
+      GEARMAN_ERROR_SET(con->thread->gearman, "gearman_server_worker_create",
+                        "malloc")
+      return NULL;
     }
 
     worker->options= GEARMAN_SERVER_WORKER_ALLOCATED;
@@ -68,32 +60,134 @@ gearman_server_worker_create(gearman_server_con_st *con,
   else
     worker->options= 0;
 
+  con_shard= &(con->shard_list[function->shard->id]);
+
   worker->timeout= 0;
   worker->con= con;
-  GEARMAN_LIST_ADD(con->worker, worker, con_)
+  GEARMAN_LIST_ADD(con_shard->worker, worker, con_)
   worker->function= function;
   GEARMAN_LIST_ADD(function->worker, worker, function_)
-  worker->job= NULL;
+  worker->job_count= 0;
+  worker->credit= 0;
+  worker->held_count= 0;
+  worker->job_list= NULL;
+  worker->held_list= NULL;
+  worker->held_end= NULL;
+
+  /* Workers are on their connection's ready list while the function has
+     queued jobs. */
+  if (function->job_count != 0)
+    gearman_server_worker_ready(worker);
 
   return worker;
 }
 
 void gearman_server_worker_free(gearman_server_worker_st *worker)
 {
-  gearman_server_st *server= worker->con->thread->server;
+  gearman_server_shard_st *shard= worker->function->shard;
+  gearman_server_con_shard_st *con_shard= &(worker->con->shard_list[shard->id]);
+  gearman_server_job_st *server_job;
 
-  /* If the worker was in the middle of a job, requeue it. */
-  if (worker->job != NULL)
-    (void)gearman_server_job_queue(worker->job);
-
-  GEARMAN_LIST_DEL(worker->con->worker, worker, con_)
+  GEARMAN_LIST_DEL(con_shard->worker, worker, con_)
+  if (worker->function->wakeup_worker == worker)
+    worker->function->wakeup_worker= worker->function_next;
   GEARMAN_LIST_DEL(worker->function->worker, worker, function_)
+  if (worker->function->job_count != 0 || worker->held_count != 0)
+    gearman_server_worker_idle(worker);
+
+  /* Jobs held for the worker are queued again for whichever worker their key
+     maps to now. The worker is already off its ready list, so they are just
+     dropped from its list here. */
+  while ((server_job= worker->held_list) != NULL)
+  {
+    worker->held_list= server_job->worker_next;
+    gearman_server_timer_remove(server_job);
+    server_job->affinity_worker= NULL;
+    (void)gearman_server_job_queue(server_job);
+  }
+  worker->held_count= 0;
+  worker->held_end= NULL;
+
+  /* Requeue any jobs the worker was in the middle of. This is done once the
+     worker is off the function list so they can't be pushed back to it. */
+  while (worker->job_list != NULL)
+    (void)gearman_server_job_queue(worker->job_list);
 
   if (worker->options & GEARMAN_SERVER_WORKER_ALLOCATED)
+    gearman_server_slab_release(&(shard->worker_slab), worker);
+}
+
+void gearman_server_worker_ready(gearman_server_worker_st *worker)
+{
+  gearman_server_con_shard_st *con_shard=
+                    &(worker->con->shard_list[worker->function->shard->id]);
+
+  /* The turn goes down the list and starts over at the head, so a worker
+     added here waits at most one round. */
+  GEARMAN_LIST_ADD(con_shard->ready_worker, worker, ready_)
+  worker->credit= worker->function->weight;
+}
+
+void gearman_server_worker_idle(gearman_server_worker_st *worker)
+{
+  gearman_server_con_shard_st *con_shard=
+                    &(worker->con->shard_list[worker->function->shard->id]);
+
+  if (con_shard->ready_worker_turn == worker)
+    con_shard->ready_worker_turn= worker->ready_next;
+  GEARMAN_LIST_DEL(con_shard->ready_worker, worker, ready_)
+}
+
+gearman_server_worker_st *
+gearman_server_worker_turn(gearman_server_con_shard_st *con_shard)
+{
+  if (con_shard->ready_worker_turn != NULL)
+    return con_shard->ready_worker_turn;
+
+  return con_shard->ready_worker_list;
+}
+
+void gearman_server_worker_charge(gearman_server_worker_st *worker)
+{
+  gearman_server_con_shard_st *con_shard=
+                    &(worker->con->shard_list[worker->function->shard->id]);
+
+  if (worker->credit > 1)
   {
-    if (server->free_worker_count < GEARMAN_MAX_FREE_SERVER_WORKER)
-      GEARMAN_LIST_ADD(server->free_worker, worker, con_)
-    else
-      free(worker);
+    worker->credit--;
+    return;
   }
+
+  /* A worker that got a job out of turn, when pushed jobs for its function
+     as they come in, starts its next turn afresh without moving the turn. */
+  worker->credit= worker->function->weight;
+  if ((worker->function->job_count != 0 || worker->held_count != 0) &&
+      gearman_server_worker_turn(con_shard) == worker)
+  {
+    con_shard->ready_worker_turn= worker->ready_next;
+  }
+}
+
+gearman_return_t gearman_server_worker_wakeup(gearman_server_worker_st *worker)
+{
+  gearman_server_con_st *con= worker->con;
+  gearman_server_con_shard_st *con_shard=
+                    &(con->shard_list[worker->function->shard->id]);
+  gearman_return_t ret;
+
+  if (!(con_shard->options & GEARMAN_SERVER_CON_SLEEPING) || con->noop_queued)
+    return GEARMAN_SUCCESS;
+
+  con->noop_queued= true;
+  ret= gearman_server_io_response_add(con, GEARMAN_COMMAND_NOOP, 0, NULL,
+                                      NULL);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    con->noop_queued= false;
+    return ret;
+  }
+
+  con_shard->options&= (gearman_server_con_options_t)
+                       ~GEARMAN_SERVER_CON_SLEEPING;
+  return GEARMAN_SUCCESS;
 }
@@ -49,6 +49,48 @@ gearman_server_worker_create(gearman_server_con_st *con,
 GEARMAN_API
 void gearman_server_worker_free(gearman_server_worker_st *worker);
 
+/**
+ * Put a worker on its connection's ready list, once its function has queued
+ * jobs or jobs are held for it. Workers on a ready list take turns, and each
+ * turn lasts for as many jobs as the weight of the function, so a function
+ * with a flood of jobs can't keep the others on the same connection from
+ * being run.
+ */
+GEARMAN_API
+void gearman_server_worker_ready(gearman_server_worker_st *worker);
+
+/**
+ * Take a worker off its connection's ready list, once its function has no
+ * queued jobs left and none are held for it.
+ */
+GEARMAN_API
+void gearman_server_worker_idle(gearman_server_worker_st *worker);
+
+/**
+ * Get the ready worker whose turn it is on a connection.
+ * @param con_shard Connection state for the shard to look in.
+ * @return The worker, or NULL if no function of the connection has queued
+ *         jobs.
+ */
+GEARMAN_API
+gearman_server_worker_st *
+gearman_server_worker_turn(gearman_server_con_shard_st *con_shard);
+
+/**
+ * Count a job given to a worker against its turn, and pass the turn on to
+ * the next ready worker once it has had as many jobs as the weight of its
+ * function.
+ */
+GEARMAN_API
+void gearman_server_worker_charge(gearman_server_worker_st *worker);
+
+/**
+ * Send NOOP to a worker's connection if it is sleeping, so it asks for the
+ * jobs held for it. This does not count as waking a worker for its function.
+ */
+GEARMAN_API
+gearman_return_t gearman_server_worker_wakeup(gearman_server_worker_st *worker);
+
 /** @} */
 
 #ifdef __cplusplus
@@ -28,15 +28,40 @@ struct gearman_st
   uint32_t con_count;
   uint32_t job_count;
   uint32_t task_count;
+  uint32_t handle_count;
+  uint32_t handle_hash_size;
+  uint32_t task_pool_count;
   uint32_t packet_count;
   uint32_t pfds_size;
+  uint32_t watch_count;
   uint32_t sending;
+  uint32_t send_buffer_count;
+  uint32_t recv_buffer_count;
   int last_errno;
+  int epoll_fd;
+  uint64_t read_count;
+  uint64_t read_bytes;
+  uint64_t write_count;
+  uint64_t write_bytes;
+  uint64_t eagain_count;
+  size_t send_buffer_size;
+  size_t recv_buffer_size;
+  size_t compress_threshold;
+  void *send_buffer_list;
+  void *recv_buffer_list;
   gearman_con_st *con_list;
+  gearman_con_st *ready_list;
+  gearman_con_st *ready_end;
   gearman_job_st *job_list;
   gearman_task_st *task_list;
+  gearman_task_st *task_new_list;
+  gearman_task_st *task_new_end;
+  gearman_task_st **handle_hash;
+  gearman_task_st *task_pool_list;
+  gearman_task_chunk_st *task_chunk_list;
   gearman_packet_st *packet_list;
   struct pollfd *pfds;
+  struct epoll_event *epoll_events;
   gearman_log_fn *log_fn;
   void *log_fn_arg;
   gearman_event_watch_fn *event_watch;
@@ -51,9 +76,30 @@ struct gearman_st
   gearman_queue_flush_fn *queue_flush_fn;
   gearman_queue_done_fn *queue_done_fn;
   gearman_queue_replay_fn *queue_replay_fn;
+  gearman_queue_commit_fn *queue_commit_fn;
+  gearman_queue_add_batch_fn *queue_add_batch_fn;
+  gearman_queue_done_batch_fn *queue_done_batch_fn;
+  gearman_queue_mark_fn *queue_mark_fn;
+  gearman_queue_checkpoint_fn *queue_checkpoint_fn;
+  gearman_queue_replay_tail_fn *queue_replay_tail_fn;
   char last_error[GEARMAN_MAX_ERROR_SIZE];
 };
 
+/**
+ * @ingroup gearman
+ */
+struct gearman_queue_record_st
+{
+  gearman_job_priority_t priority;
+  int64_t when;
+  size_t unique_size;
+  size_t function_name_size;
+  size_t data_size;
+  const void *unique;
+  const void *function_name;
+  const void *data;
+};
+
 /**
  * @ingroup gearman_packet
  */
@@ -70,11 +116,26 @@ struct gearman_packet_st
   gearman_packet_st *prev;
   uint8_t *args;
   const void *data;
+  gearman_packet_buffer_st *buffer;
+  struct iovec *data_iov;
+  int data_iov_count;
   uint8_t *arg[GEARMAN_MAX_COMMAND_ARGS];
   size_t arg_size[GEARMAN_MAX_COMMAND_ARGS];
   uint8_t args_buffer[GEARMAN_ARGS_BUFFER_SIZE];
 };
 
+/**
+ * @ingroup gearman_packet
+ */
+struct gearman_packet_buffer_st
+{
+  uint32_t ref_count;
+  size_t size;
+  void *data;
+  gearman_free_fn *free_fn;
+  const void *free_arg;
+};
+
 /**
  * @ingroup gearman_packet
  */
@@ -97,24 +158,44 @@ struct gearman_con_st
   in_port_t port;
   short events;
   short revents;
+  short watch_events;
   int fd;
   uint32_t created_id;
   uint32_t created_id_next;
+  uint32_t weight;
+  uint32_t error_count;
+  uint32_t close_count;
+  uint32_t grab_quantum;
+  uint32_t grab_deficit;
+  uint32_t grab_count;
+  uint32_t slots;
+  uint32_t rtt_id;
+  uint64_t rtt;
+  uint64_t rtt_start;
+  uint64_t retry_time;
   size_t send_buffer_size;
+  size_t send_buffer_alloc;
   size_t send_data_size;
   size_t send_data_offset;
   size_t recv_buffer_size;
+  size_t recv_buffer_alloc;
   size_t recv_data_size;
   size_t recv_data_offset;
   gearman_st *gearman;
   gearman_con_st *next;
   gearman_con_st *prev;
+  gearman_con_st *ready_next;
   void *data;
   struct addrinfo *addrinfo;
   struct addrinfo *addrinfo_next;
   uint8_t *send_buffer_ptr;
   gearman_packet_st *recv_packet;
+  gearman_task_st *task_send;
+  gearman_task_st *task_recv;
+  gearman_task_st *task_created_list;
+  gearman_task_st *task_created_end;
   uint8_t *recv_buffer_ptr;
+  const uint8_t *recv_data_ptr;
   void *protocol_data;
   gearman_con_protocol_data_free_fn *protocol_data_free_fn;
   gearman_con_recv_fn *recv_fn;
@@ -123,10 +204,10 @@ struct gearman_con_st
   gearman_con_send_data_fn *send_data_fn;
   gearman_packet_pack_fn *packet_pack_fn;
   gearman_packet_unpack_fn *packet_unpack_fn;
+  char *host;
+  uint8_t *send_buffer;
+  uint8_t *recv_buffer;
   gearman_packet_st packet;
-  char host[NI_MAXHOST];
-  uint8_t send_buffer[GEARMAN_SEND_BUFFER_SIZE];
-  uint8_t recv_buffer[GEARMAN_RECV_BUFFER_SIZE];
 };
 
 /**
@@ -141,9 +222,23 @@ struct gearman_task_st
   uint32_t created_id;
   uint32_t numerator;
   uint32_t denominator;
+  uint32_t handle_key;
+  uint32_t server_key;
+  uint64_t submit_time;
+  uint64_t created_time;
+  uint64_t data_time;
+  size_t result_buffer_size;
+  size_t result_size;
   gearman_st *gearman;
+  gearman_client_stats_st *stats;
+  void *result_buffer;
+  gearman_result_fn *result_fn;
   gearman_task_st *next;
   gearman_task_st *prev;
+  gearman_task_st *queue_next;
+  gearman_task_st *queue_prev;
+  gearman_task_st *handle_next;
+  gearman_task_st *handle_prev;
   const void *fn_arg;
   gearman_con_st *con;
   gearman_packet_st *recv;
@@ -151,6 +246,15 @@ struct gearman_task_st
   char job_handle[GEARMAN_JOB_HANDLE_SIZE];
 };
 
+/**
+ * @ingroup gearman_task
+ */
+struct gearman_task_chunk_st
+{
+  uint32_t count;
+  gearman_task_chunk_st *next;
+};
+
 /**
  * @ingroup gearman_job
  */
@@ -163,6 +267,29 @@ struct gearman_job_st
   gearman_con_st *con;
   gearman_packet_st assigned;
   gearman_packet_st work;
+  size_t result_size;
+  const void *result;
+  gearman_job_buffer_st *buffer;
+  gearman_free_fn *result_free_fn;
+  void *result_free_arg;
+};
+
+/**
+ * @ingroup gearman_job
+ */
+struct gearman_job_buffer_st
+{
+  size_t size;
+  uint8_t *data;
+};
+
+/**
+ * @ingroup gearman_client
+ */
+struct gearman_client_point_st
+{
+  uint32_t value;
+  gearman_con_st *con;
 };
 
 /**
@@ -175,10 +302,14 @@ struct gearman_client_st
   gearman_return_t do_ret;
   uint32_t new_tasks;
   uint32_t running_tasks;
+  uint32_t ring_count;
+  uint32_t ring_con_count;
   size_t do_data_size;
   gearman_st *gearman;
   const void *data;
   gearman_con_st *con;
+  gearman_client_point_st *ring;
+  gearman_client_stats_st *stats_list;
   gearman_task_st *task;
   void *do_data;
   gearman_workload_fn *workload_fn;
@@ -193,6 +324,72 @@ struct gearman_client_st
   gearman_task_st do_task;
 };
 
+/**
+ * @ingroup gearman_histogram
+ */
+struct gearman_histogram_st
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t bucket[GEARMAN_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * @ingroup gearman_client
+ */
+struct gearman_client_stats_st
+{
+  uint64_t count;
+  uint64_t fail_count;
+  size_t function_name_size;
+  char *function_name;
+  gearman_client_stats_st *next;
+  gearman_histogram_st created;
+  gearman_histogram_st first_data;
+  gearman_histogram_st total;
+};
+
+/**
+ * @ingroup gearman_client_pool
+ */
+struct gearman_client_pool_st
+{
+  gearman_client_pool_options_t options;
+  bool shutdown;
+  bool wakeup;
+  int wakeup_fd[2];
+  uint32_t pfds_size;
+  struct pollfd *pfds;
+  gearman_client_pool_req_st *list;
+  gearman_client_pool_req_st *end;
+  pthread_mutex_t lock;
+  pthread_t id;
+  gearman_client_st client;
+};
+
+/**
+ * @ingroup gearman_client_pool
+ */
+struct gearman_client_pool_req_st
+{
+  gearman_job_priority_t priority;
+  gearman_return_t ret;
+  bool background;
+  bool done;
+  size_t workload_size;
+  size_t result_size;
+  const char *function_name;
+  const char *unique;
+  const void *workload;
+  void *result;
+  char *job_handle;
+  gearman_client_pool_st *pool;
+  gearman_client_pool_req_st *next;
+  pthread_cond_t cond;
+};
+
 /**
  * @ingroup gearman_worker
  */
@@ -201,18 +398,42 @@ struct gearman_worker_st
   gearman_worker_options_t options;
   gearman_worker_state_t state;
   gearman_worker_work_state_t work_state;
+  gearman_worker_poll_t poll;
   uint32_t function_count;
+  uint32_t dispatch_count;
+  uint32_t dispatch_hash_size;
+  uint32_t prefetch;
+  uint32_t prefetch_pending;
+  uint32_t slots;
+  uint32_t batch_max;
+  uint32_t batch_count;
+  uint32_t batch_index;
+  gearman_return_t batch_ret;
+  uint64_t batch_deadline;
   size_t work_result_size;
   gearman_st *gearman;
   gearman_con_st *con;
+  gearman_con_st *con_start;
+  gearman_con_st *con_last;
   gearman_job_st *job;
   gearman_worker_function_st *function;
   gearman_worker_function_st *function_list;
+  gearman_worker_function_st **dispatch_hash;
   gearman_worker_function_st *work_function;
   void *work_result;
+  gearman_worker_abandoned_fn *abandoned_fn;
+  void *abandoned_fn_arg;
+  gearman_worker_batch_job_st *batch_free;
+  gearman_worker_batch_job_st *batch_grab;
+  gearman_worker_batch_job_st *batch_next;
+  gearman_worker_batch_job_st **batch_list;
+  gearman_job_st **batch_job_list;
   gearman_st gearman_static;
   gearman_packet_st grab_job;
   gearman_packet_st pre_sleep;
+  gearman_packet_st set_slots;
+  gearman_packet_st abandon;
+  gearman_job_buffer_st result_buffer;
   gearman_job_st work_job;
 };
 
@@ -222,14 +443,484 @@ struct gearman_worker_st
 struct gearman_worker_function_st
 {
   gearman_worker_function_options_t options;
+  uint32_t dispatch_key;
+  size_t function_name_size;
   gearman_worker_function_st *next;
   gearman_worker_function_st *prev;
+  gearman_worker_function_st *dispatch_next;
+  gearman_worker_function_st *dispatch_prev;
   char *function_name;
   gearman_worker_fn *worker_fn;
+  gearman_worker_buffer_fn *buffer_fn;
+  gearman_worker_batch_fn *batch_fn;
+  uint32_t batch_size;
+  uint32_t batch_wait;
   const void *fn_arg;
   gearman_packet_st packet;
 };
 
+/**
+ * @ingroup gearman_worker
+ */
+struct gearman_worker_batch_job_st
+{
+  gearman_worker_batch_job_st *next;
+  gearman_job_buffer_st buffer;
+  gearman_job_st job;
+};
+
+/**
+ * @ingroup gearman_worker_pool
+ */
+struct gearman_worker_pool_st
+{
+  gearman_worker_pool_options_t options;
+  bool shutdown;
+  bool wakeup;
+  bool stop;
+  bool grab_wait;
+  int wakeup_fd[2];
+  uint32_t thread_count;
+  uint32_t thread_started;
+  uint32_t job_count;
+  uint32_t job_max;
+  uint32_t pfds_size;
+  uint64_t done_count;
+  struct pollfd *pfds;
+  gearman_worker_pool_job_st *job_list;
+  gearman_worker_pool_job_st *job_end;
+  gearman_worker_pool_job_st *done_list;
+  gearman_worker_pool_job_st *done_end;
+  gearman_worker_pool_job_st *send_list;
+  gearman_worker_pool_job_st *send_end;
+  gearman_worker_pool_job_st *free_list;
+  gearman_worker_pool_job_st *grab_job;
+  pthread_t *thread_id_list;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t id;
+  gearman_worker_st worker;
+};
+
+/**
+ * @ingroup gearman_worker_pool
+ */
+struct gearman_worker_pool_job_st
+{
+  gearman_return_t ret;
+  uint32_t close_count;
+  size_t result_size;
+  void *result;
+  gearman_worker_function_st *function;
+  gearman_worker_pool_job_st *next;
+  gearman_job_buffer_st buffer;
+  gearman_job_st job;
+};
+
+/**
+ * @ingroup gearman_server_slab
+ */
+struct gearman_server_slab_st
+{
+  gearman_server_slab_options_t options;
+  uint32_t chunk_objects;
+  uint32_t chunk_count;
+  uint32_t empty_count;
+  size_t size;
+  gearman_server_slab_chunk_st *chunk_list;
+  gearman_server_slab_chunk_st *partial_list;
+  pthread_mutex_t lock;
+};
+
+/**
+ * @ingroup gearman_server_slab
+ */
+struct gearman_server_slab_chunk_st
+{
+  uint32_t free_count;
+  gearman_server_slab_st *slab;
+  gearman_server_slab_chunk_st *next;
+  gearman_server_slab_chunk_st *prev;
+  gearman_server_slab_chunk_st *partial_next;
+  gearman_server_slab_chunk_st *partial_prev;
+  void *free_list;
+};
+
+/**
+ * @ingroup gearman_server_slab
+ */
+struct gearman_server_magazine_st
+{
+  uint32_t count;
+  uint64_t hit_count;
+  uint64_t miss_count;
+  gearman_server_slab_st *slab;
+  void *object[GEARMAN_SERVER_MAGAZINE_SIZE];
+};
+
+/**
+ * @ingroup gearman_server_spill
+ */
+struct gearman_server_spill_st
+{
+  int fd;
+  uint32_t job_count;
+  size_t memory_size;
+  size_t size;
+  size_t map_size;
+  uint8_t *map;
+};
+
+/**
+ * @ingroup gearman_server_stats
+ */
+struct gearman_server_stats_st
+{
+  time_t time;
+  gearman_packet_buffer_st *buffer;
+};
+
+/**
+ * @ingroup gearman_server_commit
+ */
+struct gearman_server_commit_st
+{
+  bool in_flight;
+  bool done;
+  gearman_return_t ret;
+  uint32_t count;
+  struct timeval start;
+  gearman_server_con_st *con_list;
+  gearman_server_con_st *con_end;
+  gearman_server_con_st *flight_list;
+};
+
+/**
+ * @ingroup gearman_server_lock
+ */
+struct gearman_server_lock_stats_st
+{
+  gearman_server_lock_site_t site;
+  uint64_t count;
+  uint64_t contended;
+  uint64_t hold_start;
+  gearman_server_lock_stats_st *next;
+  gearman_server_lock_stats_st *prev;
+  gearman_histogram_st wait;
+  gearman_histogram_st hold;
+};
+
+/**
+ * @ingroup gearman_server_timer
+ */
+struct gearman_server_timer_st
+{
+  uint32_t count;
+  uint64_t tick;
+  gearman_server_job_st *slot_list[GEARMAN_SERVER_TIMER_LEVELS]
+                                  [GEARMAN_SERVER_TIMER_SLOTS];
+};
+
+/**
+ * @ingroup gearman_server_cache
+ */
+struct gearman_server_cache_st
+{
+  uint32_t ttl;
+  uint32_t lru_count;
+  uint32_t hash_size;
+  size_t bytes;
+  size_t bytes_max;
+  uint64_t hit_count;
+  uint64_t miss_count;
+  gearman_server_cache_entry_st *lru_list;
+  gearman_server_cache_entry_st *lru_end;
+  gearman_server_cache_entry_st **hash;
+};
+
+/**
+ * @ingroup gearman_server_cache
+ */
+struct gearman_server_cache_entry_st
+{
+  bool compressed;
+  uint64_t key;
+  time_t expire;
+  size_t unique_size;
+  size_t result_size;
+  gearman_server_cache_entry_st *lru_next;
+  gearman_server_cache_entry_st *lru_prev;
+  gearman_server_cache_entry_st *hash_next;
+  gearman_server_cache_entry_st *hash_prev;
+  char *unique;
+  uint8_t *result;
+};
+
+/**
+ * @ingroup gearman_server_replay
+ */
+struct gearman_server_replay_st
+{
+  bool started;
+  bool thread_started;
+  volatile bool running;
+  volatile bool stop;
+  gearman_return_t ret;
+  uint64_t read_count;
+  uint64_t add_count;
+  time_t start;
+  time_t end;
+  gearman_server_replay_chunk_st **chunk_list;
+  pthread_t id;
+};
+
+/**
+ * @ingroup gearman_server_replay
+ */
+struct gearman_server_replay_job_st
+{
+  gearman_job_priority_t priority;
+  int64_t when;
+  size_t function_name_size;
+  size_t unique_size;
+  size_t data_size;
+  void *data;
+  char *name;
+};
+
+/**
+ * @ingroup gearman_server_replay
+ */
+struct gearman_server_replay_chunk_st
+{
+  uint32_t count;
+  gearman_server_replay_chunk_st *next;
+  gearman_server_replay_job_st job[GEARMAN_SERVER_REPLAY_CHUNK_SIZE];
+};
+
+/**
+ * @ingroup gearman_server_persist
+ */
+struct gearman_server_persist_st
+{
+  bool started;
+  bool shutdown;
+  uint32_t pending;
+  uint32_t pending_max;
+  uint64_t add_count;
+  uint64_t done_count;
+  uint64_t commit_count;
+  uint64_t fail_count;
+  struct timeval batch_time;
+  gearman_server_persist_req_st *list;
+  gearman_server_persist_req_st *end;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t id;
+};
+
+/**
+ * @ingroup gearman_server_persist
+ */
+struct gearman_server_persist_req_st
+{
+  gearman_server_persist_type_t type;
+  gearman_job_priority_t priority;
+  int64_t when;
+  size_t unique_size;
+  size_t function_name_size;
+  size_t data_size;
+  struct timeval time;
+  gearman_server_persist_req_st *next;
+  char *unique;
+  char *function_name;
+  void *data;
+  gearman_queue_commit_done_fn *done_fn;
+  void *done_arg;
+};
+
+/**
+ * @ingroup gearman_server_persist
+ */
+struct gearman_server_persist_count_st
+{
+  gearman_return_t ret;
+  uint32_t run;
+  uint32_t add;
+  uint32_t done;
+  uint32_t fail;
+};
+
+/**
+ * @ingroup gearman_server_snapshot
+ */
+struct gearman_server_snapshot_st
+{
+  bool started;
+  bool shutdown;
+  bool loaded;
+  uint32_t interval;
+  uint32_t drop_hash_size;
+  uint32_t drop_count;
+  uint64_t mark;
+  uint64_t count;
+  uint64_t fail_count;
+  uint64_t job_count;
+  uint64_t size;
+  uint64_t usec;
+  time_t time;
+  char *path;
+  gearman_server_snapshot_drop_st **drop_hash;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t id;
+};
+
+/**
+ * @ingroup gearman_server_snapshot
+ * A job removed after a snapshot was taken, followed by its function name
+ * and unique key.
+ */
+struct gearman_server_snapshot_drop_st
+{
+  uint64_t key;
+  size_t function_name_size;
+  size_t unique_size;
+  gearman_server_snapshot_drop_st *next;
+};
+
+/**
+ * @ingroup gearman_server_replica
+ */
+struct gearman_server_replica_st
+{
+  bool started;
+  bool shutdown;
+  bool promoted;
+  bool standby_connected;
+  bool listening;
+  in_port_t listen_port;
+  uint32_t listen_count;
+  uint32_t peer_count;
+  uint32_t waiting;
+  uint32_t entry_count;
+  uint32_t standby_count;
+  uint64_t seq;
+  uint64_t event_size;
+  uint64_t standby_seq;
+  uint64_t standby_connect_count;
+  gearman_server_replica_peer_st *peer_list;
+  gearman_server_replica_entry_st **entry_hash;
+  gearman_server_replica_entry_st **standby_hash;
+  gearman_server_replica_event_st *event_list;
+  gearman_server_replica_event_st *event_end;
+  int *listen_fd;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t listen_id;
+};
+
+/**
+ * @ingroup gearman_server_replica
+ */
+struct gearman_server_replica_peer_st
+{
+  gearman_server_replica_peer_state_t state;
+  bool started;
+  bool resync;
+  in_port_t port;
+  uint64_t sent_seq;
+  uint64_t ack_seq;
+  uint64_t connect_count;
+  uint64_t resync_count;
+  gearman_server_st *server;
+  gearman_server_replica_peer_st *next;
+  char *host;
+  pthread_t id;
+};
+
+/**
+ * @ingroup gearman_server_replica
+ * A background job, followed by its add message.
+ */
+struct gearman_server_replica_entry_st
+{
+  uint64_t key;
+  size_t size;
+  size_t job_handle_size;
+  gearman_server_replica_entry_st *next;
+};
+
+/**
+ * @ingroup gearman_server_replica
+ * An event waiting for peers, followed by its message.
+ */
+struct gearman_server_replica_event_st
+{
+  uint64_t seq;
+  size_t size;
+  gearman_server_replica_event_st *next;
+};
+
+/**
+ * @ingroup gearman_server_shard
+ */
+struct gearman_server_shard_st
+{
+  bool proc_wakeup;
+  bool queue_batch;
+  bool queue_replay;
+  volatile bool proc_sleeping;
+  uint32_t id;
+  char *job_chain;
+  uint32_t job_handle_count;
+  uint32_t function_count;
+  uint32_t job_count;
+  uint32_t unique_count;
+  uint32_t hash_size;
+  uint32_t hash_old_size;
+  uint32_t hash_rehash;
+  uint32_t function_hash_size;
+  uint32_t job_slot_size;
+  uint32_t job_slot_free;
+  uint32_t worker_slots_free;
+  uint64_t wakeups_sent;
+  uint64_t wakeups_received;
+  uint64_t proc_queue_takes;
+  uint64_t proc_queue_cons;
+  gearman_server_st *server;
+  gearman_server_function_st *function_list;
+  gearman_server_con_st *proc_list;
+  gearman_server_con_st *proc_stack;
+  pthread_mutex_t lock;
+  pthread_mutex_t proc_lock;
+  pthread_cond_t proc_cond;
+  gearman_server_lock_stats_st lock_stats;
+  gearman_server_lock_stats_st proc_lock_stats;
+  pthread_t proc_id;
+  size_t job_handle_prefix_size;
+  char job_handle_prefix[GEARMAN_JOB_HANDLE_SIZE];
+  gearman_server_job_slot_st *job_slot_list;
+  gearman_server_job_st **job_hash;
+  gearman_server_job_st **unique_hash;
+  gearman_server_job_st **job_hash_old;
+  gearman_server_job_st **unique_hash_old;
+  gearman_server_function_st **function_hash;
+  gearman_server_slab_st job_slab[GEARMAN_SERVER_JOB_SLAB_CLASSES];
+  gearman_server_slab_st client_slab;
+  gearman_server_slab_st worker_slab;
+  gearman_server_magazine_st packet_magazine;
+  gearman_server_magazine_st io_packet_magazine;
+  gearman_server_replay_chunk_st *replay_list;
+  gearman_server_replay_chunk_st *replay_end;
+  gearman_queue_record_st *queue_record;
+  gearman_server_job_st **queue_record_job;
+  uint32_t queue_record_count;
+  gearman_server_spill_st spill;
+  gearman_server_commit_st commit;
+  gearman_server_timer_st timer;
+};
+
 /**
  * @ingroup gearman_server
  */
@@ -238,33 +929,52 @@ struct gearman_server_st
   gearman_server_options_t options;
   bool shutdown;
   bool shutdown_graceful;
-  bool proc_wakeup;
   bool proc_shutdown;
-  uint32_t job_handle_count;
+  bool queue_replay_background;
+  bool queue_shared;
+  bool queue_persist_thread;
   uint32_t thread_count;
-  uint32_t function_count;
-  uint32_t job_count;
-  uint32_t unique_count;
-  uint32_t free_packet_count;
-  uint32_t free_job_count;
-  uint32_t free_client_count;
-  uint32_t free_worker_count;
+  uint32_t shard_count;
+  uint32_t worker_wakeup;
+  uint32_t read_budget;
+  uint32_t priority_levels;
+  uint32_t priority_age;
+  uint32_t affinity_wait;
+  uint32_t stats_interval;
+  uint32_t queue_commit_size;
+  uint32_t queue_commit_window;
+  size_t spill_watermark;
+  size_t work_data_max;
+  size_t queue_bytes_max;
+  size_t queue_bytes;
+  size_t client_rate;
+  uint32_t proc_cpu_count;
+  uint32_t lock_stats_count;
+  uint32_t *proc_cpu_list;
+  char *spill_path;
   gearman_st *gearman;
   gearman_server_thread_st *thread_list;
-  gearman_server_function_st *function_list;
-  gearman_server_packet_st *free_packet_list;
-  gearman_server_job_st *free_job_list;
-  gearman_server_client_st *free_client_list;
-  gearman_server_worker_st *free_worker_list;
+  gearman_server_shard_st *shard_list;
+  gearman_server_lock_stats_st *lock_stats_list;
   gearman_server_log_fn *log_fn;
   void *log_fn_arg;
   gearman_st gearman_static;
-  pthread_mutex_t proc_lock;
-  pthread_cond_t proc_cond;
-  pthread_t proc_id;
+  pthread_key_t proc_key;
+  pthread_mutex_t queue_lock;
+  size_t job_handle_prefix_size;
   char job_handle_prefix[GEARMAN_JOB_HANDLE_SIZE];
-  gearman_server_job_st *job_hash[GEARMAN_JOB_HASH_SIZE];
-  gearman_server_job_st *unique_hash[GEARMAN_JOB_HASH_SIZE];
+  gearman_server_slab_st packet_slab;
+  gearman_server_slab_st node_packet_slab[GEARMAN_SERVER_NUMA_NODES];
+  gearman_server_magazine_st packet_magazine;
+  gearman_server_slab_st io_packet_slab;
+  gearman_server_slab_st node_io_packet_slab[GEARMAN_SERVER_NUMA_NODES];
+  gearman_server_magazine_st io_packet_magazine;
+  gearman_server_stats_st stats[GEARMAN_SERVER_STATS_MAX];
+  gearman_server_replay_st replay;
+  gearman_server_persist_st persist;
+  gearman_server_snapshot_st snapshot;
+  gearman_server_replica_st replica;
+  uint32_t priority_level[GEARMAN_JOB_PRIORITY_MAX];
 };
 
 /**
@@ -273,26 +983,44 @@ struct gearman_server_st
 struct gearman_server_thread_st
 {
   gearman_server_thread_options_t options;
+  bool io_reading;
   uint32_t con_count;
-  uint32_t io_count;
-  uint32_t proc_count;
   uint32_t free_con_count;
-  uint32_t free_packet_count;
+  uint32_t budget_count;
+  uint32_t pause_count;
+  uint32_t rate_count;
+  uint64_t read_budget_hits;
+  uint64_t rate_limit_hits;
+  uint64_t inline_count;
+  uint64_t load_count;
+  uint64_t wakeups_sent;
+  uint64_t wakeups_received;
+  uint64_t io_queue_takes;
+  uint64_t io_queue_cons;
+  uint64_t packets_in[GEARMAN_COMMAND_MAX];
+  uint64_t packets_out[GEARMAN_COMMAND_MAX];
   gearman_st *gearman;
   gearman_server_st *server;
   gearman_server_thread_st *next;
   gearman_server_thread_st *prev;
   gearman_server_thread_log_fn *log_fn;
+  gearman_server_thread_packet_log_fn *packet_log_fn;
+  gearman_server_thread_con_name_fn *con_name_fn;
   void *log_fn_arg;
   gearman_server_thread_run_fn *run_fn;
   void *run_fn_arg;
   gearman_server_con_st *con_list;
   gearman_server_con_st *io_list;
-  gearman_server_con_st *proc_list;
+  gearman_server_con_st *io_stack;
   gearman_server_con_st *free_con_list;
-  gearman_server_packet_st *free_packet_list;
+  gearman_server_con_st *budget_list;
+  gearman_server_con_st *pause_list;
+  gearman_server_con_st *rate_list;
+  gearman_server_magazine_st packet_magazine;
+  gearman_server_magazine_st io_packet_magazine;
   gearman_st gearman_static;
   pthread_mutex_t lock;
+  gearman_server_lock_stats_st lock_stats;
 };
 
 /**
@@ -305,29 +1033,65 @@ struct gearman_server_con_st
   gearman_return_t ret;
   bool noop_queued;
   bool io_list;
+  bool budget_list;
+  bool pause_list;
+  bool rate_list;
   bool proc_list;
   bool proc_removed;
-  uint32_t io_packet_count;
-  uint32_t proc_packet_count;
-  uint32_t worker_count;
-  uint32_t client_count;
+  bool proc_forward;
+  bool commit_wait;
+  uint32_t proc_hops;
+  uint32_t proc_dead;
+  uint32_t proc_rotate;
+  uint32_t io_data_waiters;
+  uint64_t id_key;
+  int64_t rate_tokens;
+  uint64_t rate_time;
+  uint64_t load_count;
+  size_t io_packet_offset;
+  size_t io_data_size;
   gearman_server_thread_st *thread;
+  gearman_server_shard_st *shard;
+  gearman_server_con_shard_st *shard_list;
   gearman_server_con_st *next;
   gearman_server_con_st *prev;
   gearman_server_packet_st *packet;
-  gearman_server_packet_st *io_packet_list;
-  gearman_server_packet_st *io_packet_end;
+  gearman_server_io_packet_st *io_packet_list;
+  gearman_server_io_packet_st *io_packet_stack;
   gearman_server_packet_st *proc_packet_list;
-  gearman_server_packet_st *proc_packet_end;
+  gearman_server_packet_st *proc_packet_stack;
   gearman_server_con_st *io_next;
-  gearman_server_con_st *io_prev;
   gearman_server_con_st *proc_next;
-  gearman_server_con_st *proc_prev;
-  gearman_server_worker_st *worker_list;
-  gearman_server_client_st *client_list;
+  gearman_server_con_st *budget_next;
+  gearman_server_con_st *budget_prev;
+  gearman_server_con_st *pause_next;
+  gearman_server_con_st *pause_prev;
+  gearman_server_con_st *rate_next;
+  gearman_server_con_st *rate_prev;
+  gearman_server_con_st *io_paused;
+  gearman_server_con_st *commit_next;
   const char *host;
   const char *port;
-  char id[GEARMAN_SERVER_CON_ID_SIZE];
+  char *id;
+  char commit_handle[GEARMAN_JOB_HANDLE_SIZE];
+};
+
+/**
+ * @ingroup gearman_server_con
+ */
+struct gearman_server_con_shard_st
+{
+  gearman_server_con_options_t options;
+  uint32_t worker_count;
+  uint32_t ready_worker_count;
+  uint32_t client_count;
+  uint32_t slots;
+  uint32_t slots_used;
+  gearman_server_worker_st *worker_list;
+  gearman_server_worker_st *ready_worker_list;
+  gearman_server_worker_st *ready_worker_turn;
+  gearman_server_client_st *client_list;
+  gearman_server_function_st *wakeup_function;
 };
 
 /**
@@ -336,9 +1100,30 @@ struct gearman_server_con_st
 struct gearman_server_packet_st
 {
   gearman_packet_st packet;
+  uint32_t shard;
+  uint32_t shard_hops;
   gearman_server_packet_st *next;
 };
 
+/**
+ * @ingroup gearman_server_con
+ */
+struct gearman_server_io_packet_st
+{
+  gearman_packet_options_t options;
+  gearman_magic_t magic;
+  gearman_command_t command;
+  uint8_t argc;
+  size_t args_size;
+  size_t data_size;
+  size_t io_data_size;
+  uint8_t *args;
+  const void *data;
+  gearman_packet_buffer_st *buffer;
+  gearman_server_io_packet_st *next;
+  uint8_t args_buffer[GEARMAN_SERVER_IO_ARGS_SIZE];
+};
+
 /**
  * @ingroup gearman_server_function
  */
@@ -350,14 +1135,36 @@ struct gearman_server_function_st
   uint32_t job_total;
   uint32_t job_running;
   uint32_t max_queue_size;
+  uint32_t function_key;
+  uint32_t wakeup_count;
+  uint32_t weight;
+  uint32_t job_scheduled;
+  uint32_t level_map;
+  uint64_t timeout_count;
+  size_t queue_bytes;
+  size_t max_queue_bytes;
   size_t function_name_size;
-  gearman_server_st *server;
+  gearman_server_cache_st cache;
+  gearman_server_latency_st *latency;
+  gearman_server_shard_st *shard;
   gearman_server_function_st *next;
   gearman_server_function_st *prev;
+  gearman_server_function_st *hash_next;
+  gearman_server_function_st *hash_prev;
   char *function_name;
   gearman_server_worker_st *worker_list;
-  gearman_server_job_st *job_list[GEARMAN_JOB_PRIORITY_MAX];
-  gearman_server_job_st *job_end[GEARMAN_JOB_PRIORITY_MAX];
+  gearman_server_worker_st *wakeup_worker;
+  gearman_server_job_st *job_list[GEARMAN_SERVER_PRIORITY_LEVELS_MAX];
+  gearman_server_job_st *job_end[GEARMAN_SERVER_PRIORITY_LEVELS_MAX];
+};
+
+/**
+ * @ingroup gearman_server_function
+ */
+struct gearman_server_latency_st
+{
+  gearman_histogram_st wait;
+  gearman_histogram_st run;
 };
 
 /**
@@ -366,6 +1173,7 @@ struct gearman_server_function_st
 struct gearman_server_client_st
 {
   gearman_server_client_options_t options;
+  gearman_server_shard_st *shard;
   gearman_server_con_st *con;
   gearman_server_client_st *con_next;
   gearman_server_client_st *con_prev;
@@ -381,13 +1189,20 @@ struct gearman_server_worker_st
 {
   gearman_server_worker_options_t options;
   uint32_t timeout;
+  uint32_t job_count;
+  uint32_t credit;
+  uint32_t held_count;
   gearman_server_con_st *con;
   gearman_server_worker_st *con_next;
   gearman_server_worker_st *con_prev;
   gearman_server_function_st *function;
   gearman_server_worker_st *function_next;
   gearman_server_worker_st *function_prev;
-  gearman_server_job_st *job;
+  gearman_server_worker_st *ready_next;
+  gearman_server_worker_st *ready_prev;
+  gearman_server_job_st *job_list;
+  gearman_server_job_st *held_list;
+  gearman_server_job_st *held_end;
 };
 
 /**
@@ -396,25 +1211,137 @@ struct gearman_server_worker_st
 struct gearman_server_job_st
 {
   gearman_server_job_options_t options;
-  gearman_job_priority_t priority;
-  uint32_t job_handle_key;
-  uint32_t unique_key;
-  uint32_t client_count;
-  uint32_t numerator;
-  uint32_t denominator;
-  size_t data_size;
-  gearman_server_st *server;
-  gearman_server_job_st *next;
-  gearman_server_job_st *prev;
-  gearman_server_job_st *unique_next;
-  gearman_server_job_st *unique_prev;
+  uint8_t priority;
+  uint8_t level;
+  uint8_t unique_size;
   gearman_server_function_st *function;
   gearman_server_job_st *function_next;
   const void *data;
-  gearman_server_client_st *client_list;
+  size_t data_size;
   gearman_server_worker_st *worker;
-  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
-  char unique[GEARMAN_UNIQUE_SIZE];
+  gearman_server_client_st *client_list;
+  char *chain;
+  uint64_t affinity_key;
+  uint64_t id;
+  uint64_t unique_key;
+  gearman_server_job_st *next;
+  gearman_server_job_st *unique_next;
+  gearman_server_job_st *worker_next;
+  gearman_server_job_st *worker_prev;
+  gearman_server_worker_st *affinity_worker;
+  uint64_t queue_time;
+  uint64_t created_time;
+  uint64_t assigned_time;
+  int64_t when;
+  uint64_t timer_expire;
+  gearman_server_job_st *timer_next;
+  gearman_server_job_st *timer_prev;
+  size_t spill_offset;
+  uint32_t client_count;
+  uint32_t numerator;
+  uint32_t denominator;
+  uint16_t timer_slot;
+  char unique[1]; /* Runs past the end, see gearman_server_job_create. */
+};
+
+/**
+ * @ingroup gearman_server_job
+ */
+struct gearman_server_job_slot_st
+{
+  uint32_t generation;
+  uint32_t next_free;
+  gearman_server_job_st *job;
+};
+
+/**
+ * @ingroup gearmand_uring
+ */
+struct gearmand_uring_st
+{
+  int fd;
+  uint32_t sq_entries;
+  uint32_t sq_queued;
+  uint32_t watch_count;
+  uint32_t slot_size;
+  uint32_t slot_free;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqe_size;
+  void *sq_ring;
+  void *cq_ring;
+  volatile uint32_t *sq_tail;
+  uint32_t *sq_mask;
+  uint32_t *sq_array;
+  volatile uint32_t *cq_head;
+  volatile uint32_t *cq_tail;
+  uint32_t *cq_mask;
+  struct io_uring_sqe *sqe_list;
+  struct io_uring_cqe *cqe_list;
+  gearmand_uring_event_st **slot_event;
+  uint32_t *slot_next;
+};
+
+/**
+ * @ingroup gearmand_uring
+ */
+struct gearmand_uring_event_st
+{
+  short events;
+  int fd;
+  uint32_t slot;
+  gearmand_uring_event_fn *fn;
+  void *arg;
+};
+
+/**
+ * @ingroup gearmand_log
+ */
+struct gearmand_log_record_st
+{
+  gearmand_log_record_t type;
+  gearman_verbose_t verbose;
+  uint32_t thread;
+  gearman_command_t command;
+  union
+  {
+    char line[GEARMAN_MAX_ERROR_SIZE];
+    struct
+    {
+      char host[NI_MAXHOST];
+      char port[NI_MAXSERV];
+    } con;
+  } data;
+};
+
+/**
+ * @ingroup gearmand_log
+ */
+struct gearmand_log_ring_st
+{
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile uint64_t dropped;
+  uint64_t dropped_reported;
+  gearmand_log_ring_st *next;
+  gearmand_log_record_st *record_list;
+};
+
+/**
+ * @ingroup gearmand_log
+ */
+struct gearmand_log_st
+{
+  bool started;
+  bool shutdown;
+  uint32_t ring_size;
+  gearmand_log_fn *write_fn;
+  void *write_fn_arg;
+  gearmand_log_ring_st *ring_list;
+  pthread_key_t key;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t id;
 };
 
 /**
@@ -426,11 +1353,18 @@ struct gearmand_st
   gearman_verbose_t verbose;
   gearman_return_t ret;
   int backlog;
+  volatile int spare_fd;
+  uint32_t accept_budget;
   uint32_t port_count;
   uint32_t threads;
   uint32_t thread_count;
   uint32_t free_dcon_count;
   uint32_t max_thread_free_dcon_count;
+  volatile uint32_t wakeup_pending;
+  gearmand_io_engine_t io_engine;
+  int main_cpu;
+  uint32_t io_cpu_count;
+  uint32_t *io_cpu_list;
   int wakeup_fd[2];
   const char *host;
   gearmand_log_fn *log_fn;
@@ -440,8 +1374,12 @@ struct gearmand_st
   gearmand_thread_st *thread_list;
   gearmand_thread_st *thread_add_next;
   gearmand_con_st *free_dcon_list;
+  gearmand_con_st *migrate_list;
+  gearmand_con_st *migrate_stack;
+  gearmand_log_st log;
   gearman_server_st server;
   struct event wakeup_event;
+  struct event timer_event;
 };
 
 /**
@@ -451,6 +1389,7 @@ struct gearmand_port_st
 {
   in_port_t port;
   uint32_t listen_count;
+  const char *path;
   gearmand_st *gearmand;
   gearman_con_add_fn *add_fn;
   int *listen_fd;
@@ -467,7 +1406,12 @@ struct gearmand_thread_st
   uint32_t dcon_count;
   uint32_t dcon_add_count;
   uint32_t free_dcon_count;
+  uint32_t listen_count;
+  volatile uint32_t wakeup_pending;
   int wakeup_fd[2];
+  uint64_t load;
+  uint64_t load_last;
+  uint64_t migrate_load;
   gearmand_thread_st *next;
   gearmand_thread_st *prev;
   gearmand_st *gearmand;
@@ -475,10 +1419,18 @@ struct gearmand_thread_st
   gearmand_con_st *dcon_list;
   gearmand_con_st *dcon_add_list;
   gearmand_con_st *free_dcon_list;
+  gearmand_con_st *migrate_dcon;
+  int *listen_fd;
+  gearmand_port_st **listen_port;
+  struct event *listen_event;
+  gearmand_uring_event_st *listen_uring_event;
   gearman_server_thread_st server_thread;
   struct event wakeup_event;
+  gearmand_uring_event_st wakeup_uring_event;
+  gearmand_uring_st uring;
   pthread_t id;
   pthread_mutex_t lock;
+  gearman_server_lock_stats_st lock_stats;
 };
 
 /**
@@ -495,6 +1447,10 @@ struct gearmand_con_st
   gearman_con_st *con;
   gearman_con_add_fn *add_fn;
   struct event event;
+  gearmand_uring_event_st uring_event;
+  volatile uint32_t name_state;
+  socklen_t addr_len;
+  struct sockaddr_storage addr;
   char host[NI_MAXHOST];
   char port[NI_MAXSERV];
 };
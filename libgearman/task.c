@@ -13,6 +13,23 @@
 
 #include "common.h"
 
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_task_private Private Task Functions
+ * @ingroup gearman_task
+ * @{
+ */
+
+/**
+ * Grow the job handle hash, moving the tasks already in it.
+ */
+static gearman_return_t _task_hash_resize(gearman_st *gearman, uint32_t size);
+
+/** @} */
+
 /*
  * Public definitions
  */
@@ -20,7 +37,15 @@
 gearman_task_st *gearman_task_create(gearman_st *gearman,
                                      gearman_task_st *task)
 {
-  if (task == NULL)
+  if (task == NULL && gearman->task_pool_list != NULL)
+  {
+    task= gearman->task_pool_list;
+    gearman->task_pool_list= task->next;
+    gearman->task_pool_count--;
+
+    task->options= GEARMAN_TASK_POOLED;
+  }
+  else if (task == NULL)
   {
     task= malloc(sizeof(gearman_task_st));
     if (task == NULL)
@@ -41,7 +66,21 @@ gearman_task_st *gearman_task_create(gearman_st *gearman,
   task->numerator= 0;
   task->denominator= 0;
   task->gearman= gearman;
+  task->handle_key= 0;
+  task->server_key= 0;
+  task->submit_time= 0;
+  task->created_time= 0;
+  task->data_time= 0;
+  task->result_buffer_size= 0;
+  task->result_size= 0;
+  task->stats= NULL;
+  task->result_buffer= NULL;
+  task->result_fn= NULL;
   GEARMAN_LIST_ADD(gearman->task, task,)
+  task->queue_next= NULL;
+  task->queue_prev= NULL;
+  task->handle_next= NULL;
+  task->handle_prev= NULL;
   task->fn_arg= NULL;
   task->con= NULL;
   task->recv= NULL;
@@ -58,10 +97,18 @@ void gearman_task_free(gearman_task_st *task)
   if (task->fn_arg != NULL && task->gearman->task_fn_arg_free_fn != NULL)
     (*(task->gearman->task_fn_arg_free_fn))(task, (void *)(task->fn_arg));
 
+  gearman_task_dequeue(task);
+  gearman_task_hash_del(task);
   GEARMAN_LIST_DEL(task->gearman->task, task,)
 
   if (task->options & GEARMAN_TASK_ALLOCATED)
     free(task);
+  else if (task->options & GEARMAN_TASK_POOLED)
+  {
+    task->next= task->gearman->task_pool_list;
+    task->gearman->task_pool_list= task;
+    task->gearman->task_pool_count++;
+  }
 }
 
 void *gearman_task_fn_arg(gearman_task_st *task)
@@ -124,6 +171,29 @@ void *gearman_task_take_data(gearman_task_st *task, size_t *size)
   return gearman_packet_take_data(task->recv, size);
 }
 
+void gearman_task_set_result_buffer(gearman_task_st *task, void *buffer,
+                                    size_t buffer_size)
+{
+  task->result_buffer= buffer;
+  task->result_buffer_size= buffer_size;
+  task->result_fn= NULL;
+  task->result_size= 0;
+}
+
+void gearman_task_set_result_fn(gearman_task_st *task,
+                                gearman_result_fn *result_fn)
+{
+  task->result_fn= result_fn;
+  task->result_buffer= NULL;
+  task->result_buffer_size= 0;
+  task->result_size= 0;
+}
+
+size_t gearman_task_result_size(gearman_task_st *task)
+{
+  return task->result_size;
+}
+
 size_t gearman_task_send_data(gearman_task_st *task, const void *data,
                               size_t data_size, gearman_return_t *ret_ptr)
 {
@@ -135,3 +205,230 @@ size_t gearman_task_recv_data(gearman_task_st *task, void *data,
 {
   return gearman_con_recv_data(task->con, data, data_size, ret_ptr);
 }
+
+void gearman_task_queue_new(gearman_task_st *task)
+{
+  gearman_st *gearman= task->gearman;
+
+  task->queue_next= NULL;
+  task->queue_prev= gearman->task_new_end;
+  if (gearman->task_new_end == NULL)
+    gearman->task_new_list= task;
+  else
+    gearman->task_new_end->queue_next= task;
+  gearman->task_new_end= task;
+
+  task->options|= GEARMAN_TASK_NEW_QUEUED;
+}
+
+void gearman_task_queue_created(gearman_task_st *task)
+{
+  gearman_con_st *con= task->con;
+
+  task->queue_next= NULL;
+  task->queue_prev= con->task_created_end;
+  if (con->task_created_end == NULL)
+    con->task_created_list= task;
+  else
+    con->task_created_end->queue_next= task;
+  con->task_created_end= task;
+
+  task->options|= GEARMAN_TASK_CREATED_QUEUED;
+}
+
+void gearman_task_dequeue(gearman_task_st *task)
+{
+  gearman_task_st **list;
+  gearman_task_st **end;
+
+  if (task->options & GEARMAN_TASK_NEW_QUEUED)
+  {
+    list= &(task->gearman->task_new_list);
+    end= &(task->gearman->task_new_end);
+  }
+  else if (task->options & GEARMAN_TASK_CREATED_QUEUED)
+  {
+    list= &(task->con->task_created_list);
+    end= &(task->con->task_created_end);
+  }
+  else
+    return;
+
+  if (task->queue_prev == NULL)
+    *list= task->queue_next;
+  else
+    task->queue_prev->queue_next= task->queue_next;
+
+  if (task->queue_next == NULL)
+    *end= task->queue_prev;
+  else
+    task->queue_next->queue_prev= task->queue_prev;
+
+  task->queue_next= NULL;
+  task->queue_prev= NULL;
+  task->options&= (gearman_task_options_t)~(GEARMAN_TASK_NEW_QUEUED |
+                                           GEARMAN_TASK_CREATED_QUEUED);
+}
+
+void gearman_task_hash_add(gearman_task_st *task)
+{
+  gearman_st *gearman= task->gearman;
+  uint32_t key;
+
+  if (task->options & GEARMAN_TASK_HANDLE_HASHED)
+    return;
+
+  if (gearman->handle_count >= gearman->handle_hash_size)
+  {
+    (void)_task_hash_resize(gearman, gearman->handle_hash_size == 0 ?
+                            GEARMAN_TASK_HASH_SIZE :
+                            (gearman->handle_hash_size << 1) + 1);
+    if (gearman->handle_hash == NULL)
+      return;
+  }
+
+  task->handle_key= gearman_server_hash(task->job_handle,
+                                        strlen(task->job_handle));
+  key= task->handle_key % gearman->handle_hash_size;
+  GEARMAN_HASH_ADD(gearman->handle, key, task, handle_)
+
+  task->options|= GEARMAN_TASK_HANDLE_HASHED;
+}
+
+void gearman_task_hash_del(gearman_task_st *task)
+{
+  gearman_st *gearman= task->gearman;
+  uint32_t key;
+
+  if (!(task->options & GEARMAN_TASK_HANDLE_HASHED))
+    return;
+
+  key= task->handle_key % gearman->handle_hash_size;
+  GEARMAN_HASH_DEL(gearman->handle, key, task, handle_)
+
+  task->options&= (gearman_task_options_t)~GEARMAN_TASK_HANDLE_HASHED;
+}
+
+gearman_task_st *gearman_task_hash_find(gearman_con_st *con,
+                                        const char *job_handle, bool status)
+{
+  gearman_st *gearman= con->gearman;
+  gearman_task_st *task;
+  uint32_t handle_key;
+
+  if (gearman->handle_hash == NULL)
+    return NULL;
+
+  handle_key= gearman_server_hash(job_handle, strlen(job_handle));
+
+  for (task= gearman->handle_hash[handle_key % gearman->handle_hash_size];
+       task != NULL; task= task->handle_next)
+  {
+    if (task->handle_key == handle_key && task->con == con &&
+        (task->send.command == GEARMAN_COMMAND_GET_STATUS) == status &&
+        !strcmp(task->job_handle, job_handle))
+    {
+      return task;
+    }
+  }
+
+  return NULL;
+}
+
+gearman_return_t gearman_task_reserve(gearman_st *gearman, uint32_t count)
+{
+  gearman_task_chunk_st *chunk;
+  gearman_task_st *task;
+  uint32_t x;
+
+  while (gearman->task_pool_count < count)
+  {
+    /* Each chunk is one allocation, with its tasks right after it. */
+    x= count - gearman->task_pool_count;
+    if (x > GEARMAN_TASK_CHUNK_SIZE)
+      x= GEARMAN_TASK_CHUNK_SIZE;
+
+    chunk= malloc(sizeof(gearman_task_chunk_st) + (x * sizeof(gearman_task_st)));
+    if (chunk == NULL)
+    {
+      GEARMAN_ERROR_SET(gearman, "gearman_task_reserve", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    chunk->count= x;
+    chunk->next= gearman->task_chunk_list;
+    gearman->task_chunk_list= chunk;
+
+    /* Push them in reverse so they are handed out in address order. */
+    task= (gearman_task_st *)(chunk + 1);
+    while (x--)
+    {
+      task[x].next= gearman->task_pool_list;
+      gearman->task_pool_list= &(task[x]);
+      gearman->task_pool_count++;
+    }
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_task_pool_free(gearman_st *gearman)
+{
+  gearman_task_chunk_st *chunk;
+
+  while (gearman->task_chunk_list != NULL)
+  {
+    chunk= gearman->task_chunk_list;
+    gearman->task_chunk_list= chunk->next;
+    free(chunk);
+  }
+
+  gearman->task_pool_list= NULL;
+  gearman->task_pool_count= 0;
+}
+
+void gearman_task_con_free(gearman_con_st *con)
+{
+  while (con->task_created_list != NULL)
+    gearman_task_dequeue(con->task_created_list);
+
+  con->task_send= NULL;
+}
+
+/*
+ * Private definitions
+ */
+
+static gearman_return_t _task_hash_resize(gearman_st *gearman, uint32_t size)
+{
+  gearman_task_st **handle_hash;
+  gearman_task_st *task;
+  gearman_task_st *next;
+  uint32_t key;
+  uint32_t x;
+
+  handle_hash= calloc(size, sizeof(gearman_task_st *));
+  if (handle_hash == NULL)
+  {
+    GEARMAN_ERROR_SET(gearman, "_task_hash_resize", "calloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  for (x= 0; x < gearman->handle_hash_size; x++)
+  {
+    for (task= gearman->handle_hash[x]; task != NULL; task= next)
+    {
+      next= task->handle_next;
+      key= task->handle_key % size;
+      GEARMAN_BUCKET_ADD(handle_hash[key], task, handle_)
+    }
+  }
+
+  if (gearman->handle_hash != NULL)
+    free(gearman->handle_hash);
+
+  gearman->handle_hash= handle_hash;
+  gearman->handle_hash_size= size;
+
+  return GEARMAN_SUCCESS;
+}
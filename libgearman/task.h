@@ -112,6 +112,45 @@ size_t gearman_task_data_size(gearman_task_st *task);
 GEARMAN_API
 void *gearman_task_take_data(gearman_task_st *task, size_t *size);
 
+/**
+ * Have the result data of a task read straight into a caller buffer, instead
+ * of into one allocated for each packet. The data of every WORK_DATA and
+ * WORK_COMPLETE packet is appended in order, so gearman_task_data returns
+ * NULL for them. Data past the end of the buffer is dropped, but still
+ * counted by gearman_task_result_size, so a result larger than the buffer
+ * can be told apart from one that just fit.
+ * @param task Task to set the buffer for, before it is run.
+ * @param buffer Buffer to read into, which must stay valid until the task is
+ *        done.
+ * @param buffer_size Size of the buffer.
+ */
+GEARMAN_API
+void gearman_task_set_result_buffer(gearman_task_st *task, void *buffer,
+                                    size_t buffer_size);
+
+/**
+ * Have the result data of a task passed to a callback as it arrives instead
+ * of being buffered. Each piece points into the connection receive buffer,
+ * or is read into it straight from the socket, and is only valid during the
+ * call. Pieces from every WORK_DATA and WORK_COMPLETE packet come in order,
+ * before the data or complete callback for that packet, which then sees NULL
+ * from gearman_task_data. If the callback returns anything but
+ * GEARMAN_SUCCESS, the connection is closed since the rest of the packet can
+ * no longer be skipped, and gearman_client_run_tasks returns that value.
+ * @param task Task to set the callback for, before it is run.
+ * @param result_fn Function to call with each piece of data.
+ */
+GEARMAN_API
+void gearman_task_set_result_fn(gearman_task_st *task,
+                                gearman_result_fn *result_fn);
+
+/**
+ * Get how many bytes of result data have been read for a task with a result
+ * buffer or callback, including any that did not fit in the buffer.
+ */
+GEARMAN_API
+size_t gearman_task_result_size(gearman_task_st *task);
+
 /**
  * Send packet data for a task.
  */
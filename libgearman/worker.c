@@ -33,11 +33,26 @@ static gearman_worker_st *_worker_allocate(gearman_worker_st *worker);
  */
 static gearman_return_t _worker_packet_init(gearman_worker_st *worker);
 
+/**
+ * Initialize the grab job packet for the current prefetch depth.
+ */
+static gearman_return_t _worker_grab_job_init(gearman_worker_st *worker);
+
+/**
+ * Initialize the SET_SLOTS packet for the current number of slots.
+ */
+static gearman_return_t _worker_set_slots_init(gearman_worker_st *worker);
+
+/**
+ * See if a connection in slot mode may have pushed jobs waiting to be read.
+ */
+static bool _worker_con_pending(gearman_con_st *con);
+
 /**
  * Callback function used when parsing server lists.
  */
 static gearman_return_t _worker_add_server(const char *host, in_port_t port,
-                                           void *data);
+                                           uint32_t weight, void *data);
 
 /**
  * Allocate and add a function to the register list.
@@ -46,14 +61,65 @@ static gearman_return_t _worker_function_add(gearman_worker_st *worker,
                                              const char *function_name,
                                              uint32_t timeout,
                                              gearman_worker_fn *worker_fn,
+                                             gearman_worker_buffer_fn *buffer_fn,
                                              const void *fn_arg);
 
+/**
+ * Grow the function dispatch hash.
+ */
+static gearman_return_t _worker_function_hash_resize(gearman_worker_st *worker,
+                                                     uint32_t size);
+
 /**
  * Free a function.
  */
 static void _worker_function_free(gearman_worker_st *worker,
                                   gearman_worker_function_st *function);
 
+/**
+ * Get the connection to start asking for jobs on, for the polling order.
+ */
+static gearman_con_st *_worker_con_first(gearman_worker_st *worker);
+
+/**
+ * Get the connection to ask after this one, or NULL once all have been asked.
+ */
+static gearman_con_st *_worker_con_next(gearman_worker_st *worker,
+                                        gearman_con_st *con);
+
+/**
+ * Pick where to ask for the next job after one was grabbed.
+ */
+static void _worker_grab_next(gearman_worker_st *worker);
+
+/**
+ * Mark all connections awake, so the next grab asks every job server.
+ */
+static void _worker_wake_all(gearman_worker_st *worker);
+
+/**
+ * Work on jobs for a worker that has batch functions. Each job is grabbed
+ * into its own structure, so jobs for a batch function can be gathered and
+ * run together.
+ */
+static gearman_return_t _worker_work_batch(gearman_worker_st *worker);
+
+/**
+ * Grab a job into a batch job structure.
+ */
+static gearman_worker_batch_job_st *
+_worker_batch_grab(gearman_worker_st *worker, gearman_return_t *ret_ptr);
+
+/**
+ * Free the jobs in the current batch, keeping their structures for reuse.
+ */
+static void _worker_batch_free(gearman_worker_st *worker);
+
+/**
+ * Release a result returned by a regular function run in a batch.
+ */
+static void _worker_result_free(void *ptr, void *arg);
+
 /** @} */
 
 /*
@@ -94,6 +160,9 @@ gearman_worker_st *gearman_worker_clone(gearman_worker_st *worker,
 
   worker->options|= (from->options &
                      (gearman_worker_options_t)~GEARMAN_WORKER_ALLOCATED);
+  worker->prefetch= from->prefetch;
+  worker->slots= from->slots;
+  worker->poll= from->poll;
 
   worker->gearman= gearman_clone(&(worker->gearman_static), from->gearman);
   if (worker->gearman == NULL)
@@ -108,23 +177,68 @@ gearman_worker_st *gearman_worker_clone(gearman_worker_st *worker,
     return NULL;
   }
 
+  if (from->abandoned_fn != NULL &&
+      gearman_worker_set_abandoned_fn(worker, from->abandoned_fn,
+                                      from->abandoned_fn_arg) !=
+      GEARMAN_SUCCESS)
+  {
+    gearman_worker_free(worker);
+    return NULL;
+  }
+
   return worker;
 }
 
 void gearman_worker_free(gearman_worker_st *worker)
 {
+  gearman_worker_batch_job_st *batch_job;
+
   if (worker->options & GEARMAN_WORKER_PACKET_INIT)
   {
     gearman_packet_free(&(worker->grab_job));
     gearman_packet_free(&(worker->pre_sleep));
+    gearman_packet_free(&(worker->set_slots));
   }
 
+  if (worker->options & GEARMAN_WORKER_ABANDON_IN_USE)
+    gearman_packet_free(&(worker->abandon));
+
   if (worker->job != NULL)
     gearman_job_free(worker->job);
 
   if (worker->options & GEARMAN_WORKER_WORK_JOB_IN_USE)
     gearman_job_free(&(worker->work_job));
 
+  _worker_batch_free(worker);
+
+  if (worker->batch_next != NULL)
+  {
+    gearman_job_free(&(worker->batch_next->job));
+    worker->batch_next->next= worker->batch_free;
+    worker->batch_free= worker->batch_next;
+  }
+
+  if (worker->batch_grab != NULL)
+  {
+    worker->batch_grab->next= worker->batch_free;
+    worker->batch_free= worker->batch_grab;
+  }
+
+  while (worker->batch_free != NULL)
+  {
+    batch_job= worker->batch_free;
+    worker->batch_free= batch_job->next;
+    if (batch_job->buffer.data != NULL)
+      free(batch_job->buffer.data);
+    free(batch_job);
+  }
+
+  if (worker->batch_list != NULL)
+    free(worker->batch_list);
+
+  if (worker->batch_job_list != NULL)
+    free(worker->batch_job_list);
+
   if (worker->work_result != NULL)
   {
     if (worker->gearman->workload_free == NULL)
@@ -136,9 +250,15 @@ void gearman_worker_free(gearman_worker_st *worker)
     }
   }
 
+  if (worker->result_buffer.data != NULL)
+    free(worker->result_buffer.data);
+
   while (worker->function_list != NULL)
     _worker_function_free(worker, worker->function_list);
 
+  if (worker->dispatch_hash != NULL)
+    free(worker->dispatch_hash);
+
   if (worker->gearman != NULL)
     gearman_free(worker->gearman);
 
@@ -163,7 +283,11 @@ void gearman_worker_set_options(gearman_worker_st *worker,
   if (options & GEARMAN_WORKER_NON_BLOCKING)
     gearman_set_options(worker->gearman, GEARMAN_NON_BLOCKING, data);
 
-  if (options & GEARMAN_WORKER_GRAB_UNIQ)
+  if (options & GEARMAN_WORKER_EPOLL)
+    gearman_set_options(worker->gearman, GEARMAN_EPOLL, data);
+
+  /* Jobs grabbed with GRAB_JOB_MULTI always include the unique ID. */
+  if (options & GEARMAN_WORKER_GRAB_UNIQ && worker->prefetch <= 1)
   {
     if (data)
       worker->grab_job.command= GEARMAN_COMMAND_GRAB_JOB_UNIQ;
@@ -179,6 +303,88 @@ void gearman_worker_set_options(gearman_worker_st *worker,
     worker->options &= ~options;
 }
 
+void gearman_worker_set_compression(gearman_worker_st *worker,
+                                    size_t threshold)
+{
+  gearman_set_compression(worker->gearman, threshold);
+}
+
+gearman_return_t gearman_worker_set_prefetch(gearman_worker_st *worker,
+                                             uint32_t prefetch)
+{
+  gearman_return_t ret;
+
+  if (prefetch > GEARMAN_GRAB_JOB_MULTI_MAX)
+    prefetch= GEARMAN_GRAB_JOB_MULTI_MAX;
+
+  gearman_packet_free(&(worker->grab_job));
+  worker->prefetch= prefetch;
+
+  ret= _worker_grab_job_init(worker);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    gearman_packet_free(&(worker->pre_sleep));
+    gearman_packet_free(&(worker->set_slots));
+    worker->options&= (gearman_worker_options_t)~GEARMAN_WORKER_PACKET_INIT;
+  }
+
+  return ret;
+}
+
+gearman_return_t gearman_worker_set_slots(gearman_worker_st *worker,
+                                          uint32_t slots)
+{
+  gearman_return_t ret;
+
+  if (slots > GEARMAN_GRAB_JOB_MULTI_MAX)
+    slots= GEARMAN_GRAB_JOB_MULTI_MAX;
+
+  gearman_packet_free(&(worker->set_slots));
+  worker->slots= slots;
+
+  ret= _worker_set_slots_init(worker);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    gearman_packet_free(&(worker->grab_job));
+    gearman_packet_free(&(worker->pre_sleep));
+    worker->options&= (gearman_worker_options_t)~GEARMAN_WORKER_PACKET_INIT;
+  }
+
+  return ret;
+}
+
+gearman_return_t
+gearman_worker_set_abandoned_fn(gearman_worker_st *worker,
+                                gearman_worker_abandoned_fn *function,
+                                void *fn_arg)
+{
+  gearman_return_t ret;
+
+  worker->abandoned_fn= function;
+  worker->abandoned_fn_arg= fn_arg;
+
+  if (function == NULL || worker->options & GEARMAN_WORKER_ABANDON_IN_USE)
+    return GEARMAN_SUCCESS;
+
+  ret= gearman_packet_add(worker->gearman, &(worker->abandon),
+                          GEARMAN_MAGIC_REQUEST, GEARMAN_COMMAND_OPTION_REQ,
+                          (uint8_t *)GEARMAN_ABANDON_OPTION,
+                          sizeof(GEARMAN_ABANDON_OPTION) - 1, NULL);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  worker->options|= GEARMAN_WORKER_ABANDON_IN_USE;
+
+  return GEARMAN_SUCCESS;
+}
+
+void gearman_worker_set_poll(gearman_worker_st *worker,
+                             gearman_worker_poll_t poll)
+{
+  worker->poll= poll;
+  worker->con_start= NULL;
+}
+
 void gearman_worker_set_workload_malloc(gearman_worker_st *worker,
                                         gearman_malloc_fn *workload_malloc,
                                         const void *workload_malloc_arg)
@@ -213,7 +419,8 @@ gearman_return_t gearman_worker_register(gearman_worker_st *worker,
                                          const char *function_name,
                                          uint32_t timeout)
 {
-  return _worker_function_add(worker, function_name, timeout, NULL, NULL);
+  return _worker_function_add(worker, function_name, timeout, NULL, NULL,
+                              NULL);
 }
 
 gearman_return_t gearman_worker_unregister(gearman_worker_st *worker,
@@ -222,13 +429,7 @@ gearman_return_t gearman_worker_unregister(gearman_worker_st *worker,
   gearman_worker_function_st *function;
   gearman_return_t ret;
 
-  for (function= worker->function_list; function != NULL;
-       function= function->next)
-  {
-    if (!strcmp(function_name, function->function_name))
-      break;
-  }
-
+  function= gearman_worker_function_find(worker, function_name);
   if (function == NULL)
     return GEARMAN_SUCCESS;
 
@@ -289,6 +490,7 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
 {
   gearman_worker_function_st *function;
   uint32_t active;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
 
   while (1)
   {
@@ -344,6 +546,9 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
           }
         }
 
+        /* Servers only wake a sleeping worker for new jobs, so ones already
+           queued for a new function need asking for. */
+        _worker_wake_all(worker);
         worker->options&= (gearman_worker_options_t)~GEARMAN_WORKER_CHANGE;
       }
 
@@ -355,12 +560,25 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
         return NULL;
       }
 
-      for (worker->con= worker->gearman->con_list; worker->con != NULL;
-           worker->con= worker->con->next)
+      for (worker->con= _worker_con_first(worker); worker->con != NULL;
+           worker->con= _worker_con_next(worker, worker->con))
       {
-        /* If the connection to the job server is not active, start it. */
+        /* A server that was sent PRE_SLEEP has nothing for us until it
+           wakes us with a NOOP, so only the ones that did are asked. */
+        if (worker->con->options & GEARMAN_CON_SLEEPING)
+          continue;
+
+        /* Each time around is a new turn for the connection. */
+        worker->con->grab_count= 0;
+        worker->con->grab_deficit= worker->con->grab_quantum;
+
+        /* If the connection to the job server is not active, start it,
+           unless it has been failing and isn't due to be tried again. */
         if (worker->con->fd == -1)
         {
+          if (!gearman_con_health_ready(worker->con))
+            continue;
+
           for (worker->function= worker->function_list;
                worker->function != NULL;
                worker->function= worker->function->next)
@@ -382,38 +600,105 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
             }
           }
 
-          if (*ret_ptr == GEARMAN_COULD_NOT_CONNECT)
-            continue;
+          if (*ret_ptr == GEARMAN_COULD_NOT_CONNECT ||
+              *ret_ptr == GEARMAN_LOST_CONNECTION)
+          {
+            gearman_con_health_fail(worker->con);
+            if (*ret_ptr == GEARMAN_COULD_NOT_CONNECT)
+              continue;
+          }
         }
 
     case GEARMAN_WORKER_STATE_GRAB_JOB_SEND:
         if (worker->con->fd == -1)
           continue;
 
-        *ret_ptr= gearman_con_send(worker->con, &(worker->grab_job), true);
-        if (*ret_ptr != GEARMAN_SUCCESS)
+        /* Let the server know the slots changed before asking for work. */
+        if (worker->con->slots != worker->slots)
         {
-          if (*ret_ptr == GEARMAN_IO_WAIT)
-            worker->state= GEARMAN_WORKER_STATE_GRAB_JOB_SEND;
-          else if (*ret_ptr == GEARMAN_LOST_CONNECTION)
-            continue;
+          *ret_ptr= gearman_con_send(worker->con, &(worker->set_slots), true);
+          if (*ret_ptr != GEARMAN_SUCCESS)
+          {
+            if (*ret_ptr == GEARMAN_IO_WAIT)
+              worker->state= GEARMAN_WORKER_STATE_GRAB_JOB_SEND;
+            else if (*ret_ptr == GEARMAN_LOST_CONNECTION)
+            {
+              gearman_con_health_fail(worker->con);
+              continue;
+            }
 
-          return NULL;
+            return NULL;
+          }
+
+          worker->con->slots= worker->slots;
         }
 
-        if (worker->job == NULL)
+        /* Ask once per connection to be told about abandoned jobs. */
+        if (worker->abandoned_fn != NULL &&
+            !(worker->con->options & GEARMAN_CON_ABANDON))
         {
-          worker->job= gearman_job_create(worker->gearman, job);
-          if (worker->job == NULL)
+          *ret_ptr= gearman_con_send(worker->con, &(worker->abandon), true);
+          if (*ret_ptr != GEARMAN_SUCCESS)
           {
-            *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+            if (*ret_ptr == GEARMAN_IO_WAIT)
+              worker->state= GEARMAN_WORKER_STATE_GRAB_JOB_SEND;
+            else if (*ret_ptr == GEARMAN_LOST_CONNECTION)
+            {
+              gearman_con_health_fail(worker->con);
+              continue;
+            }
+
             return NULL;
           }
+
+          worker->con->options|= GEARMAN_CON_ABANDON;
+        }
+
+        if (worker->con->slots > 0)
+        {
+          /* The server pushes jobs as slots free up, so there is nothing to
+             ask for, only what it already sent to read. */
+          if (!_worker_con_pending(worker->con))
+          {
+            worker->con->options|= GEARMAN_CON_SLEEPING;
+            continue;
+          }
+        }
+        else
+        {
+          *ret_ptr= gearman_con_send(worker->con, &(worker->grab_job), true);
+          if (*ret_ptr != GEARMAN_SUCCESS)
+          {
+            if (*ret_ptr == GEARMAN_IO_WAIT)
+              worker->state= GEARMAN_WORKER_STATE_GRAB_JOB_SEND;
+            else if (*ret_ptr == GEARMAN_LOST_CONNECTION)
+            {
+              gearman_con_health_fail(worker->con);
+              continue;
+            }
+
+            return NULL;
+          }
+
+          /* A GRAB_JOB_MULTI reply is complete after this many jobs, or at
+             the first NO_JOB. */
+          if (worker->prefetch > 1)
+            worker->prefetch_pending= worker->prefetch;
         }
 
         while (1)
         {
     case GEARMAN_WORKER_STATE_GRAB_JOB_RECV:
+          if (worker->job == NULL)
+          {
+            worker->job= gearman_job_create(worker->gearman, job);
+            if (worker->job == NULL)
+            {
+              *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+              return NULL;
+            }
+          }
+
           (void)gearman_con_recv(worker->con, &(worker->job->assigned), ret_ptr,
                                  true);
           if (*ret_ptr != GEARMAN_SUCCESS)
@@ -424,20 +709,49 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
             {
               gearman_job_free(worker->job);
               worker->job= NULL;
+              worker->prefetch_pending= 0;
 
               if (*ret_ptr == GEARMAN_LOST_CONNECTION)
+              {
+                gearman_con_health_fail(worker->con);
                 break;
+              }
             }
 
             return NULL;
           }
 
+          if (worker->con->error_count != 0)
+            gearman_con_health_ok(worker->con, 0);
+
           if (worker->job->assigned.command == GEARMAN_COMMAND_JOB_ASSIGN ||
               worker->job->assigned.command == GEARMAN_COMMAND_JOB_ASSIGN_UNIQ)
           {
             worker->job->options|= GEARMAN_JOB_ASSIGNED_IN_USE;
             worker->job->con= worker->con;
-            worker->state= GEARMAN_WORKER_STATE_GRAB_JOB_SEND;
+            worker->con->grab_count++;
+            if (worker->con->grab_deficit > 0)
+              worker->con->grab_deficit--;
+            worker->con_last= worker->con;
+
+            /* Prefetched jobs are already waiting on this connection, so
+               receive the next one without asking again. Pushed jobs are
+               read for as long as the connection has more. */
+            if (worker->con->slots > 0)
+            {
+              if (worker->con->recv_buffer_size == 0)
+                worker->con->revents&= (short)~POLLIN;
+              worker->state= GEARMAN_WORKER_STATE_GRAB_JOB_SEND;
+            }
+            else
+            {
+              if (worker->prefetch_pending > 0)
+                worker->prefetch_pending--;
+              if (worker->prefetch_pending > 0)
+                worker->state= GEARMAN_WORKER_STATE_GRAB_JOB_RECV;
+              else
+                _worker_grab_next(worker);
+            }
             job= worker->job;
             worker->job= NULL;
             return job;
@@ -445,11 +759,28 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
 
           if (worker->job->assigned.command == GEARMAN_COMMAND_NO_JOB)
           {
+            /* The server ran out before the turn did, so what it gave is
+               about what it has to give next time. */
+            worker->con->grab_quantum= worker->con->grab_count == 0 ?
+                                       1 : worker->con->grab_count;
+            worker->prefetch_pending= 0;
             gearman_packet_free(&(worker->job->assigned));
             break;
           }
 
-          if (worker->job->assigned.command != GEARMAN_COMMAND_NOOP)
+          if (worker->job->assigned.command == GEARMAN_COMMAND_JOB_ABANDONED)
+          {
+            if (worker->abandoned_fn != NULL)
+            {
+              snprintf(job_handle, GEARMAN_JOB_HANDLE_SIZE, "%.*s",
+                       (uint32_t)(worker->job->assigned.arg_size[0]),
+                       (char *)(worker->job->assigned.arg[0]));
+              worker->abandoned_fn(job_handle, worker->abandoned_fn_arg);
+            }
+          }
+          else if (worker->job->assigned.command !=
+                   GEARMAN_COMMAND_OPTION_RES &&
+                   worker->job->assigned.command != GEARMAN_COMMAND_NOOP)
           {
             GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_grab_job",
                               "unexpected packet:%s",
@@ -457,11 +788,25 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
             gearman_packet_free(&(worker->job->assigned));
             gearman_job_free(worker->job);
             worker->job= NULL;
+            worker->prefetch_pending= 0;
             *ret_ptr= GEARMAN_UNEXPECTED_PACKET;
             return NULL;
           }
 
           gearman_packet_free(&(worker->job->assigned));
+
+          /* Don't block reading a connection in slot mode that has nothing
+             more, since no reply to a request is coming. */
+          if (worker->con->slots > 0)
+          {
+            if (worker->con->recv_buffer_size == 0)
+              worker->con->revents&= (short)~POLLIN;
+            if (!_worker_con_pending(worker->con))
+            {
+              worker->con->options|= GEARMAN_CON_SLEEPING;
+              break;
+            }
+          }
         }
       }
 
@@ -469,8 +814,19 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
       for (worker->con= worker->gearman->con_list; worker->con != NULL;
            worker->con= worker->con->next)
       {
-        if (worker->con->fd == -1)
+        if (worker->con->fd == -1 ||
+            worker->con->options & GEARMAN_CON_SLEEPING)
+        {
           continue;
+        }
+
+        /* A server pushing jobs never put us to sleep, so just wait for it
+           to send one. */
+        if (worker->con->slots > 0)
+        {
+          worker->con->options|= GEARMAN_CON_SLEEPING;
+          continue;
+        }
 
         *ret_ptr= gearman_con_send(worker->con, &(worker->pre_sleep), true);
         if (*ret_ptr != GEARMAN_SUCCESS)
@@ -482,6 +838,8 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
 
           return NULL;
         }
+
+        worker->con->options|= GEARMAN_CON_SLEEPING;
       }
 
       worker->state= GEARMAN_WORKER_STATE_START;
@@ -515,6 +873,20 @@ gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
                                    GEARMAN_WORKER_WAIT_TIMEOUT);
         if (*ret_ptr != GEARMAN_SUCCESS)
           return NULL;
+
+        /* Fall back to asking every server if none woke us in time. */
+        for (worker->con= worker->gearman->con_list; worker->con != NULL;
+             worker->con= worker->con->next)
+        {
+          if (worker->con->fd != -1 &&
+              !(worker->con->options & GEARMAN_CON_SLEEPING))
+          {
+            break;
+          }
+        }
+
+        if (worker->con == NULL)
+          _worker_wake_all(worker);
       }
 
       break;
@@ -548,14 +920,121 @@ gearman_return_t gearman_worker_add_function(gearman_worker_st *worker,
     return GEARMAN_INVALID_WORKER_FUNCTION;
   }
 
-  return _worker_function_add(worker, function_name, timeout, worker_fn,
+  return _worker_function_add(worker, function_name, timeout, worker_fn, NULL,
                               fn_arg);
 }
 
+gearman_return_t
+gearman_worker_add_function_buffer(gearman_worker_st *worker,
+                                   const char *function_name,
+                                   uint32_t timeout,
+                                   gearman_worker_buffer_fn *buffer_fn,
+                                   const void *fn_arg)
+{
+  if (function_name == NULL)
+  {
+    GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_add_function_buffer",
+                      "function name not given")
+    return GEARMAN_INVALID_FUNCTION_NAME;
+  }
+
+  if (buffer_fn == NULL)
+  {
+    GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_add_function_buffer",
+                      "function not given")
+    return GEARMAN_INVALID_WORKER_FUNCTION;
+  }
+
+  return _worker_function_add(worker, function_name, timeout, NULL, buffer_fn,
+                              fn_arg);
+}
+
+gearman_return_t
+gearman_worker_add_batch_function(gearman_worker_st *worker,
+                                  const char *function_name,
+                                  uint32_t timeout,
+                                  uint32_t batch_size,
+                                  uint32_t batch_wait,
+                                  gearman_worker_batch_fn *batch_fn,
+                                  const void *fn_arg)
+{
+  gearman_worker_batch_job_st **batch_list;
+  gearman_job_st **batch_job_list;
+  gearman_return_t ret;
+
+  if (function_name == NULL)
+  {
+    GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_add_batch_function",
+                      "function name not given")
+    return GEARMAN_INVALID_FUNCTION_NAME;
+  }
+
+  if (batch_fn == NULL)
+  {
+    GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_add_batch_function",
+                      "function not given")
+    return GEARMAN_INVALID_WORKER_FUNCTION;
+  }
+
+  if (batch_size == 0)
+    batch_size= 1;
+  else if (batch_size > GEARMAN_GRAB_JOB_MULTI_MAX)
+    batch_size= GEARMAN_GRAB_JOB_MULTI_MAX;
+
+  /* The batch lists are shared by all functions, so they are sized for the
+     largest batch. */
+  if (batch_size > worker->batch_max)
+  {
+    batch_list= realloc(worker->batch_list,
+                        sizeof(gearman_worker_batch_job_st *) * batch_size);
+    if (batch_list == NULL)
+    {
+      GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_add_batch_function",
+                        "realloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    worker->batch_list= batch_list;
+
+    batch_job_list= realloc(worker->batch_job_list,
+                            sizeof(gearman_job_st *) * batch_size);
+    if (batch_job_list == NULL)
+    {
+      GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_add_batch_function",
+                        "realloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+
+    worker->batch_job_list= batch_job_list;
+    worker->batch_max= batch_size;
+  }
+
+  ret= _worker_function_add(worker, function_name, timeout, NULL, NULL,
+                            fn_arg);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  /* New functions go on the front of the list. */
+  worker->function_list->batch_fn= batch_fn;
+  worker->function_list->batch_size= batch_size;
+  worker->function_list->batch_wait= batch_wait;
+
+  return GEARMAN_SUCCESS;
+}
+
 gearman_return_t gearman_worker_work(gearman_worker_st *worker)
 {
   gearman_return_t ret;
 
+  /* Once a worker has batch functions, every job goes through the batch
+     path, but a job already started here is finished here first. */
+  if (worker->work_state >= GEARMAN_WORKER_WORK_STATE_BATCH_GRAB ||
+      (worker->batch_max > 0 &&
+       worker->work_state == GEARMAN_WORKER_WORK_STATE_GRAB_JOB))
+  {
+    return _worker_work_batch(worker);
+  }
+
   switch (worker->work_state)
   {
   case GEARMAN_WORKER_WORK_STATE_GRAB_JOB:
@@ -563,16 +1042,8 @@ gearman_return_t gearman_worker_work(gearman_worker_st *worker)
     if (ret != GEARMAN_SUCCESS)
       return ret;
 
-    for (worker->work_function= worker->function_list;
-         worker->work_function != NULL;
-         worker->work_function= worker->work_function->next)
-    {
-      if (!strcmp(gearman_job_function_name(&(worker->work_job)),
-                  worker->work_function->function_name))
-      {
-        break;
-      }
-    }
+    worker->work_function= gearman_worker_function_find(worker,
+                                  gearman_job_function_name(&(worker->work_job)));
 
     if (worker->work_function == NULL)
     {
@@ -582,7 +1053,8 @@ gearman_return_t gearman_worker_work(gearman_worker_st *worker)
       return GEARMAN_INVALID_FUNCTION_NAME;
     }
 
-    if (worker->work_function->worker_fn == NULL)
+    if (worker->work_function->worker_fn == NULL &&
+        worker->work_function->buffer_fn == NULL)
     {
       gearman_job_free(&(worker->work_job));
       GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_work",
@@ -594,10 +1066,21 @@ gearman_return_t gearman_worker_work(gearman_worker_st *worker)
     worker->work_result_size= 0;
 
   case GEARMAN_WORKER_WORK_STATE_FUNCTION:
-    worker->work_result= (*(worker->work_function->worker_fn))(
-                         &(worker->work_job),
-                         (void *)(worker->work_function->fn_arg),
-                         &(worker->work_result_size), &ret);
+    if (worker->work_function->buffer_fn == NULL)
+    {
+      worker->work_result= (*(worker->work_function->worker_fn))(
+                           &(worker->work_job),
+                           (void *)(worker->work_function->fn_arg),
+                           &(worker->work_result_size), &ret);
+    }
+    else
+    {
+      /* The result is left in the job, either in the worker's result buffer
+         or in memory the function owns, and is sent from there. */
+      worker->work_job.buffer= &(worker->result_buffer);
+      ret= (*(worker->work_function->buffer_fn))(&(worker->work_job),
+                                    (void *)(worker->work_function->fn_arg));
+    }
     if (ret == GEARMAN_WORK_FAIL)
     {
       ret= gearman_job_fail(&(worker->work_job));
@@ -623,8 +1106,17 @@ gearman_return_t gearman_worker_work(gearman_worker_st *worker)
     }
 
   case GEARMAN_WORKER_WORK_STATE_COMPLETE:
-    ret= gearman_job_complete(&(worker->work_job), worker->work_result,
-                              worker->work_result_size);
+    if (worker->work_function->buffer_fn == NULL)
+    {
+      ret= gearman_job_complete(&(worker->work_job), worker->work_result,
+                                worker->work_result_size);
+    }
+    else
+    {
+      ret= gearman_job_complete(&(worker->work_job),
+                                (void *)(worker->work_job.result),
+                                worker->work_job.result_size);
+    }
     if (ret == GEARMAN_IO_WAIT)
     {
       worker->work_state= GEARMAN_WORKER_WORK_STATE_COMPLETE;
@@ -665,6 +1157,10 @@ gearman_return_t gearman_worker_work(gearman_worker_st *worker)
 
    break;
 
+  /* Batch states are handled by _worker_work_batch. */
+  case GEARMAN_WORKER_WORK_STATE_BATCH_GRAB:
+  case GEARMAN_WORKER_WORK_STATE_BATCH_FUNCTION:
+  case GEARMAN_WORKER_WORK_STATE_BATCH_COMPLETE:
   default:
     GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_work",
                       "unknown state: %u", worker->work_state)
@@ -677,6 +1173,34 @@ gearman_return_t gearman_worker_work(gearman_worker_st *worker)
   return GEARMAN_SUCCESS;
 }
 
+gearman_worker_function_st *
+gearman_worker_function_find(gearman_worker_st *worker,
+                             const char *function_name)
+{
+  gearman_worker_function_st *function;
+  size_t function_name_size;
+  uint32_t key;
+
+  if (worker->dispatch_hash == NULL)
+    return NULL;
+
+  function_name_size= strlen(function_name);
+  key= gearman_server_hash(function_name, function_name_size);
+
+  for (function= worker->dispatch_hash[key % worker->dispatch_hash_size];
+       function != NULL; function= function->dispatch_next)
+  {
+    if (function->dispatch_key == key &&
+        function->function_name_size == function_name_size &&
+        !memcmp(function->function_name, function_name, function_name_size))
+    {
+      return function;
+    }
+  }
+
+  return NULL;
+}
+
 gearman_return_t gearman_worker_echo(gearman_worker_st *worker,
                                      const void *workload,
                                      size_t workload_size)
@@ -703,15 +1227,38 @@ static gearman_worker_st *_worker_allocate(gearman_worker_st *worker)
 
   worker->state= 0;
   worker->work_state= 0;
+  worker->poll= GEARMAN_WORKER_POLL_ORDER;
   worker->function_count= 0;
+  worker->dispatch_count= 0;
+  worker->dispatch_hash_size= 0;
+  worker->prefetch= 0;
+  worker->prefetch_pending= 0;
+  worker->slots= 0;
   worker->work_result_size= 0;
   worker->gearman= NULL;
   worker->con= NULL;
+  worker->con_start= NULL;
+  worker->con_last= NULL;
   worker->job= NULL;
   worker->function= NULL;
   worker->function_list= NULL;
+  worker->dispatch_hash= NULL;
   worker->work_function= NULL;
   worker->work_result= NULL;
+  worker->abandoned_fn= NULL;
+  worker->abandoned_fn_arg= NULL;
+  worker->result_buffer.size= 0;
+  worker->result_buffer.data= NULL;
+  worker->batch_max= 0;
+  worker->batch_count= 0;
+  worker->batch_index= 0;
+  worker->batch_ret= GEARMAN_SUCCESS;
+  worker->batch_deadline= 0;
+  worker->batch_free= NULL;
+  worker->batch_grab= NULL;
+  worker->batch_next= NULL;
+  worker->batch_list= NULL;
+  worker->batch_job_list= NULL;
 
   return worker;
 }
@@ -720,9 +1267,7 @@ static gearman_return_t _worker_packet_init(gearman_worker_st *worker)
 {
   gearman_return_t ret;
 
-  ret= gearman_packet_add(worker->gearman, &(worker->grab_job),
-                          GEARMAN_MAGIC_REQUEST, GEARMAN_COMMAND_GRAB_JOB,
-                          NULL);
+  ret= _worker_grab_job_init(worker);
   if (ret != GEARMAN_SUCCESS)
     return ret;
 
@@ -735,12 +1280,58 @@ static gearman_return_t _worker_packet_init(gearman_worker_st *worker)
     return ret;
   }
 
+  ret= _worker_set_slots_init(worker);
+  if (ret != GEARMAN_SUCCESS)
+  {
+    gearman_packet_free(&(worker->grab_job));
+    gearman_packet_free(&(worker->pre_sleep));
+    return ret;
+  }
+
   worker->options|= GEARMAN_WORKER_PACKET_INIT;
 
   return GEARMAN_SUCCESS;
 }
 
+static gearman_return_t _worker_grab_job_init(gearman_worker_st *worker)
+{
+  char count[11];
+
+  if (worker->prefetch > 1)
+  {
+    snprintf(count, sizeof(count), "%u", worker->prefetch);
+    return gearman_packet_add(worker->gearman, &(worker->grab_job),
+                              GEARMAN_MAGIC_REQUEST,
+                              GEARMAN_COMMAND_GRAB_JOB_MULTI,
+                              (uint8_t *)count, strlen(count), NULL);
+  }
+
+  return gearman_packet_add(worker->gearman, &(worker->grab_job),
+                            GEARMAN_MAGIC_REQUEST,
+                            worker->options & GEARMAN_WORKER_GRAB_UNIQ ?
+                            GEARMAN_COMMAND_GRAB_JOB_UNIQ :
+                            GEARMAN_COMMAND_GRAB_JOB, NULL);
+}
+
+static gearman_return_t _worker_set_slots_init(gearman_worker_st *worker)
+{
+  char count[11];
+
+  snprintf(count, sizeof(count), "%u", worker->slots);
+  return gearman_packet_add(worker->gearman, &(worker->set_slots),
+                            GEARMAN_MAGIC_REQUEST, GEARMAN_COMMAND_SET_SLOTS,
+                            (uint8_t *)count, strlen(count), NULL);
+}
+
+static bool _worker_con_pending(gearman_con_st *con)
+{
+  return con->revents & POLLIN || con->recv_buffer_size > 0 ||
+         con->recv_state != GEARMAN_CON_RECV_STATE_NONE;
+}
+
 static gearman_return_t _worker_add_server(const char *host, in_port_t port,
+                                           uint32_t weight
+                                           __attribute__ ((unused)),
                                            void *data)
 {
   return gearman_worker_add_server((gearman_worker_st *)data, host, port);
@@ -750,12 +1341,25 @@ static gearman_return_t _worker_function_add(gearman_worker_st *worker,
                                              const char *function_name,
                                              uint32_t timeout,
                                              gearman_worker_fn *worker_fn,
+                                             gearman_worker_buffer_fn *buffer_fn,
                                              const void *fn_arg)
 {
   gearman_worker_function_st *function;
   gearman_return_t ret;
   char timeout_buffer[11];
 
+  /* A function that can't be found by name could never run, so the hash has
+     to exist before one is added. Failing to grow it only makes the chains
+     longer. */
+  if (worker->dispatch_count >= worker->dispatch_hash_size)
+  {
+    ret= _worker_function_hash_resize(worker, worker->dispatch_hash_size == 0 ?
+                                      GEARMAN_WORKER_FUNCTION_HASH_SIZE :
+                                      (worker->dispatch_hash_size << 1) + 1);
+    if (ret != GEARMAN_SUCCESS && worker->dispatch_hash == NULL)
+      return ret;
+  }
+
   function= malloc(sizeof(gearman_worker_function_st));
   if (function == NULL)
   {
@@ -774,7 +1378,14 @@ static gearman_return_t _worker_function_add(gearman_worker_st *worker,
     return GEARMAN_MEMORY_ALLOCATION_FAILURE;
   }
 
+  function->function_name_size= strlen(function_name);
+  function->dispatch_key= gearman_server_hash(function_name,
+                                              function->function_name_size);
   function->worker_fn= worker_fn;
+  function->buffer_fn= buffer_fn;
+  function->batch_fn= NULL;
+  function->batch_size= 1;
+  function->batch_wait= 0;
   function->fn_arg= fn_arg;
 
   if (timeout > 0)
@@ -803,16 +1414,59 @@ static gearman_return_t _worker_function_add(gearman_worker_st *worker,
   }
 
   GEARMAN_LIST_ADD(worker->function, function,)
+  GEARMAN_HASH_ADD(worker->dispatch,
+                   function->dispatch_key % worker->dispatch_hash_size,
+                   function, dispatch_)
 
   worker->options|= GEARMAN_WORKER_CHANGE;
 
   return GEARMAN_SUCCESS;
 }
 
+static gearman_return_t _worker_function_hash_resize(gearman_worker_st *worker,
+                                                     uint32_t size)
+{
+  gearman_worker_function_st **dispatch_hash;
+  gearman_worker_function_st *function;
+  gearman_worker_function_st *next;
+  uint32_t key;
+  uint32_t x;
+
+  dispatch_hash= calloc(size, sizeof(gearman_worker_function_st *));
+  if (dispatch_hash == NULL)
+  {
+    GEARMAN_ERROR_SET(worker->gearman, "_worker_function_hash_resize",
+                      "calloc")
+    return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+  }
+
+  for (x= 0; x < worker->dispatch_hash_size; x++)
+  {
+    for (function= worker->dispatch_hash[x]; function != NULL;
+         function= next)
+    {
+      next= function->dispatch_next;
+      key= function->dispatch_key % size;
+      GEARMAN_BUCKET_ADD(dispatch_hash[key], function, dispatch_)
+    }
+  }
+
+  if (worker->dispatch_hash != NULL)
+    free(worker->dispatch_hash);
+
+  worker->dispatch_hash= dispatch_hash;
+  worker->dispatch_hash_size= size;
+
+  return GEARMAN_SUCCESS;
+}
+
 static void _worker_function_free(gearman_worker_st *worker,
                                   gearman_worker_function_st *function)
 {
   GEARMAN_LIST_DEL(worker->function, function,)
+  GEARMAN_HASH_DEL(worker->dispatch,
+                   function->dispatch_key % worker->dispatch_hash_size,
+                   function, dispatch_)
 
   if (function->options & GEARMAN_WORKER_FUNCTION_PACKET_IN_USE)
     gearman_packet_free(&(function->packet));
@@ -820,3 +1474,329 @@ static void _worker_function_free(gearman_worker_st *worker,
   free(function->function_name);
   free(function);
 }
+
+static gearman_con_st *_worker_con_first(gearman_worker_st *worker)
+{
+  switch (worker->poll)
+  {
+  case GEARMAN_WORKER_POLL_ROUND_ROBIN:
+  case GEARMAN_WORKER_POLL_DEFICIT:
+    if (worker->con_start == NULL)
+      worker->con_start= worker->gearman->con_list;
+    break;
+
+  case GEARMAN_WORKER_POLL_LAST_WORK:
+    if (worker->con_last == NULL)
+      worker->con_start= worker->gearman->con_list;
+    else
+      worker->con_start= worker->con_last;
+    break;
+
+  case GEARMAN_WORKER_POLL_ORDER:
+  default:
+    worker->con_start= worker->gearman->con_list;
+    break;
+  }
+
+  return worker->con_start;
+}
+
+static gearman_con_st *_worker_con_next(gearman_worker_st *worker,
+                                        gearman_con_st *con)
+{
+  con= con->next == NULL ? worker->gearman->con_list : con->next;
+  return con == worker->con_start ? NULL : con;
+}
+
+static void _worker_grab_next(gearman_worker_st *worker)
+{
+  gearman_con_st *con= worker->con;
+
+  if (worker->poll == GEARMAN_WORKER_POLL_DEFICIT && con->grab_deficit == 0)
+  {
+    /* Every job the turn allowed was there, so the server may well have more
+       queued than it gets credit for. */
+    con->grab_quantum*= 2;
+    if (con->grab_quantum > GEARMAN_WORKER_QUANTUM_MAX)
+      con->grab_quantum= GEARMAN_WORKER_QUANTUM_MAX;
+  }
+  else if (worker->poll != GEARMAN_WORKER_POLL_ROUND_ROBIN)
+  {
+    worker->state= GEARMAN_WORKER_STATE_GRAB_JOB_SEND;
+    return;
+  }
+
+  /* Move on to the next server, which starts a new pass over all of them
+     from there. */
+  worker->con_start= con->next == NULL ? worker->gearman->con_list : con->next;
+  worker->state= GEARMAN_WORKER_STATE_START;
+}
+
+static void _worker_wake_all(gearman_worker_st *worker)
+{
+  gearman_con_st *con;
+
+  for (con= worker->gearman->con_list; con != NULL; con= con->next)
+    con->options&= (gearman_con_options_t)~GEARMAN_CON_SLEEPING;
+}
+
+static gearman_return_t _worker_work_batch(gearman_worker_st *worker)
+{
+  gearman_worker_batch_job_st *batch_job;
+  gearman_worker_function_st *function;
+  gearman_job_st *job;
+  gearman_return_t ret;
+  gearman_return_t first_ret;
+  bool non_blocking;
+  size_t result_size;
+  uint64_t now;
+  void *result;
+  uint32_t x;
+
+  switch (worker->work_state)
+  {
+  case GEARMAN_WORKER_WORK_STATE_GRAB_JOB:
+    if (worker->batch_next == NULL)
+    {
+      batch_job= _worker_batch_grab(worker, &ret);
+      if (batch_job == NULL)
+        return ret;
+    }
+    else
+    {
+      batch_job= worker->batch_next;
+      worker->batch_next= NULL;
+    }
+
+    worker->batch_list[0]= batch_job;
+    worker->batch_count= 1;
+
+    /* This is looked up again for a job held over from the last batch,
+       since the function may have been removed since. */
+    worker->work_function= gearman_worker_function_find(worker,
+                                  gearman_job_function_name(&(batch_job->job)));
+
+    if (worker->work_function == NULL)
+    {
+      _worker_batch_free(worker);
+      GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_work",
+                        "function not found")
+      return GEARMAN_INVALID_FUNCTION_NAME;
+    }
+
+    if (worker->work_function->worker_fn == NULL &&
+        worker->work_function->buffer_fn == NULL &&
+        worker->work_function->batch_fn == NULL)
+    {
+      _worker_batch_free(worker);
+      GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_work",
+                        "no callback function supplied")
+      return GEARMAN_INVALID_FUNCTION_NAME;
+    }
+
+    worker->batch_deadline= gearman_time_now() +
+                            ((uint64_t)(worker->work_function->batch_wait) *
+                             1000);
+    worker->work_state= GEARMAN_WORKER_WORK_STATE_BATCH_GRAB;
+
+  case GEARMAN_WORKER_WORK_STATE_BATCH_GRAB:
+    function= worker->work_function;
+    non_blocking= worker->gearman->options & GEARMAN_NON_BLOCKING;
+
+    /* Take jobs for the same function while they are already here or arrive
+       before the wait is up. Grabs are done without blocking so the wait can
+       be bounded here instead. */
+    while (function->batch_fn != NULL &&
+           worker->batch_count < function->batch_size)
+    {
+      worker->gearman->options|= GEARMAN_NON_BLOCKING;
+      batch_job= _worker_batch_grab(worker, &ret);
+      if (!non_blocking)
+      {
+        worker->gearman->options&=
+          (gearman_options_t)~GEARMAN_NON_BLOCKING;
+      }
+
+      if (batch_job == NULL)
+      {
+        /* Any other error is left for the next grab to return. */
+        if (non_blocking || (ret != GEARMAN_IO_WAIT && ret != GEARMAN_NO_JOBS))
+          break;
+
+        now= gearman_time_now();
+        if (now >= worker->batch_deadline)
+          break;
+
+        ret= gearman_con_wait(worker->gearman,
+                              (int)((worker->batch_deadline - now + 999) /
+                                    1000));
+        if (ret != GEARMAN_SUCCESS)
+          break;
+
+        continue;
+      }
+
+      if (gearman_worker_function_find(worker,
+                    gearman_job_function_name(&(batch_job->job))) != function)
+      {
+        worker->batch_next= batch_job;
+        break;
+      }
+
+      worker->batch_list[worker->batch_count]= batch_job;
+      worker->batch_count++;
+    }
+
+  case GEARMAN_WORKER_WORK_STATE_BATCH_FUNCTION:
+    function= worker->work_function;
+    job= &(worker->batch_list[0]->job);
+
+    if (function->batch_fn != NULL)
+    {
+      for (x= 0; x < worker->batch_count; x++)
+        worker->batch_job_list[x]= &(worker->batch_list[x]->job);
+
+      ret= (*(function->batch_fn))(worker->batch_job_list,
+                                   worker->batch_count,
+                                   (void *)(function->fn_arg));
+    }
+    else if (function->buffer_fn != NULL)
+      ret= (*(function->buffer_fn))(job, (void *)(function->fn_arg));
+    else
+    {
+      result_size= 0;
+      result= (*(function->worker_fn))(job, (void *)(function->fn_arg),
+                                       &result_size, &ret);
+      if (result != NULL)
+      {
+        gearman_job_set_result(job, result, result_size, _worker_result_free,
+                               worker->gearman);
+      }
+    }
+
+    if (ret != GEARMAN_SUCCESS && ret != GEARMAN_WORK_FAIL)
+    {
+      if (ret == GEARMAN_LOST_CONNECTION)
+      {
+        _worker_batch_free(worker);
+        worker->work_state= GEARMAN_WORKER_WORK_STATE_GRAB_JOB;
+        return GEARMAN_SUCCESS;
+      }
+
+      worker->work_state= GEARMAN_WORKER_WORK_STATE_BATCH_FUNCTION;
+      return ret;
+    }
+
+    worker->batch_ret= ret;
+    worker->batch_index= 0;
+
+  case GEARMAN_WORKER_WORK_STATE_BATCH_COMPLETE:
+    /* Jobs the function already finished itself are skipped by
+       gearman_job_complete and gearman_job_fail. */
+    first_ret= GEARMAN_SUCCESS;
+    for (; worker->batch_index < worker->batch_count; worker->batch_index++)
+    {
+      job= &(worker->batch_list[worker->batch_index]->job);
+
+      if (worker->batch_ret == GEARMAN_WORK_FAIL)
+        ret= gearman_job_fail(job);
+      else
+        ret= gearman_job_complete(job, (void *)(job->result), job->result_size);
+
+      if (ret == GEARMAN_IO_WAIT)
+      {
+        worker->work_state= GEARMAN_WORKER_WORK_STATE_BATCH_COMPLETE;
+        return ret;
+      }
+
+      if (ret != GEARMAN_SUCCESS && ret != GEARMAN_LOST_CONNECTION &&
+          first_ret == GEARMAN_SUCCESS)
+      {
+        first_ret= ret;
+      }
+    }
+
+    _worker_batch_free(worker);
+    worker->work_state= GEARMAN_WORKER_WORK_STATE_GRAB_JOB;
+    return first_ret;
+
+  /* A job started outside a batch is finished by gearman_worker_work. */
+  case GEARMAN_WORKER_WORK_STATE_FUNCTION:
+  case GEARMAN_WORKER_WORK_STATE_COMPLETE:
+  case GEARMAN_WORKER_WORK_STATE_FAIL:
+  default:
+    GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_work",
+                      "unknown state: %u", worker->work_state)
+    return GEARMAN_UNKNOWN_STATE;
+  }
+}
+
+static gearman_worker_batch_job_st *
+_worker_batch_grab(gearman_worker_st *worker, gearman_return_t *ret_ptr)
+{
+  gearman_worker_batch_job_st *batch_job;
+
+  /* The worker keeps using the same job structure until it hands it back
+     with a job in it, so the structure is held here until then. */
+  if (worker->batch_grab == NULL)
+  {
+    if (worker->batch_free == NULL)
+    {
+      batch_job= malloc(sizeof(gearman_worker_batch_job_st));
+      if (batch_job == NULL)
+      {
+        GEARMAN_ERROR_SET(worker->gearman, "_worker_batch_grab", "malloc")
+        *ret_ptr= GEARMAN_MEMORY_ALLOCATION_FAILURE;
+        return NULL;
+      }
+
+      batch_job->buffer.size= 0;
+      batch_job->buffer.data= NULL;
+    }
+    else
+    {
+      batch_job= worker->batch_free;
+      worker->batch_free= batch_job->next;
+    }
+
+    worker->batch_grab= batch_job;
+  }
+
+  if (gearman_worker_grab_job(worker, &(worker->batch_grab->job),
+                              ret_ptr) == NULL)
+  {
+    return NULL;
+  }
+
+  batch_job= worker->batch_grab;
+  worker->batch_grab= NULL;
+  batch_job->job.buffer= &(batch_job->buffer);
+
+  return batch_job;
+}
+
+static void _worker_batch_free(gearman_worker_st *worker)
+{
+  gearman_worker_batch_job_st *batch_job;
+  uint32_t x;
+
+  for (x= 0; x < worker->batch_count; x++)
+  {
+    batch_job= worker->batch_list[x];
+    gearman_job_free(&(batch_job->job));
+    batch_job->next= worker->batch_free;
+    worker->batch_free= batch_job;
+  }
+
+  worker->batch_count= 0;
+}
+
+static void _worker_result_free(void *ptr, void *arg)
+{
+  gearman_st *gearman= (gearman_st *)arg;
+
+  if (gearman->workload_free == NULL)
+    free(ptr);
+  else
+    gearman->workload_free(ptr, (void *)(gearman->workload_free_arg));
+}
@@ -87,6 +87,98 @@ void gearman_worker_set_options(gearman_worker_st *worker,
                                 gearman_worker_options_t options,
                                 uint32_t data);
 
+/**
+ * Set how many jobs to grab from a job server at once. Above one, the worker
+ * asks for up to this many jobs with a single GRAB_JOB_MULTI request and
+ * hands them out one at a time from gearman_worker_grab_job before asking
+ * again. Jobs held this way stay assigned to the worker, and the job server
+ * queues them again if the connection is lost. This should be set before
+ * grabbing jobs, and not changed while prefetched jobs are still waiting.
+ * @param worker Worker structure previously initialized with
+ *        gearman_worker_create or gearman_worker_clone.
+ * @param prefetch Number of jobs to grab at once, where zero or one grabs
+ *        them one at a time as usual.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_worker_set_prefetch(gearman_worker_st *worker,
+                                             uint32_t prefetch);
+
+/**
+ * Set how many jobs the worker can run at once. Above zero, the worker sends
+ * SET_SLOTS to each job server instead of grabbing, and the servers push jobs
+ * with JOB_ASSIGN_UNIQ as they are queued, up to this many at a time, giving
+ * another as each one is completed or failed. This saves the GRAB_JOB round
+ * trip and the NOOP wakeups for every job. Servers split the slots between
+ * their shards, so a worker should have at least as many slots as the server
+ * has threads. A worker pool can use this through gearman_worker_pool_worker,
+ * with slots for each of its threads. Setting this to zero goes back to
+ * grabbing jobs, and jobs already pushed are still read.
+ * @param worker Worker structure previously initialized with
+ *        gearman_worker_create or gearman_worker_clone.
+ * @param slots Number of jobs servers may push at once, or zero to grab.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_worker_set_slots(gearman_worker_st *worker,
+                                          uint32_t slots);
+
+/**
+ * Ask job servers to say when a job this worker is running has lost all of
+ * its clients, so the work can be stopped early. The worker sends the
+ * GEARMAN_ABANDON_OPTION option to each server before asking it for work,
+ * and calls the function with the job handle for each JOB_ABANDONED it reads
+ * while grabbing jobs. Results sent for an abandoned job are dropped.
+ * @param worker Worker structure previously initialized with
+ *        gearman_worker_create or gearman_worker_clone.
+ * @param function Function to call, or NULL to stop asking on new
+ *        connections.
+ * @param fn_arg Argument to pass into the function.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t
+gearman_worker_set_abandoned_fn(gearman_worker_st *worker,
+                                gearman_worker_abandoned_fn *function,
+                                void *fn_arg);
+
+/**
+ * Set the order job servers are asked for work in. With more than one server
+ * the default, GEARMAN_WORKER_POLL_ORDER, always starts at the first server
+ * added and keeps taking jobs from it until it has none left, so servers
+ * later in the list can back up while the first is busy. The other choices
+ * are:
+ *
+ * - GEARMAN_WORKER_POLL_ROUND_ROBIN: Take one job (or one prefetch batch)
+ *   from a server, then move on to the next one.
+ * - GEARMAN_WORKER_POLL_DEFICIT: Give each server a turn of up to a quantum
+ *   of jobs before moving on. Servers report nothing about their queues to
+ *   workers, so the quantum is learned: it doubles, up to
+ *   GEARMAN_WORKER_QUANTUM_MAX, each time a server fills its whole turn, and
+ *   drops to what the server gave when it runs out first. Busier servers are
+ *   drained faster without idle ones being skipped.
+ * - GEARMAN_WORKER_POLL_LAST_WORK: Like the default, but start each pass
+ *   over the servers at the one that last had a job.
+ *
+ * @param worker Worker structure previously initialized with
+ *        gearman_worker_create or gearman_worker_clone.
+ * @param poll Polling order to use.
+ */
+GEARMAN_API
+void gearman_worker_set_poll(gearman_worker_st *worker,
+                             gearman_worker_poll_t poll);
+
+/**
+ * Compress job results and data at least this large. See
+ * gearman_set_compression for details.
+ * @param worker Worker structure previously initialized with
+ *        gearman_worker_create or gearman_worker_clone.
+ * @param threshold Smallest data size to compress, or 0 to not compress.
+ */
+GEARMAN_API
+void gearman_worker_set_compression(gearman_worker_st *worker,
+                                    size_t threshold);
+
 /**
  * Set custom memory allocation function for workloads. Normally gearman uses
  * the standard system malloc to allocate memory used with workloads. This
@@ -120,8 +212,11 @@ void gearman_worker_set_workload_free(gearman_worker_st *worker,
  * used to run tasks. No socket I/O happens here, it is just added to a list.
  * @param worker Worker structure previously initialized with
  *        gearman_worker_create or gearman_worker_clone.
- * @param host Hostname or IP address (IPv4 or IPv6) of the server to add.
- * @param port Port of the server to add.
+ * @param host Hostname or IP address (IPv4 or IPv6) of the server to add, or
+ *        the path of a Unix domain socket, either absolute or prefixed with
+ *        "unix:". A "shm:" prefix instead connects to the socket of a
+ *        server's shared memory module.
+ * @param port Port of the server to add, ignored for Unix domain sockets.
  * @return Standard gearman return value.
  */
 GEARMAN_API
@@ -130,10 +225,14 @@ gearman_return_t gearman_worker_add_server(gearman_worker_st *worker,
 
 /**
  * Add a list of job servers to a worker. The format for the server list is:
- * SERVER[:PORT][,SERVER[:PORT]]...
+ * SERVER[:PORT][/?WEIGHT][,SERVER[:PORT][/?WEIGHT]]...
  * Some examples are:
  * 10.0.0.1,10.0.0.2,10.0.0.3
  * localhost:1234,jobserver2.domain.com:7003,10.0.0.3
+ * unix:/run/gearmand.sock,10.0.0.1
+ * shm:/tmp/gearmand.shm
+ * 10.0.0.1/?2,10.0.0.2:7003/?1
+ * Weights are only used by clients and are ignored here.
  * @param worker Worker structure previously initialized with
  *        gearman_worker_create or gearman_worker_clone.
  * @param servers Server list described above.
@@ -167,7 +266,11 @@ GEARMAN_API
 gearman_return_t gearman_worker_unregister_all(gearman_worker_st *worker);
 
 /**
- * Get a job from one of the job servers.
+ * Get a job from one of the job servers. Once a server has no jobs it is sent
+ * PRE_SLEEP, and it is not asked again until it wakes the worker with a NOOP,
+ * or until a blocking worker's wait times out. With the non-blocking option,
+ * input on the connections must be reported with gearman_con_wait or
+ * gearman_con_set_revents before calling this again.
  */
 GEARMAN_API
 gearman_job_st *gearman_worker_grab_job(gearman_worker_st *worker,
@@ -184,6 +287,61 @@ gearman_return_t gearman_worker_add_function(gearman_worker_st *worker,
                                              gearman_worker_fn *worker_fn,
                                              const void *fn_arg);
 
+/**
+ * Register and add a callback function for worker that leaves its result in
+ * the job instead of returning an allocated one. The function either writes
+ * the result into the buffer from gearman_job_result_buffer, or points the
+ * job at memory it owns with gearman_job_set_result. Either way the result is
+ * sent in WORK_COMPLETE without being allocated or copied for each job. A
+ * function that returns GEARMAN_WORK_FAIL fails the job, and one that sets no
+ * result completes it with an empty one.
+ */
+GEARMAN_API
+gearman_return_t
+gearman_worker_add_function_buffer(gearman_worker_st *worker,
+                                   const char *function_name,
+                                   uint32_t timeout,
+                                   gearman_worker_buffer_fn *buffer_fn,
+                                   const void *fn_arg);
+
+/**
+ * Register and add a callback function for worker that runs several jobs at
+ * once. When gearman_worker_work grabs a job for the function, it keeps
+ * taking jobs for the same function that are already waiting, from a
+ * GRAB_JOB_MULTI reply or one that arrives within batch_wait, and then calls
+ * the function once with all of them. Set a prefetch depth of at least
+ * batch_size with gearman_worker_set_prefetch so a single request can fill a
+ * batch. A job for any other function ends the batch and is worked on next.
+ * In non-blocking mode the batch only takes jobs already received, without
+ * waiting.
+ *
+ * Each job in the list is a regular job. The function sets each result with
+ * gearman_job_result_buffer or gearman_job_set_result, and may fail or
+ * complete a job on its own with gearman_job_fail or gearman_job_complete.
+ * Once it returns, the jobs it did not finish are completed with their
+ * results, or all failed if it returns GEARMAN_WORK_FAIL. Once a worker has a
+ * batch function, regular functions are also run on jobs grabbed this way.
+ * @param worker Worker structure previously initialized with
+ *        gearman_worker_create or gearman_worker_clone.
+ * @param function_name Function name to register.
+ * @param timeout Timeout for each job in seconds, or 0 for no timeout.
+ * @param batch_size Most jobs to pass at once, up to
+ *        GEARMAN_GRAB_JOB_MULTI_MAX.
+ * @param batch_wait Milliseconds to wait for more jobs after the first one.
+ * @param batch_fn Function to call with the jobs.
+ * @param fn_arg Argument passed to batch_fn.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t
+gearman_worker_add_batch_function(gearman_worker_st *worker,
+                                  const char *function_name,
+                                  uint32_t timeout,
+                                  uint32_t batch_size,
+                                  uint32_t batch_wait,
+                                  gearman_worker_batch_fn *batch_fn,
+                                  const void *fn_arg);
+
 /**
  * Wait for a job and call the appropriate callback function when it gets one.
  */
@@ -0,0 +1,792 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Worker pool definitions
+ */
+
+#include "common.h"
+
+/*
+ * Private declarations
+ */
+
+/**
+ * @addtogroup gearman_worker_pool_private Private Worker Pool Functions
+ * @ingroup gearman_worker_pool
+ * @{
+ */
+
+/**
+ * Main function for the I/O thread.
+ */
+static void *_worker_pool_thread(void *data);
+
+/**
+ * Main function for the executor threads.
+ */
+static void *_worker_pool_executor(void *data);
+
+/**
+ * Grab jobs and hand them to the executor threads.
+ * @return true if the grab is waiting on the connections.
+ */
+static bool _worker_pool_grab(gearman_worker_pool_st *pool, bool shutdown);
+
+/**
+ * Send results for finished jobs.
+ * @return true if a result is only partly sent.
+ */
+static bool _worker_pool_send(gearman_worker_pool_st *pool);
+
+/**
+ * Queue a finished job for the I/O thread to send.
+ */
+static void _worker_pool_done(gearman_worker_pool_st *pool,
+                              gearman_worker_pool_job_st *pool_job);
+
+/**
+ * Wait for activity on the connections or a finished job.
+ */
+static void _worker_pool_wait(gearman_worker_pool_st *pool, bool grab);
+
+/**
+ * Get a job structure from the free list, or allocate a new one.
+ */
+static gearman_worker_pool_job_st *
+_worker_pool_job_get(gearman_worker_pool_st *pool);
+
+/**
+ * Release a job and put its structure back on the free list.
+ */
+static void _worker_pool_job_free(gearman_worker_pool_st *pool,
+                                  gearman_worker_pool_job_st *pool_job);
+
+/**
+ * Stop and join the executor threads that were started.
+ */
+static void _worker_pool_stop(gearman_worker_pool_st *pool);
+
+/**
+ * Wake the I/O thread.
+ */
+static void _worker_pool_wakeup(gearman_worker_pool_st *pool);
+
+/**
+ * Create the descriptor used to wake the I/O thread.
+ */
+static gearman_return_t _worker_pool_wakeup_init(gearman_worker_pool_st *pool);
+
+/** @} */
+
+/*
+ * Public definitions
+ */
+
+gearman_worker_pool_st *gearman_worker_pool_create(gearman_worker_pool_st *pool)
+{
+  long count;
+
+  if (pool == NULL)
+  {
+    pool= malloc(sizeof(gearman_worker_pool_st));
+    if (pool == NULL)
+      return NULL;
+
+    pool->options= GEARMAN_WORKER_POOL_ALLOCATED;
+  }
+  else
+    pool->options= 0;
+
+  count= sysconf(_SC_NPROCESSORS_ONLN);
+
+  pool->shutdown= false;
+  pool->wakeup= false;
+  pool->stop= false;
+  pool->grab_wait= false;
+  pool->wakeup_fd[0]= -1;
+  pool->wakeup_fd[1]= -1;
+  pool->thread_count= count < 1 ? 1 : (uint32_t)count;
+  pool->thread_started= 0;
+  pool->job_count= 0;
+  pool->job_max= 0;
+  pool->pfds_size= 0;
+  pool->done_count= 0;
+  pool->pfds= NULL;
+  pool->job_list= NULL;
+  pool->job_end= NULL;
+  pool->done_list= NULL;
+  pool->done_end= NULL;
+  pool->send_list= NULL;
+  pool->send_end= NULL;
+  pool->free_list= NULL;
+  pool->grab_job= NULL;
+  pool->thread_id_list= NULL;
+
+  if (gearman_worker_create(&(pool->worker)) == NULL)
+  {
+    if (pool->options & GEARMAN_WORKER_POOL_ALLOCATED)
+      free(pool);
+
+    return NULL;
+  }
+
+  return pool;
+}
+
+void gearman_worker_pool_free(gearman_worker_pool_st *pool)
+{
+  gearman_worker_pool_job_st *pool_job;
+
+  if (pool->options & GEARMAN_WORKER_POOL_STARTED)
+  {
+    (void) pthread_mutex_lock(&(pool->lock));
+    pool->shutdown= true;
+    (void) pthread_mutex_unlock(&(pool->lock));
+
+    _worker_pool_wakeup(pool);
+    (void) pthread_join(pool->id, NULL);
+    (void) pthread_cond_destroy(&(pool->cond));
+    (void) pthread_mutex_destroy(&(pool->lock));
+  }
+
+  if (pool->wakeup_fd[0] >= 0)
+  {
+    close(pool->wakeup_fd[0]);
+    if (pool->wakeup_fd[1] != pool->wakeup_fd[0])
+      close(pool->wakeup_fd[1]);
+  }
+
+  if (pool->pfds != NULL)
+    free(pool->pfds);
+
+  if (pool->thread_id_list != NULL)
+    free(pool->thread_id_list);
+
+  /* This also frees a job the worker was in the middle of grabbing, so the
+     structure holding it is only freed after. */
+  gearman_worker_free(&(pool->worker));
+
+  if (pool->grab_job != NULL)
+  {
+    if (pool->grab_job->buffer.data != NULL)
+      free(pool->grab_job->buffer.data);
+    free(pool->grab_job);
+  }
+
+  while (pool->free_list != NULL)
+  {
+    pool_job= pool->free_list;
+    pool->free_list= pool_job->next;
+    if (pool_job->buffer.data != NULL)
+      free(pool_job->buffer.data);
+    free(pool_job);
+  }
+
+  if (pool->options & GEARMAN_WORKER_POOL_ALLOCATED)
+    free(pool);
+}
+
+gearman_worker_st *gearman_worker_pool_worker(gearman_worker_pool_st *pool)
+{
+  return &(pool->worker);
+}
+
+gearman_return_t gearman_worker_pool_add_servers(gearman_worker_pool_st *pool,
+                                                 const char *servers)
+{
+  return gearman_worker_add_servers(&(pool->worker), servers);
+}
+
+gearman_return_t gearman_worker_pool_add_function(gearman_worker_pool_st *pool,
+                                                  const char *function_name,
+                                                  uint32_t timeout,
+                                                  gearman_worker_fn *worker_fn,
+                                                  const void *fn_arg)
+{
+  return gearman_worker_add_function(&(pool->worker), function_name, timeout,
+                                     worker_fn, fn_arg);
+}
+
+void gearman_worker_pool_set_threads(gearman_worker_pool_st *pool,
+                                     uint32_t thread_count)
+{
+  if (pool->options & GEARMAN_WORKER_POOL_STARTED)
+    return;
+
+  pool->thread_count= thread_count == 0 ? 1 : thread_count;
+}
+
+gearman_return_t gearman_worker_pool_start(gearman_worker_pool_st *pool)
+{
+  gearman_worker_st *worker= &(pool->worker);
+  gearman_return_t ret;
+  uint32_t x;
+
+  if (pool->options & GEARMAN_WORKER_POOL_STARTED)
+    return GEARMAN_SUCCESS;
+
+  gearman_worker_set_options(worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+  gearman_worker_set_options(worker, GEARMAN_WORKER_EPOLL, 0);
+
+  /* Ask for one job per executor at a time, and keep up to as many again
+     waiting so the executors don't sit idle while the next ones arrive. */
+  ret= gearman_worker_set_prefetch(worker, pool->thread_count);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  pool->job_max= pool->thread_count * 2;
+
+  if (pool->wakeup_fd[0] == -1)
+  {
+    ret= _worker_pool_wakeup_init(pool);
+    if (ret != GEARMAN_SUCCESS)
+      return ret;
+  }
+
+  if (pool->thread_id_list == NULL)
+  {
+    pool->thread_id_list= malloc(pool->thread_count * sizeof(pthread_t));
+    if (pool->thread_id_list == NULL)
+    {
+      GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_pool_start", "malloc")
+      return GEARMAN_MEMORY_ALLOCATION_FAILURE;
+    }
+  }
+
+  if (pthread_mutex_init(&(pool->lock), NULL) != 0)
+  {
+    GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_pool_start",
+                      "pthread_mutex_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  if (pthread_cond_init(&(pool->cond), NULL) != 0)
+  {
+    (void) pthread_mutex_destroy(&(pool->lock));
+    GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_pool_start",
+                      "pthread_cond_init")
+    return GEARMAN_PTHREAD;
+  }
+
+  pool->stop= false;
+
+  for (x= 0; x < pool->thread_count; x++)
+  {
+    if (pthread_create(&(pool->thread_id_list[x]), NULL, _worker_pool_executor,
+                       pool) != 0)
+    {
+      break;
+    }
+  }
+
+  pool->thread_started= x;
+
+  if (x < pool->thread_count ||
+      pthread_create(&(pool->id), NULL, _worker_pool_thread, pool) != 0)
+  {
+    _worker_pool_stop(pool);
+    (void) pthread_cond_destroy(&(pool->cond));
+    (void) pthread_mutex_destroy(&(pool->lock));
+    GEARMAN_ERROR_SET(worker->gearman, "gearman_worker_pool_start",
+                      "pthread_create")
+    return GEARMAN_PTHREAD;
+  }
+
+  pool->options|= GEARMAN_WORKER_POOL_STARTED;
+
+  return GEARMAN_SUCCESS;
+}
+
+uint64_t gearman_worker_pool_job_count(gearman_worker_pool_st *pool)
+{
+  uint64_t count;
+
+  if (!(pool->options & GEARMAN_WORKER_POOL_STARTED))
+    return pool->done_count;
+
+  (void) pthread_mutex_lock(&(pool->lock));
+  count= pool->done_count;
+  (void) pthread_mutex_unlock(&(pool->lock));
+
+  return count;
+}
+
+/*
+ * Private definitions
+ */
+
+static void *_worker_pool_thread(void *data)
+{
+  gearman_worker_pool_st *pool= (gearman_worker_pool_st *)data;
+  gearman_worker_st *worker= &(pool->worker);
+  gearman_worker_pool_job_st *pool_job;
+  bool shutdown;
+  bool sending;
+  bool grab;
+
+  while (1)
+  {
+    (void) pthread_mutex_lock(&(pool->lock));
+    pool_job= pool->done_list;
+    pool->done_list= NULL;
+    pool->wakeup= false;
+    shutdown= pool->shutdown;
+    if (pool_job != NULL)
+    {
+      if (pool->send_list == NULL)
+        pool->send_list= pool_job;
+      else
+        pool->send_end->next= pool_job;
+      pool->send_end= pool->done_end;
+    }
+    pool->done_end= NULL;
+    (void) pthread_mutex_unlock(&(pool->lock));
+
+    sending= _worker_pool_send(pool);
+
+    /* Jobs are no longer grabbed once shutdown is set, so this only waits for
+       the ones taken before it. */
+    if (shutdown && pool->job_count == 0)
+      break;
+
+    /* Results share the connections with the grab, so neither starts a send
+       while the other has one half done. A grab left half sent would hold up
+       results on that connection, so it is finished even when no more jobs
+       are wanted. */
+    grab= false;
+    if (!sending &&
+        ((!shutdown && pool->job_count < pool->job_max) ||
+         (pool->grab_wait && worker->state != GEARMAN_WORKER_STATE_GRAB_JOB_RECV)))
+    {
+      grab= _worker_pool_grab(pool, shutdown);
+    }
+
+    _worker_pool_wait(pool, grab);
+  }
+
+  _worker_pool_stop(pool);
+
+  return NULL;
+}
+
+static void *_worker_pool_executor(void *data)
+{
+  gearman_worker_pool_st *pool= (gearman_worker_pool_st *)data;
+  gearman_worker_pool_job_st *pool_job;
+  gearman_job_st *job;
+
+  while (1)
+  {
+    (void) pthread_mutex_lock(&(pool->lock));
+
+    while (pool->job_list == NULL && !(pool->stop))
+      (void) pthread_cond_wait(&(pool->cond), &(pool->lock));
+
+    pool_job= pool->job_list;
+    if (pool_job == NULL)
+    {
+      (void) pthread_mutex_unlock(&(pool->lock));
+      break;
+    }
+
+    pool->job_list= pool_job->next;
+    if (pool->job_list == NULL)
+      pool->job_end= NULL;
+
+    (void) pthread_mutex_unlock(&(pool->lock));
+
+    pool_job->ret= GEARMAN_SUCCESS;
+    pool_job->result_size= 0;
+    if (pool_job->function->worker_fn != NULL)
+    {
+      pool_job->result= (*(pool_job->function->worker_fn))(&(pool_job->job),
+                                        (void *)(pool_job->function->fn_arg),
+                                        &(pool_job->result_size),
+                                        &(pool_job->ret));
+    }
+    else if (pool_job->function->buffer_fn != NULL)
+    {
+      pool_job->ret= (*(pool_job->function->buffer_fn))(&(pool_job->job),
+                                        (void *)(pool_job->function->fn_arg));
+    }
+    else
+    {
+      /* The executors already run jobs side by side, so batch functions are
+         given one job at a time. */
+      job= &(pool_job->job);
+      pool_job->ret= (*(pool_job->function->batch_fn))(&job, 1,
+                                        (void *)(pool_job->function->fn_arg));
+    }
+    _worker_pool_done(pool, pool_job);
+  }
+
+  return NULL;
+}
+
+static bool _worker_pool_grab(gearman_worker_pool_st *pool, bool shutdown)
+{
+  gearman_worker_st *worker= &(pool->worker);
+  gearman_worker_pool_job_st *pool_job;
+  gearman_worker_function_st *function;
+  gearman_job_st *job;
+  gearman_return_t ret;
+
+  do
+  {
+    /* The worker keeps using the same job structure until it hands it back
+       with a job in it, so the structure is held here until then. */
+    if (pool->grab_job == NULL)
+    {
+      pool->grab_job= _worker_pool_job_get(pool);
+      if (pool->grab_job == NULL)
+        return false;
+    }
+
+    job= gearman_worker_grab_job(worker, &(pool->grab_job->job), &ret);
+    pool->grab_wait= ret == GEARMAN_IO_WAIT;
+    if (job == NULL)
+    {
+      if (ret == GEARMAN_IO_WAIT || ret == GEARMAN_NO_JOBS)
+        return true;
+
+      /* The error is left for gearman_worker_error, and the grab starts over
+         after the next wait. */
+      worker->state= GEARMAN_WORKER_STATE_START;
+      worker->prefetch_pending= 0;
+      return false;
+    }
+
+    pool_job= pool->grab_job;
+    pool->grab_job= NULL;
+    pool_job->close_count= job->con->close_count;
+    pool_job->result_size= 0;
+    pool_job->result= NULL;
+    pool_job->next= NULL;
+    pool->job_count++;
+
+    /* Each job gets its own result buffer, since the executors run at the
+       same time. */
+    job->buffer= &(pool_job->buffer);
+
+    function= gearman_worker_function_find(worker,
+                                           gearman_job_function_name(job));
+
+    /* There is no one to report a job for an unknown function to, so it is
+       failed back to the server instead. */
+    if (function == NULL ||
+        (function->worker_fn == NULL && function->buffer_fn == NULL &&
+         function->batch_fn == NULL))
+    {
+      pool_job->ret= GEARMAN_WORK_FAIL;
+      _worker_pool_done(pool, pool_job);
+      continue;
+    }
+
+    pool_job->function= function;
+
+    (void) pthread_mutex_lock(&(pool->lock));
+    if (pool->job_list == NULL)
+      pool->job_list= pool_job;
+    else
+      pool->job_end->next= pool_job;
+    pool->job_end= pool_job;
+    (void) pthread_cond_signal(&(pool->cond));
+    (void) pthread_mutex_unlock(&(pool->lock));
+  }
+  while (!shutdown && pool->job_count < pool->job_max);
+
+  return false;
+}
+
+static bool _worker_pool_send(gearman_worker_pool_st *pool)
+{
+  gearman_worker_pool_job_st *pool_job;
+  gearman_worker_pool_job_st *prev= NULL;
+  gearman_worker_pool_job_st *next;
+  gearman_con_st *con;
+  gearman_return_t ret;
+  bool sending= false;
+
+  for (pool_job= pool->send_list; pool_job != NULL; pool_job= next)
+  {
+    next= pool_job->next;
+    con= pool_job->job.con;
+
+    /* Once the connection a job came in on has closed, the server has given
+       the job to another worker and won't take a result for it here. */
+    if (con->close_count != pool_job->close_count)
+      ret= GEARMAN_LOST_CONNECTION;
+    else if (!(pool_job->job.options & GEARMAN_JOB_WORK_IN_USE) &&
+             con->send_state != GEARMAN_CON_SEND_STATE_NONE)
+    {
+      prev= pool_job;
+      continue;
+    }
+    else
+    {
+      if (pool_job->ret == GEARMAN_SUCCESS)
+      {
+        if (pool_job->function->worker_fn != NULL)
+        {
+          ret= gearman_job_complete(&(pool_job->job), pool_job->result,
+                                    pool_job->result_size);
+        }
+        else
+        {
+          ret= gearman_job_complete(&(pool_job->job),
+                                    (void *)(pool_job->job.result),
+                                    pool_job->job.result_size);
+        }
+      }
+      else
+        ret= gearman_job_fail(&(pool_job->job));
+
+      if (ret == GEARMAN_IO_WAIT)
+      {
+        sending= true;
+        prev= pool_job;
+        continue;
+      }
+
+      if (ret == GEARMAN_SUCCESS)
+      {
+        (void) pthread_mutex_lock(&(pool->lock));
+        pool->done_count++;
+        (void) pthread_mutex_unlock(&(pool->lock));
+      }
+    }
+
+    if (prev == NULL)
+      pool->send_list= next;
+    else
+      prev->next= next;
+    if (next == NULL)
+      pool->send_end= prev;
+
+    _worker_pool_job_free(pool, pool_job);
+  }
+
+  return sending;
+}
+
+static void _worker_pool_done(gearman_worker_pool_st *pool,
+                              gearman_worker_pool_job_st *pool_job)
+{
+  bool wakeup;
+
+  pool_job->next= NULL;
+
+  (void) pthread_mutex_lock(&(pool->lock));
+
+  if (pool->done_list == NULL)
+    pool->done_list= pool_job;
+  else
+    pool->done_end->next= pool_job;
+  pool->done_end= pool_job;
+
+  /* Only the first job since the I/O thread last looked needs to wake it,
+     the rest are sent along with that one. */
+  wakeup= !(pool->wakeup);
+  pool->wakeup= true;
+
+  (void) pthread_mutex_unlock(&(pool->lock));
+
+  if (wakeup)
+    _worker_pool_wakeup(pool);
+}
+
+static void _worker_pool_wait(gearman_worker_pool_st *pool, bool grab)
+{
+  gearman_st *gearman= pool->worker.gearman;
+  gearman_con_st *con;
+  struct pollfd *pfds;
+  nfds_t x;
+  short events;
+  ssize_t read_size;
+  uint64_t value;
+
+  if (pool->pfds_size < gearman->con_count + 1)
+  {
+    pfds= realloc(pool->pfds,
+                  (gearman->con_count + 1) * sizeof(struct pollfd));
+    if (pfds == NULL)
+    {
+      GEARMAN_ERROR_SET(gearman, "_worker_pool_wait", "realloc")
+      return;
+    }
+
+    pool->pfds= pfds;
+    pool->pfds_size= gearman->con_count + 1;
+  }
+  else
+    pfds= pool->pfds;
+
+  pfds[0].fd= pool->wakeup_fd[0];
+  pfds[0].events= POLLIN;
+  pfds[0].revents= 0;
+
+  /* Connections are only read by the grab, so watching them for input while
+     not grabbing would wake this thread for jobs it doesn't want yet. */
+  x= 1;
+  for (con= gearman->con_list; con != NULL; con= con->next)
+  {
+    events= grab ? con->events : (short)(con->events & POLLOUT);
+    if (events == 0)
+      continue;
+
+    pfds[x].fd= con->fd;
+    pfds[x].events= events;
+    pfds[x].revents= 0;
+    x++;
+  }
+
+  while (poll(pfds, x, GEARMAN_WORKER_WAIT_TIMEOUT) == -1)
+  {
+    if (errno != EINTR)
+    {
+      GEARMAN_ERROR_SET(gearman, "_worker_pool_wait", "poll:%d", errno)
+      gearman->last_errno= errno;
+      return;
+    }
+  }
+
+  /* An eventfd is cleared with one read, and a pipe may need a few. */
+  if (pfds[0].revents != 0)
+  {
+    do
+    {
+      read_size= read(pool->wakeup_fd[0], &value, sizeof(value));
+    }
+    while (read_size > 0 && pool->wakeup_fd[0] != pool->wakeup_fd[1]);
+  }
+
+  x= 1;
+  for (con= gearman->con_list; con != NULL; con= con->next)
+  {
+    events= grab ? con->events : (short)(con->events & POLLOUT);
+    if (events == 0)
+      continue;
+
+    /* A failure here closes the connection, which the grab reopens. */
+    (void)gearman_con_set_revents(con, pfds[x].revents);
+    x++;
+  }
+}
+
+static gearman_worker_pool_job_st *
+_worker_pool_job_get(gearman_worker_pool_st *pool)
+{
+  gearman_worker_pool_job_st *pool_job;
+
+  if (pool->free_list != NULL)
+  {
+    pool_job= pool->free_list;
+    pool->free_list= pool_job->next;
+    return pool_job;
+  }
+
+  pool_job= malloc(sizeof(gearman_worker_pool_job_st));
+  if (pool_job == NULL)
+  {
+    GEARMAN_ERROR_SET(pool->worker.gearman, "_worker_pool_job_get", "malloc")
+    return NULL;
+  }
+
+  pool_job->buffer.size= 0;
+  pool_job->buffer.data= NULL;
+
+  return pool_job;
+}
+
+static void _worker_pool_job_free(gearman_worker_pool_st *pool,
+                                  gearman_worker_pool_job_st *pool_job)
+{
+  gearman_st *gearman= pool->worker.gearman;
+
+  if (pool_job->result != NULL)
+  {
+    if (gearman->workload_free == NULL)
+      free(pool_job->result);
+    else
+      gearman->workload_free(pool_job->result,
+                             (void *)(gearman->workload_free_arg));
+    pool_job->result= NULL;
+  }
+
+  gearman_job_free(&(pool_job->job));
+  pool_job->next= pool->free_list;
+  pool->free_list= pool_job;
+  pool->job_count--;
+}
+
+static void _worker_pool_stop(gearman_worker_pool_st *pool)
+{
+  uint32_t x;
+
+  (void) pthread_mutex_lock(&(pool->lock));
+  pool->stop= true;
+  (void) pthread_cond_broadcast(&(pool->cond));
+  (void) pthread_mutex_unlock(&(pool->lock));
+
+  for (x= 0; x < pool->thread_started; x++)
+    (void) pthread_join(pool->thread_id_list[x], NULL);
+
+  pool->thread_started= 0;
+}
+
+static void _worker_pool_wakeup(gearman_worker_pool_st *pool)
+{
+  uint64_t value= 1;
+
+  if (write(pool->wakeup_fd[1], &value, sizeof(value)) != sizeof(value))
+  {
+    GEARMAN_ERROR_SET(pool->worker.gearman, "_worker_pool_wakeup", "write:%d",
+                      errno)
+  }
+}
+
+static gearman_return_t _worker_pool_wakeup_init(gearman_worker_pool_st *pool)
+{
+  int ret;
+
+#ifdef HAVE_SYS_EVENTFD_H
+  ret= eventfd(0, EFD_NONBLOCK);
+  if (ret == -1)
+  {
+    GEARMAN_ERROR_SET(pool->worker.gearman, "_worker_pool_wakeup_init",
+                      "eventfd:%d", errno)
+    return GEARMAN_ERRNO;
+  }
+
+  pool->wakeup_fd[0]= ret;
+  pool->wakeup_fd[1]= ret;
+#else
+  if (pipe(pool->wakeup_fd) == -1)
+  {
+    GEARMAN_ERROR_SET(pool->worker.gearman, "_worker_pool_wakeup_init",
+                      "pipe:%d", errno)
+    return GEARMAN_ERRNO;
+  }
+
+  ret= fcntl(pool->wakeup_fd[0], F_GETFL, 0);
+  if (ret == -1 || fcntl(pool->wakeup_fd[0], F_SETFL, ret | O_NONBLOCK) == -1)
+  {
+    GEARMAN_ERROR_SET(pool->worker.gearman, "_worker_pool_wakeup_init",
+                      "fcntl:%d", errno)
+    close(pool->wakeup_fd[0]);
+    close(pool->wakeup_fd[1]);
+    pool->wakeup_fd[0]= -1;
+    pool->wakeup_fd[1]= -1;
+    return GEARMAN_ERRNO;
+  }
+#endif
+
+  return GEARMAN_SUCCESS;
+}
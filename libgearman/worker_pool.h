@@ -0,0 +1,124 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Worker pool declarations
+ */
+
+#ifndef __GEARMAN_WORKER_POOL_H__
+#define __GEARMAN_WORKER_POOL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup gearman_worker_pool Worker Pool Interface
+ * @ingroup gearman_worker
+ * This is the interface for running job functions on a pool of threads over
+ * one shared set of server connections. The pool owns a worker that only its
+ * I/O thread uses. The I/O thread grabs jobs, several at a time on each
+ * connection with GRAB_JOB_MULTI, and hands them to the executor threads.
+ * Each executor runs the function for a job and puts it on a completion
+ * queue, and the I/O thread sends the result back to the job server.
+ *
+ * Job functions run on the executor threads, so they may only read the job
+ * with gearman_job_workload, gearman_job_workload_size, gearman_job_handle,
+ * gearman_job_unique, and gearman_job_function_name. Functions added with
+ * gearman_worker_add_function_buffer may also set their result with
+ * gearman_job_result_buffer or gearman_job_set_result; each job has its own
+ * result buffer, and a release callback runs on the I/O thread. Functions
+ * added with gearman_worker_add_batch_function are given one job at a time,
+ * and fail it by returning GEARMAN_WORK_FAIL. Sending data, status, or
+ * warnings for a job in the middle of running it is not supported.
+ * @{
+ */
+
+/**
+ * Initialize a worker pool structure. No threads are started yet.
+ * @param pool Caller allocated pool structure, or NULL to allocate one.
+ * @return Pointer to an allocated pool structure if pool parameter was NULL,
+ *         or the pool parameter pointer if it was not NULL. NULL on failure.
+ */
+GEARMAN_API
+gearman_worker_pool_st *gearman_worker_pool_create(gearman_worker_pool_st *pool);
+
+/**
+ * Stop grabbing jobs, wait for the jobs already grabbed to be run and their
+ * results sent, stop all threads, and free resources used by a pool
+ * structure.
+ * @param pool Pool structure previously initialized with
+ *        gearman_worker_pool_create.
+ */
+GEARMAN_API
+void gearman_worker_pool_free(gearman_worker_pool_st *pool);
+
+/**
+ * Get the worker the I/O thread runs, to add servers, functions, or change
+ * options before the pool is started. The non-blocking option is always set,
+ * the epoll option is turned off, and the prefetch depth is set to the
+ * number of threads when the pool starts.
+ */
+GEARMAN_API
+gearman_worker_st *gearman_worker_pool_worker(gearman_worker_pool_st *pool);
+
+/**
+ * Add a list of job servers to the pool. See gearman_worker_add_servers for
+ * the format. This must be called before the pool is started.
+ */
+GEARMAN_API
+gearman_return_t gearman_worker_pool_add_servers(gearman_worker_pool_st *pool,
+                                                 const char *servers);
+
+/**
+ * Register and add a function for the executor threads to run. See
+ * gearman_worker_add_function for the parameters. This must be called before
+ * the pool is started.
+ */
+GEARMAN_API
+gearman_return_t gearman_worker_pool_add_function(gearman_worker_pool_st *pool,
+                                                  const char *function_name,
+                                                  uint32_t timeout,
+                                                  gearman_worker_fn *worker_fn,
+                                                  const void *fn_arg);
+
+/**
+ * Set the number of executor threads. The default is the number of online
+ * processors. This must be called before the pool is started.
+ * @param pool Pool structure previously initialized with
+ *        gearman_worker_pool_create.
+ * @param thread_count Number of executor threads, at least 1.
+ */
+GEARMAN_API
+void gearman_worker_pool_set_threads(gearman_worker_pool_st *pool,
+                                     uint32_t thread_count);
+
+/**
+ * Start the I/O thread and the executor threads.
+ * @param pool Pool structure previously initialized with
+ *        gearman_worker_pool_create.
+ * @return Standard gearman return value.
+ */
+GEARMAN_API
+gearman_return_t gearman_worker_pool_start(gearman_worker_pool_st *pool);
+
+/**
+ * Get the number of jobs the pool has run and sent back, for monitoring.
+ * This is safe to call from any thread while the pool is running.
+ */
+GEARMAN_API
+uint64_t gearman_worker_pool_job_count(gearman_worker_pool_st *pool);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GEARMAN_WORKER_POOL_H__ */
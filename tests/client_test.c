@@ -7,9 +7,12 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #include <libgearman/gearman.h>
 
@@ -33,9 +36,43 @@ test_return clone_test(void *object);
 test_return echo_test(void *object);
 test_return submit_job_test(void *object);
 test_return submit_null_job_test(void *object);
+test_return submit_job_epoll_test(void *object);
 test_return background_test(void *object);
 test_return background_failure_test(void *object);
+test_return background_batch_test(void *object);
 test_return add_servers_test(void *object);
+test_return compression_test(void *object);
+test_return task_reserve_test(void *object);
+test_return consistent_hash_test(void *object);
+test_return client_pool_test(void *object);
+test_return event_watch_test(void *object);
+test_return stats_test(void *object);
+test_return health_test(void *object);
+test_return iov_test(void *object);
+test_return result_sink_test(void *object);
+test_return cache_test(void *object);
+test_return queue_bytes_test(void *object);
+test_return client_rate_test(void *object);
+
+gearman_return_t background_batch_created(gearman_task_st *task);
+gearman_return_t task_reserve_complete(gearman_task_st *task);
+gearman_return_t consistent_hash_complete(gearman_task_st *task);
+void *client_pool_thread(void *object);
+gearman_return_t result_sink_fn(gearman_task_st *task, const void *data,
+                                size_t data_size);
+gearman_return_t event_watch_fn(gearman_con_st *con, short events,
+                                void *arg);
+gearman_return_t cache_created(gearman_task_st *task);
+gearman_return_t cache_complete(gearman_task_st *task);
+test_return cache_run(gearman_client_st *client, gearman_worker_st *worker,
+                      const char *unique, bool warning, bool cached);
+void admission_bytes_setup(gearmand_st *gearmand, void *arg);
+void admission_rate_setup(gearmand_st *gearmand, void *arg);
+bool admission_submit(const char *function_name, bool full);
+bool admission_maxqueue(const char *command);
+test_return admission_bytes_run(void);
+bool admission_rate_hits(uint64_t *hits);
+test_return admission_rate_run(void);
 
 void *create(void *object);
 void destroy(void *object);
@@ -158,6 +195,49 @@ test_return submit_null_job_test(void *object)
   return TEST_SUCCESS;
 }
 
+test_return submit_job_epoll_test(void *object __attribute__((unused)))
+{
+  gearman_return_t rc;
+  gearman_client_st client;
+  uint8_t *job_result;
+  size_t job_length;
+  uint8_t *value= (uint8_t *)"submit_job_epoll_test";
+  size_t value_length= strlen("submit_job_epoll_test");
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  gearman_client_set_options(&client, GEARMAN_CLIENT_EPOLL, 1);
+
+  if (gearman_client_add_server(&client, NULL, CLIENT_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    gearman_client_free(&client);
+    return TEST_FAILURE;
+  }
+
+  job_result= gearman_client_do(&client, "client_test", NULL, value,
+                                value_length, &job_length, &rc);
+  if (rc != GEARMAN_SUCCESS)
+  {
+    printf("submit_job_epoll_test:%s\n", gearman_client_error(&client));
+    gearman_client_free(&client);
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  if (job_result == NULL)
+    return TEST_FAILURE;
+
+  if (value_length != job_length || memcmp(value, job_result, value_length))
+    return TEST_FAILURE;
+
+  free(job_result);
+
+  return TEST_SUCCESS;
+}
+
 test_return background_test(void *object)
 {
   gearman_return_t rc;
@@ -224,6 +304,61 @@ test_return background_failure_test(void *object)
   return TEST_SUCCESS;
 }
 
+gearman_return_t background_batch_created(gearman_task_st *task)
+{
+  const char *handles= gearman_task_data(task);
+  size_t size= gearman_task_data_size(task);
+  uint32_t *count= (uint32_t *)gearman_task_fn_arg(task);
+  size_t x;
+
+  if (strcmp(handles, gearman_task_job_handle(task)))
+    return GEARMAN_UNKNOWN_STATE;
+
+  for (x= 0; x < size; x++)
+  {
+    if (handles[x] == 0)
+      (*count)++;
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return background_batch_test(void *object)
+{
+  gearman_return_t rc;
+  gearman_client_st *client= (gearman_client_st *)object;
+  gearman_task_st task;
+  const char *unique[3]= { "batch_1", NULL, "batch_3" };
+  const void *workload[3]= { "one", "", "three" };
+  size_t workload_size[3]= { 3, 0, 5 };
+  uint32_t count= 0;
+
+  gearman_client_set_created_fn(client, background_batch_created);
+
+  if (gearman_client_add_tasks_batch(client, &task, &count, "client_test",
+                                     GEARMAN_JOB_PRIORITY_NORMAL, 3, unique,
+                                     workload, workload_size, &rc) == NULL ||
+      rc != GEARMAN_SUCCESS)
+  {
+    printf("background_batch_test:%s\n", gearman_client_error(client));
+    return TEST_FAILURE;
+  }
+
+  rc= gearman_client_run_tasks(client);
+  gearman_client_set_created_fn(client, NULL);
+  gearman_task_free(&task);
+  if (rc != GEARMAN_SUCCESS)
+  {
+    printf("background_batch_test:%s\n", gearman_client_error(client));
+    return TEST_FAILURE;
+  }
+
+  if (count != 3)
+    return TEST_FAILURE;
+
+  return TEST_SUCCESS;
+}
+
 test_return add_servers_test(void *object __attribute__((unused)))
 {
   gearman_client_st client;
@@ -248,6 +383,1071 @@ test_return add_servers_test(void *object __attribute__((unused)))
   return TEST_SUCCESS;
 }
 
+test_return compression_test(void *object)
+{
+  gearman_client_st *client= (gearman_client_st *)object;
+  gearman_client_st clone;
+  gearman_return_t rc;
+  uint8_t value[8192];
+  uint8_t *job_result;
+  size_t job_length;
+  size_t x;
+
+  for (x= 0; x < sizeof(value); x++)
+    value[x]= (uint8_t)('a' + ((x / 64) % 26));
+
+  if (gearman_client_clone(&clone, client) == NULL)
+    return TEST_FAILURE;
+
+  gearman_client_set_compression(&clone, 1);
+
+  /* The first echo goes out before the server accepts compression, so do it
+     twice to make sure compressed data makes it back too. */
+  for (x= 0; x < 2; x++)
+  {
+    rc= gearman_client_echo(&clone, value, sizeof(value));
+    if (rc != GEARMAN_SUCCESS)
+    {
+      printf("compression_test:%s\n", gearman_client_error(&clone));
+      return TEST_FAILURE;
+    }
+  }
+
+  /* The worker did not ask for compression, so the server must decompress
+     the workload before assigning the job. */
+  job_result= gearman_client_do(&clone, "client_test", NULL, value,
+                                sizeof(value), &job_length, &rc);
+  if (rc != GEARMAN_SUCCESS || job_result == NULL)
+  {
+    printf("compression_test:%s\n", gearman_client_error(&clone));
+    return TEST_FAILURE;
+  }
+
+  if (job_length != sizeof(value) || memcmp(value, job_result, job_length))
+    return TEST_FAILURE;
+
+  free(job_result);
+  gearman_client_free(&clone);
+
+  return TEST_SUCCESS;
+}
+
+gearman_return_t task_reserve_complete(gearman_task_st *task)
+{
+  uint32_t *count= (uint32_t *)gearman_task_fn_arg(task);
+
+  /* The unique ID was sent as the workload, or generated if that is empty. */
+  if (gearman_task_data_size(task) == 0)
+  {
+    if (strlen(gearman_task_uuid(task)) != 36)
+      return GEARMAN_UNKNOWN_STATE;
+  }
+  else if (gearman_task_data_size(task) != strlen(gearman_task_uuid(task)) ||
+           memcmp(gearman_task_data(task), gearman_task_uuid(task),
+                  gearman_task_data_size(task)))
+  {
+    return GEARMAN_UNKNOWN_STATE;
+  }
+
+  (*count)++;
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return task_reserve_test(void *object)
+{
+  gearman_client_st *client= (gearman_client_st *)object;
+  gearman_client_st clone;
+  gearman_return_t rc;
+  const char *unique[4]= { "reserve_1", NULL, "reserve_3", NULL };
+  uint32_t count= 0;
+  uint32_t pass;
+  uint32_t x;
+
+  if (gearman_client_clone(&clone, client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_task_reserve(&clone, 4) != GEARMAN_SUCCESS)
+    return TEST_FAILURE;
+
+  gearman_client_set_options(&clone, GEARMAN_CLIENT_DIRECT_PACK, 1);
+  gearman_client_set_complete_fn(&clone, task_reserve_complete);
+
+  /* The second pass runs on the tasks freed back to the reserve. */
+  for (pass= 0; pass < 2; pass++)
+  {
+    for (x= 0; x < 4; x++)
+    {
+      if (gearman_client_add_task(&clone, NULL, &count, "client_test",
+                                  unique[x], unique[x],
+                                  unique[x] == NULL ? 0 : strlen(unique[x]),
+                                  &rc) == NULL || rc != GEARMAN_SUCCESS)
+      {
+        printf("task_reserve_test:%s\n", gearman_client_error(&clone));
+        return TEST_FAILURE;
+      }
+    }
+
+    rc= gearman_client_run_tasks(&clone);
+    if (rc != GEARMAN_SUCCESS)
+    {
+      printf("task_reserve_test:%s\n", gearman_client_error(&clone));
+      return TEST_FAILURE;
+    }
+
+    gearman_client_task_free_all(&clone);
+  }
+
+  gearman_client_free(&clone);
+
+  if (count != 8)
+    return TEST_FAILURE;
+
+  return TEST_SUCCESS;
+}
+
+gearman_return_t consistent_hash_complete(gearman_task_st *task)
+{
+  uint32_t *count= (uint32_t *)gearman_task_fn_arg(task);
+
+  if (gearman_task_data_size(task) != strlen("hash_workload") ||
+      memcmp(gearman_task_data(task), "hash_workload",
+             gearman_task_data_size(task)))
+  {
+    return GEARMAN_UNKNOWN_STATE;
+  }
+
+  (*count)++;
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return consistent_hash_test(void *object)
+{
+  gearman_client_st *client= (gearman_client_st *)object;
+  gearman_client_st clone;
+  gearman_return_t rc;
+  char unique[16];
+  char servers[64];
+  uint32_t count= 0;
+  uint32_t x;
+
+  if (gearman_client_clone(&clone, client) == NULL)
+    return TEST_FAILURE;
+
+  /* A second, heavier connection to the same server gives the ring two
+     members without needing another server. It is named differently so its
+     points on the ring are too. */
+  snprintf(servers, sizeof(servers), "localhost:%u/?3", CLIENT_TEST_PORT);
+  if (gearman_client_add_servers(&clone, servers) != GEARMAN_SUCCESS)
+    return TEST_FAILURE;
+
+  gearman_client_set_options(&clone, GEARMAN_CLIENT_CONSISTENT_HASH, 1);
+  gearman_client_set_complete_fn(&clone, consistent_hash_complete);
+
+  /* Enough keys that both connections get some, and packed submissions
+     are left on one when the last task goes to the other. */
+  for (x= 0; x < 32; x++)
+  {
+    if (x % 8 == 7)
+      snprintf(unique, sizeof(unique), "-");
+    else
+      snprintf(unique, sizeof(unique), "hash_%u", x);
+
+    if (gearman_client_add_task(&clone, NULL, &count, "client_test",
+                                unique, "hash_workload",
+                                strlen("hash_workload"), &rc) == NULL ||
+        rc != GEARMAN_SUCCESS)
+    {
+      printf("consistent_hash_test:%s\n", gearman_client_error(&clone));
+      return TEST_FAILURE;
+    }
+  }
+
+  rc= gearman_client_run_tasks(&clone);
+  if (rc != GEARMAN_SUCCESS)
+  {
+    printf("consistent_hash_test:%s\n", gearman_client_error(&clone));
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&clone);
+
+  if (count != 32)
+    return TEST_FAILURE;
+
+  return TEST_SUCCESS;
+}
+
+void *client_pool_thread(void *object)
+{
+  gearman_client_pool_st *pool= (gearman_client_pool_st *)object;
+  gearman_return_t rc;
+  char workload[32];
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  size_t result_size;
+  void *result;
+  uint32_t x;
+
+  for (x= 0; x < 16; x++)
+  {
+    snprintf(workload, sizeof(workload), "pool_%lu_%u",
+             (unsigned long)pthread_self(), x);
+
+    result= gearman_client_pool_do(pool, GEARMAN_JOB_PRIORITY_NORMAL,
+                                   "client_test", NULL, workload,
+                                   strlen(workload), &result_size, &rc);
+    if (rc != GEARMAN_SUCCESS || result == NULL ||
+        result_size != strlen(workload) ||
+        memcmp(result, workload, result_size))
+    {
+      if (result != NULL)
+        free(result);
+      return (void *)TEST_FAILURE;
+    }
+
+    free(result);
+  }
+
+  rc= gearman_client_pool_do_background(pool, GEARMAN_JOB_PRIORITY_HIGH,
+                                        "client_test", NULL, "pool_background",
+                                        strlen("pool_background"), job_handle);
+  if (rc != GEARMAN_SUCCESS || job_handle[0] == 0)
+    return (void *)TEST_FAILURE;
+
+  return (void *)TEST_SUCCESS;
+}
+
+test_return client_pool_test(void *object __attribute__((unused)))
+{
+  gearman_client_pool_st pool;
+  pthread_t id[4];
+  char servers[64];
+  void *ret;
+  test_return rc= TEST_SUCCESS;
+  uint32_t x;
+
+  if (gearman_client_pool_create(&pool) == NULL)
+    return TEST_FAILURE;
+
+  snprintf(servers, sizeof(servers), "127.0.0.1:%u", CLIENT_TEST_PORT);
+  if (gearman_client_pool_add_servers(&pool, servers) != GEARMAN_SUCCESS ||
+      gearman_client_pool_start(&pool) != GEARMAN_SUCCESS)
+  {
+    gearman_client_pool_free(&pool);
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 4; x++)
+  {
+    if (pthread_create(&(id[x]), NULL, client_pool_thread, &pool) != 0)
+      break;
+  }
+
+  if (x < 4)
+    rc= TEST_FAILURE;
+
+  while (x > 0)
+  {
+    x--;
+    if (pthread_join(id[x], &ret) != 0 ||
+        (test_return)(size_t)ret != TEST_SUCCESS)
+    {
+      rc= TEST_FAILURE;
+    }
+  }
+
+  gearman_client_pool_free(&pool);
+
+  return rc;
+}
+
+gearman_return_t event_watch_fn(gearman_con_st *con, short events, void *arg)
+{
+  struct pollfd *pfd= (struct pollfd *)arg;
+
+  /* Only one connection, so the application's watch list is one entry. */
+  if (events == 0)
+    pfd->fd= -1;
+  else
+    pfd->fd= gearman_con_fd(con);
+
+  pfd->events= events;
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return event_watch_test(void *object)
+{
+  gearman_client_st *client= (gearman_client_st *)object;
+  gearman_client_st clone;
+  gearman_return_t rc;
+  struct pollfd pfd;
+  uint32_t count= 0;
+  uint32_t x;
+
+  if (gearman_client_clone(&clone, client) == NULL)
+    return TEST_FAILURE;
+
+  pfd.fd= -1;
+  pfd.events= 0;
+  gearman_client_set_event_watch(&clone, event_watch_fn, &pfd);
+  gearman_client_set_complete_fn(&clone, consistent_hash_complete);
+
+  for (x= 0; x < 8; x++)
+  {
+    if (gearman_client_add_task(&clone, NULL, &count, "client_test", NULL,
+                                "hash_workload", strlen("hash_workload"),
+                                &rc) == NULL || rc != GEARMAN_SUCCESS)
+    {
+      printf("event_watch_test:%s\n", gearman_client_error(&clone));
+      return TEST_FAILURE;
+    }
+  }
+
+  rc= gearman_client_run_tasks(&clone);
+  while (rc == GEARMAN_IO_WAIT)
+  {
+    if (pfd.fd == -1)
+      return TEST_FAILURE;
+
+    pfd.revents= 0;
+    if (poll(&pfd, 1, 10000) != 1)
+      return TEST_FAILURE;
+
+    rc= gearman_client_process_ready(&clone, pfd.fd, pfd.revents);
+  }
+
+  if (rc != GEARMAN_SUCCESS)
+  {
+    printf("event_watch_test:%s\n", gearman_client_error(&clone));
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&clone);
+
+  /* The connection was closed with the client, and the watch dropped. */
+  if (count != 8 || pfd.fd != -1)
+    return TEST_FAILURE;
+
+  return TEST_SUCCESS;
+}
+
+test_return stats_test(void *object)
+{
+  gearman_client_st *client= (gearman_client_st *)object;
+  gearman_client_st clone;
+  gearman_client_stats_st *stats;
+  const gearman_histogram_st *total;
+  gearman_histogram_st merged;
+  gearman_return_t rc;
+  uint32_t count= 0;
+  uint32_t x;
+
+  if (gearman_client_clone(&clone, client) == NULL)
+    return TEST_FAILURE;
+
+  gearman_client_set_options(&clone, GEARMAN_CLIENT_STATS, 1);
+  gearman_client_set_complete_fn(&clone, consistent_hash_complete);
+
+  for (x= 0; x < 8; x++)
+  {
+    if (gearman_client_add_task(&clone, NULL, &count, "client_test", NULL,
+                                "hash_workload", strlen("hash_workload"),
+                                &rc) == NULL || rc != GEARMAN_SUCCESS)
+    {
+      printf("stats_test:%s\n", gearman_client_error(&clone));
+      return TEST_FAILURE;
+    }
+  }
+
+  rc= gearman_client_run_tasks(&clone);
+  if (rc != GEARMAN_SUCCESS || count != 8)
+  {
+    printf("stats_test:%s\n", gearman_client_error(&clone));
+    return TEST_FAILURE;
+  }
+
+  stats= gearman_client_stats(&clone, NULL);
+  if (stats == NULL || gearman_client_stats(&clone, stats) != NULL ||
+      strcmp(gearman_client_stats_function(stats), "client_test") ||
+      gearman_client_stats_count(stats) != 8 ||
+      gearman_client_stats_fail_count(stats) != 0 ||
+      gearman_histogram_count(gearman_client_stats_created(stats)) != 8 ||
+      gearman_histogram_count(gearman_client_stats_first_data(stats)) != 8)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* A task can't finish before its job was created. */
+  total= gearman_client_stats_total(stats);
+  if (gearman_histogram_count(total) != 8 ||
+      gearman_histogram_max(total) <
+      gearman_histogram_max(gearman_client_stats_created(stats)) ||
+      gearman_histogram_percentile(total, 50) < gearman_histogram_min(total) ||
+      gearman_histogram_percentile(total, 99) > gearman_histogram_max(total))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Merging a histogram twice doubles its counts but keeps its shape. */
+  gearman_histogram_init(&merged);
+  gearman_histogram_merge(&merged, total);
+  gearman_histogram_merge(&merged, total);
+  if (gearman_histogram_count(&merged) != 16 ||
+      gearman_histogram_min(&merged) != gearman_histogram_min(total) ||
+      gearman_histogram_max(&merged) != gearman_histogram_max(total) ||
+      gearman_histogram_mean(&merged) != gearman_histogram_mean(total) ||
+      gearman_histogram_percentile(&merged, 99) !=
+      gearman_histogram_percentile(total, 99))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Cumulative counts only take whole buckets below the largest value. */
+  gearman_histogram_init(&merged);
+  gearman_histogram_add(&merged, 5);
+  gearman_histogram_add(&merged, 100);
+  gearman_histogram_add(&merged, 1000000);
+  if (gearman_histogram_count_at(&merged, 5) != 1 ||
+      gearman_histogram_count_at(&merged, 1000) != 2 ||
+      gearman_histogram_count_at(&merged, 1000000) != 3 ||
+      gearman_histogram_sum(&merged) != 1000105)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_stats_reset(&clone);
+  if (gearman_client_stats_count(stats) != 0 ||
+      gearman_histogram_count(gearman_client_stats_total(stats)) != 0)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&clone);
+
+  return TEST_SUCCESS;
+}
+
+test_return health_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_con_st *dead;
+  gearman_return_t rc;
+  uint32_t count= 0;
+  uint32_t x;
+  uint32_t y;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  /* Connections are put at the front of the list, so nothing listening on
+     the discard port is tried first. */
+  if (gearman_client_add_server(&client, NULL, CLIENT_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_client_add_server(&client, "127.0.0.1", 9) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  dead= client.gearman->con_list;
+  gearman_client_set_complete_fn(&client, consistent_hash_complete);
+
+  for (y= 0; y < 2; y++)
+  {
+    for (x= 0; x < 8; x++)
+    {
+      if (gearman_client_add_task(&client, NULL, &count, "client_test", NULL,
+                                  "hash_workload", strlen("hash_workload"),
+                                  &rc) == NULL || rc != GEARMAN_SUCCESS)
+      {
+        printf("health_test:%s\n", gearman_client_error(&client));
+        return TEST_FAILURE;
+      }
+    }
+
+    rc= gearman_client_run_tasks(&client);
+    if (rc != GEARMAN_SUCCESS)
+    {
+      printf("health_test:%s\n", gearman_client_error(&client));
+      return TEST_FAILURE;
+    }
+
+    /* The dead server failed once, and is passed over after that. */
+    if (gearman_con_error_count(dead) != 1 ||
+        gearman_con_health_ready(dead) ||
+        gearman_con_error_count(dead->next) != 0 ||
+        gearman_con_rtt(dead->next) == 0)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  gearman_client_free(&client);
+
+  if (count != 16)
+    return TEST_FAILURE;
+
+  return TEST_SUCCESS;
+}
+
+test_return iov_test(void *object)
+{
+  gearman_return_t rc;
+  gearman_client_st *client= (gearman_client_st *)object;
+  struct iovec iov[4];
+  uint8_t *large;
+  uint8_t *job_result;
+  size_t job_length;
+  size_t large_size= 256 * 1024;
+  size_t x;
+
+  /* The large chunk is more than a socket takes at once, so the write picks
+     up part way through a chunk. */
+  large= malloc(large_size);
+  if (large == NULL)
+    return TEST_FAILURE;
+
+  for (x= 0; x < large_size; x++)
+    large[x]= (uint8_t)x;
+
+  iov[0].iov_base= (void *)"iov_";
+  iov[0].iov_len= strlen("iov_");
+  iov[1].iov_base= NULL;
+  iov[1].iov_len= 0;
+  iov[2].iov_base= large;
+  iov[2].iov_len= large_size;
+  iov[3].iov_base= (void *)"_test";
+  iov[3].iov_len= strlen("_test");
+
+  job_result= gearman_client_do_iov(client, "client_test", NULL, iov, 4,
+                                    &job_length, &rc);
+  if (rc != GEARMAN_SUCCESS)
+  {
+    printf("iov_test:%s\n", gearman_client_error(client));
+    return TEST_FAILURE;
+  }
+
+  if (job_result == NULL ||
+      job_length != strlen("iov_") + large_size + strlen("_test") ||
+      memcmp(job_result, "iov_", strlen("iov_")) ||
+      memcmp(job_result + strlen("iov_"), large, large_size) ||
+      memcmp(job_result + strlen("iov_") + large_size, "_test",
+             strlen("_test")))
+  {
+    return TEST_FAILURE;
+  }
+
+  free(job_result);
+  free(large);
+
+  return TEST_SUCCESS;
+}
+
+gearman_return_t result_sink_fn(gearman_task_st *task, const void *data,
+                                size_t data_size)
+{
+  const uint8_t *expected= (const uint8_t *)gearman_task_fn_arg(task);
+
+  if (memcmp(expected + gearman_task_result_size(task), data, data_size))
+    return GEARMAN_WORK_FAIL;
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return result_sink_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_task_st *task[3];
+  gearman_return_t rc;
+  uint8_t *workload;
+  uint8_t *result;
+  uint8_t small[16];
+  size_t workload_size= 200 * 1024;
+  size_t x;
+
+  workload= malloc(workload_size);
+  result= malloc(workload_size);
+  if (workload == NULL || result == NULL)
+    return TEST_FAILURE;
+
+  for (x= 0; x < workload_size; x++)
+    workload[x]= (uint8_t)(x * 7);
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, CLIENT_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* One result that fits its buffer, one that is cut short, and one that
+     goes to a callback. */
+  for (x= 0; x < 3; x++)
+  {
+    task[x]= gearman_client_add_task(&client, NULL, workload, "client_test",
+                                     NULL, workload, workload_size, &rc);
+    if (task[x] == NULL || rc != GEARMAN_SUCCESS)
+    {
+      printf("result_sink_test:%s\n", gearman_client_error(&client));
+      return TEST_FAILURE;
+    }
+  }
+
+  gearman_task_set_result_buffer(task[0], result, workload_size);
+  gearman_task_set_result_buffer(task[1], small, sizeof(small));
+  gearman_task_set_result_fn(task[2], result_sink_fn);
+
+  rc= gearman_client_run_tasks(&client);
+  if (rc != GEARMAN_SUCCESS)
+  {
+    printf("result_sink_test:%s\n", gearman_client_error(&client));
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 3; x++)
+  {
+    if (gearman_task_result_size(task[x]) != workload_size)
+      return TEST_FAILURE;
+  }
+
+  if (memcmp(result, workload, workload_size) ||
+      memcmp(small, workload, sizeof(small)))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+  free(result);
+  free(workload);
+
+  return TEST_SUCCESS;
+}
+
+typedef struct
+{
+  bool created;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  char result[GEARMAN_UNIQUE_SIZE];
+} cache_test_st;
+
+gearman_return_t cache_created(gearman_task_st *task)
+{
+  cache_test_st *state= (cache_test_st *)gearman_task_fn_arg(task);
+
+  if (state->created)
+    return GEARMAN_SUCCESS;
+
+  /* Stop once so a worker can be run for the job. */
+  state->created= true;
+  snprintf(state->job_handle, GEARMAN_JOB_HANDLE_SIZE, "%s",
+           gearman_task_job_handle(task));
+  return GEARMAN_PAUSE;
+}
+
+gearman_return_t cache_complete(gearman_task_st *task)
+{
+  cache_test_st *state= (cache_test_st *)gearman_task_fn_arg(task);
+
+  snprintf(state->result, GEARMAN_UNIQUE_SIZE, "%.*s",
+           (int)gearman_task_data_size(task),
+           (const char *)gearman_task_data(task));
+
+  return GEARMAN_SUCCESS;
+}
+
+/* Submit a job with a unique ID that is also its workload and result, and
+   check whether it came from the cache or from the worker. */
+test_return cache_run(gearman_client_st *client, gearman_worker_st *worker,
+                      const char *unique, bool warning, bool cached)
+{
+  cache_test_st state;
+  gearman_job_st *job;
+  gearman_return_t ret;
+  const char *handle_end;
+
+  memset(&state, 0, sizeof(cache_test_st));
+
+  if (gearman_client_add_task(client, NULL, &state, "cache", unique, unique,
+                              strlen(unique), &ret) == NULL ||
+      gearman_client_run_tasks(client) != GEARMAN_PAUSE)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Only cached replies have handles ending in ":cN". */
+  handle_end= strrchr(state.job_handle, ':');
+  if (handle_end == NULL || (handle_end[1] == 'c') != cached)
+    return TEST_FAILURE;
+
+  if (!cached)
+  {
+    job= gearman_worker_grab_job(worker, NULL, &ret);
+    if (job == NULL || ret != GEARMAN_SUCCESS ||
+        gearman_job_workload_size(job) != strlen(unique) ||
+        memcmp(gearman_job_workload(job), unique, strlen(unique)) ||
+        (warning &&
+         gearman_job_warning(job, (void *)"w", 1) != GEARMAN_SUCCESS) ||
+        gearman_job_complete(job, (void *)unique, strlen(unique)) !=
+        GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    gearman_job_free(job);
+  }
+
+  if (gearman_client_run_tasks(client) != GEARMAN_SUCCESS ||
+      strcmp(state.result, unique))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* A cached reply never reaches the worker. */
+  if (cached)
+  {
+    gearman_worker_set_options(worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+    while (gearman_worker_grab_job(worker, NULL, &ret) == NULL &&
+           ret == GEARMAN_IO_WAIT)
+    {
+      if (gearman_con_wait(worker->gearman, -1) != GEARMAN_SUCCESS)
+        return TEST_FAILURE;
+    }
+    gearman_worker_set_options(worker, GEARMAN_WORKER_NON_BLOCKING, 0);
+
+    if (ret != GEARMAN_NO_JOBS)
+      return TEST_FAILURE;
+  }
+
+  return TEST_SUCCESS;
+}
+
+test_return cache_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_return_t ret;
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+  char command[64];
+  unsigned long entry_size;
+
+  if (gearman_client_create(&client) == NULL ||
+      gearman_worker_create(&worker) == NULL)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_set_created_fn(&client, cache_created);
+  gearman_client_set_complete_fn(&client, cache_complete);
+
+  if (gearman_client_add_server(&client, NULL, CLIENT_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_add_server(&worker, NULL, CLIENT_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "cache", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Register the function so the cache can be turned on for it. */
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+  while (gearman_worker_grab_job(&worker, NULL, &ret) == NULL &&
+         ret == GEARMAN_IO_WAIT)
+  {
+    if (gearman_con_wait(worker.gearman, -1) != GEARMAN_SUCCESS)
+      return TEST_FAILURE;
+  }
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 0);
+
+  if (ret != GEARMAN_NO_JOBS ||
+      test_gearmand_admin(CLIENT_TEST_PORT, "cache cache 60", reply,
+                          sizeof(reply)) == NULL || strcmp(reply, "OK\n"))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* The same unique ID is answered from the cache the second time. */
+  if (cache_run(&client, &worker, "1", false, false) != TEST_SUCCESS ||
+      cache_run(&client, &worker, "1", false, true) != TEST_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* A result that came with a warning is not kept. */
+  if (cache_run(&client, &worker, "2", true, false) != TEST_SUCCESS ||
+      cache_run(&client, &worker, "2", false, false) != TEST_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Flushing drops every entry. */
+  if (test_gearmand_admin(CLIENT_TEST_PORT, "cache cache flush", reply,
+                          sizeof(reply)) == NULL ||
+      cache_run(&client, &worker, "1", false, false) != TEST_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* With room for only one entry, the least recently used one goes. */
+  if (test_gearmand_admin(CLIENT_TEST_PORT, "cache", reply,
+                          sizeof(reply)) == NULL ||
+      sscanf(reply, "cache\t60\t1\t%lu", &entry_size) != 1)
+  {
+    return TEST_FAILURE;
+  }
+
+  snprintf(command, sizeof(command), "cache cache 60 %lu",
+           entry_size + entry_size / 2);
+  if (test_gearmand_admin(CLIENT_TEST_PORT, command, reply,
+                          sizeof(reply)) == NULL ||
+      cache_run(&client, &worker, "3", false, false) != TEST_SUCCESS ||
+      cache_run(&client, &worker, "1", false, false) != TEST_SUCCESS ||
+      cache_run(&client, &worker, "1", false, true) != TEST_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Entries are dropped once their time to live is up. */
+  if (test_gearmand_admin(CLIENT_TEST_PORT, "cache cache 1", reply,
+                          sizeof(reply)) == NULL ||
+      cache_run(&client, &worker, "4", false, false) != TEST_SUCCESS ||
+      cache_run(&client, &worker, "4", false, true) != TEST_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  sleep(2);
+
+  if (cache_run(&client, &worker, "4", false, false) != TEST_SUCCESS ||
+      test_gearmand_admin(CLIENT_TEST_PORT, "cache cache 0", reply,
+                          sizeof(reply)) == NULL)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&worker);
+  gearman_client_free(&client);
+
+  return TEST_SUCCESS;
+}
+
+/* Admission control runs on a server of its own, so the limits don't get in
+   the way of the other tests. */
+#define ADMISSION_TEST_PORT (CLIENT_TEST_PORT + 1)
+#define ADMISSION_TEST_JOB_SIZE 400
+#define ADMISSION_TEST_BYTES_MAX (ADMISSION_TEST_JOB_SIZE * 5)
+#define ADMISSION_TEST_RATE 4096
+#define ADMISSION_TEST_RATE_JOBS 8
+#define ADMISSION_TEST_RATE_SIZE 1024
+
+void admission_bytes_setup(gearmand_st *gearmand,
+                           void *arg __attribute__((unused)))
+{
+  gearmand_set_queue_bytes_max(gearmand, ADMISSION_TEST_BYTES_MAX);
+}
+
+void admission_rate_setup(gearmand_st *gearmand,
+                          void *arg __attribute__((unused)))
+{
+  gearmand_set_client_rate(gearmand, ADMISSION_TEST_RATE);
+}
+
+/* Submit a background job, and check it was taken or refused as full. Each
+   job uses its own client, since one left by an error reply can't be reused. */
+bool admission_submit(const char *function_name, bool full)
+{
+  gearman_client_st client;
+  char workload[ADMISSION_TEST_JOB_SIZE];
+  gearman_return_t ret;
+  bool ok;
+
+  if (gearman_client_create(&client) == NULL)
+    return false;
+
+  memset(workload, 'x', sizeof(workload));
+  ret= gearman_client_add_server(&client, NULL, ADMISSION_TEST_PORT);
+  if (ret == GEARMAN_SUCCESS)
+  {
+    ret= gearman_client_do_background(&client, function_name, NULL, workload,
+                                      sizeof(workload), NULL);
+  }
+
+  if (full)
+  {
+    ok= ret == GEARMAN_SERVER_ERROR &&
+        strstr(gearman_client_error(&client), "queue_full") != NULL;
+  }
+  else
+    ok= ret == GEARMAN_SUCCESS;
+
+  gearman_client_free(&client);
+
+  return ok;
+}
+
+bool admission_maxqueue(const char *command)
+{
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+
+  return test_gearmand_admin(ADMISSION_TEST_PORT, command, reply,
+                             sizeof(reply)) != NULL && !strcmp(reply, "OK\n");
+}
+
+test_return admission_bytes_run(void)
+{
+  gearman_worker_st worker;
+  gearman_job_st *job;
+  gearman_return_t ret;
+
+  /* A function limit refuses jobs past its bytes, but not past its jobs. */
+  if (!admission_submit("bytes_b", false) ||
+      !admission_maxqueue("maxqueue bytes_b 0 700") ||
+      !admission_submit("bytes_b", true) ||
+      !admission_maxqueue("maxqueue bytes_b 0 800") ||
+      !admission_submit("bytes_b", false) ||
+      !admission_submit("bytes_b", true))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* The server budget is shared by every function. */
+  if (!admission_submit("bytes_a", false) ||
+      !admission_submit("bytes_a", false) ||
+      !admission_submit("bytes_a", false) ||
+      !admission_submit("bytes_a", true) ||
+      !admission_submit("bytes_c", true))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* A finished job gives its bytes back. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, ADMISSION_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "bytes_a", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  job= gearman_worker_grab_job(&worker, NULL, &ret);
+  if (job == NULL || ret != GEARMAN_SUCCESS ||
+      gearman_job_complete(job, NULL, 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_job_free(job);
+  gearman_worker_free(&worker);
+
+  if (!admission_submit("bytes_c", false) ||
+      !admission_submit("bytes_c", true))
+  {
+    return TEST_FAILURE;
+  }
+
+  return TEST_SUCCESS;
+}
+
+test_return queue_bytes_test(void *object __attribute__((unused)))
+{
+  pid_t gearmand_pid;
+  test_return ret;
+
+  gearmand_pid= test_gearmand_start_setup(ADMISSION_TEST_PORT, NULL, NULL, 0,
+                                          0, admission_bytes_setup, NULL);
+  ret= admission_bytes_run();
+  test_gearmand_stop(gearmand_pid);
+
+  return ret;
+}
+
+/* Add up how often the I/O threads stopped reading a connection. */
+bool admission_rate_hits(uint64_t *hits)
+{
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+  char *line;
+  unsigned long long rate_hits;
+
+  if (test_gearmand_admin(ADMISSION_TEST_PORT, "threads", reply,
+                          sizeof(reply)) == NULL)
+  {
+    return false;
+  }
+
+  *hits= 0;
+  for (line= reply; *line != '.'; line= strchr(line, '\n') + 1)
+  {
+    if (sscanf(line, "%*u\t%*u\t%*u\t%llu", &rate_hits) != 1)
+      return false;
+    *hits+= rate_hits;
+  }
+
+  return true;
+}
+
+test_return admission_rate_run(void)
+{
+  gearman_client_st client;
+  char workload[ADMISSION_TEST_RATE_SIZE];
+  struct timeval start;
+  struct timeval end;
+  uint64_t hits;
+  uint32_t x;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, ADMISSION_TEST_PORT) !=
+      GEARMAN_SUCCESS || !admission_rate_hits(&hits) || hits != 0)
+  {
+    return TEST_FAILURE;
+  }
+
+  memset(workload, 'x', sizeof(workload));
+  gettimeofday(&start, NULL);
+
+  /* About twice what one second allows. The connection is paused rather
+     than refused, so every job still gets in, just later. */
+  for (x= 0; x < ADMISSION_TEST_RATE_JOBS; x++)
+  {
+    if (gearman_client_do_background(&client, "rate", NULL, workload,
+                                     sizeof(workload), NULL) !=
+        GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  gettimeofday(&end, NULL);
+
+  if (end.tv_sec - start.tv_sec < 1 || !admission_rate_hits(&hits) ||
+      hits == 0)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  return TEST_SUCCESS;
+}
+
+test_return client_rate_test(void *object __attribute__((unused)))
+{
+  pid_t gearmand_pid;
+  test_return ret;
+
+  gearmand_pid= test_gearmand_start_setup(ADMISSION_TEST_PORT, NULL, NULL, 0,
+                                          2, admission_rate_setup, NULL);
+  ret= admission_rate_run();
+  test_gearmand_stop(gearmand_pid);
+
+  return ret;
+}
+
 test_return flush(void)
 {
   return TEST_SUCCESS;
@@ -339,9 +1539,23 @@ test_st tests[] ={
   {"echo", 0, echo_test },
   {"submit_job", 0, submit_job_test },
   {"submit_null_job", 0, submit_null_job_test },
+  {"submit_job_epoll", 0, submit_job_epoll_test },
   {"background", 0, background_test },
   {"background_failure", 0, background_failure_test },
+  {"background_batch", 0, background_batch_test },
   {"add_servers", 0, add_servers_test },
+  {"compression", 0, compression_test },
+  {"task_reserve", 0, task_reserve_test },
+  {"consistent_hash", 0, consistent_hash_test },
+  {"client_pool", 0, client_pool_test },
+  {"event_watch", 0, event_watch_test },
+  {"stats", 0, stats_test },
+  {"health", 0, health_test },
+  {"iov", 0, iov_test },
+  {"result_sink", 0, result_sink_test },
+  {"cache", 0, cache_test },
+  {"queue_bytes", 0, queue_bytes_test },
+  {"client_rate", 0, client_rate_test },
   {0, 0, 0}
 };
 
@@ -0,0 +1,134 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief C++17 interface test, a client and worker round trip through
+ * gearman.hpp
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <libgearman/gearman.hpp>
+
+extern "C" {
+#include "test_gearmand.h"
+}
+
+#define CPP17_TEST_PORT 32125
+
+#define CPP17_TEST_CHECK(__expr) \
+  if (!(__expr)) \
+  { \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #__expr); \
+    return false; \
+  }
+
+static void _worker_run(void)
+{
+  gearman::worker worker;
+
+  if (worker.add_server(nullptr, CPP17_TEST_PORT) != GEARMAN_SUCCESS)
+    _exit(1);
+
+  /* The result is moved into the job and sent from the string itself. */
+  if (worker.add_function("reverse", [](gearman::job &job)
+      {
+        std::string_view workload= job.workload();
+        return std::string(workload.rbegin(), workload.rend());
+      }) != GEARMAN_SUCCESS)
+  {
+    _exit(1);
+  }
+
+  if (worker.add_function("fail", [](gearman::job &) -> gearman_return_t
+      {
+        throw std::runtime_error("fail");
+      }) != GEARMAN_SUCCESS)
+  {
+    _exit(1);
+  }
+
+  while (worker.work() == GEARMAN_SUCCESS)
+    ;
+
+  _exit(1);
+}
+
+static bool _client_run(void)
+{
+  gearman::client first;
+  std::string first_workload("first");
+  std::string second_workload("second");
+
+  CPP17_TEST_CHECK(first.add_server(nullptr, CPP17_TEST_PORT) ==
+                   GEARMAN_SUCCESS)
+
+  /* A moved client keeps its servers. */
+  gearman::client client(std::move(first));
+
+  gearman::result result= client.run("reverse", "hello");
+  CPP17_TEST_CHECK(result && result.data.view() == "olleh")
+
+  /* Workloads are packed from these strings, so they outlive the tasks. */
+  gearman::task first_task= client.add_task("reverse", first_workload);
+  gearman::task second_task= client.add_task("reverse", second_workload);
+  CPP17_TEST_CHECK(first_task.ret() == GEARMAN_IO_WAIT &&
+                   second_task.ret() == GEARMAN_IO_WAIT)
+  CPP17_TEST_CHECK(client.run_tasks() == GEARMAN_SUCCESS)
+  CPP17_TEST_CHECK(first_task.ret() == GEARMAN_SUCCESS &&
+                   first_task.data().view() == "tsrif")
+
+  gearman::task task(std::move(second_task));
+  gearman::buffer data= task.take_data();
+  CPP17_TEST_CHECK(task.ret() == GEARMAN_SUCCESS && data.view() == "dnoces" &&
+                   task.data().empty())
+
+  /* A function that throws fails the job. */
+  result= client.run("fail", "x");
+  CPP17_TEST_CHECK(result.ret == GEARMAN_WORK_FAIL)
+
+  CPP17_TEST_CHECK(client.run_background("reverse", "background") ==
+                   GEARMAN_SUCCESS)
+
+  return true;
+}
+
+int main(void)
+{
+  pid_t gearmand_pid;
+  pid_t worker_pid;
+  bool ret;
+
+  gearmand_pid= test_gearmand_start(CPP17_TEST_PORT, NULL, NULL, 0);
+
+  worker_pid= fork();
+  if (worker_pid == -1)
+  {
+    test_gearmand_stop(gearmand_pid);
+    return 1;
+  }
+
+  if (worker_pid == 0)
+    _worker_run();
+
+  ret= _client_run();
+
+  (void)kill(worker_pid, SIGKILL);
+  (void)waitpid(worker_pid, NULL, 0);
+  test_gearmand_stop(gearmand_pid);
+
+  return ret ? 0 : 1;
+}
@@ -0,0 +1,525 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libgearman/gearman.h>
+
+#include "test.h"
+#include "test_gearmand.h"
+
+#define WORKER_TEST_PORT 32123
+#define LOGFILE_TEST_DIR "/tmp/gearman_logfile"
+#define LOGFILE_TEST_SNAPSHOT LOGFILE_TEST_DIR "/gearmand-snapshot"
+#define LOGFILE_TEST_WHEN_DELAY 8
+
+typedef struct
+{
+  pid_t gearmand_pid;
+  gearman_worker_st worker;
+  bool run_worker;
+  time_t when;
+} worker_test_st;
+
+/* Prototypes */
+test_return queue_add(void *object);
+test_return queue_add_batch(void *object);
+test_return queue_restart(void *object);
+test_return queue_worker(void *object);
+test_return queue_snapshot(void *object);
+test_return queue_snapshot_worker(void *object);
+
+void *create(void *object);
+void destroy(void *object);
+test_return pre(void *object);
+test_return post(void *object);
+test_return flush(void);
+
+void *world_create(void);
+void world_destroy(void *object);
+
+/* Counter test for worker */
+static void *counter_function(gearman_job_st *job __attribute__((unused)), 
+                              void *context, 
+                              size_t *result_size,
+                              gearman_return_t *ret_ptr __attribute__((unused)))
+{
+  uint32_t *counter= (uint32_t *)context;
+
+  *result_size= 0;
+
+  *counter= *counter + 1;
+
+  return NULL;
+}
+
+test_return queue_add(void *object)
+{
+  worker_test_st *test= (worker_test_st *)object;
+  gearman_client_st client;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  uint8_t *value= (uint8_t *)"background_test";
+  size_t value_length= strlen("background_test");
+
+  test->run_worker= false;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL,
+                                WORKER_TEST_PORT) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_client_do_background(&client, "queue_test", NULL, value,
+                                   value_length, job_handle) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  test->run_worker= true;
+  return TEST_SUCCESS;
+}
+
+test_return queue_add_batch(void *object)
+{
+  worker_test_st *test= (worker_test_st *)object;
+  gearman_client_st client;
+  gearman_task_st task;
+  gearman_return_t ret;
+  const char *unique[3]= { "batch_1", "batch_2", "batch_3" };
+  const void *workload[3]= { "one", "two", "three" };
+  size_t workload_size[3]= { 3, 3, 5 };
+
+  test->run_worker= false;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL,
+                                WORKER_TEST_PORT) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* The log module stores the whole batch in one call. */
+  if (gearman_client_add_tasks_batch(&client, &task, NULL, "queue_test",
+                                     GEARMAN_JOB_PRIORITY_NORMAL, 3, unique,
+                                     workload, workload_size, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  ret= gearman_client_run_tasks(&client);
+  gearman_task_free(&task);
+  gearman_client_free(&client);
+  if (ret != GEARMAN_SUCCESS)
+    return TEST_FAILURE;
+
+  test->run_worker= true;
+  return TEST_SUCCESS;
+}
+
+test_return queue_restart(void *object)
+{
+  worker_test_st *test= (worker_test_st *)object;
+  const char *argv[2]= { "test_gearmand",
+                         "--logfile-dir=" LOGFILE_TEST_DIR };
+
+  /* The job must come back from the log, not from a clean shutdown. */
+  test_gearmand_stop(test->gearmand_pid);
+  test->gearmand_pid= test_gearmand_start(WORKER_TEST_PORT, "logfile",
+                                          (char **)argv, 2);
+
+  return TEST_SUCCESS;
+}
+
+test_return queue_worker(void *object)
+{
+  worker_test_st *test= (worker_test_st *)object;
+  gearman_worker_st *worker= &(test->worker);
+  uint32_t counter= 0;
+
+  if (!test->run_worker)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_function(worker, "queue_test", 5, counter_function,
+                                  &counter) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* The single job and the batch of three all came back. */
+  while (counter < 4)
+  {
+    if (gearman_worker_work(worker) != GEARMAN_SUCCESS)
+      return TEST_FAILURE;
+  }
+
+  return TEST_SUCCESS;
+}
+
+static void snapshot_setup(gearmand_st *gearmand,
+                           void *arg __attribute__((unused)))
+{
+  assert(gearmand_set_snapshot(gearmand, LOGFILE_TEST_SNAPSHOT, 1) ==
+         GEARMAN_SUCCESS);
+}
+
+static pid_t snapshot_start(void)
+{
+  const char *argv[2]= { "test_gearmand",
+                         "--logfile-dir=" LOGFILE_TEST_DIR };
+
+  /* Snapshots are taken by their own thread, so threads must be on. */
+  return test_gearmand_start_setup(WORKER_TEST_PORT, "logfile",
+                                   (char **)argv, 2, 2, snapshot_setup, NULL);
+}
+
+/* Add a background job, held until the given time if it is not 0. */
+static bool snapshot_add(gearman_client_st *client, const char *unique,
+                         time_t when)
+{
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  gearman_task_st task;
+  gearman_return_t ret;
+
+  if (when == 0)
+  {
+    return gearman_client_do_background(client, "snapshot_test", unique,
+                                        (void *)unique, strlen(unique),
+                                        job_handle) == GEARMAN_SUCCESS;
+  }
+
+  if (gearman_client_add_task_epoch(client, &task, NULL, "snapshot_test",
+                                    unique, unique, strlen(unique), when,
+                                    &ret) == NULL || ret != GEARMAN_SUCCESS)
+  {
+    return false;
+  }
+
+  ret= gearman_client_run_tasks(client);
+  gearman_task_free(&task);
+
+  return ret == GEARMAN_SUCCESS;
+}
+
+/* Check the queued job count the server reports for the test function. */
+static bool snapshot_status(uint32_t total)
+{
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+  char *line;
+  unsigned int count;
+
+  if (test_gearmand_admin(WORKER_TEST_PORT, "status", reply,
+                          sizeof(reply)) == NULL)
+  {
+    return false;
+  }
+
+  line= strstr(reply, "snapshot_test\t");
+  return line != NULL && sscanf(line, "snapshot_test\t%u", &count) == 1 &&
+         count == total;
+}
+
+/* Grab a job, which must be one of the given ones not seen yet, and run it. */
+static test_return snapshot_run(gearman_worker_st *worker,
+                                const char *unique[], bool seen[],
+                                uint32_t count, gearman_return_t *ret_ptr)
+{
+  gearman_job_st *job;
+  uint32_t x;
+
+  job= gearman_worker_grab_job(worker, NULL, ret_ptr);
+  if (job == NULL)
+  {
+    return *ret_ptr == GEARMAN_NO_JOBS || *ret_ptr == GEARMAN_IO_WAIT ?
+           TEST_SUCCESS : TEST_FAILURE;
+  }
+
+  for (x= 0; x < count; x++)
+  {
+    if (!strcmp(gearman_job_unique(job), unique[x]) && !seen[x])
+      break;
+  }
+
+  if (x == count || gearman_job_complete(job, NULL, 0) != GEARMAN_SUCCESS)
+    return TEST_FAILURE;
+
+  seen[x]= true;
+  gearman_job_free(job);
+
+  return TEST_SUCCESS;
+}
+
+test_return queue_snapshot(void *object)
+{
+  worker_test_st *test= (worker_test_st *)object;
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_return_t ret;
+  const char *first[1]= { "snap_1" };
+  bool seen[1]= { false };
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+  unsigned int first_snapshot= 0;
+  unsigned int snapshots;
+  unsigned int failed;
+  uint32_t x;
+
+  test->run_worker= false;
+
+  test_gearmand_stop(test->gearmand_pid);
+  test->gearmand_pid= snapshot_start();
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL,
+                                WORKER_TEST_PORT) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Held jobs carry their time in both the snapshot and the log. */
+  test->when= time(NULL) + LOGFILE_TEST_WHEN_DELAY;
+  if (!snapshot_add(&client, "snap_1", 0) ||
+      !snapshot_add(&client, "snap_2", 0) ||
+      !snapshot_add(&client, "snap_3", 0) ||
+      !snapshot_add(&client, "snap_when", test->when))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* The next snapshot may have started before the jobs were added, so wait
+     for the one after it. */
+  for (x= 0; x < 10; x++)
+  {
+    if (test_gearmand_admin(WORKER_TEST_PORT, "snapshot", reply,
+                            sizeof(reply)) == NULL ||
+        sscanf(reply, "%u\t%u", &snapshots, &failed) != 2 || failed != 0)
+    {
+      return TEST_FAILURE;
+    }
+
+    if (x == 0)
+      first_snapshot= snapshots;
+    else if (snapshots >= first_snapshot + 2)
+      break;
+
+    sleep(1);
+  }
+
+  if (x == 10)
+    return TEST_FAILURE;
+
+  /* These are only in the log after the snapshot. */
+  if (!snapshot_add(&client, "tail_1", 0) ||
+      !snapshot_add(&client, "tail_2", 0) ||
+      !snapshot_add(&client, "tail_when", test->when))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  /* Finish a job from the snapshot, and remove one from the snapshot and one
+     from the log after it. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_GRAB_UNIQ, 1);
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "snapshot_test", 0) !=
+      GEARMAN_SUCCESS ||
+      snapshot_run(&worker, first, seen, 1, &ret) != TEST_SUCCESS ||
+      !seen[0])
+  {
+    return TEST_FAILURE;
+  }
+
+  if (test_gearmand_admin(WORKER_TEST_PORT, "purge snapshot_test snap_2",
+                          reply, sizeof(reply)) == NULL ||
+      strcmp(reply, "OK 1\n") ||
+      test_gearmand_admin(WORKER_TEST_PORT, "purge snapshot_test tail_1",
+                          reply, sizeof(reply)) == NULL ||
+      strcmp(reply, "OK 1\n"))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* The finished job is only gone once the server has read its result. */
+  for (x= 0; x < 10 && !snapshot_status(4); x++)
+    usleep(100000);
+
+  gearman_worker_free(&worker);
+  if (x == 10)
+    return TEST_FAILURE;
+
+  /* The jobs must come back from the snapshot and the log after it. */
+  test_gearmand_stop(test->gearmand_pid);
+  test->gearmand_pid= snapshot_start();
+
+  test->run_worker= true;
+  return TEST_SUCCESS;
+}
+
+test_return queue_snapshot_worker(void *object)
+{
+  worker_test_st *test= (worker_test_st *)object;
+  gearman_worker_st worker;
+  gearman_return_t ret;
+  const char *unique[4]= { "snap_3", "tail_2", "snap_when", "tail_when" };
+  bool seen[4]= { false, false, false, false };
+
+  if (!test->run_worker || !snapshot_status(4))
+    return TEST_FAILURE;
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_GRAB_UNIQ, 1);
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "snapshot_test", 0) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Only the jobs that were not finished are left, and the held ones are
+     not given out before their time. */
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+  do
+  {
+    if (snapshot_run(&worker, unique, seen, 2, &ret) != TEST_SUCCESS ||
+        (ret == GEARMAN_IO_WAIT &&
+         gearman_con_wait(worker.gearman, -1) != GEARMAN_SUCCESS))
+    {
+      return TEST_FAILURE;
+    }
+  }
+  while (ret != GEARMAN_NO_JOBS);
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 0);
+
+  if (!seen[0] || !seen[1] || time(NULL) >= test->when)
+    return TEST_FAILURE;
+
+  if (snapshot_run(&worker, unique + 2, seen + 2, 2, &ret) != TEST_SUCCESS ||
+      snapshot_run(&worker, unique + 2, seen + 2, 2, &ret) != TEST_SUCCESS ||
+      !seen[2] || !seen[3] || time(NULL) < test->when)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+test_return flush(void)
+{
+  return TEST_SUCCESS;
+}
+
+void *create(void *object)
+{
+  return object;
+}
+
+void destroy(void *object __attribute__((unused)))
+{
+}
+
+test_return pre(void *object __attribute__((unused)))
+{
+  return TEST_SUCCESS;
+}
+
+test_return post(void *object __attribute__((unused)))
+{
+  return TEST_SUCCESS;
+}
+
+void *world_create(void)
+{
+  worker_test_st *test;
+  const char *argv[2]= { "test_gearmand",
+                         "--logfile-dir=" LOGFILE_TEST_DIR };
+  char path[1024];
+  struct dirent *dirent;
+  DIR *dir;
+
+  /* Start from an empty log. */
+  if (mkdir(LOGFILE_TEST_DIR, 0700) == -1)
+  {
+    assert((dir= opendir(LOGFILE_TEST_DIR)) != NULL);
+    while ((dirent= readdir(dir)) != NULL)
+    {
+      if (strncmp(dirent->d_name, "gearmand-", 9))
+        continue;
+
+      snprintf(path, sizeof(path), LOGFILE_TEST_DIR "/%s", dirent->d_name);
+      (void) unlink(path);
+    }
+    (void) closedir(dir);
+  }
+
+  assert((test= malloc(sizeof(worker_test_st))) != NULL);
+  memset(test, 0, sizeof(worker_test_st));
+  assert(gearman_worker_create(&(test->worker)) != NULL);
+
+  assert(gearman_worker_add_server(&(test->worker), NULL, WORKER_TEST_PORT) ==
+         GEARMAN_SUCCESS);
+
+  test->gearmand_pid= test_gearmand_start(WORKER_TEST_PORT, "logfile",
+                                          (char **)argv, 2);
+
+  return (void *)test;
+}
+
+void world_destroy(void *object)
+{
+  worker_test_st *test= (worker_test_st *)object;
+  gearman_worker_free(&(test->worker));
+  test_gearmand_stop(test->gearmand_pid);
+  free(test);
+}
+
+test_st tests[] ={
+  {"add", 0, queue_add },
+  {"add batch", 0, queue_add_batch },
+  {"restart", 0, queue_restart },
+  {"worker", 0, queue_worker },
+  {"snapshot", 0, queue_snapshot },
+  {"snapshot worker", 0, queue_snapshot_worker },
+  {0, 0, 0}
+};
+
+collection_st collection[] ={
+  {"logfile queue", flush, create, destroy, pre, post, tests},
+  {0, 0, 0, 0, 0, 0, 0}
+};
+
+void get_world(world_st *world)
+{
+  world->collections= collection;
+  world->create= world_create;
+  world->destroy= world_destroy;
+}
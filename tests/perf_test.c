@@ -0,0 +1,684 @@
+/* Gearman server and library
+ * Copyright (C) 2008 Brian Aker, Eric Day
+ * All rights reserved.
+ *
+ * Use and distribution licensed under the BSD license.  See
+ * the COPYING file in the parent directory for full text.
+ */
+
+/**
+ * @file
+ * @brief Performance regression tests
+ *
+ * Each test runs a fixed workload against a fresh gearmand and compares what
+ * it measured with the baseline named by GEARMAN_PERF_BASELINE. A test fails
+ * when throughput drops, or latency rises, by more than the tolerance given
+ * for it. With GEARMAN_PERF_RECORD set, the measurements are appended to that
+ * file as a new baseline instead. Each baseline line is the test name, the
+ * metric, the value, and the tolerance in percent.
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libgearman/gearman.h>
+
+#include "test.h"
+#include "test_gearmand.h"
+
+#define PERF_TEST_PORT 32124
+#define PERF_TEST_DIR "/tmp/gearman_perf"
+#define PERF_TEST_SQLITE_DB "/tmp/gearman_perf.sql"
+#define PERF_TEST_WORKERS 4
+#define PERF_ECHO_COUNT 50000
+#define PERF_ECHO_SIZE 64
+#define PERF_FAN_OUT_COUNT 50000
+#define PERF_FAN_OUT_BATCH 500
+#define PERF_COALESCE_COUNT 100000
+#define PERF_COALESCE_BATCH 100
+#define PERF_LARGE_COUNT 128
+#define PERF_LARGE_SIZE (1024 * 1024)
+#define PERF_BACKGROUND_COUNT 20000
+#define PERF_THROUGHPUT_TOLERANCE 30
+#define PERF_LATENCY_TOLERANCE 50
+
+typedef struct
+{
+  const char *name;
+  const char *queue_type;
+  uint32_t threads;
+} perf_config_st;
+
+typedef struct
+{
+  const perf_config_st *config;
+  pid_t gearmand_pid;
+  pid_t worker_pid[PERF_TEST_WORKERS];
+  uint32_t worker_count;
+  gearman_client_st client;
+} perf_test_st;
+
+/* Prototypes */
+test_return echo_test(void *object);
+test_return fan_out_test(void *object);
+test_return coalesce_test(void *object);
+test_return large_test(void *object);
+test_return background_test(void *object);
+test_return replay_test(void *object);
+
+void *create_threads_0(void *object);
+void *create_threads_4(void *object);
+void *create_logfile(void *object);
+#ifdef HAVE_LIBSQLITE3
+void *create_libsqlite3(void *object);
+#endif
+void destroy(void *object);
+test_return pre(void *object);
+test_return post(void *object);
+test_return flush(void);
+
+void *world_create(void);
+void world_destroy(void *object);
+
+static const perf_config_st perf_threads_0= { "threads-0", NULL, 0 };
+static const perf_config_st perf_threads_4= { "threads-4", NULL, 4 };
+static const perf_config_st perf_logfile= { "logfile", "logfile", 4 };
+#ifdef HAVE_LIBSQLITE3
+static const perf_config_st perf_libsqlite3= { "libsqlite3", "libsqlite3", 4 };
+#endif
+
+/* Which test is running, for the baseline name. */
+static const char *perf_test_name;
+
+static uint64_t _perf_now(void)
+{
+  struct timespec ts;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int _perf_latency_cmp(const void *a, const void *b)
+{
+  uint64_t x= *(const uint64_t *)a;
+  uint64_t y= *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Latency that 99 out of 100 requests came in under, in microseconds. */
+static double _perf_p99(uint64_t *latency, uint32_t count)
+{
+  qsort(latency, count, sizeof(uint64_t), _perf_latency_cmp);
+  return (double)latency[(count * 99) / 100];
+}
+
+/**
+ * Compare a measurement with the baseline, or record it. Higher is better for
+ * throughput, lower is better for anything else.
+ */
+static test_return _perf_report(perf_test_st *test, const char *metric,
+                                double value)
+{
+  const char *path;
+  FILE *fp;
+  char line[1024];
+  char name[256];
+  char base_name[256];
+  char base_metric[64];
+  double base_value;
+  double tolerance;
+  bool throughput= !strcmp(metric, "throughput");
+
+  snprintf(name, sizeof(name), "%s/%s", test->config->name, perf_test_name);
+  fprintf(stderr, "%s %s %.0f ", name, metric, value);
+
+  path= getenv("GEARMAN_PERF_RECORD");
+  if (path != NULL)
+  {
+    fp= fopen(path, "a");
+    if (fp == NULL)
+      return TEST_FAILURE;
+
+    fprintf(fp, "%s %s %.0f %u\n", name, metric, value,
+            throughput ? PERF_THROUGHPUT_TOLERANCE : PERF_LATENCY_TOLERANCE);
+    fclose(fp);
+    return TEST_SUCCESS;
+  }
+
+  path= getenv("GEARMAN_PERF_BASELINE");
+  if (path == NULL)
+    return TEST_SUCCESS;
+
+  fp= fopen(path, "r");
+  if (fp == NULL)
+    return TEST_FAILURE;
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    if (line[0] == '#' ||
+        sscanf(line, "%255s %63s %lf %lf", base_name, base_metric, &base_value,
+               &tolerance) != 4 ||
+        strcmp(base_name, name) || strcmp(base_metric, metric))
+    {
+      continue;
+    }
+
+    fclose(fp);
+    fprintf(stderr, "(baseline %.0f) ", base_value);
+
+    if (throughput ? value < base_value * (1 - tolerance / 100) :
+                     value > base_value * (1 + tolerance / 100))
+    {
+      return TEST_FAILURE;
+    }
+
+    return TEST_SUCCESS;
+  }
+
+  fclose(fp);
+  fprintf(stderr, "(no baseline) ");
+  return TEST_SUCCESS;
+}
+
+static test_return _perf_report_rate(perf_test_st *test, uint32_t count,
+                                     uint64_t usec)
+{
+  return _perf_report(test, "throughput",
+                      (double)count * 1000000 / (double)(usec == 0 ? 1 : usec));
+}
+
+static void *_perf_echo_worker(gearman_job_st *job,
+                               void *context __attribute__((unused)),
+                               size_t *result_size, gearman_return_t *ret_ptr)
+{
+  void *result;
+
+  *result_size= gearman_job_workload_size(job);
+  if (*result_size == 0)
+  {
+    *ret_ptr= GEARMAN_SUCCESS;
+    return NULL;
+  }
+
+  result= malloc(*result_size);
+  if (result == NULL)
+  {
+    *ret_ptr= GEARMAN_WORK_FAIL;
+    return NULL;
+  }
+
+  memcpy(result, gearman_job_workload(job), *result_size);
+  *ret_ptr= GEARMAN_SUCCESS;
+  return result;
+}
+
+static void *_perf_count_worker(gearman_job_st *job __attribute__((unused)),
+                                void *context, size_t *result_size,
+                                gearman_return_t *ret_ptr)
+{
+  uint32_t *counter= (uint32_t *)context;
+
+  (*counter)++;
+  *result_size= 0;
+  *ret_ptr= GEARMAN_SUCCESS;
+  return NULL;
+}
+
+/* Like test_worker_start, but for several workers with one wait for all. */
+static void _perf_workers_start(perf_test_st *test)
+{
+  gearman_worker_st worker;
+  uint32_t x;
+
+  for (x= 0; x < PERF_TEST_WORKERS; x++)
+  {
+    test->worker_pid[x]= fork();
+    assert(test->worker_pid[x] != -1);
+
+    if (test->worker_pid[x] == 0)
+    {
+      assert(gearman_worker_create(&worker) != NULL);
+      assert(gearman_worker_add_server(&worker, NULL, PERF_TEST_PORT) ==
+             GEARMAN_SUCCESS);
+      assert(gearman_worker_add_function(&worker, "perf_echo", 0,
+                                         _perf_echo_worker, NULL) ==
+             GEARMAN_SUCCESS);
+      while (1)
+        assert(gearman_worker_work(&worker) == GEARMAN_SUCCESS);
+    }
+
+    test->worker_count++;
+  }
+
+  sleep(1);
+}
+
+static void _perf_workers_stop(perf_test_st *test)
+{
+  uint32_t x;
+
+  for (x= 0; x < test->worker_count; x++)
+  {
+    assert(kill(test->worker_pid[x], SIGKILL) == 0);
+    assert(waitpid(test->worker_pid[x], NULL, 0) == test->worker_pid[x]);
+  }
+
+  test->worker_count= 0;
+}
+
+static pid_t _perf_gearmand_start(const perf_config_st *config)
+{
+  const char *argv[2]= { "perf_gearmand", NULL };
+  int argc= 1;
+
+  if (config->queue_type != NULL)
+  {
+    if (!strcmp(config->queue_type, "logfile"))
+      argv[1]= "--logfile-dir=" PERF_TEST_DIR;
+    else if (!strcmp(config->queue_type, "libsqlite3"))
+      argv[1]= "--libsqlite3-db=" PERF_TEST_SQLITE_DB;
+    argc= 2;
+  }
+
+  return test_gearmand_start_threads(PERF_TEST_PORT, config->queue_type,
+                                     (char **)argv, argc, config->threads);
+}
+
+/* Nothing kept from an earlier run may be replayed. */
+static void _perf_queue_clear(void)
+{
+  char path[1024];
+  struct dirent *dirent;
+  DIR *dir;
+
+  (void) unlink(PERF_TEST_SQLITE_DB);
+
+  if (mkdir(PERF_TEST_DIR, 0700) == 0 || errno != EEXIST)
+    return;
+
+  dir= opendir(PERF_TEST_DIR);
+  if (dir == NULL)
+    return;
+
+  while ((dirent= readdir(dir)) != NULL)
+  {
+    if (strncmp(dirent->d_name, "gearmand-", 9))
+      continue;
+
+    snprintf(path, sizeof(path), PERF_TEST_DIR "/%s", dirent->d_name);
+    (void) unlink(path);
+  }
+
+  (void) closedir(dir);
+}
+
+test_return echo_test(void *object)
+{
+  perf_test_st *test= (perf_test_st *)object;
+  char workload[PERF_ECHO_SIZE];
+  uint64_t *latency;
+  uint64_t start;
+  uint64_t begin;
+  uint32_t x;
+  test_return rc;
+
+  perf_test_name= "echo";
+  memset(workload, 'e', sizeof(workload));
+
+  latency= malloc(sizeof(uint64_t) * PERF_ECHO_COUNT);
+  if (latency == NULL)
+    return TEST_MEMORY_ALLOCATION_FAILURE;
+
+  start= _perf_now();
+  for (x= 0; x < PERF_ECHO_COUNT; x++)
+  {
+    begin= _perf_now();
+    if (gearman_client_echo(&(test->client), workload, sizeof(workload)) !=
+        GEARMAN_SUCCESS)
+    {
+      free(latency);
+      return TEST_FAILURE;
+    }
+    latency[x]= _perf_now() - begin;
+  }
+
+  rc= _perf_report_rate(test, PERF_ECHO_COUNT, _perf_now() - start);
+  if (rc == TEST_SUCCESS)
+    rc= _perf_report(test, "latency", _perf_p99(latency, PERF_ECHO_COUNT));
+
+  free(latency);
+  return rc;
+}
+
+/* Add a batch of tasks at once and wait for them all. */
+static test_return _perf_tasks(perf_test_st *test, uint32_t count,
+                               uint32_t batch, bool coalesce)
+{
+  gearman_task_st *task;
+  gearman_return_t ret;
+  char workload[PERF_ECHO_SIZE];
+  char unique[64];
+  uint64_t start;
+  uint32_t x;
+  uint32_t y;
+
+  memset(workload, 't', sizeof(workload));
+
+  task= malloc(sizeof(gearman_task_st) * batch);
+  if (task == NULL)
+    return TEST_MEMORY_ALLOCATION_FAILURE;
+
+  start= _perf_now();
+  for (x= 0; x < count; x+= batch)
+  {
+    for (y= 0; y < batch; y++)
+    {
+      /* The same unique key for a whole batch makes it one job. */
+      if (coalesce)
+        snprintf(unique, sizeof(unique), "perf_coalesce_%u", x);
+      else
+        snprintf(unique, sizeof(unique), "perf_fan_out_%u", x + y);
+
+      if (gearman_client_add_task(&(test->client), &(task[y]), NULL,
+                                  "perf_echo", unique, workload,
+                                  sizeof(workload), &ret) == NULL ||
+          ret != GEARMAN_SUCCESS)
+      {
+        free(task);
+        return TEST_FAILURE;
+      }
+    }
+
+    ret= gearman_client_run_tasks(&(test->client));
+    for (y= 0; y < batch; y++)
+      gearman_task_free(&(task[y]));
+
+    if (ret != GEARMAN_SUCCESS)
+    {
+      free(task);
+      return TEST_FAILURE;
+    }
+  }
+
+  free(task);
+  return _perf_report_rate(test, count, _perf_now() - start);
+}
+
+test_return fan_out_test(void *object)
+{
+  perf_test_name= "fan-out";
+  return _perf_tasks((perf_test_st *)object, PERF_FAN_OUT_COUNT,
+                     PERF_FAN_OUT_BATCH, false);
+}
+
+test_return coalesce_test(void *object)
+{
+  perf_test_name= "coalesce";
+  return _perf_tasks((perf_test_st *)object, PERF_COALESCE_COUNT,
+                     PERF_COALESCE_BATCH, true);
+}
+
+test_return large_test(void *object)
+{
+  perf_test_st *test= (perf_test_st *)object;
+  char *workload;
+  void *result;
+  size_t result_size;
+  gearman_return_t ret;
+  uint64_t latency[PERF_LARGE_COUNT];
+  uint64_t start;
+  uint64_t begin;
+  uint32_t x;
+  test_return rc;
+
+  perf_test_name= "large";
+
+  workload= malloc(PERF_LARGE_SIZE);
+  if (workload == NULL)
+    return TEST_MEMORY_ALLOCATION_FAILURE;
+
+  memset(workload, 'l', PERF_LARGE_SIZE);
+
+  start= _perf_now();
+  for (x= 0; x < PERF_LARGE_COUNT; x++)
+  {
+    begin= _perf_now();
+    result= gearman_client_do(&(test->client), "perf_echo", NULL, workload,
+                              PERF_LARGE_SIZE, &result_size, &ret);
+    latency[x]= _perf_now() - begin;
+
+    if (result != NULL)
+      free(result);
+
+    if (ret != GEARMAN_SUCCESS || result_size != PERF_LARGE_SIZE)
+    {
+      free(workload);
+      return TEST_FAILURE;
+    }
+  }
+
+  free(workload);
+
+  rc= _perf_report_rate(test, PERF_LARGE_COUNT, _perf_now() - start);
+  if (rc == TEST_SUCCESS)
+    rc= _perf_report(test, "latency", _perf_p99(latency, PERF_LARGE_COUNT));
+
+  return rc;
+}
+
+/* Submit background jobs nobody is working on, so they stay queued. */
+static test_return _perf_background(perf_test_st *test)
+{
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  char workload[PERF_ECHO_SIZE];
+  uint32_t x;
+
+  memset(workload, 'b', sizeof(workload));
+
+  for (x= 0; x < PERF_BACKGROUND_COUNT; x++)
+  {
+    if (gearman_client_do_background(&(test->client), "perf_queue", NULL,
+                                     workload, sizeof(workload),
+                                     job_handle) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  return TEST_SUCCESS;
+}
+
+test_return background_test(void *object)
+{
+  perf_test_st *test= (perf_test_st *)object;
+  uint64_t start;
+
+  perf_test_name= "background";
+
+  start= _perf_now();
+  if (_perf_background(test) != TEST_SUCCESS)
+    return TEST_FAILURE;
+
+  return _perf_report_rate(test, PERF_BACKGROUND_COUNT, _perf_now() - start);
+}
+
+test_return replay_test(void *object)
+{
+  perf_test_st *test= (perf_test_st *)object;
+  gearman_worker_st worker;
+  uint32_t counter= 0;
+  uint64_t start;
+
+  perf_test_name= "replay";
+
+  if (_perf_background(test) != TEST_SUCCESS)
+    return TEST_FAILURE;
+
+  /* The jobs must come back from the queue, not from a clean shutdown. */
+  test_gearmand_stop(test->gearmand_pid);
+  test->gearmand_pid= _perf_gearmand_start(test->config);
+
+  /* Replay starts before the server accepts connections, so whatever is left
+     of it past the startup wait holds up the first jobs and is counted. */
+  start= _perf_now();
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_MEMORY_ALLOCATION_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, PERF_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_add_function(&worker, "perf_queue", 0, _perf_count_worker,
+                                  &counter) != GEARMAN_SUCCESS)
+  {
+    gearman_worker_free(&worker);
+    return TEST_FAILURE;
+  }
+
+  while (counter < PERF_BACKGROUND_COUNT)
+  {
+    if (gearman_worker_work(&worker) != GEARMAN_SUCCESS)
+    {
+      gearman_worker_free(&worker);
+      return TEST_FAILURE;
+    }
+  }
+
+  gearman_worker_free(&worker);
+
+  return _perf_report_rate(test, PERF_BACKGROUND_COUNT, _perf_now() - start);
+}
+
+test_return flush(void)
+{
+  return TEST_SUCCESS;
+}
+
+static void *_perf_create(const perf_config_st *config)
+{
+  perf_test_st *test;
+
+  if (config->queue_type != NULL)
+    _perf_queue_clear();
+
+  test= malloc(sizeof(perf_test_st));
+  assert(test != NULL);
+  memset(test, 0, sizeof(perf_test_st));
+  test->config= config;
+
+  assert(gearman_client_create(&(test->client)) != NULL);
+  assert(gearman_client_add_server(&(test->client), NULL, PERF_TEST_PORT) ==
+         GEARMAN_SUCCESS);
+
+  test->gearmand_pid= _perf_gearmand_start(config);
+
+  if (config->queue_type == NULL)
+    _perf_workers_start(test);
+
+  return (void *)test;
+}
+
+void *create_threads_0(void *object __attribute__((unused)))
+{
+  return _perf_create(&perf_threads_0);
+}
+
+void *create_threads_4(void *object __attribute__((unused)))
+{
+  return _perf_create(&perf_threads_4);
+}
+
+void *create_logfile(void *object __attribute__((unused)))
+{
+  return _perf_create(&perf_logfile);
+}
+
+#ifdef HAVE_LIBSQLITE3
+void *create_libsqlite3(void *object __attribute__((unused)))
+{
+  return _perf_create(&perf_libsqlite3);
+}
+#endif
+
+void destroy(void *object)
+{
+  perf_test_st *test= (perf_test_st *)object;
+
+  gearman_client_free(&(test->client));
+  _perf_workers_stop(test);
+  test_gearmand_stop(test->gearmand_pid);
+  free(test);
+}
+
+test_return pre(void *object __attribute__((unused)))
+{
+  return TEST_SUCCESS;
+}
+
+test_return post(void *object __attribute__((unused)))
+{
+  return TEST_SUCCESS;
+}
+
+void *world_create(void)
+{
+  const char *path= getenv("GEARMAN_PERF_RECORD");
+  FILE *fp;
+
+  /* A new baseline replaces the old one. */
+  if (path != NULL)
+  {
+    fp= fopen(path, "w");
+    assert(fp != NULL);
+    fprintf(fp, "# Baseline for perf_test, written by make perf-record. Each "
+                "line is the test,\n# the metric, its value, and how far in "
+                "percent it may get worse.\n");
+    fclose(fp);
+  }
+
+  return NULL;
+}
+
+void world_destroy(void *object __attribute__((unused)))
+{
+}
+
+test_st tests[] ={
+  {"echo", 0, echo_test },
+  {"fan-out", 0, fan_out_test },
+  {"coalesce", 0, coalesce_test },
+  {"large", 0, large_test },
+  {0, 0, 0}
+};
+
+test_st queue_tests[] ={
+  {"background", 0, background_test },
+  {"replay", 0, replay_test },
+  {0, 0, 0}
+};
+
+collection_st collection[] ={
+  {"threads-0", flush, create_threads_0, destroy, pre, post, tests},
+  {"threads-4", flush, create_threads_4, destroy, pre, post, tests},
+  {"logfile", flush, create_logfile, destroy, pre, post, queue_tests},
+#ifdef HAVE_LIBSQLITE3
+  {"libsqlite3", flush, create_libsqlite3, destroy, pre, post, queue_tests},
+#endif
+  {0, 0, 0, 0, 0, 0, 0}
+};
+
+void get_world(world_st *world)
+{
+  world->collections= collection;
+  world->create= world_create;
+  world->destroy= world_destroy;
+}
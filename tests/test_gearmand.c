@@ -11,7 +11,11 @@
 #include <assert.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 
 #include "test_gearmand.h"
@@ -28,8 +32,24 @@
 #include <libgearman/queue_libsqlite3.h>
 #endif
 
+#include <libgearman/queue_logfile.h>
+
 pid_t test_gearmand_start(in_port_t port, const char *queue_type,
                           char *argv[], int argc)
+{
+  return test_gearmand_start_threads(port, queue_type, argv, argc, 0);
+}
+
+pid_t test_gearmand_start_threads(in_port_t port, const char *queue_type,
+                                  char *argv[], int argc, uint32_t threads)
+{
+  return test_gearmand_start_setup(port, queue_type, argv, argc, threads,
+                                   NULL, NULL);
+}
+
+pid_t test_gearmand_start_setup(in_port_t port, const char *queue_type,
+                                char *argv[], int argc, uint32_t threads,
+                                test_gearmand_setup_fn *setup_fn, void *arg)
 {
   pid_t gearmand_pid;
   gearmand_st *gearmand;
@@ -49,11 +69,15 @@ pid_t test_gearmand_start(in_port_t port, const char *queue_type,
 #ifdef HAVE_LIBSQLITE3
     assert(gearman_queue_libsqlite3_conf(&conf) == GEARMAN_SUCCESS);
 #endif
+    assert(gearman_queue_logfile_conf(&conf) == GEARMAN_SUCCESS);
 
     assert(gearman_conf_parse_args(&conf, argc, argv) == GEARMAN_SUCCESS);
 
     gearmand= gearmand_create(NULL, port);
     assert(gearmand != NULL);
+    gearmand_set_threads(gearmand, threads);
+    if (setup_fn != NULL)
+      setup_fn(gearmand, arg);
 
     if (queue_type != NULL)
     {
@@ -74,6 +98,9 @@ pid_t test_gearmand_start(in_port_t port, const char *queue_type,
         assert((gearmand_queue_libsqlite3_init(gearmand, &conf)) == GEARMAN_SUCCESS);
       else
 #endif
+      if (!strcmp(queue_type, "logfile"))
+        assert((gearmand_queue_logfile_init(gearmand, &conf)) == GEARMAN_SUCCESS);
+      else
       {
         assert(1);
       }
@@ -95,6 +122,8 @@ pid_t test_gearmand_start(in_port_t port, const char *queue_type,
       if (!strcmp(queue_type, "libmemcached"))
         gearmand_queue_libsqlite3_deinit(gearmand);
 #endif
+      if (!strcmp(queue_type, "logfile"))
+        gearmand_queue_logfile_deinit(gearmand);
     }
 
     gearmand_free(gearmand);
@@ -114,3 +143,60 @@ void test_gearmand_stop(pid_t gearmand_pid)
   assert(kill(gearmand_pid, SIGKILL) == 0);
   assert(waitpid(gearmand_pid, NULL, 0) == gearmand_pid);
 }
+
+char *test_gearmand_admin(in_port_t port, const char *command, char *reply,
+                          size_t reply_size)
+{
+  struct sockaddr_in sa;
+  struct pollfd pfd;
+  size_t size= 0;
+  ssize_t read_size;
+  int fd;
+
+  fd= socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1)
+    return NULL;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family= AF_INET;
+  sa.sin_port= htons(port);
+  sa.sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+      write(fd, command, strlen(command)) != (ssize_t)strlen(command) ||
+      write(fd, "\n", 1) != 1)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  pfd.fd= fd;
+  pfd.events= POLLIN;
+
+  /* Replies are a single OK or ERR line, lines ending with ".", or a one line
+     report with nothing after it. */
+  while (size < reply_size - 1)
+  {
+    read_size= read(fd, reply + size, reply_size - 1 - size);
+    if (read_size <= 0)
+      break;
+
+    size+= (size_t)read_size;
+    reply[size]= 0;
+    if (reply[size - 1] != '\n')
+      continue;
+
+    if (!strncmp(reply, "OK", 2) || !strncmp(reply, "ERR", 3) ||
+        !strcmp(reply, ".\n") ||
+        (size > 2 && !strcmp(reply + size - 3, "\n.\n")) ||
+        (strchr(reply, '\n') == reply + size - 1 &&
+         poll(&pfd, 1, 100) == 0))
+    {
+      close(fd);
+      return reply;
+    }
+  }
+
+  close(fd);
+  return NULL;
+}
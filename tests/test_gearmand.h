@@ -12,4 +12,19 @@
 
 pid_t test_gearmand_start(in_port_t port, const char *queue_type,
                           char *argv[], int argc);
+pid_t test_gearmand_start_threads(in_port_t port, const char *queue_type,
+                                  char *argv[], int argc, uint32_t threads);
+
+/* Called in the server process to set more options before it runs. */
+typedef void (test_gearmand_setup_fn)(gearmand_st *gearmand, void *arg);
+
+pid_t test_gearmand_start_setup(in_port_t port, const char *queue_type,
+                                char *argv[], int argc, uint32_t threads,
+                                test_gearmand_setup_fn *setup_fn, void *arg);
 void test_gearmand_stop(pid_t gearmand_pid);
+
+/* Run an admin command and return its whole reply, up to the ending "." or
+   the end of a one line report, or NULL if the server could not be
+   reached. */
+char *test_gearmand_admin(in_port_t port, const char *command, char *reply,
+                          size_t reply_size);
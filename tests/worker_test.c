@@ -31,6 +31,24 @@ test_return allocation_test(void *object);
 test_return clone_test(void *object);
 test_return echo_test(void *object);
 test_return bug372074_test(void *object);
+test_return prefetch_test(void *object);
+test_return worker_pool_test(void *object);
+test_return poll_test(void *object);
+test_return sleep_test(void *object);
+test_return dispatch_test(void *object);
+test_return result_buffer_test(void *object);
+test_return batch_test(void *object);
+test_return slots_test(void *object);
+test_return work_data_test(void *object);
+test_return timeout_test(void *object);
+test_return fair_test(void *object);
+test_return epoch_test(void *object);
+test_return chain_test(void *object);
+test_return abandon_test(void *object);
+test_return purge_test(void *object);
+test_return affinity_test(void *object);
+test_return replica_test(void *object);
+test_return priority_test(void *object);
 
 void *create(void *object);
 void destroy(void *object);
@@ -162,6 +180,2163 @@ test_return bug372074_test(void *object __attribute__((unused)))
   return TEST_SUCCESS;
 }
 
+test_return prefetch_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_return_t ret;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  uint32_t x;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 3; x++)
+  {
+    if (gearman_client_do_background(&client, "prefetch", NULL, "x", 1,
+                                     job_handle) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  gearman_client_free(&client);
+
+  /* Take all three jobs with one request, then go away without running them
+     so the job server must queue them again. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "prefetch", 0) != GEARMAN_SUCCESS ||
+      gearman_worker_set_prefetch(&worker, 3) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_job_free(&job);
+  gearman_worker_free(&worker);
+
+  /* Two at a time, so the last request only finds one job. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "prefetch", 0) != GEARMAN_SUCCESS ||
+      gearman_worker_set_prefetch(&worker, 2) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 3; x++)
+  {
+    if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+        ret != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    if (strcmp(gearman_job_function_name(&job), "prefetch") ||
+        gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    gearman_job_free(&job);
+  }
+
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+static void *_worker_pool_echo_fn(gearman_job_st *job, void *fn_arg,
+                                  size_t *result_size,
+                                  gearman_return_t *ret_ptr)
+{
+  void *result;
+
+  (void)fn_arg;
+
+  *result_size= gearman_job_workload_size(job);
+  result= malloc(*result_size);
+  if (result == NULL)
+  {
+    *ret_ptr= GEARMAN_WORK_FAIL;
+    return NULL;
+  }
+
+  /* Long enough that the jobs only finish quickly if run side by side. */
+  usleep(10000);
+  memcpy(result, gearman_job_workload(job), *result_size);
+  *ret_ptr= GEARMAN_SUCCESS;
+
+  return result;
+}
+
+static gearman_return_t _worker_pool_complete_fn(gearman_task_st *task)
+{
+  uint32_t *count= (uint32_t *)gearman_task_fn_arg(task);
+
+  if (gearman_task_data_size(task) != 4 ||
+      memcmp(gearman_task_data(task), "pool", 4))
+  {
+    return GEARMAN_WORK_FAIL;
+  }
+
+  (*count)++;
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return worker_pool_test(void *object __attribute__((unused)))
+{
+  gearman_worker_pool_st pool;
+  gearman_client_st client;
+  gearman_return_t ret;
+  uint32_t count= 0;
+  uint32_t x;
+
+  if (gearman_worker_pool_create(&pool) == NULL)
+    return TEST_FAILURE;
+
+  gearman_worker_pool_set_threads(&pool, 4);
+
+  if (gearman_worker_add_server(gearman_worker_pool_worker(&pool), NULL,
+                                WORKER_TEST_PORT) != GEARMAN_SUCCESS ||
+      gearman_worker_pool_add_function(&pool, "pool", 0, _worker_pool_echo_fn,
+                                       NULL) != GEARMAN_SUCCESS ||
+      gearman_worker_pool_start(&pool) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_set_complete_fn(&client, _worker_pool_complete_fn);
+
+  for (x= 0; x < 16; x++)
+  {
+    if (gearman_client_add_task(&client, NULL, &count, "pool", NULL, "pool", 4,
+                                &ret) == NULL)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (gearman_client_run_tasks(&client) != GEARMAN_SUCCESS || count != 16)
+    return TEST_FAILURE;
+
+  gearman_client_free(&client);
+  gearman_worker_pool_free(&pool);
+
+  return TEST_SUCCESS;
+}
+
+test_return poll_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_return_t ret;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  in_port_t last_port= 0;
+  pid_t gearmand_pid;
+  uint32_t x;
+  uint32_t y;
+
+  gearmand_pid= test_gearmand_start(WORKER_TEST_PORT + 1, NULL, NULL, 0);
+
+  /* Queue the same number of jobs on each server. */
+  for (x= 0; x < 2; x++)
+  {
+    if (gearman_client_create(&client) == NULL)
+      return TEST_FAILURE;
+
+    if (gearman_client_add_server(&client, NULL,
+                                  (in_port_t)(WORKER_TEST_PORT + x)) !=
+        GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    for (y= 0; y < 3; y++)
+    {
+      if (gearman_client_do_background(&client, "poll", NULL, "x", 1,
+                                       job_handle) != GEARMAN_SUCCESS)
+      {
+        return TEST_FAILURE;
+      }
+    }
+
+    gearman_client_free(&client);
+  }
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_add_server(&worker, NULL,
+                                (in_port_t)(WORKER_TEST_PORT + 1)) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "poll", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_set_poll(&worker, GEARMAN_WORKER_POLL_ROUND_ROBIN);
+
+  /* Each job must come from the other server than the one before it. */
+  for (x= 0; x < 6; x++)
+  {
+    if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+        ret != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    if (job.con->port == last_port)
+      return TEST_FAILURE;
+
+    last_port= job.con->port;
+
+    if (gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+      return TEST_FAILURE;
+
+    gearman_job_free(&job);
+  }
+
+  gearman_worker_free(&worker);
+  test_gearmand_stop(gearmand_pid);
+
+  return TEST_SUCCESS;
+}
+
+test_return sleep_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_con_st *con;
+  gearman_return_t ret;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  pid_t gearmand_pid;
+
+  gearmand_pid= test_gearmand_start(WORKER_TEST_PORT + 1, NULL, NULL, 0);
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_add_server(&worker, NULL,
+                                (in_port_t)(WORKER_TEST_PORT + 1)) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "sleep", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+
+  /* Both servers are asked once and then put to sleep. */
+  while (gearman_worker_grab_job(&worker, &job, &ret) == NULL)
+  {
+    if (ret == GEARMAN_NO_JOBS)
+      break;
+
+    if (ret != GEARMAN_IO_WAIT ||
+        gearman_con_wait(worker.gearman, -1) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (ret != GEARMAN_NO_JOBS)
+    return TEST_FAILURE;
+
+  for (con= worker.gearman->con_list; con != NULL; con= con->next)
+  {
+    if (!(con->options & GEARMAN_CON_SLEEPING))
+      return TEST_FAILURE;
+  }
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_client_do_background(&client, "sleep", NULL, "x", 1,
+                                   job_handle) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  /* Only the server with the job wakes the worker, so the other one is never
+     asked and still sleeps once the job is grabbed. */
+  while (gearman_worker_grab_job(&worker, &job, &ret) == NULL)
+  {
+    if ((ret != GEARMAN_IO_WAIT && ret != GEARMAN_NO_JOBS) ||
+        gearman_con_wait(worker.gearman, -1) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (job.con->port != WORKER_TEST_PORT)
+    return TEST_FAILURE;
+
+  for (con= worker.gearman->con_list; con != NULL; con= con->next)
+  {
+    if (con != job.con && !(con->options & GEARMAN_CON_SLEEPING))
+      return TEST_FAILURE;
+  }
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 0);
+
+  if (gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+    return TEST_FAILURE;
+
+  gearman_job_free(&job);
+  gearman_worker_free(&worker);
+  test_gearmand_stop(gearmand_pid);
+
+  return TEST_SUCCESS;
+}
+
+static void *_dispatch_fn(gearman_job_st *job, void *fn_arg,
+                          size_t *result_size, gearman_return_t *ret_ptr)
+{
+  (void)job;
+
+  (*((uint32_t *)fn_arg))++;
+  *result_size= 0;
+  *ret_ptr= GEARMAN_SUCCESS;
+
+  return NULL;
+}
+
+test_return dispatch_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  char function_name[16];
+  uint32_t count[200];
+  uint32_t x;
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Enough functions that the dispatch hash has to grow a few times. */
+  for (x= 0; x < 200; x++)
+  {
+    count[x]= 0;
+    snprintf(function_name, sizeof(function_name), "dispatch%u", x);
+    if (gearman_worker_add_function(&worker, function_name, 0, _dispatch_fn,
+                                    &(count[x])) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (gearman_worker_unregister(&worker, "dispatch7") != GEARMAN_SUCCESS ||
+      gearman_worker_unregister(&worker, "dispatch") != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_client_do_background(&client, "dispatch123", NULL, "x", 1,
+                                   job_handle) != GEARMAN_SUCCESS ||
+      gearman_client_do_background(&client, "dispatch0", NULL, "x", 1,
+                                   job_handle) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  for (x= 0; x < 2; x++)
+  {
+    if (gearman_worker_work(&worker) != GEARMAN_SUCCESS)
+      return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 200; x++)
+  {
+    if (count[x] != (x == 0 || x == 123 ? 1 : 0))
+      return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+static gearman_return_t _result_buffer_fn(gearman_job_st *job, void *fn_arg)
+{
+  size_t workload_size= gearman_job_workload_size(job);
+  gearman_return_t ret;
+  uint8_t *result;
+
+  (void)fn_arg;
+
+  /* Write the start first and then grow the buffer past its initial size, so
+     the part already written has to be kept. */
+  result= gearman_job_result_buffer(job, workload_size, &ret);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  memcpy(result, gearman_job_workload(job), workload_size);
+
+  result= gearman_job_result_buffer(job, workload_size * 2, &ret);
+  if (ret != GEARMAN_SUCCESS)
+    return ret;
+
+  memcpy(result + workload_size, gearman_job_workload(job), workload_size);
+
+  return GEARMAN_SUCCESS;
+}
+
+static void _result_free_fn(void *ptr, void *arg)
+{
+  if (!memcmp(ptr, "reference", 9))
+    (*((uint32_t *)arg))++;
+}
+
+static gearman_return_t _result_ref_fn(gearman_job_st *job, void *fn_arg)
+{
+  gearman_job_set_result(job, "reference", 9, _result_free_fn, fn_arg);
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _result_buffer_complete_fn(gearman_task_st *task)
+{
+  uint32_t *count= (uint32_t *)gearman_task_fn_arg(task);
+  const uint8_t *data= gearman_task_data(task);
+  size_t x;
+
+  if (!strcmp(gearman_task_function(task), "ref"))
+  {
+    if (gearman_task_data_size(task) != 9 || memcmp(data, "reference", 9))
+      return GEARMAN_WORK_FAIL;
+  }
+  else
+  {
+    if (gearman_task_data_size(task) != 3000)
+      return GEARMAN_WORK_FAIL;
+
+    for (x= 0; x < 3000; x++)
+    {
+      if (data[x] != (uint8_t)(x % 1500))
+        return GEARMAN_WORK_FAIL;
+    }
+  }
+
+  (*count)++;
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return result_buffer_test(void *object __attribute__((unused)))
+{
+  gearman_worker_pool_st pool;
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_return_t ret;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  uint8_t workload[1500];
+  uint32_t release_count= 0;
+  uint32_t count= 0;
+  uint32_t x;
+
+  for (x= 0; x < 1500; x++)
+    workload[x]= (uint8_t)x;
+
+  if (gearman_worker_pool_create(&pool) == NULL)
+    return TEST_FAILURE;
+
+  gearman_worker_pool_set_threads(&pool, 4);
+
+  if (gearman_worker_add_server(gearman_worker_pool_worker(&pool), NULL,
+                                WORKER_TEST_PORT) != GEARMAN_SUCCESS ||
+      gearman_worker_add_function_buffer(gearman_worker_pool_worker(&pool),
+                                         "buffer", 0, _result_buffer_fn,
+                                         NULL) != GEARMAN_SUCCESS ||
+      gearman_worker_add_function_buffer(gearman_worker_pool_worker(&pool),
+                                         "ref", 0, _result_ref_fn,
+                                         &release_count) != GEARMAN_SUCCESS ||
+      gearman_worker_pool_start(&pool) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_set_complete_fn(&client, _result_buffer_complete_fn);
+
+  for (x= 0; x < 16; x++)
+  {
+    if (gearman_client_add_task(&client, NULL, &count,
+                                x % 2 ? "ref" : "buffer", NULL, workload,
+                                sizeof(workload), &ret) == NULL)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (gearman_client_run_tasks(&client) != GEARMAN_SUCCESS || count != 16)
+    return TEST_FAILURE;
+
+  gearman_worker_pool_free(&pool);
+
+  if (release_count != 8)
+    return TEST_FAILURE;
+
+  /* The same functions run by gearman_worker_work. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_add_function_buffer(&worker, "buffer", 0,
+                                         _result_buffer_fn, NULL) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_add_function_buffer(&worker, "ref", 0, _result_ref_fn,
+                                         &release_count) != GEARMAN_SUCCESS ||
+      gearman_client_do_background(&client, "buffer", NULL, workload,
+                                   sizeof(workload), job_handle) !=
+      GEARMAN_SUCCESS ||
+      gearman_client_do_background(&client, "ref", NULL, "x", 1,
+                                   job_handle) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 2; x++)
+  {
+    if (gearman_worker_work(&worker) != GEARMAN_SUCCESS)
+      return TEST_FAILURE;
+  }
+
+  if (release_count != 9 || worker.result_buffer.size < 3000)
+    return TEST_FAILURE;
+
+  gearman_worker_free(&worker);
+  gearman_client_free(&client);
+
+  return TEST_SUCCESS;
+}
+
+typedef struct
+{
+  uint32_t batch_count;
+  uint32_t job_count;
+  uint32_t max_size;
+} batch_test_st;
+
+static gearman_return_t _batch_fn(gearman_job_st **job_list,
+                                  uint32_t job_count, void *fn_arg)
+{
+  batch_test_st *test= (batch_test_st *)fn_arg;
+  gearman_return_t ret;
+  uint32_t x;
+
+  test->batch_count++;
+  test->job_count+= job_count;
+  if (job_count > test->max_size)
+    test->max_size= job_count;
+
+  for (x= 0; x < job_count; x++)
+  {
+    if (strcmp(gearman_job_function_name(job_list[x]), "batch"))
+      return GEARMAN_WORK_FAIL;
+
+    /* Elements are regular jobs, so one can be failed on its own. */
+    if (x == 1)
+    {
+      ret= gearman_job_fail(job_list[x]);
+      if (ret != GEARMAN_SUCCESS)
+        return ret;
+      continue;
+    }
+
+    gearman_job_set_result(job_list[x], gearman_job_workload(job_list[x]),
+                           gearman_job_workload_size(job_list[x]), NULL, NULL);
+  }
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return batch_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  batch_test_st test;
+  uint32_t count= 0;
+  uint32_t x;
+
+  memset(&test, 0, sizeof(batch_test_st));
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 10; x++)
+  {
+    if (gearman_client_do_background(&client, x == 5 ? "single" : "batch",
+                                     NULL, "x", 1, job_handle) !=
+        GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  gearman_client_free(&client);
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_set_prefetch(&worker, 16) != GEARMAN_SUCCESS ||
+      gearman_worker_add_batch_function(&worker, "batch", 0, 4, 10, _batch_fn,
+                                        &test) != GEARMAN_SUCCESS ||
+      gearman_worker_add_function(&worker, "single", 0, _dispatch_fn,
+                                  &count) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 10 && test.job_count + count < 10; x++)
+  {
+    if (gearman_worker_work(&worker) != GEARMAN_SUCCESS)
+      return TEST_FAILURE;
+  }
+
+  if (test.job_count != 9 || count != 1 || test.max_size > 4 ||
+      test.batch_count >= 9)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+static test_return _slots_submit(uint32_t count)
+{
+  gearman_client_st client;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  uint32_t x;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < count; x++)
+  {
+    if (gearman_client_do_background(&client, "slots", NULL, "x", 1,
+                                     job_handle) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  gearman_client_free(&client);
+
+  return TEST_SUCCESS;
+}
+
+test_return slots_test(void *object __attribute__((unused)))
+{
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_return_t ret;
+  uint32_t x;
+
+  if (_slots_submit(3) != TEST_SUCCESS)
+    return TEST_FAILURE;
+
+  /* Have two jobs pushed, then go away without running them so the job
+     server must queue them again. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "slots", 0) != GEARMAN_SUCCESS ||
+      gearman_worker_set_slots(&worker, 2) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_job_free(&job);
+  gearman_worker_free(&worker);
+
+  /* All three come back, the last once a slot is freed, and jobs queued
+     after that are pushed as they arrive. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "slots", 0) != GEARMAN_SUCCESS ||
+      gearman_worker_set_slots(&worker, 2) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 5; x++)
+  {
+    if (x == 3 && _slots_submit(2) != TEST_SUCCESS)
+      return TEST_FAILURE;
+
+    if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+        ret != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    if (strcmp(gearman_job_function_name(&job), "slots") ||
+        gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    gearman_job_free(&job);
+  }
+
+  /* Going back to grabbing still gets new jobs. */
+  if (gearman_worker_set_slots(&worker, 0) != GEARMAN_SUCCESS ||
+      _slots_submit(1) != TEST_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+    return TEST_FAILURE;
+
+  gearman_job_free(&job);
+
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+#define WORK_DATA_CHUNK (64 * 1024)
+#define WORK_DATA_TOTAL (32 * 1024 * 1024)
+
+typedef struct
+{
+  size_t received;
+  bool created;
+  bool complete;
+} _work_data_st;
+
+static gearman_return_t _work_data_created_fn(gearman_task_st *task)
+{
+  _work_data_st *state= (_work_data_st *)gearman_task_fn_arg(task);
+
+  if (state->created)
+    return GEARMAN_SUCCESS;
+
+  /* Stop once so the worker is started with the job queued. */
+  state->created= true;
+  return GEARMAN_PAUSE;
+}
+
+static gearman_return_t _work_data_fn(gearman_task_st *task)
+{
+  _work_data_st *state= (_work_data_st *)gearman_task_fn_arg(task);
+
+  state->received+= gearman_task_data_size(task);
+
+  return GEARMAN_SUCCESS;
+}
+
+static gearman_return_t _work_data_complete_fn(gearman_task_st *task)
+{
+  _work_data_st *state= (_work_data_st *)gearman_task_fn_arg(task);
+
+  state->complete= true;
+
+  return GEARMAN_SUCCESS;
+}
+
+test_return work_data_test(void *object __attribute__((unused)))
+{
+  static char chunk[WORK_DATA_CHUNK];
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_return_t ret;
+  _work_data_st state;
+  size_t sent= 0;
+  uint32_t stalled= 0;
+
+  memset(&state, 0, sizeof(_work_data_st));
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_set_created_fn(&client, _work_data_created_fn);
+  gearman_client_set_data_fn(&client, _work_data_fn);
+  gearman_client_set_complete_fn(&client, _work_data_complete_fn);
+
+  if (gearman_client_add_task(&client, NULL, &state, "work_data", NULL, "x", 1,
+                              &ret) == NULL ||
+      gearman_client_run_tasks(&client) != GEARMAN_PAUSE)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_set_options(&client, GEARMAN_CLIENT_NON_BLOCKING, 1);
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "work_data", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+
+  /* With the client not reading, the job server must stop taking data well
+     before all of it is sent. */
+  while (stalled < 10)
+  {
+    if (sent == WORK_DATA_TOTAL)
+      return TEST_FAILURE;
+
+    ret= gearman_job_data(&job, chunk, WORK_DATA_CHUNK);
+    if (ret == GEARMAN_SUCCESS)
+    {
+      sent+= WORK_DATA_CHUNK;
+      stalled= 0;
+    }
+    else if (ret == GEARMAN_IO_WAIT)
+    {
+      if (gearman_job_wait(&job, 50) != GEARMAN_SUCCESS)
+        return TEST_FAILURE;
+
+      stalled++;
+    }
+    else
+      return TEST_FAILURE;
+  }
+
+  /* Once the client catches up the rest goes through. */
+  while (sent < WORK_DATA_TOTAL)
+  {
+    ret= gearman_job_data(&job, chunk, WORK_DATA_CHUNK);
+    if (ret == GEARMAN_SUCCESS)
+    {
+      sent+= WORK_DATA_CHUNK;
+      continue;
+    }
+
+    if (ret != GEARMAN_IO_WAIT ||
+        gearman_client_run_tasks(&client) != GEARMAN_IO_WAIT ||
+        gearman_con_wait(client.gearman, 10) != GEARMAN_SUCCESS ||
+        gearman_job_wait(&job, 0) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 0);
+
+  if (gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+    return TEST_FAILURE;
+
+  gearman_job_free(&job);
+
+  gearman_client_set_options(&client, GEARMAN_CLIENT_NON_BLOCKING, 0);
+
+  if (gearman_client_run_tasks(&client) != GEARMAN_SUCCESS ||
+      !state.complete || state.received != WORK_DATA_TOTAL)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&worker);
+  gearman_client_free(&client);
+
+  return TEST_SUCCESS;
+}
+
+test_return timeout_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_worker_st retry_worker;
+  gearman_job_st job;
+  gearman_job_st retry_job;
+  gearman_return_t ret;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_client_do_background(&client, "timeout", NULL, "x", 1,
+                                   job_handle) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  /* Take the job with a one second timeout and never finish it. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "timeout", 1) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS || strcmp(gearman_job_handle(&job), job_handle))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Another worker is woken up with the same job once the timeout ends. */
+  if (gearman_worker_create(&retry_worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&retry_worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&retry_worker, "timeout", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_grab_job(&retry_worker, &retry_job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS ||
+      strcmp(gearman_job_handle(&retry_job), job_handle) ||
+      gearman_job_complete(&retry_job, NULL, 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_job_free(&retry_job);
+  gearman_worker_free(&retry_worker);
+
+  gearman_job_free(&job);
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+#define FAIR_FLOOD_COUNT 8
+
+test_return fair_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_return_t ret;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  uint32_t x;
+  uint32_t fair_at= FAIR_FLOOD_COUNT + 1;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < FAIR_FLOOD_COUNT; x++)
+  {
+    if (gearman_client_do_background(&client, "flood", NULL, "x", 1,
+                                     job_handle) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (gearman_client_do_background(&client, "fair", NULL, "x", 1,
+                                   job_handle) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  /* The worker announces the flood function last, so it would be served
+     first, but the functions take turns and the other job comes right after
+     one of its jobs. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "flood", 0) != GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "fair", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x <= FAIR_FLOOD_COUNT; x++)
+  {
+    if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+        ret != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    if (!strcmp(gearman_job_function_name(&job), "fair"))
+      fair_at= x;
+
+    if (gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+      return TEST_FAILURE;
+
+    gearman_job_free(&job);
+  }
+
+  gearman_worker_free(&worker);
+
+  if (fair_at > 1)
+    return TEST_FAILURE;
+
+  return TEST_SUCCESS;
+}
+
+#define EPOCH_DELAY 2
+
+static test_return _epoch_run(in_port_t port)
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_task_st task;
+  gearman_return_t ret;
+  time_t when= time(NULL) + EPOCH_DELAY;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, port) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_client_add_task_epoch(&client, &task, NULL, "epoch", NULL, "x",
+                                    1, when, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS ||
+      gearman_client_run_tasks(&client) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_task_free(&task);
+  gearman_client_free(&client);
+
+  /* The worker goes to sleep on the held job, and is only woken up for it
+     once its time comes. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, port) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "epoch", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS || time(NULL) < when ||
+      gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_job_free(&job);
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+static void _epoch_shards(gearmand_st *gearmand,
+                          void *arg __attribute__((unused)))
+{
+  assert(gearmand_set_proc_threads(gearmand, 4) == GEARMAN_SUCCESS);
+}
+
+test_return epoch_test(void *object __attribute__((unused)))
+{
+  test_return ret;
+  pid_t gearmand_pid;
+
+  if (_epoch_run(WORKER_TEST_PORT) != TEST_SUCCESS)
+    return TEST_FAILURE;
+
+  /* Held jobs must be added in their function's own shard. */
+  gearmand_pid= test_gearmand_start_setup(WORKER_TEST_PORT + 1, NULL, NULL, 0,
+                                          0, _epoch_shards, NULL);
+  ret= _epoch_run((in_port_t)(WORKER_TEST_PORT + 1));
+  test_gearmand_stop(gearmand_pid);
+
+  return ret;
+}
+
+typedef struct
+{
+  bool created;
+  uint32_t complete;
+  char result[8];
+} _chain_st;
+
+static gearman_return_t _chain_created_fn(gearman_task_st *task)
+{
+  _chain_st *state= (_chain_st *)gearman_task_fn_arg(task);
+
+  if (state->created)
+    return GEARMAN_SUCCESS;
+
+  /* Stop once so the worker is started with the job queued. */
+  state->created= true;
+  return GEARMAN_PAUSE;
+}
+
+static gearman_return_t _chain_complete_fn(gearman_task_st *task)
+{
+  _chain_st *state= (_chain_st *)gearman_task_fn_arg(task);
+
+  state->complete++;
+  snprintf(state->result, sizeof(state->result), "%.*s",
+           (int)gearman_task_data_size(task),
+           (const char *)gearman_task_data(task));
+
+  return GEARMAN_SUCCESS;
+}
+
+static test_return _chain_stage(gearman_worker_st *worker,
+                                const char *function_name,
+                                const char *workload, const char *data)
+{
+  gearman_job_st job;
+  gearman_return_t ret;
+
+  if (gearman_worker_grab_job(worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS ||
+      strcmp(gearman_job_function_name(&job), function_name) ||
+      gearman_job_workload_size(&job) != strlen(workload) ||
+      memcmp(gearman_job_workload(&job), workload, strlen(workload)) ||
+      gearman_job_complete(&job, (void *)data, strlen(data)) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_job_free(&job);
+
+  return TEST_SUCCESS;
+}
+
+test_return chain_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_return_t ret;
+  _chain_st state;
+
+  memset(&state, 0, sizeof(_chain_st));
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_set_created_fn(&client, _chain_created_fn);
+  gearman_client_set_complete_fn(&client, _chain_complete_fn);
+
+  if (gearman_client_add_task_chain(&client, NULL, &state, "chain_a", NULL,
+                                    "chain_b =chain_c", "x", 1,
+                                    &ret) == NULL ||
+      gearman_client_run_tasks(&client) != GEARMAN_PAUSE)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "chain_a", 0) != GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "chain_b", 0) != GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "chain_c", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Each stage gets the result of the one before, except the last, which
+     keeps the workload of the second. */
+  if (_chain_stage(&worker, "chain_a", "x", "a") != TEST_SUCCESS ||
+      _chain_stage(&worker, "chain_b", "a", "b") != TEST_SUCCESS ||
+      _chain_stage(&worker, "chain_c", "a", "c") != TEST_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_client_run_tasks(&client) != GEARMAN_SUCCESS ||
+      state.complete != 1 || strcmp(state.result, "c"))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&worker);
+  gearman_client_free(&client);
+
+  return TEST_SUCCESS;
+}
+
+typedef struct
+{
+  uint32_t count;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+} _abandon_st;
+
+static gearman_return_t _abandon_created_fn(gearman_task_st *task)
+{
+  (void)task;
+  return GEARMAN_PAUSE;
+}
+
+static void _abandon_fn(const char *job_handle, void *fn_arg)
+{
+  _abandon_st *state= (_abandon_st *)fn_arg;
+
+  state->count++;
+  snprintf(state->job_handle, GEARMAN_JOB_HANDLE_SIZE, "%s", job_handle);
+}
+
+test_return abandon_test(void *object __attribute__((unused)))
+{
+  gearman_client_st client;
+  gearman_client_st status_client;
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_task_st *task;
+  gearman_return_t ret;
+  _abandon_st state;
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  char running_handle[GEARMAN_JOB_HANDLE_SIZE];
+  bool is_known;
+  uint32_t x;
+
+  memset(&state, 0, sizeof(_abandon_st));
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_set_created_fn(&client, _abandon_created_fn);
+
+  if (gearman_client_add_task(&client, NULL, NULL, "abandon", "1", "x", 1,
+                              &ret) == NULL ||
+      gearman_client_run_tasks(&client) != GEARMAN_PAUSE)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_worker_add_server(&worker, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "abandon", 0) != GEARMAN_SUCCESS ||
+      gearman_worker_set_abandoned_fn(&worker, _abandon_fn, &state) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (gearman_worker_grab_job(&worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  snprintf(running_handle, GEARMAN_JOB_HANDLE_SIZE, "%s",
+           gearman_job_handle(&job));
+
+  /* The second job stays queued behind the running one. */
+  task= gearman_client_add_task(&client, NULL, NULL, "abandon", "2", "x", 1,
+                                &ret);
+  if (task == NULL || gearman_client_run_tasks(&client) != GEARMAN_PAUSE)
+    return TEST_FAILURE;
+
+  snprintf(job_handle, GEARMAN_JOB_HANDLE_SIZE, "%s",
+           gearman_task_job_handle(task));
+  gearman_client_free(&client);
+
+  /* The queued job is dropped as soon as the server sees the client go. */
+  if (gearman_client_create(&status_client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&status_client, NULL, WORKER_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < 100; x++)
+  {
+    if (gearman_client_job_status(&status_client, job_handle, &is_known, NULL,
+                                  NULL, NULL) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    if (!is_known)
+      break;
+
+    usleep(10000);
+  }
+
+  if (is_known)
+    return TEST_FAILURE;
+
+  gearman_client_free(&status_client);
+
+  /* The running job is told about, and nothing is left to grab after it. */
+  if (gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+    return TEST_FAILURE;
+
+  gearman_job_free(&job);
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+
+  while (gearman_worker_grab_job(&worker, &job, &ret) == NULL)
+  {
+    if (ret == GEARMAN_NO_JOBS)
+      break;
+
+    if (ret != GEARMAN_IO_WAIT ||
+        gearman_con_wait(worker.gearman, -1) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (ret != GEARMAN_NO_JOBS || state.count != 1 ||
+      strcmp(state.job_handle, running_handle))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+/* Status replies are not cached by the server the purge tests run on. */
+#define PURGE_TEST_PORT (WORKER_TEST_PORT + 1)
+
+typedef struct
+{
+  bool created;
+  uint32_t fail_count;
+} _purge_st;
+
+static gearman_return_t _purge_created_fn(gearman_task_st *task)
+{
+  _purge_st *state= (_purge_st *)gearman_task_fn_arg(task);
+
+  if (state->created)
+    return GEARMAN_SUCCESS;
+
+  /* Stop once so the job can be removed while the client waits on it. */
+  state->created= true;
+  return GEARMAN_PAUSE;
+}
+
+static gearman_return_t _purge_fail_fn(gearman_task_st *task)
+{
+  _purge_st *state= (_purge_st *)gearman_task_fn_arg(task);
+
+  state->fail_count++;
+  return GEARMAN_SUCCESS;
+}
+
+static bool _purge_add(gearman_client_st *client,
+                       gearman_job_priority_t priority, const char *unique)
+{
+  gearman_task_st *task;
+  gearman_return_t ret;
+
+  if (priority == GEARMAN_JOB_PRIORITY_HIGH)
+  {
+    task= gearman_client_add_task_high_background(client, NULL, NULL, "purge",
+                                                  unique, "x", 1, &ret);
+  }
+  else if (priority == GEARMAN_JOB_PRIORITY_LOW)
+  {
+    task= gearman_client_add_task_low_background(client, NULL, NULL, "purge",
+                                                 unique, "x", 1, &ret);
+  }
+  else
+  {
+    task= gearman_client_add_task_background(client, NULL, NULL, "purge",
+                                             unique, "x", 1, &ret);
+  }
+
+  return task != NULL && gearman_client_run_tasks(client) == GEARMAN_SUCCESS;
+}
+
+static bool _purge_admin(const char *command, const char *expect)
+{
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+
+  return test_gearmand_admin(PURGE_TEST_PORT, command, reply,
+                             sizeof(reply)) != NULL && !strcmp(reply, expect);
+}
+
+/* Check the queued and running counts the server reports for the jobs. */
+static bool _purge_status(uint32_t total)
+{
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+  char *line;
+  unsigned int queued;
+  unsigned int running;
+
+  if (test_gearmand_admin(PURGE_TEST_PORT, "status", reply,
+                          sizeof(reply)) == NULL)
+  {
+    return false;
+  }
+
+  for (line= reply; strncmp(line, "purge\t", 6); line++)
+  {
+    line= strchr(line, '\n');
+    if (line == NULL)
+      return false;
+  }
+
+  return sscanf(line, "purge\t%u\t%u", &queued, &running) == 2 &&
+         queued == total && running == 0;
+}
+
+static bool _purge_grab(gearman_worker_st *worker, const char *unique)
+{
+  gearman_job_st job;
+  gearman_return_t ret;
+
+  if (gearman_worker_grab_job(worker, &job, &ret) == NULL ||
+      ret != GEARMAN_SUCCESS || strcmp(gearman_job_unique(&job), unique) ||
+      gearman_job_complete(&job, NULL, 0) != GEARMAN_SUCCESS)
+  {
+    return false;
+  }
+
+  gearman_job_free(&job);
+
+  return true;
+}
+
+static test_return _purge_run(void)
+{
+  gearman_client_st client;
+  gearman_client_st wait_client;
+  gearman_worker_st worker;
+  gearman_job_st job;
+  gearman_return_t ret;
+  _purge_st state;
+
+  memset(&state, 0, sizeof(_purge_st));
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, PURGE_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  if (!_purge_add(&client, GEARMAN_JOB_PRIORITY_NORMAL, "a_1") ||
+      !_purge_add(&client, GEARMAN_JOB_PRIORITY_NORMAL, "b_1") ||
+      !_purge_add(&client, GEARMAN_JOB_PRIORITY_HIGH, "a_2") ||
+      !_purge_add(&client, GEARMAN_JOB_PRIORITY_LOW, "b_2") ||
+      !_purge_add(&client, GEARMAN_JOB_PRIORITY_LOW, "a_3") ||
+      !_purge_status(5))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* A prefix removes matching jobs of every priority. */
+  if (!_purge_admin("purge purge a_", "OK 3\n") || !_purge_status(2))
+    return TEST_FAILURE;
+
+  /* A priority alone removes every job queued at it. */
+  if (!_purge_add(&client, GEARMAN_JOB_PRIORITY_HIGH, "c_1") ||
+      !_purge_add(&client, GEARMAN_JOB_PRIORITY_LOW, "c_2") ||
+      !_purge_admin("purge purge * low", "OK 2\n") || !_purge_status(2) ||
+      !_purge_admin("purge purge c_ normal", "OK 0\n") || !_purge_status(2))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  /* Purge leaves jobs a client waits on alone, and cancel fails them. */
+  if (gearman_client_create(&wait_client) == NULL)
+    return TEST_FAILURE;
+
+  gearman_client_set_created_fn(&wait_client, _purge_created_fn);
+  gearman_client_set_fail_fn(&wait_client, _purge_fail_fn);
+
+  if (gearman_client_add_server(&wait_client, NULL, PURGE_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_client_add_task(&wait_client, NULL, &state, "purge", "f_1",
+                              "x", 1, &ret) == NULL ||
+      gearman_client_run_tasks(&wait_client) != GEARMAN_PAUSE ||
+      !_purge_status(3) ||
+      !_purge_admin("purge purge f_", "OK 0\n") || !_purge_status(3) ||
+      !_purge_admin("cancel purge f_", "OK 1\n") || !_purge_status(2) ||
+      gearman_client_run_tasks(&wait_client) != GEARMAN_SUCCESS ||
+      state.fail_count != 1)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&wait_client);
+
+  /* What is left still goes out by priority. */
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_GRAB_UNIQ, 1);
+  if (gearman_worker_add_server(&worker, NULL, PURGE_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "purge", 0) != GEARMAN_SUCCESS ||
+      !_purge_grab(&worker, "c_1") || !_purge_grab(&worker, "b_1"))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+
+  while (gearman_worker_grab_job(&worker, &job, &ret) == NULL)
+  {
+    if (ret == GEARMAN_NO_JOBS)
+      break;
+
+    if (ret != GEARMAN_IO_WAIT ||
+        gearman_con_wait(worker.gearman, -1) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (ret != GEARMAN_NO_JOBS || !_purge_status(0))
+    return TEST_FAILURE;
+
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+static void _purge_stats(gearmand_st *gearmand,
+                         void *arg __attribute__((unused)))
+{
+  gearmand_set_stats_interval(gearmand, 0);
+}
+
+test_return purge_test(void *object __attribute__((unused)))
+{
+  pid_t gearmand_pid;
+  test_return ret;
+
+  gearmand_pid= test_gearmand_start_setup(PURGE_TEST_PORT, NULL, NULL, 0, 0,
+                                          _purge_stats, NULL);
+  ret= _purge_run();
+  test_gearmand_stop(gearmand_pid);
+
+  return ret;
+}
+
+#define AFFINITY_TEST_PORT (WORKER_TEST_PORT + 1)
+#define AFFINITY_TEST_WAIT 2
+#define AFFINITY_TEST_KEYS 16
+
+static void _affinity_setup(gearmand_st *gearmand,
+                            void *arg __attribute__((unused)))
+{
+  gearmand_set_affinity_wait(gearmand, AFFINITY_TEST_WAIT);
+}
+
+/* Run every job a worker can take, checking that no key was run by the other
+   worker before. */
+static bool _affinity_run(gearman_worker_st *worker, uint32_t owner,
+                          uint32_t *key_owner, uint32_t *count)
+{
+  gearman_job_st *job;
+  gearman_return_t ret;
+  unsigned int key;
+
+  while (1)
+  {
+    job= gearman_worker_grab_job(worker, NULL, &ret);
+    if (job == NULL)
+    {
+      if (ret == GEARMAN_NO_JOBS)
+        return true;
+
+      if (ret != GEARMAN_IO_WAIT ||
+          gearman_con_wait(worker->gearman, -1) != GEARMAN_SUCCESS)
+      {
+        return false;
+      }
+
+      continue;
+    }
+
+    if (sscanf(gearman_job_unique(job), "k%u#", &key) != 1 ||
+        key >= AFFINITY_TEST_KEYS ||
+        (key_owner[key] != 0 && key_owner[key] != owner) ||
+        gearman_job_complete(job, NULL, 0) != GEARMAN_SUCCESS)
+    {
+      return false;
+    }
+
+    key_owner[key]= owner;
+    gearman_job_free(job);
+    (*count)++;
+  }
+}
+
+static test_return _affinity_route(void)
+{
+  gearman_client_st client;
+  gearman_worker_st worker[2];
+  gearman_job_st *job;
+  gearman_return_t ret;
+  uint32_t key_owner[AFFINITY_TEST_KEYS];
+  uint32_t count[2]= { 0, 0 };
+  char unique[GEARMAN_UNIQUE_SIZE];
+  char job_handle[GEARMAN_JOB_HANDLE_SIZE];
+  time_t start;
+  uint32_t x;
+  uint32_t y;
+
+  memset(key_owner, 0, sizeof(key_owner));
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, AFFINITY_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* Both workers must be known before jobs are held for one of them. */
+  for (x= 0; x < 2; x++)
+  {
+    if (gearman_worker_create(&(worker[x])) == NULL)
+      return TEST_FAILURE;
+
+    gearman_worker_set_options(&(worker[x]), GEARMAN_WORKER_NON_BLOCKING |
+                               GEARMAN_WORKER_GRAB_UNIQ, 1);
+    if (gearman_worker_add_server(&(worker[x]), NULL, AFFINITY_TEST_PORT) !=
+        GEARMAN_SUCCESS ||
+        gearman_worker_register(&(worker[x]), "affinity", 0) !=
+        GEARMAN_SUCCESS ||
+        !_affinity_run(&(worker[x]), x + 1, key_owner, &(count[x])))
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  for (x= 0; x < AFFINITY_TEST_KEYS * 2; x++)
+  {
+    snprintf(unique, GEARMAN_UNIQUE_SIZE, "k%u#%u", x % AFFINITY_TEST_KEYS, x);
+    if (gearman_client_do_background(&client, "affinity", unique, "x", 1,
+                                     job_handle) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  /* Every job for a key goes to the one worker it is held for, and the keys
+     are spread over both. This has to finish before the holds run out. */
+  for (y= 0; y < 20 && count[0] + count[1] < AFFINITY_TEST_KEYS * 2; y++)
+  {
+    for (x= 0; x < 2; x++)
+    {
+      if (gearman_con_wait(worker[x].gearman, 50) != GEARMAN_SUCCESS ||
+          !_affinity_run(&(worker[x]), x + 1, key_owner, &(count[x])))
+      {
+        return TEST_FAILURE;
+      }
+    }
+  }
+
+  if (count[0] + count[1] != AFFINITY_TEST_KEYS * 2 || count[0] == 0 ||
+      count[1] == 0)
+  {
+    return TEST_FAILURE;
+  }
+
+  /* A held job goes to any worker once its wait is over. The wheel ticks in
+     whole seconds, so it may be let go up to a second early. */
+  x= key_owner[0] == 1 ? 1 : 0;
+  start= time(NULL);
+  if (gearman_client_do_background(&client, "affinity", "k0#last", "x", 1,
+                                   job_handle) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_set_options(&(worker[x]), GEARMAN_WORKER_NON_BLOCKING, 0);
+  job= gearman_worker_grab_job(&(worker[x]), NULL, &ret);
+  if (job == NULL || ret != GEARMAN_SUCCESS ||
+      strcmp(gearman_job_unique(job), "k0#last") ||
+      time(NULL) - start < AFFINITY_TEST_WAIT - 1 ||
+      gearman_job_complete(job, NULL, 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_job_free(job);
+  gearman_worker_free(&(worker[0]));
+  gearman_worker_free(&(worker[1]));
+  gearman_client_free(&client);
+
+  return TEST_SUCCESS;
+}
+
+test_return affinity_test(void *object __attribute__((unused)))
+{
+  pid_t gearmand_pid;
+  test_return ret;
+
+  gearmand_pid= test_gearmand_start_setup(AFFINITY_TEST_PORT, NULL, NULL, 0,
+                                          0, _affinity_setup, NULL);
+  ret= _affinity_route();
+  test_gearmand_stop(gearmand_pid);
+
+  return ret;
+}
+
+/* The primary streams its background jobs to the standby over the replication
+   port. */
+#define REPLICA_TEST_PORT (WORKER_TEST_PORT + 1)
+#define REPLICA_TEST_STANDBY_PORT (WORKER_TEST_PORT + 2)
+#define REPLICA_TEST_LISTEN_PORT (WORKER_TEST_PORT + 3)
+
+static void _replica_primary(gearmand_st *gearmand,
+                             void *arg __attribute__((unused)))
+{
+  assert(gearmand_replica_peer_add(gearmand, "127.0.0.1",
+                                   REPLICA_TEST_LISTEN_PORT) ==
+         GEARMAN_SUCCESS);
+}
+
+static void _replica_standby(gearmand_st *gearmand,
+                             void *arg __attribute__((unused)))
+{
+  gearmand_set_replica_listen(gearmand, REPLICA_TEST_LISTEN_PORT);
+}
+
+/* Wait until the standby acknowledged everything the primary sent, then check
+   how many jobs it holds. */
+static bool _replica_synced(uint32_t count)
+{
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+  char state[16];
+  unsigned long long behind;
+  unsigned int standby_count;
+  uint32_t x;
+
+  for (x= 0; x < 50; x++)
+  {
+    if (test_gearmand_admin(REPLICA_TEST_PORT, "replica", reply,
+                            sizeof(reply)) == NULL)
+    {
+      return false;
+    }
+
+    if (sscanf(reply, "peer\t%*s\t%15s\t%*u\t%*u\t%llu", state,
+               &behind) == 2 && !strcmp(state, "streaming") && behind == 0)
+    {
+      break;
+    }
+
+    usleep(100000);
+  }
+
+  return x < 50 &&
+         test_gearmand_admin(REPLICA_TEST_STANDBY_PORT, "replica", reply,
+                             sizeof(reply)) != NULL &&
+         sscanf(reply, "standby\t%*u\t%15s\t%u", state,
+                &standby_count) == 2 &&
+         !strcmp(state, "connected") && standby_count == count;
+}
+
+static bool _replica_grab(gearman_worker_st *worker, const char *unique)
+{
+  gearman_job_st *job;
+  gearman_return_t ret;
+
+  job= gearman_worker_grab_job(worker, NULL, &ret);
+  if (job == NULL || ret != GEARMAN_SUCCESS ||
+      strcmp(gearman_job_unique(job), unique) ||
+      gearman_job_complete(job, NULL, 0) != GEARMAN_SUCCESS)
+  {
+    return false;
+  }
+
+  gearman_job_free(job);
+
+  return true;
+}
+
+static bool _replica_worker(gearman_worker_st *worker, in_port_t port)
+{
+  if (gearman_worker_create(worker) == NULL)
+    return false;
+
+  gearman_worker_set_options(worker, GEARMAN_WORKER_GRAB_UNIQ, 1);
+
+  return gearman_worker_add_server(worker, NULL, port) == GEARMAN_SUCCESS &&
+         gearman_worker_register(worker, "replica", 0) == GEARMAN_SUCCESS;
+}
+
+static bool _replica_no_jobs(gearman_worker_st *worker)
+{
+  gearman_return_t ret;
+
+  gearman_worker_set_options(worker, GEARMAN_WORKER_NON_BLOCKING, 1);
+
+  while (gearman_worker_grab_job(worker, NULL, &ret) == NULL)
+  {
+    if (ret == GEARMAN_NO_JOBS)
+      break;
+
+    if (ret != GEARMAN_IO_WAIT ||
+        gearman_con_wait(worker->gearman, -1) != GEARMAN_SUCCESS)
+    {
+      return false;
+    }
+  }
+
+  gearman_worker_set_options(worker, GEARMAN_WORKER_NON_BLOCKING, 0);
+
+  return ret == GEARMAN_NO_JOBS;
+}
+
+static test_return _replica_run(pid_t *primary_pid)
+{
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_worker_st standby_worker;
+  char reply[GEARMAN_TEXT_RESPONSE_SIZE];
+  char unique[GEARMAN_UNIQUE_SIZE];
+  gearman_return_t ret;
+  uint32_t x;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, REPLICA_TEST_PORT) !=
+      GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 1; x <= 4; x++)
+  {
+    snprintf(unique, GEARMAN_UNIQUE_SIZE, "r_%u", x);
+    if (gearman_client_add_task_background(&client, NULL, NULL, "replica",
+                                           unique, "x", 1, &ret) == NULL)
+    {
+      return TEST_FAILURE;
+    }
+  }
+
+  if (gearman_client_run_tasks(&client) != GEARMAN_SUCCESS ||
+      !_replica_synced(4))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  /* Jobs finished on the primary are dropped by the standby. */
+  if (!_replica_worker(&worker, REPLICA_TEST_PORT) ||
+      !_replica_grab(&worker, "r_1") || !_replica_grab(&worker, "r_2") ||
+      !_replica_synced(2))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&worker);
+
+  /* The standby runs nothing until it is promoted. */
+  if (!_replica_worker(&standby_worker, REPLICA_TEST_STANDBY_PORT) ||
+      !_replica_no_jobs(&standby_worker))
+  {
+    return TEST_FAILURE;
+  }
+
+  test_gearmand_stop(*primary_pid);
+  *primary_pid= -1;
+
+  if (test_gearmand_admin(REPLICA_TEST_STANDBY_PORT, "replica promote",
+                          reply, sizeof(reply)) == NULL ||
+      strcmp(reply, "OK 2\n"))
+  {
+    return TEST_FAILURE;
+  }
+
+  if (!_replica_grab(&standby_worker, "r_3") ||
+      !_replica_grab(&standby_worker, "r_4") ||
+      !_replica_no_jobs(&standby_worker))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_worker_free(&standby_worker);
+
+  return TEST_SUCCESS;
+}
+
+test_return replica_test(void *object __attribute__((unused)))
+{
+  pid_t standby_pid;
+  pid_t primary_pid;
+  test_return ret;
+
+  standby_pid= test_gearmand_start_setup(REPLICA_TEST_STANDBY_PORT, NULL, NULL,
+                                         0, 0, _replica_standby, NULL);
+  primary_pid= test_gearmand_start_setup(REPLICA_TEST_PORT, NULL, NULL, 0, 0,
+                                         _replica_primary, NULL);
+  ret= _replica_run(&primary_pid);
+  if (primary_pid != -1)
+    test_gearmand_stop(primary_pid);
+  test_gearmand_stop(standby_pid);
+
+  return ret;
+}
+
+/* With five levels low jobs start on the last and normal ones in the middle,
+   so a low job must climb three levels to get ahead of new normal jobs. */
+#define PRIORITY_TEST_PORT (WORKER_TEST_PORT + 1)
+#define PRIORITY_TEST_LEVELS 5
+#define PRIORITY_TEST_AGE 2
+#define PRIORITY_TEST_WAIT 7
+
+static void _priority_setup(gearmand_st *gearmand,
+                            void *arg __attribute__((unused)))
+{
+  gearmand_set_priority(gearmand, PRIORITY_TEST_LEVELS, PRIORITY_TEST_AGE);
+}
+
+static bool _priority_add(gearman_client_st *client,
+                          gearman_job_priority_t priority, const char *unique)
+{
+  gearman_return_t ret;
+
+  if (priority == GEARMAN_JOB_PRIORITY_HIGH)
+  {
+    ret= gearman_client_do_high_background(client, "priority", unique, "x", 1,
+                                           NULL);
+  }
+  else if (priority == GEARMAN_JOB_PRIORITY_LOW)
+  {
+    ret= gearman_client_do_low_background(client, "priority", unique, "x", 1,
+                                          NULL);
+  }
+  else
+  {
+    ret= gearman_client_do_background(client, "priority", unique, "x", 1,
+                                      NULL);
+  }
+
+  return ret == GEARMAN_SUCCESS;
+}
+
+static test_return _priority_run(void)
+{
+  const char *order[]= { "high_6", "norm_1", "norm_2", "norm_3", "low_0",
+                         "norm_4", "norm_5" };
+  gearman_client_st client;
+  gearman_worker_st worker;
+  gearman_job_st *job;
+  gearman_return_t ret;
+  uint32_t x;
+
+  if (gearman_client_create(&client) == NULL)
+    return TEST_FAILURE;
+
+  if (gearman_client_add_server(&client, NULL, PRIORITY_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      !_priority_add(&client, GEARMAN_JOB_PRIORITY_LOW, "low_0") ||
+      !_priority_add(&client, GEARMAN_JOB_PRIORITY_NORMAL, "norm_1") ||
+      !_priority_add(&client, GEARMAN_JOB_PRIORITY_NORMAL, "norm_2") ||
+      !_priority_add(&client, GEARMAN_JOB_PRIORITY_NORMAL, "norm_3"))
+  {
+    return TEST_FAILURE;
+  }
+
+  /* No worker asks for jobs meanwhile, and the wait still counts. */
+  sleep(PRIORITY_TEST_WAIT);
+
+  if (!_priority_add(&client, GEARMAN_JOB_PRIORITY_NORMAL, "norm_4") ||
+      !_priority_add(&client, GEARMAN_JOB_PRIORITY_NORMAL, "norm_5") ||
+      !_priority_add(&client, GEARMAN_JOB_PRIORITY_HIGH, "high_6"))
+  {
+    return TEST_FAILURE;
+  }
+
+  gearman_client_free(&client);
+
+  if (gearman_worker_create(&worker) == NULL)
+    return TEST_FAILURE;
+
+  gearman_worker_set_options(&worker, GEARMAN_WORKER_GRAB_UNIQ, 1);
+  if (gearman_worker_add_server(&worker, NULL, PRIORITY_TEST_PORT) !=
+      GEARMAN_SUCCESS ||
+      gearman_worker_register(&worker, "priority", 0) != GEARMAN_SUCCESS)
+  {
+    return TEST_FAILURE;
+  }
+
+  for (x= 0; x < sizeof(order) / sizeof(order[0]); x++)
+  {
+    job= gearman_worker_grab_job(&worker, NULL, &ret);
+    if (job == NULL || ret != GEARMAN_SUCCESS ||
+        strcmp(gearman_job_unique(job), order[x]) ||
+        gearman_job_complete(job, NULL, 0) != GEARMAN_SUCCESS)
+    {
+      return TEST_FAILURE;
+    }
+
+    gearman_job_free(job);
+  }
+
+  gearman_worker_free(&worker);
+
+  return TEST_SUCCESS;
+}
+
+test_return priority_test(void *object __attribute__((unused)))
+{
+  pid_t gearmand_pid;
+  test_return ret;
+
+  gearmand_pid= test_gearmand_start_setup(PRIORITY_TEST_PORT, NULL, NULL, 0,
+                                          0, _priority_setup, NULL);
+  ret= _priority_run();
+  test_gearmand_stop(gearmand_pid);
+
+  return ret;
+}
+
 #ifdef NOT_DONE
 /* Prototype */
 uint8_t* simple_worker(gearman_worker_st *job,
@@ -254,6 +2429,24 @@ test_st tests[] ={
   {"clone", 0, clone_test },
   {"echo", 0, echo_test },
   {"bug372074", 0, bug372074_test },
+  {"prefetch", 0, prefetch_test },
+  {"worker_pool", 0, worker_pool_test },
+  {"poll", 0, poll_test },
+  {"sleep", 0, sleep_test },
+  {"dispatch", 0, dispatch_test },
+  {"result_buffer", 0, result_buffer_test },
+  {"batch", 0, batch_test },
+  {"slots", 0, slots_test },
+  {"work_data", 0, work_data_test },
+  {"timeout", 0, timeout_test },
+  {"fair", 0, fair_test },
+  {"epoch", 0, epoch_test },
+  {"chain", 0, chain_test },
+  {"abandon", 0, abandon_test },
+  {"purge", 0, purge_test },
+  {"affinity", 0, affinity_test },
+  {"replica", 0, replica_test },
+  {"priority", 0, priority_test },
 #ifdef NOT_DONE
   {"simple_work_test", 0, simple_work_test },
 #endif